@@ -26,13 +26,11 @@
 
 #include<opencv2/core/core.hpp>
 
+#include<ImageSource.h>
 #include<System.h>
 
 using namespace std;
 
-void LoadImages(const string &strImagePath, const string &strPathTimes,
-                vector<string> &vstrImages, vector<double> &vTimeStamps);
-
 int main(int argc, char **argv)
 {
     if(argc != 5)
@@ -42,11 +40,10 @@ int main(int argc, char **argv)
     }
 
     // Retrieve paths to images
-    vector<string> vstrImageFilenames;
-    vector<double> vTimestamps;
-    LoadImages(string(argv[3]), string(argv[4]), vstrImageFilenames, vTimestamps);
+    vector<ORB_SLAM2::ImageSource::Entry> vEntries;
+    ORB_SLAM2::ImageSource::LoadEuRoC(string(argv[3]), "", string(argv[4]), vEntries);
 
-    int nImages = vstrImageFilenames.size();
+    int nImages = vEntries.size();
 
     if(nImages<=0)
     {
@@ -61,24 +58,23 @@ int main(int argc, char **argv)
     vector<float> vTimesTrack;
     vTimesTrack.resize(nImages);
 
+    // Images are read ahead while the previous ones are tracked
+    ORB_SLAM2::ImageSource source(vEntries);
+
     cout << endl << "-------" << endl;
     cout << "Start processing sequence ..." << endl;
     cout << "Images in the sequence: " << nImages << endl << endl;
 
     // Main loop
+    ORB_SLAM2::ImageSource::Image image;
     cv::Mat im;
     for(int ni=0; ni<nImages; ni++)
     {
         // Read image from file
-        im = cv::imread(vstrImageFilenames[ni],CV_LOAD_IMAGE_UNCHANGED);
-        double tframe = vTimestamps[ni];
-
-        if(im.empty())
-        {
-            cerr << endl << "Failed to load image at: "
-                 <<  vstrImageFilenames[ni] << endl;
+        if(!source.Next(image))
             return 1;
-        }
+        im = image.im;
+        double tframe = image.timestamp;
 
 #ifdef COMPILEDWITHC11
         std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
@@ -102,9 +98,9 @@ int main(int argc, char **argv)
         // Wait to load the next frame
         double T=0;
         if(ni<nImages-1)
-            T = vTimestamps[ni+1]-tframe;
+            T = vEntries[ni+1].timestamp-tframe;
         else if(ni>0)
-            T = tframe-vTimestamps[ni-1];
+            T = tframe-vEntries[ni-1].timestamp;
 
         if(ttrack<T)
             usleep((T-ttrack)*1e6);
@@ -129,27 +125,3 @@ int main(int argc, char **argv)
 
     return 0;
 }
-
-void LoadImages(const string &strImagePath, const string &strPathTimes,
-                vector<string> &vstrImages, vector<double> &vTimeStamps)
-{
-    ifstream fTimes;
-    fTimes.open(strPathTimes.c_str());
-    vTimeStamps.reserve(5000);
-    vstrImages.reserve(5000);
-    while(!fTimes.eof())
-    {
-        string s;
-        getline(fTimes,s);
-        if(!s.empty())
-        {
-            stringstream ss;
-            ss << s;
-            vstrImages.push_back(strImagePath + "/" + ss.str() + ".png");
-            double t;
-            ss >> t;
-            vTimeStamps.push_back(t/1e9);
-
-        }
-    }
-}
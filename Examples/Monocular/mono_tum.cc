@@ -19,6 +19,7 @@
 */
 
 #include "Parameter.h"
+#include "ImageSource.h"
 #include "System.h"
 #include "pangolin/pangolin.h"
 
@@ -31,9 +32,6 @@
 
 using namespace std;
 
-void LoadImages(const string &strFile, vector<string> &vstrImageFilenames,
-                vector<double> &vTimestamps);
-
 int main(int argc, char **argv)
 {
     if(argc != 4)
@@ -44,12 +42,10 @@ int main(int argc, char **argv)
     DLOG(INFO) << "Logging is active.";
 
     // Retrieve paths to images
-    vector<string> vstrImageFilenames;
-    vector<double> vTimestamps;
-    string strFile = string(argv[3])+"/rgb.txt";
-    LoadImages(strFile, vstrImageFilenames, vTimestamps);
+    vector<ORB_SLAM2::ImageSource::Entry> vEntries;
+    ORB_SLAM2::ImageSource::LoadTUM(string(argv[3]), "", vEntries);
 
-    int nImages = vstrImageFilenames.size();
+    int nImages = vEntries.size();
     ORB_SLAM2::SystemLogger::totalFrameCount = nImages;
 
     // Create SLAM system. It initializes all system threads and gets ready to process frames.
@@ -60,6 +56,9 @@ int main(int argc, char **argv)
     vector<float> vTimesTrack;
     vTimesTrack.resize(nImages);
 
+    // Images are read ahead while the previous ones are tracked
+    ORB_SLAM2::ImageSource source(vEntries);
+
     cout << endl << "-------" << endl;
     cout << "Start processing sequence ..." << endl;
     cout << "Images in the sequence: " << nImages << endl << endl;
@@ -69,21 +68,18 @@ int main(int argc, char **argv)
     pangolin::Var<bool> nextFrame("menu.Next frame", false, false);
     pangolin::Var<std::string> fastForward("menu.Fast forward", "0");
     int forwardCounter = 0;
+    ORB_SLAM2::ImageSource::Image image;
     cv::Mat im;
     for(int ni=0; ni<nImages; ni++)
     {
         ORB_SLAM2::SystemLogger::currentFrameNum = ni + 1;
 
         // Read image from file
-        im = cv::imread(string(argv[3])+"/"+vstrImageFilenames[ni],CV_LOAD_IMAGE_UNCHANGED);
-        double tframe = vTimestamps[ni];
-
-        if(im.empty())
-        {
-            cerr << endl << "Failed to load image at: "
-                 << string(argv[3]) << "/" << vstrImageFilenames[ni] << endl;
+        if(!source.Next(image))
             return 1;
-        }
+        im = image.im;
+        double tframe = image.timestamp;
+
         int fastForwardVar = std::stoi(fastForward.Get());
         if(fastForwardVar != 0)
         {
@@ -142,9 +138,9 @@ int main(int argc, char **argv)
             // Wait to load the next frame
             double T=0;
             if(ni<nImages-1)
-                T = vTimestamps[ni+1]-tframe;
+                T = vEntries[ni+1].timestamp-tframe;
             else if(ni>0)
-                T = tframe-vTimestamps[ni-1];
+                T = tframe-vEntries[ni-1].timestamp;
 
             if(ttrack<T)
                 usleep((T-ttrack)*1e6);
@@ -170,32 +166,3 @@ int main(int argc, char **argv)
 
     return 0;
 }
-
-void LoadImages(const string &strFile, vector<string> &vstrImageFilenames, vector<double> &vTimestamps)
-{
-    ifstream f;
-    f.open(strFile.c_str());
-
-    // skip first three lines
-    string s0;
-    getline(f,s0);
-    getline(f,s0);
-    getline(f,s0);
-
-    while(!f.eof())
-    {
-        string s;
-        getline(f,s);
-        if(!s.empty())
-        {
-            stringstream ss;
-            ss << s;
-            double t;
-            string sRGB;
-            ss >> t;
-            vTimestamps.push_back(t);
-            ss >> sRGB;
-            vstrImageFilenames.push_back(sRGB);
-        }
-    }
-}
@@ -0,0 +1,517 @@
+// Nodelet versions of the Mono, Stereo and RGBD nodes. Loaded into the nodelet manager of the
+// camera driver the images come in as shared pointers, without serialization or copy, and the
+// mono8 (and 32FC1 depth) buffers go straight into the tracking as external images.
+//
+// The subscriber callbacks only put the images into a slot which holds the latest frame.
+// An input thread takes them from there, converts (and for stereo rectifies) them and hands
+// them to the asynchronous input of the system, which should keep only the latest image too
+// (Async.QueueSize: 1, Async.DropPolicy: 1). Frames which come in faster than they are
+// tracked are dropped and counted instead of queued. Pose, TF and the tracked map points are
+// published from a thread of their own, the tracking only leaves its result there.
+//
+// Private parameters: vocabulary, settings, use_viewer (false), do_rectify (stereo, false),
+// world_frame ("world"), camera_frame ("camera"), publish_tf (true).
+// Topics: as the nodes, out: ~pose (geometry_msgs/PoseStamped), ~tracked_points
+// (sensor_msgs/PointCloud2 in world_frame).
+
+#include<atomic>
+#include<condition_variable>
+#include<mutex>
+#include<thread>
+
+#include<ros/ros.h>
+#include<nodelet/nodelet.h>
+#include<pluginlib/class_list_macros.h>
+#include<cv_bridge/cv_bridge.h>
+#include<sensor_msgs/image_encodings.h>
+#include<sensor_msgs/PointCloud2.h>
+#include<sensor_msgs/point_cloud2_iterator.h>
+#include<geometry_msgs/PoseStamped.h>
+#include<tf/transform_broadcaster.h>
+#include<message_filters/subscriber.h>
+#include<message_filters/synchronizer.h>
+#include<message_filters/sync_policies/approximate_time.h>
+
+#include<opencv2/core/core.hpp>
+#include<opencv2/imgproc/imgproc.hpp>
+
+#include"../../../include/System.h"
+#include"../../../include/MapPoint.h"
+
+using namespace std;
+
+namespace ORB_SLAM2_ROS
+{
+
+namespace
+{
+ORB_SLAM2::System::ExternalImage ToExternal(const cv::Mat &im)
+{
+    ORB_SLAM2::System::ExternalImage image;
+    image.data = im.data;
+    image.width = im.cols;
+    image.height = im.rows;
+    image.step = im.step[0];
+    return image;
+}
+
+ORB_SLAM2::System::ExternalDepth ToExternalDepth(const cv::Mat &depth)
+{
+    ORB_SLAM2::System::ExternalDepth image;
+    image.data = depth.ptr<float>();
+    image.width = depth.cols;
+    image.height = depth.rows;
+    image.step = depth.step[0];
+    return image;
+}
+}
+
+class SlamNodelet : public nodelet::Nodelet
+{
+public:
+    SlamNodelet(const ORB_SLAM2::System::eSensor sensor);
+    virtual ~SlamNodelet();
+
+protected:
+
+    struct Input
+    {
+        sensor_msgs::ImageConstPtr msg;
+        // right image or depthmap
+        sensor_msgs::ImageConstPtr msg2;
+    };
+
+    virtual void onInit();
+
+    // Subscribes the image topics, the callbacks call Offer
+    virtual void Subscribe(ros::NodeHandle &nh, ros::NodeHandle &pnh) = 0;
+    // Hands the images to the system, on the input thread
+    virtual void Track(const Input &input) = 0;
+
+    // Replaces the images waiting for the input thread, from the subscriber callbacks
+    void Offer(const Input &input);
+
+    void RunInput();
+    void RunPublisher();
+
+    // From the tracker thread of the system
+    void OnTracked(const double &timestamp, const cv::Mat &Tcw);
+
+    void Publish(const double timestamp, const cv::Mat &Tcw, const vector<cv::Point3f> &vPoints);
+
+    const ORB_SLAM2::System::eSensor mSensor;
+    ORB_SLAM2::System* mpSLAM;
+
+    std::mutex mMutexInput;
+    std::condition_variable mCondInput;
+    Input mInput;
+    bool mbInputWaiting;
+    size_t mnInputDropped;
+
+    std::mutex mMutexResult;
+    std::condition_variable mCondResult;
+    double mResultTimestamp;
+    cv::Mat mResultTcw;
+    vector<cv::Point3f> mvResultPoints;
+    bool mbResultWaiting;
+
+    std::atomic<bool> mbFinishInput;
+    std::atomic<bool> mbFinishPublisher;
+    std::thread mtInput;
+    std::thread mtPublisher;
+
+    ros::Publisher mPosePublisher;
+    ros::Publisher mPointsPublisher;
+    tf::TransformBroadcaster* mpTFBroadcaster;
+    string mWorldFrame;
+    string mCameraFrame;
+    bool mbPublishTF;
+};
+
+SlamNodelet::SlamNodelet(const ORB_SLAM2::System::eSensor sensor):
+    mSensor(sensor), mpSLAM(NULL), mbInputWaiting(false), mnInputDropped(0), mResultTimestamp(0),
+    mbResultWaiting(false), mbFinishInput(false), mbFinishPublisher(false), mpTFBroadcaster(NULL), mbPublishTF(true)
+{
+}
+
+SlamNodelet::~SlamNodelet()
+{
+    {
+        unique_lock<mutex> lock(mMutexInput);
+        mbFinishInput = true;
+    }
+    mCondInput.notify_all();
+    if(mtInput.joinable())
+        mtInput.join();
+
+    if(mpSLAM)
+    {
+        // Waits for the images in the asynchronous input, the last results still reach the publisher
+        mpSLAM->Shutdown();
+        mpSLAM->SaveKeyFrameTrajectoryTUM("KeyFrameTrajectory.txt");
+        NODELET_INFO("ORB-SLAM2: %lu frames dropped by the nodelet, %lu by the system", mnInputDropped,
+                     mpSLAM->GetNumDroppedFrames());
+    }
+
+    {
+        unique_lock<mutex> lock(mMutexResult);
+        mbFinishPublisher = true;
+    }
+    mCondResult.notify_all();
+    if(mtPublisher.joinable())
+        mtPublisher.join();
+    delete mpSLAM;
+    delete mpTFBroadcaster;
+}
+
+void SlamNodelet::onInit()
+{
+    ros::NodeHandle &nh = getNodeHandle();
+    ros::NodeHandle &pnh = getPrivateNodeHandle();
+
+    string strVocabulary, strSettings;
+    if(!pnh.getParam("vocabulary",strVocabulary) || !pnh.getParam("settings",strSettings))
+    {
+        NODELET_ERROR("ORB-SLAM2: the parameters vocabulary and settings are required");
+        return;
+    }
+    bool bUseViewer;
+    pnh.param("use_viewer",bUseViewer,false);
+    pnh.param("world_frame",mWorldFrame,string("world"));
+    pnh.param("camera_frame",mCameraFrame,string("camera"));
+    pnh.param("publish_tf",mbPublishTF,true);
+
+    mpSLAM = new ORB_SLAM2::System(strVocabulary,strSettings,mSensor,bUseViewer);
+    mpSLAM->SetTrackingCallback(boost::bind(&SlamNodelet::OnTracked,this,_1,_2));
+
+    mPosePublisher = pnh.advertise<geometry_msgs::PoseStamped>("pose",1);
+    mPointsPublisher = pnh.advertise<sensor_msgs::PointCloud2>("tracked_points",1);
+    if(mbPublishTF)
+        mpTFBroadcaster = new tf::TransformBroadcaster();
+
+    mtInput = std::thread(&SlamNodelet::RunInput,this);
+    mtPublisher = std::thread(&SlamNodelet::RunPublisher,this);
+
+    Subscribe(nh,pnh);
+}
+
+void SlamNodelet::Offer(const Input &input)
+{
+    {
+        unique_lock<mutex> lock(mMutexInput);
+        if(mbInputWaiting)
+            mnInputDropped++;
+        mInput = input;
+        mbInputWaiting = true;
+    }
+    mCondInput.notify_one();
+}
+
+void SlamNodelet::RunInput()
+{
+    while(true)
+    {
+        Input input;
+        {
+            unique_lock<mutex> lock(mMutexInput);
+            while(!mbInputWaiting && !mbFinishInput)
+                mCondInput.wait(lock);
+            if(mbFinishInput)
+                return;
+            input = mInput;
+            mInput = Input();
+            mbInputWaiting = false;
+        }
+
+        try
+        {
+            Track(input);
+        }
+        catch(cv_bridge::Exception& e)
+        {
+            NODELET_ERROR("cv_bridge exception: %s", e.what());
+        }
+    }
+}
+
+void SlamNodelet::OnTracked(const double &timestamp, const cv::Mat &Tcw)
+{
+    // On the tracker thread, where the tracked points are valid until the next frame
+    vector<cv::Point3f> vPoints;
+    if(!Tcw.empty())
+    {
+        const vector<ORB_SLAM2::MapPoint*> vpMPs = mpSLAM->GetTrackedMapPoints();
+        vPoints.reserve(vpMPs.size());
+        for(size_t i=0; i<vpMPs.size(); i++)
+        {
+            if(!vpMPs[i] || vpMPs[i]->isBad())
+                continue;
+            Eigen::Vector3f pos;
+            vpMPs[i]->GetWorldPos(pos);
+            vPoints.push_back(cv::Point3f(pos(0),pos(1),pos(2)));
+        }
+    }
+
+    {
+        unique_lock<mutex> lock(mMutexResult);
+        // A result the publisher has not taken yet is replaced
+        mResultTimestamp = timestamp;
+        mResultTcw = Tcw;
+        mvResultPoints.swap(vPoints);
+        mbResultWaiting = true;
+    }
+    mCondResult.notify_one();
+}
+
+void SlamNodelet::RunPublisher()
+{
+    double timestamp;
+    cv::Mat Tcw;
+    vector<cv::Point3f> vPoints;
+    while(true)
+    {
+        {
+            unique_lock<mutex> lock(mMutexResult);
+            while(!mbResultWaiting && !mbFinishPublisher)
+                mCondResult.wait(lock);
+            if(!mbResultWaiting)
+                return;
+            timestamp = mResultTimestamp;
+            Tcw = mResultTcw;
+            vPoints.swap(mvResultPoints);
+            mbResultWaiting = false;
+        }
+
+        if(!Tcw.empty())
+            Publish(timestamp,Tcw,vPoints);
+    }
+}
+
+void SlamNodelet::Publish(const double timestamp, const cv::Mat &Tcw, const vector<cv::Point3f> &vPoints)
+{
+    const ros::Time stamp(timestamp);
+
+    const cv::Mat Rwc = Tcw.rowRange(0,3).colRange(0,3).t();
+    const cv::Mat twc = -Rwc*Tcw.rowRange(0,3).col(3);
+
+    const tf::Matrix3x3 R(Rwc.at<float>(0,0),Rwc.at<float>(0,1),Rwc.at<float>(0,2),
+                          Rwc.at<float>(1,0),Rwc.at<float>(1,1),Rwc.at<float>(1,2),
+                          Rwc.at<float>(2,0),Rwc.at<float>(2,1),Rwc.at<float>(2,2));
+    tf::Quaternion q;
+    R.getRotation(q);
+    const tf::Vector3 t(twc.at<float>(0),twc.at<float>(1),twc.at<float>(2));
+
+    if(mpTFBroadcaster)
+        mpTFBroadcaster->sendTransform(tf::StampedTransform(tf::Transform(q,t),stamp,mWorldFrame,mCameraFrame));
+
+    if(mPosePublisher.getNumSubscribers()>0)
+    {
+        geometry_msgs::PoseStamped pose;
+        pose.header.stamp = stamp;
+        pose.header.frame_id = mWorldFrame;
+        tf::poseTFToMsg(tf::Transform(q,t),pose.pose);
+        mPosePublisher.publish(pose);
+    }
+
+    if(mPointsPublisher.getNumSubscribers()>0)
+    {
+        sensor_msgs::PointCloud2Ptr pCloud(new sensor_msgs::PointCloud2());
+        pCloud->header.stamp = stamp;
+        pCloud->header.frame_id = mWorldFrame;
+        sensor_msgs::PointCloud2Modifier modifier(*pCloud);
+        modifier.setPointCloud2FieldsByString(1,"xyz");
+        modifier.resize(vPoints.size());
+        sensor_msgs::PointCloud2Iterator<float> itX(*pCloud,"x"), itY(*pCloud,"y"), itZ(*pCloud,"z");
+        for(size_t i=0; i<vPoints.size(); i++, ++itX, ++itY, ++itZ)
+        {
+            *itX = vPoints[i].x;
+            *itY = vPoints[i].y;
+            *itZ = vPoints[i].z;
+        }
+        mPointsPublisher.publish(pCloud);
+    }
+}
+
+class MonoNodelet : public SlamNodelet
+{
+public:
+    MonoNodelet(): SlamNodelet(ORB_SLAM2::System::MONOCULAR) {}
+
+protected:
+
+    virtual void Subscribe(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    {
+        mSubscriber = nh.subscribe("/camera/image_raw", 1, &MonoNodelet::Grab, this);
+    }
+
+    void Grab(const sensor_msgs::ImageConstPtr& msg)
+    {
+        Input input;
+        input.msg = msg;
+        Offer(input);
+    }
+
+    virtual void Track(const Input &input)
+    {
+        // Shares the buffer of the message for mono8, converts otherwise
+        const cv_bridge::CvImageConstPtr cv_ptr = cv_bridge::toCvShare(input.msg,sensor_msgs::image_encodings::MONO8);
+        mpSLAM->TrackMonocularAsync(ToExternal(cv_ptr->image),cv_ptr->header.stamp.toSec(),[cv_ptr](){});
+    }
+
+    ros::Subscriber mSubscriber;
+};
+
+class StereoNodelet : public SlamNodelet
+{
+public:
+    StereoNodelet(): SlamNodelet(ORB_SLAM2::System::STEREO), mbRectify(false) {}
+
+protected:
+
+    typedef message_filters::sync_policies::ApproximateTime<sensor_msgs::Image, sensor_msgs::Image> SyncPolicy;
+
+    virtual void Subscribe(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    {
+        pnh.param("do_rectify",mbRectify,false);
+        if(mbRectify && !LoadRectification())
+            mbRectify = false;
+
+        mpLeftSubscriber.reset(new message_filters::Subscriber<sensor_msgs::Image>(nh,"/camera/left/image_raw",1));
+        mpRightSubscriber.reset(new message_filters::Subscriber<sensor_msgs::Image>(nh,"camera/right/image_raw",1));
+        mpSync.reset(new message_filters::Synchronizer<SyncPolicy>(SyncPolicy(10),*mpLeftSubscriber,*mpRightSubscriber));
+        mpSync->registerCallback(boost::bind(&StereoNodelet::Grab,this,_1,_2));
+    }
+
+    bool LoadRectification()
+    {
+        string strSettings;
+        getPrivateNodeHandle().getParam("settings",strSettings);
+        cv::FileStorage fsSettings(strSettings, cv::FileStorage::READ);
+        if(!fsSettings.isOpened())
+        {
+            NODELET_ERROR("ERROR: Wrong path to settings");
+            return false;
+        }
+
+        cv::Mat K_l, K_r, P_l, P_r, R_l, R_r, D_l, D_r;
+        fsSettings["LEFT.K"] >> K_l;
+        fsSettings["RIGHT.K"] >> K_r;
+
+        fsSettings["LEFT.P"] >> P_l;
+        fsSettings["RIGHT.P"] >> P_r;
+
+        fsSettings["LEFT.R"] >> R_l;
+        fsSettings["RIGHT.R"] >> R_r;
+
+        fsSettings["LEFT.D"] >> D_l;
+        fsSettings["RIGHT.D"] >> D_r;
+
+        int rows_l = fsSettings["LEFT.height"];
+        int cols_l = fsSettings["LEFT.width"];
+        int rows_r = fsSettings["RIGHT.height"];
+        int cols_r = fsSettings["RIGHT.width"];
+
+        if(K_l.empty() || K_r.empty() || P_l.empty() || P_r.empty() || R_l.empty() || R_r.empty() || D_l.empty() || D_r.empty() ||
+                rows_l==0 || rows_r==0 || cols_l==0 || cols_r==0)
+        {
+            NODELET_ERROR("ERROR: Calibration parameters to rectify stereo are missing!");
+            return false;
+        }
+
+        // Fixed point maps, remap is faster with them than with float maps
+        cv::initUndistortRectifyMap(K_l,D_l,R_l,P_l.rowRange(0,3).colRange(0,3),cv::Size(cols_l,rows_l),CV_16SC2,M1l,M2l);
+        cv::initUndistortRectifyMap(K_r,D_r,R_r,P_r.rowRange(0,3).colRange(0,3),cv::Size(cols_r,rows_r),CV_16SC2,M1r,M2r);
+        return true;
+    }
+
+    void Grab(const sensor_msgs::ImageConstPtr& msgLeft, const sensor_msgs::ImageConstPtr& msgRight)
+    {
+        Input input;
+        input.msg = msgLeft;
+        input.msg2 = msgRight;
+        Offer(input);
+    }
+
+    virtual void Track(const Input &input)
+    {
+        const cv_bridge::CvImageConstPtr cv_ptrLeft = cv_bridge::toCvShare(input.msg,sensor_msgs::image_encodings::MONO8);
+        const cv_bridge::CvImageConstPtr cv_ptrRight = cv_bridge::toCvShare(input.msg2,sensor_msgs::image_encodings::MONO8);
+        const double timestamp = cv_ptrLeft->header.stamp.toSec();
+
+        if(mbRectify)
+        {
+            // The rectified images live until the system releases them
+            cv::Mat imLeft, imRight;
+            cv::remap(cv_ptrLeft->image,imLeft,M1l,M2l,cv::INTER_LINEAR);
+            cv::remap(cv_ptrRight->image,imRight,M1r,M2r,cv::INTER_LINEAR);
+            mpSLAM->TrackStereoAsync(ToExternal(imLeft),ToExternal(imRight),timestamp,[imLeft,imRight](){});
+        }
+        else
+        {
+            mpSLAM->TrackStereoAsync(ToExternal(cv_ptrLeft->image),ToExternal(cv_ptrRight->image),timestamp,
+                                     [cv_ptrLeft,cv_ptrRight](){});
+        }
+    }
+
+    bool mbRectify;
+    cv::Mat M1l,M2l,M1r,M2r;
+
+    boost::shared_ptr<message_filters::Subscriber<sensor_msgs::Image> > mpLeftSubscriber;
+    boost::shared_ptr<message_filters::Subscriber<sensor_msgs::Image> > mpRightSubscriber;
+    boost::shared_ptr<message_filters::Synchronizer<SyncPolicy> > mpSync;
+};
+
+class RGBDNodelet : public SlamNodelet
+{
+public:
+    RGBDNodelet(): SlamNodelet(ORB_SLAM2::System::RGBD) {}
+
+protected:
+
+    typedef message_filters::sync_policies::ApproximateTime<sensor_msgs::Image, sensor_msgs::Image> SyncPolicy;
+
+    virtual void Subscribe(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    {
+        mpRGBSubscriber.reset(new message_filters::Subscriber<sensor_msgs::Image>(nh,"/camera/rgb/image_raw",1));
+        mpDepthSubscriber.reset(new message_filters::Subscriber<sensor_msgs::Image>(nh,"camera/depth_registered/image_raw",1));
+        mpSync.reset(new message_filters::Synchronizer<SyncPolicy>(SyncPolicy(10),*mpRGBSubscriber,*mpDepthSubscriber));
+        mpSync->registerCallback(boost::bind(&RGBDNodelet::Grab,this,_1,_2));
+    }
+
+    void Grab(const sensor_msgs::ImageConstPtr& msgRGB, const sensor_msgs::ImageConstPtr& msgD)
+    {
+        Input input;
+        input.msg = msgRGB;
+        input.msg2 = msgD;
+        Offer(input);
+    }
+
+    virtual void Track(const Input &input)
+    {
+        const cv_bridge::CvImageConstPtr cv_ptrRGB = cv_bridge::toCvShare(input.msg,sensor_msgs::image_encodings::MONO8);
+        const cv_bridge::CvImageConstPtr cv_ptrD = cv_bridge::toCvShare(input.msg2);
+        const double timestamp = cv_ptrRGB->header.stamp.toSec();
+
+        if(cv_ptrD->image.type()==CV_32F)
+        {
+            // 32FC1 depth is in meters, both buffers are shared with the messages
+            mpSLAM->TrackRGBDAsync(ToExternal(cv_ptrRGB->image),ToExternalDepth(cv_ptrD->image),timestamp,
+                                   [cv_ptrRGB,cv_ptrD](){});
+        }
+        else
+        {
+            // Raw depth is scaled with DepthMapFactor, this path copies the images
+            mpSLAM->TrackRGBDAsync(cv_ptrRGB->image,cv_ptrD->image,timestamp);
+        }
+    }
+
+    boost::shared_ptr<message_filters::Subscriber<sensor_msgs::Image> > mpRGBSubscriber;
+    boost::shared_ptr<message_filters::Subscriber<sensor_msgs::Image> > mpDepthSubscriber;
+    boost::shared_ptr<message_filters::Synchronizer<SyncPolicy> > mpSync;
+};
+
+} //namespace ORB_SLAM2_ROS
+
+PLUGINLIB_EXPORT_CLASS(ORB_SLAM2_ROS::MonoNodelet, nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(ORB_SLAM2_ROS::StereoNodelet, nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(ORB_SLAM2_ROS::RGBDNodelet, nodelet::Nodelet)
@@ -27,13 +27,11 @@
 
 #include<opencv2/core/core.hpp>
 
+#include<ImageSource.h>
 #include<System.h>
 
 using namespace std;
 
-void LoadImages(const string &strPathLeft, const string &strPathRight, const string &strPathTimes,
-                vector<string> &vstrImageLeft, vector<string> &vstrImageRight, vector<double> &vTimeStamps);
-
 int main(int argc, char **argv)
 {
     if(argc != 6)
@@ -43,62 +41,30 @@ int main(int argc, char **argv)
     }
 
     // Retrieve paths to images
-    vector<string> vstrImageLeft;
-    vector<string> vstrImageRight;
-    vector<double> vTimeStamp;
-    LoadImages(string(argv[3]), string(argv[4]), string(argv[5]), vstrImageLeft, vstrImageRight, vTimeStamp);
+    vector<ORB_SLAM2::ImageSource::Entry> vEntries;
+    ORB_SLAM2::ImageSource::LoadEuRoC(string(argv[3]), string(argv[4]), string(argv[5]), vEntries);
 
-    if(vstrImageLeft.empty() || vstrImageRight.empty())
+    if(vEntries.empty())
     {
         cerr << "ERROR: No images in provided path." << endl;
         return 1;
     }
 
-    if(vstrImageLeft.size()!=vstrImageRight.size())
-    {
-        cerr << "ERROR: Different number of left and right images." << endl;
-        return 1;
-    }
-
     // Read rectification parameters
-    cv::FileStorage fsSettings(argv[2], cv::FileStorage::READ);
-    if(!fsSettings.isOpened())
+    ORB_SLAM2::Settings fsSettings;
+    if(!fsSettings.Load(argv[2]))
     {
         cerr << "ERROR: Wrong path to settings" << endl;
         return -1;
     }
 
-    cv::Mat K_l, K_r, P_l, P_r, R_l, R_r, D_l, D_r;
-    fsSettings["LEFT.K"] >> K_l;
-    fsSettings["RIGHT.K"] >> K_r;
-
-    fsSettings["LEFT.P"] >> P_l;
-    fsSettings["RIGHT.P"] >> P_r;
-
-    fsSettings["LEFT.R"] >> R_l;
-    fsSettings["RIGHT.R"] >> R_r;
-
-    fsSettings["LEFT.D"] >> D_l;
-    fsSettings["RIGHT.D"] >> D_r;
-
-    int rows_l = fsSettings["LEFT.height"];
-    int cols_l = fsSettings["LEFT.width"];
-    int rows_r = fsSettings["RIGHT.height"];
-    int cols_r = fsSettings["RIGHT.width"];
-
-    if(K_l.empty() || K_r.empty() || P_l.empty() || P_r.empty() || R_l.empty() || R_r.empty() || D_l.empty() || D_r.empty() ||
-            rows_l==0 || rows_r==0 || cols_l==0 || cols_r==0)
-    {
-        cerr << "ERROR: Calibration parameters to rectify stereo are missing!" << endl;
+    // Images are read and rectified ahead while the previous ones are tracked, unless the System
+    // rectifies them (Camera.rectifyStereo)
+    ORB_SLAM2::ImageSource source(vEntries);
+    if(!(int)fsSettings["Camera.rectifyStereo"] && !source.SetStereoRectification(fsSettings))
         return -1;
-    }
 
-    cv::Mat M1l,M2l,M1r,M2r;
-    cv::initUndistortRectifyMap(K_l,D_l,R_l,P_l.rowRange(0,3).colRange(0,3),cv::Size(cols_l,rows_l),CV_32F,M1l,M2l);
-    cv::initUndistortRectifyMap(K_r,D_r,R_r,P_r.rowRange(0,3).colRange(0,3),cv::Size(cols_r,rows_r),CV_32F,M1r,M2r);
-
-
-    const int nImages = vstrImageLeft.size();
+    const int nImages = vEntries.size();
 
     // Create SLAM system. It initializes all system threads and gets ready to process frames.
     ORB_SLAM2::System SLAM(argv[1],argv[2],ORB_SLAM2::System::STEREO,true);
@@ -112,31 +78,16 @@ int main(int argc, char **argv)
     cout << "Images in the sequence: " << nImages << endl << endl;
 
     // Main loop
-    cv::Mat imLeft, imRight, imLeftRect, imRightRect;
+    ORB_SLAM2::ImageSource::Image image;
+    cv::Mat imLeftRect, imRightRect;
     for(int ni=0; ni<nImages; ni++)
     {
         // Read left and right images from file
-        imLeft = cv::imread(vstrImageLeft[ni],CV_LOAD_IMAGE_UNCHANGED);
-        imRight = cv::imread(vstrImageRight[ni],CV_LOAD_IMAGE_UNCHANGED);
-
-        if(imLeft.empty())
-        {
-            cerr << endl << "Failed to load image at: "
-                 << string(vstrImageLeft[ni]) << endl;
+        if(!source.Next(image))
             return 1;
-        }
-
-        if(imRight.empty())
-        {
-            cerr << endl << "Failed to load image at: "
-                 << string(vstrImageRight[ni]) << endl;
-            return 1;
-        }
-
-        cv::remap(imLeft,imLeftRect,M1l,M2l,cv::INTER_LINEAR);
-        cv::remap(imRight,imRightRect,M1r,M2r,cv::INTER_LINEAR);
-
-        double tframe = vTimeStamp[ni];
+        imLeftRect = image.im;
+        imRightRect = image.im2;
+        double tframe = image.timestamp;
 
 
 #ifdef COMPILEDWITHC11
@@ -161,9 +112,9 @@ int main(int argc, char **argv)
         // Wait to load the next frame
         double T=0;
         if(ni<nImages-1)
-            T = vTimeStamp[ni+1]-tframe;
+            T = vEntries[ni+1].timestamp-tframe;
         else if(ni>0)
-            T = tframe-vTimeStamp[ni-1];
+            T = tframe-vEntries[ni-1].timestamp;
 
         if(ttrack<T)
             usleep((T-ttrack)*1e6);
@@ -188,29 +139,3 @@ int main(int argc, char **argv)
 
     return 0;
 }
-
-void LoadImages(const string &strPathLeft, const string &strPathRight, const string &strPathTimes,
-                vector<string> &vstrImageLeft, vector<string> &vstrImageRight, vector<double> &vTimeStamps)
-{
-    ifstream fTimes;
-    fTimes.open(strPathTimes.c_str());
-    vTimeStamps.reserve(5000);
-    vstrImageLeft.reserve(5000);
-    vstrImageRight.reserve(5000);
-    while(!fTimes.eof())
-    {
-        string s;
-        getline(fTimes,s);
-        if(!s.empty())
-        {
-            stringstream ss;
-            ss << s;
-            vstrImageLeft.push_back(strPathLeft + "/" + ss.str() + ".png");
-            vstrImageRight.push_back(strPathRight + "/" + ss.str() + ".png");
-            double t;
-            ss >> t;
-            vTimeStamps.push_back(t/1e9);
-
-        }
-    }
-}
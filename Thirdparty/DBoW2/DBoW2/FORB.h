@@ -60,6 +60,20 @@ public:
    */
   static void fromString(TDescriptor &a, const std::string &s);
 
+  /**
+   * Makes a descriptor which uses the given memory, nothing is copied
+   * @param a (out) descriptor
+   * @param p L bytes, must outlive the descriptor
+   */
+  static void fromArray(TDescriptor &a, const unsigned char *p);
+
+  /**
+   * Copies the L bytes of a descriptor
+   * @param a descriptor
+   * @param p (out) L bytes
+   */
+  static void toArray(const TDescriptor &a, unsigned char *p);
+
   /**
    * Returns a mat with the descriptors in float format
    * @param descriptors
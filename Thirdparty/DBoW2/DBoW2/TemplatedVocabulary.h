@@ -3,6 +3,13 @@
  * Added functions: Save and Load from text files without using cv::FileStorage.
  * Date: August 2015
  * Raúl Mur-Artal
+ *
+ * Added functions: Save and Load from binary files, the binary file is memory
+ * mapped and the node descriptors are used in place.
+ *
+ * Added a flat, level ordered copy of the tree (children descriptors stored
+ * contiguously) and a transform of a whole descriptor block which walks it
+ * with an exchangeable block distance function.
  */
 
 /**
@@ -26,6 +33,16 @@
 #include <algorithm>
 #include <opencv2/core/core.hpp>
 #include <limits>
+#include <memory>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "FeatureVector.h"
 #include "BowVector.h"
@@ -44,6 +61,14 @@ template<class TDescriptor, class F>
 class TemplatedVocabulary
 {		
 public:
+
+  /**
+   * Distances of a query descriptor to n descriptors of a contiguous block,
+   * the i-th one is located at block + indices[i]*step
+   */
+  typedef void (*BlockDistance)(const unsigned char *query,
+    const unsigned char *block, const size_t step, const size_t *indices,
+    const size_t n, int *distances);
   
   /**
    * Initiates an empty vocabulary
@@ -145,6 +170,19 @@ public:
   virtual void transform(const std::vector<TDescriptor>& features,
     BowVector &v, FeatureVector &fv, int levelsup) const;
 
+  /**
+   * Transforms n descriptors of F::L bytes stored row by row (e.g. the
+   * rows of a CV_8U descriptor matrix) into a bow vector and a feature vector
+   * @param descriptors first byte of the first descriptor
+   * @param step bytes between two consecutive descriptors
+   * @param n number of descriptors
+   * @param v (out) bow vector
+   * @param fv (out) feature vector of nodes and feature indexes
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void transform(const unsigned char *descriptors, size_t step, size_t n,
+    BowVector &v, FeatureVector &fv, int levelsup) const;
+
   /**
    * Transforms a single feature into a word (without weight)
    * @param feature
@@ -189,12 +227,37 @@ public:
    * @return L
    */
   inline int getDepthLevels() const { return m_L; }
+
+  /**
+   * Returns the levels up from the leaves of the nodes the features of a
+   * FeatureVector are grouped by, the value to pass to transform. Unless
+   * set, 4 for a vocabulary of 6 levels and 2 levels below the root for
+   * any other depth
+   * @return levelsup 0..L-1
+   */
+  int getFeatureVectorLevelsUp() const;
+
+  /**
+   * Changes the levels returned by getFeatureVectorLevelsUp. It is saved in
+   * the binary file; features grouped by other levels do not match
+   * @param levelsup levels up from the leaves, clamped to 0..L-1, or -1
+   *   for the default
+   */
+  inline void setFeatureVectorLevelsUp(int levelsup) { m_levelsup = levelsup; }
   
   /**
    * Returns the real depth levels of the tree on average
    * @return average of depth levels of leaves
    */
   float getEffectiveLevels() const;
+
+  /**
+   * Returns the bytes the vocabulary holds on the heap, estimated from
+   * the sizes of its containers. Descriptors in a mapped file and a shared
+   * memory segment are not counted
+   * @return bytes
+   */
+  size_t getMemoryUsage() const;
   
   /**
    * Returns the descriptor of a word
@@ -234,12 +297,77 @@ public:
    */
   void setScoringType(ScoringType type);
 
+  /**
+   * Changes the function used to compare descriptors against the children
+   * of a node when descending the tree (by default F::distance)
+   * @param f block distance, must give the same distances as F::distance
+   */
+  inline void setBlockDistance(BlockDistance f) { m_block_distance = f; }
+
   /**
    * Loads the vocabulary from a text file
    * @param filename
    */
   bool loadFromTextFile(const std::string &filename);
 
+  /**
+   * Loads the vocabulary from a binary file (see saveToBinaryFile).
+   * The file is memory mapped and stays mapped as long as the vocabulary
+   * (or a copy of it) uses it, node descriptors point directly into it
+   * @param filename
+   * @return false if the file could not be mapped or is not a valid binary file
+   */
+  bool loadFromBinaryFile(const std::string &filename);
+
+  /**
+   * Saves the vocabulary into a binary file which can be memory mapped
+   * by loadFromBinaryFile. The file is written in host byte order
+   * @param filename
+   * @param quantizeWeights store the weights as 16 bit fractions of the
+   *   largest one instead of doubles
+   * @return false if the file could not be written
+   */
+  bool saveToBinaryFile(const std::string &filename,
+    bool quantizeWeights = false) const;
+
+  /**
+   * Checks the header of a file for the binary vocabulary signature
+   * @param filename
+   * @return true iff the file is a binary vocabulary
+   */
+  static bool isBinaryFile(const std::string &filename);
+
+  /**
+   * Copies the flat tree (the nodes and descriptors transform descends,
+   * which hold no pointers) into a new POSIX shared memory segment, which
+   * stays until it is removed, for other processes to attach
+   * @param name segment name, e.g. "/orbslam_voc"
+   * @return false if the segment exists already or can not be written
+   */
+  bool createSharedMemory(const std::string &name) const;
+
+  /**
+   * Attaches to a segment written by createSharedMemory, read only: every
+   * process uses the same physical pages. Only the flat tree is there, so
+   * the vocabulary transforms features and scores vectors, but it can not
+   * be saved, pruned or queried by node
+   * @param name segment name
+   * @return false if there is no complete segment of this kind
+   */
+  bool attachSharedMemory(const std::string &name);
+
+  /**
+   * Removes a segment, the processes attached to it keep using it
+   * @param name segment name
+   * @return false if there was no such segment
+   */
+  static bool removeSharedMemory(const std::string &name);
+
+  /**
+   * Returns whether the vocabulary is attached to a shared memory segment
+   */
+  inline bool isShared() const { return m_nodes.empty() && m_flat != NULL; }
+
   /**
    * Saves the vocabulary into a text file
    * @param filename
@@ -288,11 +416,111 @@ public:
    */
   virtual int stopWords(double minWeight);
 
+  /**
+   * Cuts the tree to its first L levels: the nodes of level L become words
+   * and the nodes below them are removed. The weight of a new word merges
+   * the idf of the words below it (the images where any of them is present)
+   * @return number of words removed
+   */
+  int pruneLevels(int L);
+
+  /**
+   * Keeps the k children of every node whose words are present in most
+   * training images (from their idf) and removes the others with their
+   * subtrees. Features go to the closest of the kept children instead
+   * @return number of words removed
+   */
+  int pruneBranches(int k);
+
+  /**
+   * Merges the words of a node into the node when they occur less than
+   * minUsage times in total, bottom up, so a node whose children were
+   * merged can be merged again. The weights merge as in pruneLevels
+   * @param usage occurrences of every word id, e.g. counted by transforming
+   *   the features of a dataset
+   * @param minUsage
+   * @return number of words removed
+   */
+  int mergeWords(const std::vector<unsigned int> &usage, unsigned int minUsage);
+
 protected:
 
   /// Pointer to descriptor
   typedef const TDescriptor *pDescriptor;
 
+  /// Header of the binary vocabulary file. It is followed by the arrays
+  /// (one entry per node, including the root) at the given byte offsets:
+  /// parents (uint32), word ids (int32, -1 for inner nodes),
+  /// weights (double or uint16) and descriptors (F::L bytes each).
+  /// Version 1 files have no version 2 fields and double weights
+  struct BinaryHeader
+  {
+    char magic[8];
+    uint32_t version;
+    int32_t k;
+    int32_t L;
+    int32_t scoring;
+    int32_t weighting;
+    uint32_t nodes;
+    uint32_t words;
+    uint32_t descriptorBytes;
+    uint64_t parentsOffset;
+    uint64_t wordIdsOffset;
+    uint64_t weightsOffset;
+    uint64_t descriptorsOffset;
+    // version 2
+    /// 8 for doubles, 2 for weights quantized to weightScale/65535 steps
+    uint32_t weightBytes;
+    /// m_levelsup
+    int32_t featureLevelsUp;
+    double weightScale;
+  };
+
+  static const char* binaryMagic() { return "DBoW2BIN"; }
+  static const uint32_t kBinaryVersion = 2;
+
+  /// Header of a shared memory segment, followed by the flat nodes and
+  /// their descriptors at the given byte offsets. ready is set last, once
+  /// the segment is complete
+  struct SharedHeader
+  {
+    char magic[8];
+    uint32_t version;
+    int32_t k;
+    int32_t L;
+    int32_t scoring;
+    int32_t weighting;
+    int32_t featureLevelsUp;
+    uint32_t nodes;
+    uint32_t words;
+    uint32_t maxChildren;
+    uint32_t descriptorBytes;
+    uint32_t flatNodeBytes;
+    uint32_t ready;
+    uint64_t nodesOffset;
+    uint64_t descriptorsOffset;
+    uint64_t size;
+  };
+
+  static const char* sharedMagic() { return "DBoW2SHM"; }
+  static const uint32_t kSharedVersion = 1;
+
+  /// Node of the flat tree. Nodes are stored level by level, so the
+  /// children of a node and their descriptors are contiguous
+  struct FlatNode
+  {
+    /// Position of the first child in the flat tree
+    uint32_t first_child;
+    /// Number of children (0 for words)
+    uint32_t n_children;
+    /// Id of the node in m_nodes
+    NodeId id;
+    /// Word id if the node is a word
+    WordId word_id;
+    /// Weight if the node is a word
+    WordValue weight;
+  };
+
   /// Tree node
   struct Node 
   {
@@ -361,6 +589,31 @@ protected:
    * @param id (out) word id
    */
   virtual void transform(const TDescriptor &feature, WordId &id) const;
+
+  /**
+   * Returns the word id associated to a feature by descending the flat tree
+   * @param feature F::L bytes of the feature
+   * @param id (out) word id
+   * @param weight (out) word weight
+   * @param nid (out) if given, id of the node "levelsup" levels up
+   * @param levelsup
+   * @param distances buffer for at least m_flat_offsets.size() distances
+   */
+  void transformFlat(const unsigned char *feature, WordId &id,
+    WordValue &weight, NodeId *nid, int levelsup, int *distances) const;
+
+  /**
+   * Block distance computed with F::distance
+   */
+  static void defaultBlockDistance(const unsigned char *query,
+    const unsigned char *block, const size_t step, const size_t *indices,
+    const size_t n, int *distances);
+
+  /**
+   * Rebuilds the flat tree from m_nodes. Must be called whenever the nodes
+   * or their weights change
+   */
+  void createFlatTree();
       
   /**
    * Creates a level in the tree, under the parent, by running kmeans with
@@ -401,6 +654,22 @@ protected:
    * @param features
    */
   void setNodeWeights(const vector<vector<TDescriptor> > &features);
+
+  /**
+   * Weight of a word merging the given words, the idf of the images where
+   * any of them is present (at most all of them)
+   */
+  WordValue mergedWeight(const std::vector<NodeId> &words) const;
+
+  /**
+   * Removes the nodes below the collapsed ones and the removed ones, gives
+   * the remaining nodes consecutive ids and creates the words again
+   * @param collapsed nodes which become words, with their new weight
+   * @param removed nodes removed with their subtrees
+   * @return number of words removed
+   */
+  int rebuildTree(const std::vector<bool> &collapsed,
+    const std::vector<WordValue> &weights, const std::vector<bool> &removed);
   
 protected:
 
@@ -425,6 +694,30 @@ protected:
   /// Words of the vocabulary (tree leaves)
   /// this condition holds: m_words[wid]->word_id == wid
   std::vector<Node*> m_words;
+
+  /// Memory mapped binary file the node descriptors point into (or NULL)
+  std::shared_ptr<const unsigned char> m_mapping;
+
+  /// Tree nodes in level order, see FlatNode
+  std::vector<FlatNode> m_flat_nodes;
+
+  /// Descriptors of m_flat_nodes, F::L bytes each
+  std::vector<unsigned char> m_flat_descriptors;
+
+  /// The flat tree transform descends: m_flat_nodes and m_flat_descriptors,
+  /// or the arrays of the attached shared memory segment (in m_mapping)
+  const FlatNode *m_flat;
+  const unsigned char *m_flat_desc;
+  unsigned int m_flat_words;
+
+  /// 0..max number of children - 1, indices for the block distance
+  std::vector<size_t> m_flat_offsets;
+
+  /// Distance used when descending the flat tree
+  BlockDistance m_block_distance;
+
+  /// Levels up of the FeatureVector nodes, -1 for the default
+  int m_levelsup;
   
 };
 
@@ -434,7 +727,8 @@ template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
   (int k, int L, WeightingType weighting, ScoringType scoring)
   : m_k(k), m_L(L), m_weighting(weighting), m_scoring(scoring),
-  m_scoring_object(NULL)
+  m_scoring_object(NULL), m_flat(NULL), m_flat_desc(NULL), m_flat_words(0),
+  m_block_distance(&defaultBlockDistance), m_levelsup(-1)
 {
   createScoringObject();
 }
@@ -443,7 +737,9 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const std::string &filename): m_scoring_object(NULL)
+  (const std::string &filename): m_scoring_object(NULL),
+  m_flat(NULL), m_flat_desc(NULL), m_flat_words(0),
+  m_block_distance(&defaultBlockDistance), m_levelsup(-1)
 {
   load(filename);
 }
@@ -452,7 +748,9 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const char *filename): m_scoring_object(NULL)
+  (const char *filename): m_scoring_object(NULL),
+  m_flat(NULL), m_flat_desc(NULL), m_flat_words(0),
+  m_block_distance(&defaultBlockDistance), m_levelsup(-1)
 {
   load(filename);
 }
@@ -516,7 +814,8 @@ void TemplatedVocabulary<TDescriptor,F>::setWeightingType(WeightingType type)
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary(
   const TemplatedVocabulary<TDescriptor, F> &voc)
-  : m_scoring_object(NULL)
+  : m_scoring_object(NULL), m_flat(NULL), m_flat_desc(NULL), m_flat_words(0),
+  m_block_distance(&defaultBlockDistance), m_levelsup(-1)
 {
   *this = voc;
 }
@@ -546,8 +845,21 @@ TemplatedVocabulary<TDescriptor,F>::operator=
   this->m_nodes.clear();
   this->m_words.clear();
   
+  // the copied descriptors may still point into the mapped file of voc
+  this->m_mapping = voc.m_mapping;
   this->m_nodes = voc.m_nodes;
   this->createWords();
+  this->createFlatTree();
+  if(voc.isShared())
+  {
+    // the flat tree of a shared vocabulary is in the segment
+    this->m_flat = voc.m_flat;
+    this->m_flat_desc = voc.m_flat_desc;
+    this->m_flat_words = voc.m_flat_words;
+    this->m_flat_offsets = voc.m_flat_offsets;
+  }
+  this->m_block_distance = voc.m_block_distance;
+  this->m_levelsup = voc.m_levelsup;
   
   return *this;
 }
@@ -560,6 +872,7 @@ void TemplatedVocabulary<TDescriptor,F>::create(
 {
   m_nodes.clear();
   m_words.clear();
+  m_mapping.reset();
   
   // expected_nodes = Sum_{i=0..L} ( k^i )
 	int expected_nodes = 
@@ -583,6 +896,8 @@ void TemplatedVocabulary<TDescriptor,F>::create(
 
   // and set the weight of each node of the tree
   setNodeWeights(training_features);
+
+  createFlatTree();
   
 }
 
@@ -1000,7 +1315,7 @@ void TemplatedVocabulary<TDescriptor,F>::setNodeWeights
 template<class TDescriptor, class F>
 inline unsigned int TemplatedVocabulary<TDescriptor,F>::size() const
 {
-  return m_words.size();
+  return m_nodes.empty() ? m_flat_words : m_words.size();
 }
 
 // --------------------------------------------------------------------------
@@ -1008,7 +1323,7 @@ inline unsigned int TemplatedVocabulary<TDescriptor,F>::size() const
 template<class TDescriptor, class F>
 inline bool TemplatedVocabulary<TDescriptor,F>::empty() const
 {
-  return m_words.empty();
+  return size() == 0;
 }
 
 // --------------------------------------------------------------------------
@@ -1016,6 +1331,8 @@ inline bool TemplatedVocabulary<TDescriptor,F>::empty() const
 template<class TDescriptor, class F>
 float TemplatedVocabulary<TDescriptor,F>::getEffectiveLevels() const
 {
+  if(m_words.empty()) return 0;
+
   long sum = 0;
   typename std::vector<Node*>::const_iterator wit;
   for(wit = m_words.begin(); wit != m_words.end(); ++wit)
@@ -1030,6 +1347,37 @@ float TemplatedVocabulary<TDescriptor,F>::getEffectiveLevels() const
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+int TemplatedVocabulary<TDescriptor,F>::getFeatureVectorLevelsUp() const
+{
+  const int max_levelsup = std::max(m_L - 1, 0);
+  if(m_levelsup >= 0)
+    return std::min(m_levelsup, max_levelsup);
+  return std::min(std::max(m_L - 2, 0), max_levelsup);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+size_t TemplatedVocabulary<TDescriptor,F>::getMemoryUsage() const
+{
+  size_t bytes = m_nodes.capacity()*sizeof(Node) + m_words.capacity()*sizeof(Node*) +
+    m_flat_nodes.capacity()*sizeof(FlatNode) + m_flat_descriptors.capacity() +
+    m_flat_offsets.capacity()*sizeof(size_t);
+
+  typename std::vector<Node>::const_iterator nit;
+  for(nit = m_nodes.begin(); nit != m_nodes.end(); ++nit)
+  {
+    bytes += nit->children.capacity()*sizeof(NodeId);
+    if(!m_mapping)
+      bytes += F::L;
+  }
+
+  return bytes;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 TDescriptor TemplatedVocabulary<TDescriptor,F>::getWord(WordId wid) const
 {
@@ -1195,6 +1543,122 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const unsigned char *descriptors, size_t step, size_t n,
+  BowVector &v, FeatureVector &fv, int levelsup) const
+{
+  v.clear();
+  fv.clear();
+  
+  if(empty() || m_flat == NULL)
+  {
+    return;
+  }
+  
+  // normalize 
+  LNorm norm;
+  bool must = m_scoring_object->mustNormalize(norm);
+
+  // one buffer for the distances to the children of all the visited nodes
+  std::vector<int> distances(m_flat_offsets.size());
+
+  const bool tf = (m_weighting == TF || m_weighting == TF_IDF);
+
+  // level at which the node must be stored in nid
+  const int nid_level = m_L - levelsup;
+
+  // The features descend the tree together, one level at a time. At every
+  // level they are sorted by the node they reached, so the children of a
+  // node are compared with all of its features in a row while their
+  // descriptors are in the cache. Every feature takes the same path as in
+  // transformFlat.
+  std::vector<uint32_t> final_pos(n, 0);
+  std::vector<NodeId> nids(n, 0);
+  std::vector<int> final_level(n, 0);
+  // position of the node in the high bits, feature index in the low ones
+  std::vector<uint64_t> active(n);
+  for(size_t i_feature = 0; i_feature < n; ++i_feature)
+    active[i_feature] = i_feature;
+
+  int current_level = 0;
+  while(!active.empty())
+  {
+    ++current_level;
+    std::sort(active.begin(), active.end());
+
+    size_t n_active = 0;
+    for(size_t i = 0; i < active.size(); ++i)
+    {
+      const uint32_t pos = (uint32_t)(active[i] >> 32);
+      const uint32_t i_feature = (uint32_t)active[i];
+      const FlatNode &node = m_flat[pos];
+
+      m_block_distance(descriptors + i_feature*step,
+        m_flat_desc + (size_t)node.first_child * F::L, F::L,
+        &m_flat_offsets[0], node.n_children, &distances[0]);
+
+      // first child with the smallest distance, as in transform
+      uint32_t best = 0;
+      for(uint32_t c = 1; c < node.n_children; ++c)
+      {
+        if(distances[c] < distances[best])
+          best = c;
+      }
+      const uint32_t child = node.first_child + best;
+
+      if(current_level == nid_level)
+        nids[i_feature] = m_flat[child].id;
+
+      if(m_flat[child].n_children > 0)
+        active[n_active++] = ((uint64_t)child << 32) | i_feature;
+      else
+      {
+        final_pos[i_feature] = child;
+        final_level[i_feature] = current_level;
+      }
+    }
+    active.resize(n_active);
+  }
+
+  for(size_t i_feature = 0; i_feature < n; ++i_feature)
+  {
+    // w is the idf value if TF_IDF, 1 if TF
+    // w is idf if IDF, or 1 if BINARY
+    const FlatNode &leaf = m_flat[final_pos[i_feature]];
+    const WordId id = leaf.word_id;
+    const WordValue w = leaf.weight;
+
+    // merged words can be above the level of the FeatureVector nodes
+    NodeId nid = nids[i_feature];
+    if(nid_level <= 0)
+      nid = 0; // root
+    else if(final_level[i_feature] < nid_level)
+      nid = leaf.id;
+
+    if(w > 0) // not stopped
+    {
+      if(tf)
+        v.addWeight(id, w);
+      else
+        v.addIfNotExist(id, w);
+      fv.addFeature(nid, i_feature);
+    }
+  }
+
+  if(tf && !v.empty() && !must)
+  {
+    // unnecessary when normalizing
+    const double nd = v.size();
+    for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
+      vit->second /= nd;
+  }
+  
+  if(must) v.normalize(norm);
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F> 
 inline double TemplatedVocabulary<TDescriptor,F>::score
   (const BowVector &v1, const BowVector &v2) const
@@ -1218,8 +1682,17 @@ template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature, 
   WordId &word_id, WordValue &weight, NodeId *nid, int levelsup) const
 { 
+  if(m_nodes.empty())
+  {
+    // a shared vocabulary only has the flat tree
+    std::vector<unsigned char> bytes(F::L);
+    std::vector<int> distances(m_flat_offsets.size());
+    F::toArray(feature, &bytes[0]);
+    transformFlat(&bytes[0], word_id, weight, nid, levelsup, &distances[0]);
+    return;
+  }
+
   // propagate the feature down the tree
-  vector<NodeId> nodes;
   typename vector<NodeId>::const_iterator nit;
 
   // level at which the node must be stored in nid, if given
@@ -1232,7 +1705,7 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
   do
   {
     ++current_level;
-    nodes = m_nodes[final_id].children;
+    const vector<NodeId> &nodes = m_nodes[final_id].children;
     final_id = nodes[0];
  
     double best_d = F::distance(feature, m_nodes[final_id].descriptor);
@@ -1253,6 +1726,10 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
     
   } while( !m_nodes[final_id].isLeaf() );
 
+  // merged words can be above the level of the FeatureVector nodes
+  if(nid != NULL && current_level < nid_level)
+    *nid = final_id;
+
   // turn node id into word id
   word_id = m_nodes[final_id].word_id;
   weight = m_nodes[final_id].weight;
@@ -1260,6 +1737,119 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transformFlat(
+  const unsigned char *feature, WordId &word_id, WordValue &weight,
+  NodeId *nid, int levelsup, int *distances) const
+{
+  // level at which the node must be stored in nid, if given
+  const int nid_level = m_L - levelsup;
+  if(nid_level <= 0 && nid != NULL) *nid = 0; // root
+
+  uint32_t final_pos = 0; // root
+  int current_level = 0;
+
+  do
+  {
+    ++current_level;
+    const FlatNode &node = m_flat[final_pos];
+
+    m_block_distance(feature, m_flat_desc + (size_t)node.first_child * F::L,
+      F::L, &m_flat_offsets[0], node.n_children, distances);
+
+    // first child with the smallest distance, as in transform
+    uint32_t best = 0;
+    for(uint32_t i = 1; i < node.n_children; ++i)
+    {
+      if(distances[i] < distances[best])
+        best = i;
+    }
+    final_pos = node.first_child + best;
+
+    if(nid != NULL && current_level == nid_level)
+      *nid = m_flat[final_pos].id;
+
+  } while(m_flat[final_pos].n_children > 0);
+
+  // merged words can be above the level of the FeatureVector nodes
+  if(nid != NULL && current_level < nid_level)
+    *nid = m_flat[final_pos].id;
+
+  word_id = m_flat[final_pos].word_id;
+  weight = m_flat[final_pos].weight;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::defaultBlockDistance(
+  const unsigned char *query, const unsigned char *block, const size_t step,
+  const size_t *indices, const size_t n, int *distances)
+{
+  TDescriptor q, d;
+  F::fromArray(q, query);
+  for(size_t i = 0; i < n; ++i)
+  {
+    F::fromArray(d, block + indices[i]*step);
+    distances[i] = (int)F::distance(q, d);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::createFlatTree()
+{
+  m_flat_nodes.clear();
+  m_flat_descriptors.clear();
+  m_flat_offsets.clear();
+  m_flat = NULL;
+  m_flat_desc = NULL;
+  m_flat_words = 0;
+
+  if(m_nodes.empty()) return;
+
+  // breadth first, so the children of every node are next to each other
+  std::vector<NodeId> order;
+  order.reserve(m_nodes.size());
+  order.push_back(0);
+
+  m_flat_nodes.reserve(m_nodes.size());
+  m_flat_descriptors.resize(m_nodes.size() * F::L, 0);
+
+  size_t max_children = 0;
+  for(size_t i = 0; i < order.size(); ++i)
+  {
+    const Node &node = m_nodes[order[i]];
+
+    FlatNode flat;
+    flat.first_child = order.size();
+    flat.n_children = node.children.size();
+    flat.id = node.id;
+    flat.word_id = node.isLeaf() ? node.word_id : 0;
+    flat.weight = node.weight;
+    m_flat_nodes.push_back(flat);
+
+    order.insert(order.end(), node.children.begin(), node.children.end());
+    max_children = std::max(max_children, node.children.size());
+
+    // the root has no descriptor
+    if(i > 0) F::toArray(node.descriptor, &m_flat_descriptors[i * F::L]);
+  }
+
+  m_flat_descriptors.resize(m_flat_nodes.size() * F::L);
+
+  m_flat_offsets.resize(max_children);
+  for(size_t i = 0; i < max_children; ++i)
+    m_flat_offsets[i] = i;
+
+  m_flat = &m_flat_nodes[0];
+  m_flat_desc = &m_flat_descriptors[0];
+  m_flat_words = m_words.size();
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 NodeId TemplatedVocabulary<TDescriptor,F>::getParentNode
   (WordId wid, int levelsup) const
@@ -1329,11 +1919,228 @@ int TemplatedVocabulary<TDescriptor,F>::stopWords(double minWeight)
       (*wit)->weight = 0;
     }
   }
+
+  // the flat tree holds a copy of the weights
+  if(c > 0) createFlatTree();
+
   return c;
 }
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+int TemplatedVocabulary<TDescriptor,F>::pruneLevels(int L)
+{
+  if(m_nodes.empty() || L < 1 || L >= m_L) return 0;
+
+  const size_t N = m_nodes.size();
+  std::vector<bool> collapsed(N, false), removed(N, false);
+  std::vector<WordValue> weights(N, 0);
+  std::vector<WordId> words;
+
+  // breadth first, nodes of level L and the leaves above them are kept
+  std::vector<NodeId> order(1, 0);
+  std::vector<int> level(N, 0);
+  for(size_t i = 0; i < order.size(); ++i)
+  {
+    const NodeId nid = order[i];
+    const Node &node = m_nodes[nid];
+    if(level[nid] == L)
+    {
+      if(!node.isLeaf())
+      {
+        collapsed[nid] = true;
+        getWordsFromNode(nid, words);
+        weights[nid] = mergedWeight(words);
+      }
+      continue;
+    }
+
+    for(size_t j = 0; j < node.children.size(); ++j)
+    {
+      level[node.children[j]] = level[nid] + 1;
+      order.push_back(node.children[j]);
+    }
+  }
+
+  m_L = L;
+  return rebuildTree(collapsed, weights, removed);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+int TemplatedVocabulary<TDescriptor,F>::pruneBranches(int k)
+{
+  if(m_nodes.empty() || k < 1 || k >= m_k) return 0;
+
+  const size_t N = m_nodes.size();
+  std::vector<NodeId> order(1, 0);
+  for(size_t i = 0; i < order.size(); ++i)
+  {
+    const vector<NodeId> &children = m_nodes[order[i]].children;
+    order.insert(order.end(), children.begin(), children.end());
+  }
+
+  // fraction of the training images where any word below a node is present,
+  // as in mergedWeight, children before their parents
+  std::vector<double> frequency(N, 0);
+  for(size_t i = order.size(); i-- > 0; )
+  {
+    const Node &node = m_nodes[order[i]];
+    if(node.isLeaf())
+      frequency[node.id] = std::exp(-node.weight);
+    for(size_t j = 0; j < node.children.size(); ++j)
+      frequency[node.id] += frequency[node.children[j]];
+  }
+
+  std::vector<bool> collapsed(N, false), removed(N, false);
+  std::vector<WordValue> weights(N, 0);
+  std::vector<std::pair<double, NodeId> > children;
+  for(size_t i = 0; i < N; ++i)
+  {
+    const Node &node = m_nodes[i];
+    if((int)node.children.size() <= k) continue;
+
+    children.clear();
+    for(size_t j = 0; j < node.children.size(); ++j)
+      children.push_back(std::make_pair(-frequency[node.children[j]],
+        node.children[j]));
+    std::sort(children.begin(), children.end());
+
+    for(size_t j = k; j < children.size(); ++j)
+      removed[children[j].second] = true;
+  }
+
+  m_k = k;
+  return rebuildTree(collapsed, weights, removed);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+int TemplatedVocabulary<TDescriptor,F>::mergeWords(
+  const std::vector<unsigned int> &usage, unsigned int minUsage)
+{
+  if(m_nodes.empty() || usage.size() != m_words.size()) return 0;
+
+  const size_t N = m_nodes.size();
+  std::vector<NodeId> order(1, 0);
+  for(size_t i = 0; i < order.size(); ++i)
+  {
+    const vector<NodeId> &children = m_nodes[order[i]].children;
+    order.insert(order.end(), children.begin(), children.end());
+  }
+
+  std::vector<bool> collapsed(N, false), removed(N, false);
+  std::vector<WordValue> weights(N, 0);
+  std::vector<uint64_t> count(N, 0);
+  std::vector<WordId> words;
+
+  // children before their parents, the children of the root stay
+  for(size_t i = order.size(); i-- > 1; )
+  {
+    const Node &node = m_nodes[order[i]];
+    if(node.isLeaf())
+    {
+      count[node.id] = usage[node.word_id];
+      continue;
+    }
+
+    bool leaves = true;
+    for(size_t j = 0; j < node.children.size(); ++j)
+    {
+      const NodeId child = node.children[j];
+      count[node.id] += count[child];
+      leaves = leaves && (m_nodes[child].isLeaf() || collapsed[child]);
+    }
+
+    if(leaves && count[node.id] < minUsage)
+    {
+      collapsed[node.id] = true;
+      getWordsFromNode(node.id, words);
+      weights[node.id] = mergedWeight(words);
+    }
+  }
+
+  return rebuildTree(collapsed, weights, removed);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+WordValue TemplatedVocabulary<TDescriptor,F>::mergedWeight(
+  const std::vector<WordId> &words) const
+{
+  if(words.empty()) return 0;
+
+  if(m_weighting == TF || m_weighting == BINARY)
+  {
+    // 1, unless all the words are stopped
+    WordValue w = 0;
+    for(size_t i = 0; i < words.size(); ++i)
+      w = std::max(w, m_words[words[i]]->weight);
+    return w;
+  }
+
+  // idf = -log(Ni/N), the images of the merged word are at most the sum of
+  // those of its words
+  double f = 0;
+  for(size_t i = 0; i < words.size(); ++i)
+    f += std::exp(-m_words[words[i]]->weight);
+
+  return f >= 1 ? 0 : -std::log(f);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+int TemplatedVocabulary<TDescriptor,F>::rebuildTree(
+  const std::vector<bool> &collapsed, const std::vector<WordValue> &weights,
+  const std::vector<bool> &removed)
+{
+  const size_t nWords = m_words.size();
+
+  std::vector<Node> nodes;
+  nodes.reserve(m_nodes.size());
+  nodes.push_back(m_nodes[0]);
+  nodes[0].children.clear();
+
+  // breadth first from the root, old ids of the new nodes
+  std::vector<NodeId> order(1, 0);
+  for(size_t i = 0; i < order.size(); ++i)
+  {
+    const NodeId nid = order[i];
+    if(collapsed[nid])
+    {
+      nodes[i].weight = weights[nid];
+      continue;
+    }
+
+    const vector<NodeId> &children = m_nodes[nid].children;
+    for(size_t j = 0; j < children.size(); ++j)
+    {
+      if(removed[children[j]]) continue;
+
+      Node child = m_nodes[children[j]];
+      child.id = nodes.size();
+      child.parent = i;
+      child.children.clear();
+      nodes[i].children.push_back(child.id);
+      nodes.push_back(child);
+      order.push_back(children[j]);
+    }
+  }
+
+  m_nodes.swap(nodes);
+  createWords();
+  createFlatTree();
+
+  return (int)(nWords - m_words.size());
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &filename)
 {
@@ -1345,6 +2152,7 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
 
     m_words.clear();
     m_nodes.clear();
+    m_mapping.reset();
 
     string s;
     getline(f,s);
@@ -1419,6 +2227,8 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
         }
     }
 
+    createFlatTree();
+
     return true;
 
 }
@@ -1450,6 +2260,367 @@ void TemplatedVocabulary<TDescriptor,F>::saveToTextFile(const std::string &filen
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::isBinaryFile(const std::string &filename)
+{
+    ifstream f(filename.c_str(), ios_base::in | ios_base::binary);
+    if(!f.is_open())
+        return false;
+
+    char magic[8];
+    f.read(magic, sizeof(magic));
+
+    return f.gcount() == sizeof(magic) && memcmp(magic, binaryMagic(), sizeof(magic)) == 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::createSharedMemory(const std::string &name) const
+{
+    if(m_nodes.empty() || m_flat == NULL)
+        return false;
+
+    const uint64_t align = 64;
+    SharedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, sharedMagic(), sizeof(header.magic));
+    header.version = kSharedVersion;
+    header.k = m_k;
+    header.L = m_L;
+    header.scoring = m_scoring;
+    header.weighting = m_weighting;
+    header.featureLevelsUp = m_levelsup;
+    header.nodes = m_flat_nodes.size();
+    header.words = m_flat_words;
+    header.maxChildren = m_flat_offsets.size();
+    header.descriptorBytes = F::L;
+    header.flatNodeBytes = sizeof(FlatNode);
+    header.nodesOffset = (sizeof(header) + align-1) / align * align;
+    header.descriptorsOffset = (header.nodesOffset + (uint64_t)header.nodes*sizeof(FlatNode) + align-1) / align * align;
+    header.size = header.descriptorsOffset + (uint64_t)header.nodes*F::L;
+
+    // only one process creates the segment, the others find it
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0)
+        return false;
+
+    if(ftruncate(fd, header.size) != 0)
+    {
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    void* pMap = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(pMap == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    unsigned char* data = static_cast<unsigned char*>(pMap);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + header.nodesOffset, m_flat, (size_t)header.nodes*sizeof(FlatNode));
+    memcpy(data + header.descriptorsOffset, m_flat_desc, (size_t)header.nodes*F::L);
+
+    // the readers check ready before anything else
+    std::atomic_thread_fence(std::memory_order_release);
+    reinterpret_cast<SharedHeader*>(data)->ready = 1;
+
+    munmap(pMap, header.size);
+    return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::attachSharedMemory(const std::string &name)
+{
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SharedHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = st.st_size;
+    void* pMap = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(pMap == MAP_FAILED)
+        return false;
+
+    std::shared_ptr<const unsigned char> mapping(static_cast<const unsigned char*>(pMap),
+        [size](const unsigned char* p){ munmap(const_cast<unsigned char*>(p), size); });
+
+    const unsigned char* data = mapping.get();
+    SharedHeader header;
+    memcpy(&header, data, sizeof(header));
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    const uint64_t N = header.nodes;
+    if(memcmp(header.magic, sharedMagic(), sizeof(header.magic)) != 0 || header.ready != 1 ||
+       header.version != kSharedVersion || header.descriptorBytes != (uint32_t)F::L ||
+       header.flatNodeBytes != sizeof(FlatNode) || N == 0 || header.words > N ||
+       header.maxChildren == 0 || header.size > size ||
+       header.nodesOffset + N*sizeof(FlatNode) > size ||
+       header.descriptorsOffset + N*F::L > size)
+    {
+        return false;
+    }
+
+    // the children of every node must be after it in the segment and the words
+    // must have valid ids, transform trusts them
+    const FlatNode* flat = reinterpret_cast<const FlatNode*>(data + header.nodesOffset);
+    for(uint64_t i = 0; i < N; ++i)
+    {
+        const FlatNode &node = flat[i];
+        if(node.n_children > header.maxChildren ||
+           (node.n_children > 0 && (node.first_child <= i || (uint64_t)node.first_child + node.n_children > N)) ||
+           (node.n_children == 0 && (i == 0 || node.word_id >= header.words)))
+        {
+            std::cerr << "Vocabulary loading failure: Corrupt shared memory segment!" << endl;
+            return false;
+        }
+    }
+
+    m_nodes.clear();
+    m_words.clear();
+    m_flat_nodes.clear();
+    m_flat_descriptors.clear();
+
+    m_k = header.k;
+    m_L = header.L;
+    m_scoring = (ScoringType)header.scoring;
+    m_weighting = (WeightingType)header.weighting;
+    m_levelsup = header.featureLevelsUp;
+    createScoringObject();
+
+    m_flat = flat;
+    m_flat_desc = data + header.descriptorsOffset;
+    m_flat_words = header.words;
+    m_flat_offsets.resize(header.maxChildren);
+    for(size_t i = 0; i < m_flat_offsets.size(); ++i)
+        m_flat_offsets[i] = i;
+
+    m_mapping = mapping;
+
+    return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::removeSharedMemory(const std::string &name)
+{
+    return shm_unlink(name.c_str()) == 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::saveToBinaryFile(const std::string &filename,
+  bool quantizeWeights) const
+{
+    if(m_nodes.empty())
+        return false;
+
+    fstream f;
+    f.open(filename.c_str(),ios_base::out | ios_base::binary | ios_base::trunc);
+    if(!f.is_open())
+        return false;
+
+    const uint32_t N = m_nodes.size();
+
+    // sections are 64 byte aligned, so the mapped descriptors are aligned for SIMD loads
+    const uint64_t align = 64;
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, binaryMagic(), sizeof(header.magic));
+    header.version = kBinaryVersion;
+    header.k = m_k;
+    header.L = m_L;
+    header.scoring = m_scoring;
+    header.weighting = m_weighting;
+    header.nodes = N;
+    header.words = m_words.size();
+    header.descriptorBytes = F::L;
+    header.weightBytes = quantizeWeights ? sizeof(uint16_t) : sizeof(double);
+    header.featureLevelsUp = m_levelsup;
+    header.weightScale = 0;
+    for(size_t i=0; i<N; i++)
+        header.weightScale = std::max(header.weightScale, m_nodes[i].weight);
+    header.parentsOffset = (sizeof(header) + align-1) / align * align;
+    header.wordIdsOffset = (header.parentsOffset + N*sizeof(uint32_t) + align-1) / align * align;
+    header.weightsOffset = (header.wordIdsOffset + N*sizeof(int32_t) + align-1) / align * align;
+    header.descriptorsOffset = (header.weightsOffset + N*header.weightBytes + align-1) / align * align;
+
+    vector<uint32_t> parents(N, 0);
+    vector<int32_t> wordIds(N, -1);
+    vector<double> weights(N, 0);
+    vector<uint16_t> quantized(quantizeWeights ? N : 0, 0);
+    vector<unsigned char> descriptors((size_t)N*F::L, 0);
+
+    for(size_t i=0; i<N; i++)
+    {
+        const Node& node = m_nodes[i];
+        parents[i] = node.parent;
+        weights[i] = node.weight;
+        if(quantizeWeights && header.weightScale > 0)
+            quantized[i] = (uint16_t)(node.weight / header.weightScale * 65535 + 0.5);
+        if(i>0 && node.isLeaf())
+            wordIds[i] = node.word_id;
+        if(!node.descriptor.empty())
+            F::toArray(node.descriptor, &descriptors[i*F::L]);
+    }
+
+    const char zeros[64] = {0};
+    uint64_t pos = 0;
+    // writes data after padding the file up to the given offset
+    auto writeAt = [&](uint64_t offset, const void* data, size_t bytes)
+    {
+        f.write(zeros, offset-pos);
+        f.write(static_cast<const char*>(data), bytes);
+        pos = offset + bytes;
+    };
+
+    writeAt(0, &header, sizeof(header));
+    writeAt(header.parentsOffset, parents.data(), parents.size()*sizeof(uint32_t));
+    writeAt(header.wordIdsOffset, wordIds.data(), wordIds.size()*sizeof(int32_t));
+    if(quantizeWeights)
+        writeAt(header.weightsOffset, quantized.data(), quantized.size()*sizeof(uint16_t));
+    else
+        writeAt(header.weightsOffset, weights.data(), weights.size()*sizeof(double));
+    writeAt(header.descriptorsOffset, descriptors.data(), descriptors.size());
+
+    f.close();
+    return !f.fail();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::loadFromBinaryFile(const std::string &filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BinaryHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = st.st_size;
+    void* pMap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(pMap == MAP_FAILED)
+        return false;
+
+    std::shared_ptr<const unsigned char> mapping(static_cast<const unsigned char*>(pMap),
+        [size](const unsigned char* p){ munmap(const_cast<unsigned char*>(p), size); });
+
+    const unsigned char* data = mapping.get();
+    BinaryHeader header;
+    memcpy(&header, data, sizeof(header));
+
+    if(header.version == 1)
+    {
+        header.weightBytes = sizeof(double);
+        header.featureLevelsUp = -1;
+    }
+
+    const uint64_t N = header.nodes;
+    if(memcmp(header.magic, binaryMagic(), sizeof(header.magic)) != 0 ||
+       header.version < 1 || header.version > kBinaryVersion ||
+       header.descriptorBytes != (uint32_t)F::L ||
+       (header.weightBytes != sizeof(double) && header.weightBytes != sizeof(uint16_t)) ||
+       N == 0 || header.words > N ||
+       header.parentsOffset + N*sizeof(uint32_t) > size ||
+       header.wordIdsOffset + N*sizeof(int32_t) > size ||
+       header.weightsOffset + N*header.weightBytes > size ||
+       header.descriptorsOffset + N*F::L > size)
+    {
+        std::cerr << "Vocabulary loading failure: This is not a correct binary file!" << endl;
+        return false;
+    }
+
+    const uint32_t* parents = reinterpret_cast<const uint32_t*>(data + header.parentsOffset);
+    const int32_t* wordIds = reinterpret_cast<const int32_t*>(data + header.wordIdsOffset);
+    const double* weights = reinterpret_cast<const double*>(data + header.weightsOffset);
+    const uint16_t* quantized = reinterpret_cast<const uint16_t*>(data + header.weightsOffset);
+    const bool bQuantized = header.weightBytes == sizeof(uint16_t);
+    const unsigned char* descriptors = data + header.descriptorsOffset;
+
+    m_words.clear();
+    m_nodes.clear();
+
+    m_k = header.k;
+    m_L = header.L;
+    m_scoring = (ScoringType)header.scoring;
+    m_weighting = (WeightingType)header.weighting;
+    m_levelsup = header.featureLevelsUp;
+    createScoringObject();
+
+    // count the children first, so every child list is allocated only once
+    vector<uint32_t> nChildren(N, 0);
+    for(size_t i=1; i<N; i++)
+    {
+        if(parents[i] >= N)
+        {
+            std::cerr << "Vocabulary loading failure: Corrupt binary file!" << endl;
+            m_nodes.clear();
+            return false;
+        }
+        nChildren[parents[i]]++;
+    }
+
+    m_nodes.resize(N);
+    m_words.resize(header.words, NULL);
+    for(size_t i=0; i<N; i++)
+    {
+        Node& node = m_nodes[i];
+        node.id = i;
+        node.weight = bQuantized ? quantized[i] * (header.weightScale / 65535) : weights[i];
+        node.children.reserve(nChildren[i]);
+
+        if(i == 0)
+            continue;
+
+        node.parent = parents[i];
+        m_nodes[node.parent].children.push_back(i);
+        F::fromArray(node.descriptor, descriptors + i*F::L);
+
+        if(wordIds[i] >= 0)
+        {
+            if(wordIds[i] >= (int32_t)header.words)
+            {
+                std::cerr << "Vocabulary loading failure: Corrupt binary file!" << endl;
+                m_nodes.clear();
+                m_words.clear();
+                return false;
+            }
+            node.word_id = wordIds[i];
+            m_words[node.word_id] = &node;
+        }
+    }
+
+    m_mapping = mapping;
+
+    createFlatTree();
+
+    return true;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::save(const std::string &filename) const
 {
@@ -1575,6 +2746,7 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
 {
   m_words.clear();
   m_nodes.clear();
+  m_mapping.reset();
   
   cv::FileNode fvoc = fs[name];
   
@@ -1619,6 +2791,8 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
     m_nodes[nid].word_id = wid;
     m_words[wid] = &m_nodes[nid];
   }
+
+  createFlatTree();
 }
 
 // --------------------------------------------------------------------------
@@ -108,6 +108,12 @@ namespace g2o {
       JacobianXiOplusType _jacobianOplusXi;
       JacobianXjOplusType _jacobianOplusXj;
 
+#ifdef G2O_OPENMP
+      //! lock both vertices, always in the same order to avoid a deadlock between two edges connecting them the other way round
+      void lockVertices();
+      void unlockVertices();
+#endif
+
     public:
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
   };
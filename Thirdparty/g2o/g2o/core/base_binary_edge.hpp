@@ -67,8 +67,7 @@ void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::constructQuadraticForm()
 
   if (fromNotFixed || toNotFixed) {
 #ifdef G2O_OPENMP
-    from->lockQuadraticForm();
-    to->lockQuadraticForm();
+    lockVertices();
 #endif
     const InformationType& omega = _information;
     Matrix<double, D, 1> omega_r = - omega * _error;
@@ -113,8 +112,7 @@ void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::constructQuadraticForm()
       }
     }
 #ifdef G2O_OPENMP
-    to->unlockQuadraticForm();
-    from->unlockQuadraticForm();
+    unlockVertices();
 #endif
   }
 }
@@ -140,8 +138,7 @@ void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::linearizeOplus()
     return;
 
 #ifdef G2O_OPENMP
-  vi->lockQuadraticForm();
-  vj->lockQuadraticForm();
+  lockVertices();
 #endif
 
   const double delta = 1e-9;
@@ -199,8 +196,7 @@ void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::linearizeOplus()
 
   _error = errorBeforeNumeric;
 #ifdef G2O_OPENMP
-  vj->unlockQuadraticForm();
-  vi->unlockQuadraticForm();
+  unlockVertices();
 #endif
 }
 
@@ -216,3 +212,26 @@ void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::mapHessianMemory(double*
   }
   _hessianRowMajor = rowMajor;
 }
+
+#ifdef G2O_OPENMP
+template <int D, typename E, typename VertexXiType, typename VertexXjType>
+void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::lockVertices()
+{
+  OptimizableGraph::Vertex* vi = static_cast<OptimizableGraph::Vertex*>(_vertices[0]);
+  OptimizableGraph::Vertex* vj = static_cast<OptimizableGraph::Vertex*>(_vertices[1]);
+  if (vi < vj) {
+    vi->lockQuadraticForm();
+    vj->lockQuadraticForm();
+  } else {
+    vj->lockQuadraticForm();
+    vi->lockQuadraticForm();
+  }
+}
+
+template <int D, typename E, typename VertexXiType, typename VertexXjType>
+void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::unlockVertices()
+{
+  static_cast<OptimizableGraph::Vertex*>(_vertices[0])->unlockQuadraticForm();
+  static_cast<OptimizableGraph::Vertex*>(_vertices[1])->unlockQuadraticForm();
+}
+#endif
@@ -0,0 +1,84 @@
+#include "object_pool.h"
+
+#include <algorithm>
+#include <new>
+
+#include <Eigen/Core>
+
+namespace g2o {
+
+namespace {
+#ifdef EIGEN_MAX_ALIGN_BYTES
+  const size_t kBlockAlignment = EIGEN_MAX_ALIGN_BYTES > 16 ? EIGEN_MAX_ALIGN_BYTES : 16;
+#else
+  const size_t kBlockAlignment = 16;
+#endif
+  //! bytes of a chunk, at least one block
+  const size_t kChunkBytes = 64*1024;
+}
+
+ObjectPool::ObjectPool(size_t objectSize) :
+  _objectSize(objectSize),
+  _blockSize((std::max(objectSize, sizeof(FreeBlock)) + kBlockAlignment - 1) / kBlockAlignment * kBlockAlignment),
+  _blocksPerChunk(std::max<size_t>(kChunkBytes / _blockSize, 1)),
+  _freeList(0), _chunkPos(0), _chunkRemaining(0), _allocated(0)
+{
+}
+
+void* ObjectPool::allocate(size_t size)
+{
+  if (size != _objectSize)
+    return Eigen::internal::aligned_malloc(size);
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  _allocated++;
+  if (_freeList) {
+    FreeBlock* block = _freeList;
+    _freeList = block->next;
+    return block;
+  }
+
+  if (_chunkRemaining == 0) {
+    // throws std::bad_alloc as a plain new does
+    void* chunk = ::operator new(_blockSize * _blocksPerChunk + kBlockAlignment);
+    _chunks.push_back(chunk);
+    const size_t offset = reinterpret_cast<size_t>(chunk) % kBlockAlignment;
+    _chunkPos = static_cast<char*>(chunk) + (offset ? kBlockAlignment - offset : 0);
+    _chunkRemaining = _blocksPerChunk;
+  }
+
+  void* p = _chunkPos;
+  _chunkPos += _blockSize;
+  _chunkRemaining--;
+  return p;
+}
+
+void ObjectPool::deallocate(void* p, size_t size)
+{
+  if (!p)
+    return;
+  if (size != _objectSize) {
+    Eigen::internal::aligned_free(p);
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  FreeBlock* block = static_cast<FreeBlock*>(p);
+  block->next = _freeList;
+  _freeList = block;
+  _allocated--;
+}
+
+size_t ObjectPool::numAllocated()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  return _allocated;
+}
+
+size_t ObjectPool::capacity()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  return _chunks.size() * _blocksPerChunk;
+}
+
+} // end namespace
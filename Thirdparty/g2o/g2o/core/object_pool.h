@@ -0,0 +1,75 @@
+#ifndef G2O_OBJECT_POOL_H
+#define G2O_OBJECT_POOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace g2o {
+
+/**
+ * \brief fixed size blocks for the vertices, edges and robust kernels of one type
+ *
+ * The blocks are cut from chunks which are never given back, a freed block goes to a free list
+ * and is handed out to the next object of the type. Building and clearing graphs over and over
+ * hence no longer goes to the system allocator once the largest graph was seen. Every block is
+ * aligned for the fixed size Eigen members. Objects of a derived type reaching the pool of their
+ * base (they are larger) get plain aligned memory. Thread safe.
+ */
+class ObjectPool
+{
+  public:
+    ObjectPool(size_t objectSize);
+
+    void* allocate(size_t size);
+    void deallocate(void* p, size_t size);
+
+    //! number of blocks handed out and not freed yet
+    size_t numAllocated();
+    //! number of blocks in all chunks
+    size_t capacity();
+
+    //! the pool of the type T, never destroyed: graphs may still be cleared during static destruction
+    template <typename T>
+    static ObjectPool& of()
+    {
+      static ObjectPool* pool = new ObjectPool(sizeof(T));
+      return *pool;
+    }
+
+  protected:
+    struct FreeBlock
+    {
+      FreeBlock* next;
+    };
+
+    size_t _objectSize;
+    size_t _blockSize;
+    size_t _blocksPerChunk;
+
+    FreeBlock* _freeList;
+    //! blocks of the newest chunk which were not handed out yet
+    char* _chunkPos;
+    size_t _chunkRemaining;
+
+    std::vector<void*> _chunks;
+    size_t _allocated;
+
+    std::mutex _mutex;
+};
+
+} // end namespace
+
+/**
+ * Class operators new and delete of Type from its ObjectPool, in place of
+ * EIGEN_MAKE_ALIGNED_OPERATOR_NEW (the blocks are aligned the same).
+ * HyperGraph::clear deletes through the virtual destructors, which gives the pool of the
+ * dynamic type and its size.
+ */
+#define G2O_MAKE_POOLED_OPERATOR_NEW(Type) \
+  static void* operator new(std::size_t size) { return g2o::ObjectPool::of<Type>().allocate(size); } \
+  static void operator delete(void* p, std::size_t size) { g2o::ObjectPool::of<Type>().deallocate(p, size); } \
+  static void* operator new(std::size_t, void* p) { return p; } \
+  static void operator delete(void*, void*) {}
+
+#endif
@@ -28,6 +28,7 @@
 #define G2O_ROBUST_KERNEL_IMPL_H
 
 #include "robust_kernel.h"
+#include "object_pool.h"
 
 namespace g2o {
 
@@ -76,6 +77,8 @@ namespace g2o {
   class  RobustKernelHuber : public RobustKernel
   {
     public:
+      G2O_MAKE_POOLED_OPERATOR_NEW(RobustKernelHuber)
+
       virtual void setDelta(double delta);
       virtual void setDeltaSqr(const double &delta, const double &deltaSqr);
       virtual void robustify(double e2, Eigen::Vector3d& rho) const;
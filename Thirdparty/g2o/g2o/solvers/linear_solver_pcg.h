@@ -0,0 +1,170 @@
+#ifndef G2O_LINEAR_SOLVER_PCG_H
+#define G2O_LINEAR_SOLVER_PCG_H
+
+#include <Eigen/Core>
+#include <Eigen/LU>
+
+#include "../core/linear_solver.h"
+#include "../core/batch_stats.h"
+#include "../stuff/timeutil.h"
+
+#include "../core/eigen_types.h"
+
+#include <vector>
+#include <utility>
+
+namespace g2o {
+
+/**
+ * \brief linear solver using the preconditioned conjugate gradient, preconditioned with the block Jacobi
+ *
+ * Needs no factorization, only products with A, hence its memory stays linear in the number of
+ * non-zero blocks and it is faster than the Cholesky solvers on very large, well connected systems.
+ * The solution is approximate, up to the relative residual given by setTolerance.
+ */
+template <typename MatrixType>
+class LinearSolverPCG: public LinearSolver<MatrixType>
+{
+  public:
+    LinearSolverPCG() :
+      LinearSolver<MatrixType>(),
+      _init(true), _tolerance(1e-6), _maxIterations(-1)
+    {
+    }
+
+    virtual ~LinearSolverPCG()
+    {
+    }
+
+    virtual bool init()
+    {
+      _init = true;
+      return true;
+    }
+
+    bool solve(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+      double t=get_monotonic_time();
+      const int n = A.rows();
+      if (_init) // the pattern is the same in all the iterations
+        collectBlocks(A);
+      _init = false;
+
+      // block Jacobi preconditioner
+      for (size_t i = 0; i < _diagonal.size(); ++i)
+        _diagonalInverse[i] = _diagonal[i].second->inverse();
+
+      VectorXD::MapType xx(x, n);
+      VectorXD::ConstMapType bb(b, n);
+      xx.setZero();
+
+      VectorXD r = bb;
+      VectorXD z(n), p(n), q(n);
+      applyPreconditioner(r, z);
+      p = z;
+      double rz = r.dot(z);
+      const double r0 = r.squaredNorm();
+      const double threshold = _tolerance * _tolerance * r0;
+      const int maxIterations = _maxIterations > 0 ? _maxIterations : n;
+
+      int iteration = 0;
+      for (; iteration < maxIterations && r.squaredNorm() > threshold; ++iteration) {
+        multiply(p, q);
+        const double pq = p.dot(q);
+        if (pq <= 0.) // A is not positive definite along p
+          break;
+        const double alpha = rz / pq;
+        xx += alpha * p;
+        r -= alpha * q;
+        applyPreconditioner(r, z);
+        const double rzNew = r.dot(z);
+        p = z + (rzNew / rz) * p;
+        rz = rzNew;
+      }
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats) {
+        globalStats->timeNumericDecomposition = get_monotonic_time() - t;
+        globalStats->iterationsLinearSolver = iteration;
+      }
+
+      return xx.allFinite();
+    }
+
+    //! relative residual at which the iteration stops
+    double tolerance() const { return _tolerance;}
+    void setTolerance(double tolerance) { _tolerance = tolerance;}
+
+    //! maximum number of iterations, -1 for the dimension of the system
+    int maxIterations() const { return _maxIterations;}
+    void setMaxIterations(int maxIterations) { _maxIterations = maxIterations;}
+
+  protected:
+    typedef std::pair<int, const MatrixType*> BaseBlock;
+
+    //! a stored block of the upper triangle with the bases of its row and column
+    struct OffDiagonalBlock
+    {
+      int rowBase;
+      int colBase;
+      const MatrixType* block;
+    };
+
+    bool _init;
+    double _tolerance;
+    int _maxIterations;
+
+    std::vector<BaseBlock> _diagonal;
+    std::vector<MatrixType, Eigen::aligned_allocator<MatrixType> > _diagonalInverse;
+    std::vector<OffDiagonalBlock> _offDiagonal;
+
+    void collectBlocks(const SparseBlockMatrix<MatrixType>& A)
+    {
+      _diagonal.clear();
+      _offDiagonal.clear();
+      for (size_t c = 0; c < A.blockCols().size(); ++c) {
+        const int colBase = A.colBaseOfBlock(c);
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first == static_cast<int>(c)) {
+            _diagonal.push_back(BaseBlock(colBase, it->second));
+          } else if (it->first < static_cast<int>(c)) {
+            OffDiagonalBlock block;
+            block.rowBase = A.rowBaseOfBlock(it->first);
+            block.colBase = colBase;
+            block.block = it->second;
+            _offDiagonal.push_back(block);
+          }
+        }
+      }
+      _diagonalInverse.resize(_diagonal.size());
+    }
+
+    //! q = A p, A is symmetric and only its upper triangle is stored
+    void multiply(const VectorXD& p, VectorXD& q) const
+    {
+      q.setZero();
+      for (size_t i = 0; i < _diagonal.size(); ++i) {
+        const MatrixType& m = *_diagonal[i].second;
+        q.segment(_diagonal[i].first, m.rows()).noalias() += m * p.segment(_diagonal[i].first, m.cols());
+      }
+      for (size_t i = 0; i < _offDiagonal.size(); ++i) {
+        const OffDiagonalBlock& b = _offDiagonal[i];
+        const MatrixType& m = *b.block;
+        q.segment(b.rowBase, m.rows()).noalias() += m * p.segment(b.colBase, m.cols());
+        q.segment(b.colBase, m.cols()).noalias() += m.transpose() * p.segment(b.rowBase, m.rows());
+      }
+    }
+
+    void applyPreconditioner(const VectorXD& r, VectorXD& z) const
+    {
+      for (size_t i = 0; i < _diagonal.size(); ++i) {
+        const MatrixType& m = _diagonalInverse[i];
+        z.segment(_diagonal[i].first, m.rows()).noalias() = m * r.segment(_diagonal[i].first, m.cols());
+      }
+    }
+};
+
+} // end namespace
+
+#endif
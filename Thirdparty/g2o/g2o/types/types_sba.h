@@ -28,6 +28,7 @@
 #define G2O_SBA_TYPES
 
 #include "../core/base_vertex.h"
+#include "../core/object_pool.h"
 
 #include <Eigen/Geometry>
 #include <iostream>
@@ -40,7 +41,7 @@ namespace g2o {
  class VertexSBAPointXYZ : public BaseVertex<3, Vector3d>
 {
   public:
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW    
+    G2O_MAKE_POOLED_OPERATOR_NEW(VertexSBAPointXYZ)
     VertexSBAPointXYZ();
     virtual bool read(std::istream& is);
     virtual bool write(std::ostream& os) const;
@@ -138,6 +138,43 @@ void EdgeSE3ProjectXYZ::linearizeOplus() {
   _jacobianOplusXj(1,5) = y/z_2 *fy;
 }
 
+EdgeSE3ProjectXYZRig::EdgeSE3ProjectXYZRig() : EdgeSE3ProjectXYZ() {
+}
+
+void EdgeSE3ProjectXYZRig::linearizeOplus() {
+  VertexSE3Expmap * vj = static_cast<VertexSE3Expmap *>(_vertices[1]);
+  SE3Quat T(vj->estimate());
+  VertexSBAPointXYZ* vi = static_cast<VertexSBAPointXYZ*>(_vertices[0]);
+  Vector3d xyz = vi->estimate();
+  Vector3d xyz_rig = T.map(xyz);
+  Vector3d xyz_trans = Tcr.map(xyz_rig);
+
+  double x = xyz_trans[0];
+  double y = xyz_trans[1];
+  double z = xyz_trans[2];
+
+  Matrix<double,2,3> tmp;
+  tmp(0,0) = fx;
+  tmp(0,1) = 0;
+  tmp(0,2) = -x/z*fx;
+
+  tmp(1,0) = 0;
+  tmp(1,1) = fy;
+  tmp(1,2) = -y/z*fy;
+
+  // The update of the pose moves the point in the first camera, seen through Rcr
+  Matrix<double,2,3> tmp_rig = -1./z * tmp * Tcr.rotation().toRotationMatrix();
+
+  _jacobianOplusXi = tmp_rig * T.rotation().toRotationMatrix();
+
+  Matrix3d skew;
+  skew << 0, xyz_rig[2], -xyz_rig[1],
+          -xyz_rig[2], 0, xyz_rig[0],
+          xyz_rig[1], -xyz_rig[0], 0;
+  _jacobianOplusXj.leftCols<3>() = tmp_rig * skew;
+  _jacobianOplusXj.rightCols<3>() = tmp_rig;
+}
+
 Vector2d EdgeSE3ProjectXYZ::cam_project(const Vector3d & trans_xyz) const{
   Vector2d proj = project2d(trans_xyz);
   Vector2d res;
@@ -58,7 +58,7 @@ typedef Matrix<double, 6, 6> Matrix6d;
  */
 class  VertexSE3Expmap : public BaseVertex<6, SE3Quat>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_MAKE_POOLED_OPERATOR_NEW(VertexSE3Expmap)
 
   VertexSE3Expmap();
 
@@ -79,7 +79,7 @@ public:
 
 class  EdgeSE3ProjectXYZ: public  BaseBinaryEdge<2, Vector2d, VertexSBAPointXYZ, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_MAKE_POOLED_OPERATOR_NEW(EdgeSE3ProjectXYZ)
 
   EdgeSE3ProjectXYZ();
 
@@ -109,9 +109,38 @@ public:
 };
 
 
+/**
+ * \brief Observation of another camera of a rig. The pose vertex is the one of the first
+ camera, Tcr takes points from it to the camera of the observation.
+ */
+class  EdgeSE3ProjectXYZRig: public  EdgeSE3ProjectXYZ{
+public:
+  G2O_MAKE_POOLED_OPERATOR_NEW(EdgeSE3ProjectXYZRig)
+
+  EdgeSE3ProjectXYZRig();
+
+  void computeError()  {
+    const VertexSE3Expmap* v1 = static_cast<const VertexSE3Expmap*>(_vertices[1]);
+    const VertexSBAPointXYZ* v2 = static_cast<const VertexSBAPointXYZ*>(_vertices[0]);
+    Vector2d obs(_measurement);
+    _error = obs-cam_project(Tcr.map(v1->estimate().map(v2->estimate())));
+  }
+
+  bool isDepthPositive() {
+    const VertexSE3Expmap* v1 = static_cast<const VertexSE3Expmap*>(_vertices[1]);
+    const VertexSBAPointXYZ* v2 = static_cast<const VertexSBAPointXYZ*>(_vertices[0]);
+    return (Tcr.map(v1->estimate().map(v2->estimate())))(2)>0.0;
+  }
+
+  virtual void linearizeOplus();
+
+  SE3Quat Tcr;
+};
+
+
 class  EdgeStereoSE3ProjectXYZ: public  BaseBinaryEdge<3, Vector3d, VertexSBAPointXYZ, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_MAKE_POOLED_OPERATOR_NEW(EdgeStereoSE3ProjectXYZ)
 
   EdgeStereoSE3ProjectXYZ();
 
@@ -142,7 +171,7 @@ public:
 
 class  EdgeSE3ProjectXYZOnlyPose: public  BaseUnaryEdge<2, Vector2d, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_MAKE_POOLED_OPERATOR_NEW(EdgeSE3ProjectXYZOnlyPose)
 
   EdgeSE3ProjectXYZOnlyPose(){}
 
@@ -173,7 +202,7 @@ public:
 
 class  EdgeStereoSE3ProjectXYZOnlyPose: public  BaseUnaryEdge<3, Vector3d, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_MAKE_POOLED_OPERATOR_NEW(EdgeStereoSE3ProjectXYZOnlyPose)
 
   EdgeStereoSE3ProjectXYZOnlyPose(){}
 
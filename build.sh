@@ -38,3 +38,9 @@ mkdir build
 cd build
 cmake .. -DCMAKE_BUILD_TYPE=Release -DCMAKE_EXPORT_COMPILE_COMMANDS=ON
 make -j
+
+cd ..
+
+echo "Converting vocabulary to binary format ..."
+
+./tools/bin_vocabulary Vocabulary/ORBvoc.txt Vocabulary/ORBvoc.bin
@@ -0,0 +1,78 @@
+#ifndef BOWDISTANCEBATCH_H
+#define BOWDISTANCEBATCH_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include "KeyFrame.h"
+#include "Frame.h"
+
+namespace ORB_SLAM2
+{
+
+// Descriptor distances of the SearchByBoW of one query, a frame or a keyframe, with all its
+// candidate keyframes, the relocalization and loop candidates of the KeyFrameDatabase. The pairs
+// of every vocabulary node the query shares with a candidate are computed in one go, as a list of
+// blocks which the Hamming kernels run one after the other. ORBmatcher::SearchByBoW picks the
+// matches from them as it does from its own distances, with the BowMatchIndex of each candidate
+// taken here, so they are the same as those of a search one candidate after the other.
+class BowDistanceBatch
+{
+public:
+
+    BowDistanceBatch(): mnDistances(0) {}
+
+    // SearchByBoW(vpKFs[i],F) of every candidate
+    void Compute(Frame &F, const std::vector<KeyFrame*> &vpKFs);
+
+    // SearchByBoW(pKF,vpKFs[i]) of every candidate
+    void Compute(KeyFrame* pKF, const std::vector<KeyFrame*> &vpKFs);
+
+    // Index of candidate i the distances are for, NULL for a bad candidate
+    const KeyFrame::BowMatchIndexPtr& GetIndex(const size_t i) const { return mvpIndices[i]; }
+    // The one of the query keyframe
+    const KeyFrame::BowMatchIndexPtr& GetQueryIndex() const { return mpQueryIndex; }
+
+    // Of the nodes shared with the query by increasing id, for each the rows of the node of the
+    // first index times those of the second (the frame features of the node for a frame query),
+    // each row after the other
+    const int* GetDistances(const size_t i) const { return mvDistances.data()+mvnOffsets[i]; }
+
+protected:
+
+    // The distances of the rows a..a+nA times b..b+nB, written from out on
+    struct Block
+    {
+        size_t a, b;
+        unsigned int nA, nB;
+        size_t out;
+    };
+
+    struct QueryNode
+    {
+        DBoW2::NodeId id;
+        unsigned int begin;
+        unsigned int count;
+    };
+
+    // Rows of the index and its blocks with the query nodes
+    void AddCandidate(const BowMatchIndex &index, const bool bQueryFirst);
+
+    void ComputeDistances();
+
+    std::vector<KeyFrame::BowMatchIndexPtr> mvpIndices;
+    KeyFrame::BowMatchIndexPtr mpQueryIndex;
+    std::vector<QueryNode> mvQueryNodes;
+
+    // The query first, then the candidates
+    std::vector<uint8_t> mvRows;
+    std::vector<Block> mvBlocks;
+    size_t mnDistances;
+    std::vector<size_t> mvnOffsets;
+    std::vector<int> mvDistances;
+};
+
+} //namespace ORB_SLAM
+
+#endif // BOWDISTANCEBATCH_H
@@ -0,0 +1,60 @@
+#ifndef BOWMATCHINDEX_H
+#define BOWMATCHINDEX_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "Thirdparty/DBoW2/DBoW2/FeatureVector.h"
+
+namespace ORB_SLAM2
+{
+
+class MapPoint;
+
+// The features of a keyframe which have a MapPoint, grouped by the node of the FeatureVector
+// they fall in. Their descriptors are packed contiguously node after node, so SearchByBoW scans
+// a shared node as one block with the batch kernel of HammingDistance, without going through
+// the features with no MapPoint or copying the matches of the keyframe. Immutable once built,
+// the keyframe shares it until its matches change (KeyFrame::GetBowMatchIndex). The MapPoints
+// may have turned bad since, the searches still check them.
+class BowMatchIndex
+{
+public:
+
+    struct Node
+    {
+        DBoW2::NodeId id;
+        // Entries [begin,end)
+        size_t begin;
+        size_t end;
+    };
+
+    BowMatchIndex(const DBoW2::FeatureVector &featVec, const cv::Mat &descriptors,
+                  const std::vector<MapPoint*> &vpMapPoints);
+
+    size_t Size() const { return mvpMapPoints.size(); }
+
+    const uint8_t* Descriptor(const size_t i) const { return &mvDescriptors[i*DESCRIPTOR_BYTES]; }
+
+    // First node from it on with an id of at least id, as FeatureVector::lower_bound
+    std::vector<Node>::const_iterator LowerBound(std::vector<Node>::const_iterator it, const DBoW2::NodeId id) const;
+
+    size_t GetMemoryUsage() const;
+
+    static const size_t DESCRIPTOR_BYTES = 32;
+
+    // By increasing id, only the nodes with at least one entry
+    std::vector<Node> mvNodes;
+
+    // Per entry: its descriptor, the index of its feature and its MapPoint
+    std::vector<uint8_t> mvDescriptors;
+    std::vector<size_t> mvnFeatures;
+    std::vector<MapPoint*> mvpMapPoints;
+};
+
+} //namespace ORB_SLAM
+
+#endif // BOWMATCHINDEX_H
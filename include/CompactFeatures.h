@@ -0,0 +1,76 @@
+#ifndef COMPACTFEATURES_H
+#define COMPACTFEATURES_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "SharedArray.h"
+
+namespace ORB_SLAM2
+{
+
+// Cold storage of the keypoints, right coordinates and depths of a keyframe which left the
+// local window (LocalMapping.ColdKeyFrames), in about a third of the memory of the full arrays:
+// - coordinates and right coordinates in 16 bit fixed point over the range of the keyframe,
+//   a few hundredths of a pixel apart. Half floats would be a whole pixel apart above 1024.
+// - octave and angle in 8 bit, the angle in steps of 360/256 degrees. The size comes back from
+//   the octave, response and depth are half floats.
+// - the undistorted keypoints only if they differ from the keypoints, the depths only if they
+//   differ from the right coordinates, as the keyframe shares them.
+// Negative right coordinates and depths come back as -1, the class id as -1. Immutable once
+// built, so any thread may read it.
+class CompactFeatures
+{
+public:
+
+    CompactFeatures(const SharedArray<cv::KeyPoint> &vKeys, const SharedArray<cv::KeyPoint> &vKeysUn,
+                    const SharedArray<float> &vuRight, const SharedArray<float> &vDepth);
+
+    // Decodes the arrays, shared between them as they were
+    void Expand(SharedArray<cv::KeyPoint> &vKeys, SharedArray<cv::KeyPoint> &vKeysUn,
+                SharedArray<float> &vuRight, SharedArray<float> &vDepth) const;
+
+    int Octave(const size_t i) const { return mvOctaves[i]; }
+    float Right(const size_t i) const;
+
+    size_t GetMemoryUsage() const;
+
+protected:
+
+    struct Point
+    {
+        uint16_t x;
+        uint16_t y;
+    };
+
+    Point Quantize(const cv::Point2f &pt) const;
+    cv::Point2f Dequantize(const Point &p) const;
+    void Decode(const std::vector<Point> &vPoints, std::vector<cv::KeyPoint> &vKeys) const;
+
+    size_t mN;
+    // Coordinates of step 0 and the size of a step
+    float mfMinX, mfMinY;
+    float mfStepX, mfStepY;
+
+    std::vector<Point> mvKeys;
+    // Empty if the undistorted keypoints are the keypoints
+    std::vector<Point> mvKeysUn;
+    bool mbKeysUnShared;
+    std::vector<uint8_t> mvOctaves;
+    std::vector<uint8_t> mvAngles;
+    std::vector<uint16_t> mvResponses;
+    // Keypoint size by octave
+    std::vector<float> mvOctaveSizes;
+
+    std::vector<uint16_t> mvuRight;
+    // Empty if the depths are the right coordinates
+    std::vector<uint16_t> mvDepth;
+    bool mbDepthShared;
+};
+
+} //namespace ORB_SLAM
+
+#endif // COMPACTFEATURES_H
@@ -37,6 +37,7 @@ public:
 
     static g2o::SE3Quat toSE3Quat(const cv::Mat &cvT);
     static g2o::SE3Quat toSE3Quat(const g2o::Sim3 &gSim3);
+    static g2o::SE3Quat toSE3Quat(const Eigen::Matrix3f &R, const Eigen::Vector3f &t);
 
     static cv::Mat toCvMat(const g2o::SE3Quat &SE3);
     static cv::Mat toCvMat(const g2o::Sim3 &Sim3);
@@ -44,11 +45,18 @@ public:
     static cv::Mat toCvMat(const Eigen::Matrix3d &m);
     static cv::Mat toCvMat(const Eigen::Matrix<double,3,1> &m);
     static cv::Mat toCvSE3(const Eigen::Matrix<double,3,3> &R, const Eigen::Matrix<double,3,1> &t);
+    static cv::Mat toCvMat(const Eigen::Matrix3f &m);
+    static cv::Mat toCvMat(const Eigen::Vector3f &m);
+    static cv::Mat toCvSE3(const Eigen::Matrix3f &R, const Eigen::Vector3f &t);
 
     static Eigen::Matrix<double,3,1> toVector3d(const cv::Mat &cvVector);
     static Eigen::Matrix<double,3,1> toVector3d(const cv::Point3f &cvPoint);
     static Eigen::Matrix<double,3,3> toMatrix3d(const cv::Mat &cvMat3);
 
+    // Fixed-size float types used by Frame, KeyFrame and MapPoint
+    static Eigen::Vector3f toVector3f(const cv::Mat &cvVector);
+    static Eigen::Matrix3f toMatrix3f(const cv::Mat &cvMat3);
+
     static std::vector<float> toQuaternion(const cv::Mat &M);
 };
 
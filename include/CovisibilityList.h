@@ -0,0 +1,153 @@
+#ifndef COVISIBILITYLIST_H
+#define COVISIBILITYLIST_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Covisibility connections of a KeyFrame: the connected keyframes and their weights in two
+// arrays sorted by decreasing weight, ties by decreasing mnId. Traversals read them in order
+// without building anything, the best N are a prefix and the ones over a weight a prefix found
+// by binary search. Changing the weight of one connection moves just that entry to its new
+// place instead of sorting everything again. Lookups by keyframe scan the array, which is
+// faster than a tree for the tens of connections a keyframe has.
+//
+// The weight of a connection is the number of map points both keyframes observe, kept up to
+// date by MapPoint as observations come and go. Only the connections with at least MIN_WEIGHT
+// points are covisible keyframes for the traversals, or the best one if none has that many.
+// These are the first NumOrdered() entries, the rest only count for the weights.
+// Not thread safe, KeyFrame locks around it.
+template<class KF>
+class BasicCovisibilityList
+{
+public:
+
+    static const int MIN_WEIGHT = 15; //param
+
+    size_t size() const { return mvpKeyFrames.size(); }
+    bool empty() const { return mvpKeyFrames.empty(); }
+
+    // All connections, by decreasing weight
+    const std::vector<KF*>& KeyFrames() const { return mvpKeyFrames; }
+    const std::vector<int>& Weights() const { return mvWeights; }
+
+    size_t NumOrdered() const
+    {
+        return std::max(NumAllWithWeight(MIN_WEIGHT), std::min<size_t>(1,size()));
+    }
+
+    // Number of ordered connections with a weight of at least w
+    size_t NumOrderedWithWeight(const int w) const
+    {
+        const std::vector<int>::const_iterator begin = mvWeights.begin();
+        return std::upper_bound(begin, begin+NumOrdered(), w, std::greater<int>()) - begin;
+    }
+
+    int Weight(const KF* pKF) const
+    {
+        const size_t i = IndexOf(pKF);
+        return i<size() ? mvWeights[i] : 0;
+    }
+
+    bool count(const KF* pKF) const { return IndexOf(pKF)<size(); }
+
+    // Adds n to the weight of the connection, which is created if needed and removed when the
+    // weight drops to zero. Returns false if nothing changed.
+    bool Add(KF* pKF, const int n)
+    {
+        size_t i = IndexOf(pKF);
+        if(i<size())
+        {
+            mvWeights[i] += n;
+            if(mvWeights[i]<=0)
+            {
+                mvpKeyFrames.erase(mvpKeyFrames.begin()+i);
+                mvWeights.erase(mvWeights.begin()+i);
+                return true;
+            }
+        }
+        else if(n>0)
+        {
+            mvpKeyFrames.push_back(pKF);
+            mvWeights.push_back(n);
+        }
+        else
+            return false;
+
+        // Only the changed entry is out of place
+        while(i>0 && Before(i,i-1))
+        {
+            Swap(i,i-1);
+            i--;
+        }
+        while(i+1<size() && Before(i+1,i))
+        {
+            Swap(i,i+1);
+            i++;
+        }
+        return true;
+    }
+
+    bool Erase(const KF* pKF)
+    {
+        const size_t i = IndexOf(pKF);
+        if(i>=size())
+            return false;
+
+        mvpKeyFrames.erase(mvpKeyFrames.begin()+i);
+        mvWeights.erase(mvWeights.begin()+i);
+        return true;
+    }
+
+    void clear()
+    {
+        mvpKeyFrames.clear();
+        mvWeights.clear();
+    }
+
+    void swap(BasicCovisibilityList &other)
+    {
+        mvpKeyFrames.swap(other.mvpKeyFrames);
+        mvWeights.swap(other.mvWeights);
+    }
+
+private:
+
+    size_t IndexOf(const KF* pKF) const
+    {
+        return std::find(mvpKeyFrames.begin(), mvpKeyFrames.end(), pKF) - mvpKeyFrames.begin();
+    }
+
+    size_t NumAllWithWeight(const int w) const
+    {
+        return std::upper_bound(mvWeights.begin(), mvWeights.end(), w, std::greater<int>()) - mvWeights.begin();
+    }
+
+    static bool Greater(const std::pair<int,KF*> &a, const std::pair<int,KF*> &b)
+    {
+        return a.first>b.first || (a.first==b.first && a.second->mnId>b.second->mnId);
+    }
+
+    bool Before(const size_t i, const size_t j) const
+    {
+        return Greater(std::make_pair(mvWeights[i],mvpKeyFrames[i]), std::make_pair(mvWeights[j],mvpKeyFrames[j]));
+    }
+
+    void Swap(const size_t i, const size_t j)
+    {
+        std::swap(mvpKeyFrames[i], mvpKeyFrames[j]);
+        std::swap(mvWeights[i], mvWeights[j]);
+    }
+
+    std::vector<KF*> mvpKeyFrames;
+    std::vector<int> mvWeights;
+};
+
+} //namespace ORB_SLAM
+
+#endif // COVISIBILITYLIST_H
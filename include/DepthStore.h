@@ -0,0 +1,91 @@
+#ifndef DEPTHSTORE_H
+#define DEPTHSTORE_H
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Depth images of the RGB-D keyframes (KeyFrameDepth.Retain), for the consumers which densify
+// the map after the fact. Every image is compressed losslessly as 16 bit with RVL (run lengths
+// of the invalid pixels and variable length deltas of the valid ones, a few ms to encode and
+// decode a VGA image and usually a fifth of its size). The compressed images stay in memory up
+// to a budget, over it the oldest keyframes are spilled to a file and read back from it when
+// asked for. Keyed by the mnId of the keyframe, erased with it. Any thread may ask, so all
+// methods lock.
+class DepthStore
+{
+public:
+
+    DepthStore();
+    ~DepthStore();
+
+    // nMaxBytes of compressed images in memory (0: no limit), the rest in spillFile (a
+    // temporary file if empty). Only call while it is empty. False if the file can not be opened.
+    bool Enable(const size_t nMaxBytes, const std::string &spillFile);
+    bool IsEnabled() const { return mbEnabled; }
+
+    // Lossless for 16 bit depth, which is kept in its units (meters*depthMapFactor). Other types
+    // are converted to millimeters.
+    void Insert(const unsigned long nId, const cv::Mat &imDepth, const float depthMapFactor);
+
+    // The depth of the keyframe in meters (CV_32F, 0 where it is invalid). False if it has none.
+    bool Get(const unsigned long nId, cv::Mat &imDepth);
+
+    void Erase(const unsigned long nId);
+    void Clear();
+
+    size_t NumImages();
+    size_t NumSpilled();
+    // Compressed bytes in memory
+    size_t GetMemoryUsage();
+
+    // depth16 (CV_16U) to words, and back into a depth16 of rows x cols. Decode is false on
+    // data which is not of that size.
+    static void Encode(const cv::Mat &depth16, std::vector<uint32_t> &vWords);
+    static bool Decode(const uint32_t* pWords, const size_t nWords, const int rows, const int cols, cv::Mat &depth16);
+
+protected:
+
+    struct Image
+    {
+        int rows;
+        int cols;
+        // Meters per unit of the depth
+        float fScale;
+        // Empty once spilled
+        std::vector<uint32_t> vWords;
+        size_t nWords;
+        bool bSpilled;
+        int64_t nOffset;
+    };
+
+    // Spills the oldest images in memory until the budget holds
+    void Spill();
+
+    bool mbEnabled;
+    size_t mnMaxBytes;
+
+    // By mnId, which is also the age
+    std::map<unsigned long,Image> mImages;
+    // Images with a lower mnId are spilled
+    unsigned long mnFirstResident;
+    size_t mnBytes;
+    size_t mnSpilled;
+
+    FILE* mpSpillFile;
+    int64_t mnSpillEnd;
+
+    std::mutex mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // DEPTHSTORE_H
@@ -0,0 +1,78 @@
+#ifndef DESCRIPTORARENA_H
+#define DESCRIPTORARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Descriptors of the keyframes, one block of contiguous rows per keyframe, cut from large chunks
+// mapped from the system. The chunks are advised to be backed by transparent huge pages, so that
+// streaming the descriptors of many candidate keyframes through the distance kernels misses the
+// TLB less, and their pages are placed on the NUMA node of the thread which copies the first
+// descriptors into them, the tracking. The keyframes only hold the matrix of their block, it
+// is found again from its rows when it is freed. Freed blocks are reused by size, a larger one is split. They
+// are not merged, the blocks of the keyframes of a map are about the same size. Chunks are never
+// given back, like the ones of ObjectPool.
+class DescriptorArena
+{
+public:
+
+    static const uint64_t NO_OFFSET = ~static_cast<uint64_t>(0);
+
+    static const int CHUNK_BITS = 26; //param
+    static const size_t CHUNK_SIZE = static_cast<size_t>(1)<<CHUNK_BITS;
+    static const size_t MAX_CHUNKS = 4096; //param
+
+    // Never destroyed, keyframes may still be deleted during static destruction
+    static DescriptorArena& Global();
+
+    DescriptorArena();
+    ~DescriptorArena() {}
+
+    // Copy of the descriptors in a block of the arena. The matrix does not own its rows, they
+    // are valid until Free. Empty descriptors and more than a chunk are cloned on the heap.
+    cv::Mat Copy(const cv::Mat &descriptors);
+
+    // The block of descriptors returned by Copy, does nothing for rows outside of the arena
+    void Free(const cv::Mat &descriptors);
+
+    // Bytes in blocks handed out and not freed yet
+    size_t GetUsed();
+
+    // Bytes of all chunks
+    size_t GetReserved();
+
+protected:
+
+    uint64_t Allocate(const size_t nBytes);
+
+    uint8_t* Data(const uint64_t nOffset) const
+    {
+        return mvpChunks[nOffset>>CHUNK_BITS].load(std::memory_order_acquire)+(nOffset&(CHUNK_SIZE-1));
+    }
+
+    // Chunks mapped so far, the first mnChunks
+    std::atomic<uint8_t*> mvpChunks[MAX_CHUNKS];
+    size_t mnChunks;
+
+    // Bytes of the newest chunk which have not been handed out yet
+    uint64_t mnChunkPos;
+    size_t mnChunkRemaining;
+
+    // Freed blocks by size
+    std::multimap<size_t, uint64_t> mmFree;
+    size_t mnUsed;
+
+    std::mutex mMutexArena;
+};
+
+} //namespace ORB_SLAM
+
+#endif // DESCRIPTORARENA_H
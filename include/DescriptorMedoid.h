@@ -0,0 +1,52 @@
+#ifndef DESCRIPTORMEDOID_H
+#define DESCRIPTORMEDOID_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// The descriptors of the observations of a map point and their pairwise Hamming distances,
+// kept from one choice of its distinctive descriptor to the next. The descriptor of an
+// observation never changes, so an update only computes the distances of the observations
+// added since the last one (with the batch kernel, against all the others) and drops those of
+// the removed ones. The medoid is the descriptor with the least median distance to the rest,
+// the first one of the order given on a tie, exactly as the full computation chooses it.
+// Not thread safe, the map point updates it under its mMutexFeatures.
+class DescriptorMedoid
+{
+public:
+    // Keyframe id and keypoint index of an observation. Ids are not reused as the addresses of
+    // retired keyframes are, a renumbered keyframe is only computed again.
+    typedef std::pair<long unsigned int,size_t> Key;
+
+    DescriptorMedoid(): mnMedoid(0) {}
+
+    // Brings the set to the observations vKeys, in that order, with their descriptors
+    // vpDescriptors (only read for the keys not in the set yet)
+    void Update(const std::vector<Key> &vKeys, const std::vector<const uint8_t*> &vpDescriptors);
+
+    // Descriptor of the medoid, NULL if the set is empty
+    const uint8_t* GetMedoid() const;
+
+    size_t Size() const { return mvKeys.size(); }
+
+    void Clear();
+
+    size_t GetMemoryUsage() const;
+
+protected:
+    std::vector<Key> mvKeys;
+    // Size()*kDescriptorBytes, in the order of mvKeys
+    std::vector<uint8_t> mvDescriptors;
+    // Size()*Size() distances, row major
+    std::vector<uint16_t> mvDistances;
+    int mnMedoid;
+};
+
+} //namespace ORB_SLAM
+
+#endif // DESCRIPTORMEDOID_H
@@ -0,0 +1,66 @@
+#ifndef ESSENTIALGRAPH_H
+#define ESSENTIALGRAPH_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "Thirdparty/g2o/g2o/core/sparse_optimizer.h"
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+
+// Edges of the essential graph (spanning tree, loop edges and strong covisibility edges) kept
+// from one loop correction to the next, with the optimizer and solver of the pose graph. The
+// edges of a keyframe only change with its connections, so Update derives them again only for
+// the keyframes whose change index moved (KeyFrame::GetChangeIdx), the rest of the map reuses
+// what it had at the last loop. Only used by the loop closing.
+class EssentialGraph
+{
+public:
+    EssentialGraph();
+
+    // Older keyframes a keyframe is linked to, by mnId
+    struct Edges
+    {
+        // Parent and loop edges, always in the graph
+        std::vector<unsigned long> vnTree;
+        // Covisibles of weight at least minFeat which are neither, left out where a loop
+        // connection links the two keyframes already
+        std::vector<unsigned long> vnCovisible;
+
+        unsigned long nChangeIdx;
+        unsigned long nUpdate;
+    };
+
+    // The edges of vpKFs[i] in vpEdges[i], NULL for bad keyframes. Valid up to the next Update.
+    void Update(const std::vector<KeyFrame*> &vpKFs, const int minFeat, std::vector<const Edges*> &vpEdges);
+
+    // Drops everything, the keyframe ids are reused after a reset
+    void Clear();
+
+    // The algorithm is set by the first user and kept with the graph
+    g2o::SparseOptimizer& GetOptimizer() { return mOptimizer; }
+
+    // Keyframes whose edges were derived again by the last Update
+    size_t NumRefreshed() const { return mnRefreshed; }
+
+protected:
+
+    void Derive(KeyFrame* pKF, const int minFeat, Edges &edges);
+
+    g2o::SparseOptimizer mOptimizer;
+
+    // By mnId, a keyframe erased since may be freed and its address reused
+    std::unordered_map<unsigned long, Edges> mmEdges;
+
+    int mnMinFeat;
+    // Incremented on every Update, entries which were not touched left the map
+    unsigned long mnUpdate;
+    size_t mnRefreshed;
+};
+
+} //namespace ORB_SLAM
+
+#endif // ESSENTIALGRAPH_H
@@ -0,0 +1,93 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include "StageTimer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ORB_SLAM2
+{
+
+// Binary log of the events of a session (Logging.EventFile), for tools which would otherwise
+// match the lines of the text log. The records have a fixed size and layout, so a reader maps the
+// whole file as one array (tools/event_log.py). Like the lines of the asynchronous logging, the
+// records are queued in a lock free ring and written by a writer thread, the threads which log
+// never wait for the file. Records which do not fit are dropped and counted.
+//
+// The file starts with the magic "ORBEVLOG", the record size and the number of stages (uint32),
+// then the names of the stages, each terminated by a zero byte. Records follow, little endian.
+class EventLog
+{
+public:
+
+    enum Type
+    {
+        // A tracked image. nValue1: inliers of the pose, nValue2: id of the frame
+        FRAME=0,
+        // An image which was not tracked and got the pose of the motion model
+        SKIPPED=1,
+        INITIALIZED=2,
+        LOST=3,
+        RELOCALIZED=4,
+        // nValue1: id of the keyframe
+        KEYFRAME=5,
+        // Loop corrected, nValue1: current keyframe, nValue2: matched keyframe
+        LOOP=6,
+        // Global BA applied to the map, nValue1: keyframe of the loop which started it
+        GLOBAL_BA=7,
+        RESET=8,
+        // Shutdown
+        DONE=9,
+        // Hash of the settings (Settings::GetHash), nValue1: low 32 bits, nValue2: high 32 bits
+        SETTINGS=10
+    };
+
+    static const int NUM_STAGES = static_cast<int>(Stage::NUM_STAGES);
+
+    struct Record
+    {
+        uint32_t nType;
+        // Tracking state after the image
+        int32_t nState;
+        // Number of the image, the tracked and the skipped ones from 1
+        uint64_t nImage;
+        // Of the image
+        double timestamp;
+        // Seconds since the log was opened
+        double wallTime;
+        uint32_t nValue1;
+        uint32_t nValue2;
+        // FRAME: microseconds each stage took since the last FRAME record, by Stage. Zero
+        // otherwise, and with ORB_SLAM2_NO_STAGE_TIMERS.
+        float vfStageTimes[NUM_STAGES];
+    };
+
+    // Starts writing to filename, nCapacity records can be queued. False if it can't be opened.
+    static bool Open(const std::string &filename, const size_t nCapacity=4096);
+
+    // Writes the records queued and closes the file
+    static void Close();
+
+    static bool IsOpen() { return mbOpen.load(std::memory_order_relaxed); }
+
+    // Records of the thread which tracks the images, the others take the image of the last one.
+    // A FRAME record takes the stage times since the last one.
+    static void AddImage(const Type type, const unsigned long nImage, const double timestamp, const int nState,
+                         const unsigned int nValue1=0, const unsigned int nValue2=0);
+
+    // Any thread
+    static void Add(const Type type, const unsigned int nValue1=0, const unsigned int nValue2=0);
+
+    // Number of records dropped by the log opened last
+    static size_t GetNumDropped();
+
+private:
+    static std::atomic<bool> mbOpen;
+};
+
+} //namespace ORB_SLAM
+
+#endif // EVENTLOG_H
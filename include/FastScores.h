@@ -0,0 +1,37 @@
+#ifndef FASTSCORES_H
+#define FASTSCORES_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace ORB_SLAM2
+{
+
+// FAST-9 corner strength of every pixel of a region in a single pass, so the cells of a pyramid
+// level can be detected at any threshold (and again at a lower one) without scanning the image for
+// every cell. The strength of a pixel is the largest difference d such that 9 contiguous pixels of
+// the Bresenham circle of radius 3 are all brighter or all darker than it by at least d: it is a
+// FAST corner at threshold t if its strength is larger than t, and its cv::FAST score is the
+// strength minus 1.
+// The kernel (scalar, AVX2 or NEON) is chosen once at runtime depending on what the cpu
+// supports, all kernels return the exact same strengths.
+class FastScores
+{
+public:
+    // radius of the circle
+    static const int kRadius = 3;
+
+    // image: 8 bit, step bytes per row. The strengths of the pixels of columns [x0,x1) and rows
+    // [y0,y1), at least kRadius away from the image borders, are written to the same pixels of
+    // scores (scoresStep bytes per row). Pixels which are no corner at threshold get 0.
+    static void Compute(const uint8_t* image, const size_t step, const int x0, const int y0,
+                        const int x1, const int y1, const int threshold, uint8_t* scores,
+                        const size_t scoresStep);
+
+    // Name of the kernel that is used on this machine
+    static const char* KernelName();
+};
+
+}// namespace ORB_SLAM
+
+#endif // FASTSCORES_H
@@ -0,0 +1,80 @@
+#ifndef FEATUREBUDGET_H
+#define FEATUREBUDGET_H
+
+#include <mutex>
+
+namespace ORB_SLAM2
+{
+
+// Closed loop controller of the extraction parameters of the tracking (FeatureBudget.enable).
+// After every tracked frame it gets the time the frame took, the inliers of its pose and the
+// keyframes waiting for the local mapping, and adapts the extraction of the next frames:
+// more features while the inliers are below the minimum, fewer while the frames take longer than
+// the target or the local mapping falls behind, and slowly fewer while there are inliers to spare.
+// The FAST threshold follows the keypoints the extractor found, the pyramid loses levels once the
+// features are at their minimum and the frames are still too slow. The values of the settings
+// file are the upper bounds. Frames can be built on another thread than the one tracking them,
+// so all methods lock.
+class FeatureBudget
+{
+public:
+
+    struct Budget
+    {
+        int nFeatures;
+        int iniThFAST;
+        int minThFAST;
+        int nLevels;
+    };
+
+    struct Settings
+    {
+        // seconds to extract and track a frame
+        float targetFrameTime;
+        // inliers of the pose below which features are added
+        int nMinInliers;
+        // keyframes in the local mapping queue above which features are removed
+        int nMaxQueuedKeyFrames;
+        int nMinFeatures;
+        int nMinLevels;
+    };
+
+    FeatureBudget(const Budget &maxBudget, const Settings &settings);
+
+    // The parameters the next frame is extracted with
+    Budget GetBudget();
+
+    // Seconds it took to build the last frame and the keypoints it got
+    void AddExtraction(const double time, const int nKeys);
+
+    // Seconds it took to track the last frame, bTracked if its pose was found
+    void AddTracking(const double time, const bool bTracked, const int nInliers, const int nQueuedKeyFrames);
+
+    // Back to the upper bounds, after a reset of the tracking
+    void Reset();
+
+protected:
+
+    std::mutex mMutex;
+
+    const Budget mMaxBudget;
+    const Settings mSettings;
+
+    Budget mBudget;
+
+    // features as a float, the steps are relative to it
+    float mfFeatures;
+
+    // smoothed seconds per frame, negative before the first frame
+    float mfFrameTime;
+
+    double mLastExtractionTime;
+    int mnLastKeys;
+
+    // frames since the number of levels changed
+    int mnFramesSinceLevelChange;
+};
+
+} //namespace ORB_SLAM
+
+#endif // FEATUREBUDGET_H
@@ -0,0 +1,94 @@
+#ifndef FEATURECACHE_H
+#define FEATURECACHE_H
+
+#include "Frame.h"
+#include "MappedFile.h"
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Record and replay of the features of a recorded sequence (FeatureCache.File), so sweeps of the
+// tracking, mapping and loop closing parameters over the same sequence extract each image once.
+// The first run records the keypoints, descriptors, stereo coordinates, depths and BoW vectors of
+// every frame it extracts, the runs after it build their frames from the file (Frame from
+// FrameFeatures) without the extraction, the stereo matching and the BoW. A frame is found by its
+// timestamp and its extractor, a frame which is not in the file is extracted and appended.
+//
+// The file starts with the settings the features depend on, a file of other settings is left
+// alone and every frame is extracted. Frames are appended in chunks of CHUNK_FRAMES, a chunk is
+// only read once it is complete, so the file of a run which crashed is good up to its last
+// chunk. The file is mapped, any thread can look up and add frames.
+class FeatureCache
+{
+public:
+
+    enum Extractor
+    {
+        TRACKING=0,
+        // The monocular initializer, with more features
+        INITIALIZER=1
+    };
+
+    // settings: the extraction settings, as text
+    FeatureCache(const std::string &filename, const std::string &settings);
+    // Writes the chunk of frames added last
+    ~FeatureCache();
+
+    // False if the file is of other settings or can not be written
+    bool IsOpen() const { return mbOpen; }
+
+    // Frames in the file when it was opened
+    size_t Size() const { return mmIndex.size(); }
+
+    // The features of the image at timestamp, false if they are not in the file
+    bool Get(const double timestamp, const Extractor extractor, FrameFeatures &features);
+
+    // Adds the features of frame, which has its BoW
+    void Add(const Frame &frame, const Extractor extractor);
+
+    // Writes the chunk of frames added last
+    void Flush();
+
+    // Frames read from the file and frames added
+    void PrintStats(std::ostream &out);
+
+protected:
+
+    static const int CHUNK_FRAMES = 64; //param
+
+    typedef std::pair<double,int> Key;
+
+    // Indexes the complete chunks from nOffset on, returns where the next chunk starts
+    uint64_t ReadChunks(uint64_t nOffset);
+
+    void WriteChunk();
+
+    std::string mFilename;
+    bool mbOpen;
+
+    MappedFile mFile;
+    // Offset of the record of every frame in the file
+    std::map<Key,uint64_t> mmIndex;
+
+    std::mutex mMutexWrite;
+    bool mbWriteFailed;
+    std::ofstream mOut;
+    std::vector<char> mvChunk;
+    uint32_t mnChunkFrames;
+
+    std::atomic<unsigned long> mnReplayed;
+    std::atomic<unsigned long> mnRecorded;
+};
+
+} //namespace ORB_SLAM
+
+#endif // FEATURECACHE_H
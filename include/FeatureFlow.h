@@ -0,0 +1,24 @@
+#ifndef FEATUREFLOW_H
+#define FEATUREFLOW_H
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Pyramidal Lucas-Kanade tracking of points from one image to the next, on the pyramids the ORB
+// extractor builds (every second level from the coarsest down to the full image). Each point is
+// an 8x8 window, solved for its translation by inverse compositional Gauss-Newton on the
+// intensities minus their mean, so a change of exposure does not move it. vPrev are pixels of
+// the full previous image, vCur the initial guesses in the current one and on return the
+// positions found. vbTracked tells which points converged with a small enough error and a
+// textured enough window.
+void TrackFeatureFlow(const std::vector<cv::Mat> &vPrevPyramid, const std::vector<cv::Mat> &vCurPyramid,
+                      const std::vector<float> &vScaleFactors, const std::vector<cv::Point2f> &vPrev,
+                      std::vector<cv::Point2f> &vCur, std::vector<unsigned char> &vbTracked);
+
+} //namespace ORB_SLAM
+
+#endif // FEATUREFLOW_H
@@ -0,0 +1,62 @@
+#ifndef FEATUREGRID_H
+#define FEATUREGRID_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Keypoint indices sorted by the grid cell they fall in, with the offset of every cell into
+// the one index array (compressed sparse rows). Within a cell the indices are increasing.
+// It is built once per Frame and read only afterwards, so the copies of the Frame and its
+// KeyFrame share it instead of copying one vector per cell.
+class FeatureGrid
+{
+public:
+    // vCells holds the cell x*nRows+y of every keypoint, -1 if it is outside the grid
+    FeatureGrid(const int nCols, const int nRows, const std::vector<int> &vCells);
+
+    // Grid whose nCols*nRows+1 offsets and indices live in memory kept alive by pOwner (a mapped map)
+    FeatureGrid(const int nCols, const int nRows, const unsigned int* pOffsets, const unsigned int* pIndices,
+                const std::shared_ptr<const void> &pOwner);
+
+    // The keypoints in cell (x,y) are [CellBegin(x,y), CellEnd(x,y))
+    const unsigned int* CellBegin(const int x, const int y) const
+    {
+        return mpIndices+mpOffsets[x*mnRows+y];
+    }
+
+    const unsigned int* CellEnd(const int x, const int y) const
+    {
+        return mpIndices+mpOffsets[x*mnRows+y+1];
+    }
+
+    int Cols() const { return mnCols; }
+    int Rows() const { return mnRows; }
+
+    // The nCols*nRows+1 offsets, the indices are [Indices(), Indices()+Offsets()[nCols*nRows])
+    const unsigned int* Offsets() const { return mpOffsets; }
+    const unsigned int* Indices() const { return mpIndices; }
+
+protected:
+    FeatureGrid(const FeatureGrid&);
+    FeatureGrid& operator=(const FeatureGrid&);
+
+    int mnCols;
+    int mnRows;
+
+    // nCols*nRows+1 offsets into mpIndices. They point into the vectors, or into the memory
+    // of mpOwner.
+    const unsigned int* mpOffsets;
+    const unsigned int* mpIndices;
+
+    std::vector<unsigned int> mvOffsets;
+    std::vector<unsigned int> mvIndices;
+    std::shared_ptr<const void> mpOwner;
+};
+
+} //namespace ORB_SLAM
+
+#endif // FEATUREGRID_H
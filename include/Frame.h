@@ -29,8 +29,16 @@
 #include "ORBVocabulary.h"
 #include "KeyFrame.h"
 #include "ORBextractor.h"
+#include "ThreadPool.h"
+#include "LocalMapGeometry.h"
+#include "FeatureGrid.h"
+#include "ImagePyramid.h"
+#include "FrameContext.h"
+#include "SharedArray.h"
 
 #include <opencv2/opencv.hpp>
+#include <Eigen/Core>
+#include <memory>
 
 namespace ORB_SLAM2
 {
@@ -40,22 +48,60 @@ namespace ORB_SLAM2
 class MapPoint;
 class KeyFrame;
 
+// Features of a frame extracted before, to build it again without extracting them (FeatureCache)
+struct FrameFeatures
+{
+    std::vector<cv::KeyPoint> vKeys;
+    // Empty without stereo coordinates
+    std::vector<float> vuRight;
+    std::vector<float> vDepth;
+    cv::Mat descriptors;
+    DBoW2::BowVector bowVec;
+    DBoW2::FeatureVector featVec;
+};
+
 class Frame
 {
+    // builds the grid of the frames of loaded keyframes
+    friend class MapSerializer;
+
 public:
     Frame();
 
     // Copy constructor.
+    // The features, descriptors and grid are never changed after a Frame was built, copies share
+    // them with the original. The tracking hands frames on by moving them.
     Frame(const Frame &frame);
+    Frame(Frame &&frame) = default;
+    Frame& operator=(const Frame &frame) = default;
+    Frame& operator=(Frame &&frame) = default;
+
+    // The frames of one map share pContext (the Map's mFrameContext), it gives the id and the
+    // calibration computed by the first frame.
 
     // Constructor for stereo cameras.
-    Frame(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timeStamp, ORBextractor* extractorLeft, ORBextractor* extractorRight, ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+    // If a thread pool is given the right image is extracted on it while the calling thread extracts the left one.
+    Frame(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timeStamp, ORBextractor* extractorLeft, ORBextractor* extractorRight, ORBVocabulary* voc, FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth, ThreadPool* pThreadPool=NULL);
 
     // Constructor for RGB-D cameras.
-    Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+    // imDepth is CV_16U or CV_32F, depthMapFactor turns its values into meters
+    Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth,
+          const float depthMapFactor=1.0f, const int nDepthFilterRadius=0);
 
     // Constructor for Monocular cameras.
-    Frame(const cv::Mat &imGray, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+    Frame(const cv::Mat &imGray, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+
+    // Constructor from the features of an earlier extraction (FeatureCache), without the
+    // extraction, the stereo matching and the BoW. extractor gives the scale levels the features
+    // were extracted with, it is not run. imGray only gives the image bounds to the first frame.
+    Frame(const cv::Mat &imGray, const double &timeStamp, FrameFeatures &&features, ORBextractor* extractor, ORBVocabulary* voc, FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+
+    // Constructor for a monocular frame without an extraction: the keypoints of lastFrame with a
+    // map point are tracked into imGray by optical flow on the pyramid of extractor, starting at
+    // vPredicted (negative x: not tracked). They keep their map point, octave and descriptor.
+    // lastFrame needs its pyramid (mpImagePyramid), the frame holds the one of imGray.
+    Frame(const Frame &lastFrame, const cv::Mat &imGray, const double &timeStamp, ORBextractor* extractor,
+          const std::vector<cv::Point2f> &vPredicted, FrameContext* pContext);
 
     // Extract ORB on the image. 0 for left image and 1 for right image.
     void ExtractORB(int flag, const cv::Mat &im);
@@ -70,35 +116,52 @@ public:
     void UpdatePoseMatrices();
 
     // Returns the camera center.
-    inline cv::Mat GetCameraCenter(){
-        return mOw.clone();
-    }
+    cv::Mat GetCameraCenter();
 
     // Returns inverse of rotation
-    inline cv::Mat GetRotationInverse(){
-        return mRwc.clone();
+    cv::Mat GetRotationInverse();
+
+    // Fixed-size pose and camera center, valid after SetPose.
+    inline void GetPose(Eigen::Matrix3f &Rcw, Eigen::Vector3f &tcw) const {
+        Rcw = mRcw;
+        tcw = mtcw;
+    }
+
+    inline void GetCameraCenter(Eigen::Vector3f &Ow) const {
+        Ow = mOw;
     }
 
-    // Check if a MapPoint is in the frustum of the camera
-    // and fill variables of the MapPoint to be used by the tracking
-    bool isInFrustum(MapPoint* pMP, float viewingCosLimit);
+    // Check which points of a local map copy are in the frustum of the camera, all at once, and
+    // fill mProjections with them for the local map search. vpExcluded (sorted) and bad points
+    // are skipped.
+    void ProjectLocalMap(const LocalMapGeometry &localMap, const float viewingCosLimit,
+                         const std::vector<MapPoint*> &vpExcluded=std::vector<MapPoint*>());
 
     // Compute the cell of a keypoint (return false if outside the grid)
     bool PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY);
 
     // given a certain point (x, y) this function searches all grid cells in the vicinity of it with a the windowsize r
     vector<size_t> GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel=-1, const int maxLevel=-1) const;
+    // Same into vIndices, which keeps its capacity from one call to the next
+    void GetFeaturesInArea(const float &x, const float &y, const float &r, const int minLevel, const int maxLevel,
+                           std::vector<size_t> &vIndices) const;
 
     // Search a match for each keypoint in the left image to a keypoint in the right image.
     // If there is a match, depth is computed and the right coordinate associated to the left keypoint is stored.
-    void ComputeStereoMatches();
+    // The left keypoints are split over the pool if there is one.
+    void ComputeStereoMatches(ThreadPool* pThreadPool=NULL);
 
     // Associate a "right" coordinate to a keypoint if there is valid depth in the depthmap.
-    void ComputeStereoFromRGBD(const cv::Mat &imDepth);
+    // Only the keypoint pixels are read and scaled, with nFilterRadius>0 their depth is the median
+    // of the window around them.
+    void ComputeStereoFromRGBD(const cv::Mat &imDepth, const float depthMapFactor=1.0f, const int nFilterRadius=0);
 
     // Backprojects a keypoint (if stereo/depth info available) into 3D world coordinates.
     cv::Mat UnprojectStereo(const int &i);
 
+    // Copies the calibration, image bounds and grid size of the context
+    void SetCalibration(const FrameContext &context);
+
 public:
     // Vocabulary used for relocalization.
     ORBVocabulary* mpORBvocabulary;
@@ -111,12 +174,12 @@ public:
 
     // Calibration matrix and OpenCV distortion parameters.
     cv::Mat mK;
-    static float fx;
-    static float fy;
-    static float cx;
-    static float cy;
-    static float invfx;
-    static float invfy;
+    float fx;
+    float fy;
+    float cx;
+    float cy;
+    float invfx;
+    float invfy;
     cv::Mat mDistCoef;
 
     // Stereo baseline multiplied by fx.
@@ -135,13 +198,27 @@ public:
     // Vector of keypoints (original for visualization) and undistorted (actually used by the system).
     // In the stereo case, mvKeysUn is redundant as images must be rectified.
     // In the RGB-D case, RGB images can be distorted.
-    std::vector<cv::KeyPoint> mvKeys, mvKeysRight;
-    std::vector<cv::KeyPoint> mvKeysUn;
+    // Immutable once the frame is built, shared by the copies and by the keyframe made of it.
+    SharedArray<cv::KeyPoint> mvKeys;
+    std::vector<cv::KeyPoint> mvKeysRight;
+    SharedArray<cv::KeyPoint> mvKeysUn;
 
     // Corresponding stereo coordinate and depth for each keypoint.
     // "Monocular" keypoints have a negative value.
-    std::vector<float> mvuRight;
-    std::vector<float> mvDepth;
+    SharedArray<float> mvuRight;
+    SharedArray<float> mvDepth;
+
+    // Some keypoints may have a stereo coordinate (stereo and RGB-D frames). If false all of them
+    // are monocular and the loops over the observations take the monocular path only.
+    bool mbStereo = false;
+
+    // RGB color of each keypoint, sampled by the tracking with Export.Color, empty otherwise
+    SharedArray<cv::Vec3b> mvColors;
+
+    // Depth image of an RGB-D frame with KeyFrameDepth.Retain, for Map::mKeyFrameDepths if the
+    // frame becomes a keyframe. Shared by the copies, empty otherwise.
+    cv::Mat mImDepth;
+    float mfDepthMapFactor = 1.0f;
 
     // Bag of Words Vector structures.
     DBoW2::BowVector mBowVec;
@@ -150,23 +227,51 @@ public:
     // ORB descriptor, each row associated to a keypoint.
     cv::Mat mDescriptors, mDescriptorsRight;
 
+    // Pyramid of the left image, shared with the extractor and the copies of the frame. Only if
+    // the extractor keeps it (ImageAlignment, FlowFrames), NULL otherwise.
+    std::shared_ptr<const ImagePyramid> mpImagePyramid;
+
+    // The keypoints were tracked from the last frame instead of extracted
+    bool mbFlowTracked = false;
+
     // MapPoints associated to keypoints, NULL pointer if no association.
     std::vector<MapPoint*> mvpMapPoints;
 
     // Flag to identify outlier associations.
     std::vector<bool> mvbOutlier;
 
+    // MapPoints discarded as outliers of the pose of this frame, the local map search does not
+    // match them again
+    std::vector<MapPoint*> mvpRejectedPoints;
+
+    // Local map points in the frustum, where they project and at which level, for
+    // ORBmatcher::SearchByProjection. Kept by the frame as arrays instead of in the map points,
+    // the tracking does not write into objects other threads share.
+    struct ProjectionCache
+    {
+        std::vector<MapPoint*> vpMapPoints;
+        std::vector<float> vu;
+        std::vector<float> vv;
+        // Right image, stereo and RGB-D
+        std::vector<float> vuRight;
+        std::vector<int> vnLevel;
+        std::vector<float> vViewCos;
+
+        size_t Size() const { return vpMapPoints.size(); }
+        void Clear();
+    };
+    ProjectionCache mProjections;
+
     // Keypoints are assigned to cells in a grid to reduce matching complexity when projecting MapPoints.
-    static float mfGridElementWidthInv;
-    static float mfGridElementHeightInv;
+    float mfGridElementWidthInv;
+    float mfGridElementHeightInv;
     //mgrid remembers all indicies of the features located in a specific cell
-    std::vector<std::size_t> mGrid[FRAME_GRID_COLS][FRAME_GRID_ROWS];
+    std::shared_ptr<const FeatureGrid> mpGrid;
 
     // Camera pose.
     cv::Mat mTcw;
 
-    // Current and Next Frame id.
-    static long unsigned int nNextId;
+    // Current Frame id, the next one is in the FrameContext.
     long unsigned int mnId;
 
     // Reference Keyframe.
@@ -182,32 +287,42 @@ public:
     vector<float> mvInvLevelSigma2;
 
     // Undistorted Image Bounds (computed once).
-    static float mnMinX;
-    static float mnMaxX;
-    static float mnMinY;
-    static float mnMaxY;
-
-    static bool mbInitialComputations;
+    float mnMinX;
+    float mnMaxX;
+    float mnMinY;
+    float mnMaxY;
 
 
 private:
 
     // Undistort keypoints given OpenCV distortion parameters.
     // Only for the RGB-D case. Stereo must be already rectified!
-    // (called in the constructor).
-    void UndistortKeyPoints();
+    // (called in the constructor). Once the undistortion map exists the keypoints are looked up in
+    // it, until then (and after a change of the calibration) cv::undistortPoints solves every point.
+    void UndistortKeyPoints(const FrameContext &context);
+
+    // Bilinear lookup of mvKeys in the undistortion map, false if a keypoint is outside of it
+    bool UndistortKeyPointsFromMap(const FrameContext &context);
+
+    // No stereo coordinate for any keypoint
+    void SetMonocular();
+
+    // Computes image bounds and the undistortion map of the context (called in the constructor).
+    void ComputeImageBounds(const cv::Mat &imLeft, FrameContext &context);
 
-    // Computes image bounds for the undistorted image (called in the constructor).
-    void ComputeImageBounds(const cv::Mat &imLeft);
+    // The first frame (or the first after a change in the calibration) computes the calibration
+    // of the context, every frame copies it (SetCalibration)
+    void ComputeCalibration(const cv::Mat &im, FrameContext &context);
 
     // Assign keypoints to the grid for speed up feature matching (called in the constructor).
     void AssignFeaturesToGrid();
 
-    // Rotation, translation and camera center
-    cv::Mat mRcw;
-    cv::Mat mtcw;
-    cv::Mat mRwc;
-    cv::Mat mOw; //==mtwc
+    // Rotation, translation and camera center. Fixed size so that frustum checks and projections
+    // do not allocate. No Matrix4f on purpose, it would need aligned storage in every Frame copy.
+    Eigen::Matrix3f mRcw;
+    Eigen::Vector3f mtcw;
+    Eigen::Matrix3f mRwc;
+    Eigen::Vector3f mOw; //==mtwc
 };
 
 }// namespace ORB_SLAM
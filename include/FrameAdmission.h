@@ -0,0 +1,57 @@
+#ifndef FRAMEADMISSION_H
+#define FRAMEADMISSION_H
+
+#include <mutex>
+
+namespace ORB_SLAM2
+{
+
+// Decides which images the system tracks when it can't keep up with the camera
+// (Admission.LatencyBudget). It keeps the backlog, the seconds the output would lag behind an
+// input arriving at the timestamps of the images: every tracked image adds the time it took,
+// the time between two images is taken off. An image is skipped while tracking it would bring
+// the backlog over the budget, or while the backlog is over the budget if the tracker expects a
+// new keyframe: those are kept as long as possible, a missed keyframe costs more than a late
+// pose. The tracker gives a skipped image the pose of its motion model instead. An image is
+// never skipped if the tracker has no motion model or after Admission.MaxSkippedFrames skipped
+// ones in a row. Images can be admitted on another thread than the one tracking them, so all
+// methods lock.
+class FrameAdmission
+{
+public:
+
+    FrameAdmission(const double budget, const int nMaxSkipped);
+
+    // Whether the image of the timestamp is tracked, in the order of the images
+    bool Admit(const double timestamp);
+
+    // Seconds it took to track the last admitted image, and what the tracker told for the next:
+    // bCanSkip if it can predict its pose, bKeyFrameLikely if it may become a keyframe
+    void AddTracking(const double time, const bool bCanSkip, const bool bKeyFrameLikely);
+
+    // Seconds the output lags behind, 0 while the tracking keeps up
+    double GetBacklog();
+
+    void Reset();
+
+protected:
+
+    std::mutex mMutex;
+
+    const double mfBudget;
+    const int mnMaxSkipped;
+
+    double mfBacklog;
+    // smoothed seconds per tracked image, negative before the first one
+    double mfFrameTime;
+    // negative before the first image
+    double mfLastTimestamp;
+    int mnSkippedInRow;
+
+    bool mbCanSkip;
+    bool mbKeyFrameLikely;
+};
+
+} //namespace ORB_SLAM
+
+#endif // FRAMEADMISSION_H
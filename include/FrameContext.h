@@ -0,0 +1,43 @@
+#ifndef FRAMECONTEXT_H
+#define FRAMECONTEXT_H
+
+#include <atomic>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Calibration, undistorted image bounds and grid which all the frames of one map share, and the
+// id of the next frame. The first frame computes them (again after a change of the calibration),
+// a loaded map sets them, every frame keeps a copy. Each Map has its own, so several Systems can
+// run in one process.
+class FrameContext
+{
+public:
+    FrameContext(): fx(0), fy(0), cx(0), cy(0), invfx(0), invfy(0), mnMinX(0), mnMaxX(0), mnMinY(0), mnMaxY(0),
+        mfGridElementWidthInv(0), mfGridElementHeightInv(0), mbInitialComputations(true), nNextId(0) {}
+
+    float fx, fy, cx, cy, invfx, invfy;
+    float mnMinX, mnMaxX, mnMinY, mnMaxY;
+    float mfGridElementWidthInv, mfGridElementHeightInv;
+
+    // Undistorted position of every pixel of the image, (rows+1)x(cols+1) so the lookups can
+    // interpolate up to the border. Built by Frame::ComputeImageBounds with the calibration of
+    // that frame, empty without distortion.
+    cv::Mat mUndistortMapX;
+    cv::Mat mUndistortMapY;
+
+    bool mbInitialComputations;
+
+    // The builders of the offline input take ids in parallel
+    std::atomic<long unsigned int> nNextId;
+
+private:
+    FrameContext(const FrameContext&);
+    FrameContext& operator=(const FrameContext&);
+};
+
+} //namespace ORB_SLAM
+
+#endif // FRAMECONTEXT_H
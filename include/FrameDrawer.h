@@ -28,6 +28,7 @@
 #include<opencv2/core/core.hpp>
 #include<opencv2/features2d/features2d.hpp>
 
+#include<memory>
 #include<mutex>
 
 
@@ -37,6 +38,10 @@ namespace ORB_SLAM2
 class Tracking;
 class Viewer;
 
+// The tracking publishes every frame as an immutable snapshot behind a shared pointer, the
+// viewer draws the newest one at its own pace. The image is shared with the tracking unless
+// the caller of the tracking still owns it. At most three snapshots exist: the published one,
+// the one the viewer draws and the one Update fills next.
 class FrameDrawer
 {
 public:
@@ -52,27 +57,35 @@ public:
 
 protected:
 
-    void DrawTextInfo(cv::Mat &im, int nState, cv::Mat &imText);
-
     // Info of the frame to be drawn
-    cv::Mat mIm;
+    struct Snapshot
+    {
+        unsigned long nId;
+        cv::Mat im;
+        int state;
+        bool bOnlyTracking;
+        // Initialization: lines from the reference keypoints to their matches
+        std::vector<std::pair<cv::Point2f,cv::Point2f> > vIniLines;
+        // Tracking: keypoints matched to points of the map and to visual odometry points
+        std::vector<cv::Point2f> vMap, vVO;
+    };
+
+    void DrawTextInfo(cv::Mat &im, const Snapshot &frame, cv::Mat &imText);
+
+    // Published by Update, read by DrawFrame with the atomic shared pointer functions
+    std::shared_ptr<const Snapshot> mpFront;
+    // Only touched by Update: the snapshot swapped out of mpFront
+    std::shared_ptr<Snapshot> mpBack;
+    unsigned long mnPublished;
+
+    // Only touched by DrawFrame
+    unsigned long mnDrawn;
     cv::Mat mLastIm;
-    int N;
-    vector<cv::KeyPoint> mvCurrentKeys;
-    vector<bool> mvbMap, mvbVO;
-    bool mbOnlyTracking;
-    int mnTracked, mnTrackedVO;
-    vector<cv::KeyPoint> mvIniKeys;
-    vector<int> mvIniMatches;
-    int mState;
 
     Map* mpMap;
 
-    std::mutex mMutex;
-
     int mFrameCounter;
     int mFrameCount;
-    bool mWasUpdated;
 };
 
 } //namespace ORB_SLAM
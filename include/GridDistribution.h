@@ -0,0 +1,54 @@
+#ifndef GRIDDISTRIBUTION_H
+#define GRIDDISTRIBUTION_H
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Distribution of the FAST corners of a level over the image on a fixed grid, a cheaper
+// alternative to OctTreeDistribution: the area is divided into buckets of about
+// FEATURES_PER_BUCKET of the N features wanted, every bucket keeps its strongest corners and the
+// strongest of the remaining corners fill up what the empty buckets left. A partial selection per
+// bucket (nth_element) replaces the recursive division, and the result is exactly
+// min(N, number of corners) keypoints. Ties of the response go to the corner found first, so the
+// result does not depend on the standard library. The buffers are kept from one call to the
+// next. Not thread safe, the extractor keeps one per level.
+class GridDistribution
+{
+public:
+
+    // vKeys are relative to (minX,minY), vResult gets at most N of them
+    void Distribute(const std::vector<cv::KeyPoint> &vKeys, const int minX, const int maxX, const int minY,
+                    const int maxY, const int N, std::vector<cv::KeyPoint> &vResult);
+
+protected:
+
+    // A keypoint and its response, close together for the selections
+    struct Candidate
+    {
+        float response;
+        int index;
+
+        // Strongest first, the earlier of equal ones first
+        bool operator<(const Candidate &other) const
+        {
+            return response>other.response || (response==other.response && index<other.index);
+        }
+    };
+
+    // The keypoints grouped by bucket, mvBucketStart[b] is where bucket b begins
+    std::vector<Candidate> mvCandidates;
+    std::vector<int> mvBucketOfKey;
+    std::vector<int> mvBucketStart;
+    std::vector<int> mvPos;
+    // Candidates left over by the buckets, for the top-up
+    std::vector<Candidate> mvRest;
+    std::vector<int> mvSelected;
+};
+
+} //namespace ORB_SLAM
+
+#endif // GRIDDISTRIBUTION_H
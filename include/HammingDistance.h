@@ -0,0 +1,34 @@
+#ifndef HAMMINGDISTANCE_H
+#define HAMMINGDISTANCE_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace ORB_SLAM2
+{
+
+// Hamming distance between 256 bit ORB descriptors.
+// The kernel (scalar, AVX2, AVX-512 VPOPCNTDQ or NEON) is chosen once at runtime
+// depending on what the cpu supports, all kernels return the exact same distances.
+class HammingDistance
+{
+public:
+    // size of one ORB descriptor in bytes
+    static const int kDescriptorBytes = 32;
+
+    // Distance between two descriptors
+    static int Compute(const uint8_t* a, const uint8_t* b);
+
+    // Distance of one query descriptor against many candidates stored in one contiguous
+    // block (e.g. the rows of Frame::mDescriptors). The candidate i is located at
+    // block + indices[i]*step, the result for it is written to distances[i]
+    static void ComputeBatch(const uint8_t* query, const uint8_t* block, const size_t step,
+                             const size_t* indices, const size_t n, int* distances);
+
+    // Name of the kernel that is used on this machine
+    static const char* KernelName();
+};
+
+}// namespace ORB_SLAM
+
+#endif // HAMMINGDISTANCE_H
@@ -0,0 +1,79 @@
+#ifndef IMAGEALIGNMENT_H
+#define IMAGEALIGNMENT_H
+
+#include <vector>
+
+#include <Eigen/Core>
+#include <opencv2/core/core.hpp>
+
+#include "Thirdparty/g2o/g2o/types/se3quat.h"
+
+namespace ORB_SLAM2
+{
+
+class Frame;
+
+// Sparse direct alignment of the current frame to the last one, to correct the pose the motion
+// model predicted before the projection search. The patches are the 4x4 pixels around the
+// keypoints of the last frame with a map point, at the depth of the point. The relative pose is
+// found by inverse compositional Gauss-Newton with a Huber weight, coarse to fine on the ORB
+// pyramids of both frames, without the finest levels (the matching refines the pose anyway).
+// The Jacobians ignore the distortion of the lens, the residuals do not. Both frames need their
+// pyramid (Frame::mpImagePyramid). The buffers are kept from one frame to the next.
+class ImageAlignment
+{
+public:
+
+    struct Report
+    {
+        Report(): nPoints(0), nIterations(0), fErrorBefore(0), fErrorAfter(0) {}
+
+        // Points in view at the finest level
+        int nPoints;
+        int nIterations;
+        // Mean Huber cost per pixel at the finest level, with the predicted and the aligned pose
+        float fErrorBefore;
+        float fErrorAfter;
+    };
+
+    ImageAlignment();
+
+    // Refines the pose of currentFrame, which has to hold the prediction. False if a frame has
+    // no pyramid, too few points are in view or the error did not go down, the pose is left as
+    // it was then.
+    bool Align(const Frame &lastFrame, Frame &currentFrame, Report* pReport=NULL);
+
+protected:
+
+    typedef Eigen::Matrix<float,6,1> Vector6f;
+    typedef Eigen::Matrix<double,6,6> Matrix6d;
+    typedef Eigen::Matrix<double,6,1> Vector6d;
+
+    // Reference patches and their Jacobians at a level of the last frame
+    void Precompute(const Frame &lastFrame, const int level);
+
+    // Mean cost per pixel of the pose Tcr of the current camera relative to the last one, and the
+    // normal equations of the step. Returns the number of points in view.
+    int Evaluate(const cv::Mat &image, const float invScale, const g2o::SE3Quat &Tcr, float &error,
+                 Matrix6d &H, Vector6d &b) const;
+
+    // Pinhole and distortion of the current frame, in pixels of level 0
+    bool Project(const Eigen::Vector3f &p, float &u, float &v) const;
+
+    float fx, fy, cx, cy;
+    float k1, k2, p1, p2, k3;
+    bool mbDistorted;
+
+    // Points of the last frame in its camera, the keypoint they were seen at (level 0)
+    std::vector<Eigen::Vector3f> mvPoints;
+    std::vector<cv::Point2f> mvKeys;
+
+    // 16 intensities and Jacobians per point, for the level of the last Precompute
+    std::vector<unsigned char> mvbVisible;
+    std::vector<float> mvRefPatches;
+    std::vector<Vector6f> mvJacobians;
+};
+
+} //namespace ORB_SLAM
+
+#endif // IMAGEALIGNMENT_H
@@ -0,0 +1,67 @@
+#ifndef IMAGEPYRAMID_H
+#define IMAGEPYRAMID_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// The image pyramid of one image, built once by the ORBextractor and then shared by everything
+// which reads it: the extraction, the SAD refinement of the stereo matching, the optical flow
+// and the image alignment of the tracking and the rectified image of the viewer. Every level
+// lives inside a padded buffer, so the extraction can read around the border. The blurred levels
+// of the descriptors are kept next to them, they are computed by the extraction for the levels
+// with keypoints and by GetBlurredLevel for any other on demand. The frames hold the pyramid of
+// their left image by a shared pointer, the extractor builds its next image into another pyramid
+// as long as a frame still holds the last one.
+class ImagePyramid
+{
+public:
+
+    ImagePyramid() {}
+
+    // Padded buffers for levels of vSizes, with border pixels on every side. The buffers of the
+    // levels of the same size and type are kept. The blurred levels are invalidated.
+    void Allocate(const std::vector<cv::Size> &vSizes, const int type, const int border);
+
+    int GetLevels() const { return static_cast<int>(mvLevels.size()); }
+
+    // The levels without their border, the non-const one for the builder to write into
+    const std::vector<cv::Mat>& GetImages() const { return mvLevels; }
+    const cv::Mat& GetLevel(const int level) const { return mvLevels[level]; }
+    cv::Mat& GetLevel(const int level) { return mvLevels[level]; }
+
+    // The whole padded buffer of a level
+    cv::Mat& GetBuffer(const int level) { return mvBuffers[level]; }
+
+    // Blurs a level for the descriptors. The builder may blur different levels in parallel, but
+    // only as long as no one else reads the pyramid.
+    void Blur(const int level);
+    bool IsBlurred(const int level) const { return mvbBlurred[level]!=0; }
+
+    // The blurred level, blurred now if the extraction did not need it. Any thread can ask.
+    const cv::Mat& GetBlurredLevel(const int level) const;
+
+    // Bytes of the padded and the blurred levels
+    size_t GetMemoryUsage() const;
+
+protected:
+    ImagePyramid(const ImagePyramid&);
+    ImagePyramid& operator=(const ImagePyramid&);
+
+    std::vector<cv::Mat> mvBuffers;
+    std::vector<cv::Mat> mvLevels;
+
+    // Computed lazily by the readers, under mMutexBlur
+    mutable std::vector<cv::Mat> mvBlurred;
+    mutable std::vector<unsigned char> mvbBlurred;
+    mutable std::mutex mMutexBlur;
+};
+
+} //namespace ORB_SLAM
+
+#endif // IMAGEPYRAMID_H
@@ -0,0 +1,100 @@
+#ifndef IMAGESOURCE_H
+#define IMAGESOURCE_H
+
+#include "Settings.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Images of a recorded sequence for the example drivers and tools. Decoding threads read and
+// rectify the images ahead of the caller, at most a queue size ahead, so the PNG decoding
+// overlaps with the tracking; Next returns them in order.
+class ImageSource
+{
+public:
+
+    struct Entry
+    {
+        double timestamp;
+        std::string strImage;
+        // Right image or depthmap, empty for monocular
+        std::string strImage2;
+    };
+
+    struct Image
+    {
+        int index;
+        double timestamp;
+        cv::Mat im;
+        cv::Mat im2;
+    };
+
+    // Layouts of the datasets, the lists the examples used to build. False if the list of the
+    // images could not be opened.
+    // TUM: rgb.txt of the sequence, or the association file for RGB-D.
+    static bool LoadTUM(const std::string &strSequence, const std::string &strAssociations,
+                        std::vector<Entry> &vEntries);
+    // KITTI: times.txt, image_0 and image_1 for stereo.
+    static bool LoadKITTI(const std::string &strSequence, const bool bStereo, std::vector<Entry> &vEntries);
+    // EuRoC: the cam0/data (and cam1/data) folders and a file of timestamps as in EuRoC_TimeStamps.
+    static bool LoadEuRoC(const std::string &strLeft, const std::string &strRight, const std::string &strTimes,
+                          std::vector<Entry> &vEntries);
+
+    // nThreads decoding threads, which start with the first Next. With none Next reads the images.
+    ImageSource(const std::vector<Entry> &vEntries, const int nThreads=2, const int nQueueSize=8);
+    ~ImageSource();
+
+    // Stereo rectification from LEFT.* and RIGHT.* of the settings, as stereo_euroc. The maps are
+    // computed once and applied by the decoding threads. Call before the first Next.
+    bool SetStereoRectification(const Settings &fsSettings);
+
+    // Next image of the sequence, false at the end or if it could not be read
+    bool Next(Image &image);
+
+    int Size() const { return mvEntries.size(); }
+
+protected:
+
+    struct Slot
+    {
+        // Index of the image it holds, -1 when empty
+        int nIndex;
+        bool bOk;
+        cv::Mat im;
+        cv::Mat im2;
+    };
+
+    bool Read(const int i, cv::Mat &im, cv::Mat &im2) const;
+
+    void Run();
+
+    const std::vector<Entry> mvEntries;
+
+    bool mbRectify;
+    cv::Mat mM1l, mM2l, mM1r, mM2r;
+
+    const int mnThreads;
+    std::vector<std::thread> mvThreads;
+
+    // Slot i%size holds image i. An image is only read when its slot has been released, so the
+    // threads never get more than the queue size ahead of Next.
+    std::vector<Slot> mvSlots;
+    std::mutex mMutex;
+    std::condition_variable mCondRead;
+    std::condition_variable mCondReady;
+    int mnNextRead;
+    int mnNextReturned;
+    bool mbStop;
+};
+
+} //namespace ORB_SLAM
+
+#endif // IMAGESOURCE_H
@@ -0,0 +1,108 @@
+#ifndef INDEXEDSTORE_H
+#define INDEXEDSTORE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Set of pointers to objects with a unique, increasing mnId (MapPoint, KeyFrame).
+// The pointers are kept in one contiguous vector and a table indexed by mnId stores
+// where each of them is, so insert and erase are O(1) and iterating is a plain
+// vector traversal. Erasing moves the last element into the gap, the order is arbitrary.
+// Not thread safe, the owner has to lock around every call.
+template<class T>
+class IndexedStore
+{
+public:
+    typedef std::vector<T*> Items;
+    typedef std::shared_ptr<const Items> Snapshot;
+    typedef typename Items::const_iterator const_iterator;
+
+    IndexedStore() {}
+
+    // returns false if the object was already stored
+    bool Insert(T* p)
+    {
+        const size_t id = p->mnId;
+        if(id>=mvPositions.size())
+            mvPositions.resize(std::max(id+1, 2*mvPositions.size()), 0);
+        else if(mvPositions[id])
+            return false;
+
+        mvItems.push_back(p);
+        mvPositions[id] = mvItems.size();
+        mSnapshot.reset();
+        return true;
+    }
+
+    // returns false if the object was not stored
+    bool Erase(T* p)
+    {
+        const size_t id = p->mnId;
+        if(id>=mvPositions.size() || !mvPositions[id])
+            return false;
+
+        const size_t pos = mvPositions[id]-1;
+        T* pLast = mvItems.back();
+        mvItems[pos] = pLast;
+        mvPositions[pLast->mnId] = pos+1;
+        mvItems.pop_back();
+        mvPositions[id] = 0;
+        mSnapshot.reset();
+        return true;
+    }
+
+    bool Contains(const T* p) const
+    {
+        const size_t id = p->mnId;
+        return id<mvPositions.size() && mvPositions[id];
+    }
+
+    // NULL if no object with this id is stored
+    T* Find(const size_t id) const
+    {
+        if(id>=mvPositions.size() || !mvPositions[id])
+            return static_cast<T*>(NULL);
+        return mvItems[mvPositions[id]-1];
+    }
+
+    size_t Size() const { return mvItems.size(); }
+    bool Empty() const { return mvItems.empty(); }
+
+    void Clear()
+    {
+        mvItems.clear();
+        mvPositions.clear();
+        mSnapshot.reset();
+    }
+
+    // valid until the next Insert, Erase or Clear
+    const Items& GetItems() const { return mvItems; }
+    const_iterator begin() const { return mvItems.begin(); }
+    const_iterator end() const { return mvItems.end(); }
+
+    // Immutable copy of the current content. It is only rebuilt after the store changed,
+    // callers which poll an unchanged store share one copy instead of making a new one each time.
+    Snapshot GetSnapshot()
+    {
+        if(!mSnapshot)
+            mSnapshot = std::make_shared<const Items>(mvItems);
+        return mSnapshot;
+    }
+
+protected:
+    Items mvItems;
+
+    // position+1 in mvItems for every mnId, 0 if not stored
+    std::vector<size_t> mvPositions;
+
+    Snapshot mSnapshot;
+};
+
+} //namespace ORB_SLAM
+
+#endif // INDEXEDSTORE_H
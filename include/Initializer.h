@@ -21,14 +21,18 @@
 #define INITIALIZER_H
 
 #include<opencv2/opencv.hpp>
+#include<Eigen/Core>
 
 #include "Frame.h"
 #include "Parameter.h"
+#include "RandomStream.h"
 
 
 namespace ORB_SLAM2
 {
 
+class ThreadPool;
+
 // THIS IS THE INITIALIZER FOR MONOCULAR SLAM. NOT USED IN THE STEREO OR RGBD CASE.
 class Initializer
 {
@@ -36,8 +40,9 @@ class Initializer
 
 public:
 
-    // Fix the reference frame
-    Initializer(const Frame &ReferenceFrame, float sigma = 1.0, int iterations = 200);
+    // Fix the reference frame. The RANSAC hypotheses are scored on pThreadPool if given.
+    Initializer(const Frame &ReferenceFrame, float sigma = 1.0, int iterations = 200,
+                ThreadPool* pThreadPool = NULL);
 
     // Computes in parallel a fundamental matrix and a homography
     // Selects a model and tries to recover the motion and the structure from motion
@@ -47,15 +52,30 @@ public:
 
 private:
 
-    void FindHomography(vector<bool> &vbMatchesInliers, float &score, cv::Mat &H21);
-    void FindFundamental(vector<bool> &vbInliers, float &score, cv::Mat &F21);
+    // A RANSAC hypothesis with its score and number of inliers
+    struct Hypothesis
+    {
+        cv::Mat M21;
+        float score;
+        int nInliers;
+    };
+
+    // Runs RANSAC for both models with adaptive termination
+    void FindModels(vector<bool> &vbMatchesInliersH, float &SH, cv::Mat &H21,
+                    vector<bool> &vbMatchesInliersF, float &SF, cv::Mat &F21);
+
+    void ComputeHomographyHypothesis(const int it, Hypothesis &hypothesis);
+    void ComputeFundamentalHypothesis(const int it, Hypothesis &hypothesis);
 
     cv::Mat ComputeH21(const vector<cv::Point2f> &vP1, const vector<cv::Point2f> &vP2);
     cv::Mat ComputeF21(const vector<cv::Point2f> &vP1, const vector<cv::Point2f> &vP2);
 
-    float CheckHomography(const cv::Mat &H21, const cv::Mat &H12, vector<bool> &vbMatchesInliers, float sigma);
+    float CheckHomography(const cv::Mat &H21, const cv::Mat &H12, int &nInliers, float sigma) const;
+    void ComputeInliersHomography(const cv::Mat &H21, const cv::Mat &H12, vector<bool> &vbMatchesInliers,
+                                  float sigma) const;
 
-    float CheckFundamental(const cv::Mat &F21, vector<bool> &vbMatchesInliers, float sigma);
+    float CheckFundamental(const cv::Mat &F21, int &nInliers, float sigma) const;
+    void ComputeInliersFundamental(const cv::Mat &F21, vector<bool> &vbMatchesInliers, float sigma) const;
 
     bool ReconstructF(vector<bool> &vbMatchesInliers, cv::Mat &F21, cv::Mat &K,
                       cv::Mat &R21, cv::Mat &t21, vector<cv::Point3f> &vP3D, vector<bool> &vbTriangulated, float minParallax, int minTriangulated);
@@ -63,7 +83,8 @@ private:
     bool ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, cv::Mat &K,
                       cv::Mat &R21, cv::Mat &t21, vector<cv::Point3f> &vP3D, vector<bool> &vbTriangulated, float minParallax, int minTriangulated);
 
-    void Triangulate(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const cv::Mat &P1, const cv::Mat &P2, cv::Mat &x3D);
+    void Triangulate(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const Eigen::Matrix<float,3,4> &P1,
+                     const Eigen::Matrix<float,3,4> &P2, Eigen::Vector3f &x3D);
 
     void Normalize(const vector<cv::KeyPoint> &vKeys, vector<cv::Point2f> &vNormalizedPoints, cv::Mat &T);
 
@@ -84,6 +105,13 @@ private:
     vector<Match> mvMatches12;
     vector<bool> mvbMatched1;
 
+    // Coordinates of the matches, mvU1[i] is the x of mvKeys1[mvMatches12[i].first]
+    vector<float> mvU1, mvV1, mvU2, mvV2;
+
+    // Normalized keypoints and their normalization
+    vector<cv::Point2f> mvPn1, mvPn2;
+    cv::Mat mT1, mT2;
+
     // Calibration
     cv::Mat mK;
 
@@ -96,6 +124,16 @@ private:
     // Ransac sets
     vector<vector<size_t> > mvSets;
 
+    // Draws the sets, seeded by the ids of the two frames
+    long unsigned int mnReferenceFrameId;
+    RandomStream mRandom;
+
+    // Evaluates the hypotheses, may be NULL
+    ThreadPool* mpThreadPool;
+
+    // Iterations done by the last Initialize
+    int mnIterationsH, mnIterationsF;
+
     static Parameter<bool> visualizeInitialization;
 };
 
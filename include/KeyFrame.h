@@ -22,13 +22,25 @@
 #define KEYFRAME_H
 
 #include "MapPoint.h"
+#include "BowMatchIndex.h"
 #include "Thirdparty/DBoW2/DBoW2/BowVector.h"
 #include "Thirdparty/DBoW2/DBoW2/FeatureVector.h"
 #include "ORBVocabulary.h"
 #include "ORBextractor.h"
 #include "Frame.h"
 #include "KeyFrameDatabase.h"
-
+#include "CovisibilityList.h"
+#include "MapMutex.h"
+#include "MemoryUsage.h"
+#include "SeqLock.h"
+#include "SharedArray.h"
+#include "CompactFeatures.h"
+#include "DescriptorArena.h"
+
+#include <Eigen/Core>
+
+#include <atomic>
+#include <memory>
 #include <mutex>
 
 
@@ -40,10 +52,20 @@ class MapPoint;
 class Frame;
 class KeyFrameDatabase;
 
+typedef BasicCovisibilityList<KeyFrame> CovisibilityList;
+
 class KeyFrame
 {
+    // restores the graph of a loaded keyframe
+    friend class MapSerializer;
+
 public:
     KeyFrame(Frame &F, Map* pMap, KeyFrameDatabase* pKFDB);
+    ~KeyFrame();
+
+    // KeyFrames are allocated from a pool like MapPoints
+    static void* operator new(std::size_t size);
+    static void operator delete(void* p, std::size_t size);
 
     // Pose functions
     void SetPose(const cv::Mat &Tcw);
@@ -54,20 +76,33 @@ public:
     cv::Mat GetRotation();
     cv::Mat GetTranslation();
 
+    // Same with fixed-size types, without locking or allocating. Used by the core classes,
+    // the cv::Mat versions are kept for the remaining callers and the System API.
+    void SetPose(const Eigen::Matrix3f &Rcw, const Eigen::Vector3f &tcw);
+    void GetPose(Eigen::Matrix3f &Rcw, Eigen::Vector3f &tcw);
+    void GetCameraCenter(Eigen::Vector3f &Ow);
+
     // Bag of Words Representation
     void ComputeBoW();
 
     // Covisibility graph functions
-    void AddConnection(KeyFrame* pKF, const int &weight);
+    // The weights follow the observations of the map points: MapPoint adds n to the weight of
+    // both keyframes whenever a point seen by both gains or loses one of them.
+    void AddCovisibility(KeyFrame* pKF, const int n);
     void EraseConnection(KeyFrame* pKF);
+    // Links a new keyframe to its parent in the spanning tree, the weights are already current
     void UpdateConnections();
-    void UpdateBestCovisibles();
     std::set<KeyFrame *> GetConnectedKeyFrames();
     std::vector<KeyFrame* > GetVectorCovisibleKeyFrames();
     std::vector<KeyFrame*> GetBestCovisibilityKeyFrames(const int &N);
     std::vector<KeyFrame*> GetCovisiblesByWeight(const int &w);
     int GetWeight(KeyFrame* pKF);
 
+    // Shared immutable copy of the connections, only rebuilt after they changed. Traversals
+    // which just read the best covisibles or their weights should prefer it to the vectors.
+    typedef std::shared_ptr<const CovisibilityList> CovisibilitySnapshot;
+    CovisibilitySnapshot GetCovisibilitySnapshot();
+
     // Spanning tree functions
     void AddChild(KeyFrame* pKF);
     void EraseChild(KeyFrame* pKF);
@@ -75,6 +110,11 @@ public:
     std::set<KeyFrame*> GetChilds();
     KeyFrame* GetParent();
     bool hasChild(KeyFrame* pKF);
+    // Root of the spanning tree of its map (Map::IsOrigin)
+    bool IsOrigin();
+    // The keyframe whose pose carries this one in the bundle adjustments: the keyframe of the
+    // first camera of its rig while that one is good, itself otherwise
+    KeyFrame* GetRigBody();
 
     // Loop Edges
     void AddLoopEdge(KeyFrame* pKF);
@@ -85,15 +125,55 @@ public:
     void EraseMapPointMatch(const size_t &idx);
     void EraseMapPointMatch(MapPoint* pMP);
     void ReplaceMapPointMatch(const size_t &idx, MapPoint* pMP);
+    // Many entries under one lock, NULL erases
+    void ReplaceMapPointMatches(const std::vector<std::pair<size_t, MapPoint*> > &vMatches);
     std::set<MapPoint*> GetMapPoints();
     std::vector<MapPoint*> GetMapPointMatches();
+
+    // Shared immutable copy of the MapPoint matches, only rebuilt after they changed.
+    // Readers which just iterate over the matches should prefer it to GetMapPointMatches.
+    typedef std::shared_ptr<const std::vector<MapPoint*> > MapPointMatchesSnapshot;
+    MapPointMatchesSnapshot GetMapPointMatchesSnapshot();
+
+    // The features with a MapPoint packed by vocabulary node for SearchByBoW, built on the first
+    // call after the matches changed and shared until they change again
+    typedef std::shared_ptr<const BowMatchIndex> BowMatchIndexPtr;
+    BowMatchIndexPtr GetBowMatchIndex();
     int TrackedMapPoints(const int &minObs);
     MapPoint* GetMapPoint(const size_t &idx);
 
     // KeyPoint functions
     std::vector<size_t> GetFeaturesInArea(const float &x, const float  &y, const float  &r) const;
+    // Same into vIndices, which keeps its capacity from one call to the next, with the
+    // undistorted keypoints of GetFeatures
+    void GetFeaturesInArea(const float &x, const float &y, const float &r, const SharedArray<cv::KeyPoint> &vKeysUn,
+                           std::vector<size_t> &vIndices) const;
     cv::Mat UnprojectStereo(int i);
 
+    // Keypoints, right coordinates and depths, as mvKeys, mvKeysUn, mvuRight and mvDepth
+    struct Features
+    {
+        SharedArray<cv::KeyPoint> vKeys;
+        SharedArray<cv::KeyPoint> vKeysUn;
+        SharedArray<float> vuRight;
+        SharedArray<float> vDepth;
+    };
+
+    // Any thread. The arrays of a compact keyframe are decoded for the caller, the keyframe stays
+    // compact. They stay valid as long as the caller keeps them.
+    Features GetFeatures();
+    // Of one keypoint, without decoding a compact keyframe. Any thread.
+    int GetOctave(const size_t idx);
+    float GetRight(const size_t idx);
+
+    // Cold storage (LocalMapping.ColdKeyFrames): Compact replaces the arrays by a CompactFeatures,
+    // Expand decodes them back. Only called by the local mapping and its workers, one of them for
+    // a keyframe at a time, which read the arrays of the keyframes they expanded directly. The
+    // other threads read them with the getters above.
+    void Compact();
+    void Expand();
+    bool IsCompact() const { return mbCompact; }
+
     // Image
     bool IsInImage(const float &x, const float &y) const;
 
@@ -105,6 +185,22 @@ public:
     void SetBadFlag();
     bool isBad();
 
+    // Culls several keyframes at once, by increasing mnId. The spanning tree is repaired around
+    // the whole batch, a child is never attached to another keyframe of it. Returns how many are
+    // bad afterwards, the ones the loop closing holds are erased when it releases them.
+    static int SetBadFlags(std::vector<KeyFrame*> vpKFs);
+
+    // Incremented whenever the MapPoint matches, the covisibility connections, the spanning tree
+    // links or the bad flag change, lets the tracking tell if its local map is still up to date
+    unsigned long GetChangeIdx();
+
+    // Frees keypoints, descriptors, BoW, grid and MapPoint matches of a bad KeyFrame.
+    // Pose and spanning tree are kept for the trajectory. Only called by the Reclaimer.
+    void ReleaseFeatures();
+
+    // Adds the bytes of its features, grid, BoW and connections to usage
+    void AddMemoryUsage(MemoryUsage &usage);
+
     // Compute Scene Depth (q=2 median). Used in monocular.
     float ComputeSceneMedianDepth(const int q);
 
@@ -120,10 +216,23 @@ public:
     // The following variables are accesed from only 1 thread or never change (no mutex needed).
 public:
 
-    static long unsigned int nNextId;
     long unsigned int mnId;
     const long unsigned int mnFrameId;
 
+    // Map of the atlas the keyframe belongs to, set by the tracking and changed when a loop
+    // closure merges two maps (under Map::mMutexMapUpdate)
+    std::atomic<long unsigned int> mnMapId;
+
+    // Camera rig (Rig.nCameras): the keyframes the other cameras took with a keyframe of the
+    // first camera are its mvpRigKFs, they point back with mpRigKF and keep their camera and the
+    // extrinsics mTcr (from the first camera). mpPrevRigKF is the keyframe of the same camera
+    // before. NULL, empty and 0 without a rig, set before the keyframes are inserted.
+    KeyFrame* mpRigKF;
+    std::vector<KeyFrame*> mvpRigKFs;
+    int mnRigCamera;
+    cv::Mat mTcr;
+    KeyFrame* mpPrevRigKF;
+
     const double mTimeStamp;
 
     // Grid (to speed up feature matching)
@@ -133,25 +242,19 @@ public:
     const float mfGridElementHeightInv;
 
     // Variables used by the tracking
-    long unsigned int mnTrackReferenceForFrame;
+    long unsigned int mnTrackReferenceForLocalMap;
     long unsigned int mnFuseTargetForKF;
 
     // Variables used by the local mapping
     long unsigned int mnBALocalForKF;
     long unsigned int mnBAFixedForKF;
 
-    // Variables used by the keyframe database
-    long unsigned int mnLoopQuery;
-    int mnLoopWords;
-    float mLoopScore;
-    long unsigned int mnRelocQuery;
-    int mnRelocWords;
-    float mRelocScore;
-
     // Variables used by loop closing
     cv::Mat mTcwGBA;
     cv::Mat mTcwBefGBA;
     long unsigned int mnBAGlobalForKF;
+    long unsigned int mnBARegionForKF;
+    long unsigned int mnBARegionFixedForKF;
 
     // Calibration parameters
     const float fx, fy, cx, cy, invfx, invfy, mbf, mb, mThDepth;
@@ -160,11 +263,16 @@ public:
     const int N;
 
     // KeyPoints, stereo coordinate and descriptors (all associated by an index)
-    const std::vector<cv::KeyPoint> mvKeys;
-    const std::vector<cv::KeyPoint> mvKeysUn;
-    const std::vector<float> mvuRight; // negative value for monocular points
-    const std::vector<float> mvDepth; // negative value for monocular points
-    const cv::Mat mDescriptors;
+    // They never change but are released with ReleaseFeatures and Compact, so they are not const.
+    // In a map loaded with MapSerializer::LoadMapped they point into the read only file.
+    // Only the local mapping reads them directly, after Expand, other threads use GetFeatures.
+    SharedArray<cv::KeyPoint> mvKeys;
+    SharedArray<cv::KeyPoint> mvKeysUn;
+    SharedArray<float> mvuRight; // negative value for monocular points
+    SharedArray<float> mvDepth; // negative value for monocular points
+    SharedArray<cv::Vec3b> mvColors; // RGB with Export.Color, empty otherwise and in a loaded map
+    // The descriptors are copied into DescriptorArena::Global()
+    cv::Mat mDescriptors;
 
     //BoW
     DBoW2::BowVector mBowVec;
@@ -188,32 +296,51 @@ public:
     const int mnMaxY;
     const cv::Mat mK;
 
-    // Debug
-    bool mbIsRelocalizationCandidate;
+    // Debug: the keyframe is a candidate of the last relocalization if its stamp is the
+    // current epoch. System starts a new epoch every frame instead of clearing all the stamps.
+    long unsigned int mnRelocalizationCandidateEpoch;
+    static std::atomic<long unsigned int> nRelocalizationEpoch;
+    bool IsRelocalizationCandidate() const { return mnRelocalizationCandidateEpoch==nRelocalizationEpoch; }
+
+    // Every pose written takes the next epoch, a keyframe keeps the one of its pose. A value
+    // derived from poses read after the epoch E holds as long as none of them is above E.
+    std::atomic<long unsigned int> mnPoseEpoch;
+    static std::atomic<long unsigned int> nPoseEpoch;
 
     // The following variables need to be accessed trough a mutex to be thread safe.
 protected:
 
-    // SE3 Pose and camera center
-    cv::Mat Tcw;
-    cv::Mat Twc;
-    cv::Mat Ow;
+    // vpBatch (sorted) are culled with this one and can not become parents
+    void SetBadFlag(const std::vector<KeyFrame*> &vpBatch);
+
+    // Attaches the good children to the parent or to each other, every one by its heaviest
+    // covisibility link to the parent or to a child placed before it (a maximum spanning tree
+    // grown from the parent). The children left without a link go to the parent.
+    void ReparentChildren(const std::vector<KeyFrame*> &vpBatch);
 
-    cv::Mat Cw; // Stereo middel point. Only for visualization
+    // SE3 Pose and camera center: Rcw (row major) | tcw | Ow. Written under mMutexPose,
+    // read without locking. Twc and the stereo middle point are derived from it.
+    SeqLock<float,15> mPose;
 
     // MapPoints associated to keypoints
     std::vector<MapPoint*> mvpMapPoints;
+    MapPointMatchesSnapshot mpMapPointsSnapshot;
+    BowMatchIndexPtr mpBowMatchIndex;
 
     // BoW
     KeyFrameDatabase* mpKeyFrameDB;
     ORBVocabulary* mpORBvocabulary;
 
     // Grid over the image to speed up feature matching
-    std::vector< std::vector <std::vector<size_t> > > mGrid;
+    std::shared_ptr<const FeatureGrid> mpGrid;
 
-    std::map<KeyFrame*,int> mConnectedKeyFrameWeights;
-    std::vector<KeyFrame*> mvpOrderedConnectedKeyFrames;
-    std::vector<int> mvOrderedWeights;
+    // The keypoints, right coordinates and depths while compact, under mMutexCold
+    std::shared_ptr<const CompactFeatures> mpCompactFeatures;
+    std::atomic<bool> mbCompact;
+
+    // Covisibility graph
+    CovisibilityList mConnections;
+    CovisibilitySnapshot mpConnectionsSnapshot;
 
     // Spanning Tree and Loop Edges
     bool mbFirstConnection;
@@ -224,15 +351,19 @@ protected:
     // Bad flags
     bool mbNotErase;
     bool mbToBeErased;
-    bool mbBad;
+    std::atomic<bool> mbBad; // written under mMutexConnections, read without locking
+
+    std::atomic<unsigned long> mnChangeIdx;
 
     float mHalfBaseline; // Only for visualization
 
     Map* mpMap;
 
-    std::mutex mMutexPose;
-    std::mutex mMutexConnections;
-    std::mutex mMutexFeatures;
+    MapMutex mMutexPose{"KeyFrame::mMutexPose"};
+    MapMutex mMutexConnections{"KeyFrame::mMutexConnections"};
+    MapMutex mMutexFeatures{"KeyFrame::mMutexFeatures"};
+    // Guards the arrays against Compact and Expand, no other lock is taken under it
+    MapMutex mMutexCold{"KeyFrame::mMutexCold"};
 };
 
 } //namespace ORB_SLAM
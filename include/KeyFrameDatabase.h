@@ -24,12 +24,14 @@
 #include <vector>
 #include <list>
 #include <set>
+#include <string>
 
 #include "KeyFrame.h"
 #include "Frame.h"
+#include "KeyFrameDatabaseFile.h"
 #include "ORBVocabulary.h"
-
-#include<mutex>
+#include "SharedMutex.h"
+#include "ThumbnailIndex.h"
 
 
 namespace ORB_SLAM2
@@ -37,13 +39,15 @@ namespace ORB_SLAM2
 
 class KeyFrame;
 class Frame;
+class ThreadPool;
 
 
 class KeyFrameDatabase
 {
 public:
 
-    KeyFrameDatabase(const ORBVocabulary &voc);
+    // nRelocTopK>0 only scores the nRelocTopK most similar keyframes in relocalization queries
+    KeyFrameDatabase(const ORBVocabulary &voc, const int nRelocTopK=0);
 
    void add(KeyFrame* pKF);
 
@@ -51,22 +55,118 @@ public:
 
    void clear();
 
+   // Where the camera is thought to be in the map nMapId of the atlas, from external odometry
+   // or a motion model. The keyframes of that map whose center is farther than fRadius from
+   // center are no candidates and are never scored, the other maps are not pruned.
+   struct PosePrior
+   {
+       Eigen::Vector3f center;
+       float fRadius;
+       long unsigned int nMapId;
+   };
+
    // Loop Detection
-   std::vector<KeyFrame *> DetectLoopCandidates(KeyFrame* pKF, float minScore);
+   std::vector<KeyFrame *> DetectLoopCandidates(KeyFrame* pKF, float minScore, const PosePrior* pPrior=NULL);
+
+   // Relocalization. The keyframes are scored on pThreadPool if given.
+   std::vector<KeyFrame*> DetectRelocalizationCandidates(Frame* F, ThreadPool* pThreadPool=NULL,
+                                                         const PosePrior* pPrior=NULL);
+
+   // Writes the keyframes of the database to a file which LoadPrior maps in another session
+   bool Save(const std::string &filename);
+
+   // Maps the database of a previous session, built with the same vocabulary. It is kept
+   // apart from the keyframes of this session and survives clear().
+   bool LoadPrior(const std::string &filename);
+
+   // Relocalization against the prior database, same selection as DetectRelocalizationCandidates.
+   // Returns the mnIds the candidates had in their session.
+   std::vector<unsigned long> DetectPriorRelocalizationCandidates(const DBoW2::BowVector &bowVec);
+
+   // Thumbnails of the keyframes (see ThumbnailIndex), erased and cleared with them. A keyframe
+   // has one only if AddThumbnail was called for it.
+   void AddThumbnail(KeyFrame* pKF, const std::vector<uint8_t> &signature);
+   bool HasThumbnails();
+   void DetectThumbnailCandidates(const std::vector<uint8_t> &signature, const int nK, const int maxDistance,
+                                  std::vector<ThumbnailIndex::Match> &vMatches);
 
-   // Relocalization
-   std::vector<KeyFrame*> DetectRelocalizationCandidates(Frame* F);
+   // Bytes of the inverted file, the keyframe table and the thumbnails, the mapped prior is not counted
+   size_t GetMemoryUsage();
 
 protected:
 
+  // Entry of an inverted list: the mnId of a keyframe with the word and the weight of the
+  // word in its BoW vector
+  struct Posting
+  {
+      unsigned int nId;
+      float weight;
+  };
+
+  // Scratch of one query, indexed by keyframe mnId. Every query has its own, so queries
+  // only share the index and run at the same time.
+  struct Query
+  {
+      // Room for the keyframes with mnId<nIds
+      void Resize(const size_t nIds)
+      {
+          vnWords.assign(nIds,0);
+          vbCandidate.assign(nIds,false);
+          vScore.assign(nIds,0);
+          vScoreBound.assign(nIds,0);
+      }
+
+      // Words shared with the query
+      std::vector<int> vnWords;
+      // Shares a word and is not excluded
+      std::vector<unsigned char> vbCandidate;
+      // Similarity score with the query, if computed
+      std::vector<float> vScore;
+      // Sum of min(v_i,w_i) over the shared words, the L1 score (up to rounding). It bounds
+      // the score before it is computed.
+      std::vector<float> vScoreBound;
+      // The candidates in the order in which they were found
+      std::vector<KeyFrame*> vpCandidates;
+  };
+
+  // Counts the words every keyframe shares with bowVec. Keyframes in pExcluded or outside of
+  // pPrior count their words but are no candidates.
+  void SearchSharedWords(const DBoW2::BowVector &bowVec, const std::set<KeyFrame*>* pExcluded,
+                         const PosePrior* pPrior, Query &query);
+
+  // Computes the similarity score of every keyframe with bowVec
+  void ScoreKeyFrames(const DBoW2::BowVector &bowVec, const std::vector<KeyFrame*> &vpKFs, Query &query,
+                      ThreadPool* pThreadPool) const;
+
+  // Keeps the nK keyframes most similar to bowVec, in their order. With the L1 score the
+  // keyframes are scored by decreasing bound and the ones whose bound is below the nK-th best
+  // score are never scored (max-score pruning).
+  void SelectTopK(const DBoW2::BowVector &bowVec, const int nK, std::vector<KeyFrame*> &vpKFs, Query &query,
+                  ThreadPool* pThreadPool) const;
+
   // Associated vocabulary
   const ORBVocabulary* mpVoc;
 
-  // Inverted file
-  std::vector<list<KeyFrame*> > mvInvertedFile;
+  // Number of keyframes scored in relocalization, 0 for all
+  const int mnRelocTopK;
+
+  // Inverted file, one contiguous posting list per word
+  std::vector<std::vector<Posting> > mvInvertedFile;
+
+  // Words whose posting list has a buffer, clear only visits these instead of the vocabulary
+  std::vector<unsigned int> mvnUsedWords;
+
+  // Keyframes in the database by mnId, NULL if not in it
+  std::vector<KeyFrame*> mvpKeyFrames;
+
+  // Database of a previous session, if one was loaded
+  KeyFrameDatabaseFile mPrior;
+
+  // Has a lock of its own
+  ThumbnailIndex mThumbnails;
 
-  // Mutex
-  std::mutex mMutex;
+  // Queries hold it shared, add/erase/clear/LoadPrior exclusively
+  SharedMutex mMutex;
 };
 
 } //namespace ORB_SLAM
@@ -0,0 +1,106 @@
+#ifndef KEYFRAMEDATABASEFILE_H
+#define KEYFRAMEDATABASEFILE_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+#include "Thirdparty/DBoW2/DBoW2/BowVector.h"
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+
+// Keyframe database of a previous session on disk: the inverted file, the BoW vector and the
+// best covisible keyframes of every keyframe. The file is memory mapped read only. Opening it
+// checks the header, the sizes of the sections and every count, offset and index in them once,
+// so the queries never read past the sections of a truncated or corrupt file. Several processes
+// opening the same file share the pages.
+//
+// Layout, in native byte order, every section 8 byte aligned:
+//   Header
+//   Record[nKeyFrames]           keyframes by increasing mnId
+//   uint64_t[nWords+1]           offset of the posting list of every word in Postings
+//   Entry[nPostings]             Postings: (index of the keyframe in Records, weight)
+//   Entry[nBowEntries]           BoW vectors: (word, weight), referenced by the Records
+class KeyFrameDatabaseFile
+{
+public:
+
+    // Best covisible keyframes stored per keyframe
+    static const int NUM_COVISIBLES = 10; //param
+
+    struct Entry
+    {
+        uint32_t n;
+        float weight;
+    };
+
+    struct Record
+    {
+        // mnId and time stamp of the keyframe in its session
+        uint64_t nId;
+        double timeStamp;
+        // BoW vector of the keyframe
+        uint64_t nBowOffset;
+        uint32_t nBowSize;
+        // Best covisible keyframes, as indices of Records
+        uint32_t nCovisibles;
+        uint32_t vnCovisibles[NUM_COVISIBLES];
+    };
+
+    KeyFrameDatabaseFile();
+    ~KeyFrameDatabaseFile();
+
+    // Writes the keyframes, sorted by mnId, for a vocabulary of nWords words
+    static bool Write(const std::string &filename, const std::vector<KeyFrame*> &vpKFs, const size_t nWords);
+
+    // Maps the file. Fails if it is not a database of a vocabulary with nWords words.
+    bool Open(const std::string &filename, const size_t nWords);
+    void Close();
+
+    bool IsOpen() const { return mFile.IsOpen(); }
+
+    size_t NumKeyFrames() const { return mnKeyFrames; }
+    const Record& GetRecord(const size_t idx) const { return mpRecords[idx]; }
+
+    // Posting list of a word
+    const Entry* PostingsBegin(const DBoW2::WordId wordId) const { return mpPostings+mpWordOffsets[wordId]; }
+    const Entry* PostingsEnd(const DBoW2::WordId wordId) const { return mpPostings+mpWordOffsets[wordId+1]; }
+
+    void GetBowVector(const size_t idx, DBoW2::BowVector &bowVec) const;
+
+protected:
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t nVersion;
+        uint32_t nWords;
+        uint64_t nKeyFrames;
+        uint64_t nPostings;
+        uint64_t nBowEntries;
+    };
+
+    // Whether the word offsets, the postings, the records and the BoW entries of the mapped
+    // sections only refer to what is in the sections
+    bool CheckSections(const Header &header) const;
+
+    KeyFrameDatabaseFile(const KeyFrameDatabaseFile&);
+    KeyFrameDatabaseFile& operator=(const KeyFrameDatabaseFile&);
+
+    MappedFile mFile;
+
+    size_t mnKeyFrames;
+    const Record* mpRecords;
+    const uint64_t* mpWordOffsets;
+    const Entry* mpPostings;
+    const Entry* mpBowEntries;
+};
+
+} //namespace ORB_SLAM
+
+#endif // KEYFRAMEDATABASEFILE_H
@@ -0,0 +1,49 @@
+#ifndef KEYFRAMEPOLICY_H
+#define KEYFRAMEPOLICY_H
+
+namespace ORB_SLAM2
+{
+
+// Decides what the tracker does with a keyframe it needs while the local mapping is busy
+// (LocalMapping.TargetUtilization). Interrupting the local BA lets the mapping catch up, but the
+// BA is lost and the map gets worse, so it only pays while the mapping does not keep up: its
+// load is the seconds the queued keyframes, the one in progress and the new one cost (smoothed
+// per keyframe) over the seconds since the last keyframe. Up to the target the BA finishes, the new
+// keyframe queues behind it if the mapping can take more than one or waits for a later frame
+// otherwise. Over the target, always while the tracking is weak and with a target of 0 the BA is
+// interrupted as before.
+class KeyFramePolicy
+{
+public:
+
+    enum Decision
+    {
+        // Insert the keyframe and interrupt the local BA
+        INSERT=0,
+        // Insert the keyframe behind the local BA
+        QUEUE=1,
+        // Interrupt the local BA, insert the keyframe later
+        INTERRUPT=2,
+        // Insert the keyframe later
+        POSTPONE=3
+    };
+
+    // nMaxQueued: keyframes the mapping can have queued (0: none, as monocular)
+    KeyFramePolicy(const float targetUtilization=0, const int nMaxQueued=0);
+
+    // For a keyframe interval seconds after the last one while the mapping is busy with nQueued
+    // keyframes queued, each costing cost seconds (negative before the first one). bUrgent if
+    // the tracking is weak.
+    Decision Decide(const double interval, const int nQueued, const double cost, const bool bUrgent) const;
+
+    float GetTargetUtilization() const { return mfTargetUtilization; }
+
+protected:
+
+    float mfTargetUtilization;
+    int mnMaxQueued;
+};
+
+} //namespace ORB_SLAM
+
+#endif // KEYFRAMEPOLICY_H
@@ -0,0 +1,100 @@
+#ifndef LATENCYSCHEDULER_H
+#define LATENCYSCHEDULER_H
+
+#include "StageTimer.h"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Coordinates the knobs which trade quality for time in all threads against a target
+// end-to-end pose latency and a CPU budget (Latency.Target, Latency.Percentile, Latency.nCores):
+// "20 ms p99 on 4 cores". It keeps the latencies of the last frames, from the image to its pose,
+// and every UPDATE_PERIOD frames compares their percentile with the target and the cores which the
+// stages of all threads used meanwhile (wall seconds of the StageTimeSet of the map per second,
+// the parallel stages counted once) with the budget. Over either it goes one level up, it comes
+// back down after a few periods well under both. A level sets all the knobs together: the
+// features extracted, the search radius and the local map of the tracking, the window and
+// iterations of the local BA, the threads of the map-wide optimizations and whether a global BA
+// may start. Level 0 leaves the settings as they are. Any thread reads the knobs, so all methods
+// lock.
+class LatencyScheduler
+{
+public:
+
+    // The defaults are the settings as they are
+    struct Knobs
+    {
+        Knobs(): fFeatureScale(1), fSearchRadiusScale(1), nMaxLocalKeyFrames(80), nLocalBAKeyFrames(0),
+            fLocalBAIterationScale(1), nOptimizerThreads(0), bGlobalBA(true) {}
+
+        // Of the features of the extraction
+        float fFeatureScale;
+        // Of the radius of the search of the local map points
+        float fSearchRadiusScale;
+        // Keyframes of the local map of the tracking
+        int nMaxLocalKeyFrames;
+        // Keyframes the local BA optimizes, 0: no limit
+        int nLocalBAKeyFrames;
+        // Of the iterations of the local BA
+        float fLocalBAIterationScale;
+        // Threads of the local and global BA and the essential graph, 0: all cores
+        int nOptimizerThreads;
+        // A global BA may start, otherwise it waits for a lower level
+        bool bGlobalBA;
+    };
+
+    static const int NUM_LEVELS = 6;
+
+    // target in seconds at the percentile (0..1) of the latencies, nCores 0: all cores
+    LatencyScheduler(const double target, const double percentile, const int nCores, StageTimeSet* pStageTimes);
+
+    // Seconds from the image to its pose, in the order of the images. True if the level changed.
+    bool AddFrame(const double latency);
+
+    Knobs GetKnobs();
+    int GetLevel();
+
+    // Percentile of the latencies and cores used in the last period, negative before the first
+    double GetLatency();
+    double GetCores();
+
+    int GetNumCores() const { return mnCores; }
+
+    // Back to level 0, after a reset of the tracking
+    void Reset();
+
+protected:
+
+    uint64_t GetBusyNanoseconds() const;
+
+    std::mutex mMutex;
+
+    const double mfTarget;
+    const double mfPercentile;
+    const int mnCores;
+    StageTimeSet* mpStageTimes;
+
+    int mnLevel;
+    // Periods in a row with room to spare
+    int mnSlackPeriods;
+
+    // The last WINDOW latencies, the frame mnFrames%WINDOW is the oldest
+    std::vector<double> mvLatencies;
+    std::vector<double> mvSorted;
+    size_t mnFrames;
+
+    double mfLatency;
+    double mfCores;
+
+    uint64_t mnLastBusy;
+    std::chrono::steady_clock::time_point mtLastUpdate;
+};
+
+} //namespace ORB_SLAM
+
+#endif // LATENCYSCHEDULER_H
@@ -0,0 +1,102 @@
+#ifndef LOCALBAPROBLEM_H
+#define LOCALBAPROBLEM_H
+
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "Thirdparty/g2o/g2o/core/sparse_optimizer.h"
+#include "Thirdparty/g2o/g2o/types/types_six_dof_expmap.h"
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+class MapPoint;
+
+// g2o graph of the local bundle adjustment which is kept from one keyframe to the next.
+// Consecutive local windows share most of their keyframes and points, so Update only adds
+// the vertices and edges which entered the window and removes the ones which left it, the
+// rest keeps its allocation and only gets the current estimates. Only used by local mapping.
+class LocalBAProblem
+{
+public:
+    LocalBAProblem();
+
+    // Brings the graph to the given window. Every edge is an inlier with its robust kernel again.
+    void Update(const std::list<KeyFrame*> &lLocalKeyFrames, const std::list<KeyFrame*> &lFixedKeyFrames,
+                const std::list<MapPoint*> &lLocalMapPoints);
+
+    // Drops the whole graph, the ids of keyframes and points are reused after a reset
+    void Clear();
+
+    // Turns the robust kernels off for the second round (up to the next Update)
+    void DisableRobustKernels();
+
+    // The algorithm is set by the first user and kept with the graph
+    g2o::SparseOptimizer& GetOptimizer() { return mOptimizer; }
+
+    g2o::VertexSE3Expmap* GetVertex(KeyFrame* pKF);
+    g2o::VertexSBAPointXYZ* GetVertex(MapPoint* pMP);
+
+    // The edges of the current window with their keyframe and point
+    std::vector<g2o::EdgeSE3ProjectXYZ*> mvpEdgesMono;
+    std::vector<KeyFrame*> mvpEdgeKFMono;
+    std::vector<MapPoint*> mvpMapPointEdgeMono;
+
+    std::vector<g2o::EdgeStereoSE3ProjectXYZ*> mvpEdgesStereo;
+    std::vector<KeyFrame*> mvpEdgeKFStereo;
+    std::vector<MapPoint*> mvpMapPointEdgeStereo;
+
+    // Observations of the keyframes of the other cameras of a rig (KeyFrame::GetRigBody), on the
+    // vertex of the keyframe of the first camera
+    std::vector<g2o::EdgeSE3ProjectXYZRig*> mvpEdgesRig;
+    std::vector<KeyFrame*> mvpEdgeKFRig;
+    std::vector<MapPoint*> mvpMapPointEdgeRig;
+
+protected:
+
+    struct Observation
+    {
+        g2o::OptimizableGraph::Edge* pEdge;
+        size_t nIdx;
+        bool bStereo;
+        bool bRig;
+        unsigned long nUpdate;
+    };
+
+    struct PointEntry
+    {
+        g2o::VertexSBAPointXYZ* pVertex;
+        unsigned long nUpdate;
+        // by keyframe mnId
+        std::map<unsigned long, Observation> mObservations;
+    };
+
+    struct KeyFrameEntry
+    {
+        g2o::VertexSE3Expmap* pVertex;
+        unsigned long nUpdate;
+    };
+
+    void UpdateKeyFrame(KeyFrame* pKF, const bool bFixed);
+    // pBody is the keyframe with the vertex, pKF itself or the first camera of its rig
+    g2o::OptimizableGraph::Edge* CreateEdge(g2o::VertexSBAPointXYZ* pVPoint, KeyFrame* pKF, KeyFrame* pBody,
+                                            const size_t idx);
+
+    g2o::SparseOptimizer mOptimizer;
+
+    // Keyed by mnId, not by pointer: a point or keyframe which left the window may be freed and
+    // its address reused before the next Update. Vertex ids are 2*mnId for keyframes and
+    // 2*mnId+1 for points, so they stay valid while the window moves.
+    std::unordered_map<unsigned long, KeyFrameEntry> mmKeyFrames;
+    std::unordered_map<unsigned long, PointEntry> mmMapPoints;
+
+    // Incremented on every Update, entries which were not touched left the window
+    unsigned long mnUpdate;
+};
+
+} //namespace ORB_SLAM
+
+#endif // LOCALBAPROBLEM_H
@@ -0,0 +1,25 @@
+#ifndef LOCALMAPGEOMETRY_H
+#define LOCALMAPGEOMETRY_H
+
+#include "PointProjection.h"
+
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class MapPoint;
+
+// Structure of arrays copy of the viewing geometry of the local map points. It is taken once
+// per local map update, so that the frustum culling of the frame (Frame::ProjectLocalMap) runs
+// over contiguous arrays instead of reading the points one by one.
+class LocalMapGeometry : public PointProjection::Points
+{
+public:
+    // Copies the geometry of the points, all of them have to be good
+    void Build(const std::vector<MapPoint*> &vpMapPoints);
+};
+
+} //namespace ORB_SLAM
+
+#endif // LOCALMAPGEOMETRY_H
@@ -27,7 +27,14 @@
 #include "Tracking.h"
 #include "KeyFrameDatabase.h"
 #include "Parameter.h"
-
+#include "ThreadPool.h"
+#include "LocalBAProblem.h"
+#include "LatencyScheduler.h"
+#include "SPSCQueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 
 
@@ -41,16 +48,70 @@ class Map;
 class LocalMapping
 {
 public:
-    LocalMapping(Map* pMap, const float bMonocular);
+    // nThreads threads (including the mapping thread) triangulate and fuse with the neighbor keyframes.
+    // With a target keyframe rate (keyframes per second, 0: none) the local BA of every keyframe
+    // is given the time left of the period and adapts its window to it.
+    LocalMapping(Map* pMap, const float bMonocular, const int nThreads=1, const float fTargetKeyFrameRate=0);
+
+    ~LocalMapping();
 
     void SetLoopCloser(LoopClosing* pLoopCloser);
 
     void SetTracker(Tracking* pTracker);
 
+    // Budget of the whole atlas (0: no limit), bytes as estimated for MemoryUsage. Over it every
+    // new keyframe culls the most redundant keyframes and the weakest MapPoints of the area it
+    // sees, which is the one being revisited. Set before Run.
+    void SetMapBudget(const int nMaxKeyFrames, const int nMaxMapPoints, const size_t nMaxBytes);
+
+    // Sliding window odometry (0: off): only the last nKeyFrames keyframes are kept, older ones
+    // are erased from the map and the keyframe database with their MapPoints, and the local BA
+    // optimizes a fixed number of them. The loop closing must not detect loops. Set before Run.
+    void SetSlidingWindow(const int nKeyFrames);
+
+    // Cold storage of keyframes (0: off): the keypoints of a keyframe which has not been in a
+    // local BA for nKeyFrames keyframes are compacted (KeyFrame::Compact) and expanded again when
+    // the local mapping needs them. Set before Run.
+    void SetColdKeyFrames(const int nKeyFrames);
+
+    // What a keyframe processed while others wait behind it gets (LocalMapping.OverloadPolicy):
+    // SKIP_BA no local BA, the mapping catches up at the cost of the map. REDUCE_BA a local BA
+    // of only the nOverloadKeyFrames keyframes most covisible with it. Set before Run.
+    enum OverloadPolicy
+    {
+        SKIP_BA=0,
+        REDUCE_BA=1
+    };
+    void SetOverloadPolicy(const OverloadPolicy policy);
+
+    // Limits the window and the iterations of the local BA (Latency.Target). Set before Run.
+    void SetLatencyScheduler(LatencyScheduler* pScheduler);
+
+    // Backlog of the keyframe queue, the seconds each keyframe waited go to the stage timers
+    // (KeyFrameQueue)
+    struct QueueStats
+    {
+        QueueStats(): nInserted(0), nMaxQueued(0), nPostponed(0), nSkippedBA(0), nReducedBA(0), nResumed(0) {}
+
+        unsigned long nInserted;
+        size_t nMaxQueued;
+        // Keyframes the tracker needed but left for a later frame, the queue being full
+        unsigned long nPostponed;
+        // Keyframes processed with others waiting, by the overload policy
+        unsigned long nSkippedBA;
+        unsigned long nReducedBA;
+        // Stages skipped while others waited and run later, when the queue was empty
+        unsigned long nResumed;
+    };
+    QueueStats GetQueueStats();
+    // The tracker needed a keyframe and did not insert it
+    void PostponedKeyFrame();
+
     // Main function
     void Run();
 
-    void InsertKeyFrame(KeyFrame* pKF);
+    // bInterruptBA: the local BA in progress stops, otherwise the keyframe waits for it
+    void InsertKeyFrame(KeyFrame* pKF, const bool bInterruptBA=true);
 
     // Thread Synch
     void RequestStop();
@@ -58,6 +119,8 @@ public:
     bool Stop();
     void Release();
     bool isStopped();
+    // Blocks until Local Mapping has stopped (or finished) after RequestStop
+    void WaitUntilStopped();
     bool stopRequested();
     bool AcceptKeyFrames();
     void SetAcceptKeyFrames(bool flag);
@@ -67,10 +130,30 @@ public:
 
     void RequestFinish();
     bool isFinished();
+    void WaitUntilFinished();
+
+    // No keyframe is queued or being processed (or Local Mapping is stopped)
+    bool isIdle();
+
+    // Bytes of the local BA graph kept for the next keyframe, as of the last local BA
+    size_t GetLocalBAMemoryUsage() { return mnLocalBAMemory.load(std::memory_order_relaxed); }
+
+    // Smoothed seconds the mapping takes for a keyframe, negative before the first one
+    double GetKeyFrameCost() { return mfKeyFrameCost.load(std::memory_order_relaxed); }
 
+    // The camera stands still (StaticScene), the idle thread wakes up less often to pass its
+    // quiescent state. A new keyframe still wakes it up right away.
+    void SetParked(const bool bParked) { mbParked.store(bParked,std::memory_order_relaxed); }
+
+    // Sets bad the keyframes of vpKeyFrames whose MapPoints are seen by at least 3 other
+    // keyframes for 90% of them, the rule of the local culling, and returns how many. They are
+    // culled in one batch (KeyFrame::SetBadFlags). Also for a whole map after Shutdown
+    // (System::RefineMap), when the mapping thread does not run.
+    int CullRedundantKeyFrames(const std::vector<KeyFrame*> &vpKeyFrames);
+
+    // Without locking, the tracker reads it for every frame
     int KeyframesInQueue(){
-        unique_lock<std::mutex> lock(mMutexNewKFs);
-        return mlNewKeyFrames.size();
+        return mNewKeyFrames.Size();
     }
 
 protected:
@@ -79,51 +162,161 @@ protected:
     void ProcessNewKeyFrame();
     void CreateNewMapPoints();
 
+    // A match between the current keyframe and a neighbor which passed all triangulation checks
+    struct TriangulatedMatch
+    {
+        size_t idx1;
+        size_t idx2;
+        cv::Mat x3D;
+    };
+
+    // Matches and triangulates against one neighbor without changing the map, thread safe.
+    // vMatched1: the keypoints of the current keyframe matched, triangulated or not.
+    void TriangulateWithNeighbor(KeyFrame* pKF2, std::vector<TriangulatedMatch> &vTriangulated,
+                                 std::vector<size_t> &vMatched1);
+
     void MapPointCulling();
     void SearchInNeighbors();
 
     void KeyFrameCulling();
 
+    // Collects the neighborhood of the processed keyframe for the tracking (Map::mNeighborhoods)
+    void PublishNeighborhood();
+
+    // Culling of the area of the current keyframe while the map is over its budget
+    void BudgetCulling();
+    void CullKeyFramesOverBudget(const std::vector<KeyFrame*> &vpLocalKFs, const int nMaxCulled);
+    void CullMapPointsOverBudget(const std::vector<KeyFrame*> &vpLocalKFs, const int nMaxCulled);
+    // Running averages of the bytes of a keyframe and a MapPoint, from the current keyframe
+    void UpdateObjectSizes();
+
+    // Adds the current keyframe to the window and erases the ones which fell out of it
+    void SlidingWindowCulling();
+
+    // Compacts the keyframes which left the local window for mnColdKeyFrames keyframes
+    void CompactColdKeyFrames();
+
+    // Local BA of the current keyframe, within the period of the target keyframe rate if there is one.
+    // bReduced: the window of the overload policy.
+    void LocalBundleAdjustment(const std::chrono::steady_clock::time_point &tKeyFrameStart, const bool bReduced);
+
     cv::Mat ComputeF12(KeyFrame* &pKF1, KeyFrame* &pKF2);
 
     cv::Mat SkewSymmetricMatrix(const cv::Mat &v);
 
+    // Drops the pointers to bad MapPoints kept between iterations and announces
+    // a quiescent state to the reclaimer of the map
+    void PassQuiescentState();
+
+    // The mapping thread sleeps until there is something to do: a new keyframe, a stop,
+    // release, reset or finish request. It wakes up periodically to pass a quiescent state.
+    // A new keyframe only takes the mutex to wake the thread up while mbSleeping.
+    void WaitForWakeUp();
+    void WakeUp();
+    bool mbWakeUp;
+    std::atomic<bool> mbSleeping;
+    std::atomic<bool> mbParked;
+    std::mutex mMutexWakeUp;
+    std::condition_variable mCondWakeUp;
+
     bool mbMonocular;
 
+    bool CheckReset();
     void ResetIfRequested();
     bool mbResetRequested;
     std::mutex mMutexReset;
+    std::condition_variable mCondReset;
 
     bool CheckFinish();
     void SetFinish();
     bool mbFinishRequested;
     bool mbFinished;
     std::mutex mMutexFinish;
+    std::condition_variable mCondFinish;
 
     Map* mpMap;
+    int mnReclaimerId;
+
+    // Workers for the per neighbor work, the mapping thread takes part in it
+    ThreadPool* mpThreadPool;
 
     LoopClosing* mpLoopCloser;
     Tracking* mpTracker;
 
-    std::list<KeyFrame*> mlNewKeyFrames;
+    // NULL without a latency target
+    LatencyScheduler* mpLatencyScheduler;
+
+    // Tracking is the producer, the mapping thread the consumer, or the thread which releases it
+    // while it is stopped (under mMutexStop)
+    struct QueuedKeyFrame
+    {
+        KeyFrame* pKF;
+        std::chrono::steady_clock::time_point tQueued;
+    };
+    SPSCQueue<QueuedKeyFrame,64> mNewKeyFrames; //param
+
+    OverloadPolicy mOverloadPolicy;
+    QueueStats mQueueStats;
+    std::mutex mMutexQueueStats;
 
     KeyFrame* mpCurrentKeyFrame;
 
     std::list<MapPoint*> mlpRecentAddedMapPoints;
 
-    std::mutex mMutexNewKFs;
+    // Stages of a keyframe which newer keyframes preempted: the fusion with the neighbors was
+    // skipped, or the local BA was skipped or reduced by the overload policy. They are resumed
+    // one at a time while the queue is empty, the newest keyframe first, so a new keyframe
+    // preempts them again. Only the last kMaxDeferred keyframes are kept.
+    struct DeferredStages
+    {
+        KeyFrame* pKF;
+        bool bFusion;
+        bool bLocalBA;
+    };
+    std::list<DeferredStages> mlDeferredStages;
+    static const size_t kMaxDeferred = 4; //param
+    void DeferStages(const bool bFusion, const bool bLocalBA);
+    // Runs one stage of the newest deferred keyframe, false if there was none
+    bool ResumeDeferredStage();
 
     bool mbAbortBA;
 
+    // Local BA graph of the previous keyframe, updated for the next one
+    LocalBAProblem mLocalBAProblem;
+    std::atomic<size_t> mnLocalBAMemory;
+    std::atomic<double> mfKeyFrameCost;
+
+    float mfTargetKeyFrameRate;
+    // Local keyframes of the budgeted local BA (0: all), shrinks when the BA misses its deadline
+    int mnBAMaxKeyFrames;
+
+    // Map budget, 0: no limit
+    int mnMaxKeyFrames;
+    int mnMaxMapPoints;
+    size_t mnMaxBytes;
+    double mfKeyFrameBytes;
+    double mfMapPointBytes;
+
+    // Sliding window, 0: off. Oldest keyframe first.
+    int mnWindowKeyFrames;
+    std::list<KeyFrame*> mlpWindowKeyFrames;
+
+    // Cold storage, 0: off
+    int mnColdKeyFrames;
+
     bool mbStopped;
     bool mbStopRequested;
     bool mbNotStop;
     std::mutex mMutexStop;
+    std::condition_variable mCondStop;
 
     bool mbAcceptKeyFrames;
     std::mutex mMutexAccept;
 
     Parameter<bool> mVisualizeLocalMapping;
+    // Iterations of the two rounds of the local BA, before and after dropping the outliers
+    Parameter<int> mnLocalBAIterations;
+    Parameter<int> mnLocalBAOutlierIterations;
 };
 
 } //namespace ORB_SLAM
@@ -0,0 +1,69 @@
+#ifndef LOCALNEIGHBORHOOD_H
+#define LOCALNEIGHBORHOOD_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+class MapPoint;
+
+// Neighborhood of a keyframe which local mapping collected after processing it: the keyframe
+// and its covisible keyframes (the window of its local BA) and the map points they observe,
+// without duplicates. The version of the neighborhood is the change index of each of its
+// keyframes when they were read (KeyFrame::GetChangeIdx): it is only current while none of them
+// changed.
+struct LocalNeighborhood
+{
+    KeyFrame* pKF;
+    // pKF first, then by covisibility, with the change index of each
+    std::vector<KeyFrame*> vpKeyFrames;
+    std::vector<unsigned long> vnChangeIdx;
+    // In the order the keyframes observe them
+    std::vector<MapPoint*> vpMapPoints;
+
+    // Collects the neighborhood of pKF
+    void Build(KeyFrame* pKF);
+
+    // None of the keyframes changed since Build. Only then the points are still in them, and so
+    // none of them can have been freed (see Reclaimer).
+    bool IsCurrent() const;
+
+    bool Contains(KeyFrame* pKF) const;
+
+protected:
+    // vpKeyFrames by address
+    std::vector<KeyFrame*> mvpSortedKeyFrames;
+};
+
+// The neighborhoods local mapping published for the last kMaxNeighborhoods keyframes, for the
+// tracking, which collects its local map from them instead of the keyframes one by one. Any
+// thread.
+class LocalNeighborhoods
+{
+public:
+    typedef std::shared_ptr<const LocalNeighborhood> Snapshot;
+
+    static const size_t kMaxNeighborhoods = 4; //param
+
+    void Publish(const Snapshot &pNeighborhood);
+
+    // The last neighborhood published for pKF, NULL if none
+    Snapshot Get(KeyFrame* pKF);
+
+    // Before the keyframes are deleted (reset)
+    void Clear();
+
+protected:
+    // By keyframe mnId, the oldest are dropped first
+    std::map<unsigned long, Snapshot> mmNeighborhoods;
+    std::mutex mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // LOCALNEIGHBORHOOD_H
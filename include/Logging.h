@@ -33,6 +33,18 @@ public:
     };
 
     static const char* LogLevelNames[kLevelCount];
+
+    // In the asynchronous mode the threads which log format their records and only queue the
+    // lines in a lock free ring buffer of nCapacity lines, a writer thread writes them to the
+    // console. Lines which do not fit are dropped and counted, the writer reports how many.
+    // Off (the default) writes them on the logging thread, under the lock of the sink.
+    static void SetAsynchronous(const bool bAsync, const size_t nCapacity=4096);
+
+    // Number of records the asynchronous mode has dropped so far
+    static size_t GetNumDropped();
+
+    // Blocks until the writer thread has written what was queued before
+    static void Flush();
 };
 
 // names for the loglevels above
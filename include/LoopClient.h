@@ -0,0 +1,121 @@
+#ifndef LOOPCLIENT_H
+#define LOOPCLIENT_H
+
+#include "MapChangeLog.h"
+#include "ORBVocabulary.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <chrono>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+class Map;
+
+// Client end of the loop server link (see LoopServer.h for the messages), used by LoopClosing
+// when LoopClosing.Server is set, from the loop closing thread only. It never blocks: the
+// connection is made in the background and retried, the messages wait in an outbox until the
+// socket takes them. Every connection starts the replica of the server over, all keyframes of the
+// map are sent again first. Nothing is sent before the calibration of the frames is known.
+class LoopClient
+{
+public:
+
+    struct Correction
+    {
+        // LoopServer::CorrectionType
+        int type;
+        // Current and matched keyframe of a loop, loop keyframe of a global BA
+        unsigned long nKFId;
+        unsigned long nMatchedKFId;
+        // Largest keyframe id the server had, the keyframes above follow the correction of their
+        // parent
+        unsigned long nLastKFId;
+        // Keyframe id and its world correction, Twc after times Tcw before (4x4, CV_32F)
+        std::vector<std::pair<unsigned long, cv::Mat> > vCorrections;
+    };
+
+    // Map point id replaced by the second one
+    typedef std::vector<std::pair<unsigned long, unsigned long> > Fusions;
+
+    LoopClient(Map* pMap, const ORBVocabulary* pVoc, const bool bFixScale, const std::string &host, const int port);
+    ~LoopClient();
+
+    // Queues a keyframe which went through Local Mapping, with the map points the server does
+    // not have yet
+    void SendKeyFrame(KeyFrame* pKF);
+
+    // Connects if needed, sends the changes of the map at most every UPDATE_PERIOD and what is
+    // queued, and returns the corrections and fusions received since the last call
+    void Poll(std::vector<Correction> &vCorrections, std::vector<Fusions> &vFusions);
+
+    // Before a correction from Poll is applied: sends the changes made before it, which the server
+    // drops, it is a correction ahead. CorrectionApplied once it is applied.
+    void SendChanges();
+    void CorrectionApplied();
+
+    // The map is being cleared, the server starts over with the next connection
+    void Reset();
+
+protected:
+
+    enum State
+    {
+        DISCONNECTED,
+        CONNECTING,
+        CONNECTED
+    };
+
+    bool Connect();
+    bool CheckConnected();
+    void Close();
+
+    // HELLO and every keyframe of the map
+    void SendMap();
+    void SendUpdate();
+
+    // False if the connection is gone
+    bool Send();
+    bool Receive(std::vector<Correction> &vCorrections, std::vector<Fusions> &vFusions);
+
+    Map* mpMap;
+    const ORBVocabulary* mpVocabulary;
+    bool mbFixScale;
+    std::string mHost;
+    int mPort;
+
+    State mState;
+    int mnFd;
+    std::chrono::steady_clock::time_point mtLastAttempt;
+    std::chrono::steady_clock::time_point mtLastUpdate;
+
+    // Encoded messages not sent yet, from mnSent on
+    std::string mOutbox;
+    size_t mnSent;
+    // Received, not a complete message yet
+    std::string mInbox;
+
+    // Corrections applied since the connection was made
+    unsigned int mnEpoch;
+
+    // Keyframes and map points the server got
+    std::unordered_set<unsigned long> msSentKeyFrames;
+    std::unordered_set<unsigned long> msSentPoints;
+
+    // Reset until the map is cleared, which the change log tells
+    bool mbWaitForClear;
+
+    int mnChangeLogConsumer;
+    std::vector<MapChangeLog::PointChange> mvPointChanges;
+    std::vector<MapChangeLog::KeyFrameChange> mvKeyFrameChanges;
+};
+
+} //namespace ORB_SLAM
+
+#endif // LOOPCLIENT_H
@@ -22,13 +22,19 @@
 #define LOOPCLOSING_H
 
 #include "KeyFrame.h"
+#include "EssentialGraph.h"
 #include "LocalMapping.h"
 #include "Map.h"
 #include "ORBVocabulary.h"
 #include "Tracking.h"
 #include "KeyFrameDatabase.h"
+#include "LoopClient.h"
+#include "LatencyScheduler.h"
 #include "Parameter.h"
+#include "ThreadPool.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <thread>
 #include <mutex>
 #include "Thirdparty/g2o/g2o/types/types_seven_dof_expmap.h"
@@ -45,27 +51,124 @@ class LoopClosing
 {
 public:
 
-    typedef pair<set<KeyFrame*>,int> ConsistentGroup;
+    // Covisibility groups of the loop candidates of a keyframe: the sorted ids of the keyframes
+    // of all groups back to back in one buffer, and a consistency counter per group. Clear keeps
+    // the buffers, so the two sets swapped from keyframe to keyframe stop allocating once they
+    // reached the largest size, unless a dense area left them over MAX_POOLED_IDS.
+    struct ConsistentGroups
+    {
+        static const size_t MAX_POOLED_IDS = 1<<16; //param
+
+        ConsistentGroups(): vBegin(1,0) {}
+
+        size_t Size() const { return vConsistency.size(); }
+        const long unsigned int* Begin(const size_t i) const { return vIds.data()+vBegin[i]; }
+        const long unsigned int* End(const size_t i) const { return vIds.data()+vBegin[i+1]; }
+        int Consistency(const size_t i) const { return vConsistency[i]; }
+
+        void Add(const std::vector<long unsigned int> &vGroup, const int nConsistency)
+        {
+            vIds.insert(vIds.end(),vGroup.begin(),vGroup.end());
+            vBegin.push_back(vIds.size());
+            vConsistency.push_back(nConsistency);
+        }
+
+        void Clear()
+        {
+            if(vIds.capacity()>MAX_POOLED_IDS)
+                std::vector<long unsigned int>().swap(vIds);
+            vIds.clear();
+            vBegin.resize(1);
+            vConsistency.clear();
+        }
+
+        std::vector<long unsigned int> vIds;
+        // Group i is [vBegin[i],vBegin[i+1]) of vIds
+        std::vector<size_t> vBegin;
+        std::vector<int> vConsistency;
+    };
+
     typedef map<KeyFrame*,g2o::Sim3,std::less<KeyFrame*>,
         Eigen::aligned_allocator<std::pair<const KeyFrame*, g2o::Sim3> > > KeyFrameAndPose;
 
 public:
 
-    LoopClosing(Map* pMap, KeyFrameDatabase* pDB, ORBVocabulary* pVoc,const bool bFixScale);
+    // Maps with more than nMaxGBAKeyFrames keyframes only optimize the nMaxGBAKeyFrames keyframes
+    // around the loop after closing it (0: always the whole map). The global BA stops iterating
+    // after fGBATimeBudget seconds (0: no limit). nThreads threads (including the loop closing
+    // thread) compute the Sim3 of the loop candidates.
+    LoopClosing(Map* pMap, KeyFrameDatabase* pDB, ORBVocabulary* pVoc,const bool bFixScale,
+                const int nMaxGBAKeyFrames=0, const float fGBATimeBudget=0, const int nThreads=1);
 
     void SetTracker(Tracking* pTracker);
 
     void SetLocalMapper(LocalMapping* pLocalMapper);
 
+    // The loops are closed by a loop server (LoopServer) instead: the keyframes are streamed to
+    // it through pClient and the corrections it sends back are applied to the map. Before Run.
+    void SetClient(LoopClient* pClient);
+    bool HasClient() const { return mpClient!=NULL; }
+
+    // Without loop detection (the sliding window odometry of LocalMapping) the keyframes only go
+    // to the database for the relocalization. Before Run.
+    void SetLoopDetection(const bool bDetectLoops);
+
+    // Backlog policy (0: off for each). Only the newest nMaxQueue queued keyframes query the
+    // database for loops, the older ones are stale after a long correction and only go to the
+    // database. A keyframe closer than fMinInterval seconds and fMinDistance (map units) to the
+    // last query of its map does not query either. Before Run.
+    void SetQueryPolicy(const int nMaxQueue, const float fMinInterval, const float fMinDistance);
+
+    // Bound of the drift (map units, 0: off): the loop candidates of the map of a keyframe are
+    // the keyframes within fRadius of it, the farther ones are not even scored. The other maps of
+    // the atlas are not bounded. Before Run.
+    void SetCandidateRadius(const float fRadius);
+
+    // A global BA waits while the scheduler keeps the cores for the tracking (Latency.Target).
+    // Before Run.
+    void SetLatencyScheduler(LatencyScheduler* pScheduler);
+
+    // The BoW matches of all loop candidates are computed at once
+    // (ORBmatcher.batchCandidates), the candidates are verified by decreasing number of matches.
+    // Before Run.
+    void SetBatchMatching();
+
+    // Counts since the start, any thread
+    struct QueueStats
+    {
+        QueueStats(): nQueued(0), nMaxQueued(0), nInserted(0), nQueried(0), nStale(0), nSpaced(0) {}
+
+        size_t nQueued;
+        size_t nMaxQueued;
+        unsigned long nInserted;
+        // Keyframes which queried the database for loop candidates
+        unsigned long nQueried;
+        // Skipped for the backlog and for the spacing
+        unsigned long nStale;
+        unsigned long nSpaced;
+    };
+    QueueStats GetQueueStats();
+
     // Main function
     void Run();
 
+    // For the loop server, which updates its map and closes the loops from one thread of its own
+    // instead of Run. Nothing else changes the map meanwhile, so there is no Local Mapping to
+    // stop. AttachThread and DetachThread enclose the calls of that thread, ProcessQueue detects
+    // and corrects the loops of the keyframes queued and ResetQueue drops them before a clear.
+    void AttachThread();
+    void DetachThread();
+    void ProcessQueue();
+    void ResetQueue();
+
     void InsertKeyFrame(KeyFrame *pKF);
 
     void RequestReset();
 
-    // This function will run in a separate thread
-    void RunGlobalBundleAdjustment(unsigned long nLoopKF);
+    // This function will run in a separate thread. If vpRegionKFs is not empty only these
+    // keyframes are optimized, the rest of the map stays as it is. Local mapping is not stopped,
+    // the result is merged back under the map update mutex.
+    void RunGlobalBundleAdjustment(unsigned long nLoopKF, std::vector<KeyFrame*> vpRegionKFs);
 
     bool isRunningGBA(){
         unique_lock<std::mutex> lock(mMutexGBA);
@@ -76,9 +179,16 @@ public:
         return mbFinishedGBA;
     }
 
+    // Blocks until no Global Bundle Adjustment thread is running
+    void WaitForGBA();
+
     void RequestFinish();
 
     bool isFinished();
+    void WaitUntilFinished();
+
+    // No keyframe is queued or being processed and no Global Bundle Adjustment is running
+    bool isIdle();
 
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -86,25 +196,63 @@ protected:
 
     bool CheckNewKeyFrames();
 
+    // False if pKF is too close in time or space to the last query of its map, which it becomes
+    // otherwise
+    bool SpacedFromLastQuery(KeyFrame* pKF);
+
     bool DetectLoop();
 
     bool ComputeSim3();
 
+    // Matches, RANSAC and Sim3 optimization of one candidate, run concurrently for all of them.
+    // The first candidate whose Sim3 is supported by enough inliers sets bMatch, which stops the
+    // others, and hands out its transformation and matches. Returns true for that candidate.
+    // bBoWMatched: the BoW matches are in mvvpCandidateMatches already.
+    bool EvaluateSim3Candidate(KeyFrame* pKF, const int nIndex, std::atomic<bool> &bMatch,
+                               std::atomic<int> &nCandidates, g2o::Sim3 &gScm,
+                               std::vector<MapPoint*> &vpMatchedPoints, const bool bBoWMatched);
+
     void SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap);
 
+    // Keyframes closest to the loop in the covisibility graph, empty if the whole map is optimized
+    std::vector<KeyFrame*> GetGBARegion();
+
     void CorrectLoop();
 
+    // Detects and corrects the loop of the next keyframe of the queue
+    void ProcessKeyFrame();
+
+    // Remote loop closing: streams the queued keyframes and applies what the server sent
+    void ServeClient();
+    void ApplyCorrection(const LoopClient::Correction &correction);
+    void ApplyFusions(const LoopClient::Fusions &vFusions);
+
+    // Drops the pointers to bad MapPoints and KeyFrames kept between iterations and
+    // announces a quiescent state to the reclaimer of the map
+    void PassQuiescentState();
+
+    // The loop closing thread sleeps until a keyframe is queued or a reset or finish is
+    // requested. It wakes up periodically to pass a quiescent state.
+    void WaitForWakeUp();
+    void WakeUp();
+    bool mbWakeUp;
+    std::mutex mMutexWakeUp;
+    std::condition_variable mCondWakeUp;
+
     void ResetIfRequested();
     bool mbResetRequested;
     std::mutex mMutexReset;
+    std::condition_variable mCondReset;
 
     bool CheckFinish();
     void SetFinish();
     bool mbFinishRequested;
     bool mbFinished;
     std::mutex mMutexFinish;
+    std::condition_variable mCondFinish;
 
     Map* mpMap;
+    int mnReclaimerId;
     Tracking* mpTracker;
 
     KeyFrameDatabase* mpKeyFrameDB;
@@ -112,9 +260,35 @@ protected:
 
     LocalMapping *mpLocalMapper;
 
+    LoopClient* mpClient;
+
+    // NULL without a latency target
+    LatencyScheduler* mpLatencyScheduler;
+
+    bool mbDetectLoops;
+
+    // Local mapping and the loop server both queue keyframes and culled ones are erased from the
+    // middle, so the queue stays a list under mMutexLoopQueue. Its size is mirrored in mnQueued
+    // (SyncQueued under the mutex) for the polls which only need to know whether it is empty.
     std::list<KeyFrame*> mlpLoopKeyFrameQueue;
+    std::atomic<size_t> mnQueued;
+    void SyncQueued() { mnQueued.store(mlpLoopKeyFrameQueue.size(), std::memory_order_release); }
+
+    // Backlog policy and the last keyframe which queried
+    size_t mnMaxQueue;
+    float mfMinQueryInterval;
+    float mfMinQueryDistance;
+    float mfCandidateRadius;
+    bool mbLastQuery;
+    unsigned long mnLastQueryMapId;
+    double mLastQueryTime;
+    Eigen::Vector3f mLastQueryCenter;
+    // With mMutexLoopQueue
+    QueueStats mQueueStats;
 
     std::mutex mMutexLoopQueue;
+    // A keyframe taken from the queue is being processed
+    bool mbProcessing;
 
     // Loop detector parameters
     float mnCovisibilityConsistencyTh;
@@ -122,8 +296,16 @@ protected:
     // Loop detector variables
     KeyFrame* mpCurrentKF;
     KeyFrame* mpMatchedKF;
-    std::vector<ConsistentGroup> mvConsistentGroups;
+    ConsistentGroups mConsistentGroups;
+    // Filled for the next keyframe and swapped with mConsistentGroups, both keep their buffers
+    ConsistentGroups mNextConsistentGroups;
+    std::vector<long unsigned int> mvnCandidateGroup;
+    std::vector<bool> mvbConsistentGroup;
     std::vector<KeyFrame*> mvpEnoughConsistentCandidates;
+    // BoW and RANSAC inlier matches of every candidate of ComputeSim3, by its index, kept with
+    // their capacity from keyframe to keyframe
+    std::vector<std::vector<MapPoint*> > mvvpCandidateMatches;
+    std::vector<std::vector<MapPoint*> > mvvpCandidateInliers;
     std::vector<KeyFrame*> mvpCurrentConnectedKFs;
     std::vector<MapPoint*> mvpCurrentMatchedPoints;
     std::vector<MapPoint*> mvpLoopMapPoints;
@@ -132,12 +314,22 @@ protected:
 
     long unsigned int mLastLoopKFid;
 
+    // Essential graph edges and solver of the loop corrections so far
+    EssentialGraph mEssentialGraph;
+
     // Variables related to Global Bundle Adjustment
     bool mbRunningGBA;
     bool mbFinishedGBA;
     bool mbStopGBA;
     std::mutex mMutexGBA;
+    std::condition_variable mCondGBA;
     std::thread* mpThreadGBA;
+    int mnMaxGBAKeyFrames;
+    float mfGBATimeBudget;
+
+    ThreadPool* mpThreadPool;
+    // False: every candidate is matched on its own
+    bool mbBatchMatching;
 
     // Fix scale in the stereo/RGB-D case
     bool mbFixScale;
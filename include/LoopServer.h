@@ -0,0 +1,146 @@
+#ifndef LOOPSERVER_H
+#define LOOPSERVER_H
+
+#include "MapChangeLog.h"
+#include "MapEvents.h"
+#include "ORBVocabulary.h"
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrameDatabase;
+class LoopClosing;
+class Map;
+
+// Closes the loops of a remote System (LoopClosing.Server) on a machine of its own, so the place
+// recognition, the essential graph optimization and the global BA do not compete with the
+// tracking. The server keeps a replica of the map of its client with the keyframes and map
+// points it streams, closes the loops there with an ordinary LoopClosing and sends back how every
+// keyframe moved, which the client applies to its own map. One client at a time, every
+// connection starts the replica over.
+//
+// Every message is a 32 bit length of the rest, then a byte with the type, then the payload.
+// Numbers are in the byte order of the hosts (both ends are builds of the same code), poses are
+// 12 floats, the rotation row major then the translation. The blocks are the ones of the map
+// file (MapSerializer), each with a 32 bit size first.
+// From the client:
+//   HELLO       vocabulary size, fix scale (8 bit), fx,fy,cx,cy,minX,maxX,minY,maxY and the grid
+//               cell sizes of the calibration
+//   KEYFRAME    epoch, map id (64 bit), has parent (8 bit) and the pose of the parent, keyframe
+//               block, count and the map point id of every keypoint (64 bit, -1 for none), count
+//               and the blocks of the map points the server does not have yet
+//   UPDATE      epoch, count and id,pose of the keyframes moved, count and id,x,y,z of the map
+//               points moved, count and the ids of the keyframes erased, same for the map points
+// From the server:
+//   CORRECTION  type (8 bit), keyframe and matched keyframe, largest keyframe id of the server,
+//               count and id,Twc after times Tcw before (3x4) of every keyframe moved, ids 64 bit
+//   FUSIONS     count and the 64 bit ids of a map point and the one which replaced it
+// The epoch is the number of corrections the client applied. The server drops the poses and
+// positions of the messages from an epoch it already corrected, a keyframe of such a message is
+// placed relative to its parent instead.
+class LoopServer
+{
+public:
+
+    enum MessageType
+    {
+        HELLO=1,
+        KEYFRAME=2,
+        UPDATE=3,
+        CORRECTION=4,
+        FUSIONS=5
+    };
+
+    enum CorrectionType
+    {
+        LOOP=0,
+        GLOBAL_BA=1
+    };
+
+    // Listens on all interfaces. The other parameters are the ones of LoopClosing.
+    LoopServer(ORBVocabulary* pVoc, const int port, const int nMaxGBAKeyFrames=0, const float fGBATimeBudget=0,
+               const int nThreads=1);
+    ~LoopServer();
+
+    // Main function
+    void Run();
+
+    void RequestFinish();
+    bool isFinished();
+
+protected:
+
+    struct Client
+    {
+        int fd;
+        // Received, not a complete message yet
+        std::string inbox;
+        // Messages not sent yet, from nSent on
+        std::string outbox;
+        size_t nSent;
+    };
+
+    bool Listen();
+    void AcceptClient();
+
+    // False if the client is gone or sent a corrupt message
+    bool Receive();
+    bool Send();
+    void CloseClient();
+
+    bool HandleHello(const char* pData, const size_t nSize);
+    bool HandleKeyFrame(const char* pData, const size_t nSize);
+    bool HandleUpdate(const char* pData, const size_t nSize);
+
+    // Corrections the server made since the client connected, under mMutexMapUpdate
+    unsigned int GetEpoch();
+
+    // From the dispatcher thread of the map events
+    void OnMapEvent(const MapEvents::Event &event);
+    // The map points the loop closing replaced
+    void CollectFusions();
+
+    bool CheckFinish();
+    void SetFinish();
+
+    ORBVocabulary* mpVocabulary;
+    int mPort;
+    int mnMaxGBAKeyFrames;
+    float mfGBATimeBudget;
+    int mnThreads;
+
+    Map* mpMap;
+    KeyFrameDatabase* mpKeyFrameDB;
+    // Created with the fix scale of the first client
+    LoopClosing* mpLoopCloser;
+    bool mbFixScale;
+    std::thread* mptMapEvents;
+
+    int mnListenFd;
+    Client mClient;
+
+    int mnEpochBase;
+
+    int mnChangeLogConsumer;
+    std::vector<MapChangeLog::PointChange> mvPointChanges;
+
+    // Corrections encoded by OnMapEvent for the client. The events of before the last clear of the
+    // map are dropped, they count the RESET events they see against the clears.
+    std::string mPending;
+    unsigned int mnResets;
+    unsigned int mnResetsSeen;
+    std::mutex mMutexPending;
+
+    bool mbFinishRequested;
+    bool mbFinished;
+    std::mutex mMutexFinish;
+};
+
+} //namespace ORB_SLAM
+
+#endif // LOOPSERVER_H
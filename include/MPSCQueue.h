@@ -0,0 +1,99 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace ORB_SLAM2
+{
+
+// Bounded ring of values with any number of producers and one consumer (Vyukov's queue), the
+// capacity is rounded up to a power of two. The slot of position p is free for the producer which
+// claims p when its sequence is p and readable when it is p+1, so producers only contend on
+// claiming a position. The values are swapped in and out, a string keeps its buffer.
+template<class T>
+class MPSCQueue
+{
+public:
+    explicit MPSCQueue(const size_t nCapacity)
+    {
+        size_t n = 1;
+        while(n<nCapacity)
+            n <<= 1;
+        mnMask = n-1;
+        mpSlots.reset(new Slot[n]);
+        for(size_t i=0; i<n; i++)
+            mpSlots[i].nSequence.store(i,std::memory_order_relaxed);
+        mnEnqueue.store(0,std::memory_order_relaxed);
+        mnDequeue = 0;
+    }
+
+    // false if the ring is full
+    bool Push(T &value)
+    {
+        size_t pos = mnEnqueue.load(std::memory_order_relaxed);
+        Slot* pSlot;
+        while(true)
+        {
+            pSlot = &mpSlots[pos&mnMask];
+            const size_t seq = pSlot->nSequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq)-static_cast<std::ptrdiff_t>(pos);
+            if(diff==0)
+            {
+                if(mnEnqueue.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                    break;
+            }
+            else if(diff<0)
+                return false;
+            else
+                pos = mnEnqueue.load(std::memory_order_relaxed);
+        }
+
+        std::swap(pSlot->value,value);
+        pSlot->nSequence.store(pos+1,std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only
+    bool Pop(T &value)
+    {
+        Slot &slot = mpSlots[mnDequeue&mnMask];
+        if(slot.nSequence.load(std::memory_order_acquire)!=mnDequeue+1)
+            return false;
+
+        std::swap(value,slot.value);
+        slot.nSequence.store(mnDequeue+mnMask+1,std::memory_order_release);
+        mnDequeue++;
+        return true;
+    }
+
+    // Consumer only, true if Pop would return a value
+    bool Readable() const
+    {
+        return mpSlots[mnDequeue&mnMask].nSequence.load(std::memory_order_acquire)==mnDequeue+1;
+    }
+
+    // Positions claimed by producers so far
+    size_t Claimed() const
+    {
+        return mnEnqueue.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> nSequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> mpSlots;
+    size_t mnMask;
+    std::atomic<size_t> mnEnqueue;
+    size_t mnDequeue;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MPSCQUEUE_H
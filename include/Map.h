@@ -23,7 +23,19 @@
 
 #include "MapPoint.h"
 #include "KeyFrame.h"
+#include "IndexedStore.h"
+#include "MapChangeLog.h"
+#include "FrameContext.h"
+#include "MapEvents.h"
+#include "MapMutex.h"
+#include "StageTimer.h"
+#include "MapPointIndex.h"
+#include "LocalNeighborhood.h"
+#include "Reclaimer.h"
+#include "DepthStore.h"
+#include <atomic>
 #include <set>
+#include <stdint.h>
 
 #include <mutex>
 
@@ -42,8 +54,11 @@ public:
 
     void AddKeyFrame(KeyFrame* pKF);
     void AddMapPoint(MapPoint* pMP);
-    void EraseMapPoint(MapPoint* pMP);
-    void EraseKeyFrame(KeyFrame* pKF);
+    // Return false if the object was not in the map (already erased)
+    bool EraseMapPoint(MapPoint* pMP);
+    // Many under one lock, vpErased gets those which were in the map
+    void EraseMapPoints(const std::vector<MapPoint*> &vpMPs, std::vector<MapPoint*> &vpErased);
+    bool EraseKeyFrame(KeyFrame* pKF);
     void SetReferenceMapPoints(const std::vector<MapPoint*> &vpMPs);
     void InformNewBigChange();
     int GetLastBigChangeIdx();
@@ -52,34 +67,134 @@ public:
     std::vector<MapPoint*> GetAllMapPoints();
     std::vector<MapPoint*> GetReferenceMapPoints();
 
+    // Read only views of all keyframes / map points. The same copy is handed out
+    // until the map changes, use these instead of GetAll* when the result is only read.
+    IndexedStore<KeyFrame>::Snapshot GetKeyFramesSnapshot();
+    IndexedStore<MapPoint>::Snapshot GetMapPointsSnapshot();
+
+    // By mnId, NULL if it is not in the map (never inserted or erased)
+    KeyFrame* GetKeyFrame(const long unsigned int nId);
+    MapPoint* GetMapPoint(const long unsigned int nId);
+
     long unsigned int MapPointsInMap();
     long unsigned  KeyFramesInMap();
+    // Keyframes with KeyFrame::mnMapId nMapId
+    long unsigned int KeyFramesInMap(const long unsigned int nMapId);
 
     long unsigned int GetMaxKFid();
 
     void clear();
+    // Empties the map without deleting its keyframes and map points, which moved to another map
+    void Release();
+
+    // The map is an atlas of separate maps when the tracking started over after a loss
+    // (Atlas.nLostFrames). Every keyframe has the id of its map, the root of the spanning tree
+    // of each map is its origin, which stays fixed in the bundle adjustments and is never erased.
+    // Add the origin before its first UpdateConnections.
+    void AddOrigin(KeyFrame* pKF);
+    void EraseOrigin(KeyFrame* pKF);
+    bool IsOrigin(KeyFrame* pKF);
+    std::vector<KeyFrame*> GetOrigins();
+
+    // Under mMutexMapUpdate, after a loop closure aligned the map nMapId with the map of pKF.
+    // Its keyframes move to the map of pKF and its origin becomes a child of pKF.
+    void MergeMap(const long unsigned int nMapId, KeyFrame* pKF);
+
+    // Taken through MapUpdateLock by the writers of the map
+    MapMutex mMutexMapUpdate{"Map::mMutexMapUpdate"};
+
+    // Counts the acquisitions and releases of mMutexMapUpdate, odd while someone holds it. The
+    // tracking estimates a pose without the mutex, a different version when it takes it after
+    // means the map was written meanwhile.
+    unsigned long GetUpdateVersion() const { return mnUpdateVersion; }
 
-    vector<KeyFrame*> mvpKeyFrameOrigins;
+    // This avoid that two points are created simultaneously in separate threads (id conflict)
+    MapMutex mMutexPointCreation{"Map::mMutexPointCreation"};
 
-    std::mutex mMutexMapUpdate;
+    // Ids of the next KeyFrame (only created by the tracking) and MapPoint (under mMutexPointCreation)
+    long unsigned int mnNextKeyFrameId;
+    long unsigned int mnNextMapPointId;
+    // Id of the next map of the atlas, only changed by the tracking
+    long unsigned int mnNextMapId;
+    // Hash of the settings of the System (Settings::GetHash), saved with the map
+    uint64_t mnSettingsHash;
 
-    // This avoid that two points are created simultaneously in separate threads (id conflict)
-    std::mutex mMutexPointCreation;
+    // Calibration and frame ids of the frames tracked against this map
+    FrameContext mFrameContext;
+
+    // Bad MapPoints and KeyFrames are handed over here once they are erased from the map
+    Reclaimer mReclaimer;
+
+    // Spatial index of the map points, disabled unless a voxel size is set
+    MapPointIndex mPointIndex;
+
+    // Neighborhoods of the last keyframes local mapping processed, for the local map of the tracking
+    LocalNeighborhoods mNeighborhoods;
+
+    // Changes of the map points for the viewer, disabled unless it uses them
+    MapChangeLog mChangeLog;
+
+    // Keyframes added and erased, loop corrections, global BA results and resets for the
+    // subscribers of System::SubscribeMapEvents
+    MapEvents mEvents;
+
+    // Durations of the stages timed by the threads of the System of this map
+    StageTimeSet mStageTimes;
+
+    // Compressed depth images of the RGB-D keyframes, disabled unless KeyFrameDepth.Retain is set
+    DepthStore mKeyFrameDepths;
 
 protected:
-    std::set<MapPoint*> mspMapPoints;
-    std::set<KeyFrame*> mspKeyFrames;
+    IndexedStore<MapPoint> mMapPoints;
+    IndexedStore<KeyFrame> mKeyFrames;
 
     std::vector<MapPoint*> mvpReferenceMapPoints;
 
+    std::vector<KeyFrame*> mvpKeyFrameOrigins;
+
     long unsigned int mnMaxKFid;
 
     // Index related to a big change in the map (loop closure, global BA)
     int mnBigChangeIdx;
 
+    std::atomic<unsigned long> mnUpdateVersion;
+    friend class MapUpdateLock;
+
     std::mutex mMutexMap;
 };
 
+// Holds Map::mMutexMapUpdate and counts it in the update version, lock with the call site marked:
+//   MapUpdateLock lock(pMap,LOCK_SITE(pMap->mMutexMapUpdate));
+class MapUpdateLock
+{
+public:
+    MapUpdateLock(Map* pMap, MapMutex &mutex): mpMap(pMap), mLock(mutex, std::defer_lock) { lock(); }
+    ~MapUpdateLock() { if(mLock.owns_lock()) unlock(); }
+
+    void lock()
+    {
+        mLock.lock();
+        mnAcquiredVersion = mpMap->mnUpdateVersion++;
+    }
+
+    void unlock()
+    {
+        mpMap->mnUpdateVersion++;
+        mLock.unlock();
+    }
+
+    // The version found at the last acquisition, every writer before has finished
+    unsigned long GetAcquiredVersion() const { return mnAcquiredVersion; }
+
+private:
+    MapUpdateLock(const MapUpdateLock&);
+    MapUpdateLock& operator=(const MapUpdateLock&);
+
+    Map* mpMap;
+    std::unique_lock<MapMutex> mLock;
+    unsigned long mnAcquiredVersion;
+};
+
 } //namespace ORB_SLAM
 
 #endif // MAP_H
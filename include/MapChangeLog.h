@@ -0,0 +1,100 @@
+#ifndef MAPCHANGELOG_H
+#define MAPCHANGELOG_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+namespace ORB_SLAM2
+{
+
+class MapPoint;
+class KeyFrame;
+
+// Changes of the map since each of its consumers (the MapDrawer, the MapStreamer) last took
+// them: map points added to the map, moved by SetWorldPos (BA, loop correction) and erased, each
+// with the id and the position at the time, so a consumer never touches the points themselves.
+// Consumers which ask for them also get the keyframes added, moved by SetPose and erased.
+// Nothing is recorded until the first consumer registers. After a clear of the map, or when a
+// consumer falls too far behind, the log asks it to start over from the map instead.
+class MapChangeLog
+{
+public:
+
+    struct PointChange
+    {
+        unsigned long nId;
+        Eigen::Vector3f pos;
+        bool bErased;
+        // Id of the point which took the place of an erased one (MapPoint::Replace), -1 otherwise
+        long nReplacedBy;
+    };
+
+    struct KeyFrameChange
+    {
+        unsigned long nId;
+        // Camera to world, unaligned so the changes can live in a std::vector
+        Eigen::Quaternion<float,Eigen::DontAlign> qwc;
+        Eigen::Vector3f Ow;
+        bool bErased;
+    };
+
+    // Changes kept at most per consumer before it has to start over
+    static const size_t MAX_CHANGES = 1<<20; //param
+
+    MapChangeLog();
+
+    // Starts recording for a new consumer, its first Take asks for a full rebuild.
+    // Returns the id the consumer takes its changes with.
+    int AddConsumer(const bool bKeyFrames=false);
+    bool IsEnabled() const { return mbEnabled.load(std::memory_order_relaxed); }
+
+    void Insert(MapPoint* pMP);
+    // pReplacedBy: the point which took its place, if it was replaced
+    void Erase(MapPoint* pMP, MapPoint* pReplacedBy);
+    // Called after the position of pMP changed to Pos
+    void Update(MapPoint* pMP, const Eigen::Vector3f &Pos);
+
+    void Insert(KeyFrame* pKF);
+    void Erase(KeyFrame* pKF);
+    // Called after the pose of pKF changed
+    void Update(KeyFrame* pKF, const Eigen::Matrix3f &Rcw, const Eigen::Vector3f &Ow);
+
+    // The map was cleared
+    void Clear();
+
+    // Swaps the changes since the last call into the vectors, in the order they happened. False if
+    // the consumer has to rebuild from the map, changes later than the call still follow.
+    bool Take(const int nConsumer, std::vector<PointChange> &vChanges);
+    bool Take(const int nConsumer, std::vector<PointChange> &vChanges, std::vector<KeyFrameChange> &vKeyFrameChanges);
+
+protected:
+
+    struct Consumer
+    {
+        std::vector<PointChange> vPoints;
+        std::vector<KeyFrameChange> vKeyFrames;
+        bool bKeyFrames;
+        bool bRebuild;
+    };
+
+    bool IsKeyFramesEnabled() const { return mbKeyFramesEnabled.load(std::memory_order_relaxed); }
+
+    void Add(const PointChange &change);
+    void Add(const KeyFrameChange &change);
+    // Starts the consumer over if it holds too many changes, true if it did
+    bool Overflow(Consumer &consumer);
+
+    std::atomic<bool> mbEnabled;
+    std::atomic<bool> mbKeyFramesEnabled;
+    std::vector<Consumer> mvConsumers;
+
+    std::mutex mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPCHANGELOG_H
@@ -0,0 +1,114 @@
+#ifndef MAPCHECKPOINT_H
+#define MAPCHECKPOINT_H
+
+#include "MapChangeLog.h"
+#include "ORBVocabulary.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class Map;
+
+// Writes checkpoints of the map while the system runs (Checkpoint.File), so a crash or a power
+// loss loses at most Checkpoint.Period seconds of mapping, on a thread of its own which
+// Threads.Checkpoint can give a low priority. A checkpoint holds Map::mMutexMapUpdate only to
+// find what changed and to read the poses of the keyframes and the geometries of the map points
+// which moved, at one instant between two updates of local mapping or loop closing. The blocks
+// of the objects are encoded after, without the mutex, and the next checkpoint writes again the
+// objects which changed meanwhile.
+//
+// The first checkpoint, the first after a reset and every MaxDeltas-th after a base write the
+// whole map with MapSerializer::Save, the ones between only the changes since the last one
+// (MapSerializer::SaveDelta): the keyframes which are new or whose links changed, the map points
+// which are new or observed by them, the poses and geometries which moved and the erased ids.
+// For File "prefix":
+//   prefix             manifest, "<generation> <number of deltas>"
+//   prefix.G.map       base of generation G
+//   prefix.G.N.delta   deltas after it, delta 0 holds the poses and geometries of the base
+// Every file is written to .tmp and renamed once complete, the manifest last, so a crash at any
+// point leaves the last complete checkpoint. The files of the generation before are removed once
+// the manifest names a new base.
+class MapCheckpointer
+{
+public:
+
+    MapCheckpointer(Map* pMap, const ORBVocabulary* pVoc, const std::string &prefix, const float fPeriod,
+                    const int nMaxDeltas);
+    // Stops the thread without a last checkpoint
+    ~MapCheckpointer();
+
+    // The map is cleared or loaded between the two calls, a checkpoint which is running finishes
+    // first
+    void Pause();
+    void Release();
+
+    // Writes a last checkpoint, once nothing changes the map anymore, and stops the thread
+    void Finish();
+    // Stops the thread without a last checkpoint
+    void Stop();
+
+    // Merges the checkpoint of the manifest prefix into a map file for MapSerializer::Load
+    static bool Restore(const std::string &prefix, const ORBVocabulary* pVoc, const std::string &outFile);
+
+protected:
+
+    struct KeyFrameStamp
+    {
+        unsigned long nChangeIdx;
+        unsigned long nPoseEpoch;
+    };
+
+    static std::string BaseFile(const std::string &prefix, const int nGeneration);
+    static std::string DeltaFile(const std::string &prefix, const int nGeneration, const int nDelta);
+    // False if there is no manifest
+    static bool ReadManifest(const std::string &prefix, int &nGeneration, int &nDeltas);
+
+    void Run();
+    void StopThread(const bool bLast);
+
+    // False if nothing was written, because the map is empty or a file failed
+    bool Checkpoint();
+    bool Write();
+
+    bool WriteManifest(const int nGeneration, const int nDeltas);
+    void RemoveGeneration(const int nGeneration, const int nDeltas);
+
+    Map* mpMap;
+    const ORBVocabulary* mpVocabulary;
+    std::string mPrefix;
+    float mfPeriod;
+    int mnMaxDeltas;
+
+    // Held by the thread while it writes a checkpoint, by Pause while the map is cleared
+    std::mutex mMutexCheckpoint;
+
+    // Of the manifest written last, the one of an earlier run before the first base. mbRebuild:
+    // the next checkpoint writes a base.
+    int mnGeneration;
+    int mnDeltas;
+    bool mbRebuild;
+
+    // The objects as the last checkpoint saw them
+    std::unordered_map<unsigned long,KeyFrameStamp> mmKeyFrames;
+    std::unordered_set<unsigned long> msMapPoints;
+    int mnChangeLogConsumer;
+    std::vector<MapChangeLog::PointChange> mvPointChanges;
+
+    std::mutex mMutexFinish;
+    std::condition_variable mcvFinish;
+    bool mbFinish;
+    bool mbLast;
+    std::thread mThread;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPCHECKPOINT_H
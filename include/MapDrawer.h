@@ -24,9 +24,15 @@
 #include"Map.h"
 #include"MapPoint.h"
 #include"KeyFrame.h"
+#include"MapLOD.h"
+#include"Parameter.h"
+#include"Settings.h"
 #include<pangolin/pangolin.h>
 
+#include<chrono>
 #include<mutex>
+#include<unordered_map>
+#include<vector>
 
 namespace ORB_SLAM2
 {
@@ -34,7 +40,7 @@ namespace ORB_SLAM2
 class MapDrawer
 {
 public:
-    MapDrawer(Map* pMap, const string &strSettingPath);
+    MapDrawer(Map* pMap, const Settings &fSettings);
 
     Map* mpMap;
 
@@ -57,6 +63,69 @@ private:
     cv::Mat mCameraPose;
 
     std::mutex mMutexCamera;
+
+    // Retained rendering (Viewer.RetainedMap). The map points live in a vertex buffer which is
+    // only updated with the changes of Map::mChangeLog, so a viewer frame no longer walks all
+    // points. The keyframes and the graph are drawn from buffers filled with lock free reads of
+    // the poses, the edges of the graph are only collected again when a keyframe changed.
+    bool mbRetained;
+
+    void DrawMapPointsRetained();
+    void DrawKeyFramesRetained(const bool bDrawKF, const bool bDrawGraph);
+
+    // Level of detail of the retained map (Viewer.LOD) for maps too large to draw whole: the points
+    // are drawn from PointClusters, culled to the view and thinned out with the distance, the
+    // keyframes outside the view are culled and the covisibility edges only drawn around the
+    // keyframe closest to the camera (the spanning tree and the loops stay). The clusters are
+    // built from the retained vertices again at most every LOD_REBUILD_PERIOD seconds while the
+    // map points change, new and moved points show up with that delay.
+    bool mbLOD;
+    float mLODCellSize;
+    float mLODDistance;
+    float mLODMinFraction;
+    PointClusters mPointClusters;
+    bool mbClustersDirty;
+    std::chrono::steady_clock::time_point mtClustersBuilt;
+    pangolin::GlBuffer mClusterBuffer;
+    std::vector<int> mvDrawFirsts;
+    std::vector<int> mvDrawCounts;
+
+    // Of the current camera pose, false before the first one
+    bool GetCurrentCameraCenter(Eigen::Vector3f &Ow);
+
+    // Applies the changes of the map points to the buffer
+    void UpdatePointBuffer();
+    void SetPointVertex(const unsigned long nId, const Eigen::Vector3f &pos);
+    void RemovePointVertex(const unsigned long nId);
+
+    // Position of every point in the buffer, slot i belongs to point mvSlotIds[i]
+    std::vector<float> mvPointVertices;
+    std::vector<unsigned long> mvSlotIds;
+    std::unordered_map<unsigned long, size_t> mmPointSlots;
+    // Slots changed since the last upload
+    size_t mnDirtyBegin;
+    size_t mnDirtyEnd;
+    std::vector<MapChangeLog::PointChange> mvPointChanges;
+    // Consumer id in Map::mChangeLog, -1 before the first update
+    int mnChangeLogConsumer;
+    pangolin::GlBuffer mPointBuffer;
+
+    // Graph edges as indices into the keyframes of mpGraphKeyFrames, collected when the keyframes,
+    // the sum of their change indices or the big change index of the map changed
+    IndexedStore<KeyFrame>::Snapshot mpGraphKeyFrames;
+    unsigned long mnGraphChangeIdx;
+    int mnGraphBigChangeIdx;
+    // mnId of the keyframe the covisibility edges were collected around, with Viewer.LOD
+    unsigned long mnGraphCenterId;
+    std::vector<std::pair<int,int> > mvGraphEdges;
+
+    std::vector<float> mvKeyFrameVertices;
+    std::vector<float> mvGraphVertices;
+    pangolin::GlBuffer mKeyFrameBuffer;
+    pangolin::GlBuffer mGraphBuffer;
+
+    // "Show Relocalization" of Tracking
+    ParameterHandle<bool> mShowRelocalization;
 };
 
 } //namespace ORB_SLAM
@@ -0,0 +1,119 @@
+#ifndef MAPEVENTS_H
+#define MAPEVENTS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+
+// Typed events of the map for subscribers which follow it incrementally (path planners,
+// trajectory exporters) instead of polling System::MapChanged and reading every keyframe again.
+// The SLAM threads only queue the events, a dispatcher thread (Run) calls the subscribers in the
+// order the events happened. Events name the keyframes by id and carry copies of their poses,
+// the keyframes themselves may be gone by the time an event is delivered. Nothing is recorded
+// while there are no subscribers.
+class MapEvents
+{
+public:
+
+    enum Type
+    {
+        KEYFRAME_ADDED,
+        // Culled by Local Mapping
+        KEYFRAME_ERASED,
+        // After the essential graph optimization of a loop closure
+        LOOP_CORRECTED,
+        // The map got the result of the global BA started by a loop closure
+        GLOBAL_BA_FINISHED,
+        // The map was cleared, all keyframe ids before are gone
+        RESET
+    };
+
+    typedef Eigen::Matrix<float,4,4,Eigen::DontAlign> Pose;
+
+    struct KeyFrameCorrection
+    {
+        unsigned long nKFId;
+        // World to camera after the correction
+        Pose Tcw;
+        // Takes world coordinates relative to the keyframe before the correction to the ones after
+        // it: Twc after times Tcw before
+        Pose Tcorrection;
+    };
+
+    struct Event
+    {
+        Type type;
+        // Keyframe added or erased, current keyframe of a loop, loop keyframe of a global BA
+        unsigned long nKFId;
+        // Keyframe on the other side of a loop
+        unsigned long nMatchedKFId;
+        // Of the keyframe added
+        double timestamp;
+        // World to camera of the keyframe added
+        Pose Tcw;
+        // Every keyframe a loop correction or global BA moved
+        std::vector<KeyFrameCorrection> vCorrections;
+        // Largest keyframe id in the map before the correction, the ones above were not corrected
+        unsigned long nLastKFId;
+    };
+
+    typedef std::function<void(const Event&)> Callback;
+
+    MapEvents();
+
+    // Any thread. The callback is called from the dispatcher thread for every event queued after
+    // the call. Returns the id to unsubscribe with.
+    int Subscribe(const Callback &callback);
+    // No call starts after it returns, unless it is called from a callback
+    void Unsubscribe(const int nId);
+    bool HasSubscribers() const { return mbSubscribed.load(std::memory_order_relaxed); }
+
+    void KeyFrameAdded(KeyFrame* pKF);
+    void KeyFrameErased(KeyFrame* pKF);
+    void Reset();
+
+    // Poses of the keyframes before a correction, the event only lists the keyframes which moved
+    typedef std::map<unsigned long, Pose> PoseMap;
+    void GetPoses(const std::vector<KeyFrame*> &vpKFs, PoseMap &poses);
+    void Corrected(const Type type, const unsigned long nKFId, const unsigned long nMatchedKFId,
+                   const PoseMap &posesBefore, const std::vector<KeyFrame*> &vpKFs);
+
+    // Dispatcher thread, delivers until RequestFinish, the events queued before are delivered
+    void Run();
+
+    void RequestFinish();
+    bool isFinished();
+
+protected:
+
+    void Publish(Event &event);
+
+    std::atomic<bool> mbSubscribed;
+    std::map<int, Callback> mmCallbacks;
+    int mnNextId;
+    // Held while the callbacks run, Unsubscribe waits for it
+    std::mutex mMutexDispatch;
+    std::thread::id mDispatcherId;
+
+    std::deque<Event> mqEvents;
+    bool mbFinishRequested;
+    bool mbFinished;
+    std::mutex mMutexQueue;
+    std::condition_variable mCondQueue;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPEVENTS_H
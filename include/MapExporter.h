@@ -0,0 +1,138 @@
+#ifndef MAPEXPORTER_H
+#define MAPEXPORTER_H
+
+#include "MapChangeLog.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class Map;
+class MapPoint;
+
+// Writes the map points to point cloud files for meshing and occupancy pipelines, on a thread of
+// its own. An export walks a snapshot of the map points and writes them in chunks, so it never
+// holds Map::mMutexMap and the SLAM threads go on while it runs. The points are written to
+// filename.tmp, renamed to filename once complete, so a reader polling the file never sees half
+// of one.
+//
+// A changes export only holds the points added or moved since the last changes export, found in
+// Map::mChangeLog, and the erased ones with 0 observations (not in LAS). The first one, and the
+// one after a reset or after the log overflowed, holds the whole map instead.
+//
+// Every point has its position, mean viewing direction, id and number of observations, and the
+// color of its keypoint in the reference keyframe if the tracking samples them (Export.Color).
+//   PLY  binary little endian, x y z nx ny nz id observations [red green blue]
+//   PCD  binary, x y z normal_x normal_y normal_z id observations [rgb]
+//   LAS  1.2, point format 0 or 2 with color, intensity is the number of observations. It has no
+//        normals and ids, so a changes export has no erased points.
+class MapExporter
+{
+public:
+
+    enum Format
+    {
+        PLY=0,
+        PCD=1,
+        LAS=2
+    };
+
+    struct Result
+    {
+        bool bOk;
+        // The whole map, not only the changes
+        bool bFull;
+        size_t nPoints;
+        size_t nErased;
+    };
+
+    // By the extension of filename, PLY if it is neither .pcd nor .las
+    static Format GetFormat(const std::string &filename);
+
+    MapExporter(Map* pMap);
+    // Finishes the exports queued
+    ~MapExporter();
+
+    // Queues an export, they run one after another. bChanges: only what changed since the last
+    // changes export. bColors: with the colors of the keyframes, white without them.
+    std::future<Result> Export(const std::string &filename, const Format format, const bool bChanges, const bool bColors);
+
+    // The map is cleared between the two calls, an export which is running is aborted
+    void Pause();
+    void Release();
+
+    // Runs the exports queued and stops the thread
+    void Finish();
+
+protected:
+
+    // Points are written in chunks of this many
+    static const size_t CHUNK_SIZE = 4096; //param
+
+    struct Request
+    {
+        std::string filename;
+        Format format;
+        bool bChanges;
+        bool bColors;
+        std::promise<Result> result;
+    };
+
+    struct Point
+    {
+        float x, y, z;
+        float nx, ny, nz;
+        uint32_t nId;
+        uint32_t nObservations;
+        uint8_t r, g, b;
+    };
+
+    void Run();
+
+    Result Write(Request &request);
+
+    // Fills point from pMP, false if it is bad
+    bool GetPoint(MapPoint* pMP, const bool bColors, Point &point);
+
+    void WriteHeader(std::ofstream &f, const Format format, const bool bColors);
+    void WriteChunk(std::ofstream &f, const Format format, const bool bColors, const std::vector<Point> &vPoints);
+    // Writes the number of points and in LAS the bounds into the header
+    void FinishHeader(std::ofstream &f, const Format format, const size_t nPoints);
+
+    Map* mpMap;
+
+    // Held by the thread while it exports, by Pause while the map is cleared
+    std::mutex mMutexExport;
+    std::atomic<bool> mbAbort;
+
+    // Consumer of the change log, -1 before the first changes export. mbRebuild: the changes
+    // taken by an export which failed are gone, the next one has to be full.
+    int mnChangeLogConsumer;
+    bool mbRebuild;
+    std::vector<MapChangeLog::PointChange> mvPointChanges;
+
+    // Of the file being written: offsets of the counts in the header, bounds of LAS
+    std::vector<std::streampos> mvCountOffsets;
+    double mvMin[3];
+    double mvMax[3];
+
+    std::mutex mMutexRequests;
+    std::condition_variable mcvRequests;
+    std::deque<Request> mqRequests;
+    bool mbFinish;
+    std::thread mThread;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPEXPORTER_H
@@ -0,0 +1,92 @@
+#ifndef MAPLOD_H
+#define MAPLOD_H
+
+#include <cstddef>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace ORB_SLAM2
+{
+
+// Planes of the view volume of a projection*modelview matrix, for culling what the viewer draws
+class ViewFrustum
+{
+public:
+    enum eResult{
+        OUTSIDE=0,
+        INTERSECTS=1,
+        INSIDE=2
+    };
+
+    // Column major as glGetFloatv returns them
+    ViewFrustum(const float* projection, const float* modelView);
+
+    eResult TestBox(const Eigen::Vector3f &min, const Eigen::Vector3f &max) const;
+    bool TestSphere(const Eigen::Vector3f &center, const float radius) const;
+
+    // Camera center of the view in world coordinates
+    const Eigen::Vector3f& GetEye() const { return mEye; }
+
+private:
+    // n.p+d>=0 inside, normalized
+    Eigen::Vector4f mvPlanes[6];
+    Eigen::Vector3f mEye;
+};
+
+// Level of detail of the map points in the viewer. The points are clustered in cubic cells, the
+// cells grouped in blocks of BLOCK_CELLS^3 cells, and the vertices stored cell after cell in a
+// hierarchical order: every prefix of a cell is an even subsample of it. Select culls the blocks
+// and then the cells outside the view and draws only a prefix of the far cells, the fraction
+// falling with the square of the distance as their points crowd on the screen. Built again from
+// all vertices, the viewer does it every few seconds while the map changes.
+class PointClusters
+{
+public:
+
+    struct Cell
+    {
+        Eigen::Vector3f min;
+        Eigen::Vector3f max;
+        // Vertices [begin, begin+count)
+        size_t begin;
+        size_t count;
+    };
+
+    struct Block
+    {
+        Eigen::Vector3f min;
+        Eigen::Vector3f max;
+        // Cells [begin,end)
+        size_t begin;
+        size_t end;
+    };
+
+    PointClusters();
+
+    // vVertices holds x,y,z of every point
+    void Build(const std::vector<float> &vVertices, const float cellSize);
+
+    // Vertex ranges to draw of the points in the view, adjacent full cells merged. All points of
+    // cells closer than fullDistance to the eye (map units), at least minFraction of the others.
+    void Select(const ViewFrustum &frustum, const float fullDistance, const float minFraction,
+                std::vector<int> &vFirsts, std::vector<int> &vCounts) const;
+
+    // Vertices in the order of the cells
+    const std::vector<float>& GetVertices() const { return mvVertices; }
+
+    size_t NumPoints() const { return mvVertices.size()/3; }
+    size_t NumCells() const { return mvCells.size(); }
+
+    static const int BLOCK_CELLS = 8; //param
+
+private:
+
+    std::vector<float> mvVertices;
+    std::vector<Cell> mvCells;
+    std::vector<Block> mvBlocks;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPLOD_H
@@ -0,0 +1,151 @@
+#ifndef MAPMUTEX_H
+#define MAPMUTEX_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+namespace ORB_SLAM2
+{
+
+// Mutex of the structures the threads share through the map: Map::mMutexMapUpdate and
+// mMutexPointCreation, MapPoint::mGlobalMutex and the pose, feature and connection mutexes of
+// MapPoint and KeyFrame. In a normal build it is a std::mutex. Built with
+// ORB_SLAM2_PROFILE_LOCKS (cmake -DLOCK_PROFILER=ON) it records how long the threads wait for
+// it and hold it, per named lock and per call site, which LockProfiler prints.
+//
+// Lock as std::mutex, with the call site marked:
+//   unique_lock<MapMutex> lock(LOCK_SITE(pMP->mMutexPos));
+
+// Call site of a lock, statistics in nanoseconds
+struct LockSite
+{
+    LockSite(const char* file, const int line, const char* function);
+
+    const char* mFile;
+    const int mLine;
+    const char* mFunction;
+    // Name of the lock, set by the first acquisition
+    std::atomic<const char*> mName;
+
+    std::atomic<uint64_t> mnAcquisitions;
+    std::atomic<uint64_t> mnContended;
+    std::atomic<uint64_t> mnWait;
+    std::atomic<uint64_t> mnMaxWait;
+    std::atomic<uint64_t> mnHold;
+    std::atomic<uint64_t> mnMaxHold;
+
+    // All sites, linked as they are first used
+    LockSite* mpNext;
+};
+
+class LockProfiler
+{
+public:
+    // Compiled with ORB_SLAM2_PROFILE_LOCKS
+    static bool IsEnabled();
+
+    // Totals per lock name, then the call sites by decreasing total wait.
+    // Does nothing when profiling is not compiled in.
+    static void Print(std::ostream &out);
+    static void Reset();
+
+    static void Register(LockSite* pSite);
+    static LockSite* FirstSite();
+};
+
+#ifdef ORB_SLAM2_PROFILE_LOCKS
+
+class MapMutex
+{
+public:
+    explicit MapMutex(const char* name): mpName(name), mpHolder(NULL) {}
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    // Sets the site of the next lock by this thread
+    MapMutex& At(LockSite &site);
+
+private:
+    MapMutex(const MapMutex&);
+    MapMutex& operator=(const MapMutex&);
+
+    void Acquired(LockSite* pSite, const uint64_t nWait, const bool bContended);
+
+    std::mutex mMutex;
+    const char* mpName;
+    // Written by the holder only
+    LockSite* mpHolder;
+    std::chrono::steady_clock::time_point mtAcquired;
+};
+
+// Every expansion is its own lambda, so every call site gets its own static LockSite
+#define LOCK_SITE(mutex) \
+    ([&](const char* function) -> ORB_SLAM2::MapMutex& { \
+        static ORB_SLAM2::LockSite site(__FILE__, __LINE__, function); \
+        return (mutex).At(site); \
+    }(__func__))
+
+#else
+
+class MapMutex : public std::mutex
+{
+public:
+    explicit MapMutex(const char*) {}
+};
+
+#define LOCK_SITE(mutex) (mutex)
+
+#endif
+
+// Marks the calling thread as a reader of a frozen map while it lives: localization mode with
+// nothing else writing the map (Tracking::IsMapFrozen). The getters of MapPoint and KeyFrame
+// skip their locks on such a thread (MapReadLock) and the tracking counters of the points are
+// not updated. Nests, ThreadPool::ParallelFor passes it on to the workers.
+class FrozenMapReader
+{
+public:
+    explicit FrozenMapReader(const bool bFrozen=true): mbPrevious(sbActive) { sbActive = mbPrevious || bFrozen; }
+    ~FrozenMapReader() { sbActive = mbPrevious; }
+
+    static bool IsActive() { return sbActive; }
+
+private:
+    FrozenMapReader(const FrozenMapReader&);
+    FrozenMapReader& operator=(const FrozenMapReader&);
+
+    const bool mbPrevious;
+    static thread_local bool sbActive;
+};
+
+// Scoped lock of the getters, which does not lock on a reader of a frozen map:
+//   MapReadLock lock(LOCK_SITE(mMutexFeatures));
+class MapReadLock
+{
+public:
+    explicit MapReadLock(MapMutex &mutex): mpMutex(FrozenMapReader::IsActive() ? NULL : &mutex)
+    {
+        if(mpMutex)
+            mpMutex->lock();
+    }
+
+    ~MapReadLock()
+    {
+        if(mpMutex)
+            mpMutex->unlock();
+    }
+
+private:
+    MapReadLock(const MapReadLock&);
+    MapReadLock& operator=(const MapReadLock&);
+
+    MapMutex* mpMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPMUTEX_H
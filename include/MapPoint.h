@@ -21,12 +21,24 @@
 #ifndef MAPPOINT_H
 #define MAPPOINT_H
 
+#include"DescriptorMedoid.h"
 #include"KeyFrame.h"
 #include"Frame.h"
 #include"Map.h"
+#include"MapMutex.h"
+#include"ObservationList.h"
+#include"SeqLock.h"
 
 #include<opencv2/core/core.hpp>
+#include<Eigen/Core>
+#include<atomic>
+#include<cstddef>
+#include<cstdint>
+#include<memory>
 #include<mutex>
+#include<unordered_map>
+#include<utility>
+#include<vector>
 
 namespace ORB_SLAM2
 {
@@ -35,20 +47,56 @@ class KeyFrame;
 class Map;
 class Frame;
 
+typedef BasicObservationList<KeyFrame> ObservationList;
 
+
+// The fields the tracking reads for every local point of every frame, the geometry, the
+// descriptor and the bad and replaced state, are next to each other near the start of the object.
+// The markers of local mapping, loop closing and global BA come last, they are only touched once
+// per keyframe or per correction.
 class MapPoint
 {
+    // saves and restores the geometry, descriptor and counters
+    friend class MapSerializer;
+    // moves the observations of the replaced points
+    friend class MapPointReplacer;
+
 public:
     MapPoint(const cv::Mat &Pos, KeyFrame* pRefKF, Map* pMap);
     MapPoint(const cv::Mat &Pos,  Map* pMap, Frame* pFrame, const int &idxF);
 
+    // MapPoints are created and culled all the time, their memory comes from a pool
+    static void* operator new(std::size_t size);
+    static void operator delete(void* p, std::size_t size);
+
+    // Number of MapPoints currently allocated (including bad ones)
+    static size_t GetNumAllocated();
+
     void SetWorldPos(const cv::Mat &Pos);
     cv::Mat GetWorldPos();
 
     cv::Mat GetNormal();
+
+    // Same with fixed-size types, without locking or allocating. Used by the core classes,
+    // the cv::Mat versions are kept for the remaining callers and the System API.
+    void SetWorldPos(const Eigen::Vector3f &Pos);
+    void GetWorldPos(Eigen::Vector3f &Pos);
+    void GetNormal(Eigen::Vector3f &Normal);
+
+    // Position, viewing direction and scale invariance distances of one consistent state
+    void GetViewingGeometry(Eigen::Vector3f &Pos, Eigen::Vector3f &Normal, float &minDistance, float &maxDistance);
+
     KeyFrame* GetReferenceKeyFrame();
 
-    std::map<KeyFrame*,size_t> GetObservations();
+    ObservationList GetObservations();
+
+    // Shared immutable copy of the observations, only rebuilt after they changed.
+    // Readers which just iterate over the observations should prefer it to GetObservations.
+    typedef std::shared_ptr<const ObservationList> ObservationsSnapshot;
+    ObservationsSnapshot GetObservationsSnapshot();
+
+    // Bytes of the object and its observations
+    size_t GetMemoryUsage();
     int Observations();
 
     void AddObservation(KeyFrame* pKF,size_t idx);
@@ -67,13 +115,17 @@ public:
     void IncreaseFound(int n=1);
     float GetFoundRatio();
     inline int GetFound(){
-        return mnFound;
+        return mnFound.load(std::memory_order_relaxed);
     }
 
     void ComputeDistinctiveDescriptors();
 
     cv::Mat GetDescriptor();
 
+    // Copies the descriptor into Desc, which is only allocated if it is not a 1x32 CV_8U matrix yet.
+    // Reuse one matrix across a loop to avoid an allocation per MapPoint.
+    void GetDescriptor(cv::Mat &Desc);
+
     void UpdateNormalAndDepth();
 
     float GetMinDistanceInvariance();
@@ -83,68 +135,109 @@ public:
 
 public:
     long unsigned int mnId;
-    static long unsigned int nNextId;
     long int mnFirstKFid;
     long int mnFirstFrame;
     int nObs;
 
     // Variables used by the tracking
-    float mTrackProjX;
-    float mTrackProjY;
-    float mTrackProjXR;
-    bool mbTrackInView;
-    int mnTrackScaleLevel;
-    float mTrackViewCos;
-    long unsigned int mnTrackReferenceForFrame;
-    long unsigned int mnLastFrameSeen;
+    long unsigned int mnTrackReferenceForLocalMap;
 
-    // Variables used by local mapping
-    long unsigned int mnBALocalForKF;
-    long unsigned int mnFuseCandidateForKF;
-
-    // Variables used by loop closing
-    long unsigned int mnLoopPointForKF;
-    long unsigned int mnCorrectedByKF;
-    long unsigned int mnCorrectedReference;
-    cv::Mat mPosGBA;
-    long unsigned int mnBAGlobalForKF;
+    // Voxel of the point in the MapPointIndex of the map, written by the index
+    std::atomic<int64_t> mnIndexVoxel;
 
 
-    static std::mutex mGlobalMutex;
+    static MapMutex mGlobalMutex;
 
 protected:
 
-     // Position in absolute coordinates
-     cv::Mat mWorldPos;
+     // Position in absolute coordinates, mean viewing direction and scale invariance distances:
+     // x y z | nx ny nz | min distance | max distance. Written under mMutexPos, read without locking.
+     SeqLock<float,8> mGeometry;
 
-     // Keyframes observing the point and associated index in keyframe
-     std::map<KeyFrame*,size_t> mObservations;
+     // Best descriptor to fast matching. Written under mMutexFeatures, read without locking.
+     SeqLock<uint32_t,8> mDescriptor;
 
-     // Mean viewing direction
-     cv::Mat mNormalVector;
+     // Bad flag (we do not currently erase MapPoint from memory)
+     std::atomic<bool> mbBad; // written under mMutexFeatures and mMutexPos, read without locking
+     MapPoint* mpReplaced;
 
-     // Best descriptor to fast matching
-     cv::Mat mDescriptor;
+     // Tracking counters. Only statistics, the tracking counts every local point of every frame
+     // without taking mMutexFeatures.
+     std::atomic<int> mnVisible;
+     std::atomic<int> mnFound;
 
      // Reference KeyFrame
      KeyFrame* mpRefKF;
 
-     // Tracking counters
-     int mnVisible;
-     int mnFound;
+     // Keyframes observing the point and associated index in keyframe
+     ObservationList mObservations;
+     ObservationsSnapshot mpObservationsSnapshot;
 
-     // Bad flag (we do not currently erase MapPoint from memory)
-     bool mbBad;
-     MapPoint* mpReplaced;
+     // Sum of the unit viewing directions of the observations, for the position mNormalPos and the
+     // keyframe poses up to mnNormalEpoch (0 if it has to be computed again). Kept by adding and
+     // erasing observations, so UpdateNormalAndDepth only visits the keyframes after a pose or the
+     // position changed. Under mMutexFeatures.
+     Eigen::Vector3f mNormalSum;
+     Eigen::Vector3f mNormalPos;
+     long unsigned int mnNormalEpoch;
 
-     // Scale invariance distances
-     float mfMinDistance;
-     float mfMaxDistance;
+     // Observed descriptors and their distances it is chosen from, under mMutexFeatures
+     DescriptorMedoid mDescriptorMedoid;
 
      Map* mpMap;
 
-     std::mutex mMutexPos;
-     std::mutex mMutexFeatures;
+     // Under mMutexFeatures
+     bool IsNormalSumValid(const Eigen::Vector3f &Pos);
+
+     MapMutex mMutexPos{"MapPoint::mMutexPos"};
+     MapMutex mMutexFeatures{"MapPoint::mMutexFeatures"};
+
+public:
+    // Variables used by local mapping
+    long unsigned int mnBALocalForKF;
+    long unsigned int mnFuseCandidateForKF;
+
+    // Variables used by loop closing
+    long unsigned int mnLoopPointForKF;
+    long unsigned int mnCorrectedByKF;
+    long unsigned int mnCorrectedReference;
+    Eigen::Vector3f mPosGBA;
+    long unsigned int mnBAGlobalForKF;
+    long unsigned int mnBARegionForKF;
+};
+
+// Batch of MapPoint::Replace calls and of new observations, for the fusions which make many in a
+// row. Replace and Add change the observations of the points at once, as the single calls do,
+// but the keyframe entries they change are kept until Apply, which writes them with one lock
+// per keyframe, computes the descriptor of every survivor once and erases the replaced points
+// from the map in one go. Until then GetMapPoint gives the entries a keyframe will have.
+class MapPointReplacer
+{
+public:
+    MapPointReplacer();
+    // Applies what is left
+    ~MapPointReplacer();
+
+    // pMP->Replace(pBy)
+    void Replace(MapPoint* pMP, MapPoint* pBy);
+
+    // pMP->AddObservation(pKF,idx) and pKF->AddMapPoint(pMP,idx)
+    void Add(MapPoint* pMP, KeyFrame* pKF, const size_t idx);
+
+    // pKF->GetMapPoint(idx) after Apply
+    MapPoint* GetMapPoint(KeyFrame* pKF, const size_t idx);
+
+    void Apply();
+
+protected:
+    void SetEntry(KeyFrame* pKF, const size_t idx, MapPoint* pMP);
+
+    // New entries of every keyframe, by keypoint index
+    std::vector<std::pair<KeyFrame*, std::unordered_map<size_t, MapPoint*> > > mvEntries;
+    std::unordered_map<KeyFrame*, size_t> mmEntriesIdx;
+
+    std::vector<MapPoint*> mvpSurvivors;
+    std::vector<MapPoint*> mvpReplaced;
 };
 
 } //namespace ORB_SLAM
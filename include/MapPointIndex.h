@@ -0,0 +1,78 @@
+#ifndef MAPPOINTINDEX_H
+#define MAPPOINTINDEX_H
+
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace ORB_SLAM2
+{
+
+class MapPoint;
+
+// Voxel hash over the world positions of the map points of a Map, for the queries which need
+// the points in a region regardless of the covisibility graph. A point is inserted when it is
+// added to the map, moved when SetWorldPos puts it into another voxel (BA, loop correction)
+// and erased with it. The voxel of every point is kept in MapPoint::mnIndexVoxel, so moves
+// within a voxel cost no lock. Queries filter by the current positions.
+class MapPointIndex
+{
+public:
+
+    // Camera through which the points are seen. Rcw and tcw may carry a scale (Sim3),
+    // maxDepth is then in the scaled camera frame.
+    struct Frustum
+    {
+        Eigen::Matrix3f Rcw;
+        Eigen::Vector3f tcw;
+        float fx, fy, cx, cy;
+        float minX, maxX, minY, maxY;
+        float maxDepth;
+    };
+
+    // MapPoint::mnIndexVoxel of a point which is not in the index
+    static const int64_t NO_VOXEL;
+
+    MapPointIndex();
+
+    // A voxel size of 0 disables the index. Only call while it is empty.
+    void SetVoxelSize(const float fVoxelSize);
+    bool IsEnabled() const { return mfVoxelSize>0; }
+
+    void Insert(MapPoint* pMP);
+    void Erase(MapPoint* pMP);
+    // Called after the position of pMP changed to Pos
+    void Update(MapPoint* pMP, const Eigen::Vector3f &Pos);
+    void Clear();
+
+    // Points whose position is within fRadius of center
+    void GetPointsInRadius(const Eigen::Vector3f &center, const float fRadius, std::vector<MapPoint*> &vpMPs);
+
+    // Points which project into the image of the frustum at a depth in (0, maxDepth]
+    void GetPointsInFrustum(const Frustum &frustum, std::vector<MapPoint*> &vpMPs);
+
+protected:
+
+    int64_t GetVoxel(const Eigen::Vector3f &Pos) const;
+    void GetVoxelCoords(const Eigen::Vector3f &Pos, int &x, int &y, int &z) const;
+
+    // Calls f for every point in a voxel of the box [vMin, vMax]
+    template<typename F>
+    void ForEachInBox(const Eigen::Vector3f &vMin, const Eigen::Vector3f &vMax, F f);
+
+    void EraseFromVoxel(MapPoint* pMP, const int64_t nVoxel);
+
+    float mfVoxelSize;
+    float mfInvVoxelSize;
+
+    std::unordered_map<int64_t, std::vector<MapPoint*> > mVoxels;
+
+    std::mutex mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPPOINTINDEX_H
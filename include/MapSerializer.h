@@ -0,0 +1,126 @@
+#ifndef MAPSERIALIZER_H
+#define MAPSERIALIZER_H
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ORBVocabulary.h"
+
+namespace ORB_SLAM2
+{
+
+class Frame;
+class FrameContext;
+class KeyFrame;
+class KeyFrameDatabase;
+class Map;
+class MapPoint;
+class MapTiles;
+class ThreadPool;
+
+// Binary map file: the keyframes with keypoints, descriptors, BoW, pose, covisibility, spanning
+// tree and loop edges, then the map points with position, descriptor and observations.
+// Writing and reading are sequential through a large buffer. The keyframes are encoded and
+// decoded on the thread pool in batches, so the memory on top of the map stays bounded. Objects
+// refer to each other by mnId, which are kept, and pointers are restored from tables by id.
+// The keyframe database is rebuilt from the stored BoW vectors, which is cheap.
+class MapSerializer
+{
+public:
+
+    // Writes the good keyframes and map points. Nothing may change the map meanwhile, or each
+    // object is written as it is when it is encoded (MapCheckpointer, which holds a reclaimer slot).
+    static bool Save(const std::string &filename, Map* pMap, const ORBVocabulary* pVoc, ThreadPool* pThreadPool);
+
+    // Loads into an empty map and keyframe database, built with the same vocabulary, and sets
+    // the next ids of frames, keyframes and map points after the ones of the file. The map is
+    // left unchanged if the file can not be read. Returns the last keyframe, NULL on failure.
+    static KeyFrame* Load(const std::string &filename, Map* pMap, KeyFrameDatabase* pKFDB, ORBVocabulary* pVoc,
+                          ThreadPool* pThreadPool);
+
+    // Map file for localization only. The keypoints, stereo coordinates, descriptors and grids of
+    // the keyframes are stored as they lie in memory, 16 byte aligned, and the loaded keyframes
+    // point into the file mapped read only instead of copying them: the kernel loads the pages
+    // the first time tracking touches them and shares them between processes. BoW vectors,
+    // graphs and map points are decoded as in Load. The keyframes of such a map must not be
+    // modified, which localization mode guarantees. Only works with a build of the same layout.
+    // The features of the keyframes are added to pTiles, if given, to be evicted and prefetched.
+    static bool SaveMapped(const std::string &filename, Map* pMap, const ORBVocabulary* pVoc, ThreadPool* pThreadPool);
+    static KeyFrame* LoadMapped(const std::string &filename, Map* pMap, KeyFrameDatabase* pKFDB, ORBVocabulary* pVoc,
+                                ThreadPool* pThreadPool, MapTiles* pTiles);
+
+    // Second half of merging a map file into a map which is being tracked (System::MergeMap): the
+    // file is loaded with Load into pStaging, a map of its own with the calibration of pMap,
+    // which touches nothing the SLAM threads use. MoveMap then moves the keyframes and map points
+    // of pStaging into pMap and pKFDB, with new ids after the ones of pMap, every map of the file
+    // becoming a new map of the atlas. From the tracking thread, which owns the ids. pStaging is
+    // left empty.
+    static void MoveMap(Map* pStaging, Map* pMap, KeyFrameDatabase* pKFDB);
+
+    // Blocks of a single keyframe or map point as they are in the map file, for the loop server
+    // link (LoopClient, LoopServer). A keyframe decodes to the frame it was built from, with its
+    // grid, mnId and the mnId of its parent (-1 without), a map point to its record. Decode
+    // returns false on a corrupt block.
+    struct MapPointData
+    {
+        uint64_t nId;
+        int64_t nFirstKFid;
+        int64_t nFirstFrame;
+        uint64_t nRefKFId;
+        float geometry[8];
+        uint32_t descriptor[8];
+        int32_t nVisible;
+        int32_t nFound;
+        std::vector<std::pair<uint64_t,uint32_t> > vObservations;
+    };
+
+    static void EncodeKeyFrame(KeyFrame* pKF, std::vector<char> &vData);
+    static void EncodeMapPoint(MapPoint* pMP, std::vector<char> &vData);
+    static bool DecodeKeyFrame(const char* pData, const size_t nSize, ORBVocabulary* pVoc, const FrameContext &context,
+                               Frame &F, uint64_t &nId, int64_t &nParentId);
+    static bool DecodeMapPoint(const char* pData, const size_t nSize, MapPointData &data);
+    // Without its observations, not in the map yet
+    static MapPoint* CreateMapPoint(const MapPointData &data, KeyFrame* pRefKF, Map* pMap);
+
+    // Delta of a checkpoint (MapCheckpointer), after a map file written by Save or an earlier
+    // delta: the blocks of the keyframes and map points which are new or changed, then the poses
+    // of keyframes and the geometries of map points read at one instant, which replace the ones
+    // of the blocks before, then the ids of the ones erased. Ids are never reused.
+    struct CheckpointDelta
+    {
+        std::vector<std::vector<char> > vKeyFrameBlocks;
+        std::vector<std::vector<char> > vMapPointBlocks;
+        // Rcw row major and tcw, 12 floats per keyframe
+        std::vector<uint64_t> vPoseIds;
+        std::vector<float> vPoses;
+        // Position, normal, min and max distance, 8 floats per map point
+        std::vector<uint64_t> vGeometryIds;
+        std::vector<float> vGeometries;
+        std::vector<uint64_t> vErasedKeyFrames;
+        std::vector<uint64_t> vErasedMapPoints;
+    };
+
+    // Add the pose of pKF and the geometry of pMP as they are now
+    static void AddPose(CheckpointDelta &delta, KeyFrame* pKF);
+    static void AddGeometry(CheckpointDelta &delta, MapPoint* pMP);
+
+    // With the next ids of pMap
+    static bool SaveDelta(const std::string &filename, const CheckpointDelta &delta, Map* pMap,
+                          const ORBVocabulary* pVoc);
+
+    // Applies the deltas in order to the map file baseFile and writes the result to outFile, a
+    // map file for Load
+    static bool MergeDeltas(const std::string &baseFile, const std::vector<std::string> &vDeltaFiles,
+                            const ORBVocabulary* pVoc, const std::string &outFile);
+
+protected:
+
+    static KeyFrame* LoadFile(const std::string &filename, const bool bMapped, Map* pMap, KeyFrameDatabase* pKFDB,
+                              ORBVocabulary* pVoc, ThreadPool* pThreadPool, MapTiles* pTiles);
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPSERIALIZER_H
@@ -0,0 +1,141 @@
+#ifndef MAPSTREAMER_H
+#define MAPSTREAMER_H
+
+#include "MapChangeLog.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+namespace ORB_SLAM2
+{
+
+class Map;
+
+// Streams the map to remote viewers over TCP (Streamer.Port). The streamer keeps a copy of the
+// map points and keyframe poses which it only updates with the changes of Map::mChangeLog, so
+// it never walks the map unless the log asks it to start over. A client which connects gets the
+// whole copy first, then at most Streamer.Rate updates per second with the points and keyframes
+// which changed since its last update. The sockets never block: while a client has not taken its
+// last update, the changes for it are merged by id, so a slow client gets fewer and larger
+// updates and the SLAM threads never wait for it.
+//
+// Every message is a 32 bit length of the rest, then a byte with the type, then the payload.
+// All numbers are little endian, ids are 32 bit, coordinates 32 bit floats.
+//   RESET                 the client drops its map, the whole map follows
+//   POINTS                count, then per point id,x,y,z
+//   POINTS_ERASED         count, then the ids
+//   KEYFRAMES             count, then per keyframe id,qx,qy,qz,qw,x,y,z (camera to world)
+//   KEYFRAMES_ERASED      count, then the ids
+//   CAMERA                qx,qy,qz,qw,x,y,z of the current frame (camera to world)
+class MapStreamer
+{
+public:
+
+    enum MessageType
+    {
+        RESET=1,
+        POINTS=2,
+        POINTS_ERASED=3,
+        KEYFRAMES=4,
+        KEYFRAMES_ERASED=5,
+        CAMERA=6
+    };
+
+    // Listens on all interfaces, rate: updates per second
+    MapStreamer(Map* pMap, const int port, const float rate);
+    ~MapStreamer();
+
+    // Main function
+    void Run();
+
+    // Pose of the current frame, the latest one is sent with the next update
+    void SetCurrentCameraPose(const cv::Mat &Tcw);
+
+    void RequestFinish();
+    bool isFinished();
+
+    // The map is reset while the streamer is stopped
+    void RequestStop();
+    bool isStopped();
+    void Release();
+
+protected:
+
+    struct KeyFramePose
+    {
+        Eigen::Quaternion<float,Eigen::DontAlign> qwc;
+        Eigen::Vector3f Ow;
+    };
+
+    struct Client
+    {
+        int fd;
+        // Encoded messages not sent yet, from nSent on
+        std::string outbox;
+        size_t nSent;
+        // Whole map next, instead of the changes
+        bool bFull;
+        // Ids changed since the last update of this client, erased if they are not in the copy anymore
+        std::unordered_set<unsigned long> sPoints;
+        std::unordered_set<unsigned long> sKeyFrames;
+        // Camera pose sent last
+        unsigned long nCameraPoseIdx;
+    };
+
+    bool Listen();
+    void AcceptClients();
+
+    // Applies the changes of the log to the copy of the map and marks them for every client
+    void UpdateMap();
+    void RebuildMap();
+
+    void EncodeUpdate(Client &client);
+    // False if the client is gone
+    bool Send(Client &client);
+    void CloseClient(Client &client);
+
+    bool Stop();
+    bool CheckFinish();
+    void SetFinish();
+
+    Map* mpMap;
+    int mPort;
+    // microseconds between two updates
+    int mnPeriod;
+
+    int mnListenFd;
+    std::vector<Client> mvClients;
+
+    int mnChangeLogConsumer;
+    std::vector<MapChangeLog::PointChange> mvPointChanges;
+    std::vector<MapChangeLog::KeyFrameChange> mvKeyFrameChanges;
+
+    // Copy of the map
+    std::unordered_map<unsigned long, Eigen::Vector3f> mmPoints;
+    std::unordered_map<unsigned long, KeyFramePose> mmKeyFrames;
+
+    KeyFramePose mCameraPose;
+    // Counts the poses set, 0 before the first
+    unsigned long mnCameraPoseIdx;
+    std::mutex mMutexCamera;
+
+    bool mbFinishRequested;
+    bool mbFinished;
+    std::mutex mMutexFinish;
+
+    bool mbStopped;
+    bool mbStopRequested;
+    std::mutex mMutexStop;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPSTREAMER_H
@@ -0,0 +1,74 @@
+#ifndef MAPTILES_H
+#define MAPTILES_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <tuple>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace ORB_SLAM2
+{
+
+class MappedFile;
+
+// Partition of the keyframes of a mapped map (MapSerializer::LoadMapped) into cubic tiles by
+// their camera centers. The features of the keyframes stay in the file, so a tile far from the
+// camera is evicted by dropping its pages, and the tiles around the camera are prefetched as it
+// approaches them. The keyframes themselves, with their poses, graphs and BoW vectors, stay in
+// memory: the keyframe database proposes candidates in evicted tiles as before and their
+// features are read again from the file when a search touches them. The resident memory of
+// the features then depends on the area around the camera, not on the size of the map.
+class MapTiles
+{
+public:
+    // Tiles whose index differs by at most nRadius from the tile of the camera stay resident
+    MapTiles(const float fTileSize, const int nRadius);
+
+    // The features of a keyframe centered at Ow are [nOffset, nOffset+nSize) of pFile
+    void AddKeyFrame(const std::shared_ptr<const MappedFile> &pFile, const Eigen::Vector3f &Ow,
+                     const uint64_t nOffset, const uint64_t nSize);
+
+    // Evicts and prefetches tiles when the camera, at Ow, enters another tile
+    void Update(const Eigen::Vector3f &Ow);
+
+    size_t NumTiles();
+    size_t NumResidentTiles();
+
+protected:
+
+    typedef std::tuple<int,int,int> TileKey;
+
+    struct Region
+    {
+        uint64_t nOffset;
+        uint64_t nSize;
+    };
+
+    struct Tile
+    {
+        std::vector<Region> vRegions;
+        bool bResident;
+    };
+
+    TileKey GetTileKey(const Eigen::Vector3f &Ow) const;
+    bool IsNear(const TileKey &key1, const TileKey &key2) const;
+
+    float mfTileSize;
+    int mnRadius;
+
+    std::shared_ptr<const MappedFile> mpFile;
+    std::map<TileKey,Tile> mTiles;
+
+    bool mbHasCameraTile;
+    TileKey mCameraTile;
+
+    std::mutex mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPTILES_H
@@ -0,0 +1,51 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+namespace ORB_SLAM2
+{
+
+// Read only memory mapping of a whole file. Nothing is read when it is opened, the kernel
+// loads the pages the first time they are touched, and processes which map the same file
+// share them.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // bRandomAccess turns off the read ahead, for files read in no particular order
+    bool Open(const std::string &filename, const bool bRandomAccess);
+    void Close();
+
+    bool IsOpen() const { return mpData!=NULL; }
+    const char* Data() const { return static_cast<const char*>(mpData); }
+    size_t Size() const { return mnSize; }
+
+    // Hints the kernel that [offset, offset+size) is needed soon, so it starts reading it, or
+    // that it is not, so its pages are dropped. They are read again when touched.
+    void Advise(const uint64_t offset, const uint64_t size, const bool bNeeded) const;
+
+    // The n elements of type T at offset, NULL if they are not within the file or misaligned
+    template<typename T>
+    const T* Get(const uint64_t offset, const uint64_t n) const
+    {
+        if(offset>mnSize || n>(mnSize-offset)/sizeof(T) || offset%alignof(T)!=0)
+            return static_cast<const T*>(NULL);
+        return reinterpret_cast<const T*>(Data()+offset);
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void* mpData;
+    size_t mnSize;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPPEDFILE_H
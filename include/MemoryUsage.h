@@ -0,0 +1,54 @@
+#ifndef MEMORYUSAGE_H
+#define MEMORYUSAGE_H
+
+#include <cstddef>
+#include <ostream>
+
+namespace ORB_SLAM2
+{
+
+// Bytes held by the parts of the system, estimated from the sizes of their containers and
+// matrices, not measured by the allocator. Filled by System::GetMemoryUsage.
+struct MemoryUsage
+{
+    MemoryUsage();
+
+    // Keyframes in the map
+    size_t nKeyFrames;
+    // Keypoints, undistorted keypoints, right coordinates and depths
+    size_t keyFrameKeyPoints;
+    size_t keyFrameDescriptors;
+    size_t keyFrameGrids;
+    // BoW and feature vectors, BoW match indices
+    size_t keyFrameBoW;
+    // The objects, MapPoint matches, covisibility graph and spanning tree
+    size_t keyFrameOther;
+
+    // MapPoints in the map, the objects with their observations
+    size_t nMapPoints;
+    size_t mapPoints;
+
+    // Bad MapPoints and KeyFrames retired to the Reclaimer and not freed yet
+    size_t nRetired;
+
+    // Inverted file and keyframe table of the KeyFrameDatabase
+    size_t keyFrameDatabase;
+    // Compressed depth images of the keyframes in memory (KeyFrameDepth.Retain)
+    size_t keyFrameDepths;
+    size_t vocabulary;
+    // Pyramid buffers of the ORB extractors of the tracking
+    size_t imagePyramids;
+    // g2o graph local mapping keeps between keyframes
+    size_t localBAProblem;
+    // Largest global (or region) bundle adjustment graph so far
+    size_t globalBAProblem;
+
+    size_t Total() const;
+
+    // One line per part, in MB
+    void Print(std::ostream &out) const;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MEMORYUSAGE_H
@@ -0,0 +1,102 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include "MemoryUsage.h"
+#include "SeqLock.h"
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class Map;
+class LocalMapping;
+class LoopClosing;
+
+// Serves the instrumentation of a System to Prometheus (MetricsServer.Port, only on the loopback
+// interface): any HTTP GET is answered with the text exposition format, 0.0.4. The stage times
+// are histograms of their power of two buckets, in seconds, the lock waits are there when the
+// lock profiler is compiled in. Scraping never blocks the tracking: the stage times and the lock
+// sites are atomics, the tracking publishes its state, counts and the map size after every frame
+// without a lock and the memory usage when it computes it (Memory.LogPeriod). The queue
+// statistics are copied under the mutexes of the statistics of Local Mapping and Loop Closing.
+// The server only polls its sockets, as ParameterServer.
+class MetricsServer
+{
+public:
+
+    MetricsServer(const int port, Map* pMap, LocalMapping* pLocalMapper, LoopClosing* pLoopCloser);
+    ~MetricsServer();
+
+    // Main function
+    void Run();
+
+    void RequestFinish();
+    bool isFinished();
+
+    // By the tracking thread after every frame
+    void PublishFrame(const int nState, const int nInliers, const unsigned long nKeyFrames,
+                      const unsigned long nMapPoints, const bool bLost, const bool bRelocalized);
+    void PublishMemoryUsage(const MemoryUsage &usage);
+
+protected:
+
+    struct Client
+    {
+        int fd;
+        // Request received so far, answered once its header is complete
+        std::string inbox;
+        std::string outbox;
+        size_t nSent;
+        bool bAnswered;
+    };
+
+    bool Listen();
+    void AcceptClients();
+
+    // False if the client is gone
+    bool Receive(Client &client);
+    // False once the reply is sent, the connection is closed then
+    bool Send(Client &client);
+    void CloseClient(Client &client);
+
+    // The body of a scrape
+    void WriteMetrics(std::string &body);
+
+    bool CheckFinish();
+    void SetFinish();
+
+    int mPort;
+    Map* mpMap;
+    LocalMapping* mpLocalMapper;
+    LoopClosing* mpLoopCloser;
+
+    int mnListenFd;
+    std::vector<Client> mvClients;
+
+    // Published by the tracking
+    std::atomic<uint64_t> mnFrames;
+    std::atomic<int> mnState;
+    std::atomic<int> mnInliers;
+    std::atomic<unsigned long> mnKeyFrames;
+    std::atomic<unsigned long> mnMapPoints;
+    std::atomic<uint64_t> mnLost;
+    std::atomic<uint64_t> mnRelocalized;
+
+    // The fields of MemoryUsage in their order, nothing until the first PublishMemoryUsage
+    static const int MEMORY_FIELDS = 15;
+    SeqLock<uint64_t,MEMORY_FIELDS> mMemoryUsage;
+    std::atomic<bool> mbMemoryUsage;
+
+    bool mbFinishRequested;
+    bool mbFinished;
+    std::mutex mMutexFinish;
+};
+
+} //namespace ORB_SLAM
+
+#endif // METRICSSERVER_H
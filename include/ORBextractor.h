@@ -21,8 +21,15 @@
 #ifndef ORBEXTRACTOR_H
 #define ORBEXTRACTOR_H
 
+#include "GridDistribution.h"
+#include "ImagePyramid.h"
+#include "OctTreeDistribution.h"
 #include "Parameter.h"
+#include "Settings.h"
+#include "ThreadPool.h"
 
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <list>
 #include <opencv/cv.h>
@@ -31,30 +38,23 @@
 namespace ORB_SLAM2
 {
 
-class ExtractorNode
-{
-public:
-    ExtractorNode():bNoMore(false){}
-
-    void DivideNode(ExtractorNode &n1, ExtractorNode &n2, ExtractorNode &n3, ExtractorNode &n4);
-
-    std::vector<cv::KeyPoint> vKeys;
-    cv::Point2i UL, UR, BL, BR;
-    std::list<ExtractorNode>::iterator lit;
-    bool bNoMore;
-};
-
 class ORBextractor
 {
 public:
 
     enum {HARRIS_SCORE=0, FAST_SCORE=1 };
 
+    // nThreads > 1 extracts the pyramid levels in parallel on a worker pool owned by the extractor.
+    // patternBins > 0 rounds the angles of the keypoints to that many bins for the descriptors, so
+    // the rotated pattern is looked up instead of computed, 0 keeps the exact angles.
+    // gridDistribution keeps the features of a level with GridDistribution instead of the octree,
+    // it can be switched at runtime ("Grid distribution").
     ORBextractor(int nfeatures, float scaleFactor, int nlevels,
                  int iniThFAST, int minThFAST, std::vector<std::vector<int>> excludedRegions,
-                 bool initialization = false);
+                 bool initialization = false, int nthreads = 1, int patternBins = 0,
+                 bool gridDistribution = false);
 
-    ~ORBextractor(){}
+    ~ORBextractor();
 
     // Compute the ORB features and descriptors on an image.
     // ORB are dispersed on the image using an octree.
@@ -63,6 +63,10 @@ public:
       std::vector<cv::KeyPoint>& keypoints,
       cv::OutputArray descriptors);
 
+    // Only the pyramid of operator(), for the frames tracked without an extraction
+    // (Tracking.FlowFrames)
+    void BuildImagePyramid(const cv::Mat &image) { ComputePyramid(image); }
+
     int inline GetLevels(){
         return nLevels();}
 
@@ -89,20 +93,89 @@ public:
     // (nFeatures, scaleFactor, etc.)
     void UpdateParameters();
 
-    std::vector<cv::Mat> mvImagePyramid;
+    // Sets the parameters the tracking adapts from frame to frame (FeatureBudget). Only the
+    // derived values are recomputed, the pyramid buffers are kept where the sizes stay the same.
+    void SetFeatureBudget(const int nfeatures, const int iniThFast, const int minThFast, const int nlevels);
+
+    // Excludes the pixels inside the polygons and the nonzero pixels of mask from the extraction,
+    // on top of the excluded regions. Both are in the coordinates of the images passed to
+    // operator(), a mask of a different size is scaled to the image.
+    void SetExclusionMask(const std::vector<std::vector<cv::Point> >& vPolygons, const cv::Mat& mask);
+
+    // Reads ORBextractor.ExcludedPolygons (lists of x,y pairs) and ORBextractor.ExclusionMask (path
+    // of an image, nonzero pixels are excluded) from the settings. False if the mask can't be read.
+    static bool ReadExclusionMask(const Settings& fSettings, std::vector<std::vector<cv::Point> >& vPolygons,
+                                  cv::Mat& mask);
+
+    // Whether the frames hold the pyramid of their extraction, for the image alignment and the
+    // flow of the tracking
+    void SetKeepImagePyramid(const bool bKeep) { mbKeepImagePyramid = bKeep; }
+    bool KeepsImagePyramid() const { return mbKeepImagePyramid; }
+
+    // Remaps the images passed to operator() with the fixed-point maps of initUndistortRectifyMap
+    // (CV_16SC2) straight into the padded first level of the pyramid, instead of remapping them
+    // into an image of their own which the pyramid copies. The keypoints, the exclusion mask and
+    // pyramid are then in the remapped image, of the size of the maps. Empty maps turn
+    // it off.
+    void SetRemap(const cv::Mat &map1, const cv::Mat &map2);
+    bool Remaps() const { return !mRemapMap1.empty(); }
+
+    // Bytes of the pyramid buffers as of the last extraction, any thread can ask
+    size_t GetMemoryUsage() const { return mnBufferBytes.load(std::memory_order_relaxed); }
+
+    // Pyramid of the last operator() or BuildImagePyramid, NULL before. The extractor reuses it
+    // for a later image only once no one else holds it.
+    std::shared_ptr<const ImagePyramid> GetImagePyramid() const { return mpPyramid; }
 
 protected:
 
+    // Builds the pyramid into a pyramid of mvpPyramids no one else holds. With fusedPyramid every
+    // level is blurred right after it has been resized and padded, while it is still in the cache.
     void ComputePyramid(cv::Mat image);
 
     // Divides every image in the image pyramid into a grid of cells. Then calculates FAST corners
     // in every cell. Will also try to distribute the calculated features as much as possible using
-    // DistributeOctTree.
+    // the octree distribution.
     void ComputeKeyPointsOctTree(std::vector<std::vector<cv::KeyPoint> >& allKeypoints);
 
-    // Distributes features across the image
-    std::vector<cv::KeyPoint> DistributeOctTree(const std::vector<cv::KeyPoint>& vToDistributeKeys, const int &minX,
-                                           const int &maxX, const int &minY, const int &maxY, const int &nFeatures, const int &level);
+    // FAST detection, octree distribution and orientation for a single pyramid level
+    void ComputeKeyPointsLevel(const int level, std::vector<cv::KeyPoint>& keypoints);
+
+    // Keypoints and descriptors of a single pyramid level, levels are independent of each other
+    // once the pyramid exists. The keypoints are still in the coordinates of the level.
+    void ComputeLevel(const int level, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors);
+
+    // Geometry of a pyramid level. It only depends on the image size and the parameters, so it is
+    // computed once when one of them changes instead of in the loops of every frame.
+    struct LevelLayout
+    {
+        cv::Size size;
+        // area the FAST corners are searched in
+        int minBorderX, minBorderY, maxBorderX, maxBorderY;
+        // the FAST grid without the cells touching an excluded region, and the number of cells
+        // of the whole grid
+        std::vector<cv::Rect> vCells;
+        int nGridCells;
+        // excluded pixels of the level (nonzero), empty if there is no exclusion mask
+        cv::Mat mask;
+    };
+
+    // Rebuilds mvLevelLayouts if the image size or the parameters changed
+    void UpdateLayouts(const cv::Size& imageSize);
+
+    // Octree (or grid) distribution of the FAST corners of a level, with the border, octave and size set
+    void DistributeLevel(const int level, const std::vector<cv::KeyPoint>& vToDistributeKeys,
+                         const int numCells, const int numHigherThreshUsed, const int numLowerThreshUsed,
+                         std::vector<cv::KeyPoint>& keypoints);
+
+    // (re)creates the worker pool according to nThreads
+    void UpdateThreadPool();
+
+    // Rotates the pattern into the patternAngleBins bins and drops the offset tables of the levels
+    void UpdateRotatedPatterns();
+
+    // Offsets of the rotated patterns into a level with rows of step bytes, built on first use
+    const int* GetPatternOffsets(const int level, const size_t step);
 
     void ComputeKeyPointsOld(std::vector<std::vector<cv::KeyPoint> >& allKeypoints);
 
@@ -110,9 +183,20 @@ protected:
 
     std::vector<cv::Point> pattern;
 
+    // The pattern rotated into mnPatternBins angle bins, 512 points per bin. Every level has the
+    // positions as offsets into its rows, mvPatternSteps holds the step they are for.
+    int mnPatternBins = 0;
+    std::vector<cv::Point> mvRotatedPatterns;
+    std::vector<std::vector<int> > mvPatternOffsets;
+    std::vector<size_t> mvPatternSteps;
+
     std::vector<int> mnFeaturesPerLevel;
     std::vector<std::vector<int>> mExcludedRegions;
 
+    // exclusion mask as set, rasterized per level by UpdateLayouts
+    std::vector<std::vector<cv::Point> > mvExcludedPolygons;
+    cv::Mat mExclusionMask;
+
     std::vector<int> umax;
 
     std::vector<float> mvScaleFactor;
@@ -120,6 +204,37 @@ protected:
     std::vector<float> mvLevelSigma2;
     std::vector<float> mvInvLevelSigma2;
 
+    // The pyramid being extracted, its levels and the per level descriptors. The pyramids are
+    // kept between frames, one no frame holds any more is built into again, and its buffers are
+    // only reallocated if the number of levels or the image size changes.
+    std::shared_ptr<ImagePyramid> mpPyramid;
+    std::vector<std::shared_ptr<ImagePyramid> > mvpPyramids;
+    size_t mnNextPyramid = 0;
+    std::vector<cv::Mat> mvImagePyramid;
+    std::vector<cv::Mat> mvLevelDescriptors;
+
+    bool mbKeepImagePyramid = false;
+
+    // Of SetRemap
+    cv::Mat mRemapMap1;
+    cv::Mat mRemapMap2;
+
+    // Layouts for images of mLayoutImageSize, invalidated by UpdateParameters
+    std::vector<LevelLayout> mvLevelLayouts;
+    // Octree buffers of every level, the levels are distributed in parallel
+    std::vector<OctTreeDistribution> mvDistributions;
+    std::vector<GridDistribution> mvGridDistributions;
+    // FAST strengths of every level (FastScores), the cells of a level are detected from them
+    std::vector<cv::Mat> mvFastScores;
+    cv::Size mLayoutImageSize;
+    bool mbLayoutsValid = false;
+
+    // The FAST thresholds and the distribution of the current extraction, read from the parameters
+    // once per image so all cells of all levels use the same values
+    int mnIniThFAST = 0;
+    int mnMinThFAST = 0;
+    bool mbGridDistribution = false;
+
     bool mVisualizationActive = false;
 
     Parameter<bool> visualizeExtractor;
@@ -129,6 +244,17 @@ protected:
     Parameter<int> iniThFAST;
     Parameter<int> minThFAST;
     Parameter<int> cellWidth;
+    Parameter<int> nThreads;
+    Parameter<bool> fusedPyramid;
+    Parameter<int> patternAngleBins;
+    Parameter<bool> gridDistribution;
+    // "Show Extraction" of the extractor registered last, read on every call
+    ParameterHandle<bool> mShowExtraction;
+
+    // nThreads-1 workers, the calling thread extracts as well. NULL when running serially
+    ThreadPool* mpThreadPool;
+
+    std::atomic<size_t> mnBufferBytes;
 };
 
 } //namespace ORB_SLAM
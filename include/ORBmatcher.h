@@ -29,6 +29,8 @@
 #include"MapPoint.h"
 #include"KeyFrame.h"
 #include"Frame.h"
+#include"PointProjection.h"
+#include"BowDistanceBatch.h"
 
 
 namespace ORB_SLAM2
@@ -43,9 +45,17 @@ public:
     // Computes the Hamming distance between two ORB descriptors
     static int DescriptorDistance(const cv::Mat &a, const cv::Mat &b);
 
-    // Search matches between Frame keypoints and projected MapPoints. Returns number of matches
-    // Used to track the local map (Tracking)
-    int SearchByProjection(Frame &F, const std::vector<MapPoint*> &vpMapPoints, const float th=3);
+    // Computes the Hamming distance between the query descriptor and the rows vIndices of descriptors
+    // (one vs many, uses the vectorized kernels of HammingDistance)
+    static void DescriptorDistances(const cv::Mat &query, const cv::Mat &descriptors,
+                                    const std::vector<size_t> &vIndices, std::vector<int> &vDistances);
+    // Same against the descriptors at block + vIndices[i]*step
+    static void DescriptorDistances(const uint8_t* query, const uint8_t* block, const size_t step,
+                                    const std::vector<size_t> &vIndices, std::vector<int> &vDistances);
+
+    // Search matches between Frame keypoints and the MapPoints projected by Frame::ProjectLocalMap.
+    // Returns number of matches. Used to track the local map (Tracking)
+    int SearchByProjection(Frame &F, const float th=3);
 
     // Project MapPoints tracked in last frame into the current frame and search matches.
     // Used to track from previous frame (Tracking)
@@ -55,9 +65,23 @@ public:
     // Used in relocalisation (Tracking)
     int SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const std::set<MapPoint*> &sAlreadyFound, const float th, const int ORBdist);
 
+    // Structure of arrays copy of the viewing geometry and descriptors of MapPoints projected with
+    // a Similarity Transformation. The loop MapPoints are searched in many keyframes (the current
+    // keyframe and all its corrected neighbors), the copy is taken once and the projection into
+    // every keyframe runs over contiguous arrays instead of reading the points one by one.
+    struct ProjectionPoints : public PointProjection::Points
+    {
+        // Copies the points, bad ones get an empty scale invariance region and never project
+        void Set(const std::vector<MapPoint*> &vpPoints);
+
+        // One row per point
+        cv::Mat mDescriptors;
+    };
+
     // Project MapPoints using a Similarity Transformation and search matches.
     // Used in loop detection (Loop Closing)
      int SearchByProjection(KeyFrame* pKF, cv::Mat Scw, const std::vector<MapPoint*> &vpPoints, std::vector<MapPoint*> &vpMatched, int th);
+     int SearchByProjection(KeyFrame* pKF, cv::Mat Scw, const ProjectionPoints &points, std::vector<MapPoint*> &vpMatched, int th);
 
     // Search matches between MapPoints in a KeyFrame and ORB in a Frame.
     // Brute force constrained to ORB that belong to the same vocabulary node (at a certain level)
@@ -65,6 +89,13 @@ public:
     int SearchByBoW(KeyFrame *pKF, Frame &F, std::vector<MapPoint*> &vpMapPointMatches);
     int SearchByBoW(KeyFrame *pKF1, KeyFrame* pKF2, std::vector<MapPoint*> &vpMatches12);
 
+    // The same searches with the distances of candidate i of a batch computed for all candidates
+    // at once, pKF is that candidate (pKF2 for a keyframe query)
+    int SearchByBoW(const BowDistanceBatch &batch, const size_t i, KeyFrame *pKF, Frame &F,
+                    std::vector<MapPoint*> &vpMapPointMatches);
+    int SearchByBoW(const BowDistanceBatch &batch, const size_t i, KeyFrame *pKF1, KeyFrame* pKF2,
+                    std::vector<MapPoint*> &vpMatches12);
+
     // Matching for the Map Initialization (only used in the monocular case)
     int SearchForInitialization(Frame &F1, Frame &F2, std::vector<cv::Point2f> &vbPrevMatched, std::vector<int> &vnMatches12, int windowSize=10);
 
@@ -79,8 +110,17 @@ public:
     // Project MapPoints into KeyFrame and search for duplicated MapPoints.
     int Fuse(KeyFrame* pKF, const vector<MapPoint *> &vpMapPoints, const float th=3.0); //param
 
+    // The two steps of Fuse. The search only reads the map, so several searches can run in parallel.
+    // It appends the MapPoints with the keypoint of pKF they were matched to. Applying replaces the
+    // duplicated MapPoints or adds the observations and skips matches the map changes since made invalid.
+    // With a replacer the keyframe entries wait for its Apply, so that many fusions share the locks.
+    typedef std::pair<MapPoint*,size_t> FuseMatch;
+    void SearchFuseMatches(KeyFrame* pKF, const vector<MapPoint *> &vpMapPoints, std::vector<FuseMatch> &vMatches, const float th=3.0); //param
+    int ApplyFuseMatches(KeyFrame* pKF, const std::vector<FuseMatch> &vMatches, MapPointReplacer* pReplacer=NULL);
+
     // Project MapPoints into KeyFrame using a given Sim3 and search for duplicated MapPoints.
     int Fuse(KeyFrame* pKF, cv::Mat Scw, const std::vector<MapPoint*> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint);
+    int Fuse(KeyFrame* pKF, cv::Mat Scw, const ProjectionPoints &points, float th, vector<MapPoint *> &vpReplacePoint);
 
 public:
 
@@ -91,11 +131,13 @@ public:
 
 protected:
 
-    bool CheckDistEpipolarLine(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const cv::Mat &F12, const KeyFrame *pKF);
-
     float RadiusByViewingCos(const float &viewCos);
 
-    void ComputeThreeMaxima(std::vector<int>* histo, const int L, int &ind1, int &ind2, int &ind3);
+    // pDistances: those of a BowDistanceBatch, NULL to compute them
+    int SearchByBoW(KeyFrame *pKF, const BowMatchIndex &index, Frame &F, std::vector<MapPoint*> &vpMapPointMatches,
+                    const int* pDistances);
+    int SearchByBoW(KeyFrame *pKF1, const BowMatchIndex &index1, KeyFrame* pKF2, const BowMatchIndex &index2,
+                    std::vector<MapPoint*> &vpMatches12, const int* pDistances);
 
     float mfNNratio;
     bool mbCheckOrientation;
@@ -0,0 +1,57 @@
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Fixed size memory blocks for the objects of one class (MapPoint, KeyFrame).
+// Blocks are cut from large chunks and freed blocks are kept in a free list, so
+// creating and deleting objects all the time neither fragments the heap nor
+// needs a call to the system allocator each time. Chunks are never given back.
+class ObjectPool
+{
+public:
+
+    ObjectPool(const size_t nBlockSize, const size_t nBlocksPerChunk);
+
+    // Chunks are intentionally not released, objects may outlive the pool at exit
+    ~ObjectPool() {}
+
+    void* Allocate();
+    void Free(void* p);
+
+    // Number of blocks handed out and not freed yet
+    size_t GetNumAllocated();
+
+    // Number of blocks in all chunks
+    size_t GetCapacity();
+
+protected:
+
+    struct FreeBlock
+    {
+        FreeBlock* pNext;
+    };
+
+    size_t mnBlockSize;
+    size_t mnBlocksPerChunk;
+
+    FreeBlock* mpFreeList;
+
+    // Blocks of the newest chunk which have not been handed out yet
+    char* mpChunkPos;
+    size_t mnChunkRemaining;
+
+    std::vector<char*> mvpChunks;
+    size_t mnAllocated;
+
+    std::mutex mMutexPool;
+};
+
+} //namespace ORB_SLAM
+
+#endif // OBJECTPOOL_H
@@ -0,0 +1,134 @@
+#ifndef OBSERVATIONLIST_H
+#define OBSERVATIONLIST_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+namespace ORB_SLAM2
+{
+
+// Observations of a MapPoint, (keyframe, index of the keypoint in it) pairs sorted by the mnId
+// of the keyframe, in one array. Most points are seen by a few keyframes only, those live inside
+// the object and need no allocation, the array moves to the heap when it grows beyond them.
+// Iterators are pointers to std::pair, so loops written for std::map<KF*,size_t> keep working.
+// Not thread safe, MapPoint locks around it.
+template<class KF>
+class BasicObservationList
+{
+public:
+    typedef std::pair<KF*,size_t> value_type;
+    typedef value_type* iterator;
+    typedef const value_type* const_iterator;
+
+    static const size_t INLINE_CAPACITY = 3; //param
+
+    BasicObservationList(): mpData(mInline), mnSize(0), mnCapacity(INLINE_CAPACITY) {}
+
+    BasicObservationList(const BasicObservationList &other): mpData(mInline), mnSize(0), mnCapacity(INLINE_CAPACITY)
+    {
+        Assign(other);
+    }
+
+    BasicObservationList& operator=(const BasicObservationList &other)
+    {
+        if(this!=&other)
+        {
+            mnSize = 0;
+            Assign(other);
+        }
+        return *this;
+    }
+
+    ~BasicObservationList()
+    {
+        if(mpData!=mInline)
+            delete[] mpData;
+    }
+
+    iterator begin() { return mpData; }
+    iterator end() { return mpData+mnSize; }
+    const_iterator begin() const { return mpData; }
+    const_iterator end() const { return mpData+mnSize; }
+    size_t size() const { return mnSize; }
+    size_t capacity() const { return mnCapacity; }
+    bool empty() const { return mnSize==0; }
+
+    const_iterator find(const KF* pKF) const
+    {
+        const_iterator it = LowerBound(pKF);
+        return it!=end() && it->first==pKF ? it : end();
+    }
+
+    size_t count(const KF* pKF) const { return find(pKF)!=end(); }
+
+    // Adds the observation, or sets its index if pKF is already there
+    void insert(KF* pKF, const size_t idx)
+    {
+        iterator it = const_cast<iterator>(LowerBound(pKF));
+        if(it!=end() && it->first==pKF)
+        {
+            it->second = idx;
+            return;
+        }
+
+        const size_t pos = it-begin();
+        if(mnSize==mnCapacity)
+            Reserve(2*mnCapacity);
+        std::copy_backward(mpData+pos, mpData+mnSize, mpData+mnSize+1);
+        mpData[pos] = value_type(pKF,idx);
+        mnSize++;
+    }
+
+    void erase(const KF* pKF)
+    {
+        const_iterator it = find(pKF);
+        if(it==end())
+            return;
+        const size_t pos = it-begin();
+        std::copy(mpData+pos+1, mpData+mnSize, mpData+pos);
+        mnSize--;
+    }
+
+    void clear() { mnSize = 0; }
+
+private:
+
+    // First observation whose keyframe does not come before pKF
+    const_iterator LowerBound(const KF* pKF) const
+    {
+        const_iterator it = begin();
+        while(it!=end() && it->first->mnId<pKF->mnId)
+            it++;
+        return it;
+    }
+
+    void Reserve(const size_t nCapacity)
+    {
+        if(nCapacity<=mnCapacity)
+            return;
+        value_type* pData = new value_type[nCapacity];
+        std::copy(mpData, mpData+mnSize, pData);
+        if(mpData!=mInline)
+            delete[] mpData;
+        mpData = pData;
+        mnCapacity = nCapacity;
+    }
+
+    void Assign(const BasicObservationList &other)
+    {
+        Reserve(other.mnSize);
+        std::copy(other.mpData, other.mpData+other.mnSize, mpData);
+        mnSize = other.mnSize;
+    }
+
+    value_type* mpData;
+    size_t mnSize;
+    size_t mnCapacity;
+    value_type mInline[INLINE_CAPACITY];
+};
+
+} //namespace ORB_SLAM
+
+#endif // OBSERVATIONLIST_H
@@ -0,0 +1,70 @@
+#ifndef OCTTREEDISTRIBUTION_H
+#define OCTTREEDISTRIBUTION_H
+
+#include <utility>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Distribution of the FAST corners of a level over the image: the area is divided into
+// quadrants until there are as many nodes as features wanted, or every node holds one corner,
+// and the strongest corner of every node is kept. The nodes are kept in one array and refer to
+// ranges of one index array, a division partitions the range of its node in place instead of
+// copying the keypoints into the children, and the list of nodes is linked by their indices.
+// The buffers are kept from one call to the next, so once they have grown a distribution does
+// not allocate. The result is the one of the list based version, nodes are divided and visited
+// in the same order. Not thread safe, the extractor keeps one per level.
+class OctTreeDistribution
+{
+public:
+
+    // vKeys are relative to (minX,minY), vResult gets at most about N of them
+    void Distribute(const std::vector<cv::KeyPoint> &vKeys, const int minX, const int maxX, const int minY,
+                    const int maxY, const int N, std::vector<cv::KeyPoint> &vResult);
+
+protected:
+
+    struct Node
+    {
+        // corners of the area, upper left and bottom right
+        int ulx, uly, brx, bry;
+        // range of mvIndices holding the keypoints of the node
+        int begin, end;
+        // neighbours in the list, -1 at its ends
+        int prev, next;
+        bool bNoMore;
+
+        int Size() const { return end-begin; }
+    };
+
+    // Creates the node of the area and the range in the arena
+    int NewNode(const int ulx, const int uly, const int brx, const int bry, const int begin, const int end);
+
+    // Creates the four quadrants of the node, the empty ones are -1
+    void Divide(const int node, int children[4]);
+
+    void PushFront(const int node);
+    // Unlinks the node, returns the one after it
+    int Erase(const int node);
+
+    const std::vector<cv::KeyPoint>* mpKeys;
+
+    std::vector<Node> mvNodes;
+    std::vector<int> mvIndices;
+    std::vector<int> mvScratch;
+    std::vector<unsigned char> mvQuadrants;
+    std::vector<int> mvIniCounts;
+    std::vector<int> mvIniPos;
+    int mnHead;
+    int mnSize;
+
+    std::vector<std::pair<int,int> > mvSizeAndNode;
+    std::vector<std::pair<int,int> > mvPrevSizeAndNode;
+};
+
+} //namespace ORB_SLAM
+
+#endif // OCTTREEDISTRIBUTION_H
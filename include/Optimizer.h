@@ -27,34 +27,179 @@
 #include "LoopClosing.h"
 #include "Frame.h"
 
+#include "Thirdparty/g2o/g2o/core/sparse_optimizer.h"
 #include "Thirdparty/g2o/g2o/types/types_seven_dof_expmap.h"
 
+#include <atomic>
+#include <chrono>
+
 namespace ORB_SLAM2
 {
 
 class LoopClosing;
+class LocalBAProblem;
+class EssentialGraph;
 
 class Optimizer
 {
 public:
+    // Linear solvers of the map-wide problems (global BA, essential graph)
+    enum eLinearSolver{
+        SPARSE_CHOLESKY=0,
+        PCG=1
+    };
+
+    // Only call before the threads start. The Cholesky solvers of the local and map-wide
+    // problems order the blocks instead of the scalar matrix if bBlockOrdering is true.
+    void static SetLinearSolver(const eLinearSolver solver, const bool bBlockOrdering);
+
+    // Only call before the threads start. The bundle adjustments (each round of the local one)
+    // and the essential graph stop iterating once an iteration lowered the chi2 by less than
+    // fRelativeChi2 of it, or the norm of its update is under fMinUpdateNorm. 0 turns a test off.
+    void static SetConvergence(const float fRelativeChi2, const float fMinUpdateNorm);
+
+    // Only call before the threads start. PoseOptimization computes its residuals and Jacobians
+    // in float instead of double (PoseSolver::SetSinglePrecision).
+    void static SetSinglePrecision(const bool bSinglePrecision);
+
+    // Threads the map-wide problems use from their next optimization on (0: all cores), any
+    // thread can change it while they run (LatencyScheduler)
+    void static SetMaxThreads(const int nThreads);
+
+    // Only call before the threads start. A global BA of more than nKeyFrames keyframes
+    // (0: never) is solved as PartitionedBundleAdjustment with submaps of nKeyFrames.
+    void static SetPartitionedGlobalBA(const int nKeyFrames);
+
+    // Time budget of a bundle adjustment. The iterations stop at the deadline, a local BA also
+    // only optimizes the nMaxKeyFrames most covisible keyframes (0: all) and shortens or skips
+    // its second round to finish in time.
+    struct BABudget
+    {
+        BABudget(): nMaxKeyFrames(0) {}
+
+        std::chrono::steady_clock::time_point deadline;
+        int nMaxKeyFrames;
+    };
+
+    // What a bundle adjustment did, times in seconds
+    struct BAReport
+    {
+        BAReport(): nKeyFrames(0), nFixedKeyFrames(0), nMapPoints(0), nIterations(0), nOutlierIterations(0),
+            bOutlierPass(false), nOutliers(0), bDeadlineReached(false), bConverged(false), bStale(false), tBudget(0),
+            tElapsed(0) {}
+
+        int nKeyFrames;
+        int nFixedKeyFrames;
+        int nMapPoints;
+        int nIterations;
+        // Second round of the local BA, without the outliers
+        int nOutlierIterations;
+        bool bOutlierPass;
+        // Observations over the chi2 threshold at the end, erased by the local BA
+        int nOutliers;
+        // Robust chi2 before the first iteration of each round and after every iteration
+        std::vector<double> vChi2;
+        // The budget cut the optimization short
+        bool bDeadlineReached;
+        // A round stopped early since it converged
+        bool bConverged;
+        // The map was corrected meanwhile, only the outliers were applied
+        bool bStale;
+        double tBudget;
+        double tElapsed;
+    };
+
+    // The keyframes in vpFixedKF only constrain the points, observations in other keyframes are ignored
     void static BundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
                                  int nIterations = 5, bool *pbStopFlag=NULL, const unsigned long nLoopKF=0,
-                                 const bool bRobust = true);
+                                 const bool bRobust = true,
+                                 const std::vector<KeyFrame*> &vpFixedKF = std::vector<KeyFrame*>(),
+                                 const BABudget* pBudget=NULL, BAReport* pReport=NULL);
     void static GlobalBundleAdjustemnt(Map* pMap, int nIterations=5, bool *pbStopFlag=NULL,
-                                       const unsigned long nLoopKF=0, const bool bRobust = true);
-    void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap);
+                                       const unsigned long nLoopKF=0, const bool bRobust = true,
+                                       const BABudget* pBudget=NULL, BAReport* pReport=NULL);
+
+    // Bundle adjustment of the keyframes split into submaps of about nPartitionKF covisible
+    // keyframes, grown from the strongest covisibility links. The submaps are solved in parallel
+    // (SetMaxThreads), each with the points its keyframes see and the other keyframes observing
+    // them fixed. They are stitched by a boundary re-solve: the points seen by several submaps
+    // start from the mean of their estimates, and the keyframes observing them are optimized
+    // again with their points, the rest fixed. The budget covers all of it.
+    void static PartitionedBundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
+                                            const int nPartitionKF, int nIterations=5, bool *pbStopFlag=NULL,
+                                            const unsigned long nLoopKF=0, const bool bRobust=true,
+                                            const BABudget* pBudget=NULL, BAReport* pReport=NULL);
+
+    // Global BA restricted to the keyframes in vpRegionKF and the points they see, the other
+    // keyframes observing these points are fixed
+    void static RegionBundleAdjustment(const std::vector<KeyFrame*> &vpRegionKF, int nIterations=5,
+                                       bool *pbStopFlag=NULL, const unsigned long nLoopKF=0,
+                                       const bool bRobust = true,
+                                       const BABudget* pBudget=NULL, BAReport* pReport=NULL);
+    // pProblem keeps the graph for the next call, a temporary one is used if it is NULL.
+    // nIterations with all observations, then nMoreIterations without the outliers.
+    void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap, LocalBAProblem* pProblem=NULL,
+                                      const BABudget* pBudget=NULL, BAReport* pReport=NULL,
+                                      const int nIterations=5, const int nMoreIterations=10);
     int static PoseOptimization(Frame* pFrame);
+    // Pose of a rig whose first camera is pFrame. The observations of the frames of the other
+    // cameras, with poses vTcr[i] times the one of pFrame, constrain it as well, their poses and
+    // outliers are set too. Returns the inliers of all the frames.
+    int static PoseOptimization(Frame* pFrame, const std::vector<Frame*> &vpRigFrames, const std::vector<cv::Mat> &vTcr);
 
-    // if bFixScale is true, 6DoF optimization (stereo,rgbd), 7DoF otherwise (mono)
+    // if bFixScale is true, 6DoF optimization (stereo,rgbd), 7DoF otherwise (mono).
+    // pGraph keeps the edge topology and the solver for the next loop, a temporary one is used if
+    // it is NULL.
     void static OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
                                        const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                                        const LoopClosing::KeyFrameAndPose &CorrectedSim3,
                                        const map<KeyFrame *, set<KeyFrame *> > &LoopConnections,
-                                       const bool &bFixScale);
+                                       const bool &bFixScale, BAReport* pReport=NULL,
+                                       EssentialGraph* pGraph=NULL);
 
     // if bFixScale is true, optimize SE3 (stereo,rgbd), Sim3 otherwise (mono)
     static int OptimizeSim3(KeyFrame* pKF1, KeyFrame* pKF2, std::vector<MapPoint *> &vpMatches1,
                             g2o::Sim3 &g2oS12, const float th2, const bool bFixScale);
+
+    // Bytes of the vertices, edges and Hessian blocks of a graph, estimated from their number
+    // and dimensions
+    static size_t EstimateMemoryUsage(const g2o::SparseOptimizer &optimizer);
+
+    // Largest graph of a global or region bundle adjustment so far
+    static size_t GetPeakBundleAdjustmentMemory();
+
+protected:
+
+    // Poses of the keyframes and positions of the points a bundle adjustment starts from or
+    // found, in the order of its inputs
+    struct BAEstimates
+    {
+        // vpKF, then vpFixedKF, as g2o::SE3Quat::toVector. Zero for a keyframe left out.
+        std::vector<g2o::Vector7d> vPoses;
+        std::vector<g2o::Vector7d> vFixedPoses;
+        std::vector<Eigen::Vector3d> vPoints;
+        // The points without an observation in the problem are left out
+        std::vector<bool> vbIncluded;
+    };
+
+    // The optimization of BundleAdjustment, starting from pInitial if it is not NULL, from the
+    // keyframes and points otherwise. Nothing is written to them.
+    void static SolveBundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
+                                      const std::vector<KeyFrame*> &vpFixedKF, const BAEstimates* pInitial,
+                                      int nIterations, bool *pbStopFlag, const bool bRobust,
+                                      const BABudget* pBudget, BAReport* pReport, BAEstimates &result);
+
+    // The poses and positions found, or their GBA copies for a loop (nLoopKF)
+    void static StoreBundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
+                                      const BAEstimates &estimates, const unsigned long nLoopKF);
+
+    static eLinearSolver meLinearSolver;
+    static bool mbBlockOrdering;
+    static float mfConvergenceChi2;
+    static float mfMinUpdateNorm;
+    static bool mbSinglePrecision;
+    static std::atomic<size_t> mnPeakBAMemory;
+    static int mnPartitionKeyFrames;
 };
 
 } //namespace ORB_SLAM
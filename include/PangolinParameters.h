@@ -0,0 +1,49 @@
+#ifndef PANGOLINPARAMETERS_H
+#define PANGOLINPARAMETERS_H
+
+#include "Parameter.h"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <pangolin/pangolin.h>
+#include <boost/variant.hpp>
+
+namespace ORB_SLAM2 {
+
+// The parameters as entries of the Pangolin panels of the viewer, part of the viewer module.
+// The viewer creates the entries, updateParameters syncs them on the tracking thread.
+class PangolinParameters : public ParameterFrontend
+{
+public:
+
+    // The panel has to exist, its entries are named panel_name.parameter
+    void createEntries(const std::string& panel_name, ParameterGroup target_group);
+
+    virtual void sync() override;
+
+    virtual bool hasEntry(const ParameterBase* param) override;
+
+private:
+
+    typedef boost::variant<pangolin::Var<bool>*, pangolin::Var<int>*, pangolin::Var<float>*,
+            pangolin::Var<double>*, pangolin::Var<std::string>* > PangolinVariants;
+
+    typedef std::map<ParameterGroup, std::map<std::string,
+            std::pair<ParameterBase*, PangolinVariants>>> ParameterPairMap;
+
+    static void onGuiVarChanged(void* data, const std::string& name, pangolin::VarValueGenericBase& var);
+
+    template<typename T>
+    void createEntry(ParameterBase* param, const std::string& panel_name);
+
+    template<typename T>
+    static void updateValue(ParameterBase* param, PangolinVariants& pango_var_variant);
+
+    // Guards pangolinParams, taken before parametersMutex
+    std::mutex mMutex;
+    ParameterPairMap pangolinParams;
+};
+}
+
+#endif  // PANGOLINPARAMETERS_H
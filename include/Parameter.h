@@ -3,8 +3,12 @@
 
 #include "Logging.h"
 
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
-#include <pangolin/pangolin.h>
 #include <boost/variant.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -29,6 +33,7 @@ class ParameterBase
 {
 protected:
     friend class ParameterManager;
+    friend class ParameterFrontend;
     enum ParameterCategory
     {
         MINMAX,
@@ -38,6 +43,12 @@ protected:
     };
 
     static std::map<ParameterGroup, std::map<std::string, ParameterBase*> > parametersDict;
+    // Guards parametersDict, the frontends read it from their own threads
+    static std::mutex parametersMutex;
+    // Set when a value changed in the code or in the gui since the last updateParameters
+    static std::atomic<bool> parametersChanged;
+    // Incremented when a parameter is registered or deleted, ParameterHandle resolves again then
+    static std::atomic<unsigned int> parametersRegistered;
     virtual void onUpdate() const {};
     virtual void setValueInternal(const bool& value){};
     virtual void setValueInternal(const int& value){};
@@ -76,12 +87,14 @@ public:
         , mGroup(group)
         , mOnUpdateCallback(onUpdateCallback)
     {
+        std::unique_lock<std::mutex> lock(parametersMutex);
         std::map<std::string, ParameterBase*>::iterator found_it = parametersDict[group].find(name);
         if(found_it != parametersDict[group].end())
         {
             LOG(WARNING) << "Duplicate parameter: " << name;
         }
         parametersDict[group][name] = this;
+        parametersRegistered++;
     }
 
     Parameter(const std::string& name, const T& value, const T& minValue,
@@ -95,12 +108,14 @@ public:
         , mGroup(group)
         , mOnUpdateCallback(onUpdateCallback)
     {
+        std::unique_lock<std::mutex> lock(parametersMutex);
         std::map<std::string, ParameterBase*>::iterator found_it = parametersDict[group].find(name);
         if(found_it != parametersDict[group].end())
         {
             LOG(WARNING) << "Duplicate parameter: " << name;
         }
         parametersDict[group][name] = this;
+        parametersRegistered++;
     }
 
     Parameter(const std::string& name, const T& value, const ParameterGroup& group,
@@ -113,36 +128,42 @@ public:
         , mGroup(group)
         , mOnUpdateCallback(onUpdateCallback)
     {
+        std::unique_lock<std::mutex> lock(parametersMutex);
         std::map<std::string, ParameterBase*>::iterator found_it = parametersDict[group].find(name);
         if(found_it != parametersDict[group].end())
         {
             LOG(WARNING) << "Duplicate parameter: " << name;
         }
         parametersDict[group][name] = this;
+        parametersRegistered++;
     }
 
     virtual ~Parameter()
     {
         LOG(WARNING) << "Parameter being deleted: " << mName;
+        std::unique_lock<std::mutex> lock(parametersMutex);
         parametersDict[mGroup][mName] = nullptr;
+        parametersRegistered++;
     };
 
-    const T& getValue() const { return mValue; };
-    virtual void setValue(const T& value) { mValue = value; mChangedInCode = true; };
+    // The value is atomic, any thread can read it while the viewer thread updates it
+    T getValue() const { return mValue.load(std::memory_order_relaxed); };
+    virtual void setValue(const T& value)
+    {
+        mValue.store(value, std::memory_order_relaxed);
+        mVersion++;
+        mChangedInCode = true;
+        parametersChanged = true;
+    };
     const bool checkAndResetIfChanged()
     {
-        if(mChangedThroughPangolin)
-        {
-            mChangedThroughPangolin = false;
-            return true;
-        }
-        else
-        {
-            return false;
-        }
+        return mChangedThroughPangolin.exchange(false);
     };
 
-    const T operator()()
+    // Incremented on every change of the value, in the code or in the gui
+    unsigned int getVersion() const { return mVersion.load(std::memory_order_acquire); };
+
+    T operator()() const
     {
         return getValue();
     }
@@ -153,101 +174,223 @@ public:
 
 protected:
     friend class ParameterManager;
+    friend class ParameterFrontend;
 
     virtual const ParameterVariant getMinValue() const override { return mMinValue; };
     virtual const ParameterVariant getMaxValue() const override { return mMaxValue; };
     virtual const ParameterCategory getCategory() const override { return mCategory; };
     virtual const std::string getName() const override { return mName; };
     virtual const ParameterGroup getGroup() const override { return mGroup; };
-    virtual const ParameterVariant getVariant() const override { return mValue; }; // cannot return a const ref because implicitly casted
-    virtual void setValueInternal(const T& value) override { mValue = value; };
+    virtual const ParameterVariant getVariant() const override { return getValue(); };
+    virtual void setValueInternal(const T& value) override
+    {
+        mValue.store(value, std::memory_order_relaxed);
+        mVersion++;
+    };
     virtual void onUpdate() const override { mOnUpdateCallback(); };
 
-    T mValue;
+    std::atomic<T> mValue;
+    std::atomic<unsigned int> mVersion{0};
     std::string mName;
     ParameterGroup mGroup;
-    bool mChangedThroughPangolin = false;
-    bool mChangedInCode = false;
+    std::atomic<bool> mChangedThroughPangolin{false};
+    std::atomic<bool> mChangedInCode{false};
     std::function<void(void)> mOnUpdateCallback;
 };
 
 
+// A gui which shows the parameters and changes them (the Pangolin panel of the viewer module).
+// ParameterManager::updateParameters syncs it on the thread which updates the parameters. The
+// frontends are no friends of the parameters, the helpers below are what they may change.
+class ParameterFrontend : public ParameterBase
+{
+public:
+    virtual ~ParameterFrontend(){};
+
+    // Takes the changes in the gui and shows the changes in the code, runs the callbacks of both
+    virtual void sync() = 0;
+
+    // Whether the gui has an entry for the parameter, sync runs its callback then
+    virtual bool hasEntry(const ParameterBase* param) = 0;
+
+protected:
+    template<typename T>
+    static bool changedInCode(ParameterBase* param)
+    {
+        return static_cast<Parameter<T>* >(param)->mChangedInCode;
+    }
+
+    template<typename T>
+    static void clearChangedInCode(ParameterBase* param)
+    {
+        static_cast<Parameter<T>* >(param)->mChangedInCode = false;
+    }
+
+    // A value entered in the gui, seen by checkAndResetIfChanged
+    template<typename T>
+    static void setValueFromGui(ParameterBase* param, const T& value)
+    {
+        param->setValueInternal(value);
+        static_cast<Parameter<T>* >(param)->mChangedThroughPangolin = true;
+    }
+
+    static void runCallback(ParameterBase* param)
+    {
+        param->onUpdate();
+    }
+};
+
+
 class ParameterManager : public ParameterBase
 {
 public:
 
-    typedef boost::variant<pangolin::Var<bool>*, pangolin::Var<int>*, pangolin::Var<float>*,
-            pangolin::Var<double>*, pangolin::Var<std::string>* > PangolinVariants;
+    // Installed by the viewer, nullptr without a gui
+    static void setFrontend(ParameterFrontend* pFrontend)
+    {
+        frontend = pFrontend;
+        parametersChanged = true;
+    }
+
+
+    // Cheap when nothing changed, the parameters are only walked after a change
+    static void updateParameters()
+    {
+        if(!parametersChanged.exchange(false))
+            return;
+
+        applyRequests();
+
+        ParameterFrontend* pFrontend = frontend.load();
+        if(pFrontend)
+            pFrontend->sync();
+    }
+
+    template<typename T>
+    static Parameter<T>* getParameter(ParameterGroup group, const std::string& name)
+    {
+        std::unique_lock<std::mutex> lock(parametersMutex);
+        return static_cast<Parameter<T>* >(findParameter(group, name));
+    }
 
-    typedef std::map<ParameterGroup, std::map<std::string,
-            std::pair<ParameterBase*, PangolinVariants>>> ParameterPairMap;
+    // Backend independent access for the frontends without Pangolin (ParameterServer). Parameters
+    // are named by group and name, the values are text.
 
+    // Panel names of the viewer, "tracking", "localMapping", ...
+    static const char* getGroupName(ParameterGroup group)
+    {
+        switch (group)
+        {
+            case ParameterGroup::PARAMETER: return "parameters";
+            case ParameterGroup::MAIN: return "menu";
+            case ParameterGroup::ORBEXTRACTOR: return "extractor";
+            case ParameterGroup::INITIALIZATION: return "initialization";
+            case ParameterGroup::TRACKING: return "tracking";
+            case ParameterGroup::RELOCALIZATION: return "relocalization";
+            case ParameterGroup::LOCAL_MAPPING: return "localMapping";
+            case ParameterGroup::LOOP_CLOSING: return "loopClosing";
+            default: return "undefined";
+        }
+    }
 
-    static void createPangolinEntries(const std::string& panel_name, ParameterGroup target_group)
+    static bool getGroup(const std::string& groupName, ParameterGroup& group)
     {
-        for(std::map<std::string, ParameterBase*>::iterator it = parametersDict[target_group].begin(); it != parametersDict[target_group].end(); it++)
+        for(int i = 0; i < static_cast<int>(ParameterGroup::UNDEFINED); i++)
         {
-            auto& param = it->second;
-            switch (param->getVariant().which())
+            if(groupName == getGroupName(static_cast<ParameterGroup>(i)))
             {
-                case 0: // bool
-                    createPangolinEntry<bool>(param, panel_name);
-                    break;
-                case 1: // int
-                    createPangolinEntry<int>(param, panel_name);
-                    break;
-                case 2: // float
-                    createPangolinEntry<float>(param, panel_name);
-                    break;
-                case 3: // double
-                    createPangolinEntry<double>(param, panel_name);
-                    break;
+                group = static_cast<ParameterGroup>(i);
+                return true;
             }
         }
+        return false;
     }
 
-    static void updateParameters()
+    // One line per parameter: group, name, type, value, then min and max of the sliders,
+    // separated by tabs. Only the given parameter if name is not empty, false if it doesn't exist.
+    static bool describeParameters(std::vector<std::string>& lines, ParameterGroup group = ParameterGroup::UNDEFINED,
+            const std::string& name = "")
     {
-        for(ParameterPairMap::iterator it_groups = pangolinParams.begin(); it_groups != pangolinParams.end(); it_groups++)
+        std::unique_lock<std::mutex> lock(parametersMutex);
+        if(!name.empty())
         {
-            for(std::map<std::string, std::pair<ParameterBase*, PangolinVariants>>::iterator it = it_groups->second.begin(); it != it_groups->second.end(); it++)
+            ParameterBase* param = findParameter(group, name);
+            if(!param)
+                return false;
+            lines.push_back(describe(param));
+            return true;
+        }
+
+        for(ParameterDictionary::iterator it_groups = parametersDict.begin(); it_groups != parametersDict.end(); it_groups++)
+        {
+            if(it_groups->first == ParameterGroup::UNDEFINED)
+                continue;
+            for(std::map<std::string, ParameterBase*>::iterator it = it_groups->second.begin(); it != it_groups->second.end(); it++)
             {
-                auto& pango_var_variant = it->second.second;
-                auto& param = it->second.first;
+                if(it->second)
+                    lines.push_back(describe(it->second));
+            }
+        }
+        return true;
+    }
 
-                const int& type = param->getVariant().which();
+    // Any thread: checks the value and queues it, the next updateParameters sets it and runs the
+    // callback of the parameter on the thread which updates the parameters, as for the gui.
+    // False with the reason in error if the parameter doesn't exist or the value doesn't fit.
+    static bool requestValue(ParameterGroup group, const std::string& name, const std::string& value,
+            std::string& error)
+    {
+        std::unique_lock<std::mutex> lock(parametersMutex);
+        ParameterBase* param = findParameter(group, name);
+        if(!param)
+        {
+            error = "no such parameter";
+            return false;
+        }
 
-                if (type == 0) // bool
-                {
-                    updateValue<bool>(param, pango_var_variant);
-                }
-                else if (type == 1) // int
-                {
-                    updateValue<int>(param, pango_var_variant);
-                }
-                else if (type == 2) // float
-                {
-                    updateValue<float>(param, pango_var_variant);
-                }
-                else if (type == 3) // double
-                {
-                    updateValue<double>(param, pango_var_variant);
-                }
-            }
+        bool valid = false;
+        switch (param->getVariant().which())
+        {
+            case 0: // bool
+                valid = checkValue<bool>(param, value, error);
+                break;
+            case 1: // int
+                valid = checkValue<int>(param, value, error);
+                break;
+            case 2: // float
+                valid = checkValue<float>(param, value, error);
+                break;
+            case 3: // double
+                valid = checkValue<double>(param, value, error);
+                break;
         }
+        if(!valid)
+            return false;
+
+        requests.push_back(ParameterRequest{group, name, value});
+        parametersChanged = true;
+        return true;
     }
 
-    template<typename T>
-    static Parameter<T>* getParameter(ParameterGroup group, const std::string& name)
+private:
+
+    struct ParameterRequest
+    {
+        ParameterGroup group;
+        std::string name;
+        std::string value;
+    };
+
+    // Call with parametersMutex locked
+    static ParameterBase* findParameter(ParameterGroup group, const std::string& name)
     {
         ParameterDictionary::iterator found_group_it = parametersDict.find(group);
         if(found_group_it != parametersDict.end())
         {
-            std::map<std::string, ParameterBase*>::iterator it = parametersDict[group].find(name);
-            if(it != parametersDict[group].end())
+            std::map<std::string, ParameterBase*>::iterator it = found_group_it->second.find(name);
+            if(it != found_group_it->second.end())
             {
-                auto& param = it->second;
-                return static_cast<Parameter<T>* >(param);
+                return it->second;
             }
             else
             {
@@ -257,97 +400,185 @@ public:
         }
         else
         {
-            DLOG(WARNING) << "Looking for a group which doesn't have any parameters: " << &group;
+            DLOG(WARNING) << "Looking for a group which doesn't have any parameters: " << getGroupName(group);
             return nullptr;
         }
     }
 
-private:
+    static std::string describe(ParameterBase* param)
+    {
+        static const char* types[] = {"bool", "int", "float", "double"};
+        const ParameterVariant value = param->getVariant();
+        std::string line = std::string(getGroupName(param->getGroup())) + "\t" + param->getName() + "\t" +
+                types[value.which()] + "\t" + boost::lexical_cast<std::string>(value);
+        if(param->getCategory() == ParameterCategory::MINMAX)
+        {
+            line += "\t" + boost::lexical_cast<std::string>(param->getMinValue()) +
+                    "\t" + boost::lexical_cast<std::string>(param->getMaxValue());
+        }
+        return line;
+    }
 
     template<typename T>
-    static void createPangolinEntry(ParameterBase* param, const std::string& panel_name)
+    static bool parseValue(const std::string& text, T& value)
     {
-        if (param->getCategory() == ParameterCategory::BOOL)
+        try
         {
-            pangolinParams[param->getGroup()][param->getName()] = std::make_pair(param, (new pangolin::Var<T>(
-                            panel_name + "." + param->getName(), boost::get<T>(param->getVariant()),
-                            boost::get<T>(param->getMaxValue()))));
+            value = boost::lexical_cast<T>(text);
+            return true;
         }
-        else if (param->getCategory() == ParameterCategory::MINMAX)
+        catch(const boost::bad_lexical_cast&)
         {
-            pangolinParams[param->getGroup()][param->getName()] = std::make_pair(param, (new pangolin::Var<T>(
-                            panel_name + "." + param->getName(), boost::get<T>(param->getVariant()),
-                            boost::get<T>(param->getMinValue()),boost::get<T>(param->getMaxValue()))));
+            return false;
         }
-        else if (param->getCategory() == ParameterCategory::TEXTINPUT)
+    }
+
+    // bool also takes true and false
+    static bool parseValue(const std::string& text, bool& value)
+    {
+        if(text == "true" || text == "false")
         {
-            pangolinParams[param->getGroup()][param->getName()] = std::make_pair(param, new pangolin::Var<std::string>(
-                        panel_name + "." + param->getName(), std::to_string(boost::get<T>(param->getVariant()))));
+            value = (text == "true");
+            return true;
         }
+        return parseValue<bool>(text, value);
     }
 
     template<typename T>
-    static void updateValue(ParameterBase* param, PangolinVariants& pango_var_variant)
+    static bool checkValue(ParameterBase* param, const std::string& text, std::string& error)
     {
-        // If the ParameterCategory is TEXTINPUT the pangolin::var needs to be cast
-        // from a string to the type value holds in the parameter, this is done here
-        // through a boost::lexical_cast. All other cases are managed by the else block
-        T param_value = boost::get<T>(param->getVariant());
-
-        if (param->getCategory() == ParameterCategory::TEXTINPUT)
+        T value;
+        if(!parseValue(text, value))
         {
-            auto& pango_var = boost::get<pangolin::Var<std::string>* >(pango_var_variant);
-            T pango_var_value = boost::lexical_cast<T>(pango_var->Get());
-
-            if(static_cast<Parameter<T>* >(param)->mChangedInCode)
-            {
-                // When the parameter value was changed from inside the code
-                // adjust the gui variable to show the updated value
-                pango_var->operator=(std::to_string(param_value));
-                static_cast<Parameter<T>* >(param)->mChangedInCode = false;
-                DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
-                param->onUpdate();
-            }
-            else if(pango_var_value != param_value)
-            {
-                // When the pangolin var value was changed via the user
-                // adjust the parameter to the desired value
-                param->setValueInternal(pango_var_value);
-                static_cast<Parameter<T>* >(param)->mChangedThroughPangolin = true;
-                param_value = boost::get<T>(param->getVariant());
-                DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
-                param->onUpdate();
-            }
+            error = "invalid value";
+            return false;
         }
-        else
+        if(param->getCategory() == ParameterCategory::MINMAX &&
+           (value < boost::get<T>(param->getMinValue()) || value > boost::get<T>(param->getMaxValue())))
         {
-            auto& pango_var = boost::get<pangolin::Var<T>* >(pango_var_variant);
+            error = "out of range";
+            return false;
+        }
+        return true;
+    }
 
-            if(pango_var->Get() != param_value)
+    template<typename T>
+    static void applyValue(ParameterBase* param, const std::string& text)
+    {
+        T value;
+        if(!parseValue(text, value))
+            return;
+
+        param->setValueInternal(value);
+        // Shown by the gui, and seen by checkAndResetIfChanged like a change in the gui
+        static_cast<Parameter<T>* >(param)->mChangedInCode = true;
+        static_cast<Parameter<T>* >(param)->mChangedThroughPangolin = true;
+        DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << value;
+    }
+
+    static void applyRequests()
+    {
+        std::vector<ParameterRequest> pending;
+        std::vector<ParameterBase*> updated;
+        {
+            std::unique_lock<std::mutex> lock(parametersMutex);
+            pending.swap(requests);
+            for(size_t i = 0; i < pending.size(); i++)
             {
-                if(static_cast<Parameter<T>* >(param)->mChangedInCode)
-                {
-                    // When the parameter value was changed from inside the code
-                    // adjust the gui variable to show the updated value
-                    pango_var->operator=(param_value);
-                    static_cast<Parameter<T>* >(param)->mChangedInCode = false;
-                    DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
-                }
-                else
+                ParameterBase* param = findParameter(pending[i].group, pending[i].name);
+                if(!param)
+                    continue;
+
+                switch (param->getVariant().which())
                 {
-                    // When the pangolin var value was changed via the user
-                    // adjust the parameter to the desired value
-                    param->setValueInternal(pango_var->Get());
-                    static_cast<Parameter<T>* >(param)->mChangedThroughPangolin = true;
-                    param_value = boost::get<T>(param->getVariant());
-                    DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
+                    case 0: // bool
+                        applyValue<bool>(param, pending[i].value);
+                        break;
+                    case 1: // int
+                        applyValue<int>(param, pending[i].value);
+                        break;
+                    case 2: // float
+                        applyValue<float>(param, pending[i].value);
+                        break;
+                    case 3: // double
+                        applyValue<double>(param, pending[i].value);
+                        break;
                 }
-                param->onUpdate();
+
+                updated.push_back(param);
             }
         }
+
+        // Outside of the lock, the callbacks may look up parameters. The gui entries run the
+        // callback once they took the value.
+        ParameterFrontend* pFrontend = frontend.load();
+        for(size_t i = 0; i < updated.size(); i++)
+        {
+            if(!pFrontend || !pFrontend->hasEntry(updated[i]))
+                updated[i]->onUpdate();
+        }
     }
 
-    static ParameterPairMap pangolinParams;
+    static std::vector<ParameterRequest> requests;
+
+    static std::atomic<ParameterFrontend*> frontend;
+};
+
+// Parameter looked up by name once instead of on every read, for the hot paths which read
+// a parameter owned by another object. It resolves again only when parameters were registered
+// or deleted since, so a read is two atomic loads. A handle is used by one thread at a time.
+template <typename T>
+class ParameterHandle : public ParameterBase
+{
+public:
+    ParameterHandle(const ParameterGroup& group, const std::string& name)
+        : mGroup(group)
+        , mName(name)
+        , mpParameter(nullptr)
+        , mnRegistered(parametersRegistered.load()-1)
+        , mnVersion(0)
+    {}
+
+    // nullptr while no parameter of that name is registered
+    Parameter<T>* get()
+    {
+        const unsigned int nRegistered = parametersRegistered.load(std::memory_order_acquire);
+        if(nRegistered != mnRegistered)
+        {
+            mpParameter = ParameterManager::getParameter<T>(mGroup, mName);
+            mnRegistered = nRegistered;
+            if(mpParameter)
+                mnVersion = mpParameter->getVersion();
+        }
+        return mpParameter;
+    }
+
+    // defaultValue while the parameter does not exist
+    T operator()(const T& defaultValue = T())
+    {
+        Parameter<T>* param = get();
+        return param ? param->getValue() : defaultValue;
+    }
+
+    // True once after every change of the value since the last call
+    bool changed()
+    {
+        Parameter<T>* param = get();
+        if(!param)
+            return false;
+        const unsigned int nVersion = param->getVersion();
+        if(nVersion == mnVersion)
+            return false;
+        mnVersion = nVersion;
+        return true;
+    }
+
+private:
+    ParameterGroup mGroup;
+    std::string mName;
+    Parameter<T>* mpParameter;
+    unsigned int mnRegistered;
+    unsigned int mnVersion;
 };
 }
 
@@ -0,0 +1,71 @@
+#ifndef PARAMETERSERVER_H
+#define PARAMETERSERVER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Retunes the parameters of the ParameterManager without the viewer, over a text protocol on
+// TCP (ParameterServer.Port, only on the loopback interface). A command is one line with its
+// fields separated by tabs, groups are named as the panels of the viewer:
+//   list                         every parameter
+//   get   <group> <name>         one parameter
+//   set   <group> <name> <value> queues the value, it is set before the next frame
+// Parameters are listed as group, name, type, value and min, max of the sliders, one per line.
+// Every reply ends with a line "ok" or "error <reason>". The server only polls its sockets, the
+// tracking picks the values up in ParameterManager::updateParameters, which is cheap while
+// nothing changed.
+class ParameterServer
+{
+public:
+
+    ParameterServer(const int port);
+    ~ParameterServer();
+
+    // Main function
+    void Run();
+
+    void RequestFinish();
+    bool isFinished();
+
+protected:
+
+    struct Client
+    {
+        int fd;
+        // Received, not a complete line yet
+        std::string inbox;
+        // Replies not sent yet, from nSent on
+        std::string outbox;
+        size_t nSent;
+    };
+
+    bool Listen();
+    void AcceptClients();
+
+    // False if the client is gone
+    bool Receive(Client &client);
+    bool Send(Client &client);
+    void CloseClient(Client &client);
+
+    void HandleCommand(const std::string &command, std::string &reply);
+
+    bool CheckFinish();
+    void SetFinish();
+
+    int mPort;
+
+    int mnListenFd;
+    std::vector<Client> mvClients;
+
+    bool mbFinishRequested;
+    bool mbFinished;
+    std::mutex mMutexFinish;
+};
+
+} //namespace ORB_SLAM
+
+#endif // PARAMETERSERVER_H
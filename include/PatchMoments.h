@@ -0,0 +1,34 @@
+#ifndef PATCHMOMENTS_H
+#define PATCHMOMENTS_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace ORB_SLAM2
+{
+
+// Intensity centroid moments m_01 (rows) and m_10 (columns) of the circular ORB patches the
+// orientation of the keypoints is computed from, for many keypoints per call. The rows of the
+// patch are weighted by vectors built once per call from the circle.
+// The kernel (scalar, AVX2 or NEON) is chosen once at runtime depending on what the cpu
+// supports, all kernels return the exact same moments.
+class PatchMoments
+{
+public:
+    // radius of the patch
+    static const int kHalfPatchSize = 15;
+
+    // image: 8 bit, step bytes per row. umax: the half width of every row of the circle,
+    // kHalfPatchSize+1 values. positions: x and y of n keypoints, at least kHalfPatchSize away
+    // from the image borders. The moments m_01 and m_10 of keypoint i are written to
+    // moments[2*i] and moments[2*i+1].
+    static void Compute(const uint8_t* image, const size_t step, const int* umax, const int* positions,
+                        const size_t n, int* moments);
+
+    // Name of the kernel that is used on this machine
+    static const char* KernelName();
+};
+
+}// namespace ORB_SLAM
+
+#endif // PATCHMOMENTS_H
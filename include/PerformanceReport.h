@@ -0,0 +1,93 @@
+#ifndef PERFORMANCEREPORT_H
+#define PERFORMANCEREPORT_H
+
+#include "StageTimer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+namespace ORB_SLAM2
+{
+
+// JSON lines report of the work done per frame, keyframe, loop and global BA
+// (Logging.ReportFile), to find the frames and keyframes which were slow and what they saw. Every
+// line is one object with "type" "frame", "keyframe", "loop" or "global_ba" and "stages_us", the
+// microseconds each stage of the thread which wrote it took since its last record: the tracking
+// stages for a frame, the local mapping ones for a keyframe, the loop detection and correction
+// for a loop, the global BA for one. As the event log, the records are queued in a lock free ring
+// and a writer thread formats them and writes them in batches. Records which do not fit are
+// dropped and counted.
+class PerformanceReport
+{
+public:
+
+    enum Type
+    {
+        FRAME=0,
+        KEYFRAME=1,
+        LOOP=2,
+        GLOBAL_BA=3
+    };
+
+    // Matches found by each tracking strategy for a frame, 0 for the ones not tried
+    enum Strategy
+    {
+        FLOW=0,
+        MOTION_MODEL,
+        REFERENCE_KEYFRAME,
+        RELOCALIZATION,
+        LOCAL_MAP,
+        NUM_STRATEGIES
+    };
+
+    static const int NUM_STAGES = static_cast<int>(Stage::NUM_STAGES);
+
+    struct Record
+    {
+        Type type;
+        // Frame: id of the frame. Keyframe: id of the keyframe. Loop and global BA: id of the
+        // current keyframe of the loop.
+        unsigned long nId;
+        // Frame: id of the keyframe made from it, -1 for none. Keyframe: id of its frame. Loop: id
+        // of the matched keyframe.
+        long nOther;
+        double timestamp;
+        // Seconds since the report was opened
+        double wallTime;
+        // Frame: tracking state after it
+        int nState;
+        // Frame: features extracted
+        int nFeatures;
+        // Frame: inliers of the pose. Keyframe: keyframes waiting behind it. Loop and global BA:
+        // keyframes corrected.
+        int nCount;
+        int vnMatches[NUM_STRATEGIES];
+        float vfStageTimes[NUM_STAGES];
+    };
+
+    // Starts writing to filename, nCapacity records can be queued. False if it can't be opened.
+    static bool Open(const std::string &filename, const size_t nCapacity=4096);
+
+    // Writes the records queued and closes the file
+    static void Close();
+
+    static bool IsOpen() { return mbOpen.load(std::memory_order_relaxed); }
+
+    // A record with every count zero, for the caller to fill
+    static Record NewRecord(const Type type);
+
+    // Takes the stage times of the type since the last record of the same type, the records of a
+    // type come from one thread
+    static void Add(Record &record);
+
+    // Number of records dropped by the report opened last
+    static size_t GetNumDropped();
+
+private:
+    static std::atomic<bool> mbOpen;
+};
+
+} //namespace ORB_SLAM
+
+#endif // PERFORMANCEREPORT_H
@@ -52,8 +52,10 @@
 #define PNPSOLVER_H
 
 #include <opencv2/core/core.hpp>
+#include <Eigen/Core>
 #include "MapPoint.h"
 #include "Frame.h"
+#include "RandomStream.h"
 
 namespace ORB_SLAM2
 {
@@ -69,11 +71,33 @@ class PnPsolver {
 
   cv::Mat find(vector<bool> &vbInliers, int &nInliers);
 
+  // Runs at least nIterations RANSAC iterations. The hypotheses are drawn and scored in
+  // batches, then visited in order as if they had been evaluated one at a time.
   cv::Mat iterate(int nIterations, bool &bNoMore, vector<bool> &vbInliers, int &nInliers);
 
  private:
 
+  typedef Eigen::Matrix<double,6,10,Eigen::RowMajor> Matrix6x10d;
+  typedef Eigen::Matrix<double,6,4,Eigen::RowMajor> Matrix6x4d;
+  typedef Eigen::Matrix<double,6,1> Vector6d;
+
+  // Pose of a minimal set and its number of inliers
+  struct Hypothesis
+  {
+    double R[3][3];
+    double t[3];
+    int nInliers;
+  };
+
+  // Draws nHypotheses minimal sets, computes their poses and counts their inliers
+  void EvaluateHypotheses(const int nHypotheses);
+
+  // Inliers of the current estimation (mRi, mti)
   void CheckInliers();
+
+  // Number of inliers of the pose, without the mask
+  int CountInliers(const double R[3][3], const double t[3]) const;
+
   bool Refine();
 
   // Functions from the original EPnP code
@@ -93,16 +117,16 @@ class PnPsolver {
 
   void choose_control_points(void);
   void compute_barycentric_coordinates(void);
-  void fill_M(CvMat * M, const int row, const double * alphas, const double u, const double v);
+  void fill_M(Eigen::Matrix<double,2,12> &M, const double * alphas, const double u, const double v);
   void compute_ccs(const double * betas, const double * ut);
   void compute_pcs(void);
 
   void solve_for_sign(void);
 
-  void find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void find_betas_approx_3(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void qr_solve(CvMat * A, CvMat * b, CvMat * X);
+  void find_betas_approx_1(const Matrix6x10d & L_6x10, const Vector6d & Rho, double * betas);
+  void find_betas_approx_2(const Matrix6x10d & L_6x10, const Vector6d & Rho, double * betas);
+  void find_betas_approx_3(const Matrix6x10d & L_6x10, const Vector6d & Rho, double * betas);
+  void qr_solve(Matrix6x4d & A, Vector6d & b, Eigen::Vector4d & X);
 
   double dot(const double * v1, const double * v2);
   double dist2(const double * p1, const double * p2);
@@ -110,9 +134,9 @@ class PnPsolver {
   void compute_rho(double * rho);
   void compute_L_6x10(const double * ut, double * l_6x10);
 
-  void gauss_newton(const CvMat * L_6x10, const CvMat * Rho, double current_betas[4]);
+  void gauss_newton(const Matrix6x10d & L_6x10, const Vector6d & Rho, double current_betas[4]);
   void compute_A_and_b_gauss_newton(const double * l_6x10, const double * rho,
-				    double cb[4], CvMat * A, CvMat * b);
+				    double cb[4], Matrix6x4d & A, Vector6d & b);
 
   double compute_R_and_t(const double * ut, const double * betas,
 			 double R[3][3], double t[3]);
@@ -127,7 +151,8 @@ class PnPsolver {
 
   double uc, vc, fu, fv;
 
-  double * pws, * us, * alphas, * pcs;
+  // Buffers of the correspondences, they only grow
+  vector<double> pws, us, alphas, pcs;
   int maximum_number_of_correspondences;
   int number_of_correspondences;
 
@@ -137,11 +162,11 @@ class PnPsolver {
   vector<MapPoint*> mvpMapPointMatches;
 
   // 2D Points
-  vector<cv::Point2f> mvP2D;
+  vector<float> mvU, mvV;
   vector<float> mvSigma2;
 
   // 3D Points
-  vector<cv::Point3f> mvP3Dw;
+  vector<float> mvX, mvY, mvZ;
 
   // Index in Frame
   vector<size_t> mvKeyPointIndices;
@@ -150,18 +175,22 @@ class PnPsolver {
   double mRi[3][3];
   double mti[3];
   cv::Mat mTcwi;
-  vector<bool> mvbInliersi;
+  vector<unsigned char> mvbInliersi;
   int mnInliersi;
 
+  // Current batch of hypotheses
+  vector<Hypothesis> mvHypotheses;
+  vector<size_t> mvAvailableIndices;
+
   // Current Ransac State
   int mnIterations;
-  vector<bool> mvbBestInliers;
+  vector<unsigned char> mvbBestInliers;
   int mnBestInliers;
   cv::Mat mBestTcw;
 
   // Refined
   cv::Mat mRefinedTcw;
-  vector<bool> mvbRefinedInliers;
+  vector<unsigned char> mvbRefinedInliers;
   int mnRefinedInliers;
 
   // Number of Correspondences
@@ -170,6 +199,9 @@ class PnPsolver {
   // Indices for random selection [0 .. N-1]
   vector<size_t> mvAllIndices;
 
+  // Draws the minimal sets, seeded by the frame and the matched points
+  RandomStream mRandom;
+
   // RANSAC probability
   double mRansacProb;
 
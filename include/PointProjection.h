@@ -0,0 +1,94 @@
+#ifndef POINTPROJECTION_H
+#define POINTPROJECTION_H
+
+#include <vector>
+#include <Eigen/Core>
+
+namespace ORB_SLAM2
+{
+
+class MapPoint;
+class Frame;
+class KeyFrame;
+
+// Batched projection of map points into a pinhole camera, shared by the frustum culling of the
+// frame and all projective searches of the matcher. The points are a structure of arrays, the
+// transform, depth, image bounds, scale invariance and viewing angle tests run on whole arrays,
+// which Eigen vectorizes (SSE/AVX or NEON). Only the visible points come out, compacted, with
+// what the searches need of them.
+class PointProjection
+{
+public:
+    typedef Eigen::Array<float,Eigen::Dynamic,1> ArrayXf;
+
+    // Viewing geometry of the points. Clear keeps the arrays, a searcher reusing one does not
+    // allocate once it saw its largest set.
+    struct Points
+    {
+        void Clear();
+        void Reserve(const size_t n);
+
+        // The geometry of a good point
+        void Add(MapPoint* pMP);
+        // Bad points get an empty scale invariance region and never project
+        void Add(MapPoint* pMP, const Eigen::Vector3f &P, const Eigen::Vector3f &Pn,
+                 const float minDistance, const float maxDistance);
+
+        size_t Size() const { return mvpMapPoints.size(); }
+
+        std::vector<MapPoint*> mvpMapPoints;
+
+        // World position
+        std::vector<float> mvX, mvY, mvZ;
+
+        // Mean viewing direction
+        std::vector<float> mvNx, mvNy, mvNz;
+
+        // Scale invariance distances
+        std::vector<float> mvMinDistance, mvMaxDistance;
+    };
+
+    // Where and through which tests the points project
+    struct Camera
+    {
+        // Intrinsics and image bounds of the frame or keyframe, the pose is left to set.
+        // KeyFrame::IsInImage excludes the maxima of the bounds, the frames include them.
+        void SetImage(const Frame &F);
+        void SetImage(KeyFrame* pKF);
+
+        // SE3 or Sim3 from the frame of the points to the camera, Pc = R*P+t. The distance is
+        // the norm of Pc. R has to be a rotation if the viewing angle is tested.
+        Eigen::Matrix3f R;
+        Eigen::Vector3f t;
+
+        float fx, fy, cx, cy;
+        float minX, maxX, minY, maxY;
+        bool bIncludeMax;
+
+        // Test the distance against the scale invariance region
+        bool bScaleInvariance;
+        // Minimum cosine between the viewing ray and the mean viewing direction, -1: not tested
+        float fMinViewCos;
+    };
+
+    // The points which passed, by their index in the Points
+    struct Visible
+    {
+        void Clear();
+        size_t Size() const { return vnIndex.size(); }
+
+        std::vector<int> vnIndex;
+        std::vector<float> vu;
+        std::vector<float> vv;
+        std::vector<float> vInvZ;
+        std::vector<float> vDist;
+        // Only if the viewing angle is tested
+        std::vector<float> vViewCos;
+    };
+
+    static void Project(const Points &points, const Camera &camera, Visible &visible);
+};
+
+} //namespace ORB_SLAM
+
+#endif // POINTPROJECTION_H
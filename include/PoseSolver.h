@@ -0,0 +1,128 @@
+#ifndef POSESOLVER_H
+#define POSESOLVER_H
+
+#include <cstddef>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "Thirdparty/g2o/g2o/types/se3quat.h"
+
+namespace ORB_SLAM2
+{
+
+// Levenberg-Marquardt on the pose of a single camera with fixed map points, the problem of
+// Optimizer::PoseOptimization. It follows the steps of the g2o Levenberg solver with the
+// pose-only monocular and stereo edges (same Jacobians, Huber kernel, damping and stopping
+// rule), but the observations are kept in flat arrays and the 6x6 system is solved in place,
+// so no graph is built. The arrays keep their capacity, a solver which is reused does not
+// allocate once it has seen the largest frame. The other cameras of a rig (AddCamera) add their
+// monocular observations to the same pose, the one of the camera of Reset.
+// The observations are stored as the floats they come from. With SetSinglePrecision the residuals
+// and Jacobians are computed in float as well, twice as many per SIMD instruction; the normal
+// equations, the chi2 sums and the pose update stay in double.
+class PoseSolver
+{
+public:
+    PoseSolver();
+
+    // Starts a new problem with the calibration of the frame
+    void Reset(const double fx, const double fy, const double cx, const double cy, const double bf);
+
+    // Float residuals and Jacobians from the next Optimize or ComputeChi2 on
+    void SetSinglePrecision(const bool bSinglePrecision) { mbSinglePrecision = bSinglePrecision; }
+
+    // Observations of Xw at pixel (u,v), stereo ones also at ur in the right image.
+    // They start as inliers.
+    void AddMono(const Eigen::Vector3f &Xw, const float u, const float v, const float invSigma2);
+    void AddStereo(const Eigen::Vector3f &Xw, const float u, const float v, const float ur,
+                   const float invSigma2);
+
+    // Another camera of the rig, Tcr takes points from the camera of Reset to it. Returns the
+    // index of the camera for AddRig.
+    std::size_t AddCamera(const double fx, const double fy, const double cx, const double cy, const g2o::SE3Quat &Tcr);
+    // Monocular observation of Xw at pixel (u,v) of camera nCamera
+    void AddRig(const std::size_t nCamera, const Eigen::Vector3f &Xw, const float u, const float v,
+                const float invSigma2);
+
+    // Refines Tcw with at most nIterations iterations on the inlier observations.
+    // The Huber kernel (deltaMono, deltaStereo) is only used if bRobust.
+    void Optimize(g2o::SE3Quat &Tcw, const int nIterations, const bool bRobust);
+
+    // Squared error of every observation at Tcw, weighted by its information
+    void ComputeChi2(const g2o::SE3Quat &Tcw);
+
+    std::size_t NumMono() const { return mMono.Size(); }
+    std::size_t NumStereo() const { return mStereo.Size(); }
+    std::size_t NumRig() const { return mRig.Size(); }
+
+    double Chi2Mono(const std::size_t i) const { return mMono.vChi2[i]; }
+    double Chi2Stereo(const std::size_t i) const { return mStereo.vChi2[i]; }
+    double Chi2Rig(const std::size_t i) const { return mRig.vChi2[i]; }
+
+    void SetInlierMono(const std::size_t i, const bool bInlier) { mMono.vbInlier[i] = bInlier; }
+    void SetInlierStereo(const std::size_t i, const bool bInlier) { mStereo.vbInlier[i] = bInlier; }
+    void SetInlierRig(const std::size_t i, const bool bInlier) { mRig.vbInlier[i] = bInlier; }
+
+    double deltaMono;
+    double deltaStereo;
+
+protected:
+    typedef Eigen::Matrix<double,6,6> Matrix6d;
+    typedef Eigen::Matrix<double,6,1> Vector6d;
+
+    // Structure of arrays, one entry per observation. vUr is only filled for stereo.
+    struct Observations
+    {
+        std::size_t Size() const { return vX.size(); }
+        void Clear();
+
+        std::vector<float> vX, vY, vZ;
+        std::vector<float> vU, vV, vUr;
+        std::vector<float> vInvSigma2;
+        std::vector<double> vChi2;
+        std::vector<unsigned char> vbInlier;
+    };
+
+    struct Camera
+    {
+        double fx, fy, cx, cy;
+        Eigen::Matrix3d Rcr;
+        Eigen::Vector3d tcr;
+    };
+
+    // The kernels below compute the residuals and Jacobians in T, float or double
+
+    // Observation i of the rig in its camera, for the pose Tcw of the first camera
+    template<typename T>
+    Eigen::Matrix<T,3,1> RigPoint(const std::size_t i, const Eigen::Matrix<T,3,3> &R, const Eigen::Matrix<T,3,1> &t) const;
+    template<typename T>
+    Eigen::Matrix<T,2,1> RigError(const std::size_t i, const Eigen::Matrix<T,3,1> &Xc) const;
+
+    // Robust chi2 of the inliers at Tcw
+    template<typename T>
+    double ComputeCost(const g2o::SE3Quat &Tcw, const bool bRobust) const;
+
+    // Gauss-Newton system H dx = b of the inliers at Tcw. Returns the robust chi2.
+    template<typename T>
+    double BuildSystem(const g2o::SE3Quat &Tcw, const bool bRobust, Matrix6d &H, Vector6d &b) const;
+
+    // Chi2 of every observation, for ComputeChi2
+    template<typename T>
+    void UpdateChi2(const g2o::SE3Quat &Tcw);
+
+    double fx, fy, cx, cy, bf;
+
+    bool mbSinglePrecision;
+
+    Observations mMono;
+    Observations mStereo;
+
+    std::vector<Camera> mvCameras;
+    Observations mRig;
+    std::vector<std::size_t> mvRigCamera;
+};
+
+} //namespace ORB_SLAM
+
+#endif // POSESOLVER_H
@@ -0,0 +1,54 @@
+#ifndef RANDOMSTREAM_H
+#define RANDOMSTREAM_H
+
+#include <stdint.h>
+
+namespace ORB_SLAM2
+{
+
+// Random numbers of one RANSAC solver (SplitMix64). The seed comes from what is solved (frame,
+// keyframe and point ids), so the minimal sets drawn do not depend on which solvers ran before
+// on other threads, unlike the process-wide rand() behind DUtils::Random.
+class RandomStream
+{
+public:
+    explicit RandomStream(const uint64_t seed=0): mnState(seed) {}
+
+    void Seed(const uint64_t seed)
+    {
+        mnState = seed;
+    }
+
+    // Uniform in [min,max]
+    int RandomInt(const int min, const int max)
+    {
+        const uint64_t d = static_cast<uint64_t>(max-min+1);
+        return min+static_cast<int>(((Next()>>32)*d)>>32);
+    }
+
+    // Seed of a pair of values, also for chaining more
+    static uint64_t Hash(const uint64_t a, const uint64_t b=0)
+    {
+        return Mix(Mix(a)^(b+0x9E3779B97F4A7C15ULL));
+    }
+
+protected:
+    static uint64_t Mix(uint64_t z)
+    {
+        z = (z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+        z = (z^(z>>27))*0x94D049BB133111EBULL;
+        return z^(z>>31);
+    }
+
+    uint64_t Next()
+    {
+        mnState += 0x9E3779B97F4A7C15ULL;
+        return Mix(mnState);
+    }
+
+    uint64_t mnState;
+};
+
+} //namespace ORB_SLAM
+
+#endif // RANDOMSTREAM_H
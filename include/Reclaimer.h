@@ -0,0 +1,78 @@
+#ifndef RECLAIMER_H
+#define RECLAIMER_H
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class MapPoint;
+class KeyFrame;
+
+// Frees bad MapPoints and KeyFrames once no thread can hold a pointer to them anymore
+// (quiescent state based reclamation). Every thread which works on the map registers a slot
+// and announces a quiescent state at the end of each iteration of its loop, right after it
+// dropped the pointers to bad objects it keeps between iterations. An object is retired
+// after it has been removed from the map and the covisibility graph, and it is freed when
+// every registered thread has passed a few quiescent states since then.
+//
+// MapPoints are deleted. KeyFrames keep their pose and spanning tree links, which the
+// trajectory needs until the end, only their features are released.
+class Reclaimer
+{
+public:
+    Reclaimer();
+
+    // Only call when no thread works on the map anymore
+    ~Reclaimer();
+
+    // Returns the slot of the calling thread
+    int RegisterThread();
+    void UnregisterThread(const int nId);
+
+    // The thread holds no pointer to a retired object which it got before this call
+    void QuiescentState(const int nId);
+
+    void Retire(MapPoint* pMP);
+    void Retire(KeyFrame* pKF);
+
+    // Deletes all retired objects right away, only call when no thread works on the map (reset)
+    void Clear();
+
+    // Number of retired objects which have not been freed yet
+    size_t GetNumPending();
+
+protected:
+
+    struct Batch
+    {
+        unsigned long nEpoch;
+        std::vector<MapPoint*> vpMapPoints;
+        std::vector<KeyFrame*> vpKeyFrames;
+    };
+
+    void Free(std::vector<Batch> &vBatches);
+
+    unsigned long mnGlobalEpoch;
+
+    // Last epoch each thread has seen in a quiescent state
+    std::vector<unsigned long> mvnLocalEpochs;
+    std::vector<bool> mvbActive;
+
+    // Objects retired since the last quiescent state and batches waiting for their grace period
+    Batch mCurrentBatch;
+    std::deque<Batch> mqSealedBatches;
+    size_t mnPending;
+
+    // KeyFrames whose features are released, they are deleted on Clear
+    std::vector<KeyFrame*> mvpReleasedKeyFrames;
+
+    std::mutex mMutexReclaimer;
+};
+
+} //namespace ORB_SLAM
+
+#endif // RECLAIMER_H
@@ -0,0 +1,42 @@
+#ifndef ROTATIONHISTOGRAM_H
+#define ROTATIONHISTOGRAM_H
+
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Rotation consistency check of the matcher: the matches are binned by the difference of the
+// angles of their keypoints, and those outside the three largest bins (and outside the second
+// and third if they hold less than a tenth of the largest) are rejected. The matches are kept in
+// one flat buffer and sorted into the bins by counting, each thread has one histogram reused by
+// all its searches, so a search allocates nothing once the buffers have grown.
+class RotationHistogram
+{
+public:
+    static const int HISTO_LENGTH = 30; //param
+
+    // The histogram of the calling thread, empty. Only one search of a thread can use it at a time.
+    static RotationHistogram& Local();
+
+    void Clear();
+
+    // Match idx between keypoints with the angles angle1 and angle2, in degrees
+    void Add(const float angle1, const float angle2, const int idx);
+
+    // Matches of the rejected bins, by bin and in the order they were added
+    const std::vector<int>& ComputeRejected();
+
+protected:
+    // Indices of the three largest bins, -1 if there is none or it is too small
+    void ComputeThreeMaxima(int &ind1, int &ind2, int &ind3) const;
+
+    int mCounts[HISTO_LENGTH];
+    std::vector<unsigned char> mvBins;
+    std::vector<int> mvIndices;
+    std::vector<int> mvRejected;
+};
+
+} //namespace ORB_SLAM
+
+#endif // ROTATIONHISTOGRAM_H
@@ -0,0 +1,84 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+namespace ORB_SLAM2
+{
+
+// Bounded queue of N values (a power of two) between one producer and one consumer thread,
+// without locks: each side only writes its own index and publishes it with a release store.
+// Empty and Size can be called from any thread and are exact as of some moment during the call.
+// The consumer side (Pop, ForEach, Clear) can move to another thread while the consumer thread
+// is parked, if the hand-off between the two synchronizes (a mutex both take).
+template<class T, size_t N>
+class SPSCQueue
+{
+public:
+    SPSCQueue(): mnHead(0), mnTail(0)
+    {
+        static_assert(N>0 && (N&(N-1))==0, "SPSCQueue capacity must be a power of two");
+    }
+
+    // Producer, false if the queue is full
+    bool Push(const T &value)
+    {
+        const size_t nTail = mnTail.load(std::memory_order_relaxed);
+        if(nTail-mnHead.load(std::memory_order_acquire)==N)
+            return false;
+        mData[nTail&(N-1)] = value;
+        mnTail.store(nTail+1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer, false if the queue is empty
+    bool Pop(T &value)
+    {
+        const size_t nHead = mnHead.load(std::memory_order_relaxed);
+        if(nHead==mnTail.load(std::memory_order_acquire))
+            return false;
+        value = mData[nHead&(N-1)];
+        mnHead.store(nHead+1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer, calls f on every queued value from the oldest, without popping them
+    template<class F>
+    void ForEach(F f) const
+    {
+        const size_t nTail = mnTail.load(std::memory_order_acquire);
+        for(size_t i=mnHead.load(std::memory_order_relaxed); i!=nTail; i++)
+            f(mData[i&(N-1)]);
+    }
+
+    // Consumer, drops the values queued so far
+    void Clear()
+    {
+        mnHead.store(mnTail.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    bool Empty() const
+    {
+        return Size()==0;
+    }
+
+    size_t Size() const
+    {
+        // The head first: the tail read after it is never behind it
+        const size_t nHead = mnHead.load(std::memory_order_acquire);
+        return mnTail.load(std::memory_order_acquire)-nHead;
+    }
+
+protected:
+    // Counters of the values popped and pushed, the slot is the counter modulo N. The consumer and
+    // the producer write one each, the padding keeps them off the same cache line.
+    std::atomic<size_t> mnHead;
+    char mPadding[64-sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> mnTail;
+    T mData[N];
+};
+
+} //namespace ORB_SLAM
+
+#endif // SPSCQUEUE_H
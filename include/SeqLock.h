@@ -0,0 +1,67 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <atomic>
+#include <thread>
+
+namespace ORB_SLAM2
+{
+
+// Sequence lock around a small fixed-size block of values which is read far more often than
+// it is written (MapPoint position, KeyFrame pose). Readers never block and never make a writer
+// wait: they copy the block and retry if a write happened meanwhile. Writers are not serialized
+// here, the owner has to hold its own mutex around every Write.
+template<class T, int N>
+class SeqLock
+{
+public:
+    SeqLock(): mnSeq(0)
+    {
+        for(int i=0; i<N; i++)
+            mData[i].store(T(0), std::memory_order_relaxed);
+    }
+
+    // Copies n values starting at first into pOut, always a consistent state
+    void Read(T* pOut, const int first=0, const int n=N) const
+    {
+        while(true)
+        {
+            const unsigned int nSeq = mnSeq.load(std::memory_order_acquire);
+            if(nSeq & 1)
+            {
+                // a writer is in the middle of an update
+                std::this_thread::yield();
+                continue;
+            }
+
+            for(int i=0; i<n; i++)
+                pOut[i] = mData[first+i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(mnSeq.load(std::memory_order_relaxed)==nSeq)
+                return;
+        }
+    }
+
+    // Stores n values starting at first
+    void Write(const T* pIn, const int first=0, const int n=N)
+    {
+        const unsigned int nSeq = mnSeq.load(std::memory_order_relaxed);
+        mnSeq.store(nSeq+1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for(int i=0; i<n; i++)
+            mData[first+i].store(pIn[i], std::memory_order_relaxed);
+
+        mnSeq.store(nSeq+2, std::memory_order_release);
+    }
+
+protected:
+    // odd while a write is in progress
+    std::atomic<unsigned int> mnSeq;
+    std::atomic<T> mData[N];
+};
+
+} //namespace ORB_SLAM
+
+#endif // SEQLOCK_H
@@ -0,0 +1,128 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <cstddef>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// The settings file, read once by the System and shared by the subsystems instead of each of them
+// looking its keys up in the YAML. Every value is typed when it is read (a number, a string, an
+// opencv-matrix or a sequence of values) and is read back like a cv::FileNode: a missing key reads
+// as 0 or "", a value of another type reads as 0 or "" with a warning.
+//
+// Save writes the binary form of the values (bin_settings), which Load reads without the YAML
+// parser. The hash of the values is the same for a YAML file and its binary form, it is printed
+// at startup and recorded in the event log and the saved maps.
+class Settings
+{
+public:
+
+    class Node
+    {
+    public:
+
+        enum Type
+        {
+            NONE=0,
+            NUMBER=1,
+            STRING=2,
+            MATRIX=3,
+            SEQUENCE=4
+        };
+
+        Node(): mType(NONE), mNumber(0) {}
+
+        Type type() const { return mType; }
+        bool empty() const { return mType==NONE; }
+        bool isNumber() const { return mType==NUMBER; }
+        bool isString() const { return mType==STRING; }
+        bool isMatrix() const { return mType==MATRIX; }
+        bool isSeq() const { return mType==SEQUENCE; }
+
+        // Key of the value, with the index of an element of a sequence
+        const std::string& name() const { return mName; }
+
+        // Integers are rounded
+        operator int() const;
+        operator float() const;
+        operator double() const;
+        operator std::string() const;
+
+        // A copy of the matrix, empty if the value is not one
+        void operator>>(cv::Mat &mat) const;
+
+        // Elements of a sequence, none for other values
+        size_t size() const { return mvItems.size(); }
+        const Node& operator[](const size_t i) const;
+        std::vector<Node>::const_iterator begin() const { return mvItems.begin(); }
+        std::vector<Node>::const_iterator end() const { return mvItems.end(); }
+
+    protected:
+
+        friend class Settings;
+
+        // Warns that the value is read as a number (bNumber) or a string
+        void WarnType(const bool bNumber) const;
+
+        Type mType;
+        std::string mName;
+        double mNumber;
+        std::string mString;
+        cv::Mat mMatrix;
+        std::vector<Node> mvItems;
+    };
+
+    Settings();
+
+    // A YAML settings file or its binary form, false with a message if it can't be read
+    bool Load(const std::string &filename);
+
+    // The binary form
+    bool Save(const std::string &filename) const;
+
+    static bool IsBinaryFile(const std::string &filename);
+
+    bool IsLoaded() const { return mbLoaded; }
+    const std::string& GetFilename() const { return mFilename; }
+
+    // The value of key, an empty node if it is not in the file
+    const Node& operator[](const std::string &key) const;
+
+    // Prints the missing and out of range values every System of sensor (System::eSensor) needs,
+    // false if there is any
+    bool Validate(const int sensor) const;
+
+    // FNV-1a of the binary form of the values, 0 before a file is loaded
+    uint64_t GetHash() const { return mnHash; }
+
+    // 16 hex digits, for the logs
+    static std::string FormatHash(const uint64_t nHash);
+
+protected:
+
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 1;
+
+    bool LoadYAML(const std::string &filename);
+    bool LoadBinary(const std::string &filename);
+
+    // The values as they are saved after the header, the hash is of these bytes
+    std::vector<char> Encode() const;
+    bool Decode(const std::vector<char> &vData);
+
+    std::string mFilename;
+    bool mbLoaded;
+    std::map<std::string,Node> mmValues;
+    uint64_t mnHash;
+};
+
+} //namespace ORB_SLAM
+
+#endif // SETTINGS_H
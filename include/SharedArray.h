@@ -0,0 +1,86 @@
+#ifndef SHAREDARRAY_H
+#define SHAREDARRAY_H
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Read only array whose elements are either its own or live in memory kept alive by an owner,
+// like a memory mapped map file. Copies share the elements. Frames and KeyFrames keep their
+// keypoints in it: a keyframe shares the ones of its frame, and the ones of a mapped map point
+// into the file instead of the heap.
+template<typename T>
+class SharedArray
+{
+public:
+    SharedArray(): mpData(NULL), mnSize(0), mbOwned(false) {}
+
+    // Copies the elements of v
+    explicit SharedArray(const std::vector<T> &v): mpData(NULL), mnSize(v.size()), mbOwned(true)
+    {
+        if(!v.empty())
+        {
+            std::shared_ptr<std::vector<T> > pElements = std::make_shared<std::vector<T> >(v);
+            mpData = &(*pElements)[0];
+            mpOwner = pElements;
+        }
+    }
+
+    // Takes the elements of v, which is left empty
+    explicit SharedArray(std::vector<T> &&v): mpData(NULL), mnSize(v.size()), mbOwned(true)
+    {
+        if(!v.empty())
+        {
+            std::shared_ptr<std::vector<T> > pElements = std::make_shared<std::vector<T> >();
+            pElements->swap(v);
+            mpData = &(*pElements)[0];
+            mpOwner = pElements;
+        }
+    }
+
+    // Views the n elements at pData, which pOwner keeps alive
+    SharedArray(const T* pData, const std::size_t n, const std::shared_ptr<const void> &pOwner):
+        mpOwner(pOwner), mpData(pData), mnSize(n), mbOwned(false) {}
+
+    const T& operator[](const std::size_t i) const { return mpData[i]; }
+    const T* begin() const { return mpData; }
+    const T* end() const { return mpData+mnSize; }
+    std::size_t size() const { return mnSize; }
+    bool empty() const { return mnSize==0; }
+
+    // Same elements, bit for bit (T is plain data)
+    bool SameElements(const SharedArray &other) const
+    {
+        return mnSize==other.mnSize && (mpData==other.mpData || mnSize==0 ||
+                                        std::memcmp(mpData,other.mpData,mnSize*sizeof(T))==0);
+    }
+
+    // The elements are the ones of other, they are only counted once
+    bool SharesElements(const SharedArray &other) const { return mpData==other.mpData && mnSize>0; }
+
+    // The elements are on the heap, copied or taken from a vector, not a view of an owner's memory
+    bool OwnsElements() const { return mbOwned; }
+
+    // Drops the elements
+    void clear()
+    {
+        mpOwner.reset();
+        mpData = NULL;
+        mnSize = 0;
+        mbOwned = false;
+    }
+
+private:
+    std::shared_ptr<const void> mpOwner;
+    const T* mpData;
+    std::size_t mnSize;
+    bool mbOwned;
+};
+
+} //namespace ORB_SLAM
+
+#endif // SHAREDARRAY_H
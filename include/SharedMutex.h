@@ -0,0 +1,82 @@
+#ifndef SHAREDMUTEX_H
+#define SHAREDMUTEX_H
+
+#include <condition_variable>
+#include <mutex>
+
+namespace ORB_SLAM2
+{
+
+// Readers-writer lock for structures which are queried from several threads and rarely
+// modified (std::shared_mutex is C++17). Any number of readers hold it at the same time,
+// a writer holds it alone. Waiting writers go first, so a stream of queries can not starve
+// them. lock()/unlock() work with std::unique_lock, SharedLock holds it as a reader.
+class SharedMutex
+{
+public:
+    SharedMutex(): mnReaders(0), mnWaitingWriters(0), mbWriter(false) {}
+
+    void lock()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mnWaitingWriters++;
+        mCond.wait(lock, [this]{ return !mbWriter && mnReaders==0; });
+        mnWaitingWriters--;
+        mbWriter = true;
+    }
+
+    void unlock()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mbWriter = false;
+        }
+        mCond.notify_all();
+    }
+
+    void lock_shared()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait(lock, [this]{ return !mbWriter && mnWaitingWriters==0; });
+        mnReaders++;
+    }
+
+    void unlock_shared()
+    {
+        bool bLast;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            bLast = --mnReaders==0;
+        }
+        if(bLast)
+            mCond.notify_all();
+    }
+
+private:
+    SharedMutex(const SharedMutex&);
+    SharedMutex& operator=(const SharedMutex&);
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    int mnReaders;
+    int mnWaitingWriters;
+    bool mbWriter;
+};
+
+// Holds a SharedMutex as a reader for its lifetime
+class SharedLock
+{
+public:
+    explicit SharedLock(SharedMutex &mutex): mMutex(mutex) { mMutex.lock_shared(); }
+    ~SharedLock() { mMutex.unlock_shared(); }
+
+private:
+    SharedLock(const SharedLock&);
+    SharedLock& operator=(const SharedLock&);
+
+    SharedMutex &mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // SHAREDMUTEX_H
@@ -25,7 +25,10 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 
+#include <Eigen/Core>
+
 #include "KeyFrame.h"
+#include "RandomStream.h"
 
 
 
@@ -51,52 +54,58 @@ public:
 
 protected:
 
-    void ComputeCentroid(cv::Mat &P, cv::Mat &Pr, cv::Mat &C);
+    typedef Eigen::Array<float,Eigen::Dynamic,1> ArrayXf;
 
-    void ComputeSim3(cv::Mat &P1, cv::Mat &P2);
+    // Horn's closed form of the Sim3 of a minimal set, the columns of P1 and P2 are the points
+    // in the two cameras. Fixed size, it does not allocate.
+    void ComputeSim3(const Eigen::Matrix3f &P1, const Eigen::Matrix3f &P2);
 
+    // Both reprojection errors of all matches at once, over the arrays below
     void CheckInliers();
 
-    void Project(const std::vector<cv::Mat> &vP3Dw, std::vector<cv::Mat> &vP2D, cv::Mat Tcw, cv::Mat K);
-    void FromCameraToImage(const std::vector<cv::Mat> &vP3Dc, std::vector<cv::Mat> &vP2D, cv::Mat K);
-
-
 protected:
 
     // KeyFrames and matches
     KeyFrame* mpKF1;
     KeyFrame* mpKF2;
 
-    std::vector<cv::Mat> mvX3Dc1;
-    std::vector<cv::Mat> mvX3Dc2;
     std::vector<MapPoint*> mvpMapPoints1;
     std::vector<MapPoint*> mvpMapPoints2;
     std::vector<MapPoint*> mvpMatches12;
     std::vector<size_t> mvnIndices1;
-    std::vector<size_t> mvSigmaSquare1;
-    std::vector<size_t> mvSigmaSquare2;
-    std::vector<size_t> mvnMaxError1;
-    std::vector<size_t> mvnMaxError2;
+
+    // Per match as structure of arrays: the points in the camera of each keyframe, where they
+    // project in it and the maximum squared reprojection errors (9.210*sigma^2, truncated)
+    std::vector<float> mvX1, mvY1, mvZ1;
+    std::vector<float> mvX2, mvY2, mvZ2;
+    std::vector<float> mvU1, mvV1;
+    std::vector<float> mvU2, mvV2;
+    std::vector<float> mvMaxError1;
+    std::vector<float> mvMaxError2;
 
     int N;
     int mN1;
 
     // Current Estimation
-    cv::Mat mR12i;
-    cv::Mat mt12i;
+    Eigen::Matrix3f mR12i;
+    Eigen::Vector3f mt12i;
     float ms12i;
-    cv::Mat mT12i;
-    cv::Mat mT21i;
-    std::vector<bool> mvbInliersi;
+    // Inverse, T21 = [mR21i mt21i] with the scale in mR21i
+    Eigen::Matrix3f mR21i;
+    Eigen::Vector3f mt21i;
+    Eigen::Array<bool,Eigen::Dynamic,1> mvbInliersi;
     int mnInliersi;
 
+    // Squared reprojection errors of the current estimation, sized once
+    ArrayXf mvErr1;
+    ArrayXf mvErr2;
+
     // Current Ransac State
     int mnIterations;
-    std::vector<bool> mvbBestInliers;
+    Eigen::Array<bool,Eigen::Dynamic,1> mvbBestInliers;
     int mnBestInliers;
-    cv::Mat mBestT12;
-    cv::Mat mBestRotation;
-    cv::Mat mBestTranslation;
+    Eigen::Matrix3f mBestRotation;
+    Eigen::Vector3f mBestTranslation;
     float mBestScale;
 
     // Scale is fixed to 1 in the stereo/RGBD case
@@ -104,10 +113,10 @@ protected:
 
     // Indices for random selection
     std::vector<size_t> mvAllIndices;
+    std::vector<size_t> mvAvailableIndices;
 
-    // Projections
-    std::vector<cv::Mat> mvP1im1;
-    std::vector<cv::Mat> mvP2im2;
+    // Draws the minimal sets, seeded by the two keyframes
+    RandomStream mRandom;
 
     // RANSAC probability
     double mRansacProb;
@@ -123,9 +132,8 @@ protected:
     float mSigma2;
 
     // Calibration
-    cv::Mat mK1;
-    cv::Mat mK2;
-
+    float mfx1, mfy1, mcx1, mcy1;
+    float mfx2, mfy2, mcx2, mcy2;
 };
 
 } //namespace ORB_SLAM
@@ -0,0 +1,164 @@
+#ifndef STAGETIMER_H
+#define STAGETIMER_H
+
+#include "Trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Timed stages of the pipeline. Most take one sample per frame or keyframe, POSE_OPTIMIZATION
+// one per call, which the tracking makes a few times per frame.
+enum class Stage
+{
+    // Tracking
+    TRACK,
+    EXTRACT_ORB,
+    FLOW_TRACKING,
+    STEREO_MATCHING,
+    FRAME_BOW,
+    TRACK_REFERENCE_KEYFRAME,
+    TRACK_MOTION_MODEL,
+    IMAGE_ALIGNMENT,
+    RELOCALIZATION,
+    POSE_OPTIMIZATION,
+    SEARCH_LOCAL_POINTS,
+    NEED_NEW_KEYFRAME,
+    // Local Mapping, KEYFRAME_QUEUE is the time a keyframe waited for it
+    KEYFRAME_QUEUE,
+    PROCESS_NEW_KEYFRAME,
+    MAP_POINT_CULLING,
+    CREATE_NEW_MAP_POINTS,
+    SEARCH_IN_NEIGHBORS,
+    LOCAL_BUNDLE_ADJUSTMENT,
+    KEYFRAME_CULLING,
+    BUDGET_CULLING,
+    // Loop Closing
+    DETECT_LOOP,
+    COMPUTE_SIM3,
+    CORRECT_LOOP,
+    GLOBAL_BUNDLE_ADJUSTMENT,
+    NUM_STAGES
+};
+
+class StageTimeSet;
+
+// Durations of the stages, for the whole process. Always on: adding a sample is a few relaxed
+// atomic operations, any thread can time any stage. Every stage keeps a histogram of buckets
+// of powers of two microseconds, enough for quantiles without storing the samples. A thread
+// bound to a StageTimeSet adds its samples to it as well, so the Systems of one process have
+// their own.
+// Define ORB_SLAM2_NO_STAGE_TIMERS (cmake -DSTAGE_TIMERS=OFF) to compile the timers out.
+class StageTimes
+{
+public:
+
+    // Bucket b holds the samples under 2^b microseconds not in a lower one, the last the rest
+    static const int NUM_BUCKETS = 25; //param
+
+    struct Summary
+    {
+        Stage stage;
+        const char* name;
+        uint64_t nCount;
+        // Seconds
+        double total;
+        double last;
+        double max;
+        uint64_t vnBuckets[NUM_BUCKETS];
+
+        double Mean() const { return nCount ? total/nCount : 0.0; }
+
+        // Upper bound of the bucket holding the q quantile (0..1) of the samples, in seconds
+        double Quantile(const double q) const;
+    };
+
+    static void Add(const Stage stage, const std::chrono::steady_clock::duration &d);
+
+    static Summary Get(const Stage stage);
+    // Nanoseconds of all samples so far, without the histogram
+    static uint64_t GetTotalNanoseconds(const Stage stage);
+    static std::vector<Summary> GetAll();
+    static void Reset();
+
+    static const char* Name(const Stage stage);
+
+    // Table of the stages with samples, then their histograms
+    static void Print(std::ostream &out);
+
+    // The stages timed by the calling thread from now on go to pSet as well, NULL: only to the
+    // process
+    static void BindThread(StageTimeSet* pSet);
+};
+
+// Durations of the stages timed by the threads bound to it, those of one System
+class StageTimeSet
+{
+public:
+
+    StageTimeSet();
+
+    void Add(const Stage stage, const uint64_t ns);
+
+    StageTimes::Summary Get(const Stage stage) const;
+    uint64_t GetTotalNanoseconds(const Stage stage) const;
+    std::vector<StageTimes::Summary> GetAll() const;
+    void Reset();
+
+    void Print(std::ostream &out) const;
+
+private:
+
+    StageTimeSet(const StageTimeSet&);
+    StageTimeSet& operator=(const StageTimeSet&);
+
+    // Nanoseconds
+    struct Slot
+    {
+        std::atomic<uint64_t> nCount;
+        std::atomic<uint64_t> nTotal;
+        std::atomic<uint64_t> nLast;
+        std::atomic<uint64_t> nMax;
+        std::atomic<uint64_t> vnBuckets[StageTimes::NUM_BUCKETS];
+    };
+
+    Slot mvSlots[static_cast<int>(Stage::NUM_STAGES)];
+};
+
+// Adds the time between its construction and destruction to a stage, and an event to the trace
+// when one is recorded
+class ScopedStageTimer
+{
+public:
+    explicit ScopedStageTimer(const Stage stage): mStage(stage), mStart(std::chrono::steady_clock::now()) {}
+    ~ScopedStageTimer()
+    {
+        const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        StageTimes::Add(mStage, end-mStart);
+        if(Trace::IsActive())
+            Trace::Complete(StageTimes::Name(mStage), mStart, end);
+    }
+
+private:
+    ScopedStageTimer(const ScopedStageTimer&);
+    ScopedStageTimer& operator=(const ScopedStageTimer&);
+
+    const Stage mStage;
+    const std::chrono::steady_clock::time_point mStart;
+};
+
+} //namespace ORB_SLAM
+
+// Times the rest of the enclosing scope, at most one per scope
+#ifdef ORB_SLAM2_NO_STAGE_TIMERS
+#define STAGE_TIMER(stage)
+#else
+#define STAGE_TIMER(stage) ORB_SLAM2::ScopedStageTimer stageTimer(ORB_SLAM2::Stage::stage)
+#endif
+
+#endif // STAGETIMER_H
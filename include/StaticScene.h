@@ -0,0 +1,63 @@
+#ifndef STATICSCENE_H
+#define STATICSCENE_H
+
+#include <mutex>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+// Power saving while the camera stands still (StaticScene.enable). After nMinFrames tracked
+// frames in a row whose motion model moves less than the thresholds the camera is still, and
+// an image whose thumbnail differs from the one of the last tracked image by less than
+// maxImageDifference is not tracked: it gets the last pose and nothing is extracted. The first
+// image which differs more is tracked in full and ends the still state if it moved, so is every
+// nMaxSkipped+1-th one. Images can be checked on another thread than the one tracking them, so
+// all methods lock.
+class StaticScene
+{
+public:
+
+    struct Settings
+    {
+        int nMinFrames;
+        // per frame, degrees and map units (monocular: the initial median depth is 1)
+        float maxRotation;
+        float maxTranslation;
+        // mean absolute intensity
+        float maxImageDifference;
+        int nMaxSkipped;
+    };
+
+    explicit StaticScene(const Settings &settings);
+
+    // Small grayscale copy of an image, for Skip and AddTracking
+    static cv::Mat Thumbnail(const cv::Mat &im);
+
+    // Whether the image of the thumbnail is skipped, in the order of the images
+    bool Skip(const cv::Mat &thumbnail);
+
+    // The last tracked image: its thumbnail and the velocity of the tracker after it (empty
+    // if it has no motion model)
+    void AddTracking(const cv::Mat &thumbnail, const cv::Mat &velocity);
+
+    bool IsStill();
+
+    void Reset();
+
+protected:
+
+    std::mutex mMutex;
+
+    const Settings mSettings;
+
+    // of the last tracked image
+    cv::Mat mThumbnail;
+    int mnStillFrames;
+    int mnSkippedInRow;
+};
+
+} //namespace ORB_SLAM
+
+#endif // STATICSCENE_H
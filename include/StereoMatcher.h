@@ -0,0 +1,61 @@
+#ifndef STEREOMATCHER_H
+#define STEREOMATCHER_H
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "SharedArray.h"
+
+namespace ORB_SLAM2
+{
+
+class ThreadPool;
+
+// Stereo correspondences of Frame::ComputeStereoMatches on a rectified pair: the best descriptor
+// of the right keypoints in the band of rows of every left keypoint, refined by an 11x11 SAD
+// search on the pyramid level of the keypoint and a parabola fit. The results are the same as
+// the per keypoint search it replaces, with the right keypoints in one flat row index, the
+// descriptor distances of a keypoint computed in one batch and the left keypoints split into
+// blocks which can run on a thread pool.
+class StereoMatcher
+{
+public:
+    StereoMatcher(const SharedArray<cv::KeyPoint> &vKeysLeft, const cv::Mat &descriptorsLeft,
+                  const std::vector<cv::Mat> &vPyramidLeft,
+                  const std::vector<cv::KeyPoint> &vKeysRight, const cv::Mat &descriptorsRight,
+                  const std::vector<cv::Mat> &vPyramidRight,
+                  const std::vector<float> &vScaleFactors, const std::vector<float> &vInvScaleFactors,
+                  const float bf, const float b);
+
+    // Right coordinate and depth of every left keypoint, -1 if it has no match
+    void Match(std::vector<float> &vuRight, std::vector<float> &vDepth, ThreadPool* pThreadPool=NULL);
+
+protected:
+
+    // Rows of the band every right keypoint is searched in, as offsets into mvRowIndices
+    void BuildRowIndex();
+
+    // Matches the left keypoints [begin,end), the SAD distance of the match goes to vDist
+    void MatchRange(const int begin, const int end, std::vector<float> &vuRight, std::vector<float> &vDepth,
+                    std::vector<int> &vDist) const;
+
+    const SharedArray<cv::KeyPoint> &mvKeysLeft;
+    const cv::Mat &mDescriptorsLeft;
+    const std::vector<cv::Mat> &mvPyramidLeft;
+    const std::vector<cv::KeyPoint> &mvKeysRight;
+    const cv::Mat &mDescriptorsRight;
+    const std::vector<cv::Mat> &mvPyramidRight;
+    const std::vector<float> &mvScaleFactors;
+    const std::vector<float> &mvInvScaleFactors;
+    const float mbf;
+    const float mb;
+
+    // Right keypoints whose band contains row y are mvRowIndices[mvRowOffsets[y]..mvRowOffsets[y+1])
+    std::vector<unsigned int> mvRowOffsets;
+    std::vector<size_t> mvRowIndices;
+};
+
+} //namespace ORB_SLAM
+
+#endif // STEREOMATCHER_H
@@ -23,28 +23,52 @@
 #define SYSTEM_H
 
 #include<string>
+#include<chrono>
 #include<thread>
+#include<deque>
+#include<future>
+#include<memory>
+#include<functional>
+#include<condition_variable>
+#include<atomic>
 #include<opencv2/core/core.hpp>
 
 #include "Tracking.h"
 #include "FrameDrawer.h"
-#include "MapDrawer.h"
 #include "Map.h"
 #include "LocalMapping.h"
 #include "LoopClosing.h"
 #include "KeyFrameDatabase.h"
 #include "ORBVocabulary.h"
-#include "Viewer.h"
+#include "Settings.h"
+#include "StageTimer.h"
+#include "MemoryUsage.h"
+#include "MapExporter.h"
+#include "TaskScheduler.h"
+#include "SeqLock.h"
+#include "SharedMutex.h"
+#include "MPSCQueue.h"
+
+#include <Eigen/Core>
 
 namespace ORB_SLAM2
 {
 
-class Viewer;
+class Visualization;
 class FrameDrawer;
+class MapStreamer;
+class ParameterServer;
+class MetricsServer;
+class TrajectoryWriter;
 class Map;
 class Tracking;
 class LocalMapping;
 class LoopClosing;
+class MapTiles;
+class FrameAdmission;
+class LatencyScheduler;
+class StaticScene;
+class MapCheckpointer;
 
 class System
 {
@@ -56,11 +80,58 @@ public:
         RGBD=2
     };
 
+    // What the asynchronous input does with waiting images when a new one comes in
+    // and the queue is full (Async.DropPolicy in the settings file)
+    enum eDropPolicy{
+        DROP_OLDEST=0,  // the oldest waiting image is dropped
+        KEEP_LATEST=1   // all waiting images are dropped, only the newest is processed
+    };
+
+    // Called with the timestamp and camera pose (empty if tracking fails) of every image
+    // given to the asynchronous input, from the thread which tracks them
+    typedef std::function<void(const double&, const cv::Mat&)> TrackingCallback;
+
+    // 8 bit grayscale image in memory owned by the caller, e.g. a DMA buffer of a camera driver
+    // or the luma plane of an NV12 or YUV image. It is read in place, without copy or colour
+    // conversion, step is the number of bytes of a row.
+    struct ExternalImage
+    {
+        const unsigned char* data;
+        int width;
+        int height;
+        size_t step;
+    };
+
+    // Depthmap in meters (DepthMapFactor is not applied) in memory owned by the caller
+    struct ExternalDepth
+    {
+        const float* data;
+        int width;
+        int height;
+        size_t step;
+    };
+
+    // Called once the system does not read the buffers of an external image anymore. The
+    // asynchronous input calls it from its threads, or from the caller for an image it drops.
+    typedef std::function<void()> ReleaseCallback;
+
 public:
 
     // Initialize the SLAM system. It launches the Local Mapping, Loop Closing and Viewer threads.
     System(const string &strVocFile, const string &strSettingsFile, const eSensor sensor, const bool bUseViewer = true);
 
+    // Several Systems in one process (one per camera, parallel replays) can share one vocabulary
+    // from LoadVocabulary, it must outlive them. The calibration and the ids belong to the map of
+    // each System. The parameters of the ParameterManager, the logging and the trace stay
+    // process wide.
+    System(ORBVocabulary* pVocabulary, const string &strSettingsFile, const eSensor sensor, const bool bUseViewer = true);
+
+    // Text or binary vocabulary (see tools/bin_vocabulary), NULL if it can not be read.
+    // With strSharedMemory (Vocabulary.SharedMemory) the vocabulary is attached read only to that
+    // shared memory segment, so all the processes on the machine use one copy; the first process
+    // loads strVocFile and creates the segment. A vocabulary which can't be shared is loaded.
+    static ORBVocabulary* LoadVocabulary(const string &strVocFile, const string &strSharedMemory = string());
+
     // Proccess the given stereo frame. Images must be synchronized and rectified.
     // Input images: RGB (CV_8UC3) or grayscale (CV_8U). RGB is converted to grayscale.
     // Returns the camera pose (empty if tracking fails).
@@ -77,15 +148,112 @@ public:
     // Returns the camera pose (empty if tracking fails).
     cv::Mat TrackMonocular(const cv::Mat &im, const double &timestamp);
 
+    // Proccess the images a monocular camera rig (Rig.nCameras) took at the same time, vIm[0]
+    // from the camera of the Camera.* settings and vIm[i] from Rig.Camera<i>. The features of
+    // all cameras are extracted in parallel and the rig is tracked in one map.
+    // Returns the pose of the first camera (empty if tracking fails).
+    cv::Mat TrackRig(const std::vector<cv::Mat> &vIm, const double &timestamp);
+
+    // Asynchronous versions of the functions above, they return right away. Features of the next
+    // image are extracted on a worker thread while the previous one is still being tracked.
+    // Images wait in a bounded queue (Async.QueueSize), the future returns the camera pose,
+    // which is also empty if the image was dropped. The input images are copied.
+    // Do not mix them with the synchronous functions.
+    // Offline (Offline.nBuilders>0, for recorded sequences) nothing is dropped, the functions
+    // block while the queue is full. That many threads build the frames ahead of the tracker in
+    // parallel and keyframes wait for Local Mapping, throughput over latency.
+    std::future<cv::Mat> TrackStereoAsync(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timestamp);
+    std::future<cv::Mat> TrackRGBDAsync(const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp);
+    std::future<cv::Mat> TrackMonocularAsync(const cv::Mat &im, const double &timestamp);
+
+    // Versions of the functions above for external buffers, which go straight into the pyramid
+    // of the extractor. The buffers must stay valid until release is called, the synchronous
+    // functions call it before they return. The asynchronous ones only copy the images when
+    // release is empty.
+    cv::Mat TrackStereo(const ExternalImage &imLeft, const ExternalImage &imRight, const double &timestamp,
+                        const ReleaseCallback &release=ReleaseCallback());
+    cv::Mat TrackRGBD(const ExternalImage &im, const ExternalDepth &depthmap, const double &timestamp,
+                      const ReleaseCallback &release=ReleaseCallback());
+    cv::Mat TrackMonocular(const ExternalImage &im, const double &timestamp,
+                           const ReleaseCallback &release=ReleaseCallback());
+    std::future<cv::Mat> TrackStereoAsync(const ExternalImage &imLeft, const ExternalImage &imRight,
+                                          const double &timestamp, const ReleaseCallback &release);
+    std::future<cv::Mat> TrackRGBDAsync(const ExternalImage &im, const ExternalDepth &depthmap,
+                                        const double &timestamp, const ReleaseCallback &release);
+    std::future<cv::Mat> TrackMonocularAsync(const ExternalImage &im, const double &timestamp,
+                                             const ReleaseCallback &release);
+
+    // Optional, called for every image tracked by the asynchronous input (not for dropped ones)
+    void SetTrackingCallback(const TrackingCallback &callback);
+
+    // Number of images the asynchronous input has dropped so far
+    size_t GetNumDroppedFrames();
+
+    // Input of a tracking thread owned by the system, for callers which must never block such as
+    // a camera driver. The image is copied into a ring without locks (TrackerThread.QueueSize) and
+    // the functions return right away, false if the ring is full and the image dropped. The
+    // thread, started with the first image, tracks the images in order with the synchronous
+    // functions, so stalls of the tracking (e.g. on a loop correction) only fill the ring. Any
+    // number of threads may submit. Do not mix them with the other Track functions.
+    bool SubmitStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timestamp);
+    bool SubmitRGBD(const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp);
+    bool SubmitMonocular(const cv::Mat &im, const double &timestamp);
+
+    // Result of a submitted image
+    struct TrackingResult
+    {
+        double timestamp;
+        // Empty if tracking fails
+        cv::Mat Tcw;
+        int state;
+    };
+    // The results of the tracking thread in order, false while there is none. Results not taken
+    // are dropped once their ring (of the same size) is full.
+    bool PopTrackingResult(TrackingResult &result);
+    // Images the tracking thread input has dropped so far
+    size_t GetNumDroppedSubmissions();
+
+    // With a latency budget (Admission.LatencyBudget, real-time input only) the synchronous and
+    // asynchronous functions skip images while the tracking falls behind the timestamps, the
+    // ones which may become keyframes last (see FrameAdmission). A skipped image returns the pose
+    // of the motion model, TrackingSnapshot::bSkipped tells it apart. Number skipped so far:
+    size_t GetNumSkippedFrames();
+
+    // Localization streams: more cameras, e.g. of other robots, tracked in the map of this System
+    // without a copy of it. Every stream has a tracking of its own (extractor, frames, motion
+    // model, local map, relocalization) and never changes the map; the local mapping and loop
+    // closing stay the ones of the System. In localization mode the map is frozen and the
+    // streams read it without locks at the same time, otherwise their frames take turns with the
+    // writers of the map. A stream starts lost in the map once it has a keyframe and relocalizes,
+    // after a reset it starts over. Returns the id of the stream, from 1. Each stream is tracked
+    // by one thread at a time. Returns an empty pose while the map has no keyframe.
+    int AddLocalizationStream();
+    cv::Mat TrackStreamStereo(const int nStream, const cv::Mat &imLeft, const cv::Mat &imRight, const double &timestamp);
+    cv::Mat TrackStreamRGBD(const int nStream, const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp);
+    cv::Mat TrackStreamMonocular(const int nStream, const cv::Mat &im, const double &timestamp);
+    int GetStreamTrackingState(const int nStream);
+
     // This stops local mapping thread (map building) and performs only camera tracking.
     void ActivateLocalizationMode();
     // This resumes local mapping thread and performs SLAM again.
     void DeactivateLocalizationMode();
 
+    // Approximate pose of the camera (external odometry, a motion prior), in the frame of the
+    // poses returned by Track*. While tracking is lost, relocalization only tries the keyframes
+    // of the current map whose center is within radius (map units) of its center. A radius of 0
+    // removes the prior.
+    void SetPosePrior(const cv::Mat &Tcw, const float radius);
+
     // Returns true if there have been a big map change (loop closure, global BA)
     // since last call to this function
     bool MapChanged();
 
+    // Typed map events (keyframe added or culled, loop corrected, global BA finished, reset)
+    // for consumers which follow the map incrementally, see MapEvents. The callback is called from
+    // a dispatcher thread, started with the first subscription. Returns the id to unsubscribe.
+    int SubscribeMapEvents(const MapEvents::Callback &callback);
+    void UnsubscribeMapEvents(const int nId);
+
     // Reset the system (clear map)
     void Reset();
 
@@ -112,28 +280,239 @@ public:
     // See format details at: http://www.cvlibs.net/datasets/kitti/eval_odometry.php
     void SaveTrajectoryKITTI(const string &filename);
 
-    // TODO: Save/Load functions
-    // SaveMap(const string &filename);
-    // LoadMap(const string &filename);
+    // Save the keyframe database (the place recognition index of the map) to a file.
+    // A later session maps it with LoadKeyFrameDatabase, it needs the same vocabulary.
+    bool SaveKeyFrameDatabase(const string &filename);
+
+    // Load the keyframe database of a previous session. Nothing is read up front, the file is
+    // memory mapped and only the parts which the queries touch are loaded.
+    bool LoadKeyFrameDatabase(const string &filename);
+
+    // Keyframes of the loaded database similar to the last frame in which tracking was lost,
+    // by their mnId in the session which saved it. The map of that session is not loaded:
+    // the caller holds the poses of its keyframes.
+    std::vector<unsigned long> GetPriorRelocalizationCandidates();
+
+    // Depth image of the keyframe nKeyFrameId in meters (CV_32F, undistorted as its keypoints, 0
+    // where invalid), with KeyFrameDepth.Retain in RGB-D. False if it has none: retention is off,
+    // the keyframe was culled or it was loaded with a map.
+    bool GetKeyFrameDepth(const unsigned long nKeyFrameId, cv::Mat &imDepth);
+
+    // Save the map (keyframes, map points and their graphs) in a binary file.
+    // Call first Shutdown()
+    bool SaveMap(const string &filename);
+
+    // Offline refinement of the whole map, as the threads would not afford it while tracking: a
+    // robust global BA of nIterations with all cores, the duplicated MapPoints each keyframe sees
+    // (from Map.VoxelSize's index, else its covisible keyframes) fused, the redundant keyframes
+    // culled, a second global BA and the keyframe database rebuilt. Call first Shutdown()
+    void RefineMap(const int nIterations=20);
+
+    // Load a map saved by SaveMap with the same vocabulary and calibration.
+    // Call it before the first image, tracking then relocalizes in the loaded map.
+    bool LoadMap(const string &filename);
+
+    // Load the last checkpoint written with Checkpoint.File "filename", by this run or one which
+    // crashed, as LoadMap. Call it before the first image.
+    bool LoadCheckpoint(const string &filename);
+
+    // Adds a map saved by SaveMap, of another session or robot with the same vocabulary and
+    // calibration, to the atlas while the tracking goes on: the file is loaded by a thread of its
+    // own and then becomes separate maps of the atlas before the next frame. The loop closing
+    // merges them with the map being tracked once a keyframe sees a place of them, as it merges
+    // the maps of the atlas. Call it after the first image. False if a merge is still loading.
+    bool MergeMap(const string &filename);
+
+    // Save the map in the format of MapSerializer::SaveMapped, whose keyframe features are
+    // mapped from the file instead of read. Call first Shutdown()
+    bool SaveMapForLocalization(const string &filename);
+
+    // Load a map saved by SaveMapForLocalization and activate the localization mode, which
+    // keeps the mapped keyframes read only. Call it before the first image.
+    bool LoadMapForLocalization(const string &filename);
+
+    // Writes the map points to a PLY, PCD or LAS file (by the extension) on a thread of its own,
+    // while the system runs. bChanges: only the points added, moved or erased since the last
+    // changes export, the whole map the first time. The colors are written with Export.Color.
+    std::future<MapExporter::Result> ExportMapPoints(const string &filename, const bool bChanges=false);
 
     // Information from most recent processed frame
     // You can call this right after TrackMonocular (or stereo or RGBD)
     int GetTrackingState();
 
+    // Result of the latest frame, published without a lock after every frame. Any thread can
+    // read it at any rate, the tracking never waits for the readers.
+    struct TrackingSnapshot
+    {
+        unsigned long nFrameId;
+        double timestamp;
+        int state;
+        // Map points tracked as inliers, 0 unless the state is OK
+        int nInliers;
+        // World to camera, identity if bPoseValid is false
+        bool bPoseValid;
+        Eigen::Matrix<double,4,4,Eigen::DontAlign> Tcw;
+        // Motion model, Tcw = velocity*Tcw of the frame dt seconds before
+        bool bVelocityValid;
+        Eigen::Matrix<double,4,4,Eigen::DontAlign> velocity;
+        double dt;
+        // The image was skipped by the frame admission, Tcw is the prediction of the motion
+        // model and nFrameId the one of the last tracked frame
+        bool bSkipped;
+
+        // Pose at time t (seconds, as the timestamps) by constant velocity from this frame,
+        // for the latency of the tracking. Tcw if there is no velocity.
+        Eigen::Matrix4d Extrapolate(const double t) const;
+    };
+    TrackingSnapshot GetTrackingSnapshot() const;
+
     // Sets the total frame count so the frame drawer can put it in the current frame
     void setFrameCount(const int& frameCount);
 
     // Tells the Viewer to ignore FPS so the algorithm can run as fast as possible
     void ignoreFPS(const bool& ignore);
 
+    // Bad MapPoints are freed a few frames after they were culled, use the pointers
+    // before the next call to TrackMonocular (or stereo or RGBD)
     std::vector<MapPoint*> GetTrackedMapPoints();
     std::vector<cv::KeyPoint> GetTrackedKeyPointsUn();
 
+    // Durations of the stages of tracking, local mapping and loop closing of this System since the
+    // start (or ResetStageTimes), last is the latest sample. Shutdown prints them as histograms.
+    StageTimes::Summary GetStageTimes(const Stage stage);
+    std::vector<StageTimes::Summary> GetAllStageTimes();
+    void ResetStageTimes();
+
+    // Keyframes queued for loop detection and how many queried or were skipped by the backlog
+    // policy (LoopClosing.MaxQueue, MinQueryInterval, MinQueryDistance)
+    LoopClosing::QueueStats GetLoopQueueStats();
+
+    // Tasks run by the shared scheduler (Scheduler.nThreads) per pool, empty without one
+    std::vector<TaskScheduler::TaskStats> GetTaskStats();
+
+    // Blocks until Local Mapping and Loop Closing have processed all their keyframes and no
+    // Global BA is running. A replay which waits for it after every image is reproducible.
+    void WaitUntilIdle();
+
+    // CPU time used so far by the threads of the system (Local Mapping, Loop Closing, Viewer
+    // and the asynchronous input once started), in seconds. Not after Shutdown.
+    // The synchronous tracking runs on the thread of the caller.
+    struct ThreadCpuTime
+    {
+        ThreadCpuTime(const std::string &name_, const double seconds_): name(name_), seconds(seconds_) {}
+        std::string name;
+        double seconds;
+    };
+    std::vector<ThreadCpuTime> GetThreadCpuTimes();
+
+    // Bytes held by the keyframes, map points, keyframe database, vocabulary, image pyramids
+    // and bundle adjustment graphs. Walks the whole map, a few ms for a large one.
+    // With Memory.LogPeriod the tracking logs it as a status message every that many seconds.
+    MemoryUsage GetMemoryUsage();
+
 private:
 
+    // Waits of LoadVocabulary for a shared vocabulary another process is creating
+    static const int SHARED_VOCABULARY_ATTEMPTS = 50; //param
+    static const int SHARED_VOCABULARY_WAIT_US = 100000; //param
+
+    // Reads a text or binary vocabulary file, false if it can not be read
+    static bool ReadVocabulary(ORBVocabulary* pVocabulary, const string &strVocFile);
+
+    // Main function of mptVocabulary (Vocabulary.LoadAsync), exits as the synchronous loading if
+    // the file can not be read. nLevelsUp<0 keeps the level of the file.
+    void LoadVocabularyAsync(const string strVocFile, const int nLevelsUp);
+
+    // Loads a map with MapSerializer::Load or LoadMapped
+    bool LoadMapFile(const string &filename, const bool bMapped);
+
+    // Thread of MergeMap
+    void LoadMergedMap(const string filename);
+
+    // Steps around Tracking::GrabImage* shared by the synchronous and the asynchronous input
+    void UpdateDebugParameters();
+    void ApplyModeChange();
+    void ApplyReset();
+    void ApplyMapMerge();
+    void StoreTrackingResult();
+    // With mMutexState locked
+    void PublishTrackingSnapshot();
+    void WriteTrackingSnapshot(const double timestamp, const cv::Mat &Tcw, const bool bSkipped);
+
+    // Frame admission and static scene check of the synchronous input, true and the predicted
+    // pose if the image is skipped. Starts the clock of the tracking otherwise.
+    bool SkipImage(const double timestamp, const cv::Mat &im, cv::Mat &Tcw);
+    // Publishes the pose the tracker gave a skipped image
+    void StoreSkippedResult(const double timestamp, const cv::Mat &Tcw);
+
+    // Records of the frame just tracked in the event log: the frame, state changes, a new keyframe
+    void LogTrackingEvents();
+    // Record of the frame just tracked in the performance report
+    void ReportFrame();
+
+    void LogMemoryUsage();
+
+    struct AsyncImage
+    {
+        cv::Mat im;
+        cv::Mat im2; // right image or depthmap
+        double timestamp;
+        // Depthmap already in meters
+        bool bMetricDepth;
+        // Calls the release callback of external buffers once the last copy is destroyed
+        std::shared_ptr<void> external;
+        std::promise<cv::Mat> pose;
+        // When it was submitted
+        std::chrono::steady_clock::time_point tArrival;
+    };
+
+    struct AsyncFrame
+    {
+        // Order of the images, the offline builders may finish them in any order
+        size_t nSeq;
+        Frame frame;
+        cv::Mat imGray;
+        // Monocular offline: the frame is built again if the tracker is not in the state it was
+        // built for (initializer extractor or not)
+        bool bInitializing;
+        cv::Mat im;
+        std::shared_ptr<void> external;
+        std::promise<cv::Mat> pose;
+        // Not admitted, the frame only has the timestamp
+        bool bSkipped;
+        // For the static scene check (StaticScene.enable), bStill if it skipped the image
+        cv::Mat thumbnail;
+        bool bStill;
+        std::chrono::steady_clock::time_point tArrival;
+    };
+
+    // Loads the vocabulary from strVocFile unless one is shared
+    System(const string &strVocFile, ORBVocabulary* pVocabulary, const string &strSettingsFile, const eSensor sensor,
+           const bool bUseViewer);
+
+    // External images (with a release guard) are not copied
+    std::future<cv::Mat> SubmitAsync(const cv::Mat &im, const cv::Mat &im2, const double &timestamp,
+                                     const bool bMetricDepth=false,
+                                     const std::shared_ptr<void> &external=std::shared_ptr<void>());
+
+    // Builds the Frame of the next image while the tracker thread tracks the current one.
+    // nBuilder>0 is one of the offline builders.
+    void RunAsyncFrameBuilder(const int nBuilder);
+    AsyncFrame BuildAsyncFrame(AsyncImage &image, const int nBuilder);
+    void RunAsyncTracker();
+    void FinishAsync();
+
+    bool Submit(const cv::Mat &im, const cv::Mat &im2, const double &timestamp);
+    void RunTrackerThread();
+    void WaitForSubmission();
+    void FinishTrackerThread();
+
     // Input sensor
     eSensor mSensor;
 
+    // The settings file, shared by the subsystems
+    Settings mSettings;
+
     // ORB vocabulary used for place recognition and feature matching.
     ORBVocabulary* mpVocabulary;
 
@@ -148,6 +527,14 @@ private:
     // performs relocalization if tracking fails.
     Tracking* mpTracker;
 
+    // Trackings of the localization streams, stream n at n-1. Their frames hold it shared, the
+    // resets, merges and mode changes exclusively.
+    std::vector<Tracking*> mvpStreams;
+    SharedMutex mMutexStreams;
+    // The stream nStream attached to the map, NULL if there is none or the map has no keyframe.
+    // Under mMutexStreams.
+    Tracking* GetAttachedStream(const int nStream);
+
     // Local Mapper. It manages the local map and performs local bundle adjustment.
     LocalMapping* mpLocalMapper;
 
@@ -155,17 +542,30 @@ private:
     // a pose graph optimization and full bundle adjustment (in a new thread) afterwards.
     LoopClosing* mpLoopCloser;
 
-    // The viewer draws the map and the current camera pose. It uses Pangolin.
-    Viewer* mpViewer;
+    // The viewer draws the map and the current camera pose. It is loaded from the viewer module,
+    // NULL without it.
+    Visualization* mpViewer;
 
     FrameDrawer* mpFrameDrawer;
-    MapDrawer* mpMapDrawer;
 
-    // System threads: Local Mapping, Loop Closing, Viewer.
-    // The Tracking thread "lives" in the main execution thread that creates the System object.
+    // Streams the map to remote viewers (Streamer.Port), NULL if the port is 0
+    MapStreamer* mpStreamer;
+
+    // Retunes the parameters without the viewer (ParameterServer.Port), NULL if the port is 0
+    ParameterServer* mpParameterServer;
+
+    // Serves the counters and stage times to Prometheus (MetricsServer.Port), NULL if the port is 0
+    MetricsServer* mpMetricsServer;
+
+    // System threads: Local Mapping, Loop Closing, Viewer, Streamer, Parameter Server, Metrics Server.
+    // The Tracking thread "lives" in the main execution thread that creates the System object,
+    // unless the images are submitted to mptTracker (Submit*) or to the asynchronous input.
     std::thread* mptLocalMapping;
     std::thread* mptLoopClosing;
     std::thread* mptViewer;
+    std::thread* mptStreamer;
+    std::thread* mptParameterServer;
+    std::thread* mptMetricsServer;
 
     // Reset flag
     std::mutex mMutexReset;
@@ -180,7 +580,136 @@ private:
     int mTrackingState;
     std::vector<MapPoint*> mTrackedMapPoints;
     std::vector<cv::KeyPoint> mTrackedKeyPointsUn;
+    // BoW vector of the last frame in which tracking was lost
+    DBoW2::BowVector mLostBowVec;
     std::mutex mMutexState;
+
+    // TrackingSnapshot: frame id, timestamp, state, inliers, pose valid, velocity valid, dt,
+    // then the top 3 rows of Tcw and of the velocity, row major, then skipped. Written under
+    // mMutexState.
+    static const int SNAPSHOT_SIZE = 32;
+    SeqLock<double,SNAPSHOT_SIZE> mSnapshot;
+    // Timestamp of the frame published before, for the dt of the velocity
+    double mLastSnapshotTimestamp;
+
+    // Threads encoding and decoding the keyframes in SaveMap / LoadMap
+    int mnMapThreads;
+
+    // The vocabulary does not change once loaded, with Vocabulary.LoadAsync it is set by mptVocabulary
+    std::atomic<size_t> mnVocabularyMemory;
+    std::thread* mptVocabulary;
+    // Seconds between two memory logs of the tracking, 0 for none
+    double mfMemoryLogPeriod;
+    std::chrono::steady_clock::time_point mtLastMemoryLog;
+
+    // Map file of MergeMap, loaded into a map and keyframe database of its own which the tracking
+    // moves into mpMap once mbMergeLoaded is set
+    std::thread* mptMapMerge;
+    Map* mpMergeMap;
+    KeyFrameDatabase* mpMergeKeyFrameDB;
+    bool mbMergeLoading;
+    bool mbMergeLoaded;
+    std::mutex mMutexMapMerge;
+
+    // Runs the tasks of all thread pools, NULL: every pool has workers of its own
+    TaskScheduler* mpScheduler;
+
+    // Decides which images are tracked under load (Admission.LatencyBudget), NULL without a
+    // budget or offline. mtTrackStart is when the tracking of the current image started.
+    FrameAdmission* mpAdmission;
+    std::chrono::steady_clock::time_point mtTrackStart;
+
+    // Trades the knobs of all threads for the latency (Latency.Target), NULL without a target,
+    // offline or deterministic. mfInputWait: seconds the current image waited in the asynchronous
+    // input or the one of the tracking thread before its tracking started, 0 for the synchronous
+    // input.
+    LatencyScheduler* mpLatencyScheduler;
+    double mfInputWait;
+    // Under mMutexState
+    size_t mnSkippedFrames;
+    // Images tracked and skipped, the number of the image in the event log (Logging.EventFile)
+    unsigned long mnEventImage;
+
+    // Skips the images of a still camera (StaticScene.enable), NULL when off or offline.
+    // mThumbnail is the one of the image being tracked.
+    StaticScene* mpStaticScene;
+    cv::Mat mThumbnail;
+
+    // Writes the trajectory while the system runs (Trajectory.StreamFile), NULL without a file
+    TrajectoryWriter* mpTrajectoryWriter;
+
+    // Created by the first ExportMapPoints. mbExportColors: the keyframes have colors.
+    MapExporter* mpMapExporter;
+    std::mutex mMutexMapExporter;
+    bool mbExportColors;
+
+    // Writes checkpoints of the map (Checkpoint.File), NULL without a file
+    MapCheckpointer* mpCheckpointer;
+
+    // Tiles of a map loaded with LoadMapForLocalization, far ones are evicted (see MapTiles)
+    MapTiles* mpMapTiles;
+    float mfMapTileSize;
+    int mnMapTileRadius;
+
+    // Asynchronous input. At most mnAsyncMaxFramesAhead Frames are built ahead of the tracker
+    // (one, offline two per builder), images wait in mqAsyncImages. The threads are started with
+    // the first asynchronous image.
+    std::deque<AsyncImage> mqAsyncImages;
+    // Sorted by nSeq
+    std::deque<AsyncFrame> mqAsyncFrames;
+    size_t mnAsyncQueueSize;
+    eDropPolicy mAsyncDropPolicy;
+    size_t mnAsyncDropped;
+    // Offline input, 0 for the real-time one
+    int mnOfflineBuilders;
+    // Of the next image a builder takes and of the next frame the tracker takes
+    size_t mnAsyncNextSeq;
+    size_t mnAsyncTrackSeq;
+    // Taken by a builder and not by the tracker yet
+    size_t mnAsyncFramesAhead;
+    size_t mnAsyncMaxFramesAhead;
+    // Offline the tracker gives the ids, the frames are built out of order and survive a reset
+    long unsigned int mnAsyncNextFrameId;
+    TrackingCallback mTrackingCallback;
+    bool mbAsyncFinishRequested;
+    int mnAsyncBuildersRunning;
+    std::mutex mMutexAsync;
+    std::condition_variable mCondAsyncBuilder;
+    std::condition_variable mCondAsyncTracker;
+    // Offline, the images wait for a place in the queue
+    std::condition_variable mCondAsyncInput;
+    std::vector<std::thread*> mvptAsyncFrameBuilders;
+    std::thread* mptAsyncTracker;
+
+    // Tracking thread (Submit*). The callers push into mpSubmitted and only lock
+    // mMutexTrackerWakeUp to wake the thread if it sleeps, or to start it with the first image.
+    struct SubmittedImage
+    {
+        cv::Mat im;
+        cv::Mat im2; // right image or depthmap
+        double timestamp;
+        std::chrono::steady_clock::time_point tArrival;
+    };
+    std::unique_ptr<MPSCQueue<SubmittedImage> > mpSubmitted;
+    std::unique_ptr<MPSCQueue<TrackingResult> > mpTrackingResults;
+    std::atomic<size_t> mnSubmitDropped;
+    std::atomic<bool> mbTrackerThreadStarted;
+    std::atomic<bool> mbTrackerSleeping;
+    std::atomic<bool> mbTrackerFinishRequested;
+    bool mbTrackerWakeUp;
+    std::mutex mMutexTrackerWakeUp;
+    std::condition_variable mCondTrackerWakeUp;
+    std::thread* mptTracker;
+    // The results have one consumer at a time
+    std::mutex mMutexTrackingResults;
+
+    // Dispatcher of mpMap->mEvents, NULL until the first subscription
+    std::thread* mptMapEvents;
+    std::mutex mMutexMapEvents;
+
+    // Held while a Frame is built and while the tracker resets, Tracking::Reset restarts the frame ids.
+    // The offline builders share it, unless the frame does the initial computations.
+    SharedMutex mMutexAsyncBuild;
 };
 
 }// namespace ORB_SLAM
@@ -0,0 +1,157 @@
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// One set of workers for the parallel work of all subsystems (Scheduler.nThreads), owned by
+// System. Every worker has a deque per priority: it pushes and pops its own tasks at the back
+// and steals from the front of the others when it runs out, the tasks of other threads go to a
+// shared queue. HIGH tasks (tracking) are always taken before NORMAL ones (mapping, loop
+// closing), so tracking preempts the background work at its next task boundary, and idle cores
+// run the background work.
+//
+// A thread which waits for a TaskGroup runs queued tasks meanwhile, which makes nested groups
+// and parallel fors from inside tasks safe. A HIGH waiter only runs HIGH tasks, a long mapping
+// task would delay it. Tasks must not block on anything else the scheduler has to run.
+//
+// Every task is counted and timed (queue wait and run time) under the name of its group, and
+// added to the trace while one is recorded.
+class TaskScheduler
+{
+public:
+
+    enum Priority
+    {
+        HIGH=0,
+        NORMAL=1,
+        NUM_PRIORITIES
+    };
+
+    // Sums per name, seconds
+    struct TaskStats
+    {
+        TaskStats(): name(""), nTasks(0), tRun(0), tMaxRun(0), tWait(0) {}
+
+        const char* name;
+        uint64_t nTasks;
+        double tRun;
+        double tMaxRun;
+        double tWait;
+    };
+
+    // Tasks waited for together. name must be a literal.
+    class TaskGroup
+    {
+    public:
+        TaskGroup(TaskScheduler* pScheduler, const Priority priority, const char* name);
+        // Waits for the tasks still running
+        ~TaskGroup();
+
+        void Run(const std::function<void(void)> &task);
+
+        // Returns once every task run so far has finished, runs queued tasks meanwhile
+        void Wait();
+
+    private:
+        TaskGroup(const TaskGroup&);
+        TaskGroup& operator=(const TaskGroup&);
+
+        friend class TaskScheduler;
+
+        TaskScheduler* mpScheduler;
+        Priority mPriority;
+        const char* mName;
+        std::atomic<int> mnPending;
+        // Nanoseconds, added to the stats of the scheduler by Wait
+        std::atomic<uint64_t> mnTasks;
+        std::atomic<uint64_t> mnRun;
+        std::atomic<uint64_t> mnMaxRun;
+        std::atomic<uint64_t> mnWait;
+    };
+
+    // nThreads workers, the threads which wait for a group take part as well
+    TaskScheduler(const int nThreads);
+    // Runs the tasks still queued, then joins the workers
+    ~TaskScheduler();
+
+    // Calls task(i) for all i in [0,n) with the calling thread and at most nMaxHelpers workers
+    // (-1: all), returns once every call has finished. The indices are taken one at a time.
+    void ParallelFor(const int n, const std::function<void(int)> &task, const Priority priority,
+                     const char* name, const int nMaxHelpers=-1);
+
+    // Runs task once without a group, to be waited for with a future of its own. name must be
+    // a literal.
+    void Submit(const std::function<void(void)> &task, const Priority priority, const char* name);
+
+    int GetNumThreads() const;
+
+    std::vector<TaskStats> GetTaskStats();
+    void ResetTaskStats();
+    // One line per name
+    void PrintTaskStats(std::ostream &out);
+
+private:
+
+    struct Task
+    {
+        std::function<void(void)> fn;
+        // NULL for Submit
+        TaskGroup* pGroup;
+        const char* name;
+        std::chrono::steady_clock::time_point tQueued;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks[NUM_PRIORITIES];
+    };
+
+    void Push(Task &&task, const Priority priority);
+
+    // Takes a task of a priority up to maxPriority: own deque, shared queue, then the others
+    bool Pop(const Priority maxPriority, Task &task);
+    bool HasQueued(const Priority maxPriority) const;
+    bool Steal(const int nThief, const Priority priority, Task &task);
+
+    void Execute(Task &task);
+
+    void Run(const int nWorker);
+
+    void AddStats(const char* name, const uint64_t nTasks, const uint64_t nRun, const uint64_t nMaxRun,
+                  const uint64_t nWait);
+
+    std::vector<Worker*> mvpWorkers;
+    std::vector<std::thread> mvThreads;
+
+    std::mutex mMutexShared;
+    std::deque<Task> mqShared[NUM_PRIORITIES];
+
+    // Tasks queued and not taken yet per priority, the sleepers wake up when one goes up or a
+    // group finishes
+    std::atomic<int> mnQueued[NUM_PRIORITIES];
+    std::mutex mMutexSleep;
+    std::condition_variable mCondSleep;
+    bool mbFinish;
+
+    std::mutex mMutexStats;
+    std::map<std::string, TaskStats> mStats;
+};
+
+} //namespace ORB_SLAM
+
+#endif // TASKSCHEDULER_H
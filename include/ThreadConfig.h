@@ -0,0 +1,76 @@
+#ifndef THREADCONFIG_H
+#define THREADCONFIG_H
+
+#include <string>
+
+namespace ORB_SLAM2
+{
+
+class Settings;
+
+// Cores and priorities of the threads by their role, from the settings (Threads.<Role>).
+// Every thread applies the ones of its role once, when it starts or on its first frame, so a
+// busy global BA or bundle of extraction workers can be kept off the cores of the tracking.
+// A setting is a list of fields, "" leaves the thread as it is:
+//   cores=2,3   affinity, the threads it creates (the OpenMP threads of g2o) inherit it
+//   nice=10     nice value of the thread alone (-20..19, below 0 needs privileges)
+//   rt=50       SCHED_FIFO priority (1..99, needs privileges), takes precedence over nice
+// Only applied on Linux, a failure is reported and the thread goes on as it is.
+class ThreadConfig
+{
+public:
+
+    enum Role
+    {
+        NONE=-1,
+        TRACKING=0,
+        LOCAL_MAPPING,
+        LOOP_CLOSING,
+        GLOBAL_BA,
+        VIEWER,
+        // Periodic map checkpoints (Checkpoint.File)
+        CHECKPOINT,
+        // Thread pools of the ORB extractors and the offline frame builders
+        EXTRACTION_WORKERS,
+        // Stereo matching, relocalization and rig tracking pools of the tracking
+        TRACKING_WORKERS,
+        // Triangulation and fusion pool of local mapping
+        MAPPING_WORKERS,
+        // Sim3 pool of loop closing
+        LOOP_WORKERS,
+        // Workers of the TaskScheduler shared by the pools (Scheduler.nThreads)
+        SCHEDULER_WORKERS,
+        NUM_ROLES
+    };
+
+    // Before the threads are started, not thread safe. False if a setting does not parse,
+    // that role is left unchanged.
+    static bool Load(const ORB_SLAM2::Settings &fsSettings);
+
+    // Applies the settings of role to the calling thread, only the first time it is called
+    // from that thread
+    static void Apply(const Role role);
+
+    static const char* GetName(const Role role);
+
+private:
+
+    struct Settings
+    {
+        Settings(): nCoreMask(0), nNice(0), bNice(false), nRealTime(0) {}
+
+        // Bit i for core i, 0: any
+        unsigned long long nCoreMask;
+        int nNice;
+        bool bNice;
+        int nRealTime;
+    };
+
+    static bool Parse(const std::string &value, Settings &settings);
+
+    static Settings msSettings[NUM_ROLES];
+};
+
+} //namespace ORB_SLAM
+
+#endif // THREADCONFIG_H
@@ -0,0 +1,77 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "TaskScheduler.h"
+#include "ThreadConfig.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+// Fixed set of worker threads which live as long as the pool, so per frame work
+// can be distributed without creating new threads every time.
+// With a shared TaskScheduler (SetScheduler) a pool has no workers of its own: its tasks go to
+// the scheduler, at HIGH priority for the tracking roles, and nThreads only caps the workers
+// one ParallelFor takes.
+class ThreadPool
+{
+public:
+
+    // The workers apply the thread settings of role
+    ThreadPool(const int nThreads, const ThreadConfig::Role role=ThreadConfig::NONE);
+
+    // For the pools created afterwards, NULL: workers of their own again. Set by System before
+    // the subsystems are created.
+    static void SetScheduler(TaskScheduler* pScheduler);
+
+    // waits for all queued tasks to finish before joining the workers
+    ~ThreadPool();
+
+    // Queues a task and returns a future which becomes ready once it has been executed
+    std::future<void> Submit(const std::function<void(void)>& task);
+
+    // Calls task(i) for all i in [0,n) and returns once every call has finished.
+    // The calling thread takes part in the work, so a pool with zero workers runs it serially.
+    void ParallelFor(const int n, const std::function<void(int)>& task);
+
+    // Joins the current workers and starts nThreads new ones
+    void Resize(const int nThreads);
+
+    int GetNumThreads() const;
+
+protected:
+
+    void Run();
+
+    void RunParallelFor(const int n, const std::function<void(int)>& task);
+
+    void Start(const int nThreads);
+    const char* GetTaskName() const;
+    void Stop();
+
+    std::vector<std::thread> mvWorkers;
+    std::deque<std::function<void(void)> > mqTasks;
+
+    std::mutex mMutexQueue;
+    std::condition_variable mCondQueue;
+    bool mbFinish;
+    ThreadConfig::Role mRole;
+
+    // Shared scheduler instead of mvWorkers, with the number of workers it may take
+    TaskScheduler* mpScheduler;
+    TaskScheduler::Priority mPriority;
+    int mnSchedulerThreads;
+
+    static TaskScheduler* mpsScheduler;
+};
+
+} //namespace ORB_SLAM
+
+#endif // THREADPOOL_H
@@ -0,0 +1,72 @@
+#ifndef THUMBNAILINDEX_H
+#define THUMBNAILINDEX_H
+
+#include "SharedMutex.h"
+
+#include <cstddef>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+
+// Tiny signatures of the images of the keyframes (Relocalization.ThumbnailIndex), for a first
+// pass of the relocalization before the BoW stage: the image shrunk to WIDTH x HEIGHT, blurred
+// and with its mean moved to 128, so a change of the exposure does not count. The signatures of
+// all keyframes lie in one block and a query scans it with the sum of absolute differences
+// (psadbw on x86, vabd on NEON). After a short occlusion the camera is close to where one of
+// the last keyframes was, the nearest signatures find it and their poses seed the tracking.
+// Keyframes of a loaded map have no signature. Queries hold the index shared, the changes
+// exclusively.
+class ThumbnailIndex
+{
+public:
+
+    static const int WIDTH = 32; //param
+    static const int HEIGHT = 24; //param
+    static const int SIZE = WIDTH*HEIGHT;
+
+    struct Match
+    {
+        KeyFrame* pKF;
+        // Sum of the absolute differences of the pixels
+        int distance;
+    };
+
+    // Signature of a grayscale image
+    static void Compute(const cv::Mat &imGray, std::vector<uint8_t> &signature);
+
+    // Sum of the absolute differences of two signatures
+    static int Distance(const uint8_t* a, const uint8_t* b);
+
+    // Replaces the signature of pKF if it has one already
+    void Add(KeyFrame* pKF, const std::vector<uint8_t> &signature);
+    void Erase(KeyFrame* pKF);
+    void Clear();
+
+    bool Empty();
+
+    // The nK keyframes nearest to signature, closest first, at most maxDistance away
+    void Search(const std::vector<uint8_t> &signature, const int nK, const int maxDistance,
+                std::vector<Match> &vMatches);
+
+    size_t GetMemoryUsage();
+
+protected:
+
+    // SIZE bytes per keyframe, in the order of mvpKeyFrames
+    std::vector<uint8_t> mvSignatures;
+    std::vector<KeyFrame*> mvpKeyFrames;
+    std::unordered_map<KeyFrame*,size_t> mmSlots;
+
+    SharedMutex mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // THUMBNAILINDEX_H
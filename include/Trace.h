@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace ORB_SLAM2
+{
+
+// Timeline of the threads in the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+// While a trace is recorded every timed stage (STAGE_TIMER) and every TRACE_SCOPE adds an event
+// to a buffer of its thread, with the id of the frame or keyframe the thread is processing.
+// Stop writes them. When no trace is recorded an event costs one relaxed atomic load.
+class Trace
+{
+public:
+    // Starts recording, the events are kept in memory until Stop
+    static void Start(const std::string &filename);
+
+    // Writes the events recorded since Start, false if the file could not be written
+    static bool Stop();
+
+    static bool IsActive() { return mbActive.load(std::memory_order_relaxed); }
+
+    // Shown for the events of the calling thread
+    static void SetThreadName(const char* name);
+
+    // Frame or keyframe the calling thread is processing, an argument of its next events.
+    // key must be a literal.
+    static void SetContext(const char* key, const long id);
+
+    // name must be a literal
+    static void Complete(const char* name, const std::chrono::steady_clock::time_point &start,
+                         const std::chrono::steady_clock::time_point &end);
+    static void Instant(const char* name);
+
+private:
+    static std::atomic<bool> mbActive;
+};
+
+// Adds an event from its construction to its destruction
+class ScopedTrace
+{
+public:
+    explicit ScopedTrace(const char* name): mName(name), mbActive(Trace::IsActive())
+    {
+        if(mbActive)
+            mStart = std::chrono::steady_clock::now();
+    }
+
+    ~ScopedTrace()
+    {
+        if(mbActive)
+            Trace::Complete(mName, mStart, std::chrono::steady_clock::now());
+    }
+
+private:
+    ScopedTrace(const ScopedTrace&);
+    ScopedTrace& operator=(const ScopedTrace&);
+
+    const char* mName;
+    const bool mbActive;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+} //namespace ORB_SLAM
+
+// Traces the rest of the enclosing scope, at most one per scope
+#define TRACE_SCOPE(name) ORB_SLAM2::ScopedTrace traceScope(name)
+
+#endif // TRACE_H
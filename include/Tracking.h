@@ -26,7 +26,6 @@
 #include<opencv2/features2d/features2d.hpp>
 
 #include "Parameter.h"
-#include"Viewer.h"
 #include"FrameDrawer.h"
 #include"Map.h"
 #include"LocalMapping.h"
@@ -36,36 +35,101 @@
 #include"KeyFrameDatabase.h"
 #include"ORBextractor.h"
 #include "Initializer.h"
-#include "MapDrawer.h"
+#include "ImageAlignment.h"
+#include "KeyFramePolicy.h"
+#include "Settings.h"
+#include "Trajectory.h"
+#include "FeatureBudget.h"
+#include "LatencyScheduler.h"
+#include "PerformanceReport.h"
 #include "System.h"
 
+#include <atomic>
 #include <mutex>
 
 namespace ORB_SLAM2
 {
 
-class Viewer;
+class Visualization;
 class FrameDrawer;
+class MapStreamer;
 class Map;
 class LocalMapping;
 class LoopClosing;
 class System;
+class FeatureCache;
 
 class Tracking
 {
 
 public:
-    Tracking(System* pSys, ORBVocabulary* pVoc, FrameDrawer* pFrameDrawer, MapDrawer* pMapDrawer, Map* pMap,
-             KeyFrameDatabase* pKFDB, const string &strSettingPath, const int sensor);
+    Tracking(System* pSys, ORBVocabulary* pVoc, FrameDrawer* pFrameDrawer, Map* pMap, KeyFrameDatabase* pKFDB,
+             const Settings &settings, const int sensor);
 
     // Preprocess the input and call Track(). Extract features and performs stereo matching.
     cv::Mat GrabImageStereo(const cv::Mat &imRectLeft,const cv::Mat &imRectRight, const double &timestamp);
-    cv::Mat GrabImageRGBD(const cv::Mat &imRGB,const cv::Mat &imD, const double &timestamp);
+    // bMetricDepth: the depthmap is CV_32F in meters already, DepthMapFactor is not applied
+    cv::Mat GrabImageRGBD(const cv::Mat &imRGB,const cv::Mat &imD, const double &timestamp, const bool bMetricDepth=false);
     cv::Mat GrabImageMonocular(const cv::Mat &im, const double &timestamp);
+    // Monocular camera rig: vIm[0] is the image of the camera of the Camera.* settings, which
+    // initializes, relocalizes and decides the keyframes, the other cameras are tracked with it
+    // once there is a map. Returns the pose of the first camera.
+    cv::Mat GrabImageRig(const std::vector<cv::Mat> &vIm, const double &timestamp);
+    // 1 without a rig
+    int GetNumRigCameras() const { return mvRigCameras.size()+1; }
+
+    // The two steps of GrabImage*. Building the Frame only reads the calibration and the
+    // extractors, so the next image can be processed while the current one is tracked.
+    // imGray returns the grayscale image which TrackFrame shows in the frame drawer.
+    // nBuilder>0 builds with the extractors of that builder of the offline input, without the
+    // feature budget, several builders can run at the same time.
+    Frame CreateFrameStereo(const cv::Mat &imRectLeft,const cv::Mat &imRectRight, const double &timestamp, cv::Mat &imGray,
+                            const int nBuilder=0);
+    Frame CreateFrameRGBD(const cv::Mat &imRGB,const cv::Mat &imD, const double &timestamp, cv::Mat &imGray,
+                          const bool bMetricDepth=false, const int nBuilder=0);
+    Frame CreateFrameMonocular(const cv::Mat &im, const double &timestamp, const bool bInitializing, cv::Mat &imGray,
+                               const int nBuilder=0);
+
+    // Offline input (Offline.nBuilders): nBuilders more sets of extractors for CreateFrame*, and
+    // keyframe decisions which wait for Local Mapping instead of depending on how far it got.
+    // The feature budget is timing based and is disabled. Call before the first image.
+    void SetOfflineMode(const int nBuilders);
+    bool IsOffline() const { return mbOffline; }
+    // Deterministic mode (Deterministic.Enabled), on top of the offline one: every keyframe is
+    // done by Local Mapping and Loop Closing before the next frame is tracked.
+    void SetDeterministicMode() { mbDeterministic = true; }
+    // The next frame sets up the calibration shared by the frames or the undistortion maps, it
+    // must not be built at the same time as another one
+    bool NeedsInitialComputations() const;
+
+    // Whether the images are undistorted instead of the keypoints, and the distortion the frames see
+    bool UndistortsImages() const { return mbUndistortImages && mDistCoef.at<float>(0)!=0.0; }
+    void UndistortImage(cv::Mat &im, const int interpolation);
+    // The image pExtractor rectified as imGray, for the drawer
+    void TakeRectifiedImage(ORBextractor* pExtractor, cv::Mat &imGray);
+    // Colors of the keypoints of frame from the color image it was extracted from (Export.Color)
+    void SampleColors(Frame &frame, const cv::Mat &im);
+    // Keeps the depth image of an RGB-D frame for its keyframe (KeyFrameDepth.Retain). imDepth is
+    // copied if it is still the buffer of the caller, imInput.
+    void RetainDepth(Frame &frame, const cv::Mat &imDepth, const cv::Mat &imInput, const float depthMapFactor);
+    // Writes the frames recorded last to the feature cache (FeatureCache.File) and prints how
+    // many frames it replayed, once no frame is built anymore
+    void FinishFeatureCache();
+    // The frame is moved into the tracking. bImGrayOwned: nobody writes to imGray anymore, the
+    // frame drawer keeps it instead of a copy
+    cv::Mat TrackFrame(Frame &&frame, const cv::Mat &imGray, const bool bImGrayOwned=false);
 
     void SetLocalMapper(LocalMapping* pLocalMapper);
     void SetLoopClosing(LoopClosing* pLoopClosing);
-    void SetViewer(Viewer* pViewer);
+    void SetViewer(Visualization* pViewer);
+    void SetStreamer(MapStreamer* pStreamer);
+    // Scales the extraction, the search of the local map and its size (Latency.Target). Set
+    // before the first image.
+    void SetLatencyScheduler(LatencyScheduler* pScheduler);
+    // The BoW matches of all relocalization candidates are computed at once
+    // (ORBmatcher.batchCandidates), the candidates are verified by decreasing number of matches. Set
+    // before the first image.
+    void SetBatchMatching();
 
     // Load new settings
     // The focal lenght should be similar or scale prediction will fail when projecting points
@@ -75,6 +139,45 @@ public:
     // Use this function if you have deactivated local mapping and you only want to localize the camera.
     void InformOnlyTracking(const bool &flag);
 
+    // A map was loaded before the first image, the tracking starts lost and relocalizes in it
+    void InformMapLoaded(KeyFrame* pLastKF);
+
+    // Makes this a localization stream (System::AddLocalizationStream): one more camera tracked
+    // in the map of the System, never initializing, creating keyframes or resetting the map. Its
+    // marks of the local map are kept in tables of its own, several streams read the same map.
+    void SetLocalizationStream();
+    // Starts a stream lost in the map before its first image and after a reset. False while the
+    // map has no keyframe.
+    bool AttachStream();
+    // The map was cleared, nothing of the stream may point into it
+    void ResetStream();
+
+    // Bytes of the pyramid buffers of the extractors, any thread can ask
+    size_t GetPyramidMemoryUsage();
+
+    // Prior on the pose of the camera, in the frame of the poses which the tracking returns. The
+    // relocalization only considers the keyframes of the current map within fRadius (map units)
+    // of its center, fRadius<=0 clears it. Any thread.
+    void SetPosePrior(const cv::Mat &Tcw, const float fRadius);
+
+    // Inliers of the local map tracking and motion model (empty without one) of the last frame
+    int GetNumMatchesInliers() const { return mnMatchesInliers; }
+    // Matches each strategy found for the last frame, by PerformanceReport::Strategy
+    const int* GetStrategyMatches() const { return mvnStrategyMatches; }
+    const cv::Mat &GetVelocity() const { return mVelocity; }
+    // The keyframe made from the last frame, NULL if it made none
+    KeyFrame* GetNewKeyFrame() const { return mnLastKeyFrameId==mCurrentFrame.mnId ? mpLastKeyFrame : NULL; }
+
+    // Frame admission (Admission.LatencyBudget): whether the next image could be skipped, with a
+    // pose from the motion model, and whether it may become a keyframe
+    bool CanSkipFrame() const;
+    bool IsKeyFrameLikely();
+    // The pose of the motion model for an image which is not tracked, empty if CanSkipFrame is
+    // false. It is stored in the trajectory, the velocity spreads the motion of the next tracked
+    // frame over the skipped ones. bStill (StaticScene): the camera did not move, the image
+    // gets the last pose and the motion of the next frame is not spread.
+    cv::Mat SkipFrame(const double &timestamp, const bool bStill=false);
+
 
 public:
 
@@ -96,6 +199,7 @@ public:
     // Current Frame
     Frame mCurrentFrame;
     cv::Mat mImGray;
+    bool mbImGrayOwned;
 
     // Initialization Variables (Monocular)
     std::vector<int> mvIniLastMatches;
@@ -104,20 +208,25 @@ public:
     std::vector<cv::Point3f> mvIniP3D;
     Frame mInitialFrame;
 
-    // Lists used to recover the full camera trajectory at the end of the execution.
+    // Used to recover the full camera trajectory, during or at the end of the execution.
     // Basically we store the reference keyframe for each frame and its relative transformation
-    list<cv::Mat> mlRelativeFramePoses;
-    list<KeyFrame*> mlpReferences;
-    list<double> mlFrameTimes;
-    list<bool> mlbLost;
+    Trajectory mTrajectory;
 
     // True if local mapping is deactivated and we are performing only localization
     bool mbOnlyTracking;
 
+    // Localization mode with the local mapping stopped and the loop closing idle, as of the
+    // current frame: nothing writes the map, the frame reads it without locks (FrozenMapReader)
+    bool IsMapFrozen();
+    bool mbMapFrozen;
+
     void Reset();
 
 protected:
 
+    // Forgets the frames, local map and reference keyframes, before the map is cleared
+    void ClearTrackingState();
+
     // Main tracking function. It is independent of the input sensor.
     void Track();
 
@@ -127,24 +236,73 @@ protected:
     // Map initialization for monocular
     void MonocularInitialization();
     void CreateInitialMapMonocular();
+    // The points of the first keyframe of a new map are its local map
+    void SetInitialLocalMapPoints(KeyFrame* pKF);
+    // Erases a monocular initialization which failed, the other maps of the atlas are kept
+    void DiscardInitialMap(KeyFrame* pKFini, KeyFrame* pKFcur);
+
+    // Atlas: initializes a new map with the next frames, the lost map is kept
+    void StartNewMap();
 
     void CheckReplacedInLastFrame();
     bool TrackReferenceKeyFrame();
     void UpdateLastFrame();
     bool TrackWithMotionModel();
 
+    // Flow frames (Tracking.FlowFrames): the next image is tracked with the points of the last
+    // frame, without an extraction, if the last frame was tracked from the motion model and no
+    // keyframe is likely to be needed
+    bool CanTrackWithFlow();
+    Frame CreateFrameFlow(const cv::Mat &im, const double &timestamp, cv::Mat &imGray);
+    // The pose from the points tracked by flow alone, false if too few of them are inliers
+    bool TrackWithFlow();
+
+    // Motion model prediction of the next tracked frame, past the skipped ones
+    cv::Mat PredictPose() const;
+
     bool Relocalization();
+    // Matches the current frame against one relocalization candidate and estimates its pose.
+    // Returns true and sets the pose and matches if this candidate was the first to succeed.
+    // pvpBoWMatches: the BoW matches if they were computed already, NULL to search them.
+    bool EvaluateRelocalizationCandidate(KeyFrame* pKF, const int nIndex, std::atomic<bool> &bMatch,
+                                         std::atomic<int> &nCandidates, cv::Mat &Tcw,
+                                         std::vector<MapPoint*> &vpMapPoints, std::vector<bool> &vbOutlier,
+                                         const std::vector<MapPoint*>* pvpBoWMatches);
 
     void UpdateLocalMap();
     void UpdateLocalPoints();
-    void UpdateLocalKeyFrames();
-
-    bool TrackLocalMap();
-    void SearchLocalPoints();
+    // Returns false if the local keyframes and their contents are the same as in the last frame
+    bool UpdateLocalKeyFrames();
+    bool LocalKeyFramesChanged();
+    // The next UpdateLocalMap builds the local map from scratch
+    void InvalidateLocalMap();
+
+    // bCount: the visible and found counters of the points count this frame. Only the first
+    // search of a frame counts it, the culling of Local Mapping takes the ratio of the two.
+    bool TrackLocalMap(const bool bCount=true);
+    // Estimates the pose again after the map changed while it was estimated without the map mutex.
+    // The pose is first moved with the correction of pRefKF, whose pose was TcwRefOld before, so
+    // a loop correction or a merged global BA does not leave it off by the whole correction.
+    // After such a big change (bBigChange) the local map is tracked again, otherwise only the
+    // pose is optimized again on the matches. The frame was counted by the first search already.
+    bool RefinePose(KeyFrame* pRefKF, const cv::Mat &TcwRefOld, const bool bBigChange);
+    void SearchLocalPoints(const bool bCount=true);
+    // Matches the frames of the other rig cameras to the local map, at the pose of the rig
+    void SearchLocalPointsRig(const bool bCount=true);
 
     bool NeedNewKeyFrame();
+    // Ratio of the points of the reference keyframe under which a new keyframe is wanted
+    float KeyFrameRefRatio(const int nKFs) const;
+    // Offline, until Local Mapping is idle and running. The map lock is released meanwhile.
+    void WaitForLocalMapping(MapUpdateLock &lock);
+    // Deterministic, until Local Mapping and Loop Closing are done with the last keyframe
+    void WaitForMapping(MapUpdateLock &lock);
     void CreateNewKeyFrame();
 
+    // Drops the pointers to bad MapPoints and KeyFrames which are kept for the next frame
+    // and announces a quiescent state to the reclaimer of the map. Called after each frame.
+    void PassQuiescentState();
+
     // In case of performing only localization, this flag is true when there are no matches to
     // points in the map. Still tracking will continue if there are enough matches with temporal points.
     // In that case we are doing visual odometry. The system will try to do relocalization to recover
@@ -159,6 +317,91 @@ protected:
     ORBextractor* mpORBextractorLeft, *mpORBextractorRight;
     ORBextractor* mpIniORBextractor;
 
+    // Extracts the right image while the tracking thread extracts the left one (stereo only)
+    ThreadPool* mpStereoThreadPool;
+
+    // Adapts the extraction of mpORBextractorLeft/Right to the frame time, NULL unless FeatureBudget.enable
+    FeatureBudget* mpFeatureBudget;
+
+    // What NeedNewKeyFrame does while the local mapping is busy, and whether the keyframe it
+    // asked for interrupts the local BA
+    KeyFramePolicy mKeyFramePolicy;
+    bool mbKeyFrameInterruptsBA;
+
+    // The values of the settings, the upper bounds of the feature budget
+    FeatureBudget::Budget mMaxFeatureBudget;
+
+    // NULL without a latency target, mLatencyKnobs are taken again before every frame
+    LatencyScheduler* mpLatencyScheduler;
+    LatencyScheduler::Knobs mLatencyKnobs;
+
+    // Hands the current budget to the extractors before a frame is built, as the latency
+    // scheduler scales it
+    void ApplyFeatureBudget();
+
+    // Features of earlier runs of the sequence (FeatureCache.File), NULL without. ReplayFrame
+    // builds frame from the features of timestamp instead of extracting them, false if they
+    // are not there. RecordFrame adds an extracted frame with its BoW.
+    FeatureCache* mpFeatureCache;
+    bool ReplayFrame(const cv::Mat &imGray, const double &timestamp, const bool bInitializer, cv::Mat &distCoef, Frame &frame);
+    void RecordFrame(Frame &frame, const bool bInitializer);
+
+    // Evaluates the relocalization candidates in parallel
+    ThreadPool* mpRelocalizationThreadPool;
+    // False: every candidate is matched on its own
+    bool mbBatchMatching;
+
+    // Thumbnails of the keyframes seed the relocalization before the BoW stage
+    // (Relocalization.ThumbnailIndex)
+    bool mbThumbnailIndex;
+    // Adds the thumbnail of mImGray for a keyframe of the current frame
+    void AddThumbnail(KeyFrame* pKF);
+    // Compresses the depth image the current frame kept for its keyframe pKF
+    void StoreDepth(KeyFrame* pKF);
+    // Tracks the points of pKF from its pose, the first pass of the relocalization. Returns true
+    // and sets the pose and matches on enough inliers.
+    bool EvaluateThumbnailCandidate(KeyFrame* pKF, cv::Mat &Tcw, std::vector<MapPoint*> &vpMapPoints,
+                                    std::vector<bool> &vbOutlier);
+
+    // Pose prior of the relocalization (radius 0: none), under mMutexPosePrior
+    std::mutex mMutexPosePrior;
+    Eigen::Vector3f mPosePriorCenter;
+    float mfPosePriorRadius;
+
+    // Camera rig (Rig.nCameras>1, monocular only): calibration, extractor and extrinsics Tcr
+    // (from the first camera) of each other camera, and its last keyframe
+    struct RigCamera
+    {
+        cv::Mat K;
+        cv::Mat DistCoef;
+        cv::Mat Tcr;
+        ORBextractor* pExtractor;
+        FrameContext* pContext;
+        KeyFrame* pLastKF;
+    };
+    std::vector<RigCamera> mvRigCameras;
+    // Frames of the other cameras for the current image, empty while initializing
+    std::vector<Frame> mvRigFrames;
+    // The rig frames were matched and optimized with the current frame, they get keyframes
+    bool mbRigTracked;
+    // Extracts the other cameras while the tracking thread extracts the first one
+    ThreadPool* mpRigThreadPool;
+
+    // Reads the Rig.* settings, the rig is not used if a camera is incomplete
+    void LoadRig();
+    Frame CreateFrameRig(const size_t nCamera, const cv::Mat &im, const double &timestamp);
+
+    // Offline input: the extractors of each builder, pRight for stereo, pIni for monocular
+    struct BuilderExtractors
+    {
+        ORBextractor* pLeft;
+        ORBextractor* pRight;
+        ORBextractor* pIni;
+    };
+    std::vector<BuilderExtractors> mvBuilderExtractors;
+    bool mbOffline;
+    bool mbDeterministic;
+
     //BoW
     ORBVocabulary* mpORBVocabulary;
     KeyFrameDatabase* mpKeyFrameDB;
@@ -170,23 +413,83 @@ protected:
     KeyFrame* mpReferenceKF;
     std::vector<KeyFrame*> mvpLocalKeyFrames;
     std::vector<MapPoint*> mvpLocalMapPoints;
+    // Geometry of mvpLocalMapPoints, taken in UpdateLocalMap for SearchLocalPoints
+    LocalMapGeometry mLocalMapGeometry;
+
+    // The local map is kept from frame to frame while the keyframes voted by the matches of
+    // the frame are the same and none of the local keyframes changed (KeyFrame::GetChangeIdx).
+    // Each rebuild has a new generation, it marks the keyframes and points already collected.
+    std::vector<KeyFrame*> mvpLocalMapVotedKFs;
+    std::vector<unsigned long> mvnLocalKeyFramesChangeIdx;
+    unsigned long mnLocalMapGeneration;
+
+    // Marks pMP or pKF with the generation of the local map, false if it already was. In the
+    // objects for the tracking of the System, in the tables by mnId for a localization stream.
+    bool MarkLocalMap(MapPoint* pMP);
+    bool MarkLocalMap(KeyFrame* pKF);
+    bool MarkLocalMap(std::vector<unsigned long> &vMarks, const unsigned long nId);
+    bool mbStream;
+    std::vector<unsigned long> mvMapPointMarks;
+    std::vector<unsigned long> mvKeyFrameMarks;
+
+    // Radius around the reference keyframe whose map points (Map::mPointIndex) join the local
+    // map even if no local keyframe observes them. 0: only the covisibility graph
+    float mfLocalMapRadius;
+
+    // Direct alignment of the frame to the last one before the projection search of the motion
+    // model (Tracking.ImageAlignment), the search radius is halved when it succeeds
+    bool mbImageAlignment;
+    ImageAlignment mImageAlignment;
+
+    // At most mnMaxFlowFrames frames in a row are tracked by flow (0: never), mnFlowFrames since
+    // the last extracted one, which had mnFlowReferenceInliers inliers. mbFlowFailed asks
+    // GrabImageMonocular to extract the same image after all.
+    int mnMaxFlowFrames;
+    int mnFlowFrames;
+    int mnFlowReferenceInliers;
+    bool mbFlowFailed;
+
+    // Images skipped by the frame admission since the last frame, at the frame rate
+    int mnSkippedFrames;
 
     // System
     System* mpSystem;
 
-    //Drawers
-    Viewer* mpViewer;
+    //Drawers, all NULL without the viewer
+    Visualization* mpViewer;
     FrameDrawer* mpFrameDrawer;
-    MapDrawer* mpMapDrawer;
+
+    // Streams the map to remote viewers, NULL unless Streamer.Port is set
+    MapStreamer* mpStreamer;
+
+    // Hands the camera pose to the map drawer and the map streamer, if there are any
+    void PublishCameraPose(const cv::Mat &Tcw);
 
     //Map
     Map* mpMap;
+    int mnReclaimerId;
 
     //Calibration matrix
     cv::Mat mK;
     cv::Mat mDistCoef;
     float mbf;
 
+    // Monocular and RGB-D images can be undistorted as a whole before the extraction (Camera.undistortImages),
+    // the frames then get mNoDistCoef. The maps are built for the first image and after a change of the calibration.
+    bool mbUndistortImages;
+    cv::Mat mNoDistCoef;
+    cv::Mat mUndistortMap1;
+    cv::Mat mUndistortMap2;
+
+    // Stereo images are rectified by the extractors while they build the first level of their
+    // pyramids (Camera.rectifyStereo), with the fixed-point maps of LEFT.* and RIGHT.*. Empty if
+    // the caller rectifies.
+    void LoadStereoRectification();
+    cv::Mat mRectifyMapLeft1;
+    cv::Mat mRectifyMapLeft2;
+    cv::Mat mRectifyMapRight1;
+    cv::Mat mRectifyMapRight2;
+
     //New KeyFrame rules (according to fps)
     int mMinFrames;
     int mMaxFrames;
@@ -198,9 +501,12 @@ protected:
 
     // For RGB-D inputs only. For some datasets (e.g. TUM) the depthmap values are scaled.
     float mDepthMapFactor;
+    // Radius of the median of the depth around every keypoint, 0 to take the pixel
+    int mnDepthFilterRadius;
 
     //Current matches in frame
     int mnMatchesInliers;
+    int mvnStrategyMatches[PerformanceReport::NUM_STRATEGIES];
 
     //Last Frame, KeyFrame and Relocalisation Info
     KeyFrame* mpLastKeyFrame;
@@ -208,15 +514,22 @@ protected:
     unsigned int mnLastKeyFrameId;
     unsigned int mnLastRelocFrameId;
 
+    // Frames lost in a row, a new map is started after mnMaxLostFrames (Atlas.nLostFrames, 0: never)
+    int mnLostFrames;
+    int mnMaxLostFrames;
+
     //Motion Model
     cv::Mat mVelocity;
 
     //Color order (true RGB, false BGR, ignored if grayscale)
     bool mbRGB;
+    // The frames keep the colors of their keypoints (Export.Color)
+    bool mbSampleColors;
 
     list<MapPoint*> mlpTemporalPoints;
 
-    cv::FileStorage mfSettings;
+    // Of the System, which outlives the tracking
+    const Settings &mfSettings;
 
     int mnAmountTrackedMapPoints;
     int mnAmountTrackedMapPointsKF;
@@ -225,6 +538,8 @@ protected:
     Parameter<bool> mTriggerRelocalization;
     Parameter<bool> mVisualizeTracking;
     Parameter<bool> mVisualizeRelocalization;
+    // "Show Init." of the Initializer
+    ParameterHandle<bool> mShowInitialization;
 };
 
 } //namespace ORB_SLAM
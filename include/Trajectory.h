@@ -0,0 +1,73 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+
+// Frame pose relative to its reference keyframe (which is optimized by BA and pose graph) for
+// every frame, to recover the full camera trajectory. The entries have a fixed size and are kept
+// in chunks which never move, one allocation per CHUNK_SIZE frames instead of a list node and a
+// matrix per frame. The tracking appends, any thread copies entries out under the lock.
+class Trajectory
+{
+public:
+
+    struct Entry
+    {
+        // Rows 0 to 2 of Tcr, row major
+        float Tcr[12];
+        KeyFrame* pReference;
+        double timestamp;
+        // The tracking failed for this frame
+        bool bLost;
+    };
+
+    Trajectory();
+
+    void Add(const cv::Mat &Tcr, KeyFrame* pReference, const double timestamp, const bool bLost);
+
+    // The last entry again with a new lost flag, for a frame without a pose. Nothing if empty.
+    void AddLast(const bool bLost);
+
+    // Tcr of the last entry, empty if there is none
+    cv::Mat GetLastRelativePose();
+
+    size_t Size();
+
+    // Copies up to nMax entries from nBegin to the end of vEntries, returns the number copied
+    size_t Get(const size_t nBegin, const size_t nMax, std::vector<Entry> &vEntries);
+
+    // The chunks are kept for the next trajectory
+    void Clear();
+
+    // Incremented by every Clear, the entries before belong to another map
+    unsigned int GetNumClears();
+
+    // World to camera of a frame now. If the reference keyframe was culled it is walked up the
+    // spanning tree. pnPoseEpoch gets the KeyFrame::mnPoseEpoch of the keyframe the pose depends on.
+    static cv::Mat GetCameraPose(const Entry &entry, unsigned long* pnPoseEpoch = NULL);
+
+protected:
+
+    static const size_t CHUNK_SIZE = 4096; //param frames
+
+    Entry &At(const size_t i) { return mvChunks[i/CHUNK_SIZE][i%CHUNK_SIZE]; }
+
+    std::mutex mMutex;
+    std::vector<std::unique_ptr<Entry[]> > mvChunks;
+    size_t mnSize;
+    unsigned int mnClears;
+};
+
+} //namespace ORB_SLAM
+
+#endif // TRAJECTORY_H
@@ -0,0 +1,54 @@
+#ifndef TRAJECTORYEVALUATION_H
+#define TRAJECTORYEVALUATION_H
+
+#include "ImageSource.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace ORB_SLAM2
+{
+
+// Absolute trajectory error of a saved trajectory against a ground truth, for the replay and
+// sweep tools. The estimate is aligned to the ground truth with a similarity (monocular) or a
+// rigid transformation (Umeyama) on the positions associated by timestamp.
+class TrajectoryEvaluation
+{
+public:
+
+    struct Point
+    {
+        double timestamp;
+        Eigen::Vector3d position;
+    };
+
+    struct Error
+    {
+        size_t nPairs;
+        double scale;
+        double rmse;
+        double mean;
+        double median;
+        double max;
+    };
+
+    // Positions of a TUM trajectory, a EuRoC ground truth (data.csv) or KITTI poses, which have
+    // no timestamps and take those of the images. Sorted by timestamp.
+    static bool Load(const std::string &strFile, const std::vector<ImageSource::Entry> &vImages, std::vector<Point> &vPoints);
+
+    // False if fewer than 3 positions of vEstimate have a ground truth
+    static bool ComputeATE(const std::vector<Point> &vEstimate, const std::vector<Point> &vGroundTruth, const bool bScale,
+                           Error &error);
+
+protected:
+
+    // Maximum time difference between an estimated pose and its ground truth, in seconds
+    static const double MAX_ASSOCIATION_DT;
+};
+
+} //namespace ORB_SLAM
+
+#endif // TRAJECTORYEVALUATION_H
@@ -0,0 +1,68 @@
+#ifndef TRAJECTORYWRITER_H
+#define TRAJECTORYWRITER_H
+
+#include "Trajectory.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace ORB_SLAM2
+{
+
+class Map;
+
+// Writes the camera trajectory while the system runs (Trajectory.StreamFile), in the format of
+// System::SaveTrajectoryTUM but in world coordinates. A frame is written once it is delay seconds
+// older than the last frame, local BA has mostly settled its reference keyframe by then. After a
+// loop correction or a global BA the frames written so far whose keyframe moved are written again
+// with the corrected pose, so readers keep the last line of a timestamp. A reset of the map is the
+// comment line "# reset", the poses after it are in the new map. Lost frames are not written.
+// Called on the tracking thread, one call writes a bounded number of lines.
+class TrajectoryWriter
+{
+public:
+
+    TrajectoryWriter(Trajectory* pTrajectory, Map* pMap, const std::string &strFile, const double delay);
+
+    bool IsOpen() const { return mFile.is_open(); }
+
+    // After every frame, writes the frames which got old enough and goes on with a correction
+    void Update();
+
+    // Writes all frames left and finishes a correction, at shutdown
+    void Finish();
+
+protected:
+
+    void Update(const bool bAll);
+
+    // Returns the number of entries looked at
+    size_t WriteNewFrames(const size_t nMax, const bool bAll);
+    size_t CorrectFrames(const size_t nMax);
+
+    void WriteLine(const Trajectory::Entry &entry, const cv::Mat &Tcw);
+
+    Trajectory* mpTrajectory;
+    Map* mpMap;
+    std::ofstream mFile;
+    const double mfDelay;
+
+    unsigned int mnClears;
+    int mnBigChangeIdx;
+
+    // Frames of the trajectory looked at so far, with the pose epoch of the keyframe their written
+    // pose depends on (0 if the frame was lost and not written)
+    size_t mnWritten;
+    std::vector<unsigned long> mvnWrittenEpochs;
+
+    // The correction after the last big change checks the frames up to mnCorrectionEnd
+    size_t mnCorrected;
+    size_t mnCorrectionEnd;
+
+    std::vector<Trajectory::Entry> mvEntries;
+};
+
+} //namespace ORB_SLAM
+
+#endif // TRAJECTORYWRITER_H
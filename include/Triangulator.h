@@ -0,0 +1,106 @@
+#ifndef TRIANGULATOR_H
+#define TRIANGULATOR_H
+
+#include <cstddef>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+
+// Linear triangulation (DLT) of the point seen at (x1,y1) by the camera P1 and at (x2,y2) by P2,
+// with a fixed size SVD. The homogeneous point is only defined up to scale.
+void TriangulateDLT(const Eigen::Matrix<float,3,4> &P1, const Eigen::Matrix<float,3,4> &P2,
+                    const float x1, const float y1, const float x2, const float y2, Eigen::Vector4f &x3Dh);
+
+// Triangulates a batch of matches between two keyframes and runs the checks of new map points:
+// parallax, depth in front of both cameras, reprojection error and scale consistency. The matches
+// are stored as structure of arrays and the checks are branch free loops over them, so they are
+// vectorized by the compiler. Nothing is allocated per match once the arrays have grown.
+class Triangulator
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    Triangulator();
+
+    // Starts a new batch between pKF1 and pKF2. Reads the poses, the keyframes must stay alive
+    // until the batch is done.
+    void Reset(KeyFrame* pKF1, KeyFrame* pKF2);
+
+    // Match of keypoint idx1 of the first keyframe with idx2 of the second
+    void Add(const size_t idx1, const size_t idx2);
+
+    // Triangulates every match. A match is good if it passes all checks, ratioFactor bounds the
+    // ratio of the distances to both cameras against the ratio of the scales of the keypoints.
+    void Run(const float ratioFactor);
+
+    std::size_t Size() const { return mvIdx1.size(); }
+    bool IsGood(const std::size_t i) const { return mvbGood[i]; }
+    std::size_t Idx1(const std::size_t i) const { return mvIdx1[i]; }
+    std::size_t Idx2(const std::size_t i) const { return mvIdx2[i]; }
+    Eigen::Vector3f Position(const std::size_t i) const { return Eigen::Vector3f(mvX[i],mvY[i],mvZ[i]); }
+
+protected:
+
+    // How the point of a match is computed
+    enum Method
+    {
+        NONE=0,
+        LINEAR=1,
+        STEREO1=2,
+        STEREO2=3
+    };
+
+    struct Camera
+    {
+        Eigen::Matrix3f Rcw;
+        Eigen::Matrix3f Rwc;
+        Eigen::Vector3f tcw;
+        Eigen::Vector3f Ow;
+        Eigen::Matrix<float,3,4> Tcw;
+        float fx, fy, cx, cy, invfx, invfy, bf, b;
+    };
+
+    // Observations of the matches in one keyframe
+    struct Observations
+    {
+        void Clear();
+
+        // normalized coordinates
+        std::vector<float> vXn, vYn;
+        // undistorted keypoint and right coordinate (negative if monocular)
+        std::vector<float> vU, vV, vUr;
+        // point from the stereo depth, in world coordinates
+        std::vector<float> vStereoX, vStereoY, vStereoZ;
+        // cos of the parallax of the stereo pair, larger than any ray parallax if monocular
+        std::vector<float> vCosParallaxStereo;
+        std::vector<float> vSigma2;
+        std::vector<float> vScale;
+    };
+
+    void SetCamera(KeyFrame* pKF, Camera &camera);
+    void AddObservation(KeyFrame* pKF, const Camera &camera, const size_t idx, Observations &obs);
+
+    // Squared reprojection errors, the right coordinate only counts for stereo observations.
+    // Writes whether the point is in front of the camera and passes the chi2 test.
+    void CheckCamera(const Camera &camera, const Observations &obs, std::vector<unsigned char> &vbGood) const;
+
+    KeyFrame* mpKF1;
+    KeyFrame* mpKF2;
+    Camera mCamera1, mCamera2;
+
+    std::vector<std::size_t> mvIdx1, mvIdx2;
+    Observations mObs1, mObs2;
+
+    std::vector<unsigned char> mvMethod;
+    std::vector<float> mvX, mvY, mvZ;
+    std::vector<unsigned char> mvbGood;
+};
+
+} //namespace ORB_SLAM
+
+#endif // TRIANGULATOR_H
@@ -24,8 +24,10 @@
 
 #include "FrameDrawer.h"
 #include "MapDrawer.h"
+#include "PangolinParameters.h"
 #include "Tracking.h"
 #include "System.h"
+#include "Visualization.h"
 
 #include <stdio.h>
 #include <mutex>
@@ -38,26 +40,31 @@ class FrameDrawer;
 class MapDrawer;
 class System;
 
-class Viewer
+// Part of the viewer module, System loads it through Visualization
+class Viewer : public Visualization
 {
 public:
-    Viewer(System* pSystem, FrameDrawer* pFrameDrawer, MapDrawer* pMapDrawer, Tracking *pTracking, const string &strSettingPath);
+    Viewer(System* pSystem, FrameDrawer* pFrameDrawer, MapDrawer* pMapDrawer, Tracking *pTracking, const Settings &fSettings);
 
     // Main thread function. Draw points, keyframes, the current camera pose and the last processed
     // frame. Drawing is refreshed according to the camera fps. We use Pangolin.
-    void Run();
+    void Run() override;
 
-    void RequestFinish();
+    void RequestFinish() override;
 
-    void RequestStop();
+    void RequestStop() override;
 
-    bool isFinished();
+    bool isFinished() override;
 
-    bool isStopped();
+    bool isStopped() override;
 
-    void Release();
+    void Release() override;
 
-    void ignoreFPS(const bool& ignore);
+    void ignoreFPS(const bool& ignore) override;
+
+    void SetCurrentCameraPose(const cv::Mat &Tcw) override;
+
+    void BindContext() override;
 
 private:
 
@@ -85,6 +92,9 @@ private:
     std::mutex mMutexStop;
 
     bool mIgnoreFPS;
+
+    // The panels of the parameters
+    PangolinParameters mParameters;
 };
 
 }
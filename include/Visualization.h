@@ -0,0 +1,64 @@
+#ifndef VISUALIZATION_H
+#define VISUALIZATION_H
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+
+namespace ORB_SLAM2
+{
+
+class System;
+class FrameDrawer;
+class Tracking;
+class Map;
+class Settings;
+
+// The viewer as the core library sees it. The viewer, the map drawer and the Pangolin parameter
+// panel are a module of their own (libORB_SLAM2_viewer.so), so the core links no GL, Pangolin
+// or window libraries. Load opens the module only when a viewer is asked for, a system without
+// it never loads them.
+class Visualization
+{
+public:
+    virtual ~Visualization() {}
+
+    // Main thread function
+    virtual void Run() = 0;
+
+    virtual void RequestFinish() = 0;
+
+    virtual void RequestStop() = 0;
+
+    virtual bool isFinished() = 0;
+
+    virtual bool isStopped() = 0;
+
+    virtual void Release() = 0;
+
+    virtual void ignoreFPS(const bool& ignore) = 0;
+
+    // Pose of the current frame, called by the tracking
+    virtual void SetCurrentCameraPose(const cv::Mat &Tcw) = 0;
+
+    // Binds the GL context of the finished viewer to the calling thread, so its window is closed
+    // with the calling thread's resources
+    virtual void BindContext() = 0;
+
+    // Opens the module next to the core library, or on the library path. False with a message if
+    // it is not there (a HEADLESS build).
+    static bool Available();
+
+    // NULL if the module is not available
+    static Visualization* Load(System* pSystem, FrameDrawer* pFrameDrawer, Tracking* pTracking, Map* pMap,
+                               const Settings &settings);
+};
+
+} //namespace ORB_SLAM
+
+// The entry point of the module
+extern "C" ORB_SLAM2::Visualization* ORB_SLAM2_CreateVisualization(ORB_SLAM2::System* pSystem,
+        ORB_SLAM2::FrameDrawer* pFrameDrawer, ORB_SLAM2::Tracking* pTracking, ORB_SLAM2::Map* pMap,
+        const ORB_SLAM2::Settings &settings);
+
+#endif // VISUALIZATION_H
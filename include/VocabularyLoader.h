@@ -0,0 +1,31 @@
+#ifndef VOCABULARYLOADER_H
+#define VOCABULARYLOADER_H
+
+#include "ORBVocabulary.h"
+
+namespace ORB_SLAM2
+{
+
+// The vocabularies still being read on a thread of their own (Vocabulary.LoadAsync), while the
+// rest of the System starts and the tracking takes its first frames. The object of such a
+// vocabulary exists from the start, so the frames, the keyframes and the threads hold it as
+// usual, only what reads its words waits for it: the BoW of the frames and keyframes, the
+// inverted file of the KeyFrameDatabase, the map files and the loop server. Once no vocabulary
+// is loading a wait is one atomic load.
+class VocabularyLoader
+{
+public:
+
+    // Around the loading of pVocabulary: Begin before anyone else can see it, End once it is complete
+    static void Begin(const ORBVocabulary* pVocabulary);
+    static void End(const ORBVocabulary* pVocabulary);
+
+    // Blocks while pVocabulary is loading
+    static void Wait(const ORBVocabulary* pVocabulary);
+
+    static bool IsLoading(const ORBVocabulary* pVocabulary);
+};
+
+} //namespace ORB_SLAM
+
+#endif // VOCABULARYLOADER_H
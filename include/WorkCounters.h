@@ -0,0 +1,145 @@
+#ifndef WORKCOUNTERS_H
+#define WORKCOUNTERS_H
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace ORB_SLAM2
+{
+
+// Searches of the ORBmatcher, one per overload
+enum class MatcherSearch
+{
+    PROJECTION_LOCAL_MAP,
+    PROJECTION_LAST_FRAME,
+    PROJECTION_KEYFRAME,
+    PROJECTION_SIM3,
+    BOW_FRAME,
+    BOW_KEYFRAMES,
+    INITIALIZATION,
+    TRIANGULATION,
+    FUSE,
+    FUSE_SIM3,
+    SIM3,
+    NUM_SEARCHES
+};
+
+// Optimizations of the Optimizer
+enum class OptimizerRun
+{
+    POSE_OPTIMIZATION,
+    LOCAL_BUNDLE_ADJUSTMENT,
+    BUNDLE_ADJUSTMENT,
+    ESSENTIAL_GRAPH,
+    SIM3,
+    NUM_RUNS
+};
+
+struct MatcherCounts
+{
+    uint64_t nCalls;
+    // Features returned by the grid or BoW lookups
+    uint64_t nCandidates;
+    // Descriptor distances computed
+    uint64_t nDistances;
+    // Matches dropped by the rotation consistency check
+    uint64_t nRotationRejected;
+    uint64_t nMatches;
+};
+
+struct OptimizerCounts
+{
+    uint64_t nCalls;
+    uint64_t nVertices;
+    uint64_t nEdges;
+    uint64_t nIterations;
+    uint64_t nOutliers;
+    // Final chi2 and seconds, summed over the calls
+    double chi2;
+    double time;
+    double maxTime;
+};
+
+// How much work the matcher searches and the optimizations do, for the whole process: what they
+// were given, what they computed and what they kept, to tell a slow search from a search given
+// too many candidates. Compiled in with ORB_SLAM2_WORK_COUNTERS (cmake -DWORK_COUNTERS=ON),
+// otherwise the counting macros expand to nothing and their arguments are not evaluated.
+class WorkCounters
+{
+public:
+    static bool IsEnabled();
+
+    static void Add(const MatcherSearch search, const MatcherCounts &counts);
+    static void Add(const OptimizerRun run, const OptimizerCounts &counts);
+
+    static MatcherCounts Get(const MatcherSearch search);
+    static OptimizerCounts Get(const OptimizerRun run);
+    static void Reset();
+
+    static const char* Name(const MatcherSearch search);
+    static const char* Name(const OptimizerRun run);
+
+    // Table of the searches and optimizations with calls. Does nothing when not compiled in.
+    static void Print(std::ostream &out);
+};
+
+// Counts of the search running on this thread, added when it returns
+class ScopedMatcherCounter
+{
+public:
+    explicit ScopedMatcherCounter(const MatcherSearch search);
+    ~ScopedMatcherCounter();
+
+    // Of the calling thread, NULL out of a search
+    static MatcherCounts* Current();
+
+private:
+    ScopedMatcherCounter(const ScopedMatcherCounter&);
+    ScopedMatcherCounter& operator=(const ScopedMatcherCounter&);
+
+    const MatcherSearch mSearch;
+    MatcherCounts mCounts;
+    MatcherCounts* mpPrevious;
+};
+
+// Times an optimization, the function reports the size of its problem with SetResult
+class ScopedOptimizerCounter
+{
+public:
+    explicit ScopedOptimizerCounter(const OptimizerRun run);
+    ~ScopedOptimizerCounter();
+
+    void SetResult(const int nVertices, const int nEdges, const int nIterations, const int nOutliers,
+                   const double chi2);
+
+private:
+    ScopedOptimizerCounter(const ScopedOptimizerCounter&);
+    ScopedOptimizerCounter& operator=(const ScopedOptimizerCounter&);
+
+    const OptimizerRun mRun;
+    OptimizerCounts mCounts;
+    const std::chrono::steady_clock::time_point mStart;
+};
+
+} //namespace ORB_SLAM
+
+// MATCHER_COUNTER counts the rest of the enclosing search, MATCHER_COUNT adds to one of its
+// MatcherCounts fields (and does nothing out of a search). OPTIMIZER_COUNTER and
+// OPTIMIZER_RESULT do the same for an optimization.
+#ifdef ORB_SLAM2_WORK_COUNTERS
+#define MATCHER_COUNTER(search) ORB_SLAM2::ScopedMatcherCounter matcherCounter(ORB_SLAM2::MatcherSearch::search)
+#define MATCHER_COUNT(field,n) \
+    do { ORB_SLAM2::MatcherCounts* pCounts = ORB_SLAM2::ScopedMatcherCounter::Current(); \
+         if(pCounts) pCounts->field += (n); } while(0)
+#define OPTIMIZER_COUNTER(run) ORB_SLAM2::ScopedOptimizerCounter optimizerCounter(ORB_SLAM2::OptimizerRun::run)
+#define OPTIMIZER_RESULT(nVertices,nEdges,nIterations,nOutliers,chi2) \
+    optimizerCounter.SetResult(nVertices,nEdges,nIterations,nOutliers,chi2)
+#else
+#define MATCHER_COUNTER(search)
+#define MATCHER_COUNT(field,n) ((void)0)
+#define OPTIMIZER_COUNTER(run)
+#define OPTIMIZER_RESULT(nVertices,nEdges,nIterations,nOutliers,chi2) ((void)0)
+#endif
+
+#endif // WORKCOUNTERS_H
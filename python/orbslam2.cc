@@ -0,0 +1,387 @@
+/**
+* Python module over System for batch evaluation from NumPy (cmake -DPYTHON_BINDINGS=ON, builds
+* lib/orbslam2*.so). The images are not copied: a uint8 grayscale array (or color, except for
+* RGB-D) and a float32 depthmap in meters are wrapped as they are, their rows only need contiguous
+* pixels (a crop of a larger array works). The GIL is released while an image is tracked and during shutdown, so
+* several Systems run in parallel from Python threads, one thread per System. They can share one
+* Vocabulary, which is kept alive by them.
+*
+*   import numpy as np, orbslam2
+*   voc = orbslam2.Vocabulary("Vocabulary/ORBvoc.bin")
+*   slam = orbslam2.System(voc, "Examples/Stereo/EuRoC.yaml", orbslam2.Sensor.STEREO)
+*   Tcw = slam.track_stereo(left, right, t)       # 4x4 float32, None while lost
+*   keypoints, points = slam.tracked_points()     # Nx2 undistorted pixels, Nx3 world (NaN unmatched)
+*   times = slam.stage_times()                    # dict of arrays by stage, seconds
+*   slam.shutdown()
+*
+* The poses, points and times are copied into new arrays, they are small. The parameters, the
+* logging and the trace stay process wide as they are for the Systems of one C++ process.
+*/
+
+#include "System.h"
+#include "MapPoint.h"
+
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+namespace py = pybind11;
+
+namespace
+{
+
+class Vocabulary
+{
+public:
+    Vocabulary(const std::string &strVocFile, const std::string &strSharedMemory)
+    {
+        {
+            py::gil_scoped_release release;
+            mpVocabulary.reset(ORB_SLAM2::System::LoadVocabulary(strVocFile,strSharedMemory));
+        }
+        if(!mpVocabulary)
+            throw std::runtime_error("Can not read the vocabulary " + strVocFile);
+    }
+
+    ORB_SLAM2::ORBVocabulary* Get() { return mpVocabulary.get(); }
+
+private:
+    std::unique_ptr<ORB_SLAM2::ORBVocabulary> mpVocabulary;
+};
+
+// Header of a NumPy image without a copy, valid while its buffer is held
+cv::Mat WrapImage(const py::buffer_info &info, const char* name)
+{
+    if(info.format!=py::format_descriptor<uint8_t>::format())
+        throw std::invalid_argument(std::string(name) + " must be uint8");
+    int channels = 1;
+    if(info.ndim==3)
+        channels = static_cast<int>(info.shape[2]);
+    else if(info.ndim!=2)
+        throw std::invalid_argument(std::string(name) + " must be HxW, HxWx1 or HxWx3");
+    if(channels!=1 && channels!=3)
+        throw std::invalid_argument(std::string(name) + " must have 1 or 3 channels");
+    if(info.strides[1]!=channels || (info.ndim==3 && info.strides[2]!=1) || info.strides[0]<info.shape[1]*channels)
+        throw std::invalid_argument(std::string(name) + " must have contiguous rows");
+
+    return cv::Mat(static_cast<int>(info.shape[0]),static_cast<int>(info.shape[1]),CV_8UC(channels),
+                   info.ptr,static_cast<size_t>(info.strides[0]));
+}
+
+cv::Mat WrapDepth(const py::buffer_info &info)
+{
+    if(info.format!=py::format_descriptor<float>::format() || info.ndim!=2)
+        throw std::invalid_argument("depthmap must be a HxW float32 array");
+    if(info.strides[1]!=sizeof(float) || info.strides[0]%sizeof(float) || info.strides[0]<info.shape[1]*static_cast<py::ssize_t>(sizeof(float)))
+        throw std::invalid_argument("depthmap must have contiguous rows");
+
+    return cv::Mat(static_cast<int>(info.shape[0]),static_cast<int>(info.shape[1]),CV_32F,
+                   info.ptr,static_cast<size_t>(info.strides[0]));
+}
+
+ORB_SLAM2::System::ExternalImage External(const cv::Mat &im)
+{
+    ORB_SLAM2::System::ExternalImage external;
+    external.data = im.data;
+    external.width = im.cols;
+    external.height = im.rows;
+    external.step = im.step[0];
+    return external;
+}
+
+ORB_SLAM2::System::ExternalDepth ExternalDepth(const cv::Mat &depth)
+{
+    ORB_SLAM2::System::ExternalDepth external;
+    external.data = depth.ptr<float>();
+    external.width = depth.cols;
+    external.height = depth.rows;
+    external.step = depth.step[0];
+    return external;
+}
+
+py::object ToPose(const cv::Mat &Tcw)
+{
+    if(Tcw.empty())
+        return py::none();
+
+    py::array_t<float> pose({4,4});
+    cv::Mat header(4,4,CV_32F,pose.mutable_data());
+    Tcw.convertTo(header,CV_32F);
+    return pose;
+}
+
+class PySystem
+{
+public:
+    PySystem(std::shared_ptr<Vocabulary> pVocabulary, const std::string &strSettingsFile,
+             const ORB_SLAM2::System::eSensor sensor, const bool bUseViewer):
+        mpVocabulary(pVocabulary), mSensor(sensor), mbShutdown(false)
+    {
+        py::gil_scoped_release release;
+        mpSystem.reset(new ORB_SLAM2::System(mpVocabulary->Get(),strSettingsFile,sensor,bUseViewer));
+    }
+
+    ~PySystem()
+    {
+        py::gil_scoped_release release;
+        ShutdownUnlocked();
+    }
+
+    py::object TrackMonocular(py::buffer im, const double timestamp)
+    {
+        Check(ORB_SLAM2::System::MONOCULAR,"track_monocular");
+        const py::buffer_info info = im.request();
+        const cv::Mat image = WrapImage(info,"image");
+
+        cv::Mat Tcw;
+        {
+            py::gil_scoped_release release;
+            std::unique_lock<std::mutex> lock(mMutex);
+            if(image.channels()==1)
+                Tcw = mpSystem->TrackMonocular(External(image),timestamp);
+            else
+                Tcw = mpSystem->TrackMonocular(image,timestamp);
+        }
+        return ToPose(Tcw);
+    }
+
+    py::object TrackStereo(py::buffer imLeft, py::buffer imRight, const double timestamp)
+    {
+        Check(ORB_SLAM2::System::STEREO,"track_stereo");
+        const py::buffer_info infoLeft = imLeft.request();
+        const py::buffer_info infoRight = imRight.request();
+        const cv::Mat left = WrapImage(infoLeft,"left image");
+        const cv::Mat right = WrapImage(infoRight,"right image");
+
+        cv::Mat Tcw;
+        {
+            py::gil_scoped_release release;
+            std::unique_lock<std::mutex> lock(mMutex);
+            if(left.channels()==1 && right.channels()==1)
+                Tcw = mpSystem->TrackStereo(External(left),External(right),timestamp);
+            else
+                Tcw = mpSystem->TrackStereo(left,right,timestamp);
+        }
+        return ToPose(Tcw);
+    }
+
+    py::object TrackRGBD(py::buffer im, py::buffer depthmap, const double timestamp)
+    {
+        Check(ORB_SLAM2::System::RGBD,"track_rgbd");
+        const py::buffer_info info = im.request();
+        const py::buffer_info infoDepth = depthmap.request();
+        const cv::Mat image = WrapImage(info,"image");
+        const cv::Mat depth = WrapDepth(infoDepth);
+        // The color conversion of the cv::Mat input comes with DepthMapFactor, the depthmap here
+        // is in meters already
+        if(image.channels()!=1)
+            throw std::invalid_argument("track_rgbd takes a grayscale image");
+
+        cv::Mat Tcw;
+        {
+            py::gil_scoped_release release;
+            std::unique_lock<std::mutex> lock(mMutex);
+            Tcw = mpSystem->TrackRGBD(External(image),ExternalDepth(depth),timestamp);
+        }
+        return ToPose(Tcw);
+    }
+
+    // Undistorted keypoints of the last frame and the world positions of their map points
+    py::tuple TrackedPoints()
+    {
+        std::vector<cv::KeyPoint> vKeys;
+        std::vector<Eigen::Vector3f> vPos;
+        std::vector<bool> vbMatched;
+        {
+            py::gil_scoped_release release;
+            std::unique_lock<std::mutex> lock(mMutex);
+            vKeys = mpSystem->GetTrackedKeyPointsUn();
+            const std::vector<ORB_SLAM2::MapPoint*> vpMPs = mpSystem->GetTrackedMapPoints();
+            vPos.resize(vKeys.size());
+            vbMatched.assign(vKeys.size(),false);
+            for(size_t i=0; i<vKeys.size() && i<vpMPs.size(); i++)
+            {
+                ORB_SLAM2::MapPoint* pMP = vpMPs[i];
+                if(pMP && !pMP->isBad())
+                {
+                    pMP->GetWorldPos(vPos[i]);
+                    vbMatched[i] = true;
+                }
+            }
+        }
+
+        const py::ssize_t N = static_cast<py::ssize_t>(vKeys.size());
+        py::array_t<float> keypoints({N,static_cast<py::ssize_t>(2)});
+        py::array_t<float> points({N,static_cast<py::ssize_t>(3)});
+        float* pKeys = keypoints.mutable_data();
+        float* pPoints = points.mutable_data();
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        for(py::ssize_t i=0; i<N; i++)
+        {
+            pKeys[2*i] = vKeys[i].pt.x;
+            pKeys[2*i+1] = vKeys[i].pt.y;
+            for(int j=0; j<3; j++)
+                pPoints[3*i+j] = vbMatched[i] ? vPos[i][j] : nan;
+        }
+        return py::make_tuple(keypoints,points);
+    }
+
+    // Per stage name: count, total, last, max, mean and the 0.5, 0.9 and 0.99 quantiles, seconds
+    py::dict StageTimes()
+    {
+        std::vector<ORB_SLAM2::StageTimes::Summary> vSummaries;
+        {
+            py::gil_scoped_release release;
+            vSummaries = mpSystem->GetAllStageTimes();
+        }
+
+        py::dict times;
+        for(size_t i=0; i<vSummaries.size(); i++)
+        {
+            const ORB_SLAM2::StageTimes::Summary &s = vSummaries[i];
+            py::array_t<double> values(8);
+            double* p = values.mutable_data();
+            p[0] = static_cast<double>(s.nCount);
+            p[1] = s.total;
+            p[2] = s.last;
+            p[3] = s.max;
+            p[4] = s.Mean();
+            p[5] = s.Quantile(0.5);
+            p[6] = s.Quantile(0.9);
+            p[7] = s.Quantile(0.99);
+            times[py::str(s.name)] = values;
+        }
+        return times;
+    }
+
+    int GetTrackingState()
+    {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(mMutex);
+        return mpSystem->GetTrackingState();
+    }
+
+    void ResetStageTimes() { mpSystem->ResetStageTimes(); }
+
+    void WaitUntilIdle()
+    {
+        py::gil_scoped_release release;
+        mpSystem->WaitUntilIdle();
+    }
+
+    void Reset() { mpSystem->Reset(); }
+
+    void ActivateLocalizationMode() { mpSystem->ActivateLocalizationMode(); }
+    void DeactivateLocalizationMode() { mpSystem->DeactivateLocalizationMode(); }
+
+    void Shutdown()
+    {
+        py::gil_scoped_release release;
+        ShutdownUnlocked();
+    }
+
+    void SaveTrajectoryTUM(const std::string &filename)
+    {
+        CheckShutdown();
+        py::gil_scoped_release release;
+        mpSystem->SaveTrajectoryTUM(filename);
+    }
+
+    void SaveKeyFrameTrajectoryTUM(const std::string &filename)
+    {
+        CheckShutdown();
+        py::gil_scoped_release release;
+        mpSystem->SaveKeyFrameTrajectoryTUM(filename);
+    }
+
+    void SaveTrajectoryKITTI(const std::string &filename)
+    {
+        CheckShutdown();
+        py::gil_scoped_release release;
+        mpSystem->SaveTrajectoryKITTI(filename);
+    }
+
+private:
+
+    // The System exits on an input of the wrong sensor, raise instead
+    void Check(const ORB_SLAM2::System::eSensor sensor, const char* function)
+    {
+        if(mSensor!=sensor)
+            throw std::invalid_argument(std::string(function) + " called on a System of another sensor");
+        if(mbShutdown)
+            throw std::runtime_error(std::string(function) + " called after shutdown");
+    }
+
+    void CheckShutdown()
+    {
+        if(!mbShutdown)
+            throw std::runtime_error("call shutdown before saving the trajectory");
+    }
+
+    // Without the GIL
+    void ShutdownUnlocked()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if(mbShutdown || !mpSystem)
+            return;
+        mpSystem->Shutdown();
+        mbShutdown = true;
+    }
+
+    std::shared_ptr<Vocabulary> mpVocabulary;
+    std::unique_ptr<ORB_SLAM2::System> mpSystem;
+    ORB_SLAM2::System::eSensor mSensor;
+    bool mbShutdown;
+
+    // One image at a time, the tracked points are read between two images
+    std::mutex mMutex;
+};
+
+} // namespace
+
+PYBIND11_MODULE(orbslam2, m)
+{
+    m.doc() = "ORB-SLAM2 System with NumPy input and output";
+
+    py::enum_<ORB_SLAM2::System::eSensor>(m,"Sensor")
+        .value("MONOCULAR",ORB_SLAM2::System::MONOCULAR)
+        .value("STEREO",ORB_SLAM2::System::STEREO)
+        .value("RGBD",ORB_SLAM2::System::RGBD);
+
+    m.attr("SYSTEM_NOT_READY") = static_cast<int>(ORB_SLAM2::Tracking::SYSTEM_NOT_READY);
+    m.attr("NO_IMAGES_YET") = static_cast<int>(ORB_SLAM2::Tracking::NO_IMAGES_YET);
+    m.attr("NOT_INITIALIZED") = static_cast<int>(ORB_SLAM2::Tracking::NOT_INITIALIZED);
+    m.attr("OK") = static_cast<int>(ORB_SLAM2::Tracking::OK);
+    m.attr("LOST") = static_cast<int>(ORB_SLAM2::Tracking::LOST);
+
+    m.attr("STAGE_TIME_FIELDS") = py::make_tuple("count","total","last","max","mean","p50","p90","p99");
+
+    py::class_<Vocabulary, std::shared_ptr<Vocabulary> >(m,"Vocabulary")
+        .def(py::init<const std::string&, const std::string&>(),py::arg("path"),py::arg("shared_memory")="");
+
+    py::class_<PySystem>(m,"System")
+        .def(py::init<std::shared_ptr<Vocabulary>, const std::string&, ORB_SLAM2::System::eSensor, bool>(),
+             py::arg("vocabulary"),py::arg("settings"),py::arg("sensor"),py::arg("use_viewer")=false)
+        .def("track_monocular",&PySystem::TrackMonocular,py::arg("image"),py::arg("timestamp"))
+        .def("track_stereo",&PySystem::TrackStereo,py::arg("left"),py::arg("right"),py::arg("timestamp"))
+        .def("track_rgbd",&PySystem::TrackRGBD,py::arg("image"),py::arg("depthmap"),py::arg("timestamp"))
+        .def("tracked_points",&PySystem::TrackedPoints)
+        .def("stage_times",&PySystem::StageTimes)
+        .def("reset_stage_times",&PySystem::ResetStageTimes)
+        .def("tracking_state",&PySystem::GetTrackingState)
+        .def("wait_until_idle",&PySystem::WaitUntilIdle)
+        .def("reset",&PySystem::Reset)
+        .def("activate_localization_mode",&PySystem::ActivateLocalizationMode)
+        .def("deactivate_localization_mode",&PySystem::DeactivateLocalizationMode)
+        .def("shutdown",&PySystem::Shutdown)
+        .def("save_trajectory_tum",&PySystem::SaveTrajectoryTUM,py::arg("filename"))
+        .def("save_keyframe_trajectory_tum",&PySystem::SaveKeyFrameTrajectoryTUM,py::arg("filename"))
+        .def("save_trajectory_kitti",&PySystem::SaveTrajectoryKITTI,py::arg("filename"));
+}
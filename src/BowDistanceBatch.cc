@@ -0,0 +1,146 @@
+#include "BowDistanceBatch.h"
+#include "HammingDistance.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+void BowDistanceBatch::Compute(Frame &F, const vector<KeyFrame*> &vpKFs)
+{
+    mpQueryIndex.reset();
+    mvQueryNodes.clear();
+    mvRows.clear();
+    mvBlocks.clear();
+    mnDistances = 0;
+
+    // The features of every node of the frame packed in the order of the FeatureVector
+    size_t nRows = 0;
+    for(DBoW2::FeatureVector::const_iterator it=F.mFeatVec.begin(); it!=F.mFeatVec.end(); it++)
+        nRows += it->second.size();
+    mvRows.resize(nRows*HammingDistance::kDescriptorBytes);
+    nRows = 0;
+    for(DBoW2::FeatureVector::const_iterator it=F.mFeatVec.begin(); it!=F.mFeatVec.end(); it++)
+    {
+        QueryNode node;
+        node.id = it->first;
+        node.begin = nRows;
+        node.count = it->second.size();
+        for(size_t i=0; i<it->second.size(); i++, nRows++)
+            memcpy(&mvRows[nRows*HammingDistance::kDescriptorBytes],F.mDescriptors.ptr<uint8_t>(it->second[i]),
+                   HammingDistance::kDescriptorBytes);
+        mvQueryNodes.push_back(node);
+    }
+
+    mvpIndices.assign(vpKFs.size(),KeyFrame::BowMatchIndexPtr());
+    mvnOffsets.assign(vpKFs.size(),0);
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        mvnOffsets[i] = mnDistances;
+        if(vpKFs[i]->isBad())
+            continue;
+        mvpIndices[i] = vpKFs[i]->GetBowMatchIndex();
+        AddCandidate(*mvpIndices[i],false);
+    }
+
+    ComputeDistances();
+}
+
+void BowDistanceBatch::Compute(KeyFrame* pKF, const vector<KeyFrame*> &vpKFs)
+{
+    mvQueryNodes.clear();
+    mvRows.clear();
+    mvBlocks.clear();
+    mnDistances = 0;
+
+    // The rows of the index are packed by node already
+    mpQueryIndex = pKF->GetBowMatchIndex();
+    const BowMatchIndex &query = *mpQueryIndex;
+    mvRows = query.mvDescriptors;
+    for(size_t i=0; i<query.mvNodes.size(); i++)
+    {
+        QueryNode node;
+        node.id = query.mvNodes[i].id;
+        node.begin = query.mvNodes[i].begin;
+        node.count = query.mvNodes[i].end-query.mvNodes[i].begin;
+        mvQueryNodes.push_back(node);
+    }
+
+    mvpIndices.assign(vpKFs.size(),KeyFrame::BowMatchIndexPtr());
+    mvnOffsets.assign(vpKFs.size(),0);
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        mvnOffsets[i] = mnDistances;
+        if(vpKFs[i]->isBad())
+            continue;
+        mvpIndices[i] = vpKFs[i]->GetBowMatchIndex();
+        AddCandidate(*mvpIndices[i],true);
+    }
+
+    ComputeDistances();
+}
+
+void BowDistanceBatch::AddCandidate(const BowMatchIndex &index, const bool bQueryFirst)
+{
+    const size_t nBase = mvRows.size()/HammingDistance::kDescriptorBytes;
+    mvRows.insert(mvRows.end(),index.mvDescriptors.begin(),index.mvDescriptors.end());
+
+    vector<QueryNode>::const_iterator qit = mvQueryNodes.begin(), qend = mvQueryNodes.end();
+    vector<BowMatchIndex::Node>::const_iterator cit = index.mvNodes.begin(), cend = index.mvNodes.end();
+    while(qit!=qend && cit!=cend)
+    {
+        if(qit->id==cit->id)
+        {
+            Block block;
+            if(bQueryFirst)
+            {
+                block.a = qit->begin;
+                block.nA = qit->count;
+                block.b = nBase+cit->begin;
+                block.nB = cit->end-cit->begin;
+            }
+            else
+            {
+                block.a = nBase+cit->begin;
+                block.nA = cit->end-cit->begin;
+                block.b = qit->begin;
+                block.nB = qit->count;
+            }
+            block.out = mnDistances;
+            mnDistances += static_cast<size_t>(block.nA)*block.nB;
+            if(block.nA>0 && block.nB>0)
+                mvBlocks.push_back(block);
+            qit++;
+            cit++;
+        }
+        else if(qit->id<cit->id)
+            qit++;
+        else
+            cit = index.LowerBound(cit,qit->id);
+    }
+}
+
+void BowDistanceBatch::ComputeDistances()
+{
+    const size_t nDistances = mnDistances;
+    mvDistances.resize(nDistances);
+    if(nDistances==0)
+        return;
+
+    vector<size_t> vIndices;
+    for(size_t k=0; k<mvBlocks.size(); k++)
+    {
+        const Block &block = mvBlocks[k];
+        for(size_t j=vIndices.size(); j<block.nB; j++)
+            vIndices.push_back(j);
+        const uint8_t* pB = &mvRows[block.b*HammingDistance::kDescriptorBytes];
+        for(unsigned int i=0; i<block.nA; i++)
+            HammingDistance::ComputeBatch(&mvRows[(block.a+i)*HammingDistance::kDescriptorBytes],
+                                          pB,HammingDistance::kDescriptorBytes,&vIndices[0],block.nB,
+                                          &mvDistances[block.out+static_cast<size_t>(i)*block.nB]);
+    }
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,68 @@
+#include "BowMatchIndex.h"
+#include "MapPoint.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+BowMatchIndex::BowMatchIndex(const DBoW2::FeatureVector &featVec, const cv::Mat &descriptors,
+                             const vector<MapPoint*> &vpMapPoints)
+{
+    size_t nEntries = 0;
+    for(DBoW2::FeatureVector::const_iterator it=featVec.begin(); it!=featVec.end(); it++)
+        for(size_t i=0, iend=it->second.size(); i<iend; i++)
+        {
+            const unsigned int idx = it->second[i];
+            if(idx<vpMapPoints.size() && vpMapPoints[idx] && !vpMapPoints[idx]->isBad())
+                nEntries++;
+        }
+
+    mvDescriptors.resize(nEntries*DESCRIPTOR_BYTES);
+    mvnFeatures.reserve(nEntries);
+    mvpMapPoints.reserve(nEntries);
+
+    for(DBoW2::FeatureVector::const_iterator it=featVec.begin(); it!=featVec.end(); it++)
+    {
+        Node node;
+        node.id = it->first;
+        node.begin = mvpMapPoints.size();
+        for(size_t i=0, iend=it->second.size(); i<iend; i++)
+        {
+            const unsigned int idx = it->second[i];
+            if(idx>=vpMapPoints.size())
+                continue;
+            MapPoint* pMP = vpMapPoints[idx];
+            // Bad stays bad, there are at most the entries counted above
+            if(!pMP || pMP->isBad())
+                continue;
+            memcpy(&mvDescriptors[mvpMapPoints.size()*DESCRIPTOR_BYTES],descriptors.ptr<uint8_t>(idx),DESCRIPTOR_BYTES);
+            mvnFeatures.push_back(idx);
+            mvpMapPoints.push_back(pMP);
+        }
+        node.end = mvpMapPoints.size();
+        if(node.end>node.begin)
+            mvNodes.push_back(node);
+    }
+    mvDescriptors.resize(mvpMapPoints.size()*DESCRIPTOR_BYTES);
+}
+
+vector<BowMatchIndex::Node>::const_iterator BowMatchIndex::LowerBound(vector<Node>::const_iterator it,
+                                                                   const DBoW2::NodeId id) const
+{
+    return lower_bound(it,mvNodes.end(),id,[](const Node &node, const DBoW2::NodeId nodeId)
+    {
+        return node.id<nodeId;
+    });
+}
+
+size_t BowMatchIndex::GetMemoryUsage() const
+{
+    return mvNodes.capacity()*sizeof(Node)+mvDescriptors.capacity()+
+           mvnFeatures.capacity()*sizeof(size_t)+mvpMapPoints.capacity()*sizeof(MapPoint*);
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,226 @@
+#include "CompactFeatures.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+
+// Fixed point steps, the last one marks a negative right coordinate
+const uint16_t MAX_STEP = 0xfffe;
+const uint16_t NO_RIGHT = 0xffff;
+
+// IEEE half float, rounded to the nearest. Values beyond its range become infinite.
+uint16_t ToHalf(const float value)
+{
+    uint32_t bits;
+    memcpy(&bits,&value,sizeof(bits));
+    const uint16_t sign = (bits>>16)&0x8000;
+    const int exponent = static_cast<int>((bits>>23)&0xff)-127+15;
+    uint32_t mantissa = bits&0x7fffff;
+
+    if(((bits>>23)&0xff)==0xff)
+        return sign|0x7c00|(mantissa ? 0x200 : 0);
+    if(exponent>=31)
+        return sign|0x7c00;
+    if(exponent<=0)
+    {
+        // Subnormal, or zero below its smallest step
+        if(exponent<-10)
+            return sign;
+        mantissa |= 0x800000;
+        const int shift = 14-exponent;
+        uint32_t half = mantissa>>shift;
+        if((mantissa>>(shift-1))&1)
+            half++;
+        return sign|half;
+    }
+
+    uint32_t half = (static_cast<uint32_t>(exponent)<<10)|(mantissa>>13);
+    // Rounds up on the dropped half, which may carry into the exponent
+    if(mantissa&0x1000)
+        half++;
+    return sign|min(half,static_cast<uint32_t>(0x7c00));
+}
+
+float FromHalf(const uint16_t half)
+{
+    const uint32_t sign = static_cast<uint32_t>(half&0x8000)<<16;
+    const int exponent = (half>>10)&0x1f;
+    const uint32_t mantissa = half&0x3ff;
+
+    if(exponent==0)
+    {
+        const float value = ldexp(static_cast<float>(mantissa),-24);
+        return sign ? -value : value;
+    }
+
+    uint32_t bits;
+    if(exponent==31)
+        bits = sign|0x7f800000|(mantissa<<13);
+    else
+        bits = sign|(static_cast<uint32_t>(exponent-15+127)<<23)|(mantissa<<13);
+    float value;
+    memcpy(&value,&bits,sizeof(value));
+    return value;
+}
+
+uint16_t ToStep(const float value, const float origin, const float step)
+{
+    if(step<=0)
+        return 0;
+    const float q = floor((value-origin)/step+0.5f);
+    return static_cast<uint16_t>(max(0.0f,min(q,static_cast<float>(MAX_STEP))));
+}
+
+}
+
+CompactFeatures::CompactFeatures(const SharedArray<cv::KeyPoint> &vKeys, const SharedArray<cv::KeyPoint> &vKeysUn,
+                                 const SharedArray<float> &vuRight, const SharedArray<float> &vDepth):
+    mN(vKeys.size()), mfMinX(0), mfMinY(0), mfStepX(0), mfStepY(0), mbKeysUnShared(vKeysUn.SharesElements(vKeys)),
+    mbDepthShared(vDepth.SharesElements(vuRight))
+{
+    // One range for the keypoints, the undistorted ones and the right coordinates
+    float minX = numeric_limits<float>::max(), maxX = -numeric_limits<float>::max();
+    float minY = numeric_limits<float>::max(), maxY = -numeric_limits<float>::max();
+    for(size_t i=0; i<mN; i++)
+    {
+        minX = min(minX,vKeys[i].pt.x);
+        maxX = max(maxX,vKeys[i].pt.x);
+        minY = min(minY,vKeys[i].pt.y);
+        maxY = max(maxY,vKeys[i].pt.y);
+        if(!mbKeysUnShared)
+        {
+            minX = min(minX,vKeysUn[i].pt.x);
+            maxX = max(maxX,vKeysUn[i].pt.x);
+            minY = min(minY,vKeysUn[i].pt.y);
+            maxY = max(maxY,vKeysUn[i].pt.y);
+        }
+        if(i<vuRight.size() && vuRight[i]>=0)
+        {
+            minX = min(minX,vuRight[i]);
+            maxX = max(maxX,vuRight[i]);
+        }
+    }
+    if(mN>0)
+    {
+        mfMinX = minX;
+        mfMinY = minY;
+        mfStepX = (maxX-minX)/MAX_STEP;
+        mfStepY = (maxY-minY)/MAX_STEP;
+    }
+
+    mvKeys.resize(mN);
+    mvOctaves.resize(mN);
+    mvAngles.resize(mN);
+    mvResponses.resize(mN);
+    if(!mbKeysUnShared)
+        mvKeysUn.resize(mN);
+    for(size_t i=0; i<mN; i++)
+    {
+        const cv::KeyPoint &kp = vKeys[i];
+        mvKeys[i] = Quantize(kp.pt);
+        if(!mbKeysUnShared)
+            mvKeysUn[i] = Quantize(vKeysUn[i].pt);
+
+        mvOctaves[i] = static_cast<uint8_t>(max(kp.octave,0));
+        float angle = fmod(kp.angle,360.0f);
+        if(angle<0)
+            angle += 360.0f;
+        mvAngles[i] = static_cast<uint8_t>(static_cast<int>(floor(angle*256.0f/360.0f+0.5f))&0xff);
+        mvResponses[i] = ToHalf(kp.response);
+
+        if(mvOctaves[i]>=mvOctaveSizes.size())
+            mvOctaveSizes.resize(mvOctaves[i]+1,0.0f);
+        if(mvOctaveSizes[mvOctaves[i]]==0)
+            mvOctaveSizes[mvOctaves[i]] = kp.size;
+    }
+
+    mvuRight.resize(vuRight.size());
+    for(size_t i=0; i<vuRight.size(); i++)
+        mvuRight[i] = vuRight[i]<0 ? NO_RIGHT : ToStep(vuRight[i],mfMinX,mfStepX);
+    if(!mbDepthShared)
+    {
+        mvDepth.resize(vDepth.size());
+        for(size_t i=0; i<vDepth.size(); i++)
+            mvDepth[i] = ToHalf(vDepth[i]<0 ? -1.0f : vDepth[i]);
+    }
+}
+
+CompactFeatures::Point CompactFeatures::Quantize(const cv::Point2f &pt) const
+{
+    Point p;
+    p.x = ToStep(pt.x,mfMinX,mfStepX);
+    p.y = ToStep(pt.y,mfMinY,mfStepY);
+    return p;
+}
+
+cv::Point2f CompactFeatures::Dequantize(const Point &p) const
+{
+    return cv::Point2f(mfMinX+p.x*mfStepX,mfMinY+p.y*mfStepY);
+}
+
+void CompactFeatures::Decode(const vector<Point> &vPoints, vector<cv::KeyPoint> &vKeys) const
+{
+    vKeys.resize(mN);
+    for(size_t i=0; i<mN; i++)
+    {
+        cv::KeyPoint &kp = vKeys[i];
+        kp.pt = Dequantize(vPoints[i]);
+        kp.octave = mvOctaves[i];
+        kp.size = mvOctaveSizes[mvOctaves[i]];
+        kp.angle = mvAngles[i]*360.0f/256.0f;
+        kp.response = FromHalf(mvResponses[i]);
+        kp.class_id = -1;
+    }
+}
+
+void CompactFeatures::Expand(SharedArray<cv::KeyPoint> &vKeys, SharedArray<cv::KeyPoint> &vKeysUn,
+                             SharedArray<float> &vuRight, SharedArray<float> &vDepth) const
+{
+    vector<cv::KeyPoint> vDecoded;
+    Decode(mvKeys,vDecoded);
+    vKeys = SharedArray<cv::KeyPoint>(std::move(vDecoded));
+    if(mbKeysUnShared)
+        vKeysUn = vKeys;
+    else
+    {
+        Decode(mvKeysUn,vDecoded);
+        vKeysUn = SharedArray<cv::KeyPoint>(std::move(vDecoded));
+    }
+
+    vector<float> vRight(mvuRight.size());
+    for(size_t i=0; i<mvuRight.size(); i++)
+        vRight[i] = Right(i);
+    vuRight = SharedArray<float>(std::move(vRight));
+    if(mbDepthShared)
+        vDepth = vuRight;
+    else
+    {
+        vector<float> vDepths(mvDepth.size());
+        for(size_t i=0; i<mvDepth.size(); i++)
+            vDepths[i] = FromHalf(mvDepth[i]);
+        vDepth = SharedArray<float>(std::move(vDepths));
+    }
+}
+
+float CompactFeatures::Right(const size_t i) const
+{
+    return mvuRight[i]==NO_RIGHT ? -1.0f : mfMinX+mvuRight[i]*mfStepX;
+}
+
+size_t CompactFeatures::GetMemoryUsage() const
+{
+    return sizeof(CompactFeatures)+(mvKeys.capacity()+mvKeysUn.capacity())*sizeof(Point)+
+           mvOctaves.capacity()+mvAngles.capacity()+mvOctaveSizes.capacity()*sizeof(float)+
+           (mvResponses.capacity()+mvuRight.capacity()+mvDepth.capacity())*sizeof(uint16_t);
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,364 @@
+#include "DepthStore.h"
+
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Nibbles of 3 bits of the value and a continuation bit, 8 to a word, the first one in the
+// highest bits
+class NibbleWriter
+{
+public:
+    NibbleWriter(vector<uint32_t> &vWords): mvWords(vWords), mnWord(0), mnNibbles(0) {}
+
+    void Write(unsigned int value)
+    {
+        do
+        {
+            unsigned int nibble = value & 0x7;
+            value >>= 3;
+            if(value)
+                nibble |= 0x8;
+            mnWord = (mnWord<<4) | nibble;
+            if(++mnNibbles==8)
+            {
+                mvWords.push_back(mnWord);
+                mnWord = 0;
+                mnNibbles = 0;
+            }
+        }
+        while(value);
+    }
+
+    void Flush()
+    {
+        if(mnNibbles)
+            mvWords.push_back(mnWord<<(4*(8-mnNibbles)));
+        mnWord = 0;
+        mnNibbles = 0;
+    }
+
+protected:
+    vector<uint32_t> &mvWords;
+    uint32_t mnWord;
+    int mnNibbles;
+};
+
+class NibbleReader
+{
+public:
+    NibbleReader(const uint32_t* pWords, const size_t nWords):
+        mpWords(pWords), mpEnd(pWords+nWords), mnWord(0), mnNibbles(0) {}
+
+    // False past the end or on a value of more than 32 bits
+    bool Read(unsigned int &value)
+    {
+        value = 0;
+        int shift = 0;
+        uint32_t nibble;
+        do
+        {
+            if(!mnNibbles)
+            {
+                if(mpWords==mpEnd)
+                    return false;
+                mnWord = *mpWords++;
+                mnNibbles = 8;
+            }
+            nibble = mnWord>>28;
+            mnWord <<= 4;
+            mnNibbles--;
+            if(shift>30)
+                return false;
+            value |= (nibble & 0x7)<<shift;
+            shift += 3;
+        }
+        while(nibble & 0x8);
+        return true;
+    }
+
+protected:
+    const uint32_t* mpWords;
+    const uint32_t* mpEnd;
+    uint32_t mnWord;
+    int mnNibbles;
+};
+}
+
+DepthStore::DepthStore(): mbEnabled(false), mnMaxBytes(0), mnFirstResident(0), mnBytes(0), mnSpilled(0),
+    mpSpillFile(static_cast<FILE*>(NULL)), mnSpillEnd(0)
+{
+}
+
+DepthStore::~DepthStore()
+{
+    if(mpSpillFile)
+        fclose(mpSpillFile);
+}
+
+bool DepthStore::Enable(const size_t nMaxBytes, const string &spillFile)
+{
+    unique_lock<mutex> lock(mMutex);
+    if(mpSpillFile)
+        fclose(mpSpillFile);
+    mpSpillFile = spillFile.empty() ? tmpfile() : fopen(spillFile.c_str(),"w+b");
+    mnSpillEnd = 0;
+    mbEnabled = mpSpillFile!=NULL;
+    mnMaxBytes = nMaxBytes;
+    if(!mbEnabled)
+        cerr << "Could not open the depth spill file " << (spillFile.empty() ? "(temporary)" : spillFile) << endl;
+    return mbEnabled;
+}
+
+void DepthStore::Encode(const cv::Mat &depth16, vector<uint32_t> &vWords)
+{
+    vWords.clear();
+    vWords.reserve(depth16.total()/8);
+    NibbleWriter writer(vWords);
+
+    // Runs of invalid pixels, then of valid ones with the zigzag deltas of their depths. The
+    // previous depth carries over the rows.
+    int previous = 0;
+    for(int y=0; y<depth16.rows; y++)
+    {
+        const uint16_t* row = depth16.ptr<uint16_t>(y);
+        const uint16_t* end = row+depth16.cols;
+        const uint16_t* p = row;
+        while(p<end)
+        {
+            unsigned int nZeros = 0;
+            while(p<end && *p==0)
+            {
+                p++;
+                nZeros++;
+            }
+            writer.Write(nZeros);
+
+            unsigned int nValid = 0;
+            while(p+nValid<end && p[nValid]!=0)
+                nValid++;
+            writer.Write(nValid);
+            for(unsigned int i=0; i<nValid; i++, p++)
+            {
+                const int delta = static_cast<int>(*p)-previous;
+                writer.Write(static_cast<unsigned int>((delta<<1)^(delta>>31)));
+                previous = *p;
+            }
+        }
+    }
+    writer.Flush();
+}
+
+bool DepthStore::Decode(const uint32_t* pWords, const size_t nWords, const int rows, const int cols, cv::Mat &depth16)
+{
+    depth16.create(rows,cols,CV_16U);
+    NibbleReader reader(pWords,nWords);
+
+    int previous = 0;
+    for(int y=0; y<rows; y++)
+    {
+        uint16_t* p = depth16.ptr<uint16_t>(y);
+        unsigned int nLeft = cols;
+        while(nLeft)
+        {
+            unsigned int nZeros, nValid;
+            if(!reader.Read(nZeros) || nZeros>nLeft)
+                return false;
+            for(unsigned int i=0; i<nZeros; i++)
+                *p++ = 0;
+            nLeft -= nZeros;
+
+            if(!reader.Read(nValid) || nValid>nLeft)
+                return false;
+            for(unsigned int i=0; i<nValid; i++)
+            {
+                unsigned int zigzag;
+                if(!reader.Read(zigzag))
+                    return false;
+                const int delta = static_cast<int>(zigzag>>1)^-static_cast<int>(zigzag&1);
+                previous += delta;
+                if(previous<=0 || previous>0xffff)
+                    return false;
+                *p++ = static_cast<uint16_t>(previous);
+            }
+            nLeft -= nValid;
+        }
+    }
+    return true;
+}
+
+void DepthStore::Insert(const unsigned long nId, const cv::Mat &imDepth, const float depthMapFactor)
+{
+    if(!mbEnabled || imDepth.empty())
+        return;
+
+    Image image;
+    image.rows = imDepth.rows;
+    image.cols = imDepth.cols;
+    image.bSpilled = false;
+    image.nOffset = 0;
+
+    // Encoded before the lock, the tracking does not wait for the readers
+    if(imDepth.type()==CV_16U)
+    {
+        image.fScale = 1.0f/depthMapFactor;
+        Encode(imDepth,image.vWords);
+    }
+    else
+    {
+        cv::Mat depth;
+        imDepth.convertTo(depth,CV_32F,1.0/depthMapFactor);
+        cv::Mat depth16(depth.size(),CV_16U);
+        for(int y=0; y<depth.rows; y++)
+        {
+            const float* src = depth.ptr<float>(y);
+            uint16_t* dst = depth16.ptr<uint16_t>(y);
+            for(int x=0; x<depth.cols; x++)
+            {
+                const float mm = src[x]*1000.0f;
+                dst[x] = (mm>0 && mm<65535.0f) ? static_cast<uint16_t>(mm+0.5f) : 0;
+            }
+        }
+        image.fScale = 0.001f;
+        Encode(depth16,image.vWords);
+    }
+    image.vWords.shrink_to_fit();
+    image.nWords = image.vWords.size();
+
+    unique_lock<mutex> lock(mMutex);
+    map<unsigned long,Image>::iterator it = mImages.find(nId);
+    if(it!=mImages.end())
+    {
+        if(!it->second.bSpilled)
+            mnBytes -= it->second.nWords*sizeof(uint32_t);
+        else
+            mnSpilled--;
+        mImages.erase(it);
+    }
+    mnBytes += image.nWords*sizeof(uint32_t);
+    mImages[nId] = std::move(image);
+    if(nId<mnFirstResident)
+        mnFirstResident = nId;
+
+    Spill();
+}
+
+void DepthStore::Spill()
+{
+    if(mnMaxBytes==0)
+        return;
+
+    map<unsigned long,Image>::iterator it = mImages.lower_bound(mnFirstResident);
+    while(mnBytes>mnMaxBytes && it!=mImages.end())
+    {
+        Image &image = it->second;
+        if(!image.bSpilled)
+        {
+            if(fseeko(mpSpillFile,mnSpillEnd,SEEK_SET)!=0 ||
+               fwrite(image.vWords.data(),sizeof(uint32_t),image.nWords,mpSpillFile)!=image.nWords)
+            {
+                cerr << "Could not spill the depth of keyframe " << it->first << endl;
+                return;
+            }
+            image.nOffset = mnSpillEnd;
+            mnSpillEnd += image.nWords*sizeof(uint32_t);
+            image.bSpilled = true;
+            vector<uint32_t>().swap(image.vWords);
+            mnBytes -= image.nWords*sizeof(uint32_t);
+            mnSpilled++;
+        }
+        it++;
+        mnFirstResident = it!=mImages.end() ? it->first : mnFirstResident+1;
+    }
+}
+
+bool DepthStore::Get(const unsigned long nId, cv::Mat &imDepth)
+{
+    vector<uint32_t> vWords;
+    int rows, cols;
+    float fScale;
+    {
+        unique_lock<mutex> lock(mMutex);
+        map<unsigned long,Image>::iterator it = mImages.find(nId);
+        if(it==mImages.end())
+            return false;
+
+        const Image &image = it->second;
+        rows = image.rows;
+        cols = image.cols;
+        fScale = image.fScale;
+        if(image.bSpilled)
+        {
+            vWords.resize(image.nWords);
+            if(fflush(mpSpillFile)!=0 || fseeko(mpSpillFile,image.nOffset,SEEK_SET)!=0 ||
+               fread(vWords.data(),sizeof(uint32_t),image.nWords,mpSpillFile)!=image.nWords)
+                return false;
+        }
+        else
+            vWords = image.vWords;
+    }
+
+    // Decoded without the lock
+    cv::Mat depth16;
+    if(!Decode(vWords.data(),vWords.size(),rows,cols,depth16))
+        return false;
+    depth16.convertTo(imDepth,CV_32F,fScale);
+    return true;
+}
+
+void DepthStore::Erase(const unsigned long nId)
+{
+    unique_lock<mutex> lock(mMutex);
+    map<unsigned long,Image>::iterator it = mImages.find(nId);
+    if(it==mImages.end())
+        return;
+
+    // The space in the spill file is not reused, it is freed by Clear
+    if(it->second.bSpilled)
+        mnSpilled--;
+    else
+        mnBytes -= it->second.nWords*sizeof(uint32_t);
+    mImages.erase(it);
+}
+
+void DepthStore::Clear()
+{
+    unique_lock<mutex> lock(mMutex);
+    mImages.clear();
+    mnFirstResident = 0;
+    mnBytes = 0;
+    mnSpilled = 0;
+    mnSpillEnd = 0;
+    if(mpSpillFile)
+    {
+        fflush(mpSpillFile);
+        if(ftruncate(fileno(mpSpillFile),0)!=0)
+            cerr << "Could not truncate the depth spill file" << endl;
+    }
+}
+
+size_t DepthStore::NumImages()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mImages.size();
+}
+
+size_t DepthStore::NumSpilled()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mnSpilled;
+}
+
+size_t DepthStore::GetMemoryUsage()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mnBytes;
+}
+
+} //namespace ORB_SLAM
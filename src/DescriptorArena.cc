@@ -0,0 +1,157 @@
+#include "DescriptorArena.h"
+
+#include <cstring>
+#include <new>
+
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// a block starts at a cache line, the rows of a keyframe are read from there in a row
+const size_t kBlockAlignment = 64;
+
+// the chunks are aligned to the huge pages, a partial one would not be backed by them
+const size_t kHugePageSize = static_cast<size_t>(2)<<20;
+
+size_t BlockBytes(const size_t nBytes)
+{
+    return (nBytes+kBlockAlignment-1)/kBlockAlignment*kBlockAlignment;
+}
+
+uint8_t* MapChunk(const size_t nBytes)
+{
+    const size_t nMapped = nBytes+kHugePageSize;
+    void* p = mmap(NULL, nMapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    // throws std::bad_alloc like a plain new would
+    if(p==MAP_FAILED)
+        throw bad_alloc();
+
+    // Trim to a huge page boundary on both sides
+    uint8_t* pBegin = static_cast<uint8_t*>(p);
+    uint8_t* pAligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(pBegin)+kHugePageSize-1)/kHugePageSize*kHugePageSize);
+    if(pAligned>pBegin)
+        munmap(pBegin, pAligned-pBegin);
+    const size_t nTail = (pBegin+nMapped)-(pAligned+nBytes);
+    if(nTail>0)
+        munmap(pAligned+nBytes, nTail);
+
+#ifdef MADV_HUGEPAGE
+    // only a hint, the chunk works with small pages where huge ones are disabled
+    madvise(pAligned, nBytes, MADV_HUGEPAGE);
+#endif
+    return pAligned;
+}
+}
+
+const uint64_t DescriptorArena::NO_OFFSET;
+const int DescriptorArena::CHUNK_BITS;
+const size_t DescriptorArena::CHUNK_SIZE;
+const size_t DescriptorArena::MAX_CHUNKS;
+
+DescriptorArena& DescriptorArena::Global()
+{
+    static DescriptorArena* pArena = new DescriptorArena();
+    return *pArena;
+}
+
+DescriptorArena::DescriptorArena(): mnChunks(0), mnChunkPos(0), mnChunkRemaining(0), mnUsed(0)
+{
+    for(size_t i=0; i<MAX_CHUNKS; i++)
+        mvpChunks[i].store(NULL, memory_order_relaxed);
+}
+
+uint64_t DescriptorArena::Allocate(const size_t nBytes)
+{
+    unique_lock<mutex> lock(mMutexArena);
+
+    // Smallest freed block large enough, the rest is freed again
+    multimap<size_t, uint64_t>::iterator it = mmFree.lower_bound(nBytes);
+    if(it!=mmFree.end())
+    {
+        const size_t nBlock = it->first;
+        const uint64_t nOffset = it->second;
+        mmFree.erase(it);
+        if(nBlock>nBytes)
+            mmFree.insert(make_pair(nBlock-nBytes,nOffset+nBytes));
+        mnUsed += nBytes;
+        return nOffset;
+    }
+
+    if(mnChunkRemaining<nBytes)
+    {
+        if(mnChunks==MAX_CHUNKS)
+            return NO_OFFSET;
+        // The rest of the newest chunk is kept for smaller blocks
+        if(mnChunkRemaining>0)
+            mmFree.insert(make_pair(mnChunkRemaining,mnChunkPos));
+        mvpChunks[mnChunks].store(MapChunk(CHUNK_SIZE), memory_order_release);
+        mnChunkPos = static_cast<uint64_t>(mnChunks)<<CHUNK_BITS;
+        mnChunkRemaining = CHUNK_SIZE;
+        mnChunks++;
+    }
+
+    const uint64_t nOffset = mnChunkPos;
+    mnChunkPos += nBytes;
+    mnChunkRemaining -= nBytes;
+    mnUsed += nBytes;
+    return nOffset;
+}
+
+cv::Mat DescriptorArena::Copy(const cv::Mat &descriptors)
+{
+    const size_t nRowBytes = descriptors.cols*descriptors.elemSize();
+    const size_t nBytes = BlockBytes(descriptors.rows*nRowBytes);
+    if(descriptors.empty() || nBytes>CHUNK_SIZE)
+        return descriptors.clone();
+
+    const uint64_t nOffset = Allocate(nBytes);
+    if(nOffset==NO_OFFSET)
+        return descriptors.clone();
+
+    uint8_t* pData = Data(nOffset);
+    // Contiguous rows, the distance kernels take the row step of the matrix
+    cv::Mat copy(descriptors.rows,descriptors.cols,descriptors.type(),pData,nRowBytes);
+    descriptors.copyTo(copy);
+    return copy;
+}
+
+void DescriptorArena::Free(const cv::Mat &descriptors)
+{
+    if(descriptors.empty())
+        return;
+
+    const uint8_t* pData = descriptors.data;
+    unique_lock<mutex> lock(mMutexArena);
+    // A few chunks at most, and keyframes are rarely freed
+    for(size_t i=0; i<mnChunks; i++)
+    {
+        const uint8_t* pChunk = mvpChunks[i].load(memory_order_relaxed);
+        if(pData<pChunk || pData>=pChunk+CHUNK_SIZE)
+            continue;
+
+        const uint64_t nOffset = (static_cast<uint64_t>(i)<<CHUNK_BITS)+(pData-pChunk);
+        const size_t nBlock = BlockBytes(descriptors.total()*descriptors.elemSize());
+        mmFree.insert(make_pair(nBlock,nOffset));
+        mnUsed -= nBlock;
+        return;
+    }
+}
+
+size_t DescriptorArena::GetUsed()
+{
+    unique_lock<mutex> lock(mMutexArena);
+    return mnUsed;
+}
+
+size_t DescriptorArena::GetReserved()
+{
+    unique_lock<mutex> lock(mMutexArena);
+    return mnChunks*CHUNK_SIZE;
+}
+
+} //namespace ORB_SLAM
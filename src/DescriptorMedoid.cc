@@ -0,0 +1,125 @@
+#include "DescriptorMedoid.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include "HammingDistance.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+void DescriptorMedoid::Update(const vector<Key> &vKeys, const vector<const uint8_t*> &vpDescriptors)
+{
+    const size_t N = vKeys.size();
+    if(N==0)
+    {
+        Clear();
+        return;
+    }
+    if(vKeys==mvKeys)
+        return;
+
+    const size_t B = HammingDistance::kDescriptorBytes;
+    const size_t nOld = mvKeys.size();
+
+    // Entry of every key in the old set, -1 for the new ones
+    vector<int> vOld(N,-1);
+    size_t nNew = 0;
+    for(size_t i=0; i<N; i++)
+    {
+        vector<Key>::const_iterator it = find(mvKeys.begin(),mvKeys.end(),vKeys[i]);
+        if(it!=mvKeys.end())
+            vOld[i] = it-mvKeys.begin();
+        else
+            nNew++;
+    }
+
+    vector<uint8_t> vDescriptors(N*B);
+    for(size_t i=0; i<N; i++)
+    {
+        const uint8_t* pSrc = vOld[i]>=0 ? &mvDescriptors[vOld[i]*B] : vpDescriptors[i];
+        memcpy(&vDescriptors[i*B],pSrc,B);
+    }
+
+    vector<uint16_t> vDistances(N*N);
+    for(size_t i=0; i<N; i++)
+    {
+        vDistances[i*N+i] = 0;
+        if(vOld[i]<0)
+            continue;
+        for(size_t j=i+1; j<N; j++)
+        {
+            if(vOld[j]<0)
+                continue;
+            const uint16_t dist = mvDistances[vOld[i]*nOld+vOld[j]];
+            vDistances[i*N+j] = dist;
+            vDistances[j*N+i] = dist;
+        }
+    }
+
+    // Rows of the new entries against the whole set
+    if(nNew>0)
+    {
+        vector<size_t> vIndices(N);
+        for(size_t j=0; j<N; j++)
+            vIndices[j] = j;
+        vector<int> vRow(N);
+        for(size_t i=0; i<N; i++)
+        {
+            if(vOld[i]>=0)
+                continue;
+            HammingDistance::ComputeBatch(&vDescriptors[i*B],&vDescriptors[0],B,&vIndices[0],N,&vRow[0]);
+            for(size_t j=0; j<N; j++)
+            {
+                vDistances[i*N+j] = vRow[j];
+                vDistances[j*N+i] = vRow[j];
+            }
+        }
+    }
+
+    mvKeys = vKeys;
+    mvDescriptors.swap(vDescriptors);
+    mvDistances.swap(vDistances);
+
+    // Least median distance to the rest
+    const size_t k = (N-1)/2;
+    vector<uint16_t> vRow(N);
+    int bestMedian = INT_MAX;
+    mnMedoid = 0;
+    for(size_t i=0; i<N; i++)
+    {
+        copy(mvDistances.begin()+i*N,mvDistances.begin()+(i+1)*N,vRow.begin());
+        nth_element(vRow.begin(),vRow.begin()+k,vRow.end());
+        const int median = vRow[k];
+        if(median<bestMedian)
+        {
+            bestMedian = median;
+            mnMedoid = i;
+        }
+    }
+}
+
+const uint8_t* DescriptorMedoid::GetMedoid() const
+{
+    if(mvKeys.empty())
+        return NULL;
+    return &mvDescriptors[mnMedoid*HammingDistance::kDescriptorBytes];
+}
+
+void DescriptorMedoid::Clear()
+{
+    vector<Key>().swap(mvKeys);
+    vector<uint8_t>().swap(mvDescriptors);
+    vector<uint16_t>().swap(mvDistances);
+    mnMedoid = 0;
+}
+
+size_t DescriptorMedoid::GetMemoryUsage() const
+{
+    return mvKeys.capacity()*sizeof(Key) + mvDescriptors.capacity() + mvDistances.capacity()*sizeof(uint16_t);
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,91 @@
+#include "EssentialGraph.h"
+
+#include <set>
+
+#include "KeyFrame.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+EssentialGraph::EssentialGraph(): mnMinFeat(-1), mnUpdate(0), mnRefreshed(0)
+{
+}
+
+void EssentialGraph::Clear()
+{
+    mOptimizer.clear();
+    mmEdges.clear();
+    mnRefreshed = 0;
+}
+
+void EssentialGraph::Derive(KeyFrame* pKF, const int minFeat, Edges &edges)
+{
+    edges.vnTree.clear();
+    edges.vnCovisible.clear();
+
+    // Spanning tree edge
+    KeyFrame* pParentKF = pKF->GetParent();
+    if(pParentKF)
+        edges.vnTree.push_back(pParentKF->mnId);
+
+    // Loop edges
+    const set<KeyFrame*> sLoopEdges = pKF->GetLoopEdges();
+    for(set<KeyFrame*>::const_iterator sit=sLoopEdges.begin(), send=sLoopEdges.end(); sit!=send; sit++)
+        if((*sit)->mnId<pKF->mnId)
+            edges.vnTree.push_back((*sit)->mnId);
+
+    // Covisibility graph edges
+    const vector<KeyFrame*> vpConnectedKFs = pKF->GetCovisiblesByWeight(minFeat);
+    for(vector<KeyFrame*>::const_iterator vit=vpConnectedKFs.begin(); vit!=vpConnectedKFs.end(); vit++)
+    {
+        KeyFrame* pKFn = *vit;
+        if(pKFn && pKFn!=pParentKF && !pKF->hasChild(pKFn) && !sLoopEdges.count(pKFn))
+        {
+            if(!pKFn->isBad() && pKFn->mnId<pKF->mnId)
+                edges.vnCovisible.push_back(pKFn->mnId);
+        }
+    }
+}
+
+void EssentialGraph::Update(const vector<KeyFrame*> &vpKFs, const int minFeat, vector<const Edges*> &vpEdges)
+{
+    mnUpdate++;
+    mnRefreshed = 0;
+    vpEdges.assign(vpKFs.size(),static_cast<const Edges*>(NULL));
+
+    // A keyframe which turns bad erases itself from the connections of the others and changes
+    // their index, so do new parents, children, loop edges and covisibility weights
+    const bool bAll = minFeat!=mnMinFeat;
+    mnMinFeat = minFeat;
+
+    for(size_t i=0, iend=vpKFs.size(); i<iend; i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        if(pKF->isBad())
+            continue;
+
+        // Read before deriving, a change in between is seen by the next Update
+        const unsigned long nChangeIdx = pKF->GetChangeIdx();
+        Edges &edges = mmEdges[pKF->mnId];
+        if(bAll || edges.nUpdate==0 || edges.nChangeIdx!=nChangeIdx)
+        {
+            Derive(pKF,minFeat,edges);
+            edges.nChangeIdx = nChangeIdx;
+            mnRefreshed++;
+        }
+        edges.nUpdate = mnUpdate;
+        vpEdges[i] = &edges;
+    }
+
+    for(unordered_map<unsigned long, Edges>::iterator it=mmEdges.begin(); it!=mmEdges.end();)
+    {
+        if(it->second.nUpdate!=mnUpdate)
+            it = mmEdges.erase(it);
+        else
+            it++;
+    }
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,218 @@
+#include "EventLog.h"
+#include "MPSCQueue.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const char MAGIC[8] = {'O','R','B','E','V','L','O','G'};
+
+static_assert(sizeof(EventLog::Record)==40+4*EventLog::NUM_STAGES,
+              "the readers of the event log expect records without padding");
+
+class Writer
+{
+public:
+    Writer(const size_t nCapacity):
+        mRing(nCapacity), mnDropped(0), mbFinish(false)
+    {
+    }
+
+    bool Open(const string &filename)
+    {
+        mFile.open(filename.c_str(), ios::binary | ios::trunc);
+        if(!mFile.is_open())
+            return false;
+
+        const uint32_t nRecordSize = sizeof(EventLog::Record);
+        const uint32_t nStages = EventLog::NUM_STAGES;
+        mFile.write(MAGIC,sizeof(MAGIC));
+        mFile.write(reinterpret_cast<const char*>(&nRecordSize),sizeof(nRecordSize));
+        mFile.write(reinterpret_cast<const char*>(&nStages),sizeof(nStages));
+        for(int i=0; i<EventLog::NUM_STAGES; i++)
+        {
+            const char* name = StageTimes::Name(static_cast<Stage>(i));
+            mFile.write(name,strlen(name)+1);
+        }
+
+        mThread = thread(&Writer::Run,this);
+        return true;
+    }
+
+    void Push(EventLog::Record &record)
+    {
+        if(!mRing.Push(record))
+            mnDropped.fetch_add(1,memory_order_relaxed);
+    }
+
+    size_t GetNumDropped() const
+    {
+        return mnDropped.load(memory_order_relaxed);
+    }
+
+    // Writes what is queued and joins the writer
+    void Stop()
+    {
+        mbFinish = true;
+        if(mThread.joinable())
+            mThread.join();
+        mFile.close();
+    }
+
+private:
+    void Run()
+    {
+        EventLog::Record record;
+        while(true)
+        {
+            if(mRing.Pop(record))
+            {
+                mFile.write(reinterpret_cast<const char*>(&record),sizeof(record));
+                continue;
+            }
+
+            mFile.flush();
+            if(mbFinish)
+                break;
+            usleep(1000); //param
+        }
+    }
+
+    MPSCQueue<EventLog::Record> mRing;
+    ofstream mFile;
+    atomic<size_t> mnDropped;
+    atomic<bool> mbFinish;
+    thread mThread;
+};
+
+// Swapped by Open and Close, the threads which add records take a reference with atomic_load
+shared_ptr<Writer> gpWriter;
+mutex gMutexOpen;
+size_t gnDropped = 0;
+chrono::steady_clock::time_point gStart;
+
+// Of the last record added by AddImage
+atomic<uint64_t> gnImage(0);
+atomic<double> gTimestamp(0.0);
+atomic<int> gnState(0);
+
+// Stage totals at the last FRAME record, tracking thread only
+uint64_t gvnLastTotals[EventLog::NUM_STAGES];
+
+void Push(EventLog::Record &record)
+{
+    shared_ptr<Writer> pWriter = atomic_load(&gpWriter);
+    if(!pWriter)
+        return;
+    record.wallTime = chrono::duration<double>(chrono::steady_clock::now()-gStart).count();
+    pWriter->Push(record);
+}
+
+EventLog::Record MakeRecord(const EventLog::Type type, const unsigned int nValue1, const unsigned int nValue2)
+{
+    EventLog::Record record;
+    memset(&record,0,sizeof(record));
+    record.nType = type;
+    record.nValue1 = nValue1;
+    record.nValue2 = nValue2;
+    return record;
+}
+}
+
+atomic<bool> EventLog::mbOpen(false);
+
+bool EventLog::Open(const string &filename, const size_t nCapacity)
+{
+    Close();
+
+    unique_lock<mutex> lock(gMutexOpen);
+    shared_ptr<Writer> pWriter = make_shared<Writer>(nCapacity);
+    if(!pWriter->Open(filename))
+    {
+        cerr << "Could not open the event log " << filename << endl;
+        return false;
+    }
+
+    for(int i=0; i<NUM_STAGES; i++)
+        gvnLastTotals[i] = StageTimes::GetTotalNanoseconds(static_cast<Stage>(i));
+    gnImage = 0;
+    gTimestamp = 0.0;
+    gnState = 0;
+    gStart = chrono::steady_clock::now();
+    atomic_store(&gpWriter,pWriter);
+    mbOpen = true;
+    return true;
+}
+
+void EventLog::Close()
+{
+    unique_lock<mutex> lock(gMutexOpen);
+    mbOpen = false;
+    shared_ptr<Writer> pWriter = atomic_exchange(&gpWriter,shared_ptr<Writer>());
+    if(!pWriter)
+        return;
+    pWriter->Stop();
+    gnDropped = pWriter->GetNumDropped();
+}
+
+void EventLog::AddImage(const Type type, const unsigned long nImage, const double timestamp, const int nState,
+                        const unsigned int nValue1, const unsigned int nValue2)
+{
+    if(!IsOpen())
+        return;
+
+    Record record = MakeRecord(type,nValue1,nValue2);
+    record.nImage = nImage;
+    record.timestamp = timestamp;
+    record.nState = nState;
+    if(type==FRAME)
+    {
+        for(int i=0; i<NUM_STAGES; i++)
+        {
+            const uint64_t nTotal = StageTimes::GetTotalNanoseconds(static_cast<Stage>(i));
+            // The totals start over when the stage times are reset
+            const uint64_t nDelta = nTotal>=gvnLastTotals[i] ? nTotal-gvnLastTotals[i] : nTotal;
+            record.vfStageTimes[i] = static_cast<float>(nDelta*1e-3);
+            gvnLastTotals[i] = nTotal;
+        }
+    }
+
+    gnImage.store(nImage,memory_order_relaxed);
+    gTimestamp.store(timestamp,memory_order_relaxed);
+    gnState.store(nState,memory_order_relaxed);
+    Push(record);
+}
+
+void EventLog::Add(const Type type, const unsigned int nValue1, const unsigned int nValue2)
+{
+    if(!IsOpen())
+        return;
+
+    Record record = MakeRecord(type,nValue1,nValue2);
+    record.nImage = gnImage.load(memory_order_relaxed);
+    record.timestamp = gTimestamp.load(memory_order_relaxed);
+    record.nState = gnState.load(memory_order_relaxed);
+    Push(record);
+}
+
+size_t EventLog::GetNumDropped()
+{
+    unique_lock<mutex> lock(gMutexOpen);
+    shared_ptr<Writer> pWriter = atomic_load(&gpWriter);
+    return pWriter ? pWriter->GetNumDropped() : gnDropped;
+}
+
+} //namespace ORB_SLAM
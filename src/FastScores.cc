@@ -0,0 +1,308 @@
+#include "FastScores.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FASTSCORES_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FASTSCORES_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+
+const int kCircle = 16;
+// contiguous pixels of a corner
+const int kArc = 9;
+
+typedef void (*ScoresKernel)(const uint8_t*, const size_t, const int, const int, const int, const int, const int,
+                             uint8_t*, const size_t);
+
+struct Kernel
+{
+    const char* name;
+    ScoresKernel scores;
+};
+
+// Offsets of the circle into rows of step bytes, in the order of cv::FAST, so the arcs are
+// contiguous
+void CircleOffsets(const size_t step, int* offsets)
+{
+    static const int circle[kCircle][2] =
+    {
+        {0, 3}, { 1, 3}, { 2, 2}, { 3, 1}, { 3, 0}, { 3, -1}, { 2, -2}, { 1, -3},
+        {0, -3}, {-1, -3}, {-2, -2}, {-3, -1}, {-3, 0}, {-3, 1}, {-2, 2}, {-1, 3}
+    };
+    for(int k=0; k<kCircle; k++)
+        offsets[k] = circle[k][0] + circle[k][1]*(int)step;
+}
+
+// ---------------------------------------------------------------------------------------
+// scalar
+// ---------------------------------------------------------------------------------------
+
+// Largest minimum of kArc contiguous differences
+inline int MaxArcMinimum(const int* diff)
+{
+    int best = 0;
+    for(int k=0; k<kCircle; k++)
+    {
+        int m = diff[k];
+        for(int j=1; j<kArc && m>best; j++)
+            m = std::min(m, diff[(k+j)&(kCircle-1)]);
+        best = std::max(best, m);
+    }
+    return best;
+}
+
+inline uint8_t ScorePixel(const uint8_t* center, const int* offsets, const int threshold)
+{
+    const int v = center[0];
+    int brighter[kCircle], darker[kCircle];
+    for(int k=0; k<kCircle; k++)
+    {
+        const int p = center[offsets[k]];
+        brighter[k] = std::max(p-v, 0);
+        darker[k] = std::max(v-p, 0);
+    }
+
+    // every arc holds one of two opposite pixels, a corner has one of both pairs above the threshold
+    const bool bBright = std::min(std::max(brighter[0],brighter[8]), std::max(brighter[4],brighter[12]))>threshold;
+    const bool bDark = std::min(std::max(darker[0],darker[8]), std::max(darker[4],darker[12]))>threshold;
+    if(!bBright && !bDark)
+        return 0;
+
+    const int strength = std::max(MaxArcMinimum(brighter), MaxArcMinimum(darker));
+    return strength>threshold ? static_cast<uint8_t>(strength) : 0;
+}
+
+void ScoresScalar(const uint8_t* image, const size_t step, const int x0, const int y0, const int x1, const int y1,
+                  const int threshold, uint8_t* scores, const size_t scoresStep)
+{
+    int offsets[kCircle];
+    CircleOffsets(step, offsets);
+
+    for(int y=y0; y<y1; y++)
+    {
+        const uint8_t* row = image + y*step;
+        uint8_t* out = scores + y*scoresStep;
+        for(int x=x0; x<x1; x++)
+            out[x] = ScorePixel(row+x, offsets, threshold);
+    }
+}
+
+#ifdef FASTSCORES_X86
+
+// ---------------------------------------------------------------------------------------
+// AVX2, 32 pixels at a time with saturated 8 bit differences, the arcs by a sliding minimum
+// ---------------------------------------------------------------------------------------
+
+__attribute__((target("avx2")))
+inline __m256i Load32(const uint8_t* p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+// a > threshold, per byte
+__attribute__((target("avx2")))
+inline __m256i Above(const __m256i a, const __m256i threshold)
+{
+    return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(a, threshold), _mm256_setzero_si256()),
+                            _mm256_set1_epi8(-1));
+}
+
+__attribute__((target("avx2")))
+inline __m256i MaxArcMinimum(const __m256i* diff)
+{
+    __m256i m2[kCircle], m4[kCircle];
+    for(int k=0; k<kCircle; k++)
+        m2[k] = _mm256_min_epu8(diff[k], diff[(k+1)&(kCircle-1)]);
+    for(int k=0; k<kCircle; k++)
+        m4[k] = _mm256_min_epu8(m2[k], m2[(k+2)&(kCircle-1)]);
+
+    __m256i best = _mm256_setzero_si256();
+    for(int k=0; k<kCircle; k++)
+    {
+        const __m256i m8 = _mm256_min_epu8(m4[k], m4[(k+4)&(kCircle-1)]);
+        best = _mm256_max_epu8(best, _mm256_min_epu8(m8, diff[(k+8)&(kCircle-1)]));
+    }
+    return best;
+}
+
+__attribute__((target("avx2")))
+inline void ScoreBlock(const uint8_t* center, const int* offsets, const __m256i threshold, uint8_t* out)
+{
+    const __m256i v = Load32(center);
+    __m256i brighter[kCircle], darker[kCircle];
+    for(int k=0; k<kCircle; k++)
+    {
+        const __m256i p = Load32(center+offsets[k]);
+        brighter[k] = _mm256_subs_epu8(p, v);
+        darker[k] = _mm256_subs_epu8(v, p);
+    }
+
+    const __m256i bright = _mm256_min_epu8(_mm256_max_epu8(brighter[0],brighter[8]),
+                                           _mm256_max_epu8(brighter[4],brighter[12]));
+    const __m256i dark = _mm256_min_epu8(_mm256_max_epu8(darker[0],darker[8]),
+                                         _mm256_max_epu8(darker[4],darker[12]));
+    if(_mm256_testz_si256(Above(_mm256_max_epu8(bright, dark), threshold), _mm256_set1_epi8(-1)))
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_setzero_si256());
+        return;
+    }
+
+    const __m256i strength = _mm256_max_epu8(MaxArcMinimum(brighter), MaxArcMinimum(darker));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_and_si256(strength, Above(strength, threshold)));
+}
+
+__attribute__((target("avx2")))
+void ScoresAVX2(const uint8_t* image, const size_t step, const int x0, const int y0, const int x1, const int y1,
+                const int threshold, uint8_t* scores, const size_t scoresStep)
+{
+    if(x1-x0<32)
+    {
+        ScoresScalar(image, step, x0, y0, x1, y1, threshold, scores, scoresStep);
+        return;
+    }
+
+    int offsets[kCircle];
+    CircleOffsets(step, offsets);
+    const __m256i t = _mm256_set1_epi8(static_cast<char>(threshold));
+
+    for(int y=y0; y<y1; y++)
+    {
+        const uint8_t* row = image + y*step;
+        uint8_t* out = scores + y*scoresStep;
+        int x = x0;
+        for(; x+32<=x1; x+=32)
+            ScoreBlock(row+x, offsets, t, out+x);
+        // the last block overlaps the one before
+        if(x<x1)
+            ScoreBlock(row+x1-32, offsets, t, out+x1-32);
+    }
+}
+
+#endif // FASTSCORES_X86
+
+#ifdef FASTSCORES_NEON
+
+// ---------------------------------------------------------------------------------------
+// NEON, 16 pixels at a time, the same as AVX2
+// ---------------------------------------------------------------------------------------
+
+inline uint8x16_t MaxArcMinimum(const uint8x16_t* diff)
+{
+    uint8x16_t m2[kCircle], m4[kCircle];
+    for(int k=0; k<kCircle; k++)
+        m2[k] = vminq_u8(diff[k], diff[(k+1)&(kCircle-1)]);
+    for(int k=0; k<kCircle; k++)
+        m4[k] = vminq_u8(m2[k], m2[(k+2)&(kCircle-1)]);
+
+    uint8x16_t best = vdupq_n_u8(0);
+    for(int k=0; k<kCircle; k++)
+    {
+        const uint8x16_t m8 = vminq_u8(m4[k], m4[(k+4)&(kCircle-1)]);
+        best = vmaxq_u8(best, vminq_u8(m8, diff[(k+8)&(kCircle-1)]));
+    }
+    return best;
+}
+
+inline bool AnyNonZero(const uint8x16_t a)
+{
+    const uint64x2_t a64 = vreinterpretq_u64_u8(a);
+    return (vgetq_lane_u64(a64, 0) | vgetq_lane_u64(a64, 1))!=0;
+}
+
+inline void ScoreBlock(const uint8_t* center, const int* offsets, const uint8x16_t threshold, uint8_t* out)
+{
+    const uint8x16_t v = vld1q_u8(center);
+    uint8x16_t brighter[kCircle], darker[kCircle];
+    for(int k=0; k<kCircle; k++)
+    {
+        const uint8x16_t p = vld1q_u8(center+offsets[k]);
+        brighter[k] = vqsubq_u8(p, v);
+        darker[k] = vqsubq_u8(v, p);
+    }
+
+    const uint8x16_t bright = vminq_u8(vmaxq_u8(brighter[0],brighter[8]), vmaxq_u8(brighter[4],brighter[12]));
+    const uint8x16_t dark = vminq_u8(vmaxq_u8(darker[0],darker[8]), vmaxq_u8(darker[4],darker[12]));
+    if(!AnyNonZero(vcgtq_u8(vmaxq_u8(bright, dark), threshold)))
+    {
+        vst1q_u8(out, vdupq_n_u8(0));
+        return;
+    }
+
+    const uint8x16_t strength = vmaxq_u8(MaxArcMinimum(brighter), MaxArcMinimum(darker));
+    vst1q_u8(out, vandq_u8(strength, vcgtq_u8(strength, threshold)));
+}
+
+void ScoresNEON(const uint8_t* image, const size_t step, const int x0, const int y0, const int x1, const int y1,
+                const int threshold, uint8_t* scores, const size_t scoresStep)
+{
+    if(x1-x0<16)
+    {
+        ScoresScalar(image, step, x0, y0, x1, y1, threshold, scores, scoresStep);
+        return;
+    }
+
+    int offsets[kCircle];
+    CircleOffsets(step, offsets);
+    const uint8x16_t t = vdupq_n_u8(static_cast<uint8_t>(threshold));
+
+    for(int y=y0; y<y1; y++)
+    {
+        const uint8_t* row = image + y*step;
+        uint8_t* out = scores + y*scoresStep;
+        int x = x0;
+        for(; x+16<=x1; x+=16)
+            ScoreBlock(row+x, offsets, t, out+x);
+        // the last block overlaps the one before
+        if(x<x1)
+            ScoreBlock(row+x1-16, offsets, t, out+x1-16);
+    }
+}
+
+#endif // FASTSCORES_NEON
+
+Kernel SelectKernel()
+{
+#ifdef FASTSCORES_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return Kernel{"avx2", ScoresAVX2};
+#endif
+#ifdef FASTSCORES_NEON
+    return Kernel{"neon", ScoresNEON};
+#endif
+    return Kernel{"scalar", ScoresScalar};
+}
+
+// selected once, on first use (thread safe static initialization)
+const Kernel& ActiveKernel()
+{
+    static const Kernel kernel = SelectKernel();
+    return kernel;
+}
+
+} // namespace
+
+void FastScores::Compute(const uint8_t* image, const size_t step, const int x0, const int y0, const int x1,
+                         const int y1, const int threshold, uint8_t* scores, const size_t scoresStep)
+{
+    if(x1<=x0 || y1<=y0)
+        return;
+    // thresholds of 255 and above find no corner, as in cv::FAST
+    ActiveKernel().scores(image, step, x0, y0, x1, y1, std::min(std::max(threshold, 0), 255), scores, scoresStep);
+}
+
+const char* FastScores::KernelName()
+{
+    return ActiveKernel().name;
+}
+
+}// namespace ORB_SLAM
@@ -0,0 +1,109 @@
+#include "FeatureBudget.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const float SMOOTHING = 0.2f; //param weight of the last frame in the smoothed frame time
+const float GAIN = 0.5f; //param relative change of the features per relative error of the frame time
+const float MAX_STEP = 0.1f; //param largest relative change of the features per frame
+const float QUEUE_STEP = 0.05f; //param features removed per frame while the local mapping falls behind
+const float INLIER_MARGIN = 2.0f; //param inliers (times the minimum) below which spare time buys features
+const float DECAY = 0.01f; //param features removed per frame while there are inliers to spare
+const float LEVEL_HEADROOM = 0.25f; //param spare time (relative to the target) to add a level back
+const int LEVEL_HOLD_FRAMES = 30; //param frames between two changes of the number of levels
+const float FAST_SHORTFALL = 0.9f; //param keypoints (times the features) below which the FAST threshold drops
+}
+
+FeatureBudget::FeatureBudget(const Budget &maxBudget, const Settings &settings):
+    mMaxBudget(maxBudget), mSettings(settings)
+{
+    Reset();
+}
+
+FeatureBudget::Budget FeatureBudget::GetBudget()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mBudget;
+}
+
+void FeatureBudget::AddExtraction(const double time, const int nKeys)
+{
+    unique_lock<mutex> lock(mMutex);
+    mLastExtractionTime = time;
+    mnLastKeys = nKeys;
+}
+
+void FeatureBudget::AddTracking(const double time, const bool bTracked, const int nInliers, const int nQueuedKeyFrames)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    const float frameTime = mLastExtractionTime+time;
+    if(mfFrameTime<0)
+        mfFrameTime = frameTime;
+    else
+        mfFrameTime += SMOOTHING*(frameTime-mfFrameTime);
+
+    // positive while the frames are faster than the target
+    const float error = (mSettings.targetFrameTime-mfFrameTime)/mSettings.targetFrameTime;
+    const bool bBehind = nQueuedKeyFrames>mSettings.nMaxQueuedKeyFrames;
+    const bool bFewInliers = !bTracked || nInliers<mSettings.nMinInliers;
+
+    // Keeping the tracking goes first, then the time
+    float step;
+    if(bFewInliers)
+        step = MAX_STEP;
+    else if(error<0)
+        step = max(GAIN*error,-MAX_STEP);
+    else if(bBehind)
+        step = -QUEUE_STEP;
+    else if(nInliers<INLIER_MARGIN*mSettings.nMinInliers)
+        step = min(GAIN*error,MAX_STEP);
+    else
+        step = -DECAY;
+
+    const float minFeatures = min(mSettings.nMinFeatures,mMaxBudget.nFeatures);
+    mfFeatures = min(max(mfFeatures*(1.0f+step),minFeatures),(float)mMaxBudget.nFeatures);
+    mBudget.nFeatures = (int)(mfFeatures+0.5f);
+
+    // Lower the threshold while FAST can't deliver the features, raise it again once it can
+    if(mnLastKeys<FAST_SHORTFALL*mBudget.nFeatures)
+        mBudget.iniThFAST = max(mBudget.iniThFAST-1,mBudget.minThFAST);
+    else if(mnLastKeys>=mBudget.nFeatures)
+        mBudget.iniThFAST = min(mBudget.iniThFAST+1,mMaxBudget.iniThFAST);
+
+    // The pyramid is the last resort, its depth changes seldom
+    mnFramesSinceLevelChange++;
+    if(mnFramesSinceLevelChange>=LEVEL_HOLD_FRAMES)
+    {
+        const bool bAtMinimum = mfFeatures<=minFeatures;
+        if(!bFewInliers && error<0 && bAtMinimum && mBudget.nLevels>mSettings.nMinLevels)
+        {
+            mBudget.nLevels--;
+            mnFramesSinceLevelChange = 0;
+        }
+        else if((bFewInliers || error>LEVEL_HEADROOM) && mBudget.nLevels<mMaxBudget.nLevels)
+        {
+            mBudget.nLevels++;
+            mnFramesSinceLevelChange = 0;
+        }
+    }
+}
+
+void FeatureBudget::Reset()
+{
+    unique_lock<mutex> lock(mMutex);
+    mBudget = mMaxBudget;
+    mfFeatures = mMaxBudget.nFeatures;
+    mfFrameTime = -1.0f;
+    mLastExtractionTime = 0;
+    mnLastKeys = mMaxBudget.nFeatures;
+    mnFramesSinceLevelChange = 0;
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,360 @@
+#include "FeatureCache.h"
+
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const char MAGIC[8] = {'O','R','B','F','E','A','T','S'};
+const uint32_t VERSION = 1;
+
+// Bytes of a keypoint: x, y, size, angle, response and the octave
+const size_t KEYPOINT_SIZE = 5*sizeof(float)+1;
+
+bool IsReadable(const string &filename)
+{
+    ifstream f(filename.c_str(), ios::binary);
+    return f.good();
+}
+
+template<typename T>
+void Put(vector<char> &vData, const T &value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    vData.insert(vData.end(),p,p+sizeof(T));
+}
+
+void PutBytes(vector<char> &vData, const void* p, const size_t n)
+{
+    const char* pBytes = static_cast<const char*>(p);
+    vData.insert(vData.end(),pBytes,pBytes+n);
+}
+
+// Reads from a part of the mapped file, every Get fails once it is exhausted
+class Reader
+{
+public:
+    Reader(const char* pData, const size_t nSize): mpData(pData), mnSize(nSize), mnPos(0) {}
+
+    template<typename T>
+    bool Get(T &value) { return GetBytes(&value,sizeof(T)); }
+
+    bool GetBytes(void* p, const size_t n)
+    {
+        if(n>mnSize-mnPos)
+            return false;
+        memcpy(p,mpData+mnPos,n);
+        mnPos += n;
+        return true;
+    }
+
+    // n elements of nElementSize bytes
+    bool Skip(const uint64_t n, const size_t nElementSize)
+    {
+        if(nElementSize>0 && n>(mnSize-mnPos)/nElementSize)
+            return false;
+        mnPos += n*nElementSize;
+        return true;
+    }
+
+    size_t Pos() const { return mnPos; }
+
+private:
+    const char* mpData;
+    size_t mnSize;
+    size_t mnPos;
+};
+
+struct RecordHeader
+{
+    double timestamp;
+    int32_t nExtractor;
+    int32_t N;
+    int32_t nDescCols;
+    uint8_t bStereo;
+};
+
+bool GetRecordHeader(Reader &r, RecordHeader &header)
+{
+    return r.Get(header.timestamp) && r.Get(header.nExtractor) && r.Get(header.N) && r.Get(header.nDescCols) &&
+           r.Get(header.bStereo) && header.N>=0 && header.nDescCols>=0;
+}
+
+// Skips the features of a record, false if it is corrupt
+bool SkipRecord(Reader &r, const RecordHeader &header)
+{
+    if(!r.Skip(header.N,KEYPOINT_SIZE) || (header.bStereo && !r.Skip(2*static_cast<uint64_t>(header.N),sizeof(float))) ||
+       !r.Skip(header.N,header.nDescCols))
+        return false;
+
+    uint32_t nWords, nNodes;
+    if(!r.Get(nWords) || !r.Skip(nWords,sizeof(uint32_t)+sizeof(double)) || !r.Get(nNodes))
+        return false;
+    for(uint32_t i=0; i<nNodes; i++)
+    {
+        uint32_t nNode, nFeatures;
+        if(!r.Get(nNode) || !r.Get(nFeatures) || !r.Skip(nFeatures,sizeof(uint32_t)))
+            return false;
+    }
+    return true;
+}
+
+bool GetRecord(Reader &r, const RecordHeader &header, FrameFeatures &features)
+{
+    const int N = header.N;
+    features.vKeys.resize(N);
+    for(int i=0; i<N; i++)
+    {
+        cv::KeyPoint &kp = features.vKeys[i];
+        uint8_t octave;
+        if(!r.Get(kp.pt.x) || !r.Get(kp.pt.y) || !r.Get(kp.size) || !r.Get(kp.angle) || !r.Get(kp.response) ||
+           !r.Get(octave))
+            return false;
+        kp.octave = octave;
+    }
+
+    features.vuRight.clear();
+    features.vDepth.clear();
+    if(header.bStereo)
+    {
+        features.vuRight.resize(N);
+        features.vDepth.resize(N);
+        if(N>0 && (!r.GetBytes(&features.vuRight[0],N*sizeof(float)) || !r.GetBytes(&features.vDepth[0],N*sizeof(float))))
+            return false;
+    }
+
+    features.descriptors.create(N,header.nDescCols,CV_8U);
+    for(int i=0; i<N; i++)
+    {
+        if(!r.GetBytes(features.descriptors.ptr<unsigned char>(i),header.nDescCols))
+            return false;
+    }
+
+    features.bowVec.clear();
+    features.featVec.clear();
+    uint32_t nWords, nNodes;
+    if(!r.Get(nWords))
+        return false;
+    for(uint32_t i=0; i<nWords; i++)
+    {
+        uint32_t nWord;
+        double weight;
+        if(!r.Get(nWord) || !r.Get(weight))
+            return false;
+        features.bowVec.insert(features.bowVec.end(),make_pair(nWord,weight));
+    }
+    if(!r.Get(nNodes))
+        return false;
+    for(uint32_t i=0; i<nNodes; i++)
+    {
+        uint32_t nNode, nFeatures;
+        if(!r.Get(nNode) || !r.Get(nFeatures))
+            return false;
+        vector<unsigned int> &vFeatures = features.featVec[nNode];
+        vFeatures.resize(nFeatures);
+        if(nFeatures>0 && !r.GetBytes(&vFeatures[0],nFeatures*sizeof(uint32_t)))
+            return false;
+    }
+    return true;
+}
+}
+
+FeatureCache::FeatureCache(const string &filename, const string &settings):
+    mFilename(filename), mbOpen(false), mbWriteFailed(false), mnChunkFrames(0), mnReplayed(0), mnRecorded(0)
+{
+    vector<char> vHeader;
+    PutBytes(vHeader,MAGIC,sizeof(MAGIC));
+    Put<uint32_t>(vHeader,VERSION);
+    Put<uint32_t>(vHeader,settings.size());
+    PutBytes(vHeader,settings.data(),settings.size());
+
+    // A new file, or the complete chunks of the one recorded before
+    uint64_t nEnd = 0;
+    if(IsReadable(filename) && mFile.Open(filename,true))
+    {
+        if(mFile.Size()<vHeader.size() || memcmp(mFile.Data(),&vHeader[0],vHeader.size())!=0)
+        {
+            cerr << "The feature cache " << filename << " was recorded with other extraction settings or by another "
+                 << "version, it is not used" << endl;
+            mFile.Close();
+            return;
+        }
+        nEnd = ReadChunks(vHeader.size());
+
+        // A chunk cut off by a crash is overwritten
+        if(nEnd<mFile.Size() && truncate(filename.c_str(),nEnd)!=0)
+        {
+            cerr << "Could not truncate the feature cache " << filename << ", it is not used" << endl;
+            mFile.Close();
+            mmIndex.clear();
+            return;
+        }
+        mOut.open(filename.c_str(), ios::out | ios::in | ios::binary);
+        mOut.seekp(nEnd);
+    }
+    else
+    {
+        mOut.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+        mOut.write(&vHeader[0],vHeader.size());
+        mOut.flush();
+    }
+
+    if(!mOut)
+    {
+        cerr << "Could not write the feature cache " << filename << ", it is not used" << endl;
+        mFile.Close();
+        mmIndex.clear();
+        return;
+    }
+    mbOpen = true;
+}
+
+FeatureCache::~FeatureCache()
+{
+    Flush();
+}
+
+uint64_t FeatureCache::ReadChunks(uint64_t nOffset)
+{
+    while(nOffset<mFile.Size())
+    {
+        Reader chunk(mFile.Data()+nOffset,mFile.Size()-nOffset);
+        uint64_t nBytes;
+        uint32_t nFrames;
+        if(!chunk.Get(nBytes) || !chunk.Get(nFrames) || nBytes>mFile.Size()-nOffset-chunk.Pos())
+            break;
+
+        // The records of the chunk, it is only taken if all of them are complete
+        const uint64_t nStart = nOffset+chunk.Pos();
+        Reader r(mFile.Data()+nStart,nBytes);
+        vector<pair<Key,uint64_t> > vRecords;
+        bool bOk = true;
+        for(uint32_t i=0; i<nFrames && bOk; i++)
+        {
+            const size_t nPos = r.Pos();
+            RecordHeader header;
+            bOk = GetRecordHeader(r,header) && SkipRecord(r,header);
+            if(bOk)
+                vRecords.push_back(make_pair(Key(header.timestamp,header.nExtractor),nStart+nPos));
+        }
+        if(!bOk || r.Pos()!=nBytes)
+            break;
+
+        mmIndex.insert(vRecords.begin(),vRecords.end());
+        nOffset = nStart+nBytes;
+    }
+    return nOffset;
+}
+
+bool FeatureCache::Get(const double timestamp, const Extractor extractor, FrameFeatures &features)
+{
+    if(!mbOpen)
+        return false;
+
+    map<Key,uint64_t>::const_iterator it = mmIndex.find(Key(timestamp,extractor));
+    if(it==mmIndex.end())
+        return false;
+
+    // Checked when the chunk was indexed
+    Reader r(mFile.Data()+it->second,mFile.Size()-it->second);
+    RecordHeader header;
+    if(!GetRecordHeader(r,header) || !GetRecord(r,header,features))
+        return false;
+
+    mnReplayed++;
+    return true;
+}
+
+void FeatureCache::Add(const Frame &frame, const Extractor extractor)
+{
+    if(!mbOpen)
+        return;
+
+    const int N = frame.N;
+    bool bStereo = false;
+    for(size_t i=0; i<frame.mvuRight.size() && !bStereo; i++)
+        bStereo = frame.mvuRight[i]>=0;
+
+    unique_lock<mutex> lock(mMutexWrite);
+    if(mbWriteFailed)
+        return;
+    Put<double>(mvChunk,frame.mTimeStamp);
+    Put<int32_t>(mvChunk,extractor);
+    Put<int32_t>(mvChunk,N);
+    Put<int32_t>(mvChunk,N>0 ? frame.mDescriptors.cols : 0);
+    Put<uint8_t>(mvChunk,bStereo);
+
+    for(int i=0; i<N; i++)
+    {
+        const cv::KeyPoint &kp = frame.mvKeys[i];
+        Put<float>(mvChunk,kp.pt.x);
+        Put<float>(mvChunk,kp.pt.y);
+        Put<float>(mvChunk,kp.size);
+        Put<float>(mvChunk,kp.angle);
+        Put<float>(mvChunk,kp.response);
+        Put<uint8_t>(mvChunk,kp.octave);
+    }
+    if(bStereo)
+    {
+        PutBytes(mvChunk,&frame.mvuRight[0],N*sizeof(float));
+        PutBytes(mvChunk,&frame.mvDepth[0],N*sizeof(float));
+    }
+    for(int i=0; i<N; i++)
+        PutBytes(mvChunk,frame.mDescriptors.ptr<unsigned char>(i),frame.mDescriptors.cols);
+
+    Put<uint32_t>(mvChunk,frame.mBowVec.size());
+    for(DBoW2::BowVector::const_iterator vit=frame.mBowVec.begin(), vend=frame.mBowVec.end(); vit!=vend; vit++)
+    {
+        Put<uint32_t>(mvChunk,vit->first);
+        Put<double>(mvChunk,vit->second);
+    }
+    Put<uint32_t>(mvChunk,frame.mFeatVec.size());
+    for(DBoW2::FeatureVector::const_iterator fit=frame.mFeatVec.begin(), fend=frame.mFeatVec.end(); fit!=fend; fit++)
+    {
+        Put<uint32_t>(mvChunk,fit->first);
+        Put<uint32_t>(mvChunk,fit->second.size());
+        for(size_t i=0; i<fit->second.size(); i++)
+            Put<uint32_t>(mvChunk,fit->second[i]);
+    }
+
+    mnRecorded++;
+    if(++mnChunkFrames==CHUNK_FRAMES)
+        WriteChunk();
+}
+
+void FeatureCache::Flush()
+{
+    unique_lock<mutex> lock(mMutexWrite);
+    if(mbOpen && !mbWriteFailed && mnChunkFrames>0)
+        WriteChunk();
+}
+
+void FeatureCache::WriteChunk()
+{
+    const uint64_t nBytes = mvChunk.size();
+    mOut.write(reinterpret_cast<const char*>(&nBytes),sizeof(nBytes));
+    mOut.write(reinterpret_cast<const char*>(&mnChunkFrames),sizeof(mnChunkFrames));
+    mOut.write(&mvChunk[0],nBytes);
+    // A complete chunk survives a crash of the run
+    mOut.flush();
+    if(!mOut)
+    {
+        cerr << "Failed to write to the feature cache " << mFilename << ", the frames after are not recorded" << endl;
+        mbWriteFailed = true;
+    }
+    mvChunk.clear();
+    mnChunkFrames = 0;
+}
+
+void FeatureCache::PrintStats(ostream &out)
+{
+    out << "Feature cache: " << mnReplayed << " frames replayed, " << mnRecorded << " extracted and recorded" << endl;
+}
+
+} //namespace ORB_SLAM
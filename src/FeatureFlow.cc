@@ -0,0 +1,179 @@
+#include "FeatureFlow.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int WINDOW = 8;
+const int WINDOW_AREA = WINDOW*WINDOW;
+const int WINDOW_HALF = WINDOW/2;
+// The window and the pixels of its gradient
+const int BORDER = WINDOW_HALF+2;
+
+const float MAX_SCALE = 4.0f; //param coarsest level
+const int LEVEL_STEP = 2; //param
+const int MAX_ITERATIONS = 10; //param
+const float MIN_STEP = 0.01f; //param pixels of the level
+// Smallest eigenvalue of the structure tensor per pixel, (intensity per pixel)^2
+const float MIN_EIGENVALUE = 2.0f; //param
+// Mean absolute difference in the full image, intensity
+const float MAX_ERROR = 10.0f; //param
+
+// Bilinear, x and y must be at least one pixel inside the image
+inline float Interpolate(const cv::Mat &image, const float x, const float y)
+{
+    const int x0 = static_cast<int>(x);
+    const int y0 = static_cast<int>(y);
+    const float ax = x-x0;
+    const float ay = y-y0;
+    const size_t step = image.step;
+    const unsigned char* p = image.ptr<unsigned char>(y0)+x0;
+    return (1.0f-ay)*((1.0f-ax)*p[0]+ax*p[1]) + ay*((1.0f-ax)*p[step]+ax*p[step+1]);
+}
+
+inline bool IsInside(const cv::Mat &image, const float x, const float y)
+{
+    return x>=BORDER && y>=BORDER && x<image.cols-BORDER && y<image.rows-BORDER;
+}
+
+// Tracks a point at one level, u,v hold the guess in pixels of the level. False if the window
+// is out of the image or has too little texture. error is the mean absolute difference at the end.
+bool TrackLevel(const cv::Mat &prev, const cv::Mat &cur, const float px, const float py, float &u, float &v,
+                float &error)
+{
+    if(!IsInside(prev,px,py))
+        return false;
+
+    // Template and gradients without their mean
+    float T[WINDOW_AREA], Gx[WINDOW_AREA], Gy[WINDOW_AREA];
+    float meanT = 0, meanGx = 0, meanGy = 0;
+    for(int dy=-WINDOW_HALF, k=0; dy<WINDOW_HALF; dy++)
+    {
+        for(int dx=-WINDOW_HALF; dx<WINDOW_HALF; dx++, k++)
+        {
+            const float x = px+dx;
+            const float y = py+dy;
+            T[k] = Interpolate(prev,x,y);
+            Gx[k] = 0.5f*(Interpolate(prev,x+1,y)-Interpolate(prev,x-1,y));
+            Gy[k] = 0.5f*(Interpolate(prev,x,y+1)-Interpolate(prev,x,y-1));
+            meanT += T[k];
+            meanGx += Gx[k];
+            meanGy += Gy[k];
+        }
+    }
+    meanT /= WINDOW_AREA;
+    meanGx /= WINDOW_AREA;
+    meanGy /= WINDOW_AREA;
+
+    float hxx = 0, hxy = 0, hyy = 0;
+    for(int k=0; k<WINDOW_AREA; k++)
+    {
+        T[k] -= meanT;
+        Gx[k] -= meanGx;
+        Gy[k] -= meanGy;
+        hxx += Gx[k]*Gx[k];
+        hxy += Gx[k]*Gy[k];
+        hyy += Gy[k]*Gy[k];
+    }
+
+    const float minEigenvalue = 0.5f*(hxx+hyy-sqrt((hxx-hyy)*(hxx-hyy)+4.0f*hxy*hxy));
+    if(minEigenvalue<MIN_EIGENVALUE*WINDOW_AREA)
+        return false;
+    const float invDet = 1.0f/(hxx*hyy-hxy*hxy);
+
+    float I[WINDOW_AREA];
+    for(int it=0; it<=MAX_ITERATIONS; it++)
+    {
+        if(!IsInside(cur,u,v))
+            return false;
+
+        float meanI = 0;
+        for(int dy=-WINDOW_HALF, k=0; dy<WINDOW_HALF; dy++)
+            for(int dx=-WINDOW_HALF; dx<WINDOW_HALF; dx++, k++)
+            {
+                I[k] = Interpolate(cur,u+dx,v+dy);
+                meanI += I[k];
+            }
+        meanI /= WINDOW_AREA;
+
+        float bx = 0, by = 0;
+        error = 0;
+        for(int k=0; k<WINDOW_AREA; k++)
+        {
+            const float r = I[k]-meanI-T[k];
+            bx += Gx[k]*r;
+            by += Gy[k]*r;
+            error += fabs(r);
+        }
+        error /= WINDOW_AREA;
+
+        // The error of the last position is known, no step after it
+        if(it==MAX_ITERATIONS)
+            break;
+
+        const float du = invDet*(hyy*bx-hxy*by);
+        const float dv = invDet*(hxx*by-hxy*bx);
+        u -= du;
+        v -= dv;
+        if(du*du+dv*dv<MIN_STEP*MIN_STEP)
+        {
+            if(!IsInside(cur,u,v))
+                return false;
+            break;
+        }
+    }
+    return true;
+}
+}
+
+void TrackFeatureFlow(const vector<cv::Mat> &vPrevPyramid, const vector<cv::Mat> &vCurPyramid,
+                      const vector<float> &vScaleFactors, const vector<cv::Point2f> &vPrev,
+                      vector<cv::Point2f> &vCur, vector<unsigned char> &vbTracked)
+{
+    vbTracked.assign(vPrev.size(),false);
+
+    const int nLevels = min(min(vPrevPyramid.size(),vCurPyramid.size()),vScaleFactors.size());
+    if(nLevels==0)
+        return;
+
+    // The levels tracked end at the full image
+    int nCoarsest = 0;
+    while(nCoarsest+LEVEL_STEP<nLevels && vScaleFactors[nCoarsest+LEVEL_STEP]<=MAX_SCALE)
+        nCoarsest += LEVEL_STEP;
+
+    for(size_t i=0; i<vPrev.size(); i++)
+    {
+        float u = vCur[i].x;
+        float v = vCur[i].y;
+        float error = 0;
+        bool bTracked = false;
+
+        for(int level=nCoarsest; level>=0; level-=LEVEL_STEP)
+        {
+            const float scale = vScaleFactors[level];
+            const float invScale = 1.0f/scale;
+            float ul = u*invScale;
+            float vl = v*invScale;
+
+            // A coarse level which fails leaves the guess to the finer ones
+            bTracked = TrackLevel(vPrevPyramid[level],vCurPyramid[level],vPrev[i].x*invScale,vPrev[i].y*invScale,
+                                  ul,vl,error);
+            if(bTracked)
+            {
+                u = ul*scale;
+                v = vl*scale;
+            }
+        }
+
+        vCur[i] = cv::Point2f(u,v);
+        vbTracked[i] = bTracked && error<MAX_ERROR;
+    }
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,38 @@
+#include "FeatureGrid.h"
+
+namespace ORB_SLAM2
+{
+
+FeatureGrid::FeatureGrid(const int nCols, const int nRows, const std::vector<int> &vCells):
+    mnCols(nCols), mnRows(nRows), mvOffsets(nCols*nRows+1,0)
+{
+    // Count the keypoints of every cell, then turn the counts into offsets
+    for(std::size_t i=0; i<vCells.size(); i++)
+    {
+        if(vCells[i]>=0)
+            mvOffsets[vCells[i]+1]++;
+    }
+
+    for(int c=0; c<nCols*nRows; c++)
+        mvOffsets[c+1] += mvOffsets[c];
+
+    // Fill in keypoint order, each cell stays sorted
+    mvIndices.resize(mvOffsets.back());
+    std::vector<unsigned int> vNext(mvOffsets.begin(),mvOffsets.end()-1);
+    for(std::size_t i=0; i<vCells.size(); i++)
+    {
+        if(vCells[i]>=0)
+            mvIndices[vNext[vCells[i]]++] = i;
+    }
+
+    mpOffsets = mvOffsets.data();
+    mpIndices = mvIndices.data();
+}
+
+FeatureGrid::FeatureGrid(const int nCols, const int nRows, const unsigned int* pOffsets, const unsigned int* pIndices,
+                         const std::shared_ptr<const void> &pOwner):
+    mnCols(nCols), mnRows(nRows), mpOffsets(pOffsets), mpIndices(pIndices), mpOwner(pOwner)
+{
+}
+
+} //namespace ORB_SLAM
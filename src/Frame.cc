@@ -20,17 +20,56 @@
 
 #include "Frame.h"
 #include "Converter.h"
+#include "FeatureFlow.h"
 #include "ORBmatcher.h"
-#include <thread>
+#include "PointProjection.h"
+#include "StageTimer.h"
+#include "StereoMatcher.h"
+#include "VocabularyLoader.h"
+#include <algorithm>
+#include <future>
 
 namespace ORB_SLAM2
 {
 
-long unsigned int Frame::nNextId=0;
-bool Frame::mbInitialComputations=true;
-float Frame::cx, Frame::cy, Frame::fx, Frame::fy, Frame::invfx, Frame::invfy;
-float Frame::mnMinX, Frame::mnMinY, Frame::mnMaxX, Frame::mnMaxY;
-float Frame::mfGridElementWidthInv, Frame::mfGridElementHeightInv;
+namespace
+{
+const float DEPTH_FILTER_TOLERANCE = 0.05f; //param relative
+
+// Depth in meters at (u,v), 0 or less if there is none. With a radius it is the median of the
+// window, over the samples within DEPTH_FILTER_TOLERANCE of the center only, so the two sides of
+// a depth edge are not mixed.
+template<typename T>
+float SampleDepth(const cv::Mat &imDepth, const int u, const int v, const float factor, const int radius,
+                  vector<float> &vWindow)
+{
+    const float d = imDepth.at<T>(v,u)*factor;
+    if(!(d>0) || radius<=0)
+        return d;
+
+    const int minU = max(u-radius,0);
+    const int maxU = min(u+radius,imDepth.cols-1);
+    const int minV = max(v-radius,0);
+    const int maxV = min(v+radius,imDepth.rows-1);
+    const float tolerance = DEPTH_FILTER_TOLERANCE*d;
+
+    vWindow.clear();
+    for(int y=minV; y<=maxV; y++)
+    {
+        const T* row = imDepth.ptr<T>(y);
+        for(int x=minU; x<=maxU; x++)
+        {
+            const float di = row[x]*factor;
+            if(di>0 && fabs(di-d)<=tolerance)
+                vWindow.push_back(di);
+        }
+    }
+
+    // the center itself is always in the window
+    nth_element(vWindow.begin(),vWindow.begin()+vWindow.size()/2,vWindow.end());
+    return vWindow[vWindow.size()/2];
+}
+}
 
 Frame::Frame()
 {}
@@ -38,32 +77,33 @@ Frame::Frame()
 //Copy Constructor
 Frame::Frame(const Frame &frame)
     :mpORBvocabulary(frame.mpORBvocabulary), mpORBextractorLeft(frame.mpORBextractorLeft), mpORBextractorRight(frame.mpORBextractorRight),
-     mTimeStamp(frame.mTimeStamp), mK(frame.mK.clone()), mDistCoef(frame.mDistCoef.clone()),
+     mTimeStamp(frame.mTimeStamp), mK(frame.mK), fx(frame.fx), fy(frame.fy), cx(frame.cx), cy(frame.cy),
+     invfx(frame.invfx), invfy(frame.invfy), mDistCoef(frame.mDistCoef),
      mbf(frame.mbf), mb(frame.mb), mThDepth(frame.mThDepth), N(frame.N), mvKeys(frame.mvKeys),
      mvKeysRight(frame.mvKeysRight), mvKeysUn(frame.mvKeysUn),  mvuRight(frame.mvuRight),
-     mvDepth(frame.mvDepth), mBowVec(frame.mBowVec), mFeatVec(frame.mFeatVec),
-     mDescriptors(frame.mDescriptors.clone()), mDescriptorsRight(frame.mDescriptorsRight.clone()),
-     mvpMapPoints(frame.mvpMapPoints), mvbOutlier(frame.mvbOutlier), mnId(frame.mnId),
+     mvDepth(frame.mvDepth), mbStereo(frame.mbStereo), mvColors(frame.mvColors),
+     mImDepth(frame.mImDepth), mfDepthMapFactor(frame.mfDepthMapFactor), mBowVec(frame.mBowVec), mFeatVec(frame.mFeatVec),
+     mDescriptors(frame.mDescriptors), mDescriptorsRight(frame.mDescriptorsRight),
+     mpImagePyramid(frame.mpImagePyramid), mbFlowTracked(frame.mbFlowTracked), mvpMapPoints(frame.mvpMapPoints), mvbOutlier(frame.mvbOutlier),
+     mfGridElementWidthInv(frame.mfGridElementWidthInv), mfGridElementHeightInv(frame.mfGridElementHeightInv),
+     mpGrid(frame.mpGrid), mnId(frame.mnId),
      mpReferenceKF(frame.mpReferenceKF), mnScaleLevels(frame.mnScaleLevels),
      mfScaleFactor(frame.mfScaleFactor), mfLogScaleFactor(frame.mfLogScaleFactor),
      mvScaleFactors(frame.mvScaleFactors), mvInvScaleFactors(frame.mvInvScaleFactors),
-     mvLevelSigma2(frame.mvLevelSigma2), mvInvLevelSigma2(frame.mvInvLevelSigma2)
+     mvLevelSigma2(frame.mvLevelSigma2), mvInvLevelSigma2(frame.mvInvLevelSigma2),
+     mnMinX(frame.mnMinX), mnMaxX(frame.mnMaxX), mnMinY(frame.mnMinY), mnMaxY(frame.mnMaxY)
 {
-    for(int i=0;i<FRAME_GRID_COLS;i++)
-        for(int j=0; j<FRAME_GRID_ROWS; j++)
-            mGrid[i][j]=frame.mGrid[i][j];
-
     if(!frame.mTcw.empty())
         SetPose(frame.mTcw);
 }
 
 
-Frame::Frame(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timeStamp, ORBextractor* extractorLeft, ORBextractor* extractorRight, ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth)
+Frame::Frame(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timeStamp, ORBextractor* extractorLeft, ORBextractor* extractorRight, ORBVocabulary* voc, FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth, ThreadPool* pThreadPool)
     :mpORBvocabulary(voc),mpORBextractorLeft(extractorLeft),mpORBextractorRight(extractorRight), mTimeStamp(timeStamp), mK(K.clone()),mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth),
      mpReferenceKF(static_cast<KeyFrame*>(NULL))
 {
     // Frame ID
-    mnId=nNextId++;
+    mnId=pContext->nNextId++;
 
     // Scale Level Info
     mnScaleLevels = mpORBextractorLeft->GetLevels();
@@ -74,54 +114,52 @@ Frame::Frame(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timeSt
     mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
     mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
 
-    // ORB extraction
-    thread threadLeft(&Frame::ExtractORB,this,0,imLeft);
-    thread threadRight(&Frame::ExtractORB,this,1,imRight);
-    threadLeft.join();
-    threadRight.join();
+    // ORB extraction, both extractors are independent so left and right can run at the same time
+    {
+        STAGE_TIMER(EXTRACT_ORB);
+        if(pThreadPool)
+        {
+            future<void> rightDone = pThreadPool->Submit([&]{ExtractORB(1,imRight);});
+            ExtractORB(0,imLeft);
+            rightDone.get();
+        }
+        else
+        {
+            ExtractORB(0,imLeft);
+            ExtractORB(1,imRight);
+        }
+    }
 
     N = mvKeys.size();
 
     if(mvKeys.empty())
+    {
+        SetCalibration(*pContext);
         return;
+    }
 
-    UndistortKeyPoints();
+    UndistortKeyPoints(*pContext);
 
-    ComputeStereoMatches();
+    ComputeStereoMatches(pThreadPool);
 
     mvpMapPoints = vector<MapPoint*>(N,static_cast<MapPoint*>(NULL));
     mvbOutlier = vector<bool>(N,false);
 
 
-    // This is done only for the first Frame (or after a change in the calibration)
-    if(mbInitialComputations)
-    {
-        ComputeImageBounds(imLeft);
-
-        mfGridElementWidthInv=static_cast<float>(FRAME_GRID_COLS)/(mnMaxX-mnMinX);
-        mfGridElementHeightInv=static_cast<float>(FRAME_GRID_ROWS)/(mnMaxY-mnMinY);
-
-        fx = K.at<float>(0,0);
-        fy = K.at<float>(1,1);
-        cx = K.at<float>(0,2);
-        cy = K.at<float>(1,2);
-        invfx = 1.0f/fx;
-        invfy = 1.0f/fy;
-
-        mbInitialComputations=false;
-    }
+    ComputeCalibration(imLeft,*pContext);
 
     mb = mbf/fx;
 
     AssignFeaturesToGrid();
 }
 
-Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth)
+Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth,
+             const float depthMapFactor, const int nDepthFilterRadius)
     :mpORBvocabulary(voc),mpORBextractorLeft(extractor),mpORBextractorRight(static_cast<ORBextractor*>(NULL)),
      mTimeStamp(timeStamp), mK(K.clone()),mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth)
 {
     // Frame ID
-    mnId=nNextId++;
+    mnId=pContext->nNextId++;
 
     // Scale Level Info
     mnScaleLevels = mpORBextractorLeft->GetLevels();
@@ -133,37 +171,27 @@ Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const double &timeSt
     mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
 
     // ORB extraction
-    ExtractORB(0,imGray);
+    {
+        STAGE_TIMER(EXTRACT_ORB);
+        ExtractORB(0,imGray);
+    }
 
     N = mvKeys.size();
 
     if(mvKeys.empty())
+    {
+        SetCalibration(*pContext);
         return;
+    }
 
-    UndistortKeyPoints();
+    UndistortKeyPoints(*pContext);
 
-    ComputeStereoFromRGBD(imDepth);
+    ComputeStereoFromRGBD(imDepth,depthMapFactor,nDepthFilterRadius);
 
     mvpMapPoints = vector<MapPoint*>(N,static_cast<MapPoint*>(NULL));
     mvbOutlier = vector<bool>(N,false);
 
-    // This is done only for the first Frame (or after a change in the calibration)
-    if(mbInitialComputations)
-    {
-        ComputeImageBounds(imGray);
-
-        mfGridElementWidthInv=static_cast<float>(FRAME_GRID_COLS)/static_cast<float>(mnMaxX-mnMinX);
-        mfGridElementHeightInv=static_cast<float>(FRAME_GRID_ROWS)/static_cast<float>(mnMaxY-mnMinY);
-
-        fx = K.at<float>(0,0);
-        fy = K.at<float>(1,1);
-        cx = K.at<float>(0,2);
-        cy = K.at<float>(1,2);
-        invfx = 1.0f/fx;
-        invfy = 1.0f/fy;
-
-        mbInitialComputations=false;
-    }
+    ComputeCalibration(imGray,*pContext);
 
     mb = mbf/fx;
 
@@ -171,12 +199,12 @@ Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const double &timeSt
 }
 
 
-Frame::Frame(const cv::Mat &imGray, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth)
+Frame::Frame(const cv::Mat &imGray, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth)
     :mpORBvocabulary(voc),mpORBextractorLeft(extractor),mpORBextractorRight(static_cast<ORBextractor*>(NULL)),
      mTimeStamp(timeStamp), mK(K.clone()),mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth)
 {
     // Frame ID
-    mnId=nNextId++;
+    mnId=pContext->nNextId++;
 
     // Scale Level Info
     mnScaleLevels = mpORBextractorLeft->GetLevels();
@@ -188,66 +216,180 @@ Frame::Frame(const cv::Mat &imGray, const double &timeStamp, ORBextractor* extra
     mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
 
     // ORB extraction
-    ExtractORB(0,imGray);
+    {
+        STAGE_TIMER(EXTRACT_ORB);
+        ExtractORB(0,imGray);
+    }
 
     N = mvKeys.size();
 
     if(mvKeys.empty())
+    {
+        SetCalibration(*pContext);
         return;
+    }
 
-    UndistortKeyPoints();
+    UndistortKeyPoints(*pContext);
 
     // Set no stereo information
-    mvuRight = vector<float>(N,-1);
-    mvDepth = vector<float>(N,-1);
+    SetMonocular();
 
     mvpMapPoints = vector<MapPoint*>(N,static_cast<MapPoint*>(NULL));
     mvbOutlier = vector<bool>(N,false);
 
-    // This is done only for the first Frame (or after a change in the calibration)
-    if(mbInitialComputations)
+    ComputeCalibration(imGray,*pContext);
+
+    mb = mbf/fx;
+
+    AssignFeaturesToGrid();
+}
+
+Frame::Frame(const cv::Mat &imGray, const double &timeStamp, FrameFeatures &&features, ORBextractor* extractor, ORBVocabulary* voc,
+             FrameContext* pContext, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth)
+    :mpORBvocabulary(voc),mpORBextractorLeft(extractor),mpORBextractorRight(static_cast<ORBextractor*>(NULL)),
+     mTimeStamp(timeStamp), mK(K.clone()),mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth),
+     mpReferenceKF(static_cast<KeyFrame*>(NULL))
+{
+    // Frame ID
+    mnId=pContext->nNextId++;
+
+    // Scale Level Info
+    mnScaleLevels = mpORBextractorLeft->GetLevels();
+    mfScaleFactor = mpORBextractorLeft->GetScaleFactor();
+    mfLogScaleFactor = log(mfScaleFactor);
+    mvScaleFactors = mpORBextractorLeft->GetScaleFactors();
+    mvInvScaleFactors = mpORBextractorLeft->GetInverseScaleFactors();
+    mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
+    mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
+
+    mvKeys = SharedArray<cv::KeyPoint>(std::move(features.vKeys));
+    mDescriptors = features.descriptors;
+    mBowVec.swap(features.bowVec);
+    mFeatVec.swap(features.featVec);
+
+    N = mvKeys.size();
+
+    if(mvKeys.empty())
     {
-        ComputeImageBounds(imGray);
+        SetCalibration(*pContext);
+        return;
+    }
 
-        mfGridElementWidthInv=static_cast<float>(FRAME_GRID_COLS)/static_cast<float>(mnMaxX-mnMinX);
-        mfGridElementHeightInv=static_cast<float>(FRAME_GRID_ROWS)/static_cast<float>(mnMaxY-mnMinY);
+    UndistortKeyPoints(*pContext);
 
-        fx = K.at<float>(0,0);
-        fy = K.at<float>(1,1);
-        cx = K.at<float>(0,2);
-        cy = K.at<float>(1,2);
-        invfx = 1.0f/fx;
-        invfy = 1.0f/fy;
+    if(features.vuRight.size()==static_cast<size_t>(N) && features.vDepth.size()==static_cast<size_t>(N))
+    {
+        mvuRight = SharedArray<float>(std::move(features.vuRight));
+        mvDepth = SharedArray<float>(std::move(features.vDepth));
+        mbStereo = true;
+    }
+    else
+        SetMonocular();
+
+    mvpMapPoints = vector<MapPoint*>(N,static_cast<MapPoint*>(NULL));
+    mvbOutlier = vector<bool>(N,false);
 
-        mbInitialComputations=false;
+    ComputeCalibration(imGray,*pContext);
+
+    mb = mbf/fx;
+
+    AssignFeaturesToGrid();
+}
+
+Frame::Frame(const Frame &lastFrame, const cv::Mat &imGray, const double &timeStamp, ORBextractor* extractor,
+             const vector<cv::Point2f> &vPredicted, FrameContext* pContext)
+    :mpORBvocabulary(lastFrame.mpORBvocabulary),mpORBextractorLeft(extractor),mpORBextractorRight(static_cast<ORBextractor*>(NULL)),
+     mTimeStamp(timeStamp), mK(lastFrame.mK), mDistCoef(lastFrame.mDistCoef), mbf(lastFrame.mbf), mThDepth(lastFrame.mThDepth),
+     mbFlowTracked(true)
+{
+    // Frame ID
+    mnId=pContext->nNextId++;
+
+    // Scale Level Info
+    mnScaleLevels = mpORBextractorLeft->GetLevels();
+    mfScaleFactor = mpORBextractorLeft->GetScaleFactor();
+    mfLogScaleFactor = log(mfScaleFactor);
+    mvScaleFactors = mpORBextractorLeft->GetScaleFactors();
+    mvInvScaleFactors = mpORBextractorLeft->GetInverseScaleFactors();
+    mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
+    mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
+
+    vector<size_t> vIndices;
+    vector<cv::Point2f> vPrev, vCur;
+    vector<cv::KeyPoint> vKeys;
+    vector<unsigned char> vbTracked;
+    {
+        STAGE_TIMER(FLOW_TRACKING);
+        mpORBextractorLeft->BuildImagePyramid(imGray);
+        mpImagePyramid = mpORBextractorLeft->GetImagePyramid();
+
+        for(int i=0; i<lastFrame.N; i++)
+        {
+            if(!lastFrame.mvpMapPoints[i] || vPredicted[i].x<0)
+                continue;
+            vIndices.push_back(i);
+            vPrev.push_back(lastFrame.mvKeys[i].pt);
+            vCur.push_back(vPredicted[i]);
+        }
+        TrackFeatureFlow(lastFrame.mpImagePyramid->GetImages(),mpImagePyramid->GetImages(),mvScaleFactors,vPrev,vCur,vbTracked);
+    }
+
+    for(size_t j=0; j<vIndices.size(); j++)
+    {
+        if(!vbTracked[j])
+            continue;
+        const size_t i = vIndices[j];
+        cv::KeyPoint kp = lastFrame.mvKeys[i];
+        kp.pt = vCur[j];
+        vKeys.push_back(kp);
+        mvpMapPoints.push_back(lastFrame.mvpMapPoints[i]);
+        mDescriptors.push_back(lastFrame.mDescriptors.row(i));
     }
+    mvKeys = SharedArray<cv::KeyPoint>(std::move(vKeys));
 
+    N = mvKeys.size();
+
+    SetCalibration(*pContext);
     mb = mbf/fx;
 
+    if(N>0)
+        UndistortKeyPoints(*pContext);
+
+    // Set no stereo information
+    SetMonocular();
+
+    mvbOutlier = vector<bool>(N,false);
+
     AssignFeaturesToGrid();
 }
 
 void Frame::AssignFeaturesToGrid()
 {
-    int nReserve = 0.5f*N/(FRAME_GRID_COLS*FRAME_GRID_ROWS);
-    for(unsigned int i=0; i<FRAME_GRID_COLS;i++)
-        for (unsigned int j=0; j<FRAME_GRID_ROWS;j++)
-            mGrid[i][j].reserve(nReserve);
-
+    vector<int> vCells(N,-1);
     for(int i=0;i<N;i++)
     {
         const cv::KeyPoint &kp = mvKeysUn[i];
 
         int nGridPosX, nGridPosY;
         if(PosInGrid(kp,nGridPosX,nGridPosY))
-            mGrid[nGridPosX][nGridPosY].push_back(i);
+            vCells[i] = nGridPosX*FRAME_GRID_ROWS+nGridPosY;
     }
+
+    mpGrid = make_shared<const FeatureGrid>(FRAME_GRID_COLS,FRAME_GRID_ROWS,vCells);
 }
 
 void Frame::ExtractORB(int flag, const cv::Mat &im)
 {
     if(flag==0)
-        (*mpORBextractorLeft)(im,cv::Mat(),mvKeys,mDescriptors);
+    {
+        vector<cv::KeyPoint> vKeys;
+        (*mpORBextractorLeft)(im,cv::Mat(),vKeys,mDescriptors);
+        mvKeys = SharedArray<cv::KeyPoint>(std::move(vKeys));
+
+        // Held, the extractor builds the next image into another pyramid then
+        if(mpORBextractorLeft->KeepsImagePyramid())
+            mpImagePyramid = mpORBextractorLeft->GetImagePyramid();
+    }
     else
         (*mpORBextractorRight)(im,cv::Mat(),mvKeysRight,mDescriptorsRight);
 }
@@ -260,93 +402,97 @@ void Frame::SetPose(cv::Mat Tcw)
 
 void Frame::UpdatePoseMatrices()
 {
-    mRcw = mTcw.rowRange(0,3).colRange(0,3);
-    mRwc = mRcw.t();
-    mtcw = mTcw.rowRange(0,3).col(3);
-    mOw = -mRcw.t()*mtcw;
+    mRcw = Converter::toMatrix3f(mTcw.rowRange(0,3).colRange(0,3));
+    mRwc = mRcw.transpose();
+    mtcw = Converter::toVector3f(mTcw.rowRange(0,3).col(3));
+    mOw = -mRwc*mtcw;
 }
 
-bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
+cv::Mat Frame::GetCameraCenter()
 {
-    pMP->mbTrackInView = false;
-
-    // 3D in absolute coordinates
-    cv::Mat P = pMP->GetWorldPos();
-
-    // 3D in camera coordinates
-    const cv::Mat Pc = mRcw*P+mtcw;
-    const float &PcX = Pc.at<float>(0);
-    const float &PcY= Pc.at<float>(1);
-    const float &PcZ = Pc.at<float>(2);
-
-    // Check positive depth
-    if(PcZ<0.0f)
-        return false;
-
-    // Project in image and check it is not outside
-    const float invz = 1.0f/PcZ;
-    const float u=fx*PcX*invz+cx;
-    const float v=fy*PcY*invz+cy;
-
-    if(u<mnMinX || u>mnMaxX)
-        return false;
-    if(v<mnMinY || v>mnMaxY)
-        return false;
+    return Converter::toCvMat(mOw);
+}
 
-    // Check distance is in the scale invariance region of the MapPoint
-    const float maxDistance = pMP->GetMaxDistanceInvariance();
-    const float minDistance = pMP->GetMinDistanceInvariance();
-    const cv::Mat PO = P-mOw;
-    const float dist = cv::norm(PO);
+cv::Mat Frame::GetRotationInverse()
+{
+    return Converter::toCvMat(mRwc);
+}
 
-    if(dist<minDistance || dist>maxDistance)
-        return false;
+void Frame::ProjectionCache::Clear()
+{
+    vpMapPoints.clear();
+    vu.clear();
+    vv.clear();
+    vuRight.clear();
+    vnLevel.clear();
+    vViewCos.clear();
+}
 
-   // Check viewing angle
-    cv::Mat Pn = pMP->GetNormal();
+void Frame::ProjectLocalMap(const LocalMapGeometry &localMap, const float viewingCosLimit,
+                            const vector<MapPoint*> &vpExcluded)
+{
+    mProjections.Clear();
+    if(localMap.Size()==0)
+        return;
 
-    const float viewCos = PO.dot(Pn)/dist;
+    // The tests of the frustum on whole arrays
+    PointProjection::Camera camera;
+    camera.SetImage(*this);
+    camera.R = mRcw;
+    camera.t = mtcw;
+    camera.fMinViewCos = viewingCosLimit;
 
-    if(viewCos<viewingCosLimit)
-        return false;
-
-    // Predict scale in the image
-    const int nPredictedLevel = pMP->PredictScale(dist,this);
+    static thread_local PointProjection::Visible visible;
+    PointProjection::Project(localMap,camera,visible);
 
     // Data used by the tracking
-    pMP->mbTrackInView = true;
-    pMP->mTrackProjX = u;
-    pMP->mTrackProjXR = u - mbf*invz;
-    pMP->mTrackProjY = v;
-    pMP->mnTrackScaleLevel= nPredictedLevel;
-    pMP->mTrackViewCos = viewCos;
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
+    {
+        MapPoint* pMP = localMap.mvpMapPoints[visible.vnIndex[j]];
+        if(binary_search(vpExcluded.begin(),vpExcluded.end(),pMP))
+            continue;
+        if(pMP->isBad())
+            continue;
 
-    return true;
+        mProjections.vpMapPoints.push_back(pMP);
+        mProjections.vu.push_back(visible.vu[j]);
+        mProjections.vv.push_back(visible.vv[j]);
+        mProjections.vuRight.push_back(visible.vu[j] - mbf*visible.vInvZ[j]);
+        mProjections.vnLevel.push_back(pMP->PredictScale(visible.vDist[j],this));
+        mProjections.vViewCos.push_back(visible.vViewCos[j]);
+    }
 }
 
 vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel, const int maxLevel) const
 {
     vector<size_t> vIndices;
-    vIndices.reserve(N);
+    GetFeaturesInArea(x,y,r,minLevel,maxLevel,vIndices);
+    return vIndices;
+}
+
+void Frame::GetFeaturesInArea(const float &x, const float &y, const float &r, const int minLevel, const int maxLevel,
+                              vector<size_t> &vIndices) const
+{
+    vIndices.clear();
     // FRAME_GRID_COLS = 64
     // FRAME_GRID_COLS = 48
 
     // DLOG(INFO) << "Looking for features in vicinity of : (" << x << ", " << y << ")";
     const int nMinCellX = max(0,(int)floor((x-mnMinX-r)*mfGridElementWidthInv));
     if(nMinCellX>=FRAME_GRID_COLS)
-        return vIndices;
+        return;
 
     const int nMaxCellX = min((int)FRAME_GRID_COLS-1,(int)ceil((x-mnMinX+r)*mfGridElementWidthInv));
     if(nMaxCellX<0)
-        return vIndices;
+        return;
 
     const int nMinCellY = max(0,(int)floor((y-mnMinY-r)*mfGridElementHeightInv));
     if(nMinCellY>=FRAME_GRID_ROWS)
-        return vIndices;
+        return;
 
     const int nMaxCellY = min((int)FRAME_GRID_ROWS-1,(int)ceil((y-mnMinY+r)*mfGridElementHeightInv));
     if(nMaxCellY<0)
-        return vIndices;
+        return;
 
     // DLOG(INFO) << "minCellX: " << nMinCellX << ", minCellY: " << nMinCellY << ", maxCellX: " << nMaxCellX << ", maxCellY: " << nMaxCellY;
     const bool bCheckLevels = (minLevel>0) || (maxLevel>=0);
@@ -355,13 +501,10 @@ vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const f
     {
         for(int iy = nMinCellY; iy<=nMaxCellY; iy++)
         {
-            const vector<size_t> vCell = mGrid[ix][iy];
-            if(vCell.empty())
-                continue;
-
-            for(size_t j=0, jend=vCell.size(); j<jend; j++)
+            const unsigned int* pCellEnd = mpGrid->CellEnd(ix,iy);
+            for(const unsigned int* pIdx=mpGrid->CellBegin(ix,iy); pIdx!=pCellEnd; pIdx++)
             {
-                const cv::KeyPoint &kpUn = mvKeysUn[vCell[j]];
+                const cv::KeyPoint &kpUn = mvKeysUn[*pIdx];
                 if(bCheckLevels)
                 {
                     if(kpUn.octave<minLevel)
@@ -377,12 +520,10 @@ vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const f
                 const float disty = kpUn.pt.y-y;
 
                 if(fabs(distx)<r && fabs(disty)<r)
-                    vIndices.push_back(vCell[j]);
+                    vIndices.push_back(*pIdx);
             }
         }
     }
-
-    return vIndices;
 }
 
 bool Frame::PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY)
@@ -402,12 +543,15 @@ void Frame::ComputeBoW()
 {
     if(mBowVec.empty())
     {
-        vector<cv::Mat> vCurrentDesc = Converter::toDescriptorVector(mDescriptors);
-        mpORBvocabulary->transform(vCurrentDesc,mBowVec,mFeatVec,4);
+        STAGE_TIMER(FRAME_BOW);
+        VocabularyLoader::Wait(mpORBvocabulary);
+        // the descriptor rows are transformed in place, no per row cv::Mat headers needed
+        mpORBvocabulary->transform(mDescriptors.data,mDescriptors.step[0],mDescriptors.rows,mBowVec,mFeatVec,
+                                   mpORBvocabulary->getFeatureVectorLevelsUp());
     }
 }
 
-void Frame::UndistortKeyPoints()
+void Frame::UndistortKeyPoints(const FrameContext &context)
 {
     if(mDistCoef.at<float>(0)==0.0)
     {
@@ -415,6 +559,10 @@ void Frame::UndistortKeyPoints()
         return;
     }
 
+    // The map is only valid if it was built with the current calibration
+    if(!context.mbInitialComputations && !context.mUndistortMapX.empty() && UndistortKeyPointsFromMap(context))
+        return;
+
     // Fill matrix with points
     cv::Mat mat(N,2,CV_32F);
     for(int i=0; i<N; i++)
@@ -429,20 +577,83 @@ void Frame::UndistortKeyPoints()
     mat=mat.reshape(1);
 
     // Fill undistorted keypoint vector
-    mvKeysUn.resize(N);
+    vector<cv::KeyPoint> vKeysUn(N);
     for(int i=0; i<N; i++)
     {
         cv::KeyPoint kp = mvKeys[i];
         kp.pt.x=mat.at<float>(i,0);
         kp.pt.y=mat.at<float>(i,1);
-        mvKeysUn[i]=kp;
+        vKeysUn[i]=kp;
     }
+    mvKeysUn = SharedArray<cv::KeyPoint>(std::move(vKeysUn));
 }
 
-void Frame::ComputeImageBounds(const cv::Mat &imLeft)
+bool Frame::UndistortKeyPointsFromMap(const FrameContext &context)
 {
+    const cv::Mat &mapX = context.mUndistortMapX;
+    const cv::Mat &mapY = context.mUndistortMapY;
+    const int maxX = mapX.cols-1;
+    const int maxY = mapX.rows-1;
+
+    vector<cv::KeyPoint> vKeysUn(mvKeys.begin(),mvKeys.end());
+    for(int i=0; i<N; i++)
+    {
+        const float x = mvKeys[i].pt.x;
+        const float y = mvKeys[i].pt.y;
+        if(x<0 || y<0 || x>maxX || y>maxY)
+            return false;
+
+        const int x0 = min((int)x,maxX-1);
+        const int y0 = min((int)y,maxY-1);
+        const float ax = x-x0;
+        const float ay = y-y0;
+
+        const float* pX0 = mapX.ptr<float>(y0)+x0;
+        const float* pX1 = mapX.ptr<float>(y0+1)+x0;
+        const float* pY0 = mapY.ptr<float>(y0)+x0;
+        const float* pY1 = mapY.ptr<float>(y0+1)+x0;
+
+        vKeysUn[i].pt.x = (1-ay)*((1-ax)*pX0[0]+ax*pX0[1]) + ay*((1-ax)*pX1[0]+ax*pX1[1]);
+        vKeysUn[i].pt.y = (1-ay)*((1-ax)*pY0[0]+ax*pY0[1]) + ay*((1-ax)*pY1[0]+ax*pY1[1]);
+    }
+    mvKeysUn = SharedArray<cv::KeyPoint>(std::move(vKeysUn));
+    return true;
+}
+
+void Frame::ComputeImageBounds(const cv::Mat &imLeft, FrameContext &context)
+{
+    cv::Mat &mapX = context.mUndistortMapX;
+    cv::Mat &mapY = context.mUndistortMapY;
+    mapX.release();
+    mapY.release();
+
     if(mDistCoef.at<float>(0)!=0.0)
     {
+        // Undistort every pixel once, the keypoints of the following frames are interpolated
+        const int nCols = imLeft.cols+1;
+        const int nRows = imLeft.rows+1;
+        cv::Mat grid(nRows*nCols,1,CV_32FC2);
+        for(int y=0; y<nRows; y++)
+        {
+            for(int x=0; x<nCols; x++)
+                grid.at<cv::Vec2f>(y*nCols+x) = cv::Vec2f(x,y);
+        }
+        cv::undistortPoints(grid,grid,mK,mDistCoef,cv::Mat(),mK);
+
+        mapX.create(nRows,nCols,CV_32F);
+        mapY.create(nRows,nCols,CV_32F);
+        for(int y=0; y<nRows; y++)
+        {
+            float* pX = mapX.ptr<float>(y);
+            float* pY = mapY.ptr<float>(y);
+            for(int x=0; x<nCols; x++)
+            {
+                const cv::Vec2f &p = grid.at<cv::Vec2f>(y*nCols+x);
+                pX[x] = p[0];
+                pY[x] = p[1];
+            }
+        }
+
         cv::Mat mat(4,2,CV_32F);
         mat.at<float>(0,0)=0.0; mat.at<float>(0,1)=0.0;
         mat.at<float>(1,0)=imLeft.cols; mat.at<float>(1,1)=0.0;
@@ -454,220 +665,124 @@ void Frame::ComputeImageBounds(const cv::Mat &imLeft)
         cv::undistortPoints(mat,mat,mK,mDistCoef,cv::Mat(),mK);
         mat=mat.reshape(1);
 
-        mnMinX = min(mat.at<float>(0,0),mat.at<float>(2,0));
-        mnMaxX = max(mat.at<float>(1,0),mat.at<float>(3,0));
-        mnMinY = min(mat.at<float>(0,1),mat.at<float>(1,1));
-        mnMaxY = max(mat.at<float>(2,1),mat.at<float>(3,1));
+        context.mnMinX = min(mat.at<float>(0,0),mat.at<float>(2,0));
+        context.mnMaxX = max(mat.at<float>(1,0),mat.at<float>(3,0));
+        context.mnMinY = min(mat.at<float>(0,1),mat.at<float>(1,1));
+        context.mnMaxY = max(mat.at<float>(2,1),mat.at<float>(3,1));
         // DLOG(INFO) << "Size of distorted image: " << imLeft.cols << " x " << imLeft.rows;
         // DLOG(INFO) << "Size of undistorted image: " << mnMaxX - mnMinX << "x" << mnMaxY - mnMinY;
     }
     else
     {
-        mnMinX = 0.0f;
-        mnMaxX = imLeft.cols;
-        mnMinY = 0.0f;
-        mnMaxY = imLeft.rows;
+        context.mnMinX = 0.0f;
+        context.mnMaxX = imLeft.cols;
+        context.mnMinY = 0.0f;
+        context.mnMaxY = imLeft.rows;
     }
 }
 
-void Frame::ComputeStereoMatches()
+void Frame::ComputeCalibration(const cv::Mat &im, FrameContext &context)
 {
-    mvuRight = vector<float>(N,-1.0f);
-    mvDepth = vector<float>(N,-1.0f);
-
-    const int thOrbDist = (ORBmatcher::TH_HIGH+ORBmatcher::TH_LOW)/2; //param
-
-    const int nRows = mpORBextractorLeft->mvImagePyramid[0].rows;
-
-    //Assign keypoints to row table
-    vector<vector<size_t> > vRowIndices(nRows,vector<size_t>());
-
-    for(int i=0; i<nRows; i++)
-        vRowIndices[i].reserve(200);
-
-    const int Nr = mvKeysRight.size();
-
-    for(int iR=0; iR<Nr; iR++)
-    {
-        const cv::KeyPoint &kp = mvKeysRight[iR];
-        const float &kpY = kp.pt.y;
-        const float r = 2.0f*mvScaleFactors[mvKeysRight[iR].octave];
-        const int maxr = ceil(kpY+r);
-        const int minr = floor(kpY-r);
-
-        for(int yi=minr;yi<=maxr;yi++)
-            vRowIndices[yi].push_back(iR);
-    }
-
-    // Set limits for search
-    const float minZ = mb;
-    const float minD = 0;
-    const float maxD = mbf/minZ;
-
-    // For each left keypoint search a match in the right image
-    vector<pair<int, int> > vDistIdx;
-    vDistIdx.reserve(N);
-
-    for(int iL=0; iL<N; iL++)
+    // This is done only for the first Frame (or after a change in the calibration)
+    if(context.mbInitialComputations)
     {
-        const cv::KeyPoint &kpL = mvKeys[iL];
-        const int &levelL = kpL.octave;
-        const float &vL = kpL.pt.y;
-        const float &uL = kpL.pt.x;
+        ComputeImageBounds(im,context);
 
-        const vector<size_t> &vCandidates = vRowIndices[vL];
-
-        if(vCandidates.empty())
-            continue;
-
-        const float minU = uL-maxD;
-        const float maxU = uL-minD;
-
-        if(maxU<0)
-            continue;
-
-        int bestDist = ORBmatcher::TH_HIGH; //param
-        size_t bestIdxR = 0;
-
-        const cv::Mat &dL = mDescriptors.row(iL);
-
-        // Compare descriptor to right keypoints
-        for(size_t iC=0; iC<vCandidates.size(); iC++)
-        {
-            const size_t iR = vCandidates[iC];
-            const cv::KeyPoint &kpR = mvKeysRight[iR];
+        context.mfGridElementWidthInv=static_cast<float>(FRAME_GRID_COLS)/static_cast<float>(context.mnMaxX-context.mnMinX);
+        context.mfGridElementHeightInv=static_cast<float>(FRAME_GRID_ROWS)/static_cast<float>(context.mnMaxY-context.mnMinY);
 
-            if(kpR.octave<levelL-1 || kpR.octave>levelL+1)
-                continue;
-
-            const float &uR = kpR.pt.x;
-
-            if(uR>=minU && uR<=maxU)
-            {
-                const cv::Mat &dR = mDescriptorsRight.row(iR);
-                const int dist = ORBmatcher::DescriptorDistance(dL,dR);
-
-                if(dist<bestDist)
-                {
-                    bestDist = dist;
-                    bestIdxR = iR;
-                }
-            }
-        }
-
-        // Subpixel match by correlation
-        if(bestDist<thOrbDist)
-        {
-            // coordinates in image pyramid at keypoint scale
-            const float uR0 = mvKeysRight[bestIdxR].pt.x;
-            const float scaleFactor = mvInvScaleFactors[kpL.octave];
-            const float scaleduL = round(kpL.pt.x*scaleFactor);
-            const float scaledvL = round(kpL.pt.y*scaleFactor);
-            const float scaleduR0 = round(uR0*scaleFactor);
-
-            // sliding window search
-            const int w = 5; //param
-            cv::Mat IL = mpORBextractorLeft->mvImagePyramid[kpL.octave].rowRange(scaledvL-w,scaledvL+w+1).colRange(scaleduL-w,scaleduL+w+1);
-            IL.convertTo(IL,CV_32F);
-            IL = IL - IL.at<float>(w,w) *cv::Mat::ones(IL.rows,IL.cols,CV_32F);
-
-            int bestDist = INT_MAX;
-            int bestincR = 0;
-            const int L = 5; //param
-            vector<float> vDists;
-            vDists.resize(2*L+1);
-
-            const float iniu = scaleduR0+L-w;
-            const float endu = scaleduR0+L+w+1;
-            if(iniu<0 || endu >= mpORBextractorRight->mvImagePyramid[kpL.octave].cols)
-                continue;
-
-            for(int incR=-L; incR<=+L; incR++)
-            {
-                cv::Mat IR = mpORBextractorRight->mvImagePyramid[kpL.octave].rowRange(scaledvL-w,scaledvL+w+1).colRange(scaleduR0+incR-w,scaleduR0+incR+w+1);
-                IR.convertTo(IR,CV_32F);
-                IR = IR - IR.at<float>(w,w) *cv::Mat::ones(IR.rows,IR.cols,CV_32F);
+        context.fx = mK.at<float>(0,0);
+        context.fy = mK.at<float>(1,1);
+        context.cx = mK.at<float>(0,2);
+        context.cy = mK.at<float>(1,2);
+        context.invfx = 1.0f/context.fx;
+        context.invfy = 1.0f/context.fy;
 
-                float dist = cv::norm(IL,IR,cv::NORM_L1);
-                if(dist<bestDist)
-                {
-                    bestDist =  dist;
-                    bestincR = incR;
-                }
-
-                vDists[L+incR] = dist;
-            }
-
-            if(bestincR==-L || bestincR==L)
-                continue;
+        context.mbInitialComputations=false;
+    }
 
-            // Sub-pixel match (Parabola fitting)
-            const float dist1 = vDists[L+bestincR-1];
-            const float dist2 = vDists[L+bestincR];
-            const float dist3 = vDists[L+bestincR+1];
+    SetCalibration(context);
+}
 
-            const float deltaR = (dist1-dist3)/(2.0f*(dist1+dist3-2.0f*dist2));
+void Frame::SetCalibration(const FrameContext &context)
+{
+    fx = context.fx;
+    fy = context.fy;
+    cx = context.cx;
+    cy = context.cy;
+    invfx = context.invfx;
+    invfy = context.invfy;
+    mnMinX = context.mnMinX;
+    mnMaxX = context.mnMaxX;
+    mnMinY = context.mnMinY;
+    mnMaxY = context.mnMaxY;
+    mfGridElementWidthInv = context.mfGridElementWidthInv;
+    mfGridElementHeightInv = context.mfGridElementHeightInv;
+}
 
-            if(deltaR<-1 || deltaR>1)
-                continue;
+void Frame::SetMonocular()
+{
+    // One array of -1 for both
+    mvuRight = SharedArray<float>(vector<float>(N,-1));
+    mvDepth = mvuRight;
+}
 
-            // Re-scaled coordinate
-            float bestuR = mvScaleFactors[kpL.octave]*((float)scaleduR0+(float)bestincR+deltaR);
+void Frame::ComputeStereoMatches(ThreadPool* pThreadPool)
+{
+    STAGE_TIMER(STEREO_MATCHING);
+
+    // The pyramids of the extraction, not rebuilt for the SAD
+    StereoMatcher matcher(mvKeys,mDescriptors,mpORBextractorLeft->GetImagePyramid()->GetImages(),
+                          mvKeysRight,mDescriptorsRight,mpORBextractorRight->GetImagePyramid()->GetImages(),
+                          mvScaleFactors,mvInvScaleFactors,mbf,mb);
+    vector<float> vuRight, vDepth;
+    matcher.Match(vuRight,vDepth,pThreadPool);
+    mvuRight = SharedArray<float>(std::move(vuRight));
+    mvDepth = SharedArray<float>(std::move(vDepth));
+    mbStereo = true;
+}
 
-            float disparity = (uL-bestuR);
 
-            if(disparity>=minD && disparity<maxD)
-            {
-                if(disparity<=0)
-                {
-                    disparity=0.01;
-                    bestuR = uL-0.01;
-                }
-                mvDepth[iL]=mbf/disparity;
-                mvuRight[iL] = bestuR;
-                vDistIdx.push_back(pair<int,int>(bestDist,iL));
-            }
-        }
-    }
+void Frame::ComputeStereoFromRGBD(const cv::Mat &imDepth, const float depthMapFactor, const int nFilterRadius)
+{
+    STAGE_TIMER(STEREO_MATCHING);
 
-    sort(vDistIdx.begin(),vDistIdx.end());
-    const float median = vDistIdx[vDistIdx.size()/2].first;
-    const float thDist = 1.5f*1.4f*median; //param
+    vector<float> vuRight(N,-1), vDepth(N,-1);
+    mbStereo = true;
 
-    for(int i=vDistIdx.size()-1;i>=0;i--)
+    // Other types are converted as a whole
+    cv::Mat imConverted;
+    float factor = depthMapFactor;
+    if(imDepth.type()!=CV_16U && imDepth.type()!=CV_32F)
     {
-        if(vDistIdx[i].first<thDist)
-            break;
-        else
-        {
-            mvuRight[vDistIdx[i].second]=-1;
-            mvDepth[vDistIdx[i].second]=-1;
-        }
+        imDepth.convertTo(imConverted,CV_32F,depthMapFactor);
+        factor = 1.0f;
     }
-}
-
+    const cv::Mat &im = imConverted.empty() ? imDepth : imConverted;
+    const bool b16U = im.type()==CV_16U;
 
-void Frame::ComputeStereoFromRGBD(const cv::Mat &imDepth)
-{
-    mvuRight = vector<float>(N,-1);
-    mvDepth = vector<float>(N,-1);
+    vector<float> vWindow;
+    vWindow.reserve((2*nFilterRadius+1)*(2*nFilterRadius+1));
 
     for(int i=0; i<N; i++)
     {
         const cv::KeyPoint &kp = mvKeys[i];
         const cv::KeyPoint &kpU = mvKeysUn[i];
 
-        const float &v = kp.pt.y;
-        const float &u = kp.pt.x;
+        const int v = kp.pt.y;
+        const int u = kp.pt.x;
 
-        const float d = imDepth.at<float>(v,u);
+        const float d = b16U ? SampleDepth<unsigned short>(im,u,v,factor,nFilterRadius,vWindow)
+                             : SampleDepth<float>(im,u,v,factor,nFilterRadius,vWindow);
 
         if(d>0)
         {
-            mvDepth[i] = d;
-            mvuRight[i] = kpU.pt.x-mbf/d;
+            vDepth[i] = d;
+            vuRight[i] = kpU.pt.x-mbf/d;
         }
     }
+    mvuRight = SharedArray<float>(std::move(vuRight));
+    mvDepth = SharedArray<float>(std::move(vDepth));
 }
 
 cv::Mat Frame::UnprojectStereo(const int &i)
@@ -679,8 +794,8 @@ cv::Mat Frame::UnprojectStereo(const int &i)
         const float v = mvKeysUn[i].pt.y;
         const float x = (u-cx)*z*invfx;
         const float y = (v-cy)*z*invfy;
-        cv::Mat x3Dc = (cv::Mat_<float>(3,1) << x, y, z);
-        return mRwc*x3Dc+mOw;
+        const Eigen::Vector3f x3Dc(x,y,z);
+        return Converter::toCvMat(Eigen::Vector3f(mRwc*x3Dc+mOw));
     }
     else
         return cv::Mat();
@@ -0,0 +1,79 @@
+#include "FrameAdmission.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const double SMOOTHING = 0.2; //param weight of the last image in the smoothed frame time
+// Timestamps further apart are a gap of the input (a pause of a replay, a dropped camera),
+// not the time the system had for the backlog
+const double MAX_INTERVAL = 1.0; //param seconds
+}
+
+FrameAdmission::FrameAdmission(const double budget, const int nMaxSkipped):
+    mfBudget(budget), mnMaxSkipped(nMaxSkipped)
+{
+    Reset();
+}
+
+bool FrameAdmission::Admit(const double timestamp)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    if(mfLastTimestamp>=0 && timestamp>mfLastTimestamp)
+    {
+        const double interval = timestamp-mfLastTimestamp;
+        mfBacklog = interval<MAX_INTERVAL ? max(mfBacklog-interval,0.0) : 0;
+    }
+    mfLastTimestamp = timestamp;
+
+    bool bAdmit = true;
+    if(mbCanSkip && mnSkippedInRow<mnMaxSkipped && mfFrameTime>=0)
+    {
+        if(mbKeyFrameLikely)
+            bAdmit = mfBacklog<=mfBudget;
+        else
+            bAdmit = mfBacklog+mfFrameTime<=mfBudget;
+    }
+
+    mnSkippedInRow = bAdmit ? 0 : mnSkippedInRow+1;
+    return bAdmit;
+}
+
+void FrameAdmission::AddTracking(const double time, const bool bCanSkip, const bool bKeyFrameLikely)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    mfBacklog += time;
+    if(mfFrameTime<0)
+        mfFrameTime = time;
+    else
+        mfFrameTime += SMOOTHING*(time-mfFrameTime);
+
+    mbCanSkip = bCanSkip;
+    mbKeyFrameLikely = bKeyFrameLikely;
+}
+
+double FrameAdmission::GetBacklog()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mfBacklog;
+}
+
+void FrameAdmission::Reset()
+{
+    unique_lock<mutex> lock(mMutex);
+    mfBacklog = 0;
+    mfFrameTime = -1;
+    mfLastTimestamp = -1;
+    mnSkippedInRow = 0;
+    mbCanSkip = false;
+    mbKeyFrameLikely = false;
+}
+
+} //namespace ORB_SLAM
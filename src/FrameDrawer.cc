@@ -31,144 +31,80 @@ namespace ORB_SLAM2
 
 FrameDrawer::FrameDrawer(Map* pMap)
     : mpMap(pMap)
+    , mnPublished(0)
+    , mnDrawn(0)
     , mFrameCounter(0)
     , mFrameCount(0)
 {
-    mState=Tracking::SYSTEM_NOT_READY;
-    mIm = cv::Mat(480,640,CV_8UC3, cv::Scalar(0,0,0));
+    shared_ptr<Snapshot> pFrame = make_shared<Snapshot>();
+    pFrame->nId=0;
+    pFrame->state=Tracking::SYSTEM_NOT_READY;
+    pFrame->bOnlyTracking=false;
+    pFrame->im = cv::Mat(480,640,CV_8UC3, cv::Scalar(0,0,0));
+    mpFront = pFrame;
 }
 
 cv::Mat FrameDrawer::DrawFrame()
 {
+    shared_ptr<const Snapshot> pFrame = atomic_load(&mpFront);
+
     // If there was no update yet simply return the lastFrame
     // avoids redrawing the same frame over and over
-    if(!mWasUpdated && !mLastIm.empty())
+    if(pFrame->nId==mnDrawn && !mLastIm.empty())
     {
         // DLOG(WARNING) << "FPS set higher than tracking can compute the frames";
         return mLastIm;
     }
+    mnDrawn = pFrame->nId;
 
     mFrameCounter++;
 
-    cv::Mat im;
-    vector<cv::KeyPoint> vIniKeys; // Initialization: KeyPoints in reference frame
-    vector<int> vMatches; // Initialization: correspondeces with reference keypoints
-    vector<cv::KeyPoint> vCurrentKeys; // KeyPoints in current frame
-    vector<bool> vbVO, vbMap; // Tracked MapPoints in current frame
-    int state; // Tracking state
-
-
-    //Copy variables within scoped mutex
-    {
-        unique_lock<mutex> lock(mMutex);
-        state=mState;
-        if(mState==Tracking::SYSTEM_NOT_READY)
-            mState=Tracking::NO_IMAGES_YET;
+    const Snapshot &frame = *pFrame;
 
-        mIm.copyTo(im);
-
-        if(mState==Tracking::NOT_INITIALIZED)
-        {
-            vCurrentKeys = mvCurrentKeys;
-            vIniKeys = mvIniKeys;
-            vMatches = mvIniMatches;
-        }
-        else if(mState==Tracking::OK)
-        {
-            vCurrentKeys = mvCurrentKeys;
-            vbVO = mvbVO;
-            vbMap = mvbMap;
-        }
-        else if(mState==Tracking::LOST)
-        {
-            vCurrentKeys = mvCurrentKeys;
-        }
-    } // destroy scoped mutex -> release mutex
-
-    if(im.channels()<3) //this should be always true
-        cvtColor(im,im,CV_GRAY2BGR);
+    // The image belongs to the snapshot, drawing needs a copy
+    cv::Mat im;
+    if(frame.im.channels()<3) //this should be always true
+        cvtColor(frame.im,im,CV_GRAY2BGR);
+    else
+        frame.im.copyTo(im);
 
     //Draw
-    if(state==Tracking::NOT_INITIALIZED) //INITIALIZING
+    if(frame.state==Tracking::NOT_INITIALIZED) //INITIALIZING
     {
-        for(unsigned int i=0; i<vMatches.size(); i++)
-        {
-            if(vMatches[i]>=0)
-            {
-                cv::line(im,vIniKeys[i].pt,vCurrentKeys[vMatches[i]].pt,
-                        cv::Scalar(0,255,0));
-            }
-        }
-        // const float r = 5;
-        // draw all found points even if not initialized
-        // for (int i = 0; i < vCurrentKeys.size(); i++) {
-        //       // cv::rectangle(im,pt1,pt2,cv::Scalar(0,0,255));
-        //       cv::Point2f pt1,pt2;
-        //       pt1.x=vCurrentKeys[i].pt.x-r;
-        //       pt1.y=vCurrentKeys[i].pt.y-r;
-        //       pt2.x=vCurrentKeys[i].pt.x+r;
-        //       pt2.y=vCurrentKeys[i].pt.y+r;
-        //
-        //       cv::circle(im,vCurrentKeys[i].pt,2,cv::Scalar(0,0,255),-1);
-        // }
+        for(size_t i=0; i<frame.vIniLines.size(); i++)
+            cv::line(im,frame.vIniLines[i].first,frame.vIniLines[i].second,cv::Scalar(0,255,0));
     }
-    else if(state==Tracking::OK) //TRACKING
+    else if(frame.state==Tracking::OK) //TRACKING
     {
-        mnTracked=0;
-        mnTrackedVO=0;
         const float r = 5;
-        const int n = vCurrentKeys.size();
-        for(int i=0;i<n;i++)
+        // This is a match to a MapPoint in the map
+        for(size_t i=0; i<frame.vMap.size(); i++)
         {
-            if(vbVO[i] || vbMap[i])
-            {
-                cv::Point2f pt1,pt2;
-                pt1.x=vCurrentKeys[i].pt.x-r;
-                pt1.y=vCurrentKeys[i].pt.y-r;
-                pt2.x=vCurrentKeys[i].pt.x+r;
-                pt2.y=vCurrentKeys[i].pt.y+r;
-
-                // This is a match to a MapPoint in the map
-                if(vbMap[i])
-                {
-                    cv::rectangle(im,pt1,pt2,cv::Scalar(0,255,0));
-                    cv::circle(im,vCurrentKeys[i].pt,2,cv::Scalar(0,255,0),-1);
-                    mnTracked++;
-                }
-                else // This is match to a "visual odometry" MapPoint created in the last frame
-                {
-                    cv::rectangle(im,pt1,pt2,cv::Scalar(255,0,0));
-                    cv::circle(im,vCurrentKeys[i].pt,2,cv::Scalar(255,0,0),-1);
-                    mnTrackedVO++;
-                }
-            }
-            // else
-            // {
-            //   // This is not a match at all
-            //   // cv::rectangle(im,pt1,pt2,cv::Scalar(0,0,255));
-            //   cv::Point2f pt1,pt2;
-            //   pt1.x=vCurrentKeys[i].pt.x-r;
-            //   pt1.y=vCurrentKeys[i].pt.y-r;
-            //   pt2.x=vCurrentKeys[i].pt.x+r;
-            //   pt2.y=vCurrentKeys[i].pt.y+r;
-            //
-            //   cv::circle(im,vCurrentKeys[i].pt,2,cv::Scalar(0,0,255),-1);
-            // }
+            const cv::Point2f &pt = frame.vMap[i];
+            cv::rectangle(im,cv::Point2f(pt.x-r,pt.y-r),cv::Point2f(pt.x+r,pt.y+r),cv::Scalar(0,255,0));
+            cv::circle(im,pt,2,cv::Scalar(0,255,0),-1);
+        }
+        // This is match to a "visual odometry" MapPoint created in the last frame
+        for(size_t i=0; i<frame.vVO.size(); i++)
+        {
+            const cv::Point2f &pt = frame.vVO[i];
+            cv::rectangle(im,cv::Point2f(pt.x-r,pt.y-r),cv::Point2f(pt.x+r,pt.y+r),cv::Scalar(255,0,0));
+            cv::circle(im,pt,2,cv::Scalar(255,0,0),-1);
         }
     }
 
     cv::Mat imWithInfo;
-    DrawTextInfo(im,state, imWithInfo);
+    DrawTextInfo(im,frame,imWithInfo);
 
-    mWasUpdated = false;
     mLastIm = imWithInfo;
 
     return imWithInfo;
 }
 
 
-void FrameDrawer::DrawTextInfo(cv::Mat &im, int nState, cv::Mat &imText)
+void FrameDrawer::DrawTextInfo(cv::Mat &im, const Snapshot &frame, cv::Mat &imText)
 {
+    const int nState = frame.state;
     stringstream s;
     if(nState==Tracking::NO_IMAGES_YET)
         s << " WAITING FOR IMAGES";
@@ -176,15 +112,15 @@ void FrameDrawer::DrawTextInfo(cv::Mat &im, int nState, cv::Mat &imText)
         s << " TRYING TO INITIALIZE ";
     else if(nState==Tracking::OK)
     {
-        if(!mbOnlyTracking)
+        if(!frame.bOnlyTracking)
             s << "SLAM MODE |  ";
         else
             s << "LOCALIZATION | ";
         int nKFs = mpMap->KeyFramesInMap();
         int nMPs = mpMap->MapPointsInMap();
-        s << "KFs: " << nKFs << ", MPs: " << nMPs << ", Matches: " << mnTracked;
-        if(mnTrackedVO>0)
-            s << ", + VO matches: " << mnTrackedVO;
+        s << "KFs: " << nKFs << ", MPs: " << nMPs << ", Matches: " << frame.vMap.size();
+        if(!frame.vVO.empty())
+            s << ", + VO matches: " << frame.vVO.size();
         if(mFrameCount > 0)
         {
             s << ", Frame: " << mFrameCounter << "/" << mFrameCount;
@@ -211,39 +147,55 @@ void FrameDrawer::DrawTextInfo(cv::Mat &im, int nState, cv::Mat &imText)
 
 void FrameDrawer::Update(Tracking *pTracker)
 {
-    unique_lock<mutex> lock(mMutex);
-    pTracker->mImGray.copyTo(mIm);
-    mvCurrentKeys=pTracker->mCurrentFrame.mvKeys;
-    N = mvCurrentKeys.size();
-    mvbVO = vector<bool>(N,false);
-    mvbMap = vector<bool>(N,false);
-    mbOnlyTracking = pTracker->mbOnlyTracking;
-
-
+    // Refill the snapshot swapped out by the last Update unless the viewer still draws it
+    if(!mpBack || mpBack.use_count()>1)
+        mpBack = make_shared<Snapshot>();
+    Snapshot &frame = *mpBack;
+
+    frame.nId = ++mnPublished;
+    // Images someone else may still write to are copied
+    if(pTracker->mbImGrayOwned)
+        frame.im = pTracker->mImGray;
+    else
+        frame.im = pTracker->mImGray.clone();
+    frame.state = static_cast<int>(pTracker->mLastProcessedState);
+    frame.bOnlyTracking = pTracker->mbOnlyTracking;
+    frame.vIniLines.clear();
+    frame.vMap.clear();
+    frame.vVO.clear();
+
+    const Frame &F = pTracker->mCurrentFrame;
     if(pTracker->mLastProcessedState==Tracking::NOT_INITIALIZED)
     {
-        mvIniKeys=pTracker->mInitialFrame.mvKeys;
-        mvIniMatches=pTracker->mvIniMatches;
+        const SharedArray<cv::KeyPoint> &vIniKeys = pTracker->mInitialFrame.mvKeys;
+        const vector<int> &vMatches = pTracker->mvIniMatches;
+        for(size_t i=0; i<vMatches.size(); i++)
+        {
+            if(vMatches[i]>=0)
+                frame.vIniLines.push_back(make_pair(vIniKeys[i].pt,F.mvKeys[vMatches[i]].pt));
+        }
     }
     else if(pTracker->mLastProcessedState==Tracking::OK)
     {
-        for(int i=0;i<N;i++)
+        for(int i=0;i<F.N;i++)
         {
-            MapPoint* pMP = pTracker->mCurrentFrame.mvpMapPoints[i];
+            MapPoint* pMP = F.mvpMapPoints[i];
             if(pMP)
             {
-                if(!pTracker->mCurrentFrame.mvbOutlier[i])
+                if(!F.mvbOutlier[i])
                 {
                     if(pMP->Observations()>0)
-                        mvbMap[i]=true;
+                        frame.vMap.push_back(F.mvKeys[i].pt);
                     else
-                        mvbVO[i]=true;
+                        frame.vVO.push_back(F.mvKeys[i].pt);
                 }
             }
         }
     }
-    mState=static_cast<int>(pTracker->mLastProcessedState);
-    mWasUpdated = true;
+
+    // Publish, the snapshot before becomes the next one to fill
+    shared_ptr<const Snapshot> pPublished = atomic_exchange(&mpFront,shared_ptr<const Snapshot>(mpBack));
+    mpBack = const_pointer_cast<Snapshot>(pPublished);
 }
 
 void FrameDrawer::setFrameCount(const int& frameCount)
@@ -0,0 +1,116 @@
+#include "GridDistribution.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Features one bucket of the grid keeps at first
+const int FEATURES_PER_BUCKET = 2; //param
+}
+
+void GridDistribution::Distribute(const vector<cv::KeyPoint> &vKeys, const int minX, const int maxX,
+                                  const int minY, const int maxY, const int N, vector<cv::KeyPoint> &vResult)
+{
+    vResult.clear();
+    const int nKeys = vKeys.size();
+    if(N<=0 || nKeys==0)
+        return;
+
+    // Nothing to choose from, as the octree which keeps every corner in its own node
+    if(nKeys<=N)
+    {
+        vResult = vKeys;
+        return;
+    }
+
+    // Buckets about square, as many as the features allow
+    const float width = max(maxX-minX,1);
+    const float height = max(maxY-minY,1);
+    const int nWanted = max(N/FEATURES_PER_BUCKET,1);
+    const int nCols = max(static_cast<int>(round(sqrt(nWanted*width/height))),1);
+    const int nRows = max(static_cast<int>(round(static_cast<float>(nWanted)/nCols)),1);
+    const int nBuckets = nCols*nRows;
+    const float invW = nCols/width;
+    const float invH = nRows/height;
+    const int nQuota = max(N/nBuckets,1);
+
+    // Group the keypoints by bucket, in their order
+    mvBucketOfKey.resize(nKeys);
+    mvBucketStart.assign(nBuckets+1,0);
+    for(int i=0; i<nKeys; i++)
+    {
+        const cv::Point2f &pt = vKeys[i].pt;
+        const int bx = min(max(static_cast<int>(pt.x*invW),0),nCols-1);
+        const int by = min(max(static_cast<int>(pt.y*invH),0),nRows-1);
+        const int bucket = by*nCols+bx;
+        mvBucketOfKey[i] = bucket;
+        mvBucketStart[bucket+1]++;
+    }
+    for(int b=0; b<nBuckets; b++)
+        mvBucketStart[b+1] += mvBucketStart[b];
+    mvPos.assign(mvBucketStart.begin(),mvBucketStart.end()-1);
+    mvCandidates.resize(nKeys);
+    for(int i=0; i<nKeys; i++)
+    {
+        Candidate &c = mvCandidates[mvPos[mvBucketOfKey[i]]++];
+        c.response = vKeys[i].response;
+        c.index = i;
+    }
+
+    // The strongest of every bucket
+    mvSelected.clear();
+    mvRest.clear();
+    for(int b=0; b<nBuckets; b++)
+    {
+        vector<Candidate>::iterator begin = mvCandidates.begin()+mvBucketStart[b];
+        vector<Candidate>::iterator end = mvCandidates.begin()+mvBucketStart[b+1];
+        if(end-begin>nQuota)
+        {
+            nth_element(begin,begin+nQuota,end);
+            mvRest.insert(mvRest.end(),begin+nQuota,end);
+            end = begin+nQuota;
+        }
+        for(vector<Candidate>::iterator it=begin; it!=end; it++)
+            mvSelected.push_back(it->index);
+    }
+
+    // Rounding of the grid may give more buckets than features, the weakest are dropped. Otherwise
+    // the strongest of the rest fill up the budget.
+    const int nSelected = mvSelected.size();
+    if(nSelected>N)
+    {
+        mvRest.clear();
+        for(int i=0; i<nSelected; i++)
+        {
+            Candidate c;
+            c.response = vKeys[mvSelected[i]].response;
+            c.index = mvSelected[i];
+            mvRest.push_back(c);
+        }
+        nth_element(mvRest.begin(),mvRest.begin()+N,mvRest.end());
+        for(int i=0; i<N; i++)
+            mvSelected[i] = mvRest[i].index;
+        mvSelected.resize(N);
+    }
+    else if(nSelected<N && !mvRest.empty())
+    {
+        const int nTopUp = min(N-nSelected,static_cast<int>(mvRest.size()));
+        nth_element(mvRest.begin(),mvRest.begin()+nTopUp,mvRest.end());
+        for(int i=0; i<nTopUp; i++)
+            mvSelected.push_back(mvRest[i].index);
+    }
+
+    // In the order the corners were found
+    sort(mvSelected.begin(),mvSelected.end());
+    vResult.reserve(mvSelected.size());
+    for(size_t i=0; i<mvSelected.size(); i++)
+        vResult.push_back(vKeys[mvSelected[i]]);
+}
+
+} //namespace ORB_SLAM
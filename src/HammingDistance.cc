@@ -0,0 +1,207 @@
+#include "HammingDistance.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAMMING_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAMMING_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+
+typedef int (*DistanceKernel)(const uint8_t*, const uint8_t*);
+typedef void (*BatchKernel)(const uint8_t*, const uint8_t*, const size_t, const size_t*, const size_t, int*);
+
+struct Kernel
+{
+    const char* name;
+    DistanceKernel distance;
+    BatchKernel batch;
+};
+
+// ---------------------------------------------------------------------------------------
+// scalar
+// ---------------------------------------------------------------------------------------
+
+inline int DistanceScalar(const uint8_t* a, const uint8_t* b)
+{
+    uint64_t wa[4];
+    uint64_t wb[4];
+    memcpy(wa, a, sizeof(wa));
+    memcpy(wb, b, sizeof(wb));
+
+    return __builtin_popcountll(wa[0]^wb[0]) + __builtin_popcountll(wa[1]^wb[1]) +
+           __builtin_popcountll(wa[2]^wb[2]) + __builtin_popcountll(wa[3]^wb[3]);
+}
+
+void BatchScalar(const uint8_t* query, const uint8_t* block, const size_t step,
+                 const size_t* indices, const size_t n, int* distances)
+{
+    for(size_t i=0; i<n; i++)
+        distances[i] = DistanceScalar(query, block + indices[i]*step);
+}
+
+#ifdef HAMMING_X86
+
+// ---------------------------------------------------------------------------------------
+// AVX2, popcount with a nibble lookup table (pshufb) and horizontal sum with psadbw
+// ---------------------------------------------------------------------------------------
+
+__attribute__((target("avx2")))
+inline int DistanceAVX2Reg(const __m256i q, const uint8_t* b)
+{
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+
+    const __m256i v = _mm256_xor_si256(q, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)));
+    const __m256i lo = _mm256_and_si256(v, lowMask);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+    const __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    const __m256i sum = _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+
+    const __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    return _mm_cvtsi128_si32(s) + _mm_extract_epi32(s, 2);
+}
+
+__attribute__((target("avx2")))
+int DistanceAVX2(const uint8_t* a, const uint8_t* b)
+{
+    return DistanceAVX2Reg(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)), b);
+}
+
+__attribute__((target("avx2")))
+void BatchAVX2(const uint8_t* query, const uint8_t* block, const size_t step,
+               const size_t* indices, const size_t n, int* distances)
+{
+    const __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query));
+    for(size_t i=0; i<n; i++)
+        distances[i] = DistanceAVX2Reg(q, block + indices[i]*step);
+}
+
+// ---------------------------------------------------------------------------------------
+// AVX-512 VPOPCNTDQ, two candidates per 512 bit register
+// ---------------------------------------------------------------------------------------
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+int DistanceAVX512(const uint8_t* a, const uint8_t* b)
+{
+    const __m512i va = _mm512_maskz_loadu_epi64(0x0f, a);
+    const __m512i vb = _mm512_maskz_loadu_epi64(0x0f, b);
+    const __m512i cnt = _mm512_popcnt_epi64(_mm512_xor_si512(va, vb));
+
+    uint64_t c[8];
+    _mm512_storeu_si512(c, cnt);
+    return static_cast<int>(c[0]+c[1]+c[2]+c[3]);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+void BatchAVX512(const uint8_t* query, const uint8_t* block, const size_t step,
+                 const size_t* indices, const size_t n, int* distances)
+{
+    // query in both 256 bit halves, candidates pairwise merged into one register
+    const __m512i q = _mm512_maskz_permutexvar_epi64(0xff, _mm512_setr_epi64(0,1,2,3,0,1,2,3), _mm512_maskz_loadu_epi64(0x0f, query));
+    const __m512i merge = _mm512_setr_epi64(0,1,2,3,8,9,10,11);
+
+    uint64_t cnt[8];
+    size_t i=0;
+    for(; i+1<n; i+=2)
+    {
+        const __m512i c0 = _mm512_maskz_loadu_epi64(0x0f, block + indices[i]*step);
+        const __m512i c1 = _mm512_maskz_loadu_epi64(0x0f, block + indices[i+1]*step);
+        const __m512i c = _mm512_permutex2var_epi64(c0, merge, c1);
+        _mm512_storeu_si512(cnt, _mm512_popcnt_epi64(_mm512_xor_si512(q, c)));
+        distances[i] = static_cast<int>(cnt[0]+cnt[1]+cnt[2]+cnt[3]);
+        distances[i+1] = static_cast<int>(cnt[4]+cnt[5]+cnt[6]+cnt[7]);
+    }
+
+    if(i<n)
+        distances[i] = DistanceAVX512(query, block + indices[i]*step);
+}
+
+#endif // HAMMING_X86
+
+#ifdef HAMMING_NEON
+
+// ---------------------------------------------------------------------------------------
+// NEON, per byte vcnt and a widening horizontal add
+// ---------------------------------------------------------------------------------------
+
+inline int DistanceNEONReg(const uint8x16_t q0, const uint8x16_t q1, const uint8_t* b)
+{
+    const uint8x16_t c0 = vcntq_u8(veorq_u8(q0, vld1q_u8(b)));
+    const uint8x16_t c1 = vcntq_u8(veorq_u8(q1, vld1q_u8(b+16)));
+    // every byte holds at most 16 after the addition, no overflow
+    const uint8x16_t c = vaddq_u8(c0, c1);
+#if defined(__aarch64__)
+    return vaddlvq_u8(c);
+#else
+    const uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(c)));
+    return static_cast<int>(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+#endif
+}
+
+int DistanceNEON(const uint8_t* a, const uint8_t* b)
+{
+    return DistanceNEONReg(vld1q_u8(a), vld1q_u8(a+16), b);
+}
+
+void BatchNEON(const uint8_t* query, const uint8_t* block, const size_t step,
+               const size_t* indices, const size_t n, int* distances)
+{
+    const uint8x16_t q0 = vld1q_u8(query);
+    const uint8x16_t q1 = vld1q_u8(query+16);
+    for(size_t i=0; i<n; i++)
+        distances[i] = DistanceNEONReg(q0, q1, block + indices[i]*step);
+}
+
+#endif // HAMMING_NEON
+
+Kernel SelectKernel()
+{
+#ifdef HAMMING_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+        return Kernel{"avx512-vpopcntdq", DistanceAVX512, BatchAVX512};
+    if(__builtin_cpu_supports("avx2"))
+        return Kernel{"avx2", DistanceAVX2, BatchAVX2};
+#endif
+#ifdef HAMMING_NEON
+    return Kernel{"neon", DistanceNEON, BatchNEON};
+#endif
+    return Kernel{"scalar", DistanceScalar, BatchScalar};
+}
+
+// selected once, on first use (thread safe static initialization)
+const Kernel& ActiveKernel()
+{
+    static const Kernel kernel = SelectKernel();
+    return kernel;
+}
+
+} // namespace
+
+int HammingDistance::Compute(const uint8_t* a, const uint8_t* b)
+{
+    return ActiveKernel().distance(a, b);
+}
+
+void HammingDistance::ComputeBatch(const uint8_t* query, const uint8_t* block, const size_t step,
+                                   const size_t* indices, const size_t n, int* distances)
+{
+    ActiveKernel().batch(query, block, step, indices, n, distances);
+}
+
+const char* HammingDistance::KernelName()
+{
+    return ActiveKernel().name;
+}
+
+}// namespace ORB_SLAM
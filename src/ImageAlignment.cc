@@ -0,0 +1,288 @@
+#include "ImageAlignment.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <Eigen/Cholesky>
+
+#include "Converter.h"
+#include "Frame.h"
+#include "MapPoint.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int PATCH_SIZE = 4;
+const int PATCH_AREA = PATCH_SIZE*PATCH_SIZE;
+const int PATCH_HALF = PATCH_SIZE/2;
+// The patch and the pixels of its gradient
+const int BORDER = PATCH_HALF+2;
+
+const float MAX_SCALE = 4.0f; //param coarsest level
+const float MIN_SCALE = 1.4f; //param finest level
+const int LEVEL_STEP = 2; //param
+const int MAX_ITERATIONS = 10; //param
+const int MIN_POINTS = 20; //param
+const float HUBER = 20.0f; //param intensity
+const double MIN_STEP = 1e-6; //param
+
+// Bilinear, x and y must be at least one pixel inside the image
+inline float Interpolate(const cv::Mat &image, const float x, const float y)
+{
+    const int x0 = static_cast<int>(x);
+    const int y0 = static_cast<int>(y);
+    const float ax = x-x0;
+    const float ay = y-y0;
+    const size_t step = image.step;
+    const unsigned char* p = image.ptr<unsigned char>(y0)+x0;
+    return (1.0f-ay)*((1.0f-ax)*p[0]+ax*p[1]) + ay*((1.0f-ax)*p[step]+ax*p[step+1]);
+}
+
+inline bool IsInside(const cv::Mat &image, const float x, const float y)
+{
+    return x>=BORDER && y>=BORDER && x<image.cols-BORDER && y<image.rows-BORDER;
+}
+}
+
+ImageAlignment::ImageAlignment(): fx(0), fy(0), cx(0), cy(0), k1(0), k2(0), p1(0), p2(0), k3(0), mbDistorted(false)
+{
+}
+
+bool ImageAlignment::Align(const Frame &lastFrame, Frame &currentFrame, Report* pReport)
+{
+    if(!lastFrame.mpImagePyramid || !currentFrame.mpImagePyramid)
+        return false;
+    const int nLevels = min(lastFrame.mpImagePyramid->GetLevels(),currentFrame.mpImagePyramid->GetLevels());
+    if(nLevels==0 || lastFrame.mTcw.empty() || currentFrame.mTcw.empty())
+        return false;
+
+    fx = currentFrame.fx;
+    fy = currentFrame.fy;
+    cx = currentFrame.cx;
+    cy = currentFrame.cy;
+    const cv::Mat &DistCoef = currentFrame.mDistCoef;
+    k1 = DistCoef.at<float>(0);
+    k2 = DistCoef.at<float>(1);
+    p1 = DistCoef.at<float>(2);
+    p2 = DistCoef.at<float>(3);
+    k3 = DistCoef.rows==5 ? DistCoef.at<float>(4) : 0;
+    mbDistorted = k1!=0 || k2!=0 || p1!=0 || p2!=0 || k3!=0;
+
+    // The points at their depth in the last camera, on the ray of the undistorted keypoint
+    const Eigen::Matrix3f Rlw = Converter::toMatrix3f(lastFrame.mTcw.rowRange(0,3).colRange(0,3));
+    const Eigen::Vector3f tlw = Converter::toVector3f(lastFrame.mTcw.rowRange(0,3).col(3));
+    mvPoints.clear();
+    mvKeys.clear();
+    for(int i=0; i<lastFrame.N; i++)
+    {
+        MapPoint* pMP = lastFrame.mvpMapPoints[i];
+        if(!pMP || lastFrame.mvbOutlier[i] || pMP->isBad())
+            continue;
+
+        const float z = (Rlw*Converter::toVector3f(pMP->GetWorldPos())+tlw)(2);
+        if(z<=0)
+            continue;
+
+        const cv::KeyPoint &kpUn = lastFrame.mvKeysUn[i];
+        mvPoints.push_back(Eigen::Vector3f((kpUn.pt.x-lastFrame.cx)*lastFrame.invfx*z,
+                                           (kpUn.pt.y-lastFrame.cy)*lastFrame.invfy*z,z));
+        mvKeys.push_back(lastFrame.mvKeys[i].pt);
+    }
+    if(static_cast<int>(mvPoints.size())<MIN_POINTS)
+        return false;
+
+    // Coarse to fine over every LEVEL_STEP-th level between MAX_SCALE and MIN_SCALE
+    int nFinest = 0;
+    while(nFinest+1<nLevels && lastFrame.mvScaleFactors[nFinest]<MIN_SCALE)
+        nFinest++;
+    int nCoarsest = nFinest;
+    while(nCoarsest+LEVEL_STEP<nLevels && lastFrame.mvScaleFactors[nCoarsest+LEVEL_STEP]<=MAX_SCALE)
+        nCoarsest += LEVEL_STEP;
+
+    const g2o::SE3Quat Tcw = Converter::toSE3Quat(currentFrame.mTcw);
+    const g2o::SE3Quat Tlw = Converter::toSE3Quat(lastFrame.mTcw);
+    g2o::SE3Quat Tcl = Tcw*Tlw.inverse();
+
+    Matrix6d H;
+    Vector6d b;
+
+    Precompute(lastFrame,nFinest);
+    float fErrorBefore;
+    const float invScaleFinest = currentFrame.mvInvScaleFactors[nFinest];
+    const ImagePyramid &pyramid = *currentFrame.mpImagePyramid;
+    if(Evaluate(pyramid.GetLevel(nFinest),invScaleFinest,Tcl,fErrorBefore,H,b)<MIN_POINTS)
+        return false;
+
+    int nIterations = 0;
+    for(int level=nCoarsest; level>=nFinest; level-=LEVEL_STEP)
+    {
+        if(level!=nFinest)
+            Precompute(lastFrame,level);
+        const cv::Mat &image = pyramid.GetLevel(level);
+        const float invScale = currentFrame.mvInvScaleFactors[level];
+
+        float fPrevError = numeric_limits<float>::max();
+        g2o::SE3Quat TclPrev = Tcl;
+        for(int it=0; it<MAX_ITERATIONS; it++)
+        {
+            float error;
+            if(Evaluate(image,invScale,Tcl,error,H,b)<MIN_POINTS)
+                break;
+
+            // The last step made it worse
+            if(error>=fPrevError)
+            {
+                Tcl = TclPrev;
+                break;
+            }
+            fPrevError = error;
+            TclPrev = Tcl;
+            nIterations++;
+
+            const Vector6d delta = H.ldlt().solve(b);
+            if(!delta.allFinite())
+                break;
+            Tcl = Tcl*g2o::SE3Quat::exp(-delta);
+            if(delta.norm()<MIN_STEP)
+                break;
+        }
+    }
+
+    float fErrorAfter;
+    const int nPoints = Evaluate(pyramid.GetLevel(nFinest),invScaleFinest,Tcl,fErrorAfter,H,b);
+
+    if(pReport)
+    {
+        pReport->nPoints = nPoints;
+        pReport->nIterations = nIterations;
+        pReport->fErrorBefore = fErrorBefore;
+        pReport->fErrorAfter = fErrorAfter;
+    }
+
+    if(nPoints<MIN_POINTS || fErrorAfter>=fErrorBefore)
+        return false;
+
+    currentFrame.SetPose(Converter::toCvMat(Tcl*Tlw));
+    return true;
+}
+
+void ImageAlignment::Precompute(const Frame &lastFrame, const int level)
+{
+    const cv::Mat &image = lastFrame.mpImagePyramid->GetLevel(level);
+    const float invScale = lastFrame.mvInvScaleFactors[level];
+    const size_t nPoints = mvPoints.size();
+
+    mvbVisible.assign(nPoints,false);
+    mvRefPatches.resize(nPoints*PATCH_AREA);
+    mvJacobians.resize(nPoints*PATCH_AREA);
+
+    for(size_t i=0; i<nPoints; i++)
+    {
+        const float u = mvKeys[i].x*invScale;
+        const float v = mvKeys[i].y*invScale;
+        if(!IsInside(image,u,v))
+            continue;
+        mvbVisible[i] = true;
+
+        // Pixels of the level per motion of the camera, rotation first as in g2o::SE3Quat::exp
+        const Eigen::Vector3f &p = mvPoints[i];
+        const float invz = 1.0f/p(2);
+        const float x = p(0)*invz;
+        const float y = p(1)*invz;
+        Eigen::Matrix<float,2,6> Jpose;
+        Jpose << x*y, -(1.0f+x*x), y, -invz, 0, x*invz,
+                 1.0f+y*y, -x*y, -x, 0, -invz, y*invz;
+        Jpose.row(0) *= -fx*invScale;
+        Jpose.row(1) *= -fy*invScale;
+
+        float* pPatch = &mvRefPatches[i*PATCH_AREA];
+        Vector6f* pJacobian = &mvJacobians[i*PATCH_AREA];
+        for(int dy=-PATCH_HALF, k=0; dy<PATCH_HALF; dy++)
+        {
+            for(int dx=-PATCH_HALF; dx<PATCH_HALF; dx++, k++)
+            {
+                const float px = u+dx;
+                const float py = v+dy;
+                pPatch[k] = Interpolate(image,px,py);
+                const float gx = 0.5f*(Interpolate(image,px+1,py)-Interpolate(image,px-1,py));
+                const float gy = 0.5f*(Interpolate(image,px,py+1)-Interpolate(image,px,py-1));
+                pJacobian[k] = (gx*Jpose.row(0)+gy*Jpose.row(1)).transpose();
+            }
+        }
+    }
+}
+
+int ImageAlignment::Evaluate(const cv::Mat &image, const float invScale, const g2o::SE3Quat &Tcr, float &error,
+                             Matrix6d &H, Vector6d &b) const
+{
+    H.setZero();
+    b.setZero();
+    double cost = 0;
+    int nPoints = 0;
+
+    const Eigen::Matrix3f Rcr = Tcr.rotation().toRotationMatrix().cast<float>();
+    const Eigen::Vector3f tcr = Tcr.translation().cast<float>();
+
+    for(size_t i=0; i<mvPoints.size(); i++)
+    {
+        if(!mvbVisible[i])
+            continue;
+
+        float u, v;
+        if(!Project(Rcr*mvPoints[i]+tcr,u,v))
+            continue;
+        u *= invScale;
+        v *= invScale;
+        if(!IsInside(image,u,v))
+            continue;
+        nPoints++;
+
+        const float* pPatch = &mvRefPatches[i*PATCH_AREA];
+        const Vector6f* pJacobian = &mvJacobians[i*PATCH_AREA];
+        for(int dy=-PATCH_HALF, k=0; dy<PATCH_HALF; dy++)
+        {
+            for(int dx=-PATCH_HALF; dx<PATCH_HALF; dx++, k++)
+            {
+                const float r = Interpolate(image,u+dx,v+dy)-pPatch[k];
+                const float absr = fabs(r);
+                const float w = absr<HUBER ? 1.0f : HUBER/absr;
+                cost += absr<HUBER ? r*r : HUBER*(2.0f*absr-HUBER);
+
+                const Vector6d J = pJacobian[k].cast<double>();
+                H.noalias() += w*J*J.transpose();
+                b.noalias() += (w*r)*J;
+            }
+        }
+    }
+
+    error = nPoints>0 ? cost/(nPoints*PATCH_AREA) : 0;
+    return nPoints;
+}
+
+bool ImageAlignment::Project(const Eigen::Vector3f &p, float &u, float &v) const
+{
+    if(p(2)<=0)
+        return false;
+
+    float x = p(0)/p(2);
+    float y = p(1)/p(2);
+    if(mbDistorted)
+    {
+        const float r2 = x*x+y*y;
+        const float radial = 1.0f+r2*(k1+r2*(k2+r2*k3));
+        const float xd = x*radial+2.0f*p1*x*y+p2*(r2+2.0f*x*x);
+        const float yd = y*radial+p1*(r2+2.0f*y*y)+2.0f*p2*x*y;
+        x = xd;
+        y = yd;
+    }
+    u = fx*x+cx;
+    v = fy*y+cy;
+    return true;
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,64 @@
+#include "ImagePyramid.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// The blur of the ORB descriptors
+inline void BlurLevel(const cv::Mat &level, cv::Mat &blurred)
+{
+    cv::GaussianBlur(level, blurred, cv::Size(7, 7), 2, 2, cv::BORDER_REFLECT_101+cv::BORDER_ISOLATED);
+}
+}
+
+void ImagePyramid::Allocate(const vector<cv::Size> &vSizes, const int type, const int border)
+{
+    const size_t nLevels = vSizes.size();
+    mvBuffers.resize(nLevels);
+    mvLevels.resize(nLevels);
+    mvBlurred.resize(nLevels);
+    mvbBlurred.assign(nLevels,0);
+
+    for(size_t level=0; level<nLevels; level++)
+    {
+        const cv::Size &sz = vSizes[level];
+        // only allocates if the size changed
+        mvBuffers[level].create(sz.height+2*border, sz.width+2*border, type);
+        mvLevels[level] = mvBuffers[level](cv::Rect(border, border, sz.width, sz.height));
+    }
+}
+
+void ImagePyramid::Blur(const int level)
+{
+    BlurLevel(mvLevels[level], mvBlurred[level]);
+    mvbBlurred[level] = 1;
+}
+
+const cv::Mat& ImagePyramid::GetBlurredLevel(const int level) const
+{
+    unique_lock<mutex> lock(mMutexBlur);
+    if(!mvbBlurred[level])
+    {
+        BlurLevel(mvLevels[level], mvBlurred[level]);
+        mvbBlurred[level] = 1;
+    }
+    return mvBlurred[level];
+}
+
+size_t ImagePyramid::GetMemoryUsage() const
+{
+    size_t nBytes = 0;
+    for(size_t level=0; level<mvBuffers.size(); level++)
+        nBytes += mvBuffers[level].total()*mvBuffers[level].elemSize();
+    unique_lock<mutex> lock(mMutexBlur);
+    for(size_t level=0; level<mvBlurred.size(); level++)
+        nBytes += mvBlurred[level].total()*mvBlurred[level].elemSize();
+    return nBytes;
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,246 @@
+#include "ImageSource.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+bool ImageSource::LoadTUM(const string &strSequence, const string &strAssociations, vector<Entry> &vEntries)
+{
+    const bool bRGBD = !strAssociations.empty();
+    const string strFile = bRGBD ? strAssociations : strSequence+"/rgb.txt";
+    ifstream f(strFile.c_str());
+    if(!f.is_open())
+        return false;
+
+    string s;
+    while(getline(f,s))
+    {
+        if(s.empty() || s[0]=='#')
+            continue;
+        stringstream ss(s);
+        Entry entry;
+        string strImage, strImage2;
+        double tDepth;
+        if(!(ss >> entry.timestamp >> strImage))
+            continue;
+        entry.strImage = strSequence+"/"+strImage;
+        if(bRGBD)
+        {
+            if(!(ss >> tDepth >> strImage2))
+                continue;
+            entry.strImage2 = strSequence+"/"+strImage2;
+        }
+        vEntries.push_back(entry);
+    }
+    return true;
+}
+
+bool ImageSource::LoadKITTI(const string &strSequence, const bool bStereo, vector<Entry> &vEntries)
+{
+    ifstream f((strSequence+"/times.txt").c_str());
+    if(!f.is_open())
+        return false;
+
+    string s;
+    while(getline(f,s))
+    {
+        if(s.empty())
+            continue;
+        stringstream ss(s);
+        Entry entry;
+        ss >> entry.timestamp;
+
+        stringstream ssName;
+        ssName << setfill('0') << setw(6) << vEntries.size();
+        entry.strImage = strSequence+"/image_0/"+ssName.str()+".png";
+        if(bStereo)
+            entry.strImage2 = strSequence+"/image_1/"+ssName.str()+".png";
+        vEntries.push_back(entry);
+    }
+    return true;
+}
+
+bool ImageSource::LoadEuRoC(const string &strLeft, const string &strRight, const string &strTimes, vector<Entry> &vEntries)
+{
+    ifstream f(strTimes.c_str());
+    if(!f.is_open())
+        return false;
+
+    string s;
+    while(getline(f,s))
+    {
+        if(s.empty())
+            continue;
+        stringstream ss(s);
+        string strName;
+        ss >> strName;
+        Entry entry;
+        entry.timestamp = atof(strName.c_str())/1e9;
+        entry.strImage = strLeft+"/"+strName+".png";
+        if(!strRight.empty())
+            entry.strImage2 = strRight+"/"+strName+".png";
+        vEntries.push_back(entry);
+    }
+    return true;
+}
+
+ImageSource::ImageSource(const vector<Entry> &vEntries, const int nThreads, const int nQueueSize):
+    mvEntries(vEntries), mbRectify(false), mnThreads(max(nThreads,0)), mvSlots(max(nQueueSize,1)),
+    mnNextRead(0), mnNextReturned(0), mbStop(false)
+{
+    for(size_t i=0; i<mvSlots.size(); i++)
+    {
+        mvSlots[i].nIndex = -1;
+        mvSlots[i].bOk = false;
+    }
+}
+
+ImageSource::~ImageSource()
+{
+    {
+        unique_lock<mutex> lock(mMutex);
+        mbStop = true;
+    }
+    mCondRead.notify_all();
+    for(size_t i=0; i<mvThreads.size(); i++)
+        mvThreads[i].join();
+}
+
+bool ImageSource::SetStereoRectification(const Settings &fsSettings)
+{
+    cv::Mat K_l, K_r, P_l, P_r, R_l, R_r, D_l, D_r;
+    fsSettings["LEFT.K"] >> K_l;
+    fsSettings["RIGHT.K"] >> K_r;
+    fsSettings["LEFT.P"] >> P_l;
+    fsSettings["RIGHT.P"] >> P_r;
+    fsSettings["LEFT.R"] >> R_l;
+    fsSettings["RIGHT.R"] >> R_r;
+    fsSettings["LEFT.D"] >> D_l;
+    fsSettings["RIGHT.D"] >> D_r;
+    const int rows_l = fsSettings["LEFT.height"];
+    const int cols_l = fsSettings["LEFT.width"];
+    const int rows_r = fsSettings["RIGHT.height"];
+    const int cols_r = fsSettings["RIGHT.width"];
+
+    if(K_l.empty() || K_r.empty() || P_l.empty() || P_r.empty() || R_l.empty() || R_r.empty() || D_l.empty() || D_r.empty() ||
+            rows_l==0 || rows_r==0 || cols_l==0 || cols_r==0)
+    {
+        cerr << "ERROR: Calibration parameters to rectify stereo are missing!" << endl;
+        return false;
+    }
+
+    cv::initUndistortRectifyMap(K_l,D_l,R_l,P_l.rowRange(0,3).colRange(0,3),cv::Size(cols_l,rows_l),CV_16SC2,mM1l,mM2l);
+    cv::initUndistortRectifyMap(K_r,D_r,R_r,P_r.rowRange(0,3).colRange(0,3),cv::Size(cols_r,rows_r),CV_16SC2,mM1r,mM2r);
+    mbRectify = true;
+    return true;
+}
+
+bool ImageSource::Next(Image &image)
+{
+    const int i = mnNextReturned;
+    if(i>=Size())
+        return false;
+
+    image.index = i;
+    image.timestamp = mvEntries[i].timestamp;
+
+    bool bOk;
+    if(mnThreads==0)
+    {
+        bOk = Read(i,image.im,image.im2);
+        mnNextReturned++;
+    }
+    else
+    {
+        if(mvThreads.empty())
+        {
+            for(int t=0; t<mnThreads; t++)
+                mvThreads.push_back(thread(&ImageSource::Run,this));
+        }
+
+        unique_lock<mutex> lock(mMutex);
+        Slot &slot = mvSlots[i%mvSlots.size()];
+        while(slot.nIndex!=i)
+            mCondReady.wait(lock);
+
+        bOk = slot.bOk;
+        image.im = slot.im;
+        image.im2 = slot.im2;
+        slot.im.release();
+        slot.im2.release();
+        slot.nIndex = -1;
+        mnNextReturned++;
+        mCondRead.notify_all();
+    }
+
+    if(!bOk)
+        cerr << endl << "Failed to load image at: " << mvEntries[i].strImage << endl;
+    return bOk;
+}
+
+bool ImageSource::Read(const int i, cv::Mat &im, cv::Mat &im2) const
+{
+    const Entry &entry = mvEntries[i];
+    im = cv::imread(entry.strImage,CV_LOAD_IMAGE_UNCHANGED);
+    if(!entry.strImage2.empty())
+        im2 = cv::imread(entry.strImage2,CV_LOAD_IMAGE_UNCHANGED);
+    if(im.empty() || (!entry.strImage2.empty() && im2.empty()))
+        return false;
+
+    if(mbRectify)
+    {
+        cv::Mat imRect, im2Rect;
+        cv::remap(im,imRect,mM1l,mM2l,cv::INTER_LINEAR);
+        im = imRect;
+        if(!im2.empty())
+        {
+            cv::remap(im2,im2Rect,mM1r,mM2r,cv::INTER_LINEAR);
+            im2 = im2Rect;
+        }
+    }
+    return true;
+}
+
+void ImageSource::Run()
+{
+    const int nSlots = mvSlots.size();
+    while(true)
+    {
+        int i;
+        {
+            unique_lock<mutex> lock(mMutex);
+            // The slot of image i is released once image i-nSlots has been returned
+            while(!mbStop && mnNextRead<Size() && mnNextRead>=mnNextReturned+nSlots)
+                mCondRead.wait(lock);
+            if(mbStop || mnNextRead>=Size())
+                return;
+            i = mnNextRead++;
+        }
+
+        cv::Mat im, im2;
+        const bool bOk = Read(i,im,im2);
+
+        {
+            unique_lock<mutex> lock(mMutex);
+            Slot &slot = mvSlots[i%nSlots];
+            slot.bOk = bOk;
+            slot.im = im;
+            slot.im2 = im2;
+            slot.nIndex = i;
+        }
+        mCondReady.notify_one();
+    }
+}
+
+} //namespace ORB_SLAM
@@ -20,24 +20,80 @@
 
 #include "Initializer.h"
 
-#include "Thirdparty/DBoW2/DUtils/Random.h"
-
 #include "Optimizer.h"
 #include "ORBmatcher.h"
+#include "ThreadPool.h"
+#include "Triangulator.h"
+#include "Converter.h"
 
-#include<thread>
+#include<cmath>
 
 namespace ORB_SLAM2
 {
 
+namespace
+{
+// Squared transfer errors of the match (u1,v1)-(u2,v2) under H21 and its inverse H12 (row
+// major), as chi-squares: chi1 in the first image, chi2 in the second
+inline void HomographyErrors(const float* h, const float* hinv, const float invSigmaSquare,
+                             const float u1, const float v1, const float u2, const float v2,
+                             float &chi1, float &chi2)
+{
+    // x2in1 = H12*x2
+    const float w2in1inv = 1.0f/(hinv[6]*u2+hinv[7]*v2+hinv[8]);
+    const float u2in1 = (hinv[0]*u2+hinv[1]*v2+hinv[2])*w2in1inv;
+    const float v2in1 = (hinv[3]*u2+hinv[4]*v2+hinv[5])*w2in1inv;
+    chi1 = ((u1-u2in1)*(u1-u2in1)+(v1-v2in1)*(v1-v2in1))*invSigmaSquare;
+
+    // x1in2 = H21*x1
+    const float w1in2inv = 1.0f/(h[6]*u1+h[7]*v1+h[8]);
+    const float u1in2 = (h[0]*u1+h[1]*v1+h[2])*w1in2inv;
+    const float v1in2 = (h[3]*u1+h[4]*v1+h[5])*w1in2inv;
+    chi2 = ((u2-u1in2)*(u2-u1in2)+(v2-v1in2)*(v2-v1in2))*invSigmaSquare;
+}
+
+// Squared distances of the match to its epipolar lines under F21 (row major), as chi-squares:
+// chi1 to l2=F21x1 in the second image, chi2 to l1=x2tF21 in the first
+inline void FundamentalErrors(const float* f, const float invSigmaSquare,
+                              const float u1, const float v1, const float u2, const float v2,
+                              float &chi1, float &chi2)
+{
+    const float a2 = f[0]*u1+f[1]*v1+f[2];
+    const float b2 = f[3]*u1+f[4]*v1+f[5];
+    const float c2 = f[6]*u1+f[7]*v1+f[8];
+    const float num2 = a2*u2+b2*v2+c2;
+    chi1 = num2*num2/(a2*a2+b2*b2)*invSigmaSquare;
+
+    const float a1 = f[0]*u2+f[3]*v2+f[6];
+    const float b1 = f[1]*u2+f[4]*v2+f[7];
+    const float c1 = f[2]*u2+f[5]*v2+f[8];
+    const float num1 = a1*u1+b1*v1+c1;
+    chi2 = num1*num1/(a1*a1+b1*b1)*invSigmaSquare;
+}
+
+// Iterations after which RANSAC has drawn an all-inlier set of 8 matches with the given
+// confidence, for the inlier ratio w
+int RequiredIterations(const float w, const float confidence, const int nMaxIterations)
+{
+    const double w8 = std::pow(static_cast<double>(w),8);
+    if(w8<=0.0)
+        return nMaxIterations;
+    if(w8>=1.0)
+        return 1;
+    const double n = std::ceil(std::log(1.0-confidence)/std::log(1.0-w8));
+    return n<nMaxIterations ? std::max(static_cast<int>(n),1) : nMaxIterations;
+}
+}
+
 Parameter<bool> Initializer::visualizeInitialization("Show Init.", false, true,
         ParameterGroup::MAIN, []{});
 
-Initializer::Initializer(const Frame &ReferenceFrame, float sigma, int iterations)
+Initializer::Initializer(const Frame &ReferenceFrame, float sigma, int iterations, ThreadPool* pThreadPool):
+    mnReferenceFrameId(ReferenceFrame.mnId), mpThreadPool(pThreadPool), mnIterationsH(0), mnIterationsF(0)
 {
     mK = ReferenceFrame.mK.clone();
 
-    mvKeys1 = ReferenceFrame.mvKeysUn;
+    mvKeys1.assign(ReferenceFrame.mvKeysUn.begin(),ReferenceFrame.mvKeysUn.end());
 
     mSigma = sigma;
     mSigma2 = sigma*sigma;
@@ -49,7 +105,7 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
 {
     // Fill structures with current keypoints and matches with reference frame
     // Reference Frame: 1, Current Frame: 2
-    mvKeys2 = CurrentFrame.mvKeysUn;
+    mvKeys2.assign(CurrentFrame.mvKeysUn.begin(),CurrentFrame.mvKeysUn.end());
 
     mvMatches12.clear();
     mvMatches12.reserve(mvKeys2.size());
@@ -69,6 +125,21 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
 
     const int N = mvMatches12.size();
 
+    // Coordinates of the matches, contiguous for the scoring loops
+    mvU1.resize(N);
+    mvV1.resize(N);
+    mvU2.resize(N);
+    mvV2.resize(N);
+    for(int i=0; i<N; i++)
+    {
+        const cv::KeyPoint &kp1 = mvKeys1[mvMatches12[i].first];
+        const cv::KeyPoint &kp2 = mvKeys2[mvMatches12[i].second];
+        mvU1[i] = kp1.pt.x;
+        mvV1[i] = kp1.pt.y;
+        mvU2[i] = kp2.pt.x;
+        mvV2[i] = kp2.pt.y;
+    }
+
     // Indices for minimum set selection
     vector<size_t> vAllIndices;
     vAllIndices.reserve(N);
@@ -82,7 +153,7 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
     // Generate sets of 8 points for each RANSAC iteration
     mvSets = vector< vector<size_t> >(mMaxIterations,vector<size_t>(8,0));
 
-    DUtils::Random::SeedRandOnce(0);
+    mRandom.Seed(RandomStream::Hash(mnReferenceFrameId,CurrentFrame.mnId));
 
     for(int it=0; it<mMaxIterations; it++)
     {
@@ -91,7 +162,7 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
         // Select a minimum set
         for(size_t j=0; j<8; j++)
         {
-            int randi = DUtils::Random::RandomInt(0,vAvailableIndices.size()-1);
+            int randi = mRandom.RandomInt(0,vAvailableIndices.size()-1);
             int idx = vAvailableIndices[randi];
 
             mvSets[it][j] = idx;
@@ -101,17 +172,15 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
         }
     }
 
-    // Launch threads to compute in parallel a fundamental matrix and a homography
+    // Compute a fundamental matrix and a homography, the hypotheses of both are evaluated in parallel
     vector<bool> vbMatchesInliersH, vbMatchesInliersF;
     float SH, SF;
     cv::Mat H, F;
 
-    thread threadH(&Initializer::FindHomography,this,ref(vbMatchesInliersH), ref(SH), ref(H));
-    thread threadF(&Initializer::FindFundamental,this,ref(vbMatchesInliersF), ref(SF), ref(F));
+    FindModels(vbMatchesInliersH, SH, H, vbMatchesInliersF, SF, F);
 
-    // Wait until both threads have finished
-    threadH.join();
-    threadF.join();
+    DLOG_IF(INFO, visualizeInitialization()) << "RANSAC stopped after " << mnIterationsH << " homography and "
+                                             << mnIterationsF << " fundamental iterations of " << mMaxIterations;
 
     // Compute ratio of scores
     float RH = SH/(SH+SF);
@@ -135,105 +204,128 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
 }
 
 
-void Initializer::FindHomography(vector<bool> &vbMatchesInliers, float &score, cv::Mat &H21)
+void Initializer::FindModels(vector<bool> &vbMatchesInliersH, float &SH, cv::Mat &H21,
+                             vector<bool> &vbMatchesInliersF, float &SF, cv::Mat &F21)
 {
     // Number of putative matches
     const int N = mvMatches12.size();
 
     // Normalize coordinates
-    vector<cv::Point2f> vPn1, vPn2;
-    cv::Mat T1, T2;
-    Normalize(mvKeys1,vPn1, T1);
-    Normalize(mvKeys2,vPn2, T2);
-    cv::Mat T2inv = T2.inv();
-
-    // Best Results variables
-    score = 0.0;
-    vbMatchesInliers = vector<bool>(N,false);
-
-    // Iteration variables
-    vector<cv::Point2f> vPn1i(8);
-    vector<cv::Point2f> vPn2i(8);
-    cv::Mat H21i, H12i;
-    vector<bool> vbCurrentInliers(N,false);
-    float currentScore;
-
-    // Perform all RANSAC iterations and save the solution with highest score
-    for(int it=0; it<mMaxIterations; it++)
+    Normalize(mvKeys1,mvPn1, mT1);
+    Normalize(mvKeys2,mvPn2, mT2);
+
+    // The hypotheses are evaluated in rounds, in parallel, and then visited in the order of the
+    // iterations. A model stops at the first iteration beyond the number of iterations required
+    // by its best inlier ratio so far, so the result does not depend on the number of threads.
+    const float confidence = 0.99; //param
+    const int nThreads = mpThreadPool ? mpThreadPool->GetNumThreads()+1 : 1;
+    const int nRoundSize = max(8,4*nThreads); //param
+
+    vector<Hypothesis> vHypothesesH(mMaxIterations), vHypothesesF(mMaxIterations);
+    int nRequiredH = mMaxIterations, nRequiredF = mMaxIterations;
+    int bestH = -1, bestF = -1;
+    SH = 0.0;
+    SF = 0.0;
+
+    int it0 = 0;
+    while(it0<nRequiredH || it0<nRequiredF)
     {
-        // Select a minimum set
-        for(size_t j=0; j<8; j++)
+        const int nH = max(0,min(nRequiredH,it0+nRoundSize)-it0);
+        const int nF = max(0,min(nRequiredF,it0+nRoundSize)-it0);
+
+        // Tasks [0,nH) score homographies, [nH,nH+nF) fundamental matrices
+        const function<void(int)> task = [&](int i)
         {
-            int idx = mvSets[it][j];
+            if(i<nH)
+                ComputeHomographyHypothesis(it0+i, vHypothesesH[it0+i]);
+            else
+                ComputeFundamentalHypothesis(it0+i-nH, vHypothesesF[it0+i-nH]);
+        };
+        if(mpThreadPool)
+            mpThreadPool->ParallelFor(nH+nF, task);
+        else
+            for(int i=0; i<nH+nF; i++)
+                task(i);
 
-            vPn1i[j] = vPn1[mvMatches12[idx].first];
-            vPn2i[j] = vPn2[mvMatches12[idx].second];
+        // Keep the solution with highest score, as serial RANSAC would
+        for(int it=it0; it<it0+nH && it<nRequiredH; it++)
+        {
+            if(vHypothesesH[it].score>SH)
+            {
+                bestH = it;
+                SH = vHypothesesH[it].score;
+                nRequiredH = max(it+1,RequiredIterations(float(vHypothesesH[it].nInliers)/N,confidence,mMaxIterations));
+            }
         }
-
-        cv::Mat Hn = ComputeH21(vPn1i,vPn2i);
-        H21i = T2inv*Hn*T1;
-        H12i = H21i.inv();
-
-        currentScore = CheckHomography(H21i, H12i, vbCurrentInliers, mSigma);
-
-        if(currentScore>score)
+        for(int it=it0; it<it0+nF && it<nRequiredF; it++)
         {
-            H21 = H21i.clone();
-            vbMatchesInliers = vbCurrentInliers;
-            score = currentScore;
+            if(vHypothesesF[it].score>SF)
+            {
+                bestF = it;
+                SF = vHypothesesF[it].score;
+                nRequiredF = max(it+1,RequiredIterations(float(vHypothesesF[it].nInliers)/N,confidence,mMaxIterations));
+            }
         }
-    }
-}
 
+        it0 += nRoundSize;
+    }
 
-void Initializer::FindFundamental(vector<bool> &vbMatchesInliers, float &score, cv::Mat &F21)
-{
-    // Number of putative matches
-    const int N = vbMatchesInliers.size();
+    mnIterationsH = nRequiredH;
+    mnIterationsF = nRequiredF;
 
-    // Normalize coordinates
-    vector<cv::Point2f> vPn1, vPn2;
-    cv::Mat T1, T2;
-    Normalize(mvKeys1,vPn1, T1);
-    Normalize(mvKeys2,vPn2, T2);
-    cv::Mat T2t = T2.t();
+    // Inliers of the best hypotheses
+    vbMatchesInliersH = vector<bool>(N,false);
+    if(bestH>=0)
+    {
+        H21 = vHypothesesH[bestH].M21;
+        ComputeInliersHomography(H21, H21.inv(), vbMatchesInliersH, mSigma);
+    }
 
-    // Best Results variables
-    score = 0.0;
-    vbMatchesInliers = vector<bool>(N,false);
+    vbMatchesInliersF = vector<bool>(N,false);
+    if(bestF>=0)
+    {
+        F21 = vHypothesesF[bestF].M21;
+        ComputeInliersFundamental(F21, vbMatchesInliersF, mSigma);
+    }
+}
 
-    // Iteration variables
+void Initializer::ComputeHomographyHypothesis(const int it, Hypothesis &hypothesis)
+{
+    // Select a minimum set
     vector<cv::Point2f> vPn1i(8);
     vector<cv::Point2f> vPn2i(8);
-    cv::Mat F21i;
-    vector<bool> vbCurrentInliers(N,false);
-    float currentScore;
-
-    // Perform all RANSAC iterations and save the solution with highest score
-    for(int it=0; it<mMaxIterations; it++)
+    for(size_t j=0; j<8; j++)
     {
-        // Select a minimum set
-        for(int j=0; j<8; j++)
-        {
-            int idx = mvSets[it][j];
+        int idx = mvSets[it][j];
 
-            vPn1i[j] = vPn1[mvMatches12[idx].first];
-            vPn2i[j] = vPn2[mvMatches12[idx].second];
-        }
+        vPn1i[j] = mvPn1[mvMatches12[idx].first];
+        vPn2i[j] = mvPn2[mvMatches12[idx].second];
+    }
 
-        cv::Mat Fn = ComputeF21(vPn1i,vPn2i);
+    cv::Mat Hn = ComputeH21(vPn1i,vPn2i);
+    hypothesis.M21 = mT2.inv()*Hn*mT1;
+    const cv::Mat H12 = hypothesis.M21.inv();
 
-        F21i = T2t*Fn*T1;
+    hypothesis.score = CheckHomography(hypothesis.M21, H12, hypothesis.nInliers, mSigma);
+}
 
-        currentScore = CheckFundamental(F21i, vbCurrentInliers, mSigma);
+void Initializer::ComputeFundamentalHypothesis(const int it, Hypothesis &hypothesis)
+{
+    // Select a minimum set
+    vector<cv::Point2f> vPn1i(8);
+    vector<cv::Point2f> vPn2i(8);
+    for(int j=0; j<8; j++)
+    {
+        int idx = mvSets[it][j];
 
-        if(currentScore>score)
-        {
-            F21 = F21i.clone();
-            vbMatchesInliers = vbCurrentInliers;
-            score = currentScore;
-        }
+        vPn1i[j] = mvPn1[mvMatches12[idx].first];
+        vPn2i[j] = mvPn2[mvMatches12[idx].second];
     }
+
+    cv::Mat Fn = ComputeF21(vPn1i,vPn2i);
+    hypothesis.M21 = mT2.t()*Fn*mT1;
+
+    hypothesis.score = CheckFundamental(hypothesis.M21, hypothesis.nInliers, mSigma);
 }
 
 
@@ -316,174 +408,124 @@ cv::Mat Initializer::ComputeF21(const vector<cv::Point2f> &vP1,const vector<cv::
     return  u*cv::Mat::diag(w)*vt;
 }
 
-float Initializer::CheckHomography(const cv::Mat &H21, const cv::Mat &H12, vector<bool> &vbMatchesInliers, float sigma)
+float Initializer::CheckHomography(const cv::Mat &H21, const cv::Mat &H12, int &nInliers, float sigma) const
 {
     const int N = mvMatches12.size();
 
-    const float h11 = H21.at<float>(0,0);
-    const float h12 = H21.at<float>(0,1);
-    const float h13 = H21.at<float>(0,2);
-    const float h21 = H21.at<float>(1,0);
-    const float h22 = H21.at<float>(1,1);
-    const float h23 = H21.at<float>(1,2);
-    const float h31 = H21.at<float>(2,0);
-    const float h32 = H21.at<float>(2,1);
-    const float h33 = H21.at<float>(2,2);
-
-    const float h11inv = H12.at<float>(0,0);
-    const float h12inv = H12.at<float>(0,1);
-    const float h13inv = H12.at<float>(0,2);
-    const float h21inv = H12.at<float>(1,0);
-    const float h22inv = H12.at<float>(1,1);
-    const float h23inv = H12.at<float>(1,2);
-    const float h31inv = H12.at<float>(2,0);
-    const float h32inv = H12.at<float>(2,1);
-    const float h33inv = H12.at<float>(2,2);
+    const float* h = H21.ptr<float>();
+    const float* hinv = H12.ptr<float>();
 
-    vbMatchesInliers.resize(N);
+    const float* pU1 = mvU1.data();
+    const float* pV1 = mvV1.data();
+    const float* pU2 = mvU2.data();
+    const float* pV2 = mvV2.data();
 
     float score = 0;
+    int nIn = 0;
 
     const float th = 5.991;
 
     //this is 1 for monocular
     const float invSigmaSquare = 1.0/(sigma*sigma); //param
 
+    // Branch free over the coordinate arrays, so the compiler vectorizes it
+#ifdef _OPENMP
+#pragma omp simd reduction(+:score,nIn)
+#endif
     for(int i=0; i<N; i++)
     {
-        bool bIn = true;
-
-        const cv::KeyPoint &kp1 = mvKeys1[mvMatches12[i].first];
-        const cv::KeyPoint &kp2 = mvKeys2[mvMatches12[i].second];
-
-        const float u1 = kp1.pt.x;
-        const float v1 = kp1.pt.y;
-        const float u2 = kp2.pt.x;
-        const float v2 = kp2.pt.y;
-
-        // Reprojection error in first image
-        // x2in1 = H12*x2
-
-        const float w2in1inv = 1.0/(h31inv*u2+h32inv*v2+h33inv);
-        const float u2in1 = (h11inv*u2+h12inv*v2+h13inv)*w2in1inv;
-        const float v2in1 = (h21inv*u2+h22inv*v2+h23inv)*w2in1inv;
-
-        const float squareDist1 = (u1-u2in1)*(u1-u2in1)+(v1-v2in1)*(v1-v2in1);
-
-        //larger sigma would increase the chiSquare
-        const float chiSquare1 = squareDist1*invSigmaSquare;
+        float chiSquare1, chiSquare2;
+        HomographyErrors(h, hinv, invSigmaSquare, pU1[i], pV1[i], pU2[i], pV2[i], chiSquare1, chiSquare2);
 
         // for sigma = 1 if the squared distance is larger than
         // 5.991 then it is considered to be an outlier -> larger sigma -> less inliers
-        if(chiSquare1>th)
-            bIn = false;
-        else
-            // score accumulates how far away each point was from the threshold
-            score += th - chiSquare1;
+        const bool bIn1 = chiSquare1<=th;
+        const bool bIn2 = chiSquare2<=th;
 
-        // Reprojection error in second image
-        // x1in2 = H21*x1
+        // score accumulates how far away each point was from the threshold
+        score += (bIn1 ? th-chiSquare1 : 0.0f) + (bIn2 ? th-chiSquare2 : 0.0f);
+        nIn += (bIn1 && bIn2) ? 1 : 0;
+    }
 
-        const float w1in2inv = 1.0/(h31*u1+h32*v1+h33);
-        const float u1in2 = (h11*u1+h12*v1+h13)*w1in2inv;
-        const float v1in2 = (h21*u1+h22*v1+h23)*w1in2inv;
+    nInliers = nIn;
+    return score;
+}
 
-        const float squareDist2 = (u2-u1in2)*(u2-u1in2)+(v2-v1in2)*(v2-v1in2);
+void Initializer::ComputeInliersHomography(const cv::Mat &H21, const cv::Mat &H12, vector<bool> &vbMatchesInliers,
+                                           float sigma) const
+{
+    const int N = mvMatches12.size();
 
-        const float chiSquare2 = squareDist2*invSigmaSquare;
+    const float* h = H21.ptr<float>();
+    const float* hinv = H12.ptr<float>();
 
-        if(chiSquare2>th)
-            bIn = false;
-        else
-            score += th - chiSquare2;
+    const float th = 5.991;
+    const float invSigmaSquare = 1.0/(sigma*sigma);
 
-        if(bIn)
-            vbMatchesInliers[i]=true;
-        else
-            vbMatchesInliers[i]=false;
+    vbMatchesInliers.resize(N);
+    for(int i=0; i<N; i++)
+    {
+        float chiSquare1, chiSquare2;
+        HomographyErrors(h, hinv, invSigmaSquare, mvU1[i], mvV1[i], mvU2[i], mvV2[i], chiSquare1, chiSquare2);
+        vbMatchesInliers[i] = chiSquare1<=th && chiSquare2<=th;
     }
-
-    return score;
 }
 
-float Initializer::CheckFundamental(const cv::Mat &F21, vector<bool> &vbMatchesInliers, float sigma)
+float Initializer::CheckFundamental(const cv::Mat &F21, int &nInliers, float sigma) const
 {
     const int N = mvMatches12.size();
 
-    const float f11 = F21.at<float>(0,0);
-    const float f12 = F21.at<float>(0,1);
-    const float f13 = F21.at<float>(0,2);
-    const float f21 = F21.at<float>(1,0);
-    const float f22 = F21.at<float>(1,1);
-    const float f23 = F21.at<float>(1,2);
-    const float f31 = F21.at<float>(2,0);
-    const float f32 = F21.at<float>(2,1);
-    const float f33 = F21.at<float>(2,2);
+    const float* f = F21.ptr<float>();
 
-    vbMatchesInliers.resize(N);
+    const float* pU1 = mvU1.data();
+    const float* pV1 = mvV1.data();
+    const float* pU2 = mvU2.data();
+    const float* pV2 = mvV2.data();
 
     float score = 0;
+    int nIn = 0;
 
     const float th = 3.841;
     const float thScore = 5.991;
 
     const float invSigmaSquare = 1.0/(sigma*sigma);
 
+    // Branch free over the coordinate arrays, so the compiler vectorizes it
+#ifdef _OPENMP
+#pragma omp simd reduction(+:score,nIn)
+#endif
     for(int i=0; i<N; i++)
     {
-        bool bIn = true;
+        float chiSquare1, chiSquare2;
+        FundamentalErrors(f, invSigmaSquare, pU1[i], pV1[i], pU2[i], pV2[i], chiSquare1, chiSquare2);
 
-        const cv::KeyPoint &kp1 = mvKeys1[mvMatches12[i].first];
-        const cv::KeyPoint &kp2 = mvKeys2[mvMatches12[i].second];
-
-        const float u1 = kp1.pt.x;
-        const float v1 = kp1.pt.y;
-        const float u2 = kp2.pt.x;
-        const float v2 = kp2.pt.y;
-
-        // Reprojection error in second image
-        // l2=F21x1=(a2,b2,c2)
-
-        const float a2 = f11*u1+f12*v1+f13;
-        const float b2 = f21*u1+f22*v1+f23;
-        const float c2 = f31*u1+f32*v1+f33;
-
-        const float num2 = a2*u2+b2*v2+c2;
-
-        const float squareDist1 = num2*num2/(a2*a2+b2*b2);
-
-        const float chiSquare1 = squareDist1*invSigmaSquare;
+        const bool bIn1 = chiSquare1<=th;
+        const bool bIn2 = chiSquare2<=th;
 
-        if(chiSquare1>th)
-            bIn = false;
-        else
-            score += thScore - chiSquare1;
-
-        // Reprojection error in second image
-        // l1 =x2tF21=(a1,b1,c1)
-
-        const float a1 = f11*u2+f21*v2+f31;
-        const float b1 = f12*u2+f22*v2+f32;
-        const float c1 = f13*u2+f23*v2+f33;
+        score += (bIn1 ? thScore-chiSquare1 : 0.0f) + (bIn2 ? thScore-chiSquare2 : 0.0f);
+        nIn += (bIn1 && bIn2) ? 1 : 0;
+    }
 
-        const float num1 = a1*u1+b1*v1+c1;
+    nInliers = nIn;
+    return score;
+}
 
-        const float squareDist2 = num1*num1/(a1*a1+b1*b1);
+void Initializer::ComputeInliersFundamental(const cv::Mat &F21, vector<bool> &vbMatchesInliers, float sigma) const
+{
+    const int N = mvMatches12.size();
 
-        const float chiSquare2 = squareDist2*invSigmaSquare;
+    const float* f = F21.ptr<float>();
 
-        if(chiSquare2>th)
-            bIn = false;
-        else
-            score += thScore - chiSquare2;
+    const float th = 3.841;
+    const float invSigmaSquare = 1.0/(sigma*sigma);
 
-        if(bIn)
-            vbMatchesInliers[i]=true;
-        else
-            vbMatchesInliers[i]=false;
+    vbMatchesInliers.resize(N);
+    for(int i=0; i<N; i++)
+    {
+        float chiSquare1, chiSquare2;
+        FundamentalErrors(f, invSigmaSquare, mvU1[i], mvV1[i], mvU2[i], mvV2[i], chiSquare1, chiSquare2);
+        vbMatchesInliers[i] = chiSquare1<=th && chiSquare2<=th;
     }
-
-    return score;
 }
 
 bool Initializer::ReconstructF(vector<bool> &vbMatchesInliers, cv::Mat &F21, cv::Mat &K,
@@ -790,19 +832,12 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, cv:
     return false;
 }
 
-void Initializer::Triangulate(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const cv::Mat &P1, const cv::Mat &P2, cv::Mat &x3D)
+void Initializer::Triangulate(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const Eigen::Matrix<float,3,4> &P1,
+                              const Eigen::Matrix<float,3,4> &P2, Eigen::Vector3f &x3D)
 {
-    cv::Mat A(4,4,CV_32F);
-
-    A.row(0) = kp1.pt.x*P1.row(2)-P1.row(0);
-    A.row(1) = kp1.pt.y*P1.row(2)-P1.row(1);
-    A.row(2) = kp2.pt.x*P2.row(2)-P2.row(0);
-    A.row(3) = kp2.pt.y*P2.row(2)-P2.row(1);
-
-    cv::Mat u,w,vt;
-    cv::SVD::compute(A,w,u,vt,cv::SVD::MODIFY_A| cv::SVD::FULL_UV);
-    x3D = vt.row(3).t();
-    x3D = x3D.rowRange(0,3)/x3D.at<float>(3);
+    Eigen::Vector4f x3Dh;
+    TriangulateDLT(P1,P2,kp1.pt.x,kp1.pt.y,kp2.pt.x,kp2.pt.y,x3Dh);
+    x3D = x3Dh.head<3>()/x3Dh(3);
 }
 
 void Initializer::Normalize(const vector<cv::KeyPoint> &vKeys, vector<cv::Point2f> &vNormalizedPoints, cv::Mat &T)
@@ -870,19 +905,22 @@ int Initializer::CheckRT(const cv::Mat &R, const cv::Mat &t, const vector<cv::Ke
     vector<float> vCosParallax;
     vCosParallax.reserve(vKeys1.size());
 
+    const Eigen::Matrix3f Rf = Converter::toMatrix3f(R);
+    const Eigen::Vector3f tf = Converter::toVector3f(t);
+    const Eigen::Matrix3f Kf = Converter::toMatrix3f(K);
+
     // Camera 1 Projection Matrix K[I|0]
-    cv::Mat P1(3,4,CV_32F,cv::Scalar(0));
-    K.copyTo(P1.rowRange(0,3).colRange(0,3));
+    Eigen::Matrix<float,3,4> P1 = Eigen::Matrix<float,3,4>::Zero();
+    P1.leftCols<3>() = Kf;
 
-    cv::Mat O1 = cv::Mat::zeros(3,1,CV_32F);
+    const Eigen::Vector3f O1 = Eigen::Vector3f::Zero();
 
     // Camera 2 Projection Matrix K[R|t]
-    cv::Mat P2(3,4,CV_32F);
-    R.copyTo(P2.rowRange(0,3).colRange(0,3));
-    t.copyTo(P2.rowRange(0,3).col(3));
-    P2 = K*P2;
+    Eigen::Matrix<float,3,4> P2;
+    P2.leftCols<3>() = Kf*Rf;
+    P2.col(3) = Kf*tf;
 
-    cv::Mat O2 = -R.t()*t;
+    const Eigen::Vector3f O2 = -Rf.transpose()*tf;
 
     int nGood=0;
 
@@ -893,40 +931,40 @@ int Initializer::CheckRT(const cv::Mat &R, const cv::Mat &t, const vector<cv::Ke
 
         const cv::KeyPoint &kp1 = vKeys1[vMatches12[i].first];
         const cv::KeyPoint &kp2 = vKeys2[vMatches12[i].second];
-        cv::Mat p3dC1;
+        Eigen::Vector3f p3dC1;
 
         Triangulate(kp1,kp2,P1,P2,p3dC1);
 
-        if(!isfinite(p3dC1.at<float>(0)) || !isfinite(p3dC1.at<float>(1)) || !isfinite(p3dC1.at<float>(2)))
+        if(!isfinite(p3dC1(0)) || !isfinite(p3dC1(1)) || !isfinite(p3dC1(2)))
         {
             vbGood[vMatches12[i].first]=false;
             continue;
         }
 
         // Check parallax
-        cv::Mat normal1 = p3dC1 - O1;
-        float dist1 = cv::norm(normal1);
+        const Eigen::Vector3f normal1 = p3dC1 - O1;
+        float dist1 = normal1.norm();
 
-        cv::Mat normal2 = p3dC1 - O2;
-        float dist2 = cv::norm(normal2);
+        const Eigen::Vector3f normal2 = p3dC1 - O2;
+        float dist2 = normal2.norm();
 
         float cosParallax = normal1.dot(normal2)/(dist1*dist2);
 
         // Check depth in front of first camera (only if enough parallax, as "infinite" points can easily go to negative depth)
-        if(p3dC1.at<float>(2)<=0 && cosParallax<0.99998)
+        if(p3dC1(2)<=0 && cosParallax<0.99998)
             continue;
 
         // Check depth in front of second camera (only if enough parallax, as "infinite" points can easily go to negative depth)
-        cv::Mat p3dC2 = R*p3dC1+t;
+        const Eigen::Vector3f p3dC2 = Rf*p3dC1+tf;
 
-        if(p3dC2.at<float>(2)<=0 && cosParallax<0.99998)
+        if(p3dC2(2)<=0 && cosParallax<0.99998)
             continue;
 
         // Check reprojection error in first image
         float im1x, im1y;
-        float invZ1 = 1.0/p3dC1.at<float>(2);
-        im1x = fx*p3dC1.at<float>(0)*invZ1+cx;
-        im1y = fy*p3dC1.at<float>(1)*invZ1+cy;
+        float invZ1 = 1.0/p3dC1(2);
+        im1x = fx*p3dC1(0)*invZ1+cx;
+        im1y = fy*p3dC1(1)*invZ1+cy;
 
         float squareError1 = (im1x-kp1.pt.x)*(im1x-kp1.pt.x)+(im1y-kp1.pt.y)*(im1y-kp1.pt.y);
 
@@ -935,9 +973,9 @@ int Initializer::CheckRT(const cv::Mat &R, const cv::Mat &t, const vector<cv::Ke
 
         // Check reprojection error in second image
         float im2x, im2y;
-        float invZ2 = 1.0/p3dC2.at<float>(2);
-        im2x = fx*p3dC2.at<float>(0)*invZ2+cx;
-        im2y = fy*p3dC2.at<float>(1)*invZ2+cy;
+        float invZ2 = 1.0/p3dC2(2);
+        im2x = fx*p3dC2(0)*invZ2+cx;
+        im2y = fy*p3dC2(1)*invZ2+cy;
 
         float squareError2 = (im2x-kp2.pt.x)*(im2x-kp2.pt.x)+(im2y-kp2.pt.y)*(im2y-kp2.pt.y);
 
@@ -945,7 +983,7 @@ int Initializer::CheckRT(const cv::Mat &R, const cv::Mat &t, const vector<cv::Ke
             continue;
 
         vCosParallax.push_back(cosParallax);
-        vP3D[vMatches12[i].first] = cv::Point3f(p3dC1.at<float>(0),p3dC1.at<float>(1),p3dC1.at<float>(2));
+        vP3D[vMatches12[i].first] = cv::Point3f(p3dC1(0),p3dC1(1),p3dC1(2));
         nGood++;
 
         if(cosParallax<0.99998)
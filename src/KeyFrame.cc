@@ -21,220 +21,298 @@
 #include "KeyFrame.h"
 #include "Converter.h"
 #include "ORBmatcher.h"
+#include "ObjectPool.h"
+#include "DescriptorArena.h"
+#include "VocabularyLoader.h"
+#include<algorithm>
 #include<mutex>
+#include<queue>
 
 namespace ORB_SLAM2
 {
 
-long unsigned int KeyFrame::nNextId=0;
+atomic<long unsigned int> KeyFrame::nRelocalizationEpoch(1);
+atomic<long unsigned int> KeyFrame::nPoseEpoch(1);
+
+namespace
+{
+// never destroyed, KeyFrames may still be deleted during static destruction
+ObjectPool& KeyFramePool()
+{
+    static ObjectPool* pPool = new ObjectPool(sizeof(KeyFrame), 256); //param
+    return *pPool;
+}
+}
+
+void* KeyFrame::operator new(std::size_t size)
+{
+    if(size!=sizeof(KeyFrame))
+        return ::operator new(size);
+    return KeyFramePool().Allocate();
+}
+
+void KeyFrame::operator delete(void* p, std::size_t size)
+{
+    if(size!=sizeof(KeyFrame))
+        ::operator delete(p);
+    else
+        KeyFramePool().Free(p);
+}
 
 KeyFrame::KeyFrame(Frame &F, Map *pMap, KeyFrameDatabase *pKFDB):
-    mnFrameId(F.mnId),  mTimeStamp(F.mTimeStamp), mnGridCols(FRAME_GRID_COLS), mnGridRows(FRAME_GRID_ROWS),
+    mnFrameId(F.mnId), mnMapId(0), mpRigKF(NULL), mnRigCamera(0), mpPrevRigKF(NULL), mTimeStamp(F.mTimeStamp), mnGridCols(FRAME_GRID_COLS), mnGridRows(FRAME_GRID_ROWS),
     mfGridElementWidthInv(F.mfGridElementWidthInv), mfGridElementHeightInv(F.mfGridElementHeightInv),
-    mnTrackReferenceForFrame(0), mnFuseTargetForKF(0), mnBALocalForKF(0), mnBAFixedForKF(0),
-    mnLoopQuery(0), mnLoopWords(0), mnRelocQuery(0), mnRelocWords(0), mnBAGlobalForKF(0),
+    mnTrackReferenceForLocalMap(0), mnFuseTargetForKF(0), mnBALocalForKF(0), mnBAFixedForKF(0),
+    mnBAGlobalForKF(0),
+    mnBARegionForKF(0), mnBARegionFixedForKF(0),
     fx(F.fx), fy(F.fy), cx(F.cx), cy(F.cy), invfx(F.invfx), invfy(F.invfy),
     mbf(F.mbf), mb(F.mb), mThDepth(F.mThDepth), N(F.N), mvKeys(F.mvKeys), mvKeysUn(F.mvKeysUn),
-    mvuRight(F.mvuRight), mvDepth(F.mvDepth), mDescriptors(F.mDescriptors.clone()),
+    mvuRight(F.mvuRight), mvDepth(F.mvDepth), mvColors(F.mvColors),
+    mDescriptors(DescriptorArena::Global().Copy(F.mDescriptors)),
     mBowVec(F.mBowVec), mFeatVec(F.mFeatVec), mnScaleLevels(F.mnScaleLevels), mfScaleFactor(F.mfScaleFactor),
     mfLogScaleFactor(F.mfLogScaleFactor), mvScaleFactors(F.mvScaleFactors), mvLevelSigma2(F.mvLevelSigma2),
     mvInvLevelSigma2(F.mvInvLevelSigma2), mnMinX(F.mnMinX), mnMinY(F.mnMinY), mnMaxX(F.mnMaxX),
-    mnMaxY(F.mnMaxY), mK(F.mK), mbIsRelocalizationCandidate(false), mvpMapPoints(F.mvpMapPoints),
-    mpKeyFrameDB(pKFDB), mpORBvocabulary(F.mpORBvocabulary), mbFirstConnection(true), mpParent(NULL),
-    mbNotErase(false), mbToBeErased(false), mbBad(false), mHalfBaseline(F.mb/2), mpMap(pMap)
+    mnMaxY(F.mnMaxY), mK(F.mK), mnRelocalizationCandidateEpoch(0), mnPoseEpoch(0), mvpMapPoints(F.mvpMapPoints),
+    mpKeyFrameDB(pKFDB), mpORBvocabulary(F.mpORBvocabulary), mpGrid(F.mpGrid), mbCompact(false), mbFirstConnection(true), mpParent(NULL),
+    mbNotErase(false), mbToBeErased(false), mbBad(false), mnChangeIdx(0), mHalfBaseline(F.mb/2), mpMap(pMap)
 {
-    mnId=nNextId++;
+    mnId=pMap->mnNextKeyFrameId++;
 
-    mGrid.resize(mnGridCols);
-    for(int i=0; i<mnGridCols;i++)
-    {
-        mGrid[i].resize(mnGridRows);
-        for(int j=0; j<mnGridRows; j++)
-            mGrid[i][j] = F.mGrid[i][j];
-    }
+    // The features are the arrays of the frame, not copies. Without distortion the undistorted
+    // keypoints are the keypoints, and a monocular keyframe has -1 for both the right coordinates
+    // and the depths: a frame read from a map file shares them here
+    if(mvKeysUn.SameElements(mvKeys))
+        mvKeysUn = mvKeys;
+    if(mvDepth.SameElements(mvuRight))
+        mvDepth = mvuRight;
 
     SetPose(F.mTcw);
 }
 
+KeyFrame::~KeyFrame()
+{
+    DescriptorArena::Global().Free(mDescriptors);
+}
+
 void KeyFrame::ComputeBoW()
 {
     if(mBowVec.empty() || mFeatVec.empty())
     {
-        vector<cv::Mat> vCurrentDesc = Converter::toDescriptorVector(mDescriptors);
-        // Feature vector associate features with nodes in the 4th level (from leaves up)
-        // We assume the vocabulary tree has 6 levels, change the 4 otherwise
-        mpORBvocabulary->transform(vCurrentDesc,mBowVec,mFeatVec,4); //param
+        VocabularyLoader::Wait(mpORBvocabulary);
+        // Feature vector associate features with nodes of the level the vocabulary gives (4th from the
+        // leaves up for the 6 levels of ORBvoc), the same as the frames
+        mpORBvocabulary->transform(mDescriptors.data,mDescriptors.step[0],mDescriptors.rows,mBowVec,mFeatVec,
+                                   mpORBvocabulary->getFeatureVectorLevelsUp());
     }
 }
 
 void KeyFrame::SetPose(const cv::Mat &Tcw_)
 {
-    unique_lock<mutex> lock(mMutexPose);
-    Tcw_.copyTo(Tcw);
-    cv::Mat Rcw = Tcw.rowRange(0,3).colRange(0,3);
-    cv::Mat tcw = Tcw.rowRange(0,3).col(3);
-    cv::Mat Rwc = Rcw.t();
-    Ow = -Rwc*tcw;
+    SetPose(Converter::toMatrix3f(Tcw_.rowRange(0,3).colRange(0,3)),Converter::toVector3f(Tcw_.rowRange(0,3).col(3)));
+}
+
+void KeyFrame::SetPose(const Eigen::Matrix3f &Rcw, const Eigen::Vector3f &tcw)
+{
+    const Eigen::Vector3f Ow = -Rcw.transpose()*tcw;
+    float pose[15];
+    Eigen::Matrix<float,3,3,Eigen::RowMajor>::Map(pose) = Rcw;
+    Eigen::Vector3f::Map(pose+9) = tcw;
+    Eigen::Vector3f::Map(pose+12) = Ow;
+
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexPose));
+    mPose.Write(pose);
+    // After the pose, a reader of the epoch before it reads the new pose
+    mnPoseEpoch = ++nPoseEpoch;
+    // Under mMutexPose, so the log sees the writes in order
+    mpMap->mChangeLog.Update(this,Rcw,Ow);
+}
+
+void KeyFrame::GetPose(Eigen::Matrix3f &Rcw, Eigen::Vector3f &tcw)
+{
+    float pose[12];
+    mPose.Read(pose,0,12);
+    Rcw = Eigen::Map<const Eigen::Matrix<float,3,3,Eigen::RowMajor> >(pose);
+    tcw = Eigen::Map<const Eigen::Vector3f>(pose+9);
+}
 
-    Twc = cv::Mat::eye(4,4,Tcw.type());
-    Rwc.copyTo(Twc.rowRange(0,3).colRange(0,3));
-    Ow.copyTo(Twc.rowRange(0,3).col(3));
-    cv::Mat center = (cv::Mat_<float>(4,1) << mHalfBaseline, 0 , 0, 1);
-    Cw = Twc*center;
+void KeyFrame::GetCameraCenter(Eigen::Vector3f &Ow)
+{
+    mPose.Read(Ow.data(),12,3);
 }
 
 cv::Mat KeyFrame::GetPose()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Tcw.clone();
+    float pose[12];
+    mPose.Read(pose,0,12);
+
+    cv::Mat Tcw = cv::Mat::eye(4,4,CV_32F);
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<3; j++)
+            Tcw.at<float>(i,j) = pose[3*i+j];
+        Tcw.at<float>(i,3) = pose[9+i];
+    }
+    return Tcw;
 }
 
 cv::Mat KeyFrame::GetPoseInverse()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Twc.clone();
+    float pose[15];
+    mPose.Read(pose);
+
+    cv::Mat Twc = cv::Mat::eye(4,4,CV_32F);
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<3; j++)
+            Twc.at<float>(i,j) = pose[3*j+i];
+        Twc.at<float>(i,3) = pose[12+i];
+    }
+    return Twc;
 }
 
 cv::Mat KeyFrame::GetCameraCenter()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Ow.clone();
+    cv::Mat Ow(3,1,CV_32F);
+    mPose.Read(Ow.ptr<float>(),12,3);
+    return Ow;
 }
 
 cv::Mat KeyFrame::GetStereoCenter()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Cw.clone();
+    float pose[15];
+    mPose.Read(pose);
+
+    // Ow + Rwc*(b/2,0,0), the first column of Rwc is the first row of Rcw
+    cv::Mat Cw(3,1,CV_32F);
+    for(int i=0; i<3; i++)
+        Cw.at<float>(i) = pose[12+i] + mHalfBaseline*pose[i];
+    return Cw;
 }
 
 
 cv::Mat KeyFrame::GetRotation()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Tcw.rowRange(0,3).colRange(0,3).clone();
+    cv::Mat Rcw(3,3,CV_32F);
+    mPose.Read(Rcw.ptr<float>(),0,9);
+    return Rcw;
 }
 
 cv::Mat KeyFrame::GetTranslation()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Tcw.rowRange(0,3).col(3).clone();
-}
-
-void KeyFrame::AddConnection(KeyFrame *pKF, const int &weight)
-{
-    {
-        unique_lock<mutex> lock(mMutexConnections);
-        if(!mConnectedKeyFrameWeights.count(pKF))
-            mConnectedKeyFrameWeights[pKF]=weight;
-        else if(mConnectedKeyFrameWeights[pKF]!=weight)
-            mConnectedKeyFrameWeights[pKF]=weight;
-        else
-            return;
-    }
-
-    UpdateBestCovisibles();
+    cv::Mat tcw(3,1,CV_32F);
+    mPose.Read(tcw.ptr<float>(),9,3);
+    return tcw;
 }
 
-void KeyFrame::UpdateBestCovisibles()
+void KeyFrame::AddCovisibility(KeyFrame *pKF, const int n)
 {
-    unique_lock<mutex> lock(mMutexConnections);
-    vector<pair<int,KeyFrame*> > vPairs;
-    vPairs.reserve(mConnectedKeyFrameWeights.size());
-    for(map<KeyFrame*,int>::iterator mit=mConnectedKeyFrameWeights.begin(), mend=mConnectedKeyFrameWeights.end(); mit!=mend; mit++)
-       vPairs.push_back(make_pair(mit->second,mit->first));
-
-    sort(vPairs.begin(),vPairs.end());
-    list<KeyFrame*> lKFs;
-    list<int> lWs;
-    for(size_t i=0, iend=vPairs.size(); i<iend;i++)
-    {
-        lKFs.push_front(vPairs[i].second);
-        lWs.push_front(vPairs[i].first);
-    }
-
-    mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
-    mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+    if(!mConnections.Add(pKF,n))
+        return;
+    mpConnectionsSnapshot.reset();
+    mnChangeIdx++;
 }
 
 set<KeyFrame*> KeyFrame::GetConnectedKeyFrames()
 {
-    unique_lock<mutex> lock(mMutexConnections);
-    set<KeyFrame*> s;
-    for(map<KeyFrame*,int>::iterator mit=mConnectedKeyFrameWeights.begin();mit!=mConnectedKeyFrameWeights.end();mit++)
-        s.insert(mit->first);
-    return s;
+    MapReadLock lock(LOCK_SITE(mMutexConnections));
+    const vector<KeyFrame*> &vpKFs = mConnections.KeyFrames();
+    return set<KeyFrame*>(vpKFs.begin(),vpKFs.end());
 }
 
 vector<KeyFrame*> KeyFrame::GetVectorCovisibleKeyFrames()
 {
-    unique_lock<mutex> lock(mMutexConnections);
-    return mvpOrderedConnectedKeyFrames;
+    MapReadLock lock(LOCK_SITE(mMutexConnections));
+    const vector<KeyFrame*> &vpKFs = mConnections.KeyFrames();
+    return vector<KeyFrame*>(vpKFs.begin(),vpKFs.begin()+mConnections.NumOrdered());
 }
 
 vector<KeyFrame*> KeyFrame::GetBestCovisibilityKeyFrames(const int &N)
 {
-    unique_lock<mutex> lock(mMutexConnections);
-    if((int)mvpOrderedConnectedKeyFrames.size()<N)
-        return mvpOrderedConnectedKeyFrames;
-    else
-        return vector<KeyFrame*>(mvpOrderedConnectedKeyFrames.begin(),mvpOrderedConnectedKeyFrames.begin()+N);
-
+    MapReadLock lock(LOCK_SITE(mMutexConnections));
+    const vector<KeyFrame*> &vpKFs = mConnections.KeyFrames();
+    const size_t n = min(mConnections.NumOrdered(),static_cast<size_t>(max(N,0)));
+    return vector<KeyFrame*>(vpKFs.begin(),vpKFs.begin()+n);
 }
 
 vector<KeyFrame*> KeyFrame::GetCovisiblesByWeight(const int &w)
 {
-    unique_lock<mutex> lock(mMutexConnections);
-
-    if(mvpOrderedConnectedKeyFrames.empty())
-        return vector<KeyFrame*>();
-
-    vector<int>::iterator it = upper_bound(mvOrderedWeights.begin(),mvOrderedWeights.end(),w,KeyFrame::weightComp);
-    if(it==mvOrderedWeights.end())
-        return vector<KeyFrame*>();
-    else
-    {
-        int n = it-mvOrderedWeights.begin();
-        return vector<KeyFrame*>(mvpOrderedConnectedKeyFrames.begin(), mvpOrderedConnectedKeyFrames.begin()+n);
-    }
+    MapReadLock lock(LOCK_SITE(mMutexConnections));
+    const vector<KeyFrame*> &vpKFs = mConnections.KeyFrames();
+    return vector<KeyFrame*>(vpKFs.begin(),vpKFs.begin()+mConnections.NumOrderedWithWeight(w));
 }
 
 int KeyFrame::GetWeight(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutexConnections);
-    if(mConnectedKeyFrameWeights.count(pKF))
-        return mConnectedKeyFrameWeights[pKF];
-    else
-        return 0;
+    MapReadLock lock(LOCK_SITE(mMutexConnections));
+    return mConnections.Weight(pKF);
+}
+
+KeyFrame::CovisibilitySnapshot KeyFrame::GetCovisibilitySnapshot()
+{
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+    if(!mpConnectionsSnapshot)
+        mpConnectionsSnapshot = make_shared<const CovisibilityList>(mConnections);
+    return mpConnectionsSnapshot;
 }
 
 void KeyFrame::AddMapPoint(MapPoint *pMP, const size_t &idx)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
     mvpMapPoints[idx]=pMP;
+    mpMapPointsSnapshot.reset();
+    mpBowMatchIndex.reset();
+    mnChangeIdx++;
 }
 
 void KeyFrame::EraseMapPointMatch(const size_t &idx)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
     mvpMapPoints[idx]=static_cast<MapPoint*>(NULL);
+    mpMapPointsSnapshot.reset();
+    mpBowMatchIndex.reset();
+    mnChangeIdx++;
 }
 
 void KeyFrame::EraseMapPointMatch(MapPoint* pMP)
 {
     int idx = pMP->GetIndexInKeyFrame(this);
     if(idx>=0)
+    {
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
         mvpMapPoints[idx]=static_cast<MapPoint*>(NULL);
+        mpMapPointsSnapshot.reset();
+        mpBowMatchIndex.reset();
+        mnChangeIdx++;
+    }
 }
 
 
 void KeyFrame::ReplaceMapPointMatch(const size_t &idx, MapPoint* pMP)
 {
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
     mvpMapPoints[idx]=pMP;
+    mpMapPointsSnapshot.reset();
+    mpBowMatchIndex.reset();
+    mnChangeIdx++;
+}
+
+void KeyFrame::ReplaceMapPointMatches(const vector<pair<size_t, MapPoint*> > &vMatches)
+{
+    if(vMatches.empty())
+        return;
+
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
+    for(size_t i=0, iend=vMatches.size(); i<iend; i++)
+        mvpMapPoints[vMatches[i].first]=vMatches[i].second;
+    mpMapPointsSnapshot.reset();
+    mpBowMatchIndex.reset();
+    mnChangeIdx++;
 }
 
 set<MapPoint*> KeyFrame::GetMapPoints()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
     set<MapPoint*> s;
     for(size_t i=0, iend=mvpMapPoints.size(); i<iend; i++)
     {
@@ -249,7 +327,7 @@ set<MapPoint*> KeyFrame::GetMapPoints()
 
 int KeyFrame::TrackedMapPoints(const int &minObs)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
 
     int nPoints=0;
     const bool bCheckObs = minObs>0;
@@ -276,169 +354,144 @@ int KeyFrame::TrackedMapPoints(const int &minObs)
 
 vector<MapPoint*> KeyFrame::GetMapPointMatches()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
     return mvpMapPoints;
 }
 
-MapPoint* KeyFrame::GetMapPoint(const size_t &idx)
+KeyFrame::MapPointMatchesSnapshot KeyFrame::GetMapPointMatchesSnapshot()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    return mvpMapPoints[idx];
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
+    if(!mpMapPointsSnapshot)
+        mpMapPointsSnapshot = make_shared<const vector<MapPoint*> >(mvpMapPoints);
+    return mpMapPointsSnapshot;
 }
 
-void KeyFrame::UpdateConnections()
+KeyFrame::BowMatchIndexPtr KeyFrame::GetBowMatchIndex()
 {
-    map<KeyFrame*,int> KFcounter;
-
-    vector<MapPoint*> vpMP;
-
+    MapPointMatchesSnapshot pMatches;
     {
-        unique_lock<mutex> lockMPs(mMutexFeatures);
-        vpMP = mvpMapPoints;
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
+        if(mpBowMatchIndex)
+            return mpBowMatchIndex;
+        if(!mpMapPointsSnapshot)
+            mpMapPointsSnapshot = make_shared<const vector<MapPoint*> >(mvpMapPoints);
+        pMatches = mpMapPointsSnapshot;
     }
 
-    //For all map points in keyframe check in which other keyframes are they seen
-    //Increase counter for those keyframes
-    // counts how many points it shares with which keyframes
-    for(vector<MapPoint*>::iterator vit=vpMP.begin(), vend=vpMP.end(); vit!=vend; vit++)
-    {
-        MapPoint* pMP = *vit;
+    // Built without the lock, the descriptors and the feature vector do not change. Only kept if
+    // the matches did not change meanwhile and the BoW was already computed.
+    BowMatchIndexPtr pIndex = make_shared<const BowMatchIndex>(mFeatVec,mDescriptors,*pMatches);
 
-        if(!pMP)
-            continue;
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
+    if(mpMapPointsSnapshot==pMatches && !mFeatVec.empty())
+        mpBowMatchIndex = pIndex;
+    return pIndex;
+}
 
-        if(pMP->isBad())
-            continue;
+MapPoint* KeyFrame::GetMapPoint(const size_t &idx)
+{
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
+    return mvpMapPoints[idx];
+}
 
-        map<KeyFrame*,size_t> observations = pMP->GetObservations();
+void KeyFrame::UpdateConnections()
+{
+    const bool bOrigin = IsOrigin();
 
-        for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
-        {
-            if(mit->first->mnId==mnId)
-                continue;
-            KFcounter[mit->first]++;
-        }
-    }
+    unique_lock<MapMutex> lockCon(LOCK_SITE(mMutexConnections));
 
     // This should not happen
-    if(KFcounter.empty())
+    if(mConnections.empty())
         return;
 
-    //If the counter is greater than threshold add connection
-    //In case no keyframe counter is over threshold add the one with maximum counter
-    int nmax=0;
-    KeyFrame* pKFmax=NULL;
-    int th = 15; //param
-
-    vector<pair<int,KeyFrame*> > vPairs;
-    vPairs.reserve(KFcounter.size());
-    for(map<KeyFrame*,int>::iterator mit=KFcounter.begin(), mend=KFcounter.end(); mit!=mend; mit++)
-    {
-        if(mit->second>nmax)
-        {
-            nmax=mit->second;
-            pKFmax=mit->first;
-        }
-        if(mit->second>=th)
-        {
-            vPairs.push_back(make_pair(mit->second,mit->first));
-            (mit->first)->AddConnection(this,mit->second);
-        }
-    }
-
-    if(vPairs.empty())
+    if(mbFirstConnection && !bOrigin)
     {
-        vPairs.push_back(make_pair(nmax,pKFmax));
-        pKFmax->AddConnection(this,nmax);
+        mpParent = mConnections.KeyFrames().front();
+        mpParent->AddChild(this);
+        mbFirstConnection = false;
     }
 
-    sort(vPairs.begin(),vPairs.end());
-    list<KeyFrame*> lKFs;
-    list<int> lWs;
-    for(size_t i=0; i<vPairs.size();i++)
-    {
-        lKFs.push_front(vPairs[i].second);
-        lWs.push_front(vPairs[i].first);
-    }
-
-    {
-        unique_lock<mutex> lockCon(mMutexConnections);
-
-        // mspConnectedKeyFrames = spConnectedKeyFrames;
-        mConnectedKeyFrameWeights = KFcounter;
-        mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
-        mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());
-
-        if(mbFirstConnection && mnId!=0)
-        {
-            mpParent = mvpOrderedConnectedKeyFrames.front();
-            mpParent->AddChild(this);
-            mbFirstConnection = false;
-        }
-
-    }
+    mnChangeIdx++;
 }
 
 void KeyFrame::AddChild(KeyFrame *pKF)
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    unique_lock<MapMutex> lockCon(LOCK_SITE(mMutexConnections));
     mspChildrens.insert(pKF);
+    mnChangeIdx++;
 }
 
 void KeyFrame::EraseChild(KeyFrame *pKF)
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    unique_lock<MapMutex> lockCon(LOCK_SITE(mMutexConnections));
     mspChildrens.erase(pKF);
+    mnChangeIdx++;
 }
 
 void KeyFrame::ChangeParent(KeyFrame *pKF)
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    unique_lock<MapMutex> lockCon(LOCK_SITE(mMutexConnections));
     mpParent = pKF;
+    // The origin of a merged map keeps the parent it gets here
+    mbFirstConnection = false;
     pKF->AddChild(this);
+    mnChangeIdx++;
 }
 
 set<KeyFrame*> KeyFrame::GetChilds()
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    MapReadLock lockCon(LOCK_SITE(mMutexConnections));
     return mspChildrens;
 }
 
 KeyFrame* KeyFrame::GetParent()
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    MapReadLock lockCon(LOCK_SITE(mMutexConnections));
     return mpParent;
 }
 
+bool KeyFrame::IsOrigin()
+{
+    return mpMap->IsOrigin(this);
+}
+
+KeyFrame* KeyFrame::GetRigBody()
+{
+    if(mpRigKF && !mpRigKF->isBad())
+        return mpRigKF;
+    return this;
+}
+
 bool KeyFrame::hasChild(KeyFrame *pKF)
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    MapReadLock lockCon(LOCK_SITE(mMutexConnections));
     return mspChildrens.count(pKF);
 }
 
 void KeyFrame::AddLoopEdge(KeyFrame *pKF)
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    unique_lock<MapMutex> lockCon(LOCK_SITE(mMutexConnections));
     mbNotErase = true;
     mspLoopEdges.insert(pKF);
+    mnChangeIdx++;
 }
 
 set<KeyFrame*> KeyFrame::GetLoopEdges()
 {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    MapReadLock lockCon(LOCK_SITE(mMutexConnections));
     return mspLoopEdges;
 }
 
 void KeyFrame::SetNotErase()
 {
-    unique_lock<mutex> lock(mMutexConnections);
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
     mbNotErase = true;
 }
 
 void KeyFrame::SetErase()
 {
     {
-        unique_lock<mutex> lock(mMutexConnections);
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
         if(mspLoopEdges.empty())
         {
             mbNotErase = false;
@@ -453,159 +506,376 @@ void KeyFrame::SetErase()
 
 void KeyFrame::SetBadFlag()
 {
+    SetBadFlag(vector<KeyFrame*>());
+}
+
+int KeyFrame::SetBadFlags(vector<KeyFrame*> vpKFs)
+{
+    vector<KeyFrame*> vpBatch = vpKFs;
+    sort(vpBatch.begin(),vpBatch.end());
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+
+    int nBad = 0;
+    for(size_t i=0; i<vpKFs.size(); i++)
     {
-        unique_lock<mutex> lock(mMutexConnections);
-        if(mnId==0)
-            return;
-        else if(mbNotErase)
+        vpKFs[i]->SetBadFlag(vpBatch);
+        if(vpKFs[i]->isBad())
+            nBad++;
+    }
+    return nBad;
+}
+
+void KeyFrame::SetBadFlag(const vector<KeyFrame*> &vpBatch)
+{
+    if(IsOrigin())
+        return;
+
+    {
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+        if(mbNotErase)
         {
             mbToBeErased = true;
             return;
         }
     }
 
-    for(map<KeyFrame*,int>::iterator mit = mConnectedKeyFrameWeights.begin(), mend=mConnectedKeyFrameWeights.end(); mit!=mend; mit++)
-        mit->first->EraseConnection(this);
-
+    // Erasing the observations takes the weights of the connections down to zero
     for(size_t i=0; i<mvpMapPoints.size(); i++)
         if(mvpMapPoints[i])
             mvpMapPoints[i]->EraseObservation(this);
+
+    // Points which observe this keyframe without a match in it may have left some
+    vector<KeyFrame*> vpConnected;
+    {
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+        vpConnected = mConnections.KeyFrames();
+    }
+    for(vector<KeyFrame*>::iterator vit=vpConnected.begin(), vend=vpConnected.end(); vit!=vend; vit++)
+        (*vit)->EraseConnection(this);
+
     {
-        unique_lock<mutex> lock(mMutexConnections);
-        unique_lock<mutex> lock1(mMutexFeatures);
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+        unique_lock<MapMutex> lock1(LOCK_SITE(mMutexFeatures));
 
-        mConnectedKeyFrameWeights.clear();
-        mvpOrderedConnectedKeyFrames.clear();
+        mConnections.clear();
+        mpConnectionsSnapshot.reset();
 
         // Update Spanning Tree
-        set<KeyFrame*> sParentCandidates;
-        sParentCandidates.insert(mpParent);
+        ReparentChildren(vpBatch);
 
-        // Assign at each iteration one children with a parent (the pair with highest covisibility weight)
-        // Include that children as new parent candidate for the rest
-        while(!mspChildrens.empty())
+        // Only the root of a discarded initialization has no parent
+        if(mpParent)
         {
-            bool bContinue = false;
+            mpParent->EraseChild(this);
+            mTcp = GetPose()*mpParent->GetPoseInverse();
+        }
+        mbBad = true;
+        mnChangeIdx++;
+    }
 
-            int max = -1;
-            KeyFrame* pC;
-            KeyFrame* pP;
 
-            for(set<KeyFrame*>::iterator sit=mspChildrens.begin(), send=mspChildrens.end(); sit!=send; sit++)
-            {
-                KeyFrame* pKF = *sit;
-                if(pKF->isBad())
-                    continue;
+    const bool bErased = mpMap->EraseKeyFrame(this);
+    mpKeyFrameDB->erase(this);
 
-                // Check if a parent candidate is connected to the keyframe
-                vector<KeyFrame*> vpConnected = pKF->GetVectorCovisibleKeyFrames();
-                for(size_t i=0, iend=vpConnected.size(); i<iend; i++)
-                {
-                    for(set<KeyFrame*>::iterator spcit=sParentCandidates.begin(), spcend=sParentCandidates.end(); spcit!=spcend; spcit++)
-                    {
-                        if(vpConnected[i]->mnId == (*spcit)->mnId)
-                        {
-                            int w = pKF->GetWeight(vpConnected[i]);
-                            if(w>max)
-                            {
-                                pC = pKF;
-                                pP = vpConnected[i];
-                                max = w;
-                                bContinue = true;
-                            }
-                        }
-                    }
-                }
-            }
+    // SetBadFlag can run more than once, only the first call hands it over
+    if(bErased)
+        mpMap->mReclaimer.Retire(this);
+}
 
-            if(bContinue)
-            {
-                pC->ChangeParent(pP);
-                sParentCandidates.insert(pC);
-                mspChildrens.erase(pC);
-            }
-            else
-                break;
-        }
+namespace
+{
 
-        // If a children has no covisibility links with any parent candidate, assign to the original parent of this KF
-        if(!mspChildrens.empty())
-            for(set<KeyFrame*>::iterator sit=mspChildrens.begin(); sit!=mspChildrens.end(); sit++)
+// Link of a child to a keyframe it could hang from. The heaviest comes first, ties go to the
+// oldest child and then the oldest parent, so the tree is the same for any memory layout.
+struct ParentLink
+{
+    ParentLink(const int w, const size_t i, KeyFrame* pChild, KeyFrame* pP):
+        weight(w), nChild(i), nChildId(pChild->mnId), pParent(pP) {}
+
+    bool operator<(const ParentLink &other) const
+    {
+        if(weight!=other.weight)
+            return weight<other.weight;
+        if(nChildId!=other.nChildId)
+            return nChildId>other.nChildId;
+        return pParent->mnId>other.pParent->mnId;
+    }
+
+    int weight;
+    size_t nChild;
+    long unsigned int nChildId;
+    KeyFrame* pParent;
+};
+
+} // namespace
+
+void KeyFrame::ReparentChildren(const vector<KeyFrame*> &vpBatch)
+{
+    vector<KeyFrame*> vpChildren;
+    vpChildren.reserve(mspChildrens.size());
+    for(set<KeyFrame*>::iterator sit=mspChildrens.begin(), send=mspChildrens.end(); sit!=send; sit++)
+        if(!(*sit)->isBad())
+            vpChildren.push_back(*sit);
+    sort(vpChildren.begin(),vpChildren.end(),KeyFrame::lId);
+    const size_t nChildren = vpChildren.size();
+
+    // The covisibility of every child is read once. Its links to the parent are candidates from
+    // the start, the ones to another child once that child is placed.
+    priority_queue<ParentLink> queue;
+    vector<vector<ParentLink> > vvLinksFrom(nChildren);
+    for(size_t i=0; i<nChildren; i++)
+    {
+        KeyFrame* pKF = vpChildren[i];
+        const CovisibilitySnapshot pConnections = pKF->GetCovisibilitySnapshot();
+        const vector<KeyFrame*> &vpConnected = pConnections->KeyFrames();
+        const vector<int> &vWeights = pConnections->Weights();
+        for(size_t j=0, jend=pConnections->NumOrdered(); j<jend; j++)
+        {
+            KeyFrame* pKFj = vpConnected[j];
+            if(pKFj==mpParent)
             {
-                (*sit)->ChangeParent(mpParent);
+                queue.push(ParentLink(vWeights[j],i,pKF,pKFj));
+                continue;
             }
 
-        mpParent->EraseChild(this);
-        mTcp = Tcw*mpParent->GetPoseInverse();
-        mbBad = true;
+            vector<KeyFrame*>::const_iterator it = lower_bound(vpChildren.begin(),vpChildren.end(),pKFj,KeyFrame::lId);
+            if(it==vpChildren.end() || *it!=pKFj || binary_search(vpBatch.begin(),vpBatch.end(),pKFj))
+                continue;
+            vvLinksFrom[it-vpChildren.begin()].push_back(ParentLink(vWeights[j],i,pKF,pKFj));
+        }
     }
 
+    // Assign at each step the child with the heaviest link to a parent candidate, which then
+    // is a parent candidate for the rest
+    vector<bool> vbPlaced(nChildren,false);
+    while(!queue.empty())
+    {
+        const ParentLink link = queue.top();
+        queue.pop();
+        if(vbPlaced[link.nChild])
+            continue;
 
-    mpMap->EraseKeyFrame(this);
-    mpKeyFrameDB->erase(this);
+        KeyFrame* pC = vpChildren[link.nChild];
+        vbPlaced[link.nChild] = true;
+        pC->ChangeParent(link.pParent);
+        mspChildrens.erase(pC);
+
+        const vector<ParentLink> &vLinks = vvLinksFrom[link.nChild];
+        for(size_t j=0, jend=vLinks.size(); j<jend; j++)
+            if(!vbPlaced[vLinks[j].nChild])
+                queue.push(vLinks[j]);
+    }
+
+    // If a children has no covisibility links with any parent candidate, assign to the original parent of this KF
+    for(set<KeyFrame*>::iterator sit=mspChildrens.begin(); sit!=mspChildrens.end(); sit++)
+        (*sit)->ChangeParent(mpParent);
 }
 
-bool KeyFrame::isBad()
+void KeyFrame::ReleaseFeatures()
 {
-    unique_lock<mutex> lock(mMutexConnections);
-    return mbBad;
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+    unique_lock<MapMutex> lock1(LOCK_SITE(mMutexFeatures));
+
+    {
+        unique_lock<MapMutex> lock2(LOCK_SITE(mMutexCold));
+        mvKeys.clear();
+        mvKeysUn.clear();
+        mvuRight.clear();
+        mvDepth.clear();
+        mpCompactFeatures.reset();
+        mbCompact = false;
+    }
+    mvColors.clear();
+    DescriptorArena::Global().Free(mDescriptors);
+    mDescriptors.release();
+
+    DBoW2::BowVector().swap(mBowVec);
+    DBoW2::FeatureVector().swap(mFeatVec);
+
+    vector<MapPoint*>().swap(mvpMapPoints);
+    mpMapPointsSnapshot.reset();
+    mpBowMatchIndex.reset();
+    mnChangeIdx++;
+    mpGrid.reset();
+
+    CovisibilityList().swap(mConnections);
+    mpConnectionsSnapshot.reset();
 }
 
-void KeyFrame::EraseConnection(KeyFrame* pKF)
+void KeyFrame::AddMemoryUsage(MemoryUsage &usage)
 {
-    bool bUpdate = false;
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+    unique_lock<MapMutex> lock1(LOCK_SITE(mMutexFeatures));
+
     {
-        unique_lock<mutex> lock(mMutexConnections);
-        if(mConnectedKeyFrameWeights.count(pKF))
-        {
-            mConnectedKeyFrameWeights.erase(pKF);
-            bUpdate=true;
-        }
+        unique_lock<MapMutex> lock2(LOCK_SITE(mMutexCold));
+        const size_t nKeysUn = mvKeysUn.SharesElements(mvKeys) ? 0 : mvKeysUn.size();
+        const size_t nDepth = mvDepth.SharesElements(mvuRight) ? 0 : mvDepth.size();
+        usage.keyFrameKeyPoints += (mvKeys.size()+nKeysUn)*sizeof(cv::KeyPoint)+(mvuRight.size()+nDepth)*sizeof(float);
+        if(mpCompactFeatures)
+            usage.keyFrameKeyPoints += mpCompactFeatures->GetMemoryUsage();
+    }
+    usage.keyFrameKeyPoints += mvColors.size()*sizeof(cv::Vec3b);
+    usage.keyFrameDescriptors += mDescriptors.total()*mDescriptors.elemSize();
+
+    if(mpGrid)
+    {
+        const size_t nCells = mpGrid->Cols()*mpGrid->Rows();
+        usage.keyFrameGrids += sizeof(FeatureGrid)+(nCells+1+mpGrid->Offsets()[nCells])*sizeof(unsigned int);
     }
 
-    if(bUpdate)
-        UpdateBestCovisibles();
+    // A node of a std::map is about four pointers besides its value
+    const size_t nMapNode = 4*sizeof(void*);
+    usage.keyFrameBoW += mBowVec.size()*(nMapNode+sizeof(DBoW2::BowVector::value_type));
+    for(DBoW2::FeatureVector::const_iterator fit=mFeatVec.begin(); fit!=mFeatVec.end(); fit++)
+        usage.keyFrameBoW += nMapNode+sizeof(DBoW2::FeatureVector::value_type)+fit->second.capacity()*sizeof(unsigned int);
+    if(mpBowMatchIndex)
+        usage.keyFrameBoW += sizeof(BowMatchIndex)+mpBowMatchIndex->GetMemoryUsage();
+
+    usage.keyFrameOther += sizeof(KeyFrame)+mvpMapPoints.capacity()*sizeof(MapPoint*)+
+                           mConnections.KeyFrames().capacity()*sizeof(KeyFrame*)+mConnections.Weights().capacity()*sizeof(int)+
+                           (mspChildrens.size()+mspLoopEdges.size())*(nMapNode+sizeof(KeyFrame*));
+    usage.nKeyFrames++;
+}
+
+unsigned long KeyFrame::GetChangeIdx()
+{
+    return mnChangeIdx;
+}
+
+bool KeyFrame::isBad()
+{
+    return mbBad.load(memory_order_acquire);
+}
+
+void KeyFrame::EraseConnection(KeyFrame* pKF)
+{
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexConnections));
+    if(!mConnections.Erase(pKF))
+        return;
+    mpConnectionsSnapshot.reset();
+    mnChangeIdx++;
 }
 
 vector<size_t> KeyFrame::GetFeaturesInArea(const float &x, const float &y, const float &r) const
 {
     vector<size_t> vIndices;
-    vIndices.reserve(N);
+    GetFeaturesInArea(x,y,r,mvKeysUn,vIndices);
+    return vIndices;
+}
+
+void KeyFrame::GetFeaturesInArea(const float &x, const float &y, const float &r, const SharedArray<cv::KeyPoint> &vKeysUn,
+                                 vector<size_t> &vIndices) const
+{
+    vIndices.clear();
 
     const int nMinCellX = max(0,(int)floor((x-mnMinX-r)*mfGridElementWidthInv));
     if(nMinCellX>=mnGridCols)
-        return vIndices;
+        return;
 
     const int nMaxCellX = min((int)mnGridCols-1,(int)ceil((x-mnMinX+r)*mfGridElementWidthInv));
     if(nMaxCellX<0)
-        return vIndices;
+        return;
 
     const int nMinCellY = max(0,(int)floor((y-mnMinY-r)*mfGridElementHeightInv));
     if(nMinCellY>=mnGridRows)
-        return vIndices;
+        return;
 
     const int nMaxCellY = min((int)mnGridRows-1,(int)ceil((y-mnMinY+r)*mfGridElementHeightInv));
     if(nMaxCellY<0)
-        return vIndices;
+        return;
 
     for(int ix = nMinCellX; ix<=nMaxCellX; ix++)
     {
         for(int iy = nMinCellY; iy<=nMaxCellY; iy++)
         {
-            const vector<size_t> vCell = mGrid[ix][iy];
-            for(size_t j=0, jend=vCell.size(); j<jend; j++)
+            const unsigned int* pCellEnd = mpGrid->CellEnd(ix,iy);
+            for(const unsigned int* pIdx=mpGrid->CellBegin(ix,iy); pIdx!=pCellEnd; pIdx++)
             {
-                const cv::KeyPoint &kpUn = mvKeysUn[vCell[j]];
+                const cv::KeyPoint &kpUn = vKeysUn[*pIdx];
                 const float distx = kpUn.pt.x-x;
                 const float disty = kpUn.pt.y-y;
 
                 if(fabs(distx)<r && fabs(disty)<r)
-                    vIndices.push_back(vCell[j]);
+                    vIndices.push_back(*pIdx);
             }
         }
     }
+}
 
-    return vIndices;
+KeyFrame::Features KeyFrame::GetFeatures()
+{
+    Features features;
+    shared_ptr<const CompactFeatures> pCompact;
+    {
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexCold));
+        if(!mpCompactFeatures)
+        {
+            features.vKeys = mvKeys;
+            features.vKeysUn = mvKeysUn;
+            features.vuRight = mvuRight;
+            features.vDepth = mvDepth;
+            return features;
+        }
+        pCompact = mpCompactFeatures;
+    }
+
+    // Decoded outside the lock, the compact features never change
+    pCompact->Expand(features.vKeys,features.vKeysUn,features.vuRight,features.vDepth);
+    return features;
+}
+
+int KeyFrame::GetOctave(const size_t idx)
+{
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexCold));
+    return mpCompactFeatures ? mpCompactFeatures->Octave(idx) : mvKeysUn[idx].octave;
+}
+
+float KeyFrame::GetRight(const size_t idx)
+{
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexCold));
+    return mpCompactFeatures ? mpCompactFeatures->Right(idx) : mvuRight[idx];
+}
+
+void KeyFrame::Compact()
+{
+    // Arrays which are views of a mapped file cost no heap
+    if(mbCompact || mvKeys.empty() || !mvKeys.OwnsElements())
+        return;
+
+    // Built from the arrays before they are swapped out, no other thread writes them
+    shared_ptr<const CompactFeatures> pCompact = make_shared<CompactFeatures>(mvKeys,mvKeysUn,mvuRight,mvDepth);
+    SharedArray<cv::KeyPoint> vKeys, vKeysUn;
+    SharedArray<float> vuRight, vDepth;
+    {
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexCold));
+        mpCompactFeatures = pCompact;
+        mbCompact = true;
+        // Freed outside the lock, or later by a reader still holding them
+        swap(vKeys,mvKeys);
+        swap(vKeysUn,mvKeysUn);
+        swap(vuRight,mvuRight);
+        swap(vDepth,mvDepth);
+    }
+}
+
+void KeyFrame::Expand()
+{
+    if(!mbCompact)
+        return;
+
+    SharedArray<cv::KeyPoint> vKeys, vKeysUn;
+    SharedArray<float> vuRight, vDepth;
+    mpCompactFeatures->Expand(vKeys,vKeysUn,vuRight,vDepth);
+    {
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexCold));
+        swap(vKeys,mvKeys);
+        swap(vKeysUn,mvKeysUn);
+        swap(vuRight,mvuRight);
+        swap(vDepth,mvDepth);
+        mpCompactFeatures.reset();
+        mbCompact = false;
+    }
 }
 
 bool KeyFrame::IsInImage(const float &x, const float &y) const
@@ -624,7 +894,7 @@ cv::Mat KeyFrame::UnprojectStereo(int i)
         const float y = (v-cy)*z*invfy;
         cv::Mat x3Dc = (cv::Mat_<float>(3,1) << x, y, z);
 
-        unique_lock<mutex> lock(mMutexPose);
+        const cv::Mat Twc = GetPoseInverse();
         return Twc.rowRange(0,3).colRange(0,3)*x3Dc+Twc.rowRange(0,3).col(3);
     }
     else
@@ -636,10 +906,9 @@ float KeyFrame::ComputeSceneMedianDepth(const int q)
     vector<MapPoint*> vpMapPoints;
     cv::Mat Tcw_;
     {
-        unique_lock<mutex> lock(mMutexFeatures);
-        unique_lock<mutex> lock2(mMutexPose);
+        MapReadLock lock(LOCK_SITE(mMutexFeatures));
         vpMapPoints = mvpMapPoints;
-        Tcw_ = Tcw.clone();
+        Tcw_ = GetPose();
     }
 
     vector<float> vDepths;
@@ -658,6 +927,10 @@ float KeyFrame::ComputeSceneMedianDepth(const int q)
         }
     }
 
+    // A keyframe of a rig camera may not see any point yet
+    if(vDepths.empty())
+        return -1;
+
     sort(vDepths.begin(),vDepths.end());
 
     return vDepths[(vDepths.size()-1)/q];
@@ -21,100 +21,305 @@
 #include "KeyFrameDatabase.h"
 
 #include "KeyFrame.h"
+#include "ThreadPool.h"
+#include "VocabularyLoader.h"
 #include "Thirdparty/DBoW2/DBoW2/BowVector.h"
 
+#include<algorithm>
+#include<functional>
 #include<mutex>
+#include<queue>
 
 using namespace std;
 
 namespace ORB_SLAM2
 {
 
-KeyFrameDatabase::KeyFrameDatabase (const ORBVocabulary &voc):
-    mpVoc(&voc)
+namespace
 {
-    mvInvertedFile.resize(voc.size());
+void RunTasks(ThreadPool* pThreadPool, const int n, const function<void(int)> &task)
+{
+    if(pThreadPool)
+        pThreadPool->ParallelFor(n, task);
+    else
+        for(int i=0; i<n; i++)
+            task(i);
+}
+}
+
+KeyFrameDatabase::KeyFrameDatabase (const ORBVocabulary &voc, const int nRelocTopK):
+    mpVoc(&voc), mnRelocTopK(nRelocTopK)
+{
+    // A vocabulary still loading has no words yet, the inverted file grows with the first keyframe
+    if(!VocabularyLoader::IsLoading(mpVoc))
+        mvInvertedFile.resize(voc.size());
 }
 
 
 void KeyFrameDatabase::add(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutex);
+    unique_lock<SharedMutex> lock(mMutex);
+
+    // the BoW of the keyframe waited for the vocabulary
+    if(mvInvertedFile.size()<mpVoc->size())
+        mvInvertedFile.resize(mpVoc->size());
 
     for(DBoW2::BowVector::const_iterator vit= pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit!=vend; vit++)
-        mvInvertedFile[vit->first].push_back(pKF);
+    {
+        Posting posting;
+        posting.nId = pKF->mnId;
+        posting.weight = vit->second;
+        vector<Posting> &vPostings = mvInvertedFile[vit->first];
+        if(vPostings.capacity()==0)
+            mvnUsedWords.push_back(vit->first);
+        vPostings.push_back(posting);
+    }
+
+    if(pKF->mnId>=mvpKeyFrames.size())
+        mvpKeyFrames.resize(pKF->mnId+1,static_cast<KeyFrame*>(NULL));
+    mvpKeyFrames[pKF->mnId] = pKF;
 }
 
 void KeyFrameDatabase::erase(KeyFrame* pKF)
 {
-    unique_lock<mutex> lock(mMutex);
+    unique_lock<SharedMutex> lock(mMutex);
 
     // Erase elements in the Inverse File for the entry
     for(DBoW2::BowVector::const_iterator vit=pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit!=vend; vit++)
     {
+        // a keyframe erased before the first one was added is in no list
+        if(vit->first>=mvInvertedFile.size())
+            break;
+
         // List of keyframes that share the word
-        list<KeyFrame*> &lKFs =   mvInvertedFile[vit->first];
+        vector<Posting> &vPostings = mvInvertedFile[vit->first];
 
-        for(list<KeyFrame*>::iterator lit=lKFs.begin(), lend= lKFs.end(); lit!=lend; lit++)
+        for(vector<Posting>::iterator pit=vPostings.begin(), pend=vPostings.end(); pit!=pend; pit++)
         {
-            if(pKF==*lit)
+            if(pit->nId==pKF->mnId)
             {
-                lKFs.erase(lit);
+                // keeps the order of insertion, the candidates are found in that order
+                vPostings.erase(pit);
                 break;
             }
         }
     }
+
+    if(pKF->mnId<mvpKeyFrames.size())
+        mvpKeyFrames[pKF->mnId] = static_cast<KeyFrame*>(NULL);
+
+    mThumbnails.Erase(pKF);
 }
 
 void KeyFrameDatabase::clear()
 {
-    mvInvertedFile.clear();
-    mvInvertedFile.resize(mpVoc->size());
+    unique_lock<SharedMutex> lock(mMutex);
+
+    // Only the lists of words ever used hold anything, they keep their buffers for the next map
+    for(size_t i=0; i<mvnUsedWords.size(); i++)
+        mvInvertedFile[mvnUsedWords[i]].clear();
+    mvpKeyFrames.clear();
+    mThumbnails.Clear();
 }
 
+void KeyFrameDatabase::AddThumbnail(KeyFrame* pKF, const vector<uint8_t> &signature)
+{
+    mThumbnails.Add(pKF,signature);
+}
 
-vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float minScore)
+bool KeyFrameDatabase::HasThumbnails()
 {
-    set<KeyFrame*> spConnectedKeyFrames = pKF->GetConnectedKeyFrames();
-    list<KeyFrame*> lKFsSharingWords;
+    return !mThumbnails.Empty();
+}
 
-    // Search all keyframes that share a word with current keyframes
-    // Discard keyframes connected to the query keyframe
+void KeyFrameDatabase::DetectThumbnailCandidates(const vector<uint8_t> &signature, const int nK, const int maxDistance,
+                                                 vector<ThumbnailIndex::Match> &vMatches)
+{
+    mThumbnails.Search(signature,nK,maxDistance,vMatches);
+}
+
+size_t KeyFrameDatabase::GetMemoryUsage()
+{
+    SharedLock lock(mMutex);
+
+    size_t bytes = mvInvertedFile.capacity()*sizeof(vector<Posting>)+mvpKeyFrames.capacity()*sizeof(KeyFrame*);
+    for(size_t i=0; i<mvInvertedFile.size(); i++)
+        bytes += mvInvertedFile[i].capacity()*sizeof(Posting);
+    return bytes+mThumbnails.GetMemoryUsage();
+}
+
+bool KeyFrameDatabase::Save(const string &filename)
+{
+    SharedLock lock(mMutex);
+
+    // By increasing mnId
+    vector<KeyFrame*> vpKFs;
+    for(size_t i=0; i<mvpKeyFrames.size(); i++)
     {
-        unique_lock<mutex> lock(mMutex);
+        if(mvpKeyFrames[i] && !mvpKeyFrames[i]->isBad())
+            vpKFs.push_back(mvpKeyFrames[i]);
+    }
 
-        for(DBoW2::BowVector::const_iterator vit=pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit != vend; vit++)
-        {
-            list<KeyFrame*> &lKFs =   mvInvertedFile[vit->first];
+    VocabularyLoader::Wait(mpVoc);
+    return KeyFrameDatabaseFile::Write(filename,vpKFs,mpVoc->size());
+}
 
-            for(list<KeyFrame*>::iterator lit=lKFs.begin(), lend= lKFs.end(); lit!=lend; lit++)
+bool KeyFrameDatabase::LoadPrior(const string &filename)
+{
+    VocabularyLoader::Wait(mpVoc);
+    unique_lock<SharedMutex> lock(mMutex);
+
+    return mPrior.Open(filename,mpVoc->size());
+}
+
+void KeyFrameDatabase::SearchSharedWords(const DBoW2::BowVector &bowVec, const set<KeyFrame*>* pExcluded,
+                                         const PosePrior* pPrior, Query &query)
+{
+    const float fSqRadius = pPrior ? pPrior->fRadius*pPrior->fRadius : 0;
+    Eigen::Vector3f Ow;
+    for(DBoW2::BowVector::const_iterator vit=bowVec.begin(), vend=bowVec.end(); vit != vend; vit++)
+    {
+        // before the first keyframe of an asynchronously loaded vocabulary it has no words
+        if(vit->first>=mvInvertedFile.size())
+            continue;
+        const vector<Posting> &vPostings = mvInvertedFile[vit->first];
+        const float weight = vit->second;
+
+        for(vector<Posting>::const_iterator pit=vPostings.begin(), pend=vPostings.end(); pit!=pend; pit++)
+        {
+            const unsigned int nId = pit->nId;
+            if(query.vnWords[nId]==0)
             {
-                KeyFrame* pKFi=*lit;
-                if(pKFi->mnLoopQuery!=pKF->mnId)
+                KeyFrame* pKFi = mvpKeyFrames[nId];
+                bool bCandidate = !pExcluded || !pExcluded->count(pKFi);
+                // Once per keyframe, on its first shared word
+                if(bCandidate && pPrior && pKFi->mnMapId==pPrior->nMapId)
                 {
-                    pKFi->mnLoopWords=0;
-                    if(!spConnectedKeyFrames.count(pKFi))
-                    {
-                        pKFi->mnLoopQuery=pKF->mnId;
-                        lKFsSharingWords.push_back(pKFi);
-                    }
+                    pKFi->GetCameraCenter(Ow);
+                    bCandidate = (Ow-pPrior->center).squaredNorm()<=fSqRadius;
+                }
+                if(bCandidate)
+                {
+                    query.vbCandidate[nId] = true;
+                    query.vpCandidates.push_back(pKFi);
                 }
-                pKFi->mnLoopWords++;
             }
+            query.vnWords[nId]++;
+            query.vScoreBound[nId] += min(weight,pit->weight);
         }
     }
+}
+
+void KeyFrameDatabase::ScoreKeyFrames(const DBoW2::BowVector &bowVec, const vector<KeyFrame*> &vpKFs, Query &query,
+                                      ThreadPool* pThreadPool) const
+{
+    // Every task writes the score of its own keyframe
+    RunTasks(pThreadPool, vpKFs.size(), [&](int i)
+    {
+        query.vScore[vpKFs[i]->mnId] = mpVoc->score(bowVec,vpKFs[i]->mBowVec);
+    });
+}
+
+void KeyFrameDatabase::SelectTopK(const DBoW2::BowVector &bowVec, const int nK, vector<KeyFrame*> &vpKFs, Query &query,
+                                  ThreadPool* pThreadPool) const
+{
+    vector<KeyFrame*> vpScored;
+
+    if(mpVoc->getScoringType()==DBoW2::L1_NORM)
+    {
+        // The weights are positive, so min(v_i,w_i) of the shared words sums to the L1 score
+        vector<KeyFrame*> vpSorted = vpKFs;
+        stable_sort(vpSorted.begin(),vpSorted.end(),[&](KeyFrame* pKF1, KeyFrame* pKF2)
+        {
+            return query.vScoreBound[pKF1->mnId]>query.vScoreBound[pKF2->mnId];
+        });
+
+        // The nK best scores so far, the smallest on top
+        priority_queue<float, vector<float>, greater<float> > qBest;
+
+        // The bounds are summed in float, the scores in double
+        const float tolerance = 1e-4;
+
+        const int nBatch = pThreadPool ? pThreadPool->GetNumThreads()+1 : 1;
+        size_t nScored = 0;
+        while(nScored<vpSorted.size())
+        {
+            // No keyframe left can make the cut
+            if(static_cast<int>(qBest.size())==nK && query.vScoreBound[vpSorted[nScored]->mnId]+tolerance<qBest.top())
+                break;
+
+            const size_t nEnd = min(vpSorted.size(),nScored+nBatch);
+            const vector<KeyFrame*> vpBatch(vpSorted.begin()+nScored,vpSorted.begin()+nEnd);
+            ScoreKeyFrames(bowVec,vpBatch,query,pThreadPool);
+
+            for(size_t i=0; i<vpBatch.size(); i++)
+            {
+                qBest.push(query.vScore[vpBatch[i]->mnId]);
+                if(static_cast<int>(qBest.size())>nK)
+                    qBest.pop();
+            }
+            nScored = nEnd;
+        }
+
+        vpScored.assign(vpSorted.begin(),vpSorted.begin()+nScored);
+    }
+    else
+    {
+        // No bound for this score, every keyframe is scored
+        ScoreKeyFrames(bowVec,vpKFs,query,pThreadPool);
+        vpScored = vpKFs;
+    }
+
+    // The nK best scores, the keyframes remain in the order in which they were found
+    if(static_cast<int>(vpScored.size())>nK)
+    {
+        nth_element(vpScored.begin(),vpScored.begin()+nK-1,vpScored.end(),[&](KeyFrame* pKF1, KeyFrame* pKF2)
+        {
+            return query.vScore[pKF1->mnId]>query.vScore[pKF2->mnId];
+        });
+        vpScored.resize(nK);
+    }
+
+    vector<unsigned char> vbSelected(query.vScore.size(),false);
+    for(size_t i=0; i<vpScored.size(); i++)
+        vbSelected[vpScored[i]->mnId] = true;
+
+    vector<KeyFrame*> vpSelected;
+    vpSelected.reserve(vpScored.size());
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        if(vbSelected[vpKFs[i]->mnId])
+            vpSelected.push_back(vpKFs[i]);
+    }
+    vpKFs.swap(vpSelected);
+}
+
+vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float minScore, const PosePrior* pPrior)
+{
+    set<KeyFrame*> spConnectedKeyFrames = pKF->GetConnectedKeyFrames();
+
+    // Search all keyframes that share a word with current keyframes
+    // Discard keyframes connected to the query keyframe
+    Query query;
+    {
+        SharedLock lock(mMutex);
+
+        query.Resize(mvpKeyFrames.size());
+        SearchSharedWords(pKF->mBowVec,&spConnectedKeyFrames,pPrior,query);
+    }
+    const vector<KeyFrame*> &vpKFsSharingWords = query.vpCandidates;
 
-    if(lKFsSharingWords.empty())
+    if(vpKFsSharingWords.empty())
         return vector<KeyFrame*>();
 
     list<pair<float,KeyFrame*> > lScoreAndMatch;
 
     // Only compare against those keyframes that share enough words
     int maxCommonWords=0;
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
+    for(vector<KeyFrame*>::const_iterator vit=vpKFsSharingWords.begin(), vend=vpKFsSharingWords.end(); vit!=vend; vit++)
     {
-        if((*lit)->mnLoopWords>maxCommonWords)
-            maxCommonWords=(*lit)->mnLoopWords;
+        if(query.vnWords[(*vit)->mnId]>maxCommonWords)
+            maxCommonWords=query.vnWords[(*vit)->mnId];
     }
 
     int minCommonWords = maxCommonWords*0.8f; //param
@@ -122,17 +327,17 @@ vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float mi
     int nscores=0;
 
     // Compute similarity score. Retain the matches whose score is higher than minScore
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
+    for(vector<KeyFrame*>::const_iterator vit=vpKFsSharingWords.begin(), vend=vpKFsSharingWords.end(); vit!=vend; vit++)
     {
-        KeyFrame* pKFi = *lit;
+        KeyFrame* pKFi = *vit;
 
-        if(pKFi->mnLoopWords>minCommonWords)
+        if(query.vnWords[pKFi->mnId]>minCommonWords)
         {
             nscores++;
 
             float si = mpVoc->score(pKF->mBowVec,pKFi->mBowVec);
 
-            pKFi->mLoopScore = si;
+            query.vScore[pKFi->mnId] = si;
             if(si>=minScore)
                 lScoreAndMatch.push_back(make_pair(si,pKFi));
         }
@@ -148,21 +353,26 @@ vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float mi
     for(list<pair<float,KeyFrame*> >::iterator it=lScoreAndMatch.begin(), itend=lScoreAndMatch.end(); it!=itend; it++)
     {
         KeyFrame* pKFi = it->second;
-        vector<KeyFrame*> vpNeighs = pKFi->GetBestCovisibilityKeyFrames(10); //param
+        const KeyFrame::CovisibilitySnapshot pNeighs = pKFi->GetCovisibilitySnapshot();
+        const vector<KeyFrame*> &vpNeighs = pNeighs->KeyFrames();
+        const size_t nNeighs = min(pNeighs->NumOrdered(),static_cast<size_t>(10)); //param
 
         float bestScore = it->first;
         float accScore = it->first;
         KeyFrame* pBestKF = pKFi;
-        for(vector<KeyFrame*>::iterator vit=vpNeighs.begin(), vend=vpNeighs.end(); vit!=vend; vit++)
+        for(size_t iNeigh=0; iNeigh<nNeighs; iNeigh++)
         {
-            KeyFrame* pKF2 = *vit;
-            if(pKF2->mnLoopQuery==pKF->mnId && pKF2->mnLoopWords>minCommonWords)
+            KeyFrame* pKF2 = vpNeighs[iNeigh];
+            // Keyframes created after the query was started are not in its scratch
+            if(pKF2->mnId>=query.vnWords.size())
+                continue;
+            if(query.vbCandidate[pKF2->mnId] && query.vnWords[pKF2->mnId]>minCommonWords)
             {
-                accScore+=pKF2->mLoopScore;
-                if(pKF2->mLoopScore>bestScore)
+                accScore+=query.vScore[pKF2->mnId];
+                if(query.vScore[pKF2->mnId]>bestScore)
                 {
                     pBestKF=pKF2;
-                    bestScore = pKF2->mLoopScore;
+                    bestScore = query.vScore[pKF2->mnId];
                 }
             }
         }
@@ -196,110 +406,105 @@ vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float mi
     return vpLoopCandidates;
 }
 
-vector<KeyFrame*> KeyFrameDatabase::DetectRelocalizationCandidates(Frame *F)
+vector<KeyFrame*> KeyFrameDatabase::DetectRelocalizationCandidates(Frame *F, ThreadPool* pThreadPool,
+                                                                   const PosePrior* pPrior)
 {
-    list<KeyFrame*> lKFsSharingWords;
-
     // Search all keyframes that share a word with current frame
+    Query query;
     {
-        unique_lock<mutex> lock(mMutex);
-
-        for(DBoW2::BowVector::const_iterator vit=F->mBowVec.begin(), vend=F->mBowVec.end(); vit != vend; vit++)
-        {
-            list<KeyFrame*> &lKFs =   mvInvertedFile[vit->first];
+        SharedLock lock(mMutex);
 
-            for(list<KeyFrame*>::iterator lit=lKFs.begin(), lend= lKFs.end(); lit!=lend; lit++)
-            {
-                KeyFrame* pKFi=*lit;
-                if(pKFi->mnRelocQuery!=F->mnId)
-                {
-                    pKFi->mnRelocWords=0;
-                    pKFi->mnRelocQuery=F->mnId;
-                    lKFsSharingWords.push_back(pKFi);
-                }
-                pKFi->mnRelocWords++;
-            }
-        }
+        query.Resize(mvpKeyFrames.size());
+        SearchSharedWords(F->mBowVec,static_cast<set<KeyFrame*>*>(NULL),pPrior,query);
     }
-    if(lKFsSharingWords.empty())
+    const vector<KeyFrame*> &vpKFsSharingWords = query.vpCandidates;
+
+    if(vpKFsSharingWords.empty())
         return vector<KeyFrame*>();
 
     // Only compare against those keyframes that share enough words
     int maxCommonWords=0;
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
+    for(vector<KeyFrame*>::const_iterator vit=vpKFsSharingWords.begin(), vend=vpKFsSharingWords.end(); vit!=vend; vit++)
     {
-        if((*lit)->mnRelocWords>maxCommonWords)
-            maxCommonWords=(*lit)->mnRelocWords;
+        if(query.vnWords[(*vit)->mnId]>maxCommonWords)
+            maxCommonWords=query.vnWords[(*vit)->mnId];
     }
 
     int minCommonWords = maxCommonWords*0.8f; //param
 
-    list<pair<float,KeyFrame*> > lScoreAndMatch;
-
-    int nscores=0;
-
-    // Compute similarity score.
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
+    vector<KeyFrame*> vpKFsToScore;
+    vpKFsToScore.reserve(vpKFsSharingWords.size());
+    for(vector<KeyFrame*>::const_iterator vit=vpKFsSharingWords.begin(), vend=vpKFsSharingWords.end(); vit!=vend; vit++)
     {
-        KeyFrame* pKFi = *lit;
-
-        if(pKFi->mnRelocWords>minCommonWords)
-        {
-            nscores++;
-            float si = mpVoc->score(F->mBowVec,pKFi->mBowVec);
-            pKFi->mRelocScore=si;
-            lScoreAndMatch.push_back(make_pair(si,pKFi));
-        }
+        if(query.vnWords[(*vit)->mnId]>minCommonWords)
+            vpKFsToScore.push_back(*vit);
     }
 
-    if(lScoreAndMatch.empty())
-        return vector<KeyFrame*>();
+    // Compute similarity score.
+    if(mnRelocTopK>0 && static_cast<int>(vpKFsToScore.size())>mnRelocTopK)
+        SelectTopK(F->mBowVec,mnRelocTopK,vpKFsToScore,query,pThreadPool);
+    else
+        ScoreKeyFrames(F->mBowVec,vpKFsToScore,query,pThreadPool);
 
-    list<pair<float,KeyFrame*> > lAccScoreAndMatch;
-    float bestAccScore = 0;
+    const int nScored = vpKFsToScore.size();
+    if(nScored==0)
+        return vector<KeyFrame*>();
 
     // Lets now accumulate score by covisibility
-    for(list<pair<float,KeyFrame*> >::iterator it=lScoreAndMatch.begin(), itend=lScoreAndMatch.end(); it!=itend; it++)
+    vector<float> vAccScores(nScored);
+    vector<KeyFrame*> vpBestKFs(nScored);
+
+    RunTasks(pThreadPool, nScored, [&](int i)
     {
-        KeyFrame* pKFi = it->second;
-        vector<KeyFrame*> vpNeighs = pKFi->GetBestCovisibilityKeyFrames(10);
+        KeyFrame* pKFi = vpKFsToScore[i];
+        const KeyFrame::CovisibilitySnapshot pNeighs = pKFi->GetCovisibilitySnapshot();
+        const vector<KeyFrame*> &vpNeighs = pNeighs->KeyFrames();
+        const size_t nNeighs = min(pNeighs->NumOrdered(),static_cast<size_t>(10));
 
-        float bestScore = it->first;
+        float bestScore = query.vScore[pKFi->mnId];
         float accScore = bestScore;
         KeyFrame* pBestKF = pKFi;
-        for(vector<KeyFrame*>::iterator vit=vpNeighs.begin(), vend=vpNeighs.end(); vit!=vend; vit++)
+        for(size_t iNeigh=0; iNeigh<nNeighs; iNeigh++)
         {
-            KeyFrame* pKF2 = *vit;
-            if(pKF2->mnRelocQuery!=F->mnId)
+            KeyFrame* pKF2 = vpNeighs[iNeigh];
+            // Keyframes created after the query was started are not in its scratch
+            if(pKF2->mnId>=query.vnWords.size() || !query.vbCandidate[pKF2->mnId])
                 continue;
 
-            accScore+=pKF2->mRelocScore;
-            if(pKF2->mRelocScore>bestScore)
+            accScore+=query.vScore[pKF2->mnId];
+            if(query.vScore[pKF2->mnId]>bestScore)
             {
                 pBestKF=pKF2;
-                bestScore = pKF2->mRelocScore;
+                bestScore = query.vScore[pKF2->mnId];
             }
 
         }
-        lAccScoreAndMatch.push_back(make_pair(accScore,pBestKF));
-        if(accScore>bestAccScore)
-            bestAccScore=accScore;
+        vAccScores[i] = accScore;
+        vpBestKFs[i] = pBestKF;
+    });
+
+    float bestAccScore = 0;
+    for(int i=0; i<nScored; i++)
+    {
+        if(vAccScores[i]>bestAccScore)
+            bestAccScore=vAccScores[i];
     }
 
     // Return all those keyframes with a score higher than 0.75*bestScore
     float minScoreToRetain = 0.75f*bestAccScore; //param
     set<KeyFrame*> spAlreadyAddedKF;
     vector<KeyFrame*> vpRelocCandidates;
-    vpRelocCandidates.reserve(lAccScoreAndMatch.size());
-    for(list<pair<float,KeyFrame*> >::iterator it=lAccScoreAndMatch.begin(), itend=lAccScoreAndMatch.end(); it!=itend; it++)
+    vpRelocCandidates.reserve(nScored);
+    for(int i=0; i<nScored; i++)
     {
-        const float &si = it->first;
+        const float &si = vAccScores[i];
         if(si>minScoreToRetain)
         {
-            KeyFrame* pKFi = it->second;
+            KeyFrame* pKFi = vpBestKFs[i];
             if(!spAlreadyAddedKF.count(pKFi))
             {
-                pKFi->mbIsRelocalizationCandidate = true;
+                // only drawn by the viewer
+                pKFi->mnRelocalizationCandidateEpoch = KeyFrame::nRelocalizationEpoch;
                 vpRelocCandidates.push_back(pKFi);
                 spAlreadyAddedKF.insert(pKFi);
             }
@@ -309,4 +514,99 @@ vector<KeyFrame*> KeyFrameDatabase::DetectRelocalizationCandidates(Frame *F)
     return vpRelocCandidates;
 }
 
+vector<unsigned long> KeyFrameDatabase::DetectPriorRelocalizationCandidates(const DBoW2::BowVector &bowVec)
+{
+    SharedLock lock(mMutex);
+
+    const size_t N = mPrior.NumKeyFrames();
+    if(N==0)
+        return vector<unsigned long>();
+
+    // Search all keyframes that share a word with the query, by their index in the file
+    vector<int> vnWords(N,0);
+    vector<uint32_t> vnSharingWords;
+    for(DBoW2::BowVector::const_iterator vit=bowVec.begin(), vend=bowVec.end(); vit != vend; vit++)
+    {
+        for(const KeyFrameDatabaseFile::Entry *pit=mPrior.PostingsBegin(vit->first), *pend=mPrior.PostingsEnd(vit->first); pit!=pend; pit++)
+        {
+            if(vnWords[pit->n]==0)
+                vnSharingWords.push_back(pit->n);
+            vnWords[pit->n]++;
+        }
+    }
+
+    if(vnSharingWords.empty())
+        return vector<unsigned long>();
+
+    // Only compare against those keyframes that share enough words
+    int maxCommonWords=0;
+    for(size_t i=0; i<vnSharingWords.size(); i++)
+    {
+        if(vnWords[vnSharingWords[i]]>maxCommonWords)
+            maxCommonWords=vnWords[vnSharingWords[i]];
+    }
+
+    int minCommonWords = maxCommonWords*0.8f; //param
+
+    // Compute similarity score.
+    vector<float> vScore(N,0);
+    vector<uint32_t> vnScored;
+    DBoW2::BowVector bowVecKF;
+    for(size_t i=0; i<vnSharingWords.size(); i++)
+    {
+        const uint32_t idx = vnSharingWords[i];
+        if(vnWords[idx]>minCommonWords)
+        {
+            // Only the vectors of the keyframes scored are read from the file
+            mPrior.GetBowVector(idx,bowVecKF);
+            vScore[idx] = mpVoc->score(bowVec,bowVecKF);
+            vnScored.push_back(idx);
+        }
+    }
+
+    // Lets now accumulate score by covisibility
+    vector<float> vAccScores(vnScored.size());
+    vector<uint32_t> vnBest(vnScored.size());
+    float bestAccScore = 0;
+    for(size_t i=0; i<vnScored.size(); i++)
+    {
+        const KeyFrameDatabaseFile::Record &record = mPrior.GetRecord(vnScored[i]);
+
+        float bestScore = vScore[vnScored[i]];
+        float accScore = bestScore;
+        uint32_t nBest = vnScored[i];
+        for(uint32_t j=0; j<record.nCovisibles; j++)
+        {
+            // Keyframes which were not scored add 0
+            const uint32_t idx2 = record.vnCovisibles[j];
+            accScore+=vScore[idx2];
+            if(vScore[idx2]>bestScore)
+            {
+                nBest=idx2;
+                bestScore = vScore[idx2];
+            }
+        }
+        vAccScores[i] = accScore;
+        vnBest[i] = nBest;
+
+        if(accScore>bestAccScore)
+            bestAccScore=accScore;
+    }
+
+    // Return all those keyframes with a score higher than 0.75*bestScore
+    float minScoreToRetain = 0.75f*bestAccScore; //param
+    vector<unsigned char> vbAdded(N,false);
+    vector<unsigned long> vnCandidateIds;
+    for(size_t i=0; i<vnScored.size(); i++)
+    {
+        if(vAccScores[i]>minScoreToRetain && !vbAdded[vnBest[i]])
+        {
+            vbAdded[vnBest[i]] = true;
+            vnCandidateIds.push_back(mPrior.GetRecord(vnBest[i]).nId);
+        }
+    }
+
+    return vnCandidateIds;
+}
+
 } //namespace ORB_SLAM
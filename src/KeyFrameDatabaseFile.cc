@@ -0,0 +1,240 @@
+#include "KeyFrameDatabaseFile.h"
+
+#include "KeyFrame.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const char MAGIC[8] = {'O','R','B','K','F','D','B','\0'};
+const uint32_t VERSION = 1;
+
+template<typename T>
+void WriteSection(ofstream &f, const vector<T> &v)
+{
+    if(!v.empty())
+        f.write(reinterpret_cast<const char*>(&v[0]), v.size()*sizeof(T));
+}
+}
+
+const int KeyFrameDatabaseFile::NUM_COVISIBLES;
+
+KeyFrameDatabaseFile::KeyFrameDatabaseFile():
+    mnKeyFrames(0), mpRecords(NULL), mpWordOffsets(NULL), mpPostings(NULL), mpBowEntries(NULL)
+{
+}
+
+KeyFrameDatabaseFile::~KeyFrameDatabaseFile()
+{
+    Close();
+}
+
+bool KeyFrameDatabaseFile::Write(const string &filename, const vector<KeyFrame*> &vpKFs, const size_t nWords)
+{
+    unordered_map<unsigned long, uint32_t> mIdToIdx;
+    for(size_t i=0; i<vpKFs.size(); i++)
+        mIdToIdx[vpKFs[i]->mnId] = i;
+
+    vector<Record> vRecords(vpKFs.size());
+    vector<Entry> vBowEntries;
+    vector<uint64_t> vWordOffsets(nWords+1,0);
+
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        Record &record = vRecords[i];
+        memset(&record,0,sizeof(Record));
+        record.nId = pKF->mnId;
+        record.timeStamp = pKF->mTimeStamp;
+        record.nBowOffset = vBowEntries.size();
+        record.nBowSize = pKF->mBowVec.size();
+
+        for(DBoW2::BowVector::const_iterator vit=pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit!=vend; vit++)
+        {
+            Entry entry;
+            entry.n = vit->first;
+            entry.weight = vit->second;
+            vBowEntries.push_back(entry);
+            vWordOffsets[vit->first+1]++;
+        }
+
+        // Neighbours which are not in the database are dropped
+        const vector<KeyFrame*> vpNeighs = pKF->GetBestCovisibilityKeyFrames(NUM_COVISIBLES);
+        for(size_t j=0; j<vpNeighs.size(); j++)
+        {
+            unordered_map<unsigned long, uint32_t>::const_iterator it = mIdToIdx.find(vpNeighs[j]->mnId);
+            if(it!=mIdToIdx.end())
+                record.vnCovisibles[record.nCovisibles++] = it->second;
+        }
+    }
+
+    // Counting sort of the BoW entries by word, the keyframes keep their order in every list
+    for(size_t w=0; w<nWords; w++)
+        vWordOffsets[w+1] += vWordOffsets[w];
+
+    vector<uint64_t> vNext(vWordOffsets.begin(),vWordOffsets.end()-1);
+    vector<Entry> vPostings(vBowEntries.size());
+    for(size_t i=0; i<vRecords.size(); i++)
+    {
+        const Record &record = vRecords[i];
+        for(size_t j=record.nBowOffset; j<record.nBowOffset+record.nBowSize; j++)
+        {
+            Entry &posting = vPostings[vNext[vBowEntries[j].n]++];
+            posting.n = i;
+            posting.weight = vBowEntries[j].weight;
+        }
+    }
+
+    Header header;
+    memset(&header,0,sizeof(Header));
+    memcpy(header.magic,MAGIC,sizeof(MAGIC));
+    header.nVersion = VERSION;
+    header.nWords = nWords;
+    header.nKeyFrames = vRecords.size();
+    header.nPostings = vPostings.size();
+    header.nBowEntries = vBowEntries.size();
+
+    ofstream f(filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if(!f.is_open())
+    {
+        cerr << "Failed to open " << filename << " to save the keyframe database" << endl;
+        return false;
+    }
+
+    f.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    WriteSection(f,vRecords);
+    WriteSection(f,vWordOffsets);
+    WriteSection(f,vPostings);
+    WriteSection(f,vBowEntries);
+    f.close();
+
+    if(!f)
+    {
+        cerr << "Failed to write the keyframe database to " << filename << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool KeyFrameDatabaseFile::Open(const string &filename, const size_t nWords)
+{
+    Close();
+
+    // Queries jump between posting lists, read ahead would only load pages nobody asked for
+    if(!mFile.Open(filename,true))
+        return false;
+
+    const Header* pHeader = mFile.Get<Header>(0,1);
+
+    bool bValid = pHeader && memcmp(pHeader->magic,MAGIC,sizeof(MAGIC))==0 && pHeader->nVersion==VERSION;
+    if(!bValid)
+        cerr << filename << " is not a keyframe database" << endl;
+    else if(pHeader->nWords!=nWords)
+    {
+        cerr << "The keyframe database " << filename << " was built with another vocabulary" << endl;
+        bValid = false;
+    }
+
+    // The counts are checked against the size of the file before the offsets are computed from
+    // them, so they can not overflow
+    if(bValid && (pHeader->nKeyFrames>mFile.Size()/sizeof(Record) || pHeader->nPostings>mFile.Size()/sizeof(Entry) ||
+                  pHeader->nBowEntries>mFile.Size()/sizeof(Entry)))
+    {
+        cerr << "The keyframe database " << filename << " is truncated or corrupt" << endl;
+        bValid = false;
+    }
+
+    if(bValid)
+    {
+        const uint64_t nRecordsOffset = sizeof(Header);
+        const uint64_t nWordOffsetsOffset = nRecordsOffset + pHeader->nKeyFrames*sizeof(Record);
+        const uint64_t nPostingsOffset = nWordOffsetsOffset + (pHeader->nWords+1)*sizeof(uint64_t);
+        const uint64_t nBowEntriesOffset = nPostingsOffset + pHeader->nPostings*sizeof(Entry);
+        const uint64_t nEnd = nBowEntriesOffset + pHeader->nBowEntries*sizeof(Entry);
+
+        mpRecords = mFile.Get<Record>(nRecordsOffset,pHeader->nKeyFrames);
+        mpWordOffsets = mFile.Get<uint64_t>(nWordOffsetsOffset,pHeader->nWords+1);
+        mpPostings = mFile.Get<Entry>(nPostingsOffset,pHeader->nPostings);
+        mpBowEntries = mFile.Get<Entry>(nBowEntriesOffset,pHeader->nBowEntries);
+
+        if(nEnd!=mFile.Size() || !mpRecords || !mpWordOffsets || !mpPostings || !mpBowEntries ||
+           !CheckSections(*pHeader))
+        {
+            cerr << "The keyframe database " << filename << " is truncated or corrupt" << endl;
+            bValid = false;
+        }
+    }
+
+    if(!bValid)
+    {
+        Close();
+        return false;
+    }
+
+    mnKeyFrames = pHeader->nKeyFrames;
+    return true;
+}
+
+bool KeyFrameDatabaseFile::CheckSections(const Header &header) const
+{
+    // The posting lists follow each other and cover all the postings
+    if(mpWordOffsets[0]!=0 || mpWordOffsets[header.nWords]!=header.nPostings)
+        return false;
+    for(uint32_t w=0; w<header.nWords; w++)
+        if(mpWordOffsets[w]>mpWordOffsets[w+1])
+            return false;
+
+    for(uint64_t i=0; i<header.nPostings; i++)
+        if(mpPostings[i].n>=header.nKeyFrames)
+            return false;
+
+    for(uint64_t i=0; i<header.nBowEntries; i++)
+        if(mpBowEntries[i].n>=header.nWords)
+            return false;
+
+    for(uint64_t i=0; i<header.nKeyFrames; i++)
+    {
+        const Record &record = mpRecords[i];
+        if(record.nBowOffset>header.nBowEntries || record.nBowSize>header.nBowEntries-record.nBowOffset)
+            return false;
+        if(record.nCovisibles>static_cast<uint32_t>(NUM_COVISIBLES))
+            return false;
+        for(uint32_t j=0; j<record.nCovisibles; j++)
+            if(record.vnCovisibles[j]>=header.nKeyFrames)
+                return false;
+    }
+
+    return true;
+}
+
+void KeyFrameDatabaseFile::Close()
+{
+    mFile.Close();
+
+    mnKeyFrames = 0;
+    mpRecords = NULL;
+    mpWordOffsets = NULL;
+    mpPostings = NULL;
+    mpBowEntries = NULL;
+}
+
+void KeyFrameDatabaseFile::GetBowVector(const size_t idx, DBoW2::BowVector &bowVec) const
+{
+    bowVec.clear();
+
+    const Record &record = mpRecords[idx];
+    const Entry* pEntry = mpBowEntries+record.nBowOffset;
+    for(uint32_t i=0; i<record.nBowSize; i++, pEntry++)
+        bowVec.insert(bowVec.end(), make_pair(pEntry->n, static_cast<DBoW2::WordValue>(pEntry->weight)));
+}
+
+} //namespace ORB_SLAM
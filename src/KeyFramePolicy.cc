@@ -0,0 +1,26 @@
+#include "KeyFramePolicy.h"
+
+namespace ORB_SLAM2
+{
+
+KeyFramePolicy::KeyFramePolicy(const float targetUtilization, const int nMaxQueued):
+    mfTargetUtilization(targetUtilization), mnMaxQueued(nMaxQueued)
+{
+}
+
+KeyFramePolicy::Decision KeyFramePolicy::Decide(const double interval, const int nQueued, const double cost,
+                                                const bool bUrgent) const
+{
+    const bool bCanQueue = nQueued<mnMaxQueued;
+
+    bool bInterrupt = bUrgent || mfTargetUtilization<=0 || cost<0 || interval<=0;
+    // The queued keyframes, the one in progress and the new one
+    if(!bInterrupt)
+        bInterrupt = (nQueued+2)*cost>mfTargetUtilization*interval;
+
+    if(bInterrupt)
+        return bCanQueue ? INSERT : INTERRUPT;
+    return bCanQueue ? QUEUE : POSTPONE;
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,153 @@
+#include "LatencyScheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Frames of the latencies the percentile is taken of
+const size_t WINDOW = 300; //param
+// Frames between two decisions
+const size_t UPDATE_PERIOD = 30; //param
+// Room to spare: the percentile under this share of the target and the cores under this share
+// of the budget, for SLACK_PERIODS periods in a row
+const double SLACK_LATENCY = 0.7; //param
+const double SLACK_CORES = 0.8; //param
+const int SLACK_PERIODS = 3; //param
+
+// The knobs of every level, the first one is the settings
+const float FEATURE_SCALE[] = {1.0f, 0.9f, 0.8f, 0.7f, 0.6f, 0.5f}; //param
+const float SEARCH_RADIUS_SCALE[] = {1.0f, 1.0f, 0.8f, 0.8f, 0.6f, 0.6f}; //param
+const int MAX_LOCAL_KEYFRAMES[] = {80, 60, 45, 35, 25, 20}; //param
+const int LOCAL_BA_KEYFRAMES[] = {0, 20, 15, 10, 7, 5}; //param
+const float LOCAL_BA_ITERATION_SCALE[] = {1.0f, 1.0f, 0.8f, 0.6f, 0.5f, 0.4f}; //param
+// Cores the map-wide optimizations leave to the other threads
+const int RESERVED_CORES[] = {1, 1, 2, 2, 3, 3}; //param
+const int MAX_GLOBAL_BA_LEVEL = 2; //param
+
+// The stages which run on a core of their own, not the time keyframes wait in the queue
+const Stage BUSY_STAGES[] = {Stage::TRACK, Stage::EXTRACT_ORB, Stage::PROCESS_NEW_KEYFRAME,
+                             Stage::MAP_POINT_CULLING, Stage::CREATE_NEW_MAP_POINTS, Stage::SEARCH_IN_NEIGHBORS,
+                             Stage::LOCAL_BUNDLE_ADJUSTMENT, Stage::KEYFRAME_CULLING, Stage::BUDGET_CULLING,
+                             Stage::DETECT_LOOP, Stage::COMPUTE_SIM3, Stage::CORRECT_LOOP,
+                             Stage::GLOBAL_BUNDLE_ADJUSTMENT};
+}
+
+LatencyScheduler::LatencyScheduler(const double target, const double percentile, const int nCores,
+                                   StageTimeSet* pStageTimes):
+    mfTarget(target), mfPercentile(min(max(percentile,0.0),1.0)),
+    mnCores(nCores>0 ? nCores : max(static_cast<int>(thread::hardware_concurrency()),1)),
+    mpStageTimes(pStageTimes), mnLevel(0), mnSlackPeriods(0), mnFrames(0), mfLatency(-1), mfCores(-1)
+{
+    mvLatencies.reserve(WINDOW);
+    mnLastBusy = GetBusyNanoseconds();
+    mtLastUpdate = chrono::steady_clock::now();
+}
+
+uint64_t LatencyScheduler::GetBusyNanoseconds() const
+{
+    uint64_t nBusy = 0;
+    for(size_t i=0; i<sizeof(BUSY_STAGES)/sizeof(BUSY_STAGES[0]); i++)
+        nBusy += mpStageTimes->GetTotalNanoseconds(BUSY_STAGES[i]);
+    return nBusy;
+}
+
+bool LatencyScheduler::AddFrame(const double latency)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    // The oldest latencies are overwritten once the window is full
+    if(mvLatencies.size()<WINDOW)
+        mvLatencies.push_back(latency);
+    else
+        mvLatencies[mnFrames%WINDOW] = latency;
+    mnFrames++;
+    if(mnFrames%UPDATE_PERIOD!=0)
+        return false;
+
+    mvSorted = mvLatencies;
+    const size_t k = min(static_cast<size_t>(ceil(mfPercentile*mvSorted.size())),mvSorted.size())-1;
+    nth_element(mvSorted.begin(),mvSorted.begin()+k,mvSorted.end());
+    mfLatency = mvSorted[k];
+
+    // The stage times start over when they are reset
+    const chrono::steady_clock::time_point tNow = chrono::steady_clock::now();
+    const uint64_t nBusy = GetBusyNanoseconds();
+    const uint64_t nDelta = nBusy>=mnLastBusy ? nBusy-mnLastBusy : nBusy;
+    const double elapsed = chrono::duration<double>(tNow-mtLastUpdate).count();
+    mfCores = elapsed>0 ? nDelta*1e-9/elapsed : 0.0;
+    mnLastBusy = nBusy;
+    mtLastUpdate = tNow;
+
+    const int nLastLevel = mnLevel;
+    if(mfLatency>mfTarget || mfCores>mnCores)
+    {
+        mnLevel = min(mnLevel+1,NUM_LEVELS-1);
+        mnSlackPeriods = 0;
+    }
+    else if(mfLatency<SLACK_LATENCY*mfTarget && mfCores<SLACK_CORES*mnCores)
+    {
+        if(++mnSlackPeriods>=SLACK_PERIODS)
+        {
+            mnLevel = max(mnLevel-1,0);
+            mnSlackPeriods = 0;
+        }
+    }
+    else
+        mnSlackPeriods = 0;
+
+    return mnLevel!=nLastLevel;
+}
+
+LatencyScheduler::Knobs LatencyScheduler::GetKnobs()
+{
+    unique_lock<mutex> lock(mMutex);
+    Knobs knobs;
+    knobs.fFeatureScale = FEATURE_SCALE[mnLevel];
+    knobs.fSearchRadiusScale = SEARCH_RADIUS_SCALE[mnLevel];
+    knobs.nMaxLocalKeyFrames = MAX_LOCAL_KEYFRAMES[mnLevel];
+    knobs.nLocalBAKeyFrames = LOCAL_BA_KEYFRAMES[mnLevel];
+    knobs.fLocalBAIterationScale = LOCAL_BA_ITERATION_SCALE[mnLevel];
+    knobs.nOptimizerThreads = max(mnCores-RESERVED_CORES[mnLevel],1);
+    knobs.bGlobalBA = mnLevel<=MAX_GLOBAL_BA_LEVEL;
+    return knobs;
+}
+
+int LatencyScheduler::GetLevel()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mnLevel;
+}
+
+double LatencyScheduler::GetLatency()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mfLatency;
+}
+
+double LatencyScheduler::GetCores()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mfCores;
+}
+
+void LatencyScheduler::Reset()
+{
+    unique_lock<mutex> lock(mMutex);
+    mnLevel = 0;
+    mnSlackPeriods = 0;
+    mnFrames = 0;
+    mvLatencies.clear();
+    mfLatency = -1;
+    mfCores = -1;
+    mnLastBusy = GetBusyNanoseconds();
+    mtLastUpdate = chrono::steady_clock::now();
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,305 @@
+#include "LocalBAProblem.h"
+
+#include <cmath>
+#include <limits>
+
+#include "Thirdparty/g2o/g2o/core/robust_kernel_impl.h"
+
+#include "Converter.h"
+#include "KeyFrame.h"
+#include "MapPoint.h"
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const double thHuberMono = std::sqrt(5.991);
+const double thHuberStereo = std::sqrt(7.815);
+
+inline int KeyFrameVertexId(const unsigned long nId)
+{
+    return 2*nId;
+}
+
+inline int MapPointVertexId(const unsigned long nId)
+{
+    return 2*nId+1;
+}
+}
+
+LocalBAProblem::LocalBAProblem(): mnUpdate(0)
+{
+}
+
+void LocalBAProblem::Clear()
+{
+    mOptimizer.clear();
+    mmKeyFrames.clear();
+    mmMapPoints.clear();
+
+    mvpEdgesMono.clear();
+    mvpEdgeKFMono.clear();
+    mvpMapPointEdgeMono.clear();
+    mvpEdgesStereo.clear();
+    mvpEdgeKFStereo.clear();
+    mvpMapPointEdgeStereo.clear();
+    mvpEdgesRig.clear();
+    mvpEdgeKFRig.clear();
+    mvpMapPointEdgeRig.clear();
+}
+
+void LocalBAProblem::UpdateKeyFrame(KeyFrame* pKF, const bool bFixed)
+{
+    KeyFrameEntry &entry = mmKeyFrames[pKF->mnId];
+    if(entry.nUpdate==0)
+    {
+        entry.pVertex = new g2o::VertexSE3Expmap();
+        entry.pVertex->setId(KeyFrameVertexId(pKF->mnId));
+        mOptimizer.addVertex(entry.pVertex);
+    }
+    entry.nUpdate = mnUpdate;
+
+    Eigen::Matrix3f Rcw;
+    Eigen::Vector3f tcw;
+    pKF->GetPose(Rcw,tcw);
+    entry.pVertex->setEstimate(Converter::toSE3Quat(Rcw,tcw));
+    entry.pVertex->setFixed(bFixed || pKF->IsOrigin());
+}
+
+g2o::OptimizableGraph::Edge* LocalBAProblem::CreateEdge(g2o::VertexSBAPointXYZ* pVPoint, KeyFrame* pKF, KeyFrame* pBody,
+                                                        const size_t idx)
+{
+    // A fixed keyframe of the window may be cold, its observations are read directly
+    pKF->Expand();
+    g2o::OptimizableGraph::Vertex* pVKF = mmKeyFrames[pBody->mnId].pVertex;
+    const cv::KeyPoint &kpUn = pKF->mvKeysUn[idx];
+    const float &invSigma2 = pKF->mvInvLevelSigma2[kpUn.octave];
+
+    // Monocular observation of another camera of a rig
+    if(pBody!=pKF)
+    {
+        Eigen::Matrix<double,2,1> obs;
+        obs << kpUn.pt.x, kpUn.pt.y;
+
+        g2o::EdgeSE3ProjectXYZRig* e = new g2o::EdgeSE3ProjectXYZRig();
+        e->setVertex(0, pVPoint);
+        e->setVertex(1, pVKF);
+        e->setMeasurement(obs);
+        e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
+        e->setRobustKernel(new g2o::RobustKernelHuber);
+
+        e->fx = pKF->fx;
+        e->fy = pKF->fy;
+        e->cx = pKF->cx;
+        e->cy = pKF->cy;
+        e->Tcr = Converter::toSE3Quat(pKF->mTcr);
+
+        mOptimizer.addEdge(e);
+        return e;
+    }
+    // Monocular observation
+    else if(pKF->mvuRight[idx]<0)
+    {
+        Eigen::Matrix<double,2,1> obs;
+        obs << kpUn.pt.x, kpUn.pt.y;
+
+        g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
+        e->setVertex(0, pVPoint);
+        e->setVertex(1, pVKF);
+        e->setMeasurement(obs);
+        e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
+        e->setRobustKernel(new g2o::RobustKernelHuber);
+
+        e->fx = pKF->fx;
+        e->fy = pKF->fy;
+        e->cx = pKF->cx;
+        e->cy = pKF->cy;
+
+        mOptimizer.addEdge(e);
+        return e;
+    }
+    else // Stereo observation
+    {
+        Eigen::Matrix<double,3,1> obs;
+        obs << kpUn.pt.x, kpUn.pt.y, pKF->mvuRight[idx];
+
+        g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
+        e->setVertex(0, pVPoint);
+        e->setVertex(1, pVKF);
+        e->setMeasurement(obs);
+        e->setInformation(Eigen::Matrix3d::Identity()*invSigma2);
+        e->setRobustKernel(new g2o::RobustKernelHuber);
+
+        e->fx = pKF->fx;
+        e->fy = pKF->fy;
+        e->cx = pKF->cx;
+        e->cy = pKF->cy;
+        e->bf = pKF->mbf;
+
+        mOptimizer.addEdge(e);
+        return e;
+    }
+}
+
+void LocalBAProblem::Update(const std::list<KeyFrame*> &lLocalKeyFrames, const std::list<KeyFrame*> &lFixedKeyFrames,
+                            const std::list<MapPoint*> &lLocalMapPoints)
+{
+    mnUpdate++;
+
+    for(std::list<KeyFrame*>::const_iterator lit=lLocalKeyFrames.begin(), lend=lLocalKeyFrames.end(); lit!=lend; lit++)
+        UpdateKeyFrame(*lit,false);
+
+    for(std::list<KeyFrame*>::const_iterator lit=lFixedKeyFrames.begin(), lend=lFixedKeyFrames.end(); lit!=lend; lit++)
+        UpdateKeyFrame(*lit,true);
+
+    mvpEdgesMono.clear();
+    mvpEdgeKFMono.clear();
+    mvpMapPointEdgeMono.clear();
+    mvpEdgesStereo.clear();
+    mvpEdgeKFStereo.clear();
+    mvpMapPointEdgeStereo.clear();
+    mvpEdgesRig.clear();
+    mvpEdgeKFRig.clear();
+    mvpMapPointEdgeRig.clear();
+
+    for(std::list<MapPoint*>::const_iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++)
+    {
+        MapPoint* pMP = *lit;
+        PointEntry &entry = mmMapPoints[pMP->mnId];
+        if(entry.nUpdate==0)
+        {
+            entry.pVertex = new g2o::VertexSBAPointXYZ();
+            entry.pVertex->setId(MapPointVertexId(pMP->mnId));
+            entry.pVertex->setMarginalized(true);
+            mOptimizer.addVertex(entry.pVertex);
+        }
+        entry.nUpdate = mnUpdate;
+
+        Eigen::Vector3f Pos;
+        pMP->GetWorldPos(Pos);
+        entry.pVertex->setEstimate(Pos.cast<double>());
+
+        const MapPoint::ObservationsSnapshot pObservations = pMP->GetObservationsSnapshot();
+        const ObservationList &observations = *pObservations;
+
+        for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        {
+            KeyFrame* pKFi = mit->first;
+            if(pKFi->isBad())
+                continue;
+
+            // The keyframe may have started to observe the point after the window was collected
+            KeyFrame* pBody = pKFi->GetRigBody();
+            std::unordered_map<unsigned long, KeyFrameEntry>::const_iterator kit = mmKeyFrames.find(pBody->mnId);
+            if(kit==mmKeyFrames.end() || kit->second.nUpdate!=mnUpdate)
+                continue;
+
+            const bool bRig = pBody!=pKFi;
+            Observation &obs = entry.mObservations[pKFi->mnId];
+            if(obs.nUpdate!=0 && (obs.nIdx!=mit->second || obs.bRig!=bRig))
+            {
+                // Matched to another keypoint of the keyframe in the meantime, or the first
+                // camera of its rig was culled and it has a vertex of its own now
+                mOptimizer.removeEdge(obs.pEdge);
+                obs.nUpdate = 0;
+            }
+            if(obs.nUpdate==0)
+            {
+                obs.pEdge = CreateEdge(entry.pVertex,pKFi,pBody,mit->second);
+                obs.nIdx = mit->second;
+                obs.bStereo = !bRig && pKFi->mvuRight[mit->second]>=0;
+                obs.bRig = bRig;
+            }
+            obs.nUpdate = mnUpdate;
+
+            obs.pEdge->setLevel(0);
+            if(obs.bRig)
+            {
+                g2o::EdgeSE3ProjectXYZRig* e = static_cast<g2o::EdgeSE3ProjectXYZRig*>(obs.pEdge);
+                static_cast<g2o::RobustKernelHuber*>(e->robustKernel())->setDelta(thHuberMono);
+                mvpEdgesRig.push_back(e);
+                mvpEdgeKFRig.push_back(pKFi);
+                mvpMapPointEdgeRig.push_back(pMP);
+            }
+            else if(obs.bStereo)
+            {
+                g2o::EdgeStereoSE3ProjectXYZ* e = static_cast<g2o::EdgeStereoSE3ProjectXYZ*>(obs.pEdge);
+                static_cast<g2o::RobustKernelHuber*>(e->robustKernel())->setDelta(thHuberStereo);
+                mvpEdgesStereo.push_back(e);
+                mvpEdgeKFStereo.push_back(pKFi);
+                mvpMapPointEdgeStereo.push_back(pMP);
+            }
+            else
+            {
+                g2o::EdgeSE3ProjectXYZ* e = static_cast<g2o::EdgeSE3ProjectXYZ*>(obs.pEdge);
+                static_cast<g2o::RobustKernelHuber*>(e->robustKernel())->setDelta(thHuberMono);
+                mvpEdgesMono.push_back(e);
+                mvpEdgeKFMono.push_back(pKFi);
+                mvpMapPointEdgeMono.push_back(pMP);
+            }
+        }
+
+        // Observations which are gone
+        for(std::map<unsigned long, Observation>::iterator oit=entry.mObservations.begin(); oit!=entry.mObservations.end();)
+        {
+            if(oit->second.nUpdate!=mnUpdate)
+            {
+                mOptimizer.removeEdge(oit->second.pEdge);
+                entry.mObservations.erase(oit++);
+            }
+            else
+                oit++;
+        }
+    }
+
+    // Points which left the window, removing the vertex also removes its edges
+    for(std::unordered_map<unsigned long, PointEntry>::iterator mit=mmMapPoints.begin(); mit!=mmMapPoints.end();)
+    {
+        if(mit->second.nUpdate!=mnUpdate)
+        {
+            mOptimizer.removeVertex(mit->second.pVertex);
+            mit = mmMapPoints.erase(mit);
+        }
+        else
+            mit++;
+    }
+
+    // Keyframes which left the window. Their edges all belonged to points which were removed above.
+    for(std::unordered_map<unsigned long, KeyFrameEntry>::iterator mit=mmKeyFrames.begin(); mit!=mmKeyFrames.end();)
+    {
+        if(mit->second.nUpdate!=mnUpdate)
+        {
+            mOptimizer.removeVertex(mit->second.pVertex);
+            mit = mmKeyFrames.erase(mit);
+        }
+        else
+            mit++;
+    }
+}
+
+void LocalBAProblem::DisableRobustKernels()
+{
+    // Keeps the kernels allocated for the next window, an infinite delta makes them the identity
+    const double inf = std::numeric_limits<double>::infinity();
+    for(size_t i=0, iend=mvpEdgesMono.size(); i<iend; i++)
+        static_cast<g2o::RobustKernelHuber*>(mvpEdgesMono[i]->robustKernel())->setDelta(inf);
+    for(size_t i=0, iend=mvpEdgesStereo.size(); i<iend; i++)
+        static_cast<g2o::RobustKernelHuber*>(mvpEdgesStereo[i]->robustKernel())->setDelta(inf);
+    for(size_t i=0, iend=mvpEdgesRig.size(); i<iend; i++)
+        static_cast<g2o::RobustKernelHuber*>(mvpEdgesRig[i]->robustKernel())->setDelta(inf);
+}
+
+g2o::VertexSE3Expmap* LocalBAProblem::GetVertex(KeyFrame* pKF)
+{
+    std::unordered_map<unsigned long, KeyFrameEntry>::const_iterator it = mmKeyFrames.find(pKF->mnId);
+    return it==mmKeyFrames.end() ? static_cast<g2o::VertexSE3Expmap*>(NULL) : it->second.pVertex;
+}
+
+g2o::VertexSBAPointXYZ* LocalBAProblem::GetVertex(MapPoint* pMP)
+{
+    std::unordered_map<unsigned long, PointEntry>::const_iterator it = mmMapPoints.find(pMP->mnId);
+    return it==mmMapPoints.end() ? static_cast<g2o::VertexSBAPointXYZ*>(NULL) : it->second.pVertex;
+}
+
+} //namespace ORB_SLAM
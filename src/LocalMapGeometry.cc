@@ -0,0 +1,15 @@
+#include "LocalMapGeometry.h"
+#include "MapPoint.h"
+
+namespace ORB_SLAM2
+{
+
+void LocalMapGeometry::Build(const std::vector<MapPoint*> &vpMapPoints)
+{
+    Clear();
+    Reserve(vpMapPoints.size());
+    for(size_t i=0, iend=vpMapPoints.size(); i<iend; i++)
+        Add(vpMapPoints[i]);
+}
+
+} //namespace ORB_SLAM
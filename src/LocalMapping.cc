@@ -22,17 +22,53 @@
 #include "LoopClosing.h"
 #include "ORBmatcher.h"
 #include "Optimizer.h"
-
+#include "Converter.h"
+#include "Triangulator.h"
+#include "StageTimer.h"
+#include "Trace.h"
+#include "ThreadConfig.h"
+#include "MemoryUsage.h"
+#include "PerformanceReport.h"
+
+#include<algorithm>
+#include<chrono>
+#include<cmath>
+#include<functional>
 #include<mutex>
+#include<set>
+#include<thread>
 
 namespace ORB_SLAM2
 {
 
-LocalMapping::LocalMapping(Map *pMap, const float bMonocular):
+namespace
+{
+// The keyframes of the other rig cameras take their pose from this one in the bundle adjustments
+bool HasRigKeyFrames(KeyFrame* pKF)
+{
+    for(size_t i=0; i<pKF->mvpRigKFs.size(); i++)
+        if(!pKF->mvpRigKFs[i]->isBad())
+            return true;
+    return false;
+}
+}
+
+LocalMapping::LocalMapping(Map *pMap, const float bMonocular, const int nThreads, const float fTargetKeyFrameRate):
     mbMonocular(bMonocular), mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-    mbAbortBA(false), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true)
+    mpThreadPool(new ThreadPool(max(nThreads,1)-1,ThreadConfig::MAPPING_WORKERS)), mpLatencyScheduler(static_cast<LatencyScheduler*>(NULL)),
+    mOverloadPolicy(SKIP_BA),
+    mbAbortBA(false), mnLocalBAMemory(0), mfKeyFrameCost(-1), mfTargetKeyFrameRate(fTargetKeyFrameRate), mnBAMaxKeyFrames(0),
+    mnMaxKeyFrames(0), mnMaxMapPoints(0), mnMaxBytes(0), mfKeyFrameBytes(0), mfMapPointBytes(0), mnWindowKeyFrames(0), mnColdKeyFrames(0), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true),
+    mbWakeUp(false), mbSleeping(false), mbParked(false)
     , mVisualizeLocalMapping("Show Mapping", false, true, ParameterGroup::MAIN, []{})
+    , mnLocalBAIterations("Local BA iterations", 5, 1, 50, ParameterGroup::LOCAL_MAPPING, []{}) //param
+    , mnLocalBAOutlierIterations("Local BA outlier iterations", 10, 0, 50, ParameterGroup::LOCAL_MAPPING, []{}) //param
+{
+}
+
+LocalMapping::~LocalMapping()
 {
+    delete mpThreadPool;
 }
 
 void LocalMapping::SetLoopCloser(LoopClosing* pLoopCloser)
@@ -45,21 +81,69 @@ void LocalMapping::SetTracker(Tracking *pTracker)
     mpTracker=pTracker;
 }
 
+void LocalMapping::SetMapBudget(const int nMaxKeyFrames, const int nMaxMapPoints, const size_t nMaxBytes)
+{
+    mnMaxKeyFrames = max(nMaxKeyFrames,0);
+    mnMaxMapPoints = max(nMaxMapPoints,0);
+    mnMaxBytes = nMaxBytes;
+}
+
+void LocalMapping::SetSlidingWindow(const int nKeyFrames)
+{
+    // The local BA needs keyframes to optimize and fixed ones to hold the gauge
+    const int nMinKeyFrames = 5; //param
+    mnWindowKeyFrames = nKeyFrames>0 ? max(nKeyFrames,nMinKeyFrames) : 0;
+}
+
+void LocalMapping::SetColdKeyFrames(const int nKeyFrames)
+{
+    mnColdKeyFrames = max(nKeyFrames,0);
+}
+
+void LocalMapping::SetOverloadPolicy(const OverloadPolicy policy)
+{
+    mOverloadPolicy = policy;
+}
+
+void LocalMapping::SetLatencyScheduler(LatencyScheduler* pScheduler)
+{
+    mpLatencyScheduler = pScheduler;
+}
+
+LocalMapping::QueueStats LocalMapping::GetQueueStats()
+{
+    unique_lock<mutex> lock(mMutexQueueStats);
+    return mQueueStats;
+}
+
+void LocalMapping::PostponedKeyFrame()
+{
+    unique_lock<mutex> lock(mMutexQueueStats);
+    mQueueStats.nPostponed++;
+}
+
 void LocalMapping::Run()
 {
+    Trace::SetThreadName("LocalMapping");
+    ThreadConfig::Apply(ThreadConfig::LOCAL_MAPPING);
+    StageTimes::BindThread(&mpMap->mStageTimes);
     mbFinished = false;
+    mnReclaimerId = mpMap->mReclaimer.RegisterThread();
 
     while(1)
     {
         // Tracking will see that Local Mapping is busy
         SetAcceptKeyFrames(false);
+        bool bResumed = false;
 
         // Check if there are keyframes in the queue
         if(CheckNewKeyFrames())
         {
+            const chrono::steady_clock::time_point tKeyFrameStart = chrono::steady_clock::now();
+
             DLOG_IF(INFO, mVisualizeLocalMapping()) << "###########################################"
                                                     << " LOCAL MAPPING";
-            DLOG_IF(INFO, mVisualizeLocalMapping()) << mlNewKeyFrames.size() << " new keyframe(s).";
+            DLOG_IF(INFO, mVisualizeLocalMapping()) << mNewKeyFrames.Size() << " new keyframe(s).";
             // BoW conversion and insertion in Map
             ProcessNewKeyFrame();
 
@@ -69,7 +153,8 @@ void LocalMapping::Run()
             // Triangulate new MapPoints
             CreateNewMapPoints();
 
-            if(!CheckNewKeyFrames())
+            const bool bFusion = !CheckNewKeyFrames();
+            if(bFusion)
             {
                 // Find more matches in neighbor keyframes and fuse point duplications
                 SearchInNeighbors();
@@ -77,29 +162,74 @@ void LocalMapping::Run()
 
             mbAbortBA = false;
 
-            if(!CheckNewKeyFrames() && !stopRequested())
+            // Keyframes waiting behind this one
+            const bool bOverloaded = CheckNewKeyFrames();
+            if(bOverloaded)
+            {
+                unique_lock<mutex> lock(mMutexQueueStats);
+                if(mOverloadPolicy==REDUCE_BA)
+                    mQueueStats.nReducedBA++;
+                else
+                    mQueueStats.nSkippedBA++;
+            }
+
+            // A fusion or a local BA cut by the keyframes waiting is done later
+            if(!bFusion || bOverloaded)
+                DeferStages(!bFusion,bOverloaded);
+
+            if((!bOverloaded || mOverloadPolicy==REDUCE_BA) && !stopRequested() && !CheckReset())
             {
                 // Local BA
-                if(mpMap->KeyFramesInMap()>2)
+                // Counted in the map of the keyframe, a new map of the atlas starts with two again
+                if(mpMap->KeyFramesInMap(mpCurrentKeyFrame->mnMapId)>2)
+                {
                     DLOG_IF(INFO, mVisualizeLocalMapping()) << "Performing local BA.";
-                    Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame,&mbAbortBA, mpMap);
+                    LocalBundleAdjustment(tKeyFrameStart,bOverloaded);
+                    mnLocalBAMemory = Optimizer::EstimateMemoryUsage(mLocalBAProblem.GetOptimizer());
+                }
 
                 // Check redundant local Keyframes
                 KeyFrameCulling();
+
+                BudgetCulling();
             }
 
+            SlidingWindowCulling();
+
+            CompactColdKeyFrames();
+
+            PublishNeighborhood();
+
             mpLoopCloser->InsertKeyFrame(mpCurrentKeyFrame);
+
+            if(PerformanceReport::IsOpen())
+            {
+                PerformanceReport::Record record = PerformanceReport::NewRecord(PerformanceReport::KEYFRAME);
+                record.nId = mpCurrentKeyFrame->mnId;
+                record.nOther = mpCurrentKeyFrame->mnFrameId;
+                record.timestamp = mpCurrentKeyFrame->mTimeStamp;
+                record.nCount = mNewKeyFrames.Size();
+                PerformanceReport::Add(record);
+            }
+
+            const double cost = chrono::duration<double>(chrono::steady_clock::now()-tKeyFrameStart).count();
+            const double prevCost = mfKeyFrameCost.load(memory_order_relaxed);
+            mfKeyFrameCost.store(prevCost<0 ? cost : prevCost+0.2*(cost-prevCost), memory_order_relaxed); //param
         }
         else if(Stop())
         {
             // Safe area to stop
+            ScopedTrace traceStopped("Stopped");
             while(isStopped() && !CheckFinish())
             {
-                usleep(3000);
+                PassQuiescentState();
+                WaitForWakeUp();
             }
             if(CheckFinish())
                 break;
         }
+        else
+            bResumed = ResumeDeferredStage();
 
         ResetIfRequested();
 
@@ -109,33 +239,228 @@ void LocalMapping::Run()
         if(CheckFinish())
             break;
 
-        usleep(3000);
+        PassQuiescentState();
+
+        // Deferred stages left run on without waiting
+        if(!bResumed && !CheckNewKeyFrames())
+            WaitForWakeUp();
     }
 
+    mpMap->mReclaimer.UnregisterThread(mnReclaimerId);
     SetFinish();
 }
 
-void LocalMapping::InsertKeyFrame(KeyFrame *pKF)
+void LocalMapping::LocalBundleAdjustment(const chrono::steady_clock::time_point &tKeyFrameStart, const bool bReduced)
 {
-    unique_lock<mutex> lock(mMutexNewKFs);
-    mlNewKeyFrames.push_back(pKF);
-    mbAbortBA=true;
+    STAGE_TIMER(LOCAL_BUNDLE_ADJUSTMENT);
+
+    // The window optimizes the half most covisible with the current keyframe, the rest is fixed
+    int nWindowBAKeyFrames = mnWindowKeyFrames>0 ? max(mnWindowKeyFrames/2,2) : 0; //param
+    // Overloaded, the same with fewer keyframes
+    const int nReducedKeyFrames = 4; //param
+    if(bReduced && (nWindowBAKeyFrames==0 || nWindowBAKeyFrames>nReducedKeyFrames))
+        nWindowBAKeyFrames = nReducedKeyFrames;
+
+    // The latency scheduler limits the window and the iterations as well
+    LatencyScheduler::Knobs knobs;
+    if(mpLatencyScheduler)
+        knobs = mpLatencyScheduler->GetKnobs();
+    if(knobs.nLocalBAKeyFrames>0 && (nWindowBAKeyFrames==0 || nWindowBAKeyFrames>knobs.nLocalBAKeyFrames))
+        nWindowBAKeyFrames = knobs.nLocalBAKeyFrames;
+    const int nIterations = max(static_cast<int>(mnLocalBAIterations()*knobs.fLocalBAIterationScale),1);
+    const int nMoreIterations = static_cast<int>(mnLocalBAOutlierIterations()*knobs.fLocalBAIterationScale);
+
+    if(mfTargetKeyFrameRate<=0 && nWindowBAKeyFrames>0)
+    {
+        Optimizer::BABudget budget;
+        budget.deadline = chrono::steady_clock::time_point::max();
+        budget.nMaxKeyFrames = nWindowBAKeyFrames;
+        Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame,&mbAbortBA, mpMap, &mLocalBAProblem, &budget, NULL,
+                                         nIterations, nMoreIterations);
+        return;
+    }
+
+    if(mfTargetKeyFrameRate<=0)
+    {
+        Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame,&mbAbortBA, mpMap, &mLocalBAProblem, NULL, NULL,
+                                         nIterations, nMoreIterations);
+        return;
+    }
+
+    // Everything done for this keyframe counts, the BA gets what is left of the period
+    Optimizer::BABudget budget;
+    budget.deadline = tKeyFrameStart +
+            chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0/mfTargetKeyFrameRate));
+    budget.nMaxKeyFrames = mnBAMaxKeyFrames;
+    if(nWindowBAKeyFrames>0 && (budget.nMaxKeyFrames==0 || budget.nMaxKeyFrames>nWindowBAKeyFrames))
+        budget.nMaxKeyFrames = nWindowBAKeyFrames;
+
+    Optimizer::BAReport report;
+    Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame,&mbAbortBA, mpMap, &mLocalBAProblem, &budget, &report,
+                                     nIterations, nMoreIterations);
+
+    DLOG_IF(INFO, mVisualizeLocalMapping()) << "Local BA: " << report.nKeyFrames << " keyframes ("
+                                            << report.nFixedKeyFrames << " fixed), " << report.nMapPoints
+                                            << " points, " << report.nIterations << "+" << report.nOutlierIterations
+                                            << " iterations in " << report.tElapsed*1e3 << " ms of "
+                                            << report.tBudget*1e3 << " ms, chi2 "
+                                            << (report.vChi2.empty() ? 0.0 : report.vChi2.front()) << " -> "
+                                            << (report.vChi2.empty() ? 0.0 : report.vChi2.back()) << ", "
+                                            << report.nOutliers << " outliers"
+                                            << (report.bConverged ? ", converged" : "")
+                                            << (report.bDeadlineReached ? ", deadline reached" : "")
+                                            << (report.bStale ? ", dropped after a map correction" : "");
+
+    // Adapt the window for the next keyframe: smaller after a missed deadline, larger when most
+    // of the time was left, unlimited again once the covisible keyframes fit. A reduced window
+    // tells nothing about the full one.
+    if(bReduced)
+        return;
+    const int nMinKeyFrames = 3; //param
+    if(report.bDeadlineReached)
+        mnBAMaxKeyFrames = max(nMinKeyFrames,report.nKeyFrames*3/4);
+    else if(mnBAMaxKeyFrames>0 && report.tElapsed<0.5*report.tBudget)
+    {
+        if(report.nKeyFrames<mnBAMaxKeyFrames)
+            mnBAMaxKeyFrames = 0;
+        else
+            mnBAMaxKeyFrames += 2; //param
+    }
 }
 
+void LocalMapping::DeferStages(const bool bFusion, const bool bLocalBA)
+{
+    DeferredStages stages;
+    stages.pKF = mpCurrentKeyFrame;
+    stages.bFusion = bFusion;
+    stages.bLocalBA = bLocalBA;
+    mlDeferredStages.push_back(stages);
+    if(mlDeferredStages.size()>kMaxDeferred)
+        mlDeferredStages.pop_front();
+}
 
-bool LocalMapping::CheckNewKeyFrames()
+bool LocalMapping::ResumeDeferredStage()
 {
-    unique_lock<mutex> lock(mMutexNewKFs);
-    return(!mlNewKeyFrames.empty());
+    // Keyframes are never freed, a culled one is only bad
+    while(!mlDeferredStages.empty() && mlDeferredStages.back().pKF->isBad())
+        mlDeferredStages.pop_back();
+    if(mlDeferredStages.empty() || stopRequested() || CheckReset())
+        return false;
+
+    DeferredStages &stages = mlDeferredStages.back();
+    mpCurrentKeyFrame = stages.pKF;
+
+    if(stages.bFusion)
+    {
+        SearchInNeighbors();
+        stages.bFusion = false;
+    }
+    else if(stages.bLocalBA)
+    {
+        if(mpMap->KeyFramesInMap(mpCurrentKeyFrame->mnMapId)>2)
+        {
+            mbAbortBA = false;
+            LocalBundleAdjustment(chrono::steady_clock::now(),false);
+            mnLocalBAMemory = Optimizer::EstimateMemoryUsage(mLocalBAProblem.GetOptimizer());
+        }
+        stages.bLocalBA = false;
+    }
+
+    if(!stages.bFusion && !stages.bLocalBA)
+    {
+        mlDeferredStages.pop_back();
+        unique_lock<mutex> lock(mMutexQueueStats);
+        mQueueStats.nResumed++;
+    }
+    return true;
 }
 
-void LocalMapping::ProcessNewKeyFrame()
+void LocalMapping::PassQuiescentState()
+{
+    for(list<MapPoint*>::iterator lit=mlpRecentAddedMapPoints.begin(); lit!=mlpRecentAddedMapPoints.end();)
+    {
+        if((*lit)->isBad())
+            lit = mlpRecentAddedMapPoints.erase(lit);
+        else
+            lit++;
+    }
+
+    // Queued keyframes do not observe their MapPoints yet, culling does not erase the matches
+    mNewKeyFrames.ForEach([](const QueuedKeyFrame &queued)
+    {
+        KeyFrame* pKF = queued.pKF;
+        const vector<MapPoint*> vpMapPointMatches = pKF->GetMapPointMatches();
+        for(size_t i=0; i<vpMapPointMatches.size(); i++)
+        {
+            MapPoint* pMP = vpMapPointMatches[i];
+            if(pMP && pMP->isBad())
+                pKF->EraseMapPointMatch(i);
+        }
+    });
+
+    mpMap->mReclaimer.QuiescentState(mnReclaimerId);
+}
+
+void LocalMapping::InsertKeyFrame(KeyFrame *pKF, const bool bInterruptBA)
 {
+    // The tracker stops creating keyframes long before the queue is full, it only waits here
+    // if the mapping thread does not keep up at all
+    QueuedKeyFrame queued;
+    queued.pKF = pKF;
+    queued.tQueued = chrono::steady_clock::now();
+    while(!mNewKeyFrames.Push(queued))
+    {
+        WakeUp();
+        this_thread::sleep_for(chrono::milliseconds(1)); //param
+    }
     {
-        unique_lock<mutex> lock(mMutexNewKFs);
-        mpCurrentKeyFrame = mlNewKeyFrames.front();
-        mlNewKeyFrames.pop_front();
+        unique_lock<mutex> lock(mMutexQueueStats);
+        mQueueStats.nInserted++;
+        mQueueStats.nMaxQueued = max(mQueueStats.nMaxQueued,mNewKeyFrames.Size());
     }
+    if(bInterruptBA)
+        mbAbortBA=true;
+
+    // Either the mapping thread sees the keyframe before it sleeps or this sees it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if(mbSleeping.load(memory_order_relaxed))
+        WakeUp();
+}
+
+void LocalMapping::WaitForWakeUp()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    mbSleeping.store(true,memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    // A wake up which came in since the last wait is not lost, the flag is still set
+    if(!mbWakeUp && mNewKeyFrames.Empty())
+        mCondWakeUp.wait_for(lock,chrono::milliseconds(mbParked.load(memory_order_relaxed) ? 1000 : 50)); //param
+    mbSleeping.store(false,memory_order_relaxed);
+    mbWakeUp = false;
+}
+
+void LocalMapping::WakeUp()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    mbWakeUp = true;
+    mCondWakeUp.notify_one();
+}
+
+
+bool LocalMapping::CheckNewKeyFrames()
+{
+    return !mNewKeyFrames.Empty();
+}
+
+void LocalMapping::ProcessNewKeyFrame()
+{
+    STAGE_TIMER(PROCESS_NEW_KEYFRAME);
+
+    QueuedKeyFrame queued;
+    mNewKeyFrames.Pop(queued);
+    mpCurrentKeyFrame = queued.pKF;
+    StageTimes::Add(Stage::KEYFRAME_QUEUE,chrono::steady_clock::now()-queued.tQueued);
+    Trace::SetContext("keyframe",mpCurrentKeyFrame->mnId);
 
     // Compute Bags of Words structures
     mpCurrentKeyFrame->ComputeBoW();
@@ -174,6 +499,8 @@ void LocalMapping::ProcessNewKeyFrame()
 
 void LocalMapping::MapPointCulling()
 {
+    STAGE_TIMER(MAP_POINT_CULLING);
+
     // Check Recent Added MapPoints
     list<MapPoint*>::iterator lit = mlpRecentAddedMapPoints.begin();
     const unsigned long int nCurrentKFid = mpCurrentKeyFrame->mnId;
@@ -226,235 +553,91 @@ void LocalMapping::MapPointCulling()
 
 void LocalMapping::CreateNewMapPoints()
 {
+    STAGE_TIMER(CREATE_NEW_MAP_POINTS);
+
     // Retrieve neighbor keyframes in covisibility graph
     int nn = 10; //param
     if(mbMonocular)
         nn=20; //param
-    const vector<KeyFrame*> vpNeighKFs = mpCurrentKeyFrame->GetBestCovisibilityKeyFrames(nn);
+    vector<KeyFrame*> vpNeighKFs = mpCurrentKeyFrame->GetBestCovisibilityKeyFrames(nn);
+
+    // The points are triangulated from the poses read now
+    const int nMapChangeIdx = mpMap->GetLastBigChangeIdx();
+
+    // A rig camera sees few points of the map at first, its own keyframe before has the baseline
+    KeyFrame* pPrevRigKF = mpCurrentKeyFrame->mpPrevRigKF;
+    if(pPrevRigKF && !pPrevRigKF->isBad() &&
+       find(vpNeighKFs.begin(),vpNeighKFs.end(),pPrevRigKF)==vpNeighKFs.end())
+        vpNeighKFs.push_back(pPrevRigKF);
 
     DLOG_IF(INFO, mVisualizeLocalMapping()) << "Creating new map points from matches with the "
                                             << vpNeighKFs.size()
                                             << " nearest keyframes in covisibility graph.";
-    ORBmatcher matcher(0.6,false); //param
 
-    cv::Mat Rcw1 = mpCurrentKeyFrame->GetRotation();
-    cv::Mat Rwc1 = Rcw1.t();
-    cv::Mat tcw1 = mpCurrentKeyFrame->GetTranslation();
-    cv::Mat Tcw1(3,4,CV_32F);
-    Rcw1.copyTo(Tcw1.colRange(0,3));
-    tcw1.copyTo(Tcw1.col(3));
-    cv::Mat Ow1 = mpCurrentKeyFrame->GetCameraCenter();
-
-    const float &fx1 = mpCurrentKeyFrame->fx;
-    const float &fy1 = mpCurrentKeyFrame->fy;
-    const float &cx1 = mpCurrentKeyFrame->cx;
-    const float &cy1 = mpCurrentKeyFrame->cy;
-    const float &invfx1 = mpCurrentKeyFrame->invfx;
-    const float &invfy1 = mpCurrentKeyFrame->invfy;
+    // Search matches with epipolar restriction and triangulate. This only reads the keyframes,
+    // so every neighbor is done in parallel. The workers run inside this iteration of the
+    // mapping thread, which keeps the keyframes alive for the reclaimer.
+    const int nNeighs = vpNeighKFs.size();
+    vector<vector<TriangulatedMatch> > vvTriangulated(nNeighs);
+    vector<vector<size_t> > vvMatched1(nNeighs);
+    vector<char> vbDone(nNeighs,false);
 
-    const float ratioFactor = 1.5f*mpCurrentKeyFrame->mfScaleFactor; //param
-
-    int nnew=0;
-
-    // Search matches with epipolar restriction and triangulate
-    for(size_t i=0; i<vpNeighKFs.size(); i++)
+    mpThreadPool->ParallelFor(nNeighs, [&](int i)
     {
         if(i>0 && CheckNewKeyFrames())
             return;
 
-        KeyFrame* pKF2 = vpNeighKFs[i];
+        TriangulateWithNeighbor(vpNeighKFs[i],vvTriangulated[i],vvMatched1[i]);
+        vbDone[i] = true;
+    });
 
-        // Check first that baseline is not too short
-        cv::Mat Ow2 = pKF2->GetCameraCenter();
-        cv::Mat vBaseline = Ow2-Ow1;
-        const float baseline = cv::norm(vBaseline);
+    int nnew=0;
 
-        if(!mbMonocular)
-        {
-            if(baseline<pKF2->mb)
-            continue;
-        }
-        else
-        {
-            const float medianDepthKF2 = pKF2->ComputeSceneMedianDepth(2);
-            const float ratioBaselineDepth = baseline/medianDepthKF2;
+    // A global BA applied meanwhile moved the keyframes, these points would be off by its correction.
+    // They are triangulated again with the next keyframe.
+    MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+    if(mpMap->GetLastBigChangeIdx()!=nMapChangeIdx)
+    {
+        DLOG_IF(INFO, mVisualizeLocalMapping()) << "Map corrected during the triangulation, no new map points.";
+        return;
+    }
 
-            if(ratioBaselineDepth<0.01) //param
-                continue;
-        }
+    // Insert the new MapPoints in the order of the neighbors, so the map does not depend on the
+    // scheduling. The search with a neighbor skips the keypoints which have a point, searching the
+    // neighbors one after the other it skipped the ones the neighbors before got points for. A
+    // keypoint the search matched and which has a point now took a keypoint of the neighbor another
+    // one may have been matched with, so that neighbor is searched again, serially. The points
+    // are then the ones of the serial search and no keypoint gets a second point.
+    for(int i=0; i<nNeighs; i++)
+    {
+        // a new keyframe arrived, stop where the serial search would have stopped
+        if(!vbDone[i])
+            break;
 
-        // Compute Fundamental Matrix
-        cv::Mat F12 = ComputeF12(mpCurrentKeyFrame,pKF2);
-
-        // Search matches that fullfil epipolar constraint
-        vector<pair<size_t,size_t> > vMatchedIndices;
-        matcher.SearchForTriangulation(mpCurrentKeyFrame,pKF2,F12,vMatchedIndices,false);
-
-        cv::Mat Rcw2 = pKF2->GetRotation();
-        cv::Mat Rwc2 = Rcw2.t();
-        cv::Mat tcw2 = pKF2->GetTranslation();
-        cv::Mat Tcw2(3,4,CV_32F);
-        Rcw2.copyTo(Tcw2.colRange(0,3));
-        tcw2.copyTo(Tcw2.col(3));
-
-        const float &fx2 = pKF2->fx;
-        const float &fy2 = pKF2->fy;
-        const float &cx2 = pKF2->cx;
-        const float &cy2 = pKF2->cy;
-        const float &invfx2 = pKF2->invfx;
-        const float &invfy2 = pKF2->invfy;
-
-        // Triangulate each match
-        const int nmatches = vMatchedIndices.size();
-        for(int ikp=0; ikp<nmatches; ikp++)
+        KeyFrame* pKF2 = vpNeighKFs[i];
+        const vector<size_t> &vMatched1 = vvMatched1[i];
+        for(size_t j=0, jend=vMatched1.size(); j<jend; j++)
         {
-            const int &idx1 = vMatchedIndices[ikp].first;
-            const int &idx2 = vMatchedIndices[ikp].second;
-
-            const cv::KeyPoint &kp1 = mpCurrentKeyFrame->mvKeysUn[idx1];
-            const float kp1_ur=mpCurrentKeyFrame->mvuRight[idx1];
-            bool bStereo1 = kp1_ur>=0;
-
-            const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
-            const float kp2_ur = pKF2->mvuRight[idx2];
-            bool bStereo2 = kp2_ur>=0;
-
-            // Check parallax between rays
-            cv::Mat xn1 = (cv::Mat_<float>(3,1) << (kp1.pt.x-cx1)*invfx1, (kp1.pt.y-cy1)*invfy1, 1.0);
-            cv::Mat xn2 = (cv::Mat_<float>(3,1) << (kp2.pt.x-cx2)*invfx2, (kp2.pt.y-cy2)*invfy2, 1.0);
-
-            cv::Mat ray1 = Rwc1*xn1;
-            cv::Mat ray2 = Rwc2*xn2;
-            const float cosParallaxRays = ray1.dot(ray2)/(cv::norm(ray1)*cv::norm(ray2));
-
-            float cosParallaxStereo = cosParallaxRays+1;
-            float cosParallaxStereo1 = cosParallaxStereo;
-            float cosParallaxStereo2 = cosParallaxStereo;
-
-            if(bStereo1)
-                cosParallaxStereo1 = cos(2*atan2(mpCurrentKeyFrame->mb/2,mpCurrentKeyFrame->mvDepth[idx1]));
-            else if(bStereo2)
-                cosParallaxStereo2 = cos(2*atan2(pKF2->mb/2,pKF2->mvDepth[idx2]));
-
-            cosParallaxStereo = min(cosParallaxStereo1,cosParallaxStereo2);
-
-            cv::Mat x3D;
-            if(cosParallaxRays<cosParallaxStereo && cosParallaxRays>0 && (bStereo1 || bStereo2 || cosParallaxRays<0.9998)) //param
+            if(mpCurrentKeyFrame->GetMapPoint(vMatched1[j]))
             {
-                // Linear Triangulation Method
-                cv::Mat A(4,4,CV_32F);
-                A.row(0) = xn1.at<float>(0)*Tcw1.row(2)-Tcw1.row(0);
-                A.row(1) = xn1.at<float>(1)*Tcw1.row(2)-Tcw1.row(1);
-                A.row(2) = xn2.at<float>(0)*Tcw2.row(2)-Tcw2.row(0);
-                A.row(3) = xn2.at<float>(1)*Tcw2.row(2)-Tcw2.row(1);
-
-                cv::Mat w,u,vt;
-                cv::SVD::compute(A,w,u,vt,cv::SVD::MODIFY_A| cv::SVD::FULL_UV);
-
-                x3D = vt.row(3).t();
-
-                if(x3D.at<float>(3)==0)
-                    continue;
-
-                // Euclidean coordinates
-                x3D = x3D.rowRange(0,3)/x3D.at<float>(3);
-
-            }
-            else if(bStereo1 && cosParallaxStereo1<cosParallaxStereo2)
-            {
-                x3D = mpCurrentKeyFrame->UnprojectStereo(idx1);
-            }
-            else if(bStereo2 && cosParallaxStereo2<cosParallaxStereo1)
-            {
-                x3D = pKF2->UnprojectStereo(idx2);
-            }
-            else
-                continue; //No stereo and very low parallax
-
-            cv::Mat x3Dt = x3D.t();
-
-            //Check triangulation in front of cameras
-            float z1 = Rcw1.row(2).dot(x3Dt)+tcw1.at<float>(2);
-            if(z1<=0)
-                continue;
-
-            float z2 = Rcw2.row(2).dot(x3Dt)+tcw2.at<float>(2);
-            if(z2<=0)
-                continue;
-
-            //Check reprojection error in first keyframe
-            const float &sigmaSquare1 = mpCurrentKeyFrame->mvLevelSigma2[kp1.octave];
-            const float x1 = Rcw1.row(0).dot(x3Dt)+tcw1.at<float>(0);
-            const float y1 = Rcw1.row(1).dot(x3Dt)+tcw1.at<float>(1);
-            const float invz1 = 1.0/z1;
-
-            if(!bStereo1)
-            {
-                float u1 = fx1*x1*invz1+cx1;
-                float v1 = fy1*y1*invz1+cy1;
-                float errX1 = u1 - kp1.pt.x;
-                float errY1 = v1 - kp1.pt.y;
-                if((errX1*errX1+errY1*errY1)>5.991*sigmaSquare1)
-                    continue;
-            }
-            else
-            {
-                float u1 = fx1*x1*invz1+cx1;
-                float u1_r = u1 - mpCurrentKeyFrame->mbf*invz1;
-                float v1 = fy1*y1*invz1+cy1;
-                float errX1 = u1 - kp1.pt.x;
-                float errY1 = v1 - kp1.pt.y;
-                float errX1_r = u1_r - kp1_ur;
-                if((errX1*errX1+errY1*errY1+errX1_r*errX1_r)>7.8*sigmaSquare1)
-                    continue;
-            }
-
-            //Check reprojection error in second keyframe
-            const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
-            const float x2 = Rcw2.row(0).dot(x3Dt)+tcw2.at<float>(0);
-            const float y2 = Rcw2.row(1).dot(x3Dt)+tcw2.at<float>(1);
-            const float invz2 = 1.0/z2;
-            if(!bStereo2)
-            {
-                float u2 = fx2*x2*invz2+cx2;
-                float v2 = fy2*y2*invz2+cy2;
-                float errX2 = u2 - kp2.pt.x;
-                float errY2 = v2 - kp2.pt.y;
-                if((errX2*errX2+errY2*errY2)>5.991*sigmaSquare2)
-                    continue;
-            }
-            else
-            {
-                float u2 = fx2*x2*invz2+cx2;
-                float u2_r = u2 - mpCurrentKeyFrame->mbf*invz2;
-                float v2 = fy2*y2*invz2+cy2;
-                float errX2 = u2 - kp2.pt.x;
-                float errY2 = v2 - kp2.pt.y;
-                float errX2_r = u2_r - kp2_ur;
-                if((errX2*errX2+errY2*errY2+errX2_r*errX2_r)>7.8*sigmaSquare2)
-                    continue;
+                vvTriangulated[i].clear();
+                vvMatched1[i].clear();
+                TriangulateWithNeighbor(pKF2,vvTriangulated[i],vvMatched1[i]);
+                break;
             }
+        }
+        const vector<TriangulatedMatch> &vTriangulated = vvTriangulated[i];
 
-            //Check scale consistency
-            cv::Mat normal1 = x3D-Ow1;
-            float dist1 = cv::norm(normal1);
-
-            cv::Mat normal2 = x3D-Ow2;
-            float dist2 = cv::norm(normal2);
-
-            if(dist1==0 || dist2==0)
-                continue;
-
-            const float ratioDist = dist2/dist1;
-            const float ratioOctave = mpCurrentKeyFrame->mvScaleFactors[kp1.octave]/pKF2->mvScaleFactors[kp2.octave];
+        for(size_t j=0, jend=vTriangulated.size(); j<jend; j++)
+        {
+            const size_t idx1 = vTriangulated[j].idx1;
+            const size_t idx2 = vTriangulated[j].idx2;
 
-            /*if(fabs(ratioDist-ratioOctave)>ratioFactor)
-                continue;*/
-            if(ratioDist*ratioFactor<ratioOctave || ratioDist>ratioOctave*ratioFactor)
+            if(mpCurrentKeyFrame->GetMapPoint(idx1))
                 continue;
 
             // Triangulation is succesfull
-            MapPoint* pMP = new MapPoint(x3D,mpCurrentKeyFrame,mpMap);
+            MapPoint* pMP = new MapPoint(vTriangulated[j].x3D,mpCurrentKeyFrame,mpMap);
 
             pMP->AddObservation(mpCurrentKeyFrame,idx1);
             pMP->AddObservation(pKF2,idx2);
@@ -476,8 +659,81 @@ void LocalMapping::CreateNewMapPoints()
     DLOG_IF(INFO, mVisualizeLocalMapping()) << "Triangulated " << nnew << " new map points.";
 }
 
+void LocalMapping::TriangulateWithNeighbor(KeyFrame* pKF2, vector<TriangulatedMatch> &vTriangulated,
+                                           vector<size_t> &vMatched1)
+{
+    cv::Mat Ow1 = mpCurrentKeyFrame->GetCameraCenter();
+
+    const float ratioFactor = 1.5f*mpCurrentKeyFrame->mfScaleFactor; //param
+
+    // Check first that baseline is not too short
+    cv::Mat Ow2 = pKF2->GetCameraCenter();
+    cv::Mat vBaseline = Ow2-Ow1;
+    const float baseline = cv::norm(vBaseline);
+
+    if(!mbMonocular)
+    {
+        if(baseline<pKF2->mb)
+            return;
+    }
+    else
+    {
+        const float medianDepthKF2 = pKF2->ComputeSceneMedianDepth(2);
+        const float ratioBaselineDepth = baseline/medianDepthKF2;
+
+        if(ratioBaselineDepth<0.01) //param
+            return;
+    }
+
+    // Compute Fundamental Matrix
+    cv::Mat F12 = ComputeF12(mpCurrentKeyFrame,pKF2);
+
+    // Search matches that fullfil epipolar constraint
+    vector<pair<size_t,size_t> > vMatchedIndices;
+    ORBmatcher matcher(0.6,false); //param
+    matcher.SearchForTriangulation(mpCurrentKeyFrame,pKF2,F12,vMatchedIndices,false);
+
+    vMatched1.resize(vMatchedIndices.size());
+    for(size_t ikp=0; ikp<vMatchedIndices.size(); ikp++)
+        vMatched1[ikp] = vMatchedIndices[ikp].first;
+
+    // Triangulate all matches at once and check parallax, depth, reprojection error and scale
+    const int nmatches = vMatchedIndices.size();
+    // The triangulator reads the keypoints of the neighbor directly
+    pKF2->Expand();
+    Triangulator triangulator;
+    triangulator.Reset(mpCurrentKeyFrame,pKF2);
+    for(int ikp=0; ikp<nmatches; ikp++)
+        triangulator.Add(vMatchedIndices[ikp].first,vMatchedIndices[ikp].second);
+    triangulator.Run(ratioFactor);
+
+    vTriangulated.reserve(nmatches);
+    for(int ikp=0; ikp<nmatches; ikp++)
+    {
+        if(!triangulator.IsGood(ikp))
+            continue;
+
+        vTriangulated.push_back(TriangulatedMatch());
+        vTriangulated.back().idx1 = triangulator.Idx1(ikp);
+        vTriangulated.back().idx2 = triangulator.Idx2(ikp);
+        vTriangulated.back().x3D = Converter::toCvMat(triangulator.Position(ikp));
+    }
+}
+
+void LocalMapping::PublishNeighborhood()
+{
+    if(mpCurrentKeyFrame->isBad())
+        return;
+
+    shared_ptr<LocalNeighborhood> pNeighborhood = make_shared<LocalNeighborhood>();
+    pNeighborhood->Build(mpCurrentKeyFrame);
+    mpMap->mNeighborhoods.Publish(pNeighborhood);
+}
+
 void LocalMapping::SearchInNeighbors()
 {
+    STAGE_TIMER(SEARCH_IN_NEIGHBORS);
+
     int numMapPointsFused = 0;
 
     // Retrieve neighbor keyframes
@@ -495,10 +751,12 @@ void LocalMapping::SearchInNeighbors()
         pKFi->mnFuseTargetForKF = mpCurrentKeyFrame->mnId;
 
         // Extend to some second neighbors
-        const vector<KeyFrame*> vpSecondNeighKFs = pKFi->GetBestCovisibilityKeyFrames(5);
-        for(vector<KeyFrame*>::const_iterator vit2=vpSecondNeighKFs.begin(), vend2=vpSecondNeighKFs.end(); vit2!=vend2; vit2++)
+        const KeyFrame::CovisibilitySnapshot pSecondNeighs = pKFi->GetCovisibilitySnapshot();
+        const vector<KeyFrame*> &vpSecondNeighKFs = pSecondNeighs->KeyFrames();
+        const size_t nSecondNeighs = min(pSecondNeighs->NumOrdered(),static_cast<size_t>(5));
+        for(size_t i2=0; i2<nSecondNeighs; i2++)
         {
-            KeyFrame* pKFi2 = *vit2;
+            KeyFrame* pKFi2 = vpSecondNeighKFs[i2];
             if(pKFi2->isBad() || pKFi2->mnFuseTargetForKF==mpCurrentKeyFrame->mnId || pKFi2->mnId==mpCurrentKeyFrame->mnId)
                 continue;
             vpTargetKFs.push_back(pKFi2);
@@ -506,15 +764,25 @@ void LocalMapping::SearchInNeighbors()
     }
 
 
-    // Search matches by projection from current KF in target KFs
+    // The searches by projection only read the map and run in parallel. The fusions change
+    // the map and are applied afterwards by this thread, in a fixed order, the keyframe entries
+    // of each pass in one batch.
     ORBmatcher matcher; //param
+
+    // Search matches by projection from current KF in target KFs
     vector<MapPoint*> vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
-    for(vector<KeyFrame*>::iterator vit=vpTargetKFs.begin(), vend=vpTargetKFs.end(); vit!=vend; vit++)
+    const int nTargets = vpTargetKFs.size();
+    vector<vector<ORBmatcher::FuseMatch> > vvTargetMatches(nTargets);
+    mpThreadPool->ParallelFor(nTargets, [&](int i)
     {
-        KeyFrame* pKFi = *vit;
+        matcher.SearchFuseMatches(vpTargetKFs[i],vpMapPointMatches,vvTargetMatches[i]);
+    });
 
-        numMapPointsFused += matcher.Fuse(pKFi,vpMapPointMatches);
-    }
+    MapPointReplacer replacer;
+    for(int i=0; i<nTargets; i++)
+        numMapPointsFused += matcher.ApplyFuseMatches(vpTargetKFs[i],vvTargetMatches[i],&replacer);
+    // the candidates are read from the entries of the target KFs
+    replacer.Apply();
 
     // Search matches by projection from target KFs in current KF
     vector<MapPoint*> vpFuseCandidates;
@@ -538,24 +806,42 @@ void LocalMapping::SearchInNeighbors()
         }
     }
 
-    numMapPointsFused += matcher.Fuse(mpCurrentKeyFrame,vpFuseCandidates);
+    // the candidates are searched in blocks
+    const int nBlockSize = 64; //param
+    const int nCandidates = vpFuseCandidates.size();
+    const int nCandidateBlocks = (nCandidates+nBlockSize-1)/nBlockSize;
+    vector<vector<ORBmatcher::FuseMatch> > vvCandidateMatches(nCandidateBlocks);
+    mpThreadPool->ParallelFor(nCandidateBlocks, [&](int i)
+    {
+        const vector<MapPoint*> vpBlock(vpFuseCandidates.begin()+i*nBlockSize,
+                                        vpFuseCandidates.begin()+min((i+1)*nBlockSize,nCandidates));
+        matcher.SearchFuseMatches(mpCurrentKeyFrame,vpBlock,vvCandidateMatches[i]);
+    });
+
+    for(int i=0; i<nCandidateBlocks; i++)
+        numMapPointsFused += matcher.ApplyFuseMatches(mpCurrentKeyFrame,vvCandidateMatches[i],&replacer);
+    replacer.Apply();
     DLOG_IF(INFO, mVisualizeLocalMapping()) << numMapPointsFused << " duplicate map points fused.";
 
 
-    // Update points
+    // Update points, each one only locks itself
     vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
-    for(size_t i=0, iend=vpMapPointMatches.size(); i<iend; i++)
+    const int nPoints = vpMapPointMatches.size();
+    mpThreadPool->ParallelFor((nPoints+nBlockSize-1)/nBlockSize, [&](int iBlock)
     {
-        MapPoint* pMP=vpMapPointMatches[i];
-        if(pMP)
+        for(int i=iBlock*nBlockSize, iend=min((iBlock+1)*nBlockSize,nPoints); i<iend; i++)
         {
-            if(!pMP->isBad())
+            MapPoint* pMP=vpMapPointMatches[i];
+            if(pMP)
             {
-                pMP->ComputeDistinctiveDescriptors();
-                pMP->UpdateNormalAndDepth();
+                if(!pMP->isBad())
+                {
+                    pMP->ComputeDistinctiveDescriptors();
+                    pMP->UpdateNormalAndDepth();
+                }
             }
         }
-    }
+    });
 
     // Update connections in covisibility graph
     mpCurrentKeyFrame->UpdateConnections();
@@ -582,10 +868,13 @@ cv::Mat LocalMapping::ComputeF12(KeyFrame *&pKF1, KeyFrame *&pKF2)
 
 void LocalMapping::RequestStop()
 {
-    unique_lock<mutex> lock(mMutexStop);
-    mbStopRequested = true;
-    unique_lock<mutex> lock2(mMutexNewKFs);
-    mbAbortBA = true;
+    Trace::Instant("RequestStop");
+    {
+        unique_lock<mutex> lock(mMutexStop);
+        mbStopRequested = true;
+        mbAbortBA = true;
+    }
+    WakeUp();
 }
 
 bool LocalMapping::Stop()
@@ -594,6 +883,7 @@ bool LocalMapping::Stop()
     if(mbStopRequested && !mbNotStop)
     {
         mbStopped = true;
+        mCondStop.notify_all();
         cout << "Local Mapping STOP" << endl;
         return true;
     }
@@ -607,6 +897,13 @@ bool LocalMapping::isStopped()
     return mbStopped;
 }
 
+void LocalMapping::WaitUntilStopped()
+{
+    unique_lock<mutex> lock(mMutexStop);
+    while(!mbStopped)
+        mCondStop.wait(lock);
+}
+
 bool LocalMapping::stopRequested()
 {
     unique_lock<mutex> lock(mMutexStop);
@@ -615,17 +912,20 @@ bool LocalMapping::stopRequested()
 
 void LocalMapping::Release()
 {
-    unique_lock<mutex> lock(mMutexStop);
-    unique_lock<mutex> lock2(mMutexFinish);
-    if(mbFinished)
-        return;
-    mbStopped = false;
-    mbStopRequested = false;
-    for(list<KeyFrame*>::iterator lit = mlNewKeyFrames.begin(), lend=mlNewKeyFrames.end(); lit!=lend; lit++)
-        delete *lit;
-    mlNewKeyFrames.clear();
+    {
+        unique_lock<mutex> lock(mMutexStop);
+        unique_lock<mutex> lock2(mMutexFinish);
+        if(mbFinished)
+            return;
+        mbStopped = false;
+        mbStopRequested = false;
+        QueuedKeyFrame queued;
+        while(mNewKeyFrames.Pop(queued))
+            delete queued.pKF;
 
-    cout << "Local Mapping RELEASE" << endl;
+        cout << "Local Mapping RELEASE" << endl;
+    }
+    WakeUp();
 }
 
 bool LocalMapping::AcceptKeyFrames()
@@ -649,6 +949,10 @@ bool LocalMapping::SetNotStop(bool flag)
 
     mbNotStop = flag;
 
+    // a stop request may be waiting for this
+    if(!flag)
+        WakeUp();
+
     return true;
 }
 
@@ -659,21 +963,33 @@ void LocalMapping::InterruptBA()
 
 void LocalMapping::KeyFrameCulling()
 {
+    STAGE_TIMER(KEYFRAME_CULLING);
+
     // Check redundant keyframes (only local keyframes)
     // A keyframe is considered redundant if the 90% of the MapPoints it sees, are seen
     // in at least other 3 keyframes (in the same or finer scale)
     // We only consider close stereo points
-    vector<KeyFrame*> vpLocalKeyFrames = mpCurrentKeyFrame->GetVectorCovisibleKeyFrames();
+    const int numRemovedKeyFrames = CullRedundantKeyFrames(mpCurrentKeyFrame->GetVectorCovisibleKeyFrames());
+    DLOG_IF(INFO, mVisualizeLocalMapping()) << "Removed " << numRemovedKeyFrames
+                                            << " keyframes from local map.";
+}
 
+int LocalMapping::CullRedundantKeyFrames(const vector<KeyFrame*> &vpKeyFrames)
+{
     //TODO : throws out the first keyframe it find that falls into the criteria, doesn't consider whether
     // it might make more sense to get rid of other keyframes first, that e.g. are further away from the current keyframe
-    int numRemovedKeyFrames = 0;
-    for(vector<KeyFrame*>::iterator vit=vpLocalKeyFrames.begin(), vend=vpLocalKeyFrames.end(); vit!=vend; vit++)
+    // The redundant keyframes are culled together at the end, each one's observations no longer
+    // count for the ones checked after it
+    set<KeyFrame*> spCulled;
+    for(vector<KeyFrame*>::const_iterator vit=vpKeyFrames.begin(), vend=vpKeyFrames.end(); vit!=vend; vit++)
     {
         KeyFrame* pKF = *vit;
-        if(pKF->mnId==0)
+        if(pKF->isBad() || pKF->IsOrigin() || HasRigKeyFrames(pKF))
             continue;
-        const vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
+        const KeyFrame::MapPointMatchesSnapshot pMatches = pKF->GetMapPointMatchesSnapshot();
+        const vector<MapPoint*> &vpMapPoints = *pMatches;
+        // Read without expanding, a cold keyframe stays cold
+        const KeyFrame::Features features = pKF->GetFeatures();
 
         int nObs = 3;
         const int thObs=nObs; //param
@@ -688,7 +1004,7 @@ void LocalMapping::KeyFrameCulling()
                 {
                     if(!mbMonocular)
                     {
-                        if(pKF->mvDepth[i]>pKF->mThDepth || pKF->mvDepth[i]<0)
+                        if(features.vDepth[i]>pKF->mThDepth || features.vDepth[i]<0)
                             continue;
                     }
 
@@ -696,16 +1012,17 @@ void LocalMapping::KeyFrameCulling()
                     // check if the mappoint is seen at least three times
                     if(pMP->Observations()>thObs) //param
                     {
-                        const int &scaleLevel = pKF->mvKeysUn[i].octave;
-                        const map<KeyFrame*, size_t> observations = pMP->GetObservations();
+                        const int &scaleLevel = features.vKeysUn[i].octave;
+                        const MapPoint::ObservationsSnapshot pObservations = pMP->GetObservationsSnapshot();
+                        const ObservationList &observations = *pObservations;
                         int nObs=0;
                         // go through the keyframes that see the map point
-                        for(map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+                        for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
                         {
                             KeyFrame* pKFi = mit->first;
-                            if(pKFi==pKF)
+                            if(pKFi==pKF || spCulled.count(pKFi))
                                 continue;
-                            const int &scaleLeveli = pKFi->mvKeysUn[mit->second].octave;
+                            const int scaleLeveli = pKFi->GetOctave(mit->second);
 
                             if(scaleLeveli<=scaleLevel+1)
                             {
@@ -724,13 +1041,262 @@ void LocalMapping::KeyFrameCulling()
         }
 
         if(nRedundantObservations>0.9*nMPs) //param
+            spCulled.insert(pKF);
+    }
+    return KeyFrame::SetBadFlags(vector<KeyFrame*>(spCulled.begin(),spCulled.end()));
+}
+
+void LocalMapping::BudgetCulling()
+{
+    if(mnMaxKeyFrames==0 && mnMaxMapPoints==0 && mnMaxBytes==0)
+        return;
+
+    STAGE_TIMER(BUDGET_CULLING);
+
+    UpdateObjectSizes();
+
+    const long nKFs = mpMap->KeyFramesInMap();
+    const long nMPs = mpMap->MapPointsInMap();
+    long nExcessKFs = mnMaxKeyFrames>0 ? nKFs-mnMaxKeyFrames : 0;
+    const long nExcessMPs = mnMaxMapPoints>0 ? nMPs-mnMaxMapPoints : 0;
+    if(mnMaxBytes>0 && nKFs>0)
+    {
+        const double bytes = nKFs*mfKeyFrameBytes+nMPs*mfMapPointBytes;
+        if(bytes>mnMaxBytes)
         {
-            pKF->SetBadFlag();
-            numRemovedKeyFrames++;
+            // A culled keyframe takes its share of the MapPoints along
+            const double keyFrameShare = mfKeyFrameBytes+mfMapPointBytes*nMPs/nKFs;
+            nExcessKFs = max(nExcessKFs,static_cast<long>(ceil((bytes-mnMaxBytes)/keyFrameShare)));
         }
     }
-    DLOG_IF(INFO, mVisualizeLocalMapping()) << "Removed " << numRemovedKeyFrames
-                                            << " keyframes from local map.";
+    if(nExcessKFs<=0 && nExcessMPs<=0)
+        return;
+
+    // A map over its budget grows where it is revisited, which is the area the current keyframe sees
+    const vector<KeyFrame*> vpLocalKFs = mpCurrentKeyFrame->GetVectorCovisibleKeyFrames();
+
+    // Every keyframe adds one keyframe and its new points, culling a bit more each time gets the
+    // map back under the budget without emptying an area at once
+    const long nMaxCulledKFs = 2; //param
+    const long nMaxCulledMPs = 500; //param
+    if(nExcessKFs>0)
+        CullKeyFramesOverBudget(vpLocalKFs, min(nExcessKFs,nMaxCulledKFs));
+    if(nExcessMPs>0)
+        CullMapPointsOverBudget(vpLocalKFs, min(nExcessMPs,nMaxCulledMPs));
+}
+
+void LocalMapping::CullKeyFramesOverBudget(const vector<KeyFrame*> &vpLocalKFs, const int nMaxCulled)
+{
+    const int thObs = 3; //param
+    const float thRedundancy = 0.5f; //param
+    // A keyframe whose nearest neighbor is closer than this fraction of its median scene depth
+    // covers no place of its own
+    const float thCoverage = 0.1f; //param
+    const int nNeighbors = 10; //param
+
+    // Redundancy of the MapPoints plus covisibility with the best neighbor, minus the coverage
+    vector<pair<float,KeyFrame*> > vScoredKFs;
+    for(size_t i=0; i<vpLocalKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpLocalKFs[i];
+        if(pKF->isBad() || pKF->IsOrigin() || HasRigKeyFrames(pKF))
+            continue;
+
+        // MapPoints seen by enough other keyframes to do without this one
+        const vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
+        int nMPs=0;
+        int nRedundant=0;
+        for(size_t j=0; j<vpMapPoints.size(); j++)
+        {
+            MapPoint* pMP = vpMapPoints[j];
+            if(!pMP || pMP->isBad())
+                continue;
+            nMPs++;
+            if(pMP->Observations()>thObs)
+                nRedundant++;
+        }
+        if(nMPs==0)
+            continue;
+        const float fRedundancy = static_cast<float>(nRedundant)/nMPs;
+        if(fRedundancy<thRedundancy)
+            continue;
+
+        const float fDepth = pKF->ComputeSceneMedianDepth(2);
+        if(fDepth<=0)
+            continue;
+
+        Eigen::Vector3f Ow;
+        pKF->GetCameraCenter(Ow);
+        const vector<KeyFrame*> vpNeighs = pKF->GetBestCovisibilityKeyFrames(nNeighbors);
+        float minDist = -1;
+        int nMaxWeight = 0;
+        for(size_t j=0; j<vpNeighs.size(); j++)
+        {
+            KeyFrame* pKFn = vpNeighs[j];
+            if(pKFn->isBad())
+                continue;
+            Eigen::Vector3f On;
+            pKFn->GetCameraCenter(On);
+            const float dist = (On-Ow).norm();
+            if(minDist<0 || dist<minDist)
+                minDist = dist;
+            nMaxWeight = max(nMaxWeight,pKF->GetWeight(pKFn));
+        }
+        if(minDist<0)
+            continue;
+
+        const float fCoverage = minDist/(thCoverage*fDepth);
+        if(fCoverage>=1)
+            continue;
+        const float fOverlap = min(1.0f,static_cast<float>(nMaxWeight)/nMPs);
+
+        vScoredKFs.push_back(make_pair(fRedundancy+fOverlap-fCoverage,pKF));
+    }
+
+    sort(vScoredKFs.begin(),vScoredKFs.end(),greater<pair<float,KeyFrame*> >());
+
+    // The neighbors of a culled keyframe lost their redundancy with it, they wait for the next
+    // keyframe to be scored again. Two copies of a place never go together.
+    set<KeyFrame*> spTouched;
+    int nCulled=0;
+    for(size_t i=0; i<vScoredKFs.size() && nCulled<nMaxCulled; i++)
+    {
+        KeyFrame* pKF = vScoredKFs[i].second;
+        if(spTouched.count(pKF))
+            continue;
+
+        const vector<KeyFrame*> vpNeighs = pKF->GetVectorCovisibleKeyFrames();
+        pKF->SetBadFlag();
+        // Kept for the loop closing
+        if(!pKF->isBad())
+            continue;
+
+        spTouched.insert(vpNeighs.begin(),vpNeighs.end());
+        nCulled++;
+    }
+
+    DLOG_IF(INFO, mVisualizeLocalMapping()) << "Map budget: removed " << nCulled << " keyframes.";
+}
+
+void LocalMapping::CullMapPointsOverBudget(const vector<KeyFrame*> &vpLocalKFs, const int nMaxCulled)
+{
+    // Younger MapPoints are still checked by MapPointCulling
+    const unsigned long nMinAge = 3; //param
+    const unsigned long nCurrentKFid = mpCurrentKeyFrame->mnId;
+
+    // Fewest observations first, then the lowest found ratio
+    vector<pair<pair<int,float>,MapPoint*> > vScoredMPs;
+    set<MapPoint*> spSeen;
+    for(size_t i=0; i<=vpLocalKFs.size(); i++)
+    {
+        KeyFrame* pKF = i<vpLocalKFs.size() ? vpLocalKFs[i] : mpCurrentKeyFrame;
+        if(pKF->isBad())
+            continue;
+        const vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
+        for(size_t j=0; j<vpMapPoints.size(); j++)
+        {
+            MapPoint* pMP = vpMapPoints[j];
+            if(!pMP || pMP->isBad() || !spSeen.insert(pMP).second)
+                continue;
+            if(pMP->mnFirstKFid<0 || static_cast<unsigned long>(pMP->mnFirstKFid)+nMinAge>nCurrentKFid)
+                continue;
+            vScoredMPs.push_back(make_pair(make_pair(pMP->Observations(),pMP->GetFoundRatio()),pMP));
+        }
+    }
+
+    const size_t nCulled = min(vScoredMPs.size(),static_cast<size_t>(nMaxCulled));
+    partial_sort(vScoredMPs.begin(),vScoredMPs.begin()+nCulled,vScoredMPs.end());
+    for(size_t i=0; i<nCulled; i++)
+        vScoredMPs[i].second->SetBadFlag();
+
+    DLOG_IF(INFO, mVisualizeLocalMapping()) << "Map budget: removed " << nCulled << " map points.";
+}
+
+void LocalMapping::UpdateObjectSizes()
+{
+    MemoryUsage usage;
+    mpCurrentKeyFrame->AddMemoryUsage(usage);
+
+    const vector<MapPoint*> vpMapPoints = mpCurrentKeyFrame->GetMapPointMatches();
+    size_t nPointBytes=0;
+    int nMPs=0;
+    for(size_t i=0; i<vpMapPoints.size(); i++)
+    {
+        MapPoint* pMP = vpMapPoints[i];
+        if(pMP && !pMP->isBad())
+        {
+            nPointBytes += pMP->GetMemoryUsage();
+            nMPs++;
+        }
+    }
+
+    const double alpha = 0.1; //param
+    const double keyFrameBytes = usage.Total();
+    mfKeyFrameBytes = mfKeyFrameBytes>0 ? (1-alpha)*mfKeyFrameBytes+alpha*keyFrameBytes : keyFrameBytes;
+    if(nMPs>0)
+    {
+        const double pointBytes = static_cast<double>(nPointBytes)/nMPs;
+        mfMapPointBytes = mfMapPointBytes>0 ? (1-alpha)*mfMapPointBytes+alpha*pointBytes : pointBytes;
+    }
+}
+
+void LocalMapping::SlidingWindowCulling()
+{
+    if(mnWindowKeyFrames==0)
+        return;
+
+    mlpWindowKeyFrames.push_back(mpCurrentKeyFrame);
+
+    // Keyframes culled as redundant leave their place in the window
+    for(list<KeyFrame*>::iterator lit=mlpWindowKeyFrames.begin(); lit!=mlpWindowKeyFrames.end();)
+    {
+        if((*lit)->isBad())
+            lit = mlpWindowKeyFrames.erase(lit);
+        else
+            lit++;
+    }
+
+    // The origin of a map is never erased, it keeps its place and the window moves on. Its
+    // MapPoints go with the keyframes which shared them.
+    int nErased=0;
+    while(static_cast<int>(mlpWindowKeyFrames.size())>mnWindowKeyFrames)
+    {
+        KeyFrame* pKF = mlpWindowKeyFrames.front();
+        mlpWindowKeyFrames.pop_front();
+        pKF->SetBadFlag();
+        if(pKF->isBad())
+            nErased++;
+    }
+
+    DLOG_IF(INFO, mVisualizeLocalMapping()) << "Sliding window: erased " << nErased << " keyframes.";
+}
+
+void LocalMapping::CompactColdKeyFrames()
+{
+    if(mnColdKeyFrames==0)
+        return;
+
+    const unsigned long nCurrentId = mpCurrentKeyFrame->mnId;
+    int nCompacted=0;
+    const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+    for(vector<KeyFrame*>::const_iterator vit=vpKFs.begin(), vend=vpKFs.end(); vit!=vend; vit++)
+    {
+        KeyFrame* pKF = *vit;
+        if(pKF==mpCurrentKeyFrame || pKF->IsCompact() || pKF->isBad())
+            continue;
+
+        // Last seen by a local BA, local or fixed, as a camera of its rig
+        KeyFrame* pBody = pKF->GetRigBody();
+        const unsigned long nLastLocal = max(pKF->mnId,max(pBody->mnBALocalForKF,pBody->mnBAFixedForKF));
+        if(nCurrentId<=nLastLocal+mnColdKeyFrames)
+            continue;
+
+        pKF->Compact();
+        if(pKF->IsCompact())
+            nCompacted++;
+    }
+
+    DLOG_IF(INFO, mVisualizeLocalMapping()) << "Cold storage: compacted " << nCompacted << " keyframes.";
 }
 
 cv::Mat LocalMapping::SkewSymmetricMatrix(const cv::Mat &v)
@@ -746,16 +1312,19 @@ void LocalMapping::RequestReset()
         unique_lock<mutex> lock(mMutexReset);
         mbResetRequested = true;
     }
+    // The map the BA would refine is about to go
+    mbAbortBA = true;
+    WakeUp();
 
-    while(1)
-    {
-        {
-            unique_lock<mutex> lock2(mMutexReset);
-            if(!mbResetRequested)
-                break;
-        }
-        usleep(3000);
-    }
+    unique_lock<mutex> lock2(mMutexReset);
+    while(mbResetRequested)
+        mCondReset.wait(lock2);
+}
+
+bool LocalMapping::CheckReset()
+{
+    unique_lock<mutex> lock(mMutexReset);
+    return mbResetRequested;
 }
 
 void LocalMapping::ResetIfRequested()
@@ -763,16 +1332,25 @@ void LocalMapping::ResetIfRequested()
     unique_lock<mutex> lock(mMutexReset);
     if(mbResetRequested)
     {
-        mlNewKeyFrames.clear();
+        mNewKeyFrames.Clear();
         mlpRecentAddedMapPoints.clear();
+        mlpWindowKeyFrames.clear();
+        mlDeferredStages.clear();
+        // Keyframe and point ids start again from zero
+        mLocalBAProblem.Clear();
+        mnLocalBAMemory = 0;
         mbResetRequested=false;
+        mCondReset.notify_all();
     }
 }
 
 void LocalMapping::RequestFinish()
 {
-    unique_lock<mutex> lock(mMutexFinish);
-    mbFinishRequested = true;
+    {
+        unique_lock<mutex> lock(mMutexFinish);
+        mbFinishRequested = true;
+    }
+    WakeUp();
 }
 
 bool LocalMapping::CheckFinish()
@@ -785,8 +1363,10 @@ void LocalMapping::SetFinish()
 {
     unique_lock<mutex> lock(mMutexFinish);
     mbFinished = true;
+    mCondFinish.notify_all();
     unique_lock<mutex> lock2(mMutexStop);
     mbStopped = true;
+    mCondStop.notify_all();
 }
 
 bool LocalMapping::isFinished()
@@ -795,4 +1375,17 @@ bool LocalMapping::isFinished()
     return mbFinished;
 }
 
+bool LocalMapping::isIdle()
+{
+    // The mapping thread only accepts keyframes again once it is done with the current one
+    return (KeyframesInQueue()==0 && AcceptKeyFrames()) || isStopped() || isFinished();
+}
+
+void LocalMapping::WaitUntilFinished()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    while(!mbFinished)
+        mCondFinish.wait(lock);
+}
+
 } //namespace ORB_SLAM
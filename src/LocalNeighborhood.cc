@@ -0,0 +1,99 @@
+#include "LocalNeighborhood.h"
+#include "KeyFrame.h"
+#include "MapPoint.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+void LocalNeighborhood::Build(KeyFrame* pKF)
+{
+    this->pKF = pKF;
+
+    const vector<KeyFrame*> vpCovisible = pKF->GetVectorCovisibleKeyFrames();
+    vpKeyFrames.assign(1,pKF);
+    for(size_t i=0; i<vpCovisible.size(); i++)
+    {
+        if(!vpCovisible[i]->isBad())
+            vpKeyFrames.push_back(vpCovisible[i]);
+    }
+    mvpSortedKeyFrames = vpKeyFrames;
+    sort(mvpSortedKeyFrames.begin(),mvpSortedKeyFrames.end());
+
+    // The change index is taken before the points are read, a change in between makes the
+    // neighborhood stale
+    vnChangeIdx.resize(vpKeyFrames.size());
+    vector<MapPoint*> vpObserved;
+    for(size_t i=0; i<vpKeyFrames.size(); i++)
+    {
+        vnChangeIdx[i] = vpKeyFrames[i]->GetChangeIdx();
+        const KeyFrame::MapPointMatchesSnapshot pMatches = vpKeyFrames[i]->GetMapPointMatchesSnapshot();
+        const vector<MapPoint*> &vpMPs = *pMatches;
+        for(size_t j=0; j<vpMPs.size(); j++)
+        {
+            if(vpMPs[j] && !vpMPs[j]->isBad())
+                vpObserved.push_back(vpMPs[j]);
+        }
+    }
+
+    // Without duplicates, the first observation of each point keeps its place
+    vector<pair<MapPoint*,size_t> > vFirst(vpObserved.size());
+    for(size_t i=0; i<vpObserved.size(); i++)
+        vFirst[i] = make_pair(vpObserved[i],i);
+    sort(vFirst.begin(),vFirst.end());
+    vector<unsigned char> vbKeep(vpObserved.size(),false);
+    for(size_t i=0; i<vFirst.size(); i++)
+    {
+        if(i==0 || vFirst[i].first!=vFirst[i-1].first)
+            vbKeep[vFirst[i].second] = true;
+    }
+    vpMapPoints.clear();
+    for(size_t i=0; i<vpObserved.size(); i++)
+    {
+        if(vbKeep[i])
+            vpMapPoints.push_back(vpObserved[i]);
+    }
+}
+
+bool LocalNeighborhood::IsCurrent() const
+{
+    for(size_t i=0; i<vpKeyFrames.size(); i++)
+    {
+        if(vpKeyFrames[i]->GetChangeIdx()!=vnChangeIdx[i])
+            return false;
+    }
+    return true;
+}
+
+bool LocalNeighborhood::Contains(KeyFrame* pKF) const
+{
+    return binary_search(mvpSortedKeyFrames.begin(),mvpSortedKeyFrames.end(),pKF);
+}
+
+void LocalNeighborhoods::Publish(const Snapshot &pNeighborhood)
+{
+    unique_lock<mutex> lock(mMutex);
+    mmNeighborhoods[pNeighborhood->pKF->mnId] = pNeighborhood;
+    while(mmNeighborhoods.size()>kMaxNeighborhoods)
+        mmNeighborhoods.erase(mmNeighborhoods.begin());
+}
+
+LocalNeighborhoods::Snapshot LocalNeighborhoods::Get(KeyFrame* pKF)
+{
+    unique_lock<mutex> lock(mMutex);
+    map<unsigned long, Snapshot>::const_iterator it = mmNeighborhoods.find(pKF->mnId);
+    if(it==mmNeighborhoods.end() || it->second->pKF!=pKF)
+        return Snapshot();
+    return it->second;
+}
+
+void LocalNeighborhoods::Clear()
+{
+    unique_lock<mutex> lock(mMutex);
+    mmNeighborhoods.clear();
+}
+
+} //namespace ORB_SLAM
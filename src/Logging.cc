@@ -1,4 +1,5 @@
 #include "Logging.h"
+#include "MPSCQueue.h"
 
 #include <boost/make_shared.hpp>
 #include <boost/shared_ptr.hpp>
@@ -6,13 +7,22 @@
 #include <boost/log/attributes/function.hpp>
 #include <boost/log/expressions/formatters/date_time.hpp>
 #include <boost/log/expressions.hpp>
+#include <boost/log/sinks/basic_sink_backend.hpp>
 #include <boost/log/sinks/sync_frontend.hpp>
 #include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/sinks/unlocked_frontend.hpp>
 #include <boost/log/support/date_time.hpp>
 #include <boost/log/utility/setup/formatter_parser.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
 #include <boost/log/utility/empty_deleter.hpp>
+#include <boost/log/utility/formatting_ostream.hpp>
+#include <atomic>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
 
 namespace logging = boost::log;
 namespace src = boost::log::sources;
@@ -38,6 +48,113 @@ BOOST_LOG_ATTRIBUTE_KEYWORD(scope, "Scope", std::string)
 BOOST_LOG_ATTRIBUTE_KEYWORD(frameNum, "FrameNum", int)
 BOOST_LOG_ATTRIBUTE_KEYWORD(totalFrames, "TotalFrameCount", int)
 
+namespace
+{
+typedef sinks::synchronous_sink< sinks::text_ostream_backend > text_sink;
+
+// format of the log messages
+logging::formatter MakeFormatter()
+{
+    return expr::stream
+        << "[" << level << "]"
+        << "<" << expr::format_named_scope("Scope", boost::log::keywords::format = "%n") << ">"
+        << " - " << expr::smessage;
+}
+
+// Backend of the asynchronous mode: consume formats the record and queues the line, a writer
+// thread writes it to the stream. The record is formatted by the thread that logs it because
+// attribute values like the severity refer to that thread.
+class AsyncTextBackend : public sinks::basic_sink_backend< sinks::concurrent_feeding >
+{
+public:
+    AsyncTextBackend(const size_t nCapacity, const boost::shared_ptr< std::ostream > &stream):
+        mRing(nCapacity), mStream(stream), mFormatter(MakeFormatter()), mnDropped(0), mnWritten(0), mbFinish(false)
+    {
+        mThread = std::thread(&AsyncTextBackend::Run,this);
+    }
+
+    ~AsyncTextBackend()
+    {
+        Stop();
+    }
+
+    void consume(const logging::record_view &rec)
+    {
+        std::string line;
+        logging::formatting_ostream strm(line);
+        mFormatter(rec,strm);
+        strm.flush();
+        if(!mRing.Push(line))
+            mnDropped.fetch_add(1,std::memory_order_relaxed);
+    }
+
+    size_t GetNumDropped() const
+    {
+        return mnDropped.load(std::memory_order_relaxed);
+    }
+
+    void Flush()
+    {
+        const size_t nClaimed = mRing.Claimed();
+        while(mnWritten.load(std::memory_order_acquire)<nClaimed && mThread.joinable())
+            usleep(1000);
+    }
+
+    // Writes what is queued and joins the writer
+    void Stop()
+    {
+        mbFinish = true;
+        if(mThread.joinable())
+            mThread.join();
+    }
+
+private:
+    void Run()
+    {
+        std::string line;
+        size_t nReportedDropped = 0;
+        while(true)
+        {
+            if(mRing.Pop(line))
+            {
+                *mStream << line << '\n';
+                line.clear();
+                mnWritten.fetch_add(1,std::memory_order_release);
+                continue;
+            }
+
+            const size_t nDropped = mnDropped.load(std::memory_order_relaxed);
+            if(nDropped!=nReportedDropped)
+            {
+                *mStream << "[" << SystemLogger::LogLevelNames[SystemLogger::WARNING] << "]<> - "
+                         << nDropped-nReportedDropped << " log messages dropped, the log buffer is full" << '\n';
+                nReportedDropped = nDropped;
+            }
+            mStream->flush();
+
+            if(mbFinish)
+                break;
+            usleep(1000); //param
+        }
+    }
+
+    MPSCQueue<std::string> mRing;
+    boost::shared_ptr< std::ostream > mStream;
+    logging::formatter mFormatter;
+    std::atomic<size_t> mnDropped;
+    std::atomic<size_t> mnWritten;
+    std::atomic<bool> mbFinish;
+    std::thread mThread;
+};
+
+typedef sinks::unlocked_sink< AsyncTextBackend > async_sink;
+
+// console_sink is created with the global logger, async_sink when the asynchronous mode is set
+std::mutex gMutexSinks;
+boost::shared_ptr< text_sink > gConsoleSink;
+boost::shared_ptr< async_sink > gAsyncSink;
+}
+
 BOOST_LOG_GLOBAL_LOGGER_INIT(sys_lg, src::severity_logger_mt<LogLevel>) {
     src::severity_logger_mt<SystemLogger::LogLevel> sys_lg;
 
@@ -50,7 +167,6 @@ BOOST_LOG_GLOBAL_LOGGER_INIT(sys_lg, src::severity_logger_mt<LogLevel>) {
     boost::log::register_simple_formatter_factory< SystemLogger::LogLevel, char >("Severity");
 
        // Construct the sinks
-    typedef sinks::synchronous_sink< sinks::text_ostream_backend > text_sink;
     boost::shared_ptr< text_sink > console_sink = boost::make_shared< text_sink >();
     // boost::shared_ptr< text_sink > status_sink = boost::make_shared< text_sink >();
 
@@ -69,10 +185,7 @@ BOOST_LOG_GLOBAL_LOGGER_INIT(sys_lg, src::severity_logger_mt<LogLevel>) {
     // logging::core::get()->add_sink(status_sink);
 
     // specify the format of the log messages
-    logging::formatter formatter = expr::stream
-        << "[" << level << "]"
-        << "<" << expr::format_named_scope("Scope", boost::log::keywords::format = "%n") << ">"
-        << " - " << expr::smessage;
+    logging::formatter formatter = MakeFormatter();
     // logging::formatter status_formatter = expr::stream
     //     << "<" << expr::format_named_scope("Scope", boost::log::keywords::format = "%n") << "> "
     //     << frameNum << "/" << totalFrames
@@ -85,7 +198,52 @@ BOOST_LOG_GLOBAL_LOGGER_INIT(sys_lg, src::severity_logger_mt<LogLevel>) {
     console_sink->set_filter(level != SystemLogger::LogLevel::STATUS);
     // status_sink->set_filter(level == SystemLogger::LogLevel::STATUS);
 
+    {
+        std::unique_lock<std::mutex> lock(gMutexSinks);
+        gConsoleSink = console_sink;
+    }
+
     return sys_lg;
 }
 
+void SystemLogger::SetAsynchronous(const bool bAsync, const size_t nCapacity)
+{
+    // the console sink is created with the logger
+    sys_lg::get();
+
+    std::unique_lock<std::mutex> lock(gMutexSinks);
+    boost::shared_ptr< logging::core > core = logging::core::get();
+
+    // The new sink is added before the old one is removed, no message is lost meanwhile
+    if(bAsync && !gAsyncSink)
+    {
+        boost::shared_ptr< std::ostream > stream(&std::clog, logging::empty_deleter());
+        boost::shared_ptr< AsyncTextBackend > backend = boost::make_shared< AsyncTextBackend >(std::max<size_t>(nCapacity,1),stream);
+        gAsyncSink = boost::make_shared< async_sink >(backend);
+        gAsyncSink->set_filter(level != SystemLogger::LogLevel::STATUS);
+        core->add_sink(gAsyncSink);
+        core->remove_sink(gConsoleSink);
+    }
+    else if(!bAsync && gAsyncSink)
+    {
+        core->add_sink(gConsoleSink);
+        core->remove_sink(gAsyncSink);
+        gAsyncSink->locked_backend()->Stop();
+        gAsyncSink.reset();
+    }
+}
+
+size_t SystemLogger::GetNumDropped()
+{
+    std::unique_lock<std::mutex> lock(gMutexSinks);
+    return gAsyncSink ? gAsyncSink->locked_backend()->GetNumDropped() : 0;
+}
+
+void SystemLogger::Flush()
+{
+    std::unique_lock<std::mutex> lock(gMutexSinks);
+    if(gAsyncSink)
+        gAsyncSink->locked_backend()->Flush();
+}
+
 }
@@ -0,0 +1,532 @@
+#include "LoopClient.h"
+
+#include "KeyFrame.h"
+#include "LoopServer.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "MapSerializer.h"
+#include "VocabularyLoader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const double RECONNECT_PERIOD = 1.0; //param seconds between two connection attempts
+const double UPDATE_PERIOD = 0.1; //param seconds between two updates of the moved keyframes and points
+const uint32_t MAX_MESSAGE = 1<<28; //param longer messages from the server close the connection
+
+bool SetNonBlocking(const int fd)
+{
+    const int flags = fcntl(fd,F_GETFL,0);
+    return flags>=0 && fcntl(fd,F_SETFL,flags|O_NONBLOCK)==0;
+}
+
+double SecondsSince(const chrono::steady_clock::time_point &t)
+{
+    return chrono::duration<double>(chrono::steady_clock::now()-t).count();
+}
+
+template<typename T>
+void Put(string &buffer, const T &value)
+{
+    buffer.append(reinterpret_cast<const char*>(&value),sizeof(T));
+}
+
+void PutBlock(string &buffer, const vector<char> &vData)
+{
+    Put<uint32_t>(buffer,vData.size());
+    buffer.append(vData.begin(),vData.end());
+}
+
+// Returns the offset of the length, EndMessage writes it once the payload is complete
+size_t BeginMessage(string &buffer, const LoopServer::MessageType type)
+{
+    const size_t offset = buffer.size();
+    Put<uint32_t>(buffer,0);
+    buffer.push_back((char)type);
+    return offset;
+}
+
+void EndMessage(string &buffer, const size_t offset)
+{
+    const uint32_t length = buffer.size()-offset-4;
+    buffer.replace(offset,4,reinterpret_cast<const char*>(&length),4);
+}
+
+void PutPose(string &buffer, const Eigen::Matrix3f &Rcw, const Eigen::Vector3f &tcw)
+{
+    float pose[12];
+    Eigen::Matrix<float,3,3,Eigen::RowMajor>::Map(pose) = Rcw;
+    Eigen::Vector3f::Map(pose+9) = tcw;
+    buffer.append(reinterpret_cast<const char*>(pose),sizeof(pose));
+}
+
+// Reads a message, every Get fails once it is exhausted
+class Reader
+{
+public:
+    Reader(const char* pData, const size_t nSize): mpData(pData), mnSize(nSize), mnPos(0) {}
+
+    template<typename T>
+    bool Get(T &value)
+    {
+        if(sizeof(T)>mnSize-mnPos)
+            return false;
+        memcpy(&value,mpData+mnPos,sizeof(T));
+        mnPos += sizeof(T);
+        return true;
+    }
+
+    bool AtEnd() const { return mnPos==mnSize; }
+
+private:
+    const char* mpData;
+    size_t mnSize;
+    size_t mnPos;
+};
+
+bool DecodeCorrection(Reader &r, LoopClient::Correction &correction)
+{
+    uint8_t type;
+    uint64_t nKFId, nMatchedKFId, nLastKFId;
+    uint32_t n;
+    if(!r.Get(type) || !r.Get(nKFId) || !r.Get(nMatchedKFId) || !r.Get(nLastKFId) || !r.Get(n))
+        return false;
+    correction.type = type;
+    correction.nKFId = nKFId;
+    correction.nMatchedKFId = nMatchedKFId;
+    correction.nLastKFId = nLastKFId;
+    correction.vCorrections.clear();
+    for(uint32_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        if(!r.Get(nId))
+            return false;
+        cv::Mat T = cv::Mat::eye(4,4,CV_32F);
+        for(int j=0; j<3; j++)
+        {
+            for(int k=0; k<4; k++)
+            {
+                if(!r.Get(T.at<float>(j,k)))
+                    return false;
+            }
+        }
+        correction.vCorrections.push_back(make_pair(nId,T));
+    }
+    return r.AtEnd();
+}
+
+bool DecodeFusions(Reader &r, LoopClient::Fusions &vFusions)
+{
+    uint32_t n;
+    if(!r.Get(n))
+        return false;
+    vFusions.clear();
+    for(uint32_t i=0; i<n; i++)
+    {
+        uint64_t nId, nById;
+        if(!r.Get(nId) || !r.Get(nById))
+            return false;
+        vFusions.push_back(make_pair(nId,nById));
+    }
+    return r.AtEnd();
+}
+}
+
+LoopClient::LoopClient(Map* pMap, const ORBVocabulary* pVoc, const bool bFixScale, const string &host, const int port):
+    mpMap(pMap), mpVocabulary(pVoc), mbFixScale(bFixScale), mHost(host), mPort(port), mState(DISCONNECTED),
+    mnFd(-1), mnSent(0), mnEpoch(0), mbWaitForClear(false)
+{
+    mnChangeLogConsumer = mpMap->mChangeLog.AddConsumer(true);
+    mtLastAttempt = chrono::steady_clock::now()-chrono::hours(1);
+    mtLastUpdate = chrono::steady_clock::now();
+}
+
+LoopClient::~LoopClient()
+{
+    Close();
+}
+
+void LoopClient::SendKeyFrame(KeyFrame* pKF)
+{
+    // The keyframe goes out with the map once connected
+    if(mState!=CONNECTED || !msSentKeyFrames.insert(pKF->mnId).second)
+        return;
+
+    // The first keyframe of a map never goes through the loop closing, it is sent with its child
+    KeyFrame* pParent = pKF->GetParent();
+    if(pParent && !pParent->isBad())
+        SendKeyFrame(pParent);
+
+    vector<char> vBlock;
+    MapSerializer::EncodeKeyFrame(pKF,vBlock);
+
+    const size_t offset = BeginMessage(mOutbox,LoopServer::KEYFRAME);
+    Put<uint32_t>(mOutbox,mnEpoch);
+    Put<uint64_t>(mOutbox,pKF->mnMapId);
+
+    // A server which is a correction ahead places the keyframe relative to its parent
+    Put<uint8_t>(mOutbox,pParent!=NULL);
+    if(pParent)
+    {
+        Eigen::Matrix3f Rpw;
+        Eigen::Vector3f tpw;
+        pParent->GetPose(Rpw,tpw);
+        PutPose(mOutbox,Rpw,tpw);
+    }
+
+    PutBlock(mOutbox,vBlock);
+
+    const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
+    vector<MapPoint*> vpNewMPs;
+    Put<uint32_t>(mOutbox,vpMPs.size());
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        MapPoint* pMP = vpMPs[i];
+        if(!pMP || pMP->isBad())
+        {
+            Put<int64_t>(mOutbox,-1);
+            continue;
+        }
+        Put<int64_t>(mOutbox,pMP->mnId);
+        if(msSentPoints.insert(pMP->mnId).second)
+            vpNewMPs.push_back(pMP);
+    }
+
+    Put<uint32_t>(mOutbox,vpNewMPs.size());
+    for(size_t i=0; i<vpNewMPs.size(); i++)
+    {
+        MapSerializer::EncodeMapPoint(vpNewMPs[i],vBlock);
+        PutBlock(mOutbox,vBlock);
+    }
+
+    EndMessage(mOutbox,offset);
+}
+
+void LoopClient::Poll(vector<Correction> &vCorrections, vector<Fusions> &vFusions)
+{
+    vCorrections.clear();
+    vFusions.clear();
+
+    if(SecondsSince(mtLastUpdate)>=UPDATE_PERIOD)
+        SendChanges();
+
+    if(mState==DISCONNECTED)
+    {
+        if(mbWaitForClear || mpMap->mFrameContext.mbInitialComputations ||
+           SecondsSince(mtLastAttempt)<RECONNECT_PERIOD)
+            return;
+        mtLastAttempt = chrono::steady_clock::now();
+        if(!Connect())
+            return;
+    }
+
+    if(mState==CONNECTING)
+    {
+        if(!CheckConnected())
+            return;
+        SendMap();
+    }
+
+    if(!Send() || !Receive(vCorrections,vFusions))
+    {
+        cerr << "Loop client: lost the connection to the loop server" << endl;
+        Close();
+        vCorrections.clear();
+        vFusions.clear();
+    }
+}
+
+void LoopClient::SendChanges()
+{
+    mtLastUpdate = chrono::steady_clock::now();
+    const bool bChanges = mpMap->mChangeLog.Take(mnChangeLogConsumer,mvPointChanges,mvKeyFrameChanges);
+    if(!bChanges)
+        mbWaitForClear = false;
+    if(mState!=CONNECTED)
+        return;
+
+    if(bChanges)
+        SendUpdate();
+    else
+    {
+        // The log lost track, the server starts over
+        cerr << "Loop client: the changes of the map were lost, sending the whole map again" << endl;
+        Close();
+    }
+}
+
+void LoopClient::CorrectionApplied()
+{
+    mnEpoch++;
+}
+
+void LoopClient::Reset()
+{
+    Close();
+    msSentKeyFrames.clear();
+    msSentPoints.clear();
+
+    // Nothing is connected while the map may still hold the keyframes of before
+    mpMap->mChangeLog.Take(mnChangeLogConsumer,mvPointChanges,mvKeyFrameChanges);
+    mbWaitForClear = true;
+}
+
+bool LoopClient::Connect()
+{
+    addrinfo hints;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* pAddress = NULL;
+    const string port = to_string(mPort);
+    if(getaddrinfo(mHost.c_str(),port.c_str(),&hints,&pAddress)!=0 || !pAddress)
+    {
+        cerr << "Loop client: could not resolve the loop server " << mHost << endl;
+        return false;
+    }
+
+    mnFd = socket(AF_INET,SOCK_STREAM,0);
+    if(mnFd<0 || !SetNonBlocking(mnFd))
+    {
+        cerr << "Loop client: could not create the socket: " << strerror(errno) << endl;
+        freeaddrinfo(pAddress);
+        Close();
+        return false;
+    }
+    const int one = 1;
+    setsockopt(mnFd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+    const int result = connect(mnFd,pAddress->ai_addr,pAddress->ai_addrlen);
+    freeaddrinfo(pAddress);
+    if(result<0 && errno!=EINPROGRESS)
+    {
+        Close();
+        return false;
+    }
+
+    mState = CONNECTING;
+    return true;
+}
+
+bool LoopClient::CheckConnected()
+{
+    pollfd pfd;
+    pfd.fd = mnFd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if(poll(&pfd,1,0)<=0)
+        return false;
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(mnFd,SOL_SOCKET,SO_ERROR,&error,&length)<0 || error!=0)
+    {
+        Close();
+        return false;
+    }
+
+    cout << "Loop client: connected to the loop server " << mHost << ":" << mPort << endl;
+    mState = CONNECTED;
+    return true;
+}
+
+void LoopClient::Close()
+{
+    if(mnFd>=0)
+        close(mnFd);
+    mnFd = -1;
+    mState = DISCONNECTED;
+    mOutbox.clear();
+    mnSent = 0;
+    mInbox.clear();
+}
+
+void LoopClient::SendMap()
+{
+    mnEpoch = 0;
+    msSentKeyFrames.clear();
+    msSentPoints.clear();
+
+    const FrameContext &context = mpMap->mFrameContext;
+    VocabularyLoader::Wait(mpVocabulary);
+    const size_t offset = BeginMessage(mOutbox,LoopServer::HELLO);
+    Put<uint32_t>(mOutbox,mpVocabulary->size());
+    Put<uint8_t>(mOutbox,mbFixScale);
+    const float calibration[10] = {context.fx, context.fy, context.cx, context.cy, context.mnMinX, context.mnMaxX,
+                                   context.mnMinY, context.mnMaxY, context.mfGridElementWidthInv,
+                                   context.mfGridElementHeightInv};
+    mOutbox.append(reinterpret_cast<const char*>(calibration),sizeof(calibration));
+    EndMessage(mOutbox,offset);
+
+    // Parents before their children
+    vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        if(!vpKFs[i]->isBad())
+            SendKeyFrame(vpKFs[i]);
+    }
+}
+
+void LoopClient::SendUpdate()
+{
+    const size_t offset = BeginMessage(mOutbox,LoopServer::UPDATE);
+    Put<uint32_t>(mOutbox,mnEpoch);
+
+    // The last change of every keyframe counts
+    vector<const MapChangeLog::KeyFrameChange*> vpKFMoved, vpKFErased;
+    {
+        unordered_set<unsigned long> sSeen;
+        for(size_t i=mvKeyFrameChanges.size(); i-->0;)
+        {
+            const MapChangeLog::KeyFrameChange &change = mvKeyFrameChanges[i];
+            if(!sSeen.insert(change.nId).second)
+                continue;
+            if(change.bErased)
+                vpKFErased.push_back(&change);
+            else
+                vpKFMoved.push_back(&change);
+        }
+    }
+
+    Put<uint32_t>(mOutbox,vpKFMoved.size());
+    for(size_t i=0; i<vpKFMoved.size(); i++)
+    {
+        const MapChangeLog::KeyFrameChange &change = *vpKFMoved[i];
+        const Eigen::Matrix3f Rcw = Eigen::Quaternionf(change.qwc).toRotationMatrix().transpose();
+        Put<uint64_t>(mOutbox,change.nId);
+        PutPose(mOutbox,Rcw,-Rcw*change.Ow);
+    }
+
+    // Only the points the server has
+    vector<const MapChangeLog::PointChange*> vpMPMoved, vpMPErased;
+    {
+        unordered_set<unsigned long> sSeen;
+        for(size_t i=mvPointChanges.size(); i-->0;)
+        {
+            const MapChangeLog::PointChange &change = mvPointChanges[i];
+            if(!sSeen.insert(change.nId).second || !msSentPoints.count(change.nId))
+                continue;
+            if(change.bErased)
+            {
+                vpMPErased.push_back(&change);
+                msSentPoints.erase(change.nId);
+            }
+            else
+                vpMPMoved.push_back(&change);
+        }
+    }
+
+    Put<uint32_t>(mOutbox,vpMPMoved.size());
+    for(size_t i=0; i<vpMPMoved.size(); i++)
+    {
+        Put<uint64_t>(mOutbox,vpMPMoved[i]->nId);
+        mOutbox.append(reinterpret_cast<const char*>(vpMPMoved[i]->pos.data()),3*sizeof(float));
+    }
+
+    Put<uint32_t>(mOutbox,vpKFErased.size());
+    for(size_t i=0; i<vpKFErased.size(); i++)
+        Put<uint64_t>(mOutbox,vpKFErased[i]->nId);
+
+    Put<uint32_t>(mOutbox,vpMPErased.size());
+    for(size_t i=0; i<vpMPErased.size(); i++)
+        Put<uint64_t>(mOutbox,vpMPErased[i]->nId);
+
+    EndMessage(mOutbox,offset);
+}
+
+bool LoopClient::Send()
+{
+    while(mnSent<mOutbox.size())
+    {
+        const ssize_t n = send(mnFd,mOutbox.data()+mnSent,mOutbox.size()-mnSent,MSG_NOSIGNAL);
+        if(n>=0)
+        {
+            mnSent += n;
+            continue;
+        }
+        if(errno==EINTR)
+            continue;
+        // The rest goes with the next poll
+        return errno==EAGAIN || errno==EWOULDBLOCK;
+    }
+
+    mOutbox.clear();
+    mnSent = 0;
+    return true;
+}
+
+bool LoopClient::Receive(vector<Correction> &vCorrections, vector<Fusions> &vFusions)
+{
+    char buffer[4096];
+    while(1)
+    {
+        const ssize_t n = recv(mnFd,buffer,sizeof(buffer),0);
+        if(n==0)
+            return false;
+        if(n<0)
+        {
+            if(errno==EINTR)
+                continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                break;
+            return false;
+        }
+        mInbox.append(buffer,n);
+    }
+
+    size_t begin = 0;
+    while(mInbox.size()-begin>=4)
+    {
+        uint32_t length;
+        memcpy(&length,mInbox.data()+begin,4);
+        if(length==0 || length>MAX_MESSAGE)
+            return false;
+        if(mInbox.size()-begin-4<length)
+            break;
+
+        const char type = mInbox[begin+4];
+        Reader r(mInbox.data()+begin+5,length-1);
+        if(type==LoopServer::CORRECTION)
+        {
+            vCorrections.push_back(Correction());
+            if(!DecodeCorrection(r,vCorrections.back()))
+                return false;
+        }
+        else if(type==LoopServer::FUSIONS)
+        {
+            vFusions.push_back(Fusions());
+            if(!DecodeFusions(r,vFusions.back()))
+                return false;
+        }
+        else
+            return false;
+
+        begin += 4+length;
+    }
+    mInbox.erase(0,begin);
+
+    return true;
+}
+
+} //namespace ORB_SLAM
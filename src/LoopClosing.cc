@@ -20,6 +20,8 @@
 
 #include "LoopClosing.h"
 
+#include "LoopServer.h"
+
 #include "Sim3Solver.h"
 
 #include "Converter.h"
@@ -28,6 +30,12 @@
 
 #include "ORBmatcher.h"
 
+#include "StageTimer.h"
+#include "Trace.h"
+#include "ThreadConfig.h"
+
+#include<algorithm>
+#include<chrono>
 #include<mutex>
 #include<thread>
 
@@ -35,10 +43,46 @@
 namespace ORB_SLAM2
 {
 
-LoopClosing::LoopClosing(Map *pMap, KeyFrameDatabase *pDB, ORBVocabulary *pVoc, const bool bFixScale):
-    mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-    mpKeyFrameDB(pDB), mpORBVocabulary(pVoc), mpMatchedKF(NULL), mLastLoopKFid(0), mbRunningGBA(false), mbFinishedGBA(true),
-    mbStopGBA(false), mpThreadGBA(NULL), mbFixScale(bFixScale), mnFullBAIdx(0)
+namespace
+{
+
+// Whether two sorted groups of keyframe ids share one, in a single walk over both
+bool ShareKeyFrame(const long unsigned int* aBegin, const long unsigned int* aEnd,
+                   const long unsigned int* bBegin, const long unsigned int* bEnd)
+{
+    if(aBegin==aEnd || bBegin==bEnd || *(aEnd-1)<*bBegin || *(bEnd-1)<*aBegin)
+        return false;
+
+    const long unsigned int* a=aBegin;
+    const long unsigned int* b=bBegin;
+    while(a!=aEnd && b!=bEnd)
+    {
+        if(*a<*b)
+            a = lower_bound(a,aEnd,*b);
+        else if(*b<*a)
+            b = lower_bound(b,bEnd,*a);
+        else
+            return true;
+    }
+    return false;
+}
+
+// Seconds a global BA waits for the latency scheduler to leave it the cores
+const double MAX_GBA_DELAY = 10.0; //param
+
+// Keyframes or map points per task of the merge of a global BA
+const size_t GBA_MERGE_BLOCK = 256; //param
+
+} // namespace
+
+LoopClosing::LoopClosing(Map *pMap, KeyFrameDatabase *pDB, ORBVocabulary *pVoc, const bool bFixScale,
+                         const int nMaxGBAKeyFrames, const float fGBATimeBudget, const int nThreads):
+    mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap), mpTracker(NULL),
+    mpKeyFrameDB(pDB), mpORBVocabulary(pVoc), mpLocalMapper(NULL), mpClient(NULL), mpLatencyScheduler(NULL), mbDetectLoops(true), mnQueued(0), mnMaxQueue(0), mfMinQueryInterval(0),
+    mfMinQueryDistance(0), mfCandidateRadius(0), mbLastQuery(false), mnLastQueryMapId(0), mLastQueryTime(0), mbProcessing(false), mpMatchedKF(NULL), mLastLoopKFid(0), mbRunningGBA(false), mbFinishedGBA(true),
+    mbStopGBA(false), mpThreadGBA(NULL), mnMaxGBAKeyFrames(nMaxGBAKeyFrames),
+    mfGBATimeBudget(fGBATimeBudget), mpThreadPool(new ThreadPool(max(nThreads,1)-1,ThreadConfig::LOOP_WORKERS)), mbBatchMatching(false), mbFixScale(bFixScale), mnFullBAIdx(0),
+    mbWakeUp(false)
     , mVisualizeLoopClosing("Show Loops", false, true, ParameterGroup::MAIN, []{})
 {
     mnCovisibilityConsistencyTh = 3; //param
@@ -54,62 +98,396 @@ void LoopClosing::SetLocalMapper(LocalMapping *pLocalMapper)
     mpLocalMapper=pLocalMapper;
 }
 
+void LoopClosing::SetClient(LoopClient *pClient)
+{
+    mpClient=pClient;
+}
+
+void LoopClosing::SetLoopDetection(const bool bDetectLoops)
+{
+    mbDetectLoops=bDetectLoops;
+}
+
+void LoopClosing::SetBatchMatching()
+{
+    mbBatchMatching = true;
+}
+
+void LoopClosing::SetQueryPolicy(const int nMaxQueue, const float fMinInterval, const float fMinDistance)
+{
+    mnMaxQueue = max(nMaxQueue,0);
+    mfMinQueryInterval = max(fMinInterval,0.0f);
+    mfMinQueryDistance = max(fMinDistance,0.0f);
+}
+
+void LoopClosing::SetCandidateRadius(const float fRadius)
+{
+    mfCandidateRadius = max(fRadius,0.0f);
+}
+
+void LoopClosing::SetLatencyScheduler(LatencyScheduler* pScheduler)
+{
+    mpLatencyScheduler = pScheduler;
+}
+
+LoopClosing::QueueStats LoopClosing::GetQueueStats()
+{
+    unique_lock<mutex> lock(mMutexLoopQueue);
+    QueueStats stats = mQueueStats;
+    stats.nQueued = mlpLoopKeyFrameQueue.size();
+    return stats;
+}
+
 
 void LoopClosing::Run()
 {
+    Trace::SetThreadName("LoopClosing");
+    ThreadConfig::Apply(ThreadConfig::LOOP_CLOSING);
+    StageTimes::BindThread(&mpMap->mStageTimes);
     mbFinished =false;
+    mnReclaimerId = mpMap->mReclaimer.RegisterThread();
 
     while(1)
     {
+        if(mpClient)
+            ServeClient();
         // Check if there are keyframes in the queue
-        if(CheckNewKeyFrames())
-        {
-            // Detect loop candidates and check covisibility consistency
-            if(DetectLoop())
-            {
-               // Compute similarity transformation [sR|t]
-               // In the stereo/RGBD case s=1
-               if(ComputeSim3())
-               {
-                   // Perform loop fusion and pose graph optimization
-                   CorrectLoop();
-               }
-            }
-        }
+        else if(CheckNewKeyFrames())
+            ProcessKeyFrame();
 
         ResetIfRequested();
 
         if(CheckFinish())
             break;
 
-        usleep(5000);
+        PassQuiescentState();
+
+        if(!CheckNewKeyFrames())
+            WaitForWakeUp();
     }
 
+    mpMap->mReclaimer.UnregisterThread(mnReclaimerId);
     SetFinish();
 }
 
-void LoopClosing::InsertKeyFrame(KeyFrame *pKF)
+void LoopClosing::ProcessKeyFrame()
+{
+    if(!mbDetectLoops)
+    {
+        KeyFrame* pKF;
+        {
+            unique_lock<mutex> lock(mMutexLoopQueue);
+            pKF = mlpLoopKeyFrameQueue.front();
+            mlpLoopKeyFrameQueue.pop_front();
+            SyncQueued();
+            mbProcessing = true;
+        }
+        if(!pKF->isBad())
+            mpKeyFrameDB->add(pKF);
+
+        unique_lock<mutex> lock(mMutexLoopQueue);
+        mbProcessing = false;
+        return;
+    }
+
+    // Detect loop candidates and check covisibility consistency
+    if(DetectLoop())
+    {
+       // Compute similarity transformation [sR|t]
+       // In the stereo/RGBD case s=1
+       if(ComputeSim3())
+       {
+           // Perform loop fusion and pose graph optimization
+           CorrectLoop();
+       }
+    }
+
+    unique_lock<mutex> lock(mMutexLoopQueue);
+    mbProcessing = false;
+}
+
+void LoopClosing::AttachThread()
+{
+    mnReclaimerId = mpMap->mReclaimer.RegisterThread();
+}
+
+void LoopClosing::DetachThread()
+{
+    mpMap->mReclaimer.UnregisterThread(mnReclaimerId);
+}
+
+void LoopClosing::ProcessQueue()
+{
+    while(CheckNewKeyFrames())
+        ProcessKeyFrame();
+
+    PassQuiescentState();
+}
+
+void LoopClosing::ResetQueue()
 {
     unique_lock<mutex> lock(mMutexLoopQueue);
-    if(pKF->mnId!=0)
+    mlpLoopKeyFrameQueue.clear();
+    SyncQueued();
+    mLastLoopKFid=0;
+    mbLastQuery=false;
+}
+
+void LoopClosing::ServeClient()
+{
+    // The server detects the loops, the keyframes only go to the database for the relocalization
+    while(1)
+    {
+        KeyFrame* pKF;
+        {
+            unique_lock<mutex> lock(mMutexLoopQueue);
+            if(mlpLoopKeyFrameQueue.empty())
+                break;
+            pKF = mlpLoopKeyFrameQueue.front();
+            mlpLoopKeyFrameQueue.pop_front();
+            SyncQueued();
+            mbProcessing = true;
+        }
+
+        if(pKF->isBad())
+            continue;
+        mpKeyFrameDB->add(pKF);
+        mpClient->SendKeyFrame(pKF);
+    }
+
+    vector<LoopClient::Correction> vCorrections;
+    vector<LoopClient::Fusions> vFusions;
+    mpClient->Poll(vCorrections,vFusions);
+
+    // A fusion only names the points, it does not depend on the corrections
+    for(size_t i=0; i<vCorrections.size(); i++)
+        ApplyCorrection(vCorrections[i]);
+    for(size_t i=0; i<vFusions.size(); i++)
+        ApplyFusions(vFusions[i]);
+
+    unique_lock<mutex> lock(mMutexLoopQueue);
+    mbProcessing = false;
+}
+
+void LoopClosing::ApplyCorrection(const LoopClient::Correction &correction)
+{
+    STAGE_TIMER(CORRECT_LOOP);
+
+    const bool bLoop = correction.type==LoopServer::LOOP;
+    if(bLoop)
+        cout << "Loop closed by the loop server!" << endl;
+    else
+        cout << "Global Bundle Adjustment of the loop server finished" << endl;
+
+    mpLocalMapper->RequestStop();
+    {
+        TRACE_SCOPE("WaitLocalMappingStop");
+        mpLocalMapper->WaitUntilStopped();
+    }
+
+    // The changes of before go out with the epoch the server already corrected, it drops them
+    mpClient->SendChanges();
+
+    MapEvents::PoseMap PosesBefore;
+    if(mpMap->mEvents.HasSubscribers())
+        mpMap->mEvents.GetPoses(*mpMap->GetKeyFramesSnapshot(),PosesBefore);
+
+    KeyFrame* pCurrentKF = mpMap->GetKeyFrame(correction.nKFId);
+    KeyFrame* pMatchedKF = mpMap->GetKeyFrame(correction.nMatchedKFId);
+
+    {
+        // Get Map Mutex
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+
+        map<KeyFrame*,cv::Mat> Corrections;
+        for(size_t i=0; i<correction.vCorrections.size(); i++)
+        {
+            KeyFrame* pKF = mpMap->GetKeyFrame(correction.vCorrections[i].first);
+            if(pKF && !pKF->isBad())
+                Corrections[pKF] = correction.vCorrections[i].second;
+        }
+
+        // Keyframes the server did not have yet follow their parent, starting at the origins
+        const vector<KeyFrame*> vpOrigins = mpMap->GetOrigins();
+        list<KeyFrame*> lpKFtoCheck(vpOrigins.begin(),vpOrigins.end());
+        while(!lpKFtoCheck.empty())
+        {
+            KeyFrame* pKF = lpKFtoCheck.front();
+            lpKFtoCheck.pop_front();
+            map<KeyFrame*,cv::Mat>::const_iterator it = Corrections.find(pKF);
+            const set<KeyFrame*> sChilds = pKF->GetChilds();
+            for(set<KeyFrame*>::const_iterator sit=sChilds.begin(); sit!=sChilds.end(); sit++)
+            {
+                KeyFrame* pChild = *sit;
+                if(it!=Corrections.end() && pChild->mnId>correction.nLastKFId && !Corrections.count(pChild))
+                    Corrections[pChild] = it->second;
+                lpKFtoCheck.push_back(pChild);
+            }
+        }
+
+        // Map points follow the correction of their reference keyframe
+        const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+        const vector<MapPoint*> &vpMPs = *pMPs;
+        for(size_t i=0; i<vpMPs.size(); i++)
+        {
+            MapPoint* pMP = vpMPs[i];
+            if(pMP->isBad())
+                continue;
+            map<KeyFrame*,cv::Mat>::const_iterator it = Corrections.find(pMP->GetReferenceKeyFrame());
+            if(it==Corrections.end())
+                continue;
+            const cv::Mat &T = it->second;
+            pMP->SetWorldPos(T.rowRange(0,3).colRange(0,3)*pMP->GetWorldPos()+T.rowRange(0,3).col(3));
+            pMP->UpdateNormalAndDepth();
+        }
+
+        // Twc after times Tcw before
+        for(map<KeyFrame*,cv::Mat>::const_iterator it=Corrections.begin(); it!=Corrections.end(); it++)
+            it->first->SetPose(it->first->GetPose()*it->second.inv());
+    }
+
+    mpMap->InformNewBigChange();
+    if(mpMap->mEvents.HasSubscribers())
+        mpMap->mEvents.Corrected(bLoop ? MapEvents::LOOP_CORRECTED : MapEvents::GLOBAL_BA_FINISHED,
+                                 correction.nKFId,correction.nMatchedKFId,PosesBefore,*mpMap->GetKeyFramesSnapshot());
+
+    if(bLoop && pCurrentKF && pMatchedKF && !pCurrentKF->isBad() && !pMatchedKF->isBad())
+    {
+        pMatchedKF->AddLoopEdge(pCurrentKF);
+        pCurrentKF->AddLoopEdge(pMatchedKF);
+
+        if(pCurrentKF->mnMapId!=pMatchedKF->mnMapId)
+        {
+            cout << "Merging the maps of the loop" << endl;
+            MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+            mpMap->MergeMap(pCurrentKF->mnMapId,pMatchedKF);
+        }
+    }
+
+    mpClient->CorrectionApplied();
+
+    mpLocalMapper->Release();
+}
+
+void LoopClosing::ApplyFusions(const LoopClient::Fusions &vFusions)
+{
+    mpLocalMapper->RequestStop();
+    {
+        TRACE_SCOPE("WaitLocalMappingStop");
+        mpLocalMapper->WaitUntilStopped();
+    }
+
+    {
+        // Get Map Mutex
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+        MapPointReplacer replacer;
+        for(size_t i=0; i<vFusions.size(); i++)
+        {
+            MapPoint* pMP = mpMap->GetMapPoint(vFusions[i].first);
+            MapPoint* pByMP = mpMap->GetMapPoint(vFusions[i].second);
+            if(pMP && pByMP && pMP!=pByMP && !pMP->isBad() && !pByMP->isBad())
+                replacer.Replace(pMP,pByMP);
+        }
+        replacer.Apply();
+    }
+
+    mpLocalMapper->Release();
+}
+
+void LoopClosing::PassQuiescentState()
+{
+    // Only used while a loop is detected and corrected
+    mvpCurrentMatchedPoints.clear();
+    mvpLoopMapPoints.clear();
+
+    // The features of queued keyframes which have been culled meanwhile are going to be released
+    {
+        unique_lock<mutex> lock(mMutexLoopQueue);
+        for(list<KeyFrame*>::iterator lit=mlpLoopKeyFrameQueue.begin(); lit!=mlpLoopKeyFrameQueue.end();)
+        {
+            if((*lit)->isBad())
+                lit = mlpLoopKeyFrameQueue.erase(lit);
+            else
+                lit++;
+        }
+        SyncQueued();
+    }
+
+    mpMap->mReclaimer.QuiescentState(mnReclaimerId);
+}
+
+void LoopClosing::InsertKeyFrame(KeyFrame *pKF)
+{
+    if(pKF->mnId==0)
+        return;
+
+    {
+        unique_lock<mutex> lock(mMutexLoopQueue);
         mlpLoopKeyFrameQueue.push_back(pKF);
+        SyncQueued();
+        mQueueStats.nInserted++;
+        mQueueStats.nMaxQueued = max(mQueueStats.nMaxQueued,mlpLoopKeyFrameQueue.size());
+    }
+    WakeUp();
+}
+
+void LoopClosing::WaitForWakeUp()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    // A wake up which came in since the last wait is not lost, the flag is still set
+    if(!mbWakeUp)
+        mCondWakeUp.wait_for(lock,chrono::milliseconds(50)); //param
+    mbWakeUp = false;
+}
+
+void LoopClosing::WakeUp()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    mbWakeUp = true;
+    mCondWakeUp.notify_one();
 }
 
 bool LoopClosing::CheckNewKeyFrames()
 {
-    unique_lock<mutex> lock(mMutexLoopQueue);
-    return(!mlpLoopKeyFrameQueue.empty());
+    return mnQueued.load(std::memory_order_acquire)>0;
+}
+
+bool LoopClosing::SpacedFromLastQuery(KeyFrame* pKF)
+{
+    Eigen::Vector3f Ow;
+    pKF->GetCameraCenter(Ow);
+
+    if(mbLastQuery && pKF->mnMapId==mnLastQueryMapId)
+    {
+        const bool bRecent = mfMinQueryInterval>0 && pKF->mTimeStamp-mLastQueryTime<mfMinQueryInterval;
+        const bool bClose = mfMinQueryDistance>0 && (Ow-mLastQueryCenter).norm()<mfMinQueryDistance;
+        if(bRecent || bClose)
+            return false;
+    }
+
+    mbLastQuery = true;
+    mnLastQueryMapId = pKF->mnMapId;
+    mLastQueryTime = pKF->mTimeStamp;
+    mLastQueryCenter = Ow;
+    return true;
 }
 
 bool LoopClosing::DetectLoop()
 {
+    STAGE_TIMER(DETECT_LOOP);
+
+    size_t nQueued;
     {
         unique_lock<mutex> lock(mMutexLoopQueue);
         mpCurrentKF = mlpLoopKeyFrameQueue.front();
         mlpLoopKeyFrameQueue.pop_front();
+        SyncQueued();
+        mbProcessing = true;
         // Avoid that a keyframe can be erased while it is being process by this thread
         mpCurrentKF->SetNotErase();
+        nQueued = mlpLoopKeyFrameQueue.size();
     }
+    Trace::SetContext("keyframe",mpCurrentKF->mnId);
 
     //If the map contains less than 10 KF or less than 10 KF have passed from last loop detection
     if(mpCurrentKF->mnId<mLastLoopKFid+10) //param
@@ -119,6 +497,25 @@ bool LoopClosing::DetectLoop()
         return false;
     }
 
+    // The newer keyframes see the same places, they query instead
+    const bool bStale = mnMaxQueue>0 && nQueued>=mnMaxQueue;
+    const bool bSpaced = !bStale && !SpacedFromLastQuery(mpCurrentKF);
+    if(bStale || bSpaced)
+    {
+        mpKeyFrameDB->add(mpCurrentKF);
+        mpCurrentKF->SetErase();
+        unique_lock<mutex> lock(mMutexLoopQueue);
+        if(bStale)
+            mQueueStats.nStale++;
+        else
+            mQueueStats.nSpaced++;
+        return false;
+    }
+    {
+        unique_lock<mutex> lock(mMutexLoopQueue);
+        mQueueStats.nQueried++;
+    }
+
     // Compute reference BoW similarity score
     // This is the lowest score to a connected keyframe in the covisibility graph
     // We will impose loop candidates to have a higher similarity than this
@@ -138,8 +535,16 @@ bool LoopClosing::DetectLoop()
             minScore = score;
     }
 
-    // Query the database imposing the minimum score
-    vector<KeyFrame*> vpCandidateKFs = mpKeyFrameDB->DetectLoopCandidates(mpCurrentKF, minScore);
+    // Query the database imposing the minimum score, and the drift bound around the keyframe
+    KeyFrameDatabase::PosePrior prior;
+    if(mfCandidateRadius>0)
+    {
+        mpCurrentKF->GetCameraCenter(prior.center);
+        prior.fRadius = mfCandidateRadius;
+        prior.nMapId = mpCurrentKF->mnMapId;
+    }
+    vector<KeyFrame*> vpCandidateKFs = mpKeyFrameDB->DetectLoopCandidates(mpCurrentKF, minScore,
+                                                                          mfCandidateRadius>0 ? &prior : NULL);
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&"
                                            << " LOOP CLOSING";
 
@@ -147,7 +552,7 @@ bool LoopClosing::DetectLoop()
     if(vpCandidateKFs.empty())
     {
         mpKeyFrameDB->add(mpCurrentKF);
-        mvConsistentGroups.clear();
+        mConsistentGroups.Clear();
         mpCurrentKF->SetErase();
         DLOG_IF(INFO, mVisualizeLoopClosing()) << "No candidate Keyframes found, aborting.";
         return false;
@@ -156,17 +561,17 @@ bool LoopClosing::DetectLoop()
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Found " << vpCandidateKFs.size()
                                            << " candidate keyframes for loop closing.";
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Checking consistency. Current number of consistent "
-                                           << "candidate groups: " << mvConsistentGroups.size();
+                                           << "candidate groups: " << mConsistentGroups.Size();
     // For each loop candidate check consistency with previous loop candidates
     // Each candidate expands a covisibility group (keyframes connected to the loop candidate in the covisibility graph)
     // A group is consistent with a previous group if they share at least a keyframe
     // We must detect a consistent loop in several consecutive keyframes to accept it
     mvpEnoughConsistentCandidates.clear();
 
-    vector<ConsistentGroup> vCurrentConsistentGroups;
-    vector<bool> vbConsistentGroup(mvConsistentGroups.size(),false);
-    // For the first keyframe that comes in when mvConsistentGroups is empty
-    // the loop will create a entry with it's counter at 0 in mvConsistentGroups for
+    mNextConsistentGroups.Clear();
+    mvbConsistentGroup.assign(mConsistentGroups.Size(),false);
+    // For the first keyframe that comes in when mConsistentGroups is empty
+    // the loop will create a entry with it's counter at 0 in mConsistentGroups for
     // every keyframe group.
     for(size_t i=0, iend=vpCandidateKFs.size(); i<iend; i++)
     {
@@ -174,37 +579,33 @@ bool LoopClosing::DetectLoop()
 
         // collect all keyframes connected to the current keyframe in the covisibility graph
         // form a candidate group form them
-        set<KeyFrame*> spCandidateGroup = pCandidateKF->GetConnectedKeyFrames();
-        spCandidateGroup.insert(pCandidateKF);
+        const KeyFrame::CovisibilitySnapshot pConnections = pCandidateKF->GetCovisibilitySnapshot();
+        const vector<KeyFrame*> &vpConnected = pConnections->KeyFrames();
+        vector<long unsigned int> &vCandidateGroup = mvnCandidateGroup;
+        vCandidateGroup.clear();
+        for(size_t iC=0; iC<vpConnected.size(); iC++)
+            vCandidateGroup.push_back(vpConnected[iC]->mnId);
+        vCandidateGroup.push_back(pCandidateKF->mnId);
+        sort(vCandidateGroup.begin(),vCandidateGroup.end());
+        vCandidateGroup.erase(unique(vCandidateGroup.begin(),vCandidateGroup.end()),vCandidateGroup.end());
+        const long unsigned int* pGroupBegin = vCandidateGroup.data();
+        const long unsigned int* pGroupEnd = pGroupBegin+vCandidateGroup.size();
 
         bool bEnoughConsistent = false;
         bool bConsistentForSomeGroup = false;
-        for(size_t iG=0, iendG=mvConsistentGroups.size(); iG<iendG; iG++)
+        for(size_t iG=0, iendG=mConsistentGroups.Size(); iG<iendG; iG++)
         {
-            set<KeyFrame*> sPreviousGroup = mvConsistentGroups[iG].first;
-
-            bool bConsistent = false;
-            for(set<KeyFrame*>::iterator sit=spCandidateGroup.begin(), send=spCandidateGroup.end(); sit!=send;sit++)
-            {
-                // check if a keyframe from the currenct candidate group is also part of the
-                // previous group
-                if(sPreviousGroup.count(*sit))
-                {
-                    bConsistent=true;
-                    bConsistentForSomeGroup=true;
-                    break;
-                }
-            }
-
-            if(bConsistent)
+            // check if a keyframe from the currenct candidate group is also part of the
+            // previous group
+            if(ShareKeyFrame(pGroupBegin,pGroupEnd,mConsistentGroups.Begin(iG),mConsistentGroups.End(iG)))
             {
-                int nPreviousConsistency = mvConsistentGroups[iG].second;
+                bConsistentForSomeGroup=true;
+                int nPreviousConsistency = mConsistentGroups.Consistency(iG);
                 int nCurrentConsistency = nPreviousConsistency + 1;
-                if(!vbConsistentGroup[iG])
+                if(!mvbConsistentGroup[iG])
                 {
-                    ConsistentGroup cg = make_pair(spCandidateGroup,nCurrentConsistency);
-                    vCurrentConsistentGroups.push_back(cg);
-                    vbConsistentGroup[iG]=true; //this avoid to include the same group more than once
+                    mNextConsistentGroups.Add(vCandidateGroup,nCurrentConsistency);
+                    mvbConsistentGroup[iG]=true; //this avoid to include the same group more than once
                 }
                 if(nCurrentConsistency>=mnCovisibilityConsistencyTh && !bEnoughConsistent) //param
                 {
@@ -216,22 +617,19 @@ bool LoopClosing::DetectLoop()
 
         // If the group is not consistent with any previous group insert with consistency counter set to zero
         if(!bConsistentForSomeGroup)
-        {
-            ConsistentGroup cg = make_pair(spCandidateGroup,0);
-            vCurrentConsistentGroups.push_back(cg);
-        }
+            mNextConsistentGroups.Add(vCandidateGroup,0);
     }
 
-    // Update Covisibility Consistent Groups
-    mvConsistentGroups = vCurrentConsistentGroups;
+    // Update Covisibility Consistent Groups, the previous ones are refilled for the next keyframe
+    swap(mConsistentGroups,mNextConsistentGroups);
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "New number of consistent "
-                                           << "candidate groups: " << mvConsistentGroups.size();
+                                           << "candidate groups: " << mConsistentGroups.Size();
     if(mVisualizeLoopClosing())
     {
-        for (int i = 0; i < mvConsistentGroups.size(); i++)
+        for (size_t i = 0; i < mConsistentGroups.Size(); i++)
         {
             DLOG_IF(INFO, mVisualizeLoopClosing()) << "Consistency count for group: " << i
-                                                   << " = " << mvConsistentGroups[i].second;
+                                                   << " = " << mConsistentGroups.Consistency(i);
         }
     }
 
@@ -256,134 +654,66 @@ bool LoopClosing::DetectLoop()
 
 bool LoopClosing::ComputeSim3()
 {
+    STAGE_TIMER(COMPUTE_SIM3);
+
     // For each consistent loop candidate we try to compute a Sim3
 
     const int nInitialCandidates = mvpEnoughConsistentCandidates.size();
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Using consistent candidates to compute Sim3.";
 
-    // We compute first ORB matches for each candidate
-    // If enough matches are found, we setup a Sim3Solver
-    ORBmatcher matcher(0.75,true); //param
-
-    vector<Sim3Solver*> vpSim3Solvers;
-    vpSim3Solvers.resize(nInitialCandidates);
-
-    vector<vector<MapPoint*> > vvpMapPointMatches;
-    vvpMapPointMatches.resize(nInitialCandidates);
-
-    vector<bool> vbDiscarded;
-    vbDiscarded.resize(nInitialCandidates);
+    // avoid that local mapping erase them while they are being processed
+    for(int i=0; i<nInitialCandidates; i++)
+        mvpEnoughConsistentCandidates[i]->SetNotErase();
 
-    int nCandidates=0; //candidates with enough matches
+    // The candidates are evaluated in parallel. The first one accepted stops the others.
+    std::atomic<bool> bMatch(false);
+    std::atomic<int> nCandidates(0); //candidates with enough matches
+    g2o::Sim3 gScm;
+    if(mvvpCandidateMatches.size()<static_cast<size_t>(nInitialCandidates))
+    {
+        mvvpCandidateMatches.resize(nInitialCandidates);
+        mvvpCandidateInliers.resize(nInitialCandidates);
+    }
 
+    // With the batch matching the BoW matches of all candidates come first, in one batch, and the
+    // candidates with the most matches are verified first
+    vector<int> vnOrder(nInitialCandidates);
     for(int i=0; i<nInitialCandidates; i++)
+        vnOrder[i] = i;
+    const bool bBoWMatched = mbBatchMatching;
+    if(bBoWMatched)
     {
-        KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
-
-        // avoid that local mapping erase it while it is being processed in this thread
-        pKF->SetNotErase();
-
-        if(pKF->isBad())
+        BowDistanceBatch batch;
+        batch.Compute(mpCurrentKF,mvpEnoughConsistentCandidates);
+        vector<int> vnBoWMatches(nInitialCandidates);
+        mpThreadPool->ParallelFor(nInitialCandidates, [&](int i)
         {
-            vbDiscarded[i] = true;
-            continue;
-        }
-
-        int nmatches = matcher.SearchByBoW(mpCurrentKF,pKF,vvpMapPointMatches[i]);
-
-        if(nmatches<20) //param
+            ORBmatcher matcher(0.75,true); //param same as in EvaluateSim3Candidate
+            vnBoWMatches[i] = matcher.SearchByBoW(batch,i,mpCurrentKF,mvpEnoughConsistentCandidates[i],
+                                                  mvvpCandidateMatches[i]);
+        });
+        stable_sort(vnOrder.begin(),vnOrder.end(),[&](const int a, const int b)
         {
-            DLOG_IF(INFO, mVisualizeLoopClosing()) << "Candidate " << i
-                                                   << " has " << nmatches
-                                                   << " matches with current keyframe. -> Discarded!";
-            vbDiscarded[i] = true;
-            continue;
-        }
-        else
-        {
-            DLOG_IF(INFO, mVisualizeLoopClosing()) << "Candidate " << i
-                                                   << " has " << nmatches
-                                                   << " matches with current keyframe. -> Using it!";
-            Sim3Solver* pSolver = new Sim3Solver(mpCurrentKF,pKF,vvpMapPointMatches[i],mbFixScale);
-            pSolver->SetRansacParameters(0.99,20,300); //param
-            vpSim3Solvers[i] = pSolver;
-        }
-
-        nCandidates++;
+            return vnBoWMatches[a]>vnBoWMatches[b];
+        });
     }
 
-    bool bMatch = false;
-
-    // Perform alternatively RANSAC iterations for each candidate
-    // until one is succesful or all fail
-    while(nCandidates>0 && !bMatch)
+    mpThreadPool->ParallelFor(nInitialCandidates, [&](int k)
     {
-        for(int i=0; i<nInitialCandidates; i++)
-        {
-            if(vbDiscarded[i])
-                continue;
-
-            KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
-
-            // Perform 5 Ransac Iterations
-            vector<bool> vbInliers;
-            int nInliers;
-            bool bNoMore;
-
-            Sim3Solver* pSolver = vpSim3Solvers[i];
-            cv::Mat Scm  = pSolver->iterate(5,bNoMore,vbInliers,nInliers); //param
-
-            // If Ransac reachs max. iterations discard keyframe
-            if(bNoMore)
-            {
-                vbDiscarded[i]=true;
-                nCandidates--;
-            }
-
-            // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
-            if(!Scm.empty())
-            {
-                DLOG_IF(INFO, mVisualizeLoopClosing()) << "Found Sim(3) for candidate " << i
-                                                       << " trying to optimize it.";
-                vector<MapPoint*> vpMapPointMatches(vvpMapPointMatches[i].size(), static_cast<MapPoint*>(NULL));
-                for(size_t j=0, jend=vbInliers.size(); j<jend; j++)
-                {
-                    if(vbInliers[j])
-                       vpMapPointMatches[j]=vvpMapPointMatches[i][j];
-                }
+        const int i = vnOrder[k];
+        if(EvaluateSim3Candidate(mvpEnoughConsistentCandidates[i], i, bMatch, nCandidates, gScm, mvpCurrentMatchedPoints,
+                                 bBoWMatched))
+            mpMatchedKF = mvpEnoughConsistentCandidates[i];
+    });
 
-                cv::Mat R = pSolver->GetEstimatedRotation();
-                cv::Mat t = pSolver->GetEstimatedTranslation();
-                const float s = pSolver->GetEstimatedScale();
-                int nmatchesSim3 = matcher.SearchBySim3(mpCurrentKF,pKF,vpMapPointMatches,s,R,t,7.5); //param
+    DLOG_IF(INFO, mVisualizeLoopClosing()) << nCandidates.load() << "/" << nInitialCandidates
+                                           << " candidates had enough matches with current keyframe.";
 
-                g2o::Sim3 gScm(Converter::toMatrix3d(R),Converter::toVector3d(t),s);
-                const int nInliers = Optimizer::OptimizeSim3(mpCurrentKF, pKF, vpMapPointMatches, gScm, 10, mbFixScale); //param
-
-                DLOG_IF(INFO, mVisualizeLoopClosing()) << nInliers << " matches after optimization.";
-                // If optimization is succesful stop ransacs and continue
-                if(nInliers>=20) //param
-                {
-                    DLOG_IF(INFO, mVisualizeLoopClosing()) << "Thats enough,"
-                                                           << " candidate accepted for last test!";
-                    bMatch = true;
-                    mpMatchedKF = pKF;
-                    g2o::Sim3 gSmw(Converter::toMatrix3d(pKF->GetRotation()),Converter::toVector3d(pKF->GetTranslation()),1.0);
-                    mg2oScw = gScm*gSmw;
-                    mScw = Converter::toCvMat(mg2oScw);
-
-                    mvpCurrentMatchedPoints = vpMapPointMatches;
-                    //TODO : If there is another candidate that performs better than the first one
-                    // accepted here and the one accepted here should be rejected later the one
-                    // rejected here will not be considered anymore
-                    break;
-                }
-            }
-            else
-            {
-                DLOG_IF(INFO, mVisualizeLoopClosing()) << "Couldn't find Sim(3) for candidate " << i;
-            }
-        }
+    if(bMatch)
+    {
+        g2o::Sim3 gSmw(Converter::toMatrix3d(mpMatchedKF->GetRotation()),Converter::toVector3d(mpMatchedKF->GetTranslation()),1.0);
+        mg2oScw = gScm*gSmw;
+        mScw = Converter::toCvMat(mg2oScw);
     }
 
     if(!bMatch)
@@ -398,13 +728,14 @@ bool LoopClosing::ComputeSim3()
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Doing one last matching with map points "
                                            << "found in keyframes connected to candidate.";
     // Retrieve MapPoints seen in Loop Keyframe and neighbors
-    vector<KeyFrame*> vpLoopConnectedKFs = mpMatchedKF->GetVectorCovisibleKeyFrames();
-    vpLoopConnectedKFs.push_back(mpMatchedKF);
+    const KeyFrame::CovisibilitySnapshot pLoopConnections = mpMatchedKF->GetCovisibilitySnapshot();
+    const vector<KeyFrame*> &vpLoopConnectedKFs = pLoopConnections->KeyFrames();
     mvpLoopMapPoints.clear();
-    for(vector<KeyFrame*>::iterator vit=vpLoopConnectedKFs.begin(); vit!=vpLoopConnectedKFs.end(); vit++)
+    for(size_t iKF=0, iendKF=pLoopConnections->NumOrdered(); iKF<=iendKF; iKF++)
     {
-        KeyFrame* pKF = *vit;
-        vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
+        KeyFrame* pKF = iKF<iendKF ? vpLoopConnectedKFs[iKF] : mpMatchedKF;
+        const KeyFrame::MapPointMatchesSnapshot pMapPoints = pKF->GetMapPointMatchesSnapshot();
+        const vector<MapPoint*> &vpMapPoints = *pMapPoints;
         for(size_t i=0, iend=vpMapPoints.size(); i<iend; i++)
         {
             MapPoint* pMP = vpMapPoints[i];
@@ -420,7 +751,10 @@ bool LoopClosing::ComputeSim3()
     }
 
     // Find more matches projecting with the computed Sim3
-    int nmatchesProj = matcher.SearchByProjection(mpCurrentKF, mScw, mvpLoopMapPoints, mvpCurrentMatchedPoints,10); //param
+    ORBmatcher matcher(0.75,true); //param
+    ORBmatcher::ProjectionPoints loopPoints;
+    loopPoints.Set(mvpLoopMapPoints);
+    int nmatchesProj = matcher.SearchByProjection(mpCurrentKF, mScw, loopPoints, mvpCurrentMatchedPoints,10); //param
 
     // If enough matches accept Loop
     //TODO : nmatchestotal could just be calculated from nInliers and nmatchesProj instead of
@@ -454,13 +788,118 @@ bool LoopClosing::ComputeSim3()
 
 }
 
+bool LoopClosing::EvaluateSim3Candidate(KeyFrame* pKF, const int nIndex, std::atomic<bool> &bMatch,
+                                        std::atomic<int> &nCandidates, g2o::Sim3 &gScm,
+                                        vector<MapPoint*> &vpMatchedPoints, const bool bBoWMatched)
+{
+    if(bMatch || pKF->isBad())
+        return false;
+
+    // We compute first ORB matches with the candidate
+    // If enough matches are found, we setup a Sim3Solver
+    ORBmatcher matcher(0.75,true); //param
+
+    vector<MapPoint*> &vpMapPointMatches = mvvpCandidateMatches[nIndex];
+    int nmatches = 0;
+    if(bBoWMatched)
+        nmatches = vpMapPointMatches.size()-count(vpMapPointMatches.begin(),vpMapPointMatches.end(),
+                                                  static_cast<MapPoint*>(NULL));
+    else
+        nmatches = matcher.SearchByBoW(mpCurrentKF,pKF,vpMapPointMatches);
+
+    if(nmatches<20) //param
+    {
+        DLOG_IF(INFO, mVisualizeLoopClosing()) << "Candidate " << nIndex
+                                               << " has " << nmatches
+                                               << " matches with current keyframe. -> Discarded!";
+        return false;
+    }
+
+    DLOG_IF(INFO, mVisualizeLoopClosing()) << "Candidate " << nIndex
+                                           << " has " << nmatches
+                                           << " matches with current keyframe. -> Using it!";
+    nCandidates++;
+
+    Sim3Solver solver(mpCurrentKF,pKF,vpMapPointMatches,mbFixScale);
+    solver.SetRansacParameters(0.99,20,300); //param
+
+    // Perform RANSAC iterations until a Sim3 is accepted, here or for another candidate,
+    // or RANSAC reaches its maximum number of iterations
+    vector<MapPoint*> &vpMatches = mvvpCandidateInliers[nIndex];
+    bool bNoMore = false;
+    while(!bNoMore && !bMatch)
+    {
+        // Perform 5 Ransac Iterations
+        vector<bool> vbInliers;
+        int nInliers;
+
+        cv::Mat Scm  = solver.iterate(5,bNoMore,vbInliers,nInliers); //param
+
+        if(Scm.empty())
+            continue;
+
+        // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
+        DLOG_IF(INFO, mVisualizeLoopClosing()) << "Found Sim(3) for candidate " << nIndex
+                                               << " trying to optimize it.";
+        vpMatches.assign(vpMapPointMatches.size(), static_cast<MapPoint*>(NULL));
+        for(size_t j=0, jend=vbInliers.size(); j<jend; j++)
+        {
+            if(vbInliers[j])
+               vpMatches[j]=vpMapPointMatches[j];
+        }
+
+        cv::Mat R = solver.GetEstimatedRotation();
+        cv::Mat t = solver.GetEstimatedTranslation();
+        const float s = solver.GetEstimatedScale();
+        matcher.SearchBySim3(mpCurrentKF,pKF,vpMatches,s,R,t,7.5); //param
+
+        g2o::Sim3 gS(Converter::toMatrix3d(R),Converter::toVector3d(t),s);
+        const int nInliersOpt = Optimizer::OptimizeSim3(mpCurrentKF, pKF, vpMatches, gS, 10, mbFixScale); //param
+
+        DLOG_IF(INFO, mVisualizeLoopClosing()) << nInliersOpt << " matches after optimization.";
+        // If optimization is succesful stop ransacs and continue,
+        // only the first candidate to get here hands out its Sim3
+        //TODO : If there is another candidate that performs better than the first one
+        // accepted here and the one accepted here should be rejected later the one
+        // rejected here will not be considered anymore
+        if(nInliersOpt>=20) //param
+        {
+            if(bMatch.exchange(true))
+                return false;
+
+            DLOG_IF(INFO, mVisualizeLoopClosing()) << "Thats enough,"
+                                                   << " candidate accepted for last test!";
+            gScm = gS;
+            // The pooled vector of this candidate takes the previous matches of the loop
+            vpMatchedPoints.swap(vpMatches);
+            return true;
+        }
+    }
+
+    if(!bMatch)
+    {
+        DLOG_IF(INFO, mVisualizeLoopClosing()) << "Couldn't find Sim(3) for candidate " << nIndex;
+    }
+
+    return false;
+}
+
 void LoopClosing::CorrectLoop()
 {
-    cout << "Loop detected!" << endl;
+    STAGE_TIMER(CORRECT_LOOP);
+
+    // A loop closure between two maps of the atlas merges the map of the current keyframe into
+    // the one of the matched keyframe, the correction is the same
+    const bool bMerge = mpCurrentKF->mnMapId!=mpMatchedKF->mnMapId;
+    if(bMerge)
+        cout << "Loop detected between two maps, merging them!" << endl;
+    else
+        cout << "Loop detected!" << endl;
 
     // Send a stop signal to Local Mapping
     // Avoid new keyframes are inserted while correcting the loop
-    mpLocalMapper->RequestStop();
+    if(mpLocalMapper)
+        mpLocalMapper->RequestStop();
 
     // If a Global Bundle Adjustment is running, abort it
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Implementing and refining loop.";
@@ -480,12 +919,18 @@ void LoopClosing::CorrectLoop()
     }
 
     // Wait until Local Mapping has effectively stopped
-    while(!mpLocalMapper->isStopped())
+    if(mpLocalMapper)
     {
-        usleep(1000);
+        TRACE_SCOPE("WaitLocalMappingStop");
+        mpLocalMapper->WaitUntilStopped();
     }
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Stopped local mapping.";
 
+    // The subscribers of the map events get the keyframes the correction moves
+    MapEvents::PoseMap PosesBeforeLoop;
+    if(mpMap->mEvents.HasSubscribers())
+        mpMap->mEvents.GetPoses(*mpMap->GetKeyFramesSnapshot(),PosesBeforeLoop);
+
     // Ensure current keyframe is updated
     mpCurrentKF->UpdateConnections();
 
@@ -493,6 +938,12 @@ void LoopClosing::CorrectLoop()
     mvpCurrentConnectedKFs = mpCurrentKF->GetVectorCovisibleKeyFrames();
     mvpCurrentConnectedKFs.push_back(mpCurrentKF);
 
+    // The covisibility weights follow the fusions below, the links to detect later are the
+    // ones these keyframes do not have yet
+    map<KeyFrame*, vector<KeyFrame*> > PreviousNeighbors;
+    for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
+        PreviousNeighbors[*vit] = (*vit)->GetVectorCovisibleKeyFrames();
+
     KeyFrameAndPose CorrectedSim3, NonCorrectedSim3;
     CorrectedSim3[mpCurrentKF]=mg2oScw;
     cv::Mat Twc = mpCurrentKF->GetPoseInverse();
@@ -502,7 +953,7 @@ void LoopClosing::CorrectLoop()
                                            << "keyframe to their new position.";
     {
         // Get Map Mutex
-        unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
 
         for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
         {
@@ -528,16 +979,32 @@ void LoopClosing::CorrectLoop()
             NonCorrectedSim3[pKFi]=g2oSiw;
         }
 
-        // Correct all MapPoints obsrved by current keyframe and neighbors, so that they align with the other side of the loop
-        for(KeyFrameAndPose::iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit!=mend; mit++)
+        // Update keyframe pose with corrected Sim3. First transform Sim3 to SE3 (scale translation)
+        vector<KeyFrameAndPose::const_iterator> vCorrectedKFs;
+        vCorrectedKFs.reserve(CorrectedSim3.size());
+        for(KeyFrameAndPose::const_iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit!=mend; mit++)
         {
-            KeyFrame* pKFi = mit->first;
-            g2o::Sim3 g2oCorrectedSiw = mit->second;
-            g2o::Sim3 g2oCorrectedSwi = g2oCorrectedSiw.inverse();
+            const g2o::Sim3 &g2oCorrectedSiw = mit->second;
+            Eigen::Matrix3d eigR = g2oCorrectedSiw.rotation().toRotationMatrix();
+            Eigen::Vector3d eigt = g2oCorrectedSiw.translation();
+            double s = g2oCorrectedSiw.scale();
+
+            eigt *=(1./s); //[R t/s;0 1]
 
-            g2o::Sim3 g2oSiw =NonCorrectedSim3[pKFi];
+            cv::Mat correctedTiw = Converter::toCvSE3(eigR,eigt);
 
-            vector<MapPoint*> vpMPsi = pKFi->GetMapPointMatches();
+            mit->first->SetPose(correctedTiw);
+            vCorrectedKFs.push_back(mit);
+        }
+
+        // Correct all MapPoints obsrved by current keyframe and neighbors, so that they align with the other side of the loop.
+        // A point is corrected by the first keyframe which observes it, claimed here in that
+        // order, then every keyframe corrects its points in parallel.
+        vector<vector<MapPoint*> > vvpCorrectedMPs(vCorrectedKFs.size());
+        for(size_t i=0; i<vCorrectedKFs.size(); i++)
+        {
+            KeyFrame* pKFi = vCorrectedKFs[i]->first;
+            const vector<MapPoint*> vpMPsi = pKFi->GetMapPointMatches();
             for(size_t iMP=0, endMPi = vpMPsi.size(); iMP<endMPi; iMP++)
             {
                 MapPoint* pMPi = vpMPsi[iMP];
@@ -548,6 +1015,23 @@ void LoopClosing::CorrectLoop()
                 if(pMPi->mnCorrectedByKF==mpCurrentKF->mnId)
                     continue;
 
+                pMPi->mnCorrectedByKF = mpCurrentKF->mnId;
+                pMPi->mnCorrectedReference = pKFi->mnId;
+                vvpCorrectedMPs[i].push_back(pMPi);
+            }
+        }
+
+        mpThreadPool->ParallelFor(vCorrectedKFs.size(), [&](int i)
+        {
+            KeyFrame* pKFi = vCorrectedKFs[i]->first;
+            const g2o::Sim3 g2oCorrectedSwi = vCorrectedKFs[i]->second.inverse();
+            const g2o::Sim3 &g2oSiw = NonCorrectedSim3.find(pKFi)->second;
+
+            const vector<MapPoint*> &vpCorrectedMPs = vvpCorrectedMPs[i];
+            for(size_t iMP=0; iMP<vpCorrectedMPs.size(); iMP++)
+            {
+                MapPoint* pMPi = vpCorrectedMPs[iMP];
+
                 // Project with non-corrected pose and project back with corrected pose
                 cv::Mat P3Dw = pMPi->GetWorldPos();
                 Eigen::Matrix<double,3,1> eigP3Dw = Converter::toVector3d(P3Dw);
@@ -555,44 +1039,33 @@ void LoopClosing::CorrectLoop()
 
                 cv::Mat cvCorrectedP3Dw = Converter::toCvMat(eigCorrectedP3Dw);
                 pMPi->SetWorldPos(cvCorrectedP3Dw);
-                pMPi->mnCorrectedByKF = mpCurrentKF->mnId;
-                pMPi->mnCorrectedReference = pKFi->mnId;
                 pMPi->UpdateNormalAndDepth();
             }
+        });
 
-            // Update keyframe pose with corrected Sim3. First transform Sim3 to SE3 (scale translation)
-            Eigen::Matrix3d eigR = g2oCorrectedSiw.rotation().toRotationMatrix();
-            Eigen::Vector3d eigt = g2oCorrectedSiw.translation();
-            double s = g2oCorrectedSiw.scale();
-
-            eigt *=(1./s); //[R t/s;0 1]
-
-            cv::Mat correctedTiw = Converter::toCvSE3(eigR,eigt);
-
-            pKFi->SetPose(correctedTiw);
-
-            // Make sure connections are updated
-            pKFi->UpdateConnections();
-        }
+        // Make sure connections are updated, one after another as they change the neighbors too
+        for(size_t i=0; i<vCorrectedKFs.size(); i++)
+            vCorrectedKFs[i]->first->UpdateConnections();
 
         // Start Loop Fusion
         // Update matched map points and replace if duplicated
+        MapPointReplacer replacer;
         for(size_t i=0; i<mvpCurrentMatchedPoints.size(); i++)
         {
             if(mvpCurrentMatchedPoints[i])
             {
                 MapPoint* pLoopMP = mvpCurrentMatchedPoints[i];
-                MapPoint* pCurMP = mpCurrentKF->GetMapPoint(i);
+                MapPoint* pCurMP = replacer.GetMapPoint(mpCurrentKF,i);
                 if(pCurMP)
-                    pCurMP->Replace(pLoopMP);
+                    replacer.Replace(pCurMP,pLoopMP);
                 else
                 {
-                    mpCurrentKF->AddMapPoint(pLoopMP,i);
-                    pLoopMP->AddObservation(mpCurrentKF,i);
+                    replacer.Add(pLoopMP,mpCurrentKF,i);
                     pLoopMP->ComputeDistinctiveDescriptors();
                 }
             }
         }
+        replacer.Apply();
 
     }
 
@@ -610,12 +1083,12 @@ void LoopClosing::CorrectLoop()
     for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
     {
         KeyFrame* pKFi = *vit;
-        vector<KeyFrame*> vpPreviousNeighbors = pKFi->GetVectorCovisibleKeyFrames();
+        const vector<KeyFrame*> &vpPreviousNeighbors = PreviousNeighbors[pKFi];
 
         // Update connections. Detect new links.
         pKFi->UpdateConnections();
         LoopConnections[pKFi]=pKFi->GetConnectedKeyFrames();
-        for(vector<KeyFrame*>::iterator vit_prev=vpPreviousNeighbors.begin(), vend_prev=vpPreviousNeighbors.end(); vit_prev!=vend_prev; vit_prev++)
+        for(vector<KeyFrame*>::const_iterator vit_prev=vpPreviousNeighbors.begin(), vend_prev=vpPreviousNeighbors.end(); vit_prev!=vend_prev; vit_prev++)
         {
             LoopConnections[pKFi].erase(*vit_prev);
         }
@@ -627,53 +1100,174 @@ void LoopClosing::CorrectLoop()
 
     // Optimize graph
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Propagating loop through essential graph.";
-    Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale);
+    Optimizer::BAReport essentialReport;
+    Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale,
+                                      &essentialReport, &mEssentialGraph);
+    DLOG_IF(INFO, mVisualizeLoopClosing()) << "Essential graph: " << essentialReport.nIterations << " iterations in "
+                                           << essentialReport.tElapsed*1e3 << " ms, "
+                                           << mEssentialGraph.NumRefreshed() << " keyframes with new edges"
+                                           << (essentialReport.bConverged ? ", converged" : "");
 
     mpMap->InformNewBigChange();
+    if(mpMap->mEvents.HasSubscribers())
+        mpMap->mEvents.Corrected(MapEvents::LOOP_CORRECTED,mpCurrentKF->mnId,mpMatchedKF->mnId,PosesBeforeLoop,
+                                 *mpMap->GetKeyFramesSnapshot());
 
     // Add loop edge
     mpMatchedKF->AddLoopEdge(mpCurrentKF);
     mpCurrentKF->AddLoopEdge(mpMatchedKF);
 
+    if(bMerge)
+    {
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+        mpMap->MergeMap(mpCurrentKF->mnMapId,mpMatchedKF);
+    }
+
     // Launch a new thread to perform Global Bundle Adjustment
     mbRunningGBA = true;
     mbFinishedGBA = false;
     mbStopGBA = false;
     DLOG_IF(INFO, mVisualizeLoopClosing()) << "Starting a global bundle adjustment in a new thread";
-    mpThreadGBA = new thread(&LoopClosing::RunGlobalBundleAdjustment,this,mpCurrentKF->mnId);
+    mpThreadGBA = new thread(&LoopClosing::RunGlobalBundleAdjustment,this,mpCurrentKF->mnId,GetGBARegion());
 
     // Loop closed. Release Local Mapping.
-    mpLocalMapper->Release();
+    if(mpLocalMapper)
+        mpLocalMapper->Release();
 
     mLastLoopKFid = mpCurrentKF->mnId;
 }
 
-void LoopClosing::SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap)
+vector<KeyFrame*> LoopClosing::GetGBARegion()
 {
-    ORBmatcher matcher(0.8); //param
+    vector<KeyFrame*> vpRegionKFs;
+    if(mnMaxGBAKeyFrames<=0 || mpMap->KeyFramesInMap()<=static_cast<long unsigned int>(mnMaxGBAKeyFrames))
+        return vpRegionKFs;
+
+    // Breadth first through the covisibility graph, both sides of the loop at the same time
+    const unsigned long nLoopKF = mpCurrentKF->mnId;
+    vpRegionKFs.reserve(mnMaxGBAKeyFrames);
+    vpRegionKFs.push_back(mpCurrentKF);
+    mpCurrentKF->mnBARegionForKF = nLoopKF;
+    if(mpMatchedKF->mnBARegionForKF!=nLoopKF)
+    {
+        vpRegionKFs.push_back(mpMatchedKF);
+        mpMatchedKF->mnBARegionForKF = nLoopKF;
+    }
+
+    for(size_t i=0; i<vpRegionKFs.size() && vpRegionKFs.size()<static_cast<size_t>(mnMaxGBAKeyFrames); i++)
+    {
+        const vector<KeyFrame*> vpNeighs = vpRegionKFs[i]->GetVectorCovisibleKeyFrames();
+        for(vector<KeyFrame*>::const_iterator vit=vpNeighs.begin(), vend=vpNeighs.end(); vit!=vend; vit++)
+        {
+            KeyFrame* pKFi = *vit;
+            if(pKFi->mnBARegionForKF==nLoopKF || pKFi->isBad())
+                continue;
+            pKFi->mnBARegionForKF = nLoopKF;
+            vpRegionKFs.push_back(pKFi);
+            if(vpRegionKFs.size()>=static_cast<size_t>(mnMaxGBAKeyFrames))
+                break;
+        }
+    }
 
+    return vpRegionKFs;
+}
+
+void LoopClosing::SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap)
+{
+    vector<KeyFrameAndPose::const_iterator> vCorrectedKFs;
+    vCorrectedKFs.reserve(CorrectedPosesMap.size());
     for(KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit!=mend;mit++)
+        vCorrectedKFs.push_back(mit);
+
+    // The keyframes search their fusions in parallel, the replacements are made afterwards in
+    // their order. A keyframe only adds observations to itself while searching. The loop points
+    // are read once for all of them.
+    ORBmatcher::ProjectionPoints loopPoints;
+    loopPoints.Set(mvpLoopMapPoints);
+    vector<const vector<MapPoint*>*> vpvpFusePoints(vCorrectedKFs.size(),&mvpLoopMapPoints);
+    vector<vector<MapPoint*> > vvpInViewPoints(vCorrectedKFs.size());
+    vector<vector<MapPoint*> > vvpReplacePoints(vCorrectedKFs.size());
+    mpThreadPool->ParallelFor(vCorrectedKFs.size(), [&](int iKF)
     {
-        KeyFrame* pKF = mit->first;
+        ORBmatcher matcher(0.8); //param
+
+        KeyFrame* pKF = vCorrectedKFs[iKF]->first;
 
-        g2o::Sim3 g2oScw = mit->second;
+        const g2o::Sim3 &g2oScw = vCorrectedKFs[iKF]->second;
         cv::Mat cvScw = Converter::toCvMat(g2oScw);
 
-        vector<MapPoint*> vpReplacePoints(mvpLoopMapPoints.size(),static_cast<MapPoint*>(NULL));
-        matcher.Fuse(pKF,cvScw,mvpLoopMapPoints,4,vpReplacePoints); //param
+        // Points in view of the corrected keyframe which the keyframes around the matched one do
+        // not observe, from the spatial index
+        vector<MapPoint*> vpExtraPoints;
+        if(mpMap->mPointIndex.IsEnabled() && pKF->TrackedMapPoints(1)>0)
+        {
+            MapPointIndex::Frustum frustum;
+            frustum.Rcw = g2oScw.rotation().toRotationMatrix().cast<float>();
+            frustum.tcw = (g2oScw.translation()/g2oScw.scale()).cast<float>();
+            frustum.fx = pKF->fx;
+            frustum.fy = pKF->fy;
+            frustum.cx = pKF->cx;
+            frustum.cy = pKF->cy;
+            frustum.minX = pKF->mnMinX;
+            frustum.maxX = pKF->mnMaxX;
+            frustum.minY = pKF->mnMinY;
+            frustum.maxY = pKF->mnMaxY;
+            frustum.maxDepth = 2*pKF->ComputeSceneMedianDepth(2); //param
+
+            vector<MapPoint*> vpInView;
+            mpMap->mPointIndex.GetPointsInFrustum(frustum,vpInView);
+            for(size_t i=0; i<vpInView.size(); i++)
+            {
+                // The maps of the atlas not merged yet may overlap the matched one
+                if(!vpInView[i]->isBad() && vpInView[i]->mnLoopPointForKF!=mpCurrentKF->mnId &&
+                   vpInView[i]->GetReferenceKeyFrame()->mnMapId==mpMatchedKF->mnMapId)
+                    vpExtraPoints.push_back(vpInView[i]);
+            }
+        }
 
-        // Get Map Mutex
-        unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
-        const int nLP = mvpLoopMapPoints.size();
+        // The loop points, then the ones of the index, replacements in the same order
+        vector<MapPoint*> &vpReplacePoints = vvpReplacePoints[iKF];
+        vpReplacePoints.assign(loopPoints.Size(),static_cast<MapPoint*>(NULL));
+        matcher.Fuse(pKF,cvScw,loopPoints,4,vpReplacePoints); //param
+
+        if(!vpExtraPoints.empty())
+        {
+            ORBmatcher::ProjectionPoints extraPoints;
+            extraPoints.Set(vpExtraPoints);
+            vector<MapPoint*> vpExtraReplacePoints(vpExtraPoints.size(),static_cast<MapPoint*>(NULL));
+            matcher.Fuse(pKF,cvScw,extraPoints,4,vpExtraReplacePoints); //param
+
+            vector<MapPoint*> &vpPoints = vvpInViewPoints[iKF];
+            vpPoints = mvpLoopMapPoints;
+            vpPoints.insert(vpPoints.end(),vpExtraPoints.begin(),vpExtraPoints.end());
+            vpReplacePoints.insert(vpReplacePoints.end(),vpExtraReplacePoints.begin(),vpExtraReplacePoints.end());
+            vpvpFusePoints[iKF] = &vpPoints;
+        }
+    });
+
+    // Get Map Mutex
+    MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+    MapPointReplacer replacer;
+    for(size_t iKF=0; iKF<vCorrectedKFs.size(); iKF++)
+    {
+        const vector<MapPoint*> &vpFusePoints = *vpvpFusePoints[iKF];
+        const vector<MapPoint*> &vpReplacePoints = vvpReplacePoints[iKF];
+        const int nLP = vpFusePoints.size();
         for(int i=0; i<nLP;i++)
         {
+            // A keyframe before may have replaced the point found meanwhile, the one which took
+            // its place is fused instead
             MapPoint* pRep = vpReplacePoints[i];
-            if(pRep)
+            while(pRep && pRep->isBad())
+                pRep = pRep->GetReplaced();
+            // Points of the index may have been replaced by a previous keyframe
+            if(pRep && pRep!=vpFusePoints[i] && !vpFusePoints[i]->isBad())
             {
-                pRep->Replace(mvpLoopMapPoints[i]);
+                replacer.Replace(pRep,vpFusePoints[i]);
             }
         }
     }
+    replacer.Apply();
 }
 
 
@@ -683,16 +1277,11 @@ void LoopClosing::RequestReset()
         unique_lock<mutex> lock(mMutexReset);
         mbResetRequested = true;
     }
+    WakeUp();
 
-    while(1)
-    {
-        {
-        unique_lock<mutex> lock2(mMutexReset);
-        if(!mbResetRequested)
-            break;
-        }
-        usleep(5000);
-    }
+    unique_lock<mutex> lock2(mMutexReset);
+    while(mbResetRequested)
+        mCondReset.wait(lock2);
 }
 
 void LoopClosing::ResetIfRequested()
@@ -701,87 +1290,176 @@ void LoopClosing::ResetIfRequested()
     if(mbResetRequested)
     {
         mlpLoopKeyFrameQueue.clear();
+        SyncQueued();
         mLastLoopKFid=0;
+        mbLastQuery=false;
+        // Keyframe ids start again from zero
+        mEssentialGraph.Clear();
+        if(mpClient)
+            mpClient->Reset();
         mbResetRequested=false;
+        mCondReset.notify_all();
     }
 }
 
-void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
+void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF, vector<KeyFrame*> vpRegionKFs)
 {
+    Trace::SetThreadName("GlobalBA");
+    ThreadConfig::Apply(ThreadConfig::GLOBAL_BA);
+    StageTimes::BindThread(&mpMap->mStageTimes);
+    Trace::SetContext("loop keyframe",nLoopKF);
+
+    // Under load the tracking keeps the cores, the BA starts once the scheduler allows it again
+    // or the delay is over. The wait is no work of the stage.
+    if(mpLatencyScheduler && !mpLatencyScheduler->GetKnobs().bGlobalBA)
+    {
+        cout << "Global Bundle Adjustment waits for the latency scheduler" << endl;
+        const chrono::steady_clock::time_point tEnd = chrono::steady_clock::now() +
+                chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(MAX_GBA_DELAY));
+        while(!mbStopGBA && !mpLatencyScheduler->GetKnobs().bGlobalBA && chrono::steady_clock::now()<tEnd)
+            this_thread::sleep_for(chrono::milliseconds(10)); //param
+    }
+
+    STAGE_TIMER(GLOBAL_BUNDLE_ADJUSTMENT);
+
     cout << "Starting Global Bundle Adjustment" << endl;
 
+    // Nothing culled during the BA may be freed before it is done
+    const int nReclaimerId = mpMap->mReclaimer.RegisterThread();
+
+    // The iterations done when the budget runs out are kept
+    Optimizer::BABudget budget;
+    budget.deadline = chrono::steady_clock::now() +
+            chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(mfGBATimeBudget));
+    const Optimizer::BABudget* pBudget = mfGBATimeBudget>0 ? &budget : NULL;
+    Optimizer::BAReport report;
+
     int idx =  mnFullBAIdx;
-    Optimizer::GlobalBundleAdjustemnt(mpMap,10,&mbStopGBA,nLoopKF,false); //param
+    IndexedStore<KeyFrame>::Snapshot pKFsBefGBA;
+    if(vpRegionKFs.empty())
+    {
+        Optimizer::GlobalBundleAdjustemnt(mpMap,10,&mbStopGBA,nLoopKF,false,pBudget,&report); //param
+    }
+    else
+    {
+        cout << "Optimizing the " << vpRegionKFs.size() << " keyframes around the loop" << endl;
+        pKFsBefGBA = mpMap->GetKeyFramesSnapshot();
+        Optimizer::RegionBundleAdjustment(vpRegionKFs,10,&mbStopGBA,nLoopKF,false,pBudget,&report); //param
+    }
+
+    cout << "Global Bundle Adjustment: " << report.nIterations << " iterations in " << report.tElapsed << " s";
+    if(!report.vChi2.empty())
+        cout << ", chi2 " << report.vChi2.front() << " -> " << report.vChi2.back();
+    cout << ", " << report.nOutliers << " outliers" << (report.bConverged ? ", converged" : "")
+         << (report.bDeadlineReached ? " (time budget reached)" : "") << endl;
 
     // Update all MapPoints and KeyFrames
-    // Local Mapping was active during BA, that means that there might be new keyframes
-    // not included in the Global BA and they are not consistent with the updated map.
-    // We need to propagate the correction through the spanning tree
+    // Local Mapping keeps running during the BA and while its result is merged back: the keyframes
+    // it inserted meanwhile follow the correction of their nearest ancestor in the BA, and the
+    // local BA and triangulation results computed against the poses of before are dropped (they
+    // check the big change index under the map update mutex).
     {
         unique_lock<mutex> lock(mMutexGBA);
         if(idx!=mnFullBAIdx)
+        {
+            mpMap->mReclaimer.UnregisterThread(nReclaimerId);
             return;
+        }
 
         if(!mbStopGBA)
         {
             DLOG_IF(INFO, mVisualizeLoopClosing()) << "LOOP CLOSING: GLOBAL BA THREAD FINISHED!";
             cout << "Global Bundle Adjustment finished" << endl;
             cout << "Updating map ..." << endl;
-            mpLocalMapper->RequestStop();
-            // Wait until Local Mapping has effectively stopped
+            TRACE_SCOPE("MergeGlobalBA");
+
+            // Get Map Mutex
+            MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+
+            const IndexedStore<KeyFrame>::Snapshot pKFs = mpMap->GetKeyFramesSnapshot();
+            const vector<KeyFrame*> &vpKFs = *pKFs;
 
-            while(!mpLocalMapper->isStopped() && !mpLocalMapper->isFinished())
+            // Keyframes which were in the map but outside the region keep their pose, the ones
+            // inserted meanwhile follow the correction of their parent
+            if(pKFsBefGBA)
             {
-                usleep(1000);
+                for(size_t i=0; i<pKFsBefGBA->size(); i++)
+                {
+                    KeyFrame* pKF = (*pKFsBefGBA)[i];
+                    if(pKF->mnBAGlobalForKF==nLoopKF)
+                        continue;
+                    pKF->mTcwGBA = pKF->GetPose();
+                    pKF->mnBAGlobalForKF = nLoopKF;
+                }
             }
 
-            // Get Map Mutex
-            unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+            MapEvents::PoseMap PosesBeforeGBA;
+            if(mpMap->mEvents.HasSubscribers())
+                mpMap->mEvents.GetPoses(vpKFs,PosesBeforeGBA);
 
-            // Correct keyframes starting at map first keyframe
+            // Correct the keyframes the BA did not see: Tcw' = Tca*Taw', with a the nearest
+            // ancestor it optimized. Every new pose is computed before any is set, so they are
+            // all relative to the poses of before. Each keyframe walks up to its own ancestor,
+            // in parallel over blocks of keyframes, and then the new poses are set in parallel.
             DLOG_IF(INFO, mVisualizeLoopClosing()) << "Updating keyframes and Map points accordingly";
-            list<KeyFrame*> lpKFtoCheck(mpMap->mvpKeyFrameOrigins.begin(),mpMap->mvpKeyFrameOrigins.end());
+            const int nKFBlocks = (vpKFs.size()+GBA_MERGE_BLOCK-1)/GBA_MERGE_BLOCK;
+            vector<cv::Mat> vTcwPropagated(vpKFs.size());
+            mpThreadPool->ParallelFor(nKFBlocks, [&](int iBlock)
+            {
+                for(size_t i=iBlock*GBA_MERGE_BLOCK, iend=min(vpKFs.size(),i+GBA_MERGE_BLOCK); i<iend; i++)
+                {
+                    KeyFrame* pKF = vpKFs[i];
+                    if(pKF->isBad() || pKF->mnBAGlobalForKF==nLoopKF)
+                        continue;
+
+                    KeyFrame* pAncestor = pKF->GetParent();
+                    while(pAncestor && pAncestor->mnBAGlobalForKF!=nLoopKF)
+                        pAncestor = pAncestor->GetParent();
+                    if(!pAncestor)
+                        continue;
 
-            while(!lpKFtoCheck.empty())
+                    vTcwPropagated[i] = pKF->GetPose()*pAncestor->GetPoseInverse()*pAncestor->mTcwGBA;
+                }
+            });
+
+            mpThreadPool->ParallelFor(nKFBlocks, [&](int iBlock)
             {
-                KeyFrame* pKF = lpKFtoCheck.front();
-                const set<KeyFrame*> sChilds = pKF->GetChilds();
-                cv::Mat Twc = pKF->GetPoseInverse();
-                for(set<KeyFrame*>::const_iterator sit=sChilds.begin();sit!=sChilds.end();sit++)
+                for(size_t i=iBlock*GBA_MERGE_BLOCK, iend=min(vpKFs.size(),i+GBA_MERGE_BLOCK); i<iend; i++)
                 {
-                    KeyFrame* pChild = *sit;
-                    if(pChild->mnBAGlobalForKF!=nLoopKF)
+                    KeyFrame* pKF = vpKFs[i];
+                    if(!vTcwPropagated[i].empty())
                     {
-                        cv::Mat Tchildc = pChild->GetPose()*Twc;
-                        pChild->mTcwGBA = Tchildc*pKF->mTcwGBA;//*Tcorc*pKF->mTcwGBA;
-                        pChild->mnBAGlobalForKF=nLoopKF;
-
+                        pKF->mTcwGBA = vTcwPropagated[i];
+                        pKF->mnBAGlobalForKF = nLoopKF;
                     }
-                    lpKFtoCheck.push_back(pChild);
+                    else if(pKF->mnBAGlobalForKF!=nLoopKF)
+                        continue;
+                    pKF->mTcwBefGBA = pKF->GetPose();
+                    pKF->SetPose(pKF->mTcwGBA);
                 }
+            });
 
-                pKF->mTcwBefGBA = pKF->GetPose();
-                pKF->SetPose(pKF->mTcwGBA);
-                lpKFtoCheck.pop_front();
-            }
-
-            // Correct MapPoints
-            const vector<MapPoint*> vpMPs = mpMap->GetAllMapPoints();
+            // Correct MapPoints, in parallel over blocks of points
+            const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+            const vector<MapPoint*> &vpMPs = *pMPs;
 
-            for(size_t i=0; i<vpMPs.size(); i++)
+            const int nMPBlocks = (vpMPs.size()+GBA_MERGE_BLOCK-1)/GBA_MERGE_BLOCK;
+            mpThreadPool->ParallelFor(nMPBlocks, [&](int iBlock)
             {
-                MapPoint* pMP = vpMPs[i];
+                for(size_t i=iBlock*GBA_MERGE_BLOCK, iend=min(vpMPs.size(),i+GBA_MERGE_BLOCK); i<iend; i++)
+                {
+                    MapPoint* pMP = vpMPs[i];
 
-                if(pMP->isBad())
-                    continue;
+                    if(pMP->isBad())
+                        continue;
+
+                    if(pMP->mnBAGlobalForKF==nLoopKF)
+                    {
+                        // If optimized by Global BA, just update
+                        pMP->SetWorldPos(pMP->mPosGBA);
+                        continue;
+                    }
 
-                if(pMP->mnBAGlobalForKF==nLoopKF)
-                {
-                    // If optimized by Global BA, just update
-                    pMP->SetWorldPos(pMP->mPosGBA);
-                }
-                else
-                {
                     // Update according to the correction of its reference keyframe
                     KeyFrame* pRefKF = pMP->GetReferenceKeyFrame();
 
@@ -789,35 +1467,49 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
                         continue;
 
                     // Map to non-corrected camera
-                    cv::Mat Rcw = pRefKF->mTcwBefGBA.rowRange(0,3).colRange(0,3);
-                    cv::Mat tcw = pRefKF->mTcwBefGBA.rowRange(0,3).col(3);
-                    cv::Mat Xc = Rcw*pMP->GetWorldPos()+tcw;
+                    const Eigen::Matrix3f Rcw = Converter::toMatrix3f(pRefKF->mTcwBefGBA.rowRange(0,3).colRange(0,3));
+                    const Eigen::Vector3f tcw = Converter::toVector3f(pRefKF->mTcwBefGBA.rowRange(0,3).col(3));
+                    Eigen::Vector3f Xw;
+                    pMP->GetWorldPos(Xw);
+                    const Eigen::Vector3f Xc = Rcw*Xw+tcw;
 
                     // Backproject using corrected camera
-                    cv::Mat Twc = pRefKF->GetPoseInverse();
-                    cv::Mat Rwc = Twc.rowRange(0,3).colRange(0,3);
-                    cv::Mat twc = Twc.rowRange(0,3).col(3);
-
-                    pMP->SetWorldPos(Rwc*Xc+twc);
+                    Eigen::Matrix3f Rcw2;
+                    Eigen::Vector3f tcw2;
+                    pRefKF->GetPose(Rcw2,tcw2);
+                    pMP->SetWorldPos(Eigen::Vector3f(Rcw2.transpose()*(Xc-tcw2)));
                 }
-            }
+            });
 
             mpMap->InformNewBigChange();
-
-            mpLocalMapper->Release();
+            if(mpMap->mEvents.HasSubscribers())
+                mpMap->mEvents.Corrected(MapEvents::GLOBAL_BA_FINISHED,nLoopKF,0,PosesBeforeGBA,vpKFs);
 
             cout << "Map updated!" << endl;
         }
 
         mbFinishedGBA = true;
         mbRunningGBA = false;
+        mCondGBA.notify_all();
     }
+
+    mpMap->mReclaimer.UnregisterThread(nReclaimerId);
+}
+
+void LoopClosing::WaitForGBA()
+{
+    unique_lock<mutex> lock(mMutexGBA);
+    while(mbRunningGBA)
+        mCondGBA.wait(lock);
 }
 
 void LoopClosing::RequestFinish()
 {
-    unique_lock<mutex> lock(mMutexFinish);
-    mbFinishRequested = true;
+    {
+        unique_lock<mutex> lock(mMutexFinish);
+        mbFinishRequested = true;
+    }
+    WakeUp();
 }
 
 bool LoopClosing::CheckFinish()
@@ -830,6 +1522,7 @@ void LoopClosing::SetFinish()
 {
     unique_lock<mutex> lock(mMutexFinish);
     mbFinished = true;
+    mCondFinish.notify_all();
 }
 
 bool LoopClosing::isFinished()
@@ -838,5 +1531,23 @@ bool LoopClosing::isFinished()
     return mbFinished;
 }
 
+bool LoopClosing::isIdle()
+{
+    {
+        unique_lock<mutex> lock(mMutexLoopQueue);
+        if(!mlpLoopKeyFrameQueue.empty() || mbProcessing)
+            return false;
+    }
+    // A Global BA is started before the keyframe which closed the loop is done
+    return !isRunningGBA();
+}
+
+void LoopClosing::WaitUntilFinished()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    while(!mbFinished)
+        mCondFinish.wait(lock);
+}
+
 
 } //namespace ORB_SLAM
@@ -0,0 +1,690 @@
+#include "LoopServer.h"
+
+#include "Frame.h"
+#include "KeyFrame.h"
+#include "KeyFrameDatabase.h"
+#include "LoopClosing.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "MapSerializer.h"
+#include "Trace.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int BACKLOG = 4; //param pending connections of the listening socket
+const int PERIOD = 5000; //param microseconds between two polls of the sockets
+const uint32_t MAX_MESSAGE = 1<<28; //param longer messages close the connection
+
+bool SetNonBlocking(const int fd)
+{
+    const int flags = fcntl(fd,F_GETFL,0);
+    return flags>=0 && fcntl(fd,F_SETFL,flags|O_NONBLOCK)==0;
+}
+
+template<typename T>
+void Put(string &buffer, const T &value)
+{
+    buffer.append(reinterpret_cast<const char*>(&value),sizeof(T));
+}
+
+// Returns the offset of the length, EndMessage writes it once the payload is complete
+size_t BeginMessage(string &buffer, const LoopServer::MessageType type)
+{
+    const size_t offset = buffer.size();
+    Put<uint32_t>(buffer,0);
+    buffer.push_back((char)type);
+    return offset;
+}
+
+void EndMessage(string &buffer, const size_t offset)
+{
+    const uint32_t length = buffer.size()-offset-4;
+    buffer.replace(offset,4,reinterpret_cast<const char*>(&length),4);
+}
+
+// Reads a message, every Get fails once it is exhausted
+class Reader
+{
+public:
+    Reader(const char* pData, const size_t nSize): mpData(pData), mnSize(nSize), mnPos(0) {}
+
+    template<typename T>
+    bool Get(T &value)
+    {
+        if(sizeof(T)>mnSize-mnPos)
+            return false;
+        memcpy(&value,mpData+mnPos,sizeof(T));
+        mnPos += sizeof(T);
+        return true;
+    }
+
+    bool GetBlock(const char* &pBlock, uint32_t &nBlockSize)
+    {
+        if(!Get(nBlockSize) || nBlockSize>mnSize-mnPos)
+            return false;
+        pBlock = mpData+mnPos;
+        mnPos += nBlockSize;
+        return true;
+    }
+
+    // 4x4, CV_32F
+    bool GetPose(cv::Mat &T)
+    {
+        float pose[12];
+        if(sizeof(pose)>mnSize-mnPos)
+            return false;
+        memcpy(pose,mpData+mnPos,sizeof(pose));
+        mnPos += sizeof(pose);
+        T = cv::Mat::eye(4,4,CV_32F);
+        for(int i=0; i<3; i++)
+        {
+            for(int j=0; j<3; j++)
+                T.at<float>(i,j) = pose[3*i+j];
+            T.at<float>(i,3) = pose[9+i];
+        }
+        return true;
+    }
+
+    bool AtEnd() const { return mnPos==mnSize; }
+
+private:
+    const char* mpData;
+    size_t mnSize;
+    size_t mnPos;
+};
+
+cv::Mat InversePose(const cv::Mat &T)
+{
+    cv::Mat Tinv = cv::Mat::eye(4,4,CV_32F);
+    const cv::Mat Rt = T.rowRange(0,3).colRange(0,3).t();
+    Rt.copyTo(Tinv.rowRange(0,3).colRange(0,3));
+    Tinv.rowRange(0,3).col(3) = -Rt*T.rowRange(0,3).col(3);
+    return Tinv;
+}
+}
+
+LoopServer::LoopServer(ORBVocabulary* pVoc, const int port, const int nMaxGBAKeyFrames, const float fGBATimeBudget,
+                       const int nThreads):
+    mpVocabulary(pVoc), mPort(port), mnMaxGBAKeyFrames(nMaxGBAKeyFrames), mfGBATimeBudget(fGBATimeBudget),
+    mnThreads(nThreads), mpLoopCloser(static_cast<LoopClosing*>(NULL)), mbFixScale(false), mnListenFd(-1),
+    mnEpochBase(0), mnResets(0), mnResetsSeen(0), mbFinishRequested(false), mbFinished(true)
+{
+    mpKeyFrameDB = new KeyFrameDatabase(*mpVocabulary);
+    mpMap = new Map();
+    mnChangeLogConsumer = mpMap->mChangeLog.AddConsumer();
+
+    mClient.fd = -1;
+    mClient.nSent = 0;
+
+    // The corrections reach the client through the events of the map
+    mpMap->mEvents.Subscribe([this](const MapEvents::Event &event){ OnMapEvent(event); });
+    mptMapEvents = new thread(&MapEvents::Run,&mpMap->mEvents);
+}
+
+LoopServer::~LoopServer()
+{
+    CloseClient();
+    if(mnListenFd>=0)
+        close(mnListenFd);
+
+    mpMap->mEvents.RequestFinish();
+    mptMapEvents->join();
+    delete mptMapEvents;
+}
+
+void LoopServer::Run()
+{
+    Trace::SetThreadName("LoopServer");
+    mbFinished = false;
+
+    if(Listen())
+        cout << "Closing the loops of a client on port " << mPort << endl;
+
+    while(1)
+    {
+        if(mnListenFd>=0)
+        {
+            AcceptClient();
+
+            if(mClient.fd>=0 && !Receive())
+                CloseClient();
+        }
+
+        if(mpLoopCloser)
+        {
+            mpLoopCloser->ProcessQueue();
+            CollectFusions();
+        }
+
+        if(mClient.fd>=0)
+        {
+            {
+                unique_lock<mutex> lock(mMutexPending);
+                mClient.outbox.append(mPending);
+                mPending.clear();
+            }
+            if(!Send())
+                CloseClient();
+        }
+
+        if(CheckFinish())
+            break;
+
+        usleep(PERIOD);
+    }
+
+    CloseClient();
+
+    if(mpLoopCloser)
+    {
+        mpLoopCloser->WaitForGBA();
+        mpLoopCloser->DetachThread();
+    }
+
+    SetFinish();
+}
+
+bool LoopServer::Listen()
+{
+    mnListenFd = socket(AF_INET,SOCK_STREAM,0);
+    if(mnListenFd<0)
+    {
+        cerr << "Loop server: could not create the socket: " << strerror(errno) << endl;
+        return false;
+    }
+
+    const int one = 1;
+    setsockopt(mnListenFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+    sockaddr_in address;
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(mPort);
+    if(bind(mnListenFd,(sockaddr*)&address,sizeof(address))<0 || listen(mnListenFd,BACKLOG)<0 ||
+       !SetNonBlocking(mnListenFd))
+    {
+        cerr << "Loop server: could not listen on port " << mPort << ": " << strerror(errno) << endl;
+        close(mnListenFd);
+        mnListenFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void LoopServer::AcceptClient()
+{
+    while(1)
+    {
+        const int fd = accept(mnListenFd,NULL,NULL);
+        if(fd<0)
+            return;
+
+        // The replica belongs to a single client
+        if(mClient.fd>=0 || !SetNonBlocking(fd))
+        {
+            cerr << "Loop server: refused a second client" << endl;
+            close(fd);
+            continue;
+        }
+
+        const int one = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+        mClient.fd = fd;
+        mClient.nSent = 0;
+        cout << "Loop server: client connected" << endl;
+    }
+}
+
+bool LoopServer::Receive()
+{
+    char buffer[65536];
+    while(1)
+    {
+        const ssize_t n = recv(mClient.fd,buffer,sizeof(buffer),0);
+        if(n==0)
+            return false;
+        if(n<0)
+        {
+            if(errno==EINTR)
+                continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                break;
+            return false;
+        }
+        mClient.inbox.append(buffer,n);
+    }
+
+    size_t begin = 0;
+    while(mClient.inbox.size()-begin>=4)
+    {
+        uint32_t length;
+        memcpy(&length,mClient.inbox.data()+begin,4);
+        if(length==0 || length>MAX_MESSAGE)
+            return false;
+        if(mClient.inbox.size()-begin-4<length)
+            break;
+
+        const char type = mClient.inbox[begin+4];
+        const char* pData = mClient.inbox.data()+begin+5;
+        bool bOk = false;
+        if(type==HELLO)
+            bOk = HandleHello(pData,length-1);
+        // Nothing but HELLO before the loop closing exists
+        else if(type==KEYFRAME)
+            bOk = mpLoopCloser && HandleKeyFrame(pData,length-1);
+        else if(type==UPDATE)
+            bOk = mpLoopCloser && HandleUpdate(pData,length-1);
+        if(!bOk)
+        {
+            cerr << "Loop server: corrupt message from the client" << endl;
+            return false;
+        }
+
+        begin += 4+length;
+    }
+    mClient.inbox.erase(0,begin);
+
+    return true;
+}
+
+bool LoopServer::Send()
+{
+    while(mClient.nSent<mClient.outbox.size())
+    {
+        const ssize_t n = send(mClient.fd,mClient.outbox.data()+mClient.nSent,mClient.outbox.size()-mClient.nSent,
+                               MSG_NOSIGNAL);
+        if(n>=0)
+        {
+            mClient.nSent += n;
+            continue;
+        }
+        if(errno==EINTR)
+            continue;
+        // The rest goes with the next poll
+        return errno==EAGAIN || errno==EWOULDBLOCK;
+    }
+
+    mClient.outbox.clear();
+    mClient.nSent = 0;
+    return true;
+}
+
+void LoopServer::CloseClient()
+{
+    if(mClient.fd<0)
+        return;
+
+    close(mClient.fd);
+    mClient.fd = -1;
+    mClient.inbox.clear();
+    mClient.outbox.clear();
+    mClient.nSent = 0;
+    cout << "Loop server: client disconnected" << endl;
+}
+
+bool LoopServer::HandleHello(const char* pData, const size_t nSize)
+{
+    Reader r(pData,nSize);
+    uint32_t nVocabularySize;
+    uint8_t bFixScale;
+    float calibration[10];
+    if(!r.Get(nVocabularySize) || !r.Get(bFixScale) || !r.Get(calibration) || !r.AtEnd())
+        return false;
+
+    if(nVocabularySize!=mpVocabulary->size())
+    {
+        cerr << "Loop server: the client uses another vocabulary" << endl;
+        return false;
+    }
+    if(mpLoopCloser && mbFixScale!=(bFixScale!=0))
+    {
+        cerr << "Loop server: the client has another sensor than the first one, restart the server" << endl;
+        return false;
+    }
+
+    if(!mpLoopCloser)
+    {
+        mbFixScale = bFixScale!=0;
+        mpLoopCloser = new LoopClosing(mpMap,mpKeyFrameDB,mpVocabulary,mbFixScale,mnMaxGBAKeyFrames,mfGBATimeBudget,
+                                       mnThreads);
+        mpLoopCloser->AttachThread();
+    }
+
+    // The replica starts over
+    mpLoopCloser->WaitForGBA();
+    mpLoopCloser->ResetQueue();
+    {
+        unique_lock<mutex> lock(mMutexPending);
+        mnResets++;
+        mPending.clear();
+    }
+    mpKeyFrameDB->clear();
+    mpMap->clear();
+    mpMap->mChangeLog.Take(mnChangeLogConsumer,mvPointChanges);
+
+    FrameContext &context = mpMap->mFrameContext;
+    context.fx = calibration[0];
+    context.fy = calibration[1];
+    context.cx = calibration[2];
+    context.cy = calibration[3];
+    context.invfx = 1.0f/context.fx;
+    context.invfy = 1.0f/context.fy;
+    context.mnMinX = calibration[4];
+    context.mnMaxX = calibration[5];
+    context.mnMinY = calibration[6];
+    context.mnMaxY = calibration[7];
+    context.mfGridElementWidthInv = calibration[8];
+    context.mfGridElementHeightInv = calibration[9];
+    context.mbInitialComputations = false;
+
+    {
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+        mnEpochBase = mpMap->GetLastBigChangeIdx();
+    }
+
+    cout << "Loop server: new map from the client" << endl;
+    return true;
+}
+
+bool LoopServer::HandleKeyFrame(const char* pData, const size_t nSize)
+{
+    Reader r(pData,nSize);
+    uint32_t nEpoch;
+    uint64_t nMapId;
+    uint8_t bHasParent;
+    cv::Mat Tpw;
+    const char* pBlock;
+    uint32_t nBlockSize;
+    if(!r.Get(nEpoch) || !r.Get(nMapId) || !r.Get(bHasParent) || (bHasParent && !r.GetPose(Tpw)) ||
+       !r.GetBlock(pBlock,nBlockSize))
+        return false;
+
+    Frame F;
+    uint64_t nId;
+    int64_t nParentId;
+    if(!MapSerializer::DecodeKeyFrame(pBlock,nBlockSize,mpVocabulary,mpMap->mFrameContext,F,nId,nParentId))
+        return false;
+
+    uint32_t N;
+    if(!r.Get(N) || N!=static_cast<uint32_t>(F.N))
+        return false;
+    vector<int64_t> vMPIds(N);
+    for(uint32_t i=0; i<N; i++)
+    {
+        if(!r.Get(vMPIds[i]))
+            return false;
+    }
+
+    uint32_t nNewPoints;
+    if(!r.Get(nNewPoints))
+        return false;
+    vector<MapSerializer::MapPointData> vNewPoints(nNewPoints);
+    for(uint32_t i=0; i<nNewPoints; i++)
+    {
+        if(!r.GetBlock(pBlock,nBlockSize) || !MapSerializer::DecodeMapPoint(pBlock,nBlockSize,vNewPoints[i]))
+            return false;
+    }
+    if(!r.AtEnd())
+        return false;
+
+    if(mpMap->GetKeyFrame(nId))
+        return true;
+
+    KeyFrame* pKF;
+    {
+        // Get Map Mutex
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+
+        KeyFrame* pParent = nParentId>=0 ? mpMap->GetKeyFrame(nParentId) : static_cast<KeyFrame*>(NULL);
+        if(pParent && pParent->isBad())
+            pParent = static_cast<KeyFrame*>(NULL);
+
+        pKF = new KeyFrame(F,mpMap,mpKeyFrameDB);
+        pKF->mnId = nId;
+        pKF->mnMapId = nMapId;
+
+        // The client did not apply a correction yet which the parent already got here
+        const cv::Mat Tcw = F.mTcw.clone();
+        if(nEpoch<GetEpoch() && pParent && bHasParent)
+            pKF->SetPose(Tcw*InversePose(Tpw)*pParent->GetPose());
+        // Takes the new map points along, Twc here times Tcw of the client
+        const cv::Mat T = pKF->GetPoseInverse()*Tcw;
+        const cv::Mat R = T.rowRange(0,3).colRange(0,3);
+        const cv::Mat t = T.rowRange(0,3).col(3);
+
+        // A keyframe whose parent is not here gets the best covisible one
+        if(nParentId<0)
+            mpMap->AddOrigin(pKF);
+        else if(pParent)
+            pKF->ChangeParent(pParent);
+        mpMap->AddKeyFrame(pKF);
+
+        vector<MapPoint*> vpNewMPs;
+        for(size_t i=0; i<vNewPoints.size(); i++)
+        {
+            MapSerializer::MapPointData &data = vNewPoints[i];
+            if(mpMap->GetMapPoint(data.nId))
+                continue;
+
+            const cv::Mat X = (cv::Mat_<float>(3,1) << data.geometry[0], data.geometry[1], data.geometry[2]);
+            const cv::Mat Pos = R*X+t;
+            data.geometry[0] = Pos.at<float>(0);
+            data.geometry[1] = Pos.at<float>(1);
+            data.geometry[2] = Pos.at<float>(2);
+
+            KeyFrame* pRefKF = mpMap->GetKeyFrame(data.nRefKFId);
+            if(!pRefKF || pRefKF->isBad())
+                pRefKF = pKF;
+            MapPoint* pMP = MapSerializer::CreateMapPoint(data,pRefKF,mpMap);
+            mpMap->AddMapPoint(pMP);
+            vpNewMPs.push_back(pMP);
+
+            // Keyframes sent before the point was triangulated do not list it
+            for(size_t j=0; j<data.vObservations.size(); j++)
+            {
+                KeyFrame* pKFi = mpMap->GetKeyFrame(data.vObservations[j].first);
+                const size_t idx = data.vObservations[j].second;
+                if(pKFi && pKFi!=pKF && !pKFi->isBad() && idx<static_cast<size_t>(pKFi->N) && !pKFi->GetMapPoint(idx))
+                {
+                    pKFi->AddMapPoint(pMP,idx);
+                    pMP->AddObservation(pKFi,idx);
+                }
+            }
+        }
+
+        for(uint32_t i=0; i<N; i++)
+        {
+            if(vMPIds[i]<0)
+                continue;
+            MapPoint* pMP = mpMap->GetMapPoint(vMPIds[i]);
+            if(!pMP || pMP->isBad() || pMP->IsInKeyFrame(pKF))
+                continue;
+            pKF->AddMapPoint(pMP,i);
+            pMP->AddObservation(pKF,i);
+        }
+
+        for(size_t i=0; i<vpNewMPs.size(); i++)
+            vpNewMPs[i]->UpdateNormalAndDepth();
+
+        pKF->UpdateConnections();
+    }
+
+    mpLoopCloser->InsertKeyFrame(pKF);
+    return true;
+}
+
+bool LoopServer::HandleUpdate(const char* pData, const size_t nSize)
+{
+    Reader r(pData,nSize);
+    uint32_t nEpoch, n;
+    if(!r.Get(nEpoch))
+        return false;
+
+    // Get Map Mutex
+    MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+
+    // The poses and positions of before a correction would undo it
+    const bool bStale = nEpoch<GetEpoch();
+
+    if(!r.Get(n))
+        return false;
+    for(uint32_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        cv::Mat Tcw;
+        if(!r.Get(nId) || !r.GetPose(Tcw))
+            return false;
+        KeyFrame* pKF = bStale ? static_cast<KeyFrame*>(NULL) : mpMap->GetKeyFrame(nId);
+        if(pKF && !pKF->isBad())
+            pKF->SetPose(Tcw);
+    }
+
+    if(!r.Get(n))
+        return false;
+    for(uint32_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        float pos[3];
+        if(!r.Get(nId) || !r.Get(pos))
+            return false;
+        MapPoint* pMP = bStale ? static_cast<MapPoint*>(NULL) : mpMap->GetMapPoint(nId);
+        if(pMP && !pMP->isBad())
+        {
+            pMP->SetWorldPos(Eigen::Vector3f(pos[0],pos[1],pos[2]));
+            pMP->UpdateNormalAndDepth();
+        }
+    }
+
+    // Culled by the client whatever the epoch
+    if(!r.Get(n))
+        return false;
+    for(uint32_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        if(!r.Get(nId))
+            return false;
+        KeyFrame* pKF = mpMap->GetKeyFrame(nId);
+        if(pKF && !pKF->isBad() && !mpMap->IsOrigin(pKF))
+            pKF->SetBadFlag();
+    }
+
+    if(!r.Get(n))
+        return false;
+    for(uint32_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        if(!r.Get(nId))
+            return false;
+        MapPoint* pMP = mpMap->GetMapPoint(nId);
+        if(pMP && !pMP->isBad())
+            pMP->SetBadFlag();
+    }
+
+    return r.AtEnd();
+}
+
+unsigned int LoopServer::GetEpoch()
+{
+    return mpMap->GetLastBigChangeIdx()-mnEpochBase;
+}
+
+void LoopServer::OnMapEvent(const MapEvents::Event &event)
+{
+    unique_lock<mutex> lock(mMutexPending);
+    if(event.type==MapEvents::RESET)
+    {
+        mnResetsSeen++;
+        return;
+    }
+    if(mnResetsSeen!=mnResets)
+        return;
+    if(event.type!=MapEvents::LOOP_CORRECTED && event.type!=MapEvents::GLOBAL_BA_FINISHED)
+        return;
+
+    const size_t offset = BeginMessage(mPending,CORRECTION);
+    Put<uint8_t>(mPending,event.type==MapEvents::LOOP_CORRECTED ? LOOP : GLOBAL_BA);
+    Put<uint64_t>(mPending,event.nKFId);
+    Put<uint64_t>(mPending,event.nMatchedKFId);
+    Put<uint64_t>(mPending,event.nLastKFId);
+    Put<uint32_t>(mPending,event.vCorrections.size());
+    for(size_t i=0; i<event.vCorrections.size(); i++)
+    {
+        const MapEvents::KeyFrameCorrection &correction = event.vCorrections[i];
+        Put<uint64_t>(mPending,correction.nKFId);
+        for(int j=0; j<3; j++)
+        {
+            for(int k=0; k<4; k++)
+                Put<float>(mPending,correction.Tcorrection(j,k));
+        }
+    }
+    EndMessage(mPending,offset);
+}
+
+void LoopServer::CollectFusions()
+{
+    if(!mpMap->mChangeLog.Take(mnChangeLogConsumer,mvPointChanges))
+        return;
+
+    vector<pair<uint64_t,uint64_t> > vFusions;
+    for(size_t i=0; i<mvPointChanges.size(); i++)
+    {
+        const MapChangeLog::PointChange &change = mvPointChanges[i];
+        if(change.bErased && change.nReplacedBy>=0)
+            vFusions.push_back(make_pair(change.nId,change.nReplacedBy));
+    }
+    if(vFusions.empty() || mClient.fd<0)
+        return;
+
+    unique_lock<mutex> lock(mMutexPending);
+    const size_t offset = BeginMessage(mPending,FUSIONS);
+    Put<uint32_t>(mPending,vFusions.size());
+    for(size_t i=0; i<vFusions.size(); i++)
+    {
+        Put<uint64_t>(mPending,vFusions[i].first);
+        Put<uint64_t>(mPending,vFusions[i].second);
+    }
+    EndMessage(mPending,offset);
+}
+
+void LoopServer::RequestFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinishRequested = true;
+}
+
+bool LoopServer::CheckFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinishRequested;
+}
+
+void LoopServer::SetFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinished = true;
+}
+
+bool LoopServer::isFinished()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinished;
+}
+
+} //namespace ORB_SLAM
@@ -21,18 +21,23 @@
 #include "Map.h"
 
 #include<mutex>
+#include<algorithm>
 
 namespace ORB_SLAM2
 {
 
-Map::Map():mnMaxKFid(0),mnBigChangeIdx(0)
+Map::Map():mnNextKeyFrameId(0),mnNextMapPointId(0),mnNextMapId(0),mnSettingsHash(0),mnMaxKFid(0),mnBigChangeIdx(0),mnUpdateVersion(0)
 {
 }
 
 void Map::AddKeyFrame(KeyFrame *pKF)
 {
     unique_lock<mutex> lock(mMutexMap);
-    mspKeyFrames.insert(pKF);
+    if(mKeyFrames.Insert(pKF))
+    {
+        mChangeLog.Insert(pKF);
+        mEvents.KeyFrameAdded(pKF);
+    }
     if(pKF->mnId>mnMaxKFid)
         mnMaxKFid=pKF->mnId;
 }
@@ -40,25 +45,66 @@ void Map::AddKeyFrame(KeyFrame *pKF)
 void Map::AddMapPoint(MapPoint *pMP)
 {
     unique_lock<mutex> lock(mMutexMap);
-    mspMapPoints.insert(pMP);
+    // Under the lock, so an erase can not come in between
+    if(mMapPoints.Insert(pMP))
+    {
+        mPointIndex.Insert(pMP);
+        mChangeLog.Insert(pMP);
+    }
 }
 
-void Map::EraseMapPoint(MapPoint *pMP)
+bool Map::EraseMapPoint(MapPoint *pMP)
 {
+    // The point locks its own mutexes, not under mMutexMap
+    MapPoint* pReplacedBy = mChangeLog.IsEnabled() ? pMP->GetReplaced() : static_cast<MapPoint*>(NULL);
+
+    unique_lock<mutex> lock(mMutexMap);
+
+    // The MapPoint itself is deleted by mReclaimer once no thread can use it anymore
+    if(!mMapPoints.Erase(pMP))
+        return false;
+    mPointIndex.Erase(pMP);
+    mChangeLog.Erase(pMP,pReplacedBy);
+    return true;
+}
+
+void Map::EraseMapPoints(const vector<MapPoint*> &vpMPs, vector<MapPoint*> &vpErased)
+{
+    vpErased.clear();
+    vpErased.reserve(vpMPs.size());
+
+    // The points lock their own mutexes, not under mMutexMap
+    vector<MapPoint*> vpReplacedBy(vpMPs.size(),static_cast<MapPoint*>(NULL));
+    if(mChangeLog.IsEnabled())
+    {
+        for(size_t i=0; i<vpMPs.size(); i++)
+            vpReplacedBy[i] = vpMPs[i]->GetReplaced();
+    }
+
     unique_lock<mutex> lock(mMutexMap);
-    mspMapPoints.erase(pMP);
 
-    // TODO: This only erase the pointer.
-    // Delete the MapPoint
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        MapPoint* pMP = vpMPs[i];
+        if(!mMapPoints.Erase(pMP))
+            continue;
+        mPointIndex.Erase(pMP);
+        mChangeLog.Erase(pMP,vpReplacedBy[i]);
+        vpErased.push_back(pMP);
+    }
 }
 
-void Map::EraseKeyFrame(KeyFrame *pKF)
+bool Map::EraseKeyFrame(KeyFrame *pKF)
 {
     unique_lock<mutex> lock(mMutexMap);
-    mspKeyFrames.erase(pKF);
 
-    // TODO: This only erase the pointer.
-    // Delete the MapPoint
+    // The features of the KeyFrame are released by mReclaimer once no thread can use them anymore
+    if(!mKeyFrames.Erase(pKF))
+        return false;
+    mChangeLog.Erase(pKF);
+    mKeyFrameDepths.Erase(pKF->mnId);
+    mEvents.KeyFrameErased(pKF);
+    return true;
 }
 
 void Map::SetReferenceMapPoints(const vector<MapPoint *> &vpMPs)
@@ -82,25 +128,61 @@ int Map::GetLastBigChangeIdx()
 vector<KeyFrame*> Map::GetAllKeyFrames()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return vector<KeyFrame*>(mspKeyFrames.begin(),mspKeyFrames.end());
+    return mKeyFrames.GetItems();
 }
 
 vector<MapPoint*> Map::GetAllMapPoints()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return vector<MapPoint*>(mspMapPoints.begin(),mspMapPoints.end());
+    return mMapPoints.GetItems();
+}
+
+IndexedStore<KeyFrame>::Snapshot Map::GetKeyFramesSnapshot()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return mKeyFrames.GetSnapshot();
+}
+
+IndexedStore<MapPoint>::Snapshot Map::GetMapPointsSnapshot()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return mMapPoints.GetSnapshot();
+}
+
+KeyFrame* Map::GetKeyFrame(const long unsigned int nId)
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return mKeyFrames.Find(nId);
+}
+
+MapPoint* Map::GetMapPoint(const long unsigned int nId)
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return mMapPoints.Find(nId);
 }
 
 long unsigned int Map::MapPointsInMap()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return mspMapPoints.size();
+    return mMapPoints.Size();
 }
 
 long unsigned int Map::KeyFramesInMap()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return mspKeyFrames.size();
+    return mKeyFrames.Size();
+}
+
+long unsigned int Map::KeyFramesInMap(const long unsigned int nMapId)
+{
+    unique_lock<mutex> lock(mMutexMap);
+    long unsigned int nKFs = 0;
+    for(IndexedStore<KeyFrame>::const_iterator sit=mKeyFrames.begin(), send=mKeyFrames.end(); sit!=send; sit++)
+    {
+        if((*sit)->mnMapId==nMapId)
+            nKFs++;
+    }
+    return nKFs;
 }
 
 vector<MapPoint*> Map::GetReferenceMapPoints()
@@ -115,16 +197,93 @@ long unsigned int Map::GetMaxKFid()
     return mnMaxKFid;
 }
 
+void Map::AddOrigin(KeyFrame* pKF)
+{
+    unique_lock<mutex> lock(mMutexMap);
+    mvpKeyFrameOrigins.push_back(pKF);
+}
+
+void Map::EraseOrigin(KeyFrame* pKF)
+{
+    unique_lock<mutex> lock(mMutexMap);
+    vector<KeyFrame*>::iterator vit = find(mvpKeyFrameOrigins.begin(),mvpKeyFrameOrigins.end(),pKF);
+    if(vit!=mvpKeyFrameOrigins.end())
+        mvpKeyFrameOrigins.erase(vit);
+}
+
+bool Map::IsOrigin(KeyFrame* pKF)
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return find(mvpKeyFrameOrigins.begin(),mvpKeyFrameOrigins.end(),pKF)!=mvpKeyFrameOrigins.end();
+}
+
+vector<KeyFrame*> Map::GetOrigins()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return mvpKeyFrameOrigins;
+}
+
+void Map::MergeMap(const long unsigned int nMapId, KeyFrame* pKF)
+{
+    const long unsigned int nIntoId = pKF->mnMapId;
+    if(nMapId==nIntoId)
+        return;
+
+    KeyFrame* pOrigin = static_cast<KeyFrame*>(NULL);
+    {
+        unique_lock<mutex> lock(mMutexMap);
+        for(vector<KeyFrame*>::iterator vit=mvpKeyFrameOrigins.begin(); vit!=mvpKeyFrameOrigins.end(); vit++)
+        {
+            if((*vit)->mnMapId==nMapId)
+            {
+                pOrigin = *vit;
+                mvpKeyFrameOrigins.erase(vit);
+                break;
+            }
+        }
+
+        for(IndexedStore<KeyFrame>::const_iterator sit=mKeyFrames.begin(), send=mKeyFrames.end(); sit!=send; sit++)
+        {
+            if((*sit)->mnMapId==nMapId)
+                (*sit)->mnMapId = nIntoId;
+        }
+    }
+
+    // The keyframe locks its connections, not under mMutexMap
+    if(pOrigin)
+        pOrigin->ChangeParent(pKF);
+}
+
 void Map::clear()
 {
-    for(set<MapPoint*>::iterator sit=mspMapPoints.begin(), send=mspMapPoints.end(); sit!=send; sit++)
+    mPointIndex.Clear();
+    mNeighborhoods.Clear();
+    mChangeLog.Clear();
+    mKeyFrameDepths.Clear();
+    mEvents.Reset();
+
+    for(IndexedStore<MapPoint>::const_iterator sit=mMapPoints.begin(), send=mMapPoints.end(); sit!=send; sit++)
         delete *sit;
 
-    for(set<KeyFrame*>::iterator sit=mspKeyFrames.begin(), send=mspKeyFrames.end(); sit!=send; sit++)
+    for(IndexedStore<KeyFrame>::const_iterator sit=mKeyFrames.begin(), send=mKeyFrames.end(); sit!=send; sit++)
         delete *sit;
 
-    mspMapPoints.clear();
-    mspKeyFrames.clear();
+    mReclaimer.Clear();
+
+    mMapPoints.Clear();
+    mKeyFrames.Clear();
+    mnMaxKFid = 0;
+    mvpReferenceMapPoints.clear();
+    mvpKeyFrameOrigins.clear();
+}
+
+void Map::Release()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    mPointIndex.Clear();
+    mNeighborhoods.Clear();
+    mMapPoints.Clear();
+    mKeyFrames.Clear();
     mnMaxKFid = 0;
     mvpReferenceMapPoints.clear();
     mvpKeyFrameOrigins.clear();
@@ -0,0 +1,179 @@
+#include "MapChangeLog.h"
+
+#include "KeyFrame.h"
+#include "MapPoint.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+const size_t MapChangeLog::MAX_CHANGES;
+
+MapChangeLog::MapChangeLog(): mbEnabled(false), mbKeyFramesEnabled(false)
+{
+}
+
+int MapChangeLog::AddConsumer(const bool bKeyFrames)
+{
+    unique_lock<mutex> lock(mMutex);
+    Consumer consumer;
+    consumer.bKeyFrames = bKeyFrames;
+    consumer.bRebuild = true;
+    mvConsumers.push_back(consumer);
+    mbEnabled = true;
+    if(bKeyFrames)
+        mbKeyFramesEnabled = true;
+    return mvConsumers.size()-1;
+}
+
+void MapChangeLog::Insert(MapPoint* pMP)
+{
+    if(!IsEnabled())
+        return;
+
+    PointChange change;
+    change.nId = pMP->mnId;
+    pMP->GetWorldPos(change.pos);
+    change.bErased = false;
+    change.nReplacedBy = -1;
+    Add(change);
+}
+
+void MapChangeLog::Erase(MapPoint* pMP, MapPoint* pReplacedBy)
+{
+    if(!IsEnabled())
+        return;
+
+    PointChange change;
+    change.nId = pMP->mnId;
+    change.pos.setZero();
+    change.bErased = true;
+    change.nReplacedBy = pReplacedBy ? static_cast<long>(pReplacedBy->mnId) : -1;
+    Add(change);
+}
+
+void MapChangeLog::Update(MapPoint* pMP, const Eigen::Vector3f &Pos)
+{
+    if(!IsEnabled())
+        return;
+
+    PointChange change;
+    change.nId = pMP->mnId;
+    change.pos = Pos;
+    change.bErased = false;
+    change.nReplacedBy = -1;
+    Add(change);
+}
+
+void MapChangeLog::Insert(KeyFrame* pKF)
+{
+    if(!IsKeyFramesEnabled())
+        return;
+
+    Eigen::Matrix3f Rcw;
+    Eigen::Vector3f tcw;
+    pKF->GetPose(Rcw,tcw);
+    Update(pKF,Rcw,-Rcw.transpose()*tcw);
+}
+
+void MapChangeLog::Erase(KeyFrame* pKF)
+{
+    if(!IsKeyFramesEnabled())
+        return;
+
+    KeyFrameChange change;
+    change.nId = pKF->mnId;
+    change.qwc.setIdentity();
+    change.Ow.setZero();
+    change.bErased = true;
+    Add(change);
+}
+
+void MapChangeLog::Update(KeyFrame* pKF, const Eigen::Matrix3f &Rcw, const Eigen::Vector3f &Ow)
+{
+    if(!IsKeyFramesEnabled())
+        return;
+
+    KeyFrameChange change;
+    change.nId = pKF->mnId;
+    change.qwc = Eigen::Quaternionf(Rcw.transpose());
+    change.Ow = Ow;
+    change.bErased = false;
+    Add(change);
+}
+
+void MapChangeLog::Clear()
+{
+    unique_lock<mutex> lock(mMutex);
+    for(size_t i=0; i<mvConsumers.size(); i++)
+    {
+        mvConsumers[i].vPoints.clear();
+        mvConsumers[i].vKeyFrames.clear();
+        mvConsumers[i].bRebuild = true;
+    }
+}
+
+bool MapChangeLog::Take(const int nConsumer, vector<PointChange> &vChanges)
+{
+    vector<KeyFrameChange> vKeyFrameChanges;
+    return Take(nConsumer,vChanges,vKeyFrameChanges);
+}
+
+bool MapChangeLog::Take(const int nConsumer, vector<PointChange> &vChanges, vector<KeyFrameChange> &vKeyFrameChanges)
+{
+    vChanges.clear();
+    vKeyFrameChanges.clear();
+
+    unique_lock<mutex> lock(mMutex);
+    Consumer &consumer = mvConsumers[nConsumer];
+    consumer.vPoints.swap(vChanges);
+    consumer.vKeyFrames.swap(vKeyFrameChanges);
+    const bool bRebuild = consumer.bRebuild;
+    consumer.bRebuild = false;
+    if(bRebuild)
+    {
+        vChanges.clear();
+        vKeyFrameChanges.clear();
+    }
+    return !bRebuild;
+}
+
+bool MapChangeLog::Overflow(Consumer &consumer)
+{
+    if(consumer.vPoints.size()+consumer.vKeyFrames.size()<MAX_CHANGES)
+        return false;
+
+    consumer.vPoints.clear();
+    consumer.vPoints.shrink_to_fit();
+    consumer.vKeyFrames.clear();
+    consumer.vKeyFrames.shrink_to_fit();
+    consumer.bRebuild = true;
+    return true;
+}
+
+void MapChangeLog::Add(const PointChange &change)
+{
+    unique_lock<mutex> lock(mMutex);
+    for(size_t i=0; i<mvConsumers.size(); i++)
+    {
+        Consumer &consumer = mvConsumers[i];
+        if(consumer.bRebuild || Overflow(consumer))
+            continue;
+        consumer.vPoints.push_back(change);
+    }
+}
+
+void MapChangeLog::Add(const KeyFrameChange &change)
+{
+    unique_lock<mutex> lock(mMutex);
+    for(size_t i=0; i<mvConsumers.size(); i++)
+    {
+        Consumer &consumer = mvConsumers[i];
+        if(!consumer.bKeyFrames || consumer.bRebuild || Overflow(consumer))
+            continue;
+        consumer.vKeyFrames.push_back(change);
+    }
+}
+
+} //namespace ORB_SLAM
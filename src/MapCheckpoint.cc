@@ -0,0 +1,328 @@
+#include "MapCheckpoint.h"
+
+#include "KeyFrame.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "MapSerializer.h"
+#include "ThreadConfig.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Replaces filename by the complete file temporary
+bool Commit(const string &temporary, const string &filename)
+{
+    if(rename(temporary.c_str(),filename.c_str())!=0)
+    {
+        cerr << "Could not rename " << temporary << " to " << filename << endl;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+}
+
+MapCheckpointer::MapCheckpointer(Map* pMap, const ORBVocabulary* pVoc, const string &prefix, const float fPeriod,
+                                 const int nMaxDeltas):
+    mpMap(pMap), mpVocabulary(pVoc), mPrefix(prefix), mfPeriod(fPeriod), mnMaxDeltas(nMaxDeltas),
+    mnGeneration(-1), mnDeltas(0), mbRebuild(true), mnChangeLogConsumer(-1), mbFinish(false), mbLast(false)
+{
+    // The checkpoint of an earlier run stays until this one has a base
+    ReadManifest(mPrefix,mnGeneration,mnDeltas);
+    mThread = thread(&MapCheckpointer::Run,this);
+}
+
+MapCheckpointer::~MapCheckpointer()
+{
+    Stop();
+}
+
+void MapCheckpointer::Pause()
+{
+    mMutexCheckpoint.lock();
+}
+
+void MapCheckpointer::Release()
+{
+    mMutexCheckpoint.unlock();
+}
+
+void MapCheckpointer::Finish()
+{
+    StopThread(true);
+}
+
+void MapCheckpointer::Stop()
+{
+    StopThread(false);
+}
+
+void MapCheckpointer::StopThread(const bool bLast)
+{
+    {
+        unique_lock<mutex> lock(mMutexFinish);
+        if(!mbFinish)
+            mbLast = bLast;
+        mbFinish = true;
+        mcvFinish.notify_one();
+    }
+    if(mThread.joinable())
+        mThread.join();
+}
+
+string MapCheckpointer::BaseFile(const string &prefix, const int nGeneration)
+{
+    stringstream ss;
+    ss << prefix << "." << nGeneration << ".map";
+    return ss.str();
+}
+
+string MapCheckpointer::DeltaFile(const string &prefix, const int nGeneration, const int nDelta)
+{
+    stringstream ss;
+    ss << prefix << "." << nGeneration << "." << nDelta << ".delta";
+    return ss.str();
+}
+
+bool MapCheckpointer::ReadManifest(const string &prefix, int &nGeneration, int &nDeltas)
+{
+    ifstream f(prefix.c_str());
+    int nG, nD;
+    if(!(f >> nG >> nD) || nG<0 || nD<0)
+        return false;
+    nGeneration = nG;
+    nDeltas = nD;
+    return true;
+}
+
+bool MapCheckpointer::WriteManifest(const int nGeneration, const int nDeltas)
+{
+    const string strTemporary = mPrefix+".tmp";
+    ofstream f(strTemporary.c_str(), ios::trunc);
+    f << nGeneration << " " << nDeltas << endl;
+    f.close();
+    if(!f)
+    {
+        cerr << "Failed to write the checkpoint manifest " << strTemporary << endl;
+        return false;
+    }
+    return Commit(strTemporary,mPrefix);
+}
+
+void MapCheckpointer::RemoveGeneration(const int nGeneration, const int nDeltas)
+{
+    remove(BaseFile(mPrefix,nGeneration).c_str());
+    for(int i=0; i<nDeltas; i++)
+        remove(DeltaFile(mPrefix,nGeneration,i).c_str());
+}
+
+bool MapCheckpointer::Restore(const string &prefix, const ORBVocabulary* pVoc, const string &outFile)
+{
+    int nGeneration, nDeltas;
+    if(!ReadManifest(prefix,nGeneration,nDeltas))
+    {
+        cerr << "No checkpoint manifest " << prefix << endl;
+        return false;
+    }
+
+    vector<string> vDeltaFiles;
+    for(int i=0; i<nDeltas; i++)
+        vDeltaFiles.push_back(DeltaFile(prefix,nGeneration,i));
+    return MapSerializer::MergeDeltas(BaseFile(prefix,nGeneration),vDeltaFiles,pVoc,outFile);
+}
+
+void MapCheckpointer::Run()
+{
+    Trace::SetThreadName("Checkpoint");
+    ThreadConfig::Apply(ThreadConfig::CHECKPOINT);
+
+    unique_lock<mutex> lock(mMutexFinish);
+    while(!mbFinish)
+    {
+        const chrono::steady_clock::time_point next = chrono::steady_clock::now()+
+                chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<float>(mfPeriod));
+        while(!mbFinish && mcvFinish.wait_until(lock,next)!=cv_status::timeout) {}
+        if(mbFinish)
+            break;
+
+        lock.unlock();
+        Checkpoint();
+        lock.lock();
+    }
+
+    if(mbLast)
+    {
+        lock.unlock();
+        Checkpoint();
+    }
+}
+
+bool MapCheckpointer::Checkpoint()
+{
+    unique_lock<mutex> lock(mMutexCheckpoint);
+    TRACE_SCOPE("Checkpoint");
+
+    if(mnChangeLogConsumer<0)
+        mnChangeLogConsumer = mpMap->mChangeLog.AddConsumer();
+
+    // The objects of the snapshots are not freed before the slot is released
+    const int nReclaimerId = mpMap->mReclaimer.RegisterThread();
+    const bool bOk = Write();
+    mpMap->mReclaimer.UnregisterThread(nReclaimerId);
+
+    // The changes are taken, only a base has them again
+    if(!bOk)
+        mbRebuild = true;
+    return bOk;
+}
+
+bool MapCheckpointer::Write()
+{
+    MapSerializer::CheckpointDelta delta;
+    vector<KeyFrame*> vpKFs;
+    vector<MapPoint*> vpMPs;
+    bool bBase;
+
+    {
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+
+        // Changes after this point are in the next checkpoint
+        const bool bChanges = mpMap->mChangeLog.Take(mnChangeLogConsumer,mvPointChanges);
+        const IndexedStore<KeyFrame>::Snapshot pKFs = mpMap->GetKeyFramesSnapshot();
+        const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+
+        // Nothing to keep after a reset, the checkpoint before stays until there is a map again
+        if(pKFs->empty())
+            return false;
+
+        bBase = mbRebuild || !bChanges || mnDeltas>mnMaxDeltas;
+
+        unordered_set<unsigned long> sMoved;
+        if(!bBase)
+        {
+            for(size_t i=0; i<mvPointChanges.size(); i++)
+            {
+                if(!mvPointChanges[i].bErased)
+                    sMoved.insert(mvPointChanges[i].nId);
+            }
+        }
+
+        // The points observed by keyframes whose links changed are written again
+        unordered_set<MapPoint*> spObserved;
+        unordered_map<unsigned long,KeyFrameStamp> mKeyFrames;
+        mKeyFrames.reserve(pKFs->size());
+        for(size_t i=0; i<pKFs->size(); i++)
+        {
+            KeyFrame* pKF = (*pKFs)[i];
+            if(pKF->isBad())
+                continue;
+
+            KeyFrameStamp &stamp = mKeyFrames[pKF->mnId];
+            stamp.nChangeIdx = pKF->GetChangeIdx();
+            stamp.nPoseEpoch = pKF->mnPoseEpoch;
+
+            unordered_map<unsigned long,KeyFrameStamp>::const_iterator it = mmKeyFrames.find(pKF->mnId);
+            const bool bNew = bBase || it==mmKeyFrames.end();
+            if(!bBase && (bNew || it->second.nChangeIdx!=stamp.nChangeIdx))
+            {
+                vpKFs.push_back(pKF);
+                const KeyFrame::MapPointMatchesSnapshot pMatches = pKF->GetMapPointMatchesSnapshot();
+                for(size_t j=0; j<pMatches->size(); j++)
+                {
+                    if((*pMatches)[j])
+                        spObserved.insert((*pMatches)[j]);
+                }
+            }
+            if(bNew || it->second.nPoseEpoch!=stamp.nPoseEpoch)
+                MapSerializer::AddPose(delta,pKF);
+        }
+
+        unordered_set<unsigned long> sMapPoints;
+        sMapPoints.reserve(pMPs->size());
+        for(size_t i=0; i<pMPs->size(); i++)
+        {
+            MapPoint* pMP = (*pMPs)[i];
+            if(pMP->isBad())
+                continue;
+
+            sMapPoints.insert(pMP->mnId);
+            const bool bNew = bBase || !msMapPoints.count(pMP->mnId);
+            if(!bBase && (bNew || spObserved.count(pMP)))
+                vpMPs.push_back(pMP);
+            if(bNew || sMoved.count(pMP->mnId))
+                MapSerializer::AddGeometry(delta,pMP);
+        }
+
+        if(!bBase)
+        {
+            for(unordered_map<unsigned long,KeyFrameStamp>::const_iterator it=mmKeyFrames.begin(); it!=mmKeyFrames.end(); it++)
+            {
+                if(!mKeyFrames.count(it->first))
+                    delta.vErasedKeyFrames.push_back(it->first);
+            }
+            for(unordered_set<unsigned long>::const_iterator it=msMapPoints.begin(); it!=msMapPoints.end(); it++)
+            {
+                if(!sMapPoints.count(*it))
+                    delta.vErasedMapPoints.push_back(*it);
+            }
+        }
+
+        mmKeyFrames.swap(mKeyFrames);
+        msMapPoints.swap(sMapPoints);
+    }
+
+    // Objects which turned bad since are erased by the next delta
+    int nGeneration = mnGeneration;
+    int nDelta = mnDeltas;
+    if(bBase)
+    {
+        nGeneration = mnGeneration+1;
+        nDelta = 0;
+        const string strBase = BaseFile(mPrefix,nGeneration);
+        if(!MapSerializer::Save(strBase+".tmp",mpMap,mpVocabulary,static_cast<ThreadPool*>(NULL)) ||
+           !Commit(strBase+".tmp",strBase))
+            return false;
+    }
+    else
+    {
+        for(size_t i=0; i<vpKFs.size(); i++)
+        {
+            if(vpKFs[i]->isBad())
+                continue;
+            delta.vKeyFrameBlocks.push_back(vector<char>());
+            MapSerializer::EncodeKeyFrame(vpKFs[i],delta.vKeyFrameBlocks.back());
+        }
+        for(size_t i=0; i<vpMPs.size(); i++)
+        {
+            if(vpMPs[i]->isBad())
+                continue;
+            delta.vMapPointBlocks.push_back(vector<char>());
+            MapSerializer::EncodeMapPoint(vpMPs[i],delta.vMapPointBlocks.back());
+        }
+    }
+
+    const string strDelta = DeltaFile(mPrefix,nGeneration,nDelta);
+    if(!MapSerializer::SaveDelta(strDelta+".tmp",delta,mpMap,mpVocabulary) || !Commit(strDelta+".tmp",strDelta) ||
+       !WriteManifest(nGeneration,nDelta+1))
+        return false;
+
+    if(bBase && mnGeneration>=0)
+        RemoveGeneration(mnGeneration,mnDeltas);
+    mnGeneration = nGeneration;
+    mnDeltas = nDelta+1;
+    mbRebuild = false;
+    return true;
+}
+
+} //namespace ORB_SLAM
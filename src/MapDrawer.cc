@@ -23,28 +23,114 @@
 #include "KeyFrame.h"
 #include "Parameter.h"
 #include <pangolin/pangolin.h>
+#include <algorithm>
+#include <iostream>
+#include <limits>
 #include <mutex>
+#include <unordered_set>
 
 namespace ORB_SLAM2
 {
 
+namespace
+{
+// Seconds between two builds of the point clusters of Viewer.LOD
+const double LOD_REBUILD_PERIOD = 2.0; //param
+
+// Grows the buffer to hold at least nVertices, doubling it so growing stays rare. True if it was
+// reallocated, its content is lost then.
+bool ReserveVertices(pangolin::GlBuffer &buffer, const size_t nVertices)
+{
+    if(buffer.bo && buffer.num_elements>=nVertices)
+        return false;
+    const GLuint nCapacity = std::max<size_t>(2*nVertices,1024); //param
+    buffer.Reinitialise(pangolin::GlArrayBuffer,nCapacity,GL_FLOAT,3,GL_DYNAMIC_DRAW);
+    return true;
+}
+
+void UploadVertices(pangolin::GlBuffer &buffer, const vector<float> &vVertices)
+{
+    if(vVertices.empty())
+        return;
+    ReserveVertices(buffer,vVertices.size()/3);
+    buffer.Upload(&vVertices[0],vVertices.size()*sizeof(float));
+}
+
+// Draws the vertices [first, first+count) of buffer
+void DrawVertices(pangolin::GlBuffer &buffer, const GLenum mode, const size_t first, const size_t count)
+{
+    if(count==0)
+        return;
+    buffer.Bind();
+    glVertexPointer(3,GL_FLOAT,0,0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glDrawArrays(mode,first,count);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    buffer.Unbind();
+}
+
+// Draws the vertex ranges of buffer in one call
+void DrawRanges(pangolin::GlBuffer &buffer, const GLenum mode, const vector<int> &vFirsts, const vector<int> &vCounts)
+{
+    if(vFirsts.empty())
+        return;
+    buffer.Bind();
+    glVertexPointer(3,GL_FLOAT,0,0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+#ifdef HAVE_GLES
+    for(size_t i=0; i<vFirsts.size(); i++)
+        glDrawArrays(mode,vFirsts[i],vCounts[i]);
+#else
+    glMultiDrawArrays(mode,&vFirsts[0],&vCounts[0],vFirsts.size());
+#endif
+    glDisableClientState(GL_VERTEX_ARRAY);
+    buffer.Unbind();
+}
 
-MapDrawer::MapDrawer(Map* pMap, const string &strSettingPath):mpMap(pMap)
+// View volume of the matrices the viewer set for this frame
+ViewFrustum CurrentFrustum()
 {
-    cv::FileStorage fSettings(strSettingPath, cv::FileStorage::READ);
+    GLfloat projection[16];
+    GLfloat modelView[16];
+    glGetFloatv(GL_PROJECTION_MATRIX,projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX,modelView);
+    return ViewFrustum(projection,modelView);
+}
+}
+
 
+MapDrawer::MapDrawer(Map* pMap, const Settings &fSettings):mpMap(pMap),
+    mShowRelocalization(ParameterGroup::MAIN, "Show Relocalization"), mnDirtyBegin(0), mnDirtyEnd(0),
+    mnChangeLogConsumer(-1), mnGraphChangeIdx(0), mnGraphBigChangeIdx(0), mnGraphCenterId(0), mbClustersDirty(false)
+{
     mKeyFrameSize = fSettings["Viewer.KeyFrameSize"];
     mKeyFrameLineWidth = fSettings["Viewer.KeyFrameLineWidth"];
     mGraphLineWidth = fSettings["Viewer.GraphLineWidth"];
     mPointSize = fSettings["Viewer.PointSize"];
     mCameraSize = fSettings["Viewer.CameraSize"];
     mCameraLineWidth = fSettings["Viewer.CameraLineWidth"];
-
+    mbRetained = (int)fSettings["Viewer.RetainedMap"];
+    mbLOD = mbRetained && (int)fSettings["Viewer.LOD"];
+    mLODCellSize = fSettings["Viewer.LODCellSize"];
+    mLODDistance = fSettings["Viewer.LODDistance"];
+    mLODMinFraction = fSettings["Viewer.LODMinFraction"];
+    if(mbLOD && mLODCellSize<=0)
+    {
+        cerr << "Viewer.LODCellSize must be positive, the viewer draws the whole map" << endl;
+        mbLOD = false;
+    }
 }
 
 void MapDrawer::DrawMapPoints()
 {
-    const vector<MapPoint*> &vpMPs = mpMap->GetAllMapPoints();
+    if(mbRetained)
+    {
+        DrawMapPointsRetained();
+        return;
+    }
+
+    const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+    const vector<MapPoint*> &vpMPs = *pMPs;
     const vector<MapPoint*> &vpRefMPs = mpMap->GetReferenceMapPoints();
 
     set<MapPoint*> spRefMPs(vpRefMPs.begin(), vpRefMPs.end());
@@ -60,8 +146,9 @@ void MapDrawer::DrawMapPoints()
     {
         if(vpMPs[i]->isBad() || spRefMPs.count(vpMPs[i]))
             continue;
-        cv::Mat pos = vpMPs[i]->GetWorldPos();
-        glVertex3f(pos.at<float>(0),pos.at<float>(1),pos.at<float>(2));
+        Eigen::Vector3f pos;
+        vpMPs[i]->GetWorldPos(pos);
+        glVertex3f(pos(0),pos(1),pos(2));
     }
     glEnd();
 
@@ -73,8 +160,9 @@ void MapDrawer::DrawMapPoints()
     {
         if((*sit)->isBad())
             continue;
-        cv::Mat pos = (*sit)->GetWorldPos();
-        glVertex3f(pos.at<float>(0),pos.at<float>(1),pos.at<float>(2));
+        Eigen::Vector3f pos;
+        (*sit)->GetWorldPos(pos);
+        glVertex3f(pos(0),pos(1),pos(2));
 
     }
 
@@ -83,13 +171,19 @@ void MapDrawer::DrawMapPoints()
 
 void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph)
 {
+    if(mbRetained)
+    {
+        DrawKeyFramesRetained(bDrawKF,bDrawGraph);
+        return;
+    }
+
     const float &w = mKeyFrameSize;
     const float h = w*0.75;
     const float z = w*0.6;
 
-    const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
-    bool showRelocalizaionCandidates =
-        ParameterManager::getParameter<bool>(ParameterGroup::MAIN, "Show Relocalization")->getValue();
+    const IndexedStore<KeyFrame>::Snapshot pKFs = mpMap->GetKeyFramesSnapshot();
+    const vector<KeyFrame*> &vpKFs = *pKFs;
+    bool showRelocalizaionCandidates = mShowRelocalization(false);
 
     if(bDrawKF)
     {
@@ -103,7 +197,7 @@ void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph)
             glMultMatrixf(Twc.ptr<GLfloat>(0));
 
             glLineWidth(mKeyFrameLineWidth);
-            if(pKF->mbIsRelocalizationCandidate && showRelocalizaionCandidates)
+            if(pKF->IsRelocalizationCandidate() && showRelocalizaionCandidates)
             {
                 glColor3f(1.0f,0.0f,0.0f);
             }
@@ -186,6 +280,321 @@ void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph)
     }
 }
 
+void MapDrawer::DrawMapPointsRetained()
+{
+    UpdatePointBuffer();
+
+    const size_t nPoints = mvSlotIds.size();
+    if(nPoints==0)
+        return;
+
+    if(mbLOD)
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if(mbClustersDirty && now-mtClustersBuilt>=std::chrono::duration<double>(LOD_REBUILD_PERIOD))
+        {
+            mPointClusters.Build(mvPointVertices,mLODCellSize);
+            UploadVertices(mClusterBuffer,mPointClusters.GetVertices());
+            mbClustersDirty = false;
+            mtClustersBuilt = now;
+        }
+        mPointClusters.Select(CurrentFrustum(),mLODDistance,mLODMinFraction,mvDrawFirsts,mvDrawCounts);
+        mnDirtyBegin = mnDirtyEnd = 0;
+    }
+    else if(mnDirtyBegin<mnDirtyEnd)
+    {
+        if(ReserveVertices(mPointBuffer,nPoints))
+            mPointBuffer.Upload(&mvPointVertices[0],mvPointVertices.size()*sizeof(float));
+        else
+            mPointBuffer.Upload(&mvPointVertices[3*mnDirtyBegin],3*(mnDirtyEnd-mnDirtyBegin)*sizeof(float),
+                                3*mnDirtyBegin*sizeof(float));
+        mnDirtyBegin = mnDirtyEnd = 0;
+    }
+
+    glPointSize(mPointSize);
+
+    // The reference points first, the black copy at the same depth fails the depth test then
+    const vector<MapPoint*> &vpRefMPs = mpMap->GetReferenceMapPoints();
+    glBegin(GL_POINTS);
+    glColor3f(1.0,0.0,0.0);
+    for(size_t i=0; i<vpRefMPs.size(); i++)
+    {
+        if(vpRefMPs[i]->isBad())
+            continue;
+        Eigen::Vector3f pos;
+        vpRefMPs[i]->GetWorldPos(pos);
+        glVertex3f(pos(0),pos(1),pos(2));
+    }
+    glEnd();
+
+    glColor3f(0.0,0.0,0.0);
+    if(mbLOD)
+        DrawRanges(mClusterBuffer,GL_POINTS,mvDrawFirsts,mvDrawCounts);
+    else
+        DrawVertices(mPointBuffer,GL_POINTS,0,nPoints);
+}
+
+void MapDrawer::UpdatePointBuffer()
+{
+    MapChangeLog &log = mpMap->mChangeLog;
+    if(mnChangeLogConsumer<0)
+        mnChangeLogConsumer = log.AddConsumer();
+
+    if(!log.Take(mnChangeLogConsumer,mvPointChanges))
+    {
+        // Start over from the points of the map, the changes from now on follow in the log
+        mvPointVertices.clear();
+        mvSlotIds.clear();
+        mmPointSlots.clear();
+
+        const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+        const vector<MapPoint*> &vpMPs = *pMPs;
+        mvPointVertices.reserve(3*vpMPs.size());
+        mvSlotIds.reserve(vpMPs.size());
+        for(size_t i=0; i<vpMPs.size(); i++)
+        {
+            if(vpMPs[i]->isBad())
+                continue;
+            Eigen::Vector3f pos;
+            vpMPs[i]->GetWorldPos(pos);
+            SetPointVertex(vpMPs[i]->mnId,pos);
+        }
+
+        // everything is uploaded again
+        mnDirtyBegin = 0;
+        mnDirtyEnd = mvSlotIds.size();
+        mbClustersDirty = true;
+        if(!mbLOD)
+            mPointBuffer.Reinitialise(pangolin::GlArrayBuffer,std::max<size_t>(2*mvSlotIds.size(),1024),GL_FLOAT,3,
+                                      GL_DYNAMIC_DRAW); //param
+        return;
+    }
+
+    if(!mvPointChanges.empty())
+        mbClustersDirty = true;
+
+    for(size_t i=0; i<mvPointChanges.size(); i++)
+    {
+        const MapChangeLog::PointChange &change = mvPointChanges[i];
+        if(change.bErased)
+            RemovePointVertex(change.nId);
+        else
+            SetPointVertex(change.nId,change.pos);
+    }
+}
+
+void MapDrawer::SetPointVertex(const unsigned long nId, const Eigen::Vector3f &pos)
+{
+    std::pair<std::unordered_map<unsigned long, size_t>::iterator, bool> it =
+            mmPointSlots.insert(std::make_pair(nId,mvSlotIds.size()));
+    const size_t slot = it.first->second;
+    if(it.second)
+    {
+        mvSlotIds.push_back(nId);
+        mvPointVertices.resize(3*mvSlotIds.size());
+    }
+
+    mvPointVertices[3*slot] = pos(0);
+    mvPointVertices[3*slot+1] = pos(1);
+    mvPointVertices[3*slot+2] = pos(2);
+
+    if(mnDirtyBegin>=mnDirtyEnd)
+    {
+        mnDirtyBegin = slot;
+        mnDirtyEnd = slot+1;
+    }
+    else
+    {
+        mnDirtyBegin = std::min(mnDirtyBegin,slot);
+        mnDirtyEnd = std::max(mnDirtyEnd,slot+1);
+    }
+}
+
+void MapDrawer::RemovePointVertex(const unsigned long nId)
+{
+    std::unordered_map<unsigned long, size_t>::iterator it = mmPointSlots.find(nId);
+    if(it==mmPointSlots.end())
+        return;
+
+    // The last point moves into the slot, the buffer stays dense
+    const size_t slot = it->second;
+    mmPointSlots.erase(it);
+    const size_t last = mvSlotIds.size()-1;
+    if(slot!=last)
+    {
+        const unsigned long nLastId = mvSlotIds[last];
+        mvSlotIds[slot] = nLastId;
+        mmPointSlots[nLastId] = slot;
+        Eigen::Vector3f pos(mvPointVertices[3*last],mvPointVertices[3*last+1],mvPointVertices[3*last+2]);
+        mvSlotIds.pop_back();
+        mvPointVertices.resize(3*mvSlotIds.size());
+        SetPointVertex(nLastId,pos);
+    }
+    else
+    {
+        mvSlotIds.pop_back();
+        mvPointVertices.resize(3*mvSlotIds.size());
+    }
+
+    // the dirty range never reaches past the points
+    mnDirtyEnd = std::min(mnDirtyEnd,mvSlotIds.size());
+}
+
+void MapDrawer::DrawKeyFramesRetained(const bool bDrawKF, const bool bDrawGraph)
+{
+    const float &w = mKeyFrameSize;
+    const float h = w*0.75;
+    const float z = w*0.6;
+
+    const IndexedStore<KeyFrame>::Snapshot pKFs = mpMap->GetKeyFramesSnapshot();
+    const vector<KeyFrame*> &vpKFs = *pKFs;
+    if(vpKFs.empty())
+        return;
+
+    if(bDrawKF)
+    {
+        // The lines of the camera model, as in DrawKeyFrames
+        const Eigen::Vector3f vCorners[16] = {
+            Eigen::Vector3f(0,0,0), Eigen::Vector3f(w,h,z), Eigen::Vector3f(0,0,0), Eigen::Vector3f(w,-h,z),
+            Eigen::Vector3f(0,0,0), Eigen::Vector3f(-w,-h,z), Eigen::Vector3f(0,0,0), Eigen::Vector3f(-w,h,z),
+            Eigen::Vector3f(w,h,z), Eigen::Vector3f(w,-h,z), Eigen::Vector3f(-w,h,z), Eigen::Vector3f(-w,-h,z),
+            Eigen::Vector3f(-w,h,z), Eigen::Vector3f(w,h,z), Eigen::Vector3f(-w,-h,z), Eigen::Vector3f(w,-h,z)};
+
+        // The keyframes in the view (all without Viewer.LOD), their lines one after the other
+        const ViewFrustum frustum = CurrentFrustum();
+        const float radius = Eigen::Vector3f(w,h,z).norm();
+        vector<KeyFrame*> vpVisibleKFs;
+        vpVisibleKFs.reserve(vpKFs.size());
+        mvKeyFrameVertices.resize(vpKFs.size()*16*3);
+        for(size_t i=0; i<vpKFs.size(); i++)
+        {
+            Eigen::Matrix3f Rcw;
+            Eigen::Vector3f tcw;
+            vpKFs[i]->GetPose(Rcw,tcw);
+            const Eigen::Matrix3f Rwc = Rcw.transpose();
+            const Eigen::Vector3f Ow = -Rwc*tcw;
+            if(mbLOD && !frustum.TestSphere(Ow,radius))
+                continue;
+            const size_t k = vpVisibleKFs.size();
+            for(int j=0; j<16; j++)
+                Eigen::Vector3f::Map(&mvKeyFrameVertices[(16*k+j)*3]) = Rwc*vCorners[j]+Ow;
+            vpVisibleKFs.push_back(vpKFs[i]);
+        }
+        mvKeyFrameVertices.resize(vpVisibleKFs.size()*16*3);
+        UploadVertices(mKeyFrameBuffer,mvKeyFrameVertices);
+
+        glLineWidth(mKeyFrameLineWidth);
+
+        // The candidates first, the blue copy at the same depth fails the depth test then
+        if(mShowRelocalization(false))
+        {
+            glColor3f(1.0f,0.0f,0.0f);
+            for(size_t k=0; k<vpVisibleKFs.size(); k++)
+            {
+                if(vpVisibleKFs[k]->IsRelocalizationCandidate())
+                    DrawVertices(mKeyFrameBuffer,GL_LINES,16*k,16);
+            }
+        }
+
+        glColor3f(0.0f,0.0f,1.0f);
+        DrawVertices(mKeyFrameBuffer,GL_LINES,0,16*vpVisibleKFs.size());
+    }
+
+    if(bDrawGraph)
+    {
+        // The centers move with every BA, they are read again on every call
+        vector<Eigen::Vector3f> vCenters(vpKFs.size());
+        for(size_t i=0; i<vpKFs.size(); i++)
+            vpKFs[i]->GetCameraCenter(vCenters[i]);
+
+        // With Viewer.LOD the covisibility edges of the keyframe closest to the camera and of its
+        // covisible keyframes
+        KeyFrame* pCenterKF = vpKFs.back();
+        Eigen::Vector3f camera;
+        if(mbLOD && GetCurrentCameraCenter(camera))
+        {
+            float bestDist = std::numeric_limits<float>::max();
+            for(size_t i=0; i<vpKFs.size(); i++)
+            {
+                const float dist = (vCenters[i]-camera).squaredNorm();
+                if(dist<bestDist)
+                {
+                    bestDist = dist;
+                    pCenterKF = vpKFs[i];
+                }
+            }
+        }
+
+        unsigned long nChangeIdx = 0;
+        for(size_t i=0; i<vpKFs.size(); i++)
+            nChangeIdx += vpKFs[i]->GetChangeIdx();
+        const int nBigChangeIdx = mpMap->GetLastBigChangeIdx();
+
+        if(pKFs!=mpGraphKeyFrames || nChangeIdx!=mnGraphChangeIdx || nBigChangeIdx!=mnGraphBigChangeIdx ||
+           (mbLOD && pCenterKF->mnId!=mnGraphCenterId))
+        {
+            std::unordered_map<KeyFrame*, int> mIndices;
+            for(size_t i=0; i<vpKFs.size(); i++)
+                mIndices[vpKFs[i]] = i;
+
+            std::unordered_set<KeyFrame*> sNeighborhood;
+            if(mbLOD)
+            {
+                const vector<KeyFrame*> vpCovKFs = pCenterKF->GetVectorCovisibleKeyFrames();
+                sNeighborhood.insert(vpCovKFs.begin(),vpCovKFs.end());
+                sNeighborhood.insert(pCenterKF);
+            }
+
+            // Covisibility graph, spanning tree and loops, every edge once
+            mvGraphEdges.clear();
+            for(size_t i=0; i<vpKFs.size(); i++)
+            {
+                KeyFrame* pKF = vpKFs[i];
+                if(!mbLOD || sNeighborhood.count(pKF))
+                {
+                    const vector<KeyFrame*> vCovKFs = pKF->GetCovisiblesByWeight(100); //param
+                    for(size_t j=0; j<vCovKFs.size(); j++)
+                    {
+                        // An edge leaving the neighborhood is only seen from this side
+                        std::unordered_map<KeyFrame*, int>::const_iterator it = mIndices.find(vCovKFs[j]);
+                        if(it!=mIndices.end() && (vCovKFs[j]->mnId>=pKF->mnId || (mbLOD && !sNeighborhood.count(vCovKFs[j]))))
+                            mvGraphEdges.push_back(std::make_pair(i,it->second));
+                    }
+                }
+
+                std::unordered_map<KeyFrame*, int>::const_iterator itParent = mIndices.find(pKF->GetParent());
+                if(itParent!=mIndices.end())
+                    mvGraphEdges.push_back(std::make_pair(i,itParent->second));
+
+                const set<KeyFrame*> sLoopKFs = pKF->GetLoopEdges();
+                for(set<KeyFrame*>::const_iterator sit=sLoopKFs.begin(); sit!=sLoopKFs.end(); sit++)
+                {
+                    std::unordered_map<KeyFrame*, int>::const_iterator it = mIndices.find(*sit);
+                    if((*sit)->mnId>=pKF->mnId && it!=mIndices.end())
+                        mvGraphEdges.push_back(std::make_pair(i,it->second));
+                }
+            }
+
+            mpGraphKeyFrames = pKFs;
+            mnGraphChangeIdx = nChangeIdx;
+            mnGraphBigChangeIdx = nBigChangeIdx;
+            mnGraphCenterId = pCenterKF->mnId;
+        }
+
+        mvGraphVertices.resize(mvGraphEdges.size()*2*3);
+        for(size_t i=0; i<mvGraphEdges.size(); i++)
+        {
+            Eigen::Vector3f::Map(&mvGraphVertices[6*i]) = vCenters[mvGraphEdges[i].first];
+            Eigen::Vector3f::Map(&mvGraphVertices[6*i+3]) = vCenters[mvGraphEdges[i].second];
+        }
+        UploadVertices(mGraphBuffer,mvGraphVertices);
+
+        glLineWidth(mGraphLineWidth);
+        glColor4f(0.0f,1.0f,0.0f,0.6f);
+        DrawVertices(mGraphBuffer,GL_LINES,0,2*mvGraphEdges.size());
+    }
+}
+
 void MapDrawer::DrawCurrentCamera(pangolin::OpenGlMatrix &Twc)
 {
     const float &w = mCameraSize;
@@ -229,6 +638,18 @@ void MapDrawer::DrawCurrentCamera(pangolin::OpenGlMatrix &Twc)
 }
 
 
+bool MapDrawer::GetCurrentCameraCenter(Eigen::Vector3f &Ow)
+{
+    unique_lock<mutex> lock(mMutexCamera);
+    if(mCameraPose.empty())
+        return false;
+    const cv::Mat Rcw = mCameraPose.rowRange(0,3).colRange(0,3);
+    const cv::Mat tcw = mCameraPose.rowRange(0,3).col(3);
+    const cv::Mat center = -Rcw.t()*tcw;
+    Ow << center.at<float>(0), center.at<float>(1), center.at<float>(2);
+    return true;
+}
+
 void MapDrawer::SetCurrentCameraPose(const cv::Mat &Tcw)
 {
     unique_lock<mutex> lock(mMutexCamera);
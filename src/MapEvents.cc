@@ -0,0 +1,224 @@
+#include "MapEvents.h"
+
+#include "KeyFrame.h"
+#include "Trace.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+MapEvents::Pose GetTcw(KeyFrame* pKF)
+{
+    Eigen::Matrix3f Rcw;
+    Eigen::Vector3f tcw;
+    pKF->GetPose(Rcw,tcw);
+    MapEvents::Pose Tcw = MapEvents::Pose::Identity();
+    Tcw.topLeftCorner<3,3>() = Rcw;
+    Tcw.topRightCorner<3,1>() = tcw;
+    return Tcw;
+}
+
+MapEvents::Pose Inverse(const MapEvents::Pose &T)
+{
+    MapEvents::Pose Tinv = MapEvents::Pose::Identity();
+    Tinv.topLeftCorner<3,3>() = T.topLeftCorner<3,3>().transpose();
+    Tinv.topRightCorner<3,1>() = -T.topLeftCorner<3,3>().transpose()*T.topRightCorner<3,1>();
+    return Tinv;
+}
+}
+
+MapEvents::MapEvents(): mbSubscribed(false), mnNextId(0), mbFinishRequested(false), mbFinished(true)
+{
+}
+
+int MapEvents::Subscribe(const Callback &callback)
+{
+    unique_lock<mutex> lock(mMutexQueue);
+    const int nId = mnNextId++;
+    mmCallbacks[nId] = callback;
+    mbSubscribed = true;
+    return nId;
+}
+
+void MapEvents::Unsubscribe(const int nId)
+{
+    {
+        unique_lock<mutex> lock(mMutexQueue);
+        mmCallbacks.erase(nId);
+        mbSubscribed = !mmCallbacks.empty();
+        // A callback unsubscribing itself must not wait for its own dispatch
+        if(this_thread::get_id()==mDispatcherId)
+            return;
+    }
+
+    // Waits for the dispatch which may have taken the callback before it was erased
+    unique_lock<mutex> lock(mMutexDispatch);
+}
+
+void MapEvents::KeyFrameAdded(KeyFrame* pKF)
+{
+    if(!HasSubscribers())
+        return;
+
+    Event event;
+    event.type = KEYFRAME_ADDED;
+    event.nKFId = pKF->mnId;
+    event.nMatchedKFId = 0;
+    event.nLastKFId = 0;
+    event.timestamp = pKF->mTimeStamp;
+    event.Tcw = GetTcw(pKF);
+    Publish(event);
+}
+
+void MapEvents::KeyFrameErased(KeyFrame* pKF)
+{
+    if(!HasSubscribers())
+        return;
+
+    Event event;
+    event.type = KEYFRAME_ERASED;
+    event.nKFId = pKF->mnId;
+    event.nMatchedKFId = 0;
+    event.nLastKFId = 0;
+    event.timestamp = pKF->mTimeStamp;
+    event.Tcw = GetTcw(pKF);
+    Publish(event);
+}
+
+void MapEvents::Reset()
+{
+    if(!HasSubscribers())
+        return;
+
+    Event event;
+    event.type = RESET;
+    event.nKFId = 0;
+    event.nMatchedKFId = 0;
+    event.nLastKFId = 0;
+    event.timestamp = 0;
+    event.Tcw.setIdentity();
+    Publish(event);
+}
+
+void MapEvents::GetPoses(const vector<KeyFrame*> &vpKFs, PoseMap &poses)
+{
+    poses.clear();
+    if(!HasSubscribers())
+        return;
+
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        if(!vpKFs[i]->isBad())
+            poses[vpKFs[i]->mnId] = GetTcw(vpKFs[i]);
+    }
+}
+
+void MapEvents::Corrected(const Type type, const unsigned long nKFId, const unsigned long nMatchedKFId,
+                          const PoseMap &posesBefore, const vector<KeyFrame*> &vpKFs)
+{
+    if(!HasSubscribers())
+        return;
+
+    Event event;
+    event.type = type;
+    event.nKFId = nKFId;
+    event.nMatchedKFId = nMatchedKFId;
+    event.nLastKFId = posesBefore.empty() ? 0 : posesBefore.rbegin()->first;
+    event.timestamp = 0;
+    event.Tcw.setIdentity();
+
+    // Keyframes inserted after the poses were taken have nothing to correct
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        if(pKF->isBad())
+            continue;
+        PoseMap::const_iterator it = posesBefore.find(pKF->mnId);
+        if(it==posesBefore.end())
+            continue;
+
+        const Pose Tcw = GetTcw(pKF);
+        if(Tcw==it->second)
+            continue;
+
+        KeyFrameCorrection correction;
+        correction.nKFId = pKF->mnId;
+        correction.Tcw = Tcw;
+        correction.Tcorrection = Inverse(Tcw)*it->second;
+        event.vCorrections.push_back(correction);
+    }
+
+    Publish(event);
+}
+
+void MapEvents::Publish(Event &event)
+{
+    {
+        unique_lock<mutex> lock(mMutexQueue);
+        mqEvents.push_back(std::move(event));
+    }
+    mCondQueue.notify_one();
+}
+
+void MapEvents::Run()
+{
+    Trace::SetThreadName("MapEvents");
+    {
+        unique_lock<mutex> lock(mMutexQueue);
+        mbFinished = false;
+        mDispatcherId = this_thread::get_id();
+    }
+
+    vector<Callback> vCallbacks;
+    while(1)
+    {
+        Event event;
+        {
+            unique_lock<mutex> lock(mMutexQueue);
+            while(mqEvents.empty() && !mbFinishRequested)
+                mCondQueue.wait(lock);
+
+            if(mqEvents.empty())
+                break;
+
+            event = std::move(mqEvents.front());
+            mqEvents.pop_front();
+        }
+
+        // The callbacks are taken after the dispatch lock, an Unsubscribe before is respected
+        unique_lock<mutex> lockDispatch(mMutexDispatch);
+        {
+            unique_lock<mutex> lock(mMutexQueue);
+            vCallbacks.clear();
+            for(map<int, Callback>::const_iterator it=mmCallbacks.begin(); it!=mmCallbacks.end(); it++)
+                vCallbacks.push_back(it->second);
+        }
+
+        for(size_t i=0; i<vCallbacks.size(); i++)
+            vCallbacks[i](event);
+    }
+
+    unique_lock<mutex> lock(mMutexQueue);
+    mDispatcherId = thread::id();
+    mbFinished = true;
+}
+
+void MapEvents::RequestFinish()
+{
+    {
+        unique_lock<mutex> lock(mMutexQueue);
+        mbFinishRequested = true;
+    }
+    mCondQueue.notify_one();
+}
+
+bool MapEvents::isFinished()
+{
+    unique_lock<mutex> lock(mMutexQueue);
+    return mbFinished;
+}
+
+} //namespace ORB_SLAM
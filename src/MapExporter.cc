@@ -0,0 +1,451 @@
+#include "MapExporter.h"
+#include "KeyFrame.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// LAS coordinates are integers of this unit
+const double LAS_SCALE = 1e-4; //param
+const uint16_t LAS_HEADER_SIZE = 227;
+// Offsets in the LAS 1.2 header
+const streamoff LAS_COUNT_OFFSET = 107;
+const streamoff LAS_BOUNDS_OFFSET = 179;
+
+// Digits of a count written into a PLY or PCD header before the points are known
+const int COUNT_DIGITS = 10;
+
+bool HasExtension(const string &filename, const string &extension)
+{
+    if(filename.size()<extension.size())
+        return false;
+    string end = filename.substr(filename.size()-extension.size());
+    transform(end.begin(),end.end(),end.begin(),::tolower);
+    return end==extension;
+}
+
+template<typename T>
+void Put(vector<char> &buffer, const T &value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(),p,p+sizeof(T));
+}
+
+template<typename T>
+void Put(ostream &f, const T &value)
+{
+    f.write(reinterpret_cast<const char*>(&value),sizeof(T));
+}
+
+void PutText(ostream &f, const char* text, const size_t n)
+{
+    char field[32] = {0};
+    strncpy(field,text,min(n,sizeof(field)));
+    f.write(field,n);
+}
+
+// Writes a placeholder for a count and remembers where it is
+void PutCount(ostream &f, vector<streampos> &vOffsets)
+{
+    vOffsets.push_back(f.tellp());
+    f << string(COUNT_DIGITS,'0');
+}
+}
+
+MapExporter::Format MapExporter::GetFormat(const string &filename)
+{
+    if(HasExtension(filename,".pcd"))
+        return PCD;
+    if(HasExtension(filename,".las"))
+        return LAS;
+    return PLY;
+}
+
+MapExporter::MapExporter(Map* pMap):
+    mpMap(pMap), mbAbort(false), mnChangeLogConsumer(-1), mbRebuild(false), mbFinish(false)
+{
+    mThread = thread(&MapExporter::Run,this);
+}
+
+MapExporter::~MapExporter()
+{
+    Finish();
+}
+
+future<MapExporter::Result> MapExporter::Export(const string &filename, const Format format, const bool bChanges,
+                                                const bool bColors)
+{
+    Request request;
+    request.filename = filename;
+    request.format = format;
+    request.bChanges = bChanges;
+    request.bColors = bColors;
+    future<Result> result = request.result.get_future();
+
+    unique_lock<mutex> lock(mMutexRequests);
+    if(mbFinish)
+    {
+        Result failed = {false, false, 0, 0};
+        request.result.set_value(failed);
+        return result;
+    }
+    mqRequests.push_back(std::move(request));
+    mcvRequests.notify_one();
+    return result;
+}
+
+void MapExporter::Pause()
+{
+    mbAbort = true;
+    mMutexExport.lock();
+    mbAbort = false;
+}
+
+void MapExporter::Release()
+{
+    mMutexExport.unlock();
+}
+
+void MapExporter::Finish()
+{
+    {
+        unique_lock<mutex> lock(mMutexRequests);
+        mbFinish = true;
+        mcvRequests.notify_one();
+    }
+    if(mThread.joinable())
+        mThread.join();
+}
+
+void MapExporter::Run()
+{
+    Trace::SetThreadName("MapExporter");
+
+    while(true)
+    {
+        Request request;
+        {
+            unique_lock<mutex> lock(mMutexRequests);
+            while(mqRequests.empty() && !mbFinish)
+                mcvRequests.wait(lock);
+            if(mqRequests.empty())
+                break;
+            request = std::move(mqRequests.front());
+            mqRequests.pop_front();
+        }
+
+        Result result;
+        {
+            unique_lock<mutex> lock(mMutexExport);
+            TRACE_SCOPE("ExportMapPoints");
+            result = Write(request);
+        }
+        request.result.set_value(result);
+    }
+}
+
+MapExporter::Result MapExporter::Write(Request &request)
+{
+    Result result = {false, !request.bChanges, 0, 0};
+
+    // Taken before the points are read, the changes after it are in the next export
+    if(request.bChanges)
+    {
+        MapChangeLog &log = mpMap->mChangeLog;
+        if(mnChangeLogConsumer<0)
+            mnChangeLogConsumer = log.AddConsumer();
+        result.bFull = !log.Take(mnChangeLogConsumer,mvPointChanges) || mbRebuild;
+        mbRebuild = false;
+    }
+
+    const string strTemporary = request.filename+".tmp";
+    ofstream f(strTemporary.c_str(), ios::binary | ios::trunc);
+    if(!f.is_open())
+    {
+        cerr << "Could not write the map points to " << strTemporary << endl;
+        mbRebuild = request.bChanges;
+        return result;
+    }
+
+    WriteHeader(f,request.format,request.bColors);
+
+    // The points of the snapshot and the ones changed are not freed before the slot is released
+    const int nReclaimerId = mpMap->mReclaimer.RegisterThread();
+    vector<Point> vChunk;
+    vChunk.reserve(CHUNK_SIZE);
+    bool bAborted = false;
+    Point point;
+
+    if(result.bFull)
+    {
+        const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+        for(size_t i=0; i<pMPs->size() && !bAborted; i++)
+        {
+            if(!GetPoint((*pMPs)[i],request.bColors,point))
+                continue;
+            vChunk.push_back(point);
+            if(vChunk.size()==CHUNK_SIZE)
+            {
+                WriteChunk(f,request.format,request.bColors,vChunk);
+                result.nPoints += vChunk.size();
+                vChunk.clear();
+                bAborted = mbAbort;
+            }
+        }
+    }
+    else
+    {
+        // A point is written once, as of its last change
+        unordered_map<unsigned long,size_t> mLastChange;
+        for(size_t i=0; i<mvPointChanges.size(); i++)
+            mLastChange[mvPointChanges[i].nId] = i;
+
+        for(size_t i=0; i<mvPointChanges.size() && !bAborted; i++)
+        {
+            const MapChangeLog::PointChange &change = mvPointChanges[i];
+            if(mLastChange[change.nId]!=i)
+                continue;
+
+            if(change.bErased)
+            {
+                if(request.format==LAS)
+                    continue;
+                memset(&point,0,sizeof(point));
+                point.x = change.pos[0];
+                point.y = change.pos[1];
+                point.z = change.pos[2];
+                point.nId = change.nId;
+                result.nErased++;
+            }
+            // Erased in the meantime, the next export has it
+            else if(!GetPoint(mpMap->GetMapPoint(change.nId),request.bColors,point))
+                continue;
+
+            vChunk.push_back(point);
+            if(vChunk.size()==CHUNK_SIZE)
+            {
+                WriteChunk(f,request.format,request.bColors,vChunk);
+                result.nPoints += vChunk.size();
+                vChunk.clear();
+                bAborted = mbAbort;
+            }
+        }
+    }
+    mpMap->mReclaimer.UnregisterThread(nReclaimerId);
+    mvPointChanges.clear();
+
+    if(!bAborted)
+    {
+        WriteChunk(f,request.format,request.bColors,vChunk);
+        result.nPoints += vChunk.size();
+        FinishHeader(f,request.format,result.nPoints);
+    }
+    f.close();
+
+    result.bOk = !bAborted && !f.fail() && rename(strTemporary.c_str(),request.filename.c_str())==0;
+    if(!result.bOk)
+    {
+        if(!bAborted)
+            cerr << "Could not write the map points to " << request.filename << endl;
+        remove(strTemporary.c_str());
+        mbRebuild = request.bChanges;
+    }
+    return result;
+}
+
+bool MapExporter::GetPoint(MapPoint* pMP, const bool bColors, Point &point)
+{
+    if(!pMP || pMP->isBad())
+        return false;
+
+    Eigen::Vector3f Pos, Normal;
+    pMP->GetWorldPos(Pos);
+    pMP->GetNormal(Normal);
+    point.x = Pos[0];
+    point.y = Pos[1];
+    point.z = Pos[2];
+    point.nx = Normal[0];
+    point.ny = Normal[1];
+    point.nz = Normal[2];
+    point.nId = pMP->mnId;
+    point.nObservations = pMP->Observations();
+    point.r = point.g = point.b = 255;
+
+    if(bColors)
+    {
+        KeyFrame* pRefKF = pMP->GetReferenceKeyFrame();
+        const int idx = pRefKF ? pMP->GetIndexInKeyFrame(pRefKF) : -1;
+        if(idx>=0 && static_cast<size_t>(idx)<pRefKF->mvColors.size())
+        {
+            const cv::Vec3b &color = pRefKF->mvColors[idx];
+            point.r = color[0];
+            point.g = color[1];
+            point.b = color[2];
+        }
+    }
+    return true;
+}
+
+void MapExporter::WriteHeader(ofstream &f, const Format format, const bool bColors)
+{
+    mvCountOffsets.clear();
+    for(int i=0; i<3; i++)
+    {
+        mvMin[i] = numeric_limits<double>::max();
+        mvMax[i] = -numeric_limits<double>::max();
+    }
+
+    if(format==PLY)
+    {
+        f << "ply\nformat binary_little_endian 1.0\ncomment ORB-SLAM2 map points\nelement vertex ";
+        PutCount(f,mvCountOffsets);
+        f << "\nproperty float x\nproperty float y\nproperty float z\n"
+             "property float nx\nproperty float ny\nproperty float nz\n"
+             "property uint id\nproperty uint observations\n";
+        if(bColors)
+            f << "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+        f << "end_header\n";
+    }
+    else if(format==PCD)
+    {
+        f << "# .PCD v0.7 - Point Cloud Data file format\nVERSION 0.7\n";
+        f << "FIELDS x y z normal_x normal_y normal_z id observations" << (bColors ? " rgb" : "") << "\n";
+        f << "SIZE 4 4 4 4 4 4 4 4" << (bColors ? " 4" : "") << "\n";
+        f << "TYPE F F F F F F U U" << (bColors ? " U" : "") << "\n";
+        f << "COUNT 1 1 1 1 1 1 1 1" << (bColors ? " 1" : "") << "\n";
+        f << "WIDTH ";
+        PutCount(f,mvCountOffsets);
+        f << "\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS ";
+        PutCount(f,mvCountOffsets);
+        f << "\nDATA binary\n";
+    }
+    else
+    {
+        const time_t now = time(NULL);
+        const tm* pDate = gmtime(&now);
+        const uint8_t zero[16] = {0};
+
+        f.write("LASF",4);
+        Put(f,uint16_t(0)); // file source id
+        Put(f,uint16_t(0)); // global encoding
+        f.write(reinterpret_cast<const char*>(zero),16); // project id
+        Put(f,uint8_t(1));
+        Put(f,uint8_t(2));
+        PutText(f,"ORB-SLAM2",32);
+        PutText(f,"ORB-SLAM2 MapExporter",32);
+        Put(f,uint16_t(pDate ? pDate->tm_yday+1 : 0));
+        Put(f,uint16_t(pDate ? pDate->tm_year+1900 : 0));
+        Put(f,LAS_HEADER_SIZE);
+        Put(f,uint32_t(LAS_HEADER_SIZE)); // offset to the points
+        Put(f,uint32_t(0)); // variable length records
+        Put(f,uint8_t(bColors ? 2 : 0));
+        Put(f,uint16_t(bColors ? 26 : 20));
+        Put(f,uint32_t(0)); // points, written by FinishHeader
+        for(int i=0; i<5; i++)
+            Put(f,uint32_t(0)); // points by return
+        for(int i=0; i<3; i++)
+            Put(f,LAS_SCALE);
+        for(int i=0; i<3; i++)
+            Put(f,0.0); // offset
+        for(int i=0; i<6; i++)
+            Put(f,0.0); // bounds, written by FinishHeader
+    }
+}
+
+void MapExporter::WriteChunk(ofstream &f, const Format format, const bool bColors, const vector<Point> &vPoints)
+{
+    vector<char> buffer;
+    buffer.reserve(vPoints.size()*36);
+    for(size_t i=0; i<vPoints.size(); i++)
+    {
+        const Point &p = vPoints[i];
+        if(format==LAS)
+        {
+            const double v[3] = {p.x, p.y, p.z};
+            for(int j=0; j<3; j++)
+            {
+                mvMin[j] = min(mvMin[j],v[j]);
+                mvMax[j] = max(mvMax[j],v[j]);
+                Put(buffer,static_cast<int32_t>(lround(v[j]/LAS_SCALE)));
+            }
+            Put(buffer,static_cast<uint16_t>(min(p.nObservations,65535u)));
+            Put(buffer,uint8_t(0x09)); // return 1 of 1
+            Put(buffer,uint8_t(0)); // classification
+            Put(buffer,int8_t(0)); // scan angle
+            Put(buffer,uint8_t(0)); // user data
+            Put(buffer,uint16_t(0)); // point source id
+            if(bColors)
+            {
+                // 16 bit colors
+                Put(buffer,static_cast<uint16_t>(p.r*257));
+                Put(buffer,static_cast<uint16_t>(p.g*257));
+                Put(buffer,static_cast<uint16_t>(p.b*257));
+            }
+            continue;
+        }
+
+        Put(buffer,p.x);
+        Put(buffer,p.y);
+        Put(buffer,p.z);
+        Put(buffer,p.nx);
+        Put(buffer,p.ny);
+        Put(buffer,p.nz);
+        Put(buffer,p.nId);
+        Put(buffer,p.nObservations);
+        if(bColors)
+        {
+            if(format==PLY)
+            {
+                Put(buffer,p.r);
+                Put(buffer,p.g);
+                Put(buffer,p.b);
+            }
+            else
+                Put(buffer,static_cast<uint32_t>((p.r<<16) | (p.g<<8) | p.b));
+        }
+    }
+    if(!buffer.empty())
+        f.write(&buffer[0],buffer.size());
+}
+
+void MapExporter::FinishHeader(ofstream &f, const Format format, const size_t nPoints)
+{
+    if(format==LAS)
+    {
+        f.seekp(LAS_COUNT_OFFSET);
+        Put(f,static_cast<uint32_t>(nPoints));
+        Put(f,static_cast<uint32_t>(nPoints)); // all are first returns
+        f.seekp(LAS_BOUNDS_OFFSET);
+        for(int i=0; i<3; i++)
+        {
+            Put(f,nPoints ? mvMax[i] : 0.0);
+            Put(f,nPoints ? mvMin[i] : 0.0);
+        }
+        return;
+    }
+
+    char count[COUNT_DIGITS+1];
+    snprintf(count,sizeof(count),"%0*lu",COUNT_DIGITS,static_cast<unsigned long>(nPoints));
+    for(size_t i=0; i<mvCountOffsets.size(); i++)
+    {
+        f.seekp(mvCountOffsets[i]);
+        f.write(count,COUNT_DIGITS);
+    }
+}
+
+} //namespace ORB_SLAM
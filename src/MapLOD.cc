@@ -0,0 +1,241 @@
+#include "MapLOD.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+#include <Eigen/Dense>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+
+// Cells further than this from the origin share the border cells
+const int MAX_CELL_COORD = (1<<20)-1;
+
+int CellCoord(const float x, const float cellSize)
+{
+    const float c = floor(x/cellSize);
+    return static_cast<int>(max<float>(-MAX_CELL_COORD,min<float>(MAX_CELL_COORD,c)));
+}
+
+int FloorDiv(const int a, const int b)
+{
+    return a>=0 ? a/b : -((-a+b-1)/b);
+}
+
+// Block in the high bits, cell within the block in the low 9: sorted by key the cells of a block
+// are next to each other
+uint64_t Key(const int x, const int y, const int z)
+{
+    const int B = PointClusters::BLOCK_CELLS;
+    const int bx = FloorDiv(x,B), by = FloorDiv(y,B), bz = FloorDiv(z,B);
+    const uint64_t offset = MAX_CELL_COORD/B+1;
+    const uint64_t nBlock = ((bx+offset)<<36) | ((by+offset)<<18) | (bz+offset);
+    const uint64_t nCell = ((x-bx*B)<<6) | ((y-by*B)<<3) | (z-bz*B);
+    return (nBlock<<9) | nCell;
+}
+
+unsigned int ReverseBits(unsigned int v, const int nBits)
+{
+    unsigned int r = 0;
+    for(int i=0; i<nBits; i++)
+    {
+        r = (r<<1) | (v&1);
+        v >>= 1;
+    }
+    return r;
+}
+
+}
+
+ViewFrustum::ViewFrustum(const float* projection, const float* modelView)
+{
+    const Eigen::Map<const Eigen::Matrix4f> P(projection);
+    const Eigen::Map<const Eigen::Matrix4f> MV(modelView);
+    const Eigen::Matrix4f M = P*MV;
+
+    // Gribb and Hartmann: left, right, bottom, top, near, far
+    for(int i=0; i<3; i++)
+    {
+        mvPlanes[2*i] = (M.row(3)+M.row(i)).transpose();
+        mvPlanes[2*i+1] = (M.row(3)-M.row(i)).transpose();
+    }
+    for(int i=0; i<6; i++)
+    {
+        const float norm = mvPlanes[i].head<3>().norm();
+        if(norm>0)
+            mvPlanes[i] /= norm;
+    }
+
+    const Eigen::Matrix3f R = MV.topLeftCorner<3,3>();
+    mEye = -R.transpose()*MV.topRightCorner<3,1>();
+}
+
+ViewFrustum::eResult ViewFrustum::TestBox(const Eigen::Vector3f &min, const Eigen::Vector3f &max) const
+{
+    eResult result = INSIDE;
+    for(int i=0; i<6; i++)
+    {
+        const Eigen::Vector4f &plane = mvPlanes[i];
+        // The corners furthest inside and outside along the normal
+        Eigen::Vector3f pIn, pOut;
+        for(int j=0; j<3; j++)
+        {
+            pIn[j] = plane[j]>=0 ? max[j] : min[j];
+            pOut[j] = plane[j]>=0 ? min[j] : max[j];
+        }
+        if(plane.head<3>().dot(pIn)+plane[3]<0)
+            return OUTSIDE;
+        if(plane.head<3>().dot(pOut)+plane[3]<0)
+            result = INTERSECTS;
+    }
+    return result;
+}
+
+bool ViewFrustum::TestSphere(const Eigen::Vector3f &center, const float radius) const
+{
+    for(int i=0; i<6; i++)
+    {
+        if(mvPlanes[i].head<3>().dot(center)+mvPlanes[i][3]<-radius)
+            return false;
+    }
+    return true;
+}
+
+PointClusters::PointClusters()
+{
+}
+
+void PointClusters::Build(const vector<float> &vVertices, const float cellSize)
+{
+    const size_t N = vVertices.size()/3;
+    mvVertices.resize(3*N);
+    mvCells.clear();
+    mvBlocks.clear();
+    if(N==0)
+        return;
+
+    // Points by cell, in their order within a cell for now
+    vector<pair<uint64_t, uint32_t> > vKeys(N);
+    for(size_t i=0; i<N; i++)
+    {
+        const int x = CellCoord(vVertices[3*i],cellSize);
+        const int y = CellCoord(vVertices[3*i+1],cellSize);
+        const int z = CellCoord(vVertices[3*i+2],cellSize);
+        vKeys[i] = make_pair(Key(x,y,z),static_cast<uint32_t>(i));
+    }
+    sort(vKeys.begin(),vKeys.end());
+
+    for(size_t i=0; i<N; i++)
+    {
+        if(i==0 || vKeys[i].first!=vKeys[i-1].first)
+        {
+            Cell cell;
+            cell.min = cell.max = Eigen::Vector3f::Zero();
+            cell.begin = i;
+            cell.count = 0;
+            mvCells.push_back(cell);
+        }
+        mvCells.back().count++;
+    }
+
+    // Bit reversed order within every cell, so that a prefix skips points evenly
+    for(size_t c=0; c<mvCells.size(); c++)
+    {
+        Cell &cell = mvCells[c];
+        int nBits = 0;
+        while((static_cast<size_t>(1)<<nBits)<cell.count)
+            nBits++;
+
+        size_t k = cell.begin;
+        for(unsigned int r=0, rend=1u<<nBits; r<rend; r++)
+        {
+            const size_t j = ReverseBits(r,nBits);
+            if(j>=cell.count)
+                continue;
+            const float* p = &vVertices[3*vKeys[cell.begin+j].second];
+            copy(p,p+3,&mvVertices[3*k]);
+            k++;
+        }
+
+        Eigen::Map<const Eigen::Matrix<float,3,Eigen::Dynamic> > points(&mvVertices[3*cell.begin],3,cell.count);
+        cell.min = points.rowwise().minCoeff();
+        cell.max = points.rowwise().maxCoeff();
+    }
+
+    // Blocks over the runs of cells
+    for(size_t i=0; i<mvCells.size(); i++)
+    {
+        const uint64_t nBlock = vKeys[mvCells[i].begin].first>>9;
+        if(i==0 || nBlock!=(vKeys[mvCells[i-1].begin].first>>9))
+        {
+            Block block;
+            block.min = mvCells[i].min;
+            block.max = mvCells[i].max;
+            block.begin = i;
+            block.end = i+1;
+            mvBlocks.push_back(block);
+        }
+        Block &block = mvBlocks.back();
+        block.min = block.min.cwiseMin(mvCells[i].min);
+        block.max = block.max.cwiseMax(mvCells[i].max);
+        block.end = i+1;
+    }
+}
+
+void PointClusters::Select(const ViewFrustum &frustum, const float fullDistance, const float minFraction,
+                           vector<int> &vFirsts, vector<int> &vCounts) const
+{
+    vFirsts.clear();
+    vCounts.clear();
+    const Eigen::Vector3f &eye = frustum.GetEye();
+    bool bLastFull = false;
+
+    for(size_t b=0; b<mvBlocks.size(); b++)
+    {
+        const Block &block = mvBlocks[b];
+        const ViewFrustum::eResult blockResult = frustum.TestBox(block.min,block.max);
+        if(blockResult==ViewFrustum::OUTSIDE)
+        {
+            bLastFull = false;
+            continue;
+        }
+
+        for(size_t c=block.begin; c<block.end; c++)
+        {
+            const Cell &cell = mvCells[c];
+            if(blockResult==ViewFrustum::INTERSECTS && frustum.TestBox(cell.min,cell.max)==ViewFrustum::OUTSIDE)
+            {
+                bLastFull = false;
+                continue;
+            }
+
+            // Distance from the eye to the box of the cell
+            const float d = (eye.cwiseMax(cell.min).cwiseMin(cell.max)-eye).norm();
+            size_t nCount = cell.count;
+            if(d>fullDistance)
+            {
+                const float ratio = fullDistance/d;
+                const float fraction = max(minFraction,ratio*ratio);
+                nCount = max<size_t>(1,static_cast<size_t>(ceil(fraction*cell.count)));
+            }
+
+            const bool bFull = nCount==cell.count;
+            if(bFull && bLastFull && static_cast<size_t>(vFirsts.back()+vCounts.back())==cell.begin)
+                vCounts.back() += nCount;
+            else
+            {
+                vFirsts.push_back(cell.begin);
+                vCounts.push_back(nCount);
+            }
+            bLastFull = bFull;
+        }
+    }
+}
+
+} //namespace ORB_SLAM
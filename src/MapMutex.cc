@@ -0,0 +1,223 @@
+#include "MapMutex.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+atomic<LockSite*> gpFirstSite(static_cast<LockSite*>(NULL));
+
+struct LockTotals
+{
+    LockTotals(): nAcquisitions(0), nContended(0), nWait(0), nMaxWait(0), nHold(0), nMaxHold(0) {}
+
+    void Add(const LockSite &site)
+    {
+        nAcquisitions += site.mnAcquisitions.load(memory_order_relaxed);
+        nContended += site.mnContended.load(memory_order_relaxed);
+        nWait += site.mnWait.load(memory_order_relaxed);
+        nMaxWait = max(nMaxWait,site.mnMaxWait.load(memory_order_relaxed));
+        nHold += site.mnHold.load(memory_order_relaxed);
+        nMaxHold = max(nMaxHold,site.mnMaxHold.load(memory_order_relaxed));
+    }
+
+    uint64_t nAcquisitions, nContended, nWait, nMaxWait, nHold, nMaxHold;
+};
+
+void PrintTotals(ostream &out, const string &name, const LockTotals &totals)
+{
+    char line[512];
+    snprintf(line,sizeof(line),"%-56s %10llu %10llu %12.3f %10.3f %12.3f %10.3f\n",name.c_str(),
+             static_cast<unsigned long long>(totals.nAcquisitions),static_cast<unsigned long long>(totals.nContended),
+             totals.nWait*1e-6,totals.nMaxWait*1e-6,totals.nHold*1e-6,totals.nMaxHold*1e-6);
+    out << line;
+}
+
+void PrintHeader(ostream &out, const char* title)
+{
+    char line[512];
+    snprintf(line,sizeof(line),"%-56s %10s %10s %12s %10s %12s %10s\n",title,
+             "locks","contended","wait [ms]","max wait","hold [ms]","max hold");
+    out << line;
+}
+
+bool GreaterWait(const pair<string,LockTotals> &a, const pair<string,LockTotals> &b)
+{
+    return a.second.nWait>b.second.nWait;
+}
+}
+
+thread_local bool FrozenMapReader::sbActive = false;
+
+LockSite::LockSite(const char* file, const int line, const char* function):
+    mFile(file), mLine(line), mFunction(function), mName(static_cast<const char*>(NULL)),
+    mnAcquisitions(0), mnContended(0), mnWait(0), mnMaxWait(0), mnHold(0), mnMaxHold(0), mpNext(NULL)
+{
+    LockProfiler::Register(this);
+}
+
+bool LockProfiler::IsEnabled()
+{
+#ifdef ORB_SLAM2_PROFILE_LOCKS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void LockProfiler::Register(LockSite* pSite)
+{
+    pSite->mpNext = gpFirstSite.load();
+    while(!gpFirstSite.compare_exchange_weak(pSite->mpNext,pSite))
+        ;
+}
+
+LockSite* LockProfiler::FirstSite()
+{
+    return gpFirstSite.load();
+}
+
+void LockProfiler::Reset()
+{
+    for(LockSite* pSite=FirstSite(); pSite; pSite=pSite->mpNext)
+    {
+        pSite->mnAcquisitions = 0;
+        pSite->mnContended = 0;
+        pSite->mnWait = 0;
+        pSite->mnMaxWait = 0;
+        pSite->mnHold = 0;
+        pSite->mnMaxHold = 0;
+    }
+}
+
+void LockProfiler::Print(ostream &out)
+{
+    if(!IsEnabled())
+        return;
+
+    map<string,LockTotals> mLocks;
+    vector<pair<string,LockTotals> > vSites;
+    for(LockSite* pSite=FirstSite(); pSite; pSite=pSite->mpNext)
+    {
+        if(pSite->mnAcquisitions.load(memory_order_relaxed)==0)
+            continue;
+
+        const char* pName = pSite->mName.load();
+        const string name = pName ? pName : "unknown";
+        mLocks[name].Add(*pSite);
+
+        string file = pSite->mFile;
+        const size_t nSlash = file.rfind('/');
+        if(nSlash!=string::npos)
+            file = file.substr(nSlash+1);
+
+        char site[256];
+        snprintf(site,sizeof(site),"%s:%d %s (%s)",file.c_str(),pSite->mLine,pSite->mFunction,name.c_str());
+        LockTotals totals;
+        totals.Add(*pSite);
+        vSites.push_back(make_pair(string(site),totals));
+    }
+
+    out << endl;
+    PrintHeader(out,"lock");
+    for(map<string,LockTotals>::const_iterator mit=mLocks.begin(); mit!=mLocks.end(); mit++)
+        PrintTotals(out,mit->first,mit->second);
+
+    sort(vSites.begin(),vSites.end(),GreaterWait);
+    out << endl;
+    PrintHeader(out,"call site");
+    for(size_t i=0; i<vSites.size(); i++)
+        PrintTotals(out,vSites[i].first,vSites[i].second);
+}
+
+#ifdef ORB_SLAM2_PROFILE_LOCKS
+
+namespace
+{
+// Site of the next lock of this thread, set by LOCK_SITE
+thread_local LockSite* tpNextSite = NULL;
+
+LockSite& UnknownSite()
+{
+    static LockSite site("unknown", 0, "unknown");
+    return site;
+}
+
+void UpdateMax(atomic<uint64_t> &max, const uint64_t value)
+{
+    uint64_t current = max.load(memory_order_relaxed);
+    while(value>current && !max.compare_exchange_weak(current,value,memory_order_relaxed))
+        ;
+}
+}
+
+MapMutex& MapMutex::At(LockSite &site)
+{
+    tpNextSite = &site;
+    return *this;
+}
+
+void MapMutex::lock()
+{
+    LockSite* pSite = tpNextSite ? tpNextSite : &UnknownSite();
+    tpNextSite = NULL;
+
+    if(mMutex.try_lock())
+    {
+        Acquired(pSite,0,false);
+        return;
+    }
+
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+    mMutex.lock();
+    Acquired(pSite,chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-tStart).count(),true);
+}
+
+bool MapMutex::try_lock()
+{
+    LockSite* pSite = tpNextSite ? tpNextSite : &UnknownSite();
+    tpNextSite = NULL;
+
+    if(!mMutex.try_lock())
+        return false;
+    Acquired(pSite,0,false);
+    return true;
+}
+
+void MapMutex::unlock()
+{
+    LockSite* pSite = mpHolder;
+    const uint64_t nHold = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-mtAcquired).count();
+    mMutex.unlock();
+
+    pSite->mnHold.fetch_add(nHold,memory_order_relaxed);
+    UpdateMax(pSite->mnMaxHold,nHold);
+}
+
+void MapMutex::Acquired(LockSite* pSite, const uint64_t nWait, const bool bContended)
+{
+    mpHolder = pSite;
+    mtAcquired = chrono::steady_clock::now();
+
+    if(!pSite->mName.load(memory_order_relaxed))
+        pSite->mName = mpName;
+    pSite->mnAcquisitions.fetch_add(1,memory_order_relaxed);
+    if(bContended)
+    {
+        pSite->mnContended.fetch_add(1,memory_order_relaxed);
+        pSite->mnWait.fetch_add(nWait,memory_order_relaxed);
+        UpdateMax(pSite->mnMaxWait,nWait);
+    }
+}
+
+#endif
+
+} //namespace ORB_SLAM
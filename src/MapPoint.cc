@@ -19,40 +19,105 @@
 */
 
 #include "MapPoint.h"
-#include "ORBmatcher.h"
+#include "ObjectPool.h"
 
+#include<algorithm>
 #include<mutex>
 
 namespace ORB_SLAM2
 {
 
-long unsigned int MapPoint::nNextId=0;
-mutex MapPoint::mGlobalMutex;
+MapMutex MapPoint::mGlobalMutex("MapPoint::mGlobalMutex");
+
+namespace
+{
+// never destroyed, MapPoints may still be deleted during static destruction
+ObjectPool& MapPointPool()
+{
+    static ObjectPool* pPool = new ObjectPool(sizeof(MapPoint), 4096); //param
+    return *pPool;
+}
+
+// Adds n to the covisibility weight of pKF with every other keyframe observing the point. Bad
+// keyframes are skipped both when adding and when removing: a keyframe drops all its connections
+// when it becomes bad, so it has no weight left to add to or to take from.
+void AddCovisibility(const ObservationList &observations, KeyFrame* pKF, const int n)
+{
+    for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+    {
+        KeyFrame* pKF2 = mit->first;
+        if(pKF2==pKF || pKF2->isBad())
+            continue;
+        pKF->AddCovisibility(pKF2,n);
+        pKF2->AddCovisibility(pKF,n);
+    }
+}
+
+// Removes the point from the covisibility weights of all the keyframes observing it, skipping
+// the bad ones as AddCovisibility does
+void EraseCovisibility(const ObservationList &observations)
+{
+    for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+    {
+        if(mit->first->isBad())
+            continue;
+        for(ObservationList::const_iterator mit2=mit+1; mit2!=mend; mit2++)
+        {
+            if(mit2->first->isBad())
+                continue;
+            mit->first->AddCovisibility(mit2->first,-1);
+            mit2->first->AddCovisibility(mit->first,-1);
+        }
+    }
+}
+}
+
+void* MapPoint::operator new(std::size_t size)
+{
+    if(size!=sizeof(MapPoint))
+        return ::operator new(size);
+    return MapPointPool().Allocate();
+}
+
+void MapPoint::operator delete(void* p, std::size_t size)
+{
+    if(size!=sizeof(MapPoint))
+        ::operator delete(p);
+    else
+        MapPointPool().Free(p);
+}
+
+size_t MapPoint::GetNumAllocated()
+{
+    return MapPointPool().GetNumAllocated();
+}
 
 MapPoint::MapPoint(const cv::Mat &Pos, KeyFrame *pRefKF, Map* pMap):
-    mnFirstKFid(pRefKF->mnId), mnFirstFrame(pRefKF->mnFrameId), nObs(0), mnTrackReferenceForFrame(0),
-    mnLastFrameSeen(0), mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
-    mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(pRefKF), mnVisible(1), mnFound(1), mbBad(false),
-    mpReplaced(static_cast<MapPoint*>(NULL)), mfMinDistance(0), mfMaxDistance(0), mpMap(pMap)
+    mnFirstKFid(pRefKF->mnId), mnFirstFrame(pRefKF->mnFrameId), nObs(0), mnTrackReferenceForLocalMap(0),
+    mnIndexVoxel(MapPointIndex::NO_VOXEL), mbBad(false), mpReplaced(static_cast<MapPoint*>(NULL)),
+    mnVisible(1), mnFound(1), mpRefKF(pRefKF), mnNormalEpoch(0), mpMap(pMap),
+    mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
+    mnCorrectedReference(0), mnBAGlobalForKF(0), mnBARegionForKF(0)
 {
-    Pos.copyTo(mWorldPos);
-    mNormalVector = cv::Mat::zeros(3,1,CV_32F);
+    // normal, distances and descriptor start at zero
+    const float pos[3] = {Pos.at<float>(0), Pos.at<float>(1), Pos.at<float>(2)};
+    mGeometry.Write(pos,0,3);
 
     // MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
-    unique_lock<mutex> lock(mpMap->mMutexPointCreation);
-    mnId=nNextId++;
+    unique_lock<MapMutex> lock(LOCK_SITE(mpMap->mMutexPointCreation));
+    mnId=mpMap->mnNextMapPointId++;
 }
 
 MapPoint::MapPoint(const cv::Mat &Pos, Map* pMap, Frame* pFrame, const int &idxF):
-    mnFirstKFid(-1), mnFirstFrame(pFrame->mnId), nObs(0), mnTrackReferenceForFrame(0), mnLastFrameSeen(0),
-    mnBALocalForKF(0), mnFuseCandidateForKF(0),mnLoopPointForKF(0), mnCorrectedByKF(0),
-    mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(static_cast<KeyFrame*>(NULL)), mnVisible(1),
-    mnFound(1), mbBad(false), mpReplaced(NULL), mpMap(pMap)
+    mnFirstKFid(-1), mnFirstFrame(pFrame->mnId), nObs(0), mnTrackReferenceForLocalMap(0),
+    mnIndexVoxel(MapPointIndex::NO_VOXEL), mbBad(false), mpReplaced(NULL), mnVisible(1),
+    mnFound(1), mpRefKF(static_cast<KeyFrame*>(NULL)), mnNormalEpoch(0), mpMap(pMap),
+    mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
+    mnCorrectedReference(0), mnBAGlobalForKF(0), mnBARegionForKF(0)
 {
-    Pos.copyTo(mWorldPos);
     cv::Mat Ow = pFrame->GetCameraCenter();
-    mNormalVector = mWorldPos - Ow;
-    mNormalVector = mNormalVector/cv::norm(mNormalVector);
+    cv::Mat normal = Pos - Ow;
+    normal = normal/cv::norm(normal);
 
     cv::Mat PC = Pos - Ow;
     const float dist = cv::norm(PC);
@@ -60,49 +125,103 @@ MapPoint::MapPoint(const cv::Mat &Pos, Map* pMap, Frame* pFrame, const int &idxF
     const float levelScaleFactor =  pFrame->mvScaleFactors[level];
     const int nLevels = pFrame->mnScaleLevels;
 
-    mfMaxDistance = dist*levelScaleFactor;
-    mfMinDistance = mfMaxDistance/pFrame->mvScaleFactors[nLevels-1];
+    const float maxDistance = dist*levelScaleFactor;
+    const float geometry[8] = {Pos.at<float>(0), Pos.at<float>(1), Pos.at<float>(2),
+                               normal.at<float>(0), normal.at<float>(1), normal.at<float>(2),
+                               maxDistance/pFrame->mvScaleFactors[nLevels-1], maxDistance};
+    mGeometry.Write(geometry);
 
-    pFrame->mDescriptors.row(idxF).copyTo(mDescriptor);
+    mDescriptor.Write(pFrame->mDescriptors.ptr<uint32_t>(idxF));
 
     // MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
-    unique_lock<mutex> lock(mpMap->mMutexPointCreation);
-    mnId=nNextId++;
+    unique_lock<MapMutex> lock(LOCK_SITE(mpMap->mMutexPointCreation));
+    mnId=mpMap->mnNextMapPointId++;
 }
 
 void MapPoint::SetWorldPos(const cv::Mat &Pos)
 {
-    unique_lock<mutex> lock2(mGlobalMutex);
-    unique_lock<mutex> lock(mMutexPos);
-    Pos.copyTo(mWorldPos);
+    SetWorldPos(Eigen::Vector3f(Pos.at<float>(0), Pos.at<float>(1), Pos.at<float>(2)));
+}
+
+void MapPoint::SetWorldPos(const Eigen::Vector3f &Pos)
+{
+    unique_lock<MapMutex> lock2(LOCK_SITE(mGlobalMutex));
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexPos));
+    mGeometry.Write(Pos.data(),0,3);
+    // Under mMutexPos, so the index sees the writes in order
+    mpMap->mPointIndex.Update(this,Pos);
+    mpMap->mChangeLog.Update(this,Pos);
 }
 
 cv::Mat MapPoint::GetWorldPos()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return mWorldPos.clone();
+    cv::Mat Pos(3,1,CV_32F);
+    mGeometry.Read(Pos.ptr<float>(),0,3);
+    return Pos;
 }
 
 cv::Mat MapPoint::GetNormal()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return mNormalVector.clone();
+    cv::Mat Normal(3,1,CV_32F);
+    mGeometry.Read(Normal.ptr<float>(),3,3);
+    return Normal;
+}
+
+void MapPoint::GetWorldPos(Eigen::Vector3f &Pos)
+{
+    mGeometry.Read(Pos.data(),0,3);
+}
+
+void MapPoint::GetNormal(Eigen::Vector3f &Normal)
+{
+    mGeometry.Read(Normal.data(),3,3);
+}
+
+void MapPoint::GetViewingGeometry(Eigen::Vector3f &Pos, Eigen::Vector3f &Normal, float &minDistance, float &maxDistance)
+{
+    float geometry[8];
+    mGeometry.Read(geometry);
+    Pos = Eigen::Map<const Eigen::Vector3f>(geometry);
+    Normal = Eigen::Map<const Eigen::Vector3f>(geometry+3);
+    minDistance = 0.8f*geometry[6];
+    maxDistance = 1.2f*geometry[7];
 }
 
 KeyFrame* MapPoint::GetReferenceKeyFrame()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
     return mpRefKF;
 }
 
 void MapPoint::AddObservation(KeyFrame* pKF, size_t idx)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
     if(mObservations.count(pKF))
         return;
-    mObservations[pKF]=idx;
+    // Under the lock, so the weights see the events of a point in order
+    if(!mbBad && !pKF->isBad())
+        AddCovisibility(mObservations,pKF,1);
+
+    if(mnNormalEpoch!=0)
+    {
+        const long unsigned int epoch = KeyFrame::nPoseEpoch;
+        Eigen::Vector3f Pos;
+        GetWorldPos(Pos);
+        if(IsNormalSumValid(Pos) && pKF->mnPoseEpoch<=epoch)
+        {
+            Eigen::Vector3f Ow;
+            pKF->GetCameraCenter(Ow);
+            mNormalSum += (Pos-Ow).normalized();
+            mnNormalEpoch = epoch;
+        }
+        else
+            mnNormalEpoch = 0;
+    }
 
-    if(pKF->mvuRight[idx]>=0)
+    mObservations.insert(pKF,idx);
+    mpObservationsSnapshot.reset();
+
+    if(pKF->GetRight(idx)>=0)
         nObs+=2;
     else
         nObs++;
@@ -112,18 +231,36 @@ void MapPoint::EraseObservation(KeyFrame* pKF)
 {
     bool bBad=false;
     {
-        unique_lock<mutex> lock(mMutexFeatures);
+        unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
         if(mObservations.count(pKF))
         {
-            int idx = mObservations[pKF];
-            if(pKF->mvuRight[idx]>=0)
+            int idx = mObservations.find(pKF)->second;
+            if(pKF->GetRight(idx)>=0)
                 nObs-=2;
             else
                 nObs--;
 
+            if(mnNormalEpoch!=0)
+            {
+                // The keyframe has still the pose the sum was computed with
+                Eigen::Vector3f Pos;
+                GetWorldPos(Pos);
+                if(IsNormalSumValid(Pos))
+                {
+                    Eigen::Vector3f Ow;
+                    pKF->GetCameraCenter(Ow);
+                    mNormalSum -= (Pos-Ow).normalized();
+                }
+                else
+                    mnNormalEpoch = 0;
+            }
+
             mObservations.erase(pKF);
+            mpObservationsSnapshot.reset();
+            if(!mbBad && !pKF->isBad())
+                AddCovisibility(mObservations,pKF,-1);
 
-            if(mpRefKF==pKF)
+            if(mpRefKF==pKF && !mObservations.empty())
                 mpRefKF=mObservations.begin()->first;
 
             // If only 2 observations or less, discard point
@@ -136,118 +273,119 @@ void MapPoint::EraseObservation(KeyFrame* pKF)
         SetBadFlag();
 }
 
-map<KeyFrame*, size_t> MapPoint::GetObservations()
+ObservationList MapPoint::GetObservations()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
     return mObservations;
 }
 
+MapPoint::ObservationsSnapshot MapPoint::GetObservationsSnapshot()
+{
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
+    if(!mpObservationsSnapshot)
+        mpObservationsSnapshot = make_shared<const ObservationList>(mObservations);
+    return mpObservationsSnapshot;
+}
+
+size_t MapPoint::GetMemoryUsage()
+{
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
+    size_t bytes = sizeof(MapPoint);
+    if(mObservations.capacity()>ObservationList::INLINE_CAPACITY)
+        bytes += mObservations.capacity()*sizeof(ObservationList::value_type);
+    if(mpObservationsSnapshot)
+    {
+        bytes += sizeof(ObservationList);
+        if(mpObservationsSnapshot->capacity()>ObservationList::INLINE_CAPACITY)
+            bytes += mpObservationsSnapshot->capacity()*sizeof(ObservationList::value_type);
+    }
+    bytes += mDescriptorMedoid.GetMemoryUsage();
+    return bytes;
+}
+
 int MapPoint::Observations()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
     return nObs;
 }
 
 void MapPoint::SetBadFlag()
 {
-    map<KeyFrame*,size_t> obs;
+    ObservationList obs;
     {
-        unique_lock<mutex> lock1(mMutexFeatures);
-        unique_lock<mutex> lock2(mMutexPos);
+        unique_lock<MapMutex> lock1(LOCK_SITE(mMutexFeatures));
+        unique_lock<MapMutex> lock2(LOCK_SITE(mMutexPos));
+        if(!mbBad)
+            EraseCovisibility(mObservations);
         mbBad=true;
         obs = mObservations;
         mObservations.clear();
+        mpObservationsSnapshot.reset();
+        mDescriptorMedoid.Clear();
     }
-    for(map<KeyFrame*,size_t>::iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
+    for(ObservationList::iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
     {
         KeyFrame* pKF = mit->first;
         pKF->EraseMapPointMatch(mit->second);
     }
 
-    mpMap->EraseMapPoint(this);
+    if(mpMap->EraseMapPoint(this))
+        mpMap->mReclaimer.Retire(this);
 }
 
 MapPoint* MapPoint::GetReplaced()
 {
-    unique_lock<mutex> lock1(mMutexFeatures);
-    unique_lock<mutex> lock2(mMutexPos);
+    unique_lock<MapMutex> lock1(LOCK_SITE(mMutexFeatures));
+    unique_lock<MapMutex> lock2(LOCK_SITE(mMutexPos));
     return mpReplaced;
 }
 
 void MapPoint::Replace(MapPoint* pMP)
 {
-    if(pMP->mnId==this->mnId)
-        return;
-
-    int nvisible, nfound;
-    map<KeyFrame*,size_t> obs;
-    {
-        unique_lock<mutex> lock1(mMutexFeatures);
-        unique_lock<mutex> lock2(mMutexPos);
-        obs=mObservations;
-        mObservations.clear();
-        mbBad=true;
-        nvisible = mnVisible;
-        nfound = mnFound;
-        mpReplaced = pMP;
-    }
-
-    for(map<KeyFrame*,size_t>::iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
-    {
-        // Replace measurement in keyframe
-        KeyFrame* pKF = mit->first;
-
-        if(!pMP->IsInKeyFrame(pKF))
-        {
-            pKF->ReplaceMapPointMatch(mit->second, pMP);
-            pMP->AddObservation(pKF,mit->second);
-        }
-        else
-        {
-            pKF->EraseMapPointMatch(mit->second);
-        }
-    }
-    pMP->IncreaseFound(nfound);
-    pMP->IncreaseVisible(nvisible);
-    pMP->ComputeDistinctiveDescriptors();
-
-    mpMap->EraseMapPoint(this);
+    MapPointReplacer replacer;
+    replacer.Replace(this,pMP);
+    replacer.Apply();
 }
 
 bool MapPoint::isBad()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    unique_lock<mutex> lock2(mMutexPos);
-    return mbBad;
+    return mbBad.load(memory_order_acquire);
 }
 
 void MapPoint::IncreaseVisible(int n)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    mnVisible+=n;
+    // Only the culling of the local mapping reads them, the readers of a frozen map may be several
+    if(FrozenMapReader::IsActive())
+        return;
+    mnVisible.fetch_add(n,memory_order_relaxed);
 }
 
 void MapPoint::IncreaseFound(int n)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    mnFound+=n;
+    if(FrozenMapReader::IsActive())
+        return;
+    mnFound.fetch_add(n,memory_order_relaxed);
 }
 
 float MapPoint::GetFoundRatio()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    return static_cast<float>(mnFound)/mnVisible;
+    // A point is counted visible before it is found, read in the other order the ratio is at
+    // most the one of a moment
+    const int nFound = mnFound.load(memory_order_relaxed);
+    const int nVisible = mnVisible.load(memory_order_relaxed);
+    return static_cast<float>(nFound)/nVisible;
 }
 
 void MapPoint::ComputeDistinctiveDescriptors()
 {
     // Retrieve all observed descriptors
-    vector<cv::Mat> vDescriptors;
+    vector<DescriptorMedoid::Key> vKeys;
+    vector<const uint8_t*> vpDescriptors;
 
-    map<KeyFrame*,size_t> observations;
+    ObservationList observations;
 
     {
-        unique_lock<mutex> lock1(mMutexFeatures);
+        unique_lock<MapMutex> lock1(LOCK_SITE(mMutexFeatures));
         if(mbBad)
             return;
         observations=mObservations;
@@ -256,139 +394,141 @@ void MapPoint::ComputeDistinctiveDescriptors()
     if(observations.empty())
         return;
 
-    vDescriptors.reserve(observations.size());
+    vKeys.reserve(observations.size());
+    vpDescriptors.reserve(observations.size());
 
-    for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+    for(ObservationList::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
     {
         KeyFrame* pKF = mit->first;
 
         if(!pKF->isBad())
-            vDescriptors.push_back(pKF->mDescriptors.row(mit->second));
-    }
-
-    if(vDescriptors.empty())
-        return;
-
-    // Compute distances between them
-    const size_t N = vDescriptors.size();
-
-    float Distances[N][N];
-    for(size_t i=0;i<N;i++)
-    {
-        Distances[i][i]=0;
-        for(size_t j=i+1;j<N;j++)
         {
-            int distij = ORBmatcher::DescriptorDistance(vDescriptors[i],vDescriptors[j]);
-            Distances[i][j]=distij;
-            Distances[j][i]=distij;
+            vKeys.push_back(DescriptorMedoid::Key(pKF->mnId,mit->second));
+            vpDescriptors.push_back(pKF->mDescriptors.ptr<uint8_t>(mit->second));
         }
     }
 
-    // Take the descriptor with least median distance to the rest
-    int BestMedian = INT_MAX;
-    int BestIdx = 0;
-    for(size_t i=0;i<N;i++)
-    {
-        vector<int> vDists(Distances[i],Distances[i]+N);
-        sort(vDists.begin(),vDists.end());
-        int median = vDists[0.5*(N-1)];
-
-        if(median<BestMedian)
-        {
-            BestMedian = median;
-            BestIdx = i;
-        }
-    }
+    if(vKeys.empty())
+        return;
 
-    {
-        unique_lock<mutex> lock(mMutexFeatures);
-        mDescriptor = vDescriptors[BestIdx].clone();
-    }
+    // Take the descriptor with least median distance to the rest, only the distances of the
+    // observations added since the last time are computed
+    unique_lock<MapMutex> lock(LOCK_SITE(mMutexFeatures));
+    if(mbBad)
+        return;
+    mDescriptorMedoid.Update(vKeys,vpDescriptors);
+    mDescriptor.Write(reinterpret_cast<const uint32_t*>(mDescriptorMedoid.GetMedoid()));
 }
 
 cv::Mat MapPoint::GetDescriptor()
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    return mDescriptor.clone();
+    cv::Mat Desc(1,32,CV_8U);
+    mDescriptor.Read(Desc.ptr<uint32_t>());
+    return Desc;
+}
+
+void MapPoint::GetDescriptor(cv::Mat &Desc)
+{
+    Desc.create(1,32,CV_8U);
+    mDescriptor.Read(Desc.ptr<uint32_t>());
 }
 
 int MapPoint::GetIndexInKeyFrame(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    if(mObservations.count(pKF))
-        return mObservations[pKF];
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
+    ObservationList::const_iterator it = mObservations.find(pKF);
+    if(it!=mObservations.end())
+        return it->second;
     else
         return -1;
 }
 
 bool MapPoint::IsInKeyFrame(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
+    MapReadLock lock(LOCK_SITE(mMutexFeatures));
     return (mObservations.count(pKF));
 }
 
+bool MapPoint::IsNormalSumValid(const Eigen::Vector3f &Pos)
+{
+    if(mnNormalEpoch==0 || Pos!=mNormalPos)
+        return false;
+    for(ObservationList::const_iterator mit=mObservations.begin(), mend=mObservations.end(); mit!=mend; mit++)
+        if(mit->first->mnPoseEpoch>mnNormalEpoch)
+            return false;
+    return true;
+}
+
 void MapPoint::UpdateNormalAndDepth()
 {
-    map<KeyFrame*,size_t> observations;
+    Eigen::Vector3f normal;
     KeyFrame* pRefKF;
-    cv::Mat Pos;
+    size_t idxRef;
+    Eigen::Vector3f Pos;
     {
-        unique_lock<mutex> lock1(mMutexFeatures);
-        unique_lock<mutex> lock2(mMutexPos);
-        if(mbBad)
+        unique_lock<MapMutex> lock1(LOCK_SITE(mMutexFeatures));
+        if(mbBad || mObservations.empty())
             return;
-        observations=mObservations;
         pRefKF=mpRefKF;
-        Pos = mWorldPos.clone();
-    }
-
-    if(observations.empty())
-        return;
+        ObservationList::const_iterator itRef = mObservations.find(pRefKF);
+        if(itRef==mObservations.end())
+            return;
+        idxRef=itRef->second;
+        GetWorldPos(Pos);
 
-    cv::Mat normal = cv::Mat::zeros(3,1,CV_32F);
-    int n=0;
-    for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
-    {
-        KeyFrame* pKF = mit->first;
-        cv::Mat Owi = pKF->GetCameraCenter();
-        cv::Mat normali = mWorldPos - Owi;
-        normal = normal + normali/cv::norm(normali);
-        n++;
+        if(!IsNormalSumValid(Pos))
+        {
+            // The camera centers read after the epoch
+            const long unsigned int epoch = KeyFrame::nPoseEpoch;
+            mNormalSum.setZero();
+            for(ObservationList::const_iterator mit=mObservations.begin(), mend=mObservations.end(); mit!=mend; mit++)
+            {
+                Eigen::Vector3f Owi;
+                mit->first->GetCameraCenter(Owi);
+                mNormalSum += (Pos-Owi).normalized();
+            }
+            mNormalPos = Pos;
+            mnNormalEpoch = epoch;
+        }
+        normal = mNormalSum/mObservations.size();
     }
 
-    cv::Mat PC = Pos - pRefKF->GetCameraCenter();
-    const float dist = cv::norm(PC);
-    const int level = pRefKF->mvKeysUn[observations[pRefKF]].octave;
+    Eigen::Vector3f Ow;
+    pRefKF->GetCameraCenter(Ow);
+    const float dist = (Pos-Ow).norm();
+    const int level = pRefKF->GetOctave(idxRef);
     const float levelScaleFactor =  pRefKF->mvScaleFactors[level];
     const int nLevels = pRefKF->mnScaleLevels;
 
     {
-        unique_lock<mutex> lock3(mMutexPos);
-        mfMaxDistance = dist*levelScaleFactor;
-        mfMinDistance = mfMaxDistance/pRefKF->mvScaleFactors[nLevels-1];
-        mNormalVector = normal/n;
+        const float maxDistance = dist*levelScaleFactor;
+        const float geometry[5] = {normal(0), normal(1), normal(2),
+                                   maxDistance/pRefKF->mvScaleFactors[nLevels-1], maxDistance};
+
+        unique_lock<MapMutex> lock3(LOCK_SITE(mMutexPos));
+        mGeometry.Write(geometry,3,5);
     }
 }
 
 float MapPoint::GetMinDistanceInvariance()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return 0.8f*mfMinDistance;
+    float minDistance;
+    mGeometry.Read(&minDistance,6,1);
+    return 0.8f*minDistance;
 }
 
 float MapPoint::GetMaxDistanceInvariance()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return 1.2f*mfMaxDistance;
+    float maxDistance;
+    mGeometry.Read(&maxDistance,7,1);
+    return 1.2f*maxDistance;
 }
 
 int MapPoint::PredictScale(const float &currentDist, KeyFrame* pKF)
 {
-    float ratio;
-    {
-        unique_lock<mutex> lock(mMutexPos);
-        ratio = mfMaxDistance/currentDist;
-    }
+    float maxDistance;
+    mGeometry.Read(&maxDistance,7,1);
+    const float ratio = maxDistance/currentDist;
 
     int nScale = ceil(log(ratio)/pKF->mfLogScaleFactor);
     if(nScale<0)
@@ -401,11 +541,9 @@ int MapPoint::PredictScale(const float &currentDist, KeyFrame* pKF)
 
 int MapPoint::PredictScale(const float &currentDist, Frame* pF)
 {
-    float ratio;
-    {
-        unique_lock<mutex> lock(mMutexPos);
-        ratio = mfMaxDistance/currentDist;
-    }
+    float maxDistance;
+    mGeometry.Read(&maxDistance,7,1);
+    const float ratio = maxDistance/currentDist;
 
     int nScale = ceil(log(ratio)/pF->mfLogScaleFactor);
     if(nScale<0)
@@ -416,6 +554,117 @@ int MapPoint::PredictScale(const float &currentDist, Frame* pF)
     return nScale;
 }
 
+MapPointReplacer::MapPointReplacer()
+{
+}
+
+MapPointReplacer::~MapPointReplacer()
+{
+    Apply();
+}
 
+void MapPointReplacer::SetEntry(KeyFrame* pKF, const size_t idx, MapPoint* pMP)
+{
+    unordered_map<KeyFrame*, size_t>::iterator it = mmEntriesIdx.find(pKF);
+    if(it==mmEntriesIdx.end())
+    {
+        it = mmEntriesIdx.insert(make_pair(pKF,mvEntries.size())).first;
+        mvEntries.push_back(make_pair(pKF,unordered_map<size_t, MapPoint*>()));
+    }
+    mvEntries[it->second].second[idx] = pMP;
+}
+
+MapPoint* MapPointReplacer::GetMapPoint(KeyFrame* pKF, const size_t idx)
+{
+    unordered_map<KeyFrame*, size_t>::const_iterator it = mmEntriesIdx.find(pKF);
+    if(it!=mmEntriesIdx.end())
+    {
+        const unordered_map<size_t, MapPoint*> &mEntries = mvEntries[it->second].second;
+        unordered_map<size_t, MapPoint*>::const_iterator itEntry = mEntries.find(idx);
+        if(itEntry!=mEntries.end())
+            return itEntry->second;
+    }
+    return pKF->GetMapPoint(idx);
+}
+
+void MapPointReplacer::Replace(MapPoint* pMP, MapPoint* pBy)
+{
+    if(pBy->mnId==pMP->mnId)
+        return;
+
+    int nvisible, nfound;
+    ObservationList obs;
+    {
+        unique_lock<MapMutex> lock1(LOCK_SITE(pMP->mMutexFeatures));
+        unique_lock<MapMutex> lock2(LOCK_SITE(pMP->mMutexPos));
+        if(!pMP->mbBad)
+            EraseCovisibility(pMP->mObservations);
+        obs=pMP->mObservations;
+        pMP->mObservations.clear();
+        pMP->mpObservationsSnapshot.reset();
+        pMP->mbBad=true;
+        nvisible = pMP->mnVisible.load(memory_order_relaxed);
+        nfound = pMP->mnFound.load(memory_order_relaxed);
+        pMP->mpReplaced = pBy;
+    }
+
+    for(ObservationList::iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
+    {
+        // Replace measurement in keyframe
+        KeyFrame* pKF = mit->first;
+
+        if(!pBy->IsInKeyFrame(pKF))
+        {
+            SetEntry(pKF,mit->second,pBy);
+            pBy->AddObservation(pKF,mit->second);
+        }
+        else
+        {
+            SetEntry(pKF,mit->second,static_cast<MapPoint*>(NULL));
+        }
+    }
+    pBy->IncreaseFound(nfound);
+    pBy->IncreaseVisible(nvisible);
+
+    mvpSurvivors.push_back(pBy);
+    mvpReplaced.push_back(pMP);
+}
+
+void MapPointReplacer::Add(MapPoint* pMP, KeyFrame* pKF, const size_t idx)
+{
+    pMP->AddObservation(pKF,idx);
+    SetEntry(pKF,idx,pMP);
+}
+
+void MapPointReplacer::Apply()
+{
+    for(size_t i=0; i<mvEntries.size(); i++)
+    {
+        const unordered_map<size_t, MapPoint*> &mEntries = mvEntries[i].second;
+        mvEntries[i].first->ReplaceMapPointMatches(vector<pair<size_t, MapPoint*> >(mEntries.begin(),mEntries.end()));
+    }
+    mvEntries.clear();
+    mmEntriesIdx.clear();
+
+    // A survivor replaced later in the batch is bad, the one which took its place computes it
+    sort(mvpSurvivors.begin(),mvpSurvivors.end());
+    mvpSurvivors.erase(unique(mvpSurvivors.begin(),mvpSurvivors.end()),mvpSurvivors.end());
+    for(size_t i=0; i<mvpSurvivors.size(); i++)
+        if(!mvpSurvivors[i]->isBad())
+            mvpSurvivors[i]->ComputeDistinctiveDescriptors();
+    mvpSurvivors.clear();
+
+    // The replaced points are retired after their survivors took their place, so mpReplaced
+    // never dangles
+    if(!mvpReplaced.empty())
+    {
+        Map* pMap = mvpReplaced.front()->mpMap;
+        vector<MapPoint*> vpErased;
+        pMap->EraseMapPoints(mvpReplaced,vpErased);
+        for(size_t i=0; i<vpErased.size(); i++)
+            pMap->mReclaimer.Retire(vpErased[i]);
+        mvpReplaced.clear();
+    }
+}
 
 } //namespace ORB_SLAM
@@ -0,0 +1,242 @@
+#include "MapPointIndex.h"
+
+#include "MapPoint.h"
+
+#include <Eigen/LU>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Voxel coordinates are packed into 21 bits each, points further out share the border voxels
+const int COORD_BITS = 21;
+const int COORD_OFFSET = 1<<(COORD_BITS-1);
+
+int64_t PackVoxel(const int x, const int y, const int z)
+{
+    return (static_cast<int64_t>(x+COORD_OFFSET)<<(2*COORD_BITS)) |
+           (static_cast<int64_t>(y+COORD_OFFSET)<<COORD_BITS) |
+           static_cast<int64_t>(z+COORD_OFFSET);
+}
+
+void UnpackVoxel(const int64_t nVoxel, int &x, int &y, int &z)
+{
+    const int64_t mask = (int64_t(1)<<COORD_BITS)-1;
+    x = static_cast<int>((nVoxel>>(2*COORD_BITS))&mask)-COORD_OFFSET;
+    y = static_cast<int>((nVoxel>>COORD_BITS)&mask)-COORD_OFFSET;
+    z = static_cast<int>(nVoxel&mask)-COORD_OFFSET;
+}
+}
+
+const int64_t MapPointIndex::NO_VOXEL = -1;
+
+MapPointIndex::MapPointIndex(): mfVoxelSize(0), mfInvVoxelSize(0)
+{
+}
+
+void MapPointIndex::SetVoxelSize(const float fVoxelSize)
+{
+    unique_lock<mutex> lock(mMutex);
+    mfVoxelSize = max(fVoxelSize,0.0f);
+    mfInvVoxelSize = mfVoxelSize>0 ? 1.0f/mfVoxelSize : 0;
+}
+
+void MapPointIndex::Insert(MapPoint* pMP)
+{
+    if(!IsEnabled())
+        return;
+
+    unique_lock<mutex> lock(mMutex);
+    if(pMP->mnIndexVoxel!=NO_VOXEL)
+        return;
+
+    // Read under the lock, a concurrent SetWorldPos either sees the point indexed or is seen here
+    Eigen::Vector3f Pos;
+    pMP->GetWorldPos(Pos);
+    const int64_t nVoxel = GetVoxel(Pos);
+    mVoxels[nVoxel].push_back(pMP);
+    pMP->mnIndexVoxel = nVoxel;
+}
+
+void MapPointIndex::Erase(MapPoint* pMP)
+{
+    if(!IsEnabled())
+        return;
+
+    unique_lock<mutex> lock(mMutex);
+    const int64_t nVoxel = pMP->mnIndexVoxel;
+    if(nVoxel==NO_VOXEL)
+        return;
+
+    EraseFromVoxel(pMP,nVoxel);
+    pMP->mnIndexVoxel = NO_VOXEL;
+}
+
+void MapPointIndex::Update(MapPoint* pMP, const Eigen::Vector3f &Pos)
+{
+    if(!IsEnabled())
+        return;
+
+    // Most updates move the point within its voxel, or the point is not in the map
+    const int64_t nVoxel = GetVoxel(Pos);
+    if(pMP->mnIndexVoxel.load(memory_order_relaxed)==nVoxel)
+        return;
+
+    unique_lock<mutex> lock(mMutex);
+    const int64_t nOldVoxel = pMP->mnIndexVoxel;
+    if(nOldVoxel==NO_VOXEL || nOldVoxel==nVoxel)
+        return;
+
+    EraseFromVoxel(pMP,nOldVoxel);
+    mVoxels[nVoxel].push_back(pMP);
+    pMP->mnIndexVoxel = nVoxel;
+}
+
+void MapPointIndex::Clear()
+{
+    unique_lock<mutex> lock(mMutex);
+    for(unordered_map<int64_t, vector<MapPoint*> >::iterator it=mVoxels.begin(); it!=mVoxels.end(); it++)
+    {
+        for(size_t i=0; i<it->second.size(); i++)
+            it->second[i]->mnIndexVoxel = NO_VOXEL;
+    }
+    mVoxels.clear();
+}
+
+template<typename F>
+void MapPointIndex::ForEachInBox(const Eigen::Vector3f &vMin, const Eigen::Vector3f &vMax, F f)
+{
+    int x0, y0, z0, x1, y1, z1;
+    GetVoxelCoords(vMin,x0,y0,z0);
+    GetVoxelCoords(vMax,x1,y1,z1);
+
+    unique_lock<mutex> lock(mMutex);
+
+    Eigen::Vector3f Pos;
+    const double nBoxVoxels = double(x1-x0+1)*(y1-y0+1)*(z1-z0+1);
+    if(nBoxVoxels<=mVoxels.size())
+    {
+        for(int x=x0; x<=x1; x++)
+            for(int y=y0; y<=y1; y++)
+                for(int z=z0; z<=z1; z++)
+                {
+                    unordered_map<int64_t, vector<MapPoint*> >::const_iterator it = mVoxels.find(PackVoxel(x,y,z));
+                    if(it==mVoxels.end())
+                        continue;
+                    for(size_t i=0; i<it->second.size(); i++)
+                    {
+                        it->second[i]->GetWorldPos(Pos);
+                        f(it->second[i],Pos);
+                    }
+                }
+    }
+    else
+    {
+        // Large box, fewer voxels in the map than in the box
+        for(unordered_map<int64_t, vector<MapPoint*> >::const_iterator it=mVoxels.begin(); it!=mVoxels.end(); it++)
+        {
+            int x, y, z;
+            UnpackVoxel(it->first,x,y,z);
+            if(x<x0 || x>x1 || y<y0 || y>y1 || z<z0 || z>z1)
+                continue;
+            for(size_t i=0; i<it->second.size(); i++)
+            {
+                it->second[i]->GetWorldPos(Pos);
+                f(it->second[i],Pos);
+            }
+        }
+    }
+}
+
+void MapPointIndex::GetPointsInRadius(const Eigen::Vector3f &center, const float fRadius, vector<MapPoint*> &vpMPs)
+{
+    vpMPs.clear();
+    if(!IsEnabled())
+        return;
+
+    const Eigen::Vector3f vRadius = Eigen::Vector3f::Constant(fRadius);
+    const float fRadius2 = fRadius*fRadius;
+    ForEachInBox(center-vRadius, center+vRadius, [&](MapPoint* pMP, const Eigen::Vector3f &Pos)
+    {
+        if((Pos-center).squaredNorm()<=fRadius2)
+            vpMPs.push_back(pMP);
+    });
+}
+
+void MapPointIndex::GetPointsInFrustum(const Frustum &frustum, vector<MapPoint*> &vpMPs)
+{
+    vpMPs.clear();
+    if(!IsEnabled() || frustum.maxDepth<=0)
+        return;
+
+    // Bounding box of the camera center and the far corners of the image
+    const Eigen::Matrix3f Rwc = frustum.Rcw.inverse();
+    const Eigen::Vector3f Ow = -Rwc*frustum.tcw;
+    Eigen::Vector3f vMin = Ow;
+    Eigen::Vector3f vMax = Ow;
+    const float z = frustum.maxDepth;
+    const float us[2] = {frustum.minX, frustum.maxX};
+    const float vs[2] = {frustum.minY, frustum.maxY};
+    for(int i=0; i<2; i++)
+    {
+        for(int j=0; j<2; j++)
+        {
+            const Eigen::Vector3f Xc((us[i]-frustum.cx)*z/frustum.fx, (vs[j]-frustum.cy)*z/frustum.fy, z);
+            const Eigen::Vector3f Xw = Rwc*(Xc-frustum.tcw);
+            vMin = vMin.cwiseMin(Xw);
+            vMax = vMax.cwiseMax(Xw);
+        }
+    }
+
+    ForEachInBox(vMin, vMax, [&](MapPoint* pMP, const Eigen::Vector3f &Pos)
+    {
+        const Eigen::Vector3f Pc = frustum.Rcw*Pos+frustum.tcw;
+        if(Pc(2)<=0 || Pc(2)>frustum.maxDepth)
+            return;
+        const float invz = 1.0f/Pc(2);
+        const float u = frustum.fx*Pc(0)*invz+frustum.cx;
+        const float v = frustum.fy*Pc(1)*invz+frustum.cy;
+        if(u>=frustum.minX && u<frustum.maxX && v>=frustum.minY && v<frustum.maxY)
+            vpMPs.push_back(pMP);
+    });
+}
+
+int64_t MapPointIndex::GetVoxel(const Eigen::Vector3f &Pos) const
+{
+    int x, y, z;
+    GetVoxelCoords(Pos,x,y,z);
+    return PackVoxel(x,y,z);
+}
+
+void MapPointIndex::GetVoxelCoords(const Eigen::Vector3f &Pos, int &x, int &y, int &z) const
+{
+    const float fLimit = COORD_OFFSET-1;
+    x = static_cast<int>(floor(max(-fLimit,min(fLimit,Pos(0)*mfInvVoxelSize))));
+    y = static_cast<int>(floor(max(-fLimit,min(fLimit,Pos(1)*mfInvVoxelSize))));
+    z = static_cast<int>(floor(max(-fLimit,min(fLimit,Pos(2)*mfInvVoxelSize))));
+}
+
+void MapPointIndex::EraseFromVoxel(MapPoint* pMP, const int64_t nVoxel)
+{
+    unordered_map<int64_t, vector<MapPoint*> >::iterator it = mVoxels.find(nVoxel);
+    if(it==mVoxels.end())
+        return;
+
+    vector<MapPoint*> &vpMPs = it->second;
+    vector<MapPoint*>::iterator vit = find(vpMPs.begin(),vpMPs.end(),pMP);
+    if(vit!=vpMPs.end())
+    {
+        *vit = vpMPs.back();
+        vpMPs.pop_back();
+    }
+    if(vpMPs.empty())
+        mVoxels.erase(it);
+}
+
+} //namespace ORB_SLAM
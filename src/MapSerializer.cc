@@ -0,0 +1,1626 @@
+#include "MapSerializer.h"
+
+#include "FeatureGrid.h"
+#include "Frame.h"
+#include "KeyFrame.h"
+#include "KeyFrameDatabase.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "MapTiles.h"
+#include "MappedFile.h"
+#include "Settings.h"
+#include "ThreadPool.h"
+#include "VocabularyLoader.h"
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const char MAGIC[8] = {'O','R','B','M','A','P','\0','\0'};
+const char MAPPED_MAGIC[8] = {'O','R','B','M','A','P','M','\0'};
+const char DELTA_MAGIC[8] = {'O','R','B','M','A','P','D','\0'};
+const uint32_t VERSION = 2;
+
+// Keyframes or map points encoded / decoded at once
+const int BATCH_SIZE = 256; //param
+
+// Buffer of the file streams
+const size_t IO_BUFFER_SIZE = 1<<22; //param
+
+// Alignment of the feature arrays of a mapped map
+const uint64_t FEATURE_ALIGNMENT = 16;
+
+struct Header
+{
+    char magic[8];
+    uint32_t nVersion;
+    uint32_t nWords;
+    uint64_t nKeyFrames;
+    uint64_t nMapPoints;
+    uint64_t nNextKeyFrameId;
+    uint64_t nNextFrameId;
+    uint64_t nNextMapPointId;
+    // Calibration and grid of the frames, the same for all keyframes
+    float fx, fy, cx, cy;
+    float minX, maxX, minY, maxY;
+    float gridElementWidthInv, gridElementHeightInv;
+    // Of the settings the map was built with, 0 if unknown
+    uint64_t nSettingsHash;
+};
+
+// Of a checkpoint delta, followed by the keyframe blocks, the map point blocks, the poses and
+// geometries (each an id and its floats) and the erased keyframe and map point ids
+struct DeltaHeader
+{
+    char magic[8];
+    uint32_t nVersion;
+    uint32_t nWords;
+    uint64_t nNextKeyFrameId;
+    uint64_t nNextFrameId;
+    uint64_t nNextMapPointId;
+    uint64_t nKeyFrames;
+    uint64_t nMapPoints;
+    uint64_t nPoses;
+    uint64_t nGeometries;
+    uint64_t nErasedKeyFrames;
+    uint64_t nErasedMapPoints;
+};
+
+// Where the pose is in a keyframe block and the geometry in a map point block, after the ids
+// and the timestamp written first by EncodeKeyFrame and EncodeMapPoint
+const size_t POSE_OFFSET = 2*sizeof(uint64_t)+sizeof(double);
+const size_t GEOMETRY_OFFSET = 4*sizeof(uint64_t);
+
+// Follows the Header in a mapped map. The features are stored as they are in memory, so the
+// file only works with a build of the same layout.
+struct MappedHeader
+{
+    uint32_t nKeyPointSize;
+    uint32_t nGridCells;
+};
+
+struct BlockRef
+{
+    uint64_t nOffset;
+    uint64_t nSize;
+};
+
+// Keyframe of a mapped map: its block without the features, and the features, read in place
+struct MappedKeyFrame
+{
+    BlockRef block;
+    uint64_t nFeaturesOffset;
+    int32_t N;
+    int32_t nDescCols;
+};
+
+uint64_t Align(const uint64_t nOffset)
+{
+    return (nOffset+FEATURE_ALIGNMENT-1)/FEATURE_ALIGNMENT*FEATURE_ALIGNMENT;
+}
+
+// Offsets of the feature arrays of a mapped keyframe: keypoints, undistorted keypoints, right
+// coordinates, depths, descriptors, grid offsets and grid indices
+struct FeatureLayout
+{
+    FeatureLayout(const uint64_t nOffset, const uint64_t N, const uint64_t nDescCols)
+    {
+        keys = Align(nOffset);
+        keysUn = Align(keys+N*sizeof(cv::KeyPoint));
+        uRight = Align(keysUn+N*sizeof(cv::KeyPoint));
+        depth = Align(uRight+N*sizeof(float));
+        descriptors = Align(depth+N*sizeof(float));
+        gridOffsets = Align(descriptors+N*nDescCols);
+        gridIndices = Align(gridOffsets+(FRAME_GRID_COLS*FRAME_GRID_ROWS+1)*sizeof(uint32_t));
+    }
+
+    uint64_t keys, keysUn, uRight, depth, descriptors, gridOffsets, gridIndices;
+};
+
+// Features of a mapped keyframe, pointing into the file
+struct MappedFeatures
+{
+    const cv::KeyPoint* pKeys;
+    const cv::KeyPoint* pKeysUn;
+    const float* pRight;
+    const float* pDepth;
+    const unsigned char* pDescriptors;
+    const unsigned int* pGridOffsets;
+    const unsigned int* pGridIndices;
+};
+
+// Links of a keyframe by mnId, resolved once all keyframes are loaded
+struct KeyFrameGraph
+{
+    int64_t nParentId;
+    vector<pair<uint64_t,int32_t> > vConnections;
+    vector<uint64_t> vLoopEdges;
+};
+
+typedef MapSerializer::MapPointData MapPointData;
+
+void RunTasks(ThreadPool* pThreadPool, const int n, const function<void(int)> &task)
+{
+    if(pThreadPool)
+        pThreadPool->ParallelFor(n, task);
+    else
+        for(int i=0; i<n; i++)
+            task(i);
+}
+
+class BlockWriter
+{
+public:
+    void Clear() { mvData.clear(); }
+
+    template<typename T>
+    void Put(const T &value) { PutArray(&value,1); }
+
+    template<typename T>
+    void PutArray(const T* p, const size_t n)
+    {
+        const char* pBytes = reinterpret_cast<const char*>(p);
+        mvData.insert(mvData.end(), pBytes, pBytes+n*sizeof(T));
+    }
+
+    const vector<char>& GetData() const { return mvData; }
+
+private:
+    vector<char> mvData;
+};
+
+// Reads a block, every Get fails once the block is exhausted
+class BlockReader
+{
+public:
+    BlockReader(): mpData(NULL), mnSize(0), mnPos(0) {}
+    BlockReader(const vector<char> &vData): mpData(vData.empty() ? NULL : &vData[0]), mnSize(vData.size()), mnPos(0) {}
+    BlockReader(const char* pData, const size_t nSize): mpData(pData), mnSize(nSize), mnPos(0) {}
+
+    template<typename T>
+    bool Get(T &value) { return GetArray(&value,1); }
+
+    template<typename T>
+    bool GetArray(T* p, const size_t n)
+    {
+        if(n>(mnSize-mnPos)/sizeof(T))
+            return false;
+        if(n>0)
+            memcpy(p, mpData+mnPos, n*sizeof(T));
+        mnPos += n*sizeof(T);
+        return true;
+    }
+
+    // Checks the size against the block before allocating
+    template<typename T>
+    bool GetVector(vector<T> &v, const size_t n)
+    {
+        if(n>(mnSize-mnPos)/sizeof(T))
+            return false;
+        v.resize(n);
+        return n==0 || GetArray(&v[0],n);
+    }
+
+    bool AtEnd() const { return mnPos==mnSize; }
+
+private:
+    const char* mpData;
+    size_t mnSize;
+    size_t mnPos;
+};
+
+void WriteBlock(ofstream &f, const vector<char> &vData)
+{
+    const uint64_t nSize = vData.size();
+    f.write(reinterpret_cast<const char*>(&nSize), sizeof(nSize));
+    if(nSize>0)
+        f.write(&vData[0], nSize);
+}
+
+bool ReadBlock(ifstream &f, const uint64_t nFileSize, vector<char> &vData)
+{
+    uint64_t nSize;
+    if(!f.read(reinterpret_cast<char*>(&nSize), sizeof(nSize)) || nSize>nFileSize)
+        return false;
+    vData.resize(nSize);
+    return nSize==0 || f.read(&vData[0], nSize);
+}
+
+void PutKeyPoints(BlockWriter &w, const SharedArray<cv::KeyPoint> &vKeys)
+{
+    for(size_t i=0; i<vKeys.size(); i++)
+    {
+        const cv::KeyPoint &kp = vKeys[i];
+        const float values[5] = {kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response};
+        w.PutArray(values,5);
+        w.Put<int32_t>(kp.octave);
+    }
+}
+
+bool GetKeyPoints(BlockReader &r, const int N, vector<cv::KeyPoint> &vKeys)
+{
+    vKeys.resize(N);
+    for(int i=0; i<N; i++)
+    {
+        float values[5];
+        int32_t octave;
+        if(!r.GetArray(values,5) || !r.Get(octave))
+            return false;
+        vKeys[i] = cv::KeyPoint(values[0],values[1],values[2],values[3],values[4],octave);
+    }
+    return true;
+}
+
+// bFeatures is false for a mapped map, which stores the features apart
+void EncodeKeyFrame(KeyFrame* pKF, const bool bFeatures, BlockWriter &w)
+{
+    Eigen::Matrix3f Rcw;
+    Eigen::Vector3f tcw;
+    pKF->GetPose(Rcw,tcw);
+    float pose[12];
+    Eigen::Matrix<float,3,3,Eigen::RowMajor>::Map(pose) = Rcw;
+    Eigen::Vector3f::Map(pose+9) = tcw;
+
+    w.Put<uint64_t>(pKF->mnId);
+    w.Put<uint64_t>(pKF->mnFrameId);
+    w.Put<double>(pKF->mTimeStamp);
+    w.PutArray(pose,12);
+    w.Put<float>(pKF->mbf);
+    w.Put<float>(pKF->mThDepth);
+
+    w.Put<int32_t>(pKF->mnScaleLevels);
+    w.Put<float>(pKF->mfScaleFactor);
+    w.PutArray(&pKF->mvScaleFactors[0],pKF->mnScaleLevels);
+    w.PutArray(&pKF->mvLevelSigma2[0],pKF->mnScaleLevels);
+
+    // Features
+    if(bFeatures)
+    {
+        const int N = pKF->N;
+        const KeyFrame::Features features = pKF->GetFeatures();
+        w.Put<int32_t>(N);
+        PutKeyPoints(w,features.vKeys);
+        PutKeyPoints(w,features.vKeysUn);
+        w.PutArray(features.vuRight.begin(),N);
+        w.PutArray(features.vDepth.begin(),N);
+        w.Put<int32_t>(pKF->mDescriptors.cols);
+        for(int i=0; i<N; i++)
+            w.PutArray(pKF->mDescriptors.ptr<unsigned char>(i),pKF->mDescriptors.cols);
+    }
+
+    // BoW
+    w.Put<uint32_t>(pKF->mBowVec.size());
+    for(DBoW2::BowVector::const_iterator vit=pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit!=vend; vit++)
+    {
+        w.Put<uint32_t>(vit->first);
+        w.Put<double>(vit->second);
+    }
+    w.Put<uint32_t>(pKF->mFeatVec.size());
+    for(DBoW2::FeatureVector::const_iterator fit=pKF->mFeatVec.begin(), fend=pKF->mFeatVec.end(); fit!=fend; fit++)
+    {
+        w.Put<uint32_t>(fit->first);
+        w.Put<uint32_t>(fit->second.size());
+        w.PutArray(fit->second.empty() ? NULL : &fit->second[0],fit->second.size());
+    }
+
+    // Covisibility graph, spanning tree and loop edges. Links to bad keyframes are dropped.
+    KeyFrame* pParent = pKF->GetParent();
+    w.Put<int64_t>(pParent && !pParent->isBad() ? static_cast<int64_t>(pParent->mnId) : -1);
+
+    const KeyFrame::CovisibilitySnapshot pConnections = pKF->GetCovisibilitySnapshot();
+    const vector<KeyFrame*> &vpConnected = pConnections->KeyFrames();
+    vector<pair<uint64_t,int32_t> > vConnections;
+    for(size_t i=0, iend=pConnections->NumOrdered(); i<iend; i++)
+    {
+        if(!vpConnected[i]->isBad())
+            vConnections.push_back(make_pair(vpConnected[i]->mnId,pConnections->Weights()[i]));
+    }
+    w.Put<uint32_t>(vConnections.size());
+    for(size_t i=0; i<vConnections.size(); i++)
+    {
+        w.Put<uint64_t>(vConnections[i].first);
+        w.Put<int32_t>(vConnections[i].second);
+    }
+
+    const set<KeyFrame*> spLoopEdges = pKF->GetLoopEdges();
+    vector<uint64_t> vLoopEdges;
+    for(set<KeyFrame*>::const_iterator sit=spLoopEdges.begin(), send=spLoopEdges.end(); sit!=send; sit++)
+    {
+        if(!(*sit)->isBad())
+            vLoopEdges.push_back((*sit)->mnId);
+    }
+    w.Put<uint32_t>(vLoopEdges.size());
+    w.PutArray(vLoopEdges.empty() ? NULL : &vLoopEdges[0],vLoopEdges.size());
+}
+
+void EncodeMapPoint(MapPoint* pMP, const float* geometry, const uint32_t* descriptor, const int nVisible,
+                    const int nFound, BlockWriter &w)
+{
+    KeyFrame* pRefKF = pMP->GetReferenceKeyFrame();
+
+    w.Put<uint64_t>(pMP->mnId);
+    w.Put<int64_t>(pMP->mnFirstKFid);
+    w.Put<int64_t>(pMP->mnFirstFrame);
+    w.Put<uint64_t>(pRefKF ? pRefKF->mnId : 0);
+    w.PutArray(geometry,8);
+    w.PutArray(descriptor,8);
+    w.Put<int32_t>(nVisible);
+    w.Put<int32_t>(nFound);
+
+    const ObservationList observations = pMP->GetObservations();
+    vector<pair<uint64_t,uint32_t> > vObservations;
+    for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+    {
+        if(!mit->first->isBad())
+            vObservations.push_back(make_pair(mit->first->mnId,mit->second));
+    }
+    w.Put<uint32_t>(vObservations.size());
+    for(size_t i=0; i<vObservations.size(); i++)
+    {
+        w.Put<uint64_t>(vObservations[i].first);
+        w.Put<uint32_t>(vObservations[i].second);
+    }
+}
+
+// Every keypoint is on a level of the scale pyramid of its keyframe
+bool CheckOctaves(const cv::KeyPoint* pKeys, const int N, const int nLevels)
+{
+    for(int i=0; i<N; i++)
+        if(pKeys[i].octave<0 || pKeys[i].octave>=nLevels)
+            return false;
+    return true;
+}
+
+// Restores the frame a keyframe was built from, except for its grid. Without bFeatures the block
+// has no features, and F.N and the descriptors are already set.
+bool DecodeKeyFrame(BlockReader &r, const bool bFeatures, ORBVocabulary* pVoc, const FrameContext &context, Frame &F,
+                    uint64_t &nId, KeyFrameGraph &graph)
+{
+    uint64_t nFrameId;
+    float pose[12];
+    int32_t nLevels;
+    if(!r.Get(nId) || !r.Get(nFrameId) || !r.Get(F.mTimeStamp) || !r.GetArray(pose,12) || !r.Get(F.mbf) ||
+       !r.Get(F.mThDepth) || !r.Get(nLevels) || nLevels<=0 || !r.Get(F.mfScaleFactor))
+        return false;
+
+    // Scale pyramid
+    if(!r.GetVector(F.mvScaleFactors,nLevels) || !r.GetVector(F.mvLevelSigma2,nLevels))
+        return false;
+    F.mnScaleLevels = nLevels;
+    F.mfLogScaleFactor = log(F.mfScaleFactor);
+    F.mvInvScaleFactors.resize(nLevels);
+    F.mvInvLevelSigma2.resize(nLevels);
+    for(int i=0; i<nLevels; i++)
+    {
+        F.mvInvScaleFactors[i] = 1.0f/F.mvScaleFactors[i];
+        F.mvInvLevelSigma2[i] = 1.0f/F.mvLevelSigma2[i];
+    }
+
+    // Features
+    int32_t N = F.N;
+    if(bFeatures)
+    {
+        int32_t nCols;
+        vector<cv::KeyPoint> vKeys, vKeysUn;
+        vector<float> vuRight, vDepth;
+        if(!r.Get(N) || N<0 || !GetKeyPoints(r,N,vKeys) || !GetKeyPoints(r,N,vKeysUn) ||
+           !r.GetVector(vuRight,N) || !r.GetVector(vDepth,N) || !r.Get(nCols) || nCols<=0)
+            return false;
+        // the octave indexes the scale pyramid
+        if(N>0 && (!CheckOctaves(&vKeys[0],N,nLevels) || !CheckOctaves(&vKeysUn[0],N,nLevels)))
+            return false;
+        F.N = N;
+        F.mvKeys = SharedArray<cv::KeyPoint>(std::move(vKeys));
+        F.mvKeysUn = SharedArray<cv::KeyPoint>(std::move(vKeysUn));
+        F.mvuRight = SharedArray<float>(std::move(vuRight));
+        F.mvDepth = SharedArray<float>(std::move(vDepth));
+        F.mDescriptors.create(N,nCols,CV_8U);
+        if(N>0 && !r.GetArray(F.mDescriptors.data,static_cast<size_t>(N)*nCols))
+            return false;
+    }
+
+    // BoW
+    uint32_t nWords;
+    if(!r.Get(nWords))
+        return false;
+    for(uint32_t i=0; i<nWords; i++)
+    {
+        uint32_t wordId;
+        double weight;
+        if(!r.Get(wordId) || !r.Get(weight) || wordId>=pVoc->size())
+            return false;
+        F.mBowVec.insert(F.mBowVec.end(),make_pair(wordId,weight));
+    }
+
+    uint32_t nNodes;
+    if(!r.Get(nNodes))
+        return false;
+    for(uint32_t i=0; i<nNodes; i++)
+    {
+        uint32_t nodeId, nFeatures;
+        if(!r.Get(nodeId) || !r.Get(nFeatures))
+            return false;
+        vector<unsigned int> &vFeatures = F.mFeatVec[nodeId];
+        if(!r.GetVector(vFeatures,nFeatures))
+            return false;
+        for(size_t j=0; j<vFeatures.size(); j++)
+        {
+            if(vFeatures[j]>=static_cast<unsigned int>(N))
+                return false;
+        }
+    }
+
+    // Graph
+    uint32_t nConnections, nLoopEdges;
+    if(!r.Get(graph.nParentId) || !r.Get(nConnections))
+        return false;
+    graph.vConnections.clear();
+    for(uint32_t i=0; i<nConnections; i++)
+    {
+        uint64_t nId2;
+        int32_t weight;
+        if(!r.Get(nId2) || !r.Get(weight))
+            return false;
+        graph.vConnections.push_back(make_pair(nId2,weight));
+    }
+    if(!r.Get(nLoopEdges) || !r.GetVector(graph.vLoopEdges,nLoopEdges) || !r.AtEnd())
+        return false;
+
+    // Rest of the frame
+    F.mnId = nFrameId;
+    F.mpORBvocabulary = pVoc;
+    F.mpORBextractorLeft = static_cast<ORBextractor*>(NULL);
+    F.mpORBextractorRight = static_cast<ORBextractor*>(NULL);
+    F.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    F.SetCalibration(context);
+    F.mK = cv::Mat::eye(3,3,CV_32F);
+    F.mK.at<float>(0,0) = context.fx;
+    F.mK.at<float>(1,1) = context.fy;
+    F.mK.at<float>(0,2) = context.cx;
+    F.mK.at<float>(1,2) = context.cy;
+    F.mb = F.mbf/context.fx;
+    F.mvpMapPoints.assign(N,static_cast<MapPoint*>(NULL));
+    F.mvbOutlier.assign(N,false);
+
+    cv::Mat Tcw = cv::Mat::eye(4,4,CV_32F);
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<3; j++)
+            Tcw.at<float>(i,j) = pose[3*i+j];
+        Tcw.at<float>(i,3) = pose[9+i];
+    }
+    F.SetPose(Tcw);
+
+    return true;
+}
+
+bool DecodeMapPoint(BlockReader &r, MapPointData &data)
+{
+    uint32_t nObs;
+    if(!r.Get(data.nId) || !r.Get(data.nFirstKFid) || !r.Get(data.nFirstFrame) || !r.Get(data.nRefKFId) ||
+       !r.GetArray(data.geometry,8) || !r.GetArray(data.descriptor,8) || !r.Get(data.nVisible) ||
+       !r.Get(data.nFound) || !r.Get(nObs))
+        return false;
+
+    data.vObservations.clear();
+    for(uint32_t i=0; i<nObs; i++)
+    {
+        uint64_t nKFId;
+        uint32_t idx;
+        if(!r.Get(nKFId) || !r.Get(idx))
+            return false;
+        data.vObservations.push_back(make_pair(nKFId,idx));
+    }
+
+    return r.AtEnd();
+}
+
+// Checks the features of a mapped keyframe against the file and points to them
+bool GetMappedFeatures(const MappedFile &file, const MappedKeyFrame &record, MappedFeatures &features)
+{
+    if(record.N<0 || record.nDescCols<=0)
+        return false;
+
+    const uint64_t N = record.N;
+    const int nCells = FRAME_GRID_COLS*FRAME_GRID_ROWS;
+    const FeatureLayout layout(record.nFeaturesOffset,N,record.nDescCols);
+    features.pKeys = file.Get<cv::KeyPoint>(layout.keys,N);
+    features.pKeysUn = file.Get<cv::KeyPoint>(layout.keysUn,N);
+    features.pRight = file.Get<float>(layout.uRight,N);
+    features.pDepth = file.Get<float>(layout.depth,N);
+    features.pDescriptors = file.Get<unsigned char>(layout.descriptors,N*record.nDescCols);
+    features.pGridOffsets = file.Get<unsigned int>(layout.gridOffsets,nCells+1);
+    if(!features.pKeys || !features.pKeysUn || !features.pRight || !features.pDepth || !features.pDescriptors ||
+       !features.pGridOffsets)
+        return false;
+
+    // A corrupt grid would send the searches out of the keypoints
+    const unsigned int* pOffsets = features.pGridOffsets;
+    if(pOffsets[0]!=0 || pOffsets[nCells]>N)
+        return false;
+    for(int i=0; i<nCells; i++)
+    {
+        if(pOffsets[i]>pOffsets[i+1])
+            return false;
+    }
+    features.pGridIndices = file.Get<unsigned int>(layout.gridIndices,pOffsets[nCells]);
+    if(!features.pGridIndices)
+        return false;
+    for(unsigned int i=0; i<pOffsets[nCells]; i++)
+    {
+        if(features.pGridIndices[i]>=N)
+            return false;
+    }
+
+    return true;
+}
+
+// Pads the file with zeros up to nOffset
+void WritePadding(ofstream &f, uint64_t &nPos, const uint64_t nOffset)
+{
+    static const char zeros[FEATURE_ALIGNMENT] = {0};
+    f.write(zeros,nOffset-nPos);
+    nPos = nOffset;
+}
+
+template<typename T>
+void WriteArray(ofstream &f, uint64_t &nPos, const uint64_t nOffset, const T* p, const size_t n)
+{
+    WritePadding(f,nPos,nOffset);
+    if(n>0)
+        f.write(reinterpret_cast<const char*>(p),n*sizeof(T));
+    nPos += n*sizeof(T);
+}
+
+// Features of a keyframe laid out as the loader maps them, returns the record of the keyframe
+MappedKeyFrame WriteMappedFeatures(ofstream &f, uint64_t &nPos, KeyFrame* pKF, const FeatureGrid &grid)
+{
+    MappedKeyFrame record;
+    memset(&record,0,sizeof(MappedKeyFrame));
+    record.nFeaturesOffset = nPos;
+    record.N = pKF->N;
+    record.nDescCols = pKF->mDescriptors.cols;
+
+    const size_t N = pKF->N;
+    const FeatureLayout layout(nPos,N,record.nDescCols);
+    const KeyFrame::Features features = pKF->GetFeatures();
+    WriteArray(f,nPos,layout.keys,features.vKeys.begin(),N);
+    WriteArray(f,nPos,layout.keysUn,features.vKeysUn.begin(),N);
+    WriteArray(f,nPos,layout.uRight,features.vuRight.begin(),N);
+    WriteArray(f,nPos,layout.depth,features.vDepth.begin(),N);
+    WritePadding(f,nPos,layout.descriptors);
+    for(size_t i=0; i<N; i++)
+        WriteArray(f,nPos,nPos,pKF->mDescriptors.ptr<unsigned char>(i),record.nDescCols);
+
+    const int nCells = FRAME_GRID_COLS*FRAME_GRID_ROWS;
+    const unsigned int* pOffsets = grid.Offsets();
+    WriteArray(f,nPos,layout.gridOffsets,pOffsets,nCells+1);
+    WriteArray(f,nPos,layout.gridIndices,grid.Indices(),pOffsets[nCells]);
+
+    return record;
+}
+
+// The good keyframes, by mnId, and the good map points
+void GetMapContents(Map* pMap, vector<KeyFrame*> &vpKFs, vector<MapPoint*> &vpMPs)
+{
+    const vector<KeyFrame*> vpAllKFs = pMap->GetAllKeyFrames();
+    for(size_t i=0; i<vpAllKFs.size(); i++)
+    {
+        if(!vpAllKFs[i]->isBad())
+            vpKFs.push_back(vpAllKFs[i]);
+    }
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+
+    const vector<MapPoint*> vpAllMPs = pMap->GetAllMapPoints();
+    for(size_t i=0; i<vpAllMPs.size(); i++)
+    {
+        if(!vpAllMPs[i]->isBad())
+            vpMPs.push_back(vpAllMPs[i]);
+    }
+}
+
+Header MakeHeader(const char* magic, const Map* pMap, const ORBVocabulary* pVoc, const size_t nKeyFrames,
+                  const size_t nMapPoints)
+{
+    Header header;
+    memset(&header,0,sizeof(Header));
+    memcpy(header.magic,magic,sizeof(header.magic));
+    header.nVersion = VERSION;
+    VocabularyLoader::Wait(pVoc);
+    header.nWords = pVoc->size();
+    header.nKeyFrames = nKeyFrames;
+    header.nMapPoints = nMapPoints;
+    const FrameContext &context = pMap->mFrameContext;
+    header.nNextKeyFrameId = pMap->mnNextKeyFrameId;
+    header.nNextFrameId = context.nNextId;
+    header.nNextMapPointId = pMap->mnNextMapPointId;
+    header.fx = context.fx;
+    header.fy = context.fy;
+    header.cx = context.cx;
+    header.cy = context.cy;
+    header.minX = context.mnMinX;
+    header.maxX = context.mnMaxX;
+    header.minY = context.mnMinY;
+    header.maxY = context.mnMaxY;
+    header.gridElementWidthInv = context.mfGridElementWidthInv;
+    header.gridElementHeightInv = context.mfGridElementHeightInv;
+    header.nSettingsHash = pMap->mnSettingsHash;
+    return header;
+}
+
+bool CheckHeader(const Header &header, const char* magic, const string &filename, const ORBVocabulary* pVoc)
+{
+    if(memcmp(header.magic,magic,sizeof(header.magic))!=0)
+    {
+        cerr << filename << " is not a map file of this kind" << endl;
+        return false;
+    }
+    if(header.nVersion!=VERSION)
+    {
+        cerr << "The map " << filename << " has version " << header.nVersion << ", expected " << VERSION << endl;
+        return false;
+    }
+    VocabularyLoader::Wait(pVoc);
+    if(header.nWords!=pVoc->size())
+    {
+        cerr << "The map " << filename << " was built with another vocabulary" << endl;
+        return false;
+    }
+    return true;
+}
+
+// The ids come from the file, they are looked up instead of indexing a table as large as the
+// largest of them
+typedef unordered_map<uint64_t,KeyFrame*> KeyFrameById;
+
+KeyFrame* FindKeyFrame(const KeyFrameById &vpKFById, const int64_t nId)
+{
+    if(nId<0)
+        return static_cast<KeyFrame*>(NULL);
+    KeyFrameById::const_iterator it = vpKFById.find(nId);
+    return it!=vpKFById.end() ? it->second : static_cast<KeyFrame*>(NULL);
+}
+
+template<typename T>
+void DeleteAll(const vector<T*> &vp)
+{
+    for(size_t i=0; i<vp.size(); i++)
+        delete vp[i];
+}
+
+// Blocks of a merged checkpoint by the id they start with
+typedef map<uint64_t,vector<char> > BlockMap;
+
+bool ReadBlocks(ifstream &f, const uint64_t nFileSize, const uint64_t n, BlockMap &mBlocks)
+{
+    vector<char> vData;
+    for(uint64_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        if(!ReadBlock(f,nFileSize,vData) || !BlockReader(vData).Get(nId))
+            return false;
+        mBlocks[nId].swap(vData);
+    }
+    return true;
+}
+
+// Overwrites the floats at nOffset of the blocks of the ids, ids which are not there are skipped
+bool PatchBlocks(ifstream &f, const uint64_t nFileSize, const uint64_t n, const size_t nOffset, const int nFloats,
+                 BlockMap &mBlocks)
+{
+    if(n>nFileSize/(sizeof(uint64_t)+nFloats*sizeof(float)))
+        return false;
+    vector<float> vValues(nFloats);
+    for(uint64_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        if(!f.read(reinterpret_cast<char*>(&nId),sizeof(nId)) ||
+           !f.read(reinterpret_cast<char*>(&vValues[0]),nFloats*sizeof(float)))
+            return false;
+        BlockMap::iterator it = mBlocks.find(nId);
+        if(it!=mBlocks.end() && it->second.size()>=nOffset+nFloats*sizeof(float))
+            memcpy(&it->second[nOffset],&vValues[0],nFloats*sizeof(float));
+    }
+    return true;
+}
+
+bool EraseBlocks(ifstream &f, const uint64_t nFileSize, const uint64_t n, BlockMap &mBlocks)
+{
+    if(n>nFileSize/sizeof(uint64_t))
+        return false;
+    for(uint64_t i=0; i<n; i++)
+    {
+        uint64_t nId;
+        if(!f.read(reinterpret_cast<char*>(&nId),sizeof(nId)))
+            return false;
+        mBlocks.erase(nId);
+    }
+    return true;
+}
+
+// Opens filename for reading through vBuffer, with its size
+bool OpenFile(const string &filename, vector<char> &vBuffer, ifstream &f, uint64_t &nFileSize)
+{
+    vBuffer.resize(IO_BUFFER_SIZE);
+    f.rdbuf()->pubsetbuf(&vBuffer[0],vBuffer.size());
+    f.open(filename.c_str(), ios::in | ios::binary);
+    if(!f.is_open())
+        return false;
+    f.seekg(0,ios::end);
+    nFileSize = f.tellg();
+    f.seekg(0,ios::beg);
+    return true;
+}
+}
+
+bool MapSerializer::Save(const string &filename, Map* pMap, const ORBVocabulary* pVoc, ThreadPool* pThreadPool)
+{
+    vector<KeyFrame*> vpKFs;
+    vector<MapPoint*> vpMPs;
+    GetMapContents(pMap,vpKFs,vpMPs);
+
+    if(vpKFs.empty())
+    {
+        cerr << "The map is empty, nothing to save" << endl;
+        return false;
+    }
+
+    vector<char> vBuffer(IO_BUFFER_SIZE);
+    ofstream f;
+    f.rdbuf()->pubsetbuf(&vBuffer[0],vBuffer.size());
+    f.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if(!f.is_open())
+    {
+        cerr << "Failed to open " << filename << " to save the map" << endl;
+        return false;
+    }
+
+    const Header header = MakeHeader(MAGIC,pMap,pVoc,vpKFs.size(),vpMPs.size());
+    f.write(reinterpret_cast<const char*>(&header),sizeof(Header));
+
+    // Every batch is encoded in parallel and written in order
+    vector<BlockWriter> vWriters(BATCH_SIZE);
+    for(size_t i0=0; i0<vpKFs.size(); i0+=BATCH_SIZE)
+    {
+        const int n = min<size_t>(BATCH_SIZE,vpKFs.size()-i0);
+        RunTasks(pThreadPool, n, [&](int i)
+        {
+            vWriters[i].Clear();
+            EncodeKeyFrame(vpKFs[i0+i],true,vWriters[i]);
+        });
+
+        for(int i=0; i<n; i++)
+            WriteBlock(f,vWriters[i].GetData());
+    }
+
+    for(size_t i0=0; i0<vpMPs.size(); i0+=BATCH_SIZE)
+    {
+        const int n = min<size_t>(BATCH_SIZE,vpMPs.size()-i0);
+        RunTasks(pThreadPool, n, [&](int i)
+        {
+            MapPoint* pMP = vpMPs[i0+i];
+            float geometry[8];
+            uint32_t descriptor[8];
+            pMP->mGeometry.Read(geometry);
+            pMP->mDescriptor.Read(descriptor);
+
+            vWriters[i].Clear();
+            EncodeMapPoint(pMP,geometry,descriptor,pMP->mnVisible.load(memory_order_relaxed),pMP->mnFound.load(memory_order_relaxed),vWriters[i]);
+        });
+
+        for(int i=0; i<n; i++)
+            WriteBlock(f,vWriters[i].GetData());
+    }
+
+    f.close();
+    if(!f)
+    {
+        cerr << "Failed to write the map to " << filename << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool MapSerializer::SaveMapped(const string &filename, Map* pMap, const ORBVocabulary* pVoc, ThreadPool* pThreadPool)
+{
+    vector<KeyFrame*> vpKFs;
+    vector<MapPoint*> vpMPs;
+    GetMapContents(pMap,vpKFs,vpMPs);
+
+    if(vpKFs.empty())
+    {
+        cerr << "The map is empty, nothing to save" << endl;
+        return false;
+    }
+
+    vector<char> vBuffer(IO_BUFFER_SIZE);
+    ofstream f;
+    f.rdbuf()->pubsetbuf(&vBuffer[0],vBuffer.size());
+    f.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if(!f.is_open())
+    {
+        cerr << "Failed to open " << filename << " to save the map" << endl;
+        return false;
+    }
+
+    const Header header = MakeHeader(MAPPED_MAGIC,pMap,pVoc,vpKFs.size(),vpMPs.size());
+    MappedHeader mappedHeader;
+    mappedHeader.nKeyPointSize = sizeof(cv::KeyPoint);
+    mappedHeader.nGridCells = FRAME_GRID_COLS*FRAME_GRID_ROWS;
+
+    // The tables are written again once the offsets are known
+    vector<MappedKeyFrame> vKFTable(vpKFs.size());
+    vector<BlockRef> vMPTable(vpMPs.size());
+    uint64_t nPos = 0;
+    WriteArray(f,nPos,nPos,&header,1);
+    WriteArray(f,nPos,nPos,&mappedHeader,1);
+    const uint64_t nTablesOffset = nPos;
+    WriteArray(f,nPos,nPos,&vKFTable[0],vKFTable.size());
+    WriteArray(f,nPos,nPos,vMPTable.empty() ? NULL : &vMPTable[0],vMPTable.size());
+
+    vector<BlockWriter> vWriters(BATCH_SIZE);
+    for(size_t i0=0; i0<vpKFs.size(); i0+=BATCH_SIZE)
+    {
+        const int n = min<size_t>(BATCH_SIZE,vpKFs.size()-i0);
+        RunTasks(pThreadPool, n, [&](int i)
+        {
+            vWriters[i].Clear();
+            EncodeKeyFrame(vpKFs[i0+i],false,vWriters[i]);
+        });
+
+        for(int i=0; i<n; i++)
+        {
+            MappedKeyFrame &record = vKFTable[i0+i];
+            record = WriteMappedFeatures(f,nPos,vpKFs[i0+i],*vpKFs[i0+i]->mpGrid);
+
+            const vector<char> &vData = vWriters[i].GetData();
+            record.block.nOffset = nPos;
+            record.block.nSize = vData.size();
+            WriteArray(f,nPos,nPos,vData.empty() ? NULL : &vData[0],vData.size());
+        }
+    }
+
+    for(size_t i0=0; i0<vpMPs.size(); i0+=BATCH_SIZE)
+    {
+        const int n = min<size_t>(BATCH_SIZE,vpMPs.size()-i0);
+        RunTasks(pThreadPool, n, [&](int i)
+        {
+            MapPoint* pMP = vpMPs[i0+i];
+            float geometry[8];
+            uint32_t descriptor[8];
+            pMP->mGeometry.Read(geometry);
+            pMP->mDescriptor.Read(descriptor);
+
+            vWriters[i].Clear();
+            EncodeMapPoint(pMP,geometry,descriptor,pMP->mnVisible.load(memory_order_relaxed),pMP->mnFound.load(memory_order_relaxed),vWriters[i]);
+        });
+
+        for(int i=0; i<n; i++)
+        {
+            const vector<char> &vData = vWriters[i].GetData();
+            vMPTable[i0+i].nOffset = nPos;
+            vMPTable[i0+i].nSize = vData.size();
+            WriteArray(f,nPos,nPos,vData.empty() ? NULL : &vData[0],vData.size());
+        }
+    }
+
+    f.seekp(nTablesOffset);
+    nPos = nTablesOffset;
+    WriteArray(f,nPos,nPos,&vKFTable[0],vKFTable.size());
+    WriteArray(f,nPos,nPos,vMPTable.empty() ? NULL : &vMPTable[0],vMPTable.size());
+
+    f.close();
+    if(!f)
+    {
+        cerr << "Failed to write the map to " << filename << endl;
+        return false;
+    }
+
+    return true;
+}
+
+void MapSerializer::AddPose(CheckpointDelta &delta, KeyFrame* pKF)
+{
+    Eigen::Matrix3f Rcw;
+    Eigen::Vector3f tcw;
+    pKF->GetPose(Rcw,tcw);
+    delta.vPoseIds.push_back(pKF->mnId);
+    delta.vPoses.resize(delta.vPoses.size()+12);
+    float* pose = &delta.vPoses[delta.vPoses.size()-12];
+    Eigen::Matrix<float,3,3,Eigen::RowMajor>::Map(pose) = Rcw;
+    Eigen::Vector3f::Map(pose+9) = tcw;
+}
+
+void MapSerializer::AddGeometry(CheckpointDelta &delta, MapPoint* pMP)
+{
+    delta.vGeometryIds.push_back(pMP->mnId);
+    delta.vGeometries.resize(delta.vGeometries.size()+8);
+    pMP->mGeometry.Read(&delta.vGeometries[delta.vGeometries.size()-8]);
+}
+
+bool MapSerializer::SaveDelta(const string &filename, const CheckpointDelta &delta, Map* pMap, const ORBVocabulary* pVoc)
+{
+    vector<char> vBuffer(IO_BUFFER_SIZE);
+    ofstream f;
+    f.rdbuf()->pubsetbuf(&vBuffer[0],vBuffer.size());
+    f.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if(!f.is_open())
+    {
+        cerr << "Failed to open " << filename << " to save the checkpoint" << endl;
+        return false;
+    }
+
+    DeltaHeader header;
+    memset(&header,0,sizeof(DeltaHeader));
+    memcpy(header.magic,DELTA_MAGIC,sizeof(header.magic));
+    header.nVersion = VERSION;
+    VocabularyLoader::Wait(pVoc);
+    header.nWords = pVoc->size();
+    header.nNextKeyFrameId = pMap->mnNextKeyFrameId;
+    header.nNextFrameId = pMap->mFrameContext.nNextId;
+    header.nNextMapPointId = pMap->mnNextMapPointId;
+    header.nKeyFrames = delta.vKeyFrameBlocks.size();
+    header.nMapPoints = delta.vMapPointBlocks.size();
+    header.nPoses = delta.vPoseIds.size();
+    header.nGeometries = delta.vGeometryIds.size();
+    header.nErasedKeyFrames = delta.vErasedKeyFrames.size();
+    header.nErasedMapPoints = delta.vErasedMapPoints.size();
+    f.write(reinterpret_cast<const char*>(&header),sizeof(DeltaHeader));
+
+    for(size_t i=0; i<delta.vKeyFrameBlocks.size(); i++)
+        WriteBlock(f,delta.vKeyFrameBlocks[i]);
+    for(size_t i=0; i<delta.vMapPointBlocks.size(); i++)
+        WriteBlock(f,delta.vMapPointBlocks[i]);
+    for(size_t i=0; i<delta.vPoseIds.size(); i++)
+    {
+        f.write(reinterpret_cast<const char*>(&delta.vPoseIds[i]),sizeof(uint64_t));
+        f.write(reinterpret_cast<const char*>(&delta.vPoses[12*i]),12*sizeof(float));
+    }
+    for(size_t i=0; i<delta.vGeometryIds.size(); i++)
+    {
+        f.write(reinterpret_cast<const char*>(&delta.vGeometryIds[i]),sizeof(uint64_t));
+        f.write(reinterpret_cast<const char*>(&delta.vGeometries[8*i]),8*sizeof(float));
+    }
+    if(!delta.vErasedKeyFrames.empty())
+        f.write(reinterpret_cast<const char*>(&delta.vErasedKeyFrames[0]),delta.vErasedKeyFrames.size()*sizeof(uint64_t));
+    if(!delta.vErasedMapPoints.empty())
+        f.write(reinterpret_cast<const char*>(&delta.vErasedMapPoints[0]),delta.vErasedMapPoints.size()*sizeof(uint64_t));
+
+    f.close();
+    if(!f)
+    {
+        cerr << "Failed to write the checkpoint to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool MapSerializer::MergeDeltas(const string &baseFile, const vector<string> &vDeltaFiles, const ORBVocabulary* pVoc,
+                                const string &outFile)
+{
+    vector<char> vBuffer;
+    ifstream f;
+    uint64_t nFileSize = 0;
+    Header header;
+    if(!OpenFile(baseFile,vBuffer,f,nFileSize))
+    {
+        cerr << "Failed to open the map " << baseFile << endl;
+        return false;
+    }
+    if(!f.read(reinterpret_cast<char*>(&header),sizeof(Header)))
+    {
+        cerr << baseFile << " is not a map file" << endl;
+        return false;
+    }
+    if(!CheckHeader(header,MAGIC,baseFile,pVoc))
+        return false;
+
+    BlockMap mKeyFrames, mMapPoints;
+    if(!ReadBlocks(f,nFileSize,header.nKeyFrames,mKeyFrames) || !ReadBlocks(f,nFileSize,header.nMapPoints,mMapPoints))
+    {
+        cerr << "The map " << baseFile << " is truncated or corrupt" << endl;
+        return false;
+    }
+    f.close();
+
+    for(size_t i=0; i<vDeltaFiles.size(); i++)
+    {
+        const string &filename = vDeltaFiles[i];
+        ifstream fd;
+        DeltaHeader delta;
+        if(!OpenFile(filename,vBuffer,fd,nFileSize) || !fd.read(reinterpret_cast<char*>(&delta),sizeof(DeltaHeader)) ||
+           memcmp(delta.magic,DELTA_MAGIC,sizeof(delta.magic))!=0 || delta.nVersion!=VERSION)
+        {
+            cerr << filename << " is not a checkpoint delta" << endl;
+            return false;
+        }
+        if(delta.nWords!=header.nWords)
+        {
+            cerr << "The checkpoint delta " << filename << " was built with another vocabulary" << endl;
+            return false;
+        }
+
+        if(!ReadBlocks(fd,nFileSize,delta.nKeyFrames,mKeyFrames) || !ReadBlocks(fd,nFileSize,delta.nMapPoints,mMapPoints) ||
+           !PatchBlocks(fd,nFileSize,delta.nPoses,POSE_OFFSET,12,mKeyFrames) ||
+           !PatchBlocks(fd,nFileSize,delta.nGeometries,GEOMETRY_OFFSET,8,mMapPoints) ||
+           !EraseBlocks(fd,nFileSize,delta.nErasedKeyFrames,mKeyFrames) ||
+           !EraseBlocks(fd,nFileSize,delta.nErasedMapPoints,mMapPoints))
+        {
+            cerr << "The checkpoint delta " << filename << " is truncated or corrupt" << endl;
+            return false;
+        }
+
+        header.nNextKeyFrameId = max(header.nNextKeyFrameId,delta.nNextKeyFrameId);
+        header.nNextFrameId = max(header.nNextFrameId,delta.nNextFrameId);
+        header.nNextMapPointId = max(header.nNextMapPointId,delta.nNextMapPointId);
+    }
+
+    if(mKeyFrames.empty())
+    {
+        cerr << "The checkpoint " << baseFile << " has no keyframes" << endl;
+        return false;
+    }
+
+    ofstream fo;
+    fo.rdbuf()->pubsetbuf(&vBuffer[0],vBuffer.size());
+    fo.open(outFile.c_str(), ios::out | ios::binary | ios::trunc);
+    if(!fo.is_open())
+    {
+        cerr << "Failed to open " << outFile << " to save the map" << endl;
+        return false;
+    }
+    header.nKeyFrames = mKeyFrames.size();
+    header.nMapPoints = mMapPoints.size();
+    fo.write(reinterpret_cast<const char*>(&header),sizeof(Header));
+    for(BlockMap::const_iterator it=mKeyFrames.begin(); it!=mKeyFrames.end(); it++)
+        WriteBlock(fo,it->second);
+    for(BlockMap::const_iterator it=mMapPoints.begin(); it!=mMapPoints.end(); it++)
+        WriteBlock(fo,it->second);
+
+    fo.close();
+    if(!fo)
+    {
+        cerr << "Failed to write the map to " << outFile << endl;
+        return false;
+    }
+    return true;
+}
+
+void MapSerializer::EncodeKeyFrame(KeyFrame* pKF, vector<char> &vData)
+{
+    BlockWriter w;
+    ORB_SLAM2::EncodeKeyFrame(pKF,true,w);
+    vData = w.GetData();
+}
+
+void MapSerializer::EncodeMapPoint(MapPoint* pMP, vector<char> &vData)
+{
+    float geometry[8];
+    uint32_t descriptor[8];
+    pMP->mGeometry.Read(geometry);
+    pMP->mDescriptor.Read(descriptor);
+
+    BlockWriter w;
+    ORB_SLAM2::EncodeMapPoint(pMP,geometry,descriptor,pMP->mnVisible.load(memory_order_relaxed),pMP->mnFound.load(memory_order_relaxed),w);
+    vData = w.GetData();
+}
+
+bool MapSerializer::DecodeKeyFrame(const char* pData, const size_t nSize, ORBVocabulary* pVoc, const FrameContext &context,
+                                   Frame &F, uint64_t &nId, int64_t &nParentId)
+{
+    BlockReader r(pData,nSize);
+    KeyFrameGraph graph;
+    F = Frame();
+    if(!ORB_SLAM2::DecodeKeyFrame(r,true,pVoc,context,F,nId,graph))
+        return false;
+    F.AssignFeaturesToGrid();
+    nParentId = graph.nParentId;
+    return true;
+}
+
+bool MapSerializer::DecodeMapPoint(const char* pData, const size_t nSize, MapPointData &data)
+{
+    BlockReader r(pData,nSize);
+    return ORB_SLAM2::DecodeMapPoint(r,data);
+}
+
+MapPoint* MapSerializer::CreateMapPoint(const MapPointData &data, KeyFrame* pRefKF, Map* pMap)
+{
+    cv::Mat Pos = (cv::Mat_<float>(3,1) << data.geometry[0], data.geometry[1], data.geometry[2]);
+    MapPoint* pMP = new MapPoint(Pos,pRefKF,pMap);
+    pMP->mnId = data.nId;
+    pMP->mnFirstKFid = data.nFirstKFid;
+    pMP->mnFirstFrame = data.nFirstFrame;
+    pMP->mGeometry.Write(data.geometry);
+    pMP->mDescriptor.Write(data.descriptor);
+    pMP->mnVisible.store(data.nVisible,memory_order_relaxed);
+    pMP->mnFound.store(data.nFound,memory_order_relaxed);
+    return pMP;
+}
+
+void MapSerializer::MoveMap(Map* pStaging, Map* pMap, KeyFrameDatabase* pKFDB)
+{
+    vector<KeyFrame*> vpKFs = pStaging->GetAllKeyFrames();
+    const vector<MapPoint*> vpMPs = pStaging->GetAllMapPoints();
+    const vector<KeyFrame*> vpOrigins = pStaging->GetOrigins();
+    // The keyframes keep their order
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+
+    // Get Map Mutex
+    MapUpdateLock lock(pMap,LOCK_SITE(pMap->mMutexMapUpdate));
+
+    unordered_map<unsigned long, unsigned long> mKFIds;
+    const long unsigned int nFirstMapId = pMap->mnNextMapId;
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        mKFIds[pKF->mnId] = pMap->mnNextKeyFrameId;
+        pKF->mnId = pMap->mnNextKeyFrameId++;
+        pKF->mnMapId = nFirstMapId+pKF->mnMapId;
+        pKF->mpMap = pMap;
+        pKF->mpKeyFrameDB = pKFDB;
+    }
+    pMap->mnNextMapId = nFirstMapId+pStaging->mnNextMapId;
+
+    {
+        unique_lock<MapMutex> lockPoints(LOCK_SITE(pMap->mMutexPointCreation));
+        for(size_t i=0; i<vpMPs.size(); i++)
+        {
+            MapPoint* pMP = vpMPs[i];
+            pMP->mnId = pMap->mnNextMapPointId++;
+            unordered_map<unsigned long, unsigned long>::const_iterator it = mKFIds.find(pMP->mnFirstKFid);
+            pMP->mnFirstKFid = it!=mKFIds.end() ? static_cast<long int>(it->second) : -1;
+            pMP->mpMap = pMap;
+        }
+    }
+
+    for(size_t i=0; i<vpOrigins.size(); i++)
+        pMap->AddOrigin(vpOrigins[i]);
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        pMap->AddKeyFrame(vpKFs[i]);
+        pKFDB->add(vpKFs[i]);
+    }
+    for(size_t i=0; i<vpMPs.size(); i++)
+        pMap->AddMapPoint(vpMPs[i]);
+
+    // The objects belong to pMap now
+    pStaging->Release();
+}
+
+KeyFrame* MapSerializer::Load(const string &filename, Map* pMap, KeyFrameDatabase* pKFDB, ORBVocabulary* pVoc,
+                              ThreadPool* pThreadPool)
+{
+    return LoadFile(filename,false,pMap,pKFDB,pVoc,pThreadPool,static_cast<MapTiles*>(NULL));
+}
+
+KeyFrame* MapSerializer::LoadMapped(const string &filename, Map* pMap, KeyFrameDatabase* pKFDB, ORBVocabulary* pVoc,
+                                    ThreadPool* pThreadPool, MapTiles* pTiles)
+{
+    return LoadFile(filename,true,pMap,pKFDB,pVoc,pThreadPool,pTiles);
+}
+
+KeyFrame* MapSerializer::LoadFile(const string &filename, const bool bMapped, Map* pMap, KeyFrameDatabase* pKFDB,
+                                  ORBVocabulary* pVoc, ThreadPool* pThreadPool, MapTiles* pTiles)
+{
+    if(pMap->KeyFramesInMap()>0)
+    {
+        cerr << "A map can only be loaded into an empty map" << endl;
+        return static_cast<KeyFrame*>(NULL);
+    }
+
+    Header header;
+
+    // Streamed map
+    vector<char> vBuffer;
+    ifstream f;
+    uint64_t nFileSize = 0;
+
+    // Mapped map, the keyframes share the file and it is unmapped with the last of them
+    shared_ptr<MappedFile> pFile;
+    const MappedKeyFrame* pKFTable = static_cast<const MappedKeyFrame*>(NULL);
+    const BlockRef* pMPTable = static_cast<const BlockRef*>(NULL);
+
+    if(bMapped)
+    {
+        pFile = make_shared<MappedFile>();
+        // The keyframes are touched in the order tracking needs them
+        if(!pFile->Open(filename,true))
+            return static_cast<KeyFrame*>(NULL);
+
+        const Header* pHeader = pFile->Get<Header>(0,1);
+        const MappedHeader* pMappedHeader = pFile->Get<MappedHeader>(sizeof(Header),1);
+        if(!pHeader || !pMappedHeader)
+        {
+            cerr << filename << " is not a map file" << endl;
+            return static_cast<KeyFrame*>(NULL);
+        }
+        header = *pHeader;
+        if(!CheckHeader(header,MAPPED_MAGIC,filename,pVoc))
+            return static_cast<KeyFrame*>(NULL);
+        if(pMappedHeader->nKeyPointSize!=sizeof(cv::KeyPoint) ||
+           pMappedHeader->nGridCells!=FRAME_GRID_COLS*FRAME_GRID_ROWS)
+        {
+            cerr << "The map " << filename << " was saved by a build with another keypoint or grid layout" << endl;
+            return static_cast<KeyFrame*>(NULL);
+        }
+
+        const uint64_t nTablesOffset = sizeof(Header)+sizeof(MappedHeader);
+        pKFTable = pFile->Get<MappedKeyFrame>(nTablesOffset,header.nKeyFrames);
+        if(pKFTable)
+            pMPTable = pFile->Get<BlockRef>(nTablesOffset+header.nKeyFrames*sizeof(MappedKeyFrame),header.nMapPoints);
+        if(!pMPTable)
+        {
+            cerr << "The map " << filename << " is truncated or corrupt" << endl;
+            return static_cast<KeyFrame*>(NULL);
+        }
+    }
+    else
+    {
+        vBuffer.resize(IO_BUFFER_SIZE);
+        f.rdbuf()->pubsetbuf(&vBuffer[0],vBuffer.size());
+        f.open(filename.c_str(), ios::in | ios::binary);
+        if(!f.is_open())
+        {
+            cerr << "Failed to open the map " << filename << endl;
+            return static_cast<KeyFrame*>(NULL);
+        }
+
+        f.seekg(0,ios::end);
+        nFileSize = f.tellg();
+        f.seekg(0,ios::beg);
+
+        if(!f.read(reinterpret_cast<char*>(&header),sizeof(Header)))
+        {
+            cerr << filename << " is not a map file" << endl;
+            return static_cast<KeyFrame*>(NULL);
+        }
+        if(!CheckHeader(header,MAGIC,filename,pVoc))
+            return static_cast<KeyFrame*>(NULL);
+    }
+
+    // The frames which follow use the calibration of the map
+    FrameContext &context = pMap->mFrameContext;
+    const bool bSetCalibration = context.mbInitialComputations;
+    if(bSetCalibration)
+    {
+        context.fx = header.fx;
+        context.fy = header.fy;
+        context.cx = header.cx;
+        context.cy = header.cy;
+        context.invfx = 1.0f/header.fx;
+        context.invfy = 1.0f/header.fy;
+        context.mnMinX = header.minX;
+        context.mnMaxX = header.maxX;
+        context.mnMinY = header.minY;
+        context.mnMaxY = header.maxY;
+        context.mfGridElementWidthInv = header.gridElementWidthInv;
+        context.mfGridElementHeightInv = header.gridElementHeightInv;
+        // built for the old calibration, the keypoints are solved exactly again
+        context.mUndistortMapX.release();
+        context.mUndistortMapY.release();
+        context.mbInitialComputations = false;
+    }
+    else if(context.fx!=header.fx || context.fy!=header.fy || context.cx!=header.cx || context.cy!=header.cy)
+    {
+        cerr << "The map " << filename << " was built with another calibration" << endl;
+        return static_cast<KeyFrame*>(NULL);
+    }
+    if(header.nSettingsHash && pMap->mnSettingsHash && header.nSettingsHash!=pMap->mnSettingsHash)
+        cout << "The map " << filename << " was built with other settings (" << Settings::FormatHash(header.nSettingsHash)
+             << ")" << endl;
+
+    // Readers of the blocks [i0,i0+n) of the keyframes or of the map points
+    vector<vector<char> > vBlocks(BATCH_SIZE);
+    vector<BlockReader> vReaders(BATCH_SIZE);
+    auto ReadBlocks = [&](const bool bKeyFrames, const uint64_t i0, const int n) -> bool
+    {
+        for(int i=0; i<n; i++)
+        {
+            if(bMapped)
+            {
+                const BlockRef &block = bKeyFrames ? pKFTable[i0+i].block : pMPTable[i0+i];
+                const char* pData = pFile->Get<char>(block.nOffset,block.nSize);
+                if(!pData)
+                    return false;
+                vReaders[i] = BlockReader(pData,block.nSize);
+            }
+            else
+            {
+                if(!ReadBlock(f,nFileSize,vBlocks[i]))
+                    return false;
+                vReaders[i] = BlockReader(vBlocks[i]);
+            }
+        }
+        return true;
+    };
+
+    bool bOk = true;
+
+    // Keyframes. Every batch is read, decoded in parallel and then created in order
+    vector<KeyFrame*> vpKFs;
+    vector<KeyFrameGraph> vGraphs;
+    KeyFrameById vpKFById;
+
+    vector<Frame> vFrames(BATCH_SIZE);
+    vector<uint64_t> vIds(BATCH_SIZE);
+    vector<KeyFrameGraph> vBatchGraphs(BATCH_SIZE);
+    vector<MappedFeatures> vFeatures(BATCH_SIZE);
+    vector<unsigned char> vbDecoded(BATCH_SIZE);
+
+    for(uint64_t i0=0; bOk && i0<header.nKeyFrames; i0+=BATCH_SIZE)
+    {
+        const int n = min<uint64_t>(BATCH_SIZE,header.nKeyFrames-i0);
+        bOk = ReadBlocks(true,i0,n);
+        if(!bOk)
+            break;
+
+        RunTasks(pThreadPool, n, [&](int i)
+        {
+            Frame &F = vFrames[i];
+            F = Frame();
+            if(bMapped)
+            {
+                // Descriptors and grid stay in the file, the keypoints and descriptors are set on the
+                // keyframe, which would copy the descriptors into the arena
+                const MappedKeyFrame &record = pKFTable[i0+i];
+                const MappedFeatures &features = vFeatures[i];
+                vbDecoded[i] = GetMappedFeatures(*pFile,record,vFeatures[i]);
+                if(!vbDecoded[i])
+                    return;
+                F.N = record.N;
+                F.mpGrid = make_shared<const FeatureGrid>(FRAME_GRID_COLS,FRAME_GRID_ROWS,features.pGridOffsets,
+                                                          features.pGridIndices,pFile);
+            }
+            vbDecoded[i] = DecodeKeyFrame(vReaders[i],!bMapped,pVoc,context,F,vIds[i],vBatchGraphs[i]);
+            // The mapped keypoints are checked once the levels are known
+            if(vbDecoded[i] && bMapped)
+                vbDecoded[i] = CheckOctaves(vFeatures[i].pKeys,F.N,F.mnScaleLevels) &&
+                               CheckOctaves(vFeatures[i].pKeysUn,F.N,F.mnScaleLevels);
+            // With the calibration of the map, which is set by now
+            if(vbDecoded[i] && !bMapped)
+                F.AssignFeaturesToGrid();
+        });
+
+        for(int i=0; i<n; i++)
+        {
+            const uint64_t nId = vIds[i];
+            if(!vbDecoded[i] || nId>=header.nNextKeyFrameId || FindKeyFrame(vpKFById,nId))
+            {
+                bOk = false;
+                break;
+            }
+
+            KeyFrame* pKF = new KeyFrame(vFrames[i],pMap,pKFDB);
+            pKF->mnId = nId;
+            // The spanning tree comes from the file
+            pKF->mbFirstConnection = false;
+
+            if(bMapped)
+            {
+                const MappedFeatures &features = vFeatures[i];
+                pKF->mvKeys = SharedArray<cv::KeyPoint>(features.pKeys,pKF->N,pFile);
+                pKF->mvKeysUn = SharedArray<cv::KeyPoint>(features.pKeysUn,pKF->N,pFile);
+                pKF->mvuRight = SharedArray<float>(features.pRight,pKF->N,pFile);
+                pKF->mvDepth = SharedArray<float>(features.pDepth,pKF->N,pFile);
+                pKF->mDescriptors = cv::Mat(pKF->N,pKFTable[i0+i].nDescCols,CV_8U,const_cast<unsigned char*>(features.pDescriptors));
+            }
+
+            vpKFs.push_back(pKF);
+            vGraphs.push_back(KeyFrameGraph());
+            vGraphs.back().nParentId = vBatchGraphs[i].nParentId;
+            vGraphs.back().vConnections.swap(vBatchGraphs[i].vConnections);
+            vGraphs.back().vLoopEdges.swap(vBatchGraphs[i].vLoopEdges);
+
+            vpKFById[nId] = pKF;
+        }
+    }
+    vFrames.clear();
+
+    if(bOk && vpKFs.empty())
+        bOk = false;
+
+    // Map points
+    vector<MapPoint*> vpMPs;
+    vector<MapPointData> vMPData(BATCH_SIZE);
+    unordered_set<uint64_t> sMPIdUsed;
+    uint64_t nNextMPId = 0;
+
+    for(uint64_t i0=0; bOk && i0<header.nMapPoints; i0+=BATCH_SIZE)
+    {
+        const int n = min<uint64_t>(BATCH_SIZE,header.nMapPoints-i0);
+        bOk = ReadBlocks(false,i0,n);
+        if(!bOk)
+            break;
+
+        RunTasks(pThreadPool, n, [&](int i)
+        {
+            vbDecoded[i] = DecodeMapPoint(vReaders[i],vMPData[i]);
+        });
+
+        for(int i=0; i<n; i++)
+        {
+            const MapPointData &data = vMPData[i];
+            if(!vbDecoded[i] || data.nId>=header.nNextMapPointId || sMPIdUsed.count(data.nId))
+            {
+                bOk = false;
+                break;
+            }
+
+            // Observations of keyframes which are not in the file or point to a taken keypoint are
+            // dropped, and so are the ones of a keyframe seen again: the point keeps one index per
+            // keyframe, the keyframe would hold it at a slot the point does not know
+            vector<pair<KeyFrame*,size_t> > vObservations;
+            for(size_t j=0; j<data.vObservations.size(); j++)
+            {
+                KeyFrame* pKF = FindKeyFrame(vpKFById,data.vObservations[j].first);
+                const size_t idx = data.vObservations[j].second;
+                if(!pKF || idx>=static_cast<size_t>(pKF->N) || pKF->GetMapPoint(idx))
+                    continue;
+                bool bSeen = false;
+                for(size_t k=0; k<vObservations.size() && !bSeen; k++)
+                    bSeen = vObservations[k].first==pKF;
+                if(!bSeen)
+                    vObservations.push_back(make_pair(pKF,idx));
+            }
+            if(vObservations.empty())
+                continue;
+
+            KeyFrame* pRefKF = FindKeyFrame(vpKFById,data.nRefKFId);
+            if(!pRefKF)
+                pRefKF = vObservations.front().first;
+
+            MapPoint* pMP = CreateMapPoint(data,pRefKF,pMap);
+
+            for(size_t j=0; j<vObservations.size(); j++)
+            {
+                pMP->AddObservation(vObservations[j].first,vObservations[j].second);
+                vObservations[j].first->AddMapPoint(pMP,vObservations[j].second);
+            }
+
+            vpMPs.push_back(pMP);
+            sMPIdUsed.insert(data.nId);
+            nNextMPId = max<uint64_t>(nNextMPId,data.nId+1);
+        }
+    }
+
+    if(!bOk)
+    {
+        cerr << "The map " << filename << " is truncated or corrupt" << endl;
+        DeleteAll(vpMPs);
+        DeleteAll(vpKFs);
+        if(bSetCalibration)
+            context.mbInitialComputations = true;
+        return static_cast<KeyFrame*>(NULL);
+    }
+
+    // Spanning tree. The walks to the root follow the parents until there is none, so a link
+    // closing a cycle is dropped and the keyframe it leaves becomes a root.
+    const size_t nKFs = vpKFs.size();
+    unordered_map<KeyFrame*,size_t> mKFIndex;
+    for(size_t i=0; i<nKFs; i++)
+        mKFIndex[vpKFs[i]] = i;
+    vector<int64_t> vParents(nKFs,-1);
+    for(size_t i=0; i<nKFs; i++)
+    {
+        KeyFrame* pParent = FindKeyFrame(vpKFById,vGraphs[i].nParentId);
+        if(pParent && pParent!=vpKFs[i])
+            vParents[i] = mKFIndex[pParent];
+    }
+    // 1: on the current walk, 2: reaches a root
+    vector<unsigned char> vState(nKFs,0);
+    vector<int64_t> vPath;
+    for(size_t i=0; i<nKFs; i++)
+    {
+        vPath.clear();
+        int64_t j = i;
+        while(vState[j]==0 && vParents[j]>=0)
+        {
+            vState[j] = 1;
+            vPath.push_back(j);
+            j = vParents[j];
+        }
+        if(vState[j]==1)
+            vParents[j] = -1;
+        vState[j] = 2;
+        for(size_t k=0; k<vPath.size(); k++)
+            vState[vPath[k]] = 2;
+    }
+
+    // Graph, all keyframes exist now. The covisibility weights were already counted again while
+    // the observations were added, the stored connections are not needed.
+    for(size_t i=0; i<nKFs; i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        const KeyFrameGraph &graph = vGraphs[i];
+
+        if(vParents[i]>=0)
+        {
+            KeyFrame* pParent = vpKFs[vParents[i]];
+            pKF->mpParent = pParent;
+            pParent->mspChildrens.insert(pKF);
+        }
+
+        for(size_t j=0; j<graph.vLoopEdges.size(); j++)
+        {
+            KeyFrame* pKF2 = FindKeyFrame(vpKFById,graph.vLoopEdges[j]);
+            if(pKF2 && pKF2!=pKF)
+            {
+                pKF->mspLoopEdges.insert(pKF2);
+                pKF->mbNotErase = true;
+            }
+        }
+    }
+
+    KeyFrame* pLastKF = vpKFs.front();
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        pMap->AddKeyFrame(vpKFs[i]);
+        pKFDB->add(vpKFs[i]);
+        if(vpKFs[i]->mnId>pLastKF->mnId)
+            pLastKF = vpKFs[i];
+    }
+    for(size_t i=0; i<vpMPs.size(); i++)
+        pMap->AddMapPoint(vpMPs[i]);
+
+    // The features of a mapped keyframe end where its block starts
+    if(bMapped && pTiles)
+    {
+        for(size_t i=0; i<vpKFs.size(); i++)
+        {
+            Eigen::Vector3f Ow;
+            vpKFs[i]->GetCameraCenter(Ow);
+            const MappedKeyFrame &record = pKFTable[i];
+            pTiles->AddKeyFrame(pFile,Ow,record.nFeaturesOffset,record.block.nOffset-record.nFeaturesOffset);
+        }
+    }
+
+    // Every spanning tree is a map of the atlas, its root is the origin
+    vector<KeyFrame*> vpOrigins;
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        if(!vpKFs[i]->mpParent)
+            vpOrigins.push_back(vpKFs[i]);
+    }
+    sort(vpOrigins.begin(),vpOrigins.end(),KeyFrame::lId);
+    for(size_t i=0; i<vpOrigins.size(); i++)
+    {
+        pMap->AddOrigin(vpOrigins[i]);
+        list<KeyFrame*> lpKFs(1,vpOrigins[i]);
+        while(!lpKFs.empty())
+        {
+            KeyFrame* pKF = lpKFs.front();
+            lpKFs.pop_front();
+            pKF->mnMapId = i;
+            lpKFs.insert(lpKFs.end(),pKF->mspChildrens.begin(),pKF->mspChildrens.end());
+        }
+    }
+    pMap->mnNextMapId = vpOrigins.size();
+
+    // New objects get ids after the ones of the map
+    pMap->mnNextKeyFrameId = max<uint64_t>(header.nNextKeyFrameId,pLastKF->mnId+1);
+    context.nNextId = max<uint64_t>(max<uint64_t>(header.nNextFrameId,context.nNextId),pLastKF->mnFrameId+1);
+    pMap->mnNextMapPointId = max<uint64_t>(header.nNextMapPointId,nNextMPId);
+
+    return pLastKF;
+}
+
+} //namespace ORB_SLAM
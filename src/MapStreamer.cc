@@ -0,0 +1,542 @@
+#include "MapStreamer.h"
+
+#include "Converter.h"
+#include "KeyFrame.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int BACKLOG = 4; //param pending connections of the listening socket
+
+void AppendU32(string &buffer, const uint32_t value)
+{
+    const char bytes[4] = {(char)(value&0xff), (char)((value>>8)&0xff), (char)((value>>16)&0xff), (char)((value>>24)&0xff)};
+    buffer.append(bytes,4);
+}
+
+void AppendF32(string &buffer, const float value)
+{
+    uint32_t bits;
+    memcpy(&bits,&value,4);
+    AppendU32(buffer,bits);
+}
+
+// Returns the offset of the length, EndMessage writes it once the payload is complete
+size_t BeginMessage(string &buffer, const MapStreamer::MessageType type)
+{
+    const size_t offset = buffer.size();
+    AppendU32(buffer,0);
+    buffer.push_back((char)type);
+    return offset;
+}
+
+void EndMessage(string &buffer, const size_t offset)
+{
+    string length;
+    AppendU32(length,buffer.size()-offset-4);
+    buffer.replace(offset,4,length);
+}
+
+void AppendPose(string &buffer, const Eigen::Quaternion<float,Eigen::DontAlign> &qwc, const Eigen::Vector3f &Ow)
+{
+    AppendF32(buffer,qwc.x());
+    AppendF32(buffer,qwc.y());
+    AppendF32(buffer,qwc.z());
+    AppendF32(buffer,qwc.w());
+    AppendF32(buffer,Ow(0));
+    AppendF32(buffer,Ow(1));
+    AppendF32(buffer,Ow(2));
+}
+
+void AppendIds(string &buffer, const MapStreamer::MessageType type, const vector<unsigned long> &vIds)
+{
+    if(vIds.empty())
+        return;
+    const size_t offset = BeginMessage(buffer,type);
+    AppendU32(buffer,vIds.size());
+    for(size_t i=0; i<vIds.size(); i++)
+        AppendU32(buffer,vIds[i]);
+    EndMessage(buffer,offset);
+}
+
+bool SetNonBlocking(const int fd)
+{
+    const int flags = fcntl(fd,F_GETFL,0);
+    return flags>=0 && fcntl(fd,F_SETFL,flags|O_NONBLOCK)==0;
+}
+}
+
+MapStreamer::MapStreamer(Map* pMap, const int port, const float rate):
+    mpMap(pMap), mPort(port), mnPeriod(1e6/max(rate,0.1f)), mnListenFd(-1), mnChangeLogConsumer(-1),
+    mnCameraPoseIdx(0), mbFinishRequested(false), mbFinished(true), mbStopped(false), mbStopRequested(false)
+{
+    mCameraPose.qwc.setIdentity();
+    mCameraPose.Ow.setZero();
+}
+
+MapStreamer::~MapStreamer()
+{
+    for(size_t i=0; i<mvClients.size(); i++)
+        CloseClient(mvClients[i]);
+    if(mnListenFd>=0)
+        close(mnListenFd);
+}
+
+void MapStreamer::Run()
+{
+    Trace::SetThreadName("MapStreamer");
+    mbFinished = false;
+    mbStopped = false;
+
+    // Points and keyframes are only taken from the map when the streamer starts over
+    Reclaimer &reclaimer = mpMap->mReclaimer;
+    const int nReclaimerId = reclaimer.RegisterThread();
+
+    // Without the socket nothing is recorded for the streamer
+    if(Listen())
+    {
+        mnChangeLogConsumer = mpMap->mChangeLog.AddConsumer(true);
+        cout << "Streaming the map on port " << mPort << endl;
+    }
+
+    while(1)
+    {
+        if(mnChangeLogConsumer>=0)
+        {
+            AcceptClients();
+            UpdateMap();
+
+            for(size_t i=0; i<mvClients.size(); i++)
+            {
+                Client &client = mvClients[i];
+                // A client gets the next update only once it has taken the last one
+                if(client.nSent==client.outbox.size())
+                    EncodeUpdate(client);
+                if(!Send(client))
+                    CloseClient(client);
+            }
+
+            size_t nClients = 0;
+            for(size_t i=0; i<mvClients.size(); i++)
+            {
+                if(mvClients[i].fd>=0)
+                    mvClients[nClients++] = std::move(mvClients[i]);
+            }
+            mvClients.resize(nClients);
+        }
+
+        reclaimer.QuiescentState(nReclaimerId);
+
+        if(Stop())
+        {
+            while(isStopped())
+            {
+                reclaimer.QuiescentState(nReclaimerId);
+                usleep(3000);
+            }
+        }
+
+        if(CheckFinish())
+            break;
+
+        usleep(mnPeriod);
+    }
+
+    for(size_t i=0; i<mvClients.size(); i++)
+        CloseClient(mvClients[i]);
+    mvClients.clear();
+
+    reclaimer.UnregisterThread(nReclaimerId);
+    SetFinish();
+}
+
+bool MapStreamer::Listen()
+{
+    mnListenFd = socket(AF_INET,SOCK_STREAM,0);
+    if(mnListenFd<0)
+    {
+        cerr << "Map streamer: could not create the socket: " << strerror(errno) << endl;
+        return false;
+    }
+
+    const int one = 1;
+    setsockopt(mnListenFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+    sockaddr_in address;
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(mPort);
+    if(bind(mnListenFd,(sockaddr*)&address,sizeof(address))<0 || listen(mnListenFd,BACKLOG)<0 ||
+       !SetNonBlocking(mnListenFd))
+    {
+        cerr << "Map streamer: could not listen on port " << mPort << ": " << strerror(errno) << endl;
+        close(mnListenFd);
+        mnListenFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void MapStreamer::AcceptClients()
+{
+    while(1)
+    {
+        const int fd = accept(mnListenFd,NULL,NULL);
+        if(fd<0)
+            return;
+
+        if(!SetNonBlocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+        const int one = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+        Client client;
+        client.fd = fd;
+        client.nSent = 0;
+        client.bFull = true;
+        client.nCameraPoseIdx = 0;
+        mvClients.push_back(std::move(client));
+    }
+}
+
+void MapStreamer::UpdateMap()
+{
+    if(!mpMap->mChangeLog.Take(mnChangeLogConsumer,mvPointChanges,mvKeyFrameChanges))
+    {
+        RebuildMap();
+        return;
+    }
+
+    for(size_t i=0; i<mvPointChanges.size(); i++)
+    {
+        const MapChangeLog::PointChange &change = mvPointChanges[i];
+        if(change.bErased)
+            mmPoints.erase(change.nId);
+        else
+            mmPoints[change.nId] = change.pos;
+
+        for(size_t j=0; j<mvClients.size(); j++)
+        {
+            if(!mvClients[j].bFull)
+                mvClients[j].sPoints.insert(change.nId);
+        }
+    }
+
+    for(size_t i=0; i<mvKeyFrameChanges.size(); i++)
+    {
+        const MapChangeLog::KeyFrameChange &change = mvKeyFrameChanges[i];
+        if(change.bErased)
+            mmKeyFrames.erase(change.nId);
+        else
+        {
+            KeyFramePose &pose = mmKeyFrames[change.nId];
+            pose.qwc = change.qwc;
+            pose.Ow = change.Ow;
+        }
+
+        for(size_t j=0; j<mvClients.size(); j++)
+        {
+            if(!mvClients[j].bFull)
+                mvClients[j].sKeyFrames.insert(change.nId);
+        }
+    }
+}
+
+void MapStreamer::RebuildMap()
+{
+    mmPoints.clear();
+    mmKeyFrames.clear();
+
+    const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+    const vector<MapPoint*> &vpMPs = *pMPs;
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        if(vpMPs[i]->isBad())
+            continue;
+        vpMPs[i]->GetWorldPos(mmPoints[vpMPs[i]->mnId]);
+    }
+
+    const IndexedStore<KeyFrame>::Snapshot pKFs = mpMap->GetKeyFramesSnapshot();
+    const vector<KeyFrame*> &vpKFs = *pKFs;
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        if(vpKFs[i]->isBad())
+            continue;
+        Eigen::Matrix3f Rcw;
+        Eigen::Vector3f tcw;
+        vpKFs[i]->GetPose(Rcw,tcw);
+        KeyFramePose &pose = mmKeyFrames[vpKFs[i]->mnId];
+        pose.qwc = Eigen::Quaternionf(Rcw.transpose());
+        pose.Ow = -Rcw.transpose()*tcw;
+    }
+
+    for(size_t i=0; i<mvClients.size(); i++)
+    {
+        mvClients[i].bFull = true;
+        mvClients[i].sPoints.clear();
+        mvClients[i].sKeyFrames.clear();
+    }
+}
+
+void MapStreamer::EncodeUpdate(Client &client)
+{
+    client.outbox.clear();
+    client.nSent = 0;
+
+    if(client.bFull)
+    {
+        const size_t resetOffset = BeginMessage(client.outbox,RESET);
+        EndMessage(client.outbox,resetOffset);
+
+        if(!mmPoints.empty())
+        {
+            const size_t offset = BeginMessage(client.outbox,POINTS);
+            AppendU32(client.outbox,mmPoints.size());
+            for(unordered_map<unsigned long, Eigen::Vector3f>::const_iterator it=mmPoints.begin(); it!=mmPoints.end(); it++)
+            {
+                AppendU32(client.outbox,it->first);
+                AppendF32(client.outbox,it->second(0));
+                AppendF32(client.outbox,it->second(1));
+                AppendF32(client.outbox,it->second(2));
+            }
+            EndMessage(client.outbox,offset);
+        }
+
+        if(!mmKeyFrames.empty())
+        {
+            const size_t offset = BeginMessage(client.outbox,KEYFRAMES);
+            AppendU32(client.outbox,mmKeyFrames.size());
+            for(unordered_map<unsigned long, KeyFramePose>::const_iterator it=mmKeyFrames.begin(); it!=mmKeyFrames.end(); it++)
+            {
+                AppendU32(client.outbox,it->first);
+                AppendPose(client.outbox,it->second.qwc,it->second.Ow);
+            }
+            EndMessage(client.outbox,offset);
+        }
+
+        client.bFull = false;
+    }
+    else
+    {
+        // Every id once, with its state of now
+        vector<unsigned long> vErased;
+        if(!client.sPoints.empty())
+        {
+            const size_t offset = BeginMessage(client.outbox,POINTS);
+            const size_t countOffset = client.outbox.size();
+            AppendU32(client.outbox,0);
+            uint32_t nPoints = 0;
+            for(unordered_set<unsigned long>::const_iterator it=client.sPoints.begin(); it!=client.sPoints.end(); it++)
+            {
+                unordered_map<unsigned long, Eigen::Vector3f>::const_iterator itPoint = mmPoints.find(*it);
+                if(itPoint==mmPoints.end())
+                {
+                    vErased.push_back(*it);
+                    continue;
+                }
+                AppendU32(client.outbox,*it);
+                AppendF32(client.outbox,itPoint->second(0));
+                AppendF32(client.outbox,itPoint->second(1));
+                AppendF32(client.outbox,itPoint->second(2));
+                nPoints++;
+            }
+            if(nPoints>0)
+            {
+                string count;
+                AppendU32(count,nPoints);
+                client.outbox.replace(countOffset,4,count);
+                EndMessage(client.outbox,offset);
+            }
+            else
+                client.outbox.resize(offset);
+            AppendIds(client.outbox,POINTS_ERASED,vErased);
+            client.sPoints.clear();
+        }
+
+        vErased.clear();
+        if(!client.sKeyFrames.empty())
+        {
+            const size_t offset = BeginMessage(client.outbox,KEYFRAMES);
+            const size_t countOffset = client.outbox.size();
+            AppendU32(client.outbox,0);
+            uint32_t nKeyFrames = 0;
+            for(unordered_set<unsigned long>::const_iterator it=client.sKeyFrames.begin(); it!=client.sKeyFrames.end(); it++)
+            {
+                unordered_map<unsigned long, KeyFramePose>::const_iterator itKF = mmKeyFrames.find(*it);
+                if(itKF==mmKeyFrames.end())
+                {
+                    vErased.push_back(*it);
+                    continue;
+                }
+                AppendU32(client.outbox,*it);
+                AppendPose(client.outbox,itKF->second.qwc,itKF->second.Ow);
+                nKeyFrames++;
+            }
+            if(nKeyFrames>0)
+            {
+                string count;
+                AppendU32(count,nKeyFrames);
+                client.outbox.replace(countOffset,4,count);
+                EndMessage(client.outbox,offset);
+            }
+            else
+                client.outbox.resize(offset);
+            AppendIds(client.outbox,KEYFRAMES_ERASED,vErased);
+            client.sKeyFrames.clear();
+        }
+    }
+
+    // Only the latest pose, the ones in between are dropped
+    unique_lock<mutex> lock(mMutexCamera);
+    if(client.nCameraPoseIdx!=mnCameraPoseIdx)
+    {
+        const size_t offset = BeginMessage(client.outbox,CAMERA);
+        AppendPose(client.outbox,mCameraPose.qwc,mCameraPose.Ow);
+        EndMessage(client.outbox,offset);
+        client.nCameraPoseIdx = mnCameraPoseIdx;
+    }
+}
+
+bool MapStreamer::Send(Client &client)
+{
+    // Clients do not talk, whatever they send is dropped. recv returns 0 once they hang up.
+    char discard[256];
+    while(1)
+    {
+        const ssize_t n = recv(client.fd,discard,sizeof(discard),0);
+        if(n==0)
+            return false;
+        if(n<0)
+        {
+            if(errno==EINTR)
+                continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                break;
+            return false;
+        }
+    }
+
+    while(client.nSent<client.outbox.size())
+    {
+        const ssize_t n = send(client.fd,client.outbox.data()+client.nSent,client.outbox.size()-client.nSent,MSG_NOSIGNAL);
+        if(n>=0)
+        {
+            client.nSent += n;
+            continue;
+        }
+        if(errno==EINTR)
+            continue;
+        // The rest goes with the next updates, the changes meanwhile are merged
+        return errno==EAGAIN || errno==EWOULDBLOCK;
+    }
+
+    client.outbox.clear();
+    client.nSent = 0;
+    return true;
+}
+
+void MapStreamer::CloseClient(Client &client)
+{
+    if(client.fd>=0)
+        close(client.fd);
+    client.fd = -1;
+}
+
+void MapStreamer::SetCurrentCameraPose(const cv::Mat &Tcw)
+{
+    if(Tcw.empty())
+        return;
+
+    const Eigen::Matrix3f Rcw = Converter::toMatrix3f(Tcw.rowRange(0,3).colRange(0,3));
+    const Eigen::Vector3f tcw = Converter::toVector3f(Tcw.rowRange(0,3).col(3));
+
+    unique_lock<mutex> lock(mMutexCamera);
+    mCameraPose.qwc = Eigen::Quaternionf(Rcw.transpose());
+    mCameraPose.Ow = -Rcw.transpose()*tcw;
+    mnCameraPoseIdx++;
+}
+
+void MapStreamer::RequestFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinishRequested = true;
+}
+
+bool MapStreamer::CheckFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinishRequested;
+}
+
+void MapStreamer::SetFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinished = true;
+}
+
+bool MapStreamer::isFinished()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinished;
+}
+
+void MapStreamer::RequestStop()
+{
+    unique_lock<mutex> lock(mMutexStop);
+    if(!mbStopped)
+        mbStopRequested = true;
+}
+
+bool MapStreamer::isStopped()
+{
+    unique_lock<mutex> lock(mMutexStop);
+    return mbStopped;
+}
+
+bool MapStreamer::Stop()
+{
+    unique_lock<mutex> lock(mMutexStop);
+    unique_lock<mutex> lock2(mMutexFinish);
+
+    if(mbFinishRequested)
+        return false;
+    else if(mbStopRequested)
+    {
+        mbStopped = true;
+        mbStopRequested = false;
+        return true;
+    }
+
+    return false;
+}
+
+void MapStreamer::Release()
+{
+    unique_lock<mutex> lock(mMutexStop);
+    mbStopped = false;
+}
+
+} //namespace ORB_SLAM
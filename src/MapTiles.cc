@@ -0,0 +1,94 @@
+#include "MapTiles.h"
+
+#include "MappedFile.h"
+
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+MapTiles::MapTiles(const float fTileSize, const int nRadius):
+    mfTileSize(fTileSize), mnRadius(nRadius), mbHasCameraTile(false)
+{
+}
+
+void MapTiles::AddKeyFrame(const shared_ptr<const MappedFile> &pFile, const Eigen::Vector3f &Ow,
+                           const uint64_t nOffset, const uint64_t nSize)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    mpFile = pFile;
+
+    const TileKey key = GetTileKey(Ow);
+    map<TileKey,Tile>::iterator it = mTiles.find(key);
+    if(it==mTiles.end())
+    {
+        it = mTiles.insert(make_pair(key,Tile())).first;
+        // Nothing has been dropped yet
+        it->second.bResident = true;
+    }
+
+    Region region;
+    region.nOffset = nOffset;
+    region.nSize = nSize;
+    it->second.vRegions.push_back(region);
+}
+
+void MapTiles::Update(const Eigen::Vector3f &Ow)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    const TileKey key = GetTileKey(Ow);
+    if(!mpFile || (mbHasCameraTile && key==mCameraTile))
+        return;
+    mbHasCameraTile = true;
+    mCameraTile = key;
+
+    for(map<TileKey,Tile>::iterator it=mTiles.begin(), itend=mTiles.end(); it!=itend; it++)
+    {
+        Tile &tile = it->second;
+        const bool bNear = IsNear(it->first,key);
+        if(bNear==tile.bResident)
+            continue;
+
+        // Only hints, the kernel reads and drops the pages in the background
+        for(size_t i=0; i<tile.vRegions.size(); i++)
+            mpFile->Advise(tile.vRegions[i].nOffset,tile.vRegions[i].nSize,bNear);
+        tile.bResident = bNear;
+    }
+}
+
+size_t MapTiles::NumTiles()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mTiles.size();
+}
+
+size_t MapTiles::NumResidentTiles()
+{
+    unique_lock<mutex> lock(mMutex);
+
+    size_t n = 0;
+    for(map<TileKey,Tile>::const_iterator it=mTiles.begin(), itend=mTiles.end(); it!=itend; it++)
+    {
+        if(it->second.bResident)
+            n++;
+    }
+    return n;
+}
+
+MapTiles::TileKey MapTiles::GetTileKey(const Eigen::Vector3f &Ow) const
+{
+    return TileKey(floor(Ow(0)/mfTileSize),floor(Ow(1)/mfTileSize),floor(Ow(2)/mfTileSize));
+}
+
+bool MapTiles::IsNear(const TileKey &key1, const TileKey &key2) const
+{
+    return abs(get<0>(key1)-get<0>(key2))<=mnRadius && abs(get<1>(key1)-get<1>(key2))<=mnRadius &&
+           abs(get<2>(key1)-get<2>(key2))<=mnRadius;
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,99 @@
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+MappedFile::MappedFile(): mpData(NULL), mnSize(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const string &filename, const bool bRandomAccess)
+{
+    Close();
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if(fd<0)
+    {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd,&st)!=0 || st.st_size==0)
+    {
+        cerr << filename << " is empty or can not be read" << endl;
+        close(fd);
+        return false;
+    }
+
+    void* pData = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping holds its own reference to the file
+    close(fd);
+    if(pData==MAP_FAILED)
+    {
+        cerr << "Failed to map " << filename << endl;
+        return false;
+    }
+
+    if(bRandomAccess)
+        madvise(pData, st.st_size, MADV_RANDOM);
+
+    mpData = pData;
+    mnSize = st.st_size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if(mpData)
+        munmap(mpData, mnSize);
+
+    mpData = NULL;
+    mnSize = 0;
+}
+
+void MappedFile::Advise(const uint64_t offset, const uint64_t size, const bool bNeeded) const
+{
+    if(!mpData || offset>=mnSize)
+        return;
+
+    const uint64_t nPageSize = sysconf(_SC_PAGESIZE);
+    const uint64_t end = min<uint64_t>(offset+size,mnSize);
+
+    // Pages shared with a neighbour are read whole but only dropped if they are entirely inside
+    uint64_t begin;
+    uint64_t pagesEnd;
+    if(bNeeded)
+    {
+        begin = offset/nPageSize*nPageSize;
+        pagesEnd = end;
+    }
+    else
+    {
+        begin = (offset+nPageSize-1)/nPageSize*nPageSize;
+        pagesEnd = end/nPageSize*nPageSize;
+        if(end==mnSize)
+            pagesEnd = end;
+    }
+    if(pagesEnd<=begin)
+        return;
+
+    madvise(static_cast<char*>(mpData)+begin, pagesEnd-begin, bNeeded ? MADV_WILLNEED : MADV_DONTNEED);
+}
+
+} //namespace ORB_SLAM
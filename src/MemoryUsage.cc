@@ -0,0 +1,58 @@
+#include "MemoryUsage.h"
+
+#include <cstdio>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+void PrintLine(ostream &out, const char* name, const size_t bytes, const size_t nCount=0)
+{
+    char line[128];
+    if(nCount>0)
+        snprintf(line,sizeof(line),"%-24s %12.3f %10llu\n",name,bytes/(1024.0*1024.0),static_cast<unsigned long long>(nCount));
+    else
+        snprintf(line,sizeof(line),"%-24s %12.3f\n",name,bytes/(1024.0*1024.0));
+    out << line;
+}
+}
+
+MemoryUsage::MemoryUsage():
+    nKeyFrames(0), keyFrameKeyPoints(0), keyFrameDescriptors(0), keyFrameGrids(0), keyFrameBoW(0),
+    keyFrameOther(0), nMapPoints(0), mapPoints(0), nRetired(0), keyFrameDatabase(0), keyFrameDepths(0), vocabulary(0),
+    imagePyramids(0), localBAProblem(0), globalBAProblem(0)
+{
+}
+
+size_t MemoryUsage::Total() const
+{
+    return keyFrameKeyPoints+keyFrameDescriptors+keyFrameGrids+keyFrameBoW+keyFrameOther+mapPoints+
+           keyFrameDatabase+keyFrameDepths+vocabulary+imagePyramids+localBAProblem+globalBAProblem;
+}
+
+void MemoryUsage::Print(ostream &out) const
+{
+    char line[128];
+    snprintf(line,sizeof(line),"%-24s %12s %10s\n","memory","MB","count");
+    out << line;
+    PrintLine(out,"keyframe keypoints",keyFrameKeyPoints,nKeyFrames);
+    PrintLine(out,"keyframe descriptors",keyFrameDescriptors);
+    PrintLine(out,"keyframe grids",keyFrameGrids);
+    PrintLine(out,"keyframe BoW",keyFrameBoW);
+    PrintLine(out,"keyframe other",keyFrameOther);
+    PrintLine(out,"map points",mapPoints,nMapPoints);
+    PrintLine(out,"keyframe database",keyFrameDatabase);
+    PrintLine(out,"keyframe depths",keyFrameDepths);
+    PrintLine(out,"vocabulary",vocabulary);
+    PrintLine(out,"image pyramids",imagePyramids);
+    PrintLine(out,"local BA problem",localBAProblem);
+    PrintLine(out,"global BA problem",globalBAProblem);
+    PrintLine(out,"total",Total());
+    snprintf(line,sizeof(line),"%-24s %12s %10llu\n","retired, not freed","",static_cast<unsigned long long>(nRetired));
+    out << line;
+}
+
+} //namespace ORB_SLAM
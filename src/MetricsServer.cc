@@ -0,0 +1,436 @@
+#include "MetricsServer.h"
+
+#include "LocalMapping.h"
+#include "LoopClosing.h"
+#include "Map.h"
+#include "MapMutex.h"
+#include "StageTimer.h"
+#include "Trace.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int BACKLOG = 4; //param pending connections of the listening socket
+const int PERIOD = 50000; //param microseconds between two polls of the sockets
+const size_t MAX_REQUEST = 8192; //param longer request headers close the connection
+
+bool SetNonBlocking(const int fd)
+{
+    const int flags = fcntl(fd,F_GETFL,0);
+    return flags>=0 && fcntl(fd,F_SETFL,flags|O_NONBLOCK)==0;
+}
+
+void AddHeader(string &body, const char* name, const char* type, const char* help)
+{
+    body += string("# HELP ") + name + " " + help + "\n";
+    body += string("# TYPE ") + name + " " + type + "\n";
+}
+
+void AddSample(string &body, const char* name, const string &labels, const double value)
+{
+    char line[512];
+    if(labels.empty())
+        snprintf(line,sizeof(line),"%s %.9g\n",name,value);
+    else
+        snprintf(line,sizeof(line),"%s{%s} %.9g\n",name,labels.c_str(),value);
+    body += line;
+}
+
+void AddMetric(string &body, const char* name, const char* type, const char* help, const double value)
+{
+    AddHeader(body,name,type,help);
+    AddSample(body,name,"",value);
+}
+
+// The values of the labels have no quotes, backslashes nor line breaks here but the lock names
+string Label(const char* name, const string &value)
+{
+    string escaped;
+    for(size_t i=0; i<value.size(); i++)
+    {
+        if(value[i]=='"' || value[i]=='\\')
+            escaped += '\\';
+        if(value[i]=='\n')
+            escaped += "\\n";
+        else
+            escaped += value[i];
+    }
+    return string(name) + "=\"" + escaped + "\"";
+}
+
+struct LockTotals
+{
+    LockTotals(): nAcquisitions(0), nContended(0), nWait(0), nHold(0) {}
+    uint64_t nAcquisitions;
+    uint64_t nContended;
+    uint64_t nWait;
+    uint64_t nHold;
+};
+}
+
+const int MetricsServer::MEMORY_FIELDS;
+
+MetricsServer::MetricsServer(const int port, Map* pMap, LocalMapping* pLocalMapper, LoopClosing* pLoopCloser):
+    mPort(port), mpMap(pMap), mpLocalMapper(pLocalMapper), mpLoopCloser(pLoopCloser), mnListenFd(-1),
+    mnFrames(0), mnState(-1), mnInliers(0), mnKeyFrames(0), mnMapPoints(0), mnLost(0), mnRelocalized(0),
+    mbMemoryUsage(false), mbFinishRequested(false), mbFinished(true)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+    for(size_t i=0; i<mvClients.size(); i++)
+        CloseClient(mvClients[i]);
+    if(mnListenFd>=0)
+        close(mnListenFd);
+}
+
+void MetricsServer::PublishFrame(const int nState, const int nInliers, const unsigned long nKeyFrames,
+                                 const unsigned long nMapPoints, const bool bLost, const bool bRelocalized)
+{
+    // One writer, the tracking
+    mnFrames.store(mnFrames.load(memory_order_relaxed)+1,memory_order_relaxed);
+    mnState.store(nState,memory_order_relaxed);
+    mnInliers.store(nInliers,memory_order_relaxed);
+    mnKeyFrames.store(nKeyFrames,memory_order_relaxed);
+    mnMapPoints.store(nMapPoints,memory_order_relaxed);
+    if(bLost)
+        mnLost.store(mnLost.load(memory_order_relaxed)+1,memory_order_relaxed);
+    if(bRelocalized)
+        mnRelocalized.store(mnRelocalized.load(memory_order_relaxed)+1,memory_order_relaxed);
+}
+
+void MetricsServer::PublishMemoryUsage(const MemoryUsage &usage)
+{
+    const uint64_t data[MEMORY_FIELDS] = {usage.nKeyFrames, usage.keyFrameKeyPoints, usage.keyFrameDescriptors,
+                                          usage.keyFrameGrids, usage.keyFrameBoW, usage.keyFrameOther,
+                                          usage.nMapPoints, usage.mapPoints, usage.nRetired,
+                                          usage.keyFrameDatabase, usage.keyFrameDepths, usage.vocabulary,
+                                          usage.imagePyramids, usage.localBAProblem, usage.globalBAProblem};
+    mMemoryUsage.Write(data);
+    mbMemoryUsage.store(true,memory_order_release);
+}
+
+void MetricsServer::Run()
+{
+    Trace::SetThreadName("MetricsServer");
+    mbFinished = false;
+
+    if(Listen())
+        cout << "Serving the metrics on port " << mPort << endl;
+
+    while(1)
+    {
+        if(mnListenFd>=0)
+        {
+            AcceptClients();
+
+            for(size_t i=0; i<mvClients.size(); i++)
+            {
+                Client &client = mvClients[i];
+                if(!Receive(client) || !Send(client))
+                    CloseClient(client);
+            }
+
+            size_t nClients = 0;
+            for(size_t i=0; i<mvClients.size(); i++)
+            {
+                if(mvClients[i].fd>=0)
+                    mvClients[nClients++] = std::move(mvClients[i]);
+            }
+            mvClients.resize(nClients);
+        }
+
+        if(CheckFinish())
+            break;
+
+        usleep(PERIOD);
+    }
+
+    for(size_t i=0; i<mvClients.size(); i++)
+        CloseClient(mvClients[i]);
+    mvClients.clear();
+
+    SetFinish();
+}
+
+bool MetricsServer::Listen()
+{
+    mnListenFd = socket(AF_INET,SOCK_STREAM,0);
+    if(mnListenFd<0)
+    {
+        cerr << "Metrics server: could not create the socket: " << strerror(errno) << endl;
+        return false;
+    }
+
+    const int one = 1;
+    setsockopt(mnListenFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+    // A scraper on another host goes through a tunnel or a local agent
+    sockaddr_in address;
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(mPort);
+    if(bind(mnListenFd,(sockaddr*)&address,sizeof(address))<0 || listen(mnListenFd,BACKLOG)<0 ||
+       !SetNonBlocking(mnListenFd))
+    {
+        cerr << "Metrics server: could not listen on port " << mPort << ": " << strerror(errno) << endl;
+        close(mnListenFd);
+        mnListenFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void MetricsServer::AcceptClients()
+{
+    while(1)
+    {
+        const int fd = accept(mnListenFd,NULL,NULL);
+        if(fd<0)
+            return;
+
+        if(!SetNonBlocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+
+        Client client;
+        client.fd = fd;
+        client.nSent = 0;
+        client.bAnswered = false;
+        mvClients.push_back(std::move(client));
+    }
+}
+
+bool MetricsServer::Receive(Client &client)
+{
+    char buffer[1024];
+    bool bClosed = false;
+    while(1)
+    {
+        const ssize_t n = recv(client.fd,buffer,sizeof(buffer),0);
+        if(n==0)
+        {
+            bClosed = true;
+            break;
+        }
+        if(n<0)
+        {
+            if(errno==EINTR)
+                continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                break;
+            return false;
+        }
+        if(!client.bAnswered)
+            client.inbox.append(buffer,n);
+    }
+
+    if(client.bAnswered)
+        return true;
+
+    // One request per connection, the body of a GET is ignored
+    const size_t nEnd = client.inbox.find("\r\n\r\n");
+    if(nEnd==string::npos)
+        return !bClosed && client.inbox.size()<=MAX_REQUEST;
+
+    string status = "200 OK";
+    string body;
+    if(client.inbox.compare(0,4,"GET ")==0)
+        WriteMetrics(body);
+    else
+    {
+        status = "405 Method Not Allowed";
+        body = "only GET\n";
+    }
+
+    char header[256];
+    snprintf(header,sizeof(header),"HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n",status.c_str(),body.size());
+    client.outbox = header + body;
+    client.inbox.clear();
+    client.bAnswered = true;
+    return true;
+}
+
+bool MetricsServer::Send(Client &client)
+{
+    while(client.nSent<client.outbox.size())
+    {
+        const ssize_t n = send(client.fd,client.outbox.data()+client.nSent,client.outbox.size()-client.nSent,MSG_NOSIGNAL);
+        if(n>=0)
+        {
+            client.nSent += n;
+            continue;
+        }
+        if(errno==EINTR)
+            continue;
+        // The rest goes with the next poll
+        return errno==EAGAIN || errno==EWOULDBLOCK;
+    }
+
+    // The connection closes once the reply is out
+    return !client.bAnswered;
+}
+
+void MetricsServer::CloseClient(Client &client)
+{
+    if(client.fd>=0)
+        close(client.fd);
+    client.fd = -1;
+}
+
+void MetricsServer::WriteMetrics(string &body)
+{
+    // Tracking
+    AddMetric(body,"orbslam_frames_total","counter","Frames tracked",mnFrames.load(memory_order_relaxed));
+    AddMetric(body,"orbslam_tracking_state","gauge",
+              "State of the latest frame (-1 not ready, 0 no images yet, 1 not initialized, 2 ok, 3 lost)",
+              mnState.load(memory_order_relaxed));
+    AddMetric(body,"orbslam_tracking_inliers","gauge","Map points tracked as inliers by the latest frame",
+              mnInliers.load(memory_order_relaxed));
+    AddMetric(body,"orbslam_tracking_lost_total","counter","Times the tracking got lost",
+              mnLost.load(memory_order_relaxed));
+    AddMetric(body,"orbslam_relocalizations_total","counter","Times the tracking relocalized after it got lost",
+              mnRelocalized.load(memory_order_relaxed));
+
+    // Map
+    AddMetric(body,"orbslam_map_keyframes","gauge","Keyframes in the map",mnKeyFrames.load(memory_order_relaxed));
+    AddMetric(body,"orbslam_map_points","gauge","Map points in the map",mnMapPoints.load(memory_order_relaxed));
+
+    // Stage times, the loops corrected and the global BAs are the counts of their stages
+    const vector<StageTimes::Summary> vStages = mpMap->mStageTimes.GetAll();
+    AddHeader(body,"orbslam_stage_duration_seconds","histogram","Durations of the stages of the pipeline");
+    for(size_t i=0; i<vStages.size(); i++)
+    {
+        const StageTimes::Summary &s = vStages[i];
+        const string stage = Label("stage",s.name);
+        uint64_t nCumulative = 0;
+        for(int b=0; b<StageTimes::NUM_BUCKETS-1; b++)
+        {
+            nCumulative += s.vnBuckets[b];
+            char le[32];
+            snprintf(le,sizeof(le),"%g",1e-6*static_cast<double>(static_cast<uint64_t>(1)<<b));
+            AddSample(body,"orbslam_stage_duration_seconds_bucket",stage+","+Label("le",le),nCumulative);
+        }
+        AddSample(body,"orbslam_stage_duration_seconds_bucket",stage+",le=\"+Inf\"",s.nCount);
+        AddSample(body,"orbslam_stage_duration_seconds_sum",stage,s.total);
+        AddSample(body,"orbslam_stage_duration_seconds_count",stage,s.nCount);
+    }
+    AddMetric(body,"orbslam_loops_corrected_total","counter","Loops corrected",
+              mpMap->mStageTimes.Get(Stage::CORRECT_LOOP).nCount);
+
+    // Queues
+    const LocalMapping::QueueStats mapping = mpLocalMapper->GetQueueStats();
+    AddMetric(body,"orbslam_mapping_keyframes_total","counter","Keyframes inserted into Local Mapping",mapping.nInserted);
+    AddMetric(body,"orbslam_mapping_queue_max","gauge","Most keyframes waiting for Local Mapping",mapping.nMaxQueued);
+    AddMetric(body,"orbslam_mapping_postponed_total","counter","Keyframes postponed, the mapping queue being full",
+              mapping.nPostponed);
+    AddHeader(body,"orbslam_mapping_overload_total","counter","Keyframes processed with a reduced pipeline by the overload policy");
+    AddSample(body,"orbslam_mapping_overload_total","action=\"skipped_ba\"",mapping.nSkippedBA);
+    AddSample(body,"orbslam_mapping_overload_total","action=\"reduced_ba\"",mapping.nReducedBA);
+    AddSample(body,"orbslam_mapping_overload_total","action=\"resumed\"",mapping.nResumed);
+
+    const LoopClosing::QueueStats loop = mpLoopCloser->GetQueueStats();
+    AddMetric(body,"orbslam_loop_queue","gauge","Keyframes waiting for loop detection",loop.nQueued);
+    AddMetric(body,"orbslam_loop_queue_max","gauge","Most keyframes waiting for loop detection",loop.nMaxQueued);
+    AddMetric(body,"orbslam_loop_keyframes_total","counter","Keyframes inserted into Loop Closing",loop.nInserted);
+    AddMetric(body,"orbslam_loop_queries_total","counter","Keyframes which queried for loop candidates",loop.nQueried);
+    AddHeader(body,"orbslam_loop_skipped_total","counter","Keyframes not queried by the backlog policy");
+    AddSample(body,"orbslam_loop_skipped_total","reason=\"stale\"",loop.nStale);
+    AddSample(body,"orbslam_loop_skipped_total","reason=\"spaced\"",loop.nSpaced);
+
+    // Memory
+    if(mbMemoryUsage.load(memory_order_acquire))
+    {
+        uint64_t data[MEMORY_FIELDS];
+        mMemoryUsage.Read(data);
+        static const char* vParts[MEMORY_FIELDS] = {NULL, "keyframe_keypoints", "keyframe_descriptors",
+                                                    "keyframe_grids", "keyframe_bow", "keyframe_other",
+                                                    NULL, "map_points", NULL, "keyframe_database",
+                                                    "keyframe_depths", "vocabulary", "image_pyramids",
+                                                    "local_ba_problem", "global_ba_problem"};
+        AddHeader(body,"orbslam_memory_bytes","gauge","Estimated bytes held per part, of the latest Memory.LogPeriod walk");
+        for(int i=0; i<MEMORY_FIELDS; i++)
+        {
+            if(vParts[i])
+                AddSample(body,"orbslam_memory_bytes",Label("part",vParts[i]),data[i]);
+        }
+        AddMetric(body,"orbslam_memory_retired_objects","gauge","Bad map points and keyframes not freed yet",data[8]);
+    }
+
+    // Lock waits, per lock name
+    if(LockProfiler::IsEnabled())
+    {
+        map<string,LockTotals> mLocks;
+        for(LockSite* pSite=LockProfiler::FirstSite(); pSite; pSite=pSite->mpNext)
+        {
+            const uint64_t nAcquisitions = pSite->mnAcquisitions.load(memory_order_relaxed);
+            if(nAcquisitions==0)
+                continue;
+            const char* pName = pSite->mName.load();
+            LockTotals &totals = mLocks[pName ? pName : "unknown"];
+            totals.nAcquisitions += nAcquisitions;
+            totals.nContended += pSite->mnContended.load(memory_order_relaxed);
+            totals.nWait += pSite->mnWait.load(memory_order_relaxed);
+            totals.nHold += pSite->mnHold.load(memory_order_relaxed);
+        }
+
+        AddHeader(body,"orbslam_lock_acquisitions_total","counter","Acquisitions of the map locks");
+        for(map<string,LockTotals>::const_iterator mit=mLocks.begin(); mit!=mLocks.end(); mit++)
+            AddSample(body,"orbslam_lock_acquisitions_total",Label("lock",mit->first),mit->second.nAcquisitions);
+        AddHeader(body,"orbslam_lock_contended_total","counter","Acquisitions of the map locks which waited");
+        for(map<string,LockTotals>::const_iterator mit=mLocks.begin(); mit!=mLocks.end(); mit++)
+            AddSample(body,"orbslam_lock_contended_total",Label("lock",mit->first),mit->second.nContended);
+        AddHeader(body,"orbslam_lock_wait_seconds_total","counter","Time waited for the map locks");
+        for(map<string,LockTotals>::const_iterator mit=mLocks.begin(); mit!=mLocks.end(); mit++)
+            AddSample(body,"orbslam_lock_wait_seconds_total",Label("lock",mit->first),1e-9*mit->second.nWait);
+        AddHeader(body,"orbslam_lock_hold_seconds_total","counter","Time the map locks were held");
+        for(map<string,LockTotals>::const_iterator mit=mLocks.begin(); mit!=mLocks.end(); mit++)
+            AddSample(body,"orbslam_lock_hold_seconds_total",Label("lock",mit->first),1e-9*mit->second.nHold);
+    }
+}
+
+void MetricsServer::RequestFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinishRequested = true;
+}
+
+bool MetricsServer::CheckFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinishRequested;
+}
+
+void MetricsServer::SetFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinished = true;
+}
+
+bool MetricsServer::isFinished()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinished;
+}
+
+} //namespace ORB_SLAM
@@ -58,10 +58,13 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <iostream>
 #include <vector>
 
+#include "FastScores.h"
 #include "ORBextractor.h"
 #include "Parameter.h"
+#include "PatchMoments.h"
 
 
 using namespace cv;
@@ -73,44 +76,42 @@ namespace ORB_SLAM2
 const int PATCH_SIZE = 31; //param used for calculating BRIEF descriptor (see paper on ORB)
 const int HALF_PATCH_SIZE = 15; //param
 const int EDGE_THRESHOLD = 19; //param
+// Pyramids an extractor keeps for the frames holding theirs, more are freed once they are let go
+const size_t MAX_PYRAMIDS = 4; //param
 
-static float IC_Angle(const Mat& image, Point2f pt,  const vector<int> & u_max)
-{
-    int m_01 = 0, m_10 = 0;
-
-    const uchar* center = &image.at<uchar> (cvRound(pt.y), cvRound(pt.x));
+const float factorPI = (float)(CV_PI/180.f);
 
-    // Treat the center line differently, v=0
-    for (int u = -HALF_PATCH_SIZE; u <= HALF_PATCH_SIZE; ++u)
-        m_10 += u * center[u];
+// cos and sin the pattern is rotated with, for a keypoint and for the precomputed angle bins
+static void patternRotation(const float angleDeg, float& a, float& b)
+{
+    float angle = angleDeg*factorPI;
+    a = (float)cos(angle);
+    b = (float)sin(angle);
+}
 
-    // Go line by line in the circuI853lar patch
-    int step = (int)image.step1();
-    for (int v = 1; v <= HALF_PATCH_SIZE; ++v)
-    {
-        // Proceed over the two lines
-        int v_sum = 0;
-        int d = u_max[v];
-        for (int u = -d; u <= d; ++u)
-        {
-            int val_plus = center[u + v*step], val_minus = center[u - v*step];
-            v_sum += (val_plus - val_minus);
-            m_10 += u * (val_plus + val_minus);
-        }
-        m_01 += v * v_sum;
-    }
+static void patternRotation(const KeyPoint& kpt, float& a, float& b)
+{
+    patternRotation((float)kpt.angle, a, b);
+}
 
-    return fastAtan2((float)m_01, (float)m_10);
+// the angle bin of a keypoint, bins are centered on multiples of 360/nBins degrees
+static inline int patternBin(const KeyPoint& kpt, const int nBins)
+{
+    const int bin = cvRound(kpt.angle*nBins/360.f);
+    return bin>=nBins ? bin-nBins : bin;
 }
 
+static inline float patternBinAngle(const int bin, const int nBins)
+{
+    return bin*360.f/nBins;
+}
 
-const float factorPI = (float)(CV_PI/180.f);
 static void computeOrbDescriptor(const KeyPoint& kpt,
                                  const Mat& img, const Point* pattern,
                                  uchar* desc)
 {
-    float angle = (float)kpt.angle*factorPI;
-    float a = (float)cos(angle), b = (float)sin(angle);
+    float a, b;
+    patternRotation(kpt, a, b);
 
     const uchar* center = &img.at<uchar>(cvRound(kpt.pt.y), cvRound(kpt.pt.x));
     const int step = (int)img.step;
@@ -146,6 +147,21 @@ static void computeOrbDescriptor(const KeyPoint& kpt,
     #undef GET_VALUE
 }
 
+// The same tests with the pattern rotated by the angle of its bin, offsets holds the positions of
+// the 512 points relative to the center
+static void computeOrbDescriptor(const KeyPoint& kpt, const Mat& img, const int* offsets, uchar* desc)
+{
+    const uchar* center = &img.at<uchar>(cvRound(kpt.pt.y), cvRound(kpt.pt.x));
+
+    for (int i = 0; i < 32; ++i, offsets += 16)
+    {
+        int val = 0;
+        for (int j = 0; j < 8; ++j)
+            val |= (center[offsets[2*j]] < center[offsets[2*j+1]]) << j;
+        desc[i] = (uchar)val;
+    }
+}
+
 
 // This is the rBRIEF pattern for extracting test points from image patches,
 // it is rotated by the orientation of extracted FAST corners which results in
@@ -413,7 +429,7 @@ static int bit_pattern_31_[256*4] =
 
 ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels,
          int _iniThFAST, int _minThFAST, std::vector<std::vector<int>> excludedRegions,
-         bool initialization)
+         bool initialization, int _nthreads, int _patternBins, bool _gridDistribution)
     : mExcludedRegions(excludedRegions)
     , visualizeExtractor("Show Extraction", false, true,
             (initialization ? ParameterGroup::UNDEFINED : ParameterGroup::MAIN), []{})
@@ -435,6 +451,19 @@ ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels,
     , cellWidth("Cell width", 30, 10, 100,
             (initialization ? ParameterGroup::INITIALIZATION : ParameterGroup::ORBEXTRACTOR),
             [&]{UpdateParameters();})
+    , nThreads("Num threads", std::max(_nthreads, 1), 1, 16, //param
+            (initialization ? ParameterGroup::INITIALIZATION : ParameterGroup::ORBEXTRACTOR),
+            [&]{UpdateThreadPool();})
+    , fusedPyramid("Fused pyramid blur", true, true,
+            (initialization ? ParameterGroup::INITIALIZATION : ParameterGroup::ORBEXTRACTOR), []{})
+    , patternAngleBins("Pattern angle bins", std::max(_patternBins, 0), 0, 360, //param
+            (initialization ? ParameterGroup::INITIALIZATION : ParameterGroup::ORBEXTRACTOR),
+            [&]{UpdateRotatedPatterns();})
+    , gridDistribution("Grid distribution", _gridDistribution, true,
+            (initialization ? ParameterGroup::INITIALIZATION : ParameterGroup::ORBEXTRACTOR), []{})
+    , mShowExtraction(ParameterGroup::MAIN, "Show Extraction")
+    , mpThreadPool(NULL)
+    , mnBufferBytes(0)
 {
     mvScaleFactor.resize(nLevels());
     mvLevelSigma2.resize(nLevels());
@@ -454,7 +483,10 @@ ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels,
         mvInvLevelSigma2[i]=1.0f/mvLevelSigma2[i];
     }
 
+    // the buffers of the levels which remain are kept, ComputePyramid only reallocates them if
+    // their size changed
     mvImagePyramid.resize(nLevels());
+    mvLevelDescriptors.resize(nLevels());
 
     mnFeaturesPerLevel.resize(nLevels());
     float factor = 1.0f / scaleFactor();
@@ -491,336 +523,152 @@ ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels,
         umax[v] = v0;
         ++v0;
     }
+
+    UpdateRotatedPatterns();
+    UpdateThreadPool();
 }
 
-static void computeOrientation(const Mat& image, vector<KeyPoint>& keypoints, const vector<int>& umax)
+ORBextractor::~ORBextractor()
 {
-    for (vector<KeyPoint>::iterator keypoint = keypoints.begin(),
-         keypointEnd = keypoints.end(); keypoint != keypointEnd; ++keypoint)
-    {
-        keypoint->angle = IC_Angle(image, keypoint->pt, umax);
-    }
+    delete mpThreadPool;
 }
 
-void ExtractorNode::DivideNode(ExtractorNode &n1, ExtractorNode &n2, ExtractorNode &n3, ExtractorNode &n4)
+// whether the pixel (x,y) of a level is in its exclusion mask
+static inline bool IsExcluded(const Mat& mask, const int x, const int y)
 {
-    const int halfX = ceil(static_cast<float>(UR.x-UL.x)/2);
-    const int halfY = ceil(static_cast<float>(BR.y-UL.y)/2);
-
-    //Define boundaries of childs
-    n1.UL = UL;
-    n1.UR = cv::Point2i(UL.x+halfX,UL.y);
-    n1.BL = cv::Point2i(UL.x,UL.y+halfY);
-    n1.BR = cv::Point2i(UL.x+halfX,UL.y+halfY);
-    n1.vKeys.reserve(vKeys.size());
-
-    n2.UL = n1.UR;
-    n2.UR = UR;
-    n2.BL = n1.BR;
-    n2.BR = cv::Point2i(UR.x,UL.y+halfY);
-    n2.vKeys.reserve(vKeys.size());
-
-    n3.UL = n1.BL;
-    n3.UR = n1.BR;
-    n3.BL = BL;
-    n3.BR = cv::Point2i(n1.BR.x,BL.y);
-    n3.vKeys.reserve(vKeys.size());
-
-    n4.UL = n3.UR;
-    n4.UR = n2.BR;
-    n4.BL = n3.BR;
-    n4.BR = BR;
-    n4.vKeys.reserve(vKeys.size());
-
-    //Associate points to childs
-    for(size_t i=0;i<vKeys.size();i++)
-    {
-        const cv::KeyPoint &kp = vKeys[i];
-        if(kp.pt.x<n1.UR.x)
-        {
-            if(kp.pt.y<n1.BR.y)
-                n1.vKeys.push_back(kp);
-            else
-                n3.vKeys.push_back(kp);
-        }
-        else if(kp.pt.y<n1.BR.y)
-            n2.vKeys.push_back(kp);
-        else
-            n4.vKeys.push_back(kp);
-    }
-
-    if(n1.vKeys.size()==1)
-        n1.bNoMore = true;
-    if(n2.vKeys.size()==1)
-        n2.bNoMore = true;
-    if(n3.vKeys.size()==1)
-        n3.bNoMore = true;
-    if(n4.vKeys.size()==1)
-        n4.bNoMore = true;
+    return !mask.empty() && mask.at<uchar>(y,x)!=0;
 }
 
-vector<cv::KeyPoint> ORBextractor::DistributeOctTree(const vector<cv::KeyPoint>& vToDistributeKeys, const int &minX,
-                                       const int &maxX, const int &minY, const int &maxY, const int &N, const int &level)
+// The corners cv::FAST with non-maximum suppression finds at threshold in the cell, from the
+// strengths of the level: the corners of the cell interior whose score is above the scores of
+// their neighbors in the interior which are corners too. In cell coordinates and row order.
+static void detectCellCorners(const Mat& scores, const Rect& cell, const int threshold, vector<KeyPoint>& keypoints)
 {
-    // Compute how many initial nodes
-    const int nIni = round(static_cast<float>(maxX-minX)/(maxY-minY));
-
-    // TODO: this could possibly crash if the image was much larger in height than in width
-    const float hX = static_cast<float>(maxX-minX)/nIni;
-
-    list<ExtractorNode> lNodes;
-
-    vector<ExtractorNode*> vpIniNodes;
-    vpIniNodes.resize(nIni);
-
-    //This is actually pretty much always going to be exactly one node for the beginning
-    for(int i=0; i<nIni; i++)
-    {
-        ExtractorNode ni;
-        ni.UL = cv::Point2i(hX*static_cast<float>(i),0);
-        ni.UR = cv::Point2i(hX*static_cast<float>(i+1),0);
-        ni.BL = cv::Point2i(ni.UL.x,maxY-minY);
-        ni.BR = cv::Point2i(ni.UR.x,maxY-minY);
-        ni.vKeys.reserve(vToDistributeKeys.size());
-
-        lNodes.push_back(ni);
-        vpIniNodes[i] = &lNodes.back();
-    }
-
-    //Associate points to children
-    for(size_t i=0;i<vToDistributeKeys.size();i++)
-    {
-        const cv::KeyPoint &kp = vToDistributeKeys[i];
-        vpIniNodes[kp.pt.x/hX]->vKeys.push_back(kp);
-    }
-
-    list<ExtractorNode>::iterator lit = lNodes.begin();
-
-    // remove all nodes that don't contain any features
-    while(lit!=lNodes.end())
-    {
-        if(lit->vKeys.size()==1)
-        {
-            lit->bNoMore=true;
-            lit++;
-        }
-        else if(lit->vKeys.empty())
-        {
-            lit = lNodes.erase(lit);
-        }
-        else
-        {
-            lit++;
-        }
-    }
-
-    bool bFinish = false;
+    const int r = FastScores::kRadius;
+    const int x0 = cell.x+r, x1 = cell.x+cell.width-r;
+    const int y0 = cell.y+r, y1 = cell.y+cell.height-r;
 
-    int iteration = 0;
-
-    vector<pair<int,ExtractorNode*> > vSizeAndPointerToNode;
-    vSizeAndPointerToNode.reserve(lNodes.size()*4);
-
-    while(!bFinish)
+    for(int y=y0; y<y1; y++)
     {
-        iteration++;
-
-        int prevSize = lNodes.size();
-
-        lit = lNodes.begin();
-
-        int nToExpand = 0;
-
-        vSizeAndPointerToNode.clear();
-
-        while(lit!=lNodes.end())
+        const uchar* row = scores.ptr<uchar>(y);
+        for(int x=x0; x<x1; x++)
         {
-            if(lit->bNoMore)
-            {
-                // If node only contains one point do not subdivide and continue
-                lit++;
+            const int strength = row[x];
+            if(strength<=threshold)
                 continue;
-            }
-            else
-            {
-                // If more than one point, subdivide
-                ExtractorNode n1,n2,n3,n4;
-                lit->DivideNode(n1,n2,n3,n4);
 
-                // Add children if they contain points
-                if(n1.vKeys.size()>0)
-                {
-                    lNodes.push_front(n1);
-                    if(n1.vKeys.size()>1)
-                    {
-                        nToExpand++;
-                        vSizeAndPointerToNode.push_back(make_pair(n1.vKeys.size(),&lNodes.front()));
-                        lNodes.front().lit = lNodes.begin();
-                    }
-                }
-                if(n2.vKeys.size()>0)
-                {
-                    lNodes.push_front(n2);
-                    if(n2.vKeys.size()>1)
-                    {
-                        nToExpand++;
-                        vSizeAndPointerToNode.push_back(make_pair(n2.vKeys.size(),&lNodes.front()));
-                        lNodes.front().lit = lNodes.begin();
-                    }
-                }
-                if(n3.vKeys.size()>0)
-                {
-                    lNodes.push_front(n3);
-                    if(n3.vKeys.size()>1)
-                    {
-                        nToExpand++;
-                        vSizeAndPointerToNode.push_back(make_pair(n3.vKeys.size(),&lNodes.front()));
-                        lNodes.front().lit = lNodes.begin();
-                    }
-                }
-                if(n4.vKeys.size()>0)
+            bool bMaximum = true;
+            for(int dy=-1; dy<=1 && bMaximum; dy++)
+            {
+                if(y+dy<y0 || y+dy>=y1)
+                    continue;
+                const uchar* neighbors = scores.ptr<uchar>(y+dy);
+                for(int dx=-1; dx<=1; dx++)
                 {
-                    lNodes.push_front(n4);
-                    if(n4.vKeys.size()>1)
+                    if((dx==0 && dy==0) || x+dx<x0 || x+dx>=x1)
+                        continue;
+                    // the score of a neighbor which is no corner counts as 0
+                    const int neighbor = neighbors[x+dx]>threshold ? neighbors[x+dx]-1 : 0;
+                    if(strength-1<=neighbor)
                     {
-                        nToExpand++;
-                        vSizeAndPointerToNode.push_back(make_pair(n4.vKeys.size(),&lNodes.front()));
-                        lNodes.front().lit = lNodes.begin();
+                        bMaximum = false;
+                        break;
                     }
                 }
-
-                lit=lNodes.erase(lit);
-                continue;
             }
-        }
 
-        // Finish if there are more nodes than required features
-        // or all nodes contain just one point
-        // DLOG(INFO) << "Now have " << lNodes.size() << " nodes of max " << N << " features.";
-        // DLOG(INFO) << "With " << nToExpand << " nodes to expand";
-        if((int)lNodes.size()>=N || (int)lNodes.size()==prevSize)
-        {
-            if ((int)lNodes.size()>=N) {
-                // DLOG(INFO) << "Have more nodes than features wanted. Stopping now";
-            }
-            else if ((int)lNodes.size()==prevSize) {
-                // DLOG(INFO) << "Nodes all split up and dividing done.";
-            }
-            bFinish = true;
+            if(bMaximum)
+                keypoints.push_back(KeyPoint((float)(x-cell.x), (float)(y-cell.y), 7.f, -1, (float)(strength-1)));
         }
-        // when there are still lots of nodes to expand but not actually
-        // that many more features need to be created handle it here
-        // it just assumes that there will be about 3 features i every node to expand
-        else if(((int)lNodes.size()+nToExpand*3)>N) //param
-        {
-            // DLOG(INFO) << "Need to do extra steps";
-            while(!bFinish)
-            {
+    }
+}
 
-                prevSize = lNodes.size();
+static_assert(HALF_PATCH_SIZE==PatchMoments::kHalfPatchSize, "PatchMoments is built for the patch size");
 
-                vector<pair<int,ExtractorNode*> > vPrevSizeAndPointerToNode = vSizeAndPointerToNode;
-                vSizeAndPointerToNode.clear();
+// Intensity centroid angle of every keypoint, the moments of all of them in one batch
+static void computeOrientation(const Mat& image, vector<KeyPoint>& keypoints, const vector<int>& umax)
+{
+    const size_t nkps = keypoints.size();
+    if(nkps==0)
+        return;
 
-                sort(vPrevSizeAndPointerToNode.begin(),vPrevSizeAndPointerToNode.end());
-                for(int j=vPrevSizeAndPointerToNode.size()-1;j>=0;j--)
-                {
-                    ExtractorNode n1,n2,n3,n4;
-                    vPrevSizeAndPointerToNode[j].second->DivideNode(n1,n2,n3,n4);
+    vector<int> vPositions(2*nkps);
+    for(size_t i=0; i<nkps; i++)
+    {
+        vPositions[2*i] = cvRound(keypoints[i].pt.x);
+        vPositions[2*i+1] = cvRound(keypoints[i].pt.y);
+    }
 
-                    // Add childs if they contain points
-                    if(n1.vKeys.size()>0)
-                    {
-                        lNodes.push_front(n1);
-                        if(n1.vKeys.size()>1)
-                        {
-                            vSizeAndPointerToNode.push_back(make_pair(n1.vKeys.size(),&lNodes.front()));
-                            lNodes.front().lit = lNodes.begin();
-                        }
-                    }
-                    if(n2.vKeys.size()>0)
-                    {
-                        lNodes.push_front(n2);
-                        if(n2.vKeys.size()>1)
-                        {
-                            vSizeAndPointerToNode.push_back(make_pair(n2.vKeys.size(),&lNodes.front()));
-                            lNodes.front().lit = lNodes.begin();
-                        }
-                    }
-                    if(n3.vKeys.size()>0)
-                    {
-                        lNodes.push_front(n3);
-                        if(n3.vKeys.size()>1)
-                        {
-                            vSizeAndPointerToNode.push_back(make_pair(n3.vKeys.size(),&lNodes.front()));
-                            lNodes.front().lit = lNodes.begin();
-                        }
-                    }
-                    if(n4.vKeys.size()>0)
-                    {
-                        lNodes.push_front(n4);
-                        if(n4.vKeys.size()>1)
-                        {
-                            vSizeAndPointerToNode.push_back(make_pair(n4.vKeys.size(),&lNodes.front()));
-                            lNodes.front().lit = lNodes.begin();
-                        }
-                    }
+    vector<int> vMoments(2*nkps);
+    PatchMoments::Compute(image.data,image.step[0],&umax[0],&vPositions[0],nkps,&vMoments[0]);
 
-                    lNodes.erase(vPrevSizeAndPointerToNode[j].second->lit);
+    for(size_t i=0; i<nkps; i++)
+        keypoints[i].angle = fastAtan2((float)vMoments[2*i], (float)vMoments[2*i+1]);
+}
 
-                    if((int)lNodes.size()>=N)
-                        break;
-                }
+void ORBextractor::ComputeKeyPointsOctTree(vector<vector<KeyPoint> >& allKeypoints)
+{
+    allKeypoints.resize(nLevels());
 
-                if((int)lNodes.size()>=N || (int)lNodes.size()==prevSize)
-                    bFinish = true;
+    for (int level = 0; level < nLevels(); ++level)
+        ComputeKeyPointsLevel(level, allKeypoints[level]);
+}
 
-            }
-        }
-    }
+void ORBextractor::UpdateLayouts(const cv::Size& imageSize)
+{
+    if(mbLayoutsValid && imageSize==mLayoutImageSize && (int)mvLevelLayouts.size()==nLevels())
+        return;
 
-    // Retain the best point in each node
-    vector<cv::KeyPoint> vResultKeys;
-    vResultKeys.reserve(nFeatures());
-    for(list<ExtractorNode>::iterator lit=lNodes.begin(); lit!=lNodes.end(); lit++)
+    // The exclusion mask at full resolution, the levels get it downscaled so that a level pixel is
+    // excluded if any of the image pixels it covers is
+    Mat fullMask;
+    if(!mExclusionMask.empty() || !mvExcludedPolygons.empty())
     {
-        vector<cv::KeyPoint> &vNodeKeys = lit->vKeys;
-        cv::KeyPoint* pKP = &vNodeKeys[0];
-        float maxResponse = pKP->response;
-
-        for(size_t k=1;k<vNodeKeys.size();k++)
+        fullMask = Mat::zeros(imageSize, CV_8U);
+        if(!mExclusionMask.empty())
         {
-            if(vNodeKeys[k].response>maxResponse)
+            Mat mask = mExclusionMask;
+            if(mask.size()!=imageSize)
             {
-                pKP = &vNodeKeys[k];
-                maxResponse = vNodeKeys[k].response;
+                cerr << "Exclusion mask is " << mask.cols << "x" << mask.rows << ", scaling it to the image size "
+                     << imageSize.width << "x" << imageSize.height << endl;
+                resize(mExclusionMask, mask, imageSize, 0, 0, INTER_NEAREST);
             }
+            fullMask.setTo(Scalar(255), mask);
         }
-
-        vResultKeys.push_back(*pKP);
+        if(!mvExcludedPolygons.empty())
+            fillPoly(fullMask, mvExcludedPolygons, Scalar(255));
     }
 
-    // DLOG(INFO) << "Asked for " << N << " features and got " << vResultKeys.size();
-    return vResultKeys;
-}
-
-void ORBextractor::ComputeKeyPointsOctTree(vector<vector<KeyPoint> >& allKeypoints)
-{
-    allKeypoints.resize(nLevels());
-
-    int numLowerThreshUsed = 0;
-    int numHigherThreshUsed = 0;
-
-    for (int level = 0; level < nLevels(); ++level)
+    mvLevelLayouts.resize(nLevels());
+    mvDistributions.resize(nLevels());
+    mvGridDistributions.resize(nLevels());
+    mvFastScores.resize(nLevels());
+    for(int level=0; level<nLevels(); ++level)
     {
+        LevelLayout& layout = mvLevelLayouts[level];
+        const float scale = mvInvScaleFactor[level];
+        layout.size = Size(cvRound((float)imageSize.width*scale), cvRound((float)imageSize.height*scale));
+
+        if(fullMask.empty())
+            layout.mask.release();
+        else if(level==0)
+            layout.mask = fullMask;
+        else
+        {
+            resize(fullMask, layout.mask, layout.size, 0, 0, INTER_AREA);
+            layout.mask = layout.mask>0;
+        }
+
         // Determine the region of the image the features are going to be extracted in
         const int minBorderX = EDGE_THRESHOLD-3; //param
         const int minBorderY = minBorderX;
-        const int maxBorderX = mvImagePyramid[level].cols-EDGE_THRESHOLD+3; //param
-        const int maxBorderY = mvImagePyramid[level].rows-EDGE_THRESHOLD+3; //param
-
-        vector<cv::KeyPoint> vToDistributeKeys;
-        vToDistributeKeys.reserve(nFeatures()*10);
+        const int maxBorderX = layout.size.width-EDGE_THRESHOLD+3; //param
+        const int maxBorderY = layout.size.height-EDGE_THRESHOLD+3; //param
+        layout.minBorderX = minBorderX;
+        layout.minBorderY = minBorderY;
+        layout.maxBorderX = maxBorderX;
+        layout.maxBorderY = maxBorderY;
 
         const float width = (maxBorderX-minBorderX);
         const float height = (maxBorderY-minBorderY);
@@ -831,7 +679,12 @@ void ORBextractor::ComputeKeyPointsOctTree(vector<vector<KeyPoint> >& allKeypoin
         const int wCell = ceil(width/nCols);
         const int hCell = ceil(height/nRows);
 
-        // move through all cells and do the extraction
+        vector<cv::Rect>& vCells = layout.vCells;
+        vCells.clear();
+        vCells.reserve(nRows*nCols);
+        layout.nGridCells = nRows*nCols;
+
+        // move through all cells
         for(int i=0; i<nRows; i++)
         {
             const float iniY = minBorderY+i*hCell;
@@ -878,67 +731,123 @@ void ORBextractor::ComputeKeyPointsOctTree(vector<vector<KeyPoint> >& allKeypoin
                     continue;
                 }
 
-                vector<cv::KeyPoint> vKeysCell;
-                FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                     vKeysCell,iniThFAST(),true);
-                numHigherThreshUsed++;
+                const cv::Rect cell((int)iniX, (int)iniY, (int)maxX-(int)iniX, (int)maxY-(int)iniY);
 
-                // if no FAST corners were extracted try again with a different threshold
-                if(vKeysCell.empty())
+                // FAST can't find a corner within 3 pixels of the cell border, so a cell whose
+                // interior is excluded completely gives nothing
+                if(!layout.mask.empty())
                 {
-                    FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                         vKeysCell,minThFAST(),true);
-                    numHigherThreshUsed--;
-                    numLowerThreshUsed++;
+                    const cv::Rect interior(cell.x+3, cell.y+3, cell.width-6, cell.height-6); //param
+                    if(interior.width<=0 || interior.height<=0 ||
+                       countNonZero(layout.mask(interior))==interior.area())
+                        continue;
                 }
 
-                if(!vKeysCell.empty())
-                {
-                    for(vector<cv::KeyPoint>::iterator vit=vKeysCell.begin(); vit!=vKeysCell.end();vit++)
-                    {
-                        // DLOG(INFO) << "Cell keypoint: x = " << (*vit).pt.x << ", y = " << (*vit).pt.y;
-                        (*vit).pt.x+=j*wCell;
-                        (*vit).pt.y+=i*hCell;
-                        vToDistributeKeys.push_back(*vit);
-                        // DLOG(INFO) << "Moved keypoint: x = " << (*vit).pt.x << ", y = " << (*vit).pt.y;
-                    }
-                }
+                vCells.push_back(cell);
             }
         }
+    }
 
-        if(visualizeExtractor())
-        {
-            int numCells = nRows * nCols;
-            DLOG(INFO) << "Level: " << level << " used higher threshold on: "
-                       << numHigherThreshUsed << "/" << numCells << " and lower threshold on: "
-                       << numLowerThreshUsed << "/" << numCells << " cells.";
-            numHigherThreshUsed = 0;
-            numLowerThreshUsed = 0;
-        }
+    mLayoutImageSize = imageSize;
+    mbLayoutsValid = true;
+}
 
-        vector<KeyPoint> & keypoints = allKeypoints[level];
-        keypoints.reserve(nFeatures());
+void ORBextractor::ComputeKeyPointsLevel(const int level, vector<KeyPoint>& keypoints)
+{
+    int numLowerThreshUsed = 0;
+    int numHigherThreshUsed = 0;
 
-        // Make sure features are equally distributed across the image
-        keypoints = DistributeOctTree(vToDistributeKeys, minBorderX, maxBorderX,
-                                      minBorderY, maxBorderY,mnFeaturesPerLevel[level], level);
+    const LevelLayout& layout = mvLevelLayouts[level];
+    const vector<cv::Rect>& vCells = layout.vCells;
 
-        const int scaledPatchSize = PATCH_SIZE*mvScaleFactor[level];
+    vector<cv::KeyPoint> vToDistributeKeys;
+    vToDistributeKeys.reserve(nFeatures()*10);
 
-        // Add border to coordinates and scale information
-        const int nkps = keypoints.size();
-        for(int i=0; i<nkps ; i++)
+    // FAST strength of the whole search area once, the cells are detected from it at both thresholds
+    const Mat& image = mvImagePyramid[level];
+    Mat& scores = mvFastScores[level];
+    scores.create(image.size(), CV_8U);
+    const int r = FastScores::kRadius;
+    FastScores::Compute(image.data, image.step[0], layout.minBorderX+r, layout.minBorderY+r,
+                        layout.maxBorderX-r, layout.maxBorderY-r, min(mnIniThFAST,mnMinThFAST),
+                        scores.data, scores.step[0]);
+
+    // do the extraction in every cell
+    vector<cv::KeyPoint> vKeysCell;
+    for(size_t c=0; c<vCells.size(); c++)
+    {
+        const cv::Rect& cell = vCells[c];
+
+        vKeysCell.clear();
+        detectCellCorners(scores,cell,mnIniThFAST,vKeysCell);
+        numHigherThreshUsed++;
+
+        // if no FAST corners were extracted try again with a different threshold
+        if(vKeysCell.empty())
+        {
+            detectCellCorners(scores,cell,mnMinThFAST,vKeysCell);
+            numHigherThreshUsed--;
+            numLowerThreshUsed++;
+        }
+
+        if(!vKeysCell.empty())
         {
-            keypoints[i].pt.x+=minBorderX;
-            keypoints[i].pt.y+=minBorderY;
-            keypoints[i].octave=level;
-            keypoints[i].size = scaledPatchSize;
+            for(vector<cv::KeyPoint>::iterator vit=vKeysCell.begin(); vit!=vKeysCell.end();vit++)
+            {
+                // the detection takes no mask, corners on excluded pixels are dropped here
+                if(IsExcluded(layout.mask, (int)(*vit).pt.x+cell.x, (int)(*vit).pt.y+cell.y))
+                    continue;
+                // DLOG(INFO) << "Cell keypoint: x = " << (*vit).pt.x << ", y = " << (*vit).pt.y;
+                (*vit).pt.x+=cell.x-layout.minBorderX;
+                (*vit).pt.y+=cell.y-layout.minBorderY;
+                vToDistributeKeys.push_back(*vit);
+                // DLOG(INFO) << "Moved keypoint: x = " << (*vit).pt.x << ", y = " << (*vit).pt.y;
+            }
         }
     }
 
+    DistributeLevel(level, vToDistributeKeys, layout.nGridCells, numHigherThreshUsed, numLowerThreshUsed, keypoints);
+
     // compute orientations
-    for (int level = 0; level < nLevels(); ++level)
-        computeOrientation(mvImagePyramid[level], allKeypoints[level], umax);
+    computeOrientation(mvImagePyramid[level], keypoints, umax);
+}
+
+void ORBextractor::DistributeLevel(const int level, const vector<cv::KeyPoint>& vToDistributeKeys,
+                                   const int numCells, const int numHigherThreshUsed, const int numLowerThreshUsed,
+                                   vector<cv::KeyPoint>& keypoints)
+{
+    const LevelLayout& layout = mvLevelLayouts[level];
+    const int minBorderX = layout.minBorderX;
+    const int minBorderY = layout.minBorderY;
+    const int maxBorderX = layout.maxBorderX;
+    const int maxBorderY = layout.maxBorderY;
+
+    if(visualizeExtractor())
+    {
+        DLOG(INFO) << "Level: " << level << " used higher threshold on: "
+                   << numHigherThreshUsed << "/" << numCells << " and lower threshold on: "
+                   << numLowerThreshUsed << "/" << numCells << " cells.";
+    }
+
+    // Make sure features are equally distributed across the image
+    if(mbGridDistribution)
+        mvGridDistributions[level].Distribute(vToDistributeKeys, minBorderX, maxBorderX,
+                                              minBorderY, maxBorderY, mnFeaturesPerLevel[level], keypoints);
+    else
+        mvDistributions[level].Distribute(vToDistributeKeys, minBorderX, maxBorderX,
+                                          minBorderY, maxBorderY, mnFeaturesPerLevel[level], keypoints);
+
+    const int scaledPatchSize = PATCH_SIZE*mvScaleFactor[level];
+
+    // Add border to coordinates and scale information
+    const int nkps = keypoints.size();
+    for(int i=0; i<nkps ; i++)
+    {
+        keypoints[i].pt.x+=minBorderX;
+        keypoints[i].pt.y+=minBorderY;
+        keypoints[i].octave=level;
+        keypoints[i].size = scaledPatchSize;
+    }
 }
 
 void ORBextractor::ComputeKeyPointsOld(std::vector<std::vector<KeyPoint> > &allKeypoints)
@@ -1123,12 +1032,77 @@ void ORBextractor::ComputeKeyPointsOld(std::vector<std::vector<KeyPoint> > &allK
 static void computeDescriptors(const Mat& image, vector<KeyPoint>& keypoints, Mat& descriptors,
                                const vector<Point>& pattern)
 {
-    descriptors = Mat::zeros((int)keypoints.size(), 32, CV_8UC1);
+    // every byte is written by computeOrbDescriptor, create only reallocates if the buffer is too small
+    descriptors.create((int)keypoints.size(), 32, CV_8UC1);
 
     for (size_t i = 0; i < keypoints.size(); i++)
         computeOrbDescriptor(keypoints[i], image, &pattern[0], descriptors.ptr((int)i));
 }
 
+// with the offset tables of nBins angle bins of the level
+static void computeDescriptors(const Mat& image, vector<KeyPoint>& keypoints, Mat& descriptors,
+                               const int* offsets, const int nBins)
+{
+    descriptors.create((int)keypoints.size(), 32, CV_8UC1);
+
+    for (size_t i = 0; i < keypoints.size(); i++)
+        computeOrbDescriptor(keypoints[i], image, offsets + 512*patternBin(keypoints[i], nBins),
+                             descriptors.ptr((int)i));
+}
+
+void ORBextractor::UpdateRotatedPatterns()
+{
+    mnPatternBins = patternAngleBins();
+    mvRotatedPatterns.resize(512*mnPatternBins);
+    for(int bin=0; bin<mnPatternBins; bin++)
+    {
+        // the rounding of computeOrbDescriptor at the angle of the bin
+        float a, b;
+        patternRotation(patternBinAngle(bin, mnPatternBins), a, b);
+        for(int i=0; i<512; i++)
+        {
+            const Point& p = pattern[i];
+            mvRotatedPatterns[512*bin+i] = Point(cvRound(p.x*a - p.y*b), cvRound(p.x*b + p.y*a));
+        }
+    }
+
+    mvPatternOffsets.assign(nLevels(), vector<int>());
+    mvPatternSteps.assign(nLevels(), 0);
+}
+
+const int* ORBextractor::GetPatternOffsets(const int level, const size_t step)
+{
+    // only the thread extracting the level gets here, the levels don't share a table
+    vector<int>& vOffsets = mvPatternOffsets[level];
+    if(mvPatternSteps[level]!=step || vOffsets.size()!=mvRotatedPatterns.size())
+    {
+        vOffsets.resize(mvRotatedPatterns.size());
+        for(size_t i=0; i<mvRotatedPatterns.size(); i++)
+            vOffsets[i] = mvRotatedPatterns[i].y*(int)step + mvRotatedPatterns[i].x;
+        mvPatternSteps[level] = step;
+    }
+    return &vOffsets[0];
+}
+
+void ORBextractor::ComputeLevel(const int level, vector<KeyPoint>& keypoints, Mat& descriptors)
+{
+    ComputeKeyPointsLevel(level, keypoints);
+
+    if(keypoints.empty())
+        return;
+
+    // preprocess the resized image (the border of the padded buffer is ignored, same as on a copy)
+    if(!mpPyramid->IsBlurred(level))
+        mpPyramid->Blur(level);
+
+    // Compute the descriptors
+    const Mat& blurred = mpPyramid->GetBlurredLevel(level);
+    if(mnPatternBins>0)
+        computeDescriptors(blurred, keypoints, descriptors, GetPatternOffsets(level, blurred.step[0]), mnPatternBins);
+    else
+        computeDescriptors(blurred, keypoints, descriptors, pattern);
+}
+
 void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPoint>& _keypoints,
                       OutputArray _descriptors)
 {
@@ -1138,8 +1112,7 @@ void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPo
     Mat image = _image.getMat();
     assert(image.type() == CV_8UC1 );
 
-    auto visualizeParam = ParameterManager::getParameter<bool>(ParameterGroup::MAIN,
-                                                               "Show Extraction");
+    Parameter<bool>* visualizeParam = mShowExtraction.get();
     if(visualizeParam)
     {
         if(visualizeParam->getValue())
@@ -1152,12 +1125,22 @@ void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPo
         }
     }
 
+    mnIniThFAST = iniThFAST();
+    mnMinThFAST = minThFAST();
+    mbGridDistribution = gridDistribution();
+
     // Pre-compute the scale pyramid
     ComputePyramid(image);
 
-    vector < vector<KeyPoint> > allKeypoints;
-    ComputeKeyPointsOctTree(allKeypoints);
-    //ComputeKeyPointsOld(allKeypoints);
+    // The levels are independent once the pyramid exists, run them on the pool if there is one.
+    // Results are merged in level order below, so the output is the same as in the serial case.
+    vector < vector<KeyPoint> > allKeypoints(nLevels());
+    if(mpThreadPool)
+        mpThreadPool->ParallelFor(nLevels(), [&](int level)
+                {ComputeLevel(level, allKeypoints[level], mvLevelDescriptors[level]);});
+    else
+        for (int level = 0; level < nLevels(); ++level)
+            ComputeLevel(level, allKeypoints[level], mvLevelDescriptors[level]);
 
     Mat descriptors;
 
@@ -1185,13 +1168,8 @@ void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPo
         if(nkeypointsLevel==0)
             continue;
 
-        // preprocess the resized image
-        Mat workingMat = mvImagePyramid[level].clone();
-        GaussianBlur(workingMat, workingMat, Size(7, 7), 2, 2, BORDER_REFLECT_101);
-
-        // Compute the descriptors
         Mat desc = descriptors.rowRange(offset, offset + nkeypointsLevel);
-        computeDescriptors(workingMat, keypoints, desc, pattern);
+        mvLevelDescriptors[level].copyTo(desc);
 
         offset += nkeypointsLevel;
 
@@ -1209,6 +1187,14 @@ void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPo
 
     DLOG_IF(INFO, mVisualizationActive) << _keypoints.size() << " features extracted.";
 
+    // the pyramids the frames hold included
+    size_t nBufferBytes = 0;
+    for (size_t i = 0; i < mvpPyramids.size(); ++i)
+        nBufferBytes += mvpPyramids[i]->GetMemoryUsage();
+    for (size_t level = 0; level < mvLevelDescriptors.size(); ++level)
+        nBufferBytes += mvLevelDescriptors[level].total()*mvLevelDescriptors[level].elemSize();
+    mnBufferBytes.store(nBufferBytes, std::memory_order_relaxed);
+
     if(mVisualizationActive)
     {
         // convert to color for drawing
@@ -1221,14 +1207,95 @@ void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPo
     }
 }
 
+void ORBextractor::SetFeatureBudget(const int nfeatures, const int iniThFast, const int minThFast, const int nlevels)
+{
+    // the thresholds are read at the start of every extraction
+    if(iniThFast!=iniThFAST())
+        iniThFAST.setValue(iniThFast);
+    if(minThFast!=minThFAST())
+        minThFAST.setValue(minThFast);
+
+    if(nfeatures!=nFeatures() || nlevels!=nLevels())
+    {
+        nFeatures.setValue(nfeatures);
+        nLevels.setValue(nlevels);
+        UpdateParameters();
+    }
+}
+
+void ORBextractor::SetExclusionMask(const vector<vector<cv::Point> >& vPolygons, const Mat& mask)
+{
+    mvExcludedPolygons = vPolygons;
+    if(mask.empty())
+        mExclusionMask.release();
+    else
+    {
+        Mat gray = mask;
+        if(mask.channels()==3)
+            cvtColor(mask,gray,CV_BGR2GRAY);
+        else if(mask.channels()==4)
+            cvtColor(mask,gray,CV_BGRA2GRAY);
+        mExclusionMask = gray!=0;
+    }
+    mbLayoutsValid = false;
+}
+
+void ORBextractor::SetRemap(const Mat& map1, const Mat& map2)
+{
+    mRemapMap1 = map1;
+    mRemapMap2 = map2;
+    mbLayoutsValid = false;
+}
+
+bool ORBextractor::ReadExclusionMask(const Settings& fSettings, vector<vector<cv::Point> >& vPolygons,
+                                     Mat& mask)
+{
+    vPolygons.clear();
+    const Settings::Node &polygonsNode = fSettings["ORBextractor.ExcludedPolygons"];
+    for(vector<Settings::Node>::const_iterator it = polygonsNode.begin(); it != polygonsNode.end(); it++)
+    {
+        vector<int> vCoords;
+        for(vector<Settings::Node>::const_iterator it2 = (*it).begin(); it2 != (*it).end(); it2++)
+            vCoords.push_back(static_cast<int>(*it2));
+        if(vCoords.size()<6 || vCoords.size()%2)
+        {
+            cerr << "Ignoring excluded polygon with " << vCoords.size() << " coordinates" << endl;
+            continue;
+        }
+
+        vector<cv::Point> vPolygon(vCoords.size()/2);
+        for(size_t i=0; i<vPolygon.size(); i++)
+            vPolygon[i] = cv::Point(vCoords[2*i],vCoords[2*i+1]);
+        vPolygons.push_back(vPolygon);
+    }
+
+    mask.release();
+    const Settings::Node &maskNode = fSettings["ORBextractor.ExclusionMask"];
+    if(maskNode.isString())
+    {
+        const string strMask = (string)maskNode;
+        if(!strMask.empty())
+        {
+            mask = cv::imread(strMask,CV_LOAD_IMAGE_GRAYSCALE);
+            if(mask.empty())
+            {
+                cerr << "Failed to read the exclusion mask " << strMask << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 void ORBextractor::UpdateParameters()
 {
+    mbLayoutsValid = false;
     mvScaleFactor.clear();
     mvLevelSigma2.clear();
     mvInvScaleFactor.clear();
     mvInvLevelSigma2.clear();
-    mvImagePyramid.clear();
     mnFeaturesPerLevel.clear();
+    pattern.clear();
     umax.clear();
 
     mvScaleFactor.resize(nLevels());
@@ -1250,6 +1317,7 @@ void ORBextractor::UpdateParameters()
     }
 
     mvImagePyramid.resize(nLevels());
+    mvLevelDescriptors.resize(nLevels());
 
     mnFeaturesPerLevel.resize(nLevels());
     float factor = 1.0f / scaleFactor();
@@ -1286,19 +1354,64 @@ void ORBextractor::UpdateParameters()
         umax[v] = v0;
         ++v0;
     }
+
+    UpdateRotatedPatterns();
+}
+
+void ORBextractor::UpdateThreadPool()
+{
+    const int nWorkers = nThreads()-1;
+
+    if(nWorkers<=0)
+    {
+        delete mpThreadPool;
+        mpThreadPool = NULL;
+    }
+    else if(mpThreadPool)
+        mpThreadPool->Resize(nWorkers);
+    else
+        mpThreadPool = new ThreadPool(nWorkers,ThreadConfig::EXTRACTION_WORKERS);
 }
 
 void ORBextractor::ComputePyramid(cv::Mat image)
 {
     DLOG_IF(INFO, mVisualizationActive) << "Creating image pyramid with: "
             << nLevels() << " levels and scaleFactor = " << scaleFactor();
+
+    UpdateLayouts(Remaps() ? mRemapMap1.size() : image.size());
+
+    // a pyramid a frame still holds is not written over, the one of the last image is usually
+    // free again unless the frames keep their pyramids
+    mpPyramid.reset();
+    for (size_t i = 0; i < mvpPyramids.size() && !mpPyramid; ++i)
+        if (mvpPyramids[i].use_count() == 1)
+            mpPyramid = mvpPyramids[i];
+    if (!mpPyramid)
+    {
+        mpPyramid = make_shared<ImagePyramid>();
+        if (mvpPyramids.size() < MAX_PYRAMIDS)
+            mvpPyramids.push_back(mpPyramid);
+        else
+        {
+            // the one replaced is freed by the last frame holding it
+            mvpPyramids[mnNextPyramid] = mpPyramid;
+            mnNextPyramid = (mnNextPyramid + 1) % MAX_PYRAMIDS;
+        }
+    }
+
+    // reuses the buffers of an earlier frame, only allocates if the size changed
+    vector<Size> vSizes(nLevels());
+    for (int level = 0; level < nLevels(); ++level)
+        vSizes[level] = mvLevelLayouts[level].size;
+    mpPyramid->Allocate(vSizes, image.type(), EDGE_THRESHOLD);
+
+    // with a worker pool the blur is done per level in parallel instead
+    const bool bFused = fusedPyramid() && !mpThreadPool;
     for (int level = 0; level < nLevels(); ++level)
     {
-        float scale = mvInvScaleFactor[level];
-        Size sz(cvRound((float)image.cols*scale), cvRound((float)image.rows*scale));
-        Size wholeSize(sz.width + EDGE_THRESHOLD*2, sz.height + EDGE_THRESHOLD*2);
-        Mat temp(wholeSize, image.type()), masktemp;
-        mvImagePyramid[level] = temp(Rect(EDGE_THRESHOLD, EDGE_THRESHOLD, sz.width, sz.height));
+        const Size& sz = vSizes[level];
+        Mat& temp = mpPyramid->GetBuffer(level);
+        mvImagePyramid[level] = mpPyramid->GetLevel(level);
 
         // Compute the resized image
         if( level != 0 )
@@ -1308,11 +1421,23 @@ void ORBextractor::ComputePyramid(cv::Mat image)
             copyMakeBorder(mvImagePyramid[level], temp, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD,
                            BORDER_REFLECT_101+BORDER_ISOLATED);
         }
+        else if(Remaps())
+        {
+            // remapped into the inside of the buffer, the border is filled around it as for the
+            // other levels
+            remap(image, mvImagePyramid[level], mRemapMap1, mRemapMap2, INTER_LINEAR, BORDER_CONSTANT);
+
+            copyMakeBorder(mvImagePyramid[level], temp, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD,
+                           BORDER_REFLECT_101+BORDER_ISOLATED);
+        }
         else
         {
             copyMakeBorder(image, temp, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD,
                            BORDER_REFLECT_101);
         }
+
+        if(bFused)
+            mpPyramid->Blur(level);
     }
 
 }
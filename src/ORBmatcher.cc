@@ -26,6 +26,10 @@
 #include<opencv2/features2d/features2d.hpp>
 
 #include "Thirdparty/DBoW2/DBoW2/FeatureVector.h"
+#include "Converter.h"
+#include "HammingDistance.h"
+#include "RotationHistogram.h"
+#include "WorkCounters.h"
 
 #include<stdint-gcc.h>
 
@@ -36,7 +40,7 @@ namespace ORB_SLAM2
 
 const int ORBmatcher::TH_HIGH = 100; //param //descriptor distance for when a match is accepted as such
 const int ORBmatcher::TH_LOW = 50; //param //descriptor distance for when a match is accepted as such
-const int ORBmatcher::HISTO_LENGTH = 30; //param
+const int ORBmatcher::HISTO_LENGTH = RotationHistogram::HISTO_LENGTH;
 
 //TODO : This really shouldn't be a class, there is no point that an object of this is created
 // evereywhere we want to use one of it's functions, simply use static functions
@@ -45,36 +49,40 @@ ORBmatcher::ORBmatcher(float nnratio, bool checkOri): mfNNratio(nnratio), mbChec
 }
 
 
-int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoints, const float th)
+int ORBmatcher::SearchByProjection(Frame &F, const float th)
 {
+    MATCHER_COUNTER(PROJECTION_LOCAL_MAP);
     int nmatches=0;
 
     const bool bFactor = th!=1.0;
 
-    for(size_t iMP=0; iMP<vpMapPoints.size(); iMP++)
-    {
-        MapPoint* pMP = vpMapPoints[iMP];
-        if(!pMP->mbTrackInView)
-            continue;
+    vector<size_t> vIndices;
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
+    cv::Mat MPdescriptor; // reused for every MapPoint, GetDescriptor only allocates it once
 
+    const Frame::ProjectionCache &projections = F.mProjections;
+    for(size_t iMP=0; iMP<projections.Size(); iMP++)
+    {
+        MapPoint* pMP = projections.vpMapPoints[iMP];
         if(pMP->isBad())
             continue;
 
-        const int &nPredictedLevel = pMP->mnTrackScaleLevel;
+        const int nPredictedLevel = projections.vnLevel[iMP];
 
         // The size of the window will depend on the viewing direction
-        float r = RadiusByViewingCos(pMP->mTrackViewCos);
+        float r = RadiusByViewingCos(projections.vViewCos[iMP]);
 
         if(bFactor)
             r*=th;
 
-        const vector<size_t> vIndices =
-                F.GetFeaturesInArea(pMP->mTrackProjX,pMP->mTrackProjY,r*F.mvScaleFactors[nPredictedLevel],nPredictedLevel-1,nPredictedLevel);
+        F.GetFeaturesInArea(projections.vu[iMP],projections.vv[iMP],r*F.mvScaleFactors[nPredictedLevel],nPredictedLevel-1,
+                            nPredictedLevel,vIndices);
 
         if(vIndices.empty())
             continue;
 
-        const cv::Mat MPdescriptor = pMP->GetDescriptor();
+        pMP->GetDescriptor(MPdescriptor);
 
         int bestDist=256;
         int bestLevel= -1;
@@ -82,7 +90,8 @@ int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoint
         int bestLevel2 = -1;
         int bestIdx =-1 ;
 
-        // Get best and second matches with near keypoints
+        MATCHER_COUNT(nCandidates,vIndices.size());
+        vCandidates.clear();
         for(vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++)
         {
             const size_t idx = *vit;
@@ -93,14 +102,22 @@ int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoint
 
             if(F.mvuRight[idx]>0)
             {
-                const float er = fabs(pMP->mTrackProjXR-F.mvuRight[idx]);
+                const float er = fabs(projections.vuRight[iMP]-F.mvuRight[idx]);
                 if(er>r*F.mvScaleFactors[nPredictedLevel])
                     continue;
             }
 
-            const cv::Mat &d = F.mDescriptors.row(idx);
+            vCandidates.push_back(idx);
+        }
+
+        DescriptorDistances(MPdescriptor,F.mDescriptors,vCandidates,vDistances);
 
-            const int dist = DescriptorDistance(MPdescriptor,d);
+        // Get best and second matches with near keypoints
+        for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+        {
+            const size_t idx = vCandidates[ic];
+
+            const int dist = vDistances[ic];
 
             if(dist<bestDist)
             {
@@ -128,6 +145,7 @@ int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoint
         }
     }
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
@@ -140,82 +158,91 @@ float ORBmatcher::RadiusByViewingCos(const float &viewCos)
 }
 
 
-bool ORBmatcher::CheckDistEpipolarLine(const cv::KeyPoint &kp1,const cv::KeyPoint &kp2,const cv::Mat &F12,const KeyFrame* pKF2)
+int ORBmatcher::SearchByBoW(KeyFrame* pKF,Frame &F, vector<MapPoint*> &vpMapPointMatches)
 {
-    // Epipolar line in second image l = x1'F12 = [a b c]
-    const float a = kp1.pt.x*F12.at<float>(0,0)+kp1.pt.y*F12.at<float>(1,0)+F12.at<float>(2,0);
-    const float b = kp1.pt.x*F12.at<float>(0,1)+kp1.pt.y*F12.at<float>(1,1)+F12.at<float>(2,1);
-    const float c = kp1.pt.x*F12.at<float>(0,2)+kp1.pt.y*F12.at<float>(1,2)+F12.at<float>(2,2);
-
-    const float num = a*kp2.pt.x+b*kp2.pt.y+c;
-
-    const float den = a*a+b*b;
-
-    if(den==0)
-        return false;
-
-    const float dsqr = num*num/den;
-
-    return dsqr<3.84*pKF2->mvLevelSigma2[kp2.octave];
+    const KeyFrame::BowMatchIndexPtr pIndex = pKF->GetBowMatchIndex();
+    return SearchByBoW(pKF,*pIndex,F,vpMapPointMatches,static_cast<const int*>(NULL));
 }
 
-int ORBmatcher::SearchByBoW(KeyFrame* pKF,Frame &F, vector<MapPoint*> &vpMapPointMatches)
+int ORBmatcher::SearchByBoW(const BowDistanceBatch &batch, const size_t i, KeyFrame *pKF, Frame &F,
+                            vector<MapPoint*> &vpMapPointMatches)
 {
-    const vector<MapPoint*> vpMapPointsKF = pKF->GetMapPointMatches();
+    if(!batch.GetIndex(i))
+    {
+        vpMapPointMatches.assign(F.N,static_cast<MapPoint*>(NULL));
+        return 0;
+    }
+    return SearchByBoW(pKF,*batch.GetIndex(i),F,vpMapPointMatches,batch.GetDistances(i));
+}
 
-    vpMapPointMatches = vector<MapPoint*>(F.N,static_cast<MapPoint*>(NULL));
+int ORBmatcher::SearchByBoW(KeyFrame* pKF, const BowMatchIndex &index, Frame &F, vector<MapPoint*> &vpMapPointMatches,
+                            const int* pDistances)
+{
+    MATCHER_COUNTER(BOW_FRAME);
+    const KeyFrame::Features features = pKF->GetFeatures();
 
-    const DBoW2::FeatureVector &vFeatVecKF = pKF->mFeatVec;
+    vpMapPointMatches.assign(F.N,static_cast<MapPoint*>(NULL));
 
     int nmatches=0;
 
-    vector<int> rotHist[HISTO_LENGTH];
-    for(int i=0;i<HISTO_LENGTH;i++)
-        rotHist[i].reserve(500);
-    const float factor = 1.0f/HISTO_LENGTH;
+    RotationHistogram &rotHist = RotationHistogram::Local();
 
-    // We perform the matching over ORB that belong to the same vocabulary node (at a certain level)
-    DBoW2::FeatureVector::const_iterator KFit = vFeatVecKF.begin();
+    // We perform the matching over ORB that belong to the same vocabulary node (at a certain level).
+    // Only the features of the keyframe with a MapPoint are in the index.
+    vector<BowMatchIndex::Node>::const_iterator KFit = index.mvNodes.begin();
     DBoW2::FeatureVector::const_iterator Fit = F.mFeatVec.begin();
-    DBoW2::FeatureVector::const_iterator KFend = vFeatVecKF.end();
+    vector<BowMatchIndex::Node>::const_iterator KFend = index.mvNodes.end();
     DBoW2::FeatureVector::const_iterator Fend = F.mFeatVec.end();
 
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
+
     while(KFit != KFend && Fit != Fend)
     {
         //check if the nodeID is the same
-        if(KFit->first == Fit->first)
+        if(KFit->id == Fit->first)
         {
-            const vector<unsigned int> vIndicesKF = KFit->second;
-            const vector<unsigned int> vIndicesF = Fit->second;
+            const vector<unsigned int> &vIndicesF = Fit->second;
+            const size_t nF = vIndicesF.size();
 
-            for(size_t iKF=0; iKF<vIndicesKF.size(); iKF++)
+            for(size_t i=KFit->begin; i<KFit->end; i++)
             {
-                const unsigned int realIdxKF = vIndicesKF[iKF];
-
-                MapPoint* pMP = vpMapPointsKF[realIdxKF];
-
-                if(!pMP)
-                    continue;
+                MapPoint* pMP = index.mvpMapPoints[i];
 
                 if(pMP->isBad())
                     continue;
 
-                const cv::Mat &dKF= pKF->mDescriptors.row(realIdxKF);
+                const size_t realIdxKF = index.mvnFeatures[i];
 
                 int bestDist1=256;
                 int bestIdxF =-1 ;
                 int bestDist2=256;
 
-                for(size_t iF=0; iF<vIndicesF.size(); iF++)
+                MATCHER_COUNT(nCandidates,vIndicesF.size());
+                vCandidates.clear();
+                if(pDistances)
+                    vDistances.clear();
+                for(size_t iF=0; iF<nF; iF++)
                 {
                     const unsigned int realIdxF = vIndicesF[iF];
 
                     if(vpMapPointMatches[realIdxF])
                         continue;
 
-                    const cv::Mat &dF = F.mDescriptors.row(realIdxF);
+                    vCandidates.push_back(realIdxF);
+                    if(pDistances)
+                        vDistances.push_back(pDistances[(i-KFit->begin)*nF+iF]);
+                }
+
+                if(!pDistances)
+                    DescriptorDistances(index.Descriptor(i),F.mDescriptors.ptr<uint8_t>(),F.mDescriptors.step[0],
+                                        vCandidates,vDistances);
+
+                for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+                {
+                    const unsigned int realIdxF = vCandidates[ic];
 
-                    const int dist =  DescriptorDistance(dKF,dF);
+                    const int dist = vDistances[ic];
 
                     if(dist<bestDist1)
                     {
@@ -235,18 +262,11 @@ int ORBmatcher::SearchByBoW(KeyFrame* pKF,Frame &F, vector<MapPoint*> &vpMapPoin
                     {
                         vpMapPointMatches[bestIdxF]=pMP;
 
-                        const cv::KeyPoint &kp = pKF->mvKeysUn[realIdxKF];
+                        const cv::KeyPoint &kp = features.vKeysUn[realIdxKF];
 
                         if(mbCheckOrientation)
                         {
-                            float rot = kp.angle-F.mvKeys[bestIdxF].angle;
-                            if(rot<0.0)
-                                rot+=360.0f;
-                            int bin = round(rot*factor);
-                            if(bin==HISTO_LENGTH)
-                                bin=0;
-                            assert(bin>=0 && bin<HISTO_LENGTH);
-                            rotHist[bin].push_back(bestIdxF);
+                            rotHist.Add(kp.angle,F.mvKeys[bestIdxF].angle,bestIdxF);
                         }
                         nmatches++;
                     }
@@ -254,144 +274,174 @@ int ORBmatcher::SearchByBoW(KeyFrame* pKF,Frame &F, vector<MapPoint*> &vpMapPoin
 
             }
 
+            if(pDistances)
+                pDistances += (KFit->end-KFit->begin)*nF;
             KFit++;
             Fit++;
         }
-        else if(KFit->first < Fit->first)
+        else if(KFit->id < Fit->first)
         {
-            KFit = vFeatVecKF.lower_bound(Fit->first);
+            KFit = index.LowerBound(KFit,Fit->first);
         }
         else
         {
-            Fit = F.mFeatVec.lower_bound(KFit->first);
+            Fit = F.mFeatVec.lower_bound(KFit->id);
         }
     }
 
 
     if(mbCheckOrientation)
     {
-        int ind1=-1;
-        int ind2=-1;
-        int ind3=-1;
-
-        ComputeThreeMaxima(rotHist,HISTO_LENGTH,ind1,ind2,ind3);
-
-        for(int i=0; i<HISTO_LENGTH; i++)
+        const vector<int> &vRejected = rotHist.ComputeRejected();
+        MATCHER_COUNT(nRotationRejected,vRejected.size());
+        for(size_t j=0, jend=vRejected.size(); j<jend; j++)
         {
-            if(i==ind1 || i==ind2 || i==ind3)
-                continue;
-            for(size_t j=0, jend=rotHist[i].size(); j<jend; j++)
-            {
-                vpMapPointMatches[rotHist[i][j]]=static_cast<MapPoint*>(NULL);
-                nmatches--;
-            }
+            vpMapPointMatches[vRejected[j]]=static_cast<MapPoint*>(NULL);
+            nmatches--;
         }
     }
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
-int ORBmatcher::SearchByProjection(KeyFrame* pKF, cv::Mat Scw, const vector<MapPoint*> &vpPoints, vector<MapPoint*> &vpMatched, int th)
+namespace
 {
-    // Get Calibration Parameters for later projection
-    const float &fx = pKF->fx;
-    const float &fy = pKF->fy;
-    const float &cx = pKF->cx;
-    const float &cy = pKF->cy;
-
-    // Decompose Scw
-    cv::Mat sRcw = Scw.rowRange(0,3).colRange(0,3);
-    const float scw = sqrt(sRcw.row(0).dot(sRcw.row(0)));
-    cv::Mat Rcw = sRcw/scw;
-    cv::Mat tcw = Scw.rowRange(0,3).col(3)/scw;
-    cv::Mat Ow = -Rcw.t()*tcw;
 
-    // Set of MapPoints already found in the KeyFrame
-    set<MapPoint*> spAlreadyFound(vpMatched.begin(), vpMatched.end());
-    spAlreadyFound.erase(static_cast<MapPoint*>(NULL));
+// Camera of the keyframe with the similarity Scw, the scale taken out. The points have to fall
+// in the image, in their scale invariance region and be seen under less than 60 deg.
+void SetSim3Camera(KeyFrame* pKF, const cv::Mat &Scw, PointProjection::Camera &camera)
+{
+    const Eigen::Matrix3f sRcw = Converter::toMatrix3f(Scw.rowRange(0,3).colRange(0,3));
+    const float scw = sRcw.row(0).norm();
+    camera.SetImage(pKF);
+    camera.R = sRcw/scw;
+    camera.t = Eigen::Vector3f(Scw.at<float>(0,3),Scw.at<float>(1,3),Scw.at<float>(2,3))/scw;
+    camera.fMinViewCos = 0.5f;
+}
 
-    int nmatches=0;
+// Scale level predicted for a point seen at dist, as MapPoint::PredictScale from the copied
+// maximum distance (1.2 times the one of the point)
+int PredictScale(const float maxDistance, const float dist, KeyFrame* pKF)
+{
+    int nScale = ceil(log(maxDistance/(1.2f*dist))/pKF->mfLogScaleFactor);
+    if(nScale<0)
+        nScale = 0;
+    else if(nScale>=pKF->mnScaleLevels)
+        nScale = pKF->mnScaleLevels-1;
+    return nScale;
+}
 
-    // For each Candidate MapPoint Project and Match
-    for(int iMP=0, iendMP=vpPoints.size(); iMP<iendMP; iMP++)
-    {
-        MapPoint* pMP = vpPoints[iMP];
+} // namespace
 
-        // Discard Bad MapPoints and already found
-        if(pMP->isBad() || spAlreadyFound.count(pMP))
-            continue;
+void ORBmatcher::ProjectionPoints::Set(const vector<MapPoint*> &vpPoints)
+{
+    Clear();
+    Reserve(vpPoints.size());
 
-        // Get 3D Coords.
-        cv::Mat p3Dw = pMP->GetWorldPos();
+    const int N = vpPoints.size();
+    mDescriptors.create(N,32,CV_8U);
 
-        // Transform into Camera Coords.
-        cv::Mat p3Dc = Rcw*p3Dw+tcw;
+    Eigen::Vector3f P, Pn;
+    float minDistance, maxDistance;
+    for(int i=0; i<N; i++)
+    {
+        MapPoint* pMP = vpPoints[i];
+        cv::Mat row = mDescriptors.row(i);
+        if(pMP->isBad())
+        {
+            P.setZero();
+            Pn.setZero();
+            minDistance = 1.0f;
+            maxDistance = -1.0f;
+            row.setTo(0);
+        }
+        else
+        {
+            pMP->GetViewingGeometry(P,Pn,minDistance,maxDistance);
+            pMP->GetDescriptor(row);
+        }
+        Add(pMP,P,Pn,minDistance,maxDistance);
+    }
+}
 
-        // Depth must be positive
-        if(p3Dc.at<float>(2)<0.0)
-            continue;
+int ORBmatcher::SearchByProjection(KeyFrame* pKF, cv::Mat Scw, const vector<MapPoint*> &vpPoints, vector<MapPoint*> &vpMatched, int th)
+{
+    ProjectionPoints points;
+    points.Set(vpPoints);
+    return SearchByProjection(pKF,Scw,points,vpMatched,th);
+}
 
-        // Project into Image
-        const float invz = 1/p3Dc.at<float>(2);
-        const float x = p3Dc.at<float>(0)*invz;
-        const float y = p3Dc.at<float>(1)*invz;
+int ORBmatcher::SearchByProjection(KeyFrame* pKF, cv::Mat Scw, const ProjectionPoints &points, vector<MapPoint*> &vpMatched, int th)
+{
+    MATCHER_COUNTER(PROJECTION_SIM3);
+    const KeyFrame::Features features = pKF->GetFeatures();
 
-        const float u = fx*x+cx;
-        const float v = fy*y+cy;
+    // Set of MapPoints already found in the KeyFrame
+    set<MapPoint*> spAlreadyFound(vpMatched.begin(), vpMatched.end());
+    spAlreadyFound.erase(static_cast<MapPoint*>(NULL));
 
-        // Point must be inside the image
-        if(!pKF->IsInImage(u,v))
-            continue;
+    PointProjection::Camera camera;
+    SetSim3Camera(pKF,Scw,camera);
+    static thread_local PointProjection::Visible visible;
+    PointProjection::Project(points,camera,visible);
 
-        // Depth must be inside the scale invariance region of the point
-        const float maxDistance = pMP->GetMaxDistanceInvariance();
-        const float minDistance = pMP->GetMinDistanceInvariance();
-        cv::Mat PO = p3Dw-Ow;
-        const float dist = cv::norm(PO);
+    int nmatches=0;
 
-        if(dist<minDistance || dist>maxDistance)
-            continue;
+    vector<size_t> vIndices;
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
 
-        // Viewing angle must be less than 60 deg
-        cv::Mat Pn = pMP->GetNormal();
+    // For each projected Candidate MapPoint Match
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
+    {
+        const int iMP = visible.vnIndex[j];
+        MapPoint* pMP = points.mvpMapPoints[iMP];
 
-        if(PO.dot(Pn)<0.5*dist)
+        // Discard Bad MapPoints and already found
+        if(pMP->isBad() || spAlreadyFound.count(pMP))
             continue;
 
-        int nPredictedLevel = pMP->PredictScale(dist,pKF);
+        int nPredictedLevel = PredictScale(points.mvMaxDistance[iMP],visible.vDist[j],pKF);
 
         // Search in a radius
         const float radius = th*pKF->mvScaleFactors[nPredictedLevel];
 
-        const vector<size_t> vIndices = pKF->GetFeaturesInArea(u,v,radius);
+        pKF->GetFeaturesInArea(visible.vu[j],visible.vv[j],radius,features.vKeysUn,vIndices);
 
         if(vIndices.empty())
             continue;
 
         // Match to the most similar keypoint in the radius
-        const cv::Mat dMP = pMP->GetDescriptor();
+        const cv::Mat dMP = points.mDescriptors.row(iMP);
 
         int bestDist = 256;
         int bestIdx = -1;
+
+        MATCHER_COUNT(nCandidates,vIndices.size());
+        vCandidates.clear();
         for(vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++)
         {
             const size_t idx = *vit;
             if(vpMatched[idx])
                 continue;
 
-            const int &kpLevel= pKF->mvKeysUn[idx].octave;
+            const int &kpLevel= features.vKeysUn[idx].octave;
 
             if(kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
                 continue;
 
-            const cv::Mat &dKF = pKF->mDescriptors.row(idx);
+            vCandidates.push_back(idx);
+        }
 
-            const int dist = DescriptorDistance(dMP,dKF);
+        DescriptorDistances(dMP,pKF->mDescriptors,vCandidates,vDistances);
 
-            if(dist<bestDist)
+        for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+        {
+            if(vDistances[ic]<bestDist)
             {
-                bestDist = dist;
-                bestIdx = idx;
+                bestDist = vDistances[ic];
+                bestIdx = vCandidates[ic];
             }
         }
 
@@ -403,22 +453,21 @@ int ORBmatcher::SearchByProjection(KeyFrame* pKF, cv::Mat Scw, const vector<MapP
 
     }
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
 int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f> &vbPrevMatched, vector<int> &vnMatches12, int windowSize)
 {
+    MATCHER_COUNTER(INITIALIZATION);
     int nmatches=0;
     vnMatches12 = vector<int>(F1.mvKeysUn.size(),-1);
 
-    //HISTO_LENGTH = 30
-    vector<int> rotHist[HISTO_LENGTH];
-    for(int i=0;i<HISTO_LENGTH;i++)
-        rotHist[i].reserve(500);
-    const float factor = 1.0f/HISTO_LENGTH;
+    RotationHistogram &rotHist = RotationHistogram::Local();
 
     vector<int> vMatchedDistance(F2.mvKeysUn.size(),INT_MAX);
     vector<int> vnMatches21(F2.mvKeysUn.size(),-1);
+    vector<size_t> vIndices2;
 
     for(size_t i1=0, iend1=F1.mvKeysUn.size(); i1<iend1; i1++)
     {
@@ -428,7 +477,8 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
             continue;
 
         // look for features in an area around keypoint from initial frame
-        vector<size_t> vIndices2 = F2.GetFeaturesInArea(vbPrevMatched[i1].x,vbPrevMatched[i1].y, windowSize,level1,level1);
+        F2.GetFeaturesInArea(vbPrevMatched[i1].x,vbPrevMatched[i1].y,windowSize,level1,level1,vIndices2);
+        MATCHER_COUNT(nCandidates,vIndices2.size());
 
         // if no features around vbPrevMatched[i1] in new image then look for next feature
         if(vIndices2.empty())
@@ -482,17 +532,7 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
 
                 if(mbCheckOrientation)
                 {
-                    // calculate rotation between the two distance matched points
-                    float rot = F1.mvKeysUn[i1].angle-F2.mvKeysUn[bestIdx2].angle;
-                    if(rot<0.0)
-                        rot+=360.0f;
-                    // sort the rotations into histogram bins according to their size
-                    //TODO : Why is the HISTO_LENGTH 30 when there can only be 12 bins max?
-                    int bin = round(rot*factor);
-                    if(bin==HISTO_LENGTH)
-                        bin=0;
-                    assert(bin>=0 && bin<HISTO_LENGTH);
-                    rotHist[bin].push_back(i1);
+                    rotHist.Add(F1.mvKeysUn[i1].angle,F2.mvKeysUn[bestIdx2].angle,i1);
                 }
             }
         }
@@ -501,29 +541,18 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
 
     if(mbCheckOrientation)
     {
-        int ind1=-1;
-        int ind2=-1;
-        int ind3=-1;
-
-        ComputeThreeMaxima(rotHist,HISTO_LENGTH,ind1,ind2,ind3);
-
-        for(int i=0; i<HISTO_LENGTH; i++)
+        const vector<int> &vRejected = rotHist.ComputeRejected();
+        MATCHER_COUNT(nRotationRejected,vRejected.size());
+        // check each match that deviates from the most common rotation values
+        for(size_t j=0, jend=vRejected.size(); j<jend; j++)
         {
-            // don't check maximas
-            if(i==ind1 || i==ind2 || i==ind3)
-                continue;
-
-            // check each match that deviates from the most common rotation values
-            for(size_t j=0, jend=rotHist[i].size(); j<jend; j++)
+            int idx1 = vRejected[j];
+            // if a match has a roation value which differs from the three most
+            // common rotations observed erase it from matches
+            if(vnMatches12[idx1]>=0)
             {
-                int idx1 = rotHist[i][j];
-                // if a match has a roation value which differs from the three most
-                // common rotations observed erase it from matches
-                if(vnMatches12[idx1]>=0)
-                {
-                    vnMatches12[idx1]=-1;
-                    nmatches--;
-                }
+                vnMatches12[idx1]=-1;
+                nmatches--;
             }
         }
 
@@ -534,78 +563,103 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
         if(vnMatches12[i1]>=0)
             vbPrevMatched[i1]=F2.mvKeysUn[vnMatches12[i1]].pt;
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
 int ORBmatcher::SearchByBoW(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &vpMatches12)
 {
-    const vector<cv::KeyPoint> &vKeysUn1 = pKF1->mvKeysUn;
-    const DBoW2::FeatureVector &vFeatVec1 = pKF1->mFeatVec;
-    const vector<MapPoint*> vpMapPoints1 = pKF1->GetMapPointMatches();
-    const cv::Mat &Descriptors1 = pKF1->mDescriptors;
+    const KeyFrame::BowMatchIndexPtr pIndex1 = pKF1->GetBowMatchIndex();
+    const KeyFrame::BowMatchIndexPtr pIndex2 = pKF2->GetBowMatchIndex();
+    return SearchByBoW(pKF1,*pIndex1,pKF2,*pIndex2,vpMatches12,static_cast<const int*>(NULL));
+}
 
-    const vector<cv::KeyPoint> &vKeysUn2 = pKF2->mvKeysUn;
-    const DBoW2::FeatureVector &vFeatVec2 = pKF2->mFeatVec;
-    const vector<MapPoint*> vpMapPoints2 = pKF2->GetMapPointMatches();
-    const cv::Mat &Descriptors2 = pKF2->mDescriptors;
+int ORBmatcher::SearchByBoW(const BowDistanceBatch &batch, const size_t i, KeyFrame *pKF1, KeyFrame *pKF2,
+                            vector<MapPoint *> &vpMatches12)
+{
+    if(!batch.GetIndex(i))
+    {
+        vpMatches12.assign(pKF1->N,static_cast<MapPoint*>(NULL));
+        return 0;
+    }
+    return SearchByBoW(pKF1,*batch.GetQueryIndex(),pKF2,*batch.GetIndex(i),vpMatches12,batch.GetDistances(i));
+}
 
-    vpMatches12 = vector<MapPoint*>(vpMapPoints1.size(),static_cast<MapPoint*>(NULL));
-    vector<bool> vbMatched2(vpMapPoints2.size(),false);
+int ORBmatcher::SearchByBoW(KeyFrame *pKF1, const BowMatchIndex &index1, KeyFrame *pKF2, const BowMatchIndex &index2,
+                            vector<MapPoint *> &vpMatches12, const int* pDistances)
+{
+    MATCHER_COUNTER(BOW_KEYFRAMES);
+    const SharedArray<cv::KeyPoint> vKeysUn1 = pKF1->GetFeatures().vKeysUn;
+    const SharedArray<cv::KeyPoint> vKeysUn2 = pKF2->GetFeatures().vKeysUn;
 
-    vector<int> rotHist[HISTO_LENGTH];
-    for(int i=0;i<HISTO_LENGTH;i++)
-        rotHist[i].reserve(500);
+    vpMatches12.assign(pKF1->N,static_cast<MapPoint*>(NULL));
+    // By entry of the index of pKF2
+    vector<bool> vbMatched2(index2.Size(),false);
 
-    const float factor = 1.0f/HISTO_LENGTH;
+    RotationHistogram &rotHist = RotationHistogram::Local();
 
     int nmatches = 0;
 
-    DBoW2::FeatureVector::const_iterator f1it = vFeatVec1.begin();
-    DBoW2::FeatureVector::const_iterator f2it = vFeatVec2.begin();
-    DBoW2::FeatureVector::const_iterator f1end = vFeatVec1.end();
-    DBoW2::FeatureVector::const_iterator f2end = vFeatVec2.end();
+    vector<BowMatchIndex::Node>::const_iterator f1it = index1.mvNodes.begin();
+    vector<BowMatchIndex::Node>::const_iterator f2it = index2.mvNodes.begin();
+    vector<BowMatchIndex::Node>::const_iterator f1end = index1.mvNodes.end();
+    vector<BowMatchIndex::Node>::const_iterator f2end = index2.mvNodes.end();
+
+    // Good entries of the node of pKF2, the entries are the rows of its packed descriptors
+    vector<size_t> vNode2;
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
 
     while(f1it != f1end && f2it != f2end)
     {
-        if(f1it->first == f2it->first)
+        if(f1it->id == f2it->id)
         {
-            for(size_t i1=0, iend1=f1it->second.size(); i1<iend1; i1++)
-            {
-                const size_t idx1 = f1it->second[i1];
+            const size_t n2 = f2it->end-f2it->begin;
+            vNode2.clear();
+            for(size_t i2=f2it->begin; i2<f2it->end; i2++)
+                if(!index2.mvpMapPoints[i2]->isBad())
+                    vNode2.push_back(i2);
 
-                MapPoint* pMP1 = vpMapPoints1[idx1];
-                if(!pMP1)
-                    continue;
+            for(size_t i1=f1it->begin; i1<f1it->end && !vNode2.empty(); i1++)
+            {
+                MapPoint* pMP1 = index1.mvpMapPoints[i1];
                 if(pMP1->isBad())
                     continue;
 
-                const cv::Mat &d1 = Descriptors1.row(idx1);
+                const size_t idx1 = index1.mvnFeatures[i1];
 
                 int bestDist1=256;
                 int bestIdx2 =-1 ;
                 int bestDist2=256;
 
-                for(size_t i2=0, iend2=f2it->second.size(); i2<iend2; i2++)
+                MATCHER_COUNT(nCandidates,f2it->end-f2it->begin);
+                vCandidates.clear();
+                if(pDistances)
+                    vDistances.clear();
+                for(size_t j=0, jend=vNode2.size(); j<jend; j++)
                 {
-                    const size_t idx2 = f2it->second[i2];
-
-                    MapPoint* pMP2 = vpMapPoints2[idx2];
-
-                    if(vbMatched2[idx2] || !pMP2)
+                    if(vbMatched2[vNode2[j]])
                         continue;
+                    vCandidates.push_back(vNode2[j]);
+                    if(pDistances)
+                        vDistances.push_back(pDistances[(i1-f1it->begin)*n2+(vNode2[j]-f2it->begin)]);
+                }
 
-                    if(pMP2->isBad())
-                        continue;
+                if(!pDistances)
+                    DescriptorDistances(index1.Descriptor(i1),index2.Descriptor(0),BowMatchIndex::DESCRIPTOR_BYTES,
+                                        vCandidates,vDistances);
 
-                    const cv::Mat &d2 = Descriptors2.row(idx2);
+                for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+                {
+                    const size_t i2 = vCandidates[ic];
 
-                    int dist = DescriptorDistance(d1,d2);
+                    int dist = vDistances[ic];
 
                     if(dist<bestDist1)
                     {
                         bestDist2=bestDist1;
                         bestDist1=dist;
-                        bestIdx2=idx2;
+                        bestIdx2=i2;
                     }
                     else if(dist<bestDist2)
                     {
@@ -617,64 +671,54 @@ int ORBmatcher::SearchByBoW(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
                 {
                     if(static_cast<float>(bestDist1)<mfNNratio*static_cast<float>(bestDist2))
                     {
-                        vpMatches12[idx1]=vpMapPoints2[bestIdx2];
+                        vpMatches12[idx1]=index2.mvpMapPoints[bestIdx2];
                         vbMatched2[bestIdx2]=true;
 
                         if(mbCheckOrientation)
                         {
-                            float rot = vKeysUn1[idx1].angle-vKeysUn2[bestIdx2].angle;
-                            if(rot<0.0)
-                                rot+=360.0f;
-                            int bin = round(rot*factor);
-                            if(bin==HISTO_LENGTH)
-                                bin=0;
-                            assert(bin>=0 && bin<HISTO_LENGTH);
-                            rotHist[bin].push_back(idx1);
+                            rotHist.Add(vKeysUn1[idx1].angle,vKeysUn2[index2.mvnFeatures[bestIdx2]].angle,idx1);
                         }
                         nmatches++;
                     }
                 }
             }
 
+            if(pDistances)
+                pDistances += (f1it->end-f1it->begin)*n2;
             f1it++;
             f2it++;
         }
-        else if(f1it->first < f2it->first)
+        else if(f1it->id < f2it->id)
         {
-            f1it = vFeatVec1.lower_bound(f2it->first);
+            f1it = index1.LowerBound(f1it,f2it->id);
         }
         else
         {
-            f2it = vFeatVec2.lower_bound(f1it->first);
+            f2it = index2.LowerBound(f2it,f1it->id);
         }
     }
 
     if(mbCheckOrientation)
     {
-        int ind1=-1;
-        int ind2=-1;
-        int ind3=-1;
-
-        ComputeThreeMaxima(rotHist,HISTO_LENGTH,ind1,ind2,ind3);
-
-        for(int i=0; i<HISTO_LENGTH; i++)
+        const vector<int> &vRejected = rotHist.ComputeRejected();
+        MATCHER_COUNT(nRotationRejected,vRejected.size());
+        for(size_t j=0, jend=vRejected.size(); j<jend; j++)
         {
-            if(i==ind1 || i==ind2 || i==ind3)
-                continue;
-            for(size_t j=0, jend=rotHist[i].size(); j<jend; j++)
-            {
-                vpMatches12[rotHist[i][j]]=static_cast<MapPoint*>(NULL);
-                nmatches--;
-            }
+            vpMatches12[vRejected[j]]=static_cast<MapPoint*>(NULL);
+            nmatches--;
         }
     }
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
 int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F12,
                                        vector<pair<size_t, size_t> > &vMatchedPairs, const bool bOnlyStereo)
 {
+    MATCHER_COUNTER(TRIANGULATION);
+    const KeyFrame::Features features1 = pKF1->GetFeatures();
+    const KeyFrame::Features features2 = pKF2->GetFeatures();
     const DBoW2::FeatureVector &vFeatVec1 = pKF1->mFeatVec;
     const DBoW2::FeatureVector &vFeatVec2 = pKF2->mFeatVec;
 
@@ -695,17 +739,26 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F
     vector<bool> vbMatched2(pKF2->N,false);
     vector<int> vMatches12(pKF1->N,-1);
 
-    vector<int> rotHist[HISTO_LENGTH];
-    for(int i=0;i<HISTO_LENGTH;i++)
-        rotHist[i].reserve(500);
+    RotationHistogram &rotHist = RotationHistogram::Local();
 
-    const float factor = 1.0f/HISTO_LENGTH;
+    // F12 row major, the epipolar line of a keypoint of pKF1 in pKF2 is x1'F12
+    float f[9];
+    for(int i=0; i<3; i++)
+        for(int j=0; j<3; j++)
+            f[3*i+j] = F12.at<float>(i,j);
 
     DBoW2::FeatureVector::const_iterator f1it = vFeatVec1.begin();
     DBoW2::FeatureVector::const_iterator f2it = vFeatVec2.begin();
     DBoW2::FeatureVector::const_iterator f1end = vFeatVec1.end();
     DBoW2::FeatureVector::const_iterator f2end = vFeatVec2.end();
 
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
+    // The candidates close enough in descriptor space, their geometry is checked in one pass
+    vector<size_t> vClose;
+    vector<float> vCloseX, vCloseY, vCloseSigma2, vCloseEpipole;
+    vector<unsigned char> vbCloseValid;
+
     while(f1it!=f1end && f2it!=f2end)
     {
         if(f1it->first == f2it->first)
@@ -720,19 +773,29 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F
                 if(pMP1)
                     continue;
 
-                const bool bStereo1 = pKF1->mvuRight[idx1]>=0;
+                const bool bStereo1 = features1.vuRight[idx1]>=0;
 
                 if(bOnlyStereo)
                     if(!bStereo1)
                         continue;
 
-                const cv::KeyPoint &kp1 = pKF1->mvKeysUn[idx1];
+                const cv::KeyPoint &kp1 = features1.vKeysUn[idx1];
 
                 const cv::Mat &d1 = pKF1->mDescriptors.row(idx1);
 
+                // Epipolar line in second image l = x1'F12 = [a b c], no match on a degenerate one
+                const float a = kp1.pt.x*f[0]+kp1.pt.y*f[3]+f[6];
+                const float b = kp1.pt.x*f[1]+kp1.pt.y*f[4]+f[7];
+                const float c = kp1.pt.x*f[2]+kp1.pt.y*f[5]+f[8];
+                const float den = a*a+b*b;
+                if(den==0)
+                    continue;
+
                 int bestDist = TH_LOW; //param
                 int bestIdx2 = -1;
 
+                MATCHER_COUNT(nCandidates,f2it->second.size());
+                vCandidates.clear();
                 for(size_t i2=0, iend2=f2it->second.size(); i2<iend2; i2++)
                 {
                     size_t idx2 = f2it->second[i2];
@@ -743,52 +806,68 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F
                     if(vbMatched2[idx2] || pMP2)
                         continue;
 
-                    const bool bStereo2 = pKF2->mvuRight[idx2]>=0;
-
                     if(bOnlyStereo)
-                        if(!bStereo2)
+                        if(features2.vuRight[idx2]<0)
                             continue;
 
-                    const cv::Mat &d2 = pKF2->mDescriptors.row(idx2);
+                    vCandidates.push_back(idx2);
+                }
 
-                    const int dist = DescriptorDistance(d1,d2);
+                DescriptorDistances(d1,pKF2->mDescriptors,vCandidates,vDistances);
 
-                    if(dist>TH_LOW || dist>bestDist)
+                vClose.clear();
+                vCloseX.clear();
+                vCloseY.clear();
+                vCloseSigma2.clear();
+                vCloseEpipole.clear();
+                for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+                {
+                    if(vDistances[ic]>TH_LOW)
                         continue;
 
-                    const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
+                    const size_t idx2 = vCandidates[ic];
+                    const cv::KeyPoint &kp2 = features2.vKeysUn[idx2];
+                    const bool bStereo2 = features2.vuRight[idx2]>=0;
+                    vClose.push_back(ic);
+                    vCloseX.push_back(kp2.pt.x);
+                    vCloseY.push_back(kp2.pt.y);
+                    vCloseSigma2.push_back(pKF2->mvLevelSigma2[kp2.octave]);
+                    // Two monocular keypoints must not lie next to the epipole, 0 never rejects
+                    vCloseEpipole.push_back(!bStereo1 && !bStereo2 ? 100*pKF2->mvScaleFactors[kp2.octave] : 0);
+                }
 
-                    if(!bStereo1 && !bStereo2)
-                    {
-                        const float distex = ex-kp2.pt.x;
-                        const float distey = ey-kp2.pt.y;
-                        if(distex*distex+distey*distey<100*pKF2->mvScaleFactors[kp2.octave])
-                            continue;
-                    }
+                // Branch free over contiguous arrays, so the compiler vectorizes it
+                const size_t nClose = vClose.size();
+                vbCloseValid.resize(nClose);
+                for(size_t k=0; k<nClose; k++)
+                {
+                    const float num = a*vCloseX[k]+b*vCloseY[k]+c;
+                    const float dsqr = num*num/den;
+                    const float distex = ex-vCloseX[k];
+                    const float distey = ey-vCloseY[k];
+                    vbCloseValid[k] = (dsqr<3.84*vCloseSigma2[k]) & (distex*distex+distey*distey>=vCloseEpipole[k]);
+                }
 
-                    if(CheckDistEpipolarLine(kp1,kp2,F12,pKF2))
+                // The last of the closest valid ones, as when checking them one by one
+                for(size_t k=0; k<nClose; k++)
+                {
+                    const int dist = vDistances[vClose[k]];
+                    if(vbCloseValid[k] && dist<=bestDist)
                     {
-                        bestIdx2 = idx2;
+                        bestIdx2 = vCandidates[vClose[k]];
                         bestDist = dist;
                     }
                 }
 
                 if(bestIdx2>=0)
                 {
-                    const cv::KeyPoint &kp2 = pKF2->mvKeysUn[bestIdx2];
+                    const cv::KeyPoint &kp2 = features2.vKeysUn[bestIdx2];
                     vMatches12[idx1]=bestIdx2;
                     nmatches++;
 
                     if(mbCheckOrientation)
                     {
-                        float rot = kp1.angle-kp2.angle;
-                        if(rot<0.0)
-                            rot+=360.0f;
-                        int bin = round(rot*factor);
-                        if(bin==HISTO_LENGTH)
-                            bin=0;
-                        assert(bin>=0 && bin<HISTO_LENGTH);
-                        rotHist[bin].push_back(idx1);
+                        rotHist.Add(kp1.angle,kp2.angle,idx1);
                     }
                 }
             }
@@ -808,21 +887,12 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F
 
     if(mbCheckOrientation)
     {
-        int ind1=-1;
-        int ind2=-1;
-        int ind3=-1;
-
-        ComputeThreeMaxima(rotHist,HISTO_LENGTH,ind1,ind2,ind3);
-
-        for(int i=0; i<HISTO_LENGTH; i++)
+        const vector<int> &vRejected = rotHist.ComputeRejected();
+        MATCHER_COUNT(nRotationRejected,vRejected.size());
+        for(size_t j=0, jend=vRejected.size(); j<jend; j++)
         {
-            if(i==ind1 || i==ind2 || i==ind3)
-                continue;
-            for(size_t j=0, jend=rotHist[i].size(); j<jend; j++)
-            {
-                vMatches12[rotHist[i][j]]=-1;
-                nmatches--;
-            }
+            vMatches12[vRejected[j]]=-1;
+            nmatches--;
         }
 
     }
@@ -837,27 +907,27 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F
         vMatchedPairs.push_back(make_pair(i,vMatches12[i]));
     }
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
 int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const float th)
 {
-    cv::Mat Rcw = pKF->GetRotation();
-    cv::Mat tcw = pKF->GetTranslation();
+    vector<FuseMatch> vMatches;
+    SearchFuseMatches(pKF,vpMapPoints,vMatches,th);
+    return ApplyFuseMatches(pKF,vMatches);
+}
 
-    const float &fx = pKF->fx;
-    const float &fy = pKF->fy;
-    const float &cx = pKF->cx;
-    const float &cy = pKF->cy;
+void ORBmatcher::SearchFuseMatches(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, vector<FuseMatch> &vMatches, const float th)
+{
+    MATCHER_COUNTER(FUSE);
+    const KeyFrame::Features features = pKF->GetFeatures();
     const float &bf = pKF->mbf;
 
-    cv::Mat Ow = pKF->GetCameraCenter();
-
-    int nFused=0;
-
-    const int nMPs = vpMapPoints.size();
-
-    for(int i=0; i<nMPs; i++)
+    // The points not in the keyframe yet, projected all at once
+    static thread_local PointProjection::Points points;
+    points.Clear();
+    for(size_t i=0, iend=vpMapPoints.size(); i<iend; i++)
     {
         MapPoint* pMP = vpMapPoints[i];
 
@@ -867,74 +937,65 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
         if(pMP->isBad() || pMP->IsInKeyFrame(pKF))
             continue;
 
-        cv::Mat p3Dw = pMP->GetWorldPos();
-        cv::Mat p3Dc = Rcw*p3Dw + tcw;
-
-        // Depth must be positive
-        if(p3Dc.at<float>(2)<0.0f)
-            continue;
-
-        const float invz = 1/p3Dc.at<float>(2);
-        const float x = p3Dc.at<float>(0)*invz;
-        const float y = p3Dc.at<float>(1)*invz;
-
-        const float u = fx*x+cx;
-        const float v = fy*y+cy;
-
-        // Point must be inside the image
-        if(!pKF->IsInImage(u,v))
-            continue;
-
-        const float ur = u-bf*invz;
-
-        const float maxDistance = pMP->GetMaxDistanceInvariance();
-        const float minDistance = pMP->GetMinDistanceInvariance();
-        cv::Mat PO = p3Dw-Ow;
-        const float dist3D = cv::norm(PO);
+        points.Add(pMP);
+    }
 
-        // Depth must be inside the scale pyramid of the image
-        if(dist3D<minDistance || dist3D>maxDistance )
-            continue;
+    // Depth positive, inside the image and the scale pyramid, viewing angle less than 60 deg
+    PointProjection::Camera camera;
+    camera.SetImage(pKF);
+    pKF->GetPose(camera.R,camera.t);
+    camera.fMinViewCos = 0.5f;
+    static thread_local PointProjection::Visible visible;
+    PointProjection::Project(points,camera,visible);
 
-        // Viewing angle must be less than 60 deg
-        cv::Mat Pn = pMP->GetNormal();
+    vector<size_t> vIndices;
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
+    cv::Mat dMP; // reused for every MapPoint, GetDescriptor only allocates it once
 
-        if(PO.dot(Pn)<0.5*dist3D)
-            continue;
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
+    {
+        MapPoint* pMP = points.mvpMapPoints[visible.vnIndex[j]];
+        const float u = visible.vu[j];
+        const float v = visible.vv[j];
+        const float ur = u-bf*visible.vInvZ[j];
 
-        int nPredictedLevel = pMP->PredictScale(dist3D,pKF);
+        int nPredictedLevel = pMP->PredictScale(visible.vDist[j],pKF);
 
         // Search in a radius
         const float radius = th*pKF->mvScaleFactors[nPredictedLevel];
 
-        const vector<size_t> vIndices = pKF->GetFeaturesInArea(u,v,radius);
+        pKF->GetFeaturesInArea(u,v,radius,features.vKeysUn,vIndices);
 
         if(vIndices.empty())
             continue;
 
         // Match to the most similar keypoint in the radius
 
-        const cv::Mat dMP = pMP->GetDescriptor();
+        pMP->GetDescriptor(dMP);
 
         int bestDist = 256;
         int bestIdx = -1;
+
+        MATCHER_COUNT(nCandidates,vIndices.size());
+        vCandidates.clear();
         for(vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++)
         {
             const size_t idx = *vit;
 
-            const cv::KeyPoint &kp = pKF->mvKeysUn[idx];
+            const cv::KeyPoint &kp = features.vKeysUn[idx];
 
             const int &kpLevel= kp.octave;
 
             if(kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
                 continue;
 
-            if(pKF->mvuRight[idx]>=0)
+            if(features.vuRight[idx]>=0)
             {
                 // Check reprojection error in stereo
                 const float &kpx = kp.pt.x;
                 const float &kpy = kp.pt.y;
-                const float &kpr = pKF->mvuRight[idx];
+                const float &kpr = features.vuRight[idx];
                 const float ex = u-kpx;
                 const float ey = v-kpy;
                 const float er = ur-kpr;
@@ -955,38 +1016,64 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
                     continue;
             }
 
-            const cv::Mat &dKF = pKF->mDescriptors.row(idx);
+            vCandidates.push_back(idx);
+        }
 
-            const int dist = DescriptorDistance(dMP,dKF);
+        DescriptorDistances(dMP,pKF->mDescriptors,vCandidates,vDistances);
 
-            if(dist<bestDist)
+        for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+        {
+            if(vDistances[ic]<bestDist)
             {
-                bestDist = dist;
-                bestIdx = idx;
+                bestDist = vDistances[ic];
+                bestIdx = vCandidates[ic];
             }
         }
 
-        // If there is already a MapPoint replace otherwise add new measurement
         if(bestDist<=TH_LOW) //param
+            vMatches.push_back(make_pair(pMP,static_cast<size_t>(bestIdx)));
+    }
+    MATCHER_COUNT(nMatches,vMatches.size());
+}
+
+int ORBmatcher::ApplyFuseMatches(KeyFrame *pKF, const vector<FuseMatch> &vMatches, MapPointReplacer* pReplacer)
+{
+    if(!pReplacer)
+    {
+        MapPointReplacer replacer;
+        const int nFused = ApplyFuseMatches(pKF,vMatches,&replacer);
+        replacer.Apply();
+        return nFused;
+    }
+
+    int nFused=0;
+
+    for(size_t i=0, iend=vMatches.size(); i<iend; i++)
+    {
+        MapPoint* pMP = vMatches[i].first;
+        const size_t bestIdx = vMatches[i].second;
+
+        // An earlier fusion may have replaced the point or added this keyframe to it
+        if(pMP->isBad() || pMP->IsInKeyFrame(pKF))
+            continue;
+
+        // If there is already a MapPoint replace otherwise add new measurement
+        MapPoint* pMPinKF = pReplacer->GetMapPoint(pKF,bestIdx);
+        if(pMPinKF)
         {
-            MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
-            if(pMPinKF)
+            if(!pMPinKF->isBad())
             {
-                if(!pMPinKF->isBad())
-                {
-                    if(pMPinKF->Observations()>pMP->Observations())
-                        pMP->Replace(pMPinKF);
-                    else
-                        pMPinKF->Replace(pMP);
-                }
-            }
-            else
-            {
-                pMP->AddObservation(pKF,bestIdx);
-                pKF->AddMapPoint(pMP,bestIdx);
+                if(pMPinKF->Observations()>pMP->Observations())
+                    pReplacer->Replace(pMP,pMPinKF);
+                else
+                    pReplacer->Replace(pMPinKF,pMP);
             }
-            nFused++;
         }
+        else
+        {
+            pReplacer->Add(pMP,pKF,bestIdx);
+        }
+        nFused++;
     }
 
     return nFused;
@@ -994,105 +1081,79 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
 
 int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint)
 {
-    // Get Calibration Parameters for later projection
-    const float &fx = pKF->fx;
-    const float &fy = pKF->fy;
-    const float &cx = pKF->cx;
-    const float &cy = pKF->cy;
-
-    // Decompose Scw
-    cv::Mat sRcw = Scw.rowRange(0,3).colRange(0,3);
-    const float scw = sqrt(sRcw.row(0).dot(sRcw.row(0)));
-    cv::Mat Rcw = sRcw/scw;
-    cv::Mat tcw = Scw.rowRange(0,3).col(3)/scw;
-    cv::Mat Ow = -Rcw.t()*tcw;
+    ProjectionPoints points;
+    points.Set(vpPoints);
+    return Fuse(pKF,Scw,points,th,vpReplacePoint);
+}
+
+int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const ProjectionPoints &points, float th, vector<MapPoint *> &vpReplacePoint)
+{
+    MATCHER_COUNTER(FUSE_SIM3);
+    const KeyFrame::Features features = pKF->GetFeatures();
 
     // Set of MapPoints already found in the KeyFrame
     const set<MapPoint*> spAlreadyFound = pKF->GetMapPoints();
 
+    PointProjection::Camera camera;
+    SetSim3Camera(pKF,Scw,camera);
+    static thread_local PointProjection::Visible visible;
+    PointProjection::Project(points,camera,visible);
+
     int nFused=0;
 
-    const int nPoints = vpPoints.size();
+    vector<size_t> vIndices;
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
 
-    // For each candidate MapPoint project and match
-    for(int iMP=0; iMP<nPoints; iMP++)
+    // For each projected candidate MapPoint match
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
     {
-        MapPoint* pMP = vpPoints[iMP];
+        const int iMP = visible.vnIndex[j];
+        MapPoint* pMP = points.mvpMapPoints[iMP];
 
         // Discard Bad MapPoints and already found
         if(pMP->isBad() || spAlreadyFound.count(pMP))
             continue;
 
-        // Get 3D Coords.
-        cv::Mat p3Dw = pMP->GetWorldPos();
-
-        // Transform into Camera Coords.
-        cv::Mat p3Dc = Rcw*p3Dw+tcw;
-
-        // Depth must be positive
-        if(p3Dc.at<float>(2)<0.0f)
-            continue;
-
-        // Project into Image
-        const float invz = 1.0/p3Dc.at<float>(2);
-        const float x = p3Dc.at<float>(0)*invz;
-        const float y = p3Dc.at<float>(1)*invz;
-
-        const float u = fx*x+cx;
-        const float v = fy*y+cy;
-
-        // Point must be inside the image
-        if(!pKF->IsInImage(u,v))
-            continue;
-
-        // Depth must be inside the scale pyramid of the image
-        const float maxDistance = pMP->GetMaxDistanceInvariance();
-        const float minDistance = pMP->GetMinDistanceInvariance();
-        cv::Mat PO = p3Dw-Ow;
-        const float dist3D = cv::norm(PO);
-
-        if(dist3D<minDistance || dist3D>maxDistance)
-            continue;
-
-        // Viewing angle must be less than 60 deg
-        cv::Mat Pn = pMP->GetNormal();
-
-        if(PO.dot(Pn)<0.5*dist3D)
-            continue;
-
         // Compute predicted scale level
-        const int nPredictedLevel = pMP->PredictScale(dist3D,pKF);
+        const int nPredictedLevel = PredictScale(points.mvMaxDistance[iMP],visible.vDist[j],pKF);
 
         // Search in a radius
         const float radius = th*pKF->mvScaleFactors[nPredictedLevel]; //param
 
-        const vector<size_t> vIndices = pKF->GetFeaturesInArea(u,v,radius); //param
+        pKF->GetFeaturesInArea(visible.vu[j],visible.vv[j],radius,features.vKeysUn,vIndices); //param
 
         if(vIndices.empty())
             continue;
 
         // Match to the most similar keypoint in the radius
 
-        const cv::Mat dMP = pMP->GetDescriptor();
+        const cv::Mat dMP = points.mDescriptors.row(iMP);
 
         int bestDist = INT_MAX;
         int bestIdx = -1;
+
+        MATCHER_COUNT(nCandidates,vIndices.size());
+        vCandidates.clear();
         for(vector<size_t>::const_iterator vit=vIndices.begin(); vit!=vIndices.end(); vit++)
         {
             const size_t idx = *vit;
-            const int &kpLevel = pKF->mvKeysUn[idx].octave;
+            const int &kpLevel = features.vKeysUn[idx].octave;
 
             if(kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
                 continue;
 
-            const cv::Mat &dKF = pKF->mDescriptors.row(idx);
+            vCandidates.push_back(idx);
+        }
 
-            int dist = DescriptorDistance(dMP,dKF);
+        DescriptorDistances(dMP,pKF->mDescriptors,vCandidates,vDistances);
 
-            if(dist<bestDist)
+        for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+        {
+            if(vDistances[ic]<bestDist)
             {
-                bestDist = dist;
-                bestIdx = idx;
+                bestDist = vDistances[ic];
+                bestIdx = vCandidates[ic];
             }
         }
 
@@ -1114,29 +1175,35 @@ int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoi
         }
     }
 
+    MATCHER_COUNT(nMatches,nFused);
     return nFused;
 }
 
 int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &vpMatches12,
                              const float &s12, const cv::Mat &R12, const cv::Mat &t12, const float th)
 {
-    const float &fx = pKF1->fx;
-    const float &fy = pKF1->fy;
-    const float &cx = pKF1->cx;
-    const float &cy = pKF1->cy;
+    MATCHER_COUNTER(SIM3);
+    const KeyFrame::Features features1 = pKF1->GetFeatures();
+    const KeyFrame::Features features2 = pKF2->GetFeatures();
 
     // Camera 1 from world
-    cv::Mat R1w = pKF1->GetRotation();
-    cv::Mat t1w = pKF1->GetTranslation();
+    Eigen::Matrix3f R1w;
+    Eigen::Vector3f t1w;
+    pKF1->GetPose(R1w,t1w);
 
     //Camera 2 from world
-    cv::Mat R2w = pKF2->GetRotation();
-    cv::Mat t2w = pKF2->GetTranslation();
+    Eigen::Matrix3f R2w;
+    Eigen::Vector3f t2w;
+    pKF2->GetPose(R2w,t2w);
 
     //Transformation between cameras
-    cv::Mat sR12 = s12*R12;
-    cv::Mat sR21 = (1.0/s12)*R12.t();
-    cv::Mat t21 = -sR21*t12;
+    const Eigen::Matrix3f eR12 = Converter::toMatrix3f(R12);
+    const Eigen::Vector3f et12 = Converter::toVector3f(t12);
+    const Eigen::Matrix3f sR12 = s12*eR12;
+    const Eigen::Matrix3f sR21 = (1.0f/s12)*eR12.transpose();
+    const Eigen::Vector3f t21 = -sR21*et12;
+
+    vector<size_t> vIndices; // reused for every point, the grid queries do not allocate
 
     const vector<MapPoint*> vpMapPoints1 = pKF1->GetMapPointMatches();
     const int N1 = vpMapPoints1.size();
@@ -1162,7 +1229,16 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
     vector<int> vnMatch1(N1,-1);
     vector<int> vnMatch2(N2,-1);
 
+    // The unmatched points of one keyframe projected into the other all at once. Depth positive,
+    // inside the image and the scale invariance region.
+    static thread_local PointProjection::Points points;
+    static thread_local PointProjection::Visible visible;
+    vector<int> vnSource;
+    PointProjection::Camera camera;
+
     // Transform from KF1 to KF2 and search
+    points.Clear();
+    vnSource.clear();
     for(int i1=0; i1<N1; i1++)
     {
         MapPoint* pMP = vpMapPoints1[i1];
@@ -1173,40 +1249,27 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
         if(pMP->isBad())
             continue;
 
-        cv::Mat p3Dw = pMP->GetWorldPos();
-        cv::Mat p3Dc1 = R1w*p3Dw + t1w;
-        cv::Mat p3Dc2 = sR21*p3Dc1 + t21;
-
-        // Depth must be positive
-        if(p3Dc2.at<float>(2)<0.0)
-            continue;
-
-        const float invz = 1.0/p3Dc2.at<float>(2);
-        const float x = p3Dc2.at<float>(0)*invz;
-        const float y = p3Dc2.at<float>(1)*invz;
-
-        const float u = fx*x+cx;
-        const float v = fy*y+cy;
-
-        // Point must be inside the image
-        if(!pKF2->IsInImage(u,v))
-            continue;
+        points.Add(pMP);
+        vnSource.push_back(i1);
+    }
 
-        const float maxDistance = pMP->GetMaxDistanceInvariance();
-        const float minDistance = pMP->GetMinDistanceInvariance();
-        const float dist3D = cv::norm(p3Dc2);
+    camera.SetImage(pKF2);
+    camera.R = sR21*R1w;
+    camera.t = sR21*t1w+t21;
+    PointProjection::Project(points,camera,visible);
 
-        // Depth must be inside the scale invariance region
-        if(dist3D<minDistance || dist3D>maxDistance )
-            continue;
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
+    {
+        MapPoint* pMP = points.mvpMapPoints[visible.vnIndex[j]];
 
         // Compute predicted octave
-        const int nPredictedLevel = pMP->PredictScale(dist3D,pKF2);
+        const int nPredictedLevel = pMP->PredictScale(visible.vDist[j],pKF2);
 
         // Search in a radius
         const float radius = th*pKF2->mvScaleFactors[nPredictedLevel];
 
-        const vector<size_t> vIndices = pKF2->GetFeaturesInArea(u,v,radius);
+        pKF2->GetFeaturesInArea(visible.vu[j],visible.vv[j],radius,features2.vKeysUn,vIndices);
+        MATCHER_COUNT(nCandidates,vIndices.size());
 
         if(vIndices.empty())
             continue;
@@ -1220,7 +1283,7 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
         {
             const size_t idx = *vit;
 
-            const cv::KeyPoint &kp = pKF2->mvKeysUn[idx];
+            const cv::KeyPoint &kp = features2.vKeysUn[idx];
 
             if(kp.octave<nPredictedLevel-1 || kp.octave>nPredictedLevel)
                 continue;
@@ -1238,11 +1301,13 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
 
         if(bestDist<=TH_HIGH)
         {
-            vnMatch1[i1]=bestIdx;
+            vnMatch1[vnSource[visible.vnIndex[j]]]=bestIdx;
         }
     }
 
     // Transform from KF2 to KF2 and search
+    points.Clear();
+    vnSource.clear();
     for(int i2=0; i2<N2; i2++)
     {
         MapPoint* pMP = vpMapPoints2[i2];
@@ -1253,40 +1318,27 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
         if(pMP->isBad())
             continue;
 
-        cv::Mat p3Dw = pMP->GetWorldPos();
-        cv::Mat p3Dc2 = R2w*p3Dw + t2w;
-        cv::Mat p3Dc1 = sR12*p3Dc2 + t12;
-
-        // Depth must be positive
-        if(p3Dc1.at<float>(2)<0.0)
-            continue;
-
-        const float invz = 1.0/p3Dc1.at<float>(2);
-        const float x = p3Dc1.at<float>(0)*invz;
-        const float y = p3Dc1.at<float>(1)*invz;
-
-        const float u = fx*x+cx;
-        const float v = fy*y+cy;
-
-        // Point must be inside the image
-        if(!pKF1->IsInImage(u,v))
-            continue;
+        points.Add(pMP);
+        vnSource.push_back(i2);
+    }
 
-        const float maxDistance = pMP->GetMaxDistanceInvariance();
-        const float minDistance = pMP->GetMinDistanceInvariance();
-        const float dist3D = cv::norm(p3Dc1);
+    camera.SetImage(pKF1);
+    camera.R = sR12*R2w;
+    camera.t = sR12*t2w+et12;
+    PointProjection::Project(points,camera,visible);
 
-        // Depth must be inside the scale pyramid of the image
-        if(dist3D<minDistance || dist3D>maxDistance)
-            continue;
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
+    {
+        MapPoint* pMP = points.mvpMapPoints[visible.vnIndex[j]];
 
         // Compute predicted octave
-        const int nPredictedLevel = pMP->PredictScale(dist3D,pKF1);
+        const int nPredictedLevel = pMP->PredictScale(visible.vDist[j],pKF1);
 
         // Search in a radius of 2.5*sigma(ScaleLevel)
         const float radius = th*pKF1->mvScaleFactors[nPredictedLevel]; //param
 
-        const vector<size_t> vIndices = pKF1->GetFeaturesInArea(u,v,radius);
+        pKF1->GetFeaturesInArea(visible.vu[j],visible.vv[j],radius,features1.vKeysUn,vIndices);
+        MATCHER_COUNT(nCandidates,vIndices.size());
 
         if(vIndices.empty())
             continue;
@@ -1300,7 +1352,7 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
         {
             const size_t idx = *vit;
 
-            const cv::KeyPoint &kp = pKF1->mvKeysUn[idx];
+            const cv::KeyPoint &kp = features1.vKeysUn[idx];
 
             if(kp.octave<nPredictedLevel-1 || kp.octave>nPredictedLevel)
                 continue;
@@ -1318,7 +1370,7 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
 
         if(bestDist<=TH_HIGH)
         {
-            vnMatch2[i2]=bestIdx;
+            vnMatch2[vnSource[visible.vnIndex[j]]]=bestIdx;
         }
     }
 
@@ -1340,126 +1392,130 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
         }
     }
 
+    MATCHER_COUNT(nMatches,nFound);
     return nFound;
 }
 
 int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono)
 {
+    MATCHER_COUNTER(PROJECTION_LAST_FRAME);
     int nmatches = 0;
 
     // Rotation Histogram (to check rotation consistency)
-    vector<int> rotHist[HISTO_LENGTH];
-    for(int i=0;i<HISTO_LENGTH;i++)
-        rotHist[i].reserve(500);
-    const float factor = 1.0f/HISTO_LENGTH; //param
-
-    const cv::Mat Rcw = CurrentFrame.mTcw.rowRange(0,3).colRange(0,3);
-    const cv::Mat tcw = CurrentFrame.mTcw.rowRange(0,3).col(3);
+    RotationHistogram &rotHist = RotationHistogram::Local();
 
-    const cv::Mat twc = -Rcw.t()*tcw;
+    Eigen::Matrix3f Rcw, Rlw;
+    Eigen::Vector3f tcw, tlw;
+    CurrentFrame.GetPose(Rcw,tcw);
+    LastFrame.GetPose(Rlw,tlw);
 
-    const cv::Mat Rlw = LastFrame.mTcw.rowRange(0,3).colRange(0,3);
-    const cv::Mat tlw = LastFrame.mTcw.rowRange(0,3).col(3);
+    const Eigen::Vector3f twc = -Rcw.transpose()*tcw;
 
-    const cv::Mat tlc = Rlw*twc+tlw;
+    const Eigen::Vector3f tlc = Rlw*twc+tlw;
 
-    const bool bForward = tlc.at<float>(2)>CurrentFrame.mb && !bMono;
-    const bool bBackward = -tlc.at<float>(2)>CurrentFrame.mb && !bMono;
+    const bool bForward = tlc(2)>CurrentFrame.mb && !bMono;
+    const bool bBackward = -tlc(2)>CurrentFrame.mb && !bMono;
 
+    // The inliers of the last frame projected all at once, in front of the camera and inside
+    // the image. Their scale comes from the last octave, the invariance region is not tested.
+    static thread_local PointProjection::Points points;
+    static thread_local PointProjection::Visible visible;
+    vector<int> vnSource;
+    points.Clear();
+    const Eigen::Vector3f Pn = Eigen::Vector3f::Zero();
     for(int i=0; i<LastFrame.N; i++)
     {
         MapPoint* pMP = LastFrame.mvpMapPoints[i];
-
-        if(pMP)
+        if(pMP && !LastFrame.mvbOutlier[i])
         {
-            if(!LastFrame.mvbOutlier[i])
-            {
-                // Project
-                cv::Mat x3Dw = pMP->GetWorldPos();
-                cv::Mat x3Dc = Rcw*x3Dw+tcw;
-
-                const float xc = x3Dc.at<float>(0);
-                const float yc = x3Dc.at<float>(1);
-                const float invzc = 1.0/x3Dc.at<float>(2);
-
-                if(invzc<0)
-                    continue;
+            Eigen::Vector3f x3Dw;
+            pMP->GetWorldPos(x3Dw);
+            points.Add(pMP,x3Dw,Pn,0.0f,0.0f);
+            vnSource.push_back(i);
+        }
+    }
 
-                float u = CurrentFrame.fx*xc*invzc+CurrentFrame.cx;
-                float v = CurrentFrame.fy*yc*invzc+CurrentFrame.cy;
+    PointProjection::Camera camera;
+    camera.SetImage(CurrentFrame);
+    camera.R = Rcw;
+    camera.t = tcw;
+    camera.bScaleInvariance = false;
+    PointProjection::Project(points,camera,visible);
 
-                if(u<CurrentFrame.mnMinX || u>CurrentFrame.mnMaxX)
-                    continue;
-                if(v<CurrentFrame.mnMinY || v>CurrentFrame.mnMaxY)
-                    continue;
+    vector<size_t> vIndices2;
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
+    cv::Mat dMP; // reused for every MapPoint, GetDescriptor only allocates it once
 
-                int nLastOctave = LastFrame.mvKeys[i].octave;
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
+    {
+        const int i = vnSource[visible.vnIndex[j]];
+        MapPoint* pMP = points.mvpMapPoints[visible.vnIndex[j]];
+        const float invzc = visible.vInvZ[j];
+        const float u = visible.vu[j];
+        const float v = visible.vv[j];
+
+        int nLastOctave = LastFrame.mvKeys[i].octave;
+
+        // Search in a window. Size depends on scale
+        float radius = th*CurrentFrame.mvScaleFactors[nLastOctave];
+
+        // depending on whether moving foward or backward searching in different
+        // scale levels of the scale pyramid makes more sense
+        if(bForward)
+            CurrentFrame.GetFeaturesInArea(u,v, radius, nLastOctave, -1, vIndices2);
+        else if(bBackward)
+            CurrentFrame.GetFeaturesInArea(u,v, radius, 0, nLastOctave, vIndices2);
+        else
+            CurrentFrame.GetFeaturesInArea(u,v, radius, nLastOctave-1, nLastOctave+1, vIndices2);
 
-                // Search in a window. Size depends on scale
-                float radius = th*CurrentFrame.mvScaleFactors[nLastOctave];
+        if(vIndices2.empty())
+            continue;
 
-                vector<size_t> vIndices2;
+        pMP->GetDescriptor(dMP);
 
-                // depending on whether moving foward or backward searching in different
-                // scale levels of the scale pyramid makes more sense
-                if(bForward)
-                    vIndices2 = CurrentFrame.GetFeaturesInArea(u,v, radius, nLastOctave);
-                else if(bBackward)
-                    vIndices2 = CurrentFrame.GetFeaturesInArea(u,v, radius, 0, nLastOctave);
-                else
-                    vIndices2 = CurrentFrame.GetFeaturesInArea(u,v, radius, nLastOctave-1, nLastOctave+1);
+        int bestDist = 256;
+        int bestIdx2 = -1;
 
-                if(vIndices2.empty())
+        MATCHER_COUNT(nCandidates,vIndices2.size());
+        vCandidates.clear();
+        for(vector<size_t>::const_iterator vit=vIndices2.begin(), vend=vIndices2.end(); vit!=vend; vit++)
+        {
+            const size_t i2 = *vit;
+            if(CurrentFrame.mvpMapPoints[i2])
+                if(CurrentFrame.mvpMapPoints[i2]->Observations()>0)
                     continue;
 
-                const cv::Mat dMP = pMP->GetDescriptor();
-
-                int bestDist = 256;
-                int bestIdx2 = -1;
-
-                for(vector<size_t>::const_iterator vit=vIndices2.begin(), vend=vIndices2.end(); vit!=vend; vit++)
-                {
-                    const size_t i2 = *vit;
-                    if(CurrentFrame.mvpMapPoints[i2])
-                        if(CurrentFrame.mvpMapPoints[i2]->Observations()>0)
-                            continue;
-
-                    if(CurrentFrame.mvuRight[i2]>0)
-                    {
-                        const float ur = u - CurrentFrame.mbf*invzc;
-                        const float er = fabs(ur - CurrentFrame.mvuRight[i2]);
-                        if(er>radius)
-                            continue;
-                    }
+            if(CurrentFrame.mvuRight[i2]>0)
+            {
+                const float ur = u - CurrentFrame.mbf*invzc;
+                const float er = fabs(ur - CurrentFrame.mvuRight[i2]);
+                if(er>radius)
+                    continue;
+            }
 
-                    const cv::Mat &d = CurrentFrame.mDescriptors.row(i2);
+            vCandidates.push_back(i2);
+        }
 
-                    const int dist = DescriptorDistance(dMP,d);
+        DescriptorDistances(dMP,CurrentFrame.mDescriptors,vCandidates,vDistances);
 
-                    if(dist<bestDist)
-                    {
-                        bestDist=dist;
-                        bestIdx2=i2;
-                    }
-                }
+        for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+        {
+            if(vDistances[ic]<bestDist)
+            {
+                bestDist=vDistances[ic];
+                bestIdx2=vCandidates[ic];
+            }
+        }
 
-                if(bestDist<=TH_HIGH) //param
-                {
-                    CurrentFrame.mvpMapPoints[bestIdx2]=pMP;
-                    nmatches++;
+        if(bestDist<=TH_HIGH) //param
+        {
+            CurrentFrame.mvpMapPoints[bestIdx2]=pMP;
+            nmatches++;
 
-                    if(mbCheckOrientation)
-                    {
-                        float rot = LastFrame.mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
-                        if(rot<0.0)
-                            rot+=360.0f;
-                        int bin = round(rot*factor);
-                        if(bin==HISTO_LENGTH)
-                            bin=0;
-                        assert(bin>=0 && bin<HISTO_LENGTH);
-                        rotHist[bin].push_back(bestIdx2);
-                    }
-                }
+            if(mbCheckOrientation)
+            {
+                rotHist.Add(LastFrame.mvKeysUn[i].angle,CurrentFrame.mvKeysUn[bestIdx2].angle,bestIdx2);
             }
         }
     }
@@ -1467,126 +1523,114 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
     //Apply rotation consistency
     if(mbCheckOrientation)
     {
-        int ind1=-1;
-        int ind2=-1;
-        int ind3=-1;
-
-        ComputeThreeMaxima(rotHist,HISTO_LENGTH,ind1,ind2,ind3);
-
-        for(int i=0; i<HISTO_LENGTH; i++)
+        const vector<int> &vRejected = rotHist.ComputeRejected();
+        MATCHER_COUNT(nRotationRejected,vRejected.size());
+        for(size_t j=0, jend=vRejected.size(); j<jend; j++)
         {
-            if(i!=ind1 && i!=ind2 && i!=ind3)
-            {
-                for(size_t j=0, jend=rotHist[i].size(); j<jend; j++)
-                {
-                    CurrentFrame.mvpMapPoints[rotHist[i][j]]=static_cast<MapPoint*>(NULL);
-                    nmatches--;
-                }
-            }
+            CurrentFrame.mvpMapPoints[vRejected[j]]=static_cast<MapPoint*>(NULL);
+            nmatches--;
         }
     }
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
 int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set<MapPoint*> &sAlreadyFound, const float th , const int ORBdist)
 {
+    MATCHER_COUNTER(PROJECTION_KEYFRAME);
+    const SharedArray<cv::KeyPoint> vKeysUn = pKF->GetFeatures().vKeysUn;
     int nmatches = 0;
 
-    const cv::Mat Rcw = CurrentFrame.mTcw.rowRange(0,3).colRange(0,3);
-    const cv::Mat tcw = CurrentFrame.mTcw.rowRange(0,3).col(3);
-    const cv::Mat Ow = -Rcw.t()*tcw;
-
     // Rotation Histogram (to check rotation consistency)
-    vector<int> rotHist[HISTO_LENGTH];
-    for(int i=0;i<HISTO_LENGTH;i++)
-        rotHist[i].reserve(500);
-    const float factor = 1.0f/HISTO_LENGTH;
+    RotationHistogram &rotHist = RotationHistogram::Local();
 
     const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
 
+    // The points of the keyframe not found yet, projected all at once. In front of the camera,
+    // inside the image and the scale pyramid.
+    static thread_local PointProjection::Points points;
+    static thread_local PointProjection::Visible visible;
+    vector<int> vnSource;
+    points.Clear();
     for(size_t i=0, iend=vpMPs.size(); i<iend; i++)
     {
         MapPoint* pMP = vpMPs[i];
-
-        if(pMP)
+        if(pMP && !pMP->isBad() && !sAlreadyFound.count(pMP))
         {
-            if(!pMP->isBad() && !sAlreadyFound.count(pMP))
-            {
-                //Project
-                cv::Mat x3Dw = pMP->GetWorldPos();
-                cv::Mat x3Dc = Rcw*x3Dw+tcw;
-
-                const float xc = x3Dc.at<float>(0);
-                const float yc = x3Dc.at<float>(1);
-                const float invzc = 1.0/x3Dc.at<float>(2);
-
-                const float u = CurrentFrame.fx*xc*invzc+CurrentFrame.cx;
-                const float v = CurrentFrame.fy*yc*invzc+CurrentFrame.cy;
+            points.Add(pMP);
+            vnSource.push_back(i);
+        }
+    }
 
-                if(u<CurrentFrame.mnMinX || u>CurrentFrame.mnMaxX)
-                    continue;
-                if(v<CurrentFrame.mnMinY || v>CurrentFrame.mnMaxY)
-                    continue;
+    PointProjection::Camera camera;
+    camera.SetImage(CurrentFrame);
+    CurrentFrame.GetPose(camera.R,camera.t);
+    PointProjection::Project(points,camera,visible);
 
-                // Compute predicted scale level
-                cv::Mat PO = x3Dw-Ow;
-                float dist3D = cv::norm(PO);
+    vector<size_t> vIndices2;
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
+    cv::Mat dMP; // reused for every MapPoint, GetDescriptor only allocates it once
 
-                const float maxDistance = pMP->GetMaxDistanceInvariance();
-                const float minDistance = pMP->GetMinDistanceInvariance();
+    for(size_t j=0, jend=visible.Size(); j<jend; j++)
+    {
+        const int i = vnSource[visible.vnIndex[j]];
+        MapPoint* pMP = points.mvpMapPoints[visible.vnIndex[j]];
 
-                // Depth must be inside the scale pyramid of the image
-                if(dist3D<minDistance || dist3D>maxDistance)
-                    continue;
+        // Compute predicted scale level
+        int nPredictedLevel = pMP->PredictScale(visible.vDist[j],&CurrentFrame);
 
-                int nPredictedLevel = pMP->PredictScale(dist3D,&CurrentFrame);
+        // Search in a window
+        const float radius = th*CurrentFrame.mvScaleFactors[nPredictedLevel]; //param
 
-                // Search in a window
-                const float radius = th*CurrentFrame.mvScaleFactors[nPredictedLevel]; //param
+        CurrentFrame.GetFeaturesInArea(visible.vu[j], visible.vv[j], radius, nPredictedLevel-1, nPredictedLevel+1, vIndices2);
 
-                const vector<size_t> vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, nPredictedLevel-1, nPredictedLevel+1);
+        if(vIndices2.empty())
+            continue;
 
-                if(vIndices2.empty())
-                    continue;
+        pMP->GetDescriptor(dMP);
 
-                const cv::Mat dMP = pMP->GetDescriptor();
+        int bestDist = 256;
+        int bestIdx2 = -1;
 
-                int bestDist = 256;
-                int bestIdx2 = -1;
+        MATCHER_COUNT(nCandidates,vIndices2.size());
+        vCandidates.clear();
+        for(vector<size_t>::const_iterator vit=vIndices2.begin(); vit!=vIndices2.end(); vit++)
+        {
+            const size_t i2 = *vit;
+            if(CurrentFrame.mvpMapPoints[i2])
+                continue;
 
-                for(vector<size_t>::const_iterator vit=vIndices2.begin(); vit!=vIndices2.end(); vit++)
-                {
-                    const size_t i2 = *vit;
-                    if(CurrentFrame.mvpMapPoints[i2])
-                        continue;
+            vCandidates.push_back(i2);
+        }
 
-                    const cv::Mat &d = CurrentFrame.mDescriptors.row(i2);
+        DescriptorDistances(dMP,CurrentFrame.mDescriptors,vCandidates,vDistances);
 
-                    const int dist = DescriptorDistance(dMP,d);
+        for(size_t ic=0, icend=vCandidates.size(); ic<icend; ic++)
+        {
+            if(vDistances[ic]<bestDist)
+            {
+                bestDist=vDistances[ic];
+                bestIdx2=vCandidates[ic];
+            }
+        }
 
-                    if(dist<bestDist)
-                    {
-                        bestDist=dist;
-                        bestIdx2=i2;
-                    }
-                }
+        if(bestDist<=ORBdist)
+        {
+            CurrentFrame.mvpMapPoints[bestIdx2]=pMP;
+            nmatches++;
 
-                if(bestDist<=ORBdist)
-                {
-                    CurrentFrame.mvpMapPoints[bestIdx2]=pMP;
-                    nmatches++;
+            if(mbCheckOrientation)
+            {
+                rotHist.Add(vKeysUn[i].angle,CurrentFrame.mvKeysUn[bestIdx2].angle,bestIdx2);
+            }
+        }
+    }
 
-                    if(mbCheckOrientation)
+    if(mbCheckOrientation)
                     {
-                        float rot = pKF->mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
-                        if(rot<0.0)
-                            rot+=360.0f;
-                        int bin = round(rot*factor);
-                        if(bin==HISTO_LENGTH)
-                            bin=0;
-                        assert(bin>=0 && bin<HISTO_LENGTH);
-                        rotHist[bin].push_back(bestIdx2);
+                        rotHist.Add(vKeysUn[i].angle,CurrentFrame.mvKeysUn[bestIdx2].angle,bestIdx2);
                     }
                 }
 
@@ -1596,93 +1640,41 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
 
     if(mbCheckOrientation)
     {
-        int ind1=-1;
-        int ind2=-1;
-        int ind3=-1;
-
-        ComputeThreeMaxima(rotHist,HISTO_LENGTH,ind1,ind2,ind3);
-
-        for(int i=0; i<HISTO_LENGTH; i++)
+        const vector<int> &vRejected = rotHist.ComputeRejected();
+        MATCHER_COUNT(nRotationRejected,vRejected.size());
+        for(size_t j=0, jend=vRejected.size(); j<jend; j++)
         {
-            if(i!=ind1 && i!=ind2 && i!=ind3)
-            {
-                for(size_t j=0, jend=rotHist[i].size(); j<jend; j++)
-                {
-                    CurrentFrame.mvpMapPoints[rotHist[i][j]]=NULL;
-                    nmatches--;
-                }
-            }
+            CurrentFrame.mvpMapPoints[vRejected[j]]=NULL;
+            nmatches--;
         }
     }
 
+    MATCHER_COUNT(nMatches,nmatches);
     return nmatches;
 }
 
-void ORBmatcher::ComputeThreeMaxima(vector<int>* histo, const int L, int &ind1, int &ind2, int &ind3)
+int ORBmatcher::DescriptorDistance(const cv::Mat &a, const cv::Mat &b)
 {
-    int max1=0;
-    int max2=0;
-    int max3=0;
-
-    // searches for the 3 biggest peaks in the histogram
-    // (three most common value ranges)
-    for(int i=0; i<L; i++)
-    {
-        const int s = histo[i].size();
-        if(s>max1)
-        {
-            max3=max2;
-            max2=max1;
-            max1=s;
-            ind3=ind2;
-            ind2=ind1;
-            ind1=i;
-        }
-        else if(s>max2)
-        {
-            max3=max2;
-            max2=s;
-            ind3=ind2;
-            ind2=i;
-        }
-        else if(s>max3)
-        {
-            max3=s;
-            ind3=i;
-        }
-    }
-
-    // if max2 or max3 are much smaller than max1 just ignore them
-    if(max2<0.1f*(float)max1)
-    {
-        ind2=-1;
-        ind3=-1;
-    }
-    else if(max3<0.1f*(float)max1)
-    {
-        ind3=-1;
-    }
+    MATCHER_COUNT(nDistances,1);
+    return HammingDistance::Compute(a.ptr<uint8_t>(),b.ptr<uint8_t>());
 }
 
-
-// Bit set count operation from
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
-int ORBmatcher::DescriptorDistance(const cv::Mat &a, const cv::Mat &b)
+void ORBmatcher::DescriptorDistances(const cv::Mat &query, const cv::Mat &descriptors,
+                                     const vector<size_t> &vIndices, vector<int> &vDistances)
 {
-    const int *pa = a.ptr<int32_t>();
-    const int *pb = b.ptr<int32_t>();
+    DescriptorDistances(query.ptr<uint8_t>(),descriptors.ptr<uint8_t>(),descriptors.step[0],vIndices,vDistances);
+}
 
-    int dist=0;
+void ORBmatcher::DescriptorDistances(const uint8_t* query, const uint8_t* block, const size_t step,
+                                     const vector<size_t> &vIndices, vector<int> &vDistances)
+{
+    MATCHER_COUNT(nDistances,vIndices.size());
+    vDistances.resize(vIndices.size());
 
-    for(int i=0; i<8; i++, pa++, pb++)
-    {
-        unsigned  int v = *pa ^ *pb;
-        v = v - ((v >> 1) & 0x55555555);
-        v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-        dist += (((v + (v >> 4)) & 0xF0F0F0F) * 0x1010101) >> 24;
-    }
+    if(vIndices.empty())
+        return;
 
-    return dist;
+    HammingDistance::ComputeBatch(query,block,step,&vIndices[0],vIndices.size(),&vDistances[0]);
 }
 
 } //namespace ORB_SLAM
@@ -0,0 +1,73 @@
+#include "ObjectPool.h"
+
+#include <algorithm>
+#include <new>
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// every block has to be suitably aligned for any object
+const size_t kBlockAlignment = 16;
+}
+
+ObjectPool::ObjectPool(const size_t nBlockSize, const size_t nBlocksPerChunk):
+    mnBlockSize((std::max(nBlockSize, sizeof(FreeBlock)) + kBlockAlignment - 1) / kBlockAlignment * kBlockAlignment),
+    mnBlocksPerChunk(std::max<size_t>(nBlocksPerChunk, 1)), mpFreeList(NULL), mpChunkPos(NULL),
+    mnChunkRemaining(0), mnAllocated(0)
+{
+}
+
+void* ObjectPool::Allocate()
+{
+    std::unique_lock<std::mutex> lock(mMutexPool);
+
+    mnAllocated++;
+
+    if(mpFreeList)
+    {
+        FreeBlock* pBlock = mpFreeList;
+        mpFreeList = pBlock->pNext;
+        return pBlock;
+    }
+
+    if(mnChunkRemaining==0)
+    {
+        // throws std::bad_alloc like a plain new would
+        mpChunkPos = static_cast<char*>(::operator new(mnBlockSize*mnBlocksPerChunk));
+        mvpChunks.push_back(mpChunkPos);
+        mnChunkRemaining = mnBlocksPerChunk;
+    }
+
+    void* p = mpChunkPos;
+    mpChunkPos += mnBlockSize;
+    mnChunkRemaining--;
+    return p;
+}
+
+void ObjectPool::Free(void* p)
+{
+    if(!p)
+        return;
+
+    std::unique_lock<std::mutex> lock(mMutexPool);
+    FreeBlock* pBlock = static_cast<FreeBlock*>(p);
+    pBlock->pNext = mpFreeList;
+    mpFreeList = pBlock;
+    mnAllocated--;
+}
+
+size_t ObjectPool::GetNumAllocated()
+{
+    std::unique_lock<std::mutex> lock(mMutexPool);
+    return mnAllocated;
+}
+
+size_t ObjectPool::GetCapacity()
+{
+    std::unique_lock<std::mutex> lock(mMutexPool);
+    return mvpChunks.size()*mnBlocksPerChunk;
+}
+
+} //namespace ORB_SLAM
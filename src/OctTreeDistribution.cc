@@ -0,0 +1,236 @@
+#include "OctTreeDistribution.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+int OctTreeDistribution::NewNode(const int ulx, const int uly, const int brx, const int bry, const int begin,
+                                 const int end)
+{
+    Node n;
+    n.ulx = ulx;
+    n.uly = uly;
+    n.brx = brx;
+    n.bry = bry;
+    n.begin = begin;
+    n.end = end;
+    n.prev = -1;
+    n.next = -1;
+    n.bNoMore = end-begin==1;
+    mvNodes.push_back(n);
+    return mvNodes.size()-1;
+}
+
+void OctTreeDistribution::Divide(const int node, int children[4])
+{
+    // A copy, the children may move the arena
+    const Node n = mvNodes[node];
+    const int halfX = ceil(static_cast<float>(n.brx-n.ulx)/2);
+    const int halfY = ceil(static_cast<float>(n.bry-n.uly)/2);
+    const int midX = n.ulx+halfX;
+    const int midY = n.uly+halfY;
+
+    // Stable partition of the range into upper left, upper right, bottom left, bottom right
+    const vector<cv::KeyPoint> &vKeys = *mpKeys;
+    int counts[4] = {0,0,0,0};
+    for(int i=n.begin; i<n.end; i++)
+    {
+        const cv::Point2f &pt = vKeys[mvIndices[i]].pt;
+        const unsigned char q = (pt.x<midX ? 0 : 1) + (pt.y<midY ? 0 : 2);
+        mvQuadrants[i] = q;
+        counts[q]++;
+    }
+
+    int starts[4];
+    starts[0] = n.begin;
+    for(int q=1; q<4; q++)
+        starts[q] = starts[q-1]+counts[q-1];
+
+    int pos[4] = {starts[0],starts[1],starts[2],starts[3]};
+    for(int i=n.begin; i<n.end; i++)
+        mvScratch[pos[mvQuadrants[i]]++] = mvIndices[i];
+    copy(mvScratch.begin()+n.begin,mvScratch.begin()+n.end,mvIndices.begin()+n.begin);
+
+    const int ulx[4] = {n.ulx, midX, n.ulx, midX};
+    const int uly[4] = {n.uly, n.uly, midY, midY};
+    const int brx[4] = {midX, n.brx, midX, n.brx};
+    const int bry[4] = {midY, midY, n.bry, n.bry};
+    for(int q=0; q<4; q++)
+        children[q] = counts[q]>0 ? NewNode(ulx[q],uly[q],brx[q],bry[q],starts[q],starts[q]+counts[q]) : -1;
+}
+
+void OctTreeDistribution::PushFront(const int node)
+{
+    mvNodes[node].prev = -1;
+    mvNodes[node].next = mnHead;
+    if(mnHead>=0)
+        mvNodes[mnHead].prev = node;
+    mnHead = node;
+    mnSize++;
+}
+
+int OctTreeDistribution::Erase(const int node)
+{
+    const int prev = mvNodes[node].prev;
+    const int next = mvNodes[node].next;
+    if(prev>=0)
+        mvNodes[prev].next = next;
+    else
+        mnHead = next;
+    if(next>=0)
+        mvNodes[next].prev = prev;
+    mnSize--;
+    return next;
+}
+
+void OctTreeDistribution::Distribute(const vector<cv::KeyPoint> &vKeys, const int minX, const int maxX,
+                                     const int minY, const int maxY, const int N, vector<cv::KeyPoint> &vResult)
+{
+    mpKeys = &vKeys;
+    mvNodes.clear();
+    mnHead = -1;
+    mnSize = 0;
+    const int nKeys = vKeys.size();
+    mvIndices.resize(nKeys);
+    mvScratch.resize(nKeys);
+    mvQuadrants.resize(nKeys);
+
+    // Compute how many initial nodes, at least one if the image is higher than wide
+    const int nIni = max(static_cast<int>(round(static_cast<float>(maxX-minX)/(maxY-minY))),1);
+    const float hX = static_cast<float>(maxX-minX)/nIni;
+
+    // Sort the keypoints into the initial nodes, in their order
+    vector<int> &vNodeOfKey = mvScratch;
+    mvIniCounts.assign(nIni,0);
+    for(int i=0; i<nKeys; i++)
+    {
+        const int node = min(static_cast<int>(vKeys[i].pt.x/hX),nIni-1);
+        vNodeOfKey[i] = node;
+        mvIniCounts[node]++;
+    }
+    mvIniPos.resize(nIni);
+    for(int i=0, begin=0; i<nIni; i++)
+    {
+        mvIniPos[i] = begin;
+        begin += mvIniCounts[i];
+    }
+    for(int i=0; i<nKeys; i++)
+        mvIndices[mvIniPos[vNodeOfKey[i]]++] = i;
+
+    // Initial nodes without keypoints are left out, in the order of the list
+    int tail = -1;
+    for(int i=0, begin=0; i<nIni; i++)
+    {
+        const int end = begin+mvIniCounts[i];
+        if(end>begin)
+        {
+            const int node = NewNode(hX*static_cast<float>(i),0,hX*static_cast<float>(i+1),maxY-minY,begin,end);
+            mvNodes[node].prev = tail;
+            if(tail>=0)
+                mvNodes[tail].next = node;
+            else
+                mnHead = node;
+            tail = node;
+            mnSize++;
+        }
+        begin = end;
+    }
+
+    bool bFinish = false;
+    int children[4];
+
+    while(!bFinish)
+    {
+        int prevSize = mnSize;
+        int nToExpand = 0;
+        mvSizeAndNode.clear();
+
+        int lit = mnHead;
+        while(lit>=0)
+        {
+            // If node only contains one point do not subdivide and continue
+            if(mvNodes[lit].bNoMore)
+            {
+                lit = mvNodes[lit].next;
+                continue;
+            }
+
+            // If more than one point, subdivide, the children go in front of the list
+            Divide(lit,children);
+            for(int q=0; q<4; q++)
+            {
+                if(children[q]<0)
+                    continue;
+                PushFront(children[q]);
+                if(mvNodes[children[q]].Size()>1)
+                {
+                    nToExpand++;
+                    mvSizeAndNode.push_back(make_pair(mvNodes[children[q]].Size(),children[q]));
+                }
+            }
+            lit = Erase(lit);
+        }
+
+        // Finish if there are more nodes than required features or all nodes contain just one point
+        if(mnSize>=N || mnSize==prevSize)
+        {
+            bFinish = true;
+        }
+        // when there are still lots of nodes to expand but not actually that many more features
+        // need to be created, the largest nodes are divided first. It just assumes that there
+        // will be about 3 features in every node to expand.
+        else if(mnSize+nToExpand*3>N) //param
+        {
+            while(!bFinish)
+            {
+                prevSize = mnSize;
+
+                mvPrevSizeAndNode.swap(mvSizeAndNode);
+                mvSizeAndNode.clear();
+
+                sort(mvPrevSizeAndNode.begin(),mvPrevSizeAndNode.end());
+                for(int j=mvPrevSizeAndNode.size()-1; j>=0; j--)
+                {
+                    const int node = mvPrevSizeAndNode[j].second;
+                    Divide(node,children);
+                    for(int q=0; q<4; q++)
+                    {
+                        if(children[q]<0)
+                            continue;
+                        PushFront(children[q]);
+                        if(mvNodes[children[q]].Size()>1)
+                            mvSizeAndNode.push_back(make_pair(mvNodes[children[q]].Size(),children[q]));
+                    }
+                    Erase(node);
+
+                    if(mnSize>=N)
+                        break;
+                }
+
+                if(mnSize>=N || mnSize==prevSize)
+                    bFinish = true;
+            }
+        }
+    }
+
+    // Retain the best point in each node, the first one of the strongest
+    vResult.clear();
+    vResult.reserve(mnSize);
+    for(int lit=mnHead; lit>=0; lit=mvNodes[lit].next)
+    {
+        const Node &n = mvNodes[lit];
+        int best = mvIndices[n.begin];
+        for(int i=n.begin+1; i<n.end; i++)
+        {
+            if(vKeys[mvIndices[i]].response>vKeys[best].response)
+                best = mvIndices[i];
+        }
+        vResult.push_back(vKeys[best]);
+    }
+}
+
+} //namespace ORB_SLAM
@@ -22,61 +22,802 @@
 
 #include "Thirdparty/g2o/g2o/core/block_solver.h"
 #include "Thirdparty/g2o/g2o/core/optimization_algorithm_levenberg.h"
+#include "Thirdparty/g2o/g2o/core/solver.h"
 #include "Thirdparty/g2o/g2o/solvers/linear_solver_eigen.h"
 #include "Thirdparty/g2o/g2o/types/types_six_dof_expmap.h"
 #include "Thirdparty/g2o/g2o/core/robust_kernel_impl.h"
+#include "Thirdparty/g2o/g2o/core/hyper_graph_action.h"
 #include "Thirdparty/g2o/g2o/solvers/linear_solver_dense.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_pcg.h"
 #include "Thirdparty/g2o/g2o/types/types_seven_dof_expmap.h"
 
 #include<Eigen/StdVector>
 
 #include "Converter.h"
-
+#include "EssentialGraph.h"
+#include "LocalBAProblem.h"
+#include "PoseSolver.h"
+#include "StageTimer.h"
+#include "ThreadPool.h"
+#include "WorkCounters.h"
+
+#include<chrono>
+#include<limits>
 #include<mutex>
+#include<queue>
+#include<thread>
+#include<unordered_map>
+#include<unordered_set>
+
+#ifdef G2O_OPENMP
+#include<omp.h>
+#endif
 
 namespace ORB_SLAM2
 {
 
+namespace
+{
+// Threads of the map-wide problems, 0: all cores (Optimizer::SetMaxThreads)
+atomic<int> gnMaxOptimizerThreads(0);
+
+// The OpenMP thread count is kept per calling thread. The map-wide problems (local and global BA,
+// essential graph) linearize their edges and build the Schur complement with all cores, the small
+// problems of the tracking thread stay serial so they do not compete with local mapping for them.
+void SetOptimizerThreads(const bool bParallel)
+{
+#ifdef G2O_OPENMP
+    const int nMaxThreads = gnMaxOptimizerThreads.load(memory_order_relaxed);
+    const int nProcs = omp_get_num_procs();
+    omp_set_num_threads(bParallel ? (nMaxThreads>0 ? min(nMaxThreads,nProcs) : nProcs) : 1);
+#else
+    (void) bParallel;
+#endif
+}
+
+// Sparse solver of the reduced camera system. The elimination ordering and the symbolic
+// factorization are computed once per optimization and reused by all its iterations.
+template<class TBlockSolver>
+typename TBlockSolver::LinearSolverType* CreateSparseLinearSolver(const bool bPCG, const bool bBlockOrdering)
+{
+    typedef typename TBlockSolver::PoseMatrixType PoseMatrixType;
+    if(bPCG)
+        return new g2o::LinearSolverPCG<PoseMatrixType>();
+
+    g2o::LinearSolverEigen<PoseMatrixType>* pSolver = new g2o::LinearSolverEigen<PoseMatrixType>();
+    pSolver->setBlockOrdering(bBlockOrdering);
+    return pSolver;
+}
+
+double SecondsSince(const chrono::steady_clock::time_point &t)
+{
+    return chrono::duration<double>(chrono::steady_clock::now()-t).count();
+}
+
+#ifdef ORB_SLAM2_WORK_COUNTERS
+// Chi2 of the edges of the last initializeOptimization, at the current estimate
+double ActiveChi2(g2o::SparseOptimizer &optimizer)
+{
+    optimizer.computeActiveErrors();
+    return optimizer.activeChi2();
+}
+
+double InlierChi2(const PoseSolver &solver, const Frame* pFrame, const vector<size_t> &vnIndexEdgeMono,
+                  const vector<size_t> &vnIndexEdgeStereo, const vector<Frame*> &vpRigFrames,
+                  const vector<pair<size_t,size_t> > &vnIndexEdgeRig)
+{
+    double chi2 = 0.0;
+    for(size_t i=0; i<vnIndexEdgeMono.size(); i++)
+        if(!pFrame->mvbOutlier[vnIndexEdgeMono[i]])
+            chi2 += solver.Chi2Mono(i);
+    for(size_t i=0; i<vnIndexEdgeStereo.size(); i++)
+        if(!pFrame->mvbOutlier[vnIndexEdgeStereo[i]])
+            chi2 += solver.Chi2Stereo(i);
+    for(size_t i=0; i<vnIndexEdgeRig.size(); i++)
+        if(!vpRigFrames[vnIndexEdgeRig[i].first]->mvbOutlier[vnIndexEdgeRig[i].second])
+            chi2 += solver.Chi2Rig(i);
+    return chi2;
+}
+#endif
+
+// Sensor policies of PoseOptimization, chosen once per frame. The monocular instance never reads
+// the right coordinates and has no stereo loops. RGB-D keypoints carry a virtual right coordinate,
+// so RGB-D frames take the stereo instance, whose keypoints can still be monocular (no match or no
+// depth) and are told apart one by one.
+struct MonocularSensor
+{
+    static const bool bStereo = false;
+};
+
+struct StereoSensor
+{
+    static const bool bStereo = true;
+};
+
+// Adds the observations of the frame to the solver. Returns the number of correspondences.
+template<class TSensor>
+int AddFrameObservations(PoseSolver &solver, Frame* pFrame, vector<size_t> &vnIndexEdgeMono,
+                         vector<size_t> &vnIndexEdgeStereo)
+{
+    int nCorrespondences = 0;
+    for(int i=0; i<pFrame->N; i++)
+    {
+        MapPoint* pMP = pFrame->mvpMapPoints[i];
+        if(!pMP)
+            continue;
+
+        nCorrespondences++;
+        pFrame->mvbOutlier[i] = false;
+
+        const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
+        const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
+        Eigen::Vector3f Xw;
+        pMP->GetWorldPos(Xw);
 
-void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust)
+        // Monocular observation
+        if(!TSensor::bStereo || pFrame->mvuRight[i]<0)
+        {
+            solver.AddMono(Xw,kpUn.pt.x,kpUn.pt.y,invSigma2);
+            vnIndexEdgeMono.push_back(i);
+        }
+        else  // Stereo observation
+        {
+            solver.AddStereo(Xw,kpUn.pt.x,kpUn.pt.y,pFrame->mvuRight[i],invSigma2);
+            vnIndexEdgeStereo.push_back(i);
+        }
+    }
+    return nCorrespondences;
+}
+
+// Classifies the observations of the frame as inliers or outliers. Returns the number of outliers.
+template<class TSensor>
+int ClassifyFrameObservations(PoseSolver &solver, Frame* pFrame, const vector<size_t> &vnIndexEdgeMono,
+                              const vector<size_t> &vnIndexEdgeStereo, const float chi2Mono, const float chi2Stereo)
 {
-    vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
-    vector<MapPoint*> vpMP = pMap->GetAllMapPoints();
-    BundleAdjustment(vpKFs,vpMP,nIterations,pbStopFlag, nLoopKF, bRobust);
+    int nBad = 0;
+    for(size_t i=0, iend=vnIndexEdgeMono.size(); i<iend; i++)
+    {
+        const bool bOutlier = solver.Chi2Mono(i)>chi2Mono;
+        pFrame->mvbOutlier[vnIndexEdgeMono[i]] = bOutlier;
+        solver.SetInlierMono(i,!bOutlier);
+        nBad += bOutlier;
+    }
+
+    if(TSensor::bStereo)
+    {
+        for(size_t i=0, iend=vnIndexEdgeStereo.size(); i<iend; i++)
+        {
+            const bool bOutlier = solver.Chi2Stereo(i)>chi2Stereo;
+            pFrame->mvbOutlier[vnIndexEdgeStereo[i]] = bOutlier;
+            solver.SetInlierStereo(i,!bOutlier);
+            nBad += bOutlier;
+        }
+    }
+    return nBad;
 }
 
+// Stops the iterations of an optimizer once the deadline of the budget has passed or the
+// optimization converged (Optimizer::SetConvergence), and keeps the chi2 of every iteration for
+// the report. g2o checks a single stop flag, so with any of them it gets mbStop and the caller's
+// flag is copied into it after every iteration. Otherwise the caller's flag is used as before.
+class IterationControl : public g2o::HyperGraphAction
+{
+public:
+    IterationControl(g2o::SparseOptimizer &optimizer, bool* pbStopFlag, const Optimizer::BABudget* pBudget,
+                     Optimizer::BAReport* pReport, const float fRelativeChi2, const float fMinUpdateNorm):
+        mOptimizer(optimizer), mpbStopFlag(pbStopFlag), mpBudget(pBudget), mpReport(pReport),
+        mfRelativeChi2(fRelativeChi2), mfMinUpdateNorm(fMinUpdateNorm), mbStop(false), mbDeadlineReached(false),
+        mbConverged(false), mLastChi2(0)
+    {
+        mbActive = mpBudget || mpReport || mfRelativeChi2>0 || mfMinUpdateNorm>0;
+        if(mbActive)
+        {
+            mOptimizer.setForceStopFlag(&mbStop);
+            mOptimizer.addPostIterationAction(this);
+        }
+        else
+            mOptimizer.setForceStopFlag(pbStopFlag);
+    }
+
+    ~IterationControl()
+    {
+        if(mbActive)
+            mOptimizer.removePostIterationAction(this);
+        mOptimizer.setForceStopFlag(NULL);
+    }
+
+    // After initializeOptimization, before the iterations of a round. A new round (the local BA
+    // without the outliers) starts unconverged.
+    void StartRound()
+    {
+        if(!mbActive)
+            return;
+        mbConverged = false;
+        mbStop = mbDeadlineReached || (mpbStopFlag && *mpbStopFlag);
+        mOptimizer.computeActiveErrors();
+        mLastChi2 = mOptimizer.activeRobustChi2();
+        if(mpReport)
+            mpReport->vChi2.push_back(mLastChi2);
+    }
+
+    virtual g2o::HyperGraphAction* operator()(const g2o::HyperGraph*, Parameters* = 0)
+    {
+        if(mpbStopFlag && *mpbStopFlag)
+            mbStop = true;
+        if(Remaining()<=0)
+        {
+            mbStop = true;
+            mbDeadlineReached = true;
+        }
+
+        // The errors are those of the step the algorithm kept
+        const double chi2 = mOptimizer.activeRobustChi2();
+        if(mpReport)
+            mpReport->vChi2.push_back(chi2);
+        if(mfRelativeChi2>0 && mLastChi2-chi2<mfRelativeChi2*mLastChi2)
+            mbConverged = true;
+        else if(mfMinUpdateNorm>0 && UpdateNorm()<mfMinUpdateNorm)
+            mbConverged = true;
+        mLastChi2 = chi2;
+        if(mbConverged)
+        {
+            mbStop = true;
+            if(mpReport)
+                mpReport->bConverged = true;
+        }
+        return this;
+    }
+
+    // Seconds left, infinite without a budget
+    double Remaining() const
+    {
+        if(!mpBudget)
+            return numeric_limits<double>::infinity();
+        return chrono::duration<double>(mpBudget->deadline-chrono::steady_clock::now()).count();
+    }
+
+    bool DeadlineReached() const { return mbDeadlineReached; }
+
+    void SetDeadlineReached() { mbDeadlineReached = true; }
+
+protected:
+    // Of the last increment of all the estimates
+    double UpdateNorm()
+    {
+        g2o::OptimizationAlgorithmWithHessian* pAlgorithm =
+                dynamic_cast<g2o::OptimizationAlgorithmWithHessian*>(mOptimizer.solver());
+        if(!pAlgorithm || !pAlgorithm->solver())
+            return numeric_limits<double>::infinity();
+        const g2o::Solver* pSolver = pAlgorithm->solver();
+        return Eigen::Map<const Eigen::VectorXd>(pSolver->x(),pSolver->vectorSize()).norm();
+    }
+
+    g2o::SparseOptimizer &mOptimizer;
+    bool* mpbStopFlag;
+    const Optimizer::BABudget* mpBudget;
+    Optimizer::BAReport* mpReport;
+    const float mfRelativeChi2;
+    const float mfMinUpdateNorm;
+    bool mbActive;
+    bool mbStop;
+    bool mbDeadlineReached;
+    bool mbConverged;
+    double mLastChi2;
+};
+
+// Edges over the chi2 of 95% of the inliers, by their dimension
+int CountOutliers(const g2o::SparseOptimizer &optimizer)
+{
+    int nOutliers = 0;
+    for(g2o::HyperGraph::EdgeSet::const_iterator it=optimizer.edges().begin(); it!=optimizer.edges().end(); it++)
+    {
+        const g2o::OptimizableGraph::Edge* e = static_cast<const g2o::OptimizableGraph::Edge*>(*it);
+        if(e->level()!=0)
+            continue;
+        const int d = e->dimension();
+        if((d==2 && e->chi2()>5.991) || (d==3 && e->chi2()>7.815)) //param
+            nOutliers++;
+    }
+    return nOutliers;
+}
+
+// Graphs up to this size keep the solver of their workspace and its buffers
+const size_t MAX_KEPT_VERTICES = 1000; //param
+
+// Use of the optimizer of a workspace, a thread local optimizer a kind of problem reuses from one
+// call to the next with its algorithm, block solver and Jacobian workspace. The vertices and edges
+// come from and go back to the pools of the g2o types. On exit the graph is cleared, and after a
+// large graph the algorithm is dropped too, so it does not hold the buffers of a map-wide system.
+class ScopedOptimizer
+{
+public:
+    ScopedOptimizer(g2o::SparseOptimizer &optimizer, const size_t nMaxKeptVertices=MAX_KEPT_VERTICES):
+        mOptimizer(optimizer), mnMaxKeptVertices(nMaxKeptVertices)
+    {
+        mOptimizer.clear();
+    }
+
+    ~ScopedOptimizer()
+    {
+        const bool bLarge = mOptimizer.vertices().size()>mnMaxKeptVertices;
+        mOptimizer.clear();
+        if(bLarge)
+        {
+            g2o::OptimizationAlgorithm* pAlgorithm = mOptimizer.algorithm();
+            mOptimizer.setAlgorithm(NULL);
+            delete pAlgorithm;
+        }
+    }
+
+protected:
+    g2o::SparseOptimizer &mOptimizer;
+    const size_t mnMaxKeptVertices;
+};
+}
+
+Optimizer::eLinearSolver Optimizer::meLinearSolver = Optimizer::SPARSE_CHOLESKY;
+bool Optimizer::mbBlockOrdering = false;
+float Optimizer::mfConvergenceChi2 = 0;
+float Optimizer::mfMinUpdateNorm = 0;
+bool Optimizer::mbSinglePrecision = false;
+atomic<size_t> Optimizer::mnPeakBAMemory(0);
+int Optimizer::mnPartitionKeyFrames = 0;
+
+size_t Optimizer::EstimateMemoryUsage(const g2o::SparseOptimizer &optimizer)
+{
+    // An entry of the id map or the edge set is about four pointers
+    const size_t nNode = 4*sizeof(void*);
+
+    size_t bytes = 0;
+    for(g2o::HyperGraph::VertexIDMap::const_iterator it=optimizer.vertices().begin(); it!=optimizer.vertices().end(); it++)
+    {
+        const int d = static_cast<const g2o::OptimizableGraph::Vertex*>(it->second)->dimension();
+        bytes += sizeof(g2o::VertexSE3Expmap)+nNode+d*d*sizeof(double);
+    }
+
+    for(g2o::HyperGraph::EdgeSet::const_iterator it=optimizer.edges().begin(); it!=optimizer.edges().end(); it++)
+    {
+        const g2o::HyperGraph::Edge* e = *it;
+        bytes += sizeof(g2o::EdgeStereoSE3ProjectXYZ)+sizeof(g2o::RobustKernelHuber)+nNode;
+        // Off diagonal block of the Hessian
+        if(e->vertices().size()==2)
+            bytes += static_cast<const g2o::OptimizableGraph::Vertex*>(e->vertex(0))->dimension()*
+                     static_cast<const g2o::OptimizableGraph::Vertex*>(e->vertex(1))->dimension()*sizeof(double);
+    }
+    return bytes;
+}
+
+size_t Optimizer::GetPeakBundleAdjustmentMemory()
+{
+    return mnPeakBAMemory.load(memory_order_relaxed);
+}
+
+void Optimizer::SetLinearSolver(const eLinearSolver solver, const bool bBlockOrdering)
+{
+    meLinearSolver = solver;
+    mbBlockOrdering = bBlockOrdering;
+}
+
+void Optimizer::SetConvergence(const float fRelativeChi2, const float fMinUpdateNorm)
+{
+    mfConvergenceChi2 = max(fRelativeChi2,0.0f);
+    mfMinUpdateNorm = max(fMinUpdateNorm,0.0f);
+}
+
+void Optimizer::SetSinglePrecision(const bool bSinglePrecision)
+{
+    mbSinglePrecision = bSinglePrecision;
+}
+
+void Optimizer::SetMaxThreads(const int nThreads)
+{
+    gnMaxOptimizerThreads.store(max(nThreads,0),memory_order_relaxed);
+}
+
+void Optimizer::SetPartitionedGlobalBA(const int nKeyFrames)
+{
+    mnPartitionKeyFrames = max(nKeyFrames,0);
+}
+
+void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                       const BABudget* pBudget, BAReport* pReport)
+{
+    const IndexedStore<KeyFrame>::Snapshot pKFs = pMap->GetKeyFramesSnapshot();
+    const IndexedStore<MapPoint>::Snapshot pMPs = pMap->GetMapPointsSnapshot();
+    if(mnPartitionKeyFrames>0 && pKFs->size()>static_cast<size_t>(mnPartitionKeyFrames))
+        PartitionedBundleAdjustment(*pKFs,*pMPs,mnPartitionKeyFrames,nIterations,pbStopFlag,nLoopKF,bRobust,pBudget,pReport);
+    else
+        BundleAdjustment(*pKFs,*pMPs,nIterations,pbStopFlag, nLoopKF, bRobust, vector<KeyFrame*>(), pBudget, pReport);
+}
+
+
+void Optimizer::RegionBundleAdjustment(const vector<KeyFrame *> &vpRegionKF, int nIterations, bool* pbStopFlag,
+                                       const unsigned long nLoopKF, const bool bRobust,
+                                       const BABudget* pBudget, BAReport* pReport)
+{
+    // Points seen by the region
+    vector<MapPoint*> vpMPs;
+    for(size_t i=0; i<vpRegionKF.size(); i++)
+    {
+        KeyFrame* pKFi = vpRegionKF[i];
+        pKFi->mnBARegionForKF = nLoopKF;
+    }
+    for(size_t i=0; i<vpRegionKF.size(); i++)
+    {
+        const vector<MapPoint*> vpMPsKFi = vpRegionKF[i]->GetMapPointMatches();
+        for(size_t j=0; j<vpMPsKFi.size(); j++)
+        {
+            MapPoint* pMP = vpMPsKFi[j];
+            if(!pMP || pMP->isBad() || pMP->mnBARegionForKF==nLoopKF)
+                continue;
+            pMP->mnBARegionForKF = nLoopKF;
+            vpMPs.push_back(pMP);
+        }
+    }
+
+    // Keyframes outside the region which see those points, they stay fixed
+    vector<KeyFrame*> vpFixedKFs;
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        const ObservationList observations = vpMPs[i]->GetObservations();
+        for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        {
+            KeyFrame* pKFi = mit->first;
+            if(pKFi->mnBARegionForKF!=nLoopKF && pKFi->mnBARegionFixedForKF!=nLoopKF && !pKFi->isBad())
+            {
+                pKFi->mnBARegionFixedForKF = nLoopKF;
+                vpFixedKFs.push_back(pKFi);
+            }
+        }
+    }
+
+    BundleAdjustment(vpRegionKF,vpMPs,nIterations,pbStopFlag,nLoopKF,bRobust,vpFixedKFs,pBudget,pReport);
+}
+
+namespace
+{
+// Keyframes of vpKFs (indices) split into submaps of up to nPartitionKF. A submap grows from the
+// first keyframe not in one yet, by the keyframe reached through the strongest covisibility link.
+vector<vector<size_t> > PartitionKeyFrames(const vector<KeyFrame*> &vpKFs, const unordered_map<KeyFrame*,size_t> &mIndices,
+                                           const size_t nPartitionKF)
+{
+    vector<bool> vbAssigned(vpKFs.size(),false);
+    vector<vector<size_t> > vvPartitions;
+    for(size_t iSeed=0; iSeed<vpKFs.size(); iSeed++)
+    {
+        if(vbAssigned[iSeed] || !mIndices.count(vpKFs[iSeed]))
+            continue;
+
+        vvPartitions.push_back(vector<size_t>());
+        vector<size_t> &vPartition = vvPartitions.back();
+
+        // By the weight of the link, keyframes taken meanwhile are skipped
+        priority_queue<pair<int,size_t> > frontier;
+        frontier.push(make_pair(numeric_limits<int>::max(),iSeed));
+        while(!frontier.empty() && vPartition.size()<nPartitionKF)
+        {
+            const size_t i = frontier.top().second;
+            frontier.pop();
+            if(vbAssigned[i])
+                continue;
+            vbAssigned[i] = true;
+            vPartition.push_back(i);
+
+            const KeyFrame::CovisibilitySnapshot pConnections = vpKFs[i]->GetCovisibilitySnapshot();
+            const vector<KeyFrame*> &vpNeighbors = pConnections->KeyFrames();
+            const vector<int> &vWeights = pConnections->Weights();
+            for(size_t j=0; j<vpNeighbors.size(); j++)
+            {
+                const unordered_map<KeyFrame*,size_t>::const_iterator it = mIndices.find(vpNeighbors[j]);
+                if(it!=mIndices.end() && !vbAssigned[it->second])
+                    frontier.push(make_pair(vWeights[j],it->second));
+            }
+        }
+    }
+    return vvPartitions;
+}
+
+// Points the keyframes see, once, and the keyframes of the problem outside vbFree which observe
+// them. The point indices are those in vpMP of the whole problem.
+void CollectSubproblem(const vector<KeyFrame*> &vpFreeKFs, const unordered_map<KeyFrame*,size_t> &mKFIndices,
+                       const vector<bool> &vbFree, const unordered_map<MapPoint*,size_t> &mMPIndices,
+                       vector<MapPoint*> &vpMPs, vector<size_t> &vnMPIndices, vector<KeyFrame*> &vpFixedKFs,
+                       vector<size_t> &vnFixedIndices)
+{
+    unordered_set<MapPoint*> sMPs;
+    for(size_t i=0; i<vpFreeKFs.size(); i++)
+    {
+        const vector<MapPoint*> vpMatches = vpFreeKFs[i]->GetMapPointMatches();
+        for(size_t j=0; j<vpMatches.size(); j++)
+        {
+            MapPoint* pMP = vpMatches[j];
+            if(!pMP || pMP->isBad())
+                continue;
+            const unordered_map<MapPoint*,size_t>::const_iterator it = mMPIndices.find(pMP);
+            if(it!=mMPIndices.end() && sMPs.insert(pMP).second)
+            {
+                vpMPs.push_back(pMP);
+                vnMPIndices.push_back(it->second);
+            }
+        }
+    }
+
+    unordered_set<KeyFrame*> sFixedKFs;
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        const ObservationList observations = vpMPs[i]->GetObservations();
+        for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        {
+            KeyFrame* pKFi = mit->first;
+            const unordered_map<KeyFrame*,size_t>::const_iterator it = mKFIndices.find(pKFi);
+            if(it==mKFIndices.end() || vbFree[it->second] || pKFi->isBad() || !sFixedKFs.insert(pKFi).second)
+                continue;
+            vpFixedKFs.push_back(pKFi);
+            vnFixedIndices.push_back(it->second);
+        }
+    }
+}
+}
+
+void Optimizer::PartitionedBundleAdjustment(const vector<KeyFrame*> &vpKFs, const vector<MapPoint*> &vpMP,
+                                            const int nPartitionKF, int nIterations, bool* pbStopFlag,
+                                            const unsigned long nLoopKF, const bool bRobust,
+                                            const BABudget* pBudget, BAReport* pReport)
+{
+    OPTIMIZER_COUNTER(BUNDLE_ADJUSTMENT);
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+
+    unordered_map<KeyFrame*,size_t> mKFIndices;
+    for(size_t i=0; i<vpKFs.size(); i++)
+        if(!vpKFs[i]->isBad())
+            mKFIndices[vpKFs[i]] = i;
+    unordered_map<MapPoint*,size_t> mMPIndices;
+    for(size_t i=0; i<vpMP.size(); i++)
+        if(!vpMP[i]->isBad())
+            mMPIndices[vpMP[i]] = i;
+
+    const vector<vector<size_t> > vvPartitions = PartitionKeyFrames(vpKFs,mKFIndices,max(nPartitionKF,1));
+    const int nPartitions = vvPartitions.size();
+
+    // The submaps one thread each, a submap is not parallelized itself
+    const int nProcs = max(static_cast<int>(thread::hardware_concurrency()),1);
+    const int nMaxThreads = gnMaxOptimizerThreads.load(memory_order_relaxed);
+    const int nThreads = min(nPartitions,nMaxThreads>0 ? min(nMaxThreads,nProcs) : nProcs);
+    ThreadPool threadPool(max(nThreads,1)-1,ThreadConfig::GLOBAL_BA);
+
+    vector<BAEstimates> vResults(nPartitions);
+    vector<BAReport> vReports(nPartitions);
+    vector<vector<size_t> > vvnMPIndices(nPartitions);
+    threadPool.ParallelFor(nPartitions, [&](int p)
+    {
+        SetOptimizerThreads(false);
+
+        const vector<size_t> &vPartition = vvPartitions[p];
+        vector<bool> vbFree(vpKFs.size(),false);
+        vector<KeyFrame*> vpSubKFs;
+        for(size_t k=0; k<vPartition.size(); k++)
+        {
+            vbFree[vPartition[k]] = true;
+            vpSubKFs.push_back(vpKFs[vPartition[k]]);
+        }
+
+        vector<MapPoint*> vpSubMPs;
+        vector<KeyFrame*> vpFixedKFs;
+        vector<size_t> vnFixedIndices;
+        CollectSubproblem(vpSubKFs,mKFIndices,vbFree,mMPIndices,vpSubMPs,vvnMPIndices[p],vpFixedKFs,vnFixedIndices);
+
+        SolveBundleAdjustment(vpSubKFs,vpSubMPs,vpFixedKFs,NULL,nIterations,pbStopFlag,bRobust,pBudget,
+                              pReport ? &vReports[p] : NULL,vResults[p]);
+    });
+
+    // Stitched: the poses of their submap, the points seen by several submaps at the mean
+    BAEstimates stitched;
+    stitched.vPoses.assign(vpKFs.size(),g2o::Vector7d::Zero());
+    stitched.vPoints.assign(vpMP.size(),Eigen::Vector3d::Zero());
+    stitched.vbIncluded.assign(vpMP.size(),false);
+    vector<int> vnEstimates(vpMP.size(),0);
+    for(int p=0; p<nPartitions; p++)
+    {
+        for(size_t k=0; k<vvPartitions[p].size(); k++)
+            stitched.vPoses[vvPartitions[p][k]] = vResults[p].vPoses[k];
+        for(size_t j=0; j<vvnMPIndices[p].size(); j++)
+        {
+            if(!vResults[p].vbIncluded[j])
+                continue;
+            const size_t i = vvnMPIndices[p][j];
+            stitched.vPoints[i] += vResults[p].vPoints[j];
+            vnEstimates[i]++;
+        }
+    }
+    for(size_t i=0; i<vpMP.size(); i++)
+    {
+        if(vnEstimates[i]==0)
+            continue;
+        stitched.vPoints[i] /= vnEstimates[i];
+        stitched.vbIncluded[i] = true;
+    }
+
+    // Boundary: the keyframes which see a shared point, with all their points
+    vector<bool> vbBoundary(vpKFs.size(),false);
+    vector<KeyFrame*> vpBoundaryKFs;
+    vector<size_t> vnBoundaryIndices;
+    for(size_t i=0; i<vpMP.size(); i++)
+    {
+        if(vnEstimates[i]<2 || vpMP[i]->isBad())
+            continue;
+        const ObservationList observations = vpMP[i]->GetObservations();
+        for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        {
+            const unordered_map<KeyFrame*,size_t>::const_iterator it = mKFIndices.find(mit->first);
+            if(it==mKFIndices.end() || vbBoundary[it->second] || stitched.vPoses[it->second].isZero())
+                continue;
+            vbBoundary[it->second] = true;
+            vpBoundaryKFs.push_back(mit->first);
+            vnBoundaryIndices.push_back(it->second);
+        }
+    }
+
+    BAReport boundaryReport;
+    if(!vpBoundaryKFs.empty())
+    {
+        SetOptimizerThreads(true);
+
+        vector<MapPoint*> vpBoundaryMPs;
+        vector<size_t> vnMPIndices;
+        vector<KeyFrame*> vpFixedKFs;
+        vector<size_t> vnFixedIndices;
+        CollectSubproblem(vpBoundaryKFs,mKFIndices,vbBoundary,mMPIndices,vpBoundaryMPs,vnMPIndices,vpFixedKFs,vnFixedIndices);
+
+        // Keyframes culled meanwhile have no pose to start from
+        BAEstimates initial;
+        for(size_t k=0; k<vnBoundaryIndices.size(); k++)
+            initial.vPoses.push_back(stitched.vPoses[vnBoundaryIndices[k]]);
+        size_t nFixed = 0;
+        for(size_t k=0; k<vpFixedKFs.size(); k++)
+        {
+            if(stitched.vPoses[vnFixedIndices[k]].isZero())
+                continue;
+            vpFixedKFs[nFixed] = vpFixedKFs[k];
+            initial.vFixedPoses.push_back(stitched.vPoses[vnFixedIndices[k]]);
+            nFixed++;
+        }
+        vpFixedKFs.resize(nFixed);
+        size_t nPoints = 0;
+        for(size_t j=0; j<vpBoundaryMPs.size(); j++)
+        {
+            if(!stitched.vbIncluded[vnMPIndices[j]])
+                continue;
+            vpBoundaryMPs[nPoints] = vpBoundaryMPs[j];
+            vnMPIndices[nPoints] = vnMPIndices[j];
+            initial.vPoints.push_back(stitched.vPoints[vnMPIndices[j]]);
+            nPoints++;
+        }
+        vpBoundaryMPs.resize(nPoints);
+        vnMPIndices.resize(nPoints);
+
+        BAEstimates boundary;
+        SolveBundleAdjustment(vpBoundaryKFs,vpBoundaryMPs,vpFixedKFs,&initial,nIterations,pbStopFlag,bRobust,pBudget,
+                              pReport ? &boundaryReport : NULL,boundary);
+        for(size_t k=0; k<vnBoundaryIndices.size(); k++)
+            if(!boundary.vPoses[k].isZero())
+                stitched.vPoses[vnBoundaryIndices[k]] = boundary.vPoses[k];
+        for(size_t j=0; j<vnMPIndices.size(); j++)
+            if(boundary.vbIncluded[j])
+                stitched.vPoints[vnMPIndices[j]] = boundary.vPoints[j];
+    }
+
+    if(pReport)
+    {
+        // The iterations of the slowest submap and the boundary, the chi2 of the boundary
+        *pReport = BAReport();
+        pReport->nKeyFrames = vpKFs.size();
+        pReport->nMapPoints = vpMP.size();
+        pReport->nFixedKeyFrames = boundaryReport.nFixedKeyFrames;
+        pReport->bConverged = true;
+        int nIterationsSubmaps = 0;
+        for(int p=0; p<nPartitions; p++)
+        {
+            nIterationsSubmaps = max(nIterationsSubmaps,vReports[p].nIterations);
+            pReport->nOutliers += vReports[p].nOutliers;
+            pReport->bDeadlineReached |= vReports[p].bDeadlineReached;
+            pReport->bConverged &= vReports[p].bConverged;
+        }
+        pReport->nIterations = nIterationsSubmaps+boundaryReport.nIterations;
+        pReport->vChi2 = boundaryReport.vChi2;
+        pReport->bDeadlineReached |= boundaryReport.bDeadlineReached;
+        pReport->tBudget = nPartitions>0 ? vReports[0].tBudget : 0;
+        pReport->tElapsed = SecondsSince(tStart);
+    }
+
+    StoreBundleAdjustment(vpKFs,vpMP,stitched,nLoopKF);
+}
 
 void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<MapPoint *> &vpMP,
-                                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust)
+                                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                 const vector<KeyFrame*> &vpFixedKF, const BABudget* pBudget, BAReport* pReport)
 {
-    vector<bool> vbNotIncludedMP;
-    vbNotIncludedMP.resize(vpMP.size());
+    OPTIMIZER_COUNTER(BUNDLE_ADJUSTMENT);
+    SetOptimizerThreads(true);
 
-    g2o::SparseOptimizer optimizer;
-    g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
+    BAEstimates estimates;
+    SolveBundleAdjustment(vpKFs,vpMP,vpFixedKF,NULL,nIterations,pbStopFlag,bRobust,pBudget,pReport,estimates);
+    StoreBundleAdjustment(vpKFs,vpMP,estimates,nLoopKF);
+}
 
-    linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
+void Optimizer::SolveBundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<MapPoint *> &vpMP,
+                                      const vector<KeyFrame*> &vpFixedKF, const BAEstimates* pInitial,
+                                      int nIterations, bool* pbStopFlag, const bool bRobust,
+                                      const BABudget* pBudget, BAReport* pReport, BAEstimates &result)
+{
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+
+    vector<bool> &vbIncludedMP = result.vbIncluded;
+    vbIncludedMP.assign(vpMP.size(),false);
 
-    g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
+    static thread_local g2o::SparseOptimizer optimizer;
+    ScopedOptimizer scopedOptimizer(optimizer);
+    if(!optimizer.algorithm())
+    {
+        g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-    optimizer.setAlgorithm(solver);
+        linearSolver = CreateSparseLinearSolver<g2o::BlockSolver_6_3>(meLinearSolver==PCG, mbBlockOrdering);
 
-    if(pbStopFlag)
-        optimizer.setForceStopFlag(pbStopFlag);
+        g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
+
+        g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+        optimizer.setAlgorithm(solver);
+    }
+
+    IterationControl deadline(optimizer, pbStopFlag, pBudget, pReport, mfConvergenceChi2, mfMinUpdateNorm);
+    const double tBudget = deadline.Remaining()+SecondsSince(tStart);
 
     long unsigned int maxKFid = 0;
 
+    // Keypoints of the keyframes read once, expanded if cold
+    unordered_map<KeyFrame*,KeyFrame::Features> mFeatures;
+
     // Set KeyFrame vertices
     for(size_t i=0; i<vpKFs.size(); i++)
     {
         KeyFrame* pKF = vpKFs[i];
         if(pKF->isBad())
             continue;
+        mFeatures[pKF] = pKF->GetFeatures();
         g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
-        vSE3->setEstimate(Converter::toSE3Quat(pKF->GetPose()));
+        if(pInitial)
+            vSE3->setEstimate(g2o::SE3Quat(pInitial->vPoses[i]));
+        else
+        {
+            Eigen::Matrix3f Rcw;
+            Eigen::Vector3f tcw;
+            pKF->GetPose(Rcw,tcw);
+            vSE3->setEstimate(Converter::toSE3Quat(Rcw,tcw));
+        }
         vSE3->setId(pKF->mnId);
-        vSE3->setFixed(pKF->mnId==0);
+        vSE3->setFixed(pKF->IsOrigin());
+        optimizer.addVertex(vSE3);
+        if(pKF->mnId>maxKFid)
+            maxKFid=pKF->mnId;
+    }
+
+    for(size_t i=0; i<vpFixedKF.size(); i++)
+    {
+        KeyFrame* pKF = vpFixedKF[i];
+        if(pKF->isBad())
+            continue;
+        mFeatures[pKF] = pKF->GetFeatures();
+        g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
+        if(pInitial)
+            vSE3->setEstimate(g2o::SE3Quat(pInitial->vFixedPoses[i]));
+        else
+        {
+            Eigen::Matrix3f Rcw;
+            Eigen::Vector3f tcw;
+            pKF->GetPose(Rcw,tcw);
+            vSE3->setEstimate(Converter::toSE3Quat(Rcw,tcw));
+        }
+        vSE3->setId(pKF->mnId);
+        vSE3->setFixed(true);
         optimizer.addVertex(vSE3);
         if(pKF->mnId>maxKFid)
             maxKFid=pKF->mnId;
@@ -92,28 +833,36 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
         if(pMP->isBad())
             continue;
         g2o::VertexSBAPointXYZ* vPoint = new g2o::VertexSBAPointXYZ();
-        vPoint->setEstimate(Converter::toVector3d(pMP->GetWorldPos()));
+        if(pInitial)
+            vPoint->setEstimate(pInitial->vPoints[i]);
+        else
+        {
+            Eigen::Vector3f Pos;
+            pMP->GetWorldPos(Pos);
+            vPoint->setEstimate(Pos.cast<double>());
+        }
         const int id = pMP->mnId+maxKFid+1;
         vPoint->setId(id);
         vPoint->setMarginalized(true);
         optimizer.addVertex(vPoint);
 
-       const map<KeyFrame*,size_t> observations = pMP->GetObservations();
+       const ObservationList observations = pMP->GetObservations();
 
         int nEdges = 0;
         //SET EDGES
-        for(map<KeyFrame*,size_t>::const_iterator mit=observations.begin(); mit!=observations.end(); mit++)
+        for(ObservationList::const_iterator mit=observations.begin(); mit!=observations.end(); mit++)
         {
 
             KeyFrame* pKF = mit->first;
-            if(pKF->isBad() || pKF->mnId>maxKFid)
+            if(pKF->isBad() || pKF->mnId>maxKFid || !optimizer.vertex(pKF->mnId))
                 continue;
 
             nEdges++;
 
-            const cv::KeyPoint &kpUn = pKF->mvKeysUn[mit->second];
+            const KeyFrame::Features &features = mFeatures[pKF];
+            const cv::KeyPoint &kpUn = features.vKeysUn[mit->second];
 
-            if(pKF->mvuRight[mit->second]<0)
+            if(features.vuRight[mit->second]<0)
             {
                 Eigen::Matrix<double,2,1> obs;
                 obs << kpUn.pt.x, kpUn.pt.y;
@@ -143,7 +892,7 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
             else
             {
                 Eigen::Matrix<double,3,1> obs;
-                const float kp_ur = pKF->mvuRight[mit->second];
+                const float kp_ur = features.vuRight[mit->second];
                 obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
 
                 g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
@@ -173,33 +922,76 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
         }
 
         if(nEdges==0)
-        {
             optimizer.removeVertex(vPoint);
-            vbNotIncludedMP[i]=true;
-        }
         else
-        {
-            vbNotIncludedMP[i]=false;
-        }
+            vbIncludedMP[i]=true;
+    }
+
+    if(pReport)
+    {
+        *pReport = BAReport();
+        pReport->nKeyFrames = vpKFs.size();
+        pReport->nFixedKeyFrames = vpFixedKF.size();
+        pReport->nMapPoints = vpMP.size();
+        pReport->tBudget = tBudget;
     }
 
     // Optimize!
     optimizer.initializeOptimization();
-    optimizer.optimize(nIterations);
+    deadline.StartRound();
+    const int nDoneIterations = optimizer.optimize(nIterations);
+    OPTIMIZER_RESULT(optimizer.activeVertices().size(),optimizer.activeEdges().size(),max(nDoneIterations,0),0,
+                     ActiveChi2(optimizer));
+
+    const size_t nBytes = EstimateMemoryUsage(optimizer);
+    size_t nPeak = mnPeakBAMemory.load(memory_order_relaxed);
+    while(nBytes>nPeak && !mnPeakBAMemory.compare_exchange_weak(nPeak,nBytes,memory_order_relaxed))
+        ;
+
+    if(pReport)
+    {
+        pReport->nIterations = max(nDoneIterations,0);
+        pReport->nOutliers = CountOutliers(optimizer);
+        pReport->bDeadlineReached = deadline.DeadlineReached();
+        pReport->tElapsed = SecondsSince(tStart);
+    }
 
     // Recover optimized data
+    result.vPoses.assign(vpKFs.size(),g2o::Vector7d::Zero());
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        const g2o::VertexSE3Expmap* vSE3 = static_cast<const g2o::VertexSE3Expmap*>(optimizer.vertex(vpKFs[i]->mnId));
+        if(vSE3)
+            result.vPoses[i] = vSE3->estimate().toVector();
+    }
+    result.vFixedPoses.assign(vpFixedKF.size(),g2o::Vector7d::Zero());
+    for(size_t i=0; i<vpFixedKF.size(); i++)
+    {
+        const g2o::VertexSE3Expmap* vSE3 = static_cast<const g2o::VertexSE3Expmap*>(optimizer.vertex(vpFixedKF[i]->mnId));
+        if(vSE3)
+            result.vFixedPoses[i] = vSE3->estimate().toVector();
+    }
+    result.vPoints.assign(vpMP.size(),Eigen::Vector3d::Zero());
+    for(size_t i=0; i<vpMP.size(); i++)
+    {
+        if(vbIncludedMP[i])
+            result.vPoints[i] = static_cast<const g2o::VertexSBAPointXYZ*>(optimizer.vertex(vpMP[i]->mnId+maxKFid+1))->estimate();
+    }
+}
 
+void Optimizer::StoreBundleAdjustment(const vector<KeyFrame*> &vpKFs, const vector<MapPoint*> &vpMP,
+                                      const BAEstimates &estimates, const unsigned long nLoopKF)
+{
     //Keyframes
     for(size_t i=0; i<vpKFs.size(); i++)
     {
         KeyFrame* pKF = vpKFs[i];
-        if(pKF->isBad())
+        if(pKF->isBad() || estimates.vPoses[i].isZero())
             continue;
-        g2o::VertexSE3Expmap* vSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(pKF->mnId));
-        g2o::SE3Quat SE3quat = vSE3->estimate();
+        const g2o::SE3Quat SE3quat(estimates.vPoses[i]);
         if(nLoopKF==0)
         {
-            pKF->SetPose(Converter::toCvMat(SE3quat));
+            pKF->SetPose(SE3quat.rotation().toRotationMatrix().cast<float>(),SE3quat.translation().cast<float>());
         }
         else
         {
@@ -212,151 +1004,82 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     //Points
     for(size_t i=0; i<vpMP.size(); i++)
     {
-        if(vbNotIncludedMP[i])
+        if(!estimates.vbIncluded[i])
             continue;
 
         MapPoint* pMP = vpMP[i];
 
         if(pMP->isBad())
             continue;
-        g2o::VertexSBAPointXYZ* vPoint = static_cast<g2o::VertexSBAPointXYZ*>(optimizer.vertex(pMP->mnId+maxKFid+1));
 
         if(nLoopKF==0)
         {
-            pMP->SetWorldPos(Converter::toCvMat(vPoint->estimate()));
+            pMP->SetWorldPos(Eigen::Vector3f(estimates.vPoints[i].cast<float>()));
             pMP->UpdateNormalAndDepth();
         }
         else
         {
-            pMP->mPosGBA.create(3,1,CV_32F);
-            Converter::toCvMat(vPoint->estimate()).copyTo(pMP->mPosGBA);
+            pMP->mPosGBA = estimates.vPoints[i].cast<float>();
             pMP->mnBAGlobalForKF = nLoopKF;
         }
     }
-
 }
 
 int Optimizer::PoseOptimization(Frame *pFrame)
 {
-    g2o::SparseOptimizer optimizer;
-    g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
-
-    linearSolver = new g2o::LinearSolverDense<g2o::BlockSolver_6_3::PoseMatrixType>();
-
-    g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
+    static const vector<Frame*> vpNoRigFrames;
+    static const vector<cv::Mat> vNoTcr;
+    return PoseOptimization(pFrame,vpNoRigFrames,vNoTcr);
+}
 
-    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-    optimizer.setAlgorithm(solver);
+int Optimizer::PoseOptimization(Frame *pFrame, const vector<Frame*> &vpRigFrames, const vector<cv::Mat> &vTcr)
+{
+    STAGE_TIMER(POSE_OPTIMIZATION);
+    OPTIMIZER_COUNTER(POSE_OPTIMIZATION);
+
+    // One solver per thread (tracking and the relocalization workers), its buffers are reused
+    static thread_local PoseSolver solver;
+    static thread_local vector<size_t> vnIndexEdgeMono;
+    static thread_local vector<size_t> vnIndexEdgeStereo;
+    // Frame and keypoint of the observations of the other cameras of the rig
+    static thread_local vector<pair<size_t,size_t> > vnIndexEdgeRig;
+
+    solver.Reset(pFrame->fx,pFrame->fy,pFrame->cx,pFrame->cy,pFrame->mbf);
+    solver.SetSinglePrecision(mbSinglePrecision);
+    vnIndexEdgeMono.clear();
+    vnIndexEdgeStereo.clear();
+    vnIndexEdgeRig.clear();
 
     int nInitialCorrespondences=0;
 
-    // Set Frame vertex
-    g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
-    vSE3->setEstimate(Converter::toSE3Quat(pFrame->mTcw));
-    vSE3->setId(0);
-    vSE3->setFixed(false);
-    optimizer.addVertex(vSE3);
-
-    // Set MapPoint vertices
-    const int N = pFrame->N;
-
-    vector<g2o::EdgeSE3ProjectXYZOnlyPose*> vpEdgesMono;
-    vector<size_t> vnIndexEdgeMono;
-    vpEdgesMono.reserve(N);
-    vnIndexEdgeMono.reserve(N);
-
-    vector<g2o::EdgeStereoSE3ProjectXYZOnlyPose*> vpEdgesStereo;
-    vector<size_t> vnIndexEdgeStereo;
-    vpEdgesStereo.reserve(N);
-    vnIndexEdgeStereo.reserve(N);
-
-    const float deltaMono = sqrt(5.991);
-    const float deltaStereo = sqrt(7.815);
-
-
     {
-    unique_lock<mutex> lock(MapPoint::mGlobalMutex);
+    unique_lock<MapMutex> lock(LOCK_SITE(MapPoint::mGlobalMutex));
 
-    for(int i=0; i<N; i++)
+    if(pFrame->mbStereo)
+        nInitialCorrespondences += AddFrameObservations<StereoSensor>(solver,pFrame,vnIndexEdgeMono,vnIndexEdgeStereo);
+    else
+        nInitialCorrespondences += AddFrameObservations<MonocularSensor>(solver,pFrame,vnIndexEdgeMono,vnIndexEdgeStereo);
+
+    for(size_t j=0; j<vpRigFrames.size(); j++)
     {
-        MapPoint* pMP = pFrame->mvpMapPoints[i];
-        if(pMP)
+        Frame* pRigFrame = vpRigFrames[j];
+        const size_t nCamera = solver.AddCamera(pRigFrame->fx,pRigFrame->fy,pRigFrame->cx,pRigFrame->cy,
+                                                Converter::toSE3Quat(vTcr[j]));
+        for(int i=0; i<pRigFrame->N; i++)
         {
-            // Monocular observation
-            if(pFrame->mvuRight[i]<0)
-            {
-                nInitialCorrespondences++;
-                pFrame->mvbOutlier[i] = false;
-
-                Eigen::Matrix<double,2,1> obs;
-                const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
-                obs << kpUn.pt.x, kpUn.pt.y;
-
-                g2o::EdgeSE3ProjectXYZOnlyPose* e = new g2o::EdgeSE3ProjectXYZOnlyPose();
-
-                e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-                e->setMeasurement(obs);
-                const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
-                e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
-
-                g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                e->setRobustKernel(rk);
-                rk->setDelta(deltaMono);
-
-                e->fx = pFrame->fx;
-                e->fy = pFrame->fy;
-                e->cx = pFrame->cx;
-                e->cy = pFrame->cy;
-                cv::Mat Xw = pMP->GetWorldPos();
-                e->Xw[0] = Xw.at<float>(0);
-                e->Xw[1] = Xw.at<float>(1);
-                e->Xw[2] = Xw.at<float>(2);
-
-                optimizer.addEdge(e);
-
-                vpEdgesMono.push_back(e);
-                vnIndexEdgeMono.push_back(i);
-            }
-            else  // Stereo observation
-            {
-                nInitialCorrespondences++;
-                pFrame->mvbOutlier[i] = false;
-
-                //SET EDGE
-                Eigen::Matrix<double,3,1> obs;
-                const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
-                const float &kp_ur = pFrame->mvuRight[i];
-                obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
-
-                g2o::EdgeStereoSE3ProjectXYZOnlyPose* e = new g2o::EdgeStereoSE3ProjectXYZOnlyPose();
-
-                e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-                e->setMeasurement(obs);
-                const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
-                Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
-                e->setInformation(Info);
-
-                g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                e->setRobustKernel(rk);
-                rk->setDelta(deltaStereo);
-
-                e->fx = pFrame->fx;
-                e->fy = pFrame->fy;
-                e->cx = pFrame->cx;
-                e->cy = pFrame->cy;
-                e->bf = pFrame->mbf;
-                cv::Mat Xw = pMP->GetWorldPos();
-                e->Xw[0] = Xw.at<float>(0);
-                e->Xw[1] = Xw.at<float>(1);
-                e->Xw[2] = Xw.at<float>(2);
+            MapPoint* pMP = pRigFrame->mvpMapPoints[i];
+            if(!pMP)
+                continue;
 
-                optimizer.addEdge(e);
+            nInitialCorrespondences++;
+            pRigFrame->mvbOutlier[i] = false;
 
-                vpEdgesStereo.push_back(e);
-                vnIndexEdgeStereo.push_back(i);
-            }
+            const cv::KeyPoint &kpUn = pRigFrame->mvKeysUn[i];
+            Eigen::Vector3f Xw;
+            pMP->GetWorldPos(Xw);
+            solver.AddRig(nCamera,Xw,kpUn.pt.x,kpUn.pt.y,pRigFrame->mvInvLevelSigma2[kpUn.octave]);
+            vnIndexEdgeRig.push_back(make_pair(j,static_cast<size_t>(i)));
         }
-
     }
     }
 
@@ -370,118 +1093,112 @@ int Optimizer::PoseOptimization(Frame *pFrame)
     const float chi2Stereo[4]={7.815,7.815,7.815, 7.815};
     const int its[4]={10,10,10,10}; //param
 
+    // every round starts again from the initial pose, only the last one without robust kernel (the
+    // g2o graph dropped the kernels while classifying the third round)
+    const g2o::SE3Quat Tcw0 = Converter::toSE3Quat(pFrame->mTcw);
+    g2o::SE3Quat Tcw = Tcw0;
+
     int nBad=0;
     for(size_t it=0; it<4; it++)
     {
+        Tcw = Tcw0;
+        solver.Optimize(Tcw,its[it],it<3);
+        solver.ComputeChi2(Tcw);
 
-        vSE3->setEstimate(Converter::toSE3Quat(pFrame->mTcw));
-        optimizer.initializeOptimization(0);
-        optimizer.optimize(its[it]);
-
-        nBad=0;
-        for(size_t i=0, iend=vpEdgesMono.size(); i<iend; i++)
-        {
-            g2o::EdgeSE3ProjectXYZOnlyPose* e = vpEdgesMono[i];
-
-            const size_t idx = vnIndexEdgeMono[i];
-
-            if(pFrame->mvbOutlier[idx])
-            {
-                e->computeError();
-            }
-
-            const float chi2 = e->chi2();
-
-            if(chi2>chi2Mono[it])
-            {
-                pFrame->mvbOutlier[idx]=true;
-                e->setLevel(1);
-                nBad++;
-            }
-            else
-            {
-                pFrame->mvbOutlier[idx]=false;
-                e->setLevel(0);
-            }
-
-            if(it==2)
-                e->setRobustKernel(0);
-        }
+        if(pFrame->mbStereo)
+            nBad = ClassifyFrameObservations<StereoSensor>(solver,pFrame,vnIndexEdgeMono,vnIndexEdgeStereo,
+                                                           chi2Mono[it],chi2Stereo[it]);
+        else
+            nBad = ClassifyFrameObservations<MonocularSensor>(solver,pFrame,vnIndexEdgeMono,vnIndexEdgeStereo,
+                                                              chi2Mono[it],chi2Stereo[it]);
 
-        for(size_t i=0, iend=vpEdgesStereo.size(); i<iend; i++)
+        for(size_t i=0, iend=vnIndexEdgeRig.size(); i<iend; i++)
         {
-            g2o::EdgeStereoSE3ProjectXYZOnlyPose* e = vpEdgesStereo[i];
-
-            const size_t idx = vnIndexEdgeStereo[i];
-
-            if(pFrame->mvbOutlier[idx])
-            {
-                e->computeError();
-            }
+            Frame* pRigFrame = vpRigFrames[vnIndexEdgeRig[i].first];
+            const size_t idx = vnIndexEdgeRig[i].second;
 
-            const float chi2 = e->chi2();
-
-            if(chi2>chi2Stereo[it])
-            {
-                pFrame->mvbOutlier[idx]=true;
-                e->setLevel(1);
+            const bool bOutlier = solver.Chi2Rig(i)>chi2Mono[it];
+            pRigFrame->mvbOutlier[idx]=bOutlier;
+            solver.SetInlierRig(i,!bOutlier);
+            if(bOutlier)
                 nBad++;
-            }
-            else
-            {
-                e->setLevel(0);
-                pFrame->mvbOutlier[idx]=false;
-            }
-
-            if(it==2)
-                e->setRobustKernel(0);
         }
 
-        if(optimizer.edges().size()<10) //param
+        if(nInitialCorrespondences<10) //param
             break;
     }
 
     // Recover optimized pose and return number of inliers
-    g2o::VertexSE3Expmap* vSE3_recov = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(0));
-    g2o::SE3Quat SE3quat_recov = vSE3_recov->estimate();
-    cv::Mat pose = Converter::toCvMat(SE3quat_recov);
+    cv::Mat pose = Converter::toCvMat(Tcw);
     pFrame->SetPose(pose);
+    for(size_t j=0; j<vpRigFrames.size(); j++)
+        vpRigFrames[j]->SetPose(vTcr[j]*pose);
+
+    OPTIMIZER_RESULT(1,nInitialCorrespondences,nInitialCorrespondences<10 ? its[0] : its[0]+its[1]+its[2]+its[3],nBad,
+                     InlierChi2(solver,pFrame,vnIndexEdgeMono,vnIndexEdgeStereo,vpRigFrames,vnIndexEdgeRig));
 
     return nInitialCorrespondences-nBad;
 }
 
-void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap)
+void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap, LocalBAProblem* pProblem,
+                                      const BABudget* pBudget, BAReport* pReport,
+                                      const int nIterations, const int nMoreIterations)
 {
-    // Local KeyFrames: First Breath Search from Current Keyframe
+    OPTIMIZER_COUNTER(LOCAL_BUNDLE_ADJUSTMENT);
+    SetOptimizerThreads(true);
+
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+
+    // A global BA or loop correction applied while this one runs moves the poses it started from
+    const int nMapChangeIdx = pMap->GetLastBigChangeIdx();
+
+    // With a budget only the most covisible keyframes are optimized, the others stay fixed
+    size_t nMaxLocalKFs = numeric_limits<size_t>::max();
+    if(pBudget && pBudget->nMaxKeyFrames>0)
+        nMaxLocalKFs = pBudget->nMaxKeyFrames;
+
+    // Local KeyFrames: First Breath Search from Current Keyframe. The keyframes of the other
+    // cameras of a rig have no vertex, they are moved with the keyframe of the first camera.
     list<KeyFrame*> lLocalKeyFrames;
 
-    lLocalKeyFrames.push_back(pKF);
-    pKF->mnBALocalForKF = pKF->mnId;
+    KeyFrame* pBody = pKF->GetRigBody();
+    lLocalKeyFrames.push_back(pBody);
+    pBody->mnBALocalForKF = pKF->mnId;
 
     const vector<KeyFrame*> vNeighKFs = pKF->GetVectorCovisibleKeyFrames();
-    for(int i=0, iend=vNeighKFs.size(); i<iend; i++)
+    for(int i=0, iend=vNeighKFs.size(); i<iend && lLocalKeyFrames.size()<nMaxLocalKFs; i++)
     {
-        KeyFrame* pKFi = vNeighKFs[i];
+        KeyFrame* pKFi = vNeighKFs[i]->GetRigBody();
+        if(pKFi->mnBALocalForKF==pKF->mnId)
+            continue;
         pKFi->mnBALocalForKF = pKF->mnId;
         if(!pKFi->isBad())
             lLocalKeyFrames.push_back(pKFi);
     }
 
-    // Local MapPoints seen in Local KeyFrames
+    // Local MapPoints seen in Local KeyFrames and the keyframes of their rig
     list<MapPoint*> lLocalMapPoints;
     for(list<KeyFrame*>::iterator lit=lLocalKeyFrames.begin() , lend=lLocalKeyFrames.end(); lit!=lend; lit++)
     {
-        vector<MapPoint*> vpMPs = (*lit)->GetMapPointMatches();
-        for(vector<MapPoint*>::iterator vit=vpMPs.begin(), vend=vpMPs.end(); vit!=vend; vit++)
+        for(size_t j=0, jend=(*lit)->mvpRigKFs.size(); j<=jend; j++)
         {
-            MapPoint* pMP = *vit;
-            if(pMP)
-                if(!pMP->isBad())
-                    if(pMP->mnBALocalForKF!=pKF->mnId)
-                    {
-                        lLocalMapPoints.push_back(pMP);
-                        pMP->mnBALocalForKF=pKF->mnId;
-                    }
+            KeyFrame* pKFj = j==0 ? *lit : (*lit)->mvpRigKFs[j-1];
+            if(j>0 && pKFj->isBad())
+                continue;
+
+            const KeyFrame::MapPointMatchesSnapshot pMatches = pKFj->GetMapPointMatchesSnapshot();
+            const vector<MapPoint*> &vpMPs = *pMatches;
+            for(vector<MapPoint*>::const_iterator vit=vpMPs.begin(), vend=vpMPs.end(); vit!=vend; vit++)
+            {
+                MapPoint* pMP = *vit;
+                if(pMP)
+                    if(!pMP->isBad())
+                        if(pMP->mnBALocalForKF!=pKF->mnId)
+                        {
+                            lLocalMapPoints.push_back(pMP);
+                            pMP->mnBALocalForKF=pKF->mnId;
+                        }
+            }
         }
     }
 
@@ -489,10 +1206,11 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     list<KeyFrame*> lFixedCameras;
     for(list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++)
     {
-        map<KeyFrame*,size_t> observations = (*lit)->GetObservations();
-        for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        const MapPoint::ObservationsSnapshot pObservations = (*lit)->GetObservationsSnapshot();
+        const ObservationList &observations = *pObservations;
+        for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
         {
-            KeyFrame* pKFi = mit->first;
+            KeyFrame* pKFi = mit->first->GetRigBody();
 
             if(pKFi->mnBALocalForKF!=pKF->mnId && pKFi->mnBAFixedForKF!=pKF->mnId)
             {
@@ -503,161 +1221,58 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
         }
     }
 
-    // Setup optimizer
-    g2o::SparseOptimizer optimizer;
-    g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
-
-    linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
-
-    g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
-
-    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-    optimizer.setAlgorithm(solver);
-
-    if(pbStopFlag)
-        optimizer.setForceStopFlag(pbStopFlag);
-
-    unsigned long maxKFid = 0;
+    // Setup optimizer. The graph of the previous window is kept, only the keyframes, points and
+    // observations which entered or left the window are added or removed.
+    LocalBAProblem problem;
+    if(!pProblem)
+        pProblem = &problem;
 
-    // Set Local KeyFrame vertices
-    for(list<KeyFrame*>::iterator lit=lLocalKeyFrames.begin(), lend=lLocalKeyFrames.end(); lit!=lend; lit++)
+    g2o::SparseOptimizer &optimizer = pProblem->GetOptimizer();
+    if(!optimizer.algorithm())
     {
-        KeyFrame* pKFi = *lit;
-        g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
-        vSE3->setEstimate(Converter::toSE3Quat(pKFi->GetPose()));
-        vSE3->setId(pKFi->mnId);
-        vSE3->setFixed(pKFi->mnId==0);
-        optimizer.addVertex(vSE3);
-        if(pKFi->mnId>maxKFid)
-            maxKFid=pKFi->mnId;
-    }
+        g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-    // Set Fixed KeyFrame vertices
-    for(list<KeyFrame*>::iterator lit=lFixedCameras.begin(), lend=lFixedCameras.end(); lit!=lend; lit++)
-    {
-        KeyFrame* pKFi = *lit;
-        g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
-        vSE3->setEstimate(Converter::toSE3Quat(pKFi->GetPose()));
-        vSE3->setId(pKFi->mnId);
-        vSE3->setFixed(true);
-        optimizer.addVertex(vSE3);
-        if(pKFi->mnId>maxKFid)
-            maxKFid=pKFi->mnId;
-    }
-
-    // Set MapPoint vertices
-    const int nExpectedSize = (lLocalKeyFrames.size()+lFixedCameras.size())*lLocalMapPoints.size();
+        linearSolver = CreateSparseLinearSolver<g2o::BlockSolver_6_3>(false, mbBlockOrdering);
 
-    vector<g2o::EdgeSE3ProjectXYZ*> vpEdgesMono;
-    vpEdgesMono.reserve(nExpectedSize);
+        g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
 
-    vector<KeyFrame*> vpEdgeKFMono;
-    vpEdgeKFMono.reserve(nExpectedSize);
+        g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+        optimizer.setAlgorithm(solver);
+    }
 
-    vector<MapPoint*> vpMapPointEdgeMono;
-    vpMapPointEdgeMono.reserve(nExpectedSize);
+    IterationControl deadline(optimizer, pbStopFlag, pBudget, pReport, mfConvergenceChi2, mfMinUpdateNorm);
 
-    vector<g2o::EdgeStereoSE3ProjectXYZ*> vpEdgesStereo;
-    vpEdgesStereo.reserve(nExpectedSize);
+    pProblem->Update(lLocalKeyFrames,lFixedCameras,lLocalMapPoints);
 
-    vector<KeyFrame*> vpEdgeKFStereo;
-    vpEdgeKFStereo.reserve(nExpectedSize);
+    const vector<g2o::EdgeSE3ProjectXYZ*> &vpEdgesMono = pProblem->mvpEdgesMono;
+    const vector<KeyFrame*> &vpEdgeKFMono = pProblem->mvpEdgeKFMono;
+    const vector<MapPoint*> &vpMapPointEdgeMono = pProblem->mvpMapPointEdgeMono;
 
-    vector<MapPoint*> vpMapPointEdgeStereo;
-    vpMapPointEdgeStereo.reserve(nExpectedSize);
+    const vector<g2o::EdgeStereoSE3ProjectXYZ*> &vpEdgesStereo = pProblem->mvpEdgesStereo;
+    const vector<KeyFrame*> &vpEdgeKFStereo = pProblem->mvpEdgeKFStereo;
+    const vector<MapPoint*> &vpMapPointEdgeStereo = pProblem->mvpMapPointEdgeStereo;
 
-    const float thHuberMono = sqrt(5.991);
-    const float thHuberStereo = sqrt(7.815);
+    const vector<g2o::EdgeSE3ProjectXYZRig*> &vpEdgesRig = pProblem->mvpEdgesRig;
+    const vector<KeyFrame*> &vpEdgeKFRig = pProblem->mvpEdgeKFRig;
+    const vector<MapPoint*> &vpMapPointEdgeRig = pProblem->mvpMapPointEdgeRig;
 
-    for(list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++)
+    if(pReport)
     {
-        MapPoint* pMP = *lit;
-        g2o::VertexSBAPointXYZ* vPoint = new g2o::VertexSBAPointXYZ();
-        vPoint->setEstimate(Converter::toVector3d(pMP->GetWorldPos()));
-        int id = pMP->mnId+maxKFid+1;
-        vPoint->setId(id);
-        vPoint->setMarginalized(true);
-        optimizer.addVertex(vPoint);
-
-        const map<KeyFrame*,size_t> observations = pMP->GetObservations();
-
-        //Set edges
-        for(map<KeyFrame*,size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
-        {
-            KeyFrame* pKFi = mit->first;
-
-            if(!pKFi->isBad())
-            {
-                const cv::KeyPoint &kpUn = pKFi->mvKeysUn[mit->second];
-
-                // Monocular observation
-                if(pKFi->mvuRight[mit->second]<0)
-                {
-                    Eigen::Matrix<double,2,1> obs;
-                    obs << kpUn.pt.x, kpUn.pt.y;
-
-                    g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
-
-                    e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
-                    e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFi->mnId)));
-                    e->setMeasurement(obs);
-                    const float &invSigma2 = pKFi->mvInvLevelSigma2[kpUn.octave];
-                    e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
-
-                    g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                    e->setRobustKernel(rk);
-                    rk->setDelta(thHuberMono);
-
-                    e->fx = pKFi->fx;
-                    e->fy = pKFi->fy;
-                    e->cx = pKFi->cx;
-                    e->cy = pKFi->cy;
-
-                    optimizer.addEdge(e);
-                    vpEdgesMono.push_back(e);
-                    vpEdgeKFMono.push_back(pKFi);
-                    vpMapPointEdgeMono.push_back(pMP);
-                }
-                else // Stereo observation
-                {
-                    Eigen::Matrix<double,3,1> obs;
-                    const float kp_ur = pKFi->mvuRight[mit->second];
-                    obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
-
-                    g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
-
-                    e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
-                    e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFi->mnId)));
-                    e->setMeasurement(obs);
-                    const float &invSigma2 = pKFi->mvInvLevelSigma2[kpUn.octave];
-                    Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
-                    e->setInformation(Info);
-
-                    g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                    e->setRobustKernel(rk);
-                    rk->setDelta(thHuberStereo);
-
-                    e->fx = pKFi->fx;
-                    e->fy = pKFi->fy;
-                    e->cx = pKFi->cx;
-                    e->cy = pKFi->cy;
-                    e->bf = pKFi->mbf;
-
-                    optimizer.addEdge(e);
-                    vpEdgesStereo.push_back(e);
-                    vpEdgeKFStereo.push_back(pKFi);
-                    vpMapPointEdgeStereo.push_back(pMP);
-                }
-            }
-        }
+        *pReport = BAReport();
+        pReport->nKeyFrames = lLocalKeyFrames.size();
+        pReport->nFixedKeyFrames = lFixedCameras.size();
+        pReport->nMapPoints = lLocalMapPoints.size();
+        pReport->tBudget = deadline.Remaining()+SecondsSince(tStart);
     }
 
     if(pbStopFlag)
         if(*pbStopFlag)
             return;
 
+    const chrono::steady_clock::time_point tFirstRound = chrono::steady_clock::now();
     optimizer.initializeOptimization();
-    optimizer.optimize(5); //param
+    deadline.StartRound();
+    const int nDoneIterations = max(optimizer.optimize(nIterations),0);
 
     bool bDoMore= true;
 
@@ -665,6 +1280,28 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
         if(*pbStopFlag)
             bDoMore = false;
 
+    // The second round only gets the iterations which fit in the time left, at the speed of the first
+    int nOutlierRoundIterations = nMoreIterations;
+    if(nOutlierRoundIterations<=0)
+        bDoMore = false;
+    if(bDoMore && pBudget)
+    {
+        const double tIteration = SecondsSince(tFirstRound)/max(nDoneIterations,1);
+        const double tRemaining = deadline.Remaining();
+        if(deadline.DeadlineReached() || tRemaining<tIteration)
+        {
+            deadline.SetDeadlineReached();
+            bDoMore = false;
+        }
+        else if(tRemaining<nOutlierRoundIterations*tIteration)
+        {
+            nOutlierRoundIterations = static_cast<int>(tRemaining/tIteration);
+            deadline.SetDeadlineReached();
+        }
+    }
+
+    int nOutlierIterations = 0;
+
     if(bDoMore)
     {
 
@@ -681,8 +1318,6 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
         {
             e->setLevel(1);
         }
-
-        e->setRobustKernel(0);
     }
 
     for(size_t i=0, iend=vpEdgesStereo.size(); i<iend;i++)
@@ -697,19 +1332,42 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
         {
             e->setLevel(1);
         }
+    }
 
-        e->setRobustKernel(0);
+    for(size_t i=0, iend=vpEdgesRig.size(); i<iend;i++)
+    {
+        g2o::EdgeSE3ProjectXYZRig* e = vpEdgesRig[i];
+        MapPoint* pMP = vpMapPointEdgeRig[i];
+
+        if(pMP->isBad())
+            continue;
+
+        if(e->chi2()>5.991 || !e->isDepthPositive())
+        {
+            e->setLevel(1);
+        }
     }
 
+    pProblem->DisableRobustKernels();
+
     // Optimize again without the outliers
 
     optimizer.initializeOptimization(0);
-    optimizer.optimize(10); //param
+    deadline.StartRound();
+    nOutlierIterations = max(optimizer.optimize(nOutlierRoundIterations),0);
+
+    }
 
+    if(pReport)
+    {
+        pReport->nIterations = nDoneIterations;
+        pReport->nOutlierIterations = nOutlierIterations;
+        pReport->bOutlierPass = bDoMore;
+        pReport->bDeadlineReached = deadline.DeadlineReached();
     }
 
     vector<pair<KeyFrame*,MapPoint*> > vToErase;
-    vToErase.reserve(vpEdgesMono.size()+vpEdgesStereo.size());
+    vToErase.reserve(vpEdgesMono.size()+vpEdgesStereo.size()+vpEdgesRig.size());
 
     // Check inlier observations
     for(size_t i=0, iend=vpEdgesMono.size(); i<iend;i++)
@@ -742,8 +1400,28 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
         }
     }
 
+    for(size_t i=0, iend=vpEdgesRig.size(); i<iend;i++)
+    {
+        g2o::EdgeSE3ProjectXYZRig* e = vpEdgesRig[i];
+        MapPoint* pMP = vpMapPointEdgeRig[i];
+
+        if(pMP->isBad())
+            continue;
+
+        if(e->chi2()>5.991 || !e->isDepthPositive())
+        {
+            KeyFrame* pKFi = vpEdgeKFRig[i];
+            vToErase.push_back(make_pair(pKFi,pMP));
+        }
+    }
+
+    OPTIMIZER_RESULT(optimizer.activeVertices().size(),optimizer.activeEdges().size(),nIterations+nOutlierIterations,
+                     vToErase.size(),ActiveChi2(optimizer));
+    if(pReport)
+        pReport->nOutliers = vToErase.size();
+
     // Get Map Mutex
-    unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+    MapUpdateLock lock(pMap,LOCK_SITE(pMap->mMutexMapUpdate));
 
     if(!vToErase.empty())
     {
@@ -756,46 +1434,86 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
         }
     }
 
+    // The estimates would undo the correction, the outliers are still outliers. The problem reads
+    // the corrected poses at its next update.
+    if(pMap->GetLastBigChangeIdx()!=nMapChangeIdx)
+    {
+        if(pReport)
+        {
+            pReport->bStale = true;
+            pReport->tElapsed = SecondsSince(tStart);
+        }
+        return;
+    }
+
     // Recover optimized data
 
     //Keyframes
     for(list<KeyFrame*>::iterator lit=lLocalKeyFrames.begin(), lend=lLocalKeyFrames.end(); lit!=lend; lit++)
     {
         KeyFrame* pKF = *lit;
-        g2o::VertexSE3Expmap* vSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(pKF->mnId));
+        g2o::VertexSE3Expmap* vSE3 = pProblem->GetVertex(pKF);
         g2o::SE3Quat SE3quat = vSE3->estimate();
-        pKF->SetPose(Converter::toCvMat(SE3quat));
+        pKF->SetPose(SE3quat.rotation().toRotationMatrix().cast<float>(),SE3quat.translation().cast<float>());
+
+        for(size_t j=0; j<pKF->mvpRigKFs.size(); j++)
+        {
+            KeyFrame* pRigKF = pKF->mvpRigKFs[j];
+            if(pRigKF->isBad())
+                continue;
+            const g2o::SE3Quat SE3rig = Converter::toSE3Quat(pRigKF->mTcr)*SE3quat;
+            pRigKF->SetPose(SE3rig.rotation().toRotationMatrix().cast<float>(),SE3rig.translation().cast<float>());
+        }
     }
 
     //Points
     for(list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++)
     {
         MapPoint* pMP = *lit;
-        g2o::VertexSBAPointXYZ* vPoint = static_cast<g2o::VertexSBAPointXYZ*>(optimizer.vertex(pMP->mnId+maxKFid+1));
-        pMP->SetWorldPos(Converter::toCvMat(vPoint->estimate()));
+        g2o::VertexSBAPointXYZ* vPoint = pProblem->GetVertex(pMP);
+        pMP->SetWorldPos(Eigen::Vector3f(vPoint->estimate().cast<float>()));
         pMP->UpdateNormalAndDepth();
     }
+
+    if(pReport)
+        pReport->tElapsed = SecondsSince(tStart);
 }
 
 
 void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
                                        const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                                        const LoopClosing::KeyFrameAndPose &CorrectedSim3,
-                                       const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale)
+                                       const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale,
+                                       BAReport* pReport, EssentialGraph* pGraph)
 {
-    // Setup optimizer
-    g2o::SparseOptimizer optimizer;
+    OPTIMIZER_COUNTER(ESSENTIAL_GRAPH);
+    SetOptimizerThreads(true);
+
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+
+    // Setup optimizer. The graph keeps the edge topology and the solver from the last loop.
+    EssentialGraph graph;
+    if(!pGraph)
+        pGraph = &graph;
+
+    g2o::SparseOptimizer &optimizer = pGraph->GetOptimizer();
+    ScopedOptimizer scopedOptimizer(optimizer,numeric_limits<size_t>::max());
     optimizer.setVerbose(false);
-    g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
-           new g2o::LinearSolverEigen<g2o::BlockSolver_7_3::PoseMatrixType>();
-    g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
-    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+    if(!optimizer.algorithm())
+    {
+        g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
+               CreateSparseLinearSolver<g2o::BlockSolver_7_3>(meLinearSolver==PCG, mbBlockOrdering);
+        g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
+        g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
 
-    solver->setUserLambdaInit(1e-16);
-    optimizer.setAlgorithm(solver);
+        solver->setUserLambdaInit(1e-16);
+        optimizer.setAlgorithm(solver);
+    }
 
-    const vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
-    const vector<MapPoint*> vpMPs = pMap->GetAllMapPoints();
+    const IndexedStore<KeyFrame>::Snapshot pKFs = pMap->GetKeyFramesSnapshot();
+    const IndexedStore<MapPoint>::Snapshot pMPs = pMap->GetMapPointsSnapshot();
+    const vector<KeyFrame*> &vpKFs = *pKFs;
+    const vector<MapPoint*> &vpMPs = *pMPs;
 
     const unsigned int nMaxKFid = pMap->GetMaxKFid();
 
@@ -824,9 +1542,10 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
         }
         else
         {
-            Eigen::Matrix<double,3,3> Rcw = Converter::toMatrix3d(pKF->GetRotation());
-            Eigen::Matrix<double,3,1> tcw = Converter::toVector3d(pKF->GetTranslation());
-            g2o::Sim3 Siw(Rcw,tcw,1.0);
+            Eigen::Matrix3f Rcw;
+            Eigen::Vector3f tcw;
+            pKF->GetPose(Rcw,tcw);
+            g2o::Sim3 Siw(Rcw.cast<double>(),tcw.cast<double>(),1.0);
             vScw[nIDi] = Siw;
             VSim3->setEstimate(Siw);
         }
@@ -879,114 +1598,80 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
         }
     }
 
-    // Set normal edges
-    for(size_t i=0, iend=vpKFs.size(); i<iend; i++)
-    {
-        KeyFrame* pKF = vpKFs[i];
-
-        const int nIDi = pKF->mnId;
-
-        g2o::Sim3 Swi;
+    // Uncorrected poses, the measurements of the other edges
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vNonCorrectedScw(vScw);
+    for(LoopClosing::KeyFrameAndPose::const_iterator it=NonCorrectedSim3.begin(); it!=NonCorrectedSim3.end(); it++)
+        if(it->first->mnId<=nMaxKFid)
+            vNonCorrectedScw[it->first->mnId] = it->second;
 
-        LoopClosing::KeyFrameAndPose::const_iterator iti = NonCorrectedSim3.find(pKF);
+    // Set normal edges, of the topology kept since the last loop
+    vector<const EssentialGraph::Edges*> vpEdges;
+    pGraph->Update(vpKFs,minFeat,vpEdges);
 
-        if(iti!=NonCorrectedSim3.end())
-            Swi = (iti->second).inverse();
-        else
-            Swi = vScw[nIDi].inverse();
+    for(size_t i=0, iend=vpKFs.size(); i<iend; i++)
+    {
+        const EssentialGraph::Edges* pEdges = vpEdges[i];
+        if(!pEdges)
+            continue;
 
-        KeyFrame* pParentKF = pKF->GetParent();
+        const unsigned long nIDi = vpKFs[i]->mnId;
+        const g2o::Sim3 Swi = vNonCorrectedScw[nIDi].inverse();
 
-        // Spanning tree edge
-        if(pParentKF)
+        // Spanning tree and loop edges
+        for(size_t j=0, jend=pEdges->vnTree.size(); j<jend; j++)
         {
-            int nIDj = pParentKF->mnId;
-
-            g2o::Sim3 Sjw;
-
-            LoopClosing::KeyFrameAndPose::const_iterator itj = NonCorrectedSim3.find(pParentKF);
-
-            if(itj!=NonCorrectedSim3.end())
-                Sjw = itj->second;
-            else
-                Sjw = vScw[nIDj];
-
-            g2o::Sim3 Sji = Sjw * Swi;
+            const unsigned long nIDj = pEdges->vnTree[j];
+            if(nIDj>nMaxKFid || !vpVertices[nIDj])
+                continue;
 
             g2o::EdgeSim3* e = new g2o::EdgeSim3();
-            e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
-            e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-            e->setMeasurement(Sji);
-
+            e->setVertex(1, vpVertices[nIDj]);
+            e->setVertex(0, vpVertices[nIDi]);
+            e->setMeasurement(vNonCorrectedScw[nIDj] * Swi);
             e->information() = matLambda;
             optimizer.addEdge(e);
         }
 
-        // Loop edges
-        const set<KeyFrame*> sLoopEdges = pKF->GetLoopEdges();
-        for(set<KeyFrame*>::const_iterator sit=sLoopEdges.begin(), send=sLoopEdges.end(); sit!=send; sit++)
-        {
-            KeyFrame* pLKF = *sit;
-            if(pLKF->mnId<pKF->mnId)
-            {
-                g2o::Sim3 Slw;
-
-                LoopClosing::KeyFrameAndPose::const_iterator itl = NonCorrectedSim3.find(pLKF);
-
-                if(itl!=NonCorrectedSim3.end())
-                    Slw = itl->second;
-                else
-                    Slw = vScw[pLKF->mnId];
-
-                g2o::Sim3 Sli = Slw * Swi;
-                g2o::EdgeSim3* el = new g2o::EdgeSim3();
-                el->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pLKF->mnId)));
-                el->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-                el->setMeasurement(Sli);
-                el->information() = matLambda;
-                optimizer.addEdge(el);
-            }
-        }
-
         // Covisibility graph edges
-        const vector<KeyFrame*> vpConnectedKFs = pKF->GetCovisiblesByWeight(minFeat);
-        for(vector<KeyFrame*>::const_iterator vit=vpConnectedKFs.begin(); vit!=vpConnectedKFs.end(); vit++)
+        for(size_t j=0, jend=pEdges->vnCovisible.size(); j<jend; j++)
         {
-            KeyFrame* pKFn = *vit;
-            if(pKFn && pKFn!=pParentKF && !pKF->hasChild(pKFn) && !sLoopEdges.count(pKFn))
-            {
-                if(!pKFn->isBad() && pKFn->mnId<pKF->mnId)
-                {
-                    if(sInsertedEdges.count(make_pair(min(pKF->mnId,pKFn->mnId),max(pKF->mnId,pKFn->mnId))))
-                        continue;
-
-                    g2o::Sim3 Snw;
-
-                    LoopClosing::KeyFrameAndPose::const_iterator itn = NonCorrectedSim3.find(pKFn);
-
-                    if(itn!=NonCorrectedSim3.end())
-                        Snw = itn->second;
-                    else
-                        Snw = vScw[pKFn->mnId];
-
-                    g2o::Sim3 Sni = Snw * Swi;
+            const unsigned long nIDj = pEdges->vnCovisible[j];
+            if(nIDj>nMaxKFid || !vpVertices[nIDj])
+                continue;
+            if(sInsertedEdges.count(make_pair(nIDj,nIDi)))
+                continue;
 
-                    g2o::EdgeSim3* en = new g2o::EdgeSim3();
-                    en->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFn->mnId)));
-                    en->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-                    en->setMeasurement(Sni);
-                    en->information() = matLambda;
-                    optimizer.addEdge(en);
-                }
-            }
+            g2o::EdgeSim3* en = new g2o::EdgeSim3();
+            en->setVertex(1, vpVertices[nIDj]);
+            en->setVertex(0, vpVertices[nIDi]);
+            en->setMeasurement(vNonCorrectedScw[nIDj] * Swi);
+            en->information() = matLambda;
+            optimizer.addEdge(en);
         }
     }
 
+    if(pReport)
+    {
+        *pReport = BAReport();
+        pReport->nKeyFrames = vpKFs.size();
+        pReport->nFixedKeyFrames = 1;
+        pReport->nMapPoints = vpMPs.size();
+    }
+
     // Optimize!
+    IterationControl control(optimizer, NULL, NULL, pReport, mfConvergenceChi2, mfMinUpdateNorm);
     optimizer.initializeOptimization();
-    optimizer.optimize(20); //param
+    control.StartRound();
+    const int nDoneIterations = max(optimizer.optimize(20),0); //param
+    OPTIMIZER_RESULT(optimizer.activeVertices().size(),optimizer.activeEdges().size(),nDoneIterations,0,
+                     ActiveChi2(optimizer));
+    if(pReport)
+    {
+        pReport->nIterations = nDoneIterations;
+        pReport->tElapsed = SecondsSince(tStart);
+    }
 
-    unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+    MapUpdateLock lock(pMap,LOCK_SITE(pMap->mMutexMapUpdate));
 
     // SE3 Pose Recovering. Sim3:[sR t;0 1] -> SE3:[R t/s;0 1]
     for(size_t i=0;i<vpKFs.size();i++)
@@ -1004,9 +1689,7 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
         eigt *=(1./s); //[R t/s;0 1]
 
-        cv::Mat Tiw = Converter::toCvSE3(eigR,eigt);
-
-        pKFi->SetPose(Tiw);
+        pKFi->SetPose(eigR.cast<float>(),eigt.cast<float>());
     }
 
     // Correct points. Transform to "non-optimized" reference keyframe pose and transform back with optimized pose
@@ -1032,12 +1715,11 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
         g2o::Sim3 Srw = vScw[nIDr];
         g2o::Sim3 correctedSwr = vCorrectedSwc[nIDr];
 
-        cv::Mat P3Dw = pMP->GetWorldPos();
-        Eigen::Matrix<double,3,1> eigP3Dw = Converter::toVector3d(P3Dw);
-        Eigen::Matrix<double,3,1> eigCorrectedP3Dw = correctedSwr.map(Srw.map(eigP3Dw));
+        Eigen::Vector3f P3Dw;
+        pMP->GetWorldPos(P3Dw);
+        Eigen::Matrix<double,3,1> eigCorrectedP3Dw = correctedSwr.map(Srw.map(P3Dw.cast<double>()));
 
-        cv::Mat cvCorrectedP3Dw = Converter::toCvMat(eigCorrectedP3Dw);
-        pMP->SetWorldPos(cvCorrectedP3Dw);
+        pMP->SetWorldPos(Eigen::Vector3f(eigCorrectedP3Dw.cast<float>()));
 
         pMP->UpdateNormalAndDepth();
     }
@@ -1045,15 +1727,22 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
 int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &vpMatches1, g2o::Sim3 &g2oS12, const float th2, const bool bFixScale)
 {
-    g2o::SparseOptimizer optimizer;
-    g2o::BlockSolverX::LinearSolverType * linearSolver;
+    OPTIMIZER_COUNTER(SIM3);
+    SetOptimizerThreads(false);
 
-    linearSolver = new g2o::LinearSolverDense<g2o::BlockSolverX::PoseMatrixType>();
+    static thread_local g2o::SparseOptimizer optimizer;
+    ScopedOptimizer scopedOptimizer(optimizer);
+    if(!optimizer.algorithm())
+    {
+        g2o::BlockSolverX::LinearSolverType * linearSolver;
 
-    g2o::BlockSolverX * solver_ptr = new g2o::BlockSolverX(linearSolver);
+        linearSolver = new g2o::LinearSolverDense<g2o::BlockSolverX::PoseMatrixType>();
 
-    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-    optimizer.setAlgorithm(solver);
+        g2o::BlockSolverX * solver_ptr = new g2o::BlockSolverX(linearSolver);
+
+        g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+        optimizer.setAlgorithm(solver);
+    }
 
     // Calibration
     const cv::Mat &K1 = pKF1->mK;
@@ -1084,6 +1773,8 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
     // Set MapPoint vertices
     const int N = vpMatches1.size();
     const vector<MapPoint*> vpMapPoints1 = pKF1->GetMapPointMatches();
+    const SharedArray<cv::KeyPoint> vKeysUn1 = pKF1->GetFeatures().vKeysUn;
+    const SharedArray<cv::KeyPoint> vKeysUn2 = pKF2->GetFeatures().vKeysUn;
     vector<g2o::EdgeSim3ProjectXYZ*> vpEdges12;
     vector<g2o::EdgeInverseSim3ProjectXYZ*> vpEdges21;
     vector<size_t> vnIndexEdge;
@@ -1139,7 +1830,7 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
 
         // Set edge x1 = S12*X2
         Eigen::Matrix<double,2,1> obs1;
-        const cv::KeyPoint &kpUn1 = pKF1->mvKeysUn[i];
+        const cv::KeyPoint &kpUn1 = vKeysUn1[i];
         obs1 << kpUn1.pt.x, kpUn1.pt.y;
 
         g2o::EdgeSim3ProjectXYZ* e12 = new g2o::EdgeSim3ProjectXYZ();
@@ -1156,7 +1847,7 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
 
         // Set edge x2 = S21*X1
         Eigen::Matrix<double,2,1> obs2;
-        const cv::KeyPoint &kpUn2 = pKF2->mvKeysUn[i2];
+        const cv::KeyPoint &kpUn2 = vKeysUn2[i2];
         obs2 << kpUn2.pt.x, kpUn2.pt.y;
 
         g2o::EdgeInverseSim3ProjectXYZ* e21 = new g2o::EdgeInverseSim3ProjectXYZ();
@@ -1209,12 +1900,17 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
         nMoreIterations=5; //param
 
     if(nCorrespondences-nBad<10) //param
+    {
+        OPTIMIZER_RESULT(optimizer.activeVertices().size(),optimizer.activeEdges().size(),5,nBad,0.0);
         return 0;
+    }
 
     // Optimize again only with inliers
 
     optimizer.initializeOptimization();
     optimizer.optimize(nMoreIterations);
+    OPTIMIZER_RESULT(optimizer.activeVertices().size(),optimizer.activeEdges().size(),5+nMoreIterations,nBad,
+                     ActiveChi2(optimizer));
 
     int nIn = 0;
     for(size_t i=0; i<vpEdges12.size();i++)
@@ -0,0 +1,161 @@
+#include "PangolinParameters.h"
+
+#include <boost/lexical_cast.hpp>
+
+namespace ORB_SLAM2
+{
+
+void PangolinParameters::createEntries(const std::string& panel_name, ParameterGroup target_group)
+{
+    pangolin::RegisterGuiVarChangedCallback(&onGuiVarChanged, nullptr, panel_name + ".");
+    parametersChanged = true;
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    std::unique_lock<std::mutex> lockParameters(parametersMutex);
+    for(std::map<std::string, ParameterBase*>::iterator it = parametersDict[target_group].begin(); it != parametersDict[target_group].end(); it++)
+    {
+        auto& param = it->second;
+        switch (param->getVariant().which())
+        {
+            case 0: // bool
+                createEntry<bool>(param, panel_name);
+                break;
+            case 1: // int
+                createEntry<int>(param, panel_name);
+                break;
+            case 2: // float
+                createEntry<float>(param, panel_name);
+                break;
+            case 3: // double
+                createEntry<double>(param, panel_name);
+                break;
+        }
+    }
+}
+
+void PangolinParameters::sync()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    for(ParameterPairMap::iterator it_groups = pangolinParams.begin(); it_groups != pangolinParams.end(); it_groups++)
+    {
+        for(std::map<std::string, std::pair<ParameterBase*, PangolinVariants>>::iterator it = it_groups->second.begin(); it != it_groups->second.end(); it++)
+        {
+            auto& pango_var_variant = it->second.second;
+            auto& param = it->second.first;
+
+            const int& type = param->getVariant().which();
+
+            if (type == 0) // bool
+            {
+                updateValue<bool>(param, pango_var_variant);
+            }
+            else if (type == 1) // int
+            {
+                updateValue<int>(param, pango_var_variant);
+            }
+            else if (type == 2) // float
+            {
+                updateValue<float>(param, pango_var_variant);
+            }
+            else if (type == 3) // double
+            {
+                updateValue<double>(param, pango_var_variant);
+            }
+        }
+    }
+}
+
+bool PangolinParameters::hasEntry(const ParameterBase* param)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    ParameterPairMap::iterator it_group = pangolinParams.find(param->getGroup());
+    return it_group != pangolinParams.end() && it_group->second.count(param->getName());
+}
+
+void PangolinParameters::onGuiVarChanged(void* data, const std::string& name, pangolin::VarValueGenericBase& var)
+{
+    parametersChanged = true;
+}
+
+template<typename T>
+void PangolinParameters::createEntry(ParameterBase* param, const std::string& panel_name)
+{
+    if (param->getCategory() == ParameterCategory::BOOL)
+    {
+        pangolinParams[param->getGroup()][param->getName()] = std::make_pair(param, (new pangolin::Var<T>(
+                        panel_name + "." + param->getName(), boost::get<T>(param->getVariant()),
+                        boost::get<T>(param->getMaxValue()))));
+    }
+    else if (param->getCategory() == ParameterCategory::MINMAX)
+    {
+        pangolinParams[param->getGroup()][param->getName()] = std::make_pair(param, (new pangolin::Var<T>(
+                        panel_name + "." + param->getName(), boost::get<T>(param->getVariant()),
+                        boost::get<T>(param->getMinValue()),boost::get<T>(param->getMaxValue()))));
+    }
+    else if (param->getCategory() == ParameterCategory::TEXTINPUT)
+    {
+        pangolinParams[param->getGroup()][param->getName()] = std::make_pair(param, new pangolin::Var<std::string>(
+                    panel_name + "." + param->getName(), std::to_string(boost::get<T>(param->getVariant()))));
+    }
+}
+
+template<typename T>
+void PangolinParameters::updateValue(ParameterBase* param, PangolinVariants& pango_var_variant)
+{
+    // If the ParameterCategory is TEXTINPUT the pangolin::var needs to be cast
+    // from a string to the type value holds in the parameter, this is done here
+    // through a boost::lexical_cast. All other cases are managed by the else block
+    T param_value = boost::get<T>(param->getVariant());
+
+    if (param->getCategory() == ParameterCategory::TEXTINPUT)
+    {
+        auto& pango_var = boost::get<pangolin::Var<std::string>* >(pango_var_variant);
+        T pango_var_value = boost::lexical_cast<T>(pango_var->Get());
+
+        if(changedInCode<T>(param))
+        {
+            // When the parameter value was changed from inside the code
+            // adjust the gui variable to show the updated value
+            pango_var->operator=(std::to_string(param_value));
+            clearChangedInCode<T>(param);
+            DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
+            runCallback(param);
+        }
+        else if(pango_var_value != param_value)
+        {
+            // When the pangolin var value was changed via the user
+            // adjust the parameter to the desired value
+            setValueFromGui<T>(param, pango_var_value);
+            param_value = boost::get<T>(param->getVariant());
+            DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
+            runCallback(param);
+        }
+    }
+    else
+    {
+        auto& pango_var = boost::get<pangolin::Var<T>* >(pango_var_variant);
+
+        if(pango_var->Get() != param_value)
+        {
+            if(changedInCode<T>(param))
+            {
+                // When the parameter value was changed from inside the code
+                // adjust the gui variable to show the updated value
+                pango_var->operator=(param_value);
+                clearChangedInCode<T>(param);
+                DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
+            }
+            else
+            {
+                // When the pangolin var value was changed via the user
+                // adjust the parameter to the desired value
+                setValueFromGui<T>(param, pango_var->Get());
+                param_value = boost::get<T>(param->getVariant());
+                DLOG(INFO) << "Parameter value of " << param->getName() <<" is: " << param_value;
+            }
+            runCallback(param);
+        }
+    }
+}
+
+}
@@ -4,5 +4,9 @@ namespace ORB_SLAM2
 {
     // static variables
     ParameterDictionary ParameterBase::parametersDict;
-    ParameterManager::ParameterPairMap ParameterManager::pangolinParams;
+    std::atomic<bool> ParameterBase::parametersChanged(true);
+    std::atomic<unsigned int> ParameterBase::parametersRegistered(0);
+    std::mutex ParameterBase::parametersMutex;
+    std::vector<ParameterManager::ParameterRequest> ParameterManager::requests;
+    std::atomic<ParameterFrontend*> ParameterManager::frontend(nullptr);
 }
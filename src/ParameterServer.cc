@@ -0,0 +1,277 @@
+#include "ParameterServer.h"
+
+#include "Parameter.h"
+#include "Trace.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int BACKLOG = 4; //param pending connections of the listening socket
+const int PERIOD = 50000; //param microseconds between two polls of the sockets
+const size_t MAX_LINE = 4096; //param longer commands close the connection
+const size_t MAX_OUTBOX = 1<<20; //param clients which don't read their replies are closed
+
+bool SetNonBlocking(const int fd)
+{
+    const int flags = fcntl(fd,F_GETFL,0);
+    return flags>=0 && fcntl(fd,F_SETFL,flags|O_NONBLOCK)==0;
+}
+
+vector<string> SplitFields(const string &line)
+{
+    vector<string> vFields;
+    size_t begin = 0;
+    while(1)
+    {
+        const size_t end = line.find('\t',begin);
+        vFields.push_back(line.substr(begin,end-begin));
+        if(end==string::npos)
+            break;
+        begin = end+1;
+    }
+    return vFields;
+}
+}
+
+ParameterServer::ParameterServer(const int port):
+    mPort(port), mnListenFd(-1), mbFinishRequested(false), mbFinished(true)
+{
+}
+
+ParameterServer::~ParameterServer()
+{
+    for(size_t i=0; i<mvClients.size(); i++)
+        CloseClient(mvClients[i]);
+    if(mnListenFd>=0)
+        close(mnListenFd);
+}
+
+void ParameterServer::Run()
+{
+    Trace::SetThreadName("ParameterServer");
+    mbFinished = false;
+
+    if(Listen())
+        cout << "Serving the parameters on port " << mPort << endl;
+
+    while(1)
+    {
+        if(mnListenFd>=0)
+        {
+            AcceptClients();
+
+            for(size_t i=0; i<mvClients.size(); i++)
+            {
+                Client &client = mvClients[i];
+                if(!Receive(client) || !Send(client))
+                    CloseClient(client);
+            }
+
+            size_t nClients = 0;
+            for(size_t i=0; i<mvClients.size(); i++)
+            {
+                if(mvClients[i].fd>=0)
+                    mvClients[nClients++] = std::move(mvClients[i]);
+            }
+            mvClients.resize(nClients);
+        }
+
+        if(CheckFinish())
+            break;
+
+        usleep(PERIOD);
+    }
+
+    for(size_t i=0; i<mvClients.size(); i++)
+        CloseClient(mvClients[i]);
+    mvClients.clear();
+
+    SetFinish();
+}
+
+bool ParameterServer::Listen()
+{
+    mnListenFd = socket(AF_INET,SOCK_STREAM,0);
+    if(mnListenFd<0)
+    {
+        cerr << "Parameter server: could not create the socket: " << strerror(errno) << endl;
+        return false;
+    }
+
+    const int one = 1;
+    setsockopt(mnListenFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+    // Anyone who reaches the port can change the parameters, remote hosts go through a tunnel
+    sockaddr_in address;
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(mPort);
+    if(bind(mnListenFd,(sockaddr*)&address,sizeof(address))<0 || listen(mnListenFd,BACKLOG)<0 ||
+       !SetNonBlocking(mnListenFd))
+    {
+        cerr << "Parameter server: could not listen on port " << mPort << ": " << strerror(errno) << endl;
+        close(mnListenFd);
+        mnListenFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void ParameterServer::AcceptClients()
+{
+    while(1)
+    {
+        const int fd = accept(mnListenFd,NULL,NULL);
+        if(fd<0)
+            return;
+
+        if(!SetNonBlocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+
+        Client client;
+        client.fd = fd;
+        client.nSent = 0;
+        mvClients.push_back(std::move(client));
+    }
+}
+
+bool ParameterServer::Receive(Client &client)
+{
+    char buffer[1024];
+    while(1)
+    {
+        const ssize_t n = recv(client.fd,buffer,sizeof(buffer),0);
+        if(n==0)
+            return false;
+        if(n<0)
+        {
+            if(errno==EINTR)
+                continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                break;
+            return false;
+        }
+        client.inbox.append(buffer,n);
+    }
+
+    size_t begin = 0;
+    while(1)
+    {
+        const size_t end = client.inbox.find('\n',begin);
+        if(end==string::npos)
+            break;
+        string command = client.inbox.substr(begin,end-begin);
+        if(!command.empty() && command[command.size()-1]=='\r')
+            command.resize(command.size()-1);
+        if(!command.empty())
+            HandleCommand(command,client.outbox);
+        begin = end+1;
+    }
+    client.inbox.erase(0,begin);
+
+    return client.inbox.size()<=MAX_LINE && client.outbox.size()<=MAX_OUTBOX;
+}
+
+bool ParameterServer::Send(Client &client)
+{
+    while(client.nSent<client.outbox.size())
+    {
+        const ssize_t n = send(client.fd,client.outbox.data()+client.nSent,client.outbox.size()-client.nSent,MSG_NOSIGNAL);
+        if(n>=0)
+        {
+            client.nSent += n;
+            continue;
+        }
+        if(errno==EINTR)
+            continue;
+        // The rest goes with the next poll
+        return errno==EAGAIN || errno==EWOULDBLOCK;
+    }
+
+    client.outbox.clear();
+    client.nSent = 0;
+    return true;
+}
+
+void ParameterServer::CloseClient(Client &client)
+{
+    if(client.fd>=0)
+        close(client.fd);
+    client.fd = -1;
+}
+
+void ParameterServer::HandleCommand(const string &command, string &reply)
+{
+    const vector<string> vFields = SplitFields(command);
+    const string &name = vFields[0];
+
+    vector<string> vLines;
+    string error;
+    ParameterGroup group;
+
+    if(name=="list" && vFields.size()==1)
+        ParameterManager::describeParameters(vLines);
+    else if(name=="get" && vFields.size()==3)
+    {
+        if(!ParameterManager::getGroup(vFields[1],group))
+            error = "no such group";
+        else if(!ParameterManager::describeParameters(vLines,group,vFields[2]))
+            error = "no such parameter";
+    }
+    else if(name=="set" && vFields.size()==4)
+    {
+        if(!ParameterManager::getGroup(vFields[1],group))
+            error = "no such group";
+        else
+            ParameterManager::requestValue(group,vFields[2],vFields[3],error);
+    }
+    else
+        error = "unknown command";
+
+    for(size_t i=0; i<vLines.size(); i++)
+        reply += vLines[i] + "\n";
+    reply += error.empty() ? "ok\n" : "error " + error + "\n";
+}
+
+void ParameterServer::RequestFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinishRequested = true;
+}
+
+bool ParameterServer::CheckFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinishRequested;
+}
+
+void ParameterServer::SetFinish()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinished = true;
+}
+
+bool ParameterServer::isFinished()
+{
+    unique_lock<mutex> lock(mMutexFinish);
+    return mbFinished;
+}
+
+} //namespace ORB_SLAM
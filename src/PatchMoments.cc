@@ -0,0 +1,272 @@
+#include "PatchMoments.h"
+
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOMENTS_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MOMENTS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+
+const int R = PatchMoments::kHalfPatchSize;
+
+typedef void (*MomentsKernel)(const uint8_t*, const size_t, const int*, const int*, const size_t, int*);
+
+struct Kernel
+{
+    const char* name;
+    MomentsKernel moments;
+};
+
+// Weights of the 2*R+1 columns of every row of the circle, split in the columns -R..0 (lo) and
+// 0..R (hi), so each half is one 16 byte load which stays in the patch. u for m_10 and v for m_01
+// inside the circle, 0 outside it; the column 0 is only weighted in lo.
+struct RowWeights
+{
+    int16_t uLo[R+1][16];
+    int16_t uHi[R+1][16];
+    int16_t vLo[R+1][16];
+    int16_t vHi[R+1][16];
+};
+
+void BuildWeights(const int* umax, RowWeights &w)
+{
+    for(int v=0; v<=R; v++)
+    {
+        const int d = umax[v];
+        for(int j=0; j<16; j++)
+        {
+            const int uLo = j-R;
+            const int uHi = j;
+            const bool bLo = abs(uLo)<=d;
+            const bool bHi = uHi>=1 && uHi<=d;
+            w.uLo[v][j] = bLo ? uLo : 0;
+            w.uHi[v][j] = bHi ? uHi : 0;
+            // the center row has no m_01
+            w.vLo[v][j] = bLo ? v : 0;
+            w.vHi[v][j] = bHi ? v : 0;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------
+// scalar
+// ---------------------------------------------------------------------------------------
+
+void MomentsScalar(const uint8_t* image, const size_t step, const int* umax, const int* positions,
+                   const size_t n, int* moments)
+{
+    for(size_t i=0; i<n; i++)
+    {
+        const uint8_t* center = image + positions[2*i+1]*step + positions[2*i];
+        int m_01 = 0, m_10 = 0;
+
+        // Treat the center line differently, v=0
+        for(int u=-R; u<=R; ++u)
+            m_10 += u * center[u];
+
+        // Go line by line in the circular patch
+        for(int v=1; v<=R; ++v)
+        {
+            // Proceed over the two lines
+            int v_sum = 0;
+            const int d = umax[v];
+            for(int u=-d; u<=d; ++u)
+            {
+                const int val_plus = center[u + v*(int)step], val_minus = center[u - v*(int)step];
+                v_sum += (val_plus - val_minus);
+                m_10 += u * (val_plus + val_minus);
+            }
+            m_01 += v * v_sum;
+        }
+
+        moments[2*i] = m_01;
+        moments[2*i+1] = m_10;
+    }
+}
+
+#ifdef MOMENTS_X86
+
+// ---------------------------------------------------------------------------------------
+// AVX2, the 16 columns of a half row widened to 16 bit and multiplied with the weights by
+// pmaddwd into 32 bit sums
+// ---------------------------------------------------------------------------------------
+
+__attribute__((target("avx2")))
+inline __m256i LoadHalfRow(const uint8_t* p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+__attribute__((target("avx2")))
+inline __m256i LoadWeights(const int16_t* w)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w));
+}
+
+__attribute__((target("avx2")))
+inline int HorizontalSum(const __m256i a)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+void MomentsAVX2(const uint8_t* image, const size_t step, const int* umax, const int* positions,
+                 const size_t n, int* moments)
+{
+    RowWeights w;
+    BuildWeights(umax, w);
+
+    for(size_t i=0; i<n; i++)
+    {
+        const uint8_t* center = image + positions[2*i+1]*step + positions[2*i];
+
+        // center line, v=0
+        __m256i m10 = _mm256_add_epi32(_mm256_madd_epi16(LoadHalfRow(center-R), LoadWeights(w.uLo[0])),
+                                       _mm256_madd_epi16(LoadHalfRow(center), LoadWeights(w.uHi[0])));
+        __m256i m01 = _mm256_setzero_si256();
+
+        for(int v=1; v<=R; v++)
+        {
+            const uint8_t* plus = center + v*step;
+            const uint8_t* minus = center - v*step;
+            const __m256i plusLo = LoadHalfRow(plus-R);
+            const __m256i plusHi = LoadHalfRow(plus);
+            const __m256i minusLo = LoadHalfRow(minus-R);
+            const __m256i minusHi = LoadHalfRow(minus);
+
+            // at most 510 and -255..255, no overflow in 16 bit
+            m10 = _mm256_add_epi32(m10, _mm256_madd_epi16(_mm256_add_epi16(plusLo, minusLo), LoadWeights(w.uLo[v])));
+            m10 = _mm256_add_epi32(m10, _mm256_madd_epi16(_mm256_add_epi16(plusHi, minusHi), LoadWeights(w.uHi[v])));
+            m01 = _mm256_add_epi32(m01, _mm256_madd_epi16(_mm256_sub_epi16(plusLo, minusLo), LoadWeights(w.vLo[v])));
+            m01 = _mm256_add_epi32(m01, _mm256_madd_epi16(_mm256_sub_epi16(plusHi, minusHi), LoadWeights(w.vHi[v])));
+        }
+
+        moments[2*i] = HorizontalSum(m01);
+        moments[2*i+1] = HorizontalSum(m10);
+    }
+}
+
+#endif // MOMENTS_X86
+
+#ifdef MOMENTS_NEON
+
+// ---------------------------------------------------------------------------------------
+// NEON, the half rows widened to 16 bit and multiplied with the weights by vmlal into 32 bit
+// sums, 8 columns at a time
+// ---------------------------------------------------------------------------------------
+
+// acc += a*w for the 16 columns of a and w
+inline int32x4_t MultiplyAdd(int32x4_t acc, const int16x8_t a0, const int16x8_t a1, const int16_t* w)
+{
+    const int16x8_t w0 = vld1q_s16(w);
+    const int16x8_t w1 = vld1q_s16(w+8);
+    acc = vmlal_s16(acc, vget_low_s16(a0), vget_low_s16(w0));
+    acc = vmlal_s16(acc, vget_high_s16(a0), vget_high_s16(w0));
+    acc = vmlal_s16(acc, vget_low_s16(a1), vget_low_s16(w1));
+    acc = vmlal_s16(acc, vget_high_s16(a1), vget_high_s16(w1));
+    return acc;
+}
+
+inline int HorizontalSum(const int32x4_t a)
+{
+#if defined(__aarch64__)
+    return vaddvq_s32(a);
+#else
+    const int64x2_t s = vpaddlq_s32(a);
+    return static_cast<int>(vgetq_lane_s64(s, 0) + vgetq_lane_s64(s, 1));
+#endif
+}
+
+void MomentsNEON(const uint8_t* image, const size_t step, const int* umax, const int* positions,
+                 const size_t n, int* moments)
+{
+    RowWeights w;
+    BuildWeights(umax, w);
+
+    for(size_t i=0; i<n; i++)
+    {
+        const uint8_t* center = image + positions[2*i+1]*step + positions[2*i];
+
+        // center line, v=0
+        const uint8x16_t cLo = vld1q_u8(center-R);
+        const uint8x16_t cHi = vld1q_u8(center);
+        int32x4_t m10 = vdupq_n_s32(0);
+        int32x4_t m01 = vdupq_n_s32(0);
+        m10 = MultiplyAdd(m10, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(cLo))),
+                          vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(cLo))), w.uLo[0]);
+        m10 = MultiplyAdd(m10, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(cHi))),
+                          vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(cHi))), w.uHi[0]);
+
+        for(int v=1; v<=R; v++)
+        {
+            const uint8_t* plus = center + v*step;
+            const uint8_t* minus = center - v*step;
+            const uint8x16_t plusLo = vld1q_u8(plus-R);
+            const uint8x16_t plusHi = vld1q_u8(plus);
+            const uint8x16_t minusLo = vld1q_u8(minus-R);
+            const uint8x16_t minusHi = vld1q_u8(minus);
+
+            // widening add and subtract, 16 bit sums and differences
+            m10 = MultiplyAdd(m10, vreinterpretq_s16_u16(vaddl_u8(vget_low_u8(plusLo), vget_low_u8(minusLo))),
+                              vreinterpretq_s16_u16(vaddl_u8(vget_high_u8(plusLo), vget_high_u8(minusLo))), w.uLo[v]);
+            m10 = MultiplyAdd(m10, vreinterpretq_s16_u16(vaddl_u8(vget_low_u8(plusHi), vget_low_u8(minusHi))),
+                              vreinterpretq_s16_u16(vaddl_u8(vget_high_u8(plusHi), vget_high_u8(minusHi))), w.uHi[v]);
+            m01 = MultiplyAdd(m01, vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(plusLo), vget_low_u8(minusLo))),
+                              vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(plusLo), vget_high_u8(minusLo))), w.vLo[v]);
+            m01 = MultiplyAdd(m01, vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(plusHi), vget_low_u8(minusHi))),
+                              vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(plusHi), vget_high_u8(minusHi))), w.vHi[v]);
+        }
+
+        moments[2*i] = HorizontalSum(m01);
+        moments[2*i+1] = HorizontalSum(m10);
+    }
+}
+
+#endif // MOMENTS_NEON
+
+Kernel SelectKernel()
+{
+#ifdef MOMENTS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return Kernel{"avx2", MomentsAVX2};
+#endif
+#ifdef MOMENTS_NEON
+    return Kernel{"neon", MomentsNEON};
+#endif
+    return Kernel{"scalar", MomentsScalar};
+}
+
+// selected once, on first use (thread safe static initialization)
+const Kernel& ActiveKernel()
+{
+    static const Kernel kernel = SelectKernel();
+    return kernel;
+}
+
+} // namespace
+
+void PatchMoments::Compute(const uint8_t* image, const size_t step, const int* umax, const int* positions,
+                           const size_t n, int* moments)
+{
+    ActiveKernel().moments(image, step, umax, positions, n, moments);
+}
+
+const char* PatchMoments::KernelName()
+{
+    return ActiveKernel().name;
+}
+
+}// namespace ORB_SLAM
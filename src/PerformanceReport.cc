@@ -0,0 +1,241 @@
+#include "PerformanceReport.h"
+#include "MPSCQueue.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Bytes formatted before they are written
+const size_t BATCH_SIZE = 64*1024; //param
+
+const char* TYPE_NAMES[] = {"frame", "keyframe", "loop", "global_ba"};
+const char* STRATEGY_NAMES[] = {"flow", "motion_model", "reference_keyframe", "relocalization", "local_map"};
+
+// Stages [first,last] of the thread which writes each type
+const Stage FIRST_STAGE[] = {Stage::TRACK, Stage::KEYFRAME_QUEUE, Stage::DETECT_LOOP, Stage::GLOBAL_BUNDLE_ADJUSTMENT};
+const Stage LAST_STAGE[] = {Stage::NEED_NEW_KEYFRAME, Stage::BUDGET_CULLING, Stage::CORRECT_LOOP,
+                            Stage::GLOBAL_BUNDLE_ADJUSTMENT};
+const int NUM_TYPES = 4;
+
+void Append(string &out, const char* format, ...) __attribute__((format(printf,2,3)));
+
+void Append(string &out, const char* format, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args,format);
+    const int n = vsnprintf(buffer,sizeof(buffer),format,args);
+    va_end(args);
+    if(n>0)
+        out.append(buffer,min(static_cast<size_t>(n),sizeof(buffer)-1));
+}
+
+void Format(const PerformanceReport::Record &record, string &out)
+{
+    Append(out,"{\"type\":\"%s\",\"id\":%lu",TYPE_NAMES[record.type],record.nId);
+    switch(record.type)
+    {
+    case PerformanceReport::FRAME:
+        Append(out,",\"keyframe\":%ld",record.nOther);
+        break;
+    case PerformanceReport::KEYFRAME:
+        Append(out,",\"frame\":%ld,\"queued\":%d",record.nOther,record.nCount);
+        break;
+    case PerformanceReport::LOOP:
+        Append(out,",\"matched_keyframe\":%ld",record.nOther);
+        break;
+    default:
+        break;
+    }
+    Append(out,",\"timestamp\":%.6f,\"wall_time\":%.6f",record.timestamp,record.wallTime);
+
+    if(record.type==PerformanceReport::FRAME)
+    {
+        Append(out,",\"state\":%d,\"features\":%d,\"inliers\":%d,\"matches\":{",record.nState,record.nFeatures,
+               record.nCount);
+        for(int i=0; i<PerformanceReport::NUM_STRATEGIES; i++)
+            Append(out,"%s\"%s\":%d",i>0 ? "," : "",STRATEGY_NAMES[i],record.vnMatches[i]);
+        out += '}';
+    }
+    else if(record.type==PerformanceReport::LOOP || record.type==PerformanceReport::GLOBAL_BA)
+        Append(out,",\"corrected\":%d",record.nCount);
+
+    out += ",\"stages_us\":{";
+    const int first = static_cast<int>(FIRST_STAGE[record.type]);
+    const int last = static_cast<int>(LAST_STAGE[record.type]);
+    for(int i=first; i<=last; i++)
+        Append(out,"%s\"%s\":%.1f",i>first ? "," : "",StageTimes::Name(static_cast<Stage>(i)),record.vfStageTimes[i]);
+    out += "}}\n";
+}
+
+class Writer
+{
+public:
+    Writer(const size_t nCapacity):
+        mRing(nCapacity), mnDropped(0), mbFinish(false)
+    {
+    }
+
+    bool Open(const string &filename)
+    {
+        mFile.open(filename.c_str(), ios::trunc);
+        if(!mFile.is_open())
+            return false;
+        mThread = thread(&Writer::Run,this);
+        return true;
+    }
+
+    void Push(PerformanceReport::Record &record)
+    {
+        if(!mRing.Push(record))
+            mnDropped.fetch_add(1,memory_order_relaxed);
+    }
+
+    size_t GetNumDropped() const
+    {
+        return mnDropped.load(memory_order_relaxed);
+    }
+
+    // Writes what is queued and joins the writer
+    void Stop()
+    {
+        mbFinish = true;
+        if(mThread.joinable())
+            mThread.join();
+        mFile.close();
+    }
+
+private:
+    void Run()
+    {
+        PerformanceReport::Record record;
+        string batch;
+        batch.reserve(BATCH_SIZE+1024);
+        while(true)
+        {
+            if(mRing.Pop(record))
+            {
+                Format(record,batch);
+                if(batch.size()<BATCH_SIZE)
+                    continue;
+            }
+
+            if(!batch.empty())
+            {
+                mFile.write(batch.data(),batch.size());
+                batch.clear();
+                continue;
+            }
+
+            mFile.flush();
+            if(mbFinish)
+                break;
+            usleep(1000); //param
+        }
+    }
+
+    MPSCQueue<PerformanceReport::Record> mRing;
+    ofstream mFile;
+    atomic<size_t> mnDropped;
+    atomic<bool> mbFinish;
+    thread mThread;
+};
+
+// Swapped by Open and Close, the threads which add records take a reference with atomic_load
+shared_ptr<Writer> gpWriter;
+mutex gMutexOpen;
+size_t gnDropped = 0;
+chrono::steady_clock::time_point gStart;
+
+// Stage totals at the last record of each type, the thread of the type only
+uint64_t gvnLastTotals[PerformanceReport::NUM_STAGES];
+}
+
+atomic<bool> PerformanceReport::mbOpen(false);
+
+bool PerformanceReport::Open(const string &filename, const size_t nCapacity)
+{
+    Close();
+
+    unique_lock<mutex> lock(gMutexOpen);
+    shared_ptr<Writer> pWriter = make_shared<Writer>(nCapacity);
+    if(!pWriter->Open(filename))
+    {
+        cerr << "Could not open the performance report " << filename << endl;
+        return false;
+    }
+
+    for(int i=0; i<NUM_STAGES; i++)
+        gvnLastTotals[i] = StageTimes::GetTotalNanoseconds(static_cast<Stage>(i));
+    gStart = chrono::steady_clock::now();
+    atomic_store(&gpWriter,pWriter);
+    mbOpen = true;
+    return true;
+}
+
+void PerformanceReport::Close()
+{
+    unique_lock<mutex> lock(gMutexOpen);
+    mbOpen = false;
+    shared_ptr<Writer> pWriter = atomic_exchange(&gpWriter,shared_ptr<Writer>());
+    if(!pWriter)
+        return;
+    pWriter->Stop();
+    gnDropped = pWriter->GetNumDropped();
+}
+
+PerformanceReport::Record PerformanceReport::NewRecord(const Type type)
+{
+    Record record;
+    memset(&record,0,sizeof(record));
+    record.type = type;
+    record.nOther = -1;
+    return record;
+}
+
+void PerformanceReport::Add(Record &record)
+{
+    if(!IsOpen() || record.type<0 || record.type>=NUM_TYPES)
+        return;
+
+    // Each type owns its range of stages, so the totals of a range are only kept by one thread
+    for(int i=static_cast<int>(FIRST_STAGE[record.type]); i<=static_cast<int>(LAST_STAGE[record.type]); i++)
+    {
+        const uint64_t nTotal = StageTimes::GetTotalNanoseconds(static_cast<Stage>(i));
+        // The totals start over when the stage times are reset
+        const uint64_t nDelta = nTotal>=gvnLastTotals[i] ? nTotal-gvnLastTotals[i] : nTotal;
+        record.vfStageTimes[i] = static_cast<float>(nDelta*1e-3);
+        gvnLastTotals[i] = nTotal;
+    }
+
+    shared_ptr<Writer> pWriter = atomic_load(&gpWriter);
+    if(!pWriter)
+        return;
+    record.wallTime = chrono::duration<double>(chrono::steady_clock::now()-gStart).count();
+    pWriter->Push(record);
+}
+
+size_t PerformanceReport::GetNumDropped()
+{
+    unique_lock<mutex> lock(gMutexOpen);
+    shared_ptr<Writer> pWriter = atomic_load(&gpWriter);
+    return pWriter ? pWriter->GetNumDropped() : gnDropped;
+}
+
+} //namespace ORB_SLAM
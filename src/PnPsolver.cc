@@ -55,7 +55,7 @@
 #include <vector>
 #include <cmath>
 #include <opencv2/core/core.hpp>
-#include "Thirdparty/DBoW2/DUtils/Random.h"
+#include <Eigen/Dense>
 #include <algorithm>
 
 using namespace std;
@@ -65,17 +65,21 @@ namespace ORB_SLAM2
 
 
 PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches):
-    pws(0), us(0), alphas(0), pcs(0), maximum_number_of_correspondences(0), number_of_correspondences(0), mnInliersi(0),
+    maximum_number_of_correspondences(0), number_of_correspondences(0), mnInliersi(0),
     mnIterations(0), mnBestInliers(0), N(0)
 {
     mvpMapPointMatches = vpMapPointMatches;
-    mvP2D.reserve(F.mvpMapPoints.size());
+    mvU.reserve(F.mvpMapPoints.size());
+    mvV.reserve(F.mvpMapPoints.size());
     mvSigma2.reserve(F.mvpMapPoints.size());
-    mvP3Dw.reserve(F.mvpMapPoints.size());
+    mvX.reserve(F.mvpMapPoints.size());
+    mvY.reserve(F.mvpMapPoints.size());
+    mvZ.reserve(F.mvpMapPoints.size());
     mvKeyPointIndices.reserve(F.mvpMapPoints.size());
     mvAllIndices.reserve(F.mvpMapPoints.size());
 
     int idx=0;
+    uint64_t seed = RandomStream::Hash(F.mnId);
     for(size_t i=0, iend=vpMapPointMatches.size(); i<iend; i++)
     {
         MapPoint* pMP = vpMapPointMatches[i];
@@ -86,14 +90,18 @@ PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches)
             {
                 const cv::KeyPoint &kp = F.mvKeysUn[i];
 
-                mvP2D.push_back(kp.pt);
+                mvU.push_back(kp.pt.x);
+                mvV.push_back(kp.pt.y);
                 mvSigma2.push_back(F.mvLevelSigma2[kp.octave]);
 
                 cv::Mat Pos = pMP->GetWorldPos();
-                mvP3Dw.push_back(cv::Point3f(Pos.at<float>(0),Pos.at<float>(1), Pos.at<float>(2)));
+                mvX.push_back(Pos.at<float>(0));
+                mvY.push_back(Pos.at<float>(1));
+                mvZ.push_back(Pos.at<float>(2));
 
                 mvKeyPointIndices.push_back(i);
                 mvAllIndices.push_back(idx);
+                seed = RandomStream::Hash(seed,pMP->mnId);
 
                 idx++;
             }
@@ -106,15 +114,13 @@ PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches)
     uc = F.cx;
     vc = F.cy;
 
+    mRandom.Seed(seed);
+
     SetRansacParameters();
 }
 
 PnPsolver::~PnPsolver()
 {
-  delete [] pws;
-  delete [] us;
-  delete [] alphas;
-  delete [] pcs;
 }
 
 
@@ -126,7 +132,7 @@ void PnPsolver::SetRansacParameters(double probability, int minInliers, int maxI
     mRansacEpsilon = epsilon;
     mRansacMinSet = minSet;
 
-    N = mvP2D.size(); // number of correspondences
+    N = mvU.size(); // number of correspondences
 
     mvbInliersi.resize(N);
 
@@ -176,41 +182,34 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
         return cv::Mat();
     }
 
-    vector<size_t> vAvailableIndices;
+    const int nMaxBatch = 8; //param
 
     int nCurrentIterations = 0;
     while(mnIterations<mRansacMaxIts || nCurrentIterations<nIterations)
     {
-        nCurrentIterations++;
-        mnIterations++;
-        reset_correspondences();
+        // Never more hypotheses than the loop would still evaluate
+        const int nLeft = max(mRansacMaxIts-mnIterations, nIterations-nCurrentIterations);
+        const int nHypotheses = min(nLeft, nMaxBatch);
 
-        vAvailableIndices = mvAllIndices;
+        EvaluateHypotheses(nHypotheses);
 
-        // Get min set of points
-        for(short i = 0; i < mRansacMinSet; ++i)
+        for(int h=0; h<nHypotheses; h++)
         {
-            int randi = DUtils::Random::RandomInt(0, vAvailableIndices.size()-1);
-
-            int idx = vAvailableIndices[randi];
+            nCurrentIterations++;
+            mnIterations++;
 
-            add_correspondence(mvP3Dw[idx].x,mvP3Dw[idx].y,mvP3Dw[idx].z,mvP2D[idx].x,mvP2D[idx].y);
+            const Hypothesis &hypothesis = mvHypotheses[h];
+            if(hypothesis.nInliers<mRansacMinInliers)
+                continue;
 
-            vAvailableIndices[randi] = vAvailableIndices.back();
-            vAvailableIndices.pop_back();
-        }
+            // Current estimation
+            copy_R_and_t(hypothesis.R, hypothesis.t, mRi, mti);
 
-        // Compute camera pose
-        compute_pose(mRi, mti);
-
-        // Check inliers
-        CheckInliers();
-
-        if(mnInliersi>=mRansacMinInliers)
-        {
             // If it is the best solution so far, save it
-            if(mnInliersi>mnBestInliers)
+            if(hypothesis.nInliers>mnBestInliers)
             {
+                CheckInliers();
+
                 mvbBestInliers = mvbInliersi;
                 mnBestInliers = mnInliersi;
 
@@ -234,7 +233,6 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
                 }
                 return mRefinedTcw.clone();
             }
-
         }
     }
 
@@ -257,6 +255,41 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
     return cv::Mat();
 }
 
+void PnPsolver::EvaluateHypotheses(const int nHypotheses)
+{
+    if(static_cast<int>(mvHypotheses.size())<nHypotheses)
+        mvHypotheses.resize(nHypotheses);
+
+    set_maximum_number_of_correspondences(mRansacMinSet);
+
+    for(int h=0; h<nHypotheses; h++)
+    {
+        reset_correspondences();
+
+        mvAvailableIndices = mvAllIndices;
+
+        // Get min set of points
+        for(short i = 0; i < mRansacMinSet; ++i)
+        {
+            int randi = mRandom.RandomInt(0, mvAvailableIndices.size()-1);
+
+            int idx = mvAvailableIndices[randi];
+
+            add_correspondence(mvX[idx],mvY[idx],mvZ[idx],mvU[idx],mvV[idx]);
+
+            mvAvailableIndices[randi] = mvAvailableIndices.back();
+            mvAvailableIndices.pop_back();
+        }
+
+        // Compute camera pose
+        compute_pose(mvHypotheses[h].R, mvHypotheses[h].t);
+    }
+
+    // Check inliers, the mask is only needed for the best hypotheses
+    for(int h=0; h<nHypotheses; h++)
+        mvHypotheses[h].nInliers = CountInliers(mvHypotheses[h].R, mvHypotheses[h].t);
+}
+
 bool PnPsolver::Refine()
 {
     vector<int> vIndices;
@@ -277,7 +310,7 @@ bool PnPsolver::Refine()
     for(size_t i=0; i<vIndices.size(); i++)
     {
         int idx = vIndices[i];
-        add_correspondence(mvP3Dw[idx].x,mvP3Dw[idx].y,mvP3Dw[idx].z,mvP2D[idx].x,mvP2D[idx].y);
+        add_correspondence(mvX[idx],mvY[idx],mvZ[idx],mvU[idx],mvV[idx]);
     }
 
     // Compute camera pose
@@ -305,53 +338,103 @@ bool PnPsolver::Refine()
 }
 
 
+namespace
+{
+// Squared reprojection error of the point (x,y,z) against (u,v) under the pose R,t (row major)
+inline float ReprojectionError2(const float* R, const float* t, const float fu, const float fv,
+                                const float uc, const float vc, const float x, const float y, const float z,
+                                const float u, const float v)
+{
+    const float Xc = R[0]*x+R[1]*y+R[2]*z+t[0];
+    const float Yc = R[3]*x+R[4]*y+R[5]*z+t[1];
+    const float invZc = 1.0f/(R[6]*x+R[7]*y+R[8]*z+t[2]);
+
+    const float distX = u-(uc+fu*Xc*invZc);
+    const float distY = v-(vc+fv*Yc*invZc);
+
+    return distX*distX+distY*distY;
+}
+}
+
 void PnPsolver::CheckInliers()
 {
-    mnInliersi=0;
+    float R[9], t[3];
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<3; j++)
+            R[3*i+j] = mRi[i][j];
+        t[i] = mti[i];
+    }
 
+    mvbInliersi.resize(N);
+
+    const float fuf = fu, fvf = fv, ucf = uc, vcf = vc;
+    const float* pX = mvX.data();
+    const float* pY = mvY.data();
+    const float* pZ = mvZ.data();
+    const float* pU = mvU.data();
+    const float* pV = mvV.data();
+    const float* pMaxError = mvMaxError.data();
+    unsigned char* pbInliers = mvbInliersi.data();
+
+    int nInliers=0;
+
+#ifdef _OPENMP
+#pragma omp simd reduction(+:nInliers)
+#endif
     for(int i=0; i<N; i++)
     {
-        cv::Point3f P3Dw = mvP3Dw[i];
-        cv::Point2f P2D = mvP2D[i];
+        const float error2 = ReprojectionError2(R,t,fuf,fvf,ucf,vcf,pX[i],pY[i],pZ[i],pU[i],pV[i]);
+        const bool bInlier = error2<pMaxError[i];
+        pbInliers[i] = bInlier;
+        nInliers += bInlier ? 1 : 0;
+    }
 
-        float Xc = mRi[0][0]*P3Dw.x+mRi[0][1]*P3Dw.y+mRi[0][2]*P3Dw.z+mti[0];
-        float Yc = mRi[1][0]*P3Dw.x+mRi[1][1]*P3Dw.y+mRi[1][2]*P3Dw.z+mti[1];
-        float invZc = 1/(mRi[2][0]*P3Dw.x+mRi[2][1]*P3Dw.y+mRi[2][2]*P3Dw.z+mti[2]);
+    mnInliersi = nInliers;
+}
 
-        double ue = uc + fu * Xc * invZc;
-        double ve = vc + fv * Yc * invZc;
+int PnPsolver::CountInliers(const double Rd[3][3], const double td[3]) const
+{
+    float R[9], t[3];
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<3; j++)
+            R[3*i+j] = Rd[i][j];
+        t[i] = td[i];
+    }
 
-        float distX = P2D.x-ue;
-        float distY = P2D.y-ve;
+    const float fuf = fu, fvf = fv, ucf = uc, vcf = vc;
+    const float* pX = mvX.data();
+    const float* pY = mvY.data();
+    const float* pZ = mvZ.data();
+    const float* pU = mvU.data();
+    const float* pV = mvV.data();
+    const float* pMaxError = mvMaxError.data();
 
-        float error2 = distX*distX+distY*distY;
+    int nInliers=0;
 
-        if(error2<mvMaxError[i])
-        {
-            mvbInliersi[i]=true;
-            mnInliersi++;
-        }
-        else
-        {
-            mvbInliersi[i]=false;
-        }
+#ifdef _OPENMP
+#pragma omp simd reduction(+:nInliers)
+#endif
+    for(int i=0; i<N; i++)
+    {
+        const float error2 = ReprojectionError2(R,t,fuf,fvf,ucf,vcf,pX[i],pY[i],pZ[i],pU[i],pV[i]);
+        nInliers += error2<pMaxError[i] ? 1 : 0;
     }
+
+    return nInliers;
 }
 
 
 void PnPsolver::set_maximum_number_of_correspondences(int n)
 {
+  // The buffers keep their capacity, so repeated iterations do not allocate
   if (maximum_number_of_correspondences < n) {
-    if (pws != 0) delete [] pws;
-    if (us != 0) delete [] us;
-    if (alphas != 0) delete [] alphas;
-    if (pcs != 0) delete [] pcs;
-
     maximum_number_of_correspondences = n;
-    pws = new double[3 * maximum_number_of_correspondences];
-    us = new double[2 * maximum_number_of_correspondences];
-    alphas = new double[4 * maximum_number_of_correspondences];
-    pcs = new double[3 * maximum_number_of_correspondences];
+    pws.resize(3 * maximum_number_of_correspondences);
+    us.resize(2 * maximum_number_of_correspondences);
+    alphas.resize(4 * maximum_number_of_correspondences);
+    pcs.resize(3 * maximum_number_of_correspondences);
   }
 }
 
@@ -385,44 +468,38 @@ void PnPsolver::choose_control_points(void)
 
 
   // Take C1, C2, and C3 from PCA on the reference points:
-  CvMat * PW0 = cvCreateMat(number_of_correspondences, 3, CV_64F);
-
-  double pw0tpw0[3 * 3], dc[3], uct[3 * 3];
-  CvMat PW0tPW0 = cvMat(3, 3, CV_64F, pw0tpw0);
-  CvMat DC      = cvMat(3, 1, CV_64F, dc);
-  CvMat UCt     = cvMat(3, 3, CV_64F, uct);
-
-  for(int i = 0; i < number_of_correspondences; i++)
-    for(int j = 0; j < 3; j++)
-      PW0->data.db[3 * i + j] = pws[3 * i + j] - cws[0][j];
-
-  cvMulTransposed(PW0, &PW0tPW0, 1);
-  cvSVD(&PW0tPW0, &DC, &UCt, 0, CV_SVD_MODIFY_A | CV_SVD_U_T);
+  Eigen::Matrix3d PW0tPW0 = Eigen::Matrix3d::Zero();
+  for(int i = 0; i < number_of_correspondences; i++) {
+    const Eigen::Vector3d pw0(pws[3 * i] - cws[0][0], pws[3 * i + 1] - cws[0][1], pws[3 * i + 2] - cws[0][2]);
+    PW0tPW0.noalias() += pw0 * pw0.transpose();
+  }
 
-  cvReleaseMat(&PW0);
+  const Eigen::JacobiSVD<Eigen::Matrix3d> svd(PW0tPW0, Eigen::ComputeFullU);
+  const Eigen::Vector3d dc = svd.singularValues();
+  const Eigen::Matrix3d UC = svd.matrixU();
 
   for(int i = 1; i < 4; i++) {
-    double k = sqrt(dc[i - 1] / number_of_correspondences);
+    double k = sqrt(dc(i - 1) / number_of_correspondences);
     for(int j = 0; j < 3; j++)
-      cws[i][j] = cws[0][j] + k * uct[3 * (i - 1) + j];
+      cws[i][j] = cws[0][j] + k * UC(j, i - 1);
   }
 }
 
 void PnPsolver::compute_barycentric_coordinates(void)
 {
-  double cc[3 * 3], cc_inv[3 * 3];
-  CvMat CC     = cvMat(3, 3, CV_64F, cc);
-  CvMat CC_inv = cvMat(3, 3, CV_64F, cc_inv);
-
+  Eigen::Matrix3d CC;
   for(int i = 0; i < 3; i++)
     for(int j = 1; j < 4; j++)
-      cc[3 * i + j - 1] = cws[j][i] - cws[0][i];
+      CC(i, j - 1) = cws[j][i] - cws[0][i];
 
-  cvInvert(&CC, &CC_inv, CV_SVD);
-  double * ci = cc_inv;
+  // Pseudo inverse, the control points are degenerate for a planar set
+  const Eigen::JacobiSVD<Eigen::Matrix3d> svd(CC, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix<double,3,3,Eigen::RowMajor> CC_inv = svd.solve(Eigen::Matrix3d::Identity());
+
+  const double * ci = CC_inv.data();
   for(int i = 0; i < number_of_correspondences; i++) {
-    double * pi = pws + 3 * i;
-    double * a = alphas + 4 * i;
+    const double * pi = &pws[3 * i];
+    double * a = &alphas[4 * i];
 
     for(int j = 0; j < 3; j++)
       a[1 + j] =
@@ -433,20 +510,17 @@ void PnPsolver::compute_barycentric_coordinates(void)
   }
 }
 
-void PnPsolver::fill_M(CvMat * M,
-		  const int row, const double * as, const double u, const double v)
+void PnPsolver::fill_M(Eigen::Matrix<double,2,12> & M,
+		  const double * as, const double u, const double v)
 {
-  double * M1 = M->data.db + row * 12;
-  double * M2 = M1 + 12;
-
   for(int i = 0; i < 4; i++) {
-    M1[3 * i    ] = as[i] * fu;
-    M1[3 * i + 1] = 0.0;
-    M1[3 * i + 2] = as[i] * (uc - u);
+    M(0, 3 * i    ) = as[i] * fu;
+    M(0, 3 * i + 1) = 0.0;
+    M(0, 3 * i + 2) = as[i] * (uc - u);
 
-    M2[3 * i    ] = 0.0;
-    M2[3 * i + 1] = as[i] * fv;
-    M2[3 * i + 2] = as[i] * (vc - v);
+    M(1, 3 * i    ) = 0.0;
+    M(1, 3 * i + 1) = as[i] * fv;
+    M(1, 3 * i + 2) = as[i] * (vc - v);
   }
 }
 
@@ -466,8 +540,8 @@ void PnPsolver::compute_ccs(const double * betas, const double * ut)
 void PnPsolver::compute_pcs(void)
 {
   for(int i = 0; i < number_of_correspondences; i++) {
-    double * a = alphas + 4 * i;
-    double * pc = pcs + 3 * i;
+    const double * a = &alphas[4 * i];
+    double * pc = &pcs[3 * i];
 
     for(int j = 0; j < 3; j++)
       pc[j] = a[0] * ccs[0][j] + a[1] * ccs[1][j] + a[2] * ccs[2][j] + a[3] * ccs[3][j];
@@ -479,40 +553,42 @@ double PnPsolver::compute_pose(double R[3][3], double t[3])
   choose_control_points();
   compute_barycentric_coordinates();
 
-  CvMat * M = cvCreateMat(2 * number_of_correspondences, 12, CV_64F);
+  // M'M is accumulated two rows of M at a time, M itself is never stored
+  Eigen::Matrix<double,12,12> MtM = Eigen::Matrix<double,12,12>::Zero();
+  Eigen::Matrix<double,2,12> M;
 
-  for(int i = 0; i < number_of_correspondences; i++)
-    fill_M(M, 2 * i, alphas + 4 * i, us[2 * i], us[2 * i + 1]);
-
-  double mtm[12 * 12], d[12], ut[12 * 12];
-  CvMat MtM = cvMat(12, 12, CV_64F, mtm);
-  CvMat D   = cvMat(12,  1, CV_64F, d);
-  CvMat Ut  = cvMat(12, 12, CV_64F, ut);
+  for(int i = 0; i < number_of_correspondences; i++) {
+    fill_M(M, &alphas[4 * i], us[2 * i], us[2 * i + 1]);
+    MtM.noalias() += M.transpose() * M;
+  }
 
-  cvMulTransposed(M, &MtM, 1);
-  cvSVD(&MtM, &D, &Ut, 0, CV_SVD_MODIFY_A | CV_SVD_U_T);
-  cvReleaseMat(&M);
+  // M'M is symmetric, its eigenvectors are its singular vectors. Eigen sorts them by
+  // increasing eigenvalue, ut keeps them in decreasing order as the rows of U'.
+  const Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double,12,12> > eig(MtM);
+  double ut[12 * 12];
+  for(int i = 0; i < 12; i++)
+    for(int j = 0; j < 12; j++)
+      ut[12 * i + j] = eig.eigenvectors()(j, 11 - i);
 
-  double l_6x10[6 * 10], rho[6];
-  CvMat L_6x10 = cvMat(6, 10, CV_64F, l_6x10);
-  CvMat Rho    = cvMat(6,  1, CV_64F, rho);
+  Matrix6x10d L_6x10;
+  Vector6d Rho;
 
-  compute_L_6x10(ut, l_6x10);
-  compute_rho(rho);
+  compute_L_6x10(ut, L_6x10.data());
+  compute_rho(Rho.data());
 
   double Betas[4][4], rep_errors[4];
   double Rs[4][3][3], ts[4][3];
 
-  find_betas_approx_1(&L_6x10, &Rho, Betas[1]);
-  gauss_newton(&L_6x10, &Rho, Betas[1]);
+  find_betas_approx_1(L_6x10, Rho, Betas[1]);
+  gauss_newton(L_6x10, Rho, Betas[1]);
   rep_errors[1] = compute_R_and_t(ut, Betas[1], Rs[1], ts[1]);
 
-  find_betas_approx_2(&L_6x10, &Rho, Betas[2]);
-  gauss_newton(&L_6x10, &Rho, Betas[2]);
+  find_betas_approx_2(L_6x10, Rho, Betas[2]);
+  gauss_newton(L_6x10, Rho, Betas[2]);
   rep_errors[2] = compute_R_and_t(ut, Betas[2], Rs[2], ts[2]);
 
-  find_betas_approx_3(&L_6x10, &Rho, Betas[3]);
-  gauss_newton(&L_6x10, &Rho, Betas[3]);
+  find_betas_approx_3(L_6x10, Rho, Betas[3]);
+  gauss_newton(L_6x10, Rho, Betas[3]);
   rep_errors[3] = compute_R_and_t(ut, Betas[3], Rs[3], ts[3]);
 
   int N = 1;
@@ -552,7 +628,7 @@ double PnPsolver::reprojection_error(const double R[3][3], const double t[3])
   double sum2 = 0.0;
 
   for(int i = 0; i < number_of_correspondences; i++) {
-    double * pw = pws + 3 * i;
+    const double * pw = &pws[3 * i];
     double Xc = dot(R[0], pw) + t[0];
     double Yc = dot(R[1], pw) + t[1];
     double inv_Zc = 1.0 / (dot(R[2], pw) + t[2]);
@@ -574,8 +650,8 @@ void PnPsolver::estimate_R_and_t(double R[3][3], double t[3])
   pw0[0] = pw0[1] = pw0[2] = 0.0;
 
   for(int i = 0; i < number_of_correspondences; i++) {
-    const double * pc = pcs + 3 * i;
-    const double * pw = pws + 3 * i;
+    const double * pc = &pcs[3 * i];
+    const double * pw = &pws[3 * i];
 
     for(int j = 0; j < 3; j++) {
       pc0[j] += pc[j];
@@ -587,29 +663,24 @@ void PnPsolver::estimate_R_and_t(double R[3][3], double t[3])
     pw0[j] /= number_of_correspondences;
   }
 
-  double abt[3 * 3], abt_d[3], abt_u[3 * 3], abt_v[3 * 3];
-  CvMat ABt   = cvMat(3, 3, CV_64F, abt);
-  CvMat ABt_D = cvMat(3, 1, CV_64F, abt_d);
-  CvMat ABt_U = cvMat(3, 3, CV_64F, abt_u);
-  CvMat ABt_V = cvMat(3, 3, CV_64F, abt_v);
-
-  cvSetZero(&ABt);
+  Eigen::Matrix3d ABt = Eigen::Matrix3d::Zero();
   for(int i = 0; i < number_of_correspondences; i++) {
-    double * pc = pcs + 3 * i;
-    double * pw = pws + 3 * i;
+    const double * pc = &pcs[3 * i];
+    const double * pw = &pws[3 * i];
 
     for(int j = 0; j < 3; j++) {
-      abt[3 * j    ] += (pc[j] - pc0[j]) * (pw[0] - pw0[0]);
-      abt[3 * j + 1] += (pc[j] - pc0[j]) * (pw[1] - pw0[1]);
-      abt[3 * j + 2] += (pc[j] - pc0[j]) * (pw[2] - pw0[2]);
+      ABt(j, 0) += (pc[j] - pc0[j]) * (pw[0] - pw0[0]);
+      ABt(j, 1) += (pc[j] - pc0[j]) * (pw[1] - pw0[1]);
+      ABt(j, 2) += (pc[j] - pc0[j]) * (pw[2] - pw0[2]);
     }
   }
 
-  cvSVD(&ABt, &ABt_D, &ABt_U, &ABt_V, CV_SVD_MODIFY_A);
+  const Eigen::JacobiSVD<Eigen::Matrix3d> svd(ABt, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix3d UVt = svd.matrixU() * svd.matrixV().transpose();
 
   for(int i = 0; i < 3; i++)
     for(int j = 0; j < 3; j++)
-      R[i][j] = dot(abt_u + 3 * i, abt_v + 3 * j);
+      R[i][j] = UVt(i, j);
 
   const double det =
     R[0][0] * R[1][1] * R[2][2] + R[0][1] * R[1][2] * R[2][0] + R[0][2] * R[1][0] * R[2][1] -
@@ -664,21 +735,14 @@ double PnPsolver::compute_R_and_t(const double * ut, const double * betas,
 // betas10        = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_1 = [B11 B12     B13         B14]
 
-void PnPsolver::find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::find_betas_approx_1(const Matrix6x10d & L_6x10, const Vector6d & Rho,
 			       double * betas)
 {
-  double l_6x4[6 * 4], b4[4];
-  CvMat L_6x4 = cvMat(6, 4, CV_64F, l_6x4);
-  CvMat B4    = cvMat(4, 1, CV_64F, b4);
+  Eigen::Matrix<double,6,4> L_6x4;
+  L_6x4 << L_6x10.col(0), L_6x10.col(1), L_6x10.col(3), L_6x10.col(6);
 
-  for(int i = 0; i < 6; i++) {
-    cvmSet(&L_6x4, i, 0, cvmGet(L_6x10, i, 0));
-    cvmSet(&L_6x4, i, 1, cvmGet(L_6x10, i, 1));
-    cvmSet(&L_6x4, i, 2, cvmGet(L_6x10, i, 3));
-    cvmSet(&L_6x4, i, 3, cvmGet(L_6x10, i, 6));
-  }
-
-  cvSolve(&L_6x4, Rho, &B4, CV_SVD);
+  const Eigen::JacobiSVD<Eigen::Matrix<double,6,4> > svd(L_6x4, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Vector4d b4 = svd.solve(Rho);
 
   if (b4[0] < 0) {
     betas[0] = sqrt(-b4[0]);
@@ -696,20 +760,13 @@ void PnPsolver::find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho,
 // betas10        = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_2 = [B11 B12 B22                            ]
 
-void PnPsolver::find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::find_betas_approx_2(const Matrix6x10d & L_6x10, const Vector6d & Rho,
 			       double * betas)
 {
-  double l_6x3[6 * 3], b3[3];
-  CvMat L_6x3  = cvMat(6, 3, CV_64F, l_6x3);
-  CvMat B3     = cvMat(3, 1, CV_64F, b3);
-
-  for(int i = 0; i < 6; i++) {
-    cvmSet(&L_6x3, i, 0, cvmGet(L_6x10, i, 0));
-    cvmSet(&L_6x3, i, 1, cvmGet(L_6x10, i, 1));
-    cvmSet(&L_6x3, i, 2, cvmGet(L_6x10, i, 2));
-  }
+  const Eigen::Matrix<double,6,3> L_6x3 = L_6x10.leftCols<3>();
 
-  cvSolve(&L_6x3, Rho, &B3, CV_SVD);
+  const Eigen::JacobiSVD<Eigen::Matrix<double,6,3> > svd(L_6x3, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Vector3d b3 = svd.solve(Rho);
 
   if (b3[0] < 0) {
     betas[0] = sqrt(-b3[0]);
@@ -728,22 +785,13 @@ void PnPsolver::find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho,
 // betas10        = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_3 = [B11 B12 B22 B13 B23                    ]
 
-void PnPsolver::find_betas_approx_3(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::find_betas_approx_3(const Matrix6x10d & L_6x10, const Vector6d & Rho,
 			       double * betas)
 {
-  double l_6x5[6 * 5], b5[5];
-  CvMat L_6x5 = cvMat(6, 5, CV_64F, l_6x5);
-  CvMat B5    = cvMat(5, 1, CV_64F, b5);
+  const Eigen::Matrix<double,6,5> L_6x5 = L_6x10.leftCols<5>();
 
-  for(int i = 0; i < 6; i++) {
-    cvmSet(&L_6x5, i, 0, cvmGet(L_6x10, i, 0));
-    cvmSet(&L_6x5, i, 1, cvmGet(L_6x10, i, 1));
-    cvmSet(&L_6x5, i, 2, cvmGet(L_6x10, i, 2));
-    cvmSet(&L_6x5, i, 3, cvmGet(L_6x10, i, 3));
-    cvmSet(&L_6x5, i, 4, cvmGet(L_6x10, i, 4));
-  }
-
-  cvSolve(&L_6x5, Rho, &B5, CV_SVD);
+  const Eigen::JacobiSVD<Eigen::Matrix<double,6,5> > svd(L_6x5, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix<double,5,1> b5 = svd.solve(Rho);
 
   if (b5[0] < 0) {
     betas[0] = sqrt(-b5[0]);
@@ -810,18 +858,18 @@ void PnPsolver::compute_rho(double * rho)
 }
 
 void PnPsolver::compute_A_and_b_gauss_newton(const double * l_6x10, const double * rho,
-					double betas[4], CvMat * A, CvMat * b)
+					double betas[4], Matrix6x4d & A, Vector6d & b)
 {
   for(int i = 0; i < 6; i++) {
     const double * rowL = l_6x10 + i * 10;
-    double * rowA = A->data.db + i * 4;
+    double * rowA = A.data() + i * 4;
 
     rowA[0] = 2 * rowL[0] * betas[0] +     rowL[1] * betas[1] +     rowL[3] * betas[2] +     rowL[6] * betas[3];
     rowA[1] =     rowL[1] * betas[0] + 2 * rowL[2] * betas[1] +     rowL[4] * betas[2] +     rowL[7] * betas[3];
     rowA[2] =     rowL[3] * betas[0] +     rowL[4] * betas[1] + 2 * rowL[5] * betas[2] +     rowL[8] * betas[3];
     rowA[3] =     rowL[6] * betas[0] +     rowL[7] * betas[1] +     rowL[8] * betas[2] + 2 * rowL[9] * betas[3];
 
-    cvmSet(b, i, 0, rho[i] -
+    b(i) = rho[i] -
 	   (
 	    rowL[0] * betas[0] * betas[0] +
 	    rowL[1] * betas[0] * betas[1] +
@@ -833,49 +881,40 @@ void PnPsolver::compute_A_and_b_gauss_newton(const double * l_6x10, const double
 	    rowL[7] * betas[1] * betas[3] +
 	    rowL[8] * betas[2] * betas[3] +
 	    rowL[9] * betas[3] * betas[3]
-	    ));
+	    );
   }
 }
 
-void PnPsolver::gauss_newton(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::gauss_newton(const Matrix6x10d & L_6x10, const Vector6d & Rho,
 			double betas[4])
 {
   const int iterations_number = 5;
 
-  double a[6*4], b[6], x[4];
-  CvMat A = cvMat(6, 4, CV_64F, a);
-  CvMat B = cvMat(6, 1, CV_64F, b);
-  CvMat X = cvMat(4, 1, CV_64F, x);
+  Matrix6x4d A;
+  Vector6d B;
+  Eigen::Vector4d X;
 
   for(int k = 0; k < iterations_number; k++) {
-    compute_A_and_b_gauss_newton(L_6x10->data.db, Rho->data.db,
-				 betas, &A, &B);
-    qr_solve(&A, &B, &X);
+    compute_A_and_b_gauss_newton(L_6x10.data(), Rho.data(),
+				 betas, A, B);
+    qr_solve(A, B, X);
 
     for(int i = 0; i < 4; i++)
-      betas[i] += x[i];
+      betas[i] += X[i];
   }
 }
 
-void PnPsolver::qr_solve(CvMat * A, CvMat * b, CvMat * X)
+void PnPsolver::qr_solve(Matrix6x4d & A, Vector6d & b, Eigen::Vector4d & X)
 {
-  static int max_nr = 0;
-  static double * A1, * A2;
+  const int nr = A.rows();
+  const int nc = A.cols();
 
-  const int nr = A->rows;
-  const int nc = A->cols;
+  // On the stack, the solvers of several relocalization candidates run at the same time
+  double A1[4], A2[4];
 
-  if (max_nr != 0 && max_nr < nr) {
-    delete [] A1;
-    delete [] A2;
-  }
-  if (max_nr < nr) {
-    max_nr = nr;
-    A1 = new double[nr];
-    A2 = new double[nr];
-  }
+  X.setZero();
 
-  double * pA = A->data.db, * ppAkk = pA;
+  double * pA = A.data(), * ppAkk = pA;
   for(int k = 0; k < nc; k++) {
     double * ppAik = ppAkk, eta = fabs(*ppAik);
     for(int i = k + 1; i < nr; i++) {
@@ -919,7 +958,7 @@ void PnPsolver::qr_solve(CvMat * A, CvMat * b, CvMat * X)
   }
 
   // b <- Qt b
-  double * ppAjj = pA, * pb = b->data.db;
+  double * ppAjj = pA, * pb = b.data();
   for(int j = 0; j < nc; j++) {
     double * ppAij = ppAjj, tau = 0;
     for(int i = j; i < nr; i++)	{
@@ -936,7 +975,7 @@ void PnPsolver::qr_solve(CvMat * A, CvMat * b, CvMat * X)
   }
 
   // X = R-1 b
-  double * pX = X->data.db;
+  double * pX = X.data();
   pX[nc - 1] = pb[nc - 1] / A2[nc - 1];
   for(int i = nc - 2; i >= 0; i--) {
     double * ppAij = pA + i * nc + (i + 1), sum = 0;
@@ -0,0 +1,157 @@
+#include "PointProjection.h"
+#include "Frame.h"
+#include "KeyFrame.h"
+#include "MapPoint.h"
+
+namespace ORB_SLAM2
+{
+
+void PointProjection::Points::Clear()
+{
+    mvpMapPoints.clear();
+    mvX.clear();
+    mvY.clear();
+    mvZ.clear();
+    mvNx.clear();
+    mvNy.clear();
+    mvNz.clear();
+    mvMinDistance.clear();
+    mvMaxDistance.clear();
+}
+
+void PointProjection::Points::Reserve(const size_t n)
+{
+    mvpMapPoints.reserve(n);
+    mvX.reserve(n);
+    mvY.reserve(n);
+    mvZ.reserve(n);
+    mvNx.reserve(n);
+    mvNy.reserve(n);
+    mvNz.reserve(n);
+    mvMinDistance.reserve(n);
+    mvMaxDistance.reserve(n);
+}
+
+void PointProjection::Points::Add(MapPoint* pMP)
+{
+    Eigen::Vector3f P, Pn;
+    float minDistance, maxDistance;
+    pMP->GetViewingGeometry(P,Pn,minDistance,maxDistance);
+    Add(pMP,P,Pn,minDistance,maxDistance);
+}
+
+void PointProjection::Points::Add(MapPoint* pMP, const Eigen::Vector3f &P, const Eigen::Vector3f &Pn,
+                                  const float minDistance, const float maxDistance)
+{
+    mvpMapPoints.push_back(pMP);
+    mvX.push_back(P(0));
+    mvY.push_back(P(1));
+    mvZ.push_back(P(2));
+    mvNx.push_back(Pn(0));
+    mvNy.push_back(Pn(1));
+    mvNz.push_back(Pn(2));
+    mvMinDistance.push_back(minDistance);
+    mvMaxDistance.push_back(maxDistance);
+}
+
+void PointProjection::Camera::SetImage(const Frame &F)
+{
+    fx = F.fx;
+    fy = F.fy;
+    cx = F.cx;
+    cy = F.cy;
+    minX = F.mnMinX;
+    maxX = F.mnMaxX;
+    minY = F.mnMinY;
+    maxY = F.mnMaxY;
+    bIncludeMax = true;
+    bScaleInvariance = true;
+    fMinViewCos = -1.0f;
+}
+
+void PointProjection::Camera::SetImage(KeyFrame* pKF)
+{
+    fx = pKF->fx;
+    fy = pKF->fy;
+    cx = pKF->cx;
+    cy = pKF->cy;
+    minX = pKF->mnMinX;
+    maxX = pKF->mnMaxX;
+    minY = pKF->mnMinY;
+    maxY = pKF->mnMaxY;
+    bIncludeMax = false;
+    bScaleInvariance = true;
+    fMinViewCos = -1.0f;
+}
+
+void PointProjection::Visible::Clear()
+{
+    vnIndex.clear();
+    vu.clear();
+    vv.clear();
+    vInvZ.clear();
+    vDist.clear();
+    vViewCos.clear();
+}
+
+void PointProjection::Project(const Points &points, const Camera &camera, Visible &visible)
+{
+    visible.Clear();
+    const int N = points.Size();
+    if(N==0)
+        return;
+
+    typedef Eigen::Map<const ArrayXf> ArrayMap;
+    const ArrayMap X(points.mvX.data(),N), Y(points.mvY.data(),N), Z(points.mvZ.data(),N);
+    const Eigen::Matrix3f &R = camera.R;
+    const Eigen::Vector3f &t = camera.t;
+
+    const ArrayXf PcX = R(0,0)*X + R(0,1)*Y + R(0,2)*Z + t(0);
+    const ArrayXf PcY = R(1,0)*X + R(1,1)*Y + R(1,2)*Z + t(1);
+    const ArrayXf PcZ = R(2,0)*X + R(2,1)*Y + R(2,2)*Z + t(2);
+
+    const ArrayXf invz = PcZ.inverse();
+    const ArrayXf u = camera.fx*PcX*invz+camera.cx;
+    const ArrayXf v = camera.fy*PcY*invz+camera.cy;
+    const ArrayXf dist = (PcX.square()+PcY.square()+PcZ.square()).sqrt();
+
+    Eigen::Array<bool,Eigen::Dynamic,1> vbPass = (PcZ>=0.0f) && (u>=camera.minX) && (v>=camera.minY);
+    if(camera.bIncludeMax)
+        vbPass = vbPass && (u<=camera.maxX) && (v<=camera.maxY);
+    else
+        vbPass = vbPass && (u<camera.maxX) && (v<camera.maxY);
+
+    if(camera.bScaleInvariance)
+    {
+        const ArrayMap minDistance(points.mvMinDistance.data(),N), maxDistance(points.mvMaxDistance.data(),N);
+        vbPass = vbPass && (dist>=minDistance) && (dist<=maxDistance);
+    }
+
+    // The viewing direction rotated into the camera, against the ray Pc: the same angle as
+    // between P-Ow and the direction in the world
+    const bool bViewCos = camera.fMinViewCos>-1.0f;
+    ArrayXf viewCos;
+    if(bViewCos)
+    {
+        const ArrayMap Nx(points.mvNx.data(),N), Ny(points.mvNy.data(),N), Nz(points.mvNz.data(),N);
+        viewCos = (PcX*(R(0,0)*Nx + R(0,1)*Ny + R(0,2)*Nz) +
+                   PcY*(R(1,0)*Nx + R(1,1)*Ny + R(1,2)*Nz) +
+                   PcZ*(R(2,0)*Nx + R(2,1)*Ny + R(2,2)*Nz))/dist;
+        vbPass = vbPass && (viewCos>=camera.fMinViewCos);
+    }
+
+    for(int i=0; i<N; i++)
+    {
+        if(!vbPass[i])
+            continue;
+        visible.vnIndex.push_back(i);
+        visible.vu.push_back(u[i]);
+        visible.vv.push_back(v[i]);
+        visible.vInvZ.push_back(invz[i]);
+        visible.vDist.push_back(dist[i]);
+        if(bViewCos)
+            visible.vViewCos.push_back(viewCos[i]);
+    }
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,485 @@
+#include "PoseSolver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <Eigen/Cholesky>
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Huber cost of a squared error and its derivative (the weight of the observation)
+inline double Huber(const double e2, const double delta, double &w)
+{
+    const double delta2 = delta*delta;
+    if(e2<=delta2)
+    {
+        w = 1.0;
+        return e2;
+    }
+    const double e = std::sqrt(e2);
+    w = delta/e;
+    return 2.0*delta*e-delta2;
+}
+
+// Sum of the normal equations of the observations. In float the terms are summed over runs of
+// observations and the runs into H and b in double, so that the small terms are not lost in a
+// large sum.
+template<typename T>
+class NormalEquations
+{
+public:
+    NormalEquations(Eigen::Matrix<double,6,6> &H, Eigen::Matrix<double,6,1> &b): mH(H), mb(b), mnTerms(0)
+    {
+        mH.setZero();
+        mb.setZero();
+        mHRun.setZero();
+        mbRun.setZero();
+    }
+
+    template<int R>
+    void Add(const T wInfo, const Eigen::Matrix<T,R,6> &J, const Eigen::Matrix<T,R,1> &e)
+    {
+        mHRun.noalias() += wInfo*J.transpose()*J;
+        mbRun.noalias() -= wInfo*J.transpose()*e;
+        if(++mnTerms==RUN_LENGTH)
+            Flush();
+    }
+
+    void Flush()
+    {
+        mH += mHRun.template cast<double>();
+        mb += mbRun.template cast<double>();
+        mHRun.setZero();
+        mbRun.setZero();
+        mnTerms = 0;
+    }
+
+private:
+    static const int RUN_LENGTH = 32; //param
+
+    Eigen::Matrix<double,6,6> &mH;
+    Eigen::Matrix<double,6,1> &mb;
+    Eigen::Matrix<T,6,6> mHRun;
+    Eigen::Matrix<T,6,1> mbRun;
+    int mnTerms;
+};
+
+// In double every term goes straight into H and b
+template<>
+class NormalEquations<double>
+{
+public:
+    NormalEquations(Eigen::Matrix<double,6,6> &H, Eigen::Matrix<double,6,1> &b): mH(H), mb(b)
+    {
+        mH.setZero();
+        mb.setZero();
+    }
+
+    template<int R>
+    void Add(const double wInfo, const Eigen::Matrix<double,R,6> &J, const Eigen::Matrix<double,R,1> &e)
+    {
+        mH.noalias() += wInfo*J.transpose()*J;
+        mb.noalias() -= wInfo*J.transpose()*e;
+    }
+
+    void Flush() {}
+
+private:
+    Eigen::Matrix<double,6,6> &mH;
+    Eigen::Matrix<double,6,1> &mb;
+};
+}
+
+void PoseSolver::Observations::Clear()
+{
+    vX.clear(); vY.clear(); vZ.clear();
+    vU.clear(); vV.clear(); vUr.clear();
+    vInvSigma2.clear();
+    vChi2.clear();
+    vbInlier.clear();
+}
+
+PoseSolver::PoseSolver(): deltaMono(std::sqrt(5.991)), deltaStereo(std::sqrt(7.815)),
+    fx(0), fy(0), cx(0), cy(0), bf(0), mbSinglePrecision(false)
+{
+}
+
+void PoseSolver::Reset(const double fx_, const double fy_, const double cx_, const double cy_, const double bf_)
+{
+    fx = fx_;
+    fy = fy_;
+    cx = cx_;
+    cy = cy_;
+    bf = bf_;
+    mMono.Clear();
+    mStereo.Clear();
+    mvCameras.clear();
+    mRig.Clear();
+    mvRigCamera.clear();
+}
+
+void PoseSolver::AddMono(const Eigen::Vector3f &Xw, const float u, const float v, const float invSigma2)
+{
+    mMono.vX.push_back(Xw[0]);
+    mMono.vY.push_back(Xw[1]);
+    mMono.vZ.push_back(Xw[2]);
+    mMono.vU.push_back(u);
+    mMono.vV.push_back(v);
+    mMono.vInvSigma2.push_back(invSigma2);
+    mMono.vChi2.push_back(0);
+    mMono.vbInlier.push_back(true);
+}
+
+void PoseSolver::AddStereo(const Eigen::Vector3f &Xw, const float u, const float v, const float ur,
+                           const float invSigma2)
+{
+    mStereo.vX.push_back(Xw[0]);
+    mStereo.vY.push_back(Xw[1]);
+    mStereo.vZ.push_back(Xw[2]);
+    mStereo.vU.push_back(u);
+    mStereo.vV.push_back(v);
+    mStereo.vUr.push_back(ur);
+    mStereo.vInvSigma2.push_back(invSigma2);
+    mStereo.vChi2.push_back(0);
+    mStereo.vbInlier.push_back(true);
+}
+
+std::size_t PoseSolver::AddCamera(const double fx_, const double fy_, const double cx_, const double cy_,
+                                  const g2o::SE3Quat &Tcr)
+{
+    Camera camera;
+    camera.fx = fx_;
+    camera.fy = fy_;
+    camera.cx = cx_;
+    camera.cy = cy_;
+    camera.Rcr = Tcr.rotation().toRotationMatrix();
+    camera.tcr = Tcr.translation();
+    mvCameras.push_back(camera);
+    return mvCameras.size()-1;
+}
+
+void PoseSolver::AddRig(const std::size_t nCamera, const Eigen::Vector3f &Xw, const float u, const float v,
+                        const float invSigma2)
+{
+    mRig.vX.push_back(Xw[0]);
+    mRig.vY.push_back(Xw[1]);
+    mRig.vZ.push_back(Xw[2]);
+    mRig.vU.push_back(u);
+    mRig.vV.push_back(v);
+    mRig.vInvSigma2.push_back(invSigma2);
+    mRig.vChi2.push_back(0);
+    mRig.vbInlier.push_back(true);
+    mvRigCamera.push_back(nCamera);
+}
+
+template<typename T>
+Eigen::Matrix<T,3,1> PoseSolver::RigPoint(const std::size_t i, const Eigen::Matrix<T,3,3> &R, const Eigen::Matrix<T,3,1> &t) const
+{
+    const Camera &camera = mvCameras[mvRigCamera[i]];
+    const Eigen::Matrix<T,3,1> Xw(mRig.vX[i],mRig.vY[i],mRig.vZ[i]);
+    return camera.Rcr.cast<T>()*(R*Xw+t)+camera.tcr.cast<T>();
+}
+
+template<typename T>
+Eigen::Matrix<T,2,1> PoseSolver::RigError(const std::size_t i, const Eigen::Matrix<T,3,1> &Xc) const
+{
+    const Camera &camera = mvCameras[mvRigCamera[i]];
+    const T invz = T(1)/Xc[2];
+    return Eigen::Matrix<T,2,1>(mRig.vU[i]-(Xc[0]*invz*T(camera.fx)+T(camera.cx)),
+                                mRig.vV[i]-(Xc[1]*invz*T(camera.fy)+T(camera.cy)));
+}
+
+template<typename T>
+double PoseSolver::BuildSystem(const g2o::SE3Quat &Tcw, const bool bRobust, Matrix6d &H, Vector6d &b) const
+{
+    const Eigen::Matrix<T,3,3> R = Tcw.rotation().toRotationMatrix().cast<T>();
+    const Eigen::Matrix<T,3,1> t = Tcw.translation().cast<T>();
+    const T fu = fx, fv = fy, cu = cx, cv = cy, bfT = bf;
+
+    NormalEquations<T> equations(H,b);
+    double chi2 = 0;
+
+    Eigen::Matrix<T,2,6> J2;
+    const Observations &mono = mMono;
+    for(std::size_t i=0, iend=mono.Size(); i<iend; i++)
+    {
+        if(!mono.vbInlier[i])
+            continue;
+
+        const T x = R(0,0)*mono.vX[i]+R(0,1)*mono.vY[i]+R(0,2)*mono.vZ[i]+t[0];
+        const T y = R(1,0)*mono.vX[i]+R(1,1)*mono.vY[i]+R(1,2)*mono.vZ[i]+t[1];
+        const T z = R(2,0)*mono.vX[i]+R(2,1)*mono.vY[i]+R(2,2)*mono.vZ[i]+t[2];
+        const T invz = T(1)/z;
+        const T invz_2 = invz*invz;
+
+        const Eigen::Matrix<T,2,1> e(mono.vU[i]-(x*invz*fu+cu), mono.vV[i]-(y*invz*fv+cv));
+        const T info = mono.vInvSigma2[i];
+        const double e2 = info*e.squaredNorm();
+
+        double w = 1.0;
+        chi2 += bRobust ? Huber(e2,deltaMono,w) : e2;
+
+        J2 << x*y*invz_2*fu, -(1+x*x*invz_2)*fu, y*invz*fu, -invz*fu, 0, x*invz_2*fu,
+              (1+y*y*invz_2)*fv, -x*y*invz_2*fv, -x*invz*fv, 0, -invz*fv, y*invz_2*fv;
+
+        equations.Add(T(w)*info,J2,e);
+    }
+
+    Eigen::Matrix<T,3,6> J3;
+    const Observations &stereo = mStereo;
+    for(std::size_t i=0, iend=stereo.Size(); i<iend; i++)
+    {
+        if(!stereo.vbInlier[i])
+            continue;
+
+        const T x = R(0,0)*stereo.vX[i]+R(0,1)*stereo.vY[i]+R(0,2)*stereo.vZ[i]+t[0];
+        const T y = R(1,0)*stereo.vX[i]+R(1,1)*stereo.vY[i]+R(1,2)*stereo.vZ[i]+t[1];
+        const T z = R(2,0)*stereo.vX[i]+R(2,1)*stereo.vY[i]+R(2,2)*stereo.vZ[i]+t[2];
+        const T invz = T(1)/z;
+        const T invz_2 = invz*invz;
+
+        // the stereo edge projects with a float inverse depth
+        const float invzf = 1.0f/z;
+        const T u = x*invzf*fu+cu;
+        const Eigen::Matrix<T,3,1> e(stereo.vU[i]-u, stereo.vV[i]-(y*invzf*fv+cv), stereo.vUr[i]-(u-bfT*invzf));
+        const T info = stereo.vInvSigma2[i];
+        const double e2 = info*e.squaredNorm();
+
+        double w = 1.0;
+        chi2 += bRobust ? Huber(e2,deltaStereo,w) : e2;
+
+        J3 << x*y*invz_2*fu, -(1+x*x*invz_2)*fu, y*invz*fu, -invz*fu, 0, x*invz_2*fu,
+              (1+y*y*invz_2)*fv, -x*y*invz_2*fv, -x*invz*fv, 0, -invz*fv, y*invz_2*fv,
+              0, 0, 0, 0, 0, 0;
+        J3(2,0) = J3(0,0)-bfT*y*invz_2;
+        J3(2,1) = J3(0,1)+bfT*x*invz_2;
+        J3(2,2) = J3(0,2);
+        J3(2,3) = J3(0,3);
+        J3(2,5) = J3(0,5)-bfT*invz_2;
+
+        equations.Add(T(w)*info,J3,e);
+    }
+
+    // The update of the pose moves the point in the first camera, Xr to Xr+[w]x Xr+v, and the
+    // other camera sees that through Rcr
+    Eigen::Matrix<T,2,3> Jproj;
+    Eigen::Matrix<T,3,3> negSkew;
+    for(std::size_t i=0, iend=mRig.Size(); i<iend; i++)
+    {
+        if(!mRig.vbInlier[i])
+            continue;
+
+        const Camera &camera = mvCameras[mvRigCamera[i]];
+        const Eigen::Matrix<T,3,3> Rcr = camera.Rcr.cast<T>();
+        const Eigen::Matrix<T,3,1> Xr = R*Eigen::Matrix<T,3,1>(mRig.vX[i],mRig.vY[i],mRig.vZ[i])+t;
+        const Eigen::Matrix<T,3,1> Xc = Rcr*Xr+camera.tcr.cast<T>();
+        const T invz = T(1)/Xc[2];
+
+        const Eigen::Matrix<T,2,1> e = RigError<T>(i,Xc);
+        const T info = mRig.vInvSigma2[i];
+        const double e2 = info*e.squaredNorm();
+
+        double w = 1.0;
+        chi2 += bRobust ? Huber(e2,deltaMono,w) : e2;
+
+        Jproj << T(camera.fx)*invz, 0, -Xc[0]*invz*invz*T(camera.fx),
+                 0, T(camera.fy)*invz, -Xc[1]*invz*invz*T(camera.fy);
+        const Eigen::Matrix<T,2,3> JprojR = Jproj*Rcr;
+        negSkew << 0, Xr[2], -Xr[1],
+                   -Xr[2], 0, Xr[0],
+                   Xr[1], -Xr[0], 0;
+        J2.template leftCols<3>().noalias() = -JprojR*negSkew;
+        J2.template rightCols<3>() = -JprojR;
+
+        equations.Add(T(w)*info,J2,e);
+    }
+
+    equations.Flush();
+    return chi2;
+}
+
+template<typename T>
+double PoseSolver::ComputeCost(const g2o::SE3Quat &Tcw, const bool bRobust) const
+{
+    const Eigen::Matrix<T,3,3> R = Tcw.rotation().toRotationMatrix().cast<T>();
+    const Eigen::Matrix<T,3,1> t = Tcw.translation().cast<T>();
+    const T fu = fx, fv = fy, cu = cx, cv = cy, bfT = bf;
+
+    double chi2 = 0;
+    double w;
+
+    const Observations &mono = mMono;
+    for(std::size_t i=0, iend=mono.Size(); i<iend; i++)
+    {
+        if(!mono.vbInlier[i])
+            continue;
+
+        const T x = R(0,0)*mono.vX[i]+R(0,1)*mono.vY[i]+R(0,2)*mono.vZ[i]+t[0];
+        const T y = R(1,0)*mono.vX[i]+R(1,1)*mono.vY[i]+R(1,2)*mono.vZ[i]+t[1];
+        const T z = R(2,0)*mono.vX[i]+R(2,1)*mono.vY[i]+R(2,2)*mono.vZ[i]+t[2];
+        const T invz = T(1)/z;
+        const T eu = mono.vU[i]-(x*invz*fu+cu);
+        const T ev = mono.vV[i]-(y*invz*fv+cv);
+        const double e2 = mono.vInvSigma2[i]*(eu*eu+ev*ev);
+        chi2 += bRobust ? Huber(e2,deltaMono,w) : e2;
+    }
+
+    const Observations &stereo = mStereo;
+    for(std::size_t i=0, iend=stereo.Size(); i<iend; i++)
+    {
+        if(!stereo.vbInlier[i])
+            continue;
+
+        const T x = R(0,0)*stereo.vX[i]+R(0,1)*stereo.vY[i]+R(0,2)*stereo.vZ[i]+t[0];
+        const T y = R(1,0)*stereo.vX[i]+R(1,1)*stereo.vY[i]+R(1,2)*stereo.vZ[i]+t[1];
+        const T z = R(2,0)*stereo.vX[i]+R(2,1)*stereo.vY[i]+R(2,2)*stereo.vZ[i]+t[2];
+        const float invz = 1.0f/z;
+        const T u = x*invz*fu+cu;
+        const T eu = stereo.vU[i]-u;
+        const T ev = stereo.vV[i]-(y*invz*fv+cv);
+        const T er = stereo.vUr[i]-(u-bfT*invz);
+        const double e2 = stereo.vInvSigma2[i]*(eu*eu+ev*ev+er*er);
+        chi2 += bRobust ? Huber(e2,deltaStereo,w) : e2;
+    }
+
+    for(std::size_t i=0, iend=mRig.Size(); i<iend; i++)
+    {
+        if(!mRig.vbInlier[i])
+            continue;
+
+        const double e2 = mRig.vInvSigma2[i]*RigError<T>(i,RigPoint<T>(i,R,t)).squaredNorm();
+        chi2 += bRobust ? Huber(e2,deltaMono,w) : e2;
+    }
+
+    return chi2;
+}
+
+template<typename T>
+void PoseSolver::UpdateChi2(const g2o::SE3Quat &Tcw)
+{
+    const Eigen::Matrix<T,3,3> R = Tcw.rotation().toRotationMatrix().cast<T>();
+    const Eigen::Matrix<T,3,1> t = Tcw.translation().cast<T>();
+    const T fu = fx, fv = fy, cu = cx, cv = cy, bfT = bf;
+
+    for(std::size_t i=0, iend=mMono.Size(); i<iend; i++)
+    {
+        const T x = R(0,0)*mMono.vX[i]+R(0,1)*mMono.vY[i]+R(0,2)*mMono.vZ[i]+t[0];
+        const T y = R(1,0)*mMono.vX[i]+R(1,1)*mMono.vY[i]+R(1,2)*mMono.vZ[i]+t[1];
+        const T z = R(2,0)*mMono.vX[i]+R(2,1)*mMono.vY[i]+R(2,2)*mMono.vZ[i]+t[2];
+        const T invz = T(1)/z;
+        const T eu = mMono.vU[i]-(x*invz*fu+cu);
+        const T ev = mMono.vV[i]-(y*invz*fv+cv);
+        mMono.vChi2[i] = mMono.vInvSigma2[i]*(eu*eu+ev*ev);
+    }
+
+    for(std::size_t i=0, iend=mStereo.Size(); i<iend; i++)
+    {
+        const T x = R(0,0)*mStereo.vX[i]+R(0,1)*mStereo.vY[i]+R(0,2)*mStereo.vZ[i]+t[0];
+        const T y = R(1,0)*mStereo.vX[i]+R(1,1)*mStereo.vY[i]+R(1,2)*mStereo.vZ[i]+t[1];
+        const T z = R(2,0)*mStereo.vX[i]+R(2,1)*mStereo.vY[i]+R(2,2)*mStereo.vZ[i]+t[2];
+        const float invz = 1.0f/z;
+        const T u = x*invz*fu+cu;
+        const T eu = mStereo.vU[i]-u;
+        const T ev = mStereo.vV[i]-(y*invz*fv+cv);
+        const T er = mStereo.vUr[i]-(u-bfT*invz);
+        mStereo.vChi2[i] = mStereo.vInvSigma2[i]*(eu*eu+ev*ev+er*er);
+    }
+
+    for(std::size_t i=0, iend=mRig.Size(); i<iend; i++)
+        mRig.vChi2[i] = mRig.vInvSigma2[i]*RigError<T>(i,RigPoint<T>(i,R,t)).squaredNorm();
+}
+
+void PoseSolver::ComputeChi2(const g2o::SE3Quat &Tcw)
+{
+    if(mbSinglePrecision)
+        UpdateChi2<float>(Tcw);
+    else
+        UpdateChi2<double>(Tcw);
+}
+
+void PoseSolver::Optimize(g2o::SE3Quat &Tcw, const int nIterations, const bool bRobust)
+{
+    if(std::find(mMono.vbInlier.begin(),mMono.vbInlier.end(),true)==mMono.vbInlier.end() &&
+       std::find(mStereo.vbInlier.begin(),mStereo.vbInlier.end(),true)==mStereo.vbInlier.end() &&
+       std::find(mRig.vbInlier.begin(),mRig.vbInlier.end(),true)==mRig.vbInlier.end())
+        return;
+
+    // Same schedule as g2o::OptimizationAlgorithmLevenberg
+    const double tau = 1e-5;
+    const double goodStepUpperScale = 2./3.;
+    const double goodStepLowerScale = 1./3.;
+    const int maxTrialsAfterFailure = 10;
+
+    Matrix6d H;
+    Vector6d b;
+    double lambda = 0;
+    int ni = 2;
+    int nBad = 0;
+
+    for(int it=0; it<nIterations; it++)
+    {
+        double currentChi = mbSinglePrecision ? BuildSystem<float>(Tcw,bRobust,H,b) : BuildSystem<double>(Tcw,bRobust,H,b);
+        const double iniChi = currentChi;
+
+        if(it==0)
+            lambda = tau*H.diagonal().cwiseAbs().maxCoeff();
+
+        double rho = 0;
+        int nTrials = 0;
+        do
+        {
+            Matrix6d Hl = H;
+            Hl.diagonal().array() += lambda;
+            const Eigen::LDLT<Matrix6d> ldlt(Hl);
+
+            bool bGood = false;
+            if(ldlt.info()==Eigen::Success && ldlt.isPositive())
+            {
+                const Vector6d dx = ldlt.solve(b);
+                const g2o::SE3Quat Tnew = g2o::SE3Quat::exp(dx)*Tcw;
+                const double tempChi = mbSinglePrecision ? ComputeCost<float>(Tnew,bRobust) : ComputeCost<double>(Tnew,bRobust);
+
+                rho = (currentChi-tempChi)/(dx.dot(lambda*dx+b)+1e-3);
+                if(rho>0 && std::isfinite(tempChi))
+                {
+                    const double alpha = std::min(1.-std::pow(2*rho-1,3),goodStepUpperScale);
+                    lambda *= std::max(goodStepLowerScale,alpha);
+                    ni = 2;
+                    currentChi = tempChi;
+                    Tcw = Tnew;
+                    bGood = true;
+                }
+            }
+            else
+            {
+                rho = -1;
+            }
+
+            if(!bGood)
+            {
+                lambda *= ni;
+                ni *= 2;
+            }
+            nTrials++;
+        }
+        while(rho<0 && nTrials<maxTrialsAfterFailure);
+
+        if(nTrials==maxTrialsAfterFailure || rho==0)
+            break;
+
+        // the stop criterion of the g2o copy in Thirdparty
+        if((iniChi-currentChi)*1e3<iniChi)
+            nBad++;
+        else
+            nBad=0;
+
+        if(nBad>=3)
+            break;
+    }
+}
+
+} //namespace ORB_SLAM
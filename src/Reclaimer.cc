@@ -0,0 +1,163 @@
+#include "Reclaimer.h"
+#include "MapPoint.h"
+#include "KeyFrame.h"
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// A batch is sealed with the epoch of the first quiescent state after its objects were retired.
+// Two more epochs make sure every thread passed a quiescent state after the seal. One more is
+// needed because the scrub before a quiescent state may have run before the objects were bad,
+// and one more for pointers which a thread hands to another one just before its quiescent
+// state (new keyframes queued for local mapping), so the scrub of the receiver sees them.
+const unsigned long kGraceEpochs = 4;
+}
+
+Reclaimer::Reclaimer(): mnGlobalEpoch(0), mnPending(0)
+{
+    mCurrentBatch.nEpoch = 0;
+}
+
+Reclaimer::~Reclaimer()
+{
+    Clear();
+}
+
+int Reclaimer::RegisterThread()
+{
+    std::unique_lock<std::mutex> lock(mMutexReclaimer);
+
+    for(size_t i=0; i<mvbActive.size(); i++)
+    {
+        if(!mvbActive[i])
+        {
+            mvbActive[i] = true;
+            mvnLocalEpochs[i] = mnGlobalEpoch;
+            return i;
+        }
+    }
+
+    mvbActive.push_back(true);
+    mvnLocalEpochs.push_back(mnGlobalEpoch);
+    return mvbActive.size()-1;
+}
+
+void Reclaimer::UnregisterThread(const int nId)
+{
+    std::unique_lock<std::mutex> lock(mMutexReclaimer);
+    mvbActive[nId] = false;
+}
+
+void Reclaimer::QuiescentState(const int nId)
+{
+    std::vector<Batch> vToFree;
+    {
+        std::unique_lock<std::mutex> lock(mMutexReclaimer);
+
+        mvnLocalEpochs[nId] = mnGlobalEpoch;
+
+        // The epoch advances once every active thread has seen the current one
+        bool bAllSeen = true;
+        for(size_t i=0; i<mvbActive.size(); i++)
+        {
+            if(mvbActive[i] && mvnLocalEpochs[i]!=mnGlobalEpoch)
+            {
+                bAllSeen = false;
+                break;
+            }
+        }
+        if(bAllSeen)
+            mnGlobalEpoch++;
+
+        if(!mCurrentBatch.vpMapPoints.empty() || !mCurrentBatch.vpKeyFrames.empty())
+        {
+            mqSealedBatches.push_back(Batch());
+            mqSealedBatches.back().nEpoch = mnGlobalEpoch;
+            mqSealedBatches.back().vpMapPoints.swap(mCurrentBatch.vpMapPoints);
+            mqSealedBatches.back().vpKeyFrames.swap(mCurrentBatch.vpKeyFrames);
+        }
+
+        while(!mqSealedBatches.empty() && mqSealedBatches.front().nEpoch+kGraceEpochs<=mnGlobalEpoch)
+        {
+            vToFree.push_back(Batch());
+            vToFree.back().vpMapPoints.swap(mqSealedBatches.front().vpMapPoints);
+            vToFree.back().vpKeyFrames.swap(mqSealedBatches.front().vpKeyFrames);
+            mnPending -= vToFree.back().vpMapPoints.size() + vToFree.back().vpKeyFrames.size();
+            mqSealedBatches.pop_front();
+        }
+    }
+
+    // Freeing takes the locks of the objects, not done under our own lock
+    if(!vToFree.empty())
+        Free(vToFree);
+}
+
+void Reclaimer::Retire(MapPoint *pMP)
+{
+    std::unique_lock<std::mutex> lock(mMutexReclaimer);
+    mCurrentBatch.vpMapPoints.push_back(pMP);
+    mnPending++;
+}
+
+void Reclaimer::Retire(KeyFrame *pKF)
+{
+    std::unique_lock<std::mutex> lock(mMutexReclaimer);
+    mCurrentBatch.vpKeyFrames.push_back(pKF);
+    mnPending++;
+}
+
+void Reclaimer::Clear()
+{
+    std::unique_lock<std::mutex> lock(mMutexReclaimer);
+
+    mqSealedBatches.push_back(Batch());
+    mqSealedBatches.back().vpMapPoints.swap(mCurrentBatch.vpMapPoints);
+    mqSealedBatches.back().vpKeyFrames.swap(mCurrentBatch.vpKeyFrames);
+
+    for(std::deque<Batch>::iterator bit=mqSealedBatches.begin(), bend=mqSealedBatches.end(); bit!=bend; bit++)
+    {
+        for(size_t i=0; i<bit->vpMapPoints.size(); i++)
+            delete bit->vpMapPoints[i];
+        for(size_t i=0; i<bit->vpKeyFrames.size(); i++)
+            delete bit->vpKeyFrames[i];
+    }
+    mqSealedBatches.clear();
+    mnPending = 0;
+
+    for(size_t i=0; i<mvpReleasedKeyFrames.size(); i++)
+        delete mvpReleasedKeyFrames[i];
+    mvpReleasedKeyFrames.clear();
+}
+
+size_t Reclaimer::GetNumPending()
+{
+    std::unique_lock<std::mutex> lock(mMutexReclaimer);
+    return mnPending;
+}
+
+void Reclaimer::Free(std::vector<Batch> &vBatches)
+{
+    std::vector<KeyFrame*> vpReleased;
+    for(size_t i=0; i<vBatches.size(); i++)
+    {
+        for(size_t j=0; j<vBatches[i].vpMapPoints.size(); j++)
+            delete vBatches[i].vpMapPoints[j];
+
+        for(size_t j=0; j<vBatches[i].vpKeyFrames.size(); j++)
+        {
+            KeyFrame* pKF = vBatches[i].vpKeyFrames[j];
+            pKF->ReleaseFeatures();
+            vpReleased.push_back(pKF);
+        }
+    }
+
+    if(!vpReleased.empty())
+    {
+        std::unique_lock<std::mutex> lock(mMutexReclaimer);
+        mvpReleasedKeyFrames.insert(mvpReleasedKeyFrames.end(),vpReleased.begin(),vpReleased.end());
+    }
+}
+
+} //namespace ORB_SLAM
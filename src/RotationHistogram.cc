@@ -0,0 +1,121 @@
+#include "RotationHistogram.h"
+
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+const int RotationHistogram::HISTO_LENGTH;
+
+RotationHistogram& RotationHistogram::Local()
+{
+    static thread_local RotationHistogram histogram;
+    histogram.Clear();
+    return histogram;
+}
+
+void RotationHistogram::Clear()
+{
+    for(int i=0; i<HISTO_LENGTH; i++)
+        mCounts[i] = 0;
+    mvBins.clear();
+    mvIndices.clear();
+}
+
+void RotationHistogram::Add(const float angle1, const float angle2, const int idx)
+{
+    float rot = angle1-angle2;
+    if(rot<0.0)
+        rot+=360.0f;
+    // The bins are HISTO_LENGTH degrees wide, so only the first 13 of them are ever used
+    int bin = round(rot*(1.0f/HISTO_LENGTH));
+    if(bin==HISTO_LENGTH)
+        bin=0;
+    assert(bin>=0 && bin<HISTO_LENGTH);
+
+    mCounts[bin]++;
+    mvBins.push_back(bin);
+    mvIndices.push_back(idx);
+}
+
+const vector<int>& RotationHistogram::ComputeRejected()
+{
+    int ind1=-1;
+    int ind2=-1;
+    int ind3=-1;
+    ComputeThreeMaxima(ind1,ind2,ind3);
+
+    // Start of every rejected bin in mvRejected, -1 for the kept ones
+    int starts[HISTO_LENGTH];
+    int nRejected = 0;
+    for(int i=0; i<HISTO_LENGTH; i++)
+    {
+        if(i==ind1 || i==ind2 || i==ind3)
+        {
+            starts[i] = -1;
+            continue;
+        }
+        starts[i] = nRejected;
+        nRejected += mCounts[i];
+    }
+
+    mvRejected.resize(nRejected);
+    for(size_t j=0, jend=mvIndices.size(); j<jend; j++)
+    {
+        const int bin = mvBins[j];
+        if(starts[bin]>=0)
+            mvRejected[starts[bin]++] = mvIndices[j];
+    }
+    return mvRejected;
+}
+
+void RotationHistogram::ComputeThreeMaxima(int &ind1, int &ind2, int &ind3) const
+{
+    int max1=0;
+    int max2=0;
+    int max3=0;
+
+    // searches for the 3 biggest peaks in the histogram
+    // (three most common value ranges)
+    for(int i=0; i<HISTO_LENGTH; i++)
+    {
+        const int s = mCounts[i];
+        if(s>max1)
+        {
+            max3=max2;
+            max2=max1;
+            max1=s;
+            ind3=ind2;
+            ind2=ind1;
+            ind1=i;
+        }
+        else if(s>max2)
+        {
+            max3=max2;
+            max2=s;
+            ind3=ind2;
+            ind2=i;
+        }
+        else if(s>max3)
+        {
+            max3=s;
+            ind3=i;
+        }
+    }
+
+    // if max2 or max3 are much smaller than max1 just ignore them
+    if(max2<0.1f*(float)max1)
+    {
+        ind2=-1;
+        ind3=-1;
+    }
+    else if(max3<0.1f*(float)max1)
+    {
+        ind3=-1;
+    }
+}
+
+} //namespace ORB_SLAM
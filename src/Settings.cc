@@ -0,0 +1,446 @@
+#include "Settings.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+template<typename T>
+void Append(vector<char> &vData, const T &value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    vData.insert(vData.end(),p,p+sizeof(T));
+}
+
+void AppendString(vector<char> &vData, const string &s)
+{
+    Append(vData,static_cast<uint32_t>(s.size()));
+    vData.insert(vData.end(),s.begin(),s.end());
+}
+
+// Reads the values of Decode, every read fails once one runs past the end
+class Reader
+{
+public:
+    Reader(const vector<char> &vData): mvData(vData), mnPos(0), mbOk(true) {}
+
+    template<typename T>
+    bool Read(T &value)
+    {
+        if(!mbOk || sizeof(T)>mvData.size()-mnPos)
+            return mbOk = false;
+        memcpy(&value,&mvData[mnPos],sizeof(T));
+        mnPos += sizeof(T);
+        return true;
+    }
+
+    bool ReadBytes(void* p, const size_t n)
+    {
+        if(!mbOk || n>mvData.size()-mnPos)
+            return mbOk = false;
+        if(n)
+            memcpy(p,&mvData[mnPos],n);
+        mnPos += n;
+        return true;
+    }
+
+    bool ReadString(string &s)
+    {
+        uint32_t n;
+        if(!Read(n) || n>mvData.size()-mnPos)
+            return mbOk = false;
+        s.assign(mvData.begin()+mnPos,mvData.begin()+mnPos+n);
+        mnPos += n;
+        return true;
+    }
+
+    size_t Remaining() const { return mbOk ? mvData.size()-mnPos : 0; }
+
+    bool AtEnd() const { return mbOk && mnPos==mvData.size(); }
+
+private:
+    const vector<char> &mvData;
+    size_t mnPos;
+    bool mbOk;
+};
+
+// Deepest nesting of sequences a binary file may have
+const int MAX_DEPTH = 16;
+
+void EncodeNode(vector<char> &vData, const Settings::Node &node)
+{
+    Append(vData,static_cast<uint8_t>(node.type()));
+    if(node.isNumber())
+        Append(vData,static_cast<double>(node));
+    else if(node.isString())
+        AppendString(vData,static_cast<string>(node));
+    else if(node.isMatrix())
+    {
+        cv::Mat mat;
+        node >> mat;
+        Append(vData,static_cast<int32_t>(mat.rows));
+        Append(vData,static_cast<int32_t>(mat.cols));
+        Append(vData,static_cast<int32_t>(mat.type()));
+        for(int i=0; i<mat.rows; i++)
+            vData.insert(vData.end(),mat.ptr<char>(i),mat.ptr<char>(i)+mat.cols*mat.elemSize());
+    }
+    else if(node.isSeq())
+    {
+        Append(vData,static_cast<uint32_t>(node.size()));
+        for(size_t i=0; i<node.size(); i++)
+            EncodeNode(vData,node[i]);
+    }
+}
+
+int Round(const double value)
+{
+    return static_cast<int>(floor(value+0.5));
+}
+
+string ItemName(const string &name, const size_t i)
+{
+    stringstream ss;
+    ss << name << "[" << i << "]";
+    return ss.str();
+}
+}
+
+const char Settings::MAGIC[8] = {'O','R','B','S','E','T','S','\0'};
+
+Settings::Node::operator int() const
+{
+    if(mType==NUMBER)
+        return Round(mNumber);
+    if(mType!=NONE)
+        WarnType(true);
+    return 0;
+}
+
+Settings::Node::operator float() const
+{
+    return static_cast<float>(static_cast<double>(*this));
+}
+
+Settings::Node::operator double() const
+{
+    if(mType==NUMBER)
+        return mNumber;
+    if(mType!=NONE)
+        WarnType(true);
+    return 0;
+}
+
+Settings::Node::operator string() const
+{
+    if(mType==STRING)
+        return mString;
+    if(mType!=NONE)
+        WarnType(false);
+    return string();
+}
+
+void Settings::Node::operator>>(cv::Mat &mat) const
+{
+    if(mType==MATRIX)
+        mat = mMatrix.clone();
+    else
+    {
+        if(mType!=NONE)
+            cerr << "Settings: " << mName << " is not a matrix" << endl;
+        mat.release();
+    }
+}
+
+const Settings::Node& Settings::Node::operator[](const size_t i) const
+{
+    static const Node empty;
+    return i<mvItems.size() ? mvItems[i] : empty;
+}
+
+void Settings::Node::WarnType(const bool bNumber) const
+{
+    cerr << "Settings: " << mName << " is not a " << (bNumber ? "number" : "string") << ", read as "
+         << (bNumber ? "0" : "\"\"") << endl;
+}
+
+Settings::Settings(): mbLoaded(false), mnHash(0)
+{
+}
+
+bool Settings::IsBinaryFile(const string &filename)
+{
+    ifstream f(filename.c_str(), ios::binary);
+    char magic[sizeof(MAGIC)];
+    return f.read(magic,sizeof(magic)) && memcmp(magic,MAGIC,sizeof(MAGIC))==0;
+}
+
+bool Settings::Load(const string &filename)
+{
+    mmValues.clear();
+    mbLoaded = false;
+    mnHash = 0;
+
+    const bool bOk = IsBinaryFile(filename) ? LoadBinary(filename) : LoadYAML(filename);
+    if(!bOk)
+    {
+        mmValues.clear();
+        return false;
+    }
+
+    const vector<char> vData = Encode();
+    uint64_t nHash = FNV_OFFSET;
+    for(size_t i=0; i<vData.size(); i++)
+    {
+        nHash ^= static_cast<uint8_t>(vData[i]);
+        nHash *= FNV_PRIME;
+    }
+
+    mFilename = filename;
+    mbLoaded = true;
+    mnHash = nHash;
+    return true;
+}
+
+bool Settings::LoadYAML(const string &filename)
+{
+    cv::FileStorage fs(filename.c_str(), cv::FileStorage::READ);
+    if(!fs.isOpened())
+        return false;
+
+    // Sequences are read depth first, an element of a sequence is named after its index
+    struct Parser
+    {
+        static void Parse(const cv::FileNode &fn, const string &name, Node &node)
+        {
+            node.mName = name;
+            if(fn.isInt() || fn.isReal())
+            {
+                node.mType = Node::NUMBER;
+                node.mNumber = static_cast<double>(fn);
+            }
+            else if(fn.isString())
+            {
+                node.mType = Node::STRING;
+                node.mString = static_cast<string>(fn);
+            }
+            else if(fn.isSeq())
+            {
+                node.mType = Node::SEQUENCE;
+                node.mvItems.resize(fn.size());
+                size_t i = 0;
+                for(cv::FileNodeIterator it = fn.begin(); it != fn.end(); it++, i++)
+                    Parse(*it,ItemName(name,i),node.mvItems[i]);
+            }
+            else if(fn.isMap() && !fn["data"].empty())
+            {
+                node.mType = Node::MATRIX;
+                fn >> node.mMatrix;
+            }
+            else if(fn.isMap())
+                cerr << "Settings: ignoring the map " << name << ", only opencv-matrix maps are read" << endl;
+        }
+    };
+
+    const cv::FileNode root = fs.root();
+    for(cv::FileNodeIterator it = root.begin(); it != root.end(); it++)
+    {
+        const cv::FileNode fn = *it;
+        Node node;
+        Parser::Parse(fn,fn.name(),node);
+        if(!node.empty())
+            mmValues[fn.name()] = node;
+    }
+    return true;
+}
+
+bool Settings::LoadBinary(const string &filename)
+{
+    ifstream f(filename.c_str(), ios::binary);
+    vector<char> vData((istreambuf_iterator<char>(f)),istreambuf_iterator<char>());
+    if(vData.size()<sizeof(MAGIC)+sizeof(uint32_t))
+        return false;
+
+    uint32_t nVersion;
+    memcpy(&nVersion,&vData[sizeof(MAGIC)],sizeof(nVersion));
+    if(nVersion!=VERSION)
+    {
+        cerr << "Settings file " << filename << " is of version " << nVersion << ", expected " << VERSION << endl;
+        return false;
+    }
+
+    vData.erase(vData.begin(),vData.begin()+sizeof(MAGIC)+sizeof(uint32_t));
+    if(!Decode(vData))
+    {
+        cerr << "Settings file " << filename << " is corrupt" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool Settings::Save(const string &filename) const
+{
+    ofstream f(filename.c_str(), ios::binary);
+    const uint32_t nVersion = VERSION;
+    const vector<char> vData = Encode();
+    f.write(MAGIC,sizeof(MAGIC));
+    f.write(reinterpret_cast<const char*>(&nVersion),sizeof(nVersion));
+    if(!vData.empty())
+        f.write(&vData[0],vData.size());
+    f.close();
+    return !f.fail();
+}
+
+vector<char> Settings::Encode() const
+{
+    vector<char> vData;
+    Append(vData,static_cast<uint32_t>(mmValues.size()));
+    for(map<string,Node>::const_iterator it=mmValues.begin(); it!=mmValues.end(); it++)
+    {
+        AppendString(vData,it->first);
+        EncodeNode(vData,it->second);
+    }
+    return vData;
+}
+
+bool Settings::Decode(const vector<char> &vData)
+{
+    struct Parser
+    {
+        static bool Parse(Reader &reader, const string &name, const int depth, Node &node)
+        {
+            uint8_t type;
+            if(!reader.Read(type))
+                return false;
+            node.mName = name;
+            node.mType = static_cast<Node::Type>(type);
+            if(type==Node::NUMBER)
+                return reader.Read(node.mNumber);
+            if(type==Node::STRING)
+                return reader.ReadString(node.mString);
+            if(type==Node::MATRIX)
+            {
+                int32_t rows, cols, matType;
+                if(!reader.Read(rows) || !reader.Read(cols) || !reader.Read(matType) || rows<0 || cols<0 ||
+                        CV_MAT_DEPTH(matType)>CV_64F || (matType & ~CV_MAT_TYPE_MASK))
+                    return false;
+                if(!rows || !cols)
+                    return true;
+                // A size the rest of the file can not hold is rejected before it is allocated
+                const size_t nRowBytes = static_cast<size_t>(cols)*CV_ELEM_SIZE(matType);
+                if(nRowBytes>reader.Remaining() || static_cast<size_t>(rows)>reader.Remaining()/nRowBytes)
+                    return false;
+                node.mMatrix.create(rows,cols,matType);
+                for(int i=0; i<rows; i++)
+                    if(!reader.ReadBytes(node.mMatrix.ptr<char>(i),nRowBytes))
+                        return false;
+                return true;
+            }
+            if(type==Node::SEQUENCE)
+            {
+                uint32_t n;
+                if(depth>=MAX_DEPTH || !reader.Read(n))
+                    return false;
+                for(uint32_t i=0; i<n; i++)
+                {
+                    node.mvItems.push_back(Node());
+                    if(!Parse(reader,ItemName(name,i),depth+1,node.mvItems.back()))
+                        return false;
+                }
+                return true;
+            }
+            return false;
+        }
+    };
+
+    Reader reader(vData);
+    uint32_t nKeys;
+    if(!reader.Read(nKeys))
+        return false;
+    for(uint32_t i=0; i<nKeys; i++)
+    {
+        string key;
+        Node node;
+        if(!reader.ReadString(key) || !Parser::Parse(reader,key,0,node) || node.empty())
+            return false;
+        mmValues[key] = node;
+    }
+    return reader.AtEnd();
+}
+
+const Settings::Node& Settings::operator[](const string &key) const
+{
+    static const Node empty;
+    const map<string,Node>::const_iterator it = mmValues.find(key);
+    return it==mmValues.end() ? empty : it->second;
+}
+
+bool Settings::Validate(const int sensor) const
+{
+    struct Check
+    {
+        const char* key;
+        double min;
+        bool bExclusive;
+    };
+    // Minimum of every value the tracking needs, System::eSensor: MONOCULAR=0, STEREO=1, RGBD=2
+    const Check checks[] = {{"Camera.fx",0,true}, {"Camera.fy",0,true}, {"Camera.cx",0,false}, {"Camera.cy",0,false},
+                            {"ORBextractor.nFeatures",1,false}, {"ORBextractor.scaleFactor",1,true},
+                            {"ORBextractor.nLevels",1,false}, {"ORBextractor.iniThFAST",1,false},
+                            {"ORBextractor.minThFAST",1,false}};
+    const Check depthChecks[] = {{"Camera.bf",0,true}, {"ThDepth",0,true}};
+
+    vector<Check> vChecks(checks,checks+sizeof(checks)/sizeof(checks[0]));
+    if(sensor!=0)
+        vChecks.insert(vChecks.end(),depthChecks,depthChecks+sizeof(depthChecks)/sizeof(depthChecks[0]));
+
+    bool bOk = true;
+    for(size_t i=0; i<vChecks.size(); i++)
+    {
+        const Check &check = vChecks[i];
+        const Node &node = (*this)[check.key];
+        if(node.empty())
+        {
+            cerr << "Settings: " << check.key << " is missing" << endl;
+            bOk = false;
+        }
+        else if(!node.isNumber())
+        {
+            cerr << "Settings: " << check.key << " is not a number" << endl;
+            bOk = false;
+        }
+        else if(check.bExclusive ? static_cast<double>(node)<=check.min : static_cast<double>(node)<check.min)
+        {
+            cerr << "Settings: " << check.key << " is " << static_cast<double>(node) << ", expected "
+                 << (check.bExclusive ? "> " : ">= ") << check.min << endl;
+            bOk = false;
+        }
+    }
+
+    if((double)(*this)["ORBextractor.minThFAST"]>(double)(*this)["ORBextractor.iniThFAST"])
+    {
+        cerr << "Settings: ORBextractor.minThFAST is above ORBextractor.iniThFAST" << endl;
+        bOk = false;
+    }
+    return bOk;
+}
+
+string Settings::FormatHash(const uint64_t nHash)
+{
+    stringstream ss;
+    ss << hex << setw(16) << setfill('0') << nHash;
+    return ss.str();
+}
+
+} //namespace ORB_SLAM
@@ -24,23 +24,26 @@
 #include <vector>
 #include <cmath>
 #include <opencv2/core/core.hpp>
+#include <Eigen/Eigenvalues>
+#include <Eigen/Geometry>
 
+#include "Converter.h"
 #include "KeyFrame.h"
 #include "ORBmatcher.h"
 
-#include "Thirdparty/DBoW2/DUtils/Random.h"
-
 namespace ORB_SLAM2
 {
 
 
 Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *> &vpMatched12, const bool bFixScale):
-    mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale)
+    mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale), mRandom(RandomStream::Hash(pKF1->mnId,pKF2->mnId))
 {
     mpKF1 = pKF1;
     mpKF2 = pKF2;
 
     vector<MapPoint*> vpKeyFrameMP1 = pKF1->GetMapPointMatches();
+    const SharedArray<cv::KeyPoint> vKeysUn1 = pKF1->GetFeatures().vKeysUn;
+    const SharedArray<cv::KeyPoint> vKeysUn2 = pKF2->GetFeatures().vKeysUn;
 
     mN1 = vpMatched12.size();
 
@@ -48,13 +51,20 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
     mvpMapPoints2.reserve(mN1);
     mvpMatches12 = vpMatched12;
     mvnIndices1.reserve(mN1);
-    mvX3Dc1.reserve(mN1);
-    mvX3Dc2.reserve(mN1);
 
-    cv::Mat Rcw1 = pKF1->GetRotation();
-    cv::Mat tcw1 = pKF1->GetTranslation();
-    cv::Mat Rcw2 = pKF2->GetRotation();
-    cv::Mat tcw2 = pKF2->GetTranslation();
+    mfx1 = pKF1->fx;
+    mfy1 = pKF1->fy;
+    mcx1 = pKF1->cx;
+    mcy1 = pKF1->cy;
+    mfx2 = pKF2->fx;
+    mfy2 = pKF2->fy;
+    mcx2 = pKF2->cx;
+    mcy2 = pKF2->cy;
+
+    Eigen::Matrix3f Rcw1, Rcw2;
+    Eigen::Vector3f tcw1, tcw2;
+    pKF1->GetPose(Rcw1,tcw1);
+    pKF2->GetPose(Rcw2,tcw2);
 
     mvAllIndices.reserve(mN1);
 
@@ -78,36 +88,45 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
             if(indexKF1<0 || indexKF2<0)
                 continue;
 
-            const cv::KeyPoint &kp1 = pKF1->mvKeysUn[indexKF1];
-            const cv::KeyPoint &kp2 = pKF2->mvKeysUn[indexKF2];
+            const cv::KeyPoint &kp1 = vKeysUn1[indexKF1];
+            const cv::KeyPoint &kp2 = vKeysUn2[indexKF2];
 
             const float sigmaSquare1 = pKF1->mvLevelSigma2[kp1.octave];
             const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
 
-            mvnMaxError1.push_back(9.210*sigmaSquare1);
-            mvnMaxError2.push_back(9.210*sigmaSquare2);
+            // Truncated as the thresholds always were
+            mvMaxError1.push_back(static_cast<size_t>(9.210*sigmaSquare1));
+            mvMaxError2.push_back(static_cast<size_t>(9.210*sigmaSquare2));
 
             mvpMapPoints1.push_back(pMP1);
             mvpMapPoints2.push_back(pMP2);
             mvnIndices1.push_back(i1);
 
-            cv::Mat X3D1w = pMP1->GetWorldPos();
-            mvX3Dc1.push_back(Rcw1*X3D1w+tcw1);
-
-            cv::Mat X3D2w = pMP2->GetWorldPos();
-            mvX3Dc2.push_back(Rcw2*X3D2w+tcw2);
+            Eigen::Vector3f X3D1w, X3D2w;
+            pMP1->GetWorldPos(X3D1w);
+            pMP2->GetWorldPos(X3D2w);
+            const Eigen::Vector3f X3Dc1 = Rcw1*X3D1w+tcw1;
+            const Eigen::Vector3f X3Dc2 = Rcw2*X3D2w+tcw2;
+
+            mvX1.push_back(X3Dc1(0));
+            mvY1.push_back(X3Dc1(1));
+            mvZ1.push_back(X3Dc1(2));
+            mvX2.push_back(X3Dc2(0));
+            mvY2.push_back(X3Dc2(1));
+            mvZ2.push_back(X3Dc2(2));
+
+            const float invz1 = 1/X3Dc1(2);
+            const float invz2 = 1/X3Dc2(2);
+            mvU1.push_back(mfx1*X3Dc1(0)*invz1+mcx1);
+            mvV1.push_back(mfy1*X3Dc1(1)*invz1+mcy1);
+            mvU2.push_back(mfx2*X3Dc2(0)*invz2+mcx2);
+            mvV2.push_back(mfy2*X3Dc2(1)*invz2+mcy2);
 
             mvAllIndices.push_back(idx);
             idx++;
         }
     }
 
-    mK1 = pKF1->mK;
-    mK2 = pKF2->mK;
-
-    FromCameraToImage(mvX3Dc1,mvP1im1,mK1);
-    FromCameraToImage(mvX3Dc2,mvP2im2,mK2);
-
     SetRansacParameters();
 }
 
@@ -119,7 +138,9 @@ void Sim3Solver::SetRansacParameters(double probability, int minInliers, int max
 
     N = mvpMapPoints1.size(); // number of correspondences
 
-    mvbInliersi.resize(N);
+    mvbInliersi.setConstant(N,false);
+    mvErr1.resize(N);
+    mvErr2.resize(N);
 
     // Adjust Parameters according to number of correspondences
     float epsilon = (float)mRansacMinInliers/N;
@@ -149,10 +170,8 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
         return cv::Mat();
     }
 
-    vector<size_t> vAvailableIndices;
-
-    cv::Mat P3Dc1i(3,3,CV_32F);
-    cv::Mat P3Dc2i(3,3,CV_32F);
+    Eigen::Matrix3f P3Dc1i;
+    Eigen::Matrix3f P3Dc2i;
 
     int nCurrentIterations = 0;
     while(mnIterations<mRansacMaxIts && nCurrentIterations<nIterations)
@@ -160,20 +179,20 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
         nCurrentIterations++;
         mnIterations++;
 
-        vAvailableIndices = mvAllIndices;
+        mvAvailableIndices = mvAllIndices;
 
         // Get min set of points
         for(short i = 0; i < 3; ++i)
         {
-            int randi = DUtils::Random::RandomInt(0, vAvailableIndices.size()-1);
+            int randi = mRandom.RandomInt(0, mvAvailableIndices.size()-1);
 
-            int idx = vAvailableIndices[randi];
+            int idx = mvAvailableIndices[randi];
 
-            mvX3Dc1[idx].copyTo(P3Dc1i.col(i));
-            mvX3Dc2[idx].copyTo(P3Dc2i.col(i));
+            P3Dc1i.col(i) << mvX1[idx], mvY1[idx], mvZ1[idx];
+            P3Dc2i.col(i) << mvX2[idx], mvY2[idx], mvZ2[idx];
 
-            vAvailableIndices[randi] = vAvailableIndices.back();
-            vAvailableIndices.pop_back();
+            mvAvailableIndices[randi] = mvAvailableIndices.back();
+            mvAvailableIndices.pop_back();
         }
 
         ComputeSim3(P3Dc1i,P3Dc2i);
@@ -184,9 +203,8 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
         {
             mvbBestInliers = mvbInliersi;
             mnBestInliers = mnInliersi;
-            mBestT12 = mT12i.clone();
-            mBestRotation = mR12i.clone();
-            mBestTranslation = mt12i.clone();
+            mBestRotation = mR12i;
+            mBestTranslation = mt12i;
             mBestScale = ms12i;
 
             if(mnInliersi>mRansacMinInliers)
@@ -195,7 +213,7 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
                 for(int i=0; i<N; i++)
                     if(mvbInliersi[i])
                         vbInliers[mvnIndices1[i]] = true;
-                return mBestT12;
+                return Converter::toCvSE3(mBestScale*mBestRotation,mBestTranslation);
             }
         }
     }
@@ -212,99 +230,48 @@ cv::Mat Sim3Solver::find(vector<bool> &vbInliers12, int &nInliers)
     return iterate(mRansacMaxIts,bFlag,vbInliers12,nInliers);
 }
 
-void Sim3Solver::ComputeCentroid(cv::Mat &P, cv::Mat &Pr, cv::Mat &C)
-{
-    cv::reduce(P,C,1,CV_REDUCE_SUM);
-    C = C/P.cols;
-
-    for(int i=0; i<P.cols; i++)
-    {
-        Pr.col(i)=P.col(i)-C;
-    }
-}
-
-void Sim3Solver::ComputeSim3(cv::Mat &P1, cv::Mat &P2)
+void Sim3Solver::ComputeSim3(const Eigen::Matrix3f &P1, const Eigen::Matrix3f &P2)
 {
     // Custom implementation of:
     // Horn 1987, Closed-form solution of absolute orientataion using unit quaternions
 
     // Step 1: Centroid and relative coordinates
 
-    cv::Mat Pr1(P1.size(),P1.type()); // Relative coordinates to centroid (set 1)
-    cv::Mat Pr2(P2.size(),P2.type()); // Relative coordinates to centroid (set 2)
-    cv::Mat O1(3,1,Pr1.type()); // Centroid of P1
-    cv::Mat O2(3,1,Pr2.type()); // Centroid of P2
-
-    ComputeCentroid(P1,Pr1,O1);
-    ComputeCentroid(P2,Pr2,O2);
+    const Eigen::Vector3f O1 = P1.rowwise().mean(); // Centroid of P1
+    const Eigen::Vector3f O2 = P2.rowwise().mean(); // Centroid of P2
+    const Eigen::Matrix3f Pr1 = P1.colwise()-O1; // Relative coordinates to centroid (set 1)
+    const Eigen::Matrix3f Pr2 = P2.colwise()-O2; // Relative coordinates to centroid (set 2)
 
     // Step 2: Compute M matrix
 
-    cv::Mat M = Pr2*Pr1.t();
+    const Eigen::Matrix3d M = (Pr2*Pr1.transpose()).cast<double>();
 
     // Step 3: Compute N matrix
 
-    double N11, N12, N13, N14, N22, N23, N24, N33, N34, N44;
-
-    cv::Mat N(4,4,P1.type());
-
-    N11 = M.at<float>(0,0)+M.at<float>(1,1)+M.at<float>(2,2);
-    N12 = M.at<float>(1,2)-M.at<float>(2,1);
-    N13 = M.at<float>(2,0)-M.at<float>(0,2);
-    N14 = M.at<float>(0,1)-M.at<float>(1,0);
-    N22 = M.at<float>(0,0)-M.at<float>(1,1)-M.at<float>(2,2);
-    N23 = M.at<float>(0,1)+M.at<float>(1,0);
-    N24 = M.at<float>(2,0)+M.at<float>(0,2);
-    N33 = -M.at<float>(0,0)+M.at<float>(1,1)-M.at<float>(2,2);
-    N34 = M.at<float>(1,2)+M.at<float>(2,1);
-    N44 = -M.at<float>(0,0)-M.at<float>(1,1)+M.at<float>(2,2);
+    Eigen::Matrix4d N;
+    N << M(0,0)+M(1,1)+M(2,2), M(1,2)-M(2,1),          M(2,0)-M(0,2),          M(0,1)-M(1,0),
+         M(1,2)-M(2,1),        M(0,0)-M(1,1)-M(2,2),   M(0,1)+M(1,0),          M(2,0)+M(0,2),
+         M(2,0)-M(0,2),        M(0,1)+M(1,0),          -M(0,0)+M(1,1)-M(2,2),  M(1,2)+M(2,1),
+         M(0,1)-M(1,0),        M(2,0)+M(0,2),          M(1,2)+M(2,1),          -M(0,0)-M(1,1)+M(2,2);
 
-    N = (cv::Mat_<float>(4,4) << N11, N12, N13, N14,
-                                 N12, N22, N23, N24,
-                                 N13, N23, N33, N34,
-                                 N14, N24, N34, N44);
+    // Step 4: Eigenvector of the highest eigenvalue, the quaternion of the desired rotation
+    // (the eigenvalues come in increasing order)
 
+    const Eigen::SelfAdjointEigenSolver<Eigen::Matrix4d> solver(N);
+    const Eigen::Vector4d q = solver.eigenvectors().col(3);
 
-    // Step 4: Eigenvector of the highest eigenvalue
-
-    cv::Mat eval, evec;
-
-    cv::eigen(N,eval,evec); //evec[0] is the quaternion of the desired rotation
-
-    cv::Mat vec(1,3,evec.type());
-    (evec.row(0).colRange(1,4)).copyTo(vec); //extract imaginary part of the quaternion (sin*axis)
-
-    // Rotation angle. sin is the norm of the imaginary part, cos is the real part
-    double ang=atan2(norm(vec),evec.at<float>(0,0));
-
-    vec = 2*ang*vec/norm(vec); //Angle-axis representation. quaternion angle is the half
-
-    mR12i.create(3,3,P1.type());
-
-    cv::Rodrigues(vec,mR12i); // computes the rotation matrix from angle-axis
+    mR12i = Eigen::Quaterniond(q(0),q(1),q(2),q(3)).normalized().toRotationMatrix().cast<float>();
 
     // Step 5: Rotate set 2
 
-    cv::Mat P3 = mR12i*Pr2;
+    const Eigen::Matrix3f P3 = mR12i*Pr2;
 
     // Step 6: Scale
 
     if(!mbFixScale)
     {
-        double nom = Pr1.dot(P3);
-        cv::Mat aux_P3(P3.size(),P3.type());
-        aux_P3=P3;
-        cv::pow(P3,2,aux_P3);
-        double den = 0;
-
-        for(int i=0; i<aux_P3.rows; i++)
-        {
-            for(int j=0; j<aux_P3.cols; j++)
-            {
-                den+=aux_P3.at<float>(i,j);
-            }
-        }
-
+        const double nom = Pr1.cwiseProduct(P3).sum();
+        const double den = P3.squaredNorm();
         ms12i = nom/den;
     }
     else
@@ -312,66 +279,54 @@ void Sim3Solver::ComputeSim3(cv::Mat &P1, cv::Mat &P2)
 
     // Step 7: Translation
 
-    mt12i.create(1,3,P1.type());
     mt12i = O1 - ms12i*mR12i*O2;
 
-    // Step 8: Transformation
-
-    // Step 8.1 T12
-    mT12i = cv::Mat::eye(4,4,P1.type());
+    // Step 8: Inverse transformation T21
 
-    cv::Mat sR = ms12i*mR12i;
-
-    sR.copyTo(mT12i.rowRange(0,3).colRange(0,3));
-    mt12i.copyTo(mT12i.rowRange(0,3).col(3));
-
-    // Step 8.2 T21
-
-    mT21i = cv::Mat::eye(4,4,P1.type());
-
-    cv::Mat sRinv = (1.0/ms12i)*mR12i.t();
-
-    sRinv.copyTo(mT21i.rowRange(0,3).colRange(0,3));
-    cv::Mat tinv = -sRinv*mt12i;
-    tinv.copyTo(mT21i.rowRange(0,3).col(3));
+    mR21i = (1.0f/ms12i)*mR12i.transpose();
+    mt21i = -mR21i*mt12i;
 }
 
 
 void Sim3Solver::CheckInliers()
 {
-    vector<cv::Mat> vP1im2, vP2im1;
-    Project(mvX3Dc2,vP2im1,mT12i,mK1);
-    Project(mvX3Dc1,vP1im2,mT21i,mK2);
-
-    mnInliersi=0;
-
-    for(size_t i=0; i<mvP1im1.size(); i++)
+    typedef Eigen::Map<const ArrayXf> ArrayMap;
+    const ArrayMap X1(mvX1.data(),N), Y1(mvY1.data(),N), Z1(mvZ1.data(),N);
+    const ArrayMap X2(mvX2.data(),N), Y2(mvY2.data(),N), Z2(mvZ2.data(),N);
+    const ArrayMap U1(mvU1.data(),N), V1(mvV1.data(),N);
+    const ArrayMap U2(mvU2.data(),N), V2(mvV2.data(),N);
+
+    // The points of keyframe 2 in keyframe 1, error against the projections of their matches
+    const Eigen::Matrix3f sR12 = ms12i*mR12i;
     {
-        cv::Mat dist1 = mvP1im1[i]-vP2im1[i];
-        cv::Mat dist2 = vP1im2[i]-mvP2im2[i];
-
-        const float err1 = dist1.dot(dist1);
-        const float err2 = dist2.dot(dist2);
+        const Eigen::Matrix3f &R = sR12;
+        const Eigen::Vector3f &t = mt12i;
+        mvErr1 = (mfx1*(R(0,0)*X2 + R(0,1)*Y2 + R(0,2)*Z2 + t(0))/(R(2,0)*X2 + R(2,1)*Y2 + R(2,2)*Z2 + t(2)) + mcx1 - U1).square() +
+                 (mfy1*(R(1,0)*X2 + R(1,1)*Y2 + R(1,2)*Z2 + t(1))/(R(2,0)*X2 + R(2,1)*Y2 + R(2,2)*Z2 + t(2)) + mcy1 - V1).square();
+    }
 
-        if(err1<mvnMaxError1[i] && err2<mvnMaxError2[i])
-        {
-            mvbInliersi[i]=true;
-            mnInliersi++;
-        }
-        else
-            mvbInliersi[i]=false;
+    // And the points of keyframe 1 in keyframe 2
+    {
+        const Eigen::Matrix3f &R = mR21i;
+        const Eigen::Vector3f &t = mt21i;
+        mvErr2 = (mfx2*(R(0,0)*X1 + R(0,1)*Y1 + R(0,2)*Z1 + t(0))/(R(2,0)*X1 + R(2,1)*Y1 + R(2,2)*Z1 + t(2)) + mcx2 - U2).square() +
+                 (mfy2*(R(1,0)*X1 + R(1,1)*Y1 + R(1,2)*Z1 + t(1))/(R(2,0)*X1 + R(2,1)*Y1 + R(2,2)*Z1 + t(2)) + mcy2 - V2).square();
     }
+
+    const ArrayMap maxError1(mvMaxError1.data(),N), maxError2(mvMaxError2.data(),N);
+    mvbInliersi = (mvErr1<maxError1) && (mvErr2<maxError2);
+    mnInliersi = mvbInliersi.count();
 }
 
 
 cv::Mat Sim3Solver::GetEstimatedRotation()
 {
-    return mBestRotation.clone();
+    return Converter::toCvMat(mBestRotation);
 }
 
 cv::Mat Sim3Solver::GetEstimatedTranslation()
 {
-    return mBestTranslation.clone();
+    return Converter::toCvMat(mBestTranslation);
 }
 
 float Sim3Solver::GetEstimatedScale()
@@ -379,47 +334,4 @@ float Sim3Solver::GetEstimatedScale()
     return mBestScale;
 }
 
-void Sim3Solver::Project(const vector<cv::Mat> &vP3Dw, vector<cv::Mat> &vP2D, cv::Mat Tcw, cv::Mat K)
-{
-    cv::Mat Rcw = Tcw.rowRange(0,3).colRange(0,3);
-    cv::Mat tcw = Tcw.rowRange(0,3).col(3);
-    const float &fx = K.at<float>(0,0);
-    const float &fy = K.at<float>(1,1);
-    const float &cx = K.at<float>(0,2);
-    const float &cy = K.at<float>(1,2);
-
-    vP2D.clear();
-    vP2D.reserve(vP3Dw.size());
-
-    for(size_t i=0, iend=vP3Dw.size(); i<iend; i++)
-    {
-        cv::Mat P3Dc = Rcw*vP3Dw[i]+tcw;
-        const float invz = 1/(P3Dc.at<float>(2));
-        const float x = P3Dc.at<float>(0)*invz;
-        const float y = P3Dc.at<float>(1)*invz;
-
-        vP2D.push_back((cv::Mat_<float>(2,1) << fx*x+cx, fy*y+cy));
-    }
-}
-
-void Sim3Solver::FromCameraToImage(const vector<cv::Mat> &vP3Dc, vector<cv::Mat> &vP2D, cv::Mat K)
-{
-    const float &fx = K.at<float>(0,0);
-    const float &fy = K.at<float>(1,1);
-    const float &cx = K.at<float>(0,2);
-    const float &cy = K.at<float>(1,2);
-
-    vP2D.clear();
-    vP2D.reserve(vP3Dc.size());
-
-    for(size_t i=0, iend=vP3Dc.size(); i<iend; i++)
-    {
-        const float invz = 1/(vP3Dc[i].at<float>(2));
-        const float x = vP3Dc[i].at<float>(0)*invz;
-        const float y = vP3Dc[i].at<float>(1)*invz;
-
-        vP2D.push_back((cv::Mat_<float>(2,1) << fx*x+cx, fy*y+cy));
-    }
-}
-
 } //namespace ORB_SLAM
@@ -0,0 +1,230 @@
+#include "StageTimer.h"
+
+#include <atomic>
+#include <cstdio>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int NUM_STAGES = static_cast<int>(Stage::NUM_STAGES);
+
+const char* STAGE_NAMES[NUM_STAGES] =
+{
+    "Track",
+    "ExtractORB",
+    "FlowTracking",
+    "StereoMatching",
+    "FrameBoW",
+    "TrackReferenceKeyFrame",
+    "TrackMotionModel",
+    "ImageAlignment",
+    "Relocalization",
+    "PoseOptimization",
+    "SearchLocalPoints",
+    "NeedNewKeyFrame",
+    "KeyFrameQueue",
+    "ProcessNewKeyFrame",
+    "MapPointCulling",
+    "CreateNewMapPoints",
+    "SearchInNeighbors",
+    "LocalBundleAdjustment",
+    "KeyFrameCulling",
+    "BudgetCulling",
+    "DetectLoop",
+    "ComputeSim3",
+    "CorrectLoop",
+    "GlobalBundleAdjustment"
+};
+
+int Bucket(uint64_t us)
+{
+    int b = 0;
+    while(us && b<StageTimes::NUM_BUCKETS-1)
+    {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+double BucketBound(const int b)
+{
+    return static_cast<double>(1ull<<b)*1e-6;
+}
+
+StageTimeSet gProcess;
+
+thread_local StageTimeSet* tpThreadSet = NULL;
+}
+
+const int StageTimes::NUM_BUCKETS;
+
+double StageTimes::Summary::Quantile(const double q) const
+{
+    if(nCount==0)
+        return 0.0;
+
+    const double target = q*nCount;
+    uint64_t nSeen = 0;
+    for(int b=0; b<NUM_BUCKETS-1; b++)
+    {
+        nSeen += vnBuckets[b];
+        if(nSeen>=target)
+            return min(BucketBound(b),max);
+    }
+    return max;
+}
+
+void StageTimes::Add(const Stage stage, const chrono::steady_clock::duration &d)
+{
+    const uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(d).count();
+    gProcess.Add(stage,ns);
+    if(tpThreadSet)
+        tpThreadSet->Add(stage,ns);
+}
+
+StageTimes::Summary StageTimes::Get(const Stage stage)
+{
+    return gProcess.Get(stage);
+}
+
+uint64_t StageTimes::GetTotalNanoseconds(const Stage stage)
+{
+    return gProcess.GetTotalNanoseconds(stage);
+}
+
+vector<StageTimes::Summary> StageTimes::GetAll()
+{
+    return gProcess.GetAll();
+}
+
+void StageTimes::Reset()
+{
+    gProcess.Reset();
+}
+
+const char* StageTimes::Name(const Stage stage)
+{
+    const int i = static_cast<int>(stage);
+    return i>=0 && i<NUM_STAGES ? STAGE_NAMES[i] : "Unknown";
+}
+
+void StageTimes::Print(ostream &out)
+{
+    gProcess.Print(out);
+}
+
+void StageTimes::BindThread(StageTimeSet* pSet)
+{
+    tpThreadSet = pSet;
+}
+
+StageTimeSet::StageTimeSet()
+{
+    Reset();
+}
+
+void StageTimeSet::Add(const Stage stage, const uint64_t ns)
+{
+    Slot &slot = mvSlots[static_cast<int>(stage)];
+
+    slot.nCount.fetch_add(1,memory_order_relaxed);
+    slot.nTotal.fetch_add(ns,memory_order_relaxed);
+    slot.nLast.store(ns,memory_order_relaxed);
+    slot.vnBuckets[Bucket(ns/1000)].fetch_add(1,memory_order_relaxed);
+
+    uint64_t nMax = slot.nMax.load(memory_order_relaxed);
+    while(ns>nMax && !slot.nMax.compare_exchange_weak(nMax,ns,memory_order_relaxed))
+        ;
+}
+
+StageTimes::Summary StageTimeSet::Get(const Stage stage) const
+{
+    const Slot &slot = mvSlots[static_cast<int>(stage)];
+
+    StageTimes::Summary summary;
+    summary.stage = stage;
+    summary.name = StageTimes::Name(stage);
+    summary.nCount = slot.nCount.load(memory_order_relaxed);
+    summary.total = slot.nTotal.load(memory_order_relaxed)*1e-9;
+    summary.last = slot.nLast.load(memory_order_relaxed)*1e-9;
+    summary.max = slot.nMax.load(memory_order_relaxed)*1e-9;
+    for(int b=0; b<StageTimes::NUM_BUCKETS; b++)
+        summary.vnBuckets[b] = slot.vnBuckets[b].load(memory_order_relaxed);
+    return summary;
+}
+
+uint64_t StageTimeSet::GetTotalNanoseconds(const Stage stage) const
+{
+    return mvSlots[static_cast<int>(stage)].nTotal.load(memory_order_relaxed);
+}
+
+vector<StageTimes::Summary> StageTimeSet::GetAll() const
+{
+    vector<StageTimes::Summary> vSummaries;
+    vSummaries.reserve(NUM_STAGES);
+    for(int i=0; i<NUM_STAGES; i++)
+        vSummaries.push_back(Get(static_cast<Stage>(i)));
+    return vSummaries;
+}
+
+void StageTimeSet::Reset()
+{
+    for(int i=0; i<NUM_STAGES; i++)
+    {
+        Slot &slot = mvSlots[i];
+        slot.nCount = 0;
+        slot.nTotal = 0;
+        slot.nLast = 0;
+        slot.nMax = 0;
+        for(int b=0; b<StageTimes::NUM_BUCKETS; b++)
+            slot.vnBuckets[b] = 0;
+    }
+}
+
+void StageTimeSet::Print(ostream &out) const
+{
+    const vector<StageTimes::Summary> vSummaries = GetAll();
+    const int NUM_BUCKETS = StageTimes::NUM_BUCKETS;
+
+    char line[256];
+    snprintf(line,sizeof(line),"%-24s %10s %10s %10s %10s %10s %10s\n","stage [ms]","count","mean","p50","p90","p99","max");
+    out << endl << line;
+    for(size_t i=0; i<vSummaries.size(); i++)
+    {
+        const StageTimes::Summary &s = vSummaries[i];
+        if(s.nCount==0)
+            continue;
+        snprintf(line,sizeof(line),"%-24s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f\n",s.name,
+                 static_cast<unsigned long long>(s.nCount),1e3*s.Mean(),1e3*s.Quantile(0.5),
+                 1e3*s.Quantile(0.9),1e3*s.Quantile(0.99),1e3*s.max);
+        out << line;
+    }
+
+    // One line per stage, "bound: count" for the buckets with samples, the bounds in ms
+    out << endl << "stage histograms [ms]" << endl;
+    for(size_t i=0; i<vSummaries.size(); i++)
+    {
+        const StageTimes::Summary &s = vSummaries[i];
+        if(s.nCount==0)
+            continue;
+        out << s.name << ":";
+        for(int b=0; b<NUM_BUCKETS; b++)
+        {
+            if(s.vnBuckets[b]==0)
+                continue;
+            if(b<NUM_BUCKETS-1)
+                snprintf(line,sizeof(line)," <%g:%llu",1e3*BucketBound(b),static_cast<unsigned long long>(s.vnBuckets[b]));
+            else
+                snprintf(line,sizeof(line)," >=%g:%llu",1e3*BucketBound(b-1),static_cast<unsigned long long>(s.vnBuckets[b]));
+            out << line;
+        }
+        out << endl;
+    }
+}
+
+} //namespace ORB_SLAM
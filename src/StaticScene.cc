@@ -0,0 +1,92 @@
+#include "StaticScene.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int THUMBNAIL_WIDTH = 80; //param pixels
+}
+
+StaticScene::StaticScene(const Settings &settings):
+    mSettings(settings)
+{
+    Reset();
+}
+
+cv::Mat StaticScene::Thumbnail(const cv::Mat &im)
+{
+    if(im.empty())
+        return cv::Mat();
+
+    const double scale = static_cast<double>(THUMBNAIL_WIDTH)/im.cols;
+    const int rows = max(1,static_cast<int>(im.rows*scale+0.5));
+    cv::Mat small;
+    cv::resize(im,small,cv::Size(THUMBNAIL_WIDTH,rows),0,0,cv::INTER_AREA);
+
+    // The channel order does not matter for a difference
+    if(small.channels()==3)
+        cv::cvtColor(small,small,cv::COLOR_BGR2GRAY);
+    else if(small.channels()==4)
+        cv::cvtColor(small,small,cv::COLOR_BGRA2GRAY);
+    return small;
+}
+
+bool StaticScene::Skip(const cv::Mat &thumbnail)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    if(mnStillFrames<mSettings.nMinFrames || mnSkippedInRow>=mSettings.nMaxSkipped || thumbnail.empty() ||
+       mThumbnail.size()!=thumbnail.size() || mThumbnail.type()!=thumbnail.type())
+        return false;
+
+    cv::Mat diff;
+    cv::absdiff(thumbnail,mThumbnail,diff);
+    if(cv::mean(diff)[0]>=mSettings.maxImageDifference)
+        return false;
+
+    mnSkippedInRow++;
+    return true;
+}
+
+void StaticScene::AddTracking(const cv::Mat &thumbnail, const cv::Mat &velocity)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    mThumbnail = thumbnail;
+    mnSkippedInRow = 0;
+
+    bool bStill = !velocity.empty();
+    if(bStill)
+    {
+        const cv::Mat R = velocity.rowRange(0,3).colRange(0,3);
+        const float cosAngle = 0.5f*(R.at<float>(0,0)+R.at<float>(1,1)+R.at<float>(2,2)-1.0f);
+        const float angle = acos(min(max(cosAngle,-1.0f),1.0f))*180.0f/static_cast<float>(CV_PI);
+        const float translation = cv::norm(velocity.rowRange(0,3).col(3));
+        bStill = angle<mSettings.maxRotation && translation<mSettings.maxTranslation;
+    }
+    mnStillFrames = bStill ? mnStillFrames+1 : 0;
+}
+
+bool StaticScene::IsStill()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mnStillFrames>=mSettings.nMinFrames;
+}
+
+void StaticScene::Reset()
+{
+    unique_lock<mutex> lock(mMutex);
+    mThumbnail.release();
+    mnStillFrames = 0;
+    mnSkippedInRow = 0;
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,280 @@
+#include "StereoMatcher.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+
+#include "HammingDistance.h"
+#include "ORBmatcher.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int WINDOW = 5; //param half size of the SAD window
+const int SEARCH = 5; //param half range of the SAD search
+const int BLOCK_SIZE = 32; // left keypoints per task
+
+// L1 distances of the (2*WINDOW+1)^2 window around (uL,v) of the left level to the windows around
+// (uR0+inc,v) of the right level for inc in [-SEARCH,SEARCH], both windows relative to their
+// center pixel. The same integers cv::norm(NORM_L1) computes on the float windows. The innermost
+// loop runs over the shifts of the right window, which are contiguous in memory.
+void SADSearch(const cv::Mat &left, const cv::Mat &right, const int uL, const int v, const int uR0, int* dists)
+{
+    const int n = 2*WINDOW+1;
+    const int nInc = 2*SEARCH+1;
+
+    int windowL[n*n];
+    const int centerL = left.at<uchar>(v,uL);
+    for(int y=0; y<n; y++)
+    {
+        const uchar* rowL = left.ptr<uchar>(v-WINDOW+y) + uL-WINDOW;
+        for(int x=0; x<n; x++)
+            windowL[y*n+x] = rowL[x]-centerL;
+    }
+
+    int centersR[nInc];
+    const uchar* rowCenter = right.ptr<uchar>(v) + uR0-SEARCH;
+    for(int k=0; k<nInc; k++)
+    {
+        centersR[k] = rowCenter[k];
+        dists[k] = 0;
+    }
+
+    for(int y=0; y<n; y++)
+    {
+        const uchar* rowR = right.ptr<uchar>(v-WINDOW+y) + uR0-SEARCH-WINDOW;
+        for(int x=0; x<n; x++)
+        {
+            const int l = windowL[y*n+x];
+            const uchar* r = rowR+x;
+            for(int k=0; k<nInc; k++)
+                dists[k] += abs(l + centersR[k] - r[k]);
+        }
+    }
+}
+}
+
+StereoMatcher::StereoMatcher(const SharedArray<cv::KeyPoint> &vKeysLeft, const cv::Mat &descriptorsLeft,
+                             const vector<cv::Mat> &vPyramidLeft,
+                             const vector<cv::KeyPoint> &vKeysRight, const cv::Mat &descriptorsRight,
+                             const vector<cv::Mat> &vPyramidRight,
+                             const vector<float> &vScaleFactors, const vector<float> &vInvScaleFactors,
+                             const float bf, const float b):
+    mvKeysLeft(vKeysLeft), mDescriptorsLeft(descriptorsLeft), mvPyramidLeft(vPyramidLeft),
+    mvKeysRight(vKeysRight), mDescriptorsRight(descriptorsRight), mvPyramidRight(vPyramidRight),
+    mvScaleFactors(vScaleFactors), mvInvScaleFactors(vInvScaleFactors), mbf(bf), mb(b)
+{
+}
+
+void StereoMatcher::BuildRowIndex()
+{
+    const int nRows = mvPyramidLeft[0].rows;
+    const int Nr = mvKeysRight.size();
+
+    // Band of rows of every right keypoint, clamped to the image
+    vector<int> vMinRow(Nr), vMaxRow(Nr);
+    mvRowOffsets.assign(nRows+1,0);
+    for(int iR=0; iR<Nr; iR++)
+    {
+        const cv::KeyPoint &kp = mvKeysRight[iR];
+        const float &kpY = kp.pt.y;
+        const float r = 2.0f*mvScaleFactors[kp.octave]; //param
+        vMinRow[iR] = max((int)floor(kpY-r),0);
+        vMaxRow[iR] = min((int)ceil(kpY+r),nRows-1);
+
+        for(int yi=vMinRow[iR]; yi<=vMaxRow[iR]; yi++)
+            mvRowOffsets[yi+1]++;
+    }
+
+    for(int y=0; y<nRows; y++)
+        mvRowOffsets[y+1] += mvRowOffsets[y];
+
+    // Filled in keypoint order, so every row is sorted like the vectors of the old row table
+    mvRowIndices.resize(mvRowOffsets[nRows]);
+    vector<unsigned int> vNext(mvRowOffsets.begin(),mvRowOffsets.end()-1);
+    for(int iR=0; iR<Nr; iR++)
+    {
+        for(int yi=vMinRow[iR]; yi<=vMaxRow[iR]; yi++)
+            mvRowIndices[vNext[yi]++] = iR;
+    }
+}
+
+void StereoMatcher::Match(vector<float> &vuRight, vector<float> &vDepth, ThreadPool* pThreadPool)
+{
+    const int N = mvKeysLeft.size();
+    vuRight = vector<float>(N,-1.0f);
+    vDepth = vector<float>(N,-1.0f);
+    if(N==0)
+        return;
+
+    BuildRowIndex();
+
+    // Every task writes only the entries of its own keypoints
+    vector<int> vDist(N,-1);
+    const int nBlocks = (N+BLOCK_SIZE-1)/BLOCK_SIZE;
+    if(pThreadPool)
+        pThreadPool->ParallelFor(nBlocks, [&](int i)
+                {MatchRange(i*BLOCK_SIZE, min((i+1)*BLOCK_SIZE,N), vuRight, vDepth, vDist);});
+    else
+        MatchRange(0, N, vuRight, vDepth, vDist);
+
+    vector<pair<int, int> > vDistIdx;
+    vDistIdx.reserve(N);
+    for(int iL=0; iL<N; iL++)
+    {
+        if(vDist[iL]>=0)
+            vDistIdx.push_back(pair<int,int>(vDist[iL],iL));
+    }
+    if(vDistIdx.empty())
+        return;
+
+    sort(vDistIdx.begin(),vDistIdx.end());
+    const float median = vDistIdx[vDistIdx.size()/2].first;
+    const float thDist = 1.5f*1.4f*median; //param
+
+    for(int i=vDistIdx.size()-1;i>=0;i--)
+    {
+        if(vDistIdx[i].first<thDist)
+            break;
+        else
+        {
+            vuRight[vDistIdx[i].second]=-1;
+            vDepth[vDistIdx[i].second]=-1;
+        }
+    }
+}
+
+void StereoMatcher::MatchRange(const int begin, const int end, vector<float> &vuRight, vector<float> &vDepth,
+                               vector<int> &vDist) const
+{
+    const int thOrbDist = (ORBmatcher::TH_HIGH+ORBmatcher::TH_LOW)/2; //param
+
+    // Set limits for search
+    const float minZ = mb;
+    const float minD = 0;
+    const float maxD = mbf/minZ;
+
+    vector<size_t> vCandidates;
+    vector<int> vDistances;
+
+    for(int iL=begin; iL<end; iL++)
+    {
+        const cv::KeyPoint &kpL = mvKeysLeft[iL];
+        const int &levelL = kpL.octave;
+        const float &vL = kpL.pt.y;
+        const float &uL = kpL.pt.x;
+
+        const int row = vL;
+        const size_t* pRow = &mvRowIndices[0]+mvRowOffsets[row];
+        const size_t* pRowEnd = &mvRowIndices[0]+mvRowOffsets[row+1];
+        if(pRow==pRowEnd)
+            continue;
+
+        const float minU = uL-maxD;
+        const float maxU = uL-minD;
+
+        if(maxU<0)
+            continue;
+
+        // The right keypoints within the disparity range and the neighbouring scales
+        vCandidates.clear();
+        for(; pRow!=pRowEnd; pRow++)
+        {
+            const cv::KeyPoint &kpR = mvKeysRight[*pRow];
+
+            if(kpR.octave<levelL-1 || kpR.octave>levelL+1)
+                continue;
+
+            const float &uR = kpR.pt.x;
+            if(uR>=minU && uR<=maxU)
+                vCandidates.push_back(*pRow);
+        }
+        if(vCandidates.empty())
+            continue;
+
+        vDistances.resize(vCandidates.size());
+        HammingDistance::ComputeBatch(mDescriptorsLeft.ptr<uint8_t>(iL),mDescriptorsRight.ptr<uint8_t>(),
+                                      mDescriptorsRight.step[0],&vCandidates[0],vCandidates.size(),&vDistances[0]);
+
+        int bestDist = ORBmatcher::TH_HIGH; //param
+        size_t bestIdxR = 0;
+        for(size_t iC=0; iC<vCandidates.size(); iC++)
+        {
+            if(vDistances[iC]<bestDist)
+            {
+                bestDist = vDistances[iC];
+                bestIdxR = vCandidates[iC];
+            }
+        }
+
+        // Subpixel match by correlation
+        if(bestDist>=thOrbDist)
+            continue;
+
+        // coordinates in image pyramid at keypoint scale
+        const float uR0 = mvKeysRight[bestIdxR].pt.x;
+        const float scaleFactor = mvInvScaleFactors[kpL.octave];
+        const float scaleduL = round(kpL.pt.x*scaleFactor);
+        const float scaledvL = round(kpL.pt.y*scaleFactor);
+        const float scaleduR0 = round(uR0*scaleFactor);
+
+        // sliding window search, the right windows have to lie within the level
+        const cv::Mat &levelR = mvPyramidRight[kpL.octave];
+        const float iniu = scaleduR0+SEARCH-WINDOW;
+        const float endu = scaleduR0+SEARCH+WINDOW+1;
+        if(iniu<0 || endu >= levelR.cols || scaleduR0-SEARCH-WINDOW<0)
+            continue;
+
+        int vDists[2*SEARCH+1];
+        SADSearch(mvPyramidLeft[kpL.octave], levelR, scaleduL, scaledvL, scaleduR0, vDists);
+
+        int bestSAD = INT_MAX;
+        int bestincR = 0;
+        for(int incR=-SEARCH; incR<=+SEARCH; incR++)
+        {
+            if(vDists[SEARCH+incR]<bestSAD)
+            {
+                bestSAD = vDists[SEARCH+incR];
+                bestincR = incR;
+            }
+        }
+
+        if(bestincR==-SEARCH || bestincR==SEARCH)
+            continue;
+
+        // Sub-pixel match (Parabola fitting)
+        const float dist1 = vDists[SEARCH+bestincR-1];
+        const float dist2 = vDists[SEARCH+bestincR];
+        const float dist3 = vDists[SEARCH+bestincR+1];
+
+        const float deltaR = (dist1-dist3)/(2.0f*(dist1+dist3-2.0f*dist2));
+
+        if(deltaR<-1 || deltaR>1)
+            continue;
+
+        // Re-scaled coordinate
+        float bestuR = mvScaleFactors[kpL.octave]*((float)scaleduR0+(float)bestincR+deltaR);
+
+        float disparity = (uL-bestuR);
+
+        if(disparity>=minD && disparity<maxD)
+        {
+            if(disparity<=0)
+            {
+                disparity=0.01;
+                bestuR = uL-0.01;
+            }
+            vDepth[iL]=mbf/disparity;
+            vuRight[iL] = bestuR;
+            vDist[iL] = bestSAD;
+        }
+    }
+}
+
+} //namespace ORB_SLAM
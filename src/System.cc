@@ -22,16 +22,185 @@
 
 #include "System.h"
 #include "Converter.h"
+#include "EventLog.h"
+#include "PerformanceReport.h"
+#include "FrameAdmission.h"
+#include "LatencyScheduler.h"
+#include "HammingDistance.h"
+#include "Logging.h"
+#include "LoopClient.h"
+#include "MapCheckpoint.h"
+#include "MapSerializer.h"
+#include "MapStreamer.h"
+#include "ParameterServer.h"
+#include "MetricsServer.h"
+#include "StaticScene.h"
+#include "TrajectoryWriter.h"
+#include "MapTiles.h"
+#include "ORBmatcher.h"
+#include "Optimizer.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include "TaskScheduler.h"
+#include "ThreadConfig.h"
+#include "WorkCounters.h"
+#include "Visualization.h"
+#include "VocabularyLoader.h"
+#include <algorithm>
+#include <cstdio>
 #include <thread>
-#include <pangolin/pangolin.h>
+#include <pthread.h>
+#include <time.h>
 #include <iomanip>
+#include <sstream>
+#include <Eigen/Geometry>
 
 namespace ORB_SLAM2
 {
 
+namespace
+{
+const size_t TRAJECTORY_BATCH = 4096; //param frames copied out of the trajectory at a time
+
+// Headers over the caller's memory, nothing is copied
+cv::Mat Wrap(const System::ExternalImage &im)
+{
+    return cv::Mat(im.height,im.width,CV_8U,const_cast<unsigned char*>(im.data),im.step);
+}
+
+cv::Mat Wrap(const System::ExternalDepth &depth)
+{
+    return cv::Mat(depth.height,depth.width,CV_32F,const_cast<float*>(depth.data),depth.step);
+}
+
+// Calls release when the last copy is destroyed, empty without a callback
+std::shared_ptr<void> MakeReleaseGuard(const System::ReleaseCallback &release)
+{
+    if(!release)
+        return std::shared_ptr<void>();
+    return std::shared_ptr<void>(new System::ReleaseCallback(release),[](void* p) {
+        System::ReleaseCallback* pRelease = static_cast<System::ReleaseCallback*>(p);
+        (*pRelease)();
+        delete pRelease;
+    });
+}
+}
+
 System::System(const string &strVocFile, const string &strSettingsFile, const eSensor sensor,
-               const bool bUseViewer):mSensor(sensor), mpViewer(static_cast<Viewer*>(NULL)), mbReset(false),mbActivateLocalizationMode(false),
-        mbDeactivateLocalizationMode(false)
+               const bool bUseViewer):System(strVocFile,static_cast<ORBVocabulary*>(NULL),strSettingsFile,sensor,bUseViewer)
+{
+}
+
+System::System(ORBVocabulary* pVocabulary, const string &strSettingsFile, const eSensor sensor,
+               const bool bUseViewer):System(string(),pVocabulary,strSettingsFile,sensor,bUseViewer)
+{
+}
+
+ORBVocabulary* System::LoadVocabulary(const string &strVocFile, const string &strSharedMemory)
+{
+    if(!strSharedMemory.empty())
+    {
+        ORBVocabulary* pShared = new ORBVocabulary();
+        if(pShared->attachSharedMemory(strSharedMemory))
+        {
+            pShared->setBlockDistance(&HammingDistance::ComputeBatch);
+            cout << endl << "Vocabulary attached to shared memory " << strSharedMemory << endl << endl;
+            return pShared;
+        }
+        delete pShared;
+    }
+
+    ORBVocabulary* pVocabulary = new ORBVocabulary();
+    if(!ReadVocabulary(pVocabulary,strVocFile))
+    {
+        delete pVocabulary;
+        return static_cast<ORBVocabulary*>(NULL);
+    }
+
+    if(!strSharedMemory.empty())
+    {
+        // Another process may be creating the segment, it is attached once it is complete
+        const bool bCreated = pVocabulary->createSharedMemory(strSharedMemory);
+        ORBVocabulary* pShared = new ORBVocabulary();
+        for(int i=0; i<SHARED_VOCABULARY_ATTEMPTS; i++)
+        {
+            if(pShared->attachSharedMemory(strSharedMemory))
+            {
+                pShared->setBlockDistance(&HammingDistance::ComputeBatch);
+                cout << "Vocabulary " << (bCreated ? "copied to" : "attached to") << " shared memory "
+                     << strSharedMemory << endl << endl;
+                delete pVocabulary;
+                return pShared;
+            }
+            if(bCreated)
+                break;
+            usleep(SHARED_VOCABULARY_WAIT_US);
+        }
+        delete pShared;
+        cerr << "The vocabulary could not be shared in " << strSharedMemory
+             << ", this process uses its own copy" << endl;
+    }
+    return pVocabulary;
+}
+
+bool System::ReadVocabulary(ORBVocabulary* pVocabulary, const string &strVocFile)
+{
+    cout << endl << "Loading ORB Vocabulary. This could take a while..." << endl;
+
+    // the binary format (see tools/bin_vocabulary) is detected by its header and memory mapped
+    bool bVocLoad = false;
+    if(ORBVocabulary::isBinaryFile(strVocFile))
+        bVocLoad = pVocabulary->loadFromBinaryFile(strVocFile);
+    else
+        bVocLoad = pVocabulary->loadFromTextFile(strVocFile);
+    if(!bVocLoad)
+    {
+        cerr << "Wrong path to vocabulary. " << endl;
+        cerr << "Failed to open at: " << strVocFile << endl;
+        return false;
+    }
+    // descend the vocabulary tree with the same SIMD kernel the matcher uses
+    pVocabulary->setBlockDistance(&HammingDistance::ComputeBatch);
+    cout << "Vocabulary loaded!" << endl << endl;
+    return true;
+}
+
+void System::LoadVocabularyAsync(const string strVocFile, const int nLevelsUp)
+{
+    Trace::SetThreadName("Vocabulary");
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if(!ReadVocabulary(mpVocabulary,strVocFile))
+        exit(-1);
+    if(nLevelsUp>=0)
+        mpVocabulary->setFeatureVectorLevelsUp(nLevelsUp);
+    mnVocabularyMemory = mpVocabulary->getMemoryUsage();
+    cout << "Vocabulary: " << mpVocabulary->size() << " words, " << mpVocabulary->getDepthLevels()
+         << " levels, features grouped " << mpVocabulary->getFeatureVectorLevelsUp() << " levels up, loaded in "
+         << chrono::duration_cast<chrono::duration<double> >(chrono::steady_clock::now()-start).count()
+         << " s in the background" << endl;
+    VocabularyLoader::End(mpVocabulary);
+}
+
+System::System(const string &strVocFile, ORBVocabulary* pVocabulary, const string &strSettingsFile, const eSensor sensor,
+               const bool bUseViewer):mSensor(sensor), mpViewer(static_cast<Visualization*>(NULL)),
+               mpStreamer(static_cast<MapStreamer*>(NULL)), mpParameterServer(static_cast<ParameterServer*>(NULL)),
+               mpMetricsServer(static_cast<MetricsServer*>(NULL)),
+               mbReset(false),mbActivateLocalizationMode(false),
+        mbDeactivateLocalizationMode(false), mTrackingState(Tracking::NO_IMAGES_YET),
+        mLastSnapshotTimestamp(0),
+        mpMapTiles(static_cast<MapTiles*>(NULL)), mnVocabularyMemory(0), mptVocabulary(static_cast<thread*>(NULL)),
+        mfMemoryLogPeriod(0), mnAsyncDropped(0),
+        mnOfflineBuilders(0), mnAsyncNextSeq(0), mnAsyncTrackSeq(0), mnAsyncFramesAhead(0), mnAsyncMaxFramesAhead(1),
+        mnAsyncNextFrameId(0), mbAsyncFinishRequested(false), mnAsyncBuildersRunning(0), mptAsyncTracker(NULL),
+        mnSubmitDropped(0), mbTrackerThreadStarted(false), mbTrackerSleeping(false), mbTrackerFinishRequested(false),
+        mbTrackerWakeUp(false), mptTracker(static_cast<thread*>(NULL)),
+        mptMapEvents(NULL), mptMapMerge(NULL), mpMergeMap(static_cast<Map*>(NULL)),
+        mpMergeKeyFrameDB(static_cast<KeyFrameDatabase*>(NULL)), mbMergeLoading(false), mbMergeLoaded(false),
+        mpScheduler(static_cast<TaskScheduler*>(NULL)), mpAdmission(static_cast<FrameAdmission*>(NULL)),
+        mpLatencyScheduler(static_cast<LatencyScheduler*>(NULL)), mfInputWait(0),
+        mnSkippedFrames(0), mnEventImage(0), mpStaticScene(static_cast<StaticScene*>(NULL)),
+        mpTrajectoryWriter(static_cast<TrajectoryWriter*>(NULL)), mpMapExporter(static_cast<MapExporter*>(NULL)),
+        mbExportColors(false), mpCheckpointer(static_cast<MapCheckpointer*>(NULL))
 {
     // Output welcome message
     cout << endl <<
@@ -49,59 +218,389 @@ System::System(const string &strVocFile, const string &strSettingsFile, const eS
     else if(mSensor==RGBD)
         cout << "RGB-D" << endl;
 
-    //Check settings file
-    cv::FileStorage fsSettings(strSettingsFile.c_str(), cv::FileStorage::READ);
-    if(!fsSettings.isOpened())
+    //Check settings file, read once for all subsystems
+    if(!mSettings.Load(strSettingsFile))
     {
        cerr << "Failed to open settings file at: " << strSettingsFile << endl;
        exit(-1);
     }
+    if(!mSettings.Validate(mSensor))
+    {
+       cerr << "Invalid settings file: " << strSettingsFile << endl;
+       exit(-1);
+    }
+    cout << "Settings: " << strSettingsFile << " (hash " << Settings::FormatHash(mSettings.GetHash()) << ")" << endl;
+    const Settings &fsSettings = mSettings;
 
+    // Before any thread starts
+    ThreadConfig::Load(fsSettings);
 
-    //Load ORB Vocabulary
-    cout << endl << "Loading ORB Vocabulary. This could take a while..." << endl;
+    // One set of workers for the thread pools of all subsystems, created after it
+    int nSchedulerThreads = fsSettings["Scheduler.nThreads"];
+    if(nSchedulerThreads>0)
+    {
+        cout << "Shared Task Scheduler: " << nSchedulerThreads << " workers" << endl;
+        mpScheduler = new TaskScheduler(nSchedulerThreads);
+        ThreadPool::SetScheduler(mpScheduler);
+    }
 
-    mpVocabulary = new ORBVocabulary();
-    bool bVocLoad = mpVocabulary->loadFromTextFile(strVocFile);
-    if(!bVocLoad)
+    // Asynchronous input (Track*Async)
+    int nAsyncQueueSize = fsSettings["Async.QueueSize"];
+    if(nAsyncQueueSize<1)
+        nAsyncQueueSize = 1;
+    mnAsyncQueueSize = nAsyncQueueSize;
+    int nAsyncDropPolicy = fsSettings["Async.DropPolicy"];
+    mAsyncDropPolicy = nAsyncDropPolicy==KEEP_LATEST ? KEEP_LATEST : DROP_OLDEST;
+    // Tracking thread (Submit*)
+    int nTrackerQueueSize = fsSettings["TrackerThread.QueueSize"];
+    if(nTrackerQueueSize<1)
+        nTrackerQueueSize = 4; //param
+    mpSubmitted.reset(new MPSCQueue<SubmittedImage>(nTrackerQueueSize));
+    mpTrackingResults.reset(new MPSCQueue<TrackingResult>(nTrackerQueueSize));
+    // Offline input, the builders get their extractors once the tracker exists
+    int nOfflineBuilders = fsSettings["Offline.nBuilders"];
+    mnOfflineBuilders = max(nOfflineBuilders,0);
+    // Deterministic mode for benchmarks, on the offline input with the time budgets off
+    int nDeterministic = fsSettings["Deterministic.Enabled"];
+    const bool bDeterministic = nDeterministic!=0;
+    if(bDeterministic)
+        mnOfflineBuilders = max(mnOfflineBuilders,1);
+
+    // Frame admission of the real-time input, offline every image is tracked
+    float fLatencyBudget = fsSettings["Admission.LatencyBudget"];
+    int nMaxSkippedFrames = fsSettings["Admission.MaxSkippedFrames"];
+    if(fLatencyBudget>0 && mnOfflineBuilders==0)
     {
-        cerr << "Wrong path to vocabulary. " << endl;
-        cerr << "Failed to open at: " << strVocFile << endl;
-        exit(-1);
+        if(nMaxSkippedFrames<1)
+            nMaxSkippedFrames = 1;
+        cout << "Frame Admission: latency budget " << fLatencyBudget << " s, up to " << nMaxSkippedFrames
+             << " skipped images in a row" << endl;
+        mpAdmission = new FrameAdmission(fLatencyBudget,nMaxSkippedFrames);
+    }
+
+    // Power saving of the real-time input while the camera stands still
+    if((int)fsSettings["StaticScene.enable"] && mnOfflineBuilders==0)
+    {
+        StaticScene::Settings staticSettings;
+        staticSettings.nMinFrames = fsSettings["StaticScene.nFrames"];
+        if(staticSettings.nMinFrames<1)
+            staticSettings.nMinFrames = 5; //param
+        staticSettings.maxRotation = fsSettings["StaticScene.MaxRotation"];
+        staticSettings.maxTranslation = fsSettings["StaticScene.MaxTranslation"];
+        staticSettings.maxImageDifference = fsSettings["StaticScene.MaxImageDifference"];
+        staticSettings.nMaxSkipped = fsSettings["StaticScene.MaxSkippedFrames"];
+        if(staticSettings.nMaxSkipped<1)
+            staticSettings.nMaxSkipped = 30; //param
+        cout << "Static Scene: after " << staticSettings.nMinFrames << " still frames, images differing by less than "
+             << staticSettings.maxImageDifference << " are skipped, up to " << staticSettings.nMaxSkipped
+             << " in a row" << endl;
+        mpStaticScene = new StaticScene(staticSettings);
+    }
+
+    // Logging from the threads without waiting for the console
+    int nLoggingAsynchronous = fsSettings["Logging.Asynchronous"];
+    int nLoggingBufferSize = fsSettings["Logging.BufferSize"];
+    if(nLoggingAsynchronous)
+        SystemLogger::SetAsynchronous(true,nLoggingBufferSize>0 ? nLoggingBufferSize : 4096);
+
+    // Memory usage in the status log
+    mfMemoryLogPeriod = fsSettings["Memory.LogPeriod"];
+    mtLastMemoryLog = chrono::steady_clock::now();
+
+    // Timeline of the threads
+    const string strTraceFile = fsSettings["Trace.File"];
+    if(!strTraceFile.empty())
+        Trace::Start(strTraceFile);
+
+    // Linear solver of global BA and essential graph
+    int nLinearSolver = fsSettings["Optimizer.LinearSolver"];
+    int nBlockOrdering = fsSettings["Optimizer.BlockOrdering"];
+    Optimizer::SetLinearSolver(nLinearSolver==Optimizer::PCG ? Optimizer::PCG : Optimizer::SPARSE_CHOLESKY,
+                               nBlockOrdering!=0);
+    // Early termination of the bundle adjustments and the essential graph
+    Optimizer::SetConvergence(fsSettings["Optimizer.ConvergenceChi2"],fsSettings["Optimizer.MinUpdateNorm"]);
+    // Float pose optimization
+    int nSinglePrecision = fsSettings["Optimizer.SinglePrecision"];
+    Optimizer::SetSinglePrecision(nSinglePrecision!=0);
+    // Global BA of large maps as submaps solved in parallel
+    Optimizer::SetPartitionedGlobalBA(fsSettings["Optimizer.PartitionKeyFrames"]);
+
+
+    // Map file I/O
+    mnMapThreads = fsSettings["Map.nThreads"];
+    if(mnMapThreads<1)
+        mnMapThreads = 1;
+    mfMapTileSize = fsSettings["Map.TileSize"];
+    mnMapTileRadius = fsSettings["Map.TileRadius"];
+    if(mnMapTileRadius<0)
+        mnMapTileRadius = 0;
+
+    // Level of the nodes the matching by BoW groups the features by, a property of the vocabulary:
+    // a shared one keeps its own, as every frame and keyframe matched with it must use the same
+    const Settings::Node &levelsUpNode = fsSettings["Vocabulary.featureVectorLevelsUp"];
+    const int nLevelsUp = levelsUpNode.isNumber() ? (int)levelsUpNode : -1;
+
+    //Load ORB Vocabulary, unless a loaded one is shared. With Vocabulary.LoadAsync a vocabulary
+    //file is read on a thread of its own while the rest starts, only what needs its words waits
+    //(see VocabularyLoader): the monocular initialization and the motion model track without it.
+    const string strSharedVocabulary = fsSettings["Vocabulary.SharedMemory"];
+    const bool bLoadAsync = (int)fsSettings["Vocabulary.LoadAsync"] && !pVocabulary && strSharedVocabulary.empty();
+    if(bLoadAsync)
+    {
+        mpVocabulary = new ORBVocabulary();
+        VocabularyLoader::Begin(mpVocabulary);
+        mptVocabulary = new thread(&System::LoadVocabularyAsync,this,strVocFile,nLevelsUp);
+    }
+    else
+    {
+        mpVocabulary = pVocabulary ? pVocabulary : LoadVocabulary(strVocFile,strSharedVocabulary);
+        if(!mpVocabulary)
+            exit(-1);
+        mnVocabularyMemory = mpVocabulary->getMemoryUsage();
+
+        if(nLevelsUp>=0)
+        {
+            if(!pVocabulary)
+                mpVocabulary->setFeatureVectorLevelsUp(nLevelsUp);
+            else if(nLevelsUp!=mpVocabulary->getFeatureVectorLevelsUp())
+                cerr << "Vocabulary.featureVectorLevelsUp is ignored, the shared vocabulary groups the features "
+                     << mpVocabulary->getFeatureVectorLevelsUp() << " levels up" << endl;
+        }
+        cout << "Vocabulary: " << mpVocabulary->size() << " words, " << mpVocabulary->getDepthLevels()
+             << " levels, features grouped " << mpVocabulary->getFeatureVectorLevelsUp() << " levels up" << endl;
     }
-    cout << "Vocabulary loaded!" << endl << endl;
 
     //Create KeyFrame Database
-    mpKeyFrameDatabase = new KeyFrameDatabase(*mpVocabulary);
+    int nRelocTopK = fsSettings["Relocalization.TopK"];
+    mpKeyFrameDatabase = new KeyFrameDatabase(*mpVocabulary,nRelocTopK);
 
     //Create the Map
     mpMap = new Map();
+    mpMap->mnSettingsHash = mSettings.GetHash();
+    mpMap->mPointIndex.SetVoxelSize(fsSettings["Map.VoxelSize"]);
+    if(mSensor==RGBD && (int)fsSettings["KeyFrameDepth.Retain"])
+    {
+        const float fMemoryMB = fsSettings["KeyFrameDepth.MemoryMB"];
+        const string strSpillFile = fsSettings["KeyFrameDepth.SpillFile"];
+        if(mpMap->mKeyFrameDepths.Enable(static_cast<size_t>(max(fMemoryMB,0.0f)*1024*1024),strSpillFile))
+            cout << "Keyframe depth: retained, " << fMemoryMB << " MB in memory" << endl;
+    }
 
-    //Create Drawers. These are used by the Viewer
-    mpFrameDrawer = new FrameDrawer(mpMap);
-    mpMapDrawer = new MapDrawer(mpMap, strSettingsFile);
+    //Create the Frame Drawer. It is used by the Viewer, without it the tracking skips its updates.
+    //The viewer module is only opened if it is used.
+    mpFrameDrawer = static_cast<FrameDrawer*>(NULL);
+    if(bUseViewer && Visualization::Available())
+        mpFrameDrawer = new FrameDrawer(mpMap);
 
     //Initialize the Tracking thread
     //(it will live in the main thread of execution, the one that called this constructor)
-    mpTracker = new Tracking(this, mpVocabulary, mpFrameDrawer, mpMapDrawer,
-                             mpMap, mpKeyFrameDatabase, strSettingsFile, mSensor);
+    mpTracker = new Tracking(this, mpVocabulary, mpFrameDrawer, mpMap, mpKeyFrameDatabase, mSettings, mSensor);
+    if(mnOfflineBuilders>0)
+    {
+        cout << endl << "Offline Frame Builders: " << mnOfflineBuilders << endl;
+        mpTracker->SetOfflineMode(mnOfflineBuilders);
+        mnAsyncMaxFramesAhead = 2*mnOfflineBuilders; //param
+    }
+    if(bDeterministic)
+    {
+        cout << "Deterministic Mode: keyframes wait for Local Mapping and Loop Closing, no time budgets" << endl;
+        mpTracker->SetDeterministicMode();
+    }
+
+    // Knobs of all threads traded for the latency of the real-time input, offline and in the
+    // deterministic mode they stay as set
+    float fLatencyTarget = fsSettings["Latency.Target"];
+    float fLatencyPercentile = fsSettings["Latency.Percentile"];
+    int nLatencyCores = fsSettings["Latency.nCores"];
+    if(fLatencyTarget>0 && mnOfflineBuilders==0 && !bDeterministic)
+    {
+        if(fLatencyPercentile<=0 || fLatencyPercentile>1)
+            fLatencyPercentile = 0.99f; //param
+        mpLatencyScheduler = new LatencyScheduler(fLatencyTarget,fLatencyPercentile,nLatencyCores,&mpMap->mStageTimes);
+        mpTracker->SetLatencyScheduler(mpLatencyScheduler);
+        Optimizer::SetMaxThreads(mpLatencyScheduler->GetKnobs().nOptimizerThreads);
+        cout << "Latency Scheduler: " << fLatencyTarget*1e3 << " ms at p" << fLatencyPercentile*100 << " on "
+             << mpLatencyScheduler->GetNumCores() << " cores" << endl;
+    }
+
+    // The trajectory written while the system runs
+    const string strTrajectoryFile = fsSettings["Trajectory.StreamFile"];
+    if(!strTrajectoryFile.empty())
+    {
+        if(mSensor==MONOCULAR)
+            cerr << "ERROR: the trajectory cannot be streamed for monocular." << endl;
+        else
+        {
+            float fTrajectoryDelay = fsSettings["Trajectory.StreamDelay"];
+            if(fTrajectoryDelay<0)
+                fTrajectoryDelay = 0;
+            cout << "Trajectory Stream: " << strTrajectoryFile << ", frames " << fTrajectoryDelay << " s behind" << endl;
+            mpTrajectoryWriter = new TrajectoryWriter(&mpTracker->mTrajectory,mpMap,strTrajectoryFile,fTrajectoryDelay);
+        }
+    }
+
+    // Map points colored by the keyframes in ExportMapPoints, the tracking samples the colors
+    mbExportColors = (int)fsSettings["Export.Color"];
+
+    // Checkpoints of the map while the system runs, restored with LoadCheckpoint
+    const string strCheckpointFile = fsSettings["Checkpoint.File"];
+    if(!strCheckpointFile.empty())
+    {
+        float fCheckpointPeriod = fsSettings["Checkpoint.Period"];
+        if(fCheckpointPeriod<=0)
+            fCheckpointPeriod = 30.0f; //param
+        int nCheckpointMaxDeltas = fsSettings["Checkpoint.MaxDeltas"];
+        if(nCheckpointMaxDeltas<0)
+            nCheckpointMaxDeltas = 0;
+        cout << "Map Checkpoints: " << strCheckpointFile << " every " << fCheckpointPeriod << " s, the whole map every "
+             << nCheckpointMaxDeltas+1 << " checkpoints" << endl;
+        mpCheckpointer = new MapCheckpointer(mpMap,mpVocabulary,strCheckpointFile,fCheckpointPeriod,nCheckpointMaxDeltas);
+    }
+
+    // Binary log of the events for the tools, the loops and global BAs come from the map events
+    const string strEventFile = fsSettings["Logging.EventFile"];
+    if(!strEventFile.empty() && EventLog::Open(strEventFile,nLoggingBufferSize>0 ? nLoggingBufferSize : 4096))
+    {
+        cout << "Event Log: " << strEventFile << endl;
+        const uint64_t nSettingsHash = mSettings.GetHash();
+        EventLog::Add(EventLog::SETTINGS,static_cast<uint32_t>(nSettingsHash),static_cast<uint32_t>(nSettingsHash>>32));
+        SubscribeMapEvents([](const MapEvents::Event &event)
+        {
+            if(event.type==MapEvents::LOOP_CORRECTED)
+                EventLog::Add(EventLog::LOOP,event.nKFId,event.nMatchedKFId);
+            else if(event.type==MapEvents::GLOBAL_BA_FINISHED)
+                EventLog::Add(EventLog::GLOBAL_BA,event.nKFId);
+        });
+    }
+
+    // Report of the work per frame and keyframe, the loops and global BAs come from the map events
+    const string strReportFile = fsSettings["Logging.ReportFile"];
+    if(!strReportFile.empty() && PerformanceReport::Open(strReportFile,nLoggingBufferSize>0 ? nLoggingBufferSize : 4096))
+    {
+        cout << "Performance Report: " << strReportFile << endl;
+        SubscribeMapEvents([](const MapEvents::Event &event)
+        {
+            if(event.type!=MapEvents::LOOP_CORRECTED && event.type!=MapEvents::GLOBAL_BA_FINISHED)
+                return;
+            PerformanceReport::Record record = PerformanceReport::NewRecord(
+                        event.type==MapEvents::LOOP_CORRECTED ? PerformanceReport::LOOP : PerformanceReport::GLOBAL_BA);
+            record.nId = event.nKFId;
+            if(event.type==MapEvents::LOOP_CORRECTED)
+                record.nOther = event.nMatchedKFId;
+            record.nCount = event.vCorrections.size();
+            PerformanceReport::Add(record);
+        });
+    }
 
     //Initialize the Local Mapping thread and launch
-    mpLocalMapper = new LocalMapping(mpMap, mSensor==MONOCULAR);
+    int nLocalMappingThreads = fsSettings["LocalMapping.nThreads"];
+    if(nLocalMappingThreads<1)
+        nLocalMappingThreads = 1;
+    cout << endl << "Local Mapping Threads: " << nLocalMappingThreads << endl;
+    float fTargetKeyFrameRate = bDeterministic ? 0.0f : (float)fsSettings["LocalMapping.TargetKeyFrameRate"];
+    mpLocalMapper = new LocalMapping(mpMap, mSensor==MONOCULAR, nLocalMappingThreads, fTargetKeyFrameRate);
+    int nMaxKeyFrames = fsSettings["LocalMapping.MaxKeyFrames"];
+    int nMaxMapPoints = fsSettings["LocalMapping.MaxMapPoints"];
+    float fMaxMemoryMB = fsSettings["LocalMapping.MaxMemoryMB"];
+    if(nMaxKeyFrames>0 || nMaxMapPoints>0 || fMaxMemoryMB>0)
+        cout << "Map Budget: " << nMaxKeyFrames << " keyframes, " << nMaxMapPoints << " map points, "
+             << fMaxMemoryMB << " MB (0: no limit)" << endl;
+    mpLocalMapper->SetMapBudget(nMaxKeyFrames, nMaxMapPoints,
+                                fMaxMemoryMB>0 ? static_cast<size_t>(fMaxMemoryMB*1024*1024) : 0);
+    int nOverloadPolicy = fsSettings["LocalMapping.OverloadPolicy"];
+    if(nOverloadPolicy==LocalMapping::REDUCE_BA)
+    {
+        cout << "Mapping Overload: reduced local BA for keyframes with a backlog" << endl;
+        mpLocalMapper->SetOverloadPolicy(LocalMapping::REDUCE_BA);
+    }
+    int nWindowKeyFrames = fsSettings["LocalMapping.WindowKeyFrames"];
+    if(nWindowKeyFrames>0)
+    {
+        cout << "Sliding Window Odometry: " << nWindowKeyFrames << " keyframes, no loop closing" << endl;
+        mpLocalMapper->SetSlidingWindow(nWindowKeyFrames);
+    }
+    int nColdKeyFrames = fsSettings["LocalMapping.ColdKeyFrames"];
+    if(nColdKeyFrames>0)
+    {
+        cout << "Cold Keyframes: compacted " << nColdKeyFrames << " keyframes after their last local BA" << endl;
+        mpLocalMapper->SetColdKeyFrames(nColdKeyFrames);
+    }
+    if(mpLatencyScheduler)
+        mpLocalMapper->SetLatencyScheduler(mpLatencyScheduler);
     mptLocalMapping = new thread(&ORB_SLAM2::LocalMapping::Run,mpLocalMapper);
 
     //Initialize the Loop Closing thread and launch
-    mpLoopCloser = new LoopClosing(mpMap, mpKeyFrameDatabase, mpVocabulary, mSensor!=MONOCULAR);
+    int nMaxGBAKeyFrames = fsSettings["LoopClosing.MaxGBAKeyFrames"];
+    float fGBATimeBudget = bDeterministic ? 0.0f : (float)fsSettings["LoopClosing.GBATimeBudget"];
+    int nLoopClosingThreads = fsSettings["LoopClosing.nThreads"];
+    if(nLoopClosingThreads<1)
+        nLoopClosingThreads = 1;
+    cout << "Loop Closing Threads: " << nLoopClosingThreads << endl;
+    mpLoopCloser = new LoopClosing(mpMap, mpKeyFrameDatabase, mpVocabulary, mSensor!=MONOCULAR, nMaxGBAKeyFrames,
+                                   fGBATimeBudget, nLoopClosingThreads);
+    // The loops may be closed on a loop server instead, the sliding window closes none
+    const string strLoopServer = fsSettings["LoopClosing.Server"];
+    const int nLoopServerPort = fsSettings["LoopClosing.ServerPort"];
+    if(!strLoopServer.empty() && nLoopServerPort>0 && nWindowKeyFrames<=0)
+    {
+        cout << "Loop Closing by the loop server " << strLoopServer << ":" << nLoopServerPort << endl;
+        mpLoopCloser->SetClient(new LoopClient(mpMap, mpVocabulary, mSensor!=MONOCULAR, strLoopServer,
+                                               nLoopServerPort));
+    }
+    if(nWindowKeyFrames>0)
+        mpLoopCloser->SetLoopDetection(false);
+    int nMaxLoopQueue = fsSettings["LoopClosing.MaxQueue"];
+    float fMinQueryInterval = fsSettings["LoopClosing.MinQueryInterval"];
+    float fMinQueryDistance = fsSettings["LoopClosing.MinQueryDistance"];
+    mpLoopCloser->SetQueryPolicy(nMaxLoopQueue, fMinQueryInterval, fMinQueryDistance);
+    float fCandidateRadius = fsSettings["LoopClosing.CandidateRadius"];
+    mpLoopCloser->SetCandidateRadius(fCandidateRadius);
+    // The relocalization and the loop candidates are matched in one batch each
+    const bool bBatchCandidates = (int)fsSettings["ORBmatcher.batchCandidates"];
+    if(bBatchCandidates)
+    {
+        mpTracker->SetBatchMatching();
+        mpLoopCloser->SetBatchMatching();
+    }
+    if(mpLatencyScheduler)
+        mpLoopCloser->SetLatencyScheduler(mpLatencyScheduler);
     mptLoopClosing = new thread(&ORB_SLAM2::LoopClosing::Run, mpLoopCloser);
 
     //Initialize the Viewer thread and launch
-    if(bUseViewer)
+    if(mpFrameDrawer)
+        mpViewer = Visualization::Load(this, mpFrameDrawer, mpTracker, mpMap, mSettings);
+    if(mpViewer)
     {
-        mpViewer = new Viewer(this, mpFrameDrawer,mpMapDrawer,mpTracker,strSettingsFile);
-        mptViewer = new thread(&Viewer::Run, mpViewer);
+        mptViewer = new thread(&Visualization::Run, mpViewer);
         mpTracker->SetViewer(mpViewer);
     }
 
+    //Initialize the Streamer thread and launch
+    const int nStreamerPort = fsSettings["Streamer.Port"];
+    const float fStreamerRate = fsSettings["Streamer.Rate"];
+    if(nStreamerPort>0)
+    {
+        mpStreamer = new MapStreamer(mpMap, nStreamerPort, fStreamerRate>0 ? fStreamerRate : 10.0f);
+        mptStreamer = new thread(&MapStreamer::Run, mpStreamer);
+        mpTracker->SetStreamer(mpStreamer);
+    }
+
+    //Initialize the Parameter Server thread and launch
+    const int nParameterServerPort = fsSettings["ParameterServer.Port"];
+    if(nParameterServerPort>0)
+    {
+        mpParameterServer = new ParameterServer(nParameterServerPort);
+        mptParameterServer = new thread(&ParameterServer::Run, mpParameterServer);
+    }
+
+    //Initialize the Metrics Server thread and launch
+    const int nMetricsServerPort = fsSettings["MetricsServer.Port"];
+    if(nMetricsServerPort>0)
+    {
+        mpMetricsServer = new MetricsServer(nMetricsServerPort, mpMap, mpLocalMapper, mpLoopCloser);
+        mptMetricsServer = new thread(&MetricsServer::Run, mpMetricsServer);
+    }
+
     //Set pointers between threads
     mpTracker->SetLocalMapper(mpLocalMapper);
     mpTracker->SetLoopClosing(mpLoopCloser);
@@ -121,50 +620,192 @@ cv::Mat System::TrackStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const
         exit(-1);
     }
 
-    // Check mode change
+    UpdateDebugParameters();
+
+    ApplyModeChange();
+    ApplyReset();
+    ApplyMapMerge();
+
+    cv::Mat Tcw;
+    if(SkipImage(timestamp,imLeft,Tcw))
+        return Tcw;
+
+    Tcw = mpTracker->GrabImageStereo(imLeft,imRight,timestamp);
+
+    StoreTrackingResult();
+    return Tcw;
+}
+
+cv::Mat System::TrackRGBD(const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp)
+{
+    if(mSensor!=RGBD)
     {
-        unique_lock<mutex> lock(mMutexMode);
-        if(mbActivateLocalizationMode)
-        {
-            mpLocalMapper->RequestStop();
+        cerr << "ERROR: you called TrackRGBD but input sensor was not set to RGBD." << endl;
+        exit(-1);
+    }
 
-            // Wait until Local Mapping has effectively stopped
-            while(!mpLocalMapper->isStopped())
-            {
-                usleep(1000);
-            }
+    UpdateDebugParameters();
 
-            mpTracker->InformOnlyTracking(true);
-            mbActivateLocalizationMode = false;
-        }
-        if(mbDeactivateLocalizationMode)
-        {
-            mpTracker->InformOnlyTracking(false);
-            mpLocalMapper->Release();
-            mbDeactivateLocalizationMode = false;
-        }
+    ApplyModeChange();
+    ApplyReset();
+    ApplyMapMerge();
+
+    cv::Mat Tcw;
+    if(SkipImage(timestamp,im,Tcw))
+        return Tcw;
+
+    Tcw = mpTracker->GrabImageRGBD(im,depthmap,timestamp);
+
+    StoreTrackingResult();
+    return Tcw;
+}
+
+cv::Mat System::TrackMonocular(const cv::Mat &im, const double &timestamp)
+{
+    if(mSensor!=MONOCULAR)
+    {
+        cerr << "ERROR: you called TrackMonocular but input sensor was not set to Monocular." << endl;
+        exit(-1);
     }
 
-    // Check reset
+    UpdateDebugParameters();
+
+    ApplyModeChange();
+    ApplyReset();
+    ApplyMapMerge();
+
+    cv::Mat Tcw;
+    if(SkipImage(timestamp,im,Tcw))
+        return Tcw;
+
+    Tcw = mpTracker->GrabImageMonocular(im,timestamp);
+
+    StoreTrackingResult();
+    return Tcw;
+}
+
+cv::Mat System::TrackRig(const vector<cv::Mat> &vIm, const double &timestamp)
+{
+    if(mSensor!=MONOCULAR)
     {
-    unique_lock<mutex> lock(mMutexReset);
-    if(mbReset)
+        cerr << "ERROR: you called TrackRig but input sensor was not set to Monocular." << endl;
+        exit(-1);
+    }
+
+    if(static_cast<int>(vIm.size())!=mpTracker->GetNumRigCameras())
     {
-        mpTracker->Reset();
-        mbReset = false;
+        cerr << "ERROR: TrackRig got " << vIm.size() << " images for a rig of "
+             << mpTracker->GetNumRigCameras() << " cameras." << endl;
+        exit(-1);
     }
+
+    UpdateDebugParameters();
+
+    ApplyModeChange();
+    ApplyReset();
+    ApplyMapMerge();
+
+    cv::Mat Tcw;
+    if(SkipImage(timestamp,vIm[0],Tcw))
+        return Tcw;
+
+    Tcw = mpTracker->GrabImageRig(vIm,timestamp);
+
+    StoreTrackingResult();
+    return Tcw;
+}
+
+int System::AddLocalizationStream()
+{
+    Tracking* pTracker = new Tracking(this, mpVocabulary, static_cast<FrameDrawer*>(NULL), mpMap, mpKeyFrameDatabase,
+                                      mSettings, mSensor);
+    pTracker->SetLocalizationStream();
+    pTracker->SetLocalMapper(mpLocalMapper);
+    pTracker->SetLoopClosing(mpLoopCloser);
+
+    unique_lock<SharedMutex> lock(mMutexStreams);
+    mvpStreams.push_back(pTracker);
+    cout << "Localization Stream " << mvpStreams.size() << " added" << endl;
+    return mvpStreams.size();
+}
+
+Tracking* System::GetAttachedStream(const int nStream)
+{
+    if(nStream<1 || nStream>static_cast<int>(mvpStreams.size()))
+    {
+        cerr << "ERROR: there is no localization stream " << nStream << "." << endl;
+        return static_cast<Tracking*>(NULL);
     }
 
-    cv::Mat Tcw = mpTracker->GrabImageStereo(imLeft,imRight,timestamp);
+    Tracking* pTracker = mvpStreams[nStream-1];
+    return pTracker->AttachStream() ? pTracker : static_cast<Tracking*>(NULL);
+}
 
-    unique_lock<mutex> lock2(mMutexState);
-    mTrackingState = mpTracker->mState;
-    mTrackedMapPoints = mpTracker->mCurrentFrame.mvpMapPoints;
-    mTrackedKeyPointsUn = mpTracker->mCurrentFrame.mvKeysUn;
+cv::Mat System::TrackStreamStereo(const int nStream, const cv::Mat &imLeft, const cv::Mat &imRight, const double &timestamp)
+{
+    if(mSensor!=STEREO)
+    {
+        cerr << "ERROR: you called TrackStreamStereo but input sensor was not set to STEREO." << endl;
+        exit(-1);
+    }
+
+    SharedLock lock(mMutexStreams);
+    Tracking* pTracker = GetAttachedStream(nStream);
+    if(!pTracker)
+        return cv::Mat();
+    return pTracker->GrabImageStereo(imLeft,imRight,timestamp);
+}
+
+cv::Mat System::TrackStreamRGBD(const int nStream, const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp)
+{
+    if(mSensor!=RGBD)
+    {
+        cerr << "ERROR: you called TrackStreamRGBD but input sensor was not set to RGBD." << endl;
+        exit(-1);
+    }
+
+    SharedLock lock(mMutexStreams);
+    Tracking* pTracker = GetAttachedStream(nStream);
+    if(!pTracker)
+        return cv::Mat();
+    return pTracker->GrabImageRGBD(im,depthmap,timestamp);
+}
+
+cv::Mat System::TrackStreamMonocular(const int nStream, const cv::Mat &im, const double &timestamp)
+{
+    if(mSensor!=MONOCULAR)
+    {
+        cerr << "ERROR: you called TrackStreamMonocular but input sensor was not set to Monocular." << endl;
+        exit(-1);
+    }
+
+    SharedLock lock(mMutexStreams);
+    Tracking* pTracker = GetAttachedStream(nStream);
+    if(!pTracker)
+        return cv::Mat();
+    return pTracker->GrabImageMonocular(im,timestamp);
+}
+
+int System::GetStreamTrackingState(const int nStream)
+{
+    SharedLock lock(mMutexStreams);
+    if(nStream<1 || nStream>static_cast<int>(mvpStreams.size()))
+        return Tracking::SYSTEM_NOT_READY;
+    return mvpStreams[nStream-1]->mState;
+}
+
+cv::Mat System::TrackStereo(const ExternalImage &imLeft, const ExternalImage &imRight, const double &timestamp,
+                            const ReleaseCallback &release)
+{
+    const std::shared_ptr<void> external = MakeReleaseGuard(release);
+    const cv::Mat Tcw = TrackStereo(Wrap(imLeft),Wrap(imRight),timestamp);
+    // The frame drawer has copied the image, the tracker must not keep the buffer
+    mpTracker->mImGray.release();
     return Tcw;
 }
 
-cv::Mat System::TrackRGBD(const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp)
+cv::Mat System::TrackRGBD(const ExternalImage &im, const ExternalDepth &depthmap, const double &timestamp,
+                          const ReleaseCallback &release)
 {
     if(mSensor!=RGBD)
     {
@@ -172,107 +813,865 @@ cv::Mat System::TrackRGBD(const cv::Mat &im, const cv::Mat &depthmap, const doub
         exit(-1);
     }
 
-    // Check mode change
+    const std::shared_ptr<void> external = MakeReleaseGuard(release);
+
+    ApplyModeChange();
+    ApplyReset();
+    ApplyMapMerge();
+
+    cv::Mat Tcw;
+    if(SkipImage(timestamp,Wrap(im),Tcw))
+        return Tcw;
+
+    Tcw = mpTracker->GrabImageRGBD(Wrap(im),Wrap(depthmap),timestamp,true);
+    mpTracker->mImGray.release();
+
+    StoreTrackingResult();
+    return Tcw;
+}
+
+cv::Mat System::TrackMonocular(const ExternalImage &im, const double &timestamp, const ReleaseCallback &release)
+{
+    const std::shared_ptr<void> external = MakeReleaseGuard(release);
+    const cv::Mat Tcw = TrackMonocular(Wrap(im),timestamp);
+    mpTracker->mImGray.release();
+    return Tcw;
+}
+
+std::future<cv::Mat> System::TrackStereoAsync(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timestamp)
+{
+    if(mSensor!=STEREO)
+    {
+        cerr << "ERROR: you called TrackStereoAsync but input sensor was not set to STEREO." << endl;
+        exit(-1);
+    }
+
+    return SubmitAsync(imLeft,imRight,timestamp);
+}
+
+std::future<cv::Mat> System::TrackRGBDAsync(const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp)
+{
+    if(mSensor!=RGBD)
+    {
+        cerr << "ERROR: you called TrackRGBDAsync but input sensor was not set to RGBD." << endl;
+        exit(-1);
+    }
+
+    return SubmitAsync(im,depthmap,timestamp);
+}
+
+std::future<cv::Mat> System::TrackMonocularAsync(const cv::Mat &im, const double &timestamp)
+{
+    if(mSensor!=MONOCULAR)
+    {
+        cerr << "ERROR: you called TrackMonocularAsync but input sensor was not set to Monocular." << endl;
+        exit(-1);
+    }
+
+    return SubmitAsync(im,cv::Mat(),timestamp);
+}
+
+std::future<cv::Mat> System::TrackStereoAsync(const ExternalImage &imLeft, const ExternalImage &imRight,
+                                              const double &timestamp, const ReleaseCallback &release)
+{
+    if(mSensor!=STEREO)
+    {
+        cerr << "ERROR: you called TrackStereoAsync but input sensor was not set to STEREO." << endl;
+        exit(-1);
+    }
+
+    return SubmitAsync(Wrap(imLeft),Wrap(imRight),timestamp,false,MakeReleaseGuard(release));
+}
+
+std::future<cv::Mat> System::TrackRGBDAsync(const ExternalImage &im, const ExternalDepth &depthmap,
+                                            const double &timestamp, const ReleaseCallback &release)
+{
+    if(mSensor!=RGBD)
     {
-        unique_lock<mutex> lock(mMutexMode);
-        if(mbActivateLocalizationMode)
+        cerr << "ERROR: you called TrackRGBDAsync but input sensor was not set to RGBD." << endl;
+        exit(-1);
+    }
+
+    return SubmitAsync(Wrap(im),Wrap(depthmap),timestamp,true,MakeReleaseGuard(release));
+}
+
+std::future<cv::Mat> System::TrackMonocularAsync(const ExternalImage &im, const double &timestamp,
+                                                 const ReleaseCallback &release)
+{
+    if(mSensor!=MONOCULAR)
+    {
+        cerr << "ERROR: you called TrackMonocularAsync but input sensor was not set to Monocular." << endl;
+        exit(-1);
+    }
+
+    return SubmitAsync(Wrap(im),cv::Mat(),timestamp,false,MakeReleaseGuard(release));
+}
+
+void System::SetTrackingCallback(const TrackingCallback &callback)
+{
+    unique_lock<mutex> lock(mMutexAsync);
+    mTrackingCallback = callback;
+}
+
+size_t System::GetNumDroppedFrames()
+{
+    unique_lock<mutex> lock(mMutexAsync);
+    return mnAsyncDropped;
+}
+
+size_t System::GetNumSkippedFrames()
+{
+    unique_lock<mutex> lock(mMutexState);
+    return mnSkippedFrames;
+}
+
+std::future<cv::Mat> System::SubmitAsync(const cv::Mat &im, const cv::Mat &im2, const double &timestamp,
+                                         const bool bMetricDepth, const std::shared_ptr<void> &external)
+{
+    AsyncImage image;
+    if(external)
+    {
+        // external buffers stay valid until the guard releases them
+        image.im = im;
+        image.im2 = im2;
+    }
+    else
+    {
+        // the caller may reuse its buffers as soon as we return
+        image.im = im.clone();
+        image.im2 = im2.clone();
+    }
+    image.timestamp = timestamp;
+    image.bMetricDepth = bMetricDepth;
+    image.external = external;
+    image.tArrival = chrono::steady_clock::now();
+    std::future<cv::Mat> pose = image.pose.get_future();
+
+    {
+        unique_lock<mutex> lock(mMutexAsync);
+
+        if(mbAsyncFinishRequested)
+        {
+            mnAsyncDropped++;
+            image.pose.set_value(cv::Mat());
+            return pose;
+        }
+
+        if(!mptAsyncTracker)
+        {
+            // Offline the ids continue after a loaded map
+            mnAsyncNextFrameId = mpMap->mFrameContext.nNextId;
+            const int nBuilders = max(mnOfflineBuilders,1);
+            for(int i=0; i<nBuilders; i++)
+                mvptAsyncFrameBuilders.push_back(new thread(&System::RunAsyncFrameBuilder,this,mnOfflineBuilders>0 ? i+1 : 0));
+            mnAsyncBuildersRunning = nBuilders;
+            mptAsyncTracker = new thread(&System::RunAsyncTracker,this);
+        }
+
+        if(mnOfflineBuilders>0)
         {
-            mpLocalMapper->RequestStop();
+            // Nothing is dropped offline, the caller waits for a place in the queue
+            while(mqAsyncImages.size()>=mnAsyncQueueSize && !mbAsyncFinishRequested)
+                mCondAsyncInput.wait(lock);
 
-            // Wait until Local Mapping has effectively stopped
-            while(!mpLocalMapper->isStopped())
+            if(mbAsyncFinishRequested)
             {
-                usleep(1000);
+                mnAsyncDropped++;
+                image.pose.set_value(cv::Mat());
+                return pose;
             }
+        }
+        else
+        {
+            const size_t nMaxWaiting = mAsyncDropPolicy==KEEP_LATEST ? 0 : mnAsyncQueueSize-1;
+            while(mqAsyncImages.size()>nMaxWaiting)
+            {
+                mqAsyncImages.front().pose.set_value(cv::Mat());
+                mqAsyncImages.pop_front();
+                mnAsyncDropped++;
+            }
+        }
+
+        mqAsyncImages.push_back(std::move(image));
+    }
+    mCondAsyncBuilder.notify_one();
 
-            mpTracker->InformOnlyTracking(true);
-            mbActivateLocalizationMode = false;
+    return pose;
+}
+
+void System::RunAsyncFrameBuilder(const int nBuilder)
+{
+    ThreadConfig::Apply(ThreadConfig::EXTRACTION_WORKERS);
+    StageTimes::BindThread(&mpMap->mStageTimes);
+
+    while(1)
+    {
+        AsyncImage image;
+        size_t nSeq;
+        {
+            unique_lock<mutex> lock(mMutexAsync);
+            // Only build mnAsyncMaxFramesAhead Frames ahead of the tracker, later images stay in
+            // the queue where the drop policy applies. Images which are still queued at shutdown
+            // are processed.
+            while(!(mqAsyncImages.empty() && mbAsyncFinishRequested) &&
+                  !(!mqAsyncImages.empty() && mnAsyncFramesAhead<mnAsyncMaxFramesAhead))
+                mCondAsyncBuilder.wait(lock);
+
+            if(mqAsyncImages.empty())
+                break;
+
+            image = std::move(mqAsyncImages.front());
+            mqAsyncImages.pop_front();
+            nSeq = mnAsyncNextSeq++;
+            mnAsyncFramesAhead++;
+        }
+        mCondAsyncInput.notify_one();
+
+        // The frame is queued before the build lock is released, so a reset either waits
+        // for it or happens before it is built. The offline builders share the lock, unless
+        // the frame sets up what all frames use.
+        bool bShared = false;
+        if(nBuilder>0)
+        {
+            mMutexAsyncBuild.lock_shared();
+            bShared = !mpTracker->NeedsInitialComputations();
+            if(!bShared)
+                mMutexAsyncBuild.unlock_shared();
         }
-        if(mbDeactivateLocalizationMode)
+        if(!bShared)
+            mMutexAsyncBuild.lock();
+
+        AsyncFrame frame = BuildAsyncFrame(image,nBuilder);
+        frame.nSeq = nSeq;
+
         {
-            mpTracker->InformOnlyTracking(false);
-            mpLocalMapper->Release();
-            mbDeactivateLocalizationMode = false;
+            unique_lock<mutex> lock(mMutexAsync);
+            deque<AsyncFrame>::iterator it = mqAsyncFrames.end();
+            while(it!=mqAsyncFrames.begin() && (it-1)->nSeq>nSeq)
+                it--;
+            mqAsyncFrames.insert(it,std::move(frame));
         }
+
+        if(bShared)
+            mMutexAsyncBuild.unlock_shared();
+        else
+            mMutexAsyncBuild.unlock();
+        mCondAsyncTracker.notify_one();
     }
 
-    // Check reset
     {
+        unique_lock<mutex> lock(mMutexAsync);
+        mnAsyncBuildersRunning--;
+    }
+    mCondAsyncTracker.notify_one();
+}
+
+System::AsyncFrame System::BuildAsyncFrame(AsyncImage &image, const int nBuilder)
+{
+    AsyncFrame frame;
+    frame.bInitializing = false;
+    // The tracker gives a skipped image its pose in order, nothing is extracted
+    frame.bSkipped = mpAdmission && !mpAdmission->Admit(image.timestamp);
+    frame.bStill = false;
+    if(mpStaticScene)
+    {
+        frame.thumbnail = StaticScene::Thumbnail(image.im);
+        if(!frame.bSkipped)
+            frame.bSkipped = frame.bStill = mpStaticScene->Skip(frame.thumbnail);
+    }
+    if(frame.bSkipped)
+        frame.frame.mTimeStamp = image.timestamp;
+    else if(mSensor==STEREO)
+        frame.frame = mpTracker->CreateFrameStereo(image.im,image.im2,image.timestamp,frame.imGray,nBuilder);
+    else if(mSensor==RGBD)
+        frame.frame = mpTracker->CreateFrameRGBD(image.im,image.im2,image.timestamp,frame.imGray,image.bMetricDepth,nBuilder);
+    else
+    {
+        const int state = GetTrackingState();
+        frame.bInitializing = state==Tracking::NOT_INITIALIZED || state==Tracking::NO_IMAGES_YET;
+        frame.frame = mpTracker->CreateFrameMonocular(image.im,image.timestamp,frame.bInitializing,frame.imGray,nBuilder);
+        // Several frames ahead the state may change before the frame is tracked
+        if(nBuilder>0)
+            frame.im = image.im;
+    }
+    frame.external = image.external;
+    frame.pose = std::move(image.pose);
+    frame.tArrival = image.tArrival;
+    return frame;
+}
+
+void System::RunAsyncTracker()
+{
+    StageTimes::BindThread(&mpMap->mStageTimes);
+    while(1)
+    {
+        {
+            unique_lock<mutex> lock(mMutexAsync);
+            // Offline the next frame may still be built while later ones are done
+            while(!(!mqAsyncFrames.empty() && mqAsyncFrames.front().nSeq==mnAsyncTrackSeq) &&
+                  !(mqAsyncFrames.empty() && mnAsyncBuildersRunning==0))
+                mCondAsyncTracker.wait(lock);
+
+            if(mqAsyncFrames.empty())
+                break;
+        }
+        mtTrackStart = chrono::steady_clock::now();
+
+        UpdateDebugParameters();
+
+        ApplyModeChange();
+        ApplyMapMerge();
+
+        bool bResetRequested;
+        {
+            unique_lock<mutex> lock(mMutexReset);
+            bResetRequested = mbReset;
+        }
+
+        // Tracking::Reset restarts the frame ids, it must not run while a Frame is built.
+        // The frames built before the reset are dropped, their ids belong to the old map.
+        // Offline they are kept, the tracker gives the ids.
+        if(bResetRequested)
+        {
+            unique_lock<SharedMutex> lockBuild(mMutexAsyncBuild);
+            ApplyReset();
+            {
+                unique_lock<mutex> lock(mMutexState);
+                mTrackingState = mpTracker->mState;
+                PublishTrackingSnapshot();
+            }
+            if(mnOfflineBuilders>0)
+            {
+                mnAsyncNextFrameId = mpMap->mFrameContext.nNextId;
+                continue;
+            }
+            {
+                unique_lock<mutex> lock(mMutexAsync);
+                while(!mqAsyncFrames.empty())
+                {
+                    mnAsyncTrackSeq = mqAsyncFrames.front().nSeq+1;
+                    mqAsyncFrames.front().pose.set_value(cv::Mat());
+                    mqAsyncFrames.pop_front();
+                    mnAsyncFramesAhead--;
+                    mnAsyncDropped++;
+                }
+            }
+            mCondAsyncBuilder.notify_all();
+            continue;
+        }
+
+        AsyncFrame frame;
+        {
+            unique_lock<mutex> lock(mMutexAsync);
+            frame = std::move(mqAsyncFrames.front());
+            mqAsyncFrames.pop_front();
+            mnAsyncTrackSeq++;
+            mnAsyncFramesAhead--;
+        }
+        mCondAsyncBuilder.notify_one();
+        mfInputWait = chrono::duration<double>(mtTrackStart-frame.tArrival).count();
+
+        if(mnOfflineBuilders>0)
+        {
+            // The monocular initialization started or ended since the frame was built
+            const Tracking::eTrackingState state = mpTracker->mState;
+            const bool bInitializing = state==Tracking::NOT_INITIALIZED || state==Tracking::NO_IMAGES_YET;
+            if(mSensor==MONOCULAR && bInitializing!=frame.bInitializing)
+                frame.frame = mpTracker->CreateFrameMonocular(frame.im,frame.frame.mTimeStamp,bInitializing,frame.imGray);
+            frame.im.release();
+
+            // Ids in the order of the images, the next id stays ahead for a saved map
+            frame.frame.mnId = mnAsyncNextFrameId++;
+            long unsigned int nNextId = mpMap->mFrameContext.nNextId;
+            while(nNextId<mnAsyncNextFrameId && !mpMap->mFrameContext.nNextId.compare_exchange_weak(nNextId,mnAsyncNextFrameId))
+                ;
+        }
+
+        const double timestamp = frame.frame.mTimeStamp;
+        cv::Mat Tcw;
+        if(frame.bSkipped)
+        {
+            // The tracker lost its motion model since the image was admitted, it is dropped
+            Tcw = mpTracker->SkipFrame(timestamp,frame.bStill);
+            if(!Tcw.empty())
+                StoreSkippedResult(timestamp,Tcw);
+            else
+            {
+                unique_lock<mutex> lock(mMutexAsync);
+                mnAsyncDropped++;
+            }
+        }
+        else
+        {
+            // Images without a release guard are copies of the queue
+            mThumbnail = frame.thumbnail;
+            Tcw = mpTracker->TrackFrame(std::move(frame.frame),frame.imGray,!frame.external);
+            if(frame.external)
+            {
+                mpTracker->mImGray.release();
+                frame.imGray.release();
+            }
+            StoreTrackingResult();
+        }
+
+        TrackingCallback callback;
+        {
+            unique_lock<mutex> lock(mMutexAsync);
+            callback = mTrackingCallback;
+        }
+        if(callback)
+            callback(timestamp,Tcw);
+
+        frame.pose.set_value(Tcw);
+    }
+}
+
+void System::FinishAsync()
+{
+    {
+        unique_lock<mutex> lock(mMutexAsync);
+        mbAsyncFinishRequested = true;
+    }
+    mCondAsyncBuilder.notify_all();
+    mCondAsyncInput.notify_all();
+
+    if(mptAsyncTracker)
+    {
+        for(size_t i=0; i<mvptAsyncFrameBuilders.size(); i++)
+        {
+            mvptAsyncFrameBuilders[i]->join();
+            delete mvptAsyncFrameBuilders[i];
+        }
+        mvptAsyncFrameBuilders.clear();
+        mptAsyncTracker->join();
+        delete mptAsyncTracker;
+        mptAsyncTracker = static_cast<thread*>(NULL);
+    }
+}
+
+bool System::SubmitStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const double &timestamp)
+{
+    if(mSensor!=STEREO)
+    {
+        cerr << "ERROR: you called SubmitStereo but input sensor was not set to STEREO." << endl;
+        exit(-1);
+    }
+
+    return Submit(imLeft,imRight,timestamp);
+}
+
+bool System::SubmitRGBD(const cv::Mat &im, const cv::Mat &depthmap, const double &timestamp)
+{
+    if(mSensor!=RGBD)
+    {
+        cerr << "ERROR: you called SubmitRGBD but input sensor was not set to RGBD." << endl;
+        exit(-1);
+    }
+
+    return Submit(im,depthmap,timestamp);
+}
+
+bool System::SubmitMonocular(const cv::Mat &im, const double &timestamp)
+{
+    if(mSensor!=MONOCULAR)
+    {
+        cerr << "ERROR: you called SubmitMonocular but input sensor was not set to Monocular." << endl;
+        exit(-1);
+    }
+
+    return Submit(im,cv::Mat(),timestamp);
+}
+
+bool System::PopTrackingResult(TrackingResult &result)
+{
+    unique_lock<mutex> lock(mMutexTrackingResults);
+    return mpTrackingResults->Pop(result);
+}
+
+size_t System::GetNumDroppedSubmissions()
+{
+    return mnSubmitDropped.load(memory_order_relaxed);
+}
+
+bool System::Submit(const cv::Mat &im, const cv::Mat &im2, const double &timestamp)
+{
+    if(mbTrackerFinishRequested.load(memory_order_acquire))
+    {
+        mnSubmitDropped.fetch_add(1,memory_order_relaxed);
+        return false;
+    }
+
+    if(!mbTrackerThreadStarted.load(memory_order_acquire))
+    {
+        unique_lock<mutex> lock(mMutexTrackerWakeUp);
+        if(!mptTracker)
+            mptTracker = new thread(&System::RunTrackerThread,this);
+        mbTrackerThreadStarted.store(true,memory_order_release);
+    }
+
+    // the caller may reuse its buffers as soon as we return
+    SubmittedImage image;
+    image.im = im.clone();
+    image.im2 = im2.clone();
+    image.timestamp = timestamp;
+    image.tArrival = chrono::steady_clock::now();
+    if(!mpSubmitted->Push(image))
+    {
+        mnSubmitDropped.fetch_add(1,memory_order_relaxed);
+        return false;
+    }
+
+    // Either the tracking thread sees the image before it sleeps or this sees it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if(mbTrackerSleeping.load(memory_order_relaxed))
+    {
+        unique_lock<mutex> lock(mMutexTrackerWakeUp);
+        mbTrackerWakeUp = true;
+        mCondTrackerWakeUp.notify_one();
+    }
+    return true;
+}
+
+void System::RunTrackerThread()
+{
+    Trace::SetThreadName("Tracking");
+
+    while(1)
+    {
+        SubmittedImage image;
+        if(!mpSubmitted->Pop(image))
+        {
+            // The images submitted before the finish are tracked first
+            if(mbTrackerFinishRequested.load(memory_order_acquire))
+            {
+                if(!mpSubmitted->Pop(image))
+                    break;
+            }
+            else
+            {
+                WaitForSubmission();
+                continue;
+            }
+        }
+
+        TrackingResult result;
+        result.timestamp = image.timestamp;
+        mfInputWait = chrono::duration<double>(chrono::steady_clock::now()-image.tArrival).count();
+        if(mSensor==STEREO)
+            result.Tcw = TrackStereo(image.im,image.im2,image.timestamp);
+        else if(mSensor==RGBD)
+            result.Tcw = TrackRGBD(image.im,image.im2,image.timestamp);
+        else
+            result.Tcw = TrackMonocular(image.im,image.timestamp);
+        result.state = GetTrackingState();
+
+        // The oldest results stay for the caller, the new one is dropped
+        mpTrackingResults->Push(result);
+    }
+}
+
+void System::WaitForSubmission()
+{
+    unique_lock<mutex> lock(mMutexTrackerWakeUp);
+    mbTrackerSleeping.store(true,memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    // Nothing submitted since the last look, a wake up which came in meanwhile is not lost
+    if(!mbTrackerWakeUp && !mpSubmitted->Readable() && !mbTrackerFinishRequested.load(memory_order_relaxed))
+        mCondTrackerWakeUp.wait_for(lock,chrono::milliseconds(50)); //param
+    mbTrackerSleeping.store(false,memory_order_relaxed);
+    mbTrackerWakeUp = false;
+}
+
+void System::FinishTrackerThread()
+{
+    {
+        unique_lock<mutex> lock(mMutexTrackerWakeUp);
+        mbTrackerFinishRequested.store(true,memory_order_release);
+        mCondTrackerWakeUp.notify_one();
+    }
+
+    if(mptTracker)
+    {
+        mptTracker->join();
+        delete mptTracker;
+        mptTracker = static_cast<thread*>(NULL);
+    }
+}
+
+void System::UpdateDebugParameters()
+{
+    //update parameters before next image is processed, only walks them if one changed
+    ParameterManager::updateParameters();
+    //Reset debug variables, the candidates of the previous frame belong to an old epoch
+    KeyFrame::nRelocalizationEpoch++;
+}
+
+void System::ApplyModeChange()
+{
+    unique_lock<mutex> lock(mMutexMode);
+    if(mbActivateLocalizationMode)
+    {
+        mpLocalMapper->RequestStop();
+
+        // Wait until Local Mapping has effectively stopped
+        mpLocalMapper->WaitUntilStopped();
+
+        mpTracker->InformOnlyTracking(true);
+        mbActivateLocalizationMode = false;
+    }
+    if(mbDeactivateLocalizationMode)
+    {
+        // The streams read the frozen map without locks until their frame is done
+        unique_lock<SharedMutex> lockStreams(mMutexStreams);
+        mpTracker->InformOnlyTracking(false);
+        mpLocalMapper->Release();
+        mbDeactivateLocalizationMode = false;
+    }
+}
+
+void System::ApplyReset()
+{
     unique_lock<mutex> lock(mMutexReset);
     if(mbReset)
     {
+        // Nor the streams, which forget it before the next frame
+        unique_lock<SharedMutex> lockStreams(mMutexStreams);
+        for(size_t i=0; i<mvpStreams.size(); i++)
+            mvpStreams[i]->ResetStream();
+
+        // An export or a checkpoint must not read the map while it is deleted
+        unique_lock<mutex> lockExporter(mMutexMapExporter);
+        if(mpMapExporter)
+            mpMapExporter->Pause();
+        if(mpCheckpointer)
+            mpCheckpointer->Pause();
         mpTracker->Reset();
+        if(mpCheckpointer)
+            mpCheckpointer->Release();
+        if(mpMapExporter)
+            mpMapExporter->Release();
+        lockExporter.unlock();
         mbReset = false;
+        EventLog::Add(EventLog::RESET);
+        if(mpAdmission)
+            mpAdmission->Reset();
+        if(mpLatencyScheduler)
+        {
+            mpLatencyScheduler->Reset();
+            Optimizer::SetMaxThreads(mpLatencyScheduler->GetKnobs().nOptimizerThreads);
+        }
+        if(mpStaticScene)
+            mpStaticScene->Reset();
+
+        // The keyframes of a mapped map are gone
+        delete mpMapTiles;
+        mpMapTiles = static_cast<MapTiles*>(NULL);
+    }
+}
+
+void System::ApplyMapMerge()
+{
+    {
+        unique_lock<mutex> lock(mMutexMapMerge);
+        if(!mbMergeLoaded)
+            return;
+        mbMergeLoaded = false;
     }
+
+    const long unsigned int nKeyFrames = mpMergeMap->KeyFramesInMap();
+    const long unsigned int nMapPoints = mpMergeMap->MapPointsInMap();
+    {
+        unique_lock<SharedMutex> lockStreams(mMutexStreams);
+        MapSerializer::MoveMap(mpMergeMap,mpMap,mpKeyFrameDatabase);
     }
+    mpMap->InformNewBigChange();
+    delete mpMergeMap;
+    delete mpMergeKeyFrameDB;
+    mpMergeMap = static_cast<Map*>(NULL);
+    mpMergeKeyFrameDB = static_cast<KeyFrameDatabase*>(NULL);
+
+    cout << "Map added to the atlas: " << nKeyFrames << " keyframes, " << nMapPoints << " map points" << endl;
+}
+
+bool System::SkipImage(const double timestamp, const cv::Mat &im, cv::Mat &Tcw)
+{
+    mtTrackStart = chrono::steady_clock::now();
+    bool bStill = false;
+    if(!mpAdmission || mpAdmission->Admit(timestamp))
+    {
+        if(!mpStaticScene)
+            return false;
+        mThumbnail = StaticScene::Thumbnail(im);
+        bStill = mpStaticScene->Skip(mThumbnail);
+        if(!bStill)
+            return false;
+    }
+
+    // The tracker lost its motion model since the last image, this one is tracked after all
+    Tcw = mpTracker->SkipFrame(timestamp,bStill);
+    if(Tcw.empty())
+        return false;
+
+    StoreSkippedResult(timestamp,Tcw);
+    return true;
+}
+
+void System::StoreSkippedResult(const double timestamp, const cv::Mat &Tcw)
+{
+    if(mpTrajectoryWriter)
+        mpTrajectoryWriter->Update();
 
-    cv::Mat Tcw = mpTracker->GrabImageRGBD(im,depthmap,timestamp);
+    mnEventImage++;
+    EventLog::AddImage(EventLog::SKIPPED,mnEventImage,timestamp,mpTracker->mState);
 
-    unique_lock<mutex> lock2(mMutexState);
-    mTrackingState = mpTracker->mState;
-    mTrackedMapPoints = mpTracker->mCurrentFrame.mvpMapPoints;
-    mTrackedKeyPointsUn = mpTracker->mCurrentFrame.mvKeysUn;
-    return Tcw;
+    unique_lock<mutex> lock(mMutexState);
+    mnSkippedFrames++;
+    WriteTrackingSnapshot(timestamp,Tcw,true);
 }
 
-cv::Mat System::TrackMonocular(const cv::Mat &im, const double &timestamp)
+void System::StoreTrackingResult()
 {
-    if(mSensor!=MONOCULAR)
+    if(mpTrajectoryWriter)
+        mpTrajectoryWriter->Update();
+
+    const double time = chrono::duration<double>(chrono::steady_clock::now()-mtTrackStart).count();
+    if(mpAdmission)
+        mpAdmission->AddTracking(time,mpTracker->CanSkipFrame(),mpTracker->IsKeyFrameLikely());
+
+    // From the image to its pose, with the time it waited in the input
+    if(mpLatencyScheduler && mpLatencyScheduler->AddFrame(mfInputWait+time))
     {
-        cerr << "ERROR: you called TrackMonocular but input sensor was not set to Monocular." << endl;
-        exit(-1);
+        Optimizer::SetMaxThreads(mpLatencyScheduler->GetKnobs().nOptimizerThreads);
+        cout << "Latency Scheduler: level " << mpLatencyScheduler->GetLevel() << ", "
+             << mpLatencyScheduler->GetLatency()*1e3 << " ms, " << mpLatencyScheduler->GetCores() << " cores" << endl;
     }
+    mfInputWait = 0;
 
-    //update parameters before next image is processed
-    ParameterManager::updateParameters();
-    //Reset debug variables
-    for(auto keyFrame : mpMap->GetAllKeyFrames())
+    // Local Mapping has nothing to do while the camera stands still
+    if(mpStaticScene)
     {
-        keyFrame->mbIsRelocalizationCandidate = false;
+        mpStaticScene->AddTracking(mThumbnail,mpTracker->mState==Tracking::OK ? mpTracker->GetVelocity() : cv::Mat());
+        mpLocalMapper->SetParked(mpStaticScene->IsStill());
     }
 
-    // Check mode change
-    {
-        unique_lock<mutex> lock(mMutexMode);
-        if(mbActivateLocalizationMode)
-        {
-            mpLocalMapper->RequestStop();
+    if(EventLog::IsOpen())
+        LogTrackingEvents();
 
-            // Wait until Local Mapping has effectively stopped
-            while(!mpLocalMapper->isStopped())
-            {
-                usleep(1000);
-            }
+    if(PerformanceReport::IsOpen())
+        ReportFrame();
 
-            mpTracker->InformOnlyTracking(true);
-            mbActivateLocalizationMode = false;
-        }
-        if(mbDeactivateLocalizationMode)
-        {
-            mpTracker->InformOnlyTracking(false);
-            mpLocalMapper->Release();
-            mbDeactivateLocalizationMode = false;
-        }
+    if(mpMapTiles && mpTracker->mState==Tracking::OK)
+    {
+        Eigen::Vector3f Ow;
+        mpTracker->mCurrentFrame.GetCameraCenter(Ow);
+        mpMapTiles->Update(Ow);
     }
 
-    // Check reset
-    {
-    unique_lock<mutex> lock(mMutexReset);
-    if(mbReset)
+    unique_lock<mutex> lock(mMutexState);
+    mTrackingState = mpTracker->mState;
+    mTrackedMapPoints = mpTracker->mCurrentFrame.mvpMapPoints;
+    mTrackedKeyPointsUn.assign(mpTracker->mCurrentFrame.mvKeysUn.begin(),mpTracker->mCurrentFrame.mvKeysUn.end());
+    // Relocalization computed it
+    if(mTrackingState==Tracking::LOST)
+        mLostBowVec = mpTracker->mCurrentFrame.mBowVec;
+    PublishTrackingSnapshot();
+    lock.unlock();
+
+    if(mpMetricsServer)
     {
-        mpTracker->Reset();
-        mbReset = false;
+        const int nState = mpTracker->mState;
+        const int nLastState = mpTracker->mLastProcessedState;
+        mpMetricsServer->PublishFrame(nState,nState==Tracking::OK ? mpTracker->GetNumMatchesInliers() : 0,
+                                      mpMap->KeyFramesInMap(),mpMap->MapPointsInMap(),
+                                      nState==Tracking::LOST && nLastState==Tracking::OK,
+                                      nState==Tracking::OK && nLastState==Tracking::LOST);
     }
+
+    if(mfMemoryLogPeriod>0)
+    {
+        const chrono::steady_clock::time_point tNow = chrono::steady_clock::now();
+        if(chrono::duration<double>(tNow-mtLastMemoryLog).count()>=mfMemoryLogPeriod)
+        {
+            mtLastMemoryLog = tNow;
+            LogMemoryUsage();
+        }
     }
+}
 
-    cv::Mat Tcw = mpTracker->GrabImageMonocular(im,timestamp);
+void System::LogTrackingEvents()
+{
+    const Frame &frame = mpTracker->mCurrentFrame;
+    const int nState = mpTracker->mState;
+    mnEventImage++;
+    EventLog::AddImage(EventLog::FRAME,mnEventImage,frame.mTimeStamp,nState,mpTracker->GetNumMatchesInliers(),
+                       frame.mnId);
+
+    const int nLastState = mpTracker->mLastProcessedState;
+    if(nState==Tracking::OK && nLastState==Tracking::NOT_INITIALIZED)
+        EventLog::AddImage(EventLog::INITIALIZED,mnEventImage,frame.mTimeStamp,nState);
+    else if(nState==Tracking::OK && nLastState==Tracking::LOST)
+        EventLog::AddImage(EventLog::RELOCALIZED,mnEventImage,frame.mTimeStamp,nState);
+    else if(nState==Tracking::LOST && nLastState==Tracking::OK)
+        EventLog::AddImage(EventLog::LOST,mnEventImage,frame.mTimeStamp,nState);
+
+    KeyFrame* pKF = mpTracker->GetNewKeyFrame();
+    if(pKF)
+        EventLog::AddImage(EventLog::KEYFRAME,mnEventImage,frame.mTimeStamp,nState,pKF->mnId);
+}
 
-    unique_lock<mutex> lock2(mMutexState);
-    mTrackingState = mpTracker->mState;
-    mTrackedMapPoints = mpTracker->mCurrentFrame.mvpMapPoints;
-    mTrackedKeyPointsUn = mpTracker->mCurrentFrame.mvKeysUn;
+void System::ReportFrame()
+{
+    const Frame &frame = mpTracker->mCurrentFrame;
+    PerformanceReport::Record record = PerformanceReport::NewRecord(PerformanceReport::FRAME);
+    record.nId = frame.mnId;
+    record.timestamp = frame.mTimeStamp;
+    record.nState = mpTracker->mState;
+    record.nFeatures = frame.N;
+    record.nCount = mpTracker->GetNumMatchesInliers();
+    const int* vnMatches = mpTracker->GetStrategyMatches();
+    copy(vnMatches,vnMatches+PerformanceReport::NUM_STRATEGIES,record.vnMatches);
+    KeyFrame* pKF = mpTracker->GetNewKeyFrame();
+    if(pKF)
+        record.nOther = pKF->mnId;
+    PerformanceReport::Add(record);
+}
 
-    return Tcw;
+MemoryUsage System::GetMemoryUsage()
+{
+    MemoryUsage usage;
+
+    // Objects retired while they are counted are not freed before the slot is released
+    const int nReclaimerId = mpMap->mReclaimer.RegisterThread();
+    {
+        const IndexedStore<KeyFrame>::Snapshot pKFs = mpMap->GetKeyFramesSnapshot();
+        for(size_t i=0; i<pKFs->size(); i++)
+            (*pKFs)[i]->AddMemoryUsage(usage);
+
+        const IndexedStore<MapPoint>::Snapshot pMPs = mpMap->GetMapPointsSnapshot();
+        for(size_t i=0; i<pMPs->size(); i++)
+            usage.mapPoints += (*pMPs)[i]->GetMemoryUsage();
+        usage.nMapPoints = pMPs->size();
+    }
+    mpMap->mReclaimer.UnregisterThread(nReclaimerId);
+
+    usage.nRetired = mpMap->mReclaimer.GetNumPending();
+    usage.keyFrameDatabase = mpKeyFrameDatabase->GetMemoryUsage();
+    usage.keyFrameDepths = mpMap->mKeyFrameDepths.GetMemoryUsage();
+    usage.vocabulary = mnVocabularyMemory;
+    usage.imagePyramids = mpTracker->GetPyramidMemoryUsage();
+    usage.localBAProblem = mpLocalMapper->GetLocalBAMemoryUsage();
+    usage.globalBAProblem = Optimizer::GetPeakBundleAdjustmentMemory();
+    return usage;
+}
+
+void System::LogMemoryUsage()
+{
+    const MemoryUsage usage = GetMemoryUsage();
+    if(mpMetricsServer)
+        mpMetricsServer->PublishMemoryUsage(usage);
+    stringstream ss;
+    usage.Print(ss);
+    LOG(STATUS) << "Memory usage" << endl << ss.str();
 }
 
 void System::ActivateLocalizationMode()
@@ -287,6 +1686,11 @@ void System::DeactivateLocalizationMode()
     mbDeactivateLocalizationMode = true;
 }
 
+void System::SetPosePrior(const cv::Mat &Tcw, const float radius)
+{
+    mpTracker->SetPosePrior(Tcw, radius);
+}
+
 bool System::MapChanged()
 {
     static int n=0;
@@ -300,6 +1704,29 @@ bool System::MapChanged()
         return false;
 }
 
+int System::SubscribeMapEvents(const MapEvents::Callback &callback)
+{
+    const int nId = mpMap->mEvents.Subscribe(callback);
+
+    unique_lock<mutex> lock(mMutexMapEvents);
+    if(!mptMapEvents)
+        mptMapEvents = new thread(&MapEvents::Run, &mpMap->mEvents);
+    return nId;
+}
+
+void System::UnsubscribeMapEvents(const int nId)
+{
+    mpMap->mEvents.Unsubscribe(nId);
+}
+
+future<MapExporter::Result> System::ExportMapPoints(const string &filename, const bool bChanges)
+{
+    unique_lock<mutex> lock(mMutexMapExporter);
+    if(!mpMapExporter)
+        mpMapExporter = new MapExporter(mpMap);
+    return mpMapExporter->Export(filename,MapExporter::GetFormat(filename),bChanges,mbExportColors);
+}
+
 void System::Reset()
 {
     unique_lock<mutex> lock(mMutexReset);
@@ -308,6 +1735,11 @@ void System::Reset()
 
 void System::Shutdown()
 {
+    // Images which are still queued are tracked first
+    FinishTrackerThread();
+    FinishAsync();
+    mpTracker->FinishFeatureCache();
+
     mpLocalMapper->RequestFinish();
     mpLoopCloser->RequestFinish();
     if(mpViewer)
@@ -316,15 +1748,116 @@ void System::Shutdown()
         while(!mpViewer->isFinished())
             usleep(5000);
     }
+    if(mpStreamer)
+    {
+        mpStreamer->RequestFinish();
+        while(!mpStreamer->isFinished())
+            usleep(5000);
+    }
+    if(mpParameterServer)
+    {
+        mpParameterServer->RequestFinish();
+        while(!mpParameterServer->isFinished())
+            usleep(5000);
+    }
+    if(mpMetricsServer)
+    {
+        mpMetricsServer->RequestFinish();
+        while(!mpMetricsServer->isFinished())
+            usleep(5000);
+    }
 
     // Wait until all thread have effectively stopped
-    while(!mpLocalMapper->isFinished() || !mpLoopCloser->isFinished() || mpLoopCloser->isRunningGBA())
+    // (no new Global BA can be launched once Loop Closing has finished)
+    mpLocalMapper->WaitUntilFinished();
+    mpLoopCloser->WaitUntilFinished();
+    mpLoopCloser->WaitForGBA();
+
+    // The keyframes do not move anymore, the frames left are written with their final poses
+    if(mpTrajectoryWriter)
+        mpTrajectoryWriter->Finish();
+
+    // Exports asked for before are written
+    {
+        unique_lock<mutex> lock(mMutexMapExporter);
+        if(mpMapExporter)
+            mpMapExporter->Finish();
+    }
+
+    // The last checkpoint has the final map
+    if(mpCheckpointer)
+        mpCheckpointer->Finish();
+
+    // A vocabulary still loading is finished, nothing waits for it anymore
+    if(mptVocabulary)
+    {
+        mptVocabulary->join();
+        delete mptVocabulary;
+        mptVocabulary = static_cast<thread*>(NULL);
+    }
+
+    // A map still loading for MergeMap is not merged anymore
+    if(mptMapMerge)
+    {
+        mptMapMerge->join();
+        delete mptMapMerge;
+        mptMapMerge = static_cast<thread*>(NULL);
+    }
+
+    // The events of the threads above are delivered before the dispatcher stops
+    {
+        unique_lock<mutex> lock(mMutexMapEvents);
+        if(mptMapEvents)
+        {
+            mpMap->mEvents.RequestFinish();
+            mptMapEvents->join();
+            delete mptMapEvents;
+            mptMapEvents = static_cast<thread*>(NULL);
+        }
+    }
+
+#ifndef ORB_SLAM2_NO_STAGE_TIMERS
+    mpMap->mStageTimes.Print(cout);
+#endif
+    LockProfiler::Print(cout);
+    WorkCounters::Print(cout);
+    if(mpScheduler)
+        mpScheduler->PrintTaskStats(cout);
+    const LocalMapping::QueueStats mappingQueue = mpLocalMapper->GetQueueStats();
+    cout << "Mapping queue: " << mappingQueue.nInserted << " keyframes, " << mappingQueue.nPostponed << " postponed, "
+         << mappingQueue.nSkippedBA << " without and " << mappingQueue.nReducedBA << " with a reduced local BA, "
+         << mappingQueue.nResumed << " resumed, at most " << mappingQueue.nMaxQueued << " waiting" << endl;
+    const LoopClosing::QueueStats loopQueue = mpLoopCloser->GetQueueStats();
+    cout << "Loop queue: " << loopQueue.nInserted << " keyframes, " << loopQueue.nQueried << " queried, "
+         << loopQueue.nStale << " stale, " << loopQueue.nSpaced << " too close, at most "
+         << loopQueue.nMaxQueued << " waiting" << endl;
+    Trace::Stop();
+
+    if(PerformanceReport::IsOpen())
+    {
+        PerformanceReport::Close();
+        const size_t nReportDropped = PerformanceReport::GetNumDropped();
+        if(nReportDropped>0)
+            cout << nReportDropped << " records were dropped from the performance report, increase Logging.BufferSize"
+                 << endl;
+    }
+
+    if(EventLog::IsOpen())
     {
-        usleep(5000);
+        EventLog::Add(EventLog::DONE);
+        EventLog::Close();
+        const size_t nEventsDropped = EventLog::GetNumDropped();
+        if(nEventsDropped>0)
+            cout << nEventsDropped << " events were dropped from the event log, increase Logging.BufferSize" << endl;
     }
 
+    SystemLogger::Flush();
+    const size_t nLogDropped = SystemLogger::GetNumDropped();
+    if(nLogDropped>0)
+        cout << nLogDropped << " log messages were dropped, increase Logging.BufferSize" << endl;
+
     if(mpViewer)
-        pangolin::BindToContext("ORB-SLAM2: Map Viewer");
+        mpViewer->BindContext();
 }
 
 void System::SaveTrajectoryTUM(const string &filename)
@@ -351,37 +1884,24 @@ void System::SaveTrajectoryTUM(const string &filename)
     // We need to get first the keyframe pose and then concatenate the relative transformation.
     // Frames not localized (tracking failure) are not saved.
 
-    // For each frame we have a reference keyframe (lRit), the timestamp (lT) and a flag
-    // which is true when tracking failed (lbL).
-    list<ORB_SLAM2::KeyFrame*>::iterator lRit = mpTracker->mlpReferences.begin();
-    list<double>::iterator lT = mpTracker->mlFrameTimes.begin();
-    list<bool>::iterator lbL = mpTracker->mlbLost.begin();
-    for(list<cv::Mat>::iterator lit=mpTracker->mlRelativeFramePoses.begin(),
-        lend=mpTracker->mlRelativeFramePoses.end();lit!=lend;lit++, lRit++, lT++, lbL++)
+    // For each frame we have a reference keyframe, the timestamp and a flag which is true when
+    // tracking failed. They are copied in batches, the tracking may go on meanwhile.
+    vector<Trajectory::Entry> vEntries;
+    for(size_t nBegin=0; mpTracker->mTrajectory.Get(nBegin,TRAJECTORY_BATCH,vEntries)>0; nBegin+=vEntries.size(), vEntries.clear())
     {
-        if(*lbL)
-            continue;
-
-        KeyFrame* pKF = *lRit;
-
-        cv::Mat Trw = cv::Mat::eye(4,4,CV_32F);
-
-        // If the reference keyframe was culled, traverse the spanning tree to get a suitable keyframe.
-        while(pKF->isBad())
+        for(size_t i=0; i<vEntries.size(); i++)
         {
-            Trw = Trw*pKF->mTcp;
-            pKF = pKF->GetParent();
-        }
+            if(vEntries[i].bLost)
+                continue;
 
-        Trw = Trw*pKF->GetPose()*Two;
+            cv::Mat Tcw = Trajectory::GetCameraPose(vEntries[i])*Two;
+            cv::Mat Rwc = Tcw.rowRange(0,3).colRange(0,3).t();
+            cv::Mat twc = -Rwc*Tcw.rowRange(0,3).col(3);
 
-        cv::Mat Tcw = (*lit)*Trw;
-        cv::Mat Rwc = Tcw.rowRange(0,3).colRange(0,3).t();
-        cv::Mat twc = -Rwc*Tcw.rowRange(0,3).col(3);
+            vector<float> q = Converter::toQuaternion(Rwc);
 
-        vector<float> q = Converter::toQuaternion(Rwc);
-
-        f << setprecision(6) << *lT << " " <<  setprecision(9) << twc.at<float>(0) << " " << twc.at<float>(1) << " " << twc.at<float>(2) << " " << q[0] << " " << q[1] << " " << q[2] << " " << q[3] << endl;
+            f << setprecision(6) << vEntries[i].timestamp << " " <<  setprecision(9) << twc.at<float>(0) << " " << twc.at<float>(1) << " " << twc.at<float>(2) << " " << q[0] << " " << q[1] << " " << q[2] << " " << q[3] << "\n";
+        }
     }
     f.close();
     cout << endl << "trajectory saved!" << endl;
@@ -409,7 +1929,8 @@ void System::SaveKeyFrameTrajectoryTUM(const string &filename)
 
        // pKF->SetPose(pKF->GetPose()*Two);
 
-        if(pKF->isBad())
+        // The trajectory of a rig is the one of its first camera
+        if(pKF->isBad() || pKF->mnRigCamera>0)
             continue;
 
         cv::Mat R = pKF->GetRotation().t();
@@ -448,41 +1969,107 @@ void System::SaveTrajectoryKITTI(const string &filename)
     // We need to get first the keyframe pose and then concatenate the relative transformation.
     // Frames not localized (tracking failure) are not saved.
 
-    // For each frame we have a reference keyframe (lRit), the timestamp (lT) and a flag
-    // which is true when tracking failed (lbL).
-    list<ORB_SLAM2::KeyFrame*>::iterator lRit = mpTracker->mlpReferences.begin();
-    list<double>::iterator lT = mpTracker->mlFrameTimes.begin();
-    for(list<cv::Mat>::iterator lit=mpTracker->mlRelativeFramePoses.begin(), lend=mpTracker->mlRelativeFramePoses.end();lit!=lend;lit++, lRit++, lT++)
+    // For each frame we have a reference keyframe and the timestamp, copied in batches
+    vector<Trajectory::Entry> vEntries;
+    for(size_t nBegin=0; mpTracker->mTrajectory.Get(nBegin,TRAJECTORY_BATCH,vEntries)>0; nBegin+=vEntries.size(), vEntries.clear())
     {
-        ORB_SLAM2::KeyFrame* pKF = *lRit;
+        for(size_t i=0; i<vEntries.size(); i++)
+        {
+            cv::Mat Tcw = Trajectory::GetCameraPose(vEntries[i])*Two;
+            cv::Mat Rwc = Tcw.rowRange(0,3).colRange(0,3).t();
+            cv::Mat twc = -Rwc*Tcw.rowRange(0,3).col(3);
+
+            f << setprecision(9) << Rwc.at<float>(0,0) << " " << Rwc.at<float>(0,1)  << " " << Rwc.at<float>(0,2) << " "  << twc.at<float>(0) << " " <<
+                 Rwc.at<float>(1,0) << " " << Rwc.at<float>(1,1)  << " " << Rwc.at<float>(1,2) << " "  << twc.at<float>(1) << " " <<
+                 Rwc.at<float>(2,0) << " " << Rwc.at<float>(2,1)  << " " << Rwc.at<float>(2,2) << " "  << twc.at<float>(2) << "\n";
+        }
+    }
+    f.close();
+    cout << endl << "trajectory saved!" << endl;
+}
+
+int System::GetTrackingState()
+{
+    double state;
+    mSnapshot.Read(&state,2,1);
+    return static_cast<int>(state);
+}
 
-        cv::Mat Trw = cv::Mat::eye(4,4,CV_32F);
+void System::PublishTrackingSnapshot()
+{
+    const Frame &frame = mpTracker->mCurrentFrame;
+    WriteTrackingSnapshot(frame.mTimeStamp,frame.mTcw,false);
+}
 
-        while(pKF->isBad())
+void System::WriteTrackingSnapshot(const double timestamp, const cv::Mat &Tcw, const bool bSkipped)
+{
+    const cv::Mat &velocity = mpTracker->GetVelocity();
+    const bool bOK = mTrackingState==Tracking::OK;
+    const bool bPoseValid = bOK && !Tcw.empty();
+    const bool bVelocityValid = bPoseValid && !velocity.empty() && timestamp>mLastSnapshotTimestamp;
+
+    double data[SNAPSHOT_SIZE];
+    data[0] = mpTracker->mCurrentFrame.mnId;
+    data[1] = timestamp;
+    data[2] = mTrackingState;
+    data[3] = bOK && !bSkipped ? mpTracker->GetNumMatchesInliers() : 0;
+    data[4] = bPoseValid;
+    data[5] = bVelocityValid;
+    data[6] = bVelocityValid ? timestamp-mLastSnapshotTimestamp : 0;
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<4; j++)
         {
-          //  cout << "bad parent" << endl;
-            Trw = Trw*pKF->mTcp;
-            pKF = pKF->GetParent();
+            data[7+4*i+j] = bPoseValid ? Tcw.at<float>(i,j) : (i==j ? 1 : 0);
+            data[19+4*i+j] = bVelocityValid ? velocity.at<float>(i,j) : (i==j ? 1 : 0);
         }
+    }
+    data[31] = bSkipped;
+    mSnapshot.Write(data);
 
-        Trw = Trw*pKF->GetPose()*Two;
-
-        cv::Mat Tcw = (*lit)*Trw;
-        cv::Mat Rwc = Tcw.rowRange(0,3).colRange(0,3).t();
-        cv::Mat twc = -Rwc*Tcw.rowRange(0,3).col(3);
+    if(bPoseValid)
+        mLastSnapshotTimestamp = timestamp;
+}
 
-        f << setprecision(9) << Rwc.at<float>(0,0) << " " << Rwc.at<float>(0,1)  << " " << Rwc.at<float>(0,2) << " "  << twc.at<float>(0) << " " <<
-             Rwc.at<float>(1,0) << " " << Rwc.at<float>(1,1)  << " " << Rwc.at<float>(1,2) << " "  << twc.at<float>(1) << " " <<
-             Rwc.at<float>(2,0) << " " << Rwc.at<float>(2,1)  << " " << Rwc.at<float>(2,2) << " "  << twc.at<float>(2) << endl;
+System::TrackingSnapshot System::GetTrackingSnapshot() const
+{
+    double data[SNAPSHOT_SIZE];
+    mSnapshot.Read(data);
+
+    TrackingSnapshot snapshot;
+    snapshot.nFrameId = static_cast<unsigned long>(data[0]);
+    snapshot.timestamp = data[1];
+    snapshot.state = static_cast<int>(data[2]);
+    snapshot.nInliers = static_cast<int>(data[3]);
+    snapshot.bPoseValid = data[4]!=0;
+    snapshot.bVelocityValid = data[5]!=0;
+    snapshot.dt = data[6];
+    snapshot.bSkipped = data[31]!=0;
+    snapshot.Tcw.setIdentity();
+    snapshot.velocity.setIdentity();
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<4; j++)
+        {
+            snapshot.Tcw(i,j) = data[7+4*i+j];
+            snapshot.velocity(i,j) = data[19+4*i+j];
+        }
     }
-    f.close();
-    cout << endl << "trajectory saved!" << endl;
+    return snapshot;
 }
 
-int System::GetTrackingState()
+Eigen::Matrix4d System::TrackingSnapshot::Extrapolate(const double t) const
 {
-    unique_lock<mutex> lock(mMutexState);
-    return mTrackingState;
+    if(!bVelocityValid || dt<=0)
+        return Tcw;
+
+    // The motion of dt scaled to t: the rotation by its angle, the translation linearly
+    const double s = (t-timestamp)/dt;
+    const Eigen::AngleAxisd rotation(Eigen::Matrix3d(velocity.topLeftCorner<3,3>()));
+    Eigen::Matrix4d delta = Eigen::Matrix4d::Identity();
+    delta.topLeftCorner<3,3>() = Eigen::AngleAxisd(rotation.angle()*s,rotation.axis()).toRotationMatrix();
+    delta.topRightCorner<3,1>() = s*velocity.topRightCorner<3,1>();
+    return delta*Tcw;
 }
 
 vector<MapPoint*> System::GetTrackedMapPoints()
@@ -491,20 +2078,420 @@ vector<MapPoint*> System::GetTrackedMapPoints()
     return mTrackedMapPoints;
 }
 
+StageTimes::Summary System::GetStageTimes(const Stage stage)
+{
+    return mpMap->mStageTimes.Get(stage);
+}
+
+vector<StageTimes::Summary> System::GetAllStageTimes()
+{
+    return mpMap->mStageTimes.GetAll();
+}
+
+void System::ResetStageTimes()
+{
+    mpMap->mStageTimes.Reset();
+}
+
+vector<TaskScheduler::TaskStats> System::GetTaskStats()
+{
+    if(!mpScheduler)
+        return vector<TaskScheduler::TaskStats>();
+    return mpScheduler->GetTaskStats();
+}
+
+LoopClosing::QueueStats System::GetLoopQueueStats()
+{
+    return mpLoopCloser->GetQueueStats();
+}
+
+void System::WaitUntilIdle()
+{
+    // Local Mapping hands its keyframe to Loop Closing before it is idle, and a Global BA
+    // does not queue any keyframe, so one pass in this order is enough
+    while(!mpLocalMapper->isIdle() || !mpLoopCloser->isIdle())
+        usleep(500);
+}
+
+namespace
+{
+double ThreadCpuSeconds(thread* pThread)
+{
+    clockid_t clockId;
+    timespec ts;
+    if(pthread_getcpuclockid(pThread->native_handle(),&clockId)!=0 || clock_gettime(clockId,&ts)!=0)
+        return 0.0;
+    return ts.tv_sec+1e-9*ts.tv_nsec;
+}
+}
+
+vector<System::ThreadCpuTime> System::GetThreadCpuTimes()
+{
+    vector<ThreadCpuTime> vTimes;
+    vTimes.push_back(ThreadCpuTime("LocalMapping",ThreadCpuSeconds(mptLocalMapping)));
+    vTimes.push_back(ThreadCpuTime("LoopClosing",ThreadCpuSeconds(mptLoopClosing)));
+    if(mpViewer)
+        vTimes.push_back(ThreadCpuTime("Viewer",ThreadCpuSeconds(mptViewer)));
+    if(mpStreamer)
+        vTimes.push_back(ThreadCpuTime("Streamer",ThreadCpuSeconds(mptStreamer)));
+    if(mpParameterServer)
+        vTimes.push_back(ThreadCpuTime("ParameterServer",ThreadCpuSeconds(mptParameterServer)));
+    if(mpMetricsServer)
+        vTimes.push_back(ThreadCpuTime("MetricsServer",ThreadCpuSeconds(mptMetricsServer)));
+    {
+        unique_lock<mutex> lock(mMutexMapEvents);
+        if(mptMapEvents)
+            vTimes.push_back(ThreadCpuTime("MapEvents",ThreadCpuSeconds(mptMapEvents)));
+    }
+
+    unique_lock<mutex> lock(mMutexAsync);
+    if(mptAsyncTracker)
+    {
+        for(size_t i=0; i<mvptAsyncFrameBuilders.size(); i++)
+        {
+            const string name = mvptAsyncFrameBuilders.size()>1 ? "AsyncFrameBuilder"+to_string(i+1) : "AsyncFrameBuilder";
+            vTimes.push_back(ThreadCpuTime(name,ThreadCpuSeconds(mvptAsyncFrameBuilders[i])));
+        }
+        vTimes.push_back(ThreadCpuTime("AsyncTracker",ThreadCpuSeconds(mptAsyncTracker)));
+    }
+    return vTimes;
+}
+
 vector<cv::KeyPoint> System::GetTrackedKeyPointsUn()
 {
     unique_lock<mutex> lock(mMutexState);
     return mTrackedKeyPointsUn;
 }
 
+void System::RefineMap(const int nIterations)
+{
+    cout << endl << "Refining the map: " << mpMap->KeyFramesInMap() << " keyframes, " << mpMap->MapPointsInMap()
+         << " map points ..." << endl;
+
+    Optimizer::BAReport report;
+    Optimizer::GlobalBundleAdjustemnt(mpMap,nIterations,NULL,0,true,NULL,&report);
+    cout << "Global BA: " << report.nIterations << " iterations, " << report.nOutliers << " outliers" << endl;
+
+    ThreadPool threadPool(mnMapThreads-1);
+    const int nBlockSize = 64; //param
+    int nFused = 0;
+    int nCulled = 0;
+    {
+        MapUpdateLock lock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate));
+
+        // The searches of a block of keyframes only read the map and run in parallel, their
+        // fusions are applied in order before the next block searches
+        const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+        const int nKFs = vpKFs.size();
+        ORBmatcher matcher; //param
+        for(int i0=0; i0<nKFs; i0+=nBlockSize)
+        {
+            const int nBlock = min(nBlockSize,nKFs-i0);
+            vector<vector<ORBmatcher::FuseMatch> > vvMatches(nBlock);
+            threadPool.ParallelFor(nBlock, [&](int i)
+            {
+                KeyFrame* pKF = vpKFs[i0+i];
+                if(pKF->isBad())
+                    return;
+
+                vector<MapPoint*> vpCandidates;
+                if(mpMap->mPointIndex.IsEnabled())
+                {
+                    MapPointIndex::Frustum frustum;
+                    frustum.Rcw = Converter::toMatrix3f(pKF->GetRotation());
+                    frustum.tcw = Converter::toVector3f(pKF->GetTranslation());
+                    frustum.fx = pKF->fx;
+                    frustum.fy = pKF->fy;
+                    frustum.cx = pKF->cx;
+                    frustum.cy = pKF->cy;
+                    frustum.minX = pKF->mnMinX;
+                    frustum.maxX = pKF->mnMaxX;
+                    frustum.minY = pKF->mnMinY;
+                    frustum.maxY = pKF->mnMaxY;
+                    frustum.maxDepth = 2*pKF->ComputeSceneMedianDepth(2); //param
+                    mpMap->mPointIndex.GetPointsInFrustum(frustum,vpCandidates);
+                }
+                else
+                {
+                    const vector<KeyFrame*> vpNeighKFs = pKF->GetBestCovisibilityKeyFrames(20); //param
+                    for(size_t iKF=0; iKF<vpNeighKFs.size(); iKF++)
+                    {
+                        const vector<MapPoint*> vpMPs = vpNeighKFs[iKF]->GetMapPointMatches();
+                        for(size_t iMP=0; iMP<vpMPs.size(); iMP++)
+                            if(vpMPs[iMP])
+                                vpCandidates.push_back(vpMPs[iMP]);
+                    }
+                    sort(vpCandidates.begin(),vpCandidates.end());
+                    vpCandidates.erase(unique(vpCandidates.begin(),vpCandidates.end()),vpCandidates.end());
+                }
+
+                // Only the points of the map of the keyframe, the atlas may hold overlapping ones
+                vector<MapPoint*> vpPoints;
+                vpPoints.reserve(vpCandidates.size());
+                for(size_t iMP=0; iMP<vpCandidates.size(); iMP++)
+                {
+                    MapPoint* pMP = vpCandidates[iMP];
+                    if(!pMP->isBad() && pMP->GetReferenceKeyFrame()->mnMapId==pKF->mnMapId)
+                        vpPoints.push_back(pMP);
+                }
+                matcher.SearchFuseMatches(pKF,vpPoints,vvMatches[i]);
+            });
+
+            MapPointReplacer replacer;
+            for(int i=0; i<nBlock; i++)
+                if(!vpKFs[i0+i]->isBad())
+                    nFused += matcher.ApplyFuseMatches(vpKFs[i0+i],vvMatches[i],&replacer);
+            // the next batch reads the entries of these keyframes
+            replacer.Apply();
+        }
+
+        // Points merged from several keyframes, each one only locks itself
+        const vector<MapPoint*> vpMPs = mpMap->GetAllMapPoints();
+        const int nMPs = vpMPs.size();
+        threadPool.ParallelFor((nMPs+nBlockSize-1)/nBlockSize, [&](int iBlock)
+        {
+            for(int i=iBlock*nBlockSize, iend=min((iBlock+1)*nBlockSize,nMPs); i<iend; i++)
+            {
+                if(!vpMPs[i]->isBad())
+                {
+                    vpMPs[i]->ComputeDistinctiveDescriptors();
+                    vpMPs[i]->UpdateNormalAndDepth();
+                }
+            }
+        });
+        for(int i=0; i<nKFs; i++)
+            if(!vpKFs[i]->isBad())
+                vpKFs[i]->UpdateConnections();
+
+        nCulled = mpLocalMapper->CullRedundantKeyFrames(mpMap->GetAllKeyFrames());
+    }
+    cout << nFused << " duplicated map points fused, " << nCulled << " redundant keyframes culled" << endl;
+
+    Optimizer::BAReport finalReport;
+    Optimizer::GlobalBundleAdjustemnt(mpMap,nIterations,NULL,0,true,NULL,&finalReport);
+    cout << "Global BA: " << finalReport.nIterations << " iterations, " << finalReport.nOutliers << " outliers" << endl;
+
+    // Without the entries of the keyframes culled and in the order of the remaining ones
+    mpKeyFrameDatabase->clear();
+    const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+    for(size_t i=0; i<vpKFs.size(); i++)
+        if(!vpKFs[i]->isBad())
+            mpKeyFrameDatabase->add(vpKFs[i]);
+    mpMap->InformNewBigChange();
+
+    cout << "Map refined: " << mpMap->KeyFramesInMap() << " keyframes, " << mpMap->MapPointsInMap() << " map points"
+         << endl;
+}
+
+bool System::GetKeyFrameDepth(const unsigned long nKeyFrameId, cv::Mat &imDepth)
+{
+    return mpMap->mKeyFrameDepths.Get(nKeyFrameId,imDepth);
+}
+
+bool System::SaveMap(const string &filename)
+{
+    cout << endl << "Saving map to " << filename << " ..." << endl;
+
+    ThreadPool threadPool(mnMapThreads-1);
+    if(!MapSerializer::Save(filename,mpMap,mpVocabulary,&threadPool))
+        return false;
+
+    cout << endl << "map saved!" << endl;
+    return true;
+}
+
+bool System::LoadMap(const string &filename)
+{
+    return LoadMapFile(filename,false);
+}
+
+bool System::LoadCheckpoint(const string &filename)
+{
+    // The merged map is only needed until it is loaded
+    const string strMapFile = filename+".restore.map";
+    cout << endl << "Restoring the checkpoint " << filename << " ..." << endl;
+    if(!MapCheckpointer::Restore(filename,mpVocabulary,strMapFile))
+        return false;
+
+    const bool bLoaded = LoadMapFile(strMapFile,false);
+    remove(strMapFile.c_str());
+    return bLoaded;
+}
+
+bool System::SaveMapForLocalization(const string &filename)
+{
+    cout << endl << "Saving map for localization to " << filename << " ..." << endl;
+
+    ThreadPool threadPool(mnMapThreads-1);
+    if(!MapSerializer::SaveMapped(filename,mpMap,mpVocabulary,&threadPool))
+        return false;
+
+    cout << endl << "map saved!" << endl;
+    return true;
+}
+
+bool System::LoadMapForLocalization(const string &filename)
+{
+    if(!LoadMapFile(filename,true))
+        return false;
+
+    ActivateLocalizationMode();
+    return true;
+}
+
+bool System::LoadMapFile(const string &filename, const bool bMapped)
+{
+    cout << endl << "Loading map from " << filename << " ..." << endl;
+
+    unique_lock<mutex> lock(mMutexReset);
+
+    // Tiles of a mapped map, none if Map.TileSize is not set
+    MapTiles* pTiles = static_cast<MapTiles*>(NULL);
+    if(bMapped && mfMapTileSize>0)
+        pTiles = new MapTiles(mfMapTileSize,mnMapTileRadius);
+
+    // A checkpoint must not read the map while it is loaded. The keyframes of a mapped map are
+    // read only, they are not checkpointed.
+    if(mpCheckpointer && bMapped)
+        mpCheckpointer->Stop();
+    else if(mpCheckpointer)
+        mpCheckpointer->Pause();
+
+    ThreadPool threadPool(mnMapThreads-1);
+    KeyFrame* pLastKF = bMapped ?
+                MapSerializer::LoadMapped(filename,mpMap,mpKeyFrameDatabase,mpVocabulary,&threadPool,pTiles) :
+                MapSerializer::Load(filename,mpMap,mpKeyFrameDatabase,mpVocabulary,&threadPool);
+    if(mpCheckpointer && !bMapped)
+        mpCheckpointer->Release();
+    if(!pLastKF)
+    {
+        delete pTiles;
+        return false;
+    }
+
+    delete mpMapTiles;
+    mpMapTiles = pTiles;
+
+    mpTracker->InformMapLoaded(pLastKF);
+    {
+        unique_lock<mutex> lockState(mMutexState);
+        mTrackingState = mpTracker->mState;
+        PublishTrackingSnapshot();
+    }
+    mpMap->InformNewBigChange();
+
+    cout << "Map loaded: " << mpMap->KeyFramesInMap() << " keyframes, " << mpMap->MapPointsInMap() << " map points" << endl;
+    return true;
+}
+
+bool System::MergeMap(const string &filename)
+{
+    if(mpMap->mFrameContext.mbInitialComputations)
+    {
+        cerr << "The calibration is not known yet, merge maps after the first image" << endl;
+        return false;
+    }
+
+    unique_lock<mutex> lock(mMutexMapMerge);
+    if(mbMergeLoading || mbMergeLoaded)
+    {
+        cerr << "A map is still being merged" << endl;
+        return false;
+    }
+
+    if(mptMapMerge)
+    {
+        mptMapMerge->join();
+        delete mptMapMerge;
+    }
+    mbMergeLoading = true;
+    mptMapMerge = new thread(&System::LoadMergedMap,this,filename);
+    return true;
+}
+
+void System::LoadMergedMap(const string filename)
+{
+    Trace::SetThreadName("MapMerge");
+    cout << endl << "Loading map " << filename << " to merge it ..." << endl;
+
+    // Frames of the file are built with the calibration of this map, which the file must have
+    Map* pMap = new Map();
+    pMap->mnSettingsHash = mpMap->mnSettingsHash;
+    const FrameContext &context = mpMap->mFrameContext;
+    FrameContext &mergeContext = pMap->mFrameContext;
+    mergeContext.fx = context.fx;
+    mergeContext.fy = context.fy;
+    mergeContext.cx = context.cx;
+    mergeContext.cy = context.cy;
+    mergeContext.invfx = context.invfx;
+    mergeContext.invfy = context.invfy;
+    mergeContext.mnMinX = context.mnMinX;
+    mergeContext.mnMaxX = context.mnMaxX;
+    mergeContext.mnMinY = context.mnMinY;
+    mergeContext.mnMaxY = context.mnMaxY;
+    mergeContext.mfGridElementWidthInv = context.mfGridElementWidthInv;
+    mergeContext.mfGridElementHeightInv = context.mfGridElementHeightInv;
+    mergeContext.mbInitialComputations = false;
+
+    KeyFrameDatabase* pKFDB = new KeyFrameDatabase(*mpVocabulary);
+    ThreadPool threadPool(mnMapThreads-1);
+    const bool bLoaded = MapSerializer::Load(filename,pMap,pKFDB,mpVocabulary,&threadPool)!=NULL;
+    if(!bLoaded)
+    {
+        delete pMap;
+        delete pKFDB;
+        pMap = static_cast<Map*>(NULL);
+        pKFDB = static_cast<KeyFrameDatabase*>(NULL);
+    }
+
+    unique_lock<mutex> lock(mMutexMapMerge);
+    mpMergeMap = pMap;
+    mpMergeKeyFrameDB = pKFDB;
+    mbMergeLoading = false;
+    mbMergeLoaded = bLoaded;
+}
+
+bool System::SaveKeyFrameDatabase(const string &filename)
+{
+    cout << endl << "Saving keyframe database to " << filename << " ..." << endl;
+
+    if(!mpKeyFrameDatabase->Save(filename))
+        return false;
+
+    cout << endl << "keyframe database saved!" << endl;
+    return true;
+}
+
+bool System::LoadKeyFrameDatabase(const string &filename)
+{
+    if(!mpKeyFrameDatabase->LoadPrior(filename))
+        return false;
+
+    cout << "Keyframe database " << filename << " mapped" << endl;
+    return true;
+}
+
+vector<unsigned long> System::GetPriorRelocalizationCandidates()
+{
+    DBoW2::BowVector bowVec;
+    {
+        unique_lock<mutex> lock(mMutexState);
+        bowVec = mLostBowVec;
+    }
+
+    return mpKeyFrameDatabase->DetectPriorRelocalizationCandidates(bowVec);
+}
+
 void System::setFrameCount(const int& frameCount)
 {
-    mpFrameDrawer->setFrameCount(frameCount);
+    if(mpFrameDrawer)
+        mpFrameDrawer->setFrameCount(frameCount);
 }
 
 void System::ignoreFPS(const bool& ignore)
 {
-    mpViewer->ignoreFPS(ignore);
+    if(mpViewer)
+        mpViewer->ignoreFPS(ignore);
 }
 
 } //namespace ORB_SLAM
@@ -0,0 +1,366 @@
+#include "TaskScheduler.h"
+#include "ThreadConfig.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Worker index of the calling thread in tpScheduler, -1 for the other threads
+thread_local TaskScheduler* tpScheduler = NULL;
+thread_local int tnWorker = -1;
+
+uint64_t Nanoseconds(const chrono::steady_clock::duration &d)
+{
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(d).count());
+}
+
+void UpdateMax(atomic<uint64_t> &value, const uint64_t n)
+{
+    uint64_t current = value.load(memory_order_relaxed);
+    while(n>current && !value.compare_exchange_weak(current,n,memory_order_relaxed))
+        ;
+}
+}
+
+TaskScheduler::TaskGroup::TaskGroup(TaskScheduler* pScheduler, const Priority priority, const char* name):
+    mpScheduler(pScheduler), mPriority(priority), mName(name), mnPending(0), mnTasks(0), mnRun(0),
+    mnMaxRun(0), mnWait(0)
+{
+}
+
+TaskScheduler::TaskGroup::~TaskGroup()
+{
+    Wait();
+}
+
+void TaskScheduler::TaskGroup::Run(const function<void(void)> &task)
+{
+    Task t;
+    t.fn = task;
+    t.pGroup = this;
+    t.name = mName;
+    t.tQueued = chrono::steady_clock::now();
+
+    // Without workers nobody else would run it
+    if(mpScheduler->GetNumThreads()==0)
+    {
+        mnPending++;
+        mpScheduler->Execute(t);
+        return;
+    }
+
+    mnPending++;
+    mpScheduler->Push(std::move(t),mPriority);
+}
+
+void TaskScheduler::TaskGroup::Wait()
+{
+    while(mnPending.load()>0)
+    {
+        Task task;
+        if(mpScheduler->Pop(mPriority,task))
+        {
+            mpScheduler->Execute(task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(mpScheduler->mMutexSleep);
+        while(mnPending.load()>0 && !mpScheduler->HasQueued(mPriority))
+            mpScheduler->mCondSleep.wait(lock);
+    }
+
+    const uint64_t nTasks = mnTasks.exchange(0);
+    if(nTasks>0)
+        mpScheduler->AddStats(mName,nTasks,mnRun.exchange(0),mnMaxRun.exchange(0),mnWait.exchange(0));
+}
+
+TaskScheduler::TaskScheduler(const int nThreads): mbFinish(false)
+{
+    for(int p=0; p<NUM_PRIORITIES; p++)
+        mnQueued[p] = 0;
+
+    for(int i=0; i<nThreads; i++)
+        mvpWorkers.push_back(new Worker());
+    for(int i=0; i<nThreads; i++)
+        mvThreads.push_back(thread(&TaskScheduler::Run,this,i));
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        unique_lock<mutex> lock(mMutexSleep);
+        mbFinish = true;
+    }
+    mCondSleep.notify_all();
+
+    for(size_t i=0; i<mvThreads.size(); i++)
+        mvThreads[i].join();
+    for(size_t i=0; i<mvpWorkers.size(); i++)
+        delete mvpWorkers[i];
+}
+
+void TaskScheduler::ParallelFor(const int n, const function<void(int)> &task, const Priority priority,
+                                const char* name, const int nMaxHelpers)
+{
+    if(n<=0)
+        return;
+
+    int nHelpers = min(GetNumThreads(),n-1);
+    if(nMaxHelpers>=0)
+        nHelpers = min(nHelpers,nMaxHelpers);
+    if(nHelpers<=0)
+    {
+        for(int i=0; i<n; i++)
+            task(i);
+        return;
+    }
+
+    // A helper which starts after all indices have been taken returns right away
+    shared_ptr<atomic<int> > pNext = make_shared<atomic<int> >(0);
+    function<void(void)> helper = [pNext, n, &task]
+    {
+        int i;
+        while((i = (*pNext)++) < n)
+            task(i);
+    };
+
+    TaskGroup group(this,priority,name);
+    for(int i=0; i<nHelpers; i++)
+        group.Run(helper);
+    helper();
+    group.Wait();
+}
+
+void TaskScheduler::Submit(const function<void(void)> &task, const Priority priority, const char* name)
+{
+    Task t;
+    t.fn = task;
+    t.pGroup = NULL;
+    t.name = name;
+    t.tQueued = chrono::steady_clock::now();
+
+    if(GetNumThreads()==0)
+    {
+        Execute(t);
+        return;
+    }
+    Push(std::move(t),priority);
+}
+
+int TaskScheduler::GetNumThreads() const
+{
+    return mvThreads.size();
+}
+
+void TaskScheduler::Push(Task &&task, const Priority priority)
+{
+    if(tpScheduler==this && tnWorker>=0)
+    {
+        Worker* pWorker = mvpWorkers[tnWorker];
+        unique_lock<mutex> lock(pWorker->mutex);
+        pWorker->tasks[priority].push_back(std::move(task));
+    }
+    else
+    {
+        unique_lock<mutex> lock(mMutexShared);
+        mqShared[priority].push_back(std::move(task));
+    }
+    mnQueued[priority]++;
+
+    // The sleepers wait for different priorities, all of them check
+    {
+        unique_lock<mutex> lock(mMutexSleep);
+    }
+    mCondSleep.notify_all();
+}
+
+bool TaskScheduler::HasQueued(const Priority maxPriority) const
+{
+    for(int p=0; p<=maxPriority; p++)
+        if(mnQueued[p].load()>0)
+            return true;
+    return false;
+}
+
+bool TaskScheduler::Pop(const Priority maxPriority, Task &task)
+{
+    const int nSelf = tpScheduler==this ? tnWorker : -1;
+
+    for(int p=0; p<=maxPriority; p++)
+    {
+        if(mnQueued[p].load()==0)
+            continue;
+
+        // Newest own task first, its data is still in the cache
+        if(nSelf>=0)
+        {
+            Worker* pWorker = mvpWorkers[nSelf];
+            unique_lock<mutex> lock(pWorker->mutex);
+            if(!pWorker->tasks[p].empty())
+            {
+                task = std::move(pWorker->tasks[p].back());
+                pWorker->tasks[p].pop_back();
+                mnQueued[p]--;
+                return true;
+            }
+        }
+
+        {
+            unique_lock<mutex> lock(mMutexShared);
+            if(!mqShared[p].empty())
+            {
+                task = std::move(mqShared[p].front());
+                mqShared[p].pop_front();
+                mnQueued[p]--;
+                return true;
+            }
+        }
+
+        if(Steal(nSelf,static_cast<Priority>(p),task))
+            return true;
+    }
+    return false;
+}
+
+bool TaskScheduler::Steal(const int nThief, const Priority priority, Task &task)
+{
+    const int nWorkers = mvpWorkers.size();
+    for(int i=1; i<=nWorkers; i++)
+    {
+        const int nVictim = (max(nThief,0)+i)%nWorkers;
+        if(nVictim==nThief)
+            continue;
+
+        // Oldest task of the victim, the largest piece of its work
+        Worker* pWorker = mvpWorkers[nVictim];
+        unique_lock<mutex> lock(pWorker->mutex);
+        if(!pWorker->tasks[priority].empty())
+        {
+            task = std::move(pWorker->tasks[priority].front());
+            pWorker->tasks[priority].pop_front();
+            mnQueued[priority]--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::Execute(Task &task)
+{
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+    task.fn();
+    const chrono::steady_clock::time_point tEnd = chrono::steady_clock::now();
+
+    if(Trace::IsActive())
+        Trace::Complete(task.name,tStart,tEnd);
+
+    const uint64_t nRun = Nanoseconds(tEnd-tStart);
+    const uint64_t nWait = Nanoseconds(tStart-task.tQueued);
+
+    TaskGroup* pGroup = task.pGroup;
+    if(!pGroup)
+    {
+        AddStats(task.name,1,nRun,nRun,nWait);
+        return;
+    }
+
+    pGroup->mnTasks++;
+    pGroup->mnRun += nRun;
+    pGroup->mnWait += nWait;
+    UpdateMax(pGroup->mnMaxRun,nRun);
+
+    // The waiter may destroy the group as soon as it sees zero
+    if(--pGroup->mnPending==0)
+    {
+        {
+            unique_lock<mutex> lock(mMutexSleep);
+        }
+        mCondSleep.notify_all();
+    }
+}
+
+void TaskScheduler::Run(const int nWorker)
+{
+    tpScheduler = this;
+    tnWorker = nWorker;
+    Trace::SetThreadName("SchedulerWorker");
+    ThreadConfig::Apply(ThreadConfig::SCHEDULER_WORKERS);
+
+    while(1)
+    {
+        Task task;
+        if(Pop(NORMAL,task))
+        {
+            Execute(task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(mMutexSleep);
+        while(!mbFinish && !HasQueued(NORMAL))
+            mCondSleep.wait(lock);
+        // The tasks still queued are run before the workers are joined
+        if(mbFinish && !HasQueued(NORMAL))
+            break;
+    }
+
+    tpScheduler = NULL;
+    tnWorker = -1;
+}
+
+void TaskScheduler::AddStats(const char* name, const uint64_t nTasks, const uint64_t nRun, const uint64_t nMaxRun,
+                             const uint64_t nWait)
+{
+    unique_lock<mutex> lock(mMutexStats);
+    TaskStats &stats = mStats[name];
+    stats.name = name;
+    stats.nTasks += nTasks;
+    stats.tRun += nRun*1e-9;
+    stats.tMaxRun = max(stats.tMaxRun,nMaxRun*1e-9);
+    stats.tWait += nWait*1e-9;
+}
+
+vector<TaskScheduler::TaskStats> TaskScheduler::GetTaskStats()
+{
+    unique_lock<mutex> lock(mMutexStats);
+    vector<TaskStats> vStats;
+    vStats.reserve(mStats.size());
+    for(map<string,TaskStats>::const_iterator it=mStats.begin(); it!=mStats.end(); it++)
+        vStats.push_back(it->second);
+    return vStats;
+}
+
+void TaskScheduler::ResetTaskStats()
+{
+    unique_lock<mutex> lock(mMutexStats);
+    mStats.clear();
+}
+
+void TaskScheduler::PrintTaskStats(ostream &out)
+{
+    const vector<TaskStats> vStats = GetTaskStats();
+    if(vStats.empty())
+        return;
+
+    char line[256];
+    snprintf(line,sizeof(line),"%-24s %10s %12s %12s %12s %12s\n","tasks","count","total ms","mean us",
+             "max ms","wait us");
+    out << line;
+    for(size_t i=0; i<vStats.size(); i++)
+    {
+        const TaskStats &s = vStats[i];
+        snprintf(line,sizeof(line),"%-24s %10llu %12.1f %12.1f %12.2f %12.1f\n",s.name,
+                 static_cast<unsigned long long>(s.nTasks),s.tRun*1e3,s.tRun*1e6/s.nTasks,s.tMaxRun*1e3,
+                 s.tWait*1e6/s.nTasks);
+        out << line;
+    }
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,179 @@
+#include "ThreadConfig.h"
+#include "Settings.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const char* ROLE_NAMES[ThreadConfig::NUM_ROLES] =
+{
+    "Tracking",
+    "LocalMapping",
+    "LoopClosing",
+    "GlobalBA",
+    "Viewer",
+    "Checkpoint",
+    "ExtractionWorkers",
+    "TrackingWorkers",
+    "MappingWorkers",
+    "LoopWorkers",
+    "SchedulerWorkers"
+};
+
+const int MAX_CORES = 64;
+
+// One bit per role, the thread applied it
+thread_local unsigned int tnApplied = 0;
+
+bool ParseInt(const string &text, int &value)
+{
+    if(text.empty())
+        return false;
+    char* end;
+    errno = 0;
+    const long n = strtol(text.c_str(),&end,10);
+    if(*end!='\0' || errno!=0)
+        return false;
+    value = static_cast<int>(n);
+    return true;
+}
+}
+
+ThreadConfig::Settings ThreadConfig::msSettings[ThreadConfig::NUM_ROLES];
+
+bool ThreadConfig::Load(const ORB_SLAM2::Settings &fsSettings)
+{
+    bool bOk = true;
+    for(int i=0; i<NUM_ROLES; i++)
+    {
+        const string key = string("Threads.")+ROLE_NAMES[i];
+        const ORB_SLAM2::Settings::Node &node = fsSettings[key];
+        if(node.empty() || !node.isString())
+            continue;
+
+        Settings settings;
+        if(!Parse(static_cast<string>(node),settings))
+        {
+            cerr << "Invalid " << key << ": \"" << static_cast<string>(node) << "\", expected cores=a,b nice=n rt=p" << endl;
+            bOk = false;
+            continue;
+        }
+        msSettings[i] = settings;
+
+        if(settings.nCoreMask || settings.bNice || settings.nRealTime)
+            cout << "Thread " << ROLE_NAMES[i] << ": " << static_cast<string>(node) << endl;
+    }
+    return bOk;
+}
+
+bool ThreadConfig::Parse(const string &value, Settings &settings)
+{
+    stringstream ss(value);
+    string field;
+    while(ss >> field)
+    {
+        const size_t eq = field.find('=');
+        if(eq==string::npos)
+            return false;
+        const string name = field.substr(0,eq);
+        const string arg = field.substr(eq+1);
+
+        if(name=="cores")
+        {
+            stringstream ssCores(arg);
+            string core;
+            while(getline(ssCores,core,','))
+            {
+                int nCore;
+                if(!ParseInt(core,nCore) || nCore<0 || nCore>=MAX_CORES)
+                    return false;
+                settings.nCoreMask |= 1ull<<nCore;
+            }
+            if(!settings.nCoreMask)
+                return false;
+        }
+        else if(name=="nice")
+        {
+            if(!ParseInt(arg,settings.nNice) || settings.nNice<-20 || settings.nNice>19)
+                return false;
+            settings.bNice = true;
+        }
+        else if(name=="rt")
+        {
+            if(!ParseInt(arg,settings.nRealTime) || settings.nRealTime<1 || settings.nRealTime>99)
+                return false;
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+void ThreadConfig::Apply(const Role role)
+{
+    if(role<0 || role>=NUM_ROLES || (tnApplied & (1u<<role)))
+        return;
+    tnApplied |= 1u<<role;
+
+    const Settings &settings = msSettings[role];
+    if(!settings.nCoreMask && !settings.bNice && !settings.nRealTime)
+        return;
+
+#ifdef __linux__
+    if(settings.nCoreMask)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for(int i=0; i<MAX_CORES; i++)
+            if(settings.nCoreMask & (1ull<<i))
+                CPU_SET(i,&cpus);
+        const int err = pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus);
+        if(err)
+            cerr << "Thread " << ROLE_NAMES[role] << ": could not set the cores, " << strerror(err) << endl;
+    }
+
+    if(settings.nRealTime)
+    {
+        sched_param param;
+        param.sched_priority = settings.nRealTime;
+        const int err = pthread_setschedparam(pthread_self(),SCHED_FIFO,&param);
+        if(err)
+            cerr << "Thread " << ROLE_NAMES[role] << ": could not set the real-time priority, " << strerror(err) << endl;
+    }
+    else if(settings.bNice)
+    {
+        // On Linux the nice value of a thread id is the one of that thread only
+        const pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+        if(setpriority(PRIO_PROCESS,tid,settings.nNice)!=0)
+            cerr << "Thread " << ROLE_NAMES[role] << ": could not set the nice value, " << strerror(errno) << endl;
+    }
+#else
+    cerr << "Thread " << ROLE_NAMES[role] << ": thread settings are only supported on Linux" << endl;
+#endif
+}
+
+const char* ThreadConfig::GetName(const Role role)
+{
+    if(role<0 || role>=NUM_ROLES)
+        return "";
+    return ROLE_NAMES[role];
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,203 @@
+#include "ThreadPool.h"
+#include "MapMutex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace ORB_SLAM2
+{
+
+TaskScheduler* ThreadPool::mpsScheduler = NULL;
+
+ThreadPool::ThreadPool(const int nThreads, const ThreadConfig::Role role) : mbFinish(false), mRole(role),
+    mpScheduler(mpsScheduler), mnSchedulerThreads(0)
+{
+    const bool bTracking = role==ThreadConfig::TRACKING_WORKERS || role==ThreadConfig::EXTRACTION_WORKERS;
+    mPriority = bTracking ? TaskScheduler::HIGH : TaskScheduler::NORMAL;
+    Start(nThreads);
+}
+
+void ThreadPool::SetScheduler(TaskScheduler* pScheduler)
+{
+    mpsScheduler = pScheduler;
+}
+
+ThreadPool::~ThreadPool()
+{
+    Stop();
+}
+
+std::future<void> ThreadPool::Submit(const std::function<void(void)>& task)
+{
+    std::shared_ptr<std::packaged_task<void(void)> > pTask =
+            std::make_shared<std::packaged_task<void(void)> >(task);
+    std::future<void> result = pTask->get_future();
+
+    if(mpScheduler && mnSchedulerThreads>0)
+    {
+        mpScheduler->Submit([pTask]{(*pTask)();},mPriority,GetTaskName());
+        return result;
+    }
+
+    // without workers the task has to be run right away, nobody else would pick it up
+    if(mvWorkers.empty())
+    {
+        (*pTask)();
+        return result;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mMutexQueue);
+        mqTasks.push_back([pTask]{(*pTask)();});
+    }
+    mCondQueue.notify_one();
+
+    return result;
+}
+
+void ThreadPool::ParallelFor(const int n, const std::function<void(int)>& task)
+{
+    // The workers read a frozen map as the caller does
+    if(FrozenMapReader::IsActive())
+    {
+        RunParallelFor(n,[&task](int i){ FrozenMapReader reader; task(i); });
+        return;
+    }
+    RunParallelFor(n,task);
+}
+
+void ThreadPool::RunParallelFor(const int n, const std::function<void(int)>& task)
+{
+    if(n<=0)
+        return;
+
+    if(mpScheduler)
+    {
+        mpScheduler->ParallelFor(n,task,mPriority,GetTaskName(),mnSchedulerThreads);
+        return;
+    }
+
+    if(mvWorkers.empty() || n==1)
+    {
+        for(int i=0; i<n; i++)
+            task(i);
+        return;
+    }
+
+    // shared between the caller and the helper tasks, a helper which starts after
+    // all indices have been taken only touches this state and returns
+    struct Work
+    {
+        std::atomic<int> nNext;
+        std::atomic<int> nDone;
+        std::mutex mMutexDone;
+        std::condition_variable mCondDone;
+    };
+    std::shared_ptr<Work> pWork = std::make_shared<Work>();
+    pWork->nNext = 0;
+    pWork->nDone = 0;
+
+    std::function<void(void)> helper = [pWork, n, &task]
+    {
+        int i;
+        while((i = pWork->nNext++) < n)
+        {
+            task(i);
+            if(++pWork->nDone == n)
+            {
+                std::unique_lock<std::mutex> lock(pWork->mMutexDone);
+                pWork->mCondDone.notify_all();
+            }
+        }
+    };
+
+    const int nHelpers = std::min(static_cast<int>(mvWorkers.size()), n-1);
+    {
+        std::unique_lock<std::mutex> lock(mMutexQueue);
+        for(int i=0; i<nHelpers; i++)
+            mqTasks.push_back(helper);
+    }
+    mCondQueue.notify_all();
+
+    helper();
+
+    std::unique_lock<std::mutex> lock(pWork->mMutexDone);
+    while(pWork->nDone < n)
+        pWork->mCondDone.wait(lock);
+}
+
+void ThreadPool::Resize(const int nThreads)
+{
+    if(nThreads == GetNumThreads())
+        return;
+
+    Stop();
+    Start(nThreads);
+}
+
+int ThreadPool::GetNumThreads() const
+{
+    if(mpScheduler)
+        return std::min(mnSchedulerThreads,mpScheduler->GetNumThreads());
+    return mvWorkers.size();
+}
+
+const char* ThreadPool::GetTaskName() const
+{
+    return mRole==ThreadConfig::NONE ? "Tasks" : ThreadConfig::GetName(mRole);
+}
+
+void ThreadPool::Run()
+{
+    ThreadConfig::Apply(mRole);
+
+    while(true)
+    {
+        std::function<void(void)> task;
+        {
+            std::unique_lock<std::mutex> lock(mMutexQueue);
+            while(!mbFinish && mqTasks.empty())
+                mCondQueue.wait(lock);
+
+            if(mqTasks.empty())
+                return;
+
+            task = mqTasks.front();
+            mqTasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::Start(const int nThreads)
+{
+    if(mpScheduler)
+    {
+        mnSchedulerThreads = std::max(nThreads,0);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mMutexQueue);
+        mbFinish = false;
+    }
+
+    for(int i=0; i<nThreads; i++)
+        mvWorkers.push_back(std::thread(&ThreadPool::Run,this));
+}
+
+void ThreadPool::Stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutexQueue);
+        mbFinish = true;
+    }
+    mCondQueue.notify_all();
+
+    for(size_t i=0; i<mvWorkers.size(); i++)
+        mvWorkers[i].join();
+    mvWorkers.clear();
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,179 @@
+#include "ThumbnailIndex.h"
+#include "KeyFrame.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#if defined(__SSE2__)
+#define THUMBNAIL_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define THUMBNAIL_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Sigma of the blur, in pixels of the thumbnail
+const double BLUR_SIGMA = 1.0; //param
+}
+
+void ThumbnailIndex::Compute(const cv::Mat &imGray, vector<uint8_t> &signature)
+{
+    signature.clear();
+    if(imGray.empty())
+        return;
+
+    cv::Mat small;
+    cv::resize(imGray,small,cv::Size(WIDTH,HEIGHT),0,0,cv::INTER_AREA);
+    if(small.channels()==3)
+        cv::cvtColor(small,small,cv::COLOR_BGR2GRAY);
+    else if(small.channels()==4)
+        cv::cvtColor(small,small,cv::COLOR_BGRA2GRAY);
+    cv::GaussianBlur(small,small,cv::Size(0,0),BLUR_SIGMA);
+
+    int sum = 0;
+    for(int y=0; y<HEIGHT; y++)
+    {
+        const uint8_t* row = small.ptr<uint8_t>(y);
+        for(int x=0; x<WIDTH; x++)
+            sum += row[x];
+    }
+    const int offset = 128-sum/SIZE;
+
+    signature.resize(SIZE);
+    for(int y=0; y<HEIGHT; y++)
+    {
+        const uint8_t* row = small.ptr<uint8_t>(y);
+        for(int x=0; x<WIDTH; x++)
+            signature[y*WIDTH+x] = static_cast<uint8_t>(min(max(row[x]+offset,0),255));
+    }
+}
+
+int ThumbnailIndex::Distance(const uint8_t* a, const uint8_t* b)
+{
+#if defined(THUMBNAIL_SSE2)
+    __m128i sum = _mm_setzero_si128();
+    for(int i=0; i<SIZE; i+=16)
+    {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i));
+        sum = _mm_add_epi64(sum,_mm_sad_epu8(va,vb));
+    }
+    return _mm_cvtsi128_si32(sum)+_mm_cvtsi128_si32(_mm_srli_si128(sum,8));
+#elif defined(THUMBNAIL_NEON)
+    uint32x4_t sum = vdupq_n_u32(0);
+    for(int i=0; i<SIZE; i+=16)
+    {
+        const uint8x16_t diff = vabdq_u8(vld1q_u8(a+i),vld1q_u8(b+i));
+        sum = vpadalq_u16(sum,vpaddlq_u8(diff));
+    }
+    return vgetq_lane_u32(sum,0)+vgetq_lane_u32(sum,1)+vgetq_lane_u32(sum,2)+vgetq_lane_u32(sum,3);
+#else
+    int sum = 0;
+    for(int i=0; i<SIZE; i++)
+        sum += abs(static_cast<int>(a[i])-static_cast<int>(b[i]));
+    return sum;
+#endif
+}
+
+void ThumbnailIndex::Add(KeyFrame* pKF, const vector<uint8_t> &signature)
+{
+    if(signature.size()!=static_cast<size_t>(SIZE))
+        return;
+
+    unique_lock<SharedMutex> lock(mMutex);
+    unordered_map<KeyFrame*,size_t>::iterator it = mmSlots.find(pKF);
+    size_t slot;
+    if(it!=mmSlots.end())
+        slot = it->second;
+    else
+    {
+        slot = mvpKeyFrames.size();
+        mmSlots[pKF] = slot;
+        mvpKeyFrames.push_back(pKF);
+        mvSignatures.resize(mvSignatures.size()+SIZE);
+    }
+    copy(signature.begin(),signature.end(),mvSignatures.begin()+slot*SIZE);
+}
+
+void ThumbnailIndex::Erase(KeyFrame* pKF)
+{
+    unique_lock<SharedMutex> lock(mMutex);
+    unordered_map<KeyFrame*,size_t>::iterator it = mmSlots.find(pKF);
+    if(it==mmSlots.end())
+        return;
+
+    // The last one takes the slot, the block stays contiguous
+    const size_t slot = it->second;
+    const size_t last = mvpKeyFrames.size()-1;
+    mmSlots.erase(it);
+    if(slot!=last)
+    {
+        copy(mvSignatures.begin()+last*SIZE,mvSignatures.begin()+(last+1)*SIZE,mvSignatures.begin()+slot*SIZE);
+        mvpKeyFrames[slot] = mvpKeyFrames[last];
+        mmSlots[mvpKeyFrames[slot]] = slot;
+    }
+    mvpKeyFrames.pop_back();
+    mvSignatures.resize(last*SIZE);
+}
+
+void ThumbnailIndex::Clear()
+{
+    unique_lock<SharedMutex> lock(mMutex);
+    mvSignatures.clear();
+    mvpKeyFrames.clear();
+    mmSlots.clear();
+}
+
+bool ThumbnailIndex::Empty()
+{
+    SharedLock lock(mMutex);
+    return mvpKeyFrames.empty();
+}
+
+void ThumbnailIndex::Search(const vector<uint8_t> &signature, const int nK, const int maxDistance,
+                            vector<Match> &vMatches)
+{
+    vMatches.clear();
+    if(signature.size()!=static_cast<size_t>(SIZE) || nK<=0)
+        return;
+
+    SharedLock lock(mMutex);
+    const uint8_t* query = signature.data();
+    const uint8_t* block = mvSignatures.data();
+    for(size_t i=0; i<mvpKeyFrames.size(); i++)
+    {
+        const int distance = Distance(query,block+i*SIZE);
+        if(distance>maxDistance)
+            continue;
+        Match match;
+        match.pKF = mvpKeyFrames[i];
+        match.distance = distance;
+        vMatches.push_back(match);
+    }
+
+    // Ties go to the keyframe added first, the order does not depend on the slots
+    const size_t nKept = min(static_cast<size_t>(nK),vMatches.size());
+    partial_sort(vMatches.begin(),vMatches.begin()+nKept,vMatches.end(),[](const Match &a, const Match &b)
+    {
+        return a.distance<b.distance || (a.distance==b.distance && a.pKF->mnId<b.pKF->mnId);
+    });
+    vMatches.resize(nKept);
+}
+
+size_t ThumbnailIndex::GetMemoryUsage()
+{
+    SharedLock lock(mMutex);
+    return mvSignatures.capacity()+mvpKeyFrames.capacity()*sizeof(KeyFrame*)+
+           mmSlots.size()*(sizeof(KeyFrame*)+sizeof(size_t)+2*sizeof(void*));
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,171 @@
+#include "Trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+struct TraceEvent
+{
+    const char* name;
+    // NULL without context
+    const char* key;
+    long id;
+    // Nanoseconds since the start of the trace, dur is negative for an instant event
+    int64_t ts;
+    int64_t dur;
+};
+
+// Events of one thread. Only its thread appends, the mutex is only contended while Stop writes.
+struct ThreadBuffer
+{
+    ThreadBuffer(const int id): nId(id), name("Thread") {}
+
+    mutex mMutex;
+    const int nId;
+    string name;
+    vector<TraceEvent> vEvents;
+};
+
+mutex gMutexBuffers;
+// Buffers are never deleted, threads which exit keep their events
+vector<unique_ptr<ThreadBuffer> > gvpBuffers;
+string gFilename;
+chrono::steady_clock::time_point gStart;
+
+thread_local ThreadBuffer* tpBuffer = NULL;
+thread_local const char* tpContextKey = NULL;
+thread_local long tnContextId = 0;
+
+ThreadBuffer* GetBuffer()
+{
+    if(!tpBuffer)
+    {
+        unique_lock<mutex> lock(gMutexBuffers);
+        gvpBuffers.push_back(unique_ptr<ThreadBuffer>(new ThreadBuffer(gvpBuffers.size()+1)));
+        tpBuffer = gvpBuffers.back().get();
+    }
+    return tpBuffer;
+}
+
+void Add(const char* name, const chrono::steady_clock::time_point &start, const int64_t dur)
+{
+    TraceEvent event;
+    event.name = name;
+    event.key = tpContextKey;
+    event.id = tnContextId;
+    event.ts = chrono::duration_cast<chrono::nanoseconds>(start-gStart).count();
+    event.dur = dur;
+
+    ThreadBuffer* pBuffer = GetBuffer();
+    unique_lock<mutex> lock(pBuffer->mMutex);
+    pBuffer->vEvents.push_back(event);
+}
+}
+
+atomic<bool> Trace::mbActive(false);
+
+void Trace::Start(const string &filename)
+{
+    unique_lock<mutex> lock(gMutexBuffers);
+    for(size_t i=0; i<gvpBuffers.size(); i++)
+    {
+        unique_lock<mutex> lockBuffer(gvpBuffers[i]->mMutex);
+        gvpBuffers[i]->vEvents.clear();
+    }
+    gFilename = filename;
+    gStart = chrono::steady_clock::now();
+    mbActive = true;
+}
+
+bool Trace::Stop()
+{
+    if(!mbActive.exchange(false))
+        return true;
+
+    unique_lock<mutex> lock(gMutexBuffers);
+    ofstream f(gFilename.c_str());
+    if(!f.is_open())
+    {
+        cerr << "Could not write the trace to " << gFilename << endl;
+        return false;
+    }
+
+    size_t nEvents = 0;
+    char line[512];
+    f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << endl;
+    for(size_t i=0; i<gvpBuffers.size(); i++)
+    {
+        ThreadBuffer* pBuffer = gvpBuffers[i].get();
+        unique_lock<mutex> lockBuffer(pBuffer->mMutex);
+
+        snprintf(line,sizeof(line),"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                 pBuffer->nId,pBuffer->name.c_str());
+        f << (i>0 ? ",\n" : "") << line;
+
+        for(size_t j=0; j<pBuffer->vEvents.size(); j++)
+        {
+            const TraceEvent &e = pBuffer->vEvents[j];
+            int n;
+            if(e.dur>=0)
+                n = snprintf(line,sizeof(line),",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                             e.name,pBuffer->nId,e.ts*1e-3,e.dur*1e-3);
+            else
+                n = snprintf(line,sizeof(line),",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+                             e.name,pBuffer->nId,e.ts*1e-3);
+            if(e.key && n>0 && n<static_cast<int>(sizeof(line)))
+                snprintf(line+n,sizeof(line)-n,",\"args\":{\"%s\":%ld}}",e.key,e.id);
+            else if(n>0 && n<static_cast<int>(sizeof(line)))
+                snprintf(line+n,sizeof(line)-n,"}");
+            f << line;
+        }
+        nEvents += pBuffer->vEvents.size();
+        pBuffer->vEvents.clear();
+    }
+    f << endl << "]}" << endl;
+
+    cout << endl << "Trace of " << nEvents << " events saved to " << gFilename << endl;
+    return f.good();
+}
+
+void Trace::SetThreadName(const char* name)
+{
+    // Only this thread writes the name
+    ThreadBuffer* pBuffer = GetBuffer();
+    if(pBuffer->name==name)
+        return;
+    unique_lock<mutex> lock(pBuffer->mMutex);
+    pBuffer->name = name;
+}
+
+void Trace::SetContext(const char* key, const long id)
+{
+    tpContextKey = key;
+    tnContextId = id;
+}
+
+void Trace::Complete(const char* name, const chrono::steady_clock::time_point &start,
+                     const chrono::steady_clock::time_point &end)
+{
+    if(!mbActive.load(memory_order_acquire))
+        return;
+    Add(name,start,chrono::duration_cast<chrono::nanoseconds>(end-start).count());
+}
+
+void Trace::Instant(const char* name)
+{
+    if(!mbActive.load(memory_order_acquire))
+        return;
+    Add(name,chrono::steady_clock::now(),-1);
+}
+
+} //namespace ORB_SLAM
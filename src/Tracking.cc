@@ -32,10 +32,25 @@
 
 #include"Optimizer.h"
 #include"PnPsolver.h"
-
+#include"StageTimer.h"
+#include"FeatureBudget.h"
+#include"FeatureCache.h"
+#include"KeyFramePolicy.h"
+#include"Trace.h"
+#include"ThreadConfig.h"
+#include"MapStreamer.h"
+#include"Visualization.h"
+#include"VocabularyLoader.h"
+
+#include<algorithm>
+#include<chrono>
+#include<future>
+#include<iomanip>
 #include<iostream>
+#include<memory>
 
 #include<mutex>
+#include<sstream>
 
 
 using namespace std;
@@ -43,18 +58,152 @@ using namespace std;
 namespace ORB_SLAM2
 {
 
-Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer, MapDrawer *pMapDrawer, Map *pMap, KeyFrameDatabase* pKFDB, const string &strSettingPath, const int sensor):
-    mState(NO_IMAGES_YET), mSensor(sensor), mbOnlyTracking(false), mbVO(false), mpORBVocabulary(pVoc),
-    mpKeyFrameDB(pKFDB), mpInitializer(static_cast<Initializer*>(NULL)), mpSystem(pSys), mpViewer(NULL),
-    mpFrameDrawer(pFrameDrawer), mpMapDrawer(pMapDrawer), mpMap(pMap), mnLastRelocFrameId(0)
-    , mfSettings(strSettingPath, cv::FileStorage::READ)
+namespace
+{
+// Thumbnails tried before the BoW query, and their largest mean difference per pixel
+const int THUMBNAIL_CANDIDATES = 3; //param
+const int THUMBNAIL_MAX_DIFFERENCE = 15; //param
+
+double SecondsSince(const chrono::steady_clock::time_point &start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+}
+
+// The motion T scaled by s: the rotation by its angle, the translation linearly
+cv::Mat ScaleMotion(const cv::Mat &T, const float s)
+{
+    if(s==1.0f)
+        return T;
+    const Eigen::AngleAxisf rotation(Converter::toMatrix3f(T.rowRange(0,3).colRange(0,3)));
+    const Eigen::Matrix3f R = Eigen::AngleAxisf(rotation.angle()*s,rotation.axis()).toRotationMatrix();
+    return Converter::toCvSE3(R,s*Converter::toVector3f(T.rowRange(0,3).col(3)));
+}
+
+// ORBextractor.ExcludedRegions, regionsStr is the list for the log
+vector<vector<int> > ReadExcludedRegions(const Settings &fSettings, string &regionsStr)
+{
+    const Settings::Node &regionsNode = fSettings["ORBextractor.ExcludedRegions"];
+    vector<vector<int> > excludedRegions;
+    regionsStr = "[";
+    for (vector<Settings::Node>::const_iterator it = regionsNode.begin(); it != regionsNode.end(); it++)
+    {
+        const Settings::Node &regionNode = *it;
+        regionsStr += " [";
+        vector<int> region;
+        for (vector<Settings::Node>::const_iterator it2 = regionNode.begin(); it2 != regionNode.end(); it2++)
+        {
+            region.reserve(4);
+            region.push_back(static_cast<int>(*it2));
+            regionsStr += " " + to_string(static_cast<int>(*it2)) + " ";
+        }
+        excludedRegions.push_back(region);
+        regionsStr += " ]";
+    }
+    regionsStr += "]";
+    return excludedRegions;
+}
+
+string DescribeSetting(const Settings::Node &node)
+{
+    if(node.isNumber())
+    {
+        stringstream ss;
+        ss << setprecision(9) << (double)node;
+        return ss.str();
+    }
+    if(node.isString())
+        return (string)node;
+    string description;
+    if(node.isSeq())
+    {
+        description = "[";
+        for(vector<Settings::Node>::const_iterator it = node.begin(); it != node.end(); it++)
+            description += " "+DescribeSetting(*it);
+        description += " ]";
+    }
+    else if(node.isMatrix())
+    {
+        cv::Mat mat;
+        node >> mat;
+        mat.convertTo(mat,CV_64F);
+        stringstream ss;
+        ss << setprecision(9) << "[";
+        for(int i=0; i<mat.rows; i++)
+            for(int j=0; j<mat.cols; j++)
+                ss << " " << mat.at<double>(i,j);
+        ss << " ]";
+        description = ss.str();
+    }
+    return description;
+}
+
+// The settings the features of a frame depend on, a feature cache is only replayed with the same
+string DescribeExtractionSettings(const Settings &fSettings, const int sensor, const ORBVocabulary* pVoc)
+{
+    const char* keys[] = {"Camera.fx", "Camera.fy", "Camera.cx", "Camera.cy", "Camera.k1", "Camera.k2", "Camera.p1",
+                          "Camera.p2", "Camera.k3", "Camera.bf", "Camera.RGB", "Camera.undistortImages",
+                          "DepthMapFactor", "DepthFilterRadius", "ORBextractor.nFeatures", "ORBextractor.scaleFactor",
+                          "ORBextractor.nLevels", "ORBextractor.iniThFAST", "ORBextractor.minThFAST",
+                          "ORBextractor.ExcludedRegions", "ORBextractor.ExcludedPolygons", "ORBextractor.ExclusionMask",
+                          "ORBextractor.patternBins",
+                          "ORBextractor.gridDistribution"};
+    stringstream ss;
+    ss << "sensor " << sensor;
+    for(size_t i=0; i<sizeof(keys)/sizeof(keys[0]); i++)
+        ss << "\n" << keys[i] << " " << DescribeSetting(fSettings[keys[i]]);
+
+    // The BoW vectors depend on the vocabulary, a reduced one has other words
+    VocabularyLoader::Wait(pVoc);
+    ss << "\nvocabulary " << pVoc->size() << " " << pVoc->getDepthLevels() << " " << pVoc->getBranchingFactor()
+       << " " << pVoc->getFeatureVectorLevelsUp();
+
+    // The keypoints of the images rectified in the extraction depend on the rectification
+    if(sensor==System::STEREO && (int)fSettings["Camera.rectifyStereo"])
+    {
+        const char* rectificationKeys[] = {"Camera.rectifyStereo", "LEFT.K", "LEFT.D", "LEFT.R", "LEFT.P", "LEFT.width",
+                                           "LEFT.height", "RIGHT.K", "RIGHT.D", "RIGHT.R", "RIGHT.P", "RIGHT.width",
+                                           "RIGHT.height"};
+        for(size_t i=0; i<sizeof(rectificationKeys)/sizeof(rectificationKeys[0]); i++)
+            ss << "\n" << rectificationKeys[i] << " " << DescribeSetting(fSettings[rectificationKeys[i]]);
+    }
+    return ss.str();
+}
+
+void ConvertToGray(cv::Mat &im, const bool bRGB)
+{
+    if(im.channels()==3)
+    {
+        if(bRGB)
+            cvtColor(im,im,CV_RGB2GRAY);
+        else
+            cvtColor(im,im,CV_BGR2GRAY);
+    }
+    else if(im.channels()==4)
+    {
+        if(bRGB)
+            cvtColor(im,im,CV_RGBA2GRAY);
+        else
+            cvtColor(im,im,CV_BGRA2GRAY);
+    }
+}
+}
+
+Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer, Map *pMap, KeyFrameDatabase* pKFDB, const Settings &settings, const int sensor):
+    mState(NO_IMAGES_YET), mSensor(sensor), mbOnlyTracking(false), mbMapFrozen(false), mbVO(false), mpORBVocabulary(pVoc),
+    mpKeyFrameDB(pKFDB), mpInitializer(static_cast<Initializer*>(NULL)), mnLocalMapGeneration(0), mpSystem(pSys), mpViewer(NULL),
+    mpFrameDrawer(pFrameDrawer), mpStreamer(NULL), mpMap(pMap), mnLastRelocFrameId(0), mpStereoThreadPool(NULL),
+    mpRelocalizationThreadPool(NULL), mbBatchMatching(false), mbThumbnailIndex(false), mbStream(false), mfPosePriorRadius(0), mbRigTracked(false), mpRigThreadPool(NULL), mbOffline(false), mbDeterministic(false)
+    , mfSettings(settings)
     , mnAmountTrackedMapPoints(0)
     , mnAmountTrackedMapPointsKF(0)
     , mnMinMatchesForTracking("Min matches", 15, 0, 500, ParameterGroup::TRACKING, []{})
     , mTriggerRelocalization("Trigger Relocalization", false, false, ParameterGroup::MAIN, []{})
     , mVisualizeTracking("Show Tracking", false, true, ParameterGroup::MAIN, []{})
     , mVisualizeRelocalization("Show Relocalization", false, true, ParameterGroup::MAIN, []{})
+    , mShowInitialization(ParameterGroup::MAIN, "Show Init.")
 {
+    fill(mvnStrategyMatches,mvnStrategyMatches+PerformanceReport::NUM_STRATEGIES,0);
+
     // Load camera parameters from settings file
 
     float fx = mfSettings["Camera.fx"];
@@ -84,6 +233,9 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
 
     mbf = mfSettings["Camera.bf"];
 
+    mbUndistortImages = (int)mfSettings["Camera.undistortImages"];
+    mNoDistCoef = cv::Mat::zeros(4,1,CV_32F);
+
     float fps = mfSettings["Camera.fps"];
     if(fps==0)
         fps=30;
@@ -104,6 +256,8 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
     cout << "- p1: " << DistCoef.at<float>(2) << endl;
     cout << "- p2: " << DistCoef.at<float>(3) << endl;
     cout << "- fps: " << fps << endl;
+    if(UndistortsImages())
+        cout << "- undistortion: images" << endl;
 
 
     int nRGB = mfSettings["Camera.RGB"];
@@ -114,6 +268,11 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
     else
         cout << "- color order: BGR (ignored if grayscale)" << endl;
 
+    // Colors of the keypoints, for the exported map points
+    mbSampleColors = (int)mfSettings["Export.Color"];
+    if(mbSampleColors)
+        cout << "- keypoint colors: sampled" << endl;
+
     // Load ORB parameters
 
     int nFeatures = mfSettings["ORBextractor.nFeatures"];
@@ -121,32 +280,33 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
     int nLevels = mfSettings["ORBextractor.nLevels"];
     int fIniThFAST = mfSettings["ORBextractor.iniThFAST"];
     int fMinThFAST = mfSettings["ORBextractor.minThFAST"];
-    cv::FileNode regionsNode = mfSettings["ORBextractor.ExcludedRegions"];
-    std::vector<std::vector<int> > excludedRegions;
-    std::string regionsStr = "[";
-    for (cv::FileNodeIterator it = regionsNode.begin(); it != regionsNode.end(); it++)
-    {
-        cv::FileNode regionNode = *it;
-        regionsStr += " [";
-        std::vector<int> region;
-        for (cv::FileNodeIterator it2 = regionNode.begin(); it2 != regionNode.end(); it2++)
-        {
-            region.reserve(4);
-            region.push_back(static_cast<int>(*it2));
-            regionsStr += " " + std::to_string(static_cast<int>(*it2)) + " ";
-        }
-        excludedRegions.push_back(region);
-        regionsStr += " ]";
-    }
-    regionsStr += "]";
+    int nExtractorThreads = mfSettings["ORBextractor.nThreads"];
+    if(nExtractorThreads<1)
+        nExtractorThreads = 1;
+    const int nPatternBins = max((int)mfSettings["ORBextractor.patternBins"],0);
+    const bool bGridDistribution = (int)mfSettings["ORBextractor.gridDistribution"];
+    std::string regionsStr;
+    const std::vector<std::vector<int> > excludedRegions = ReadExcludedRegions(mfSettings,regionsStr);
+
+    std::vector<std::vector<cv::Point> > vExcludedPolygons;
+    cv::Mat exclusionMask;
+    ORBextractor::ReadExclusionMask(mfSettings,vExcludedPolygons,exclusionMask);
 
-    mpORBextractorLeft = new ORBextractor(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions);
+    mpORBextractorLeft = new ORBextractor(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,false,nExtractorThreads,nPatternBins,bGridDistribution);
+    mpORBextractorLeft->SetExclusionMask(vExcludedPolygons,exclusionMask);
 
     if(sensor==System::STEREO)
-        mpORBextractorRight = new ORBextractor(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions);
+    {
+        mpORBextractorRight = new ORBextractor(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,false,nExtractorThreads,nPatternBins,bGridDistribution);
+        mpORBextractorRight->SetExclusionMask(vExcludedPolygons,exclusionMask);
+        mpStereoThreadPool = new ThreadPool(1,ThreadConfig::TRACKING_WORKERS);
+    }
 
     if(sensor==System::MONOCULAR)
-        mpIniORBextractor = new ORBextractor(2*nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,true); //param
+    {
+        mpIniORBextractor = new ORBextractor(2*nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,true,nExtractorThreads,nPatternBins,bGridDistribution); //param
+        mpIniORBextractor->SetExclusionMask(vExcludedPolygons,exclusionMask);
+    }
 
     cout << endl  << "ORB Extractor Parameters: " << endl;
     cout << "- Number of Features: " << nFeatures << endl;
@@ -155,6 +315,107 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
     cout << "- Initial Fast Threshold: " << fIniThFAST << endl;
     cout << "- Minimum Fast Threshold: " << fMinThFAST << endl;
     cout << "- Excluded Regions: " << regionsStr << endl;
+    cout << "- Excluded Polygons: " << vExcludedPolygons.size() << endl;
+    cout << "- Exclusion Mask: " << (exclusionMask.empty() ? "no" : "yes") << endl;
+    cout << "- Extraction Threads: " << nExtractorThreads << endl;
+    cout << "- Pattern Angle Bins: " << (nPatternBins ? std::to_string(nPatternBins) : std::string("exact angles")) << endl;
+    cout << "- Distribution: " << (bGridDistribution ? "grid" : "octree") << endl;
+
+    LoadRig();
+
+    if(sensor==System::STEREO)
+        LoadStereoRectification();
+
+    // The settings of the extractor are the upper bounds of the budget
+    FeatureBudget::Budget &maxBudget = mMaxFeatureBudget;
+    maxBudget.nFeatures = nFeatures;
+    maxBudget.iniThFAST = fIniThFAST;
+    maxBudget.minThFAST = fMinThFAST;
+    maxBudget.nLevels = nLevels;
+    mpLatencyScheduler = static_cast<LatencyScheduler*>(NULL);
+    mpFeatureBudget = static_cast<FeatureBudget*>(NULL);
+    if((int)mfSettings["FeatureBudget.enable"])
+    {
+
+        FeatureBudget::Settings budgetSettings;
+        budgetSettings.targetFrameTime = mfSettings["FeatureBudget.targetFrameTime"];
+        if(budgetSettings.targetFrameTime<=0)
+            budgetSettings.targetFrameTime = 1.0f/fps;
+        budgetSettings.nMinInliers = mfSettings["FeatureBudget.minInliers"];
+        if(budgetSettings.nMinInliers<=0)
+            budgetSettings.nMinInliers = 50; //param
+        budgetSettings.nMaxQueuedKeyFrames = mfSettings["FeatureBudget.maxQueuedKeyFrames"];
+        if(budgetSettings.nMaxQueuedKeyFrames<=0)
+            budgetSettings.nMaxQueuedKeyFrames = 2; //param
+        budgetSettings.nMinFeatures = mfSettings["FeatureBudget.minFeatures"];
+        if(budgetSettings.nMinFeatures<=0)
+            budgetSettings.nMinFeatures = nFeatures/3; //param
+        budgetSettings.nMinLevels = mfSettings["FeatureBudget.minLevels"];
+        if(budgetSettings.nMinLevels<=0 || budgetSettings.nMinLevels>nLevels)
+            budgetSettings.nMinLevels = nLevels;
+
+        mpFeatureBudget = new FeatureBudget(maxBudget,budgetSettings);
+
+        cout << endl << "Feature Budget: " << budgetSettings.nMinFeatures << "-" << nFeatures << " features, "
+             << budgetSettings.nMinLevels << "-" << nLevels << " levels, target frame time "
+             << budgetSettings.targetFrameTime*1000 << " ms, min inliers " << budgetSettings.nMinInliers << endl;
+    }
+
+    // Stereo and RGB-D keep up to 3 keyframes queued while the mapping is busy, monocular none,
+    // unless LocalMapping.MaxQueue sets the limit (below the capacity of the queue)
+    const float fTargetUtilization = mfSettings["LocalMapping.TargetUtilization"];
+    int nMaxQueue = mfSettings["LocalMapping.MaxQueue"];
+    if(nMaxQueue<=0)
+        nMaxQueue = sensor==System::MONOCULAR ? 0 : 3; //param
+    mKeyFramePolicy = KeyFramePolicy(max(fTargetUtilization,0.0f),min(nMaxQueue,32)); //param
+    mbKeyFrameInterruptsBA = true;
+    if(fTargetUtilization>0)
+        cout << endl << "Keyframe Policy: target mapping utilization " << fTargetUtilization << endl;
+
+    // Relocalization candidates are evaluated in parallel, the tracking thread is one of the workers
+    int nRelocalizationThreads = mfSettings["Relocalization.nThreads"];
+    if(nRelocalizationThreads<1)
+        nRelocalizationThreads = 1;
+    mpRelocalizationThreadPool = new ThreadPool(nRelocalizationThreads-1,ThreadConfig::TRACKING_WORKERS);
+    cout << endl << "Relocalization Threads: " << nRelocalizationThreads << endl;
+
+    mbThumbnailIndex = (int)mfSettings["Relocalization.ThumbnailIndex"];
+    if(mbThumbnailIndex)
+        cout << "Relocalization: thumbnail index" << endl;
+
+    mfLocalMapRadius = mfSettings["Tracking.LocalMapRadius"];
+
+    mbImageAlignment = (int)mfSettings["Tracking.ImageAlignment"];
+    if(mbImageAlignment)
+        cout << endl << "Image Alignment: on" << endl;
+
+    // A flow frame has no depth at its keypoints and no frame for the other cameras of a rig
+    mnMaxFlowFrames = max((int)mfSettings["Tracking.FlowFrames"],0);
+    mnFlowFrames = 0;
+    mnFlowReferenceInliers = 0;
+    mbFlowFailed = false;
+    if(mnMaxFlowFrames>0 && (sensor!=System::MONOCULAR || !mvRigCameras.empty()))
+    {
+        cout << endl << "Flow Frames: only for a single monocular camera, off" << endl;
+        mnMaxFlowFrames = 0;
+    }
+    else if(mnMaxFlowFrames>0)
+        cout << endl << "Flow Frames: up to " << mnMaxFlowFrames << " in a row" << endl;
+
+    mnSkippedFrames = 0;
+
+    // The frames keep the pyramid of the left image for the alignment and the flow
+    if(mbImageAlignment || mnMaxFlowFrames>0)
+    {
+        mpORBextractorLeft->SetKeepImagePyramid(true);
+        if(sensor==System::MONOCULAR)
+            mpIniORBextractor->SetKeepImagePyramid(true);
+    }
+
+    mnLostFrames = 0;
+    mnMaxLostFrames = max((int)mfSettings["Atlas.nLostFrames"],0);
+    if(mnMaxLostFrames>0)
+        cout << endl << "Atlas: a new map is started after " << mnMaxLostFrames << " lost frames" << endl;
 
     if(sensor==System::STEREO || sensor==System::RGBD)
     {
@@ -162,6 +423,7 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
         cout << endl << "Depth Threshold (Close/Far Points): " << mThDepth << endl;
     }
 
+    mnDepthFilterRadius = 0;
     if(sensor==System::RGBD)
     {
         mDepthMapFactor = mfSettings["DepthMapFactor"];
@@ -169,8 +431,27 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
             mDepthMapFactor=1;
         else
             mDepthMapFactor = 1.0f/mDepthMapFactor;
+
+        mnDepthFilterRadius = max((int)mfSettings["DepthFilterRadius"],0);
+        cout << "Depth Filter Radius: " << mnDepthFilterRadius << endl;
+    }
+
+    // Frames of the same sequence are built from the features extracted by an earlier run
+    mpFeatureCache = static_cast<FeatureCache*>(NULL);
+    const string strFeatureCache = mfSettings["FeatureCache.File"];
+    if(!strFeatureCache.empty())
+    {
+        mpFeatureCache = new FeatureCache(strFeatureCache,DescribeExtractionSettings(mfSettings,sensor,mpORBVocabulary));
+        if(mpFeatureCache->IsOpen())
+            cout << endl << "Feature Cache: " << strFeatureCache << ", " << mpFeatureCache->Size() << " frames recorded before" << endl;
+        else
+        {
+            delete mpFeatureCache;
+            mpFeatureCache = static_cast<FeatureCache*>(NULL);
+        }
     }
 
+    mnReclaimerId = mpMap->mReclaimer.RegisterThread();
 }
 
 void Tracking::SetLocalMapper(LocalMapping *pLocalMapper)
@@ -183,128 +464,809 @@ void Tracking::SetLoopClosing(LoopClosing *pLoopClosing)
     mpLoopClosing=pLoopClosing;
 }
 
-void Tracking::SetViewer(Viewer *pViewer)
+void Tracking::SetViewer(Visualization *pViewer)
 {
     mpViewer=pViewer;
 }
 
+void Tracking::SetStreamer(MapStreamer *pStreamer)
+{
+    mpStreamer=pStreamer;
+}
+
+void Tracking::SetLatencyScheduler(LatencyScheduler* pScheduler)
+{
+    mpLatencyScheduler = pScheduler;
+}
+
+void Tracking::SetBatchMatching()
+{
+    mbBatchMatching = true;
+}
+
+void Tracking::SetPosePrior(const cv::Mat &Tcw, const float fRadius)
+{
+    unique_lock<mutex> lock(mMutexPosePrior);
+    mfPosePriorRadius = max(fRadius,0.0f);
+    if(mfPosePriorRadius==0)
+        return;
+
+    const cv::Mat Rcw = Tcw.rowRange(0,3).colRange(0,3);
+    const cv::Mat tcw = Tcw.rowRange(0,3).col(3);
+    const cv::Mat Ow = -Rcw.t()*tcw;
+    mPosePriorCenter << Ow.at<float>(0), Ow.at<float>(1), Ow.at<float>(2);
+}
+
+size_t Tracking::GetPyramidMemoryUsage()
+{
+    size_t bytes = mpORBextractorLeft->GetMemoryUsage();
+    if(mSensor==System::STEREO)
+        bytes += mpORBextractorRight->GetMemoryUsage();
+    if(mSensor==System::MONOCULAR)
+        bytes += mpIniORBextractor->GetMemoryUsage();
+    for(size_t i=0; i<mvRigCameras.size(); i++)
+        bytes += mvRigCameras[i].pExtractor->GetMemoryUsage();
+    for(size_t i=0; i<mvBuilderExtractors.size(); i++)
+    {
+        const BuilderExtractors &extractors = mvBuilderExtractors[i];
+        bytes += extractors.pLeft->GetMemoryUsage();
+        if(extractors.pRight)
+            bytes += extractors.pRight->GetMemoryUsage();
+        if(extractors.pIni)
+            bytes += extractors.pIni->GetMemoryUsage();
+    }
+    return bytes;
+}
+
+void Tracking::SetOfflineMode(const int nBuilders)
+{
+    mbOffline = true;
+
+    // The budget adapts to the frame time, offline the results must not depend on it
+    if(mpFeatureBudget)
+    {
+        cout << "Feature Budget: disabled in offline mode" << endl;
+        delete mpFeatureBudget;
+        mpFeatureBudget = static_cast<FeatureBudget*>(NULL);
+    }
+
+    int nFeatures = mfSettings["ORBextractor.nFeatures"];
+    float fScaleFactor = mfSettings["ORBextractor.scaleFactor"];
+    int nLevels = mfSettings["ORBextractor.nLevels"];
+    int fIniThFAST = mfSettings["ORBextractor.iniThFAST"];
+    int fMinThFAST = mfSettings["ORBextractor.minThFAST"];
+    const int nPatternBins = max((int)mfSettings["ORBextractor.patternBins"],0);
+    const bool bGridDistribution = (int)mfSettings["ORBextractor.gridDistribution"];
+    string regionsStr;
+    const vector<vector<int> > excludedRegions = ReadExcludedRegions(mfSettings,regionsStr);
+    vector<vector<cv::Point> > vExcludedPolygons;
+    cv::Mat exclusionMask;
+    ORBextractor::ReadExclusionMask(mfSettings,vExcludedPolygons,exclusionMask);
+
+    // The builders run in parallel, each extracts with one thread
+    for(int i=0; i<nBuilders; i++)
+    {
+        BuilderExtractors extractors;
+        extractors.pLeft = new ORBextractor(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,false,1,nPatternBins,bGridDistribution);
+        extractors.pLeft->SetExclusionMask(vExcludedPolygons,exclusionMask);
+        extractors.pLeft->SetKeepImagePyramid(mbImageAlignment);
+        extractors.pRight = static_cast<ORBextractor*>(NULL);
+        extractors.pIni = static_cast<ORBextractor*>(NULL);
+        if(mSensor==System::STEREO)
+        {
+            extractors.pRight = new ORBextractor(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,false,1,nPatternBins,bGridDistribution);
+            extractors.pRight->SetExclusionMask(vExcludedPolygons,exclusionMask);
+            extractors.pLeft->SetRemap(mRectifyMapLeft1,mRectifyMapLeft2);
+            extractors.pRight->SetRemap(mRectifyMapRight1,mRectifyMapRight2);
+        }
+        if(mSensor==System::MONOCULAR)
+        {
+            extractors.pIni = new ORBextractor(2*nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,true,1,nPatternBins,bGridDistribution); //param
+            extractors.pIni->SetExclusionMask(vExcludedPolygons,exclusionMask);
+            extractors.pIni->SetKeepImagePyramid(mbImageAlignment);
+        }
+        mvBuilderExtractors.push_back(extractors);
+    }
+}
+
+void Tracking::LoadStereoRectification()
+{
+    if(!(int)mfSettings["Camera.rectifyStereo"])
+        return;
+
+    cv::Mat K_l, K_r, P_l, P_r, R_l, R_r, D_l, D_r;
+    mfSettings["LEFT.K"] >> K_l;
+    mfSettings["RIGHT.K"] >> K_r;
+    mfSettings["LEFT.P"] >> P_l;
+    mfSettings["RIGHT.P"] >> P_r;
+    mfSettings["LEFT.R"] >> R_l;
+    mfSettings["RIGHT.R"] >> R_r;
+    mfSettings["LEFT.D"] >> D_l;
+    mfSettings["RIGHT.D"] >> D_r;
+    const int rows_l = mfSettings["LEFT.height"];
+    const int cols_l = mfSettings["LEFT.width"];
+    const int rows_r = mfSettings["RIGHT.height"];
+    const int cols_r = mfSettings["RIGHT.width"];
+
+    if(K_l.empty() || K_r.empty() || P_l.empty() || P_r.empty() || R_l.empty() || R_r.empty() || D_l.empty() || D_r.empty() ||
+            rows_l==0 || rows_r==0 || cols_l==0 || cols_r==0)
+    {
+        cerr << "Calibration parameters to rectify stereo are missing, the images must be rectified by the caller" << endl;
+        return;
+    }
+
+    cv::initUndistortRectifyMap(K_l,D_l,R_l,P_l.rowRange(0,3).colRange(0,3),cv::Size(cols_l,rows_l),CV_16SC2,
+                                mRectifyMapLeft1,mRectifyMapLeft2);
+    cv::initUndistortRectifyMap(K_r,D_r,R_r,P_r.rowRange(0,3).colRange(0,3),cv::Size(cols_r,rows_r),CV_16SC2,
+                                mRectifyMapRight1,mRectifyMapRight2);
+    mpORBextractorLeft->SetRemap(mRectifyMapLeft1,mRectifyMapLeft2);
+    mpORBextractorRight->SetRemap(mRectifyMapRight1,mRectifyMapRight2);
+
+    cout << endl << "Stereo Rectification: in the extraction, " << cols_l << "x" << rows_l << " images" << endl;
+}
+
+void Tracking::LoadRig()
+{
+    const int nCameras = mfSettings["Rig.nCameras"];
+    if(nCameras<=1)
+        return;
+
+    if(mSensor!=System::MONOCULAR)
+    {
+        cerr << "Rig: only monocular rigs are supported, the other cameras are ignored" << endl;
+        return;
+    }
+
+    vector<RigCamera> vCameras;
+    for(int i=1; i<nCameras; i++)
+    {
+        const string prefix = "Rig.Camera" + to_string(i) + ".";
+
+        RigCamera camera;
+        camera.K = cv::Mat::eye(3,3,CV_32F);
+        camera.K.at<float>(0,0) = mfSettings[prefix+"fx"];
+        camera.K.at<float>(1,1) = mfSettings[prefix+"fy"];
+        camera.K.at<float>(0,2) = mfSettings[prefix+"cx"];
+        camera.K.at<float>(1,2) = mfSettings[prefix+"cy"];
+
+        camera.DistCoef = cv::Mat(4,1,CV_32F);
+        camera.DistCoef.at<float>(0) = mfSettings[prefix+"k1"];
+        camera.DistCoef.at<float>(1) = mfSettings[prefix+"k2"];
+        camera.DistCoef.at<float>(2) = mfSettings[prefix+"p1"];
+        camera.DistCoef.at<float>(3) = mfSettings[prefix+"p2"];
+
+        mfSettings[prefix+"Tcr"] >> camera.Tcr;
+        if(camera.K.at<float>(0,0)<=0 || camera.K.at<float>(1,1)<=0 || camera.Tcr.rows!=4 || camera.Tcr.cols!=4)
+        {
+            cerr << "Rig: " << prefix << "fx/fy/cx/cy/Tcr are missing, the rig is not used" << endl;
+            return;
+        }
+        camera.Tcr.convertTo(camera.Tcr,CV_32F);
+
+        vCameras.push_back(camera);
+    }
+
+    // The other cameras are extracted in parallel, each with one thread and without the
+    // exclusion regions, which belong to the image of the first camera
+    int nFeatures = mfSettings["ORBextractor.nFeatures"];
+    float fScaleFactor = mfSettings["ORBextractor.scaleFactor"];
+    int nLevels = mfSettings["ORBextractor.nLevels"];
+    int fIniThFAST = mfSettings["ORBextractor.iniThFAST"];
+    int fMinThFAST = mfSettings["ORBextractor.minThFAST"];
+    const int nPatternBins = max((int)mfSettings["ORBextractor.patternBins"],0);
+    const bool bGridDistribution = (int)mfSettings["ORBextractor.gridDistribution"];
+
+    for(size_t i=0; i<vCameras.size(); i++)
+    {
+        RigCamera &camera = vCameras[i];
+        camera.pExtractor = new ORBextractor(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,vector<vector<int> >(),
+                                             false,1,nPatternBins,bGridDistribution);
+        camera.pContext = new FrameContext();
+        camera.pLastKF = static_cast<KeyFrame*>(NULL);
+    }
+    mvRigCameras = vCameras;
+    mpRigThreadPool = new ThreadPool(mvRigCameras.size(),ThreadConfig::TRACKING_WORKERS);
+
+    cout << endl << "Rig: " << nCameras << " cameras" << endl;
+    for(size_t i=0; i<mvRigCameras.size(); i++)
+    {
+        const cv::Mat &K = mvRigCameras[i].K;
+        cout << "- camera " << i+1 << ": fx " << K.at<float>(0,0) << ", fy " << K.at<float>(1,1)
+             << ", cx " << K.at<float>(0,2) << ", cy " << K.at<float>(1,2) << endl;
+    }
+}
+
+bool Tracking::NeedsInitialComputations() const
+{
+    return mpMap->mFrameContext.mbInitialComputations || (UndistortsImages() && mUndistortMap1.empty());
+}
+
 
 cv::Mat Tracking::GrabImageStereo(const cv::Mat &imRectLeft, const cv::Mat &imRectRight, const double &timestamp)
 {
-    mImGray = imRectLeft;
+    // The caller may drive several Systems
+    StageTimes::BindThread(&mpMap->mStageTimes);
+    cv::Mat imGray;
+    Frame frame = CreateFrameStereo(imRectLeft,imRectRight,timestamp,imGray);
+    return TrackFrame(std::move(frame),imGray,imGray.data!=imRectLeft.data);
+}
+
+
+cv::Mat Tracking::GrabImageRGBD(const cv::Mat &imRGB,const cv::Mat &imD, const double &timestamp, const bool bMetricDepth)
+{
+    StageTimes::BindThread(&mpMap->mStageTimes);
+    cv::Mat imGray;
+    Frame frame = CreateFrameRGBD(imRGB,imD,timestamp,imGray,bMetricDepth);
+    return TrackFrame(std::move(frame),imGray,imGray.data!=imRGB.data);
+}
+
+
+cv::Mat Tracking::GrabImageMonocular(const cv::Mat &im, const double &timestamp)
+{
+    StageTimes::BindThread(&mpMap->mStageTimes);
+    cv::Mat imGray;
+    if(CanTrackWithFlow())
+    {
+        mbFlowFailed = false;
+        Frame frame = CreateFrameFlow(im,timestamp,imGray);
+        const cv::Mat Tcw = TrackFrame(std::move(frame),imGray,imGray.data!=im.data);
+        if(!mbFlowFailed)
+            return Tcw;
+
+        // The state is as before the flow frame, the image is extracted and tracked as usual
+        DLOG_IF(INFO, mVisualizeTracking()) << "Flow tracking failed, extracting the frame.";
+    }
+
+    Frame frame = CreateFrameMonocular(im,timestamp,mState==NOT_INITIALIZED || mState==NO_IMAGES_YET,imGray);
+    return TrackFrame(std::move(frame),imGray,imGray.data!=im.data);
+}
+
+cv::Mat Tracking::GrabImageRig(const vector<cv::Mat> &vIm, const double &timestamp)
+{
+    StageTimes::BindThread(&mpMap->mStageTimes);
+    const bool bInitializing = mState==NOT_INITIALIZED || mState==NO_IMAGES_YET;
+
+    // The map is initialized by the first camera alone, the others join once there is one
+    mbRigTracked = false;
+    mvRigFrames.clear();
+    vector<future<void> > vExtractions;
+    if(!bInitializing)
+    {
+        mvRigFrames.resize(mvRigCameras.size());
+        for(size_t i=0; i<mvRigCameras.size(); i++)
+        {
+            vExtractions.push_back(mpRigThreadPool->Submit([this,&vIm,timestamp,i]
+            {
+                mvRigFrames[i] = CreateFrameRig(i,vIm[i+1],timestamp);
+            }));
+        }
+    }
+
+    cv::Mat imGray;
+    Frame frame = CreateFrameMonocular(vIm[0],timestamp,bInitializing,imGray);
+
+    for(size_t i=0; i<vExtractions.size(); i++)
+        vExtractions[i].get();
+
+    // The rig frames are the same frame for the map points, which mark the frames by id
+    for(size_t i=0; i<mvRigFrames.size(); i++)
+        mvRigFrames[i].mnId = frame.mnId;
+
+    return TrackFrame(std::move(frame),imGray,imGray.data!=vIm[0].data);
+}
+
+Frame Tracking::CreateFrameRig(const size_t nCamera, const cv::Mat &im, const double &timestamp)
+{
+    cv::Mat imGray = im;
+    ConvertToGray(imGray,mbRGB);
+
+    RigCamera &camera = mvRigCameras[nCamera];
+    return Frame(imGray,timestamp,camera.pExtractor,mpORBVocabulary,camera.pContext,camera.K,camera.DistCoef,mbf,mThDepth);
+}
+
+Frame Tracking::CreateFrameStereo(const cv::Mat &imRectLeft, const cv::Mat &imRectRight, const double &timestamp, cv::Mat &imGray,
+                                  const int nBuilder)
+{
+    imGray = imRectLeft;
     cv::Mat imGrayRight = imRectRight;
 
-    if(mImGray.channels()==3)
+    if(imGray.channels()==3)
     {
         if(mbRGB)
         {
-            cvtColor(mImGray,mImGray,CV_RGB2GRAY);
+            cvtColor(imGray,imGray,CV_RGB2GRAY);
             cvtColor(imGrayRight,imGrayRight,CV_RGB2GRAY);
         }
         else
         {
-            cvtColor(mImGray,mImGray,CV_BGR2GRAY);
+            cvtColor(imGray,imGray,CV_BGR2GRAY);
             cvtColor(imGrayRight,imGrayRight,CV_BGR2GRAY);
         }
     }
-    else if(mImGray.channels()==4)
+    else if(imGray.channels()==4)
     {
         if(mbRGB)
         {
-            cvtColor(mImGray,mImGray,CV_RGBA2GRAY);
+            cvtColor(imGray,imGray,CV_RGBA2GRAY);
             cvtColor(imGrayRight,imGrayRight,CV_RGBA2GRAY);
         }
         else
         {
-            cvtColor(mImGray,mImGray,CV_BGRA2GRAY);
-            cvtColor(imGrayRight,imGrayRight,CV_BGRA2GRAY);
+            cvtColor(imGray,imGray,CV_BGRA2GRAY);
+            cvtColor(imGrayRight,imGrayRight,CV_BGRA2GRAY);
+        }
+    }
+
+    Frame frame;
+    if(ReplayFrame(imGray,timestamp,false,mDistCoef,frame))
+    {
+        if(mpFrameDrawer && !mRectifyMapLeft1.empty())
+        {
+            cv::Mat imRectified;
+            cv::remap(imGray,imRectified,mRectifyMapLeft1,mRectifyMapLeft2,cv::INTER_LINEAR);
+            imGray = imRectified;
+        }
+        SampleColors(frame,imRectLeft);
+        return frame;
+    }
+
+    // The builders of the offline input extract both images themselves
+    if(nBuilder>0)
+    {
+        const BuilderExtractors &extractors = mvBuilderExtractors[nBuilder-1];
+        frame = Frame(imGray,imGrayRight,timestamp,extractors.pLeft,extractors.pRight,mpORBVocabulary,&mpMap->mFrameContext,mK,mDistCoef,mbf,mThDepth);
+        TakeRectifiedImage(extractors.pLeft,imGray);
+        RecordFrame(frame,false);
+        SampleColors(frame,imRectLeft);
+        return frame;
+    }
+
+    ApplyFeatureBudget();
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // Id the frame will get
+    Trace::SetContext("frame",mpMap->mFrameContext.nNextId);
+    frame = Frame(imGray,imGrayRight,timestamp,mpORBextractorLeft,mpORBextractorRight,mpORBVocabulary,&mpMap->mFrameContext,mK,mDistCoef,mbf,mThDepth,mpStereoThreadPool);
+    if(mpFeatureBudget)
+        mpFeatureBudget->AddExtraction(SecondsSince(start),frame.N);
+    TakeRectifiedImage(mpORBextractorLeft,imGray);
+    RecordFrame(frame,false);
+    SampleColors(frame,imRectLeft);
+    return frame;
+}
+
+Frame Tracking::CreateFrameRGBD(const cv::Mat &imRGB, const cv::Mat &imD, const double &timestamp, cv::Mat &imGray,
+                                const bool bMetricDepth, const int nBuilder)
+{
+    imGray = imRGB;
+    cv::Mat imDepth = imD;
+
+    if(imGray.channels()==3)
+    {
+        if(mbRGB)
+            cvtColor(imGray,imGray,CV_RGB2GRAY);
+        else
+            cvtColor(imGray,imGray,CV_BGR2GRAY);
+    }
+    else if(imGray.channels()==4)
+    {
+        if(mbRGB)
+            cvtColor(imGray,imGray,CV_RGBA2GRAY);
+        else
+            cvtColor(imGray,imGray,CV_BGRA2GRAY);
+    }
+
+    // 16 bit and float depth is only read at the keypoints and scaled there, other types are
+    // converted by the Frame
+    const float depthMapFactor = bMetricDepth ? 1.0f : mDepthMapFactor;
+
+    const bool bUndistort = UndistortsImages();
+    if(bUndistort)
+    {
+        UndistortImage(imGray,cv::INTER_LINEAR);
+        // depths must not be interpolated across the edges
+        UndistortImage(imDepth,cv::INTER_NEAREST);
+    }
+
+    Frame frame;
+    if(ReplayFrame(imGray,timestamp,false,bUndistort ? mNoDistCoef : mDistCoef,frame))
+    {
+        SampleColors(frame,imRGB);
+        RetainDepth(frame,imDepth,imD,depthMapFactor);
+        return frame;
+    }
+
+    if(nBuilder>0)
+    {
+        frame = Frame(imGray,imDepth,timestamp,mvBuilderExtractors[nBuilder-1].pLeft,mpORBVocabulary,&mpMap->mFrameContext,mK,
+                      bUndistort ? mNoDistCoef : mDistCoef,mbf,mThDepth,depthMapFactor,mnDepthFilterRadius);
+        RecordFrame(frame,false);
+        SampleColors(frame,imRGB);
+        RetainDepth(frame,imDepth,imD,depthMapFactor);
+        return frame;
+    }
+
+    ApplyFeatureBudget();
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // Id the frame will get
+    Trace::SetContext("frame",mpMap->mFrameContext.nNextId);
+    frame = Frame(imGray,imDepth,timestamp,mpORBextractorLeft,mpORBVocabulary,&mpMap->mFrameContext,mK,bUndistort ? mNoDistCoef : mDistCoef,
+                  mbf,mThDepth,depthMapFactor,mnDepthFilterRadius);
+    if(mpFeatureBudget)
+        mpFeatureBudget->AddExtraction(SecondsSince(start),frame.N);
+    RecordFrame(frame,false);
+    SampleColors(frame,imRGB);
+    RetainDepth(frame,imDepth,imD,depthMapFactor);
+    return frame;
+}
+
+Frame Tracking::CreateFrameMonocular(const cv::Mat &im, const double &timestamp, const bool bInitializing, cv::Mat &imGray,
+                                     const int nBuilder)
+{
+    imGray = im;
+    ConvertToGray(imGray,mbRGB);
+
+    const bool bUndistort = UndistortsImages();
+    if(bUndistort)
+        UndistortImage(imGray,cv::INTER_LINEAR);
+    cv::Mat &distCoef = bUndistort ? mNoDistCoef : mDistCoef;
+
+    Frame frame;
+    if(ReplayFrame(imGray,timestamp,bInitializing,distCoef,frame))
+    {
+        SampleColors(frame,im);
+        return frame;
+    }
+
+    if(nBuilder>0)
+    {
+        const BuilderExtractors &extractors = mvBuilderExtractors[nBuilder-1];
+        frame = Frame(imGray,timestamp,bInitializing ? extractors.pIni : extractors.pLeft,mpORBVocabulary,&mpMap->mFrameContext,mK,distCoef,mbf,mThDepth);
+        RecordFrame(frame,bInitializing);
+        SampleColors(frame,im);
+        return frame;
+    }
+
+    // Id the frame will get
+    Trace::SetContext("frame",mpMap->mFrameContext.nNextId);
+
+    // The initializer needs more features, its extractor keeps the settings
+    if(bInitializing)
+    {
+        frame = Frame(imGray,timestamp,mpIniORBextractor,mpORBVocabulary,&mpMap->mFrameContext,mK,distCoef,mbf,mThDepth);
+        RecordFrame(frame,true);
+        SampleColors(frame,im);
+        return frame;
+    }
+
+    ApplyFeatureBudget();
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    frame = Frame(imGray,timestamp,mpORBextractorLeft,mpORBVocabulary,&mpMap->mFrameContext,mK,distCoef,mbf,mThDepth);
+    if(mpFeatureBudget)
+        mpFeatureBudget->AddExtraction(SecondsSince(start),frame.N);
+    RecordFrame(frame,false);
+    SampleColors(frame,im);
+    return frame;
+}
+
+bool Tracking::CanTrackWithFlow()
+{
+    if(mnMaxFlowFrames<=0 || mbOffline || mState!=OK || mnFlowFrames>=mnMaxFlowFrames)
+        return false;
+
+    // The motion model predicts the points for the flow
+    if(mVelocity.empty() || !mLastFrame.mpImagePyramid || mLastFrame.mnId<mnLastRelocFrameId+2 ||
+       mpMap->mFrameContext.mbInitialComputations)
+        return false;
+
+    // The last frame was in localization mode with mostly visual odometry points
+    if(mbOnlyTracking && mbVO)
+        return false;
+
+    // A frame the keyframe decision would take is extracted
+    return !IsKeyFrameLikely();
+}
+
+bool Tracking::IsKeyFrameLikely()
+{
+    if(mbOnlyTracking || mState!=OK || !mpReferenceKF)
+        return false;
+
+    // The number of inliers is the one of the last frame, the first keyframe condition is the
+    // time since the last keyframe or an idle Local Mapping
+    const long unsigned int nNextId = mLastFrame.mnId+1;
+    if(nNextId>=mnLastKeyFrameId+mMaxFrames)
+        return true;
+    if(mpLocalMapper->AcceptKeyFrames() && nNextId>=mnLastKeyFrameId+mMinFrames)
+    {
+        const int nKFs = mpMap->KeyFramesInMap();
+        const int nRefMatches = mpReferenceKF->TrackedMapPoints(nKFs<=2 ? 2 : 3);
+        if(mnMatchesInliers<nRefMatches*KeyFrameRefRatio(nKFs))
+            return true;
+    }
+    return false;
+}
+
+bool Tracking::CanSkipFrame() const
+{
+    // The motion model needs two tracked frames since the last relocalization
+    return mState==OK && !mbOffline && !mVelocity.empty() && !mLastFrame.mTcw.empty() && mpReferenceKF &&
+           mLastFrame.mnId>=mnLastRelocFrameId+2;
+}
+
+cv::Mat Tracking::SkipFrame(const double &timestamp, const bool bStill)
+{
+    if(!CanSkipFrame())
+        return cv::Mat();
+
+    const cv::Mat Tcw = bStill ? mLastFrame.mTcw.clone() : PredictPose();
+    if(!bStill)
+        mnSkippedFrames++;
+
+    // In the trajectory as a tracked frame, relative to the reference keyframe
+    mTrajectory.Add(Tcw*mpReferenceKF->GetPoseInverse(),mpReferenceKF,timestamp,false);
+    return Tcw;
+}
+
+cv::Mat Tracking::PredictPose() const
+{
+    return ScaleMotion(mVelocity,1+mnSkippedFrames)*mLastFrame.mTcw;
+}
+
+Frame Tracking::CreateFrameFlow(const cv::Mat &im, const double &timestamp, cv::Mat &imGray)
+{
+    imGray = im;
+    ConvertToGray(imGray,mbRGB);
+
+    if(UndistortsImages())
+        UndistortImage(imGray,cv::INTER_LINEAR);
+
+    // The keypoints move by as much as their undistorted position from the motion model
+    const cv::Mat Tcw = PredictPose();
+    const Eigen::Matrix3f Rcw = Converter::toMatrix3f(Tcw.rowRange(0,3).colRange(0,3));
+    const Eigen::Vector3f tcw = Converter::toVector3f(Tcw.rowRange(0,3).col(3));
+    vector<cv::Point2f> vPredicted(mLastFrame.N,cv::Point2f(-1,-1));
+    for(int i=0; i<mLastFrame.N; i++)
+    {
+        MapPoint* pMP = mLastFrame.mvpMapPoints[i];
+        if(!pMP || mLastFrame.mvbOutlier[i] || pMP->isBad())
+            continue;
+
+        const Eigen::Vector3f x3Dc = Rcw*Converter::toVector3f(pMP->GetWorldPos())+tcw;
+        if(x3Dc(2)<=0)
+            continue;
+
+        const float u = mLastFrame.fx*x3Dc(0)/x3Dc(2)+mLastFrame.cx;
+        const float v = mLastFrame.fy*x3Dc(1)/x3Dc(2)+mLastFrame.cy;
+        const cv::Point2f &pt = mLastFrame.mvKeys[i].pt;
+        const cv::Point2f &ptUn = mLastFrame.mvKeysUn[i].pt;
+        vPredicted[i] = cv::Point2f(pt.x+u-ptUn.x,pt.y+v-ptUn.y);
+    }
+
+    // Id the frame will get
+    Trace::SetContext("frame",mpMap->mFrameContext.nNextId);
+    return Frame(mLastFrame,imGray,timestamp,mpORBextractorLeft,vPredicted,&mpMap->mFrameContext);
+}
+
+bool Tracking::TrackWithFlow()
+{
+    const int nMinPoints = 30; //param
+    if(mCurrentFrame.N<nMinPoints)
+        return false;
+
+    // Local Mapping might have replaced some of the points since the frame was built
+    for(int i=0; i<mCurrentFrame.N; i++)
+    {
+        MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+        if(pMP && pMP->isBad())
+            mCurrentFrame.mvpMapPoints[i] = pMP->GetReplaced();
+    }
+
+    mCurrentFrame.SetPose(PredictPose());
+    Optimizer::PoseOptimization(&mCurrentFrame);
+
+    // Discard outliers
+    int nInliers = 0;
+    for(int i=0; i<mCurrentFrame.N; i++)
+    {
+        if(!mCurrentFrame.mvpMapPoints[i])
+            continue;
+        if(mCurrentFrame.mvbOutlier[i])
+        {
+            MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+            mCurrentFrame.mvpMapPoints[i]=static_cast<MapPoint*>(NULL);
+            mCurrentFrame.mvbOutlier[i]=false;
+            mCurrentFrame.mvpRejectedPoints.push_back(pMP);
         }
+        else if(mCurrentFrame.mvpMapPoints[i]->Observations()>0)
+            nInliers++;
     }
+    mvnStrategyMatches[PerformanceReport::FLOW] = nInliers;
 
-    mCurrentFrame = Frame(mImGray,imGrayRight,timestamp,mpORBextractorLeft,mpORBextractorRight,mpORBVocabulary,mK,mDistCoef,mbf,mThDepth);
+    DLOG_IF(INFO, mVisualizeTracking()) << "Flow: " << nInliers << " inliers of " << mCurrentFrame.N
+                                        << " tracked points, " << mnFlowReferenceInliers
+                                        << " inliers in the last extracted frame.";
 
-    Track();
+    // Extract again once too many points were lost since the last extracted frame
+    const float fMinRatio = 0.6f; //param
+    if(nInliers<nMinPoints || nInliers<fMinRatio*mnFlowReferenceInliers)
+        return false;
 
-    return mCurrentFrame.mTcw.clone();
+    mnMatchesInliers = nInliers;
+    return true;
 }
 
-
-cv::Mat Tracking::GrabImageRGBD(const cv::Mat &imRGB,const cv::Mat &imD, const double &timestamp)
+void Tracking::PublishCameraPose(const cv::Mat &Tcw)
 {
-    mImGray = imRGB;
-    cv::Mat imDepth = imD;
+    if(mpViewer)
+        mpViewer->SetCurrentCameraPose(Tcw);
+    if(mpStreamer)
+        mpStreamer->SetCurrentCameraPose(Tcw);
+}
 
-    if(mImGray.channels()==3)
-    {
-        if(mbRGB)
-            cvtColor(mImGray,mImGray,CV_RGB2GRAY);
-        else
-            cvtColor(mImGray,mImGray,CV_BGR2GRAY);
-    }
-    else if(mImGray.channels()==4)
+void Tracking::ApplyFeatureBudget()
+{
+    if(mpLatencyScheduler)
     {
-        if(mbRGB)
-            cvtColor(mImGray,mImGray,CV_RGBA2GRAY);
-        else
-            cvtColor(mImGray,mImGray,CV_BGRA2GRAY);
+        // The knobs hold for the whole frame, a local map of another size is built again
+        const int nLastMaxLocalKeyFrames = mLatencyKnobs.nMaxLocalKeyFrames;
+        mLatencyKnobs = mpLatencyScheduler->GetKnobs();
+        if(mLatencyKnobs.nMaxLocalKeyFrames!=nLastMaxLocalKeyFrames)
+            mvpLocalMapVotedKFs.clear();
     }
 
-    if((fabs(mDepthMapFactor-1.0f)>1e-5) || imDepth.type()!=CV_32F)
-        imDepth.convertTo(imDepth,CV_32F,mDepthMapFactor);
+    if(!mpFeatureBudget && !mpLatencyScheduler)
+        return;
 
-    mCurrentFrame = Frame(mImGray,imDepth,timestamp,mpORBextractorLeft,mpORBVocabulary,mK,mDistCoef,mbf,mThDepth);
+    FeatureBudget::Budget budget = mpFeatureBudget ? mpFeatureBudget->GetBudget() : mMaxFeatureBudget;
+    budget.nFeatures = max(static_cast<int>(budget.nFeatures*mLatencyKnobs.fFeatureScale),1);
+    mpORBextractorLeft->SetFeatureBudget(budget.nFeatures,budget.iniThFAST,budget.minThFAST,budget.nLevels);
+    if(mSensor==System::STEREO)
+        mpORBextractorRight->SetFeatureBudget(budget.nFeatures,budget.iniThFAST,budget.minThFAST,budget.nLevels);
+}
 
-    Track();
+bool Tracking::ReplayFrame(const cv::Mat &imGray, const double &timestamp, const bool bInitializer, cv::Mat &distCoef, Frame &frame)
+{
+    FrameFeatures features;
+    if(!mpFeatureCache || !mpFeatureCache->Get(timestamp,bInitializer ? FeatureCache::INITIALIZER : FeatureCache::TRACKING,features))
+        return false;
 
-    return mCurrentFrame.mTcw.clone();
+    // The extractor only gives the scale levels
+    frame = Frame(imGray,timestamp,std::move(features),bInitializer ? mpIniORBextractor : mpORBextractorLeft,mpORBVocabulary,
+                  &mpMap->mFrameContext,mK,distCoef,mbf,mThDepth);
+    return true;
 }
 
+void Tracking::RecordFrame(Frame &frame, const bool bInitializer)
+{
+    if(!mpFeatureCache)
+        return;
+
+    // The replayed frames come with their BoW
+    frame.ComputeBoW();
+    mpFeatureCache->Add(frame,bInitializer ? FeatureCache::INITIALIZER : FeatureCache::TRACKING);
+}
 
-cv::Mat Tracking::GrabImageMonocular(const cv::Mat &im, const double &timestamp)
+void Tracking::FinishFeatureCache()
 {
-    mImGray = im;
+    if(!mpFeatureCache)
+        return;
 
-    if(mImGray.channels()==3)
-    {
-        if(mbRGB)
-            cvtColor(mImGray,mImGray,CV_RGB2GRAY);
-        else
-            cvtColor(mImGray,mImGray,CV_BGR2GRAY);
-    }
-    else if(mImGray.channels()==4)
-    {
-        if(mbRGB)
-            cvtColor(mImGray,mImGray,CV_RGBA2GRAY);
-        else
-            cvtColor(mImGray,mImGray,CV_BGRA2GRAY);
-    }
+    mpFeatureCache->Flush();
+    mpFeatureCache->PrintStats(cout);
+}
 
+void Tracking::RetainDepth(Frame &frame, const cv::Mat &imDepth, const cv::Mat &imInput, const float depthMapFactor)
+{
+    if(!mpMap->mKeyFrameDepths.IsEnabled())
+        return;
 
-    if(mState==NOT_INITIALIZED || mState==NO_IMAGES_YET)
-    {
-        mCurrentFrame = Frame(mImGray,timestamp,mpIniORBextractor,mpORBVocabulary,mK,mDistCoef,mbf,mThDepth);
-    }
-    else
+    // The caller may reuse its buffer once the frame is tracked, an undistorted image is ours
+    frame.mImDepth = imDepth.data==imInput.data ? imDepth.clone() : imDepth;
+    frame.mfDepthMapFactor = depthMapFactor;
+}
+
+void Tracking::SampleColors(Frame &frame, const cv::Mat &im)
+{
+    if(!mbSampleColors || im.channels()<3 || im.depth()!=CV_8U)
+        return;
+
+    // The keypoints of an undistorted or rectified image are in that one, the map holds the pixel
+    // of im each of its pixels came from
+    const cv::Mat &map = mRectifyMapLeft1.empty() ? mUndistortMap1 : mRectifyMapLeft1;
+    const bool bUndistorted = (UndistortsImages() || !mRectifyMapLeft1.empty()) && map.size()==im.size();
+    const int nChannels = im.channels();
+    vector<cv::Vec3b> vColors(frame.N);
+    for(int i=0; i<frame.N; i++)
     {
-        mCurrentFrame = Frame(mImGray,timestamp,mpORBextractorLeft,mpORBVocabulary,mK,mDistCoef,mbf,mThDepth);
+        int x = min(max(cvRound(frame.mvKeys[i].pt.x),0),im.cols-1);
+        int y = min(max(cvRound(frame.mvKeys[i].pt.y),0),im.rows-1);
+        if(bUndistorted)
+        {
+            const cv::Vec2s &source = map.at<cv::Vec2s>(y,x);
+            x = min(max(static_cast<int>(source[0]),0),im.cols-1);
+            y = min(max(static_cast<int>(source[1]),0),im.rows-1);
+        }
+        const uchar* pixel = im.ptr<uchar>(y)+x*nChannels;
+        vColors[i] = mbRGB ? cv::Vec3b(pixel[0],pixel[1],pixel[2]) : cv::Vec3b(pixel[2],pixel[1],pixel[0]);
     }
+    frame.mvColors = SharedArray<cv::Vec3b>(std::move(vColors));
+}
+
+void Tracking::TakeRectifiedImage(ORBextractor* pExtractor, cv::Mat &imGray)
+{
+    if(!pExtractor->Remaps())
+        return;
+
+    // The extractor writes a later image over the level once the frames let go of the pyramid,
+    // only the drawer keeps the image
+    const cv::Mat &level = pExtractor->GetImagePyramid()->GetLevel(0);
+    imGray = mpFrameDrawer ? level.clone() : level;
+}
+
+void Tracking::UndistortImage(cv::Mat &im, const int interpolation)
+{
+    if(mUndistortMap1.empty() || mUndistortMap1.size()!=im.size())
+        cv::initUndistortRectifyMap(mK,mDistCoef,cv::Mat(),mK,im.size(),CV_16SC2,mUndistortMap1,mUndistortMap2);
+
+    cv::Mat imUndistorted;
+    cv::remap(im,imUndistorted,mUndistortMap1,mUndistortMap2,interpolation);
+    im = imUndistorted;
+}
 
+cv::Mat Tracking::TrackFrame(Frame &&frame, const cv::Mat &imGray, const bool bImGrayOwned)
+{
+    mImGray = imGray;
+    mbImGrayOwned = bImGrayOwned;
+    mCurrentFrame = std::move(frame);
+
+    Trace::SetThreadName("Tracking");
+    ThreadConfig::Apply(ThreadConfig::TRACKING);
+    Trace::SetContext("frame",mCurrentFrame.mnId);
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
     Track();
 
+    // Frames which initialized the map have no pose inliers, flow frames no extraction
+    if(mpFeatureBudget && mLastProcessedState!=NOT_INITIALIZED && !mCurrentFrame.mbFlowTracked)
+        mpFeatureBudget->AddTracking(SecondsSince(start),mState==OK,mnMatchesInliers,mpLocalMapper->KeyframesInQueue());
+
+    PassQuiescentState();
+
     return mCurrentFrame.mTcw.clone();
 }
 
 void Tracking::Track()
 {
+    STAGE_TIMER(TRACK);
+
     if(mState==NO_IMAGES_YET)
     {
         mState = NOT_INITIALIZED;
     }
 
     mLastProcessedState=mState;
-
-    // Get Map Mutex -> Map cannot be changed
-    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+    fill(mvnStrategyMatches,mvnStrategyMatches+PerformanceReport::NUM_STRATEGIES,0);
+
+    const bool bFrozen = IsMapFrozen();
+    if(bFrozen!=mbMapFrozen)
+        cout << (bFrozen ? "Map frozen, tracking without locks" : "Map unfrozen") << endl;
+    mbMapFrozen = bFrozen;
+    FrozenMapReader frozenReader(bFrozen);
+
+    // The pose of a tracked frame is estimated without the map mutex, so the local mapping and the
+    // loop closing can write the map meanwhile, the rest runs under it. A write in between shows in
+    // the update version, the pose is then optimized again against the written map. A frozen map
+    // needs no mutex at all.
+    const bool bOptimistic = mState==OK && !mbOnlyTracking && mvRigCameras.empty();
+    const unsigned long nVersion = mpMap->GetUpdateVersion();
+    const int nBigChangeIdx = mpMap->GetLastBigChangeIdx();
+    // The keyframe the pose is corrected with if the map moves meanwhile
+    KeyFrame* pRefKF = bOptimistic ? mpReferenceKF : static_cast<KeyFrame*>(NULL);
+    const cv::Mat TcwRefOld = pRefKF ? pRefKF->GetPose() : cv::Mat();
+    unique_ptr<MapUpdateLock> pLock;
+    if(!bOptimistic && !bFrozen)
+        pLock.reset(new MapUpdateLock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate)));
 
     if(mState==NOT_INITIALIZED)
     {
@@ -313,7 +1275,12 @@ void Tracking::Track()
         else
             MonocularInitialization();
 
-        mpFrameDrawer->Update(this);
+        // The keyframes of the initial map
+        if(mbDeterministic && mState==OK && pLock)
+            WaitForMapping(*pLock);
+
+        if(mpFrameDrawer)
+            mpFrameDrawer->Update(this);
 
         if(mState!=OK)
             return;
@@ -344,7 +1311,17 @@ void Tracking::Track()
         }
 
         // Initial camera pose estimation using motion model or relocalization (if tracking is lost)
-        if(!mbOnlyTracking)
+        if(mCurrentFrame.mbFlowTracked)
+        {
+            // Nothing changed yet, the caller extracts the image and tracks it again
+            bOK = TrackWithFlow();
+            if(!bOK)
+            {
+                mbFlowFailed = true;
+                return;
+            }
+        }
+        else if(!mbOnlyTracking)
         {
             // Trigger relocalization button will cause to jump over this block
             // leading to a LOST state further below
@@ -456,9 +1433,10 @@ void Tracking::Track()
         mCurrentFrame.mpReferenceKF = mpReferenceKF;
 
         // If we have an initial estimation of the camera pose and matching. Track the local map.
+        // A flow frame has no other keypoints to match it with.
         if(!mbOnlyTracking)
         {
-            if(bOK)
+            if(bOK && !mCurrentFrame.mbFlowTracked)
                 bOK = TrackLocalMap();
         }
         else
@@ -466,13 +1444,21 @@ void Tracking::Track()
             // mbVO true means that there are few matches to MapPoints in the map. We cannot retrieve
             // a local map and therefore we do not perform TrackLocalMap(). Once the system relocalizes
             // the camera we will use the local map again.
-            if(bOK && !mbVO)
+            if(bOK && !mbVO && !mCurrentFrame.mbFlowTracked)
                 bOK = TrackLocalMap();
         }
 
+        if(!pLock && !bFrozen)
+        {
+            pLock.reset(new MapUpdateLock(mpMap,LOCK_SITE(mpMap->mMutexMapUpdate)));
+            if(bOK && pLock->GetAcquiredVersion()!=nVersion)
+                bOK = RefinePose(pRefKF,TcwRefOld,mpMap->GetLastBigChangeIdx()!=nBigChangeIdx);
+        }
+
         if(bOK)
         {
             mState = OK;
+            mnLostFrames = 0;
         }
         else if (mState!=LOST)
         {
@@ -480,7 +1466,8 @@ void Tracking::Track()
         }
 
         // Update drawer
-        mpFrameDrawer->Update(this);
+        if(mpFrameDrawer)
+            mpFrameDrawer->Update(this);
 
         // If tracking were good, check if we insert a keyframe
         if(bOK)
@@ -491,12 +1478,13 @@ void Tracking::Track()
                 cv::Mat LastTwc = cv::Mat::eye(4,4,CV_32F);
                 mLastFrame.GetRotationInverse().copyTo(LastTwc.rowRange(0,3).colRange(0,3));
                 mLastFrame.GetCameraCenter().copyTo(LastTwc.rowRange(0,3).col(3));
-                mVelocity = mCurrentFrame.mTcw*LastTwc;
+                // Per image, the skipped ones came in between
+                mVelocity = ScaleMotion(mCurrentFrame.mTcw*LastTwc,1.0f/(1+mnSkippedFrames));
             }
             else
                 mVelocity = cv::Mat();
 
-            mpMapDrawer->SetCurrentCameraPose(mCurrentFrame.mTcw);
+            PublishCameraPose(mCurrentFrame.mTcw);
 
             // Clean VO matches
             for(int i=0; i<mCurrentFrame.N; i++)
@@ -518,11 +1506,15 @@ void Tracking::Track()
             }
             mlpTemporalPoints.clear();
 
-            // Check if we need to insert a new keyframe
-            if(NeedNewKeyFrame())
+            // Check if we need to insert a new keyframe, a flow frame has no new keypoints for it
+            if(!mCurrentFrame.mbFlowTracked && NeedNewKeyFrame())
             {
                 DLOG_IF(INFO, mVisualizeTracking()) << "This frame is going to be a new keyframe!";
+                if(mbOffline)
+                    WaitForLocalMapping(*pLock);
                 CreateNewKeyFrame();
+                if(mbDeterministic)
+                    WaitForMapping(*pLock);
             }
 
             // We allow points with high innovation (considererd outliers by the Huber Function)
@@ -539,7 +1531,17 @@ void Tracking::Track()
         // Reset if the camera get lost soon after initialization
         if(mState==LOST)
         {
-            if(mpMap->KeyFramesInMap()<=5) //param
+            if(mnMaxLostFrames>0 && !mbOnlyTracking)
+            {
+                // With the atlas the lost map is kept, only the frames lost to start a new one differ
+                if(mpMap->KeyFramesInMap(mpReferenceKF->mnMapId)<=5 || ++mnLostFrames>=mnMaxLostFrames) //param
+                {
+                    cout << "Track lost, starting a new map..." << endl;
+                    StartNewMap();
+                    return;
+                }
+            }
+            else if(!mbStream && mpMap->KeyFramesInMap()<=5) //param
             {
                 cout << "Track lost soon after initialisation, reseting..." << endl;
                 mpSystem->Reset();
@@ -550,25 +1552,28 @@ void Tracking::Track()
         if(!mCurrentFrame.mpReferenceKF)
             mCurrentFrame.mpReferenceKF = mpReferenceKF;
 
+        if(mCurrentFrame.mbFlowTracked)
+            mnFlowFrames++;
+        else
+        {
+            mnFlowFrames = 0;
+            mnFlowReferenceInliers = mnMatchesInliers;
+        }
+
         mLastFrame = Frame(mCurrentFrame);
+        mnSkippedFrames = 0;
     }
 
     // Store frame pose Information to retrieve the complete camera trajectory afterwards.
     if(!mCurrentFrame.mTcw.empty())
     {
         cv::Mat Tcr = mCurrentFrame.mTcw*mCurrentFrame.mpReferenceKF->GetPoseInverse();
-        mlRelativeFramePoses.push_back(Tcr);
-        mlpReferences.push_back(mpReferenceKF);
-        mlFrameTimes.push_back(mCurrentFrame.mTimeStamp);
-        mlbLost.push_back(mState==LOST);
+        mTrajectory.Add(Tcr,mpReferenceKF,mCurrentFrame.mTimeStamp,mState==LOST);
     }
     else
     {
         // This can happen if tracking is lost
-        mlRelativeFramePoses.push_back(mlRelativeFramePoses.back());
-        mlpReferences.push_back(mlpReferences.back());
-        mlFrameTimes.push_back(mlFrameTimes.back());
-        mlbLost.push_back(mState==LOST);
+        mTrajectory.AddLast(mState==LOST);
     }
 
 }
@@ -583,9 +1588,13 @@ void Tracking::StereoInitialization()
 
         // Create KeyFrame
         KeyFrame* pKFini = new KeyFrame(mCurrentFrame,mpMap,mpKeyFrameDB);
+        pKFini->mnMapId = mpMap->mnNextMapId++;
+        AddThumbnail(pKFini);
+        StoreDepth(pKFini);
 
         // Insert KeyFrame in the map
         mpMap->AddKeyFrame(pKFini);
+        mpMap->AddOrigin(pKFini);
 
         // Create MapPoints and asscoiate to KeyFrame
         for(int i=0; i<mCurrentFrame.N;i++)
@@ -613,16 +1622,15 @@ void Tracking::StereoInitialization()
         mnLastKeyFrameId=mCurrentFrame.mnId;
         mpLastKeyFrame = pKFini;
 
+        InvalidateLocalMap();
         mvpLocalKeyFrames.push_back(pKFini);
-        mvpLocalMapPoints=mpMap->GetAllMapPoints();
+        SetInitialLocalMapPoints(pKFini);
         mpReferenceKF = pKFini;
         mCurrentFrame.mpReferenceKF = pKFini;
 
         mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
-        mpMap->mvpKeyFrameOrigins.push_back(pKFini);
-
-        mpMapDrawer->SetCurrentCameraPose(mCurrentFrame.mTcw);
+        PublishCameraPose(mCurrentFrame.mTcw);
 
         mState=OK;
     }
@@ -630,8 +1638,7 @@ void Tracking::StereoInitialization()
 
 void Tracking::MonocularInitialization()
 {
-    auto visualizeInitializationPt = ParameterManager::getParameter<bool>(ParameterGroup::MAIN, "Show Init.");
-    bool visualizeInitialization = visualizeInitializationPt->getValue();
+    bool visualizeInitialization = mShowInitialization(false);
     DLOG_IF(INFO, visualizeInitialization) << "&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&"
                                            << " INITIALIZATION";
     if(!mpInitializer)
@@ -649,7 +1656,7 @@ void Tracking::MonocularInitialization()
             if(mpInitializer)
                 delete mpInitializer;
 
-            mpInitializer =  new Initializer(mCurrentFrame,1.0,200); //param
+            mpInitializer =  new Initializer(mCurrentFrame,1.0,200,mpRelocalizationThreadPool); //param
 
             fill(mvIniMatches.begin(),mvIniMatches.end(),-1);
 
@@ -724,7 +1731,9 @@ void Tracking::CreateInitialMapMonocular()
     // Create KeyFrames
     KeyFrame* pKFini = new KeyFrame(mInitialFrame,mpMap,mpKeyFrameDB);
     KeyFrame* pKFcur = new KeyFrame(mCurrentFrame,mpMap,mpKeyFrameDB);
-
+    pKFini->mnMapId = pKFcur->mnMapId = mpMap->mnNextMapId++;
+    // The image of the initial frame is gone
+    AddThumbnail(pKFcur);
 
     pKFini->ComputeBoW();
     pKFcur->ComputeBoW();
@@ -732,6 +1741,7 @@ void Tracking::CreateInitialMapMonocular()
     // Insert KFs in the map
     mpMap->AddKeyFrame(pKFini);
     mpMap->AddKeyFrame(pKFcur);
+    mpMap->AddOrigin(pKFini);
 
     // Create MapPoints and asscoiate to keyframes
     for(size_t i=0; i<mvIniMatches.size();i++)
@@ -768,7 +1778,12 @@ void Tracking::CreateInitialMapMonocular()
     // Bundle Adjustment
     cout << "New Map created with " << mpMap->MapPointsInMap() << " points" << endl;
 
-    Optimizer::GlobalBundleAdjustemnt(mpMap,20); //param
+    // Only the new map, the other maps of the atlas have their own origins
+    vector<KeyFrame*> vpIniKFs;
+    vpIniKFs.push_back(pKFini);
+    vpIniKFs.push_back(pKFcur);
+    SetInitialLocalMapPoints(pKFini);
+    Optimizer::BundleAdjustment(vpIniKFs,mvpLocalMapPoints,20); //param
 
     // Set median depth to 1
     float medianDepth = pKFini->ComputeSceneMedianDepth(2);
@@ -776,8 +1791,17 @@ void Tracking::CreateInitialMapMonocular()
 
     if(medianDepth<0 || pKFcur->TrackedMapPoints(1)<100) //param
     {
+        // The maps kept in the atlas are not reset for a new map which failed
+        if(mpMap->KeyFramesInMap()>2)
+        {
+            cout << "Wrong initialization, discarding the new map..." << endl;
+            DiscardInitialMap(pKFini,pKFcur);
+            return;
+        }
+
         cout << "Wrong initialization, reseting..." << endl;
-        Reset();
+        // Applied by the System before the next frame, like any other reset request
+        mpSystem->Reset();
         return;
     }
 
@@ -804,9 +1828,9 @@ void Tracking::CreateInitialMapMonocular()
     mnLastKeyFrameId=mCurrentFrame.mnId;
     mpLastKeyFrame = pKFcur;
 
+    InvalidateLocalMap();
     mvpLocalKeyFrames.push_back(pKFcur);
     mvpLocalKeyFrames.push_back(pKFini);
-    mvpLocalMapPoints=mpMap->GetAllMapPoints();
     mpReferenceKF = pKFcur;
     mCurrentFrame.mpReferenceKF = pKFcur;
 
@@ -814,14 +1838,71 @@ void Tracking::CreateInitialMapMonocular()
 
     mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
-    mpMapDrawer->SetCurrentCameraPose(pKFcur->GetPose());
-
-    mpMap->mvpKeyFrameOrigins.push_back(pKFini);
+    PublishCameraPose(pKFcur->GetPose());
 
     mState=OK;
 
 }
 
+void Tracking::SetInitialLocalMapPoints(KeyFrame* pKF)
+{
+    mvpLocalMapPoints.clear();
+    const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        if(vpMPs[i])
+            mvpLocalMapPoints.push_back(vpMPs[i]);
+    }
+}
+
+void Tracking::DiscardInitialMap(KeyFrame* pKFini, KeyFrame* pKFcur)
+{
+    for(size_t i=0; i<mvpLocalMapPoints.size(); i++)
+        mvpLocalMapPoints[i]->SetBadFlag();
+    mvpLocalMapPoints.clear();
+    fill(mCurrentFrame.mvpMapPoints.begin(),mCurrentFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+
+    pKFcur->SetBadFlag();
+    mpMap->EraseOrigin(pKFini);
+    pKFini->SetBadFlag();
+
+    // The next frame is the new reference of the initialization
+    delete mpInitializer;
+    mpInitializer = static_cast<Initializer*>(NULL);
+}
+
+void Tracking::StartNewMap()
+{
+    // The keyframes and points of the lost map stay in the map and in the database, the
+    // relocalization and the loop closing still find them
+    if(mpInitializer)
+    {
+        delete mpInitializer;
+        mpInitializer = static_cast<Initializer*>(NULL);
+    }
+
+    fill(mCurrentFrame.mvpMapPoints.begin(),mCurrentFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+    fill(mLastFrame.mvpMapPoints.begin(),mLastFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+    mCurrentFrame.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    mLastFrame.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    mvpLocalMapPoints.clear();
+    mLocalMapGeometry.Clear();
+    mvpLocalKeyFrames.clear();
+    InvalidateLocalMap();
+    mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    mpLastKeyFrame = static_cast<KeyFrame*>(NULL);
+    mVelocity = cv::Mat();
+    mnSkippedFrames = 0;
+
+    mvRigFrames.clear();
+    mbRigTracked = false;
+    for(size_t i=0; i<mvRigCameras.size(); i++)
+        mvRigCameras[i].pLastKF = static_cast<KeyFrame*>(NULL);
+
+    mnLostFrames = 0;
+    mState = NOT_INITIALIZED;
+}
+
 void Tracking::CheckReplacedInLastFrame()
 {
     for(int i =0; i<mLastFrame.N; i++)
@@ -840,8 +1921,68 @@ void Tracking::CheckReplacedInLastFrame()
 }
 
 
+void Tracking::PassQuiescentState()
+{
+    // Local Mapping or Loop Closing may have culled or replaced MapPoints and KeyFrames
+    // since they were taken, nothing which is bad may be kept after the quiescent state
+    Frame* vpFrames[2] = {&mCurrentFrame, &mLastFrame};
+    for(int f=0; f<2; f++)
+    {
+        vector<MapPoint*> &vpMPs = vpFrames[f]->mvpMapPoints;
+        for(size_t i=0; i<vpMPs.size(); i++)
+        {
+            MapPoint* pMP = vpMPs[i];
+            if(pMP && pMP->isBad())
+            {
+                MapPoint* pRep = pMP->GetReplaced();
+                vpMPs[i] = (pRep && !pRep->isBad()) ? pRep : static_cast<MapPoint*>(NULL);
+            }
+        }
+    }
+
+    const size_t nLocalMapPoints = mvpLocalMapPoints.size();
+    for(size_t i=0; i<mvpLocalMapPoints.size();)
+    {
+        if(mvpLocalMapPoints[i]->isBad())
+        {
+            mvpLocalMapPoints[i] = mvpLocalMapPoints.back();
+            mvpLocalMapPoints.pop_back();
+        }
+        else
+            i++;
+    }
+    if(mvpLocalMapPoints.size()!=nLocalMapPoints && !mbStream)
+        mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
+
+    // Only needed within TrackLocalMap, it is taken again for the next frame
+    mLocalMapGeometry.Clear();
+
+    const size_t nLocalKeyFrames = mvpLocalKeyFrames.size();
+    for(size_t i=0; i<mvpLocalKeyFrames.size();)
+    {
+        if(mvpLocalKeyFrames[i]->isBad())
+        {
+            mvpLocalKeyFrames[i] = mvpLocalKeyFrames.back();
+            mvpLocalKeyFrames.pop_back();
+        }
+        else
+            i++;
+    }
+    if(mvpLocalKeyFrames.size()!=nLocalKeyFrames)
+        InvalidateLocalMap();
+
+    // The features of a bad reference keyframe are released, its parent takes over.
+    // The reference of the last frame stays, only its pose is used.
+    while(mpReferenceKF && mpReferenceKF->isBad())
+        mpReferenceKF = mpReferenceKF->GetParent();
+
+    mpMap->mReclaimer.QuiescentState(mnReclaimerId);
+}
+
 bool Tracking::TrackReferenceKeyFrame()
 {
+    STAGE_TIMER(TRACK_REFERENCE_KEYFRAME);
+
     // Compute Bag of Words vector
     mCurrentFrame.ComputeBoW();
 
@@ -851,6 +1992,7 @@ bool Tracking::TrackReferenceKeyFrame()
     vector<MapPoint*> vpMapPointMatches;
 
     int nmatches = matcher.SearchByBoW(mpReferenceKF,mCurrentFrame,vpMapPointMatches);
+    mvnStrategyMatches[PerformanceReport::REFERENCE_KEYFRAME] = nmatches;
 
     DLOG_IF(INFO, mVisualizeTracking()) << "Matched " << nmatches << "/" << mnAmountTrackedMapPointsKF
                                         << " map points between last and current frame using BoW";
@@ -880,8 +2022,7 @@ bool Tracking::TrackReferenceKeyFrame()
 
                 mCurrentFrame.mvpMapPoints[i]=static_cast<MapPoint*>(NULL);
                 mCurrentFrame.mvbOutlier[i]=false;
-                pMP->mbTrackInView = false;
-                pMP->mnLastFrameSeen = mCurrentFrame.mnId;
+                mCurrentFrame.mvpRejectedPoints.push_back(pMP);
                 nmatches--;
             }
             else if(mCurrentFrame.mvpMapPoints[i]->Observations()>0)
@@ -899,7 +2040,7 @@ void Tracking::UpdateLastFrame()
 {
     // Update pose according to reference keyframe
     KeyFrame* pRef = mLastFrame.mpReferenceKF;
-    cv::Mat Tlr = mlRelativeFramePoses.back();
+    cv::Mat Tlr = mTrajectory.GetLastRelativePose();
 
     mLastFrame.SetPose(Tlr*pRef->GetPose());
 
@@ -963,13 +2104,28 @@ void Tracking::UpdateLastFrame()
 
 bool Tracking::TrackWithMotionModel()
 {
+    STAGE_TIMER(TRACK_MOTION_MODEL);
+
     ORBmatcher matcher(0.9,true); //param
 
     // Update last frame pose according to its reference keyframe
     // Create "visual odometry" points if in Localization Mode
     UpdateLastFrame();
 
-    mCurrentFrame.SetPose(mVelocity*mLastFrame.mTcw);
+    mCurrentFrame.SetPose(PredictPose());
+
+    // Correct the prediction on the images, the points then land closer to their keypoints
+    bool bAligned = false;
+    if(mbImageAlignment)
+    {
+        STAGE_TIMER(IMAGE_ALIGNMENT);
+        ImageAlignment::Report report;
+        bAligned = mImageAlignment.Align(mLastFrame,mCurrentFrame,&report);
+        DLOG_IF(INFO, mVisualizeTracking()) << "Image alignment " << (bAligned ? "succeeded" : "failed") << " with "
+                                            << report.nPoints << " points in " << report.nIterations
+                                            << " iterations, error " << report.fErrorBefore << " -> "
+                                            << report.fErrorAfter;
+    }
 
     fill(mCurrentFrame.mvpMapPoints.begin(),mCurrentFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
 
@@ -979,6 +2135,8 @@ bool Tracking::TrackWithMotionModel()
         th=15; //param
     else
         th=7; //param
+    if(bAligned)
+        th = max(th/2,3); //param
     int nmatches = matcher.SearchByProjection(mCurrentFrame,mLastFrame,th,mSensor==System::MONOCULAR);
 
     DLOG_IF(INFO, mVisualizeTracking()) << "Matched " << nmatches << "/" << mnAmountTrackedMapPoints
@@ -995,6 +2153,7 @@ bool Tracking::TrackWithMotionModel()
         nmatches = matcher.SearchByProjection(mCurrentFrame,mLastFrame,2*th,mSensor==System::MONOCULAR); //param
         DLOG_IF(INFO, mVisualizeTracking()) << "Matched " << nmatches << " this time.";
     }
+    mvnStrategyMatches[PerformanceReport::MOTION_MODEL] = nmatches;
 
     if(nmatches<mnMinMatchesForTracking()) //param
     {
@@ -1019,8 +2178,7 @@ bool Tracking::TrackWithMotionModel()
 
                 mCurrentFrame.mvpMapPoints[i]=static_cast<MapPoint*>(NULL);
                 mCurrentFrame.mvbOutlier[i]=false;
-                pMP->mbTrackInView = false;
-                pMP->mnLastFrameSeen = mCurrentFrame.mnId;
+                mCurrentFrame.mvpRejectedPoints.push_back(pMP);
                 nmatches--;
             }
             else if(mCurrentFrame.mvpMapPoints[i]->Observations()>0)
@@ -1039,7 +2197,39 @@ bool Tracking::TrackWithMotionModel()
     return nmatchesMap>=10; //param
 }
 
-bool Tracking::TrackLocalMap()
+bool Tracking::RefinePose(KeyFrame* pRefKF, const cv::Mat &TcwRefOld, const bool bBigChange)
+{
+    TRACE_SCOPE("RefinePose");
+
+    // The camera stays where it was relative to its reference keyframe: Tcw*Tcw_ref_old^-1*Tcw_ref_new
+    if(pRefKF && !pRefKF->isBad())
+    {
+        const cv::Mat TcwRefNew = pRefKF->GetPose();
+        mCurrentFrame.SetPose(mCurrentFrame.mTcw*TcwRefOld.inv()*TcwRefNew);
+    }
+
+    // A loop correction or a merged global BA moved the local map, it is searched again
+    if(bBigChange || (pRefKF && pRefKF->isBad()))
+        return TrackLocalMap(false);
+
+    // The matches stay, only their positions changed
+    Optimizer::PoseOptimization(&mCurrentFrame);
+
+    mnMatchesInliers = 0;
+    for(int i=0; i<mCurrentFrame.N; i++)
+    {
+        MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+        if(pMP && !mCurrentFrame.mvbOutlier[i] && pMP->Observations()>0)
+            mnMatchesInliers++;
+    }
+
+    // As TrackLocalMap
+    if(mCurrentFrame.mnId<mnLastRelocFrameId+mMaxFrames && mnMatchesInliers<50) //param
+        return false;
+    return mnMatchesInliers>=30; //param
+}
+
+bool Tracking::TrackLocalMap(const bool bCount)
 {
     // We have an estimation of the camera pose and some map points tracked in the frame.
     // We retrieve the local map and try to find matches to points in the local map.
@@ -1049,11 +2239,49 @@ bool Tracking::TrackLocalMap()
 
     DLOG_IF(INFO, mVisualizeTracking()) << "Searching for more points of the local map which are "
                                         << "visible form the current frame.";
-    SearchLocalPoints();
+    SearchLocalPoints(bCount);
+    SearchLocalPointsRig(bCount);
 
     // Optimize Pose
     DLOG_IF(INFO, mVisualizeTracking()) << "Optimizing pose with all new found matches.";
-    Optimizer::PoseOptimization(&mCurrentFrame);
+    int nRigInliers = 0;
+    if(mvRigFrames.empty())
+        Optimizer::PoseOptimization(&mCurrentFrame);
+    else
+    {
+        vector<Frame*> vpRigFrames(mvRigFrames.size());
+        vector<cv::Mat> vTcr(mvRigFrames.size());
+        for(size_t i=0; i<mvRigFrames.size(); i++)
+        {
+            vpRigFrames[i] = &mvRigFrames[i];
+            vTcr[i] = mvRigCameras[i].Tcr;
+        }
+        Optimizer::PoseOptimization(&mCurrentFrame,vpRigFrames,vTcr);
+
+        // The outliers of the other cameras do not go into their keyframes
+        for(size_t i=0; i<mvRigFrames.size(); i++)
+        {
+            Frame &frame = mvRigFrames[i];
+            for(int j=0; j<frame.N; j++)
+            {
+                MapPoint* pMP = frame.mvpMapPoints[j];
+                if(!pMP)
+                    continue;
+                if(frame.mvbOutlier[j])
+                {
+                    frame.mvpMapPoints[j] = static_cast<MapPoint*>(NULL);
+                    frame.mvbOutlier[j] = false;
+                }
+                else
+                {
+                    if(bCount)
+                        pMP->IncreaseFound();
+                    nRigInliers++;
+                }
+            }
+        }
+        mbRigTracked = true;
+    }
     mnMatchesInliers = 0;
 
     // Update MapPoints Statistics
@@ -1063,7 +2291,8 @@ bool Tracking::TrackLocalMap()
         {
             if(!mCurrentFrame.mvbOutlier[i])
             {
-                mCurrentFrame.mvpMapPoints[i]->IncreaseFound();
+                if(bCount)
+                    mCurrentFrame.mvpMapPoints[i]->IncreaseFound();
                 if(!mbOnlyTracking)
                 {
                     if(mCurrentFrame.mvpMapPoints[i]->Observations()>0)
@@ -1078,24 +2307,27 @@ bool Tracking::TrackLocalMap()
         }
     }
 
+    // The other cameras of a rig count for the tracking, the keyframes are decided by the first one
+    const int nInliers = mnMatchesInliers+nRigInliers;
+
     // Decide if the tracking was succesful
     // More restrictive if there was a relocalization recently
-    if(mCurrentFrame.mnId<mnLastRelocFrameId+mMaxFrames && mnMatchesInliers<50) //param
+    if(mCurrentFrame.mnId<mnLastRelocFrameId+mMaxFrames && nInliers<50) //param
     {
         DLOG_IF(INFO, mVisualizeTracking()) << "Tracking failed because relocalized within the "
-            << "last second and only " << mnMatchesInliers << " matches considered to be inliers.";
+            << "last second and only " << nInliers << " matches considered to be inliers.";
         return false;
     }
 
-    if(mnMatchesInliers<30) //param
+    if(nInliers<30) //param
     {
-        DLOG_IF(INFO, mVisualizeTracking()) << "Tracking failed because only " << mnMatchesInliers
+        DLOG_IF(INFO, mVisualizeTracking()) << "Tracking failed because only " << nInliers
             << " matches were considered to be inliers.";
         return false;
     }
     else
     {
-        DLOG_IF(INFO, mVisualizeTracking()) << mnMatchesInliers << " points tracked in "
+        DLOG_IF(INFO, mVisualizeTracking()) << nInliers << " points tracked in "
             << "local map after optimization.";
         return true;
     }
@@ -1104,11 +2336,14 @@ bool Tracking::TrackLocalMap()
 
 bool Tracking::NeedNewKeyFrame()
 {
+    STAGE_TIMER(NEED_NEW_KEYFRAME);
+
     if(mbOnlyTracking)
         return false;
 
-    // If Local Mapping is freezed by a Loop Closure do not insert keyframes
-    if(mpLocalMapper->isStopped() || mpLocalMapper->stopRequested())
+    // If Local Mapping is freezed by a Loop Closure do not insert keyframes. Offline the
+    // keyframe waits for it instead (WaitForLocalMapping)
+    if(!mbOffline && (mpLocalMapper->isStopped() || mpLocalMapper->stopRequested()))
         return false;
 
     const int nKFs = mpMap->KeyFramesInMap();
@@ -1123,8 +2358,9 @@ bool Tracking::NeedNewKeyFrame()
         nMinObs=2;
     int nRefMatches = mpReferenceKF->TrackedMapPoints(nMinObs);
 
-    // Local Mapping accept keyframes?
-    bool bLocalMappingIdle = mpLocalMapper->AcceptKeyFrames();
+    // Local Mapping accept keyframes? Offline the decision must not depend on how far it got,
+    // the keyframe waits until it does
+    bool bLocalMappingIdle = mbOffline || mpLocalMapper->AcceptKeyFrames();
 
     // Check how many "close" points are being tracked and how many could be potentially created.
     int nNonTrackedClose = 0;
@@ -1146,12 +2382,7 @@ bool Tracking::NeedNewKeyFrame()
     bool bNeedToInsertClose = (nTrackedClose<100) && (nNonTrackedClose>70); //param
 
     // Thresholds
-    float thRefRatio = 0.75f; //param
-    if(nKFs<2)
-        thRefRatio = 0.4f; //param
-
-    if(mSensor==System::MONOCULAR)
-        thRefRatio = 0.9f; //param
+    const float thRefRatio = KeyFrameRefRatio(nKFs);
 
     // Condition 1a: More than "MaxFrames" have passed from last keyframe insertion
     const bool c1a = mCurrentFrame.mnId>=mnLastKeyFrameId+mMaxFrames;
@@ -1165,41 +2396,74 @@ bool Tracking::NeedNewKeyFrame()
     if((c1a||c1b||c1c)&&c2)
     {
         // If the mapping accepts keyframes, insert keyframe.
-        // Otherwise send a signal to interrupt BA
+        // Otherwise the policy decides whether to interrupt BA
+        mbKeyFrameInterruptsBA = true;
         if(bLocalMappingIdle)
-        {
             return true;
-        }
-        else
-        {
+
+        const double interval = mpLastKeyFrame ? mCurrentFrame.mTimeStamp-mpLastKeyFrame->mTimeStamp : 0;
+        const KeyFramePolicy::Decision decision =
+                mKeyFramePolicy.Decide(interval,mpLocalMapper->KeyframesInQueue(),mpLocalMapper->GetKeyFrameCost(),c1c);
+        if(decision==KeyFramePolicy::INSERT || decision==KeyFramePolicy::INTERRUPT)
             mpLocalMapper->InterruptBA();
-            if(mSensor!=System::MONOCULAR)
-            {
-                if(mpLocalMapper->KeyframesInQueue()<3) //param
-                {
-                    return true;
-                }
-                else
-                {
-                    DLOG_IF(INFO, mVisualizeTracking()) << "Couldn't insert keyframe, too many in "
-                        << "local mapping queue already";
-                    return false;
-                }
-            }
-            else
-                return false;
-        }
+        if(decision==KeyFramePolicy::QUEUE)
+            mbKeyFrameInterruptsBA = false;
+        if(decision==KeyFramePolicy::INTERRUPT || decision==KeyFramePolicy::POSTPONE)
+            mpLocalMapper->PostponedKeyFrame();
+
+        DLOG_IF(INFO, mVisualizeTracking() && (decision==KeyFramePolicy::INTERRUPT ||
+                decision==KeyFramePolicy::POSTPONE) && mSensor!=System::MONOCULAR)
+            << "Couldn't insert keyframe, too many in local mapping queue already";
+        return decision==KeyFramePolicy::INSERT || decision==KeyFramePolicy::QUEUE;
     }
     else
         return false;
 }
 
+void Tracking::WaitForLocalMapping(MapUpdateLock &lock)
+{
+    TRACE_SCOPE("WaitForLocalMapping");
+
+    // Local Mapping needs the map to finish its keyframe
+    lock.unlock();
+    while(!mpLocalMapper->isFinished() &&
+          (!mpLocalMapper->isIdle() || mpLocalMapper->isStopped() || mpLocalMapper->stopRequested()))
+        usleep(500);
+    lock.lock();
+}
+
+void Tracking::WaitForMapping(MapUpdateLock &lock)
+{
+    TRACE_SCOPE("WaitForMapping");
+
+    // Local Mapping hands the keyframe to Loop Closing before it is idle, a loop it closes
+    // stops Local Mapping until the correction (and its Global BA) is done
+    lock.unlock();
+    while(!mpLocalMapper->isFinished() && (!mpLocalMapper->isIdle() || !mpLoopClosing->isIdle()))
+        usleep(500);
+    lock.lock();
+}
+
+float Tracking::KeyFrameRefRatio(const int nKFs) const
+{
+    if(mSensor==System::MONOCULAR)
+        return 0.9f; //param
+    if(nKFs<2)
+        return 0.4f; //param
+    return 0.75f; //param
+}
+
 void Tracking::CreateNewKeyFrame()
 {
+    TRACE_SCOPE("CreateNewKeyFrame");
+
     if(!mpLocalMapper->SetNotStop(true))
         return;
 
     KeyFrame* pKF = new KeyFrame(mCurrentFrame,mpMap,mpKeyFrameDB);
+    pKF->mnMapId = mpReferenceKF->mnMapId.load();
+    AddThumbnail(pKF);
+    StoreDepth(pKF);
 
     mpReferenceKF = pKF;
     mCurrentFrame.mpReferenceKF = pKF;
@@ -1266,7 +2530,29 @@ void Tracking::CreateNewKeyFrame()
         }
     }
 
-    mpLocalMapper->InsertKeyFrame(pKF);
+    // The other cameras of a rig take their keyframes at the same time. They hang below the
+    // keyframe of the first camera in the spanning tree, a camera which sees no map point yet
+    // has no covisible keyframe to get its parent from.
+    if(mbRigTracked)
+    {
+        for(size_t i=0; i<mvRigFrames.size(); i++)
+        {
+            KeyFrame* pRigKF = new KeyFrame(mvRigFrames[i],mpMap,mpKeyFrameDB);
+            pRigKF->mnMapId = pKF->mnMapId.load();
+            pRigKF->mpRigKF = pKF;
+            pRigKF->mnRigCamera = i+1;
+            pRigKF->mTcr = mvRigCameras[i].Tcr.clone();
+            pRigKF->mpPrevRigKF = mvRigCameras[i].pLastKF;
+            pRigKF->ChangeParent(pKF);
+            pKF->mvpRigKFs.push_back(pRigKF);
+            mvRigCameras[i].pLastKF = pRigKF;
+        }
+    }
+
+    mpLocalMapper->InsertKeyFrame(pKF,mbKeyFrameInterruptsBA);
+    for(size_t i=0; i<pKF->mvpRigKFs.size(); i++)
+        mpLocalMapper->InsertKeyFrame(pKF->mvpRigKFs[i],mbKeyFrameInterruptsBA);
+    mbKeyFrameInterruptsBA = true;
 
     mpLocalMapper->SetNotStop(false);
 
@@ -1274,10 +2560,13 @@ void Tracking::CreateNewKeyFrame()
     mpLastKeyFrame = pKF;
 }
 
-void Tracking::SearchLocalPoints()
+void Tracking::SearchLocalPoints(const bool bCount)
 {
-    // // Do not search map points already matched
+    STAGE_TIMER(SEARCH_LOCAL_POINTS);
+
+    // // Do not search map points already matched, nor the outliers of the pose
     int nExistingMatches = 0;
+    vector<MapPoint*> vpExcluded = mCurrentFrame.mvpRejectedPoints;
     for(vector<MapPoint*>::iterator vit=mCurrentFrame.mvpMapPoints.begin(), vend=mCurrentFrame.mvpMapPoints.end(); vit!=vend; vit++)
     {
         MapPoint* pMP = *vit;
@@ -1289,31 +2578,21 @@ void Tracking::SearchLocalPoints()
             }
             else
             {
-                pMP->IncreaseVisible();
-                pMP->mnLastFrameSeen = mCurrentFrame.mnId;
-                pMP->mbTrackInView = false;
+                if(bCount)
+                    pMP->IncreaseVisible();
+                vpExcluded.push_back(pMP);
                 nExistingMatches++;
             }
         }
     }
-
-    int nToMatch=0;
-
-    // Project points in frame and check its visibility
-    for(vector<MapPoint*>::iterator vit=mvpLocalMapPoints.begin(), vend=mvpLocalMapPoints.end(); vit!=vend; vit++)
-    {
-        MapPoint* pMP = *vit;
-        if(pMP->mnLastFrameSeen == mCurrentFrame.mnId)
-            continue;
-        if(pMP->isBad())
-            continue;
-        // Project (this fills MapPoint variables for matching)
-        if(mCurrentFrame.isInFrustum(pMP,0.5)) //param
-        {
-            pMP->IncreaseVisible();
-            nToMatch++;
-        }
-    }
+    sort(vpExcluded.begin(),vpExcluded.end());
+
+    // Project points in frame and check its visibility (this fills the projections of the frame for matching)
+    mCurrentFrame.ProjectLocalMap(mLocalMapGeometry,0.5,vpExcluded); //param
+    const int nToMatch = mCurrentFrame.mProjections.Size();
+    if(bCount)
+        for(int i=0; i<nToMatch; i++)
+            mCurrentFrame.mProjections.vpMapPoints[i]->IncreaseVisible();
     DLOG_IF(INFO, mVisualizeTracking()) << "Now trying to match " << nToMatch << " map points which"
                                         << " should be visible from the current frame.";
 
@@ -1327,54 +2606,193 @@ void Tracking::SearchLocalPoints()
         // If the camera has been relocalised recently, perform a coarser search
         if(mCurrentFrame.mnId<mnLastRelocFrameId+2)
             th=5; //param
-        nMatchesFound = matcher.SearchByProjection(mCurrentFrame,mvpLocalMapPoints,th);
+        nMatchesFound = matcher.SearchByProjection(mCurrentFrame,th*mLatencyKnobs.fSearchRadiusScale);
     }
+    mvnStrategyMatches[PerformanceReport::LOCAL_MAP] = nMatchesFound;
     DLOG_IF(INFO, mVisualizeTracking()) << "Found matches for " << nMatchesFound << "/" << nToMatch
                                         << " of them.";
     DLOG_IF(INFO, mVisualizeTracking()) << "Total matches between map points and features in current"
         << " frame:" << nMatchesFound + nExistingMatches;
 }
 
-void Tracking::UpdateLocalMap() //param
+void Tracking::SearchLocalPointsRig(const bool bCount)
+{
+    if(mvRigFrames.empty())
+        return;
+
+    STAGE_TIMER(SEARCH_LOCAL_POINTS);
+
+    ORBmatcher matcher(0.8); //param
+    int th = 1; //param
+    if(mCurrentFrame.mnId<mnLastRelocFrameId+2)
+        th=5; //param
+
+    for(size_t i=0; i<mvRigFrames.size(); i++)
+    {
+        Frame &frame = mvRigFrames[i];
+        frame.SetPose(mvRigCameras[i].Tcr*mCurrentFrame.mTcw);
+
+        // Every point of the local map is projected again, the ones the first camera matched
+        // may be seen by this camera as well
+        frame.ProjectLocalMap(mLocalMapGeometry,0.5); //param
+        const int nToMatch = frame.mProjections.Size();
+        if(bCount)
+            for(int j=0; j<nToMatch; j++)
+                frame.mProjections.vpMapPoints[j]->IncreaseVisible();
+
+        int nMatchesFound = 0;
+        if(nToMatch>0)
+            nMatchesFound = matcher.SearchByProjection(frame,th);
+        DLOG_IF(INFO, mVisualizeTracking()) << "Rig camera " << i+1 << ": found matches for "
+                                            << nMatchesFound << "/" << nToMatch << " map points.";
+    }
+}
+
+void Tracking::UpdateLocalMap() //param
+{
+    // This is for visualization, of the camera of the System
+    if(!mbStream)
+        mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
+
+    // Update, the points are only collected again if the local keyframes changed
+    if(UpdateLocalKeyFrames())
+        UpdateLocalPoints();
+    else
+    {
+        for(size_t i=0; i<mvpLocalMapPoints.size();)
+        {
+            if(mvpLocalMapPoints[i]->isBad())
+            {
+                mvpLocalMapPoints[i] = mvpLocalMapPoints.back();
+                mvpLocalMapPoints.pop_back();
+            }
+            else
+                i++;
+        }
+    }
+    mLocalMapGeometry.Build(mvpLocalMapPoints);
+}
+
+void Tracking::InvalidateLocalMap()
+{
+    mvpLocalMapVotedKFs.clear();
+    mvnLocalKeyFramesChangeIdx.clear();
+}
+
+bool Tracking::LocalKeyFramesChanged()
 {
-    // This is for visualization
-    mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
+    if(mvnLocalKeyFramesChangeIdx.size()!=mvpLocalKeyFrames.size())
+        return true;
+
+    for(size_t i=0; i<mvpLocalKeyFrames.size(); i++)
+    {
+        if(mvpLocalKeyFrames[i]->GetChangeIdx()!=mvnLocalKeyFramesChangeIdx[i])
+            return true;
+    }
 
-    // Update
-    UpdateLocalKeyFrames();
-    UpdateLocalPoints();
+    return false;
 }
 
 void Tracking::UpdateLocalPoints()
 {
     mvpLocalMapPoints.clear();
 
+    // The points of the neighborhood which local mapping published for the reference keyframe
+    // (its covisible keyframes) are taken as they are, the local keyframes in it are not read
+    // again. Only while none of its keyframes changed.
+    LocalNeighborhoods::Snapshot pNeighborhood;
+    if(mpReferenceKF)
+        pNeighborhood = mpMap->mNeighborhoods.Get(mpReferenceKF);
+    if(pNeighborhood && !pNeighborhood->IsCurrent())
+        pNeighborhood.reset();
+    if(pNeighborhood)
+    {
+        const vector<MapPoint*> &vpMPs = pNeighborhood->vpMapPoints;
+        mvpLocalMapPoints.reserve(vpMPs.size());
+        for(size_t i=0; i<vpMPs.size(); i++)
+        {
+            MapPoint* pMP = vpMPs[i];
+            if(pMP->isBad() || !MarkLocalMap(pMP))
+                continue;
+            mvpLocalMapPoints.push_back(pMP);
+        }
+    }
+
     for(vector<KeyFrame*>::const_iterator itKF=mvpLocalKeyFrames.begin(), itEndKF=mvpLocalKeyFrames.end(); itKF!=itEndKF; itKF++)
     {
         KeyFrame* pKF = *itKF;
-        const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
+        if(pNeighborhood && pNeighborhood->Contains(pKF))
+            continue;
+        const KeyFrame::MapPointMatchesSnapshot pMatches = pKF->GetMapPointMatchesSnapshot();
+        const vector<MapPoint*> &vpMPs = *pMatches;
 
         for(vector<MapPoint*>::const_iterator itMP=vpMPs.begin(), itEndMP=vpMPs.end(); itMP!=itEndMP; itMP++)
         {
             MapPoint* pMP = *itMP;
             if(!pMP)
                 continue;
-            if(pMP->mnTrackReferenceForFrame==mCurrentFrame.mnId)
-                continue;
-            if(!pMP->isBad())
-            {
+            if(!pMP->isBad() && MarkLocalMap(pMP))
                 mvpLocalMapPoints.push_back(pMP);
-                pMP->mnTrackReferenceForFrame=mCurrentFrame.mnId;
-            }
         }
     }
+
+    // Points nearby which the covisibility graph misses, e.g. after a loop correction when the
+    // two sides of the loop are not connected yet
+    if(mfLocalMapRadius>0 && mpReferenceKF && mpMap->mPointIndex.IsEnabled())
+    {
+        Eigen::Vector3f Ow;
+        mpReferenceKF->GetCameraCenter(Ow);
+        vector<MapPoint*> vpNearMPs;
+        mpMap->mPointIndex.GetPointsInRadius(Ow,mfLocalMapRadius,vpNearMPs);
+        for(size_t i=0; i<vpNearMPs.size(); i++)
+        {
+            MapPoint* pMP = vpNearMPs[i];
+            // The other maps of the atlas have their own coordinates, they are marked as well
+            if(pMP->isBad() || !MarkLocalMap(pMP))
+                continue;
+            if(pMP->GetReferenceKeyFrame()->mnMapId!=mpReferenceKF->mnMapId)
+                continue;
+            mvpLocalMapPoints.push_back(pMP);
+        }
+    }
+}
+
+
+bool Tracking::MarkLocalMap(MapPoint* pMP)
+{
+    if(mbStream)
+        return MarkLocalMap(mvMapPointMarks,pMP->mnId);
+    if(pMP->mnTrackReferenceForLocalMap==mnLocalMapGeneration)
+        return false;
+    pMP->mnTrackReferenceForLocalMap=mnLocalMapGeneration;
+    return true;
 }
 
+bool Tracking::MarkLocalMap(KeyFrame* pKF)
+{
+    if(mbStream)
+        return MarkLocalMap(mvKeyFrameMarks,pKF->mnId);
+    if(pKF->mnTrackReferenceForLocalMap==mnLocalMapGeneration)
+        return false;
+    pKF->mnTrackReferenceForLocalMap=mnLocalMapGeneration;
+    return true;
+}
+
+bool Tracking::MarkLocalMap(vector<unsigned long> &vMarks, const unsigned long nId)
+{
+    if(nId>=vMarks.size())
+        vMarks.resize(max(nId+1,2*vMarks.size()),0);
+    if(vMarks[nId]==mnLocalMapGeneration)
+        return false;
+    vMarks[nId]=mnLocalMapGeneration;
+    return true;
+}
 
-void Tracking::UpdateLocalKeyFrames()
+bool Tracking::UpdateLocalKeyFrames()
 {
     // Each map point vote for the keyframes in which it has been observed
-    map<KeyFrame*,int> keyframeCounter;
+    vector<KeyFrame*> vpVotes;
+    vpVotes.reserve(4*mCurrentFrame.N);
     for(int i=0; i<mCurrentFrame.N; i++)
     {
         if(mCurrentFrame.mvpMapPoints[i])
@@ -1382,9 +2800,10 @@ void Tracking::UpdateLocalKeyFrames()
             MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
             if(!pMP->isBad())
             {
-                const map<KeyFrame*,size_t> observations = pMP->GetObservations();
-                for(map<KeyFrame*,size_t>::const_iterator it=observations.begin(), itend=observations.end(); it!=itend; it++)
-                    keyframeCounter[it->first]++;
+                const MapPoint::ObservationsSnapshot pObservations = pMP->GetObservationsSnapshot();
+                const ObservationList &observations = *pObservations;
+                for(ObservationList::const_iterator it=observations.begin(), itend=observations.end(); it!=itend; it++)
+                    vpVotes.push_back(it->first);
             }
             else
             {
@@ -1393,31 +2812,72 @@ void Tracking::UpdateLocalKeyFrames()
         }
     }
 
-    if(keyframeCounter.empty())
-        return;
+    // No votes, the local keyframes are kept and their points collected again if they changed
+    if(vpVotes.empty())
+    {
+        if(!LocalKeyFramesChanged())
+            return false;
+
+        mnLocalMapGeneration++;
+        mvnLocalKeyFramesChangeIdx.resize(mvpLocalKeyFrames.size());
+        for(size_t i=0; i<mvpLocalKeyFrames.size(); i++)
+            mvnLocalKeyFramesChangeIdx[i] = mvpLocalKeyFrames[i]->GetChangeIdx();
+        return true;
+    }
 
     int max=0;
     KeyFrame* pKFmax= static_cast<KeyFrame*>(NULL);
 
-    mvpLocalKeyFrames.clear();
-    mvpLocalKeyFrames.reserve(3*keyframeCounter.size());
-
-    // All keyframes that observe a map point are included in the local map. Also check which keyframe shares most points
-    for(map<KeyFrame*,int>::const_iterator it=keyframeCounter.begin(), itEnd=keyframeCounter.end(); it!=itEnd; it++)
+    // All keyframes that observe a map point are included in the local map. Also check which keyframe shares most points.
+    // Sorted, the keyframes are visited in the same order as with a map of the votes.
+    sort(vpVotes.begin(),vpVotes.end());
+    vector<KeyFrame*> vpVotedKFs;
+    vpVotedKFs.reserve(vpVotes.size());
+    for(size_t i=0, iend=vpVotes.size(); i<iend;)
     {
-        KeyFrame* pKF = it->first;
+        KeyFrame* pKF = vpVotes[i];
+        size_t j=i+1;
+        while(j<iend && vpVotes[j]==pKF)
+            j++;
+        const int nVotes = j-i;
+        i=j;
 
         if(pKF->isBad())
             continue;
 
-        if(it->second>max)
+        if(nVotes>max)
         {
-            max=it->second;
+            max=nVotes;
             pKFmax=pKF;
         }
 
-        mvpLocalKeyFrames.push_back(it->first);
-        pKF->mnTrackReferenceForFrame = mCurrentFrame.mnId;
+        vpVotedKFs.push_back(pKF);
+    }
+
+    if(pKFmax)
+    {
+        // The reference of a rig is a keyframe of the first camera, which it tracks with
+        mpReferenceKF = pKFmax->GetRigBody();
+        mCurrentFrame.mpReferenceKF = mpReferenceKF;
+    }
+
+    if(vpVotedKFs==mvpLocalMapVotedKFs && !LocalKeyFramesChanged())
+        return false;
+
+    mnLocalMapGeneration++;
+    mvpLocalMapVotedKFs = vpVotedKFs;
+
+    // The change index of a keyframe is taken before it is read, a change in between is seen in
+    // the next frame. The neighbors are added while iterating, at most 3 per keyframe until there
+    // are more than nMaxLocalKeyFrames, so the vector must not reallocate.
+    mvpLocalKeyFrames.clear();
+    mvpLocalKeyFrames.reserve(std::max<size_t>(vpVotedKFs.size(),mLatencyKnobs.nMaxLocalKeyFrames)+3);
+    mvnLocalKeyFramesChangeIdx.clear();
+    for(vector<KeyFrame*>::const_iterator itKF=vpVotedKFs.begin(), itEndKF=vpVotedKFs.end(); itKF!=itEndKF; itKF++)
+    {
+        mvpLocalKeyFrames.push_back(*itKF);
+        mvnLocalKeyFramesChangeIdx.push_back((*itKF)->GetChangeIdx());
+        MarkLocalMap(*itKF);
     }
 
 
@@ -1425,24 +2885,24 @@ void Tracking::UpdateLocalKeyFrames()
     for(vector<KeyFrame*>::const_iterator itKF=mvpLocalKeyFrames.begin(), itEndKF=mvpLocalKeyFrames.end(); itKF!=itEndKF; itKF++)
     {
         // Limit the number of keyframes
-        if(mvpLocalKeyFrames.size()>80) //param
+        if(mvpLocalKeyFrames.size()>static_cast<size_t>(mLatencyKnobs.nMaxLocalKeyFrames))
             break;
 
         KeyFrame* pKF = *itKF;
 
-        const vector<KeyFrame*> vNeighs = pKF->GetBestCovisibilityKeyFrames(10); //param
+        // Read in place, this runs for every local keyframe of every frame
+        const KeyFrame::CovisibilitySnapshot pNeighs = pKF->GetCovisibilitySnapshot();
+        const vector<KeyFrame*> &vNeighs = pNeighs->KeyFrames();
+        const size_t nNeighs = min(pNeighs->NumOrdered(),static_cast<size_t>(10)); //param
 
-        for(vector<KeyFrame*>::const_iterator itNeighKF=vNeighs.begin(), itEndNeighKF=vNeighs.end(); itNeighKF!=itEndNeighKF; itNeighKF++)
+        for(size_t iNeigh=0; iNeigh<nNeighs; iNeigh++)
         {
-            KeyFrame* pNeighKF = *itNeighKF;
-            if(!pNeighKF->isBad())
+            KeyFrame* pNeighKF = vNeighs[iNeigh];
+            if(!pNeighKF->isBad() && MarkLocalMap(pNeighKF))
             {
-                if(pNeighKF->mnTrackReferenceForFrame!=mCurrentFrame.mnId)
-                {
-                    mvpLocalKeyFrames.push_back(pNeighKF);
-                    pNeighKF->mnTrackReferenceForFrame=mCurrentFrame.mnId;
-                    break;
-                }
+                mvpLocalKeyFrames.push_back(pNeighKF);
+                mvnLocalKeyFramesChangeIdx.push_back(pNeighKF->GetChangeIdx());
+                break;
             }
         }
 
@@ -1450,47 +2910,105 @@ void Tracking::UpdateLocalKeyFrames()
         for(set<KeyFrame*>::const_iterator sit=spChilds.begin(), send=spChilds.end(); sit!=send; sit++)
         {
             KeyFrame* pChildKF = *sit;
-            if(!pChildKF->isBad())
+            if(!pChildKF->isBad() && MarkLocalMap(pChildKF))
             {
-                if(pChildKF->mnTrackReferenceForFrame!=mCurrentFrame.mnId)
-                {
-                    mvpLocalKeyFrames.push_back(pChildKF);
-                    pChildKF->mnTrackReferenceForFrame=mCurrentFrame.mnId;
-                    break;
-                }
+                mvpLocalKeyFrames.push_back(pChildKF);
+                mvnLocalKeyFramesChangeIdx.push_back(pChildKF->GetChangeIdx());
+                break;
             }
         }
 
         KeyFrame* pParent = pKF->GetParent();
-        if(pParent)
+        if(pParent && MarkLocalMap(pParent))
         {
-            if(pParent->mnTrackReferenceForFrame!=mCurrentFrame.mnId)
-            {
-                mvpLocalKeyFrames.push_back(pParent);
-                pParent->mnTrackReferenceForFrame=mCurrentFrame.mnId;
-                break;
-            }
+            mvpLocalKeyFrames.push_back(pParent);
+            mvnLocalKeyFramesChangeIdx.push_back(pParent->GetChangeIdx());
+            break;
         }
 
     }
 
-    if(pKFmax)
+    // The keyframes the other cameras of a rig took with the local keyframes
+    if(!mvRigCameras.empty())
     {
-        mpReferenceKF = pKFmax;
-        mCurrentFrame.mpReferenceKF = mpReferenceKF;
+        for(size_t i=0, iend=mvpLocalKeyFrames.size(); i<iend; i++)
+        {
+            KeyFrame* pBody = mvpLocalKeyFrames[i]->GetRigBody();
+            for(size_t j=0, jend=pBody->mvpRigKFs.size(); j<=jend; j++)
+            {
+                KeyFrame* pRigKF = j==0 ? pBody : pBody->mvpRigKFs[j-1];
+                if(pRigKF->isBad() || !MarkLocalMap(pRigKF))
+                    continue;
+                mvpLocalKeyFrames.push_back(pRigKF);
+                mvnLocalKeyFramesChangeIdx.push_back(pRigKF->GetChangeIdx());
+            }
+        }
     }
+
+    return true;
 }
 
 bool Tracking::Relocalization()
 {
+    STAGE_TIMER(RELOCALIZATION);
+
     DLOG_IF(INFO, mVisualizeRelocalization()) << "+++++++++++++++++++++++++++++++++++++++++++"
                                         << " RELOCALIZATION";
+
+    // First pass: the keyframes whose thumbnails are nearest to the image, from their poses.
+    // After a short occlusion one of them is where the camera is, the BoW query is not needed.
+    if(mbThumbnailIndex && mpKeyFrameDB->HasThumbnails())
+    {
+        vector<uint8_t> signature;
+        ThumbnailIndex::Compute(mImGray,signature);
+        vector<ThumbnailIndex::Match> vMatches;
+        mpKeyFrameDB->DetectThumbnailCandidates(signature,THUMBNAIL_CANDIDATES,
+                                                THUMBNAIL_MAX_DIFFERENCE*ThumbnailIndex::SIZE,vMatches);
+        for(size_t i=0; i<vMatches.size(); i++)
+        {
+            cv::Mat Tcw;
+            vector<MapPoint*> vpMapPoints;
+            vector<bool> vbOutlier;
+            if(!EvaluateThumbnailCandidate(vMatches[i].pKF,Tcw,vpMapPoints,vbOutlier))
+                continue;
+
+            mCurrentFrame.SetPose(Tcw);
+            mCurrentFrame.mvpMapPoints = vpMapPoints;
+            mCurrentFrame.mvbOutlier = vbOutlier;
+
+            mnLastRelocFrameId = mCurrentFrame.mnId;
+            int nInliers = 0;
+            for(size_t j=0; j<vpMapPoints.size(); j++)
+                if(vpMapPoints[j] && !vbOutlier[j])
+                    nInliers++;
+            mvnStrategyMatches[PerformanceReport::RELOCALIZATION] = nInliers;
+            DLOG_IF(INFO, mVisualizeRelocalization()) << "Relocalization successful from the thumbnail of "
+                                                      << "keyframe " << vMatches[i].pKF->mnId << ".";
+            return true;
+        }
+        DLOG_IF(INFO, mVisualizeRelocalization()) << vMatches.size() << " thumbnail candidates failed.";
+    }
+
     // Compute Bag of Words Vector
     mCurrentFrame.ComputeBoW();
 
     // Relocalization is performed when tracking is lost
     // Track Lost: Query KeyFrame Database for keyframe candidates for relocalisation
-    vector<KeyFrame*> vpCandidateKFs = mpKeyFrameDB->DetectRelocalizationCandidates(&mCurrentFrame);
+    // The prior only prunes the keyframes of the map of the last reference keyframe
+    KeyFrameDatabase::PosePrior prior;
+    bool bPrior = false;
+    {
+        unique_lock<mutex> lock(mMutexPosePrior);
+        if(mfPosePriorRadius>0 && mpReferenceKF)
+        {
+            prior.center = mPosePriorCenter;
+            prior.fRadius = mfPosePriorRadius;
+            prior.nMapId = mpReferenceKF->mnMapId;
+            bPrior = true;
+        }
+    }
+    vector<KeyFrame*> vpCandidateKFs = mpKeyFrameDB->DetectRelocalizationCandidates(&mCurrentFrame,mpRelocalizationThreadPool,
+                                                                                    bPrior ? &prior : NULL);
 
     if(vpCandidateKFs.empty())
     {
@@ -1502,186 +3020,289 @@ bool Tracking::Relocalization()
     const int nKFs = vpCandidateKFs.size();
     DLOG_IF(INFO, mVisualizeRelocalization()) << "Found " << nKFs << " candidates for relocalization";
 
-    // We perform first an ORB matching with each candidate
-    // If enough matches are found we setup a PnP solver
-    ORBmatcher matcher(0.75,true); //param
+    //TODO : if last velocities were known this could check keyframes in an area
+    //that increases with time relative to the last known velocity
+    //might avoid relocalizations somwhere completely different and reduce search cost
+    //heading INFO from imu would also help to exclude keyframes
+
+    // The candidates are evaluated in parallel, each one on its own copy of the current frame.
+    // The first candidate whose pose is supported by enough inliers stops all the others.
+    std::atomic<bool> bMatch(false);
+    std::atomic<int> nCandidates(0);
+    cv::Mat Tcw;
+    vector<MapPoint*> vpMapPoints;
+    vector<bool> vbOutlier;
+
+    // With the batch matching the BoW matches of all candidates come first, in one batch, and the
+    // candidates with the most matches are verified first
+    vector<vector<MapPoint*> > vvpBoWMatches;
+    vector<int> vnOrder(nKFs);
+    for(int i=0; i<nKFs; i++)
+        vnOrder[i] = i;
+    if(mbBatchMatching)
+    {
+        BowDistanceBatch batch;
+        batch.Compute(mCurrentFrame,vpCandidateKFs);
+        vvpBoWMatches.resize(nKFs);
+        vector<int> vnBoWMatches(nKFs);
+        mpRelocalizationThreadPool->ParallelFor(nKFs, [&](int i)
+        {
+            ORBmatcher matcher(0.75,true); //param same as in EvaluateRelocalizationCandidate
+            vnBoWMatches[i] = matcher.SearchByBoW(batch,i,vpCandidateKFs[i],mCurrentFrame,vvpBoWMatches[i]);
+        });
+        stable_sort(vnOrder.begin(),vnOrder.end(),[&](const int a, const int b)
+        {
+            return vnBoWMatches[a]>vnBoWMatches[b];
+        });
+    }
+
+    mpRelocalizationThreadPool->ParallelFor(nKFs, [&](int k)
+    {
+        const int i = vnOrder[k];
+        EvaluateRelocalizationCandidate(vpCandidateKFs[i], i, bMatch, nCandidates, Tcw, vpMapPoints, vbOutlier,
+                                        vvpBoWMatches.empty() ? NULL : &vvpBoWMatches[i]);
+    });
+
+    DLOG_IF(INFO, mVisualizeRelocalization()) << nCandidates.load() << "/" << nKFs << " had more than 15"
+                                              << " matches with current frame, rest discarded.";
 
-    vector<PnPsolver*> vpPnPsolvers;
-    vpPnPsolvers.resize(nKFs);
+    if(!bMatch)
+    {
+        DLOG_IF(INFO, mVisualizeRelocalization()) << "Relocalization failed, no candidate had"
+                                                  << " enough matches with current frame.";
+        return false;
+    }
+    else
+    {
+        mCurrentFrame.SetPose(Tcw);
+        mCurrentFrame.mvpMapPoints = vpMapPoints;
+        mCurrentFrame.mvbOutlier = vbOutlier;
 
-    vector<vector<MapPoint*> > vvpMapPointMatches;
-    vvpMapPointMatches.resize(nKFs);
+        mnLastRelocFrameId = mCurrentFrame.mnId;
+        int nInliers = 0;
+        for(size_t i=0; i<vpMapPoints.size(); i++)
+            if(vpMapPoints[i] && !vbOutlier[i])
+                nInliers++;
+        mvnStrategyMatches[PerformanceReport::RELOCALIZATION] = nInliers;
+        DLOG_IF(INFO, mVisualizeRelocalization()) << "Relocalization successful.";
+        return true;
+    }
 
-    vector<bool> vbDiscarded;
-    vbDiscarded.resize(nKFs);
+}
 
-    int nCandidates=0;
-    int numMapPointsTrackedInCandidate = 0;
+bool Tracking::EvaluateRelocalizationCandidate(KeyFrame* pKF, const int nIndex, std::atomic<bool> &bMatch,
+                                               std::atomic<int> &nCandidates, cv::Mat &Tcw,
+                                               vector<MapPoint*> &vpMapPoints, vector<bool> &vbOutlier,
+                                               const vector<MapPoint*>* pvpBoWMatches)
+{
+    if(bMatch || pKF->isBad())
+        return false;
 
-    //TODO : if last velocities were known this could check keyframes in an area
-    //that increases with time relative to the last known velocity
-    //might avoid relocalizations somwhere completely different and reduce search cost
-    //heading INFO from imu would also help to exclude keyframes
+    // We perform first an ORB matching with the candidate
+    // If enough matches are found we setup a PnP solver
+    ORBmatcher matcher(0.75,true); //param
 
-    //search matches between the candidate keyframes' mappoints and current frames keypoints
+    //search matches between the candidate keyframe's mappoints and current frames keypoints
     //TODO : One could probably filter all candidates which track less than 50 map points, since in
     // the end at lest 50 matches have to be found for relocalization anyway.
-    for(int i=0; i<nKFs; i++)
+    vector<MapPoint*> vpMapPointMatches;
+    int nmatches = 0;
+    if(pvpBoWMatches)
     {
-        KeyFrame* pKF = vpCandidateKFs[i];
-        if(pKF->isBad())
-            vbDiscarded[i] = true;
-        else
+        vpMapPointMatches = *pvpBoWMatches;
+        nmatches = vpMapPointMatches.size()-count(vpMapPointMatches.begin(),vpMapPointMatches.end(),
+                                                  static_cast<MapPoint*>(NULL));
+    }
+    else
+        nmatches = matcher.SearchByBoW(pKF,mCurrentFrame,vpMapPointMatches);
+    // if less than 15 keypoints are matched consider the frame to be a mismatch
+    if(nmatches<15) //param
+        return false;
+
+    if(mVisualizeRelocalization())
+    {
+        int numMapPointsTrackedInCandidate = 0;
+        for(auto& mapPoint : pKF->GetMapPointMatches())
         {
-            int nmatches = matcher.SearchByBoW(pKF,mCurrentFrame,vvpMapPointMatches[i]);
-            // if less than 15 keypoints are matched consider the frame to be a mismatch
-            if(nmatches<15) //param
-            {
-                vbDiscarded[i] = true;
-                continue;
-            }
-            else
+            if(mapPoint)
             {
-                if(mVisualizeRelocalization())
-                {
-                    numMapPointsTrackedInCandidate = 0;
-                    for(auto& mapPoint : pKF->GetMapPointMatches())
-                    {
-                        if(mapPoint)
-                        {
-                            numMapPointsTrackedInCandidate++;
-                        }
-                    }
-                }
-                DLOG_IF(INFO, mVisualizeRelocalization()) << "Keyframe " << i << " accepted as "
-                                                          << "candidate, was able to match "
-                                                          << nmatches << "/"
-                                                          << numMapPointsTrackedInCandidate
-                                                          << " of it's" << " tracked map points.";
-                PnPsolver* pSolver = new PnPsolver(mCurrentFrame,vvpMapPointMatches[i]);
-                pSolver->SetRansacParameters(0.99,10,300,4,0.5,5.991); //param
-                vpPnPsolvers[i] = pSolver;
-                nCandidates++;
+                numMapPointsTrackedInCandidate++;
             }
         }
+        DLOG(INFO) << "Keyframe " << nIndex << " accepted as "
+                   << "candidate, was able to match "
+                   << nmatches << "/"
+                   << numMapPointsTrackedInCandidate
+                   << " of it's" << " tracked map points.";
     }
-    DLOG_IF(INFO, mVisualizeRelocalization()) << nCandidates << "/" << nKFs << " had more than 15"
-                                              << " matches with current frame, rest discarded.";
+    nCandidates++;
+
+    PnPsolver solver(mCurrentFrame,vpMapPointMatches);
+    solver.SetRansacParameters(0.99,10,300,4,0.5,5.991); //param
+
+    // the current frame is shared by all candidates, the pose is optimized on a copy
+    Frame frame(mCurrentFrame);
 
-    // Alternatively perform some iterations of P4P RANSAC
-    // Until we found a camera pose supported by enough inliers
-    bool bMatch = false;
     ORBmatcher matcher2(0.9,true); //param
 
-    while(nCandidates>0 && !bMatch)
+    // Perform some iterations of P4P RANSAC
+    // Until we found a camera pose supported by enough inliers
+    bool bNoMore = false;
+    while(!bNoMore && !bMatch)
     {
-        for(int i=0; i<nKFs; i++)
-        {
-            if(vbDiscarded[i])
-                continue;
+        // Perform 5 Ransac Iterations
+        vector<bool> vbInliers;
+        int nInliers;
+
+        // If Ransac reachs max. iterations the keyframe is discarded
+        cv::Mat Tcw_ = solver.iterate(5,bNoMore,vbInliers,nInliers); //param
+
+        // If a Camera Pose is computed, optimize
+        if(Tcw_.empty())
+            continue;
+
+        frame.SetPose(Tcw_);
 
-            // Perform 5 Ransac Iterations
-            vector<bool> vbInliers;
-            int nInliers;
-            bool bNoMore;
+        set<MapPoint*> sFound;
 
-            PnPsolver* pSolver = vpPnPsolvers[i];
-            cv::Mat Tcw = pSolver->iterate(5,bNoMore,vbInliers,nInliers); //param
+        const int np = vbInliers.size();
 
-            // If Ransac reachs max. iterations discard keyframe
-            if(bNoMore)
+        for(int j=0; j<np; j++)
+        {
+            if(vbInliers[j])
             {
-                vbDiscarded[i]=true;
-                nCandidates--;
+                frame.mvpMapPoints[j]=vpMapPointMatches[j];
+                sFound.insert(vpMapPointMatches[j]);
             }
+            else
+                frame.mvpMapPoints[j]=NULL;
+        }
 
-            // If a Camera Pose is computed, optimize
-            if(!Tcw.empty())
-            {
-                Tcw.copyTo(mCurrentFrame.mTcw);
+        int nGood = Optimizer::PoseOptimization(&frame);
 
-                set<MapPoint*> sFound;
+        if(nGood<10) //param
+            continue;
+
+        for(int io =0; io<frame.N; io++)
+            if(frame.mvbOutlier[io])
+                frame.mvpMapPoints[io]=static_cast<MapPoint*>(NULL);
+
+        // If few inliers, search by projection in a coarse window and optimize again
+        if(nGood<50 && !bMatch) //param
+        {
+            int nadditional =matcher2.SearchByProjection(frame,pKF,sFound,10,100); //param
 
-                const int np = vbInliers.size();
+            if(nadditional+nGood>=50) //param
+            {
+                nGood = Optimizer::PoseOptimization(&frame);
 
-                for(int j=0; j<np; j++)
+                // If many inliers but still not enough, search by projection again in a narrower window
+                // the camera has been already optimized with many points
+                if(nGood>30 && nGood<50) //param
                 {
-                    if(vbInliers[j])
+                    sFound.clear();
+                    for(int ip =0; ip<frame.N; ip++)
+                        if(frame.mvpMapPoints[ip])
+                            sFound.insert(frame.mvpMapPoints[ip]);
+                    nadditional =matcher2.SearchByProjection(frame,pKF,sFound,3,64); //param
+
+                    // Final optimization
+                    if(nGood+nadditional>=50) //param
                     {
-                        mCurrentFrame.mvpMapPoints[j]=vvpMapPointMatches[i][j];
-                        sFound.insert(vvpMapPointMatches[i][j]);
+                        nGood = Optimizer::PoseOptimization(&frame);
+
+                        for(int io =0; io<frame.N; io++)
+                            if(frame.mvbOutlier[io])
+                                frame.mvpMapPoints[io]=NULL;
                     }
-                    else
-                        mCurrentFrame.mvpMapPoints[j]=NULL;
                 }
+            }
+        }
 
-                int nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+        DLOG_IF(INFO, mVisualizeRelocalization()) << "Candidate " << nIndex << " scored "
+                                                  << nGood << " matches.";
+        // If the pose is supported by enough inliers stop all candidates,
+        // only the first one to get here hands out its pose
+        if(nGood>=50) //param
+        {
+            if(bMatch.exchange(true))
+                return false;
 
-                if(nGood<10) //param
-                    continue;
+            Tcw = frame.mTcw.clone();
+            vpMapPoints = frame.mvpMapPoints;
+            vbOutlier = frame.mvbOutlier;
+            return true;
+        }
+    }
 
-                for(int io =0; io<mCurrentFrame.N; io++)
-                    if(mCurrentFrame.mvbOutlier[io])
-                        mCurrentFrame.mvpMapPoints[io]=static_cast<MapPoint*>(NULL);
+    return false;
+}
 
-                // If few inliers, search by projection in a coarse window and optimize again
-                if(nGood<50) //param
-                {
-                    int nadditional =matcher2.SearchByProjection(mCurrentFrame,vpCandidateKFs[i],sFound,10,100); //param
+void Tracking::AddThumbnail(KeyFrame* pKF)
+{
+    if(!mbThumbnailIndex)
+        return;
 
-                        if(nadditional+nGood>=50) //param
-                    {
-                        nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+    vector<uint8_t> signature;
+    ThumbnailIndex::Compute(mImGray,signature);
+    mpKeyFrameDB->AddThumbnail(pKF,signature);
+}
 
-                        // If many inliers but still not enough, search by projection again in a narrower window
-                        // the camera has been already optimized with many points
-                        if(nGood>30 && nGood<50) //param
-                        {
-                            sFound.clear();
-                            for(int ip =0; ip<mCurrentFrame.N; ip++)
-                                if(mCurrentFrame.mvpMapPoints[ip])
-                                    sFound.insert(mCurrentFrame.mvpMapPoints[ip]);
-                            nadditional =matcher2.SearchByProjection(mCurrentFrame,vpCandidateKFs[i],sFound,3,64); //param
-
-                            // Final optimization
-                            if(nGood+nadditional>=50) //param
-                            {
-                                nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+void Tracking::StoreDepth(KeyFrame* pKF)
+{
+    if(mCurrentFrame.mImDepth.empty())
+        return;
 
-                                for(int io =0; io<mCurrentFrame.N; io++)
-                                    if(mCurrentFrame.mvbOutlier[io])
-                                        mCurrentFrame.mvpMapPoints[io]=NULL;
-                            }
-                        }
-                    }
-                }
+    mpMap->mKeyFrameDepths.Insert(pKF->mnId,mCurrentFrame.mImDepth,mCurrentFrame.mfDepthMapFactor);
+}
 
+bool Tracking::EvaluateThumbnailCandidate(KeyFrame* pKF, cv::Mat &Tcw, vector<MapPoint*> &vpMapPoints,
+                                          vector<bool> &vbOutlier)
+{
+    if(pKF->isBad())
+        return false;
 
-                DLOG_IF(INFO, mVisualizeRelocalization()) << "Candidate " << i << " scored "
-                                                          << nGood << " matches.";
-                // If the pose is supported by enough inliers stop ransacs and continue
-                if(nGood>=50) //param
-                {
-                    bMatch = true;
-                    break;
-                }
-            }
-        }
-    }
+    // The pose of the keyframe is the guess, its points are searched around their projections
+    Frame frame(mCurrentFrame);
+    frame.SetPose(pKF->GetPose());
+    fill(frame.mvpMapPoints.begin(),frame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
 
-    if(!bMatch)
-    {
-        DLOG_IF(INFO, mVisualizeRelocalization()) << "Relocalization failed, no candidate had"
-                                                  << " enough matches with current frame.";
+    ORBmatcher matcher(0.9,true); //param
+    set<MapPoint*> sFound;
+    const int nmatches = matcher.SearchByProjection(frame,pKF,sFound,15,100); //param
+    if(nmatches<30) //param
         return false;
-    }
-    else
+
+    int nGood = Optimizer::PoseOptimization(&frame);
+    for(int io =0; io<frame.N; io++)
+        if(frame.mvbOutlier[io])
+            frame.mvpMapPoints[io]=static_cast<MapPoint*>(NULL);
+
+    // Narrower window from the optimized pose
+    if(nGood>=10 && nGood<50) //param
     {
-        mnLastRelocFrameId = mCurrentFrame.mnId;
-        DLOG_IF(INFO, mVisualizeRelocalization()) << "Relocalization successful.";
-        return true;
+        for(int ip =0; ip<frame.N; ip++)
+            if(frame.mvpMapPoints[ip])
+                sFound.insert(frame.mvpMapPoints[ip]);
+        const int nadditional = matcher.SearchByProjection(frame,pKF,sFound,3,64); //param
+        if(nGood+nadditional>=50) //param
+        {
+            nGood = Optimizer::PoseOptimization(&frame);
+            for(int io =0; io<frame.N; io++)
+                if(frame.mvbOutlier[io])
+                    frame.mvpMapPoints[io]=static_cast<MapPoint*>(NULL);
+        }
     }
 
+    DLOG_IF(INFO, mVisualizeRelocalization()) << "Thumbnail candidate " << pKF->mnId << " scored "
+                                              << nGood << " matches.";
+    if(nGood<50) //param
+        return false;
+
+    Tcw = frame.mTcw.clone();
+    vpMapPoints = frame.mvpMapPoints;
+    vbOutlier = frame.mvbOutlier;
+    return true;
 }
 
 void Tracking::Reset()
@@ -1693,6 +3314,12 @@ void Tracking::Reset()
         while(!mpViewer->isStopped())
             usleep(3000);
     }
+    if(mpStreamer)
+    {
+        mpStreamer->RequestStop();
+        while(!mpStreamer->isStopped())
+            usleep(3000);
+    }
 
     // Reset Local Mapping
     cout << "Reseting Local Mapper...";
@@ -1709,12 +3336,17 @@ void Tracking::Reset()
     mpKeyFrameDB->clear();
     cout << " done" << endl;
 
+    if(mpFeatureBudget)
+        mpFeatureBudget->Reset();
+
+    ClearTrackingState();
+
     // Clear Map (this erase MapPoints and KeyFrames)
     mpMap->clear();
 
-    KeyFrame::nNextId = 0;
-    Frame::nNextId = 0;
-    mnLastRelocFrameId = 0;
+    mpMap->mnNextKeyFrameId = 0;
+    mpMap->mnNextMapId = 0;
+    mpMap->mFrameContext.nNextId = 0;
     mState = NO_IMAGES_YET;
 
     if(mpInitializer)
@@ -1723,13 +3355,36 @@ void Tracking::Reset()
         mpInitializer = static_cast<Initializer*>(NULL);
     }
 
-    mlRelativeFramePoses.clear();
-    mlpReferences.clear();
-    mlFrameTimes.clear();
-    mlbLost.clear();
-
     if(mpViewer)
         mpViewer->Release();
+    if(mpStreamer)
+        mpStreamer->Release();
+}
+
+void Tracking::ClearTrackingState()
+{
+    // Nothing may point into the map after it is cleared
+    fill(mCurrentFrame.mvpMapPoints.begin(),mCurrentFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+    fill(mLastFrame.mvpMapPoints.begin(),mLastFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+    mCurrentFrame.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    mLastFrame.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    mvpLocalMapPoints.clear();
+    mLocalMapGeometry.Clear();
+    mvpLocalKeyFrames.clear();
+    InvalidateLocalMap();
+    mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    mpLastKeyFrame = static_cast<KeyFrame*>(NULL);
+    mvRigFrames.clear();
+    mbRigTracked = false;
+    for(size_t i=0; i<mvRigCameras.size(); i++)
+        mvRigCameras[i].pLastKF = static_cast<KeyFrame*>(NULL);
+    mvMapPointMarks.clear();
+    mvKeyFrameMarks.clear();
+
+    mnLastRelocFrameId = 0;
+    mnLostFrames = 0;
+    mnSkippedFrames = 0;
+    mTrajectory.Clear();
 }
 
 void Tracking::ChangeCalibration(const string &strSettingPath)
@@ -1761,7 +3416,9 @@ void Tracking::ChangeCalibration(const string &strSettingPath)
 
     mbf = mfSettings["Camera.bf"];
 
-    Frame::mbInitialComputations = true;
+    mUndistortMap1.release();
+    mUndistortMap2.release();
+    mpMap->mFrameContext.mbInitialComputations = true;
 }
 
 void Tracking::InformOnlyTracking(const bool &flag)
@@ -1769,6 +3426,60 @@ void Tracking::InformOnlyTracking(const bool &flag)
     mbOnlyTracking = flag;
 }
 
+bool Tracking::IsMapFrozen()
+{
+    // The mapping is released and a loop closed only on this thread or after a keyframe from it,
+    // so the map stays frozen until the next frame. A loop client applies corrections any time.
+    return mbOnlyTracking && !mbOffline && mpLocalMapper->isStopped() &&
+           (!mpLoopClosing || (mpLoopClosing->isIdle() && !mpLoopClosing->HasClient()));
+}
+
+void Tracking::SetLocalizationStream()
+{
+    mbStream = true;
+    mbOnlyTracking = true;
+
+    // The features recorded are the ones of the camera of the System
+    delete mpFeatureCache;
+    mpFeatureCache = static_cast<FeatureCache*>(NULL);
+}
+
+bool Tracking::AttachStream()
+{
+    if(mState!=NO_IMAGES_YET && mState!=NOT_INITIALIZED)
+        return true;
+
+    // The newest keyframe is where the System tracked last, as good a start as any
+    const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+    KeyFrame* pLastKF = static_cast<KeyFrame*>(NULL);
+    for(size_t i=0; i<vpKFs.size(); i++)
+        if(!vpKFs[i]->isBad() && (!pLastKF || vpKFs[i]->mnId>pLastKF->mnId))
+            pLastKF = vpKFs[i];
+    if(!pLastKF)
+        return false;
+
+    InformMapLoaded(pLastKF);
+    return true;
+}
+
+void Tracking::ResetStream()
+{
+    ClearTrackingState();
+    mState = NO_IMAGES_YET;
+}
+
+void Tracking::InformMapLoaded(KeyFrame* pLastKF)
+{
+    mpLastKeyFrame = pLastKF;
+    mnLastKeyFrameId = pLastKF->mnFrameId;
+    mpReferenceKF = pLastKF;
+    mnLastRelocFrameId = 0;
+    mState = LOST;
+
+    // The frames tracked until the relocalization take the pose of the last keyframe
+    mTrajectory.Add(cv::Mat::eye(4,4,CV_32F),pLastKF,pLastKF->mTimeStamp,true);
+}
+
 
 
 } //namespace ORB_SLAM
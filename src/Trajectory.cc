@@ -0,0 +1,120 @@
+#include "Trajectory.h"
+#include "KeyFrame.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+Trajectory::Trajectory(): mnSize(0), mnClears(0)
+{
+}
+
+void Trajectory::Add(const cv::Mat &Tcr, KeyFrame* pReference, const double timestamp, const bool bLost)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    if(mnSize==mvChunks.size()*CHUNK_SIZE)
+        mvChunks.push_back(unique_ptr<Entry[]>(new Entry[CHUNK_SIZE]));
+
+    Entry &entry = At(mnSize);
+    for(int i=0; i<3; i++)
+        for(int j=0; j<4; j++)
+            entry.Tcr[4*i+j] = Tcr.at<float>(i,j);
+    entry.pReference = pReference;
+    entry.timestamp = timestamp;
+    entry.bLost = bLost;
+    mnSize++;
+}
+
+void Trajectory::AddLast(const bool bLost)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    if(mnSize==0)
+        return;
+    if(mnSize==mvChunks.size()*CHUNK_SIZE)
+        mvChunks.push_back(unique_ptr<Entry[]>(new Entry[CHUNK_SIZE]));
+
+    Entry &entry = At(mnSize);
+    entry = At(mnSize-1);
+    entry.bLost = bLost;
+    mnSize++;
+}
+
+cv::Mat Trajectory::GetLastRelativePose()
+{
+    unique_lock<mutex> lock(mMutex);
+
+    if(mnSize==0)
+        return cv::Mat();
+
+    cv::Mat Tcr = cv::Mat::eye(4,4,CV_32F);
+    const Entry &entry = At(mnSize-1);
+    for(int i=0; i<3; i++)
+        for(int j=0; j<4; j++)
+            Tcr.at<float>(i,j) = entry.Tcr[4*i+j];
+    return Tcr;
+}
+
+size_t Trajectory::Size()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mnSize;
+}
+
+size_t Trajectory::Get(const size_t nBegin, const size_t nMax, vector<Entry> &vEntries)
+{
+    unique_lock<mutex> lock(mMutex);
+
+    if(nBegin>=mnSize)
+        return 0;
+
+    const size_t nEnd = min(mnSize,nBegin+nMax);
+    vEntries.reserve(vEntries.size()+nEnd-nBegin);
+    for(size_t i=nBegin; i<nEnd; i++)
+        vEntries.push_back(At(i));
+    return nEnd-nBegin;
+}
+
+void Trajectory::Clear()
+{
+    unique_lock<mutex> lock(mMutex);
+    mnSize = 0;
+    mnClears++;
+}
+
+unsigned int Trajectory::GetNumClears()
+{
+    unique_lock<mutex> lock(mMutex);
+    return mnClears;
+}
+
+cv::Mat Trajectory::GetCameraPose(const Entry &entry, unsigned long* pnPoseEpoch)
+{
+    KeyFrame* pKF = entry.pReference;
+
+    cv::Mat Trw = cv::Mat::eye(4,4,CV_32F);
+
+    // If the reference keyframe was culled, traverse the spanning tree to get a suitable keyframe.
+    while(pKF->isBad())
+    {
+        Trw = Trw*pKF->mTcp;
+        pKF = pKF->GetParent();
+    }
+
+    // The epoch first, a pose read after it is at least as new
+    if(pnPoseEpoch)
+        *pnPoseEpoch = pKF->mnPoseEpoch;
+    Trw = Trw*pKF->GetPose();
+
+    cv::Mat Tcr = cv::Mat::eye(4,4,CV_32F);
+    for(int i=0; i<3; i++)
+        for(int j=0; j<4; j++)
+            Tcr.at<float>(i,j) = entry.Tcr[4*i+j];
+    return Tcr*Trw;
+}
+
+} //namespace ORB_SLAM
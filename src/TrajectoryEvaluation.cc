@@ -0,0 +1,129 @@
+#include "TrajectoryEvaluation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include <Eigen/Geometry>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+bool PointBefore(const TrajectoryEvaluation::Point &a, const TrajectoryEvaluation::Point &b)
+{
+    return a.timestamp<b.timestamp;
+}
+}
+
+const double TrajectoryEvaluation::MAX_ASSOCIATION_DT = 0.02; //param
+
+bool TrajectoryEvaluation::Load(const string &strFile, const vector<ImageSource::Entry> &vImages, vector<Point> &vPoints)
+{
+    ifstream f(strFile.c_str());
+    if(!f.is_open())
+        return false;
+
+    string s;
+    while(getline(f,s))
+    {
+        if(s.empty() || s[0]=='#')
+            continue;
+
+        const bool bCSV = s.find(',')!=string::npos;
+        if(bCSV)
+            replace(s.begin(),s.end(),',',' ');
+
+        stringstream ss(s);
+        vector<double> vValues;
+        double value;
+        while(ss >> value)
+            vValues.push_back(value);
+
+        Point point;
+        if(bCSV && vValues.size()>=4)
+        {
+            point.timestamp = vValues[0]/1e9;
+            point.position << vValues[1], vValues[2], vValues[3];
+        }
+        else if(vValues.size()==12)
+        {
+            if(vPoints.size()>=vImages.size())
+                break;
+            point.timestamp = vImages[vPoints.size()].timestamp;
+            point.position << vValues[3], vValues[7], vValues[11];
+        }
+        else if(vValues.size()>=4)
+        {
+            point.timestamp = vValues[0];
+            point.position << vValues[1], vValues[2], vValues[3];
+        }
+        else
+            continue;
+        vPoints.push_back(point);
+    }
+    sort(vPoints.begin(),vPoints.end(),PointBefore);
+    return true;
+}
+
+bool TrajectoryEvaluation::ComputeATE(const vector<Point> &vEstimate, const vector<Point> &vGroundTruth, const bool bScale,
+                                      Error &error)
+{
+    vector<Eigen::Vector3d> vEst, vGt;
+    for(size_t i=0; i<vEstimate.size(); i++)
+    {
+        Point query;
+        query.timestamp = vEstimate[i].timestamp;
+        vector<Point>::const_iterator it = lower_bound(vGroundTruth.begin(),vGroundTruth.end(),query,PointBefore);
+
+        vector<Point>::const_iterator best = vGroundTruth.end();
+        if(it!=vGroundTruth.end())
+            best = it;
+        if(it!=vGroundTruth.begin() && (best==vGroundTruth.end() ||
+                                        query.timestamp-(it-1)->timestamp<best->timestamp-query.timestamp))
+            best = it-1;
+        if(best==vGroundTruth.end() || fabs(best->timestamp-query.timestamp)>MAX_ASSOCIATION_DT)
+            continue;
+
+        vEst.push_back(vEstimate[i].position);
+        vGt.push_back(best->position);
+    }
+
+    const int n = vEst.size();
+    if(n<3)
+        return false;
+
+    Eigen::Matrix3Xd est(3,n), gt(3,n);
+    for(int i=0; i<n; i++)
+    {
+        est.col(i) = vEst[i];
+        gt.col(i) = vGt[i];
+    }
+
+    const Eigen::Matrix4d T = Eigen::umeyama(est,gt,bScale);
+    const Eigen::Matrix3Xd aligned = (T.topLeftCorner<3,3>()*est).colwise()+T.topRightCorner<3,1>();
+
+    vector<double> vErrors(n);
+    double sum = 0, sum2 = 0;
+    for(int i=0; i<n; i++)
+    {
+        vErrors[i] = (aligned.col(i)-gt.col(i)).norm();
+        sum += vErrors[i];
+        sum2 += vErrors[i]*vErrors[i];
+    }
+    sort(vErrors.begin(),vErrors.end());
+
+    error.nPairs = n;
+    error.scale = T.topLeftCorner<3,3>().col(0).norm();
+    error.rmse = sqrt(sum2/n);
+    error.mean = sum/n;
+    error.median = vErrors[n/2];
+    error.max = vErrors.back();
+    return true;
+}
+
+} //namespace ORB_SLAM
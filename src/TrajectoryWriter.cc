@@ -0,0 +1,154 @@
+#include "TrajectoryWriter.h"
+#include "Converter.h"
+#include "Map.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+// Entries looked at per update, a correction touches every frame written before it
+const size_t MAX_ENTRIES_PER_UPDATE = 2000; //param
+const size_t BATCH_SIZE = 256; //param
+}
+
+TrajectoryWriter::TrajectoryWriter(Trajectory* pTrajectory, Map* pMap, const string &strFile, const double delay):
+    mpTrajectory(pTrajectory), mpMap(pMap), mfDelay(delay), mnClears(pTrajectory->GetNumClears()),
+    mnBigChangeIdx(pMap->GetLastBigChangeIdx()), mnWritten(0), mnCorrected(0), mnCorrectionEnd(0)
+{
+    mFile.open(strFile.c_str());
+    if(!mFile.is_open())
+    {
+        cerr << "Failed to open the trajectory stream " << strFile << endl;
+        return;
+    }
+    mFile << fixed;
+}
+
+void TrajectoryWriter::Update()
+{
+    Update(false);
+}
+
+void TrajectoryWriter::Finish()
+{
+    Update(true);
+}
+
+void TrajectoryWriter::Update(const bool bAll)
+{
+    if(!mFile.is_open())
+        return;
+
+    // The trajectory of the last map is done
+    const unsigned int nClears = mpTrajectory->GetNumClears();
+    if(nClears!=mnClears)
+    {
+        mnClears = nClears;
+        mnWritten = 0;
+        mvnWrittenEpochs.clear();
+        mnCorrected = mnCorrectionEnd = 0;
+        mFile << "# reset" << endl;
+    }
+
+    // A loop correction or a global BA moved the keyframes, a later one starts the check over
+    const int nBigChangeIdx = mpMap->GetLastBigChangeIdx();
+    if(nBigChangeIdx!=mnBigChangeIdx)
+    {
+        mnBigChangeIdx = nBigChangeIdx;
+        mnCorrected = 0;
+        mnCorrectionEnd = mnWritten;
+    }
+
+    // New frames first, the stream keeps up while a correction is in progress
+    const size_t nMax = bAll ? numeric_limits<size_t>::max() : MAX_ENTRIES_PER_UPDATE;
+    const size_t nNew = WriteNewFrames(nMax,bAll);
+    const size_t nCorrected = CorrectFrames(nMax-nNew);
+    if(nNew>0 || nCorrected>0)
+        mFile.flush();
+}
+
+size_t TrajectoryWriter::WriteNewFrames(const size_t nMax, const bool bAll)
+{
+    // The entries are added back to back, the last one has the latest timestamp
+    mvEntries.clear();
+    const size_t nSize = mpTrajectory->Size();
+    if(nSize==0 || mpTrajectory->Get(nSize-1,1,mvEntries)==0)
+        return 0;
+    const double tOldest = mvEntries[0].timestamp-mfDelay;
+
+    size_t nLooked = 0;
+    while(nLooked<nMax)
+    {
+        mvEntries.clear();
+        if(mpTrajectory->Get(mnWritten,min(BATCH_SIZE,nMax-nLooked),mvEntries)==0)
+            break;
+
+        size_t i=0;
+        for(; i<mvEntries.size(); i++)
+        {
+            const Trajectory::Entry &entry = mvEntries[i];
+            if(!bAll && entry.timestamp>tOldest)
+                break;
+
+            unsigned long nEpoch = 0;
+            if(!entry.bLost)
+                WriteLine(entry,Trajectory::GetCameraPose(entry,&nEpoch));
+            mvnWrittenEpochs.push_back(nEpoch);
+        }
+        mnWritten += i;
+        nLooked += i;
+        if(i<mvEntries.size())
+            break;
+    }
+    return nLooked;
+}
+
+size_t TrajectoryWriter::CorrectFrames(const size_t nMax)
+{
+    size_t nLooked = 0;
+    while(nLooked<nMax && mnCorrected<mnCorrectionEnd)
+    {
+        mvEntries.clear();
+        const size_t nBatch = min(min(BATCH_SIZE,nMax-nLooked),mnCorrectionEnd-mnCorrected);
+        if(mpTrajectory->Get(mnCorrected,nBatch,mvEntries)==0)
+            break;
+
+        for(size_t i=0; i<mvEntries.size(); i++)
+        {
+            const Trajectory::Entry &entry = mvEntries[i];
+            unsigned long &nWrittenEpoch = mvnWrittenEpochs[mnCorrected+i];
+            if(entry.bLost)
+                continue;
+
+            unsigned long nEpoch;
+            const cv::Mat Tcw = Trajectory::GetCameraPose(entry,&nEpoch);
+            if(nEpoch==nWrittenEpoch)
+                continue;
+            WriteLine(entry,Tcw);
+            nWrittenEpoch = nEpoch;
+        }
+        mnCorrected += mvEntries.size();
+        nLooked += mvEntries.size();
+    }
+    return nLooked;
+}
+
+void TrajectoryWriter::WriteLine(const Trajectory::Entry &entry, const cv::Mat &Tcw)
+{
+    cv::Mat Rwc = Tcw.rowRange(0,3).colRange(0,3).t();
+    cv::Mat twc = -Rwc*Tcw.rowRange(0,3).col(3);
+
+    vector<float> q = Converter::toQuaternion(Rwc);
+
+    mFile << setprecision(6) << entry.timestamp << " " <<  setprecision(9) << twc.at<float>(0) << " " << twc.at<float>(1) << " " << twc.at<float>(2) << " " << q[0] << " " << q[1] << " " << q[2] << " " << q[3] << "\n";
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,312 @@
+#include "Triangulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <Eigen/SVD>
+
+#include "KeyFrame.h"
+
+namespace ORB_SLAM2
+{
+
+void TriangulateDLT(const Eigen::Matrix<float,3,4> &P1, const Eigen::Matrix<float,3,4> &P2,
+                    const float x1, const float y1, const float x2, const float y2, Eigen::Vector4f &x3Dh)
+{
+    Eigen::Matrix4f A;
+    A.row(0) = x1*P1.row(2)-P1.row(0);
+    A.row(1) = y1*P1.row(2)-P1.row(1);
+    A.row(2) = x2*P2.row(2)-P2.row(0);
+    A.row(3) = y2*P2.row(2)-P2.row(1);
+
+    // The solution is the right singular vector of the smallest singular value
+    const Eigen::JacobiSVD<Eigen::Matrix4f> svd(A,Eigen::ComputeFullV);
+    x3Dh = svd.matrixV().col(3);
+}
+
+void Triangulator::Observations::Clear()
+{
+    vXn.clear();
+    vYn.clear();
+    vU.clear();
+    vV.clear();
+    vUr.clear();
+    vStereoX.clear();
+    vStereoY.clear();
+    vStereoZ.clear();
+    vCosParallaxStereo.clear();
+    vSigma2.clear();
+    vScale.clear();
+}
+
+Triangulator::Triangulator(): mpKF1(NULL), mpKF2(NULL)
+{
+}
+
+void Triangulator::SetCamera(KeyFrame* pKF, Camera &camera)
+{
+    pKF->GetPose(camera.Rcw,camera.tcw);
+    camera.Rwc = camera.Rcw.transpose();
+    camera.Ow = -camera.Rwc*camera.tcw;
+    camera.Tcw.leftCols<3>() = camera.Rcw;
+    camera.Tcw.col(3) = camera.tcw;
+
+    camera.fx = pKF->fx;
+    camera.fy = pKF->fy;
+    camera.cx = pKF->cx;
+    camera.cy = pKF->cy;
+    camera.invfx = pKF->invfx;
+    camera.invfy = pKF->invfy;
+    camera.bf = pKF->mbf;
+    camera.b = pKF->mb;
+}
+
+void Triangulator::Reset(KeyFrame* pKF1, KeyFrame* pKF2)
+{
+    mpKF1 = pKF1;
+    mpKF2 = pKF2;
+    SetCamera(pKF1,mCamera1);
+    SetCamera(pKF2,mCamera2);
+
+    mvIdx1.clear();
+    mvIdx2.clear();
+    mObs1.Clear();
+    mObs2.Clear();
+}
+
+void Triangulator::AddObservation(KeyFrame* pKF, const Camera &camera, const size_t idx, Observations &obs)
+{
+    const cv::KeyPoint &kpUn = pKF->mvKeysUn[idx];
+    const float ur = pKF->mvuRight[idx];
+
+    obs.vXn.push_back((kpUn.pt.x-camera.cx)*camera.invfx);
+    obs.vYn.push_back((kpUn.pt.y-camera.cy)*camera.invfy);
+    obs.vU.push_back(kpUn.pt.x);
+    obs.vV.push_back(kpUn.pt.y);
+    obs.vUr.push_back(ur);
+    obs.vSigma2.push_back(pKF->mvLevelSigma2[kpUn.octave]);
+    obs.vScale.push_back(pKF->mvScaleFactors[kpUn.octave]);
+
+    const float z = pKF->mvDepth[idx];
+    if(ur>=0 && z>0)
+    {
+        // Same as KeyFrame::UnprojectStereo, from the keypoint as extracted
+        const cv::KeyPoint &kp = pKF->mvKeys[idx];
+        const Eigen::Vector3f x3Dc((kp.pt.x-camera.cx)*z*camera.invfx, (kp.pt.y-camera.cy)*z*camera.invfy, z);
+        const Eigen::Vector3f x3Dw = camera.Rwc*x3Dc+camera.Ow;
+        obs.vStereoX.push_back(x3Dw(0));
+        obs.vStereoY.push_back(x3Dw(1));
+        obs.vStereoZ.push_back(x3Dw(2));
+
+        // cos(2*atan2(b/2,z)) in closed form
+        const float h2 = 0.25f*camera.b*camera.b;
+        obs.vCosParallaxStereo.push_back((z*z-h2)/(z*z+h2));
+    }
+    else
+    {
+        // Fails every check if it is ever used
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        obs.vStereoX.push_back(nan);
+        obs.vStereoY.push_back(nan);
+        obs.vStereoZ.push_back(nan);
+        obs.vCosParallaxStereo.push_back(2.0f);
+    }
+}
+
+void Triangulator::Add(const size_t idx1, const size_t idx2)
+{
+    mvIdx1.push_back(idx1);
+    mvIdx2.push_back(idx2);
+    AddObservation(mpKF1,mCamera1,idx1,mObs1);
+    AddObservation(mpKF2,mCamera2,idx2,mObs2);
+}
+
+void Triangulator::CheckCamera(const Camera &camera, const Observations &obs, std::vector<unsigned char> &vbGood) const
+{
+    const int N = mvIdx1.size();
+
+    const float r00 = camera.Rcw(0,0), r01 = camera.Rcw(0,1), r02 = camera.Rcw(0,2);
+    const float r10 = camera.Rcw(1,0), r11 = camera.Rcw(1,1), r12 = camera.Rcw(1,2);
+    const float r20 = camera.Rcw(2,0), r21 = camera.Rcw(2,1), r22 = camera.Rcw(2,2);
+    const float tx = camera.tcw(0), ty = camera.tcw(1), tz = camera.tcw(2);
+    const float fx = camera.fx, fy = camera.fy, cx = camera.cx, cy = camera.cy, bf = camera.bf;
+
+    const float* pX = mvX.data();
+    const float* pY = mvY.data();
+    const float* pZ = mvZ.data();
+    const float* pU = obs.vU.data();
+    const float* pV = obs.vV.data();
+    const float* pUr = obs.vUr.data();
+    const float* pSigma2 = obs.vSigma2.data();
+    unsigned char* pbGood = vbGood.data();
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for(int i=0; i<N; i++)
+    {
+        const float x = r00*pX[i]+r01*pY[i]+r02*pZ[i]+tx;
+        const float y = r10*pX[i]+r11*pY[i]+r12*pZ[i]+ty;
+        const float z = r20*pX[i]+r21*pY[i]+r22*pZ[i]+tz;
+        const float invz = 1.0f/z;
+
+        const float u = fx*x*invz+cx;
+        const float v = fy*y*invz+cy;
+        const float ur = u-bf*invz;
+
+        const bool bStereo = pUr[i]>=0;
+        const float errX = u-pU[i];
+        const float errY = v-pV[i];
+        const float errXr = bStereo ? ur-pUr[i] : 0.0f;
+        const float th = bStereo ? 7.8f : 5.991f;
+
+        //Check triangulation in front of the camera and reprojection error
+        const bool bGood = z>0 && (errX*errX+errY*errY+errXr*errXr)<=th*pSigma2[i];
+        pbGood[i] = pbGood[i] && bGood;
+    }
+}
+
+void Triangulator::Run(const float ratioFactor)
+{
+    const int N = mvIdx1.size();
+
+    mvMethod.resize(N);
+    mvX.resize(N);
+    mvY.resize(N);
+    mvZ.resize(N);
+    mvbGood.resize(N);
+
+    // Check parallax between rays and choose how to compute each point
+    {
+        const Eigen::Matrix3f &R1 = mCamera1.Rwc;
+        const Eigen::Matrix3f &R2 = mCamera2.Rwc;
+        const float a00 = R1(0,0), a01 = R1(0,1), a02 = R1(0,2);
+        const float a10 = R1(1,0), a11 = R1(1,1), a12 = R1(1,2);
+        const float a20 = R1(2,0), a21 = R1(2,1), a22 = R1(2,2);
+        const float b00 = R2(0,0), b01 = R2(0,1), b02 = R2(0,2);
+        const float b10 = R2(1,0), b11 = R2(1,1), b12 = R2(1,2);
+        const float b20 = R2(2,0), b21 = R2(2,1), b22 = R2(2,2);
+
+        const float* pXn1 = mObs1.vXn.data();
+        const float* pYn1 = mObs1.vYn.data();
+        const float* pXn2 = mObs2.vXn.data();
+        const float* pYn2 = mObs2.vYn.data();
+        const float* pUr1 = mObs1.vUr.data();
+        const float* pUr2 = mObs2.vUr.data();
+        const float* pCosStereo1 = mObs1.vCosParallaxStereo.data();
+        const float* pCosStereo2 = mObs2.vCosParallaxStereo.data();
+        unsigned char* pMethod = mvMethod.data();
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+        for(int i=0; i<N; i++)
+        {
+            const float ray1x = a00*pXn1[i]+a01*pYn1[i]+a02;
+            const float ray1y = a10*pXn1[i]+a11*pYn1[i]+a12;
+            const float ray1z = a20*pXn1[i]+a21*pYn1[i]+a22;
+            const float ray2x = b00*pXn2[i]+b01*pYn2[i]+b02;
+            const float ray2y = b10*pXn2[i]+b11*pYn2[i]+b12;
+            const float ray2z = b20*pXn2[i]+b21*pYn2[i]+b22;
+
+            const float norm1 = std::sqrt(ray1x*ray1x+ray1y*ray1y+ray1z*ray1z);
+            const float norm2 = std::sqrt(ray2x*ray2x+ray2y*ray2y+ray2z*ray2z);
+            const float cosParallaxRays = (ray1x*ray2x+ray1y*ray2y+ray1z*ray2z)/(norm1*norm2);
+
+            const bool bStereo1 = pUr1[i]>=0;
+            const bool bStereo2 = pUr2[i]>=0;
+
+            // The stereo parallax of the second keyframe only counts if the first is monocular
+            const float cosParallaxStereo1 = bStereo1 ? pCosStereo1[i] : cosParallaxRays+1;
+            const float cosParallaxStereo2 = (!bStereo1 && bStereo2) ? pCosStereo2[i] : cosParallaxRays+1;
+            const float cosParallaxStereo = std::min(cosParallaxStereo1,cosParallaxStereo2);
+
+            const bool bLinear = cosParallaxRays<cosParallaxStereo && cosParallaxRays>0 &&
+                                 (bStereo1 || bStereo2 || cosParallaxRays<0.9998f); //param
+            const bool bFromStereo1 = bStereo1 && cosParallaxStereo1<cosParallaxStereo2;
+            const bool bFromStereo2 = bStereo2 && cosParallaxStereo2<cosParallaxStereo1;
+
+            //No stereo and very low parallax
+            pMethod[i] = bLinear ? LINEAR : bFromStereo1 ? STEREO1 : bFromStereo2 ? STEREO2 : NONE;
+        }
+    }
+
+    // Compute the points
+    for(int i=0; i<N; i++)
+    {
+        mvbGood[i] = true;
+
+        switch(mvMethod[i])
+        {
+        case LINEAR:
+        {
+            // Linear Triangulation Method
+            Eigen::Vector4f x3Dh;
+            TriangulateDLT(mCamera1.Tcw,mCamera2.Tcw,mObs1.vXn[i],mObs1.vYn[i],mObs2.vXn[i],mObs2.vYn[i],x3Dh);
+
+            if(x3Dh(3)==0)
+            {
+                mvbGood[i] = false;
+                mvX[i] = mvY[i] = mvZ[i] = 0;
+                break;
+            }
+
+            // Euclidean coordinates
+            mvX[i] = x3Dh(0)/x3Dh(3);
+            mvY[i] = x3Dh(1)/x3Dh(3);
+            mvZ[i] = x3Dh(2)/x3Dh(3);
+            break;
+        }
+        case STEREO1:
+            mvX[i] = mObs1.vStereoX[i];
+            mvY[i] = mObs1.vStereoY[i];
+            mvZ[i] = mObs1.vStereoZ[i];
+            break;
+        case STEREO2:
+            mvX[i] = mObs2.vStereoX[i];
+            mvY[i] = mObs2.vStereoY[i];
+            mvZ[i] = mObs2.vStereoZ[i];
+            break;
+        default:
+            mvbGood[i] = false;
+            mvX[i] = mvY[i] = mvZ[i] = 0;
+        }
+    }
+
+    CheckCamera(mCamera1,mObs1,mvbGood);
+    CheckCamera(mCamera2,mObs2,mvbGood);
+
+    //Check scale consistency
+    {
+        const float o1x = mCamera1.Ow(0), o1y = mCamera1.Ow(1), o1z = mCamera1.Ow(2);
+        const float o2x = mCamera2.Ow(0), o2y = mCamera2.Ow(1), o2z = mCamera2.Ow(2);
+
+        const float* pX = mvX.data();
+        const float* pY = mvY.data();
+        const float* pZ = mvZ.data();
+        const float* pScale1 = mObs1.vScale.data();
+        const float* pScale2 = mObs2.vScale.data();
+        unsigned char* pbGood = mvbGood.data();
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+        for(int i=0; i<N; i++)
+        {
+            const float d1x = pX[i]-o1x, d1y = pY[i]-o1y, d1z = pZ[i]-o1z;
+            const float d2x = pX[i]-o2x, d2y = pY[i]-o2y, d2z = pZ[i]-o2z;
+            const float dist1 = std::sqrt(d1x*d1x+d1y*d1y+d1z*d1z);
+            const float dist2 = std::sqrt(d2x*d2x+d2y*d2y+d2z*d2z);
+
+            const float ratioDist = dist2/dist1;
+            const float ratioOctave = pScale1[i]/pScale2[i];
+
+            const bool bGood = dist1!=0 && dist2!=0 &&
+                               !(ratioDist*ratioFactor<ratioOctave || ratioDist>ratioOctave*ratioFactor);
+            pbGood[i] = pbGood[i] && bGood;
+        }
+    }
+}
+
+} //namespace ORB_SLAM
@@ -19,7 +19,8 @@
 */
 
 #include "Viewer.h"
-#include "Parameter.h"
+#include "Trace.h"
+#include "ThreadConfig.h"
 #include <pangolin/pangolin.h>
 
 #include <mutex>
@@ -27,13 +28,11 @@
 namespace ORB_SLAM2
 {
 
-Viewer::Viewer(System* pSystem, FrameDrawer *pFrameDrawer, MapDrawer *pMapDrawer, Tracking *pTracking, const string &strSettingPath):
+Viewer::Viewer(System* pSystem, FrameDrawer *pFrameDrawer, MapDrawer *pMapDrawer, Tracking *pTracking, const Settings &fSettings):
     mpSystem(pSystem), mpFrameDrawer(pFrameDrawer),mpMapDrawer(pMapDrawer), mpTracker(pTracking),
     mbFinishRequested(false), mbFinished(true), mbStopped(true), mbStopRequested(false)
     , mIgnoreFPS(false)
 {
-    cv::FileStorage fSettings(strSettingPath, cv::FileStorage::READ);
-
     float fps = fSettings["Camera.fps"];
     if(fps<1)
         fps=30;
@@ -55,9 +54,15 @@ Viewer::Viewer(System* pSystem, FrameDrawer *pFrameDrawer, MapDrawer *pMapDrawer
 
 void Viewer::Run()
 {
+    Trace::SetThreadName("Viewer");
+    ThreadConfig::Apply(ThreadConfig::VIEWER);
     mbFinished = false;
     mbStopped = false;
 
+    // The drawers take their MapPoints and KeyFrames from the map again in every pass
+    Reclaimer &reclaimer = mpMapDrawer->mpMap->mReclaimer;
+    const int nReclaimerId = reclaimer.RegisterThread();
+
     pangolin::CreateWindowAndBind("ORB-SLAM2: Map Viewer",1024,768);
 
     // 3D Mouse handler requires depth testing to be enabled
@@ -78,6 +83,9 @@ void Viewer::Run()
             .SetBounds(0.0, 1.0, pangolin::Attach::Pix(200), 1.0, -1024.0f/768.0f)
             .SetHandler(new pangolin::Handler3D(s_cam));
 
+    // The tracking syncs the panels of the parameters from now on
+    ParameterManager::setFrontend(&mParameters);
+
     // standart view by orb slam
     auto& menuPanel = pangolin::CreatePanel("menu").SetBounds(0.0,1.0,0.0,pangolin::Attach::Pix(200));
     pangolin::Var<bool> menuFollowCamera("menu.Follow Camera",true,true);
@@ -86,37 +94,37 @@ void Viewer::Run()
     pangolin::Var<bool> menuShowGraph("menu.Show Graph",true,true);
     pangolin::Var<bool> menuLocalizationMode("menu.Localization Mode",false,true);
     pangolin::Var<bool> menuReset("menu.Reset",false,false);
-    ParameterManager::createPangolinEntries("menu", ParameterGroup::MAIN);
+    mParameters.createEntries("menu", ParameterGroup::MAIN);
 
     // create the panels for the sub parameters
     std::map<std::string, pangolin::View*> subPanels;
     auto& extractorPanel = pangolin::CreatePanel("extractor").SetBounds(0.0,1.0,pangolin::Attach::Pix(-200),1.0);
-    ParameterManager::createPangolinEntries("extractor", ParameterGroup::ORBEXTRACTOR);
+    mParameters.createEntries("extractor", ParameterGroup::ORBEXTRACTOR);
     subPanels["extractor"] = (&extractorPanel);
     extractorPanel.ToggleShow();
 
     auto& initializePanel = pangolin::CreatePanel("initialization").SetBounds(0.0,1.0,pangolin::Attach::Pix(-200),1.0);
-    ParameterManager::createPangolinEntries("initialization", ParameterGroup::INITIALIZATION);
+    mParameters.createEntries("initialization", ParameterGroup::INITIALIZATION);
     subPanels["initialization"] = (&initializePanel);
     initializePanel.ToggleShow();
 
     auto& trackingPanel = pangolin::CreatePanel("tracking").SetBounds(0.0,1.0,pangolin::Attach::Pix(-200),1.0);
-    ParameterManager::createPangolinEntries("tracking", ParameterGroup::TRACKING);
+    mParameters.createEntries("tracking", ParameterGroup::TRACKING);
     subPanels["tracking"] = &trackingPanel;
     trackingPanel.ToggleShow();
 
     auto& relocalizationPanel = pangolin::CreatePanel("relocalization").SetBounds(0.0,1.0,pangolin::Attach::Pix(-200),1.0);
-    ParameterManager::createPangolinEntries("relocalization", ParameterGroup::RELOCALIZATION);
+    mParameters.createEntries("relocalization", ParameterGroup::RELOCALIZATION);
     subPanels["relocalization"] = &relocalizationPanel;
     relocalizationPanel.ToggleShow();
 
     auto& localMappingPanel = pangolin::CreatePanel("localMapping").SetBounds(0.0,1.0,pangolin::Attach::Pix(-200),1.0);
-    ParameterManager::createPangolinEntries("localMapping", ParameterGroup::LOCAL_MAPPING);
+    mParameters.createEntries("localMapping", ParameterGroup::LOCAL_MAPPING);
     subPanels["localMapping"] = &localMappingPanel;
     localMappingPanel.ToggleShow();
 
     auto& loopClosingPanel = pangolin::CreatePanel("loopClosing").SetBounds(0.0,1.0,pangolin::Attach::Pix(-200),1.0);
-    ParameterManager::createPangolinEntries("loopClosing", ParameterGroup::LOOP_CLOSING);
+    mParameters.createEntries("loopClosing", ParameterGroup::LOOP_CLOSING);
     subPanels["loopClosing"] = &loopClosingPanel;
     loopClosingPanel.ToggleShow();
 
@@ -170,7 +178,7 @@ void Viewer::Run()
     pangolin::Var<std::function<void(void)>> relocalizationButton("parameters.Relocalization", toggleFunctionMap["relocalization"]);
     pangolin::Var<std::function<void(void)>> localMappingButton("parameters.Local mapping", toggleFunctionMap["localMapping"]);
     pangolin::Var<std::function<void(void)>> loopClosingButton("parameters.Loop closing", toggleFunctionMap["loopClosing"]);
-    ParameterManager::createPangolinEntries("parameters", ParameterGroup::PARAMETER);
+    mParameters.createEntries("parameters", ParameterGroup::PARAMETER);
     parameterPanel.ToggleShow();
 
     // open parameter pane when pressing Ctrl+p
@@ -224,6 +232,7 @@ void Viewer::Run()
     cv::namedWindow("ORB-SLAM2: Current Frame", CV_WINDOW_NORMAL);
     while(1)
     {
+        TRACE_SCOPE("Draw");
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         mpMapDrawer->GetCurrentOpenGLCameraMatrix(Twc);
@@ -283,10 +292,13 @@ void Viewer::Run()
             menuReset = false;
         }
 
+        reclaimer.QuiescentState(nReclaimerId);
+
         if(Stop())
         {
             while(isStopped())
             {
+                reclaimer.QuiescentState(nReclaimerId);
                 usleep(3000);
             }
         }
@@ -295,6 +307,7 @@ void Viewer::Run()
             break;
     }
 
+    reclaimer.UnregisterThread(nReclaimerId);
     SetFinish();
 }
 
@@ -365,4 +378,22 @@ void Viewer::ignoreFPS(const bool& ignore)
     mIgnoreFPS = ignore;
 }
 
+void Viewer::SetCurrentCameraPose(const cv::Mat &Tcw)
+{
+    mpMapDrawer->SetCurrentCameraPose(Tcw);
+}
+
+void Viewer::BindContext()
+{
+    pangolin::BindToContext("ORB-SLAM2: Map Viewer");
+}
+
+}
+
+ORB_SLAM2::Visualization* ORB_SLAM2_CreateVisualization(ORB_SLAM2::System* pSystem,
+        ORB_SLAM2::FrameDrawer* pFrameDrawer, ORB_SLAM2::Tracking* pTracking, ORB_SLAM2::Map* pMap,
+        const ORB_SLAM2::Settings &settings)
+{
+    ORB_SLAM2::MapDrawer* pMapDrawer = new ORB_SLAM2::MapDrawer(pMap, settings);
+    return new ORB_SLAM2::Viewer(pSystem, pFrameDrawer, pMapDrawer, pTracking, settings);
 }
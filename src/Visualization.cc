@@ -0,0 +1,76 @@
+#include "Visualization.h"
+
+#include <dlfcn.h>
+
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const char* MODULE_NAME = "libORB_SLAM2_viewer.so";
+
+typedef Visualization* (*CreateFunction)(System*, FrameDrawer*, Tracking*, Map*, const Settings&);
+
+// Directory of the core library, with the trailing slash, empty if unknown
+string LibraryDirectory()
+{
+    Dl_info info;
+    if(!dladdr(reinterpret_cast<void*>(&Visualization::Load), &info) || !info.dli_fname)
+        return string();
+    const string path(info.dli_fname);
+    const size_t slash = path.rfind('/');
+    return slash==string::npos ? string() : path.substr(0,slash+1);
+}
+
+// The entry point of the module, opened once. The module is never closed, its thread and GL
+// context live until the process exits.
+CreateFunction OpenModule()
+{
+    static mutex mutexModule;
+    static bool bOpened = false;
+    static CreateFunction create = NULL;
+
+    unique_lock<mutex> lock(mutexModule);
+    if(bOpened)
+        return create;
+    bOpened = true;
+
+    void* pModule = NULL;
+    const string strDirectory = LibraryDirectory();
+    if(!strDirectory.empty())
+        pModule = dlopen((strDirectory+MODULE_NAME).c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!pModule)
+        pModule = dlopen(MODULE_NAME, RTLD_NOW | RTLD_LOCAL);
+    if(!pModule)
+    {
+        cerr << "No viewer module, running without the viewer: " << dlerror() << endl;
+        return create;
+    }
+
+    create = reinterpret_cast<CreateFunction>(dlsym(pModule, "ORB_SLAM2_CreateVisualization"));
+    if(!create)
+        cerr << "The viewer module has no entry point, running without the viewer: " << dlerror() << endl;
+    return create;
+}
+}
+
+bool Visualization::Available()
+{
+    return OpenModule()!=NULL;
+}
+
+Visualization* Visualization::Load(System* pSystem, FrameDrawer* pFrameDrawer, Tracking* pTracking, Map* pMap,
+                                   const Settings &settings)
+{
+    CreateFunction create = OpenModule();
+    if(!create)
+        return static_cast<Visualization*>(NULL);
+    return create(pSystem, pFrameDrawer, pTracking, pMap, settings);
+}
+
+} //namespace ORB_SLAM
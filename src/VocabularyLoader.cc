@@ -0,0 +1,66 @@
+#include "VocabularyLoader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+mutex gMutexLoading;
+condition_variable gLoaded;
+vector<const ORBVocabulary*> gvpLoading;
+atomic<int> gnLoading(0);
+
+bool IsLoadingLocked(const ORBVocabulary* pVocabulary)
+{
+    return find(gvpLoading.begin(),gvpLoading.end(),pVocabulary)!=gvpLoading.end();
+}
+}
+
+void VocabularyLoader::Begin(const ORBVocabulary* pVocabulary)
+{
+    unique_lock<mutex> lock(gMutexLoading);
+    gvpLoading.push_back(pVocabulary);
+    gnLoading++;
+}
+
+void VocabularyLoader::End(const ORBVocabulary* pVocabulary)
+{
+    {
+        unique_lock<mutex> lock(gMutexLoading);
+        vector<const ORBVocabulary*>::iterator it = find(gvpLoading.begin(),gvpLoading.end(),pVocabulary);
+        if(it==gvpLoading.end())
+            return;
+        gvpLoading.erase(it);
+        gnLoading--;
+    }
+    gLoaded.notify_all();
+}
+
+void VocabularyLoader::Wait(const ORBVocabulary* pVocabulary)
+{
+    if(gnLoading.load()==0)
+        return;
+
+    unique_lock<mutex> lock(gMutexLoading);
+    while(IsLoadingLocked(pVocabulary))
+        gLoaded.wait(lock);
+}
+
+bool VocabularyLoader::IsLoading(const ORBVocabulary* pVocabulary)
+{
+    if(gnLoading.load()==0)
+        return false;
+
+    unique_lock<mutex> lock(gMutexLoading);
+    return IsLoadingLocked(pVocabulary);
+}
+
+} //namespace ORB_SLAM
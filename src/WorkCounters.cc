@@ -0,0 +1,279 @@
+#include "WorkCounters.h"
+
+#include <atomic>
+#include <cstdio>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+namespace
+{
+const int NUM_SEARCHES = static_cast<int>(MatcherSearch::NUM_SEARCHES);
+const int NUM_RUNS = static_cast<int>(OptimizerRun::NUM_RUNS);
+
+const char* SEARCH_NAMES[NUM_SEARCHES] =
+{
+    "ProjectionLocalMap",
+    "ProjectionLastFrame",
+    "ProjectionKeyFrame",
+    "ProjectionSim3",
+    "BoWFrame",
+    "BoWKeyFrames",
+    "Initialization",
+    "Triangulation",
+    "Fuse",
+    "FuseSim3",
+    "Sim3"
+};
+
+const char* RUN_NAMES[NUM_RUNS] =
+{
+    "PoseOptimization",
+    "LocalBundleAdjustment",
+    "BundleAdjustment",
+    "EssentialGraph",
+    "OptimizeSim3"
+};
+
+// Static storage so they start at zero
+struct MatcherSlot
+{
+    atomic<uint64_t> nCalls;
+    atomic<uint64_t> nCandidates;
+    atomic<uint64_t> nDistances;
+    atomic<uint64_t> nRotationRejected;
+    atomic<uint64_t> nMatches;
+};
+
+// Times in nanoseconds
+struct OptimizerSlot
+{
+    atomic<uint64_t> nCalls;
+    atomic<uint64_t> nVertices;
+    atomic<uint64_t> nEdges;
+    atomic<uint64_t> nIterations;
+    atomic<uint64_t> nOutliers;
+    atomic<double> chi2;
+    atomic<uint64_t> nTime;
+    atomic<uint64_t> nMaxTime;
+};
+
+MatcherSlot gMatcherSlots[NUM_SEARCHES];
+OptimizerSlot gOptimizerSlots[NUM_RUNS];
+
+thread_local MatcherCounts* tpCurrent = NULL;
+
+void Clear(MatcherCounts &counts)
+{
+    counts.nCalls = 0;
+    counts.nCandidates = 0;
+    counts.nDistances = 0;
+    counts.nRotationRejected = 0;
+    counts.nMatches = 0;
+}
+
+void Clear(OptimizerCounts &counts)
+{
+    counts.nCalls = 0;
+    counts.nVertices = 0;
+    counts.nEdges = 0;
+    counts.nIterations = 0;
+    counts.nOutliers = 0;
+    counts.chi2 = 0.0;
+    counts.time = 0.0;
+    counts.maxTime = 0.0;
+}
+
+double PerCall(const double total, const uint64_t nCalls)
+{
+    return nCalls ? total/nCalls : 0.0;
+}
+}
+
+bool WorkCounters::IsEnabled()
+{
+#ifdef ORB_SLAM2_WORK_COUNTERS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void WorkCounters::Add(const MatcherSearch search, const MatcherCounts &counts)
+{
+    MatcherSlot &slot = gMatcherSlots[static_cast<int>(search)];
+    slot.nCalls.fetch_add(counts.nCalls,memory_order_relaxed);
+    slot.nCandidates.fetch_add(counts.nCandidates,memory_order_relaxed);
+    slot.nDistances.fetch_add(counts.nDistances,memory_order_relaxed);
+    slot.nRotationRejected.fetch_add(counts.nRotationRejected,memory_order_relaxed);
+    slot.nMatches.fetch_add(counts.nMatches,memory_order_relaxed);
+}
+
+void WorkCounters::Add(const OptimizerRun run, const OptimizerCounts &counts)
+{
+    OptimizerSlot &slot = gOptimizerSlots[static_cast<int>(run)];
+    slot.nCalls.fetch_add(counts.nCalls,memory_order_relaxed);
+    slot.nVertices.fetch_add(counts.nVertices,memory_order_relaxed);
+    slot.nEdges.fetch_add(counts.nEdges,memory_order_relaxed);
+    slot.nIterations.fetch_add(counts.nIterations,memory_order_relaxed);
+    slot.nOutliers.fetch_add(counts.nOutliers,memory_order_relaxed);
+
+    double chi2 = slot.chi2.load(memory_order_relaxed);
+    while(!slot.chi2.compare_exchange_weak(chi2,chi2+counts.chi2,memory_order_relaxed))
+        ;
+
+    const uint64_t ns = static_cast<uint64_t>(counts.time*1e9);
+    slot.nTime.fetch_add(ns,memory_order_relaxed);
+    uint64_t nMax = slot.nMaxTime.load(memory_order_relaxed);
+    while(ns>nMax && !slot.nMaxTime.compare_exchange_weak(nMax,ns,memory_order_relaxed))
+        ;
+}
+
+MatcherCounts WorkCounters::Get(const MatcherSearch search)
+{
+    const MatcherSlot &slot = gMatcherSlots[static_cast<int>(search)];
+
+    MatcherCounts counts;
+    counts.nCalls = slot.nCalls.load(memory_order_relaxed);
+    counts.nCandidates = slot.nCandidates.load(memory_order_relaxed);
+    counts.nDistances = slot.nDistances.load(memory_order_relaxed);
+    counts.nRotationRejected = slot.nRotationRejected.load(memory_order_relaxed);
+    counts.nMatches = slot.nMatches.load(memory_order_relaxed);
+    return counts;
+}
+
+OptimizerCounts WorkCounters::Get(const OptimizerRun run)
+{
+    const OptimizerSlot &slot = gOptimizerSlots[static_cast<int>(run)];
+
+    OptimizerCounts counts;
+    counts.nCalls = slot.nCalls.load(memory_order_relaxed);
+    counts.nVertices = slot.nVertices.load(memory_order_relaxed);
+    counts.nEdges = slot.nEdges.load(memory_order_relaxed);
+    counts.nIterations = slot.nIterations.load(memory_order_relaxed);
+    counts.nOutliers = slot.nOutliers.load(memory_order_relaxed);
+    counts.chi2 = slot.chi2.load(memory_order_relaxed);
+    counts.time = slot.nTime.load(memory_order_relaxed)*1e-9;
+    counts.maxTime = slot.nMaxTime.load(memory_order_relaxed)*1e-9;
+    return counts;
+}
+
+void WorkCounters::Reset()
+{
+    for(int i=0; i<NUM_SEARCHES; i++)
+    {
+        MatcherSlot &slot = gMatcherSlots[i];
+        slot.nCalls = 0;
+        slot.nCandidates = 0;
+        slot.nDistances = 0;
+        slot.nRotationRejected = 0;
+        slot.nMatches = 0;
+    }
+    for(int i=0; i<NUM_RUNS; i++)
+    {
+        OptimizerSlot &slot = gOptimizerSlots[i];
+        slot.nCalls = 0;
+        slot.nVertices = 0;
+        slot.nEdges = 0;
+        slot.nIterations = 0;
+        slot.nOutliers = 0;
+        slot.chi2 = 0.0;
+        slot.nTime = 0;
+        slot.nMaxTime = 0;
+    }
+}
+
+const char* WorkCounters::Name(const MatcherSearch search)
+{
+    const int i = static_cast<int>(search);
+    return i>=0 && i<NUM_SEARCHES ? SEARCH_NAMES[i] : "Unknown";
+}
+
+const char* WorkCounters::Name(const OptimizerRun run)
+{
+    const int i = static_cast<int>(run);
+    return i>=0 && i<NUM_RUNS ? RUN_NAMES[i] : "Unknown";
+}
+
+void WorkCounters::Print(ostream &out)
+{
+    if(!IsEnabled())
+        return;
+
+    // Per call means
+    char line[256];
+    snprintf(line,sizeof(line),"%-24s %10s %12s %12s %10s %10s\n","search","calls","candidates","distances","rotation","matches");
+    out << endl << line;
+    for(int i=0; i<NUM_SEARCHES; i++)
+    {
+        const MatcherSearch search = static_cast<MatcherSearch>(i);
+        const MatcherCounts c = Get(search);
+        if(c.nCalls==0)
+            continue;
+        snprintf(line,sizeof(line),"%-24s %10llu %12.1f %12.1f %10.1f %10.1f\n",Name(search),
+                 static_cast<unsigned long long>(c.nCalls),PerCall(c.nCandidates,c.nCalls),
+                 PerCall(c.nDistances,c.nCalls),PerCall(c.nRotationRejected,c.nCalls),PerCall(c.nMatches,c.nCalls));
+        out << line;
+    }
+
+    snprintf(line,sizeof(line),"%-24s %10s %10s %10s %10s %10s %12s %10s %10s\n","optimization","calls","vertices",
+             "edges","iterations","outliers","chi2","mean [ms]","max [ms]");
+    out << endl << line;
+    for(int i=0; i<NUM_RUNS; i++)
+    {
+        const OptimizerRun run = static_cast<OptimizerRun>(i);
+        const OptimizerCounts c = Get(run);
+        if(c.nCalls==0)
+            continue;
+        snprintf(line,sizeof(line),"%-24s %10llu %10.1f %10.1f %10.1f %10.1f %12.3f %10.3f %10.3f\n",Name(run),
+                 static_cast<unsigned long long>(c.nCalls),PerCall(c.nVertices,c.nCalls),PerCall(c.nEdges,c.nCalls),
+                 PerCall(c.nIterations,c.nCalls),PerCall(c.nOutliers,c.nCalls),PerCall(c.chi2,c.nCalls),
+                 1e3*PerCall(c.time,c.nCalls),1e3*c.maxTime);
+        out << line;
+    }
+}
+
+ScopedMatcherCounter::ScopedMatcherCounter(const MatcherSearch search): mSearch(search), mpPrevious(tpCurrent)
+{
+    Clear(mCounts);
+    mCounts.nCalls = 1;
+    tpCurrent = &mCounts;
+}
+
+ScopedMatcherCounter::~ScopedMatcherCounter()
+{
+    tpCurrent = mpPrevious;
+    WorkCounters::Add(mSearch,mCounts);
+}
+
+MatcherCounts* ScopedMatcherCounter::Current()
+{
+    return tpCurrent;
+}
+
+ScopedOptimizerCounter::ScopedOptimizerCounter(const OptimizerRun run):
+    mRun(run), mStart(chrono::steady_clock::now())
+{
+    Clear(mCounts);
+    mCounts.nCalls = 1;
+}
+
+ScopedOptimizerCounter::~ScopedOptimizerCounter()
+{
+    mCounts.time = chrono::duration<double>(chrono::steady_clock::now()-mStart).count();
+    WorkCounters::Add(mRun,mCounts);
+}
+
+void ScopedOptimizerCounter::SetResult(const int nVertices, const int nEdges, const int nIterations,
+                                       const int nOutliers, const double chi2)
+{
+    mCounts.nVertices = nVertices;
+    mCounts.nEdges = nEdges;
+    mCounts.nIterations = nIterations;
+    mCounts.nOutliers = nOutliers;
+    mCounts.chi2 = chi2;
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,79 @@
+/**
+* Converts a YAML settings file into the binary form which ORB-SLAM2 reads without the YAML
+* parser (see Settings::Load), checks it for a sensor and prints its hash. The System takes either
+* file as its settings, the hash is the same for both.
+*
+* Usage: ./tools/bin_settings path_to_settings.yaml path_to_settings.bin [mono|stereo|rgbd]
+*/
+
+#include "Settings.h"
+
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if(argc != 3 && argc != 4)
+    {
+        cerr << endl << "Usage: ./bin_settings path_to_settings.yaml path_to_settings.bin [mono|stereo|rgbd]" << endl;
+        return 1;
+    }
+
+    const string strTextFile = argv[1];
+    const string strBinFile = argv[2];
+    const string strSensor = argc==4 ? argv[3] : "";
+
+    // System::eSensor
+    int sensor = -1;
+    if(strSensor=="mono")
+        sensor = 0;
+    else if(strSensor=="stereo")
+        sensor = 1;
+    else if(strSensor=="rgbd")
+        sensor = 2;
+    else if(!strSensor.empty())
+    {
+        cerr << "Unknown sensor " << strSensor << ", expected mono, stereo or rgbd" << endl;
+        return 1;
+    }
+
+    ORB_SLAM2::Settings settings;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if(!settings.Load(strTextFile))
+    {
+        cerr << "Failed to open settings file at: " << strTextFile << endl;
+        return 1;
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    cout << "Loaded " << strTextFile << " in " << chrono::duration_cast<chrono::duration<double> >(t1 - t0).count()
+         << " s" << endl;
+
+    if(sensor>=0 && !settings.Validate(sensor))
+    {
+        cerr << "The settings are not valid for " << strSensor << endl;
+        return 1;
+    }
+
+    if(!settings.Save(strBinFile))
+    {
+        cerr << "Failed to write the binary settings to: " << strBinFile << endl;
+        return 1;
+    }
+
+    // load it again to make sure the file is usable
+    ORB_SLAM2::Settings check;
+    t0 = chrono::steady_clock::now();
+    if(!check.Load(strBinFile) || check.GetHash() != settings.GetHash())
+    {
+        cerr << "The written binary settings could not be loaded again: " << strBinFile << endl;
+        return 1;
+    }
+    t1 = chrono::steady_clock::now();
+    cout << "Binary settings written to " << strBinFile << ", load in "
+         << chrono::duration_cast<chrono::duration<double> >(t1 - t0).count() << " s, hash "
+         << ORB_SLAM2::Settings::FormatHash(settings.GetHash()) << endl;
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+* Converts the text ORB vocabulary into the binary format which ORB-SLAM2
+* memory maps at startup (see TemplatedVocabulary::loadFromBinaryFile).
+*
+* Usage: ./tools/bin_vocabulary path_to_vocabulary.txt path_to_vocabulary.bin
+*/
+
+#include "ORBVocabulary.h"
+
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if(argc != 3)
+    {
+        cerr << endl << "Usage: ./bin_vocabulary path_to_vocabulary.txt path_to_vocabulary.bin" << endl;
+        return 1;
+    }
+
+    const string strTextFile = argv[1];
+    const string strBinFile = argv[2];
+
+    ORB_SLAM2::ORBVocabulary voc;
+
+    cout << "Loading text vocabulary " << strTextFile << " ..." << endl;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if(!voc.loadFromTextFile(strTextFile))
+    {
+        cerr << "Failed to load the text vocabulary at: " << strTextFile << endl;
+        return 1;
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    cout << "Loaded " << voc.size() << " words in "
+         << chrono::duration_cast<chrono::duration<double> >(t1 - t0).count() << " s" << endl;
+
+    if(!voc.saveToBinaryFile(strBinFile))
+    {
+        cerr << "Failed to write the binary vocabulary to: " << strBinFile << endl;
+        return 1;
+    }
+
+    // load it again to make sure the file is usable
+    ORB_SLAM2::ORBVocabulary check;
+    t0 = chrono::steady_clock::now();
+    if(!check.loadFromBinaryFile(strBinFile) || check.size() != voc.size())
+    {
+        cerr << "The written binary vocabulary could not be loaded again: " << strBinFile << endl;
+        return 1;
+    }
+    t1 = chrono::steady_clock::now();
+    cout << "Binary vocabulary written to " << strBinFile << ", loads in "
+         << chrono::duration_cast<chrono::duration<double> >(t1 - t0).count() << " s" << endl;
+
+    return 0;
+}
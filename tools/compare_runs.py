@@ -0,0 +1,362 @@
+"""
+Compares two runs of ORB SLAM on the same dataset, a baseline and a candidate (two builds or two
+configurations), and prints the deltas side by side with their significance:
+
+    python tools/compare_runs.py --baseline old/*.json old/report.jsonl old/CameraTrajectory.txt \\
+                                 --candidate new/*.json new/report.jsonl new/CameraTrajectory.txt \\
+                                 --groundtruth rgbd_dataset_freiburg1_xyz/groundtruth.txt
+
+The files of a run are recognized by their content, several of a kind are repetitions:
+    - performance reports (Logging.ReportFile, JSON lines): latency distribution of every stage
+    - results of orbslam_replay: throughput, latency percentiles, tracked frames, ATE
+    - results of orbslam_bench: time and allocations per operation of every micro-benchmark
+    - trajectories (TUM format, with --groundtruth): ATE and RPE of the positions
+
+Stage latencies and per-pose errors are compared with a Mann-Whitney U test over their samples,
+values of the runs (throughput, ns/op, ...) with a Welch t-test over the repetitions, which
+needs at least two per side. The p-values are two-sided, scipy gives exact t distributions, the
+normal approximation is used without it. The exit status is 1 if something got significantly
+worse (--alpha), so a CI job can run it.
+"""
+from __future__ import print_function
+import argparse
+import json
+import math
+import sys
+
+import numpy as np
+
+try:
+    import scipy.stats
+except ImportError:
+    scipy = None
+
+# Maximum time difference between an estimated pose and its ground truth, in seconds, as
+# TrajectoryEvaluation::MAX_ASSOCIATION_DT
+MAX_ASSOCIATION_DT = 0.02
+
+# Replay results compared, key path, name and whether higher is better
+REPLAY_METRICS = [
+        (("throughput_fps",),    "throughput (fps)",    True),
+        (("latency_ms", "p50"),  "latency p50 (ms)",    False),
+        (("latency_ms", "p90"),  "latency p90 (ms)",    False),
+        (("latency_ms", "p99"),  "latency p99 (ms)",    False),
+        (("tracked",),           "tracked frames",      True),
+        (("dropped",),           "dropped frames",      False),
+        (("ate", "rmse"),        "ATE rmse (m)",        False)
+        ]
+
+####################################################################################################
+
+class Run(object):
+    """
+    The files of one side of the comparison, sorted by kind
+    """
+    def __init__(self, paths):
+        self.reports = []
+        self.replays = []
+        self.benchmarks = []
+        self.trajectories = []
+        for path in paths:
+            self.__add(path)
+
+    def __add(self, path):
+        with open(path, 'r') as file:
+            content = file.read()
+        stripped = content.lstrip()
+        if stripped.startswith("{"):
+            try:
+                result = json.loads(content)
+            except ValueError:
+                self.reports.append([json.loads(line) for line in content.splitlines() if line.strip()])
+                return
+            if "benchmarks" in result:
+                self.benchmarks.append(result)
+            elif "throughput_fps" in result:
+                self.replays.append(result)
+            elif "stages_us" in result:
+                self.reports.append([result])
+            else:
+                raise ValueError("{}: not a replay, benchmark nor performance report".format(path))
+        else:
+            self.trajectories.append(read_trajectory(content))
+
+
+def read_trajectory(content):
+    """
+    Timestamps in seconds and positions of a TUM trajectory or a EuRoC ground truth (data.csv,
+    nanoseconds), sorted by timestamp
+    """
+    rows = []
+    for line in content.splitlines():
+        line = line.strip()
+        if not line or line.startswith("#"):
+            continue
+        rows.append([float(v) for v in line.replace(",", " ").split()[:4]])
+    data = np.array(rows)
+    if len(data) and data[0, 0] > 1e12:
+        data[:, 0] /= 1e9
+    data = data[np.argsort(data[:, 0])]
+    return data[:, 0], data[:, 1:4]
+
+
+def associate(times, ground_truth_times):
+    """
+    Index of the nearest ground truth of every time, -1 where none is within MAX_ASSOCIATION_DT
+    """
+    j = np.clip(np.searchsorted(ground_truth_times, times), 1, len(ground_truth_times) - 1)
+    nearest = np.where(np.abs(ground_truth_times[j - 1] - times) < np.abs(ground_truth_times[j] - times), j - 1, j)
+    return np.where(np.abs(ground_truth_times[nearest] - times) <= MAX_ASSOCIATION_DT, nearest, -1)
+
+
+def align(estimate, ground_truth, with_scale):
+    """
+    Umeyama alignment of the estimated positions to the ground truth, the aligned positions
+    """
+    mu_e = estimate.mean(axis=0)
+    mu_g = ground_truth.mean(axis=0)
+    e = estimate - mu_e
+    g = ground_truth - mu_g
+    U, D, Vt = np.linalg.svd(np.dot(g.T, e) / len(e))
+    S = np.eye(3)
+    if np.linalg.det(U) * np.linalg.det(Vt) < 0:
+        S[2, 2] = -1
+    R = np.dot(U, np.dot(S, Vt))
+    s = np.trace(np.dot(np.diag(D), S)) / (e ** 2).sum(axis=1).mean() if with_scale else 1.0
+    return s * np.dot(e, R.T) + mu_g
+
+
+def trajectory_errors(trajectory, ground_truth, with_scale, rpe_delta):
+    """
+    Per pose position errors after the alignment (ATE) and errors of the displacement over
+    rpe_delta seconds (RPE, translation only), None if fewer than 3 poses have a ground truth
+    """
+    times, positions = trajectory
+    index = associate(times, ground_truth[0])
+    valid = index >= 0
+    if valid.sum() < 3:
+        return None
+    times = times[valid]
+    estimate = align(positions[valid], ground_truth[1][index[valid]], with_scale)
+    truth = ground_truth[1][index[valid]]
+    ate = np.linalg.norm(estimate - truth, axis=1)
+
+    later = np.searchsorted(times, times + rpe_delta)
+    pairs = later < len(times)
+    first = np.nonzero(pairs)[0]
+    second = later[pairs]
+    rpe = np.linalg.norm((estimate[second] - estimate[first]) - (truth[second] - truth[first]), axis=1)
+    return ate, rpe
+
+####################################################################################################
+
+def normal_p(z):
+    return math.erfc(abs(z) / math.sqrt(2.0))
+
+
+def mann_whitney(x, y):
+    """
+    Two-sided p-value of the U test, normal approximation with the tie correction
+    """
+    n1, n2 = len(x), len(y)
+    if n1 == 0 or n2 == 0:
+        return None
+    if scipy is not None:
+        return scipy.stats.mannwhitneyu(x, y, alternative="two-sided").pvalue
+    values = np.concatenate([x, y])
+    order = np.argsort(values, kind="mergesort")
+    ranks = np.empty(len(values))
+    sorted_values = values[order]
+    i = 0
+    ties = 0.0
+    while i < len(values):
+        j = i
+        while j + 1 < len(values) and sorted_values[j + 1] == sorted_values[i]:
+            j += 1
+        ranks[order[i:j + 1]] = 0.5 * (i + j) + 1
+        t = j - i + 1
+        ties += t ** 3 - t
+        i = j + 1
+    u = ranks[:n1].sum() - n1 * (n1 + 1) / 2.0
+    n = n1 + n2
+    variance = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1))) if n > 1 else 0.0
+    if variance <= 0:
+        return 1.0
+    return normal_p((u - n1 * n2 / 2.0) / math.sqrt(variance))
+
+
+def welch(x, y):
+    """
+    Two-sided p-value of the difference of the means, None with fewer than two values per side
+    """
+    if len(x) < 2 or len(y) < 2:
+        return None
+    vx = np.var(x, ddof=1) / len(x)
+    vy = np.var(y, ddof=1) / len(y)
+    if vx + vy == 0:
+        return 1.0 if np.mean(x) == np.mean(y) else 0.0
+    t = (np.mean(x) - np.mean(y)) / math.sqrt(vx + vy)
+    if scipy is None:
+        return normal_p(t)
+    df = (vx + vy) ** 2 / (vx ** 2 / (len(x) - 1) + vy ** 2 / (len(y) - 1))
+    return 2.0 * scipy.stats.t.sf(abs(t), df)
+
+####################################################################################################
+
+class Table(object):
+    """
+    Rows of baseline, candidate, delta and p-value, and whether any got significantly worse
+    """
+    def __init__(self, alpha):
+        self.alpha = alpha
+        self.regressions = []
+
+    def section(self, title):
+        print("")
+        print(title)
+        print("{:<44} {:>12} {:>12} {:>9} {:>9}".format("", "baseline", "candidate", "delta", "p"))
+
+    def row(self, name, baseline, candidate, p, higher_is_better=False):
+        delta = "n/a"
+        if baseline != 0:
+            delta = "{:+.1f}%".format(100.0 * (candidate - baseline) / abs(baseline))
+        verdict = ""
+        if p is not None and p < self.alpha and candidate != baseline:
+            better = (candidate > baseline) == higher_is_better
+            verdict = "better" if better else "WORSE"
+            if not better:
+                self.regressions.append(name)
+        print("{:<44} {:>12.4g} {:>12.4g} {:>9} {:>9} {}".format(
+            name[:44], baseline, candidate, delta, "n/a" if p is None else "{:.3g}".format(p), verdict))
+
+
+def stage_samples(reports):
+    """
+    Microseconds of every stage over all the records of the reports, the stages not run by a
+    record left out
+    """
+    samples = {}
+    for report in reports:
+        for record in report:
+            for stage, us in record.get("stages_us", {}).items():
+                if us > 0:
+                    samples.setdefault(stage, []).append(us)
+    return dict((stage, np.array(values)) for stage, values in samples.items())
+
+
+def compare_stages(table, baseline, candidate):
+    a = stage_samples(baseline.reports)
+    b = stage_samples(candidate.reports)
+    stages = sorted(set(a) & set(b))
+    if not stages:
+        return
+    table.section("Stage latencies (us, per record)")
+    for stage in stages:
+        p = mann_whitney(a[stage], b[stage])
+        for q in (50, 90, 99):
+            table.row("{} p{}".format(stage, q), np.percentile(a[stage], q), np.percentile(b[stage], q),
+                      p if q == 50 else None)
+        table.row("{} mean".format(stage), a[stage].mean(), b[stage].mean(), None)
+
+
+def lookup(result, path):
+    for key in path:
+        if result is None:
+            return None
+        result = result.get(key)
+    return result
+
+
+def compare_replays(table, baseline, candidate):
+    if not baseline.replays or not candidate.replays:
+        return
+    table.section("Replay ({} vs {} runs)".format(len(baseline.replays), len(candidate.replays)))
+    for path, name, higher_is_better in REPLAY_METRICS:
+        a = [v for v in (lookup(r, path) for r in baseline.replays) if v is not None]
+        b = [v for v in (lookup(r, path) for r in candidate.replays) if v is not None]
+        if a and b:
+            table.row(name, np.mean(a), np.mean(b), welch(a, b), higher_is_better)
+
+
+def compare_benchmarks(table, baseline, candidate):
+    if not baseline.benchmarks or not candidate.benchmarks:
+        return
+    def by_name(results, key):
+        values = {}
+        for result in results:
+            for benchmark in result["benchmarks"]:
+                values.setdefault(benchmark["name"], []).append(benchmark[key])
+        return values
+    table.section("Micro-benchmarks ({} vs {} runs)".format(len(baseline.benchmarks), len(candidate.benchmarks)))
+    for key, unit in (("ns_per_op", "ns/op"), ("allocs_per_op", "allocs/op"), ("bytes_per_op", "bytes/op")):
+        a = by_name(baseline.benchmarks, key)
+        b = by_name(candidate.benchmarks, key)
+        for name in sorted(set(a) & set(b)):
+            table.row("{} {}".format(name, unit), np.mean(a[name]), np.mean(b[name]), welch(a[name], b[name]))
+
+
+def compare_trajectories(table, baseline, candidate, ground_truth, with_scale, rpe_delta):
+    if not baseline.trajectories or not candidate.trajectories:
+        return
+    def errors(run):
+        ate, rpe = [], []
+        for trajectory in run.trajectories:
+            result = trajectory_errors(trajectory, ground_truth, with_scale, rpe_delta)
+            if result is None:
+                print("A trajectory has fewer than 3 poses associated to the ground truth", file=sys.stderr)
+                continue
+            ate.append(result[0])
+            rpe.append(result[1])
+        return ate, rpe
+    ate_a, rpe_a = errors(baseline)
+    ate_b, rpe_b = errors(candidate)
+    if not ate_a or not ate_b:
+        return
+    table.section("Accuracy ({} vs {} trajectories)".format(len(ate_a), len(ate_b)))
+    rmse = lambda runs: [math.sqrt(np.mean(e ** 2)) for e in runs]
+    table.row("ATE rmse (m)", np.mean(rmse(ate_a)), np.mean(rmse(ate_b)), welch(rmse(ate_a), rmse(ate_b)))
+    for name, a, b in (("ATE", ate_a, ate_b), ("RPE {:g} s".format(rpe_delta), rpe_a, rpe_b)):
+        a = np.concatenate(a)
+        b = np.concatenate(b)
+        if len(a) and len(b):
+            table.row(name + " median (m)", np.median(a), np.median(b), mann_whitney(a, b))
+            table.row(name + " max (m)", a.max(), b.max(), None)
+
+####################################################################################################
+
+if __name__ == "__main__":
+    arg_parser = argparse.ArgumentParser(description="Compares two runs of ORB SLAM on the same dataset.",
+                                         formatter_class=argparse.RawTextHelpFormatter)
+    arg_parser.add_argument("-a", "--baseline", nargs="+", required=True,
+                            help="Reports, replay and benchmark results, trajectories of the baseline")
+    arg_parser.add_argument("-b", "--candidate", nargs="+", required=True,
+                            help="The same of the candidate")
+    arg_parser.add_argument("-g", "--groundtruth", help="Ground truth of the trajectories (TUM or EuRoC data.csv)")
+    arg_parser.add_argument("--scale", action="store_true",
+                            help="Aligns the trajectories with a similarity, for monocular runs")
+    arg_parser.add_argument("--rpe-delta", type=float, default=1.0,
+                            help="Seconds of the displacements of the RPE (default 1)")
+    arg_parser.add_argument("--alpha", type=float, default=0.05, help="Significance level (default 0.05)")
+    args = arg_parser.parse_args()
+
+    baseline = Run(args.baseline)
+    candidate = Run(args.candidate)
+    table = Table(args.alpha)
+    if scipy is None:
+        print("scipy not found, the p-values are normal approximations")
+
+    compare_stages(table, baseline, candidate)
+    compare_replays(table, baseline, candidate)
+    compare_benchmarks(table, baseline, candidate)
+    if args.groundtruth:
+        with open(args.groundtruth, 'r') as file:
+            ground_truth = read_trajectory(file.read())
+        compare_trajectories(table, baseline, candidate, ground_truth, args.scale, args.rpe_delta)
+    elif baseline.trajectories or candidate.trajectories:
+        print("The trajectories need a --groundtruth", file=sys.stderr)
+
+    print("")
+    if table.regressions:
+        print("Significantly worse: " + ", ".join(table.regressions))
+        sys.exit(1)
+    print("Nothing significantly worse")
@@ -8,6 +8,8 @@ import matplotlib.lines as lines
 import os
 import re
 
+import event_log
+
 ####################################################################################################
 
 logger = logging.getLogger("Status plotter")
@@ -28,21 +30,45 @@ event_messages = {
         "Done"  : "End of process."
         }
 
+# events of the binary event log (Logging.EventFile)
+event_log_types = {
+        event_log.INITIALIZED : "Init",
+        event_log.LOST        : "Lost",
+        event_log.RELOCALIZED : "Reloc",
+        event_log.LOOP        : "Loop",
+        event_log.RESET       : "Reset",
+        event_log.DONE        : "Done"
+        }
+
 ####################################################################################################
 
 class OrbSlamSession(object):
     """
     Extracts a Representation of a single ORB SLAM run
-    from it's corresponding orb_slam_status.log.
+    from it's corresponding orb_slam_status.log, or from its binary event log.
     Holds:
         - all events that happend during the given run
         - total amount of frames in the run
     """
     def __init__(self, path_to_log):
+        if event_log.is_event_log(path_to_log):
+            self.events, self.total_frame_count = self.__read_event_log(path_to_log)
+            return
         self.events = self.__create_events(path_to_log)
         self.total_frame_count = self.__read_total_frame_count(self.events[0].log_line)
 
 
+    def __read_event_log(self, path_to_log):
+        log = event_log.read(path_to_log, use_numpy=False)
+        events = []
+        total_frame_count = 0
+        for record in log.records:
+            total_frame_count = max(total_frame_count, record.image)
+            if record.type in event_log_types:
+                events.append(OrbSlamEvent.from_record(record, len(events)))
+        return events, total_frame_count
+
+
     def __create_events(self, path_to_log):
         # read log file
         with open(path_to_log, 'r') as file:
@@ -206,11 +232,25 @@ class OrbSlamEvent(object):
     """
     def __init__(self, log_line, event_number):
         self.log_line = log_line
+        if log_line is None:
+            return
         self.frame_number = self.__extract_frame_number(log_line)
         self.event_number = event_number
         self.event_type = self.__extract_event_type(log_line)
 
 
+    @classmethod
+    def from_record(cls, record, event_number):
+        """
+        The event of a record of the binary event log.
+        """
+        event = cls(None, event_number)
+        event.frame_number = record.image
+        event.event_number = event_number
+        event.event_type = event_log_types[record.type]
+        return event
+
+
     def __extract_event_type(self, log_line):
         # match log line with event messages
         for event, message in event_messages.items():
@@ -244,7 +284,7 @@ def main():
                                          + " plot which shows when which events (loops found etc.)"
                                          + " happend during a session.",
                                          formatter_class=argparse.RawTextHelpFormatter)
-    arg_parser.add_argument("input_path", help="Path to orb_slam_status.log")
+    arg_parser.add_argument("input_path", help="Path to orb_slam_status.log or to the binary event log")
     args = arg_parser.parse_args()
 
     input_path = args.input_path
@@ -0,0 +1,119 @@
+"""
+Reads the binary event log of ORB SLAM (Logging.EventFile, see include/EventLog.h).
+
+With numpy, read() maps the records into a structured array in one call:
+
+    import event_log
+    log = event_log.read("events.bin")
+    frames = log.records[log.records["type"] == event_log.FRAME]
+    print(frames["stage_times"][:, log.stages.index("TRACK")].mean())
+
+Without numpy it returns a list of Record tuples. As a script it prints a summary of the log.
+"""
+import argparse
+import collections
+import struct
+
+MAGIC = b"ORBEVLOG"
+
+FRAME = 0
+SKIPPED = 1
+INITIALIZED = 2
+LOST = 3
+RELOCALIZED = 4
+KEYFRAME = 5
+LOOP = 6
+GLOBAL_BA = 7
+RESET = 8
+DONE = 9
+SETTINGS = 10
+
+TYPE_NAMES = ("FRAME", "SKIPPED", "INITIALIZED", "LOST", "RELOCALIZED", "KEYFRAME", "LOOP",
+              "GLOBAL_BA", "RESET", "DONE", "SETTINGS")
+
+# type, state, image, timestamp, wall_time, value1, value2, then one float per stage
+RECORD_FORMAT = "<IiQddII"
+
+Record = collections.namedtuple("Record", "type state image timestamp wall_time value1 value2 stage_times")
+
+EventLog = collections.namedtuple("EventLog", "stages records")
+
+
+def is_event_log(path):
+    with open(path, "rb") as file:
+        return file.read(len(MAGIC)) == MAGIC
+
+
+def __read_header(data):
+    if data[:len(MAGIC)] != MAGIC:
+        raise ValueError("Not an event log")
+    record_size, num_stages = struct.unpack_from("<II", data, len(MAGIC))
+    offset = len(MAGIC) + 8
+    stages = []
+    for i in range(num_stages):
+        end = data.index(b"\0", offset)
+        stages.append(data[offset:end].decode("ascii"))
+        offset = end + 1
+    if record_size != struct.calcsize(RECORD_FORMAT) + 4 * num_stages:
+        raise ValueError("Unexpected record size {}".format(record_size))
+    return stages, record_size, offset
+
+
+def dtype(num_stages):
+    import numpy
+    return numpy.dtype([("type", "<u4"), ("state", "<i4"), ("image", "<u8"), ("timestamp", "<f8"),
+                        ("wall_time", "<f8"), ("value1", "<u4"), ("value2", "<u4"),
+                        ("stage_times", "<f4", (num_stages,))])
+
+
+def read(path, use_numpy=True):
+    """
+    Returns the names of the stages and the records, a numpy structured array or a list of
+    Record. A record cut off by the end of the file (the log of a crashed run) is left out.
+    """
+    with open(path, "rb") as file:
+        data = file.read()
+    stages, record_size, offset = __read_header(data)
+    count = (len(data) - offset) // record_size
+
+    if use_numpy:
+        try:
+            import numpy
+            records = numpy.frombuffer(data, dtype=dtype(len(stages)), count=count, offset=offset)
+            return EventLog(stages, records)
+        except ImportError:
+            pass
+
+    record_format = RECORD_FORMAT + "{}f".format(len(stages))
+    records = []
+    for values in struct.iter_unpack(record_format, data[offset:offset + count * record_size]):
+        records.append(Record(*(values[:7] + (values[7:],))))
+    return EventLog(stages, records)
+
+
+def main():
+    arg_parser = argparse.ArgumentParser(description="Prints a summary of an ORB SLAM event log.")
+    arg_parser.add_argument("input_path", help="Path to the event log (Logging.EventFile)")
+    args = arg_parser.parse_args()
+
+    log = read(args.input_path, use_numpy=False)
+    counts = collections.Counter(record.type for record in log.records)
+    for event_type, count in sorted(counts.items()):
+        name = TYPE_NAMES[event_type] if event_type < len(TYPE_NAMES) else str(event_type)
+        print("{:12} {}".format(name, count))
+
+    for record in log.records:
+        if record.type == SETTINGS:
+            print("Settings hash {:016x}".format(record.value2 << 32 | record.value1))
+
+    frames = [record for record in log.records if record.type == FRAME]
+    if frames:
+        print("Mean microseconds per tracked frame:")
+        for i, stage in enumerate(log.stages):
+            total = sum(record.stage_times[i] for record in frames)
+            if total > 0:
+                print("  {:26} {:10.1f}".format(stage, total / len(frames)))
+
+
+if __name__ == '__main__':
+    main()
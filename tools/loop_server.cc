@@ -0,0 +1,62 @@
+/**
+* Closes the loops of a remote ORB-SLAM2 whose settings point LoopClosing.Server at this host (see
+* LoopServer.h). The settings give the port (LoopClosing.ServerPort), the parameters of the loop
+* closing (LoopClosing.nThreads, MaxGBAKeyFrames, GBATimeBudget) and the linear solver of the
+* optimizations, the vocabulary must be the one of the client. Serves until it is interrupted.
+*
+* Usage: ./tools/loop_server path_to_vocabulary path_to_settings
+*/
+
+#include "LoopServer.h"
+#include "Optimizer.h"
+#include "Settings.h"
+#include "System.h"
+#include "ThreadConfig.h"
+
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if(argc != 3)
+    {
+        cerr << endl << "Usage: ./loop_server path_to_vocabulary path_to_settings" << endl;
+        return 1;
+    }
+
+    ORB_SLAM2::Settings fSettings;
+    if(!fSettings.Load(argv[2]))
+    {
+        cerr << "Failed to open settings file at: " << argv[2] << endl;
+        return 1;
+    }
+
+    const int nPort = fSettings["LoopClosing.ServerPort"];
+    if(nPort<=0)
+    {
+        cerr << "LoopClosing.ServerPort is not set in " << argv[2] << endl;
+        return 1;
+    }
+    ORB_SLAM2::ThreadConfig::Load(fSettings);
+
+    const int nMaxGBAKeyFrames = fSettings["LoopClosing.MaxGBAKeyFrames"];
+    const float fGBATimeBudget = fSettings["LoopClosing.GBATimeBudget"];
+    int nThreads = fSettings["LoopClosing.nThreads"];
+    if(nThreads<1)
+        nThreads = 1;
+
+    int nLinearSolver = fSettings["Optimizer.LinearSolver"];
+    int nBlockOrdering = fSettings["Optimizer.BlockOrdering"];
+    ORB_SLAM2::Optimizer::SetLinearSolver(nLinearSolver==ORB_SLAM2::Optimizer::PCG ? ORB_SLAM2::Optimizer::PCG :
+                                          ORB_SLAM2::Optimizer::SPARSE_CHOLESKY, nBlockOrdering!=0);
+
+    ORB_SLAM2::ORBVocabulary* pVocabulary = ORB_SLAM2::System::LoadVocabulary(argv[1]);
+    if(!pVocabulary)
+        return 1;
+
+    ORB_SLAM2::LoopServer server(pVocabulary,nPort,nMaxGBAKeyFrames,fGBATimeBudget,nThreads);
+    server.Run();
+
+    return 0;
+}
@@ -0,0 +1,1012 @@
+/**
+* Micro-benchmarks of the hot kernels on recorded data: the images of a sequence and the map
+* which System::SaveMap wrote for it, with the same vocabulary and settings. Keyframes of the
+* map are matched to their images by timestamp, the frames of these images and of the images
+* right after them are the inputs of the frame kernels, the keyframes and their covisible ones
+* those of the keyframe kernels.
+*
+* Every benchmark reports the mean time and the heap allocations (of all threads, malloc and
+* new) per operation, written as JSON to path_to_results.json. Only the time of the operation
+* itself is measured, not resetting its inputs. Fuse and LocalBundleAdjustment change the map,
+* they run last and once per keyframe.
+*
+* The poses of the float PoseOptimization (Optimizer.SinglePrecision) are compared to the double
+* one on every sample, the largest and mean differences go to the results as well. So are the
+* matches of the batched candidate search (ORBmatcher.batchCandidates) to those of SearchByBoW
+* one candidate after the other, which have to be the same: the tool exits with 1 if they are not.
+*
+* The image list has one "timestamp left_image [right_image]" line per frame, paths relative
+* to the list, '#' starts a comment: the rgb.txt of a TUM sequence works as it is. The stereo
+* matching is only measured with right images and a Camera.bf in the settings.
+*
+* Usage: ./tools/orbslam_bench path_to_vocabulary path_to_settings path_to_image_list path_to_map
+*                              path_to_results.json [name_filter]
+*/
+
+#include "BowDistanceBatch.h"
+#include "Frame.h"
+#include "HammingDistance.h"
+#include "KeyFrame.h"
+#include "KeyFrameDatabase.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "MapSerializer.h"
+#include "ORBVocabulary.h"
+#include "ORBextractor.h"
+#include "ORBmatcher.h"
+#include "Optimizer.h"
+#include "Settings.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace ORB_SLAM2;
+
+namespace
+{
+// Heap allocations of the whole process, counted by the allocation functions below
+atomic<uint64_t> gnAllocs(0);
+atomic<uint64_t> gnAllocBytes(0);
+
+inline void CountAlloc(const size_t n)
+{
+    gnAllocs.fetch_add(1,memory_order_relaxed);
+    gnAllocBytes.fetch_add(n,memory_order_relaxed);
+}
+}
+
+#ifdef __GLIBC__
+
+// The malloc family is replaced so the cv::Mat and Eigen buffers count as well as new
+extern "C"
+{
+void* __libc_malloc(size_t n);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t n);
+void* __libc_memalign(size_t alignment, size_t n);
+
+void* malloc(size_t n)
+{
+    CountAlloc(n);
+    return __libc_malloc(n);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    CountAlloc(n*size);
+    return __libc_calloc(n,size);
+}
+
+void* realloc(void* p, size_t n)
+{
+    CountAlloc(n);
+    return __libc_realloc(p,n);
+}
+
+void* memalign(size_t alignment, size_t n)
+{
+    CountAlloc(n);
+    return __libc_memalign(alignment,n);
+}
+
+void* aligned_alloc(size_t alignment, size_t n)
+{
+    CountAlloc(n);
+    return __libc_memalign(alignment,n);
+}
+
+int posix_memalign(void** pp, size_t alignment, size_t n)
+{
+    if(alignment%sizeof(void*)!=0 || (alignment&(alignment-1))!=0)
+        return EINVAL;
+    CountAlloc(n);
+    void* p = __libc_memalign(alignment,n);
+    if(!p)
+        return ENOMEM;
+    *pp = p;
+    return 0;
+}
+}
+
+#else
+
+void* operator new(size_t n)
+{
+    CountAlloc(n);
+    void* p = malloc(n ? n : 1);
+    if(!p)
+        throw bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n)
+{
+    return operator new(n);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+#endif
+
+namespace
+{
+
+// Each benchmark runs at least this long and this many operations, unless limited
+const double MIN_SECONDS = 1.0; //param
+const size_t MIN_OPS = 10; //param
+// Keyframes used as inputs, spread over the map
+const size_t MAX_SAMPLES = 50; //param
+// Stereo matching runs this many times on a pair before the next one is extracted
+const size_t STEREO_OPS_PER_PAIR = 8; //param
+
+struct Benchmark
+{
+    string name;
+    // Operation i, i counts from 0
+    function<void(size_t)> op;
+    // Resets the inputs of operation i, not measured. Without it the operations are timed in batches.
+    function<void(size_t)> prepare;
+    // Number of operations if the benchmark changes its inputs for good, 0 for no limit
+    size_t nMaxOps;
+};
+
+struct Result
+{
+    string name;
+    uint64_t nOps;
+    double nsPerOp;
+    double allocsPerOp;
+    double bytesPerOp;
+};
+
+// Poses of the float PoseOptimization against the double one, from the same inputs
+struct PosePrecision
+{
+    size_t nFrames;
+    // Camera centers (map units) and rotations (radians)
+    double maxTranslation;
+    double meanTranslation;
+    double maxRotation;
+    // Frames whose number of inliers differs
+    size_t nInlierChanges;
+};
+
+// Matches of the batched SearchByBoW against those of the search of one candidate after the other
+struct BatchAgreement
+{
+    size_t nQueries;
+    size_t nCandidates;
+    // Candidates with another match or number of matches
+    size_t nMismatches;
+};
+
+struct ImageEntry
+{
+    double timestamp;
+    string strLeft;
+    string strRight;
+};
+
+// A keyframe of the map with the frame of its image and of the next image
+struct Sample
+{
+    KeyFrame* pKF;
+    // Best covisible keyframe, NULL if it has none
+    KeyFrame* pKF2;
+    size_t nImage;
+    Frame frame;
+    Frame next;
+    // Matches of frame to the map points of pKF, by SearchByBoW
+    vector<MapPoint*> vpMatches;
+    // Map points of pKF and of its best covisible keyframes, as the local map of the tracking
+    vector<MapPoint*> vpLocalMapPoints;
+    // Map points of the covisible keyframes which pKF does not observe, as SearchInNeighbors fuses
+    vector<MapPoint*> vpFuseCandidates;
+    // Matches of pKF to pKF2 by SearchByBoW
+    vector<MapPoint*> vpMatches12;
+    cv::Mat F12;
+    float minLoopScore;
+    // Relocalization candidates of next
+    vector<KeyFrame*> vpRelocCandidates;
+    // Loop candidates of pKF and its best covisible keyframes, with which it shares most nodes
+    vector<KeyFrame*> vpLoopCandidates;
+};
+
+double Seconds(const chrono::steady_clock::duration &d)
+{
+    return chrono::duration_cast<chrono::duration<double> >(d).count();
+}
+
+Result Run(const Benchmark &bench)
+{
+    uint64_t nOps = 0;
+    uint64_t nAllocs = 0;
+    uint64_t nBytes = 0;
+    chrono::steady_clock::duration time = chrono::steady_clock::duration::zero();
+
+    if(bench.prepare)
+    {
+        if(bench.nMaxOps==0)
+        {
+            bench.prepare(0);
+            bench.op(0);
+        }
+
+        while(bench.nMaxOps==0 ? (nOps<MIN_OPS || Seconds(time)<MIN_SECONDS) : nOps<bench.nMaxOps)
+        {
+            bench.prepare(nOps);
+            const uint64_t nAllocs0 = gnAllocs.load(memory_order_relaxed);
+            const uint64_t nBytes0 = gnAllocBytes.load(memory_order_relaxed);
+            const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            bench.op(nOps);
+            time += chrono::steady_clock::now()-t0;
+            nAllocs += gnAllocs.load(memory_order_relaxed)-nAllocs0;
+            nBytes += gnAllocBytes.load(memory_order_relaxed)-nBytes0;
+            nOps++;
+        }
+    }
+    else
+    {
+        bench.op(0);
+
+        // Batches of doubling size, so reading the clock does not count for short operations
+        for(uint64_t nBatch=1; nOps<MIN_OPS || Seconds(time)<MIN_SECONDS; nBatch*=2)
+        {
+            const uint64_t nAllocs0 = gnAllocs.load(memory_order_relaxed);
+            const uint64_t nBytes0 = gnAllocBytes.load(memory_order_relaxed);
+            const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            for(uint64_t i=0; i<nBatch; i++)
+                bench.op(nOps+i);
+            time += chrono::steady_clock::now()-t0;
+            nAllocs += gnAllocs.load(memory_order_relaxed)-nAllocs0;
+            nBytes += gnAllocBytes.load(memory_order_relaxed)-nBytes0;
+            nOps += nBatch;
+        }
+    }
+
+    Result result;
+    result.name = bench.name;
+    result.nOps = nOps;
+    result.nsPerOp = nOps ? chrono::duration_cast<chrono::duration<double,nano> >(time).count()/nOps : 0.0;
+    result.allocsPerOp = nOps ? static_cast<double>(nAllocs)/nOps : 0.0;
+    result.bytesPerOp = nOps ? static_cast<double>(nBytes)/nOps : 0.0;
+    return result;
+}
+
+bool LoadImageList(const string &strFile, vector<ImageEntry> &vImages)
+{
+    ifstream f(strFile.c_str());
+    if(!f.is_open())
+        return false;
+
+    const size_t nSlash = strFile.rfind('/');
+    const string strDir = nSlash==string::npos ? string() : strFile.substr(0,nSlash+1);
+
+    string s;
+    while(getline(f,s))
+    {
+        if(s.empty() || s[0]=='#')
+            continue;
+
+        stringstream ss(s);
+        ImageEntry entry;
+        if(!(ss >> entry.timestamp >> entry.strLeft))
+            continue;
+        entry.strLeft = strDir+entry.strLeft;
+        if(ss >> entry.strRight)
+            entry.strRight = strDir+entry.strRight;
+        vImages.push_back(entry);
+    }
+    return true;
+}
+
+cv::Mat LoadGray(const string &strFile, const bool bRGB)
+{
+    cv::Mat im = cv::imread(strFile,CV_LOAD_IMAGE_UNCHANGED);
+    if(im.channels()==3)
+        cv::cvtColor(im,im,bRGB ? CV_RGB2GRAY : CV_BGR2GRAY);
+    else if(im.channels()==4)
+        cv::cvtColor(im,im,bRGB ? CV_RGBA2GRAY : CV_BGRA2GRAY);
+    return im;
+}
+
+cv::Mat SkewSymmetricMatrix(const cv::Mat &v)
+{
+    return (cv::Mat_<float>(3,3) <<             0, -v.at<float>(2), v.at<float>(1),
+            v.at<float>(2),               0,-v.at<float>(0),
+            -v.at<float>(1),  v.at<float>(0),              0);
+}
+
+// Fundamental matrix between two keyframes as LocalMapping computes it
+cv::Mat ComputeF12(KeyFrame* pKF1, KeyFrame* pKF2)
+{
+    cv::Mat R1w = pKF1->GetRotation();
+    cv::Mat t1w = pKF1->GetTranslation();
+    cv::Mat R2w = pKF2->GetRotation();
+    cv::Mat t2w = pKF2->GetTranslation();
+
+    cv::Mat R12 = R1w*R2w.t();
+    cv::Mat t12 = -R1w*R2w.t()*t2w+t1w;
+
+    return pKF1->mK.t().inv()*SkewSymmetricMatrix(t12)*R12*pKF2->mK.inv();
+}
+
+void ClearMatches(Frame &F)
+{
+    fill(F.mvpMapPoints.begin(),F.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+    F.mvbOutlier.assign(F.N,false);
+}
+
+// Sets the inputs of a PoseOptimization of sample.frame, as the benchmark does
+void PreparePoseOptimization(Sample &sample)
+{
+    sample.frame.mvpMapPoints = sample.vpMatches;
+    sample.frame.mvbOutlier.assign(sample.frame.N,false);
+    sample.frame.SetPose(sample.pKF->GetPose());
+}
+
+PosePrecision ComparePosePrecision(vector<Sample> &vSamples)
+{
+    PosePrecision precision;
+    precision.nFrames = vSamples.size();
+    precision.maxTranslation = 0;
+    precision.meanTranslation = 0;
+    precision.maxRotation = 0;
+    precision.nInlierChanges = 0;
+
+    for(size_t i=0; i<vSamples.size(); i++)
+    {
+        Sample &sample = vSamples[i];
+        PreparePoseOptimization(sample);
+        Optimizer::SetSinglePrecision(false);
+        const int nInliers = Optimizer::PoseOptimization(&sample.frame);
+        const cv::Mat Tcw = sample.frame.mTcw.clone();
+        const cv::Mat Ow = sample.frame.GetCameraCenter().clone();
+
+        PreparePoseOptimization(sample);
+        Optimizer::SetSinglePrecision(true);
+        const int nInliersFloat = Optimizer::PoseOptimization(&sample.frame);
+        Optimizer::SetSinglePrecision(false);
+
+        const double translation = cv::norm(sample.frame.GetCameraCenter()-Ow);
+        const cv::Mat R = sample.frame.mTcw.rowRange(0,3).colRange(0,3)*Tcw.rowRange(0,3).colRange(0,3).t();
+        const double c = max(-1.0,min(1.0,(cv::trace(R)[0]-1.0)/2.0));
+        precision.maxTranslation = max(precision.maxTranslation,translation);
+        precision.meanTranslation += translation/vSamples.size();
+        precision.maxRotation = max(precision.maxRotation,acos(c));
+        precision.nInlierChanges += nInliers!=nInliersFloat;
+    }
+    return precision;
+}
+
+BatchAgreement CompareBatchMatching(vector<Sample> &vSamples)
+{
+    BatchAgreement agreement;
+    agreement.nQueries = 0;
+    agreement.nCandidates = 0;
+    agreement.nMismatches = 0;
+
+    // Same ratios as Tracking::Relocalization and LoopClosing::ComputeSim3
+    ORBmatcher matcher(0.75,true); //param
+    BowDistanceBatch batch;
+    vector<MapPoint*> vpBatchMatches;
+    vector<MapPoint*> vpMatches;
+    for(size_t i=0; i<vSamples.size(); i++)
+    {
+        Sample &sample = vSamples[i];
+
+        batch.Compute(sample.next,sample.vpRelocCandidates);
+        for(size_t k=0; k<sample.vpRelocCandidates.size(); k++)
+        {
+            const int nBatch = matcher.SearchByBoW(batch,k,sample.vpRelocCandidates[k],sample.next,vpBatchMatches);
+            const int n = matcher.SearchByBoW(sample.vpRelocCandidates[k],sample.next,vpMatches);
+            agreement.nMismatches += nBatch!=n || vpBatchMatches!=vpMatches;
+        }
+
+        batch.Compute(sample.pKF,sample.vpLoopCandidates);
+        for(size_t k=0; k<sample.vpLoopCandidates.size(); k++)
+        {
+            const int nBatch = matcher.SearchByBoW(batch,k,sample.pKF,sample.vpLoopCandidates[k],vpBatchMatches);
+            const int n = matcher.SearchByBoW(sample.pKF,sample.vpLoopCandidates[k],vpMatches);
+            agreement.nMismatches += nBatch!=n || vpBatchMatches!=vpMatches;
+        }
+
+        agreement.nQueries += 2;
+        agreement.nCandidates += sample.vpRelocCandidates.size()+sample.vpLoopCandidates.size();
+    }
+    return agreement;
+}
+
+void WriteJson(ostream &out, const vector<Result> &vResults, const size_t nKFs, const size_t nMPs, const size_t nSamples,
+               const PosePrecision* pPrecision, const BatchAgreement* pAgreement)
+{
+    out.precision(12);
+    out << "{" << endl;
+    out << "  \"keyframes\": " << nKFs << "," << endl;
+    out << "  \"map_points\": " << nMPs << "," << endl;
+    out << "  \"samples\": " << nSamples << "," << endl;
+    if(pPrecision)
+        out << "  \"pose_single_precision\": {\"frames\": " << pPrecision->nFrames
+            << ", \"max_translation\": " << pPrecision->maxTranslation
+            << ", \"mean_translation\": " << pPrecision->meanTranslation
+            << ", \"max_rotation\": " << pPrecision->maxRotation
+            << ", \"inlier_changes\": " << pPrecision->nInlierChanges << "}," << endl;
+    if(pAgreement)
+        out << "  \"batch_candidates\": {\"queries\": " << pAgreement->nQueries
+            << ", \"candidates\": " << pAgreement->nCandidates
+            << ", \"mismatches\": " << pAgreement->nMismatches << "}," << endl;
+    out << "  \"benchmarks\": [" << endl;
+    for(size_t i=0; i<vResults.size(); i++)
+    {
+        const Result &r = vResults[i];
+        out << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.nOps
+            << ", \"ns_per_op\": " << r.nsPerOp << ", \"allocs_per_op\": " << r.allocsPerOp
+            << ", \"bytes_per_op\": " << r.bytesPerOp << "}" << (i+1<vResults.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl;
+    out << "}" << endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 6 && argc != 7)
+    {
+        cerr << endl << "Usage: ./orbslam_bench path_to_vocabulary path_to_settings path_to_image_list path_to_map"
+             << " path_to_results.json [name_filter]" << endl;
+        return 1;
+    }
+
+    const string strVocFile = argv[1];
+    const string strSettingsFile = argv[2];
+    const string strImageList = argv[3];
+    const string strMapFile = argv[4];
+    const string strResultsFile = argv[5];
+    const string strFilter = argc==7 ? argv[6] : "";
+
+    // Calibration and extractor as Tracking reads them
+    Settings fSettings;
+    if(!fSettings.Load(strSettingsFile))
+    {
+        cerr << "Failed to open settings file at: " << strSettingsFile << endl;
+        return 1;
+    }
+
+    const float fx = fSettings["Camera.fx"];
+    cv::Mat K = cv::Mat::eye(3,3,CV_32F);
+    K.at<float>(0,0) = fx;
+    K.at<float>(1,1) = fSettings["Camera.fy"];
+    K.at<float>(0,2) = fSettings["Camera.cx"];
+    K.at<float>(1,2) = fSettings["Camera.cy"];
+
+    cv::Mat DistCoef(4,1,CV_32F);
+    DistCoef.at<float>(0) = fSettings["Camera.k1"];
+    DistCoef.at<float>(1) = fSettings["Camera.k2"];
+    DistCoef.at<float>(2) = fSettings["Camera.p1"];
+    DistCoef.at<float>(3) = fSettings["Camera.p2"];
+    const float k3 = fSettings["Camera.k3"];
+    if(k3!=0)
+    {
+        DistCoef.resize(5);
+        DistCoef.at<float>(4) = k3;
+    }
+
+    const float bf = fSettings["Camera.bf"];
+    const float thDepth = bf*(float)fSettings["ThDepth"]/fx;
+    const bool bRGB = static_cast<int>(fSettings["Camera.RGB"]);
+
+    const int nFeatures = fSettings["ORBextractor.nFeatures"];
+    const float fScaleFactor = fSettings["ORBextractor.scaleFactor"];
+    const int nLevels = fSettings["ORBextractor.nLevels"];
+    const int fIniThFAST = fSettings["ORBextractor.iniThFAST"];
+    const int fMinThFAST = fSettings["ORBextractor.minThFAST"];
+    int nExtractorThreads = fSettings["ORBextractor.nThreads"];
+    if(nExtractorThreads<1)
+        nExtractorThreads = 1;
+    const int nPatternBins = max((int)fSettings["ORBextractor.patternBins"],0);
+    vector<vector<int> > excludedRegions;
+    const Settings::Node &regionsNode = fSettings["ORBextractor.ExcludedRegions"];
+    for(vector<Settings::Node>::const_iterator it = regionsNode.begin(); it != regionsNode.end(); it++)
+    {
+        vector<int> region;
+        for(vector<Settings::Node>::const_iterator it2 = (*it).begin(); it2 != (*it).end(); it2++)
+            region.push_back(static_cast<int>(*it2));
+        excludedRegions.push_back(region);
+    }
+
+    ORBextractor extractorLeft(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,false,nExtractorThreads,false,nPatternBins);
+    ORBextractor extractorRight(nFeatures,fScaleFactor,nLevels,fIniThFAST,fMinThFAST,excludedRegions,false,nExtractorThreads,false,nPatternBins);
+    vector<vector<cv::Point> > vExcludedPolygons;
+    cv::Mat exclusionMask;
+    if(!ORBextractor::ReadExclusionMask(fSettings,vExcludedPolygons,exclusionMask))
+        return 1;
+    extractorLeft.SetExclusionMask(vExcludedPolygons,exclusionMask);
+    extractorRight.SetExclusionMask(vExcludedPolygons,exclusionMask);
+
+    cout << "Loading ORB Vocabulary ..." << endl;
+    ORBVocabulary voc;
+    const bool bVocLoad = ORBVocabulary::isBinaryFile(strVocFile) ? voc.loadFromBinaryFile(strVocFile) : voc.loadFromTextFile(strVocFile);
+    if(!bVocLoad)
+    {
+        cerr << "Failed to open vocabulary at: " << strVocFile << endl;
+        return 1;
+    }
+    voc.setBlockDistance(&HammingDistance::ComputeBatch);
+
+    int nMapThreads = fSettings["Map.nThreads"];
+    if(nMapThreads<1)
+        nMapThreads = 1;
+    ThreadPool threadPool(nMapThreads-1);
+
+    Map map;
+    map.mnSettingsHash = fSettings.GetHash();
+    const int nRelocTopK = fSettings["Relocalization.TopK"];
+    KeyFrameDatabase keyFrameDatabase(voc,nRelocTopK);
+    cout << "Loading map " << strMapFile << " ..." << endl;
+    if(!MapSerializer::Load(strMapFile,&map,&keyFrameDatabase,&voc,&threadPool))
+    {
+        cerr << "Failed to load the map at: " << strMapFile << endl;
+        return 1;
+    }
+
+    vector<ImageEntry> vImages;
+    if(!LoadImageList(strImageList,vImages) || vImages.empty())
+    {
+        cerr << "Failed to read the image list at: " << strImageList << endl;
+        return 1;
+    }
+    const bool bStereo = bf>0 && !vImages[0].strRight.empty();
+
+    // Keyframes with an image, spread evenly over the map
+    vector<KeyFrame*> vpKFs = map.GetAllKeyFrames();
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+    vector<pair<KeyFrame*,size_t> > vKFImages;
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        for(size_t j=0; j+1<vImages.size(); j++)
+        {
+            if(fabs(vImages[j].timestamp-vpKFs[i]->mTimeStamp)<1e-4) //param
+            {
+                vKFImages.push_back(make_pair(vpKFs[i],j));
+                break;
+            }
+        }
+    }
+    if(vKFImages.empty())
+    {
+        cerr << "No keyframe of the map has an image in " << strImageList << endl;
+        return 1;
+    }
+
+    const size_t nStride = (vKFImages.size()+MAX_SAMPLES-1)/MAX_SAMPLES;
+    vector<Sample> vSamples;
+    for(size_t i=0; i<vKFImages.size(); i+=nStride)
+    {
+        Sample sample;
+        sample.pKF = vKFImages[i].first;
+        sample.nImage = vKFImages[i].second;
+
+        const cv::Mat im = LoadGray(vImages[sample.nImage].strLeft,bRGB);
+        const cv::Mat imNext = LoadGray(vImages[sample.nImage+1].strLeft,bRGB);
+        if(im.empty() || imNext.empty())
+        {
+            cerr << "Failed to load image at: " << vImages[sample.nImage].strLeft << endl;
+            return 1;
+        }
+
+        sample.frame = Frame(im,vImages[sample.nImage].timestamp,&extractorLeft,&voc,&map.mFrameContext,K,DistCoef,bf,thDepth);
+        sample.next = Frame(imNext,vImages[sample.nImage+1].timestamp,&extractorLeft,&voc,&map.mFrameContext,K,DistCoef,bf,thDepth);
+        sample.frame.ComputeBoW();
+        sample.next.ComputeBoW();
+        sample.frame.SetPose(sample.pKF->GetPose());
+        sample.next.SetPose(sample.pKF->GetPose());
+
+        ORBmatcher matcher(0.7,true); //param
+        matcher.SearchByBoW(sample.pKF,sample.frame,sample.vpMatches);
+        sample.frame.mvpMapPoints = sample.vpMatches;
+        sample.frame.mvbOutlier.assign(sample.frame.N,false);
+
+        const vector<KeyFrame*> vpNeighKFs = sample.pKF->GetBestCovisibilityKeyFrames(10); //param
+        sample.pKF2 = vpNeighKFs.empty() ? static_cast<KeyFrame*>(NULL) : vpNeighKFs[0];
+
+        const vector<MapPoint*> vpKFMapPoints = sample.pKF->GetMapPointMatches();
+        const set<MapPoint*> sKFMapPoints(vpKFMapPoints.begin(),vpKFMapPoints.end());
+        set<MapPoint*> sLocalMapPoints(sKFMapPoints);
+        set<MapPoint*> sFuseCandidates;
+        for(size_t k=0; k<vpNeighKFs.size(); k++)
+        {
+            const vector<MapPoint*> vpNeighMapPoints = vpNeighKFs[k]->GetMapPointMatches();
+            for(size_t m=0; m<vpNeighMapPoints.size(); m++)
+            {
+                MapPoint* pMP = vpNeighMapPoints[m];
+                if(!pMP || pMP->isBad())
+                    continue;
+                sLocalMapPoints.insert(pMP);
+                if(!sKFMapPoints.count(pMP))
+                    sFuseCandidates.insert(pMP);
+            }
+        }
+        sLocalMapPoints.erase(static_cast<MapPoint*>(NULL));
+        sample.vpLocalMapPoints.assign(sLocalMapPoints.begin(),sLocalMapPoints.end());
+        sample.vpFuseCandidates.assign(sFuseCandidates.begin(),sFuseCandidates.end());
+
+        if(sample.pKF2)
+        {
+            ORBmatcher matcherKF(0.75,true); //param
+            matcherKF.SearchByBoW(sample.pKF,sample.pKF2,sample.vpMatches12);
+            sample.F12 = ComputeF12(sample.pKF,sample.pKF2);
+        }
+
+        // Lowest score to a covisible keyframe, as LoopClosing::DetectLoop
+        sample.minLoopScore = 1;
+        const vector<KeyFrame*> vpConnectedKFs = sample.pKF->GetVectorCovisibleKeyFrames();
+        for(size_t k=0; k<vpConnectedKFs.size(); k++)
+        {
+            if(vpConnectedKFs[k]->isBad())
+                continue;
+            sample.minLoopScore = min(sample.minLoopScore,static_cast<float>(voc.score(sample.pKF->mBowVec,vpConnectedKFs[k]->mBowVec)));
+        }
+
+        sample.vpRelocCandidates = keyFrameDatabase.DetectRelocalizationCandidates(&sample.next);
+        sample.vpLoopCandidates = keyFrameDatabase.DetectLoopCandidates(sample.pKF,sample.minLoopScore);
+        const vector<KeyFrame*> vpLoopKFs(sample.vpLoopCandidates);
+        for(size_t k=0; k<vpNeighKFs.size(); k++)
+            if(find(vpLoopKFs.begin(),vpLoopKFs.end(),vpNeighKFs[k])==vpLoopKFs.end())
+                sample.vpLoopCandidates.push_back(vpNeighKFs[k]);
+
+        vSamples.push_back(sample);
+    }
+    const size_t nSamples = vSamples.size();
+
+    // Keyframe samples with a covisible keyframe, for the pairwise kernels
+    vector<size_t> vPairs;
+    for(size_t i=0; i<nSamples; i++)
+        if(vSamples[i].pKF2)
+            vPairs.push_back(i);
+    if(vPairs.empty())
+        vPairs.push_back(0);
+
+    // Descriptor pairs of the frame and the map points it matched
+    vector<pair<cv::Mat,cv::Mat> > vDescriptorPairs;
+    for(size_t i=0; i<nSamples; i++)
+    {
+        const Sample &sample = vSamples[i];
+        for(size_t k=0; k<sample.vpMatches.size(); k++)
+            if(sample.vpMatches[k])
+                vDescriptorPairs.push_back(make_pair(sample.frame.mDescriptors.row(k),sample.vpMatches[k]->GetDescriptor()));
+    }
+    if(vDescriptorPairs.empty())
+        vDescriptorPairs.push_back(make_pair(vSamples[0].frame.mDescriptors.row(0),vSamples[0].frame.mDescriptors.row(0)));
+
+    cout << "Benchmarking on " << nSamples << " of " << vpKFs.size() << " keyframes, "
+         << map.MapPointsInMap() << " map points" << endl;
+
+    vector<cv::Mat> vImagesGray(nSamples);
+    for(size_t i=0; i<nSamples; i++)
+        vImagesGray[i] = LoadGray(vImages[vSamples[i].nImage].strLeft,bRGB);
+
+    vector<cv::KeyPoint> vKeys;
+    cv::Mat descriptors;
+    vector<MapPoint*> vpMatches;
+    vector<pair<size_t,size_t> > vMatchedPairs;
+    vector<cv::Point2f> vPrevMatched;
+    vector<int> vnMatches12;
+    vector<MapPoint*> vpReplacePoints;
+    BowDistanceBatch bowBatch;
+    Frame stereoFrame;
+    size_t nStereoPair = static_cast<size_t>(-1);
+    volatile int nSink = 0;
+    bool bStopFlag = false;
+
+    vector<Benchmark> vBenchmarks;
+
+    Benchmark bench;
+    bench.nMaxOps = 0;
+
+    bench.name = "ORBextractor::operator()";
+    bench.prepare = function<void(size_t)>();
+    bench.op = [&](size_t i) { extractorLeft(vImagesGray[i%nSamples],cv::Mat(),vKeys,descriptors); };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::DescriptorDistance";
+    bench.op = [&](size_t i) {
+        const pair<cv::Mat,cv::Mat> &p = vDescriptorPairs[i%vDescriptorPairs.size()];
+        nSink += ORBmatcher::DescriptorDistance(p.first,p.second);
+    };
+    vBenchmarks.push_back(bench);
+
+    if(bStereo)
+    {
+        bench.name = "Frame::ComputeStereoMatches";
+        bench.prepare = [&](size_t i) {
+            // the matching reads the pyramids of the extractors, so the pair is extracted again
+            const size_t n = (i/STEREO_OPS_PER_PAIR)%nSamples;
+            if(n==nStereoPair)
+                return;
+            const ImageEntry &entry = vImages[vSamples[n].nImage];
+            stereoFrame = Frame(LoadGray(entry.strLeft,bRGB),LoadGray(entry.strRight,bRGB),entry.timestamp,
+                                &extractorLeft,&extractorRight,&voc,&map.mFrameContext,K,DistCoef,bf,thDepth);
+            nStereoPair = n;
+        };
+        bench.op = [&](size_t) { stereoFrame.ComputeStereoMatches(); };
+        vBenchmarks.push_back(bench);
+    }
+
+    bench.name = "Frame::ComputeBoW";
+    bench.prepare = [&](size_t i) {
+        Frame &F = vSamples[i%nSamples].next;
+        F.mBowVec.clear();
+        F.mFeatVec.clear();
+    };
+    bench.op = [&](size_t i) { vSamples[i%nSamples].next.ComputeBoW(); };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByProjection(Frame,MapPoints)";
+    bench.prepare = [&](size_t i) {
+        Sample &sample = vSamples[i%nSamples];
+        ClearMatches(sample.next);
+        for(size_t k=0; k<sample.vpLocalMapPoints.size(); k++)
+            if(!sample.vpLocalMapPoints[k]->isBad())
+                sample.next.isInFrustum(sample.vpLocalMapPoints[k],0.5); //param
+    };
+    bench.op = [&](size_t i) {
+        ORBmatcher matcher(0.8); //param
+        matcher.SearchByProjection(vSamples[i%nSamples].next,vSamples[i%nSamples].vpLocalMapPoints,1); //param
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByProjection(Frame,Frame)";
+    bench.prepare = [&](size_t i) { ClearMatches(vSamples[i%nSamples].next); };
+    bench.op = [&](size_t i) {
+        ORBmatcher matcher(0.9,true); //param
+        matcher.SearchByProjection(vSamples[i%nSamples].next,vSamples[i%nSamples].frame,bStereo ? 7 : 15,!bStereo); //param
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByProjection(Frame,KeyFrame)";
+    bench.op = [&](size_t i) {
+        ORBmatcher matcher(0.9,true); //param
+        matcher.SearchByProjection(vSamples[i%nSamples].next,vSamples[i%nSamples].pKF,set<MapPoint*>(),10,100); //param
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByProjection(KeyFrame,Sim3)";
+    bench.prepare = [&](size_t i) { vpMatches.assign(vSamples[i%nSamples].pKF->N,static_cast<MapPoint*>(NULL)); };
+    bench.op = [&](size_t i) {
+        const Sample &sample = vSamples[i%nSamples];
+        ORBmatcher matcher(0.75,true); //param
+        matcher.SearchByProjection(sample.pKF,sample.pKF->GetPose(),sample.vpLocalMapPoints,vpMatches,10); //param
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByBoW(KeyFrame,Frame)";
+    bench.prepare = function<void(size_t)>();
+    bench.op = [&](size_t i) {
+        ORBmatcher matcher(0.7,true); //param
+        matcher.SearchByBoW(vSamples[i%nSamples].pKF,vSamples[i%nSamples].next,vpMatches);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByBoW(KeyFrame,KeyFrame)";
+    bench.op = [&](size_t i) {
+        const Sample &sample = vSamples[vPairs[i%vPairs.size()]];
+        if(!sample.pKF2)
+            return;
+        ORBmatcher matcher(0.75,true); //param
+        matcher.SearchByBoW(sample.pKF,sample.pKF2,vpMatches);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByBoW(relocalization candidates)";
+    bench.op = [&](size_t i) {
+        Sample &sample = vSamples[i%nSamples];
+        ORBmatcher matcher(0.75,true); //param
+        for(size_t k=0; k<sample.vpRelocCandidates.size(); k++)
+            matcher.SearchByBoW(sample.vpRelocCandidates[k],sample.next,vpMatches);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByBoW(relocalization candidates,batch)";
+    bench.op = [&](size_t i) {
+        Sample &sample = vSamples[i%nSamples];
+        ORBmatcher matcher(0.75,true); //param
+        bowBatch.Compute(sample.next,sample.vpRelocCandidates);
+        for(size_t k=0; k<sample.vpRelocCandidates.size(); k++)
+            matcher.SearchByBoW(bowBatch,k,sample.vpRelocCandidates[k],sample.next,vpMatches);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByBoW(loop candidates)";
+    bench.op = [&](size_t i) {
+        const Sample &sample = vSamples[i%nSamples];
+        ORBmatcher matcher(0.75,true); //param
+        for(size_t k=0; k<sample.vpLoopCandidates.size(); k++)
+            matcher.SearchByBoW(sample.pKF,sample.vpLoopCandidates[k],vpMatches);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchByBoW(loop candidates,batch)";
+    bench.op = [&](size_t i) {
+        const Sample &sample = vSamples[i%nSamples];
+        ORBmatcher matcher(0.75,true); //param
+        bowBatch.Compute(sample.pKF,sample.vpLoopCandidates);
+        for(size_t k=0; k<sample.vpLoopCandidates.size(); k++)
+            matcher.SearchByBoW(bowBatch,k,sample.pKF,sample.vpLoopCandidates[k],vpMatches);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchForInitialization";
+    bench.prepare = [&](size_t i) {
+        const Frame &F = vSamples[i%nSamples].frame;
+        vPrevMatched.resize(F.mvKeysUn.size());
+        for(size_t k=0; k<F.mvKeysUn.size(); k++)
+            vPrevMatched[k] = F.mvKeysUn[k].pt;
+    };
+    bench.op = [&](size_t i) {
+        ORBmatcher matcher(0.9,true); //param
+        matcher.SearchForInitialization(vSamples[i%nSamples].frame,vSamples[i%nSamples].next,vPrevMatched,vnMatches12,100); //param
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchForTriangulation";
+    bench.prepare = function<void(size_t)>();
+    bench.op = [&](size_t i) {
+        const Sample &sample = vSamples[vPairs[i%vPairs.size()]];
+        if(!sample.pKF2)
+            return;
+        ORBmatcher matcher(0.6,false); //param
+        matcher.SearchForTriangulation(sample.pKF,sample.pKF2,sample.F12,vMatchedPairs,false);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::SearchBySim3";
+    bench.prepare = [&](size_t i) { vpMatches = vSamples[vPairs[i%vPairs.size()]].vpMatches12; };
+    bench.op = [&](size_t i) {
+        const Sample &sample = vSamples[vPairs[i%vPairs.size()]];
+        if(!sample.pKF2)
+            return;
+        const cv::Mat R1w = sample.pKF->GetRotation();
+        const cv::Mat R12 = R1w*sample.pKF2->GetRotation().t();
+        const cv::Mat t12 = -R12*sample.pKF2->GetTranslation()+sample.pKF->GetTranslation();
+        ORBmatcher matcher(0.75,true); //param
+        matcher.SearchBySim3(sample.pKF,sample.pKF2,vpMatches,1.0f,R12,t12,7.5); //param
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "Optimizer::PoseOptimization";
+    bench.prepare = [&](size_t i) {
+        Optimizer::SetSinglePrecision(false);
+        PreparePoseOptimization(vSamples[i%nSamples]);
+    };
+    bench.op = [&](size_t i) { Optimizer::PoseOptimization(&vSamples[i%nSamples].frame); };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "Optimizer::PoseOptimization(float)";
+    bench.prepare = [&](size_t i) {
+        Optimizer::SetSinglePrecision(true);
+        PreparePoseOptimization(vSamples[i%nSamples]);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "KeyFrameDatabase::DetectLoopCandidates";
+    bench.prepare = function<void(size_t)>();
+    bench.op = [&](size_t i) { keyFrameDatabase.DetectLoopCandidates(vSamples[i%nSamples].pKF,vSamples[i%nSamples].minLoopScore); };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "KeyFrameDatabase::DetectRelocalizationCandidates";
+    bench.op = [&](size_t i) { keyFrameDatabase.DetectRelocalizationCandidates(&vSamples[i%nSamples].next); };
+    vBenchmarks.push_back(bench);
+
+    // These change the map, once per sample
+    bench.nMaxOps = nSamples;
+
+    bench.name = "ORBmatcher::Fuse(KeyFrame,Sim3)";
+    bench.prepare = [&](size_t i) { vpReplacePoints.assign(vSamples[i].vpLocalMapPoints.size(),static_cast<MapPoint*>(NULL)); };
+    bench.op = [&](size_t i) {
+        ORBmatcher matcher(0.8); //param
+        matcher.Fuse(vSamples[i].pKF,vSamples[i].pKF->GetPose(),vSamples[i].vpLocalMapPoints,4,vpReplacePoints); //param
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "ORBmatcher::Fuse(KeyFrame,MapPoints)";
+    bench.prepare = [&](size_t) {};
+    bench.op = [&](size_t i) {
+        ORBmatcher matcher;
+        matcher.Fuse(vSamples[i].pKF,vSamples[i].vpFuseCandidates);
+    };
+    vBenchmarks.push_back(bench);
+
+    bench.name = "Optimizer::LocalBundleAdjustment";
+    bench.op = [&](size_t i) { Optimizer::LocalBundleAdjustment(vSamples[i].pKF,&bStopFlag,&map); };
+    vBenchmarks.push_back(bench);
+
+    // The float pose optimization is only worth its time if it finds the same poses. Compared
+    // before the benchmarks which change the map.
+    const bool bPrecision = strFilter.empty() || string("Optimizer::PoseOptimization").find(strFilter)!=string::npos;
+    PosePrecision precision;
+    if(bPrecision)
+    {
+        cout << "Comparing the float and double PoseOptimization ..." << endl;
+        precision = ComparePosePrecision(vSamples);
+    }
+
+    // A batched search that differs from the one candidate after the other is a bug. Compared
+    // before the map changes as well.
+    const bool bAgreement = strFilter.empty() || string("ORBmatcher::SearchByBoW").find(strFilter)!=string::npos;
+    BatchAgreement agreement;
+    if(bAgreement)
+    {
+        cout << "Comparing the batched and the candidate by candidate SearchByBoW ..." << endl;
+        agreement = CompareBatchMatching(vSamples);
+    }
+
+    vector<Result> vResults;
+    for(size_t i=0; i<vBenchmarks.size(); i++)
+    {
+        if(!strFilter.empty() && vBenchmarks[i].name.find(strFilter)==string::npos)
+            continue;
+        cout << "Running " << vBenchmarks[i].name << " ..." << endl;
+        vResults.push_back(Run(vBenchmarks[i]));
+    }
+    Optimizer::SetSinglePrecision(false);
+
+    ofstream f(strResultsFile.c_str());
+    if(!f.is_open())
+    {
+        cerr << "Failed to write the results to: " << strResultsFile << endl;
+        return 1;
+    }
+    WriteJson(f,vResults,vpKFs.size(),map.MapPointsInMap(),nSamples,bPrecision ? &precision : NULL,
+              bAgreement ? &agreement : NULL);
+
+    cout << endl;
+    for(size_t i=0; i<vResults.size(); i++)
+    {
+        char line[256];
+        snprintf(line,sizeof(line),"%-52s %10llu %14.1f ns/op %10.1f allocs/op\n",vResults[i].name.c_str(),
+                 static_cast<unsigned long long>(vResults[i].nOps),vResults[i].nsPerOp,vResults[i].allocsPerOp);
+        cout << line;
+    }
+    if(bPrecision)
+    {
+        char line[256];
+        snprintf(line,sizeof(line),"\nFloat PoseOptimization on %zu frames: camera centers %.3g max %.3g mean apart, "
+                 "rotations %.3g rad max, %zu frames with other inliers\n",precision.nFrames,precision.maxTranslation,
+                 precision.meanTranslation,precision.maxRotation,precision.nInlierChanges);
+        cout << line;
+    }
+    if(bAgreement)
+    {
+        char line[256];
+        snprintf(line,sizeof(line),"\nBatched SearchByBoW on %zu queries: %zu of %zu candidates with other matches\n",
+                 agreement.nQueries,agreement.nMismatches,agreement.nCandidates);
+        cout << line;
+    }
+    cout << endl << "Results written to " << strResultsFile << endl;
+
+    return bAgreement && agreement.nMismatches>0 ? 1 : 0;
+}
@@ -0,0 +1,359 @@
+/**
+* Replays a recorded sequence as fast as possible instead of in real time like the examples,
+* for offline processing and reproducible measurements. Modes:
+*
+*   lockstep  every image is tracked with the synchronous input and the replay waits for local
+*             mapping and loop closing to go idle before the next one, so a run only depends on
+*             the data (up to the thread pools of the kernels).
+*   flatout   images go to the asynchronous input without sleeping, as fast as the pipeline
+*             accepts them: at most Async.QueueSize images are in flight, so none is dropped.
+*
+* Writes throughput, tracking latency percentiles, per thread CPU time and, with a ground truth,
+* the absolute trajectory error as JSON to path_to_results.json. The trajectory is saved as the
+* examples do (keyframes for monocular), aligned to the ground truth with a similarity for
+* monocular and a rigid transformation otherwise.
+*
+* Datasets, path_to_sequence is the folder of the sequence:
+*   tum    rgb.txt for monocular, --associations=file (as rgbd_tum) for RGB-D
+*   kitti  times.txt, image_0 and image_1
+*   euroc  the mav0 folder with cam0/data and cam1/data, --times=file as in Examples/*/EuRoC_TimeStamps.
+*          Stereo images are rectified with LEFT.* and RIGHT.* of the settings.
+* The ground truth (--groundtruth=file) can be a TUM trajectory, a EuRoC data.csv or KITTI poses.
+*
+* Usage: ./tools/orbslam_replay lockstep|flatout mono|stereo|rgbd tum|kitti|euroc path_to_vocabulary
+*                               path_to_settings path_to_sequence path_to_results.json
+*                               [--associations=file] [--times=file] [--groundtruth=file] [--trajectory=file]
+*/
+
+#include "ImageSource.h"
+#include "System.h"
+#include "TrajectoryEvaluation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <time.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+
+namespace
+{
+
+bool StartsWith(const string &s, const string &prefix)
+{
+    return s.compare(0,prefix.size(),prefix)==0;
+}
+
+// Nearest rank percentile of sorted values
+double Percentile(const vector<double> &vSorted, const double q)
+{
+    if(vSorted.empty())
+        return 0.0;
+    const size_t i = static_cast<size_t>(ceil(q*vSorted.size()));
+    return vSorted[min(vSorted.size()-1,i>0 ? i-1 : 0)];
+}
+
+double CpuSeconds(const clockid_t clockId)
+{
+    timespec ts;
+    if(clock_gettime(clockId,&ts)!=0)
+        return 0.0;
+    return ts.tv_sec+1e-9*ts.tv_nsec;
+}
+
+double Seconds(const chrono::steady_clock::duration &d)
+{
+    return chrono::duration_cast<chrono::duration<double> >(d).count();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 8)
+    {
+        cerr << endl << "Usage: ./orbslam_replay lockstep|flatout mono|stereo|rgbd tum|kitti|euroc path_to_vocabulary"
+             << " path_to_settings path_to_sequence path_to_results.json"
+             << " [--associations=file] [--times=file] [--groundtruth=file] [--trajectory=file]" << endl;
+        return 1;
+    }
+
+    const string strMode = argv[1];
+    const string strSensor = argv[2];
+    const string strDataset = argv[3];
+    const string strVocFile = argv[4];
+    const string strSettingsFile = argv[5];
+    const string strSequence = argv[6];
+    const string strResultsFile = argv[7];
+
+    string strAssociations, strTimes, strGroundTruth, strTrajectory;
+    for(int i=8; i<argc; i++)
+    {
+        const string arg = argv[i];
+        if(StartsWith(arg,"--associations="))
+            strAssociations = arg.substr(15);
+        else if(StartsWith(arg,"--times="))
+            strTimes = arg.substr(8);
+        else if(StartsWith(arg,"--groundtruth="))
+            strGroundTruth = arg.substr(14);
+        else if(StartsWith(arg,"--trajectory="))
+            strTrajectory = arg.substr(13);
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+
+    const bool bLockstep = strMode=="lockstep";
+    if(!bLockstep && strMode!="flatout")
+    {
+        cerr << "Unknown mode: " << strMode << endl;
+        return 1;
+    }
+
+    ORB_SLAM2::System::eSensor sensor;
+    if(strSensor=="mono")
+        sensor = ORB_SLAM2::System::MONOCULAR;
+    else if(strSensor=="stereo")
+        sensor = ORB_SLAM2::System::STEREO;
+    else if(strSensor=="rgbd")
+        sensor = ORB_SLAM2::System::RGBD;
+    else
+    {
+        cerr << "Unknown sensor: " << strSensor << endl;
+        return 1;
+    }
+
+    // Retrieve paths to images
+    vector<ORB_SLAM2::ImageSource::Entry> vImages;
+    bool bLoaded = false;
+    if(strDataset=="tum" && sensor!=ORB_SLAM2::System::STEREO)
+        bLoaded = (sensor==ORB_SLAM2::System::MONOCULAR || !strAssociations.empty()) &&
+                  ORB_SLAM2::ImageSource::LoadTUM(strSequence,sensor==ORB_SLAM2::System::RGBD ? strAssociations : "",vImages);
+    else if(strDataset=="kitti" && sensor!=ORB_SLAM2::System::RGBD)
+        bLoaded = ORB_SLAM2::ImageSource::LoadKITTI(strSequence,sensor==ORB_SLAM2::System::STEREO,vImages);
+    else if(strDataset=="euroc" && sensor!=ORB_SLAM2::System::RGBD)
+        bLoaded = ORB_SLAM2::ImageSource::LoadEuRoC(strSequence+"/cam0/data",
+                                                    sensor==ORB_SLAM2::System::STEREO ? strSequence+"/cam1/data" : "",
+                                                    strTimes,vImages);
+    else
+    {
+        cerr << "The " << strDataset << " dataset is not supported for " << strSensor << endl;
+        return 1;
+    }
+    if(!bLoaded || vImages.empty())
+    {
+        cerr << "ERROR: No images in provided path." << endl;
+        return 1;
+    }
+    const int nImages = vImages.size();
+
+    ORB_SLAM2::Settings fsSettings;
+    if(!fsSettings.Load(strSettingsFile))
+    {
+        cerr << "ERROR: Wrong path to settings" << endl;
+        return 1;
+    }
+
+    // Images are read ahead by the decoding threads, EuRoC stereo is rectified as stereo_euroc
+    ORB_SLAM2::ImageSource source(vImages);
+    if(strDataset=="euroc" && sensor==ORB_SLAM2::System::STEREO && !(int)fsSettings["Camera.rectifyStereo"] &&
+       !source.SetStereoRectification(fsSettings))
+        return 1;
+
+    // Images in flight in the flat-out mode, the asynchronous input drops none up to its queue size
+    int nInFlight = fsSettings["Async.QueueSize"];
+    if(nInFlight<1)
+        nInFlight = 1;
+
+    // Create SLAM system. It initializes all system threads and gets ready to process frames.
+    ORB_SLAM2::System SLAM(strVocFile,strSettingsFile,sensor,false);
+
+    cout << endl << "-------" << endl;
+    cout << "Replaying sequence " << (bLockstep ? "in lockstep" : "flat-out") << " ..." << endl;
+    cout << "Images in the sequence: " << nImages << endl << endl;
+
+    // Submission and completion times of the frames, completions come from the tracking callback
+    vector<chrono::steady_clock::time_point> vtSubmitted(nImages);
+    vector<chrono::steady_clock::time_point> vtTracked(nImages);
+    vector<bool> vbTracked(nImages,false);
+    map<double,int> mTimestampIndex;
+    for(int ni=0; ni<nImages; ni++)
+        mTimestampIndex[vImages[ni].timestamp] = ni;
+    mutex mutexTracked;
+    if(!bLockstep)
+    {
+        SLAM.SetTrackingCallback([&](const double &timestamp, const cv::Mat &Tcw) {
+            const chrono::steady_clock::time_point t = chrono::steady_clock::now();
+            unique_lock<mutex> lock(mutexTracked);
+            map<double,int>::const_iterator it = mTimestampIndex.find(timestamp);
+            if(it==mTimestampIndex.end())
+                return;
+            vtTracked[it->second] = t;
+            vbTracked[it->second] = !Tcw.empty();
+        });
+    }
+
+    deque<future<cv::Mat> > qPending;
+    int nLocalized = 0;
+    ORB_SLAM2::ImageSource::Image image;
+
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+    for(int ni=0; ni<nImages; ni++)
+    {
+        // Image (and right image or depthmap), decoded ahead
+        if(!source.Next(image))
+            return 1;
+        const cv::Mat &im = image.im;
+        const cv::Mat &im2 = image.im2;
+        const double tframe = vImages[ni].timestamp;
+
+        if(bLockstep)
+        {
+            vtSubmitted[ni] = chrono::steady_clock::now();
+            cv::Mat Tcw;
+            if(sensor==ORB_SLAM2::System::STEREO)
+                Tcw = SLAM.TrackStereo(im,im2,tframe);
+            else if(sensor==ORB_SLAM2::System::RGBD)
+                Tcw = SLAM.TrackRGBD(im,im2,tframe);
+            else
+                Tcw = SLAM.TrackMonocular(im,tframe);
+            vtTracked[ni] = chrono::steady_clock::now();
+            vbTracked[ni] = !Tcw.empty();
+
+            SLAM.WaitUntilIdle();
+        }
+        else
+        {
+            while(static_cast<int>(qPending.size())>=nInFlight)
+            {
+                if(!qPending.front().get().empty())
+                    nLocalized++;
+                qPending.pop_front();
+            }
+
+            vtSubmitted[ni] = chrono::steady_clock::now();
+            if(sensor==ORB_SLAM2::System::STEREO)
+                qPending.push_back(SLAM.TrackStereoAsync(im,im2,tframe));
+            else if(sensor==ORB_SLAM2::System::RGBD)
+                qPending.push_back(SLAM.TrackRGBDAsync(im,im2,tframe));
+            else
+                qPending.push_back(SLAM.TrackMonocularAsync(im,tframe));
+        }
+    }
+    while(!qPending.empty())
+    {
+        if(!qPending.front().get().empty())
+            nLocalized++;
+        qPending.pop_front();
+    }
+    const chrono::steady_clock::time_point tEnd = chrono::steady_clock::now();
+
+    // What the mapping still has to do after the last image
+    SLAM.WaitUntilIdle();
+    const chrono::steady_clock::time_point tIdle = chrono::steady_clock::now();
+
+    const vector<ORB_SLAM2::System::ThreadCpuTime> vCpuTimes = SLAM.GetThreadCpuTimes();
+    const double tMainCpu = CpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+    const double tProcessCpu = CpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+    const size_t nDropped = SLAM.GetNumDroppedFrames();
+
+    // Stop all threads
+    SLAM.Shutdown();
+
+    // Latency from handing the image over until its pose is known
+    vector<double> vLatencies;
+    int nTracked = 0;
+    for(int ni=0; ni<nImages; ni++)
+    {
+        if(vtTracked[ni]==chrono::steady_clock::time_point())
+            continue;
+        vLatencies.push_back(1e3*Seconds(vtTracked[ni]-vtSubmitted[ni]));
+        if(vbTracked[ni])
+            nTracked++;
+    }
+    if(bLockstep)
+        nLocalized = nTracked;
+    sort(vLatencies.begin(),vLatencies.end());
+    double totalLatency = 0;
+    for(size_t i=0; i<vLatencies.size(); i++)
+        totalLatency += vLatencies[i];
+
+    // Save camera trajectory
+    const bool bMonocular = sensor==ORB_SLAM2::System::MONOCULAR;
+    if(strTrajectory.empty())
+        strTrajectory = bMonocular ? "KeyFrameTrajectory.txt" : "CameraTrajectory.txt";
+    if(bMonocular)
+        SLAM.SaveKeyFrameTrajectoryTUM(strTrajectory);
+    else
+        SLAM.SaveTrajectoryTUM(strTrajectory);
+
+    ORB_SLAM2::TrajectoryEvaluation::Error ate;
+    bool bATE = false;
+    if(!strGroundTruth.empty())
+    {
+        vector<ORB_SLAM2::TrajectoryEvaluation::Point> vEstimate, vGroundTruth;
+        if(!ORB_SLAM2::TrajectoryEvaluation::Load(strGroundTruth,vImages,vGroundTruth))
+            cerr << "Failed to read the ground truth at: " << strGroundTruth << endl;
+        else if(!ORB_SLAM2::TrajectoryEvaluation::Load(strTrajectory,vImages,vEstimate))
+            cerr << "Failed to read the trajectory at: " << strTrajectory << endl;
+        else
+            bATE = ORB_SLAM2::TrajectoryEvaluation::ComputeATE(vEstimate,vGroundTruth,bMonocular,ate);
+        if(!bATE)
+            cerr << "Not enough poses associated to the ground truth for the ATE" << endl;
+    }
+
+    const double tReplay = Seconds(tEnd-tStart);
+
+    ofstream f(strResultsFile.c_str());
+    if(!f.is_open())
+    {
+        cerr << "Failed to write the results to: " << strResultsFile << endl;
+        return 1;
+    }
+    f << fixed << setprecision(6);
+    f << "{" << endl;
+    f << "  \"mode\": \"" << strMode << "\"," << endl;
+    f << "  \"sensor\": \"" << strSensor << "\"," << endl;
+    f << "  \"dataset\": \"" << strDataset << "\"," << endl;
+    f << "  \"frames\": " << nImages << "," << endl;
+    f << "  \"tracked\": " << nLocalized << "," << endl;
+    f << "  \"dropped\": " << nDropped << "," << endl;
+    f << "  \"wall_time_s\": " << tReplay << "," << endl;
+    f << "  \"drain_time_s\": " << Seconds(tIdle-tEnd) << "," << endl;
+    f << "  \"throughput_fps\": " << (tReplay>0 ? nImages/tReplay : 0.0) << "," << endl;
+    f << "  \"latency_ms\": {\"mean\": " << (vLatencies.empty() ? 0.0 : totalLatency/vLatencies.size())
+      << ", \"p50\": " << Percentile(vLatencies,0.5) << ", \"p90\": " << Percentile(vLatencies,0.9)
+      << ", \"p95\": " << Percentile(vLatencies,0.95) << ", \"p99\": " << Percentile(vLatencies,0.99)
+      << ", \"max\": " << (vLatencies.empty() ? 0.0 : vLatencies.back()) << "}," << endl;
+    if(bATE)
+        f << "  \"ate\": {\"pairs\": " << ate.nPairs << ", \"scale\": " << ate.scale << ", \"rmse\": " << ate.rmse
+          << ", \"mean\": " << ate.mean << ", \"median\": " << ate.median << ", \"max\": " << ate.max << "}," << endl;
+    else
+        f << "  \"ate\": null," << endl;
+    f << "  \"cpu_time_s\": {\"" << (bLockstep ? "Tracking" : "Reader") << "\": " << tMainCpu;
+    for(size_t i=0; i<vCpuTimes.size(); i++)
+        f << ", \"" << vCpuTimes[i].name << "\": " << vCpuTimes[i].seconds;
+    f << ", \"process\": " << tProcessCpu << "}" << endl;
+    f << "}" << endl;
+
+    cout << "-------" << endl << endl;
+    cout << "throughput: " << (tReplay>0 ? nImages/tReplay : 0.0) << " fps" << endl;
+    cout << "median latency: " << Percentile(vLatencies,0.5) << " ms" << endl;
+    if(bATE)
+        cout << "ATE rmse: " << ate.rmse << " m" << endl;
+    cout << "Results written to " << strResultsFile << endl;
+
+    return 0;
+}
@@ -0,0 +1,538 @@
+/**
+* Sweeps settings of the tracking, mapping and loop closing over a recorded sequence in one
+* process. The vocabulary is loaded and the images are decoded once, then one System per
+* configuration runs on the shared images, up to --jobs of them at the same time. Each
+* configuration is replayed as orbslam_replay does:
+*
+*   lockstep  every image is tracked with the synchronous input and the configuration waits for
+*             its local mapping and loop closing to go idle before the next one
+*   flatout   images go to the asynchronous input as fast as the pipeline accepts them
+*
+* The sweep file has one configuration per line, "name key=value key=value ...", '#' starts a
+* comment. The values replace those of the settings file (or are added to it) as YAML, e.g.
+*   base
+*   feat1500 ORBextractor.nFeatures=1500
+*   fast12 ORBextractor.iniThFAST=12 ORBextractor.minThFAST=5
+* For results "prefix.json" a configuration writes its settings to prefix.name.yaml and its
+* trajectory (keyframes for monocular) to prefix.name.txt. The results hold per configuration
+* the frames tracked, the wall time, the absolute trajectory error with a ground truth and the
+* durations of the stages of its System.
+*
+* All the images of the sequence are kept in memory, and a System does not free its map after
+* Shutdown, so the memory grows with the sequence and with every configuration. The files the
+* settings name (FeatureCache.File, Checkpoint.File, EventLog.File, ...) are shared by all the
+* configurations unless they override them; a feature cache should be recorded beforehand.
+*
+* Datasets and ground truth as for orbslam_replay.
+*
+* Usage: ./tools/orbslam_sweep lockstep|flatout mono|stereo|rgbd tum|kitti|euroc path_to_vocabulary
+*                              path_to_settings path_to_sweep path_to_sequence path_to_results.json
+*                              [--jobs=n] [--associations=file] [--times=file] [--groundtruth=file]
+*/
+
+#include "ImageSource.h"
+#include "Settings.h"
+#include "System.h"
+#include "TrajectoryEvaluation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+
+namespace
+{
+
+// Threads a System keeps busy, for the default number of concurrent configurations
+const unsigned int THREADS_PER_SYSTEM = 4; //param
+
+struct Configuration
+{
+    string name;
+    vector<pair<string,string> > vOverrides;
+    string strSettingsFile;
+    string strTrajectoryFile;
+    // Of the written settings (Settings::GetHash)
+    uint64_t nSettingsHash;
+};
+
+struct Result
+{
+    int nTracked;
+    size_t nDropped;
+    double tReplay;
+    double tDrain;
+    bool bATE;
+    ORB_SLAM2::TrajectoryEvaluation::Error ate;
+    vector<ORB_SLAM2::StageTimes::Summary> vStages;
+};
+
+bool StartsWith(const string &s, const string &prefix)
+{
+    return s.compare(0,prefix.size(),prefix)==0;
+}
+
+double Seconds(const chrono::steady_clock::duration &d)
+{
+    return chrono::duration_cast<chrono::duration<double> >(d).count();
+}
+
+bool ValidName(const string &name)
+{
+    for(size_t i=0; i<name.size(); i++)
+    {
+        const char c = name[i];
+        if(!isalnum(static_cast<unsigned char>(c)) && c!='_' && c!='-' && c!='.')
+            return false;
+    }
+    return !name.empty();
+}
+
+bool LoadSweep(const string &strFile, vector<Configuration> &vConfigurations)
+{
+    ifstream f(strFile.c_str());
+    if(!f.is_open())
+        return false;
+
+    string s;
+    int nLine = 0;
+    while(getline(f,s))
+    {
+        nLine++;
+        const size_t nComment = s.find('#');
+        if(nComment!=string::npos)
+            s = s.substr(0,nComment);
+
+        stringstream ss(s);
+        Configuration configuration;
+        if(!(ss >> configuration.name))
+            continue;
+        if(!ValidName(configuration.name))
+        {
+            cerr << strFile << ":" << nLine << ": the name " << configuration.name << " is not a file name" << endl;
+            return false;
+        }
+
+        string override;
+        while(ss >> override)
+        {
+            const size_t nEq = override.find('=');
+            if(nEq==string::npos || nEq==0)
+            {
+                cerr << strFile << ":" << nLine << ": " << override << " is not key=value" << endl;
+                return false;
+            }
+            configuration.vOverrides.push_back(make_pair(override.substr(0,nEq),override.substr(nEq+1)));
+        }
+        vConfigurations.push_back(configuration);
+    }
+    return true;
+}
+
+// The settings file with the values of the overrides. A key which continues on the indented
+// lines after it (a matrix) is replaced with them.
+bool WriteSettings(const string &strBase, const vector<pair<string,string> > &vOverrides, const string &strFile)
+{
+    ifstream in(strBase.c_str());
+    if(!in.is_open())
+        return false;
+
+    vector<bool> vbWritten(vOverrides.size(),false);
+    stringstream out;
+    string s;
+    bool bSkipping = false;
+    while(getline(in,s))
+    {
+        if(bSkipping && !s.empty() && (s[0]==' ' || s[0]=='\t'))
+            continue;
+        bSkipping = false;
+
+        size_t i = 0;
+        for(; i<vOverrides.size(); i++)
+        {
+            const string &key = vOverrides[i].first;
+            if(StartsWith(s,key) && s.size()>key.size() && s[key.size()]==':')
+                break;
+        }
+        if(i==vOverrides.size())
+        {
+            out << s << endl;
+            continue;
+        }
+
+        out << vOverrides[i].first << ": " << vOverrides[i].second << endl;
+        vbWritten[i] = true;
+        bSkipping = true;
+    }
+
+    for(size_t i=0; i<vOverrides.size(); i++)
+    {
+        if(!vbWritten[i])
+            out << vOverrides[i].first << ": " << vOverrides[i].second << endl;
+    }
+
+    ofstream f(strFile.c_str());
+    f << out.str();
+    f.close();
+    return static_cast<bool>(f);
+}
+
+// Replays the images with one System, as orbslam_replay
+Result Run(const Configuration &configuration, ORB_SLAM2::ORBVocabulary* pVocabulary, const ORB_SLAM2::System::eSensor sensor,
+           const bool bLockstep, const vector<ORB_SLAM2::ImageSource::Image> &vImages,
+           const vector<ORB_SLAM2::ImageSource::Entry> &vEntries, const vector<ORB_SLAM2::TrajectoryEvaluation::Point> &vGroundTruth)
+{
+    ORB_SLAM2::Settings fsSettings;
+    fsSettings.Load(configuration.strSettingsFile);
+    int nInFlight = fsSettings["Async.QueueSize"];
+    if(nInFlight<1)
+        nInFlight = 1;
+
+    ORB_SLAM2::System SLAM(pVocabulary,configuration.strSettingsFile,sensor,false);
+
+    Result result;
+    result.nTracked = 0;
+    deque<future<cv::Mat> > qPending;
+
+    const chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+    for(size_t ni=0; ni<vImages.size(); ni++)
+    {
+        const cv::Mat &im = vImages[ni].im;
+        const cv::Mat &im2 = vImages[ni].im2;
+        const double tframe = vImages[ni].timestamp;
+
+        if(bLockstep)
+        {
+            cv::Mat Tcw;
+            if(sensor==ORB_SLAM2::System::STEREO)
+                Tcw = SLAM.TrackStereo(im,im2,tframe);
+            else if(sensor==ORB_SLAM2::System::RGBD)
+                Tcw = SLAM.TrackRGBD(im,im2,tframe);
+            else
+                Tcw = SLAM.TrackMonocular(im,tframe);
+            if(!Tcw.empty())
+                result.nTracked++;
+
+            SLAM.WaitUntilIdle();
+        }
+        else
+        {
+            while(static_cast<int>(qPending.size())>=nInFlight)
+            {
+                if(!qPending.front().get().empty())
+                    result.nTracked++;
+                qPending.pop_front();
+            }
+
+            if(sensor==ORB_SLAM2::System::STEREO)
+                qPending.push_back(SLAM.TrackStereoAsync(im,im2,tframe));
+            else if(sensor==ORB_SLAM2::System::RGBD)
+                qPending.push_back(SLAM.TrackRGBDAsync(im,im2,tframe));
+            else
+                qPending.push_back(SLAM.TrackMonocularAsync(im,tframe));
+        }
+    }
+    while(!qPending.empty())
+    {
+        if(!qPending.front().get().empty())
+            result.nTracked++;
+        qPending.pop_front();
+    }
+    const chrono::steady_clock::time_point tEnd = chrono::steady_clock::now();
+
+    SLAM.WaitUntilIdle();
+    result.tReplay = Seconds(tEnd-tStart);
+    result.tDrain = Seconds(chrono::steady_clock::now()-tEnd);
+    result.nDropped = SLAM.GetNumDroppedFrames();
+
+    SLAM.Shutdown();
+    result.vStages = SLAM.GetAllStageTimes();
+
+    const bool bMonocular = sensor==ORB_SLAM2::System::MONOCULAR;
+    if(bMonocular)
+        SLAM.SaveKeyFrameTrajectoryTUM(configuration.strTrajectoryFile);
+    else
+        SLAM.SaveTrajectoryTUM(configuration.strTrajectoryFile);
+
+    result.bATE = false;
+    if(!vGroundTruth.empty())
+    {
+        vector<ORB_SLAM2::TrajectoryEvaluation::Point> vEstimate;
+        if(!ORB_SLAM2::TrajectoryEvaluation::Load(configuration.strTrajectoryFile,vEntries,vEstimate))
+            cerr << "Failed to read the trajectory at: " << configuration.strTrajectoryFile << endl;
+        else
+            result.bATE = ORB_SLAM2::TrajectoryEvaluation::ComputeATE(vEstimate,vGroundTruth,bMonocular,result.ate);
+        if(!result.bATE)
+            cerr << configuration.name << ": not enough poses associated to the ground truth for the ATE" << endl;
+    }
+    return result;
+}
+
+void WriteJson(ostream &f, const string &strMode, const string &strSensor, const string &strDataset, const size_t nImages,
+               const vector<Configuration> &vConfigurations, const vector<Result> &vResults)
+{
+    f << fixed << setprecision(6);
+    f << "{" << endl;
+    f << "  \"mode\": \"" << strMode << "\"," << endl;
+    f << "  \"sensor\": \"" << strSensor << "\"," << endl;
+    f << "  \"dataset\": \"" << strDataset << "\"," << endl;
+    f << "  \"frames\": " << nImages << "," << endl;
+    f << "  \"configurations\": [" << endl;
+    for(size_t i=0; i<vConfigurations.size(); i++)
+    {
+        const Configuration &c = vConfigurations[i];
+        const Result &r = vResults[i];
+        f << "    {" << endl;
+        f << "      \"name\": \"" << c.name << "\"," << endl;
+        f << "      \"settings_hash\": \"" << ORB_SLAM2::Settings::FormatHash(c.nSettingsHash) << "\"," << endl;
+        f << "      \"overrides\": {";
+        for(size_t j=0; j<c.vOverrides.size(); j++)
+        {
+            string value = c.vOverrides[j].second;
+            for(size_t k=value.find('"'); k!=string::npos; k=value.find('"',k+2))
+                value.replace(k,1,"\\\"");
+            f << (j ? ", " : "") << "\"" << c.vOverrides[j].first << "\": \"" << value << "\"";
+        }
+        f << "}," << endl;
+        f << "      \"tracked\": " << r.nTracked << "," << endl;
+        f << "      \"dropped\": " << r.nDropped << "," << endl;
+        f << "      \"wall_time_s\": " << r.tReplay << "," << endl;
+        f << "      \"drain_time_s\": " << r.tDrain << "," << endl;
+        f << "      \"throughput_fps\": " << (r.tReplay>0 ? nImages/r.tReplay : 0.0) << "," << endl;
+        if(r.bATE)
+            f << "      \"ate\": {\"pairs\": " << r.ate.nPairs << ", \"scale\": " << r.ate.scale << ", \"rmse\": " << r.ate.rmse
+              << ", \"mean\": " << r.ate.mean << ", \"median\": " << r.ate.median << ", \"max\": " << r.ate.max << "}," << endl;
+        else
+            f << "      \"ate\": null," << endl;
+        f << "      \"stages_ms\": {";
+        bool bFirst = true;
+        for(size_t j=0; j<r.vStages.size(); j++)
+        {
+            const ORB_SLAM2::StageTimes::Summary &s = r.vStages[j];
+            if(s.nCount==0)
+                continue;
+            f << (bFirst ? "" : ",") << endl << "        \"" << s.name << "\": {\"count\": " << s.nCount
+              << ", \"mean\": " << 1e3*s.Mean() << ", \"p50\": " << 1e3*s.Quantile(0.5) << ", \"p90\": " << 1e3*s.Quantile(0.9)
+              << ", \"p99\": " << 1e3*s.Quantile(0.99) << ", \"max\": " << 1e3*s.max << "}";
+            bFirst = false;
+        }
+        f << (bFirst ? "" : "\n      ") << "}" << endl;
+        f << "    }" << (i+1<vConfigurations.size() ? "," : "") << endl;
+    }
+    f << "  ]" << endl;
+    f << "}" << endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 9)
+    {
+        cerr << endl << "Usage: ./orbslam_sweep lockstep|flatout mono|stereo|rgbd tum|kitti|euroc path_to_vocabulary"
+             << " path_to_settings path_to_sweep path_to_sequence path_to_results.json"
+             << " [--jobs=n] [--associations=file] [--times=file] [--groundtruth=file]" << endl;
+        return 1;
+    }
+
+    const string strMode = argv[1];
+    const string strSensor = argv[2];
+    const string strDataset = argv[3];
+    const string strVocFile = argv[4];
+    const string strSettingsFile = argv[5];
+    const string strSweepFile = argv[6];
+    const string strSequence = argv[7];
+    const string strResultsFile = argv[8];
+
+    string strAssociations, strTimes, strGroundTruth;
+    int nJobs = max(1u,thread::hardware_concurrency()/THREADS_PER_SYSTEM);
+    for(int i=9; i<argc; i++)
+    {
+        const string arg = argv[i];
+        if(StartsWith(arg,"--jobs="))
+            nJobs = atoi(arg.substr(7).c_str());
+        else if(StartsWith(arg,"--associations="))
+            strAssociations = arg.substr(15);
+        else if(StartsWith(arg,"--times="))
+            strTimes = arg.substr(8);
+        else if(StartsWith(arg,"--groundtruth="))
+            strGroundTruth = arg.substr(14);
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+    if(nJobs<1)
+    {
+        cerr << "--jobs must be at least 1" << endl;
+        return 1;
+    }
+
+    const bool bLockstep = strMode=="lockstep";
+    if(!bLockstep && strMode!="flatout")
+    {
+        cerr << "Unknown mode: " << strMode << endl;
+        return 1;
+    }
+
+    ORB_SLAM2::System::eSensor sensor;
+    if(strSensor=="mono")
+        sensor = ORB_SLAM2::System::MONOCULAR;
+    else if(strSensor=="stereo")
+        sensor = ORB_SLAM2::System::STEREO;
+    else if(strSensor=="rgbd")
+        sensor = ORB_SLAM2::System::RGBD;
+    else
+    {
+        cerr << "Unknown sensor: " << strSensor << endl;
+        return 1;
+    }
+
+    vector<Configuration> vConfigurations;
+    if(!LoadSweep(strSweepFile,vConfigurations))
+    {
+        cerr << "Failed to read the sweep at: " << strSweepFile << endl;
+        return 1;
+    }
+    if(vConfigurations.empty())
+    {
+        cerr << "No configuration in " << strSweepFile << endl;
+        return 1;
+    }
+
+    // The settings of every configuration, checked before any System starts
+    const string strPrefix = strResultsFile.size()>5 && strResultsFile.compare(strResultsFile.size()-5,5,".json")==0 ?
+                             strResultsFile.substr(0,strResultsFile.size()-5) : strResultsFile;
+    for(size_t i=0; i<vConfigurations.size(); i++)
+    {
+        Configuration &c = vConfigurations[i];
+        for(size_t j=0; j<i; j++)
+        {
+            if(vConfigurations[j].name==c.name)
+            {
+                cerr << "The configuration " << c.name << " is in the sweep twice" << endl;
+                return 1;
+            }
+        }
+        c.strSettingsFile = strPrefix+"."+c.name+".yaml";
+        c.strTrajectoryFile = strPrefix+"."+c.name+".txt";
+        if(!WriteSettings(strSettingsFile,c.vOverrides,c.strSettingsFile))
+        {
+            cerr << "Failed to write the settings of " << c.name << " to: " << c.strSettingsFile << endl;
+            return 1;
+        }
+        ORB_SLAM2::Settings fsSettings;
+        if(!fsSettings.Load(c.strSettingsFile) || !fsSettings.Validate(sensor))
+        {
+            cerr << "The settings of " << c.name << " are not valid: " << c.strSettingsFile << endl;
+            return 1;
+        }
+        c.nSettingsHash = fsSettings.GetHash();
+    }
+
+    // Retrieve paths to images
+    vector<ORB_SLAM2::ImageSource::Entry> vEntries;
+    bool bLoaded = false;
+    if(strDataset=="tum" && sensor!=ORB_SLAM2::System::STEREO)
+        bLoaded = (sensor==ORB_SLAM2::System::MONOCULAR || !strAssociations.empty()) &&
+                  ORB_SLAM2::ImageSource::LoadTUM(strSequence,sensor==ORB_SLAM2::System::RGBD ? strAssociations : "",vEntries);
+    else if(strDataset=="kitti" && sensor!=ORB_SLAM2::System::RGBD)
+        bLoaded = ORB_SLAM2::ImageSource::LoadKITTI(strSequence,sensor==ORB_SLAM2::System::STEREO,vEntries);
+    else if(strDataset=="euroc" && sensor!=ORB_SLAM2::System::RGBD)
+        bLoaded = ORB_SLAM2::ImageSource::LoadEuRoC(strSequence+"/cam0/data",
+                                                    sensor==ORB_SLAM2::System::STEREO ? strSequence+"/cam1/data" : "",
+                                                    strTimes,vEntries);
+    else
+    {
+        cerr << "The " << strDataset << " dataset is not supported for " << strSensor << endl;
+        return 1;
+    }
+    if(!bLoaded || vEntries.empty())
+    {
+        cerr << "ERROR: No images in provided path." << endl;
+        return 1;
+    }
+
+    vector<ORB_SLAM2::TrajectoryEvaluation::Point> vGroundTruth;
+    if(!strGroundTruth.empty() && !ORB_SLAM2::TrajectoryEvaluation::Load(strGroundTruth,vEntries,vGroundTruth))
+    {
+        cerr << "Failed to read the ground truth at: " << strGroundTruth << endl;
+        return 1;
+    }
+
+    // The images are decoded once for all configurations, EuRoC stereo is rectified as stereo_euroc
+    ORB_SLAM2::Settings fsSettings;
+    fsSettings.Load(strSettingsFile);
+    ORB_SLAM2::ImageSource source(vEntries,max(2u,thread::hardware_concurrency()),16);
+    if(strDataset=="euroc" && sensor==ORB_SLAM2::System::STEREO && !(int)fsSettings["Camera.rectifyStereo"] &&
+       !source.SetStereoRectification(fsSettings))
+        return 1;
+    cout << "Decoding " << vEntries.size() << " images ..." << endl;
+    vector<ORB_SLAM2::ImageSource::Image> vImages(vEntries.size());
+    for(size_t i=0; i<vImages.size(); i++)
+    {
+        if(!source.Next(vImages[i]))
+            return 1;
+    }
+
+    ORB_SLAM2::ORBVocabulary* pVocabulary = ORB_SLAM2::System::LoadVocabulary(strVocFile);
+    if(!pVocabulary)
+        return 1;
+
+    nJobs = min(nJobs,static_cast<int>(vConfigurations.size()));
+    cout << endl << "-------" << endl;
+    cout << "Sweeping " << vConfigurations.size() << " configurations " << (bLockstep ? "in lockstep" : "flat-out")
+         << ", " << nJobs << " at a time ..." << endl << endl;
+
+    // Every job takes the next configuration until none is left
+    vector<Result> vResults(vConfigurations.size());
+    atomic<size_t> nNext(0);
+    mutex mutexOut;
+    vector<thread> vJobs;
+    for(int i=0; i<nJobs; i++)
+    {
+        vJobs.push_back(thread([&]
+        {
+            for(size_t n=nNext++; n<vConfigurations.size(); n=nNext++)
+            {
+                vResults[n] = Run(vConfigurations[n],pVocabulary,sensor,bLockstep,vImages,vEntries,vGroundTruth);
+
+                unique_lock<mutex> lock(mutexOut);
+                cout << vConfigurations[n].name << ": " << vResults[n].nTracked << " of " << vImages.size()
+                     << " frames tracked in " << vResults[n].tReplay << " s";
+                if(vResults[n].bATE)
+                    cout << ", ATE rmse " << vResults[n].ate.rmse << " m";
+                cout << endl;
+            }
+        }));
+    }
+    for(size_t i=0; i<vJobs.size(); i++)
+        vJobs[i].join();
+
+    ofstream f(strResultsFile.c_str());
+    if(!f.is_open())
+    {
+        cerr << "Failed to write the results to: " << strResultsFile << endl;
+        return 1;
+    }
+    WriteJson(f,strMode,strSensor,strDataset,vImages.size(),vConfigurations,vResults);
+
+    cout << "-------" << endl << endl;
+    cout << "Results written to " << strResultsFile << endl;
+
+    return 0;
+}
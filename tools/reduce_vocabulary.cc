@@ -0,0 +1,233 @@
+/**
+* Builds a reduced vocabulary from the full one for targets with little memory: fewer levels,
+* fewer branches per node, words merged by their usage on our own images and weights quantized to
+* 16 bits, written as a binary vocabulary every example and the System take instead of ORBvoc.
+* Maps and feature caches are tied to the vocabulary they were built with.
+*
+*   --levels=L             keep the first L levels (ORBvoc has 6), the nodes of level L become words
+*   --branches=K           keep the K children of every node whose words are most frequent (ORBvoc has 10)
+*   --usage=image_list     count the words of the ORB features of these images, one "timestamp image"
+*                          line per image relative to the list ('#' starts a comment, a TUM rgb.txt works)
+*   --min-usage=N          merge the words of a node which occur less than N times in the images
+*   --feature-levels-up=N  levels up of the nodes the matching by BoW groups the features by
+*   --quantize             store the weights as 16 bits instead of doubles
+*
+* With usage images the BoW time per image with the full and the reduced vocabulary is printed.
+*
+* Usage: ./tools/reduce_vocabulary path_to_vocabulary path_to_reduced_vocabulary.bin [options]
+*/
+
+#include "HammingDistance.h"
+#include "ORBVocabulary.h"
+#include "ORBextractor.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+using namespace std;
+using namespace ORB_SLAM2;
+
+namespace
+{
+
+bool StartsWith(const string &s, const string &prefix)
+{
+    return s.compare(0,prefix.size(),prefix)==0;
+}
+
+double Seconds(const chrono::steady_clock::duration &d)
+{
+    return chrono::duration_cast<chrono::duration<double> >(d).count();
+}
+
+bool LoadImageList(const string &strFile, vector<string> &vImages)
+{
+    ifstream f(strFile.c_str());
+    if(!f.is_open())
+        return false;
+
+    const size_t nSlash = strFile.rfind('/');
+    const string strDir = nSlash==string::npos ? string() : strFile.substr(0,nSlash+1);
+
+    string s;
+    while(getline(f,s))
+    {
+        if(s.empty() || s[0]=='#')
+            continue;
+
+        stringstream ss(s);
+        double timestamp;
+        string strImage;
+        if(ss >> timestamp >> strImage)
+            vImages.push_back(strDir+strImage);
+    }
+    return true;
+}
+
+// Mean seconds of the BoW of the descriptors of every image
+double MeasureBoW(const ORBVocabulary &voc, const vector<cv::Mat> &vDescriptors)
+{
+    if(vDescriptors.empty())
+        return 0.0;
+
+    DBoW2::BowVector bowVec;
+    DBoW2::FeatureVector featVec;
+    const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    for(size_t i=0; i<vDescriptors.size(); i++)
+    {
+        const cv::Mat &descriptors = vDescriptors[i];
+        voc.transform(descriptors.data,descriptors.step[0],descriptors.rows,bowVec,featVec,
+                      voc.getFeatureVectorLevelsUp());
+    }
+    return Seconds(chrono::steady_clock::now()-t0)/vDescriptors.size();
+}
+
+void PrintVocabulary(const string &strName, const ORBVocabulary &voc)
+{
+    cout << strName << ": " << voc.size() << " words, " << voc.getDepthLevels() << " levels, "
+         << voc.getBranchingFactor() << " branches, " << voc.getEffectiveLevels() << " levels on average, "
+         << voc.getMemoryUsage()/(1024*1024) << " MB" << endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 3)
+    {
+        cerr << endl << "Usage: ./reduce_vocabulary path_to_vocabulary path_to_reduced_vocabulary.bin [--levels=L]"
+             << " [--branches=K] [--usage=image_list] [--min-usage=N] [--feature-levels-up=N] [--quantize]" << endl;
+        return 1;
+    }
+
+    const string strVocFile = argv[1];
+    const string strOutFile = argv[2];
+
+    int nLevels = 0, nBranches = 0, nLevelsUp = -1;
+    unsigned int nMinUsage = 0;
+    bool bQuantize = false;
+    string strUsage;
+    for(int i=3; i<argc; i++)
+    {
+        const string arg = argv[i];
+        if(StartsWith(arg,"--levels="))
+            nLevels = atoi(arg.substr(9).c_str());
+        else if(StartsWith(arg,"--branches="))
+            nBranches = atoi(arg.substr(11).c_str());
+        else if(StartsWith(arg,"--usage="))
+            strUsage = arg.substr(8);
+        else if(StartsWith(arg,"--min-usage="))
+            nMinUsage = atoi(arg.substr(12).c_str());
+        else if(StartsWith(arg,"--feature-levels-up="))
+            nLevelsUp = atoi(arg.substr(20).c_str());
+        else if(arg=="--quantize")
+            bQuantize = true;
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+    if(nMinUsage>0 && strUsage.empty())
+    {
+        cerr << "--min-usage needs the images of --usage" << endl;
+        return 1;
+    }
+
+    ORBVocabulary voc;
+    cout << "Loading vocabulary " << strVocFile << " ..." << endl;
+    const bool bVocLoad = ORBVocabulary::isBinaryFile(strVocFile) ? voc.loadFromBinaryFile(strVocFile) :
+                                                                    voc.loadFromTextFile(strVocFile);
+    if(!bVocLoad)
+    {
+        cerr << "Failed to open vocabulary at: " << strVocFile << endl;
+        return 1;
+    }
+    voc.setBlockDistance(&HammingDistance::ComputeBatch);
+    PrintVocabulary("Full vocabulary",voc);
+
+    // Descriptors of the usage images, with the extraction settings of the examples
+    vector<cv::Mat> vDescriptors;
+    if(!strUsage.empty())
+    {
+        vector<string> vImages;
+        if(!LoadImageList(strUsage,vImages) || vImages.empty())
+        {
+            cerr << "Failed to read the image list at: " << strUsage << endl;
+            return 1;
+        }
+
+        ORBextractor extractor(1000,1.2,8,20,7,vector<vector<int> >()); //param
+        for(size_t i=0; i<vImages.size(); i++)
+        {
+            const cv::Mat im = cv::imread(vImages[i],CV_LOAD_IMAGE_GRAYSCALE);
+            if(im.empty())
+            {
+                cerr << "Failed to load image at: " << vImages[i] << endl;
+                return 1;
+            }
+            vector<cv::KeyPoint> vKeys;
+            cv::Mat descriptors;
+            extractor(im,cv::Mat(),vKeys,descriptors);
+            vDescriptors.push_back(descriptors);
+        }
+        cout << "Extracted the features of " << vDescriptors.size() << " images" << endl;
+    }
+    // kept for the comparison of the BoW time
+    ORBVocabulary full;
+    if(!vDescriptors.empty())
+        full = voc;
+
+    if(nLevels>0)
+        cout << "Pruned to " << nLevels << " levels, " << voc.pruneLevels(nLevels) << " words removed" << endl;
+    if(nBranches>0)
+        cout << "Pruned to " << nBranches << " branches, " << voc.pruneBranches(nBranches) << " words removed" << endl;
+
+    if(nMinUsage>0)
+    {
+        vector<unsigned int> vUsage(voc.size(),0);
+        for(size_t i=0; i<vDescriptors.size(); i++)
+        {
+            const cv::Mat &descriptors = vDescriptors[i];
+            for(int j=0; j<descriptors.rows; j++)
+                vUsage[voc.transform(descriptors.row(j))]++;
+        }
+        cout << "Merged the words used less than " << nMinUsage << " times, "
+             << voc.mergeWords(vUsage,nMinUsage) << " words removed" << endl;
+    }
+
+    if(nLevelsUp>=0)
+        voc.setFeatureVectorLevelsUp(nLevelsUp);
+
+    if(!voc.saveToBinaryFile(strOutFile,bQuantize))
+    {
+        cerr << "Failed to write the reduced vocabulary to: " << strOutFile << endl;
+        return 1;
+    }
+
+    // load it again to make sure the file is usable, measured as the System will use it
+    ORBVocabulary reduced;
+    if(!reduced.loadFromBinaryFile(strOutFile) || reduced.size()!=voc.size())
+    {
+        cerr << "The written reduced vocabulary could not be loaded again: " << strOutFile << endl;
+        return 1;
+    }
+    reduced.setBlockDistance(&HammingDistance::ComputeBatch);
+    PrintVocabulary("Reduced vocabulary",reduced);
+    cout << "Features grouped " << reduced.getFeatureVectorLevelsUp() << " levels up"
+         << (bQuantize ? ", weights quantized" : "") << endl;
+
+    if(!vDescriptors.empty())
+    {
+        cout << "BoW per image: " << 1e3*MeasureBoW(full,vDescriptors) << " ms full, "
+             << 1e3*MeasureBoW(reduced,vDescriptors) << " ms reduced" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+/**
+* Refines a map which System::SaveMap wrote, offline and with all cores, before it is used to
+* localize (see System::RefineMap): a robust global BA, the duplicated map points fused, the
+* redundant keyframes culled, a second global BA and the keyframe database rebuilt. The sensor,
+* vocabulary and settings must be the ones of the session which saved it. The result is written
+* for LoadMapForLocalization, or for LoadMap with --full. --partition=n solves the global BAs as
+* submaps of n keyframes in parallel (0: as one problem), instead of Optimizer.PartitionKeyFrames.
+*
+* Usage: ./tools/refine_map mono|stereo|rgbd path_to_vocabulary path_to_settings path_to_map
+*                           path_to_refined_map [--iterations=n] [--partition=n] [--full]
+*/
+
+#include "System.h"
+#include "Optimizer.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if(argc < 6)
+    {
+        cerr << endl << "Usage: ./refine_map mono|stereo|rgbd path_to_vocabulary path_to_settings path_to_map "
+                        "path_to_refined_map [--iterations=n] [--partition=n] [--full]" << endl;
+        return 1;
+    }
+
+    const string strSensor = argv[1];
+    ORB_SLAM2::System::eSensor sensor;
+    if(strSensor=="mono")
+        sensor = ORB_SLAM2::System::MONOCULAR;
+    else if(strSensor=="stereo")
+        sensor = ORB_SLAM2::System::STEREO;
+    else if(strSensor=="rgbd")
+        sensor = ORB_SLAM2::System::RGBD;
+    else
+    {
+        cerr << "Unknown sensor: " << strSensor << endl;
+        return 1;
+    }
+
+    int nIterations = 20;
+    // Keyframes per submap of a partitioned global BA, -1: as the settings
+    int nPartitionKF = -1;
+    bool bFull = false;
+    for(int i=6; i<argc; i++)
+    {
+        const string arg = argv[i];
+        if(arg.compare(0,13,"--iterations=")==0)
+            nIterations = atoi(arg.substr(13).c_str());
+        else if(arg.compare(0,12,"--partition=")==0)
+            nPartitionKF = atoi(arg.substr(12).c_str());
+        else if(arg=="--full")
+            bFull = true;
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+    if(nIterations<1)
+    {
+        cerr << "--iterations must be positive" << endl;
+        return 1;
+    }
+
+    ORB_SLAM2::System SLAM(argv[2],argv[3],sensor,false);
+    if(!SLAM.LoadMap(argv[4]))
+    {
+        SLAM.Shutdown();
+        return 1;
+    }
+
+    // The threads must not touch the map while it is refined
+    SLAM.Shutdown();
+    if(nPartitionKF>=0)
+        ORB_SLAM2::Optimizer::SetPartitionedGlobalBA(nPartitionKF);
+    SLAM.RefineMap(nIterations);
+
+    const bool bSaved = bFull ? SLAM.SaveMap(argv[5]) : SLAM.SaveMapForLocalization(argv[5]);
+    return bSaved ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+/**
+* Loads a vocabulary into the shared memory segment of Vocabulary.SharedMemory, ahead of the
+* Systems which attach to it, or removes the segment (after a change of the vocabulary: the
+* processes attached keep the old one until they exit). The segment stays until it is removed or
+* the machine restarts.
+*
+* Usage: ./tools/share_vocabulary path_to_vocabulary segment_name
+*        ./tools/share_vocabulary --remove segment_name
+*/
+
+#include "ORBVocabulary.h"
+
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if(argc != 3)
+    {
+        cerr << endl << "Usage: ./share_vocabulary path_to_vocabulary segment_name" << endl
+             << "       ./share_vocabulary --remove segment_name" << endl;
+        return 1;
+    }
+
+    const string strVocFile = argv[1];
+    const string strSegment = argv[2];
+
+    if(strVocFile=="--remove")
+    {
+        if(!ORB_SLAM2::ORBVocabulary::removeSharedMemory(strSegment))
+        {
+            cerr << "There is no shared memory segment " << strSegment << endl;
+            return 1;
+        }
+        cout << "Removed " << strSegment << endl;
+        return 0;
+    }
+
+    ORB_SLAM2::ORBVocabulary voc;
+    cout << "Loading vocabulary " << strVocFile << " ..." << endl;
+    const bool bVocLoad = ORB_SLAM2::ORBVocabulary::isBinaryFile(strVocFile) ? voc.loadFromBinaryFile(strVocFile) :
+                                                                              voc.loadFromTextFile(strVocFile);
+    if(!bVocLoad)
+    {
+        cerr << "Failed to open vocabulary at: " << strVocFile << endl;
+        return 1;
+    }
+
+    if(!voc.createSharedMemory(strSegment))
+    {
+        cerr << "Failed to create the shared memory segment " << strSegment
+             << ", remove it with --remove if it exists" << endl;
+        return 1;
+    }
+
+    // attach it as the Systems will
+    ORB_SLAM2::ORBVocabulary shared;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if(!shared.attachSharedMemory(strSegment) || shared.size()!=voc.size())
+    {
+        cerr << "The shared memory segment " << strSegment << " could not be attached" << endl;
+        ORB_SLAM2::ORBVocabulary::removeSharedMemory(strSegment);
+        return 1;
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    cout << voc.size() << " words shared in " << strSegment << ", attached in "
+         << chrono::duration_cast<chrono::duration<double> >(t1 - t0).count() << " s, "
+         << voc.getMemoryUsage()/(1024*1024) << " MB of the vocabulary per process saved" << endl;
+
+    return 0;
+}